@@ -29,6 +29,12 @@
 #include <mutex>
 #include <condition_variable>
 #include <iostream>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 namespace qclient {
 
@@ -99,6 +105,28 @@ public:
     th = std::thread(std::forward<Args>(args)..., std::ref(assistant));
   }
 
+  // Pin the running thread to the given CPUs - an empty list leaves it
+  // alone. Returns false if not supported, or rejected by the kernel.
+  bool setAffinity(const std::vector<int> &cpus) {
+    if(cpus.empty()) return true;
+    if(joined) return false;
+
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+
+    for(int cpu : cpus) {
+      if(cpu >= 0 && cpu < CPU_SETSIZE) {
+        CPU_SET(cpu, &set);
+      }
+    }
+
+    return pthread_setaffinity_np(th.native_handle(), sizeof(set), &set) == 0;
+#else
+    return false;
+#endif
+  }
+
   virtual ~AssistedThread() {
     join();
   }
@@ -0,0 +1,147 @@
+//------------------------------------------------------------------------------
+// File: AsyncLogger.hh
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2016 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#ifndef QCLIENT_ASYNC_LOGGER_HH
+#define QCLIENT_ASYNC_LOGGER_HH
+
+#include "qclient/Logger.hh"
+#include "qclient/AssistedThread.hh"
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace qclient {
+
+//------------------------------------------------------------------------------
+//! Logger which never blocks the calling thread: print only moves the message
+//! into a bounded, lock-free ring buffer, and a background thread hands it to
+//! the sink logger - a StandardErrorLogger unless given otherwise. When the
+//! ring is full, messages are dropped and counted, rather than stalling the
+//! event loop.
+//!
+//! Repeated messages are rate-limited per call site: Past burst messages
+//! within interval, the rest are suppressed, and summarized by a single line
+//! once the interval is over.
+//------------------------------------------------------------------------------
+class AsyncLogger : public Logger {
+public:
+  AsyncLogger(std::shared_ptr<Logger> sink = {}, size_t capacity = 4096);
+  virtual ~AsyncLogger();
+
+  void print(LogLevel level, int line, const std::string &file, const std::string &msg) override;
+
+  //----------------------------------------------------------------------------
+  //! Allow at most burst messages per call site per interval - burst of 0
+  //! disables rate limiting. Default is 20 per second.
+  //----------------------------------------------------------------------------
+  void setRateLimit(size_t burst, std::chrono::milliseconds interval);
+
+  //----------------------------------------------------------------------------
+  //! Block until all messages printed so far have reached the sink, or were
+  //! suppressed.
+  //----------------------------------------------------------------------------
+  void flush();
+
+  //----------------------------------------------------------------------------
+  //! Messages lost because the ring was full, and suppressed by rate limiting
+  //----------------------------------------------------------------------------
+  int64_t getDropped() const {
+    return dropped;
+  }
+
+  int64_t getSuppressed() const {
+    return suppressed;
+  }
+
+private:
+  struct Record {
+    LogLevel level;
+    int line;
+    std::string file;
+    std::string msg;
+  };
+
+  //----------------------------------------------------------------------------
+  //! Bounded MPSC ring, in the style of Vyukov's queue: Each slot carries a
+  //! sequence number telling whether it's free for the producer claiming
+  //! that position, or ready for the consumer.
+  //----------------------------------------------------------------------------
+  struct Slot {
+    std::atomic<uint64_t> sequence;
+    Record record;
+  };
+
+  bool tryPush(Record &&record);
+  bool tryPop(Record &out);
+
+  void writerThread(ThreadAssistant &assistant);
+  void drain(std::chrono::steady_clock::time_point now);
+  void write(Record &&record, std::chrono::steady_clock::time_point now);
+  void summarizeSuppressed(std::chrono::steady_clock::time_point now, bool all);
+
+  std::shared_ptr<Logger> sink;
+
+  std::unique_ptr<Slot[]> slots;
+  size_t mask;
+
+  alignas(64) std::atomic<uint64_t> tail {0};
+  alignas(64) std::atomic<uint64_t> head {0};
+
+  // Messages handed to the sink, or suppressed - trails head
+  std::atomic<uint64_t> written {0};
+
+  // Wakes up the writer once it has parked on an empty ring
+  std::atomic<bool> writerParked {false};
+  std::atomic<uint32_t> wakeups {0};
+
+  std::atomic<int64_t> dropped {0};
+  std::atomic<int64_t> suppressed {0};
+  int64_t reportedDropped = 0;
+
+  std::atomic<size_t> burst {20};
+  std::atomic<int64_t> intervalNs {1000000000};
+
+  //----------------------------------------------------------------------------
+  //! Rate limiting state, touched only by the writer thread
+  //----------------------------------------------------------------------------
+  struct CallSite {
+    std::chrono::steady_clock::time_point windowStart;
+    size_t printed = 0;
+    size_t suppressed = 0;
+    LogLevel level = LogLevel::kInfo;
+  };
+
+  std::map<std::pair<std::string, int>, CallSite> callSites;
+  std::chrono::steady_clock::time_point lastSweep;
+
+  AssistedThread thread;
+};
+
+}
+
+#endif
@@ -26,6 +26,8 @@
 
 #include "qclient/QClient.hh"
 #include "qclient/AssistedThread.hh"
+#include <limits>
+#include <map>
 
 namespace qclient {
 
@@ -44,6 +46,35 @@ public:
   virtual void record(ItemIndex index, const QueueItem &item) {}
   virtual void pop() {}
 
+  // Batched variants of record and pop, used in group-commit mode.
+  // Override them to commit the whole batch in a single write - the
+  // defaults simply loop.
+  virtual void recordBatch(ItemIndex index, const std::vector<QueueItem> &items) {
+    for(size_t i = 0; i < items.size(); i++) {
+      record(index + i, items[i]);
+    }
+  }
+
+  virtual void popBatch(size_t count) {
+    for(size_t i = 0; i < count; i++) {
+      pop();
+    }
+  }
+
+  // Layers returning true from storesEncoded are handed every item already
+  // RESP-encoded, exactly as sent to the server, and hand back the same
+  // bytes on replay - BackgroundFlusher then never calls record,
+  // recordBatch or retrieveBatch, and each item is serialized only once.
+  virtual bool storesEncoded() {
+    return false;
+  }
+
+  virtual void recordEncoded(ItemIndex index, const EncodedRequest *reqs, size_t count) {}
+
+  virtual bool retrieveEncoded(ItemIndex index, size_t count, std::vector<EncodedRequest> &out) {
+    return false;
+  }
+
   // The following three functions are only used during reconstruction.
   virtual ItemIndex getStartingIndex() {
     return 0;
@@ -56,6 +87,18 @@ public:
   virtual bool retrieve(ItemIndex index, QueueItem &ret) {
     return false;
   }
+
+  // Retrieve count consecutive items starting at index, appending them to
+  // out - false if any is missing. Used for replay; override to read them
+  // in a single sequential scan rather than point lookups.
+  virtual bool retrieveBatch(ItemIndex index, size_t count, std::vector<QueueItem> &out) {
+    for(size_t i = 0; i < count; i++) {
+      out.emplace_back();
+      if(!retrieve(index + i, out.back())) return false;
+    }
+
+    return true;
+  }
 };
 
 // Interface to notify whenever the background flusher encounters some error.
@@ -85,36 +128,77 @@ public:
   int64_t getAcknowledgedAndClear();
 
   void pushRequest(const std::vector<std::string> &operation);
+
+  // Same as above, but large arguments are handed to QClient without an
+  // extra copy.
+  void pushRequest(std::vector<std::string> &&operation);
   size_t size() const;
 
+  // Switch to group-commit mode - call before the first pushRequest.
+  //
+  // Concurrent pushRequest calls are then merged into a single recordBatch,
+  // and acknowledgements are popped from the persistency layer maxAckBatch at
+  // a time, or as soon as the queue drains. A crash may thus replay up to
+  // maxAckBatch already acknowledged items on restart.
+  //
+  // Without group commit, the popper thread pops whatever was acknowledged
+  // as soon as it can.
+  //
+  // Either way, pops happen on the popper thread, after the acknowledgement
+  // has been counted - delivery is at-least-once. A crash replays on restart
+  // whatever was acknowledged but not yet popped: Without group commit,
+  // whatever the popper had not caught up with, at most the items
+  // acknowledged during its last pop. The destructor pops everything
+  // acknowledged before returning, so a clean shutdown replays nothing
+  // twice.
+  void enableGroupCommit(size_t maxAckBatch = 128);
+
+  // Maximum number of replayed items in flight at any time. Replay of items
+  // left over from a previous run happens in the background, and any
+  // requests pushed meanwhile are only recorded - the replay thread sends
+  // them once it gets there, preserving order.
+  //
+  // Replay starts in the constructor, so a new window only takes effect
+  // from the next range replayed on - the first one may still be as large
+  // as the default of 4096.
+  void setReplayWindow(size_t window);
+
+  // True while items recorded by a previous run are still being replayed
+  bool isReplaying() const {
+    return replaying;
+  }
+
   bool hasItemBeenAcked(ItemIndex index) {
-    return (index < persistency->getStartingIndex());
+    return (index < ackedIndex);
   }
 
+  // Block until the given item is acknowledged, or the timeout expires.
+  // Waiters are only woken once their own item is acknowledged.
   template<typename Duration>
   bool waitForIndex(ItemIndex index, Duration duration) {
-    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
-    auto deadline = start + duration;
-
-    std::unique_lock<std::mutex> lock(acknowledgementMtx);
-    while(std::chrono::steady_clock::now() < deadline) {
-      if(hasItemBeenAcked(index)) return true;
-      acknowledgementCV.wait_for(lock, duration);
-    }
-
-    return hasItemBeenAcked(index);
+    return waitForIndexUntil(index, std::chrono::steady_clock::now() + duration);
   }
 
+  bool waitForIndexUntil(ItemIndex index, std::chrono::steady_clock::time_point deadline);
+
   ItemIndex getEndingIndex() {
     return persistency->getEndingIndex();
   }
 
   ItemIndex getStartingIndex() {
-    return persistency->getStartingIndex();
+    return ackedIndex;
   }
 
 private:
   void itemWasAcknowledged();
+  void pushGrouped(std::vector<std::string> &&operation);
+  void commitGroup(std::vector<std::vector<std::string>> &group);
+  void popAcknowledged();
+  bool shouldPop();
+  void popperThread(ThreadAssistant &assistant);
+  void pushEncoded(EncodedRequest &&req);
+  bool replayRange(ItemIndex index, size_t count);
+  void replayThread(ThreadAssistant &assistant);
   std::unique_ptr<BackgroundFlusherPersistency> persistency;
 
   std::atomic<int64_t> enqueued {0};
@@ -122,10 +206,42 @@ private:
 
   std::mutex newEntriesMtx;
 
-  std::mutex acknowledgementMtx;
-  std::condition_variable acknowledgementCV;
   std::atomic<bool> inShutdown {false};
 
+  // Items below ackedIndex have been acknowledged - the persistency layer
+  // catches up in the background, through the popper thread.
+  std::atomic<ItemIndex> ackedIndex {0};
+  std::atomic<size_t> maxAckBatch {1};
+  std::mutex popMtx;
+  std::condition_variable popCV;
+
+  // Threads in waitForIndex, keyed by the index they wait for. nextWakeup is
+  // the lowest such index, so acknowledgements only take acknowledgementMtx
+  // when somebody is due.
+  struct AckWaiter {
+    std::condition_variable cv;
+    bool woken = false;
+  };
+
+  std::mutex acknowledgementMtx;
+  std::multimap<ItemIndex, AckWaiter*> ackWaiters;
+  std::atomic<ItemIndex> nextWakeup {std::numeric_limits<ItemIndex>::max()};
+
+  // Group-commit state
+  bool groupCommit = false;
+
+  std::mutex groupMtx;
+  std::condition_variable groupCV;
+  std::vector<std::vector<std::string>> groupPending;
+  bool groupLeaderActive = false;
+  uint64_t groupSubmitted = 0;
+  uint64_t groupCommitted = 0;
+
+  // Replay state - while replaying, pushRequest leaves execution to the
+  // replay thread.
+  std::atomic<bool> replaying {false};
+  std::atomic<size_t> replayWindow {4096};
+
   class FlusherCallback : public QCallback {
   public:
     FlusherCallback(BackgroundFlusher *parent);
@@ -141,6 +257,8 @@ private:
   Options options;
   std::unique_ptr<QClient> qclient;
   Notifier &notifier;
+  AssistedThread replayer;
+  AssistedThread popper;
 };
 
 }
@@ -0,0 +1,71 @@
+//------------------------------------------------------------------------------
+// File: CancellationHandle.hh
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#ifndef QCLIENT_CANCELLATION_HANDLE_HH
+#define QCLIENT_CANCELLATION_HANDLE_HH
+
+#include <memory>
+
+namespace qclient {
+
+class RequestDeadline;
+
+//------------------------------------------------------------------------------
+//! Lets the caller give up on a request issued through
+//! QClient::executeCancellable. Cancelling completes the request right away
+//! with the error reply "ERR request cancelled", and releases its callback:
+//! If it hasn't been written yet, it is never sent, and its encoded buffer
+//! is dropped as soon as the writer gets to it. Otherwise, the response is
+//! discarded once it arrives.
+//!
+//! A cancelled request may still have been executed by the server. Copies
+//! of a handle refer to the same request.
+//------------------------------------------------------------------------------
+class CancellationHandle {
+public:
+  CancellationHandle() {}
+  explicit CancellationHandle(std::shared_ptr<RequestDeadline> st)
+  : state(std::move(st)) {}
+
+  //----------------------------------------------------------------------------
+  //! Returns false if the request had completed already, in which case
+  //! nothing happens. The callback, if any, runs on the calling thread.
+  //----------------------------------------------------------------------------
+  bool cancel();
+
+  //----------------------------------------------------------------------------
+  //! Has the request completed, either through its reply or cancellation?
+  //----------------------------------------------------------------------------
+  bool isCompleted() const;
+
+  bool valid() const {
+    return state != nullptr;
+  }
+
+private:
+  std::shared_ptr<RequestDeadline> state;
+};
+
+}
+
+#endif
@@ -0,0 +1,92 @@
+//------------------------------------------------------------------------------
+// File: ClientStatistics.hh
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2016 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#ifndef QCLIENT_CLIENT_STATISTICS_HH
+#define QCLIENT_CLIENT_STATISTICS_HH
+
+#include <chrono>
+#include <cstdint>
+#include "qclient/utils/AllocationAccounting.hh"
+
+namespace qclient {
+
+//------------------------------------------------------------------------------
+//! Operational counters of a QClient, see QClient::getStatistics. Totals are
+//! cumulative over the lifetime of the object; depths are point-in-time.
+//------------------------------------------------------------------------------
+struct ClientStatistics {
+  //! Requests admitted into the queue, and requests acknowledged - either by
+  //! a reply, or a null reply once given up on.
+  int64_t requestsStaged = 0;
+  int64_t requestsAcknowledged = 0;
+
+  //! Bytes written into, and read out of the socket, handshakes included
+  int64_t bytesSent = 0;
+  int64_t bytesReceived = 0;
+
+  //! Requests queued up, but not yet acknowledged
+  int64_t pendingRequests = 0;
+
+  //! Current limit on pending requests, 0 if none - changes over time with
+  //! BackpressureStrategy::Adaptive
+  int64_t inFlightWindow = 0;
+
+  //! Reads served by the reply of an identical one already in flight - see
+  //! Options::singleFlightReads
+  int64_t coalescedReads = 0;
+
+  //! Writes superseded by a later one before being sent - see
+  //! Options::writeCombining
+  int64_t combinedWrites = 0;
+
+  //! Error replies to fire-and-forget requests - see
+  //! QClient::executeFireAndForget
+  int64_t fireAndForgetErrors = 0;
+
+  //! Replies waiting for the callback executor
+  int64_t executorQueueDepth = 0;
+
+  //! Push messages waiting for the listener - see
+  //! Options::offloadPushMessages
+  int64_t pushQueueDepth = 0;
+
+  //! Connections replaced after the first one, and redirects followed
+  int64_t reconnects = 0;
+  int64_t redirects = 0;
+
+  //! Handshakes completed, and the total time spent on them
+  int64_t handshakes = 0;
+  std::chrono::nanoseconds handshakeTime {0};
+
+  //! Total time producers spent blocked by backpressure
+  std::chrono::nanoseconds backpressureBlockedTime {0};
+
+  //! Hot path allocations of the entire process, not just this QClient -
+  //! only counted when built with ALLOCATION_ACCOUNTING.
+  AllocationStatistics allocations;
+};
+
+}
+
+#endif
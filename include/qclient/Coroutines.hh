@@ -0,0 +1,130 @@
+//------------------------------------------------------------------------------
+// File: Coroutines.hh
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#ifndef QCLIENT_COROUTINES_HH
+#define QCLIENT_COROUTINES_HH
+
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#define QCLIENT_HAVE_COROUTINES 1
+#endif
+#endif
+
+#if defined(QCLIENT_HAVE_COROUTINES)
+
+#include "qclient/QClient.hh"
+#include "qclient/QCallback.hh"
+#include "qclient/EncodedRequest.hh"
+#include <atomic>
+#include <coroutine>
+
+namespace qclient {
+
+//------------------------------------------------------------------------------
+//! Awaitable for a single request: co_await suspends the coroutine until
+//! the reply arrives, then evaluates to it - no thread blocks, and there's
+//! no shared state to allocate, as the awaitable itself is the callback,
+//! living inside the coroutine frame.
+//!
+//! By default, the coroutine is resumed on the callback executor thread. If
+//! resumeInline is set, it's resumed straight on the event loop thread,
+//! which saves a hop - but then the coroutine must not block until its next
+//! suspension point, same as any inline callback.
+//!
+//! As with futures, a nullptr reply means the request could not be serviced.
+//! Only available when compiling with coroutine support (C++20).
+//------------------------------------------------------------------------------
+class ReplyAwaitable : public QCallback {
+public:
+  ReplyAwaitable(QClient &qcl, EncodedRequest &&req, bool resumeInline = false)
+  : qclient(qcl), request(std::move(req)), inlineResume(resumeInline) {}
+
+  ReplyAwaitable(const ReplyAwaitable&) = delete;
+  ReplyAwaitable& operator=(const ReplyAwaitable&) = delete;
+
+  bool await_ready() const noexcept {
+    return false;
+  }
+
+  //----------------------------------------------------------------------------
+  //! The reply might arrive before we're done suspending, in which case we
+  //! don't suspend at all.
+  //----------------------------------------------------------------------------
+  bool await_suspend(std::coroutine_handle<> handle) {
+    continuation = handle;
+    qclient.execute(this, std::move(request));
+    return state.exchange(kSuspended, std::memory_order_acq_rel) != kDone;
+  }
+
+  redisReplyPtr await_resume() {
+    return std::move(reply);
+  }
+
+  virtual void handleResponse(redisReplyPtr &&rep) override {
+    reply = std::move(rep);
+
+    if(state.exchange(kDone, std::memory_order_acq_rel) == kSuspended) {
+      continuation.resume();
+    }
+  }
+
+  virtual bool runInline() const override {
+    return inlineResume;
+  }
+
+private:
+  static constexpr int kStarted = 0;
+  static constexpr int kSuspended = 1;
+  static constexpr int kDone = 2;
+
+  QClient &qclient;
+  EncodedRequest request;
+  bool inlineResume;
+
+  std::atomic<int> state {kStarted};
+  std::coroutine_handle<> continuation;
+  redisReplyPtr reply;
+};
+
+//------------------------------------------------------------------------------
+//! co_await co_execute(qcl, EncodedRequest::make("HGET", "key", "field"))
+//------------------------------------------------------------------------------
+inline ReplyAwaitable co_execute(QClient &qcl, EncodedRequest &&req,
+  bool resumeInline = false) {
+  return ReplyAwaitable(qcl, std::move(req), resumeInline);
+}
+
+//------------------------------------------------------------------------------
+//! co_await co_exec(qcl, "HGET", "key", "field")
+//------------------------------------------------------------------------------
+template<typename... Args>
+ReplyAwaitable co_exec(QClient &qcl, const Args&... args) {
+  return ReplyAwaitable(qcl, EncodedRequest::make(args...));
+}
+
+}
+
+#endif
+
+#endif
@@ -28,6 +28,10 @@
 #include <vector>
 #include <deque>
 #include <string>
+#include <string.h>
+#include <cstdint>
+#include <type_traits>
+#include "qclient/utils/AllocationAccounting.hh"
 
 namespace qclient {
 
@@ -49,81 +53,444 @@ inline size_t toSize(const T& param) {
   return param.size();
 }
 
+//------------------------------------------------------------------------------
+// An integral argument, formatted in decimal on the stack - so that passing
+// a number to EncodedRequest::make needs no temporary std::string.
+//------------------------------------------------------------------------------
+class IntegerArgument {
+public:
+  template<typename T>
+  explicit IntegerArgument(T value) {
+    bool negative = value < 0;
+    unsigned long long magnitude = negative ?
+      0ull - static_cast<unsigned long long>(value) :
+      static_cast<unsigned long long>(value);
+
+    offset = sizeof(buffer);
+    do {
+      buffer[--offset] = '0' + (magnitude % 10);
+      magnitude /= 10;
+    } while(magnitude != 0);
+
+    if(negative) {
+      buffer[--offset] = '-';
+    }
+  }
+
+  const char* data() const {
+    return buffer + offset;
+  }
+
+  size_t size() const {
+    return sizeof(buffer) - offset;
+  }
+
+private:
+  char buffer[20];
+  uint8_t offset;
+};
+
+inline const char* toCharPointer(const IntegerArgument& param) {
+  return param.data();
+}
+
+//------------------------------------------------------------------------------
+// Integral types other than bool and characters are formatted as numbers,
+// everything else is passed through untouched.
+//------------------------------------------------------------------------------
+template<typename T>
+struct IsNumericArgument : std::integral_constant<bool,
+  std::is_integral<T>::value &&
+  !std::is_same<T, bool>::value &&
+  !std::is_same<T, char>::value &&
+  !std::is_same<T, signed char>::value &&
+  !std::is_same<T, unsigned char>::value> {};
+
+template<typename T>
+inline typename std::enable_if<!IsNumericArgument<T>::value, const T&>::type
+toArgument(const T& param) {
+  return param;
+}
+
+template<typename T>
+inline typename std::enable_if<IsNumericArgument<T>::value, IntegerArgument>::type
+toArgument(const T& param) {
+  return IntegerArgument(param);
+}
+
 //------------------------------------------------------------------------------
 // A class to represent an encoded redis request. Move-only type, it is not
 // possible to copy it, as there's no need to. This prevents accidental
 // inefficiencies.
+//
+// Small requests are encoded into inline storage, and never touch the heap.
+// Anything larger than kInlineCapacity lives in a malloc'd buffer.
+//
+// Requests built through makeZeroCopy don't copy large arguments: Only the
+// RESP framing is kept in owned memory, and the payloads are referenced in
+// place. Such requests consist of several segments, which the writer emits
+// as separate iovecs.
 //------------------------------------------------------------------------------
 class EncodedRequest {
 public:
+  static constexpr size_t kInlineCapacity = 64;
+  static constexpr size_t kZeroCopyThreshold = 16 * 1024;
+
+  //----------------------------------------------------------------------------
+  // A contiguous piece of the encoded request.
+  //----------------------------------------------------------------------------
+  struct Segment {
+    const char* data;
+    size_t len;
+  };
+
+  //----------------------------------------------------------------------------
+  // Takes ownership of the given buffer, which must have been allocated with
+  // malloc.
+  //----------------------------------------------------------------------------
   EncodedRequest(char* buff, size_t len) {
-    buffer.reset(buff);
+    heapBuffer.reset(buff);
     length = len;
   }
 
+  EncodedRequest(EncodedRequest&& other) noexcept {
+    moveFrom(std::move(other));
+  }
+
+  EncodedRequest& operator=(EncodedRequest&& other) noexcept {
+    if(this != &other) {
+      moveFrom(std::move(other));
+    }
+
+    return *this;
+  }
+
+  EncodedRequest(const EncodedRequest& other) = delete;
+  EncodedRequest& operator=(const EncodedRequest& other) = delete;
+
   EncodedRequest(size_t nchunks, const char** chunks, const size_t* sizes);
 
+  //----------------------------------------------------------------------------
+  // Encode a container of strings. No per-argument state is kept on the
+  // stack, so there's no limit on the number of arguments.
+  //----------------------------------------------------------------------------
   template <typename Container>
   EncodedRequest(const Container& cont)
   {
-    typename Container::size_type size = cont.size();
-    std::uint64_t indx = 0;
-    const char* cstr[size];
-    size_t sizes[size];
+    size_t nchunks = 0u;
+    size_t required = 0u;
 
     for (auto it = cont.begin(); it != cont.end(); ++it) {
-      cstr[indx] = it->data();
-      sizes[indx] = it->size();
-      ++indx;
+      required += chunkLength(it->size());
+      nchunks++;
     }
 
-    initFromChunks(size, cstr, sizes);
+    required += headerLength(nchunks);
+
+    char* buff = allocate(required);
+    size_t pos = writeHeader(buff, nchunks);
+
+    for (auto it = cont.begin(); it != cont.end(); ++it) {
+      pos = writeChunk(buff, pos, it->data(), it->size());
+    }
   }
 
+  //----------------------------------------------------------------------------
+  // Arguments may be strings, string literals, or integers.
+  //----------------------------------------------------------------------------
   template<typename... Args>
   static EncodedRequest make(const Args&... args) {
-    const int size = sizeof...(Args);
-    const char* cstr[] { toCharPointer(args)...  };
-    size_t sizes[] { toSize(args)... };
-
-    return EncodedRequest(size, cstr, sizes);
+    return makeFromArguments(toArgument(args)...);
   }
 
+  //----------------------------------------------------------------------------
+  // Build a request out of the given arguments, taking ownership of them.
+  // Arguments of at least kZeroCopyThreshold bytes are not copied, but
+  // referenced directly from the moved-in strings.
+  //----------------------------------------------------------------------------
+  static EncodedRequest makeZeroCopy(std::vector<std::string> &&args);
+
+  //----------------------------------------------------------------------------
+  // Same as above, but for refcounted buffers which may be shared with other
+  // requests, or the caller.
+  //----------------------------------------------------------------------------
+  static EncodedRequest makeZeroCopy(const std::vector<std::shared_ptr<const std::string>> &args);
+
+  //----------------------------------------------------------------------------
+  // Direct buffer access is only valid for contiguous requests - otherwise,
+  // go through the segments.
+  //----------------------------------------------------------------------------
   char* getBuffer() {
-    return buffer.get();
+    return heapBuffer ? heapBuffer.get() : inlineBuffer;
   }
 
   const char* getBuffer() const {
-    return buffer.get();
+    return heapBuffer ? heapBuffer.get() : inlineBuffer;
+  }
+
+  //----------------------------------------------------------------------------
+  // Is the encoded request stored inline, without a heap allocation?
+  //----------------------------------------------------------------------------
+  bool isInline() const {
+    return !heapBuffer;
   }
 
   size_t getLen() const {
     return length;
   }
 
+  //----------------------------------------------------------------------------
+  // Is the request stored as a single, contiguous buffer?
+  //----------------------------------------------------------------------------
+  bool isContiguous() const {
+    return !borrowed;
+  }
+
+  size_t getSegmentCount() const {
+    return borrowed ? borrowed->segments.size() : 1u;
+  }
+
+  Segment getSegment(size_t i) const {
+    if(borrowed) return borrowed->segments[i];
+    return Segment { getBuffer(), length };
+  }
+
+  //----------------------------------------------------------------------------
+  // Low-level encoding, for builders which manage their own buffer, such as
+  // MultiBuilder: alloc(ctx, len) is called once with the exact number of
+  // bytes required, and must return room for that many.
+  //----------------------------------------------------------------------------
+  using Allocator = char* (*)(void *ctx, size_t len);
+  static void encode(size_t nchunks, const char** chunks, const size_t* sizes,
+    Allocator alloc, void *ctx);
+
+  //----------------------------------------------------------------------------
+  // Build a request out of an already encoded prefix, holding the array header
+  // and any leading arguments, followed by the given chunks. See Command.
+  //----------------------------------------------------------------------------
+  static EncodedRequest makeWithPrefix(const char *prefix, size_t prefixLen,
+    size_t nchunks, const char** chunks, const size_t* sizes);
+
   static EncodedRequest fuseIntoBlock(const std::deque<EncodedRequest> &block);
   static EncodedRequest fuseIntoBlockAndSurround(std::deque<EncodedRequest> &&block);
 
   bool operator==(const EncodedRequest &other) const {
     if(length != other.length) return false;
-    if(std::string(buffer.get(), length) != std::string(other.buffer.get(), other.length)) {
-      return false;
+    if(isContiguous() && other.isContiguous()) {
+      return memcmp(getBuffer(), other.getBuffer(), length) == 0;
     }
 
-    return true;
+    return toString() == other.toString();
   }
 
+  //----------------------------------------------------------------------------
+  // Return the full encoded contents, concatenating all segments.
+  //----------------------------------------------------------------------------
+  std::string toString() const;
+
   std::string toPrintableString() const;
 
 private:
+  EncodedRequest() {}
+
+  template<typename... Args>
+  static EncodedRequest makeFromArguments(const Args&... args) {
+    const int size = sizeof...(Args);
+    const char* cstr[] { toCharPointer(args)...  };
+    size_t sizes[] { toSize(args)... };
+
+    return EncodedRequest(size, cstr, sizes);
+  }
   void initFromChunks(size_t nchunks, const char** chunks, const size_t* sizes);
 
+  //----------------------------------------------------------------------------
+  // Encoding primitives. Lengths are computed exactly up front, so that the
+  // buffer is allocated once and filled in a single pass.
+  //----------------------------------------------------------------------------
+  static size_t decimalLength(size_t value) {
+    size_t len = 1;
+    while(value >= 10000) {
+      value /= 10000;
+      len += 4;
+    }
+
+    if(value >= 1000) return len + 3;
+    if(value >= 100) return len + 2;
+    if(value >= 10) return len + 1;
+    return len;
+  }
+
+  static size_t writeDecimal(char* buff, size_t pos, size_t value) {
+    size_t len = decimalLength(value);
+    for(size_t i = len; i > 0; i--) {
+      buff[pos + i - 1] = '0' + (value % 10);
+      value /= 10;
+    }
+
+    return pos + len;
+  }
+
+  // "*<nchunks>\r\n"
+  static size_t headerLength(size_t nchunks) {
+    return 1 + decimalLength(nchunks) + 2;
+  }
+
+  static size_t writeHeader(char* buff, size_t nchunks) {
+    buff[0] = '*';
+    size_t pos = writeDecimal(buff, 1, nchunks);
+    buff[pos++] = '\r';
+    buff[pos++] = '\n';
+    return pos;
+  }
+
+  // "$<len>\r\n<data>\r\n"
+  static size_t chunkLength(size_t len) {
+    return 1 + decimalLength(len) + 2 + len + 2;
+  }
+
+  static size_t writeChunk(char* buff, size_t pos, const char* data, size_t len) {
+    buff[pos++] = '$';
+    pos = writeDecimal(buff, pos, len);
+    buff[pos++] = '\r';
+    buff[pos++] = '\n';
+    memcpy(buff + pos, data, len);
+    pos += len;
+    buff[pos++] = '\r';
+    buff[pos++] = '\n';
+    return pos;
+  }
+
+  static void encodeAfter(const char *header, size_t headerLen, size_t nchunks,
+    const char** chunks, const size_t* sizes, Allocator alloc, void *ctx);
+  void initZeroCopy(const std::vector<const std::string*> &args,
+    std::vector<std::shared_ptr<const std::string>> &&owners);
+
+  //----------------------------------------------------------------------------
+  // Provide a buffer of the given size: inline if it fits, heap otherwise.
+  //----------------------------------------------------------------------------
+  char* allocate(size_t len) {
+    length = len;
+
+    if(len <= kInlineCapacity) {
+      heapBuffer.reset();
+      return inlineBuffer;
+    }
+
+    heapBuffer.reset((char*) malloc(len));
+    AllocationAccounting::record(AllocationCategory::kEncoding, len);
+    return heapBuffer.get();
+  }
+
+  void moveFrom(EncodedRequest&& other) {
+    borrowed = std::move(other.borrowed);
+    heapBuffer = std::move(other.heapBuffer);
+    length = other.length;
+
+    if(!heapBuffer) {
+      memcpy(inlineBuffer, other.inlineBuffer, length);
+    }
+
+    other.length = 0;
+  }
+
   struct Deleter {
     void operator()(char* b) { if(b) { free(b); } }
   };
 
-  std::unique_ptr<char, Deleter> buffer;
-  size_t length;
+  //----------------------------------------------------------------------------
+  // Only present for zero-copy requests. The framing always lives in
+  // heapBuffer, so segment pointers remain valid when the request is moved.
+  //----------------------------------------------------------------------------
+  struct BorrowedParts {
+    std::vector<Segment> segments;
+    std::vector<std::shared_ptr<const std::string>> payloads;
+  };
+
+  std::unique_ptr<BorrowedParts> borrowed;
+  std::unique_ptr<char, Deleter> heapBuffer;
+  size_t length = 0;
+  char inlineBuffer[kInlineCapacity];
+};
+
+//------------------------------------------------------------------------------
+// A command with a constant verb and arity, such as HSET key field value.
+// Declared constexpr, its "*<arity>\r\n$<len>\r\n<verb>\r\n" prefix is
+// encoded at compile time, and only the variable arguments get formatted
+// per request:
+//
+//   static constexpr Command<4> kHset("HSET");
+//   EncodedRequest req = kHset.make(key, field, value);
+//
+// Arity counts the verb, as in the RESP array header.
+//------------------------------------------------------------------------------
+template<size_t Arity>
+class Command {
+public:
+  static constexpr size_t kMaxVerb = 32;
+
+  template<size_t N>
+  constexpr Command(const char (&verb)[N]) : prefix{}, prefixLen(0) {
+    static_assert(N - 1 <= kMaxVerb, "Command verb too long");
+    static_assert(Arity >= 1, "Arity must include the verb");
+
+    put('*');
+    putDecimal(Arity);
+    put('\r');
+    put('\n');
+    put('$');
+    putDecimal(N - 1);
+    put('\r');
+    put('\n');
+
+    for(size_t i = 0; i < N - 1; i++) {
+      put(verb[i]);
+    }
+
+    put('\r');
+    put('\n');
+  }
+
+  template<typename... Args>
+  EncodedRequest make(const Args&... args) const {
+    static_assert(sizeof...(Args) + 1 == Arity, "Wrong number of arguments for Command");
+    return makeFromArguments(toArgument(args)...);
+  }
+
+  const char* data() const {
+    return prefix;
+  }
+
+  size_t size() const {
+    return prefixLen;
+  }
+
+private:
+  template<typename... Args>
+  EncodedRequest makeFromArguments(const Args&... args) const {
+    // One spare slot, as arrays may not be empty
+    const char* cstr[sizeof...(Args) + 1] { toCharPointer(args)...  };
+    size_t sizes[sizeof...(Args) + 1] { toSize(args)... };
+    return EncodedRequest::makeWithPrefix(prefix, prefixLen, sizeof...(Args), cstr, sizes);
+  }
+
+  constexpr void put(char c) {
+    prefix[prefixLen++] = c;
+  }
+
+  constexpr void putDecimal(size_t value) {
+    size_t divisor = 1;
+    while(value / divisor >= 10) {
+      divisor *= 10;
+    }
+
+    for(; divisor != 0; divisor /= 10) {
+      put('0' + (value / divisor) % 10);
+    }
+  }
+
+  // '*' + 20 digits + CRLF, '$' + 20 digits + CRLF, verb + CRLF
+  char prefix[1 + 20 + 2 + 1 + 20 + 2 + kMaxVerb + 2];
+  size_t prefixLen;
 };
 
 }
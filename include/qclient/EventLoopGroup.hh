@@ -0,0 +1,137 @@
+//------------------------------------------------------------------------------
+// File: EventLoopGroup.hh
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#ifndef QCLIENT_EVENT_LOOP_GROUP_HH
+#define QCLIENT_EVENT_LOOP_GROUP_HH
+
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <stdint.h>
+
+namespace qclient {
+
+class EventLoop;
+
+//------------------------------------------------------------------------------
+//! A fixed pool of epoll-based event loop threads, shared between many QClient
+//! objects. Normally, every QClient runs a dedicated thread which manages the
+//! connection and reads responses from the socket - if a group is given
+//! through Options::eventLoopGroup, that job is multiplexed onto the
+//! threads of the group instead.
+//!
+//! The group must outlive all QClient objects attached to it.
+//------------------------------------------------------------------------------
+class EventLoopGroup {
+public:
+  //----------------------------------------------------------------------------
+  //! Anything driven by the group implements this interface. onEvent is
+  //! called from a group thread when the watched file descriptor becomes
+  //! ready, when the scheduled deadline expires, or after wakeup(). Spurious
+  //! calls are possible - handlers must re-check their state.
+  //!
+  //! A handler runs on a single thread of the group, it is never called
+  //! concurrently with itself.
+  //----------------------------------------------------------------------------
+  class Handler {
+  public:
+    virtual ~Handler() {}
+    virtual void onEvent() = 0;
+  };
+
+  //----------------------------------------------------------------------------
+  //! Events to watch for, can be OR'ed together.
+  //----------------------------------------------------------------------------
+  static constexpr uint32_t kReadable = 0x1;
+  static constexpr uint32_t kWritable = 0x2;
+
+  //----------------------------------------------------------------------------
+  //! Is an event loop group supported on this platform? (needs epoll)
+  //----------------------------------------------------------------------------
+  static bool supported();
+
+  //----------------------------------------------------------------------------
+  //! Constructor, spawns the given number of threads.
+  //----------------------------------------------------------------------------
+  EventLoopGroup(size_t threads = 1);
+
+  //----------------------------------------------------------------------------
+  //! Destructor
+  //----------------------------------------------------------------------------
+  ~EventLoopGroup();
+
+  //----------------------------------------------------------------------------
+  //! Number of threads in the group
+  //----------------------------------------------------------------------------
+  size_t size() const;
+
+  //----------------------------------------------------------------------------
+  //! Attach handler to the least loaded thread. Nothing happens until the
+  //! first call to watch(), scheduleAt() or wakeup().
+  //----------------------------------------------------------------------------
+  void attach(Handler *handler);
+
+  //----------------------------------------------------------------------------
+  //! Detach handler. Once this returns, onEvent will not be called again, and
+  //! any ongoing call has finished - unless we're being called from within
+  //! onEvent of this very handler.
+  //----------------------------------------------------------------------------
+  void detach(Handler *handler);
+
+  //----------------------------------------------------------------------------
+  //! Watch the given file descriptor for the given events, replacing
+  //! any previously watched one. fd == -1 stops watching.
+  //----------------------------------------------------------------------------
+  void watch(Handler *handler, int fd, uint32_t events);
+
+  //----------------------------------------------------------------------------
+  //! Call onEvent once the given deadline has passed, replacing any
+  //! previously scheduled deadline.
+  //----------------------------------------------------------------------------
+  void scheduleAt(Handler *handler, std::chrono::steady_clock::time_point deadline);
+
+  //----------------------------------------------------------------------------
+  //! Cancel any scheduled deadline.
+  //----------------------------------------------------------------------------
+  void cancelSchedule(Handler *handler);
+
+  //----------------------------------------------------------------------------
+  //! Call onEvent as soon as possible.
+  //----------------------------------------------------------------------------
+  void wakeup(Handler *handler);
+
+private:
+  EventLoop* findLoop(Handler *handler);
+
+  std::vector<std::unique_ptr<EventLoop>> loops;
+
+  std::mutex mtx;
+  std::map<Handler*, EventLoop*> assignments;
+};
+
+}
+
+#endif
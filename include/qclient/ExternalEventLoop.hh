@@ -0,0 +1,82 @@
+//------------------------------------------------------------------------------
+// File: ExternalEventLoop.hh
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#ifndef QCLIENT_EXTERNAL_EVENT_LOOP_HH
+#define QCLIENT_EXTERNAL_EVENT_LOOP_HH
+
+#include <chrono>
+#include <stdint.h>
+
+namespace qclient {
+
+//------------------------------------------------------------------------------
+//! Implemented by applications which run their own event loop (epoll, libuv,
+//! ...), and want a QClient driven by it - see Options::externalEventLoop.
+//! The client then spawns no event loop, writer or callback threads: It
+//! tells the loop which file descriptor to watch and when to wake it up,
+//! and the loop calls QClient::onReadable, onWritable and onTimer back.
+//!
+//! One object per QClient. All methods except wakeup are only called from
+//! within those entry points, or from the QClient constructor and
+//! destructor - they must not call back into the client synchronously.
+//------------------------------------------------------------------------------
+class ExternalEventLoop {
+public:
+  virtual ~ExternalEventLoop() {}
+
+  //----------------------------------------------------------------------------
+  //! Events to watch for, can be OR'ed together.
+  //----------------------------------------------------------------------------
+  static constexpr uint32_t kReadable = 0x1;
+  static constexpr uint32_t kWritable = 0x2;
+
+  //----------------------------------------------------------------------------
+  //! Watch the given file descriptor for the given events, replacing any
+  //! previously watched one, and call onReadable / onWritable once ready.
+  //! fd == -1 stops watching. The client closes file descriptors only after
+  //! having replaced them through this call.
+  //----------------------------------------------------------------------------
+  virtual void watch(int fd, uint32_t events) = 0;
+
+  //----------------------------------------------------------------------------
+  //! Call onTimer once the given deadline has passed, replacing any
+  //! previously scheduled deadline.
+  //----------------------------------------------------------------------------
+  virtual void scheduleAt(std::chrono::steady_clock::time_point deadline) = 0;
+
+  //----------------------------------------------------------------------------
+  //! Cancel any scheduled deadline.
+  //----------------------------------------------------------------------------
+  virtual void cancelSchedule() = 0;
+
+  //----------------------------------------------------------------------------
+  //! Call onTimer as soon as possible - requests were issued, or the client
+  //! needs attention otherwise. May be called from any thread issuing
+  //! requests, and from the watchdog.
+  //----------------------------------------------------------------------------
+  virtual void wakeup() = 0;
+};
+
+}
+
+#endif
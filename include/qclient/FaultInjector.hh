@@ -25,6 +25,9 @@
 #define QCLIENT_FAULT_INJECTOR_HH
 
 #include "qclient/Members.hh"
+#include <chrono>
+#include <map>
+#include <memory>
 #include <set>
 #include <mutex>
 
@@ -32,13 +35,97 @@ namespace qclient {
 
 class QClient;
 class EventFD;
+class LinkShaper;
 
 //------------------------------------------------------------------------------
-// Class used to inject faults between client and server cluster. Only network
-// partitions supported for now.
+// WAN conditions to emulate on the link towards an endpoint, see
+// FaultInjector::shapeLink. Everything is off by default.
+//------------------------------------------------------------------------------
+class LinkShaping {
+public:
+  //----------------------------------------------------------------------------
+  // Hold back responses for this long, plus a random amount between zero and
+  // jitter. Acts on received bytes only, so latency is the added round-trip
+  // time. Jitter never reorders bytes, the same as in a TCP stream.
+  //----------------------------------------------------------------------------
+  LinkShaping& withLatency(std::chrono::microseconds latency,
+    std::chrono::microseconds jitter = std::chrono::microseconds(0)) {
+    addedLatency = latency;
+    addedJitter = jitter;
+    return *this;
+  }
+
+  //----------------------------------------------------------------------------
+  // Cap the throughput of either direction at this many bytes per second.
+  //----------------------------------------------------------------------------
+  LinkShaping& withBandwidth(uint64_t bytesPerSecond) {
+    bandwidth = bytesPerSecond;
+    return *this;
+  }
+
+  //----------------------------------------------------------------------------
+  // Every period, the link stalls for duration: Nothing gets through in
+  // either direction, as if packets were dropped and retransmitted later.
+  //----------------------------------------------------------------------------
+  LinkShaping& withStalls(std::chrono::milliseconds period,
+    std::chrono::milliseconds duration) {
+    stallPeriod = period;
+    stallDuration = duration;
+    return *this;
+  }
+
+  //----------------------------------------------------------------------------
+  // Seed of the jitter generator - same seed, same sequence of delays.
+  //----------------------------------------------------------------------------
+  LinkShaping& withSeed(uint64_t value) {
+    seed = value;
+    return *this;
+  }
+
+  std::chrono::microseconds getLatency() const {
+    return addedLatency;
+  }
+
+  std::chrono::microseconds getJitter() const {
+    return addedJitter;
+  }
+
+  uint64_t getBandwidth() const {
+    return bandwidth;
+  }
+
+  std::chrono::milliseconds getStallPeriod() const {
+    return stallPeriod;
+  }
+
+  std::chrono::milliseconds getStallDuration() const {
+    return stallDuration;
+  }
+
+  uint64_t getSeed() const {
+    return seed;
+  }
+
+private:
+  std::chrono::microseconds addedLatency {0};
+  std::chrono::microseconds addedJitter {0};
+  uint64_t bandwidth = 0;
+  std::chrono::milliseconds stallPeriod {0};
+  std::chrono::milliseconds stallDuration {0};
+  uint64_t seed = 0;
+};
+
+//------------------------------------------------------------------------------
+// Class used to inject faults between client and server cluster: Network
+// partitions, and degraded links.
 //------------------------------------------------------------------------------
 class FaultInjector {
 public:
+  //----------------------------------------------------------------------------
+  // Destructor
+  //----------------------------------------------------------------------------
+  ~FaultInjector();
+
   //----------------------------------------------------------------------------
   // Enforce total blackout: This QClient cannot communicate with anyone.
   //----------------------------------------------------------------------------
@@ -71,7 +158,27 @@ public:
   //----------------------------------------------------------------------------
   bool hasPartition(const Endpoint &endpoint);
 
+  //----------------------------------------------------------------------------
+  // Emulate the given link conditions towards this endpoint, replacing any
+  // set earlier. Takes effect on the live connection right away. Applied
+  // inside the client, so no privileges needed - but only for clients with
+  // their own event loop thread, not those attached to an EventLoopGroup.
+  //----------------------------------------------------------------------------
+  void shapeLink(const Endpoint &endpoint, const LinkShaping &shaping);
+
+  //----------------------------------------------------------------------------
+  // Back to a clean link towards this endpoint, or towards all of them.
+  //----------------------------------------------------------------------------
+  void unshapeLink(const Endpoint &endpoint);
+  void unshapeAllLinks();
+
 private:
+  //----------------------------------------------------------------------------
+  // The shaper for links towards this endpoint, nullptr if it was never
+  // shaped. Shapers live as long as the FaultInjector does.
+  //----------------------------------------------------------------------------
+  LinkShaper* getLinkShaper(const Endpoint &endpoint);
+
   //----------------------------------------------------------------------------
   // Private constructor: Only QClient can initialize me.
   //----------------------------------------------------------------------------
@@ -85,6 +192,12 @@ private:
   mutable std::mutex mtx;
   std::set<Endpoint> partitions;
   bool totalBlackout = false;
+
+  //----------------------------------------------------------------------------
+  // Link shapers, by endpoint. Never removed, only reset to a clean link:
+  // live connections keep pointers to them.
+  //----------------------------------------------------------------------------
+  std::map<Endpoint, std::unique_ptr<LinkShaper>> shapers;
 };
 
 }
@@ -24,7 +24,10 @@
 #ifndef QCLIENT_FORMATTING_HH
 #define QCLIENT_FORMATTING_HH
 
+#include "qclient/EncodedRequest.hh"
+#include "fmt/format.h"
 #include <string>
+#include <string.h>
 #include <vector>
 #include <map>
 #include <sstream>
@@ -37,6 +40,10 @@ namespace qclient {
 // A class to help redis-serialize any given data structures
 // NOTE: When in doubt, this class will serialize into string-type messages,
 // not status-type messages. (status messages are not binary-safe)
+//
+// The exact size of the serialization is computed first, so that the output
+// is allocated once and filled in a single pass, without going through
+// streams.
 //------------------------------------------------------------------------------
 class Formatting {
 public:
@@ -45,69 +52,194 @@ public:
   // External API: Serialize onto a plain string.
   //----------------------------------------------------------------------------
   template<typename T>
-  static std::string serialize(T&& arg) {
-    std::ostringstream ss;
-    serializeInternal(ss, std::forward<T>(arg));
-    return ss.str();
+  static std::string serialize(const T& arg) {
+    std::string out;
+    serializeInto(out, arg);
+    return out;
+  }
+
+  //----------------------------------------------------------------------------
+  // Append the serialization to the given string, reusing its capacity.
+  //----------------------------------------------------------------------------
+  template<typename T>
+  static void serializeInto(std::string &out, const T& arg) {
+    size_t start = out.size();
+    out.resize(start + serializedLength(arg));
+    write(&out[start], arg);
   }
 
   //----------------------------------------------------------------------------
   // Serialize a vector of arbitrary types
   //----------------------------------------------------------------------------
   template<typename... Args>
-  static std::string serializeVector(Args&&... args) {
-    const size_t n = sizeof...(args);
+  static std::string serializeVector(const Args&... args) {
+    std::string out;
+    out.resize(headerLength('*', sizeof...(args)) + lengthMulti(args...));
+
+    char *pos = writeHeader(&out[0], '*', sizeof...(args));
+    writeMulti(pos, args...);
+    return out;
+  }
+
+  //----------------------------------------------------------------------------
+  // Build the request "<leading...> <serialization of payload>", with the
+  // payload serialized straight into its argument slot - no temporary string.
+  //
+  //   Formatting::makeRequest({"PUBLISH", channel}, map)
+  //----------------------------------------------------------------------------
+  template<typename T>
+  static EncodedRequest makeRequest(const std::vector<std::string> &leading,
+    const T& payload) {
+
+    size_t payloadLen = serializedLength(payload);
+
+    size_t required = headerLength('*', leading.size() + 1);
+    for(size_t i = 0; i < leading.size(); i++) {
+      required += stringLength(leading[i].size());
+    }
 
-    std::ostringstream ss;
-    ss << "*" << n << "\r\n";
-    serializeMulti(ss, std::forward<Args>(args)...);
-    return ss.str();
+    required += stringLength(payloadLen);
+
+    char *buff = (char*) malloc(required);
+    char *pos = writeHeader(buff, '*', leading.size() + 1);
+    for(size_t i = 0; i < leading.size(); i++) {
+      pos = write(pos, leading[i]);
+    }
+
+    pos = writeHeader(pos, '$', payloadLen);
+    pos = write(pos, payload);
+    *pos++ = '\r';
+    *pos++ = '\n';
+
+    return EncodedRequest(buff, required);
   }
 
 private:
 
   //----------------------------------------------------------------------------
-  // Internal API: Serialize onto a given std::ostringstream.
-  // We need this to support efficient serialization of arrays.
+  // "<marker><value>\r\n", as in "*3\r\n" or ":5\r\n"
+  //----------------------------------------------------------------------------
+  template<typename Int>
+  static size_t headerLength(char marker, Int value) {
+    return 1 + fmt::format_int(value).size() + 2;
+  }
+
+  template<typename Int>
+  static char* writeHeader(char *pos, char marker, Int value) {
+    fmt::format_int formatted(value);
+    *pos++ = marker;
+    memcpy(pos, formatted.data(), formatted.size());
+    pos += formatted.size();
+    *pos++ = '\r';
+    *pos++ = '\n';
+    return pos;
+  }
+
+  // "$<len>\r\n<contents>\r\n"
+  static size_t stringLength(size_t len) {
+    return headerLength('$', len) + len + 2;
+  }
+
+  static char* writeString(char *pos, const char *str, size_t len) {
+    pos = writeHeader(pos, '$', len);
+    memcpy(pos, str, len);
+    pos += len;
+    *pos++ = '\r';
+    *pos++ = '\n';
+    return pos;
+  }
+
+  //----------------------------------------------------------------------------
+  // Strings and integers
   //----------------------------------------------------------------------------
-  static void serializeInternal(std::ostringstream &ss, const std::string &str);
-  static void serializeInternal(std::ostringstream &ss, int64_t num);
+  static size_t serializedLength(const std::string &str) {
+    return stringLength(str.size());
+  }
+
+  static char* write(char *pos, const std::string &str) {
+    return writeString(pos, str.data(), str.size());
+  }
+
+  static size_t serializedLength(const char *str) {
+    return stringLength(strlen(str));
+  }
+
+  static char* write(char *pos, const char *str) {
+    return writeString(pos, str, strlen(str));
+  }
+
+  static size_t serializedLength(int64_t num) {
+    return headerLength(':', num);
+  }
+
+  static char* write(char *pos, int64_t num) {
+    return writeHeader(pos, ':', num);
+  }
 
   //----------------------------------------------------------------------------
   // Serialize any kind of vector
   //----------------------------------------------------------------------------
   template<typename T>
-  static void serializeInternal(std::ostringstream &ss, const std::vector<T> &vec) {
-    ss << "*" << vec.size() << "\r\n";
+  static size_t serializedLength(const std::vector<T> &vec) {
+    size_t len = headerLength('*', vec.size());
+    for(size_t i = 0; i < vec.size(); i++) {
+      len += serializedLength(vec[i]);
+    }
+
+    return len;
+  }
+
+  template<typename T>
+  static char* write(char *pos, const std::vector<T> &vec) {
+    pos = writeHeader(pos, '*', vec.size());
     for(size_t i = 0; i < vec.size(); i++) {
-      serializeInternal(ss, vec[i]);
+      pos = write(pos, vec[i]);
     }
+
+    return pos;
   }
 
   //----------------------------------------------------------------------------
   // Serialize any kind of map
   //----------------------------------------------------------------------------
   template<typename K, typename V>
-  static void serializeInternal(std::ostringstream &ss, const std::map<K, V> &map) {
-    ss << "*" << 2*map.size() << "\r\n";
+  static size_t serializedLength(const std::map<K, V> &map) {
+    size_t len = headerLength('*', 2*map.size());
+    for(auto it = map.begin(); it != map.end(); it++) {
+      len += serializedLength(it->first);
+      len += serializedLength(it->second);
+    }
+
+    return len;
+  }
+
+  template<typename K, typename V>
+  static char* write(char *pos, const std::map<K, V> &map) {
+    pos = writeHeader(pos, '*', 2*map.size());
     for(auto it = map.begin(); it != map.end(); it++) {
-      serializeInternal(ss, it->first);
-      serializeInternal(ss, it->second);
+      pos = write(pos, it->first);
+      pos = write(pos, it->second);
     }
+
+    return pos;
   }
 
   //----------------------------------------------------------------------------
   // Recursively serialize each type in the vector
   //----------------------------------------------------------------------------
-  template<class none = void>
-  static void serializeMulti(std::ostringstream &ss) {} // base case for recursion
+  static size_t lengthMulti() { return 0; } // base case for recursion
 
   template<typename Head, typename... Tail>
-  static void serializeMulti(std::ostringstream &ss, Head&& head, Tail&&... tail) {
-    serializeInternal(ss, std::forward<Head>(head));
-    serializeMulti<Tail...>(ss, std::forward<Tail>(tail)...);
+  static size_t lengthMulti(const Head& head, const Tail&... tail) {
+    return serializedLength(head) + lengthMulti(tail...);
   }
 
+  static char* writeMulti(char *pos) { return pos; } // base case for recursion
+
+  template<typename Head, typename... Tail>
+  static char* writeMulti(char *pos, const Head& head, const Tail&... tail) {
+    return writeMulti(write(pos, head), tail...);
+  }
 
 };
 
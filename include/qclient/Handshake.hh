@@ -30,6 +30,10 @@
 #include "qclient/QCallback.hh"
 #include "qclient/utils/Macros.hh"
 #include "qclient/Utils.hh"
+#include "qclient/ScriptRegistry.hh"
+#include "qclient/ServerCapabilities.hh"
+#include <functional>
+#include <memory>
 
 namespace qclient {
 
@@ -51,6 +55,17 @@ public:
   virtual Status validateResponse(const redisReplyPtr &reply) = 0;
   virtual void restart() = 0;
 
+  //----------------------------------------------------------------------------
+  //! May user requests be written right behind the request last given out
+  //! by provideHandshake, without waiting for its response? Only if a valid
+  //! response completes the handshake, and is all but certain: Should it
+  //! fail after all, the user requests are sent again on the next
+  //! connection. See Options::optimisticHandshake.
+  //----------------------------------------------------------------------------
+  virtual bool pipelinable() const {
+    return false;
+  }
+
   //----------------------------------------------------------------------------
   //! Create a new handshake object of this type - if this is a multi-stage
   //! handshake, the newly created object must start from the first stage!
@@ -72,6 +87,7 @@ public:
   virtual std::vector<std::string> provideHandshake() override final;
   virtual Status validateResponse(const redisReplyPtr &reply) override final;
   virtual void restart() override final;
+  virtual bool pipelinable() const override final;
   virtual std::unique_ptr<Handshake> clone() const override final;
 
 private:
@@ -90,6 +106,7 @@ public:
   virtual std::vector<std::string> provideHandshake() override final;
   virtual Status validateResponse(const redisReplyPtr &reply) override final;
   virtual void restart() override final;
+  virtual bool pipelinable() const override final;
   virtual std::unique_ptr<Handshake> clone() const override final;
 
 private:
@@ -109,6 +126,7 @@ public:
   virtual std::vector<std::string> provideHandshake() override final;
   virtual Status validateResponse(const redisReplyPtr &reply) override final;
   virtual void restart() override final;
+  virtual bool pipelinable() const override final;
   virtual std::unique_ptr<Handshake> clone() const override final;
 
   //----------------------------------------------------------------------------
@@ -138,6 +156,7 @@ public:
   virtual std::vector<std::string> provideHandshake() override final;
   virtual Status validateResponse(const redisReplyPtr &reply) override final;
   virtual void restart() override final;
+  virtual bool pipelinable() const override final;
   virtual std::unique_ptr<Handshake> clone() const override final;
 
 private:
@@ -158,6 +177,26 @@ public:
   virtual std::vector<std::string> provideHandshake() override final;
   virtual Status validateResponse(const redisReplyPtr &reply) override final;
   virtual void restart() override final;
+  virtual bool pipelinable() const override final;
+  virtual std::unique_ptr<Handshake> clone() const override final;
+};
+
+//------------------------------------------------------------------------------
+//! ActivateStaleReads handshake - send 'ACTIVATE-STALE-READS', expect OK
+//! Only useful for QuarkDB: Lets followers serve reads, which may lag behind
+//! the leader.
+//------------------------------------------------------------------------------
+class ActivateStaleReadsHandshake : public Handshake {
+public:
+  //----------------------------------------------------------------------------
+  //! Basic interface
+  //----------------------------------------------------------------------------
+  ActivateStaleReadsHandshake();
+  virtual ~ActivateStaleReadsHandshake();
+  virtual std::vector<std::string> provideHandshake() override final;
+  virtual Status validateResponse(const redisReplyPtr &reply) override final;
+  virtual void restart() override final;
+  virtual bool pipelinable() const override final;
   virtual std::unique_ptr<Handshake> clone() const override final;
 };
 
@@ -174,6 +213,7 @@ public:
   virtual std::vector<std::string> provideHandshake() override final;
   virtual Status validateResponse(const redisReplyPtr &reply) override final;
   virtual void restart() override final;
+  virtual bool pipelinable() const override final;
   virtual std::unique_ptr<Handshake> clone() const override final;
 
 private:
@@ -181,6 +221,73 @@ private:
   bool ignoreFailures;
 };
 
+//------------------------------------------------------------------------------
+//! ScriptLoad handshake - send 'SCRIPT LOAD' for every script in the given
+//! registry, so that EVALSHA finds them on a fresh connection. Failures are
+//! ignored: A script which doesn't load simply falls back to the NOSCRIPT
+//! path. Sends a PING if the registry is empty.
+//------------------------------------------------------------------------------
+class ScriptLoadHandshake : public Handshake {
+public:
+  //----------------------------------------------------------------------------
+  //! Basic interface
+  //----------------------------------------------------------------------------
+  ScriptLoadHandshake(std::shared_ptr<ScriptRegistry> registry);
+  virtual ~ScriptLoadHandshake();
+  virtual std::vector<std::string> provideHandshake() override final;
+  virtual Status validateResponse(const redisReplyPtr &reply) override final;
+  virtual void restart() override final;
+  virtual bool pipelinable() const override final;
+  virtual std::unique_ptr<Handshake> clone() const override final;
+
+private:
+  std::shared_ptr<ScriptRegistry> registry;
+  std::vector<std::pair<std::string, std::string>> scripts;
+  bool started = false;
+  size_t next = 0;
+};
+
+//------------------------------------------------------------------------------
+//! Capability handshake - find out what the server supports: Ask for
+//! 'QUARKDB-VERSION', then 'INFO server' if that fails, and hand the result
+//! to the given callback. If the server supports push types and
+//! activatePushTypes is set, sends 'ACTIVATE-PUSH-TYPES' as well. Never
+//! fails - a server answering neither supports nothing.
+//------------------------------------------------------------------------------
+class CapabilityHandshake : public Handshake {
+public:
+  using Callback = std::function<void(const ServerCapabilities&)>;
+
+  //----------------------------------------------------------------------------
+  //! Basic interface
+  //----------------------------------------------------------------------------
+  CapabilityHandshake(Callback callback, bool activatePushTypes);
+  virtual ~CapabilityHandshake();
+  virtual std::vector<std::string> provideHandshake() override final;
+  virtual Status validateResponse(const redisReplyPtr &reply) override final;
+  virtual void restart() override final;
+  virtual bool pipelinable() const override final;
+  virtual std::unique_ptr<Handshake> clone() const override final;
+
+  //----------------------------------------------------------------------------
+  //! Helper methods
+  //----------------------------------------------------------------------------
+  static bool parseQuarkDBVersion(const redisReplyPtr &reply, ServerCapabilities &out);
+  static bool parseRedisInfo(const redisReplyPtr &reply, ServerCapabilities &out);
+
+private:
+  enum class Stage {
+    kQuarkDBVersion,
+    kRedisInfo,
+    kActivatePushTypes
+  };
+
+  Status negotiated(const ServerCapabilities &caps);
+
+  Callback callback;
+  bool activatePushTypes;
+  Stage stage = Stage::kQuarkDBVersion;
+};
 
 }
 
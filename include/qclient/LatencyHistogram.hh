@@ -0,0 +1,104 @@
+//------------------------------------------------------------------------------
+// File: LatencyHistogram.hh
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#ifndef QCLIENT_LATENCY_HISTOGRAM_HH
+#define QCLIENT_LATENCY_HISTOGRAM_HH
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+namespace qclient {
+
+//------------------------------------------------------------------------------
+//! Point-in-time copy of a LatencyHistogram. All values are in nanoseconds.
+//------------------------------------------------------------------------------
+struct LatencySnapshot {
+  std::vector<uint64_t> buckets;
+  uint64_t count = 0;
+  uint64_t sum = 0;
+  uint64_t max = 0;
+
+  double mean() const;
+
+  //----------------------------------------------------------------------------
+  //! Upper bound of the bucket holding the given percentile, in [0, 100] -
+  //! 0 if nothing was recorded.
+  //----------------------------------------------------------------------------
+  uint64_t percentile(double p) const;
+};
+
+//------------------------------------------------------------------------------
+//! Log-linear histogram in the spirit of HdrHistogram: values below 8 get a
+//! bucket each, and every power of two above is split into 8 buckets, for a
+//! worst-case relative error of 12.5% across the full 64-bit range.
+//!
+//! Recording takes a few relaxed atomic operations - safe from any thread,
+//! never blocks. Snapshots are not atomic as a whole, but each counter is.
+//------------------------------------------------------------------------------
+class LatencyHistogram {
+public:
+  static constexpr size_t kSubBucketBits = 3;
+  static constexpr size_t kSubBuckets = 1 << kSubBucketBits;
+  static constexpr size_t kBuckets = (64 - kSubBucketBits + 1) * kSubBuckets;
+
+  LatencyHistogram();
+
+  void record(uint64_t nanoseconds);
+
+  void record(std::chrono::steady_clock::duration duration) {
+    int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count();
+    record(ns < 0 ? 0 : (uint64_t) ns);
+  }
+
+  LatencySnapshot snapshot() const;
+  void reset();
+
+  static size_t bucketIndex(uint64_t value);
+  static uint64_t bucketUpperBound(size_t index);
+
+private:
+  std::atomic<uint64_t> buckets[kBuckets];
+  std::atomic<uint64_t> sum {0};
+  std::atomic<uint64_t> max {0};
+};
+
+//------------------------------------------------------------------------------
+//! Request latency, split into stages.
+//------------------------------------------------------------------------------
+struct LatencyStats {
+  //! From execute() until the request is handed to the socket
+  LatencySnapshot queueing;
+
+  //! From then until its reply is parsed - network and server time
+  LatencySnapshot network;
+
+  //! From then until the callback starts running on the callback executor.
+  //! Callbacks running inline, such as futures, are not counted.
+  LatencySnapshot callback;
+};
+
+}
+
+#endif
@@ -43,11 +43,35 @@ public:
     return port;
   }
 
+  //----------------------------------------------------------------------------
+  // Unix domain socket endpoints are given as "unix:/path/to/socket", and
+  // carry no port.
+  //----------------------------------------------------------------------------
+  bool isUnix() const {
+    return host.compare(0, 5, "unix:") == 0;
+  }
+
+  std::string getUnixPath() const {
+    if(!isUnix()) {
+      return "";
+    }
+
+    return host.substr(5);
+  }
+
   bool empty() const {
+    if(isUnix()) {
+      return getUnixPath().empty();
+    }
+
     return host.empty() || port <= 0;
   }
 
   std::string toString() const {
+    if(isUnix()) {
+      return host;
+    }
+
     std::stringstream ss;
     ss << host << ":" << port;
     return ss.str();
@@ -116,6 +140,16 @@ public:
     std::string token;
 
     while (std::getline(iss, token, ' ')) {
+      Endpoint unixEndpoint(token, 0);
+      if(unixEndpoint.isUnix()) {
+        if(!unixEndpoint.empty()) {
+          members.push_back(unixEndpoint);
+          valid = true;
+        }
+
+        continue;
+      }
+
       size_t pos = token.find(':');
 
       if (pos != std::string::npos) {
@@ -136,7 +170,7 @@ public:
   std::string toString() const {
     std::ostringstream ss;
     for(size_t i = 0; i < members.size(); i++) {
-      ss << members[i].getHost() << ":" << members[i].getPort();
+      ss << members[i].toString();
       if(i != members.size() - 1) {
         ss << ",";
       }
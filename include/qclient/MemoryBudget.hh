@@ -0,0 +1,132 @@
+// ----------------------------------------------------------------------
+// File: MemoryBudget.hh
+// Author: Georgios Bitzes - CERN
+// ----------------------------------------------------------------------
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2016 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#ifndef QCLIENT_MEMORY_BUDGET_HH
+#define QCLIENT_MEMORY_BUDGET_HH
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+namespace qclient {
+
+//------------------------------------------------------------------------------
+//! A memory ceiling shared by any number of QClient, Subscriber and
+//! BackgroundFlusher instances, attached through Options::memoryBudget or
+//! SubscriptionOptions::memoryBudget. Per-client backpressure still applies
+//! on top.
+//!
+//! Three kinds of memory are accounted for:
+//! - Staged requests, from execute until acknowledged. Once the budget is
+//!   exhausted, issuing more blocks - or fails, for the non-blocking
+//!   flavours - until some are acknowledged, whichever client they
+//!   belong to.
+//! - Unparsed input: Bytes received, but not forming a complete response
+//!   yet - a large reply in progress, typically. Never refused, since
+//!   reading is how staged requests get acknowledged, but counts against
+//!   the budget all the same.
+//! - Messages queued inside Subscriptions. Once the budget is exhausted,
+//!   incoming messages are shed: Subscriptions with kDropOldest evict their
+//!   own oldest ones to make room, all others discard the incoming message.
+//!
+//! A single request larger than the whole budget is admitted once nothing
+//! else is accounted for.
+//------------------------------------------------------------------------------
+class MemoryBudget {
+public:
+  enum class Category {
+    kStagedRequests = 0,
+    kUnparsedInput,
+    kQueuedMessages,
+    kCount
+  };
+
+  //----------------------------------------------------------------------------
+  //! Constructor, taking the limit in bytes.
+  //----------------------------------------------------------------------------
+  MemoryBudget(size_t limit);
+
+  //----------------------------------------------------------------------------
+  //! Account for the given bytes, blocking until they fit.
+  //----------------------------------------------------------------------------
+  void acquire(Category category, size_t bytes);
+
+  //----------------------------------------------------------------------------
+  //! Same, but never blocks: Returns false if the bytes don't fit, in which
+  //! case nothing is accounted for.
+  //----------------------------------------------------------------------------
+  bool tryAcquire(Category category, size_t bytes);
+
+  //----------------------------------------------------------------------------
+  //! Account for bytes already allocated, even if that exceeds the limit.
+  //----------------------------------------------------------------------------
+  void charge(Category category, size_t bytes);
+
+  //----------------------------------------------------------------------------
+  //! Give back bytes accounted through any of the above.
+  //----------------------------------------------------------------------------
+  void release(Category category, size_t bytes);
+
+  //----------------------------------------------------------------------------
+  //! Record the given number of messages shed because of the budget.
+  //----------------------------------------------------------------------------
+  void recordShed(size_t messages = 1);
+
+  //----------------------------------------------------------------------------
+  //! Is usage at or above the limit?
+  //----------------------------------------------------------------------------
+  bool exhausted() const;
+
+  size_t getLimit() const {
+    return limit;
+  }
+
+  size_t getUsage() const;
+  size_t getUsage(Category category) const;
+
+  //----------------------------------------------------------------------------
+  //! Lifetime totals: messages shed, and time spent blocked in acquire.
+  //----------------------------------------------------------------------------
+  uint64_t getShed() const;
+  std::chrono::nanoseconds getBlockedTime() const;
+
+private:
+  bool fits(size_t usage, size_t bytes) const;
+
+  const size_t limit;
+  std::atomic<size_t> usage {0};
+  std::atomic<size_t> perCategory[static_cast<size_t>(Category::kCount)];
+  std::atomic<uint64_t> shed {0};
+  std::atomic<int64_t> blockedTime {0};
+
+  std::mutex mtx;
+  std::condition_variable cv;
+  std::atomic<size_t> waiters {0};
+};
+
+}
+
+#endif
@@ -0,0 +1,98 @@
+//------------------------------------------------------------------------------
+// File: MmapLogPersistency.hh
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#ifndef QCLIENT_MMAP_LOG_PERSISTENCY_HH
+#define QCLIENT_MMAP_LOG_PERSISTENCY_HH
+
+#include "qclient/BackgroundFlusher.hh"
+#include "qclient/network/FileDescriptor.hh"
+#include <deque>
+#include <memory>
+#include <mutex>
+
+namespace qclient {
+
+//------------------------------------------------------------------------------
+// Append-only persistency layer for BackgroundFlusher, made of fixed-size,
+// memory-mapped segment files inside a directory:
+//
+// - Items are appended to the last segment as CRC32C-framed records, holding
+//   the RESP-encoded request - replay hands those bytes straight to QClient.
+//   A new segment is started whenever the current one fills up.
+// - HEAD holds the checkpointed starting index, rewritten on every pop.
+// - A segment is deleted as soon as all its items have been popped.
+//
+// On startup, segments are scanned and a torn trailing record is discarded.
+// Like RocksDBPersistency, writes are not fsync'ed - they survive a crash
+// of the process, not of the machine.
+//------------------------------------------------------------------------------
+class MmapLogPersistency : public BackgroundFlusherPersistency {
+public:
+  MmapLogPersistency(const std::string &path, size_t segmentSize = 64 * 1024 * 1024);
+  virtual ~MmapLogPersistency();
+
+  virtual void record(ItemIndex index, const std::vector<std::string> &cmd) override;
+  virtual void recordBatch(ItemIndex index, const std::vector<std::vector<std::string>> &cmds) override;
+
+  virtual void pop() override;
+  virtual void popBatch(size_t count) override;
+
+  virtual ItemIndex getStartingIndex() override;
+  virtual ItemIndex getEndingIndex() override;
+
+  virtual bool retrieve(ItemIndex index, std::vector<std::string> &ret) override;
+  virtual bool retrieveBatch(ItemIndex index, size_t count, std::vector<std::vector<std::string>> &out) override;
+
+  virtual bool storesEncoded() override;
+  virtual void recordEncoded(ItemIndex index, const EncodedRequest *reqs, size_t count) override;
+  virtual bool retrieveEncoded(ItemIndex index, size_t count, std::vector<EncodedRequest> &out) override;
+
+  size_t getSegmentCount();
+
+private:
+  struct Segment;
+
+  void loadSegments();
+  void loadHead();
+  void writeHead();
+  void append(const EncodedRequest &req);
+  bool locate(ItemIndex index, const char *&payload, uint32_t &len);
+  void dropConsumedSegments();
+  Segment* findSegment(ItemIndex index);
+  std::unique_ptr<Segment> createSegment(ItemIndex firstIndex, size_t capacity);
+  std::unique_ptr<Segment> openSegment(const std::string &filename, ItemIndex firstIndex);
+
+  std::string dirpath;
+  size_t segmentSize;
+
+  std::mutex mtx;
+  std::deque<std::unique_ptr<Segment>> segments;
+  FileDescriptor headFd;
+
+  std::atomic<ItemIndex> startIndex {0};
+  std::atomic<ItemIndex> endIndex {0};
+};
+
+}
+
+#endif
@@ -25,29 +25,80 @@
 #define QCLIENT_MULTI_BUILDER_HH
 
 #include "EncodedRequest.hh"
+#include <deque>
 
 namespace qclient {
 
+//------------------------------------------------------------------------------
+// Builds a MULTI / EXEC transaction. Commands are encoded straight into a
+// single growable buffer, which already carries the MULTI framing - release()
+// appends EXEC and hands the buffer over to an EncodedRequest without copying
+// it. With reserve(), a whole transaction costs a single allocation. The
+// buffer is only allocated once the first command is added.
+//------------------------------------------------------------------------------
 class MultiBuilder {
 public:
+  MultiBuilder();
+  ~MultiBuilder();
+
+  MultiBuilder(MultiBuilder&& other) noexcept;
+  MultiBuilder& operator=(MultiBuilder&& other) noexcept;
+  MultiBuilder(const MultiBuilder&) = delete;
+  MultiBuilder& operator=(const MultiBuilder&) = delete;
 
   template<typename... Args>
   void emplace_back(const Args&... args) {
-    contents.emplace_back(EncodedRequest::make(args...));
+    appendArguments(toArgument(args)...);
   }
 
+  void append(size_t nchunks, const char** chunks, const size_t* sizes);
+
+  //----------------------------------------------------------------------------
+  // Make sure the buffer can hold that many bytes of encoded commands without
+  // growing again.
+  //----------------------------------------------------------------------------
+  void reserve(size_t bytes);
+
+  //----------------------------------------------------------------------------
+  // Number of commands in the transaction, not counting MULTI / EXEC
+  //----------------------------------------------------------------------------
   size_t size() const {
-    return contents.size();
+    return count;
   }
 
-  std::deque<EncodedRequest>&& getDeque() {
-    return std::move(contents);
-  }
+  //----------------------------------------------------------------------------
+  // Terminate the transaction with EXEC, and return the whole block as a
+  // single request. The builder is left empty, ready for reuse.
+  //----------------------------------------------------------------------------
+  EncodedRequest release();
+
+  //----------------------------------------------------------------------------
+  // Deprecated - use release() instead. Returns each command added so far as
+  // a separate request, decoded back out of the buffer. The builder keeps its
+  // contents.
+  //----------------------------------------------------------------------------
+  [[deprecated("use MultiBuilder::release() instead")]]
+  std::deque<EncodedRequest> getDeque() const;
 
 private:
-  std::deque<EncodedRequest> contents;
+  template<typename... Args>
+  void appendArguments(const Args&... args) {
+    const char* cstr[] { toCharPointer(args)...  };
+    size_t sizes[] { toSize(args)... };
+    append(sizeof...(Args), cstr, sizes);
+  }
+
+  void reset();
+  void start();
+  char* grow(size_t len);
+  void resize(size_t newCapacity);
+
+  char *buffer = nullptr;
+  size_t length = 0;
+  size_t capacity = 0;
+  size_t count = 0;
 };
 
 }
 
-#endif
\ No newline at end of file
+#endif
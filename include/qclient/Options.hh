@@ -24,16 +24,30 @@
 #ifndef QCLIENT_OPTIONS_HH
 #define QCLIENT_OPTIONS_HH
 
+#include <algorithm>
 #include <chrono>
+#include <functional>
 #include <memory>
+#include <vector>
 #include "TlsFilter.hh"
 #include "Handshake.hh"
+#include "qclient/network/SocketProfile.hh"
+#include "qclient/utils/MemoryResource.hh"
 
 namespace qclient {
 
 class Handshake;
 class Logger;
 class MessageListener;
+class EventLoopGroup;
+class ExternalEventLoop;
+class DnsCache;
+class LatencyProber;
+class RequestTracer;
+class EncodedRequest;
+class MemoryBudget;
+class RateLimiter;
+class SubscriptionDispatcher;
 
 //------------------------------------------------------------------------------
 //! This struct specifies how to rate-limit writing into QClient.
@@ -65,6 +79,45 @@ public:
     return ret;
   }
 
+  //----------------------------------------------------------------------------
+  //! Limit the total encoded size of pending requests to the specified amount
+  //! of bytes, which gives a predictable memory ceiling regardless of request
+  //! sizes. Once this limit is reached, attempts to issue more requests will
+  //! block.
+  //!
+  //! A single request larger than the limit is still accepted, but only once
+  //! all other pending requests have been acknowledged.
+  //!
+  //! Optionally, the number of pending requests can be limited as well - 0
+  //! means no limit on request count.
+  //----------------------------------------------------------------------------
+  static BackpressureStrategy RateLimitPendingBytes(size_t bytes, size_t sz = 0u) {
+    BackpressureStrategy ret;
+    ret.enabled = true;
+    ret.pendingBytesLimit = bytes;
+    ret.pendingRequestLimit = sz;
+    return ret;
+  }
+
+  //----------------------------------------------------------------------------
+  //! Limit pending requests to a window tuned on the fly, within [minimum,
+  //! maximum]: Once per window's worth of acknowledgements, the latency of
+  //! those is compared to the lowest seen lately, in the spirit of TCP Vegas.
+  //! While latency stays flat, the window grows - once requests start
+  //! queueing up in the network or at the server, it shrinks in proportion.
+  //! Once the window is full, attempts to issue more requests will block.
+  //----------------------------------------------------------------------------
+  static BackpressureStrategy Adaptive(size_t minimum = 64u, size_t maximum = 262144u,
+    size_t initial = 1024u) {
+    BackpressureStrategy ret;
+    ret.enabled = true;
+    ret.adaptive = true;
+    ret.minimumWindow = std::max<size_t>(std::min(minimum, maximum), 1u);
+    ret.pendingRequestLimit = std::max(maximum, ret.minimumWindow);
+    ret.initialWindow = std::min(std::max(initial, ret.minimumWindow), ret.pendingRequestLimit);
+    return ret;
+  }
+
   //----------------------------------------------------------------------------
   //! Use this only if you have a good reason to, Default() should work fine
   //! for the vast majority of use cases.
@@ -75,14 +128,54 @@ public:
     return ret;
   }
 
+  //----------------------------------------------------------------------------
+  //! Fluent interface: Set the low-water mark, as a fraction of the limits.
+  //! Capacity notifications (see QClient::notifyWhenCapacityAvailable) fire
+  //! once the backlog drops to this level. Default is 0.5.
+  //----------------------------------------------------------------------------
+  BackpressureStrategy& withLowWaterMark(double fraction) {
+    lowWaterMark = fraction;
+    return *this;
+  }
+
   bool active() const {
     return enabled;
   }
 
+  double getLowWaterMark() const {
+    return lowWaterMark;
+  }
+
+  //----------------------------------------------------------------------------
+  //! Limit on the number of pending requests, 0 if none. The maximum window,
+  //! if adaptive.
+  //----------------------------------------------------------------------------
   size_t getRequestLimit() const {
     return pendingRequestLimit;
   }
 
+  //----------------------------------------------------------------------------
+  //! Only apply if adaptive.
+  //----------------------------------------------------------------------------
+  bool isAdaptive() const {
+    return adaptive;
+  }
+
+  size_t getMinimumWindow() const {
+    return minimumWindow;
+  }
+
+  size_t getInitialWindow() const {
+    return initialWindow;
+  }
+
+  //----------------------------------------------------------------------------
+  //! Limit on the total size of pending requests in bytes, 0 if none.
+  //----------------------------------------------------------------------------
+  size_t getByteLimit() const {
+    return pendingBytesLimit;
+  }
+
 private:
   //----------------------------------------------------------------------------
   //! Private constructor - use static methods above to create an object.
@@ -91,6 +184,12 @@ private:
 
   bool enabled = false;
   size_t pendingRequestLimit = 0u;
+  size_t pendingBytesLimit = 0u;
+  double lowWaterMark = 0.5;
+
+  bool adaptive = false;
+  size_t minimumWindow = 0u;
+  size_t initialWindow = 0u;
 };
 
 //------------------------------------------------------------------------------
@@ -162,6 +261,428 @@ private:
   std::chrono::seconds timeout {0};
 };
 
+//------------------------------------------------------------------------------
+//! How long to wait between reconnection attempts, while the connection is
+//! down.
+//!
+//! kLinear: Start at 1 ms, adding 1 ms after each failed attempt, up to
+//! 2048 ms.
+//!
+//! kExponentialJitter: Retry immediately the first time, then wait a random
+//! amount between base and three times the previous wait, capped
+//! ("decorrelated jitter"). Many clients losing the same server at once
+//! then spread out their reconnections, instead of hitting it in
+//! lockstep.
+//------------------------------------------------------------------------------
+class ReconnectStrategy {
+private:
+  //----------------------------------------------------------------------------
+  //! Private constructor, use static methods below to construct an object.
+  //----------------------------------------------------------------------------
+  ReconnectStrategy() {}
+
+public:
+
+  enum class Mode {
+    kLinear = 0,
+    kExponentialJitter
+  };
+
+  //----------------------------------------------------------------------------
+  //! Linear backoff, the default.
+  //----------------------------------------------------------------------------
+  static ReconnectStrategy Linear() {
+    ReconnectStrategy val;
+    val.mode = Mode::kLinear;
+    return val;
+  }
+
+  //----------------------------------------------------------------------------
+  //! Capped exponential backoff with decorrelated jitter.
+  //----------------------------------------------------------------------------
+  static ReconnectStrategy ExponentialJitter(
+    std::chrono::milliseconds base = std::chrono::milliseconds(10),
+    std::chrono::milliseconds cap = std::chrono::milliseconds(5000)) {
+
+    ReconnectStrategy val;
+    val.mode = Mode::kExponentialJitter;
+    val.base = base;
+    val.cap = cap;
+    return val;
+  }
+
+  Mode getMode() const {
+    return mode;
+  }
+
+  std::chrono::milliseconds getBase() const {
+    return base;
+  }
+
+  std::chrono::milliseconds getCap() const {
+    return cap;
+  }
+
+private:
+  Mode mode { Mode::kLinear };
+
+  //----------------------------------------------------------------------------
+  //! Only apply if mode is kExponentialJitter.
+  //----------------------------------------------------------------------------
+  std::chrono::milliseconds base {10};
+  std::chrono::milliseconds cap {5000};
+};
+
+//------------------------------------------------------------------------------
+//! Class ReplayPacing - how to replay pending requests after reconnecting.
+//!
+//! With retries enabled, requests which were pending when the connection
+//! dropped are written again on the new one.
+//!
+//! kUnpaced: The whole backlog goes out at once, the default.
+//!
+//! kSlowStart: At most initialWindow requests may be outstanding at first.
+//! The window grows by one with every response, doubling once per round
+//! trip, until it reaches maxWindow, or the backlog has been written out.
+//! A server which has just come back then isn't hit with the full backlog
+//! before it has answered anything.
+//------------------------------------------------------------------------------
+class ReplayPacing {
+private:
+  //----------------------------------------------------------------------------
+  //! Private constructor, use static methods below to construct an object.
+  //----------------------------------------------------------------------------
+  ReplayPacing() {}
+
+public:
+
+  enum class Mode {
+    kUnpaced = 0,
+    kSlowStart
+  };
+
+  //----------------------------------------------------------------------------
+  //! Replay everything at once, the default.
+  //----------------------------------------------------------------------------
+  static ReplayPacing Unpaced() {
+    ReplayPacing val;
+    val.mode = Mode::kUnpaced;
+    return val;
+  }
+
+  //----------------------------------------------------------------------------
+  //! Slow-start style window ramp-up.
+  //----------------------------------------------------------------------------
+  static ReplayPacing SlowStart(size_t initialWindow = 64, size_t maxWindow = 16384) {
+    ReplayPacing val;
+    val.mode = Mode::kSlowStart;
+    val.initialWindow = std::max<size_t>(initialWindow, 1u);
+    val.maxWindow = std::max(maxWindow, val.initialWindow);
+    return val;
+  }
+
+  bool active() const {
+    return mode == Mode::kSlowStart;
+  }
+
+  Mode getMode() const {
+    return mode;
+  }
+
+  size_t getInitialWindow() const {
+    return initialWindow;
+  }
+
+  size_t getMaxWindow() const {
+    return maxWindow;
+  }
+
+private:
+  Mode mode { Mode::kUnpaced };
+
+  //----------------------------------------------------------------------------
+  //! Only apply if mode is kSlowStart.
+  //----------------------------------------------------------------------------
+  size_t initialWindow = 64;
+  size_t maxWindow = 16384;
+};
+
+//------------------------------------------------------------------------------
+//! Class ReadRouting - which requests may be served by followers.
+//!
+//! kLeaderOnly: Everything goes to the endpoint picked by QClient, the
+//! leader once redirects are followed. The default.
+//!
+//! kFollowers: Read-only requests go over a second connection, which prefers
+//! a different member and activates stale reads on it. Followers apply
+//! writes slightly behind the leader: To keep reading one's own writes,
+//! reads issued within leaderAfterWrite of a write through the same QClient
+//! still go to the leader.
+//!
+//! Requests are read-only if issued through QClient::executeRead, or, with
+//! the command table enabled, if their command is a known read-only one
+//! such as HGET or LHSCAN. There's no ordering between reads served by
+//! followers and anything else.
+//------------------------------------------------------------------------------
+class ReadRouting {
+private:
+  //----------------------------------------------------------------------------
+  //! Private constructor, use static methods below to construct an object.
+  //----------------------------------------------------------------------------
+  ReadRouting() {}
+
+public:
+
+  enum class Mode {
+    kLeaderOnly = 0,
+    kFollowers
+  };
+
+  //----------------------------------------------------------------------------
+  //! Send everything to the leader, the default.
+  //----------------------------------------------------------------------------
+  static ReadRouting LeaderOnly() {
+    ReadRouting val;
+    val.mode = Mode::kLeaderOnly;
+    return val;
+  }
+
+  //----------------------------------------------------------------------------
+  //! Send reads to followers, unless a write was issued within
+  //! leaderAfterWrite.
+  //----------------------------------------------------------------------------
+  static ReadRouting Followers(
+    std::chrono::milliseconds leaderAfterWrite = std::chrono::milliseconds(1000),
+    bool commandTable = true) {
+
+    ReadRouting val;
+    val.mode = Mode::kFollowers;
+    val.leaderAfterWrite = leaderAfterWrite;
+    val.commandTable = commandTable;
+    return val;
+  }
+
+  Mode getMode() const {
+    return mode;
+  }
+
+  std::chrono::milliseconds getLeaderAfterWrite() const {
+    return leaderAfterWrite;
+  }
+
+  bool usesCommandTable() const {
+    return commandTable;
+  }
+
+  bool active() const {
+    return mode != Mode::kLeaderOnly;
+  }
+
+  //----------------------------------------------------------------------------
+  //! Is the given request a known read-only command? Case-insensitive.
+  //----------------------------------------------------------------------------
+  static bool isReadOnly(const EncodedRequest &req);
+  static bool isReadOnlyCommand(const char *cmd, size_t len);
+
+private:
+  Mode mode { Mode::kLeaderOnly };
+
+  //----------------------------------------------------------------------------
+  //! Only apply if mode is kFollowers.
+  //----------------------------------------------------------------------------
+  std::chrono::milliseconds leaderAfterWrite {1000};
+  bool commandTable = true;
+};
+
+//------------------------------------------------------------------------------
+//! Class HedgedReads - whether to hedge slow reads.
+//!
+//! A read issued through QClient::executeRead which hasn't completed within
+//! the hedging delay is issued a second time, over a dedicated connection
+//! which prefers a different member and activates stale reads on it - the
+//! first of the two replies wins, the other one is discarded. When one node
+//! is slow, say due to compaction, this cuts tail latency at the cost of
+//! some duplicate reads.
+//!
+//! kAfterPercentile: The delay is the given percentile of network latency
+//! observed so far by the QClient - see QClient::getLatencyStats - clamped
+//! to [minDelay, maxDelay]. Until enough samples are in, maxDelay is used.
+//!
+//! kAfterDelay: A fixed delay.
+//!
+//! A hedged read may be served by a follower, just like with
+//! ReadRouting::Followers.
+//------------------------------------------------------------------------------
+class HedgedReads {
+private:
+  //----------------------------------------------------------------------------
+  //! Private constructor, use static methods below to construct an object.
+  //----------------------------------------------------------------------------
+  HedgedReads() {}
+
+public:
+
+  enum class Mode {
+    kDisabled = 0,
+    kAfterPercentile,
+    kAfterDelay
+  };
+
+  //----------------------------------------------------------------------------
+  //! No hedging, the default.
+  //----------------------------------------------------------------------------
+  static HedgedReads Disabled() {
+    return HedgedReads();
+  }
+
+  //----------------------------------------------------------------------------
+  //! Hedge reads slower than the given percentile, in [0, 100], of network
+  //! latency.
+  //----------------------------------------------------------------------------
+  static HedgedReads AfterPercentile(double percentile = 95,
+    std::chrono::milliseconds minDelay = std::chrono::milliseconds(1),
+    std::chrono::milliseconds maxDelay = std::chrono::milliseconds(100)) {
+
+    HedgedReads val;
+    val.mode = Mode::kAfterPercentile;
+    val.percentile = percentile;
+    val.minDelay = minDelay;
+    val.maxDelay = maxDelay;
+    return val;
+  }
+
+  //----------------------------------------------------------------------------
+  //! Hedge reads slower than the given delay.
+  //----------------------------------------------------------------------------
+  static HedgedReads AfterDelay(std::chrono::milliseconds delay) {
+    HedgedReads val;
+    val.mode = Mode::kAfterDelay;
+    val.minDelay = delay;
+    val.maxDelay = delay;
+    return val;
+  }
+
+  Mode getMode() const {
+    return mode;
+  }
+
+  double getPercentile() const {
+    return percentile;
+  }
+
+  std::chrono::milliseconds getMinDelay() const {
+    return minDelay;
+  }
+
+  std::chrono::milliseconds getMaxDelay() const {
+    return maxDelay;
+  }
+
+  bool active() const {
+    return mode != Mode::kDisabled;
+  }
+
+private:
+  Mode mode { Mode::kDisabled };
+
+  //----------------------------------------------------------------------------
+  //! Only apply if active - kAfterDelay sets both delays to the same value.
+  //----------------------------------------------------------------------------
+  double percentile = 95;
+  std::chrono::milliseconds minDelay {1};
+  std::chrono::milliseconds maxDelay {100};
+};
+
+//------------------------------------------------------------------------------
+//! Request priority, see QClient::executeWithPriority.
+//------------------------------------------------------------------------------
+enum class Priority {
+  kControl = 0,
+  kNormal,
+  kBulk
+};
+
+//------------------------------------------------------------------------------
+//! Class PriorityLanes - whether requests of different priorities share one
+//! pipeline.
+//!
+//! Disabled: Everything goes through the same connection in FIFO order, the
+//! default. A control command issued behind a large bulk load waits for the
+//! whole load to be written and acknowledged first.
+//!
+//! Enabled: Control and bulk requests each travel over a dedicated
+//! connection to the same members, with its own queue and backpressure
+//! budget, while normal requests keep using the main one. A backlog in one
+//! lane then never delays the others, and a bulk load blocking on its own
+//! budget leaves room for everything else.
+//!
+//! Requests within a lane keep their order, but there's no ordering between
+//! lanes.
+//------------------------------------------------------------------------------
+class PriorityLanes {
+private:
+  //----------------------------------------------------------------------------
+  //! Private constructor, use static methods below to construct an object.
+  //----------------------------------------------------------------------------
+  PriorityLanes() {}
+
+public:
+
+  //----------------------------------------------------------------------------
+  //! A single lane for all priorities, the default.
+  //----------------------------------------------------------------------------
+  static PriorityLanes Disabled() {
+    return PriorityLanes();
+  }
+
+  //----------------------------------------------------------------------------
+  //! Dedicated lanes for control and bulk requests, with the given
+  //! backpressure budgets. Normal requests use Options::backpressureStrategy.
+  //----------------------------------------------------------------------------
+  static PriorityLanes Enabled(
+    BackpressureStrategy control = BackpressureStrategy::RateLimitPendingRequests(4096u),
+    BackpressureStrategy bulk = BackpressureStrategy::Default()) {
+
+    PriorityLanes val;
+    val.enabled = true;
+    val.controlBackpressure = control;
+    val.bulkBackpressure = bulk;
+    return val;
+  }
+
+  bool active() const {
+    return enabled;
+  }
+
+  const BackpressureStrategy& getControlBackpressure() const {
+    return controlBackpressure;
+  }
+
+  const BackpressureStrategy& getBulkBackpressure() const {
+    return bulkBackpressure;
+  }
+
+private:
+  bool enabled = false;
+
+  //----------------------------------------------------------------------------
+  //! Only apply if enabled.
+  //----------------------------------------------------------------------------
+  BackpressureStrategy controlBackpressure = BackpressureStrategy::Default();
+  BackpressureStrategy bulkBackpressure = BackpressureStrategy::Default();
+};
+
+//------------------------------------------------------------------------------
+//! Which mechanism to use for socket I/O.
+//!
+//! kPoll: Classic poll() + recv / sendmsg, works everywhere.
+//! kIoUring: Use io_uring (Linux only). If the kernel does not support it,
+//! QClient silently falls back to kPoll.
+//------------------------------------------------------------------------------
+enum class IoBackend {
+  kPoll,
+  kIoUring
+};
 
 //------------------------------------------------------------------------------
 //! QClient Options class.
@@ -170,6 +691,10 @@ class Options {
 public:
   //----------------------------------------------------------------------------
   //! If enabled, QClient will try to transparently handle -MOVED redirects.
+  //!
+  //! The leader found this way is shared with all other QClients of the
+  //! process towards the same members, which try it first when
+  //! reconnecting.
   //----------------------------------------------------------------------------
   bool transparentRedirects = false;
 
@@ -184,10 +709,25 @@ public:
   //----------------------------------------------------------------------------
   RetryStrategy retryStrategy = RetryStrategy::NoRetries();
 
+  //----------------------------------------------------------------------------
+  //! How to space out reconnection attempts - see ReconnectStrategy.
+  //----------------------------------------------------------------------------
+  ReconnectStrategy reconnectStrategy = ReconnectStrategy::Linear();
+
+  //----------------------------------------------------------------------------
+  //! How to replay pending requests on a new connection - see ReplayPacing.
+  //! Only matters with retries enabled.
+  //----------------------------------------------------------------------------
+  ReplayPacing replayPacing = ReplayPacing::Unpaced();
+
   //----------------------------------------------------------------------------
   //! Specifies whether to rate-limit writing into QClient. If there are
-  //! too many un-acknowledged pending requests, attempting to issue more will
-  //! block.
+  //! too many un-acknowledged pending requests (or bytes, see
+  //! BackpressureStrategy::RateLimitPendingBytes), attempting to issue more
+  //! will block.
+  //!
+  //! This is the in-flight budget of this QClient object, and applies equally
+  //! to the future, callback and folly flavours of execute.
   //!
   //! Default is a maximum of 262144 pending requests in-flight.
   //----------------------------------------------------------------------------
@@ -226,9 +766,141 @@ public:
   //----------------------------------------------------------------------------
   std::chrono::seconds tcpTimeout = std::chrono::seconds(2);
 
+  //----------------------------------------------------------------------------
+  //! Socket options of every connection this client makes, including those
+  //! of warmStandby, readRouting and friends - see SocketProfile. For
+  //! example, SocketProfile::LowLatency() turns Nagle off and notices dead
+  //! peers within seconds, and SocketProfile::BandwidthDelay() also sizes
+  //! the socket buffers to fill a long, fat link.
+  //----------------------------------------------------------------------------
+  SocketProfile socketProfile = SocketProfile::Default();
+
+  //----------------------------------------------------------------------------
+  //! If enabled, reconnecting races all resolved addresses of all members
+  //! against each other, starting a new attempt every
+  //! connectionAttemptDelay, instead of trying them one by one. The first
+  //! to connect wins. This way, an endpoint dropping packets delays
+  //! failover by connectionAttemptDelay, instead of the full tcpTimeout -
+  //! which now covers all attempts together.
+  //!
+  //! Only applies to QClients running their own event loop thread, not to
+  //! those attached to an EventLoopGroup.
+  //----------------------------------------------------------------------------
+  bool parallelConnect = false;
+  std::chrono::milliseconds connectionAttemptDelay = std::chrono::milliseconds(250);
+
+  //----------------------------------------------------------------------------
+  //! If enabled, a spare connection is kept established and handshaken in
+  //! the background, preferably towards a different member than the active
+  //! one, and PINGed every standbyPingInterval. When the active connection
+  //! breaks, QClient switches over to the spare right away and replays
+  //! unacknowledged requests on it, instead of going through DNS, connect,
+  //! TLS and handshake first.
+  //!
+  //! Costs one extra connection per QClient. Only applies to QClients
+  //! running their own event loop thread, and not in exclusive pub-sub
+  //! mode.
+  //----------------------------------------------------------------------------
+  bool warmStandby = false;
+  std::chrono::milliseconds standbyPingInterval = std::chrono::milliseconds(1000);
+
+  //----------------------------------------------------------------------------
+  //! If enabled, user requests are written right behind the last handshake
+  //! request, in the same write, instead of waiting for the handshake to
+  //! complete - saving a round-trip per reconnection. Only applies to
+  //! handshakes which deem it safe, see Handshake::pipelinable.
+  //!
+  //! Should the handshake fail after all, the connection is dropped and the
+  //! user requests are sent again on the next one. The server will have
+  //! seen them once before, outside of an established handshake - only
+  //! enable if that's harmless, such as with authentication which the
+  //! server enforces.
+  //----------------------------------------------------------------------------
+  bool optimisticHandshake = false;
+
+  //----------------------------------------------------------------------------
+  //! Upper limit for the size of a single read from the socket. QClient
+  //! starts out with small reads, growing them while large responses are
+  //! streaming in, and shrinking them once traffic calms down.
+  //----------------------------------------------------------------------------
+  size_t maxReceiveBufferSize = 1024 * 256;
+
+  //----------------------------------------------------------------------------
+  //! If enabled, each reply tree is built inside a single bump-allocated
+  //! arena, instead of one allocation per node and string. Much cheaper for
+  //! large array replies, such as HSCAN pages - but holding on to any part
+  //! of a reply keeps the entire tree alive.
+  //----------------------------------------------------------------------------
+  bool replyArena = false;
+
+  //----------------------------------------------------------------------------
+  //! Bulk strings of at least this many bytes are read from the socket
+  //! straight into the memory which ends up as redisReply::str, skipping
+  //! intermediate copies. Meant for multi-megabyte GET / HGET values.
+  //! 0 disables.
+  //----------------------------------------------------------------------------
+  size_t zeroCopyReplyThreshold = 0u;
+
+  //----------------------------------------------------------------------------
+  //! If enabled, responses are parsed on a separate thread, fed with raw
+  //! bytes by the socket-reading thread - recv and parse then overlap on
+  //! different cores. Worth it for connections bringing in large array
+  //! replies, where parsing would otherwise stall the socket. Bypasses
+  //! zeroCopyReplyThreshold, and has no effect with an EventLoopGroup.
+  //----------------------------------------------------------------------------
+  bool pipelinedParsing = false;
+
+  //----------------------------------------------------------------------------
+  //! Number of threads running callbacks. With more than one, callbacks are
+  //! spread out by QCallback object: Responses for the same callback object
+  //! are still delivered in order, but a slow callback only holds up those
+  //! callbacks sharing its thread. There's no ordering guarantee across
+  //! different callback objects in that case.
+  //----------------------------------------------------------------------------
+  size_t callbackThreads = 1u;
+
+  //----------------------------------------------------------------------------
+  //! The request, future and callback queues of a connection are made of
+  //! blocks, which start out holding queueInitialBlockSize items, and double
+  //! as traffic picks up, up to queueMaxBlockSize. Small initial blocks keep
+  //! idle QClients down to a few KB; large final blocks keep busy ones from
+  //! allocating too often.
+  //----------------------------------------------------------------------------
+  size_t queueInitialBlockSize = 16u;
+  size_t queueMaxBlockSize = 5000u;
+
+  //----------------------------------------------------------------------------
+  //! Where the blocks of the request and callback queues, and reply trees
+  //! built in replyArena mode, are allocated from - nullptr means the global
+  //! heap. Lets qclient memory live in a dedicated arena. Must be
+  //! thread-safe, such as a std::pmr::synchronized_pool_resource when built
+  //! as C++17, and outlive the QClient: Memory is allocated and freed from
+  //! different threads.
+  //----------------------------------------------------------------------------
+  MemoryResource *memoryResource = nullptr;
+
+  //----------------------------------------------------------------------------
+  //! Limit egress to the rates of the given token bucket - in bytes and in
+  //! requests per second - which may be shared with other clients, and
+  //! adjusted at runtime. Requests wait in the queue for their turn, so
+  //! combine with backpressure to bound memory. Only applies to the
+  //! dedicated writer thread: Ignored with eventLoopGroup, or an external
+  //! event loop.
+  //----------------------------------------------------------------------------
+  std::shared_ptr<RateLimiter> rateLimiter;
+
+  //----------------------------------------------------------------------------
+  //! How many times the writer and callback threads poll an empty queue
+  //! before going to sleep. Spinning shaves the wake-up latency off each
+  //! request, at the cost of burning CPU while idle - only worth it when
+  //! those threads have cores of their own. 0 means sleep right away.
+  //----------------------------------------------------------------------------
+  size_t queueSpinIterations = 0u;
+
   //----------------------------------------------------------------------------
   //! Specifies the logger object to use. If left empty, a simple logger
-  //! writing to stderr will be used, with LogLevel::kInfo.
+  //! writing to stderr will be used, with LogLevel::kInfo. AsyncLogger keeps
+  //! logging off the calling threads, which matters during reconnect storms.
   //----------------------------------------------------------------------------
   std::shared_ptr<Logger> logger;
 
@@ -251,6 +923,209 @@ public:
   //----------------------------------------------------------------------------
   bool exclusivePubsub = true;
 
+  //----------------------------------------------------------------------------
+  //! With exclusivePubsub off: Deliver push messages to the listener from
+  //! a thread of their own, instead of the thread reading responses - a
+  //! slow listener then no longer holds up replies to normal requests.
+  //! Messages are still delivered one at a time, in the order received.
+  //! The thread is only spawned once the first message arrives.
+  //----------------------------------------------------------------------------
+  bool offloadPushMessages = false;
+
+  //----------------------------------------------------------------------------
+  //! Specifies the I/O backend to use - default is poll().
+  //----------------------------------------------------------------------------
+  IoBackend ioBackend = IoBackend::kPoll;
+
+  //----------------------------------------------------------------------------
+  //! Writes of at least this many bytes go out with MSG_ZEROCOPY: The kernel
+  //! sends straight from the request buffers, instead of copying them. The
+  //! requests are kept alive until the kernel reports it is done with them.
+  //! Only applies to plaintext TCP connections with their own writer thread,
+  //! and only pays off for large writes - try 64KB. 0 disables.
+  //----------------------------------------------------------------------------
+  size_t zeroCopyThreshold = 0;
+
+  //----------------------------------------------------------------------------
+  //! Experimental: Towards unix socket endpoints, offer the server a shared
+  //! memory channel with rings of this many bytes right after connecting.
+  //! If the server takes it, requests and responses travel through the rings
+  //! instead of the socket. If not, we simply stay on the socket. Only
+  //! applies to plaintext connections with their own reader and writer
+  //! threads, not to standby connections. 0 disables.
+  //----------------------------------------------------------------------------
+  size_t sharedMemoryRingSize = 0;
+
+  //----------------------------------------------------------------------------
+  //! If set, the connection is managed and responses are read by one of the
+  //! threads of the given group, instead of a thread dedicated to this
+  //! QClient. Useful when a process holds many mostly idle connections.
+  //!
+  //! The group must outlive the QClient.
+  //----------------------------------------------------------------------------
+  std::shared_ptr<EventLoopGroup> eventLoopGroup;
+
+  //----------------------------------------------------------------------------
+  //! If set, the QClient is driven by the application's own event loop
+  //! through the given object, and spawns no event loop, writer or callback
+  //! threads: Reads, writes and reconnections all happen inline, within
+  //! QClient::onReadable, onWritable and onTimer. Callbacks run on the loop
+  //! thread as well, and must not block. Takes precedence over
+  //! eventLoopGroup.
+  //!
+  //! Secondary connections, such as those of readRouting or priorityLanes,
+  //! still run their own threads. The object must outlive the QClient.
+  //----------------------------------------------------------------------------
+  std::shared_ptr<ExternalEventLoop> externalEventLoop;
+
+  //----------------------------------------------------------------------------
+  //! If set, hostnames are resolved through the given cache, instead of
+  //! calling getaddrinfo on each reconnection attempt. Pass
+  //! DnsCache::getDefault() to share resolutions across the process.
+  //----------------------------------------------------------------------------
+  std::shared_ptr<DnsCache> dnsCache;
+
+  //----------------------------------------------------------------------------
+  //! If set, members are tried fastest first, as measured by the given
+  //! prober, whenever no redirection or leader hint points elsewhere -
+  //! including by follower connections of readRouting and hedgedReads.
+  //! Construct one per cluster, and share it between all clients of it.
+  //----------------------------------------------------------------------------
+  std::shared_ptr<LatencyProber> latencyProber;
+
+  //----------------------------------------------------------------------------
+  //! If set, notified as each request starts and finishes, with the time it
+  //! reached each stage - see RequestTracer. When left empty, tracing costs a
+  //! single branch per request.
+  //----------------------------------------------------------------------------
+  std::shared_ptr<RequestTracer> tracer;
+
+  //----------------------------------------------------------------------------
+  //! Stuck pipeline watchdog: If the oldest pending request has gone without
+  //! any progress for longer than stuckRequestThreshold, a warning is logged
+  //! and stuckRequestCallback is called with its age - once per stall. If
+  //! reconnectOnStuckRequests is set, the connection is dropped as well, and
+  //! pending requests are handled as with any other broken connection -
+  //! failing over without waiting for TCP to give up.
+  //!
+  //! A threshold of 0 disables the watchdog. The callback runs on the
+  //! watchdog thread, and must not block.
+  //----------------------------------------------------------------------------
+  std::chrono::milliseconds stuckRequestThreshold = std::chrono::milliseconds(0);
+  std::function<void(std::chrono::milliseconds)> stuckRequestCallback;
+  bool reconnectOnStuckRequests = false;
+
+  //----------------------------------------------------------------------------
+  //! Whether to send read-only requests to followers - see ReadRouting.
+  //! Not for connections in exclusive pub-sub mode.
+  //----------------------------------------------------------------------------
+  ReadRouting readRouting = ReadRouting::LeaderOnly();
+
+  //----------------------------------------------------------------------------
+  //! Whether control and bulk requests get lanes of their own - see
+  //! PriorityLanes. Not for connections in exclusive pub-sub mode.
+  //----------------------------------------------------------------------------
+  PriorityLanes priorityLanes = PriorityLanes::Disabled();
+
+  //----------------------------------------------------------------------------
+  //! Whether to hedge slow reads - see HedgedReads. Not for connections in
+  //! exclusive pub-sub mode.
+  //----------------------------------------------------------------------------
+  HedgedReads hedgedReads = HedgedReads::Disabled();
+
+  //----------------------------------------------------------------------------
+  //! Whether identical read-only requests in flight at the same time share
+  //! a single round-trip: The first goes out, the rest wait for its reply.
+  //! Covers executeRead, and execute / pooledExecute for commands known to
+  //! be read-only - see ReadRouting::isReadOnly. Any other request counts as
+  //! a write, and later reads never join a flight issued before it.
+  //!
+  //! All waiters receive the same reply object - don't modify it.
+  //----------------------------------------------------------------------------
+  bool singleFlightReads = false;
+
+  //----------------------------------------------------------------------------
+  //! Whether a SET key value, or HSET key field value, supersedes an earlier
+  //! one for the same key and field which hasn't been sent yet: Only the
+  //! last value is written, and the callbacks of all superseded requests
+  //! receive its reply.
+  //!
+  //! The superseded writes effectively move to the position of the last one
+  //! - requests issued in between don't observe them. Only turn on when the
+  //! last value is all that matters, such as for periodic status updates.
+  //----------------------------------------------------------------------------
+  bool writeCombining = false;
+
+  //----------------------------------------------------------------------------
+  //! Whether scripts run through QClient::evalScript are loaded again on
+  //! every new connection, as part of the handshake. Without it, the first
+  //! call of each script after a reconnect hits NOSCRIPT, and takes an
+  //! extra round-trip.
+  //----------------------------------------------------------------------------
+  bool scriptPriming = false;
+
+  //----------------------------------------------------------------------------
+  //! Whether to find out what the server supports on every new connection,
+  //! as part of the handshake - see CapabilityHandshake. Features which
+  //! depend on it switch on by themselves where supported:
+  //!
+  //! - Push types are activated for connections with a messageListener
+  //!   outside of exclusive pub-sub mode.
+  //! - QDeque pops several items through a single command.
+  //! - SharedHash doesn't try incremental resilvering against servers which
+  //!   can't do it.
+  //!
+  //! The result is available through QClient::getServerCapabilities, and
+  //! stored per endpoint in capabilityCache - a private one if left empty.
+  //! Costs one or two extra round-trips per connection.
+  //----------------------------------------------------------------------------
+  bool negotiateCapabilities = false;
+  std::shared_ptr<CapabilityCache> capabilityCache;
+
+  //----------------------------------------------------------------------------
+  //! Memory budget shared with other clients in this process, see
+  //! MemoryBudget. Staged requests and unparsed input count against it, on
+  //! top of backpressureStrategy. Clients spawned internally - followers,
+  //! priority lanes - share it as well. Empty by default: no global limit.
+  //----------------------------------------------------------------------------
+  std::shared_ptr<MemoryBudget> memoryBudget;
+
+  //----------------------------------------------------------------------------
+  //! If enabled, constructing a QClient spawns no threads and opens no
+  //! connection: Both are deferred to the first request. Meant for short-
+  //! lived clients, such as in command line tools and tests - combine with
+  //! eventLoopGroup to avoid the event loop thread altogether.
+  //!
+  //! Has no effect on subscribers, which always connect right away.
+  //----------------------------------------------------------------------------
+  bool lazyConnect = false;
+
+  //----------------------------------------------------------------------------
+  //! CPUs to pin the internal threads of this client to - event loop,
+  //! writer, callback executor and timers. Empty leaves them to the
+  //! scheduler.
+  //!
+  //! On multi-socket machines, pick CPUs of the node the threads issuing
+  //! requests run on: Queue blocks and replies are then allocated, filled
+  //! and consumed on that node, as Linux places pages on the node of the
+  //! thread first touching them.
+  //----------------------------------------------------------------------------
+  std::vector<int> cpuAffinity;
+
+  //----------------------------------------------------------------------------
+  //! If non-zero, set SO_BUSY_POLL to this on the connection's socket: The
+  //! kernel busy-polls the device for incoming data instead of waiting for
+  //! an interrupt, trading CPU time for latency. Linux only - failures,
+  //! such as lacking CAP_NET_ADMIN, are logged and otherwise ignored.
+  //----------------------------------------------------------------------------
+  std::chrono::microseconds busyPoll {0};
+
+  //----------------------------------------------------------------------------
+  //! Copy all options - Options is move-only, as it owns the handshake, which
+  //! is cloned.
+  //----------------------------------------------------------------------------
+  qclient::Options clone() const;
+
   //----------------------------------------------------------------------------
   //! Fluent interface: Chain a handshake. Explicit transfer of ownership to
   //! this object.
@@ -286,6 +1161,129 @@ public:
   //! Fluent interface: Setting retry strategy
   //----------------------------------------------------------------------------
   qclient::Options& withRetryStrategy(const RetryStrategy& str);
+
+  //----------------------------------------------------------------------------
+  //! Fluent interface: Setting reconnect strategy
+  //----------------------------------------------------------------------------
+  qclient::Options& withReconnectStrategy(const ReconnectStrategy& str);
+
+  //----------------------------------------------------------------------------
+  //! Fluent interface: Setting replay pacing
+  //----------------------------------------------------------------------------
+  qclient::Options& withReplayPacing(const ReplayPacing& pacing);
+
+  //----------------------------------------------------------------------------
+  //! Fluent interface: Setting I/O backend
+  //----------------------------------------------------------------------------
+  qclient::Options& withIoBackend(IoBackend backend);
+
+  //----------------------------------------------------------------------------
+  //! Fluent interface: Send writes of at least threshold bytes with
+  //! MSG_ZEROCOPY
+  //----------------------------------------------------------------------------
+  qclient::Options& withZeroCopyThreshold(size_t threshold);
+
+  //----------------------------------------------------------------------------
+  //! Fluent interface: Offer a shared memory channel to unix socket servers
+  //----------------------------------------------------------------------------
+  qclient::Options& withSharedMemoryTransport(size_t ringSize = 4 * 1024 * 1024);
+
+  //----------------------------------------------------------------------------
+  //! Fluent interface: Setting event loop group
+  //----------------------------------------------------------------------------
+  qclient::Options& withEventLoopGroup(std::shared_ptr<EventLoopGroup> group);
+
+  //----------------------------------------------------------------------------
+  //! Fluent interface: Drive the client from an external event loop
+  //----------------------------------------------------------------------------
+  qclient::Options& withExternalEventLoop(std::shared_ptr<ExternalEventLoop> loop);
+
+  //----------------------------------------------------------------------------
+  //! Fluent interface: Setting DNS cache
+  //----------------------------------------------------------------------------
+  qclient::Options& withDnsCache(std::shared_ptr<DnsCache> cache);
+
+  //----------------------------------------------------------------------------
+  //! Fluent interface: Setting request tracer
+  //----------------------------------------------------------------------------
+  qclient::Options& withTracer(std::shared_ptr<RequestTracer> tracer);
+
+  //----------------------------------------------------------------------------
+  //! Fluent interface: Setting read routing
+  //----------------------------------------------------------------------------
+  qclient::Options& withReadRouting(const ReadRouting& routing);
+
+  //----------------------------------------------------------------------------
+  //! Fluent interface: Setting priority lanes
+  //----------------------------------------------------------------------------
+  qclient::Options& withPriorityLanes(const PriorityLanes& lanes);
+
+  //----------------------------------------------------------------------------
+  //! Fluent interface: Setting hedged reads
+  //----------------------------------------------------------------------------
+  qclient::Options& withHedgedReads(const HedgedReads& hedging);
+
+  //----------------------------------------------------------------------------
+  //! Fluent interface: Enable single-flight reads
+  //----------------------------------------------------------------------------
+  qclient::Options& withSingleFlightReads();
+
+  //----------------------------------------------------------------------------
+  //! Fluent interface: Enable write combining
+  //----------------------------------------------------------------------------
+  qclient::Options& withWriteCombining();
+
+  //----------------------------------------------------------------------------
+  //! Fluent interface: Enable script priming
+  //----------------------------------------------------------------------------
+  qclient::Options& withScriptPriming();
+
+  //----------------------------------------------------------------------------
+  //! Fluent interface: Negotiate capabilities, optionally through a shared
+  //! cache
+  //----------------------------------------------------------------------------
+  qclient::Options& withCapabilityNegotiation(std::shared_ptr<CapabilityCache> cache = {});
+
+  //----------------------------------------------------------------------------
+  //! Fluent interface: Share the given memory budget
+  //----------------------------------------------------------------------------
+  qclient::Options& withMemoryBudget(std::shared_ptr<MemoryBudget> budget);
+
+  //----------------------------------------------------------------------------
+  //! Fluent interface: Allocate out of the given memory resource
+  //----------------------------------------------------------------------------
+  qclient::Options& withMemoryResource(MemoryResource *resource);
+
+  //----------------------------------------------------------------------------
+  //! Fluent interface: Limit egress through the given rate limiter
+  //----------------------------------------------------------------------------
+  qclient::Options& withRateLimiter(std::shared_ptr<RateLimiter> limiter);
+
+  //----------------------------------------------------------------------------
+  //! Fluent interface: Enable lazy connect
+  //----------------------------------------------------------------------------
+  qclient::Options& withLazyConnect();
+
+  //----------------------------------------------------------------------------
+  //! Fluent interface: Pin internal threads to the given CPUs
+  //----------------------------------------------------------------------------
+  qclient::Options& withCpuAffinity(const std::vector<int> &cpus);
+
+  //----------------------------------------------------------------------------
+  //! Fluent interface: Busy-poll the socket for the given duration
+  //----------------------------------------------------------------------------
+  qclient::Options& withBusyPoll(std::chrono::microseconds duration);
+
+  //----------------------------------------------------------------------------
+  //! Fluent interface: Deliver push messages from a thread of their own
+  //----------------------------------------------------------------------------
+  qclient::Options& withOffloadPushMessages();
+
+  //----------------------------------------------------------------------------
+  //! Fluent interface: Enable stuck pipeline watchdog
+  //----------------------------------------------------------------------------
+  qclient::Options& withStuckRequestWatchdog(std::chrono::milliseconds threshold,
+    bool reconnect, std::function<void(std::chrono::milliseconds)> callback = {});
 };
 
 //------------------------------------------------------------------------------
@@ -319,6 +1317,51 @@ public:
   //----------------------------------------------------------------------------
   bool usePushTypes = false;
 
+  //----------------------------------------------------------------------------
+  //! DNS cache to use, see Options::dnsCache.
+  //----------------------------------------------------------------------------
+  std::shared_ptr<DnsCache> dnsCache;
+
+  //----------------------------------------------------------------------------
+  //! Latency prober to use, see Options::latencyProber.
+  //----------------------------------------------------------------------------
+  std::shared_ptr<LatencyProber> latencyProber;
+
+  //----------------------------------------------------------------------------
+  //! Socket options to use, see Options::socketProfile.
+  //----------------------------------------------------------------------------
+  SocketProfile socketProfile = SocketProfile::Default();
+
+  //----------------------------------------------------------------------------
+  //! Number of connections a Subscriber spreads its channels over, by hash
+  //! of the channel (or pattern) name. Each connection has its own socket
+  //! and reader thread, and resubscribes its own share on reconnect.
+  //----------------------------------------------------------------------------
+  size_t shards = 1;
+
+  //----------------------------------------------------------------------------
+  //! After reconnecting, channels and patterns are subscribed to again in
+  //! pipelined commands of at most this many each - those with a callback
+  //! attached first - so that messages start flowing again progressively,
+  //! instead of after a single, huge command.
+  //----------------------------------------------------------------------------
+  size_t resubscribeChunkSize = 512;
+
+  //----------------------------------------------------------------------------
+  //! Memory budget shared with other clients, see Options::memoryBudget.
+  //! Messages queued inside Subscriptions count against it as well: Once
+  //! it's exhausted, incoming messages are shed.
+  //----------------------------------------------------------------------------
+  std::shared_ptr<MemoryBudget> memoryBudget;
+
+  //----------------------------------------------------------------------------
+  //! Run callbacks attached through Subscription::attachCallback on this
+  //! pool of workers, instead of the thread reading from the connection.
+  //! Messages of the same channel (or pattern) are still delivered in order,
+  //! while a slow callback no longer holds up every other channel.
+  //----------------------------------------------------------------------------
+  std::shared_ptr<SubscriptionDispatcher> dispatcher;
+
 };
 
 }
@@ -36,6 +36,42 @@ public:
   // It is NOT safe to issue further requests to the driving QClient if reply
   // is nullptr, as it could be in the process of shutting down!
   virtual void handleResponse(redisReplyPtr &&reply) = 0;
+
+  // Return true to have handleResponse called directly on the event loop
+  // thread, the moment a reply arrives - skipping the hop through the
+  // callback executor. Only meant for trivial callbacks, such as counter
+  // increments or fulfilling a promise: An inline callback must never block,
+  // or issue blocking requests to the same QClient, as it stalls all other
+  // responses on the connection.
+  virtual bool runInline() const {
+    return false;
+  }
+};
+
+//------------------------------------------------------------------------------
+// Optional, per-request sink, receiving the payload of a bulk string reply
+// incrementally, as it arrives from the socket - so that retrieving a large
+// value doesn't need to buffer all of it. The callback or future of the
+// request still receives the reply afterwards, but as an empty string.
+//
+// Other types of replies, such as errors or nil, are delivered as usual,
+// without involving the sink.
+//
+// Both functions are called from the connection's event loop thread, and
+// block it: Keep them quick. The sink must stay alive until the reply has
+// been delivered.
+//------------------------------------------------------------------------------
+class BulkSink {
+public:
+  BulkSink() {}
+  virtual ~BulkSink() {}
+
+  // Called once the total length is known, before any chunk. Can be called
+  // again if the request is retried after a reconnection: The payload then
+  // starts over.
+  virtual void onStart(size_t totalLen) {}
+
+  virtual void onChunk(const char *data, size_t len) = 0;
 };
 
 }
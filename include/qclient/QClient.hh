@@ -37,17 +37,27 @@
 #include "qclient/Members.hh"
 #include "qclient/Utils.hh"
 #include "qclient/QCallback.hh"
+#include "qclient/ReplyDecoder.hh"
+#include "qclient/LatencyHistogram.hh"
+#include "qclient/ClientStatistics.hh"
+#include "qclient/ReplyFuture.hh"
+#include "qclient/ReplyCallback.hh"
+#include "qclient/CancellationHandle.hh"
 #include "qclient/Options.hh"
 #include "qclient/Handshake.hh"
+#include "qclient/ScriptRegistry.hh"
 #include "qclient/EncodedRequest.hh"
 #include "qclient/ResponseBuilder.hh"
 #include "qclient/AssistedThread.hh"
+#include "qclient/EventLoopGroup.hh"
+#include "qclient/ExternalEventLoop.hh"
 #include "qclient/FaultInjector.hh"
 #include "qclient/ReconnectionListener.hh"
 #include "qclient/Status.hh"
 
 #if HAVE_FOLLY == 1
 #include <folly/futures/Future.h>
+#include <folly/Executor.h>
 #endif
 
 //------------------------------------------------------------------------------
@@ -69,6 +79,13 @@ namespace qclient
   class ConnectionCore;
   class EndpointDecider;
   class HostResolver;
+  class AsyncConnector;
+  class ReceiveBufferSizer;
+  class ReconnectBackoff;
+  class ParseStage;
+  class StandbyConnection;
+  class SingleFlight;
+  class MultiBuilder;
 
 //------------------------------------------------------------------------------
 //! Describe a redisReplyPtr, in a format similar to what redis-cli would give.
@@ -80,7 +97,7 @@ std::string describeRedisReply(const std::string &str); // receives redis-encode
 //------------------------------------------------------------------------------
 //! Class QClient
 //------------------------------------------------------------------------------
-class QClient
+class QClient : private EventLoopGroup::Handler
 {
 public:
   //----------------------------------------------------------------------------
@@ -112,10 +129,170 @@ public:
   //----------------------------------------------------------------------------
   std::future<redisReplyPtr> execute(EncodedRequest &&req);
   void execute(QCallback *callback, EncodedRequest &&req);
+
+  //----------------------------------------------------------------------------
+  //! Fire-and-forget: Same as above, but nobody is interested in the reply.
+  //! Status and integer replies are dropped without being built, and no
+  //! callback is dispatched at all; error replies are only counted, see
+  //! ClientStatistics::fireAndForgetErrors. Calling execute with a null
+  //! QCallback does the same.
+  //----------------------------------------------------------------------------
+  void executeFireAndForget(EncodedRequest &&req);
+
+  //----------------------------------------------------------------------------
+  //! Same as above, but takes any callable accepting a redisReplyPtr&&, such
+  //! as a lambda. Small callables are stored inside the request itself, with
+  //! no heap allocation - see ReplyCallback. Runs on the callback executor;
+  //! callables run in the order their replies arrived.
+  //----------------------------------------------------------------------------
+  void execute(EncodedRequest &&req, ReplyCallback &&callback);
+
+  //----------------------------------------------------------------------------
+  //! Same as above, except that if the reply is a bulk string, its payload is
+  //! streamed into the given sink as it arrives, instead of being buffered.
+  //! The future / callback then receives an empty string, once all of it has
+  //! gone through the sink. See BulkSink.
+  //----------------------------------------------------------------------------
+  std::future<redisReplyPtr> execute(EncodedRequest &&req, BulkSink *sink);
+  void execute(QCallback *callback, EncodedRequest &&req, BulkSink *sink);
+
+  //----------------------------------------------------------------------------
+  //! Same as above, except that if the reply is an aggregate, its elements
+  //! are fed into the given decoder as they're parsed, instead of being
+  //! assembled into a redisReply tree. The future / callback then receives
+  //! an empty aggregate, once decoding is done. See ReplyDecoder.
+  //----------------------------------------------------------------------------
+  std::future<redisReplyPtr> execute(EncodedRequest &&req, ReplyDecoder *decoder);
+  void execute(QCallback *callback, EncodedRequest &&req, ReplyDecoder *decoder);
 #if HAVE_FOLLY == 1
   folly::Future<redisReplyPtr> follyExecute(EncodedRequest &&req);
+
+  //----------------------------------------------------------------------------
+  //! Folly flavours which skip the callback executor: The promise is
+  //! fulfilled straight from the event loop thread, and continuations run
+  //! on the given executor - or, for the SemiFuture, on whichever executor
+  //! the caller attaches through via(). One thread hop and queue less per
+  //! response, compared to plain follyExecute.
+  //----------------------------------------------------------------------------
+  folly::Future<redisReplyPtr> follyExecute(EncodedRequest &&req, folly::Executor *executor);
+  folly::SemiFuture<redisReplyPtr> follySemiExecute(EncodedRequest &&req);
 #endif
 
+  //----------------------------------------------------------------------------
+  //! Same as execute, but returns a pooled ReplyFuture instead of a
+  //! std::future - cheaper for callers which block on the reply right away.
+  //----------------------------------------------------------------------------
+  ReplyFuture pooledExecute(EncodedRequest &&req);
+
+  //----------------------------------------------------------------------------
+  //! Run a Lua script, sending only its SHA1 through EVALSHA. Should the
+  //! server not know the script, it's loaded through SCRIPT LOAD and the
+  //! EVALSHA retried once, transparently - the reply is that of the retry.
+  //!
+  //! A retried script runs after requests issued in the meantime. See also
+  //! Options::scriptPriming.
+  //----------------------------------------------------------------------------
+  std::future<redisReplyPtr> evalScript(const std::string &script,
+    const std::vector<std::string> &keys, const std::vector<std::string> &args = {});
+  void evalScript(const std::string &script, const std::vector<std::string> &keys,
+    const std::vector<std::string> &args, ReplyCallback &&callback);
+
+  //----------------------------------------------------------------------------
+  //! Same as execute, but marks the request as read-only: With read routing
+  //! enabled, it may be served by a follower - see ReadRouting. With hedged
+  //! reads enabled, it's issued a second time if slow - see HedgedReads.
+  //! Otherwise, identical to execute.
+  //----------------------------------------------------------------------------
+  std::future<redisReplyPtr> executeRead(EncodedRequest &&req);
+  void executeRead(QCallback *callback, EncodedRequest &&req);
+  void executeRead(EncodedRequest &&req, ReplyCallback &&callback);
+
+  //----------------------------------------------------------------------------
+  //! Same as execute, but with the given priority: With priority lanes
+  //! enabled, control and bulk requests travel over a dedicated connection
+  //! each - see PriorityLanes. Otherwise, and for Priority::kNormal,
+  //! identical to execute.
+  //----------------------------------------------------------------------------
+  std::future<redisReplyPtr> executeWithPriority(Priority priority, EncodedRequest &&req);
+  void executeWithPriority(Priority priority, QCallback *callback, EncodedRequest &&req);
+  void executeWithPriority(Priority priority, EncodedRequest &&req, ReplyCallback &&callback);
+
+  //----------------------------------------------------------------------------
+  //! Same as execute, but the request is useless past the given deadline:
+  //! Once it passes, the request completes right away with the error reply
+  //! "ERR deadline exceeded". It is not sent at all if it hasn't been
+  //! written yet, and a late response is discarded.
+  //!
+  //! A request which expires this way may still have been executed by the
+  //! server. Expiry callbacks run on a dedicated thread, and must not block.
+  //----------------------------------------------------------------------------
+  std::future<redisReplyPtr> executeWithDeadline(EncodedRequest &&req,
+    std::chrono::steady_clock::time_point deadline);
+  void executeWithDeadline(EncodedRequest &&req,
+    std::chrono::steady_clock::time_point deadline, ReplyCallback &&callback);
+
+  //----------------------------------------------------------------------------
+  //! Same as execute, but the caller may give up on the request at any
+  //! point through the returned handle - see CancellationHandle. Useful for
+  //! request-scoped work abandoned on a timeout of the caller's own.
+  //----------------------------------------------------------------------------
+  CancellationHandle executeCancellable(EncodedRequest &&req, ReplyCallback &&callback);
+  std::future<redisReplyPtr> executeCancellable(EncodedRequest &&req,
+    CancellationHandle &handle);
+
+  //----------------------------------------------------------------------------
+  //! Non-blocking execute, for callers which must never block: If the
+  //! backpressure limit has been reached, returns false immediately, and the
+  //! request is not issued - req is left untouched, and can be retried later.
+  //----------------------------------------------------------------------------
+  bool tryExecute(QCallback *callback, EncodedRequest &&req);
+
+  //----------------------------------------------------------------------------
+  //! Register a one-shot notification, fired once the backlog of pending
+  //! requests drains below the low-water mark of the backpressure strategy.
+  //! Fires immediately if that's already the case.
+  //!
+  //! Meant to be used together with tryExecute, to pause and resume producers
+  //! without blocking a thread. The callback runs on an internal QClient
+  //! thread: It must not block, but may call tryExecute.
+  //----------------------------------------------------------------------------
+  void notifyWhenCapacityAvailable(std::function<void()> callback);
+
+  //----------------------------------------------------------------------------
+  //! Number of requests issued, but not yet acknowledged by the server.
+  //----------------------------------------------------------------------------
+  int64_t getPendingRequests() const;
+
+  //----------------------------------------------------------------------------
+  //! How long the oldest pending request has been waiting without the
+  //! server making any progress - 0 if nothing is pending. See
+  //! Options::stuckRequestThreshold.
+  //----------------------------------------------------------------------------
+  std::chrono::milliseconds getOldestPendingAge() const;
+
+  //----------------------------------------------------------------------------
+  //! Latency distribution of the requests issued so far, split into queueing,
+  //! network plus server, and callback delay. Always on; recording costs a
+  //! few clock reads and relaxed atomic increments per request.
+  //----------------------------------------------------------------------------
+  LatencyStats getLatencyStats() const;
+  void resetLatencyStats();
+
+  //----------------------------------------------------------------------------
+  //! Request, byte and connection counters, for capacity planning and
+  //! spotting saturation. Counters are sharded per CPU, so maintaining them
+  //! costs no contention - reading them is slightly more expensive.
+  //----------------------------------------------------------------------------
+  ClientStatistics getStatistics() const;
+
+  //----------------------------------------------------------------------------
+  //! What the server of the current connection supports - nothing is known
+  //! unless Options::negotiateCapabilities is set. After reconnecting, the
+  //! result of an earlier negotiation with the same endpoint is served until
+  //! the handshake completes.
+  //----------------------------------------------------------------------------
+  ServerCapabilities getServerCapabilities() const;
+
   //----------------------------------------------------------------------------
   //! Execute multiple commands in a MULTI / EXEC transaction. Retries will
   //! work as expected: If the connection dies in the middle, the whole block
@@ -135,6 +312,67 @@ public:
   folly::Future<redisReplyPtr> follyExecute(std::deque<EncodedRequest> &&req);
 #endif
 
+  //----------------------------------------------------------------------------
+  //! Same as above, but for a transaction built through MultiBuilder - which
+  //! is already encoded into a single buffer, MULTI / EXEC included, and is
+  //! sent without further copies. Leaves the builder empty.
+  //----------------------------------------------------------------------------
+  std::future<redisReplyPtr> execute(MultiBuilder &&multi);
+  void execute(QCallback *callback, MultiBuilder &&multi);
+#if HAVE_FOLLY == 1
+  folly::Future<redisReplyPtr> follyExecute(MultiBuilder &&multi);
+#endif
+
+  //----------------------------------------------------------------------------
+  //! Submission buffer, local to the thread using it: Requests are collected
+  //! without touching any shared state, and handed to the QClient all at
+  //! once on commit - or on destruction, whichever comes first. The queue
+  //! lock is taken, and the writer woken up, once per commit instead of
+  //! once per request, which pays off when many threads issue requests
+  //! concurrently.
+  //!
+  //! Committed requests sit next to each other in the pipeline, with nothing
+  //! from other threads in between - but unlike a MULTI block, they are not
+  //! executed atomically by the server. Nothing is sent before commit. A
+  //! batch larger than the backpressure limits admit at once is staged in
+  //! chunks, which requests of other threads may end up between.
+  //!
+  //! Replies are delivered as with execute. A Batch must not be shared
+  //! between threads, or outlive its QClient.
+  //----------------------------------------------------------------------------
+  class Batch {
+  public:
+    Batch(QClient &client);
+    ~Batch();
+
+    Batch(const Batch&) = delete;
+    Batch& operator=(const Batch&) = delete;
+
+    std::future<redisReplyPtr> execute(EncodedRequest &&req);
+    void execute(QCallback *callback, EncodedRequest &&req);
+    void execute(EncodedRequest &&req, ReplyCallback &&callback);
+
+    template<typename... Args>
+    std::future<redisReplyPtr> exec(const Args&... args) {
+      return execute(EncodedRequest::make(args...));
+    }
+
+    //--------------------------------------------------------------------------
+    //! Hand everything collected so far over to the QClient. The Batch may be
+    //! reused afterwards.
+    //--------------------------------------------------------------------------
+    void commit();
+
+    size_t size() const {
+      return requests.size();
+    }
+
+  private:
+    QClient &client;
+    std::vector<EncodedRequest> requests;
+    std::vector<ReplyCallback> callbacks;
+  };
+
   //----------------------------------------------------------------------------
   //! Conveninence function to encode a redis command given as a container of
   //! strings to a redis buffer
@@ -191,6 +429,39 @@ public:
   }
 #endif
 
+  //----------------------------------------------------------------------------
+  // The same as the above, but returns a pooled ReplyFuture.
+  //----------------------------------------------------------------------------
+  template<typename... Args>
+  ReplyFuture pooledExec(const Args&... args) {
+    return this->pooledExecute(EncodedRequest::make(args...));
+  }
+
+  //----------------------------------------------------------------------------
+  // The same as the above, but read-only - see executeRead.
+  //----------------------------------------------------------------------------
+  template<typename... Args>
+  std::future<redisReplyPtr> execRead(const Args&... args) {
+    return this->executeRead(EncodedRequest::make(args...));
+  }
+
+  //----------------------------------------------------------------------------
+  // The same as the above, with the given priority - see executeWithPriority.
+  //----------------------------------------------------------------------------
+  template<typename... Args>
+  std::future<redisReplyPtr> execWithPriority(Priority priority, const Args&... args) {
+    return this->executeWithPriority(priority, EncodedRequest::make(args...));
+  }
+
+  //----------------------------------------------------------------------------
+  // The same as the above, with the given timeout - see executeWithDeadline.
+  //----------------------------------------------------------------------------
+  template<typename Duration, typename... Args>
+  std::future<redisReplyPtr> execWithTimeout(Duration timeout, const Args&... args) {
+    return this->executeWithDeadline(EncodedRequest::make(args...),
+      std::chrono::steady_clock::now() + timeout);
+  }
+
   //----------------------------------------------------------------------------
   //! Return fault injector object for this QClient
   //----------------------------------------------------------------------------
@@ -216,6 +487,35 @@ public:
   long long int
   del(const std::string& key);
 
+  //----------------------------------------------------------------------------
+  //! Bulk versions of exists / del, for large sets of keys: The keys are
+  //! sent as multi-key EXISTS / DEL / UNLINK requests of up to chunkSize
+  //! keys each, with at most window of them in flight at a time.
+  //!
+  //! @return number of keys found / removed. Throws on an unexpected reply,
+  //! just like the single-key versions.
+  //----------------------------------------------------------------------------
+  long long int
+  existsMany(const std::vector<std::string>& keys, size_t chunkSize = 256,
+    size_t window = 16);
+
+  long long int
+  delMany(const std::vector<std::string>& keys, size_t chunkSize = 256,
+    size_t window = 16);
+
+  long long int
+  unlinkMany(const std::vector<std::string>& keys, size_t chunkSize = 256,
+    size_t window = 16);
+
+  //----------------------------------------------------------------------------
+  //! Per-key version of existsMany: Pipelines single-key EXISTS requests,
+  //! with at most window of them in flight at a time.
+  //!
+  //! @return whether each of the keys exists, in order
+  //----------------------------------------------------------------------------
+  std::vector<bool>
+  existsEach(const std::vector<std::string>& keys, size_t window = 256);
+
   //----------------------------------------------------------------------------
   //! Attach reconnection listener. The underlying object must remain alive
   //! as long as the reconnection listener is attached!
@@ -237,10 +537,31 @@ public:
   //----------------------------------------------------------------------------
   Status checkConnection(std::chrono::milliseconds timeout);
 
+  //----------------------------------------------------------------------------
+  //! Block until a connection is established, and has gone through the
+  //! handshake - without sending anything itself. Meant for warming up the
+  //! connection during startup, so that the first user request doesn't pay
+  //! for DNS, connect, TLS and handshake. Starts connecting if lazy.
+  //----------------------------------------------------------------------------
+  Status waitUntilReady(std::chrono::milliseconds timeout);
+
+  //----------------------------------------------------------------------------
+  //! Entry points for Options::externalEventLoop, to be called from the
+  //! loop thread only: The watched file descriptor became readable or
+  //! writable, or the scheduled deadline passed, or wakeup() was requested.
+  //! Spurious calls are harmless. No-ops for clients not driven externally.
+  //----------------------------------------------------------------------------
+  void onReadable();
+  void onWritable();
+  void onTimer();
+
 private:
   // The cluster members, as given in the constructor.
   Members members;
 
+  // The endpoint the current connection went to, unresolved.
+  Endpoint connectedEndpoint;
+
   std::unique_ptr<EndpointDecider> endpointDecider;
 
   // the endpoint we're actually connecting to
@@ -252,6 +573,26 @@ private:
   std::unique_ptr<NetworkStream> networkStream;
 
   void startEventLoop();
+  void startConnecting();
+
+  //----------------------------------------------------------------------------
+  // Lazy connect: lazyPending is set until the first request arrives, which
+  // spawns the threads and starts connecting. Everything staging requests
+  // obtains the ConnectionCore through core().
+  //----------------------------------------------------------------------------
+  std::atomic<bool> lazyPending {false};
+  std::once_flag lazyOnce;
+
+  ConnectionCore* core() {
+    if(lazyPending.load(std::memory_order_acquire)) {
+      std::call_once(lazyOnce, [this]() {
+        startConnecting();
+        lazyPending.store(false, std::memory_order_release);
+      });
+    }
+
+    return connectionCore.get();
+  }
   void eventLoop(ThreadAssistant &assistant);
   void connect();
   bool handleConnectionEpoch(ThreadAssistant &assistant);
@@ -261,16 +602,164 @@ private:
 
   void cleanup(bool shutdown);
   bool feed(const char* buf, size_t len);
+  bool processResponses();
+  void accountUnparsedInput();
+  size_t unparsedInputCharged = 0u;
+  RecvStatus recvIntoParser();
+  RecvStatus recvIntoParseStage(ParseStage &stage);
+  std::unique_ptr<ReceiveBufferSizer> receiveSizer;
+  std::unique_ptr<ReconnectBackoff> reconnectBackoff;
   void connectTCP();
+  int connectSingle();
+  int connectParallel();
+  bool takeStandby();
+  void applyBusyPoll();
+  void loadCachedCapabilities();
+  void capabilitiesNegotiated(const ServerCapabilities &caps);
+  std::unique_ptr<StandbyConnection> standby;
   void notifyConnectionLost(int errc, const std::string &err);
   void notifyConnectionEstablished();
 
+  //----------------------------------------------------------------------------
+  // Capability negotiation: The handshake actually used on connections -
+  // options.handshake followed by a CapabilityHandshake - and its outcome.
+  //----------------------------------------------------------------------------
+  std::unique_ptr<Handshake> negotiatingHandshake;
+  std::shared_ptr<CapabilityCache> capabilityCache;
+  mutable std::mutex capabilitiesMtx;
+  ServerCapabilities serverCapabilities;
+
   std::unique_ptr<ConnectionCore> connectionCore;
   EventFD shutdownEventFD;
+
+  // Wakes up the dedicated event loop thread, which otherwise only wakes
+  // up on socket activity - used by the watchdog.
+  EventFD wakeupEventFD;
   std::unique_ptr<WriterThread> writerThread;
 
   void processRedirection();
   AssistedThread eventLoopThread;
+
+  //----------------------------------------------------------------------------
+  // Stuck pipeline watchdog, only running if enabled in the options. Asks
+  // the event loop to drop the connection through reconnectRequested.
+  //----------------------------------------------------------------------------
+  void watchdog(ThreadAssistant &assistant);
+  std::atomic<bool> reconnectRequested {false};
+  AssistedThread watchdogThread;
+
+  //----------------------------------------------------------------------------
+  // Set by the fault injector, so that the event loop re-checks partitions
+  // and link shaping for the live connection.
+  //----------------------------------------------------------------------------
+  std::atomic<bool> faultInjectionsUpdated {false};
+
+  //----------------------------------------------------------------------------
+  // Read routing: readClient is the connection towards followers, only set
+  // if enabled. lastWriteAt is in nanoseconds of steady_clock.
+  //----------------------------------------------------------------------------
+  std::unique_ptr<QClient> readClient;
+  std::atomic<int64_t> lastWriteAt {0};
+
+  void startReadClient();
+  std::unique_ptr<QClient> makeFollowerClient(size_t offset);
+  size_t followerStart = 0;
+  ConnectionCore* routeRequest(const EncodedRequest &req);
+  ConnectionCore* routeRead();
+  void noteWrite();
+
+  ConnectionCore* coreFor(const EncodedRequest &req) {
+    if(!readClient && !singleFlight) return core();
+    return routeRequest(req);
+  }
+
+  //----------------------------------------------------------------------------
+  // Priority lanes: controlClient and bulkClient are the dedicated
+  // connections, only set if enabled.
+  //----------------------------------------------------------------------------
+  std::unique_ptr<QClient> controlClient;
+  std::unique_ptr<QClient> bulkClient;
+
+  void startLaneClients();
+  ConnectionCore* coreFor(Priority priority, const EncodedRequest &req);
+
+  //----------------------------------------------------------------------------
+  // Hedged reads: hedgeClient is the connection the second attempts go to,
+  // only set if enabled. hedgeDelay is refreshed from the network latency
+  // histogram every so often, both are in nanoseconds of steady_clock.
+  //----------------------------------------------------------------------------
+  std::unique_ptr<QClient> hedgeClient;
+  std::atomic<int64_t> hedgeDelay {0};
+  std::atomic<int64_t> hedgeDelayUpdatedAt {0};
+
+  std::chrono::nanoseconds getHedgeDelay();
+  void executeHedged(EncodedRequest &&req, ReplyCallback &&callback);
+
+  //----------------------------------------------------------------------------
+  // Single-flight reads: Table of the reads in flight, only set if enabled.
+  //----------------------------------------------------------------------------
+  std::shared_ptr<SingleFlight> singleFlight;
+
+  //----------------------------------------------------------------------------
+  // Scripts run through evalScript, shared with the ScriptLoadHandshake if
+  // script priming is enabled.
+  //----------------------------------------------------------------------------
+  std::shared_ptr<ScriptRegistry> scriptRegistry;
+
+  //----------------------------------------------------------------------------
+  // Shared by existsMany / delMany / unlinkMany: Sum up the integer replies
+  // of a multi-key command over all keys, chunk by chunk.
+  //----------------------------------------------------------------------------
+  long long int bulkCount(const char *cmd, const std::vector<std::string>& keys,
+    size_t chunkSize, size_t window);
+
+  bool coalesces(const EncodedRequest &req) const;
+  void executeCoalesced(EncodedRequest &&req, ReplyCallback &&callback, bool explicitRead);
+  void issueRead(EncodedRequest &&req, ReplyCallback &&callback);
+
+  //----------------------------------------------------------------------------
+  // When attached to an EventLoopGroup, there's no eventLoopThread: The same
+  // connect -> read responses -> backoff cycle is driven as a state machine
+  // by one of the group threads, through onEvent.
+  //
+  // An ExternalEventLoop drives the very same state machine, through the
+  // public entry points - and also writes inline, instead of through the
+  // writer thread.
+  //----------------------------------------------------------------------------
+  enum class GroupState {
+    kIdle,
+    kConnecting,
+    kConnected,
+    kBackoff
+  };
+
+  EventLoopGroup *eventLoopGroup = nullptr;
+  ExternalEventLoop *externalLoop = nullptr;
+  std::atomic<bool> externalWakeupPending {false};
+  int externalFd = -1;
+  uint32_t externalEvents = 0u;
+  GroupState groupState = GroupState::kIdle;
+  std::unique_ptr<AsyncConnector> pendingConnector;
+  std::string pendingEndpoint;
+  std::chrono::steady_clock::time_point groupDeadline;
+  bool groupReceivedBytes = false;
+
+  void onEvent() override;
+  void groupConnect();
+  void groupContinueConnecting();
+  void groupRead();
+  void groupEpochFinished(bool receivedBytes);
+  void groupWrite();
+  void drive();
+  void requestWakeup();
+
+  bool loopDriven() const {
+    return eventLoopGroup || externalLoop;
+  }
+
+  void loopWatch(int fd, uint32_t events);
+  void loopScheduleAt(std::chrono::steady_clock::time_point deadline);
+  void loopCancelSchedule();
   FaultInjector faultInjector;
 
   friend class FaultInjector;
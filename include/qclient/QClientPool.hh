@@ -0,0 +1,170 @@
+//------------------------------------------------------------------------------
+// File: QClientPool.hh
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#ifndef QCLIENT_QCLIENT_POOL_HH
+#define QCLIENT_QCLIENT_POOL_HH
+
+#include "qclient/QClient.hh"
+#include <atomic>
+#include <memory>
+#include <vector>
+
+namespace qclient {
+
+//------------------------------------------------------------------------------
+//! How QClientPool picks a connection for each request.
+//!
+//! kRoundRobin: Cycle through all connections.
+//! kLeastPending: Pick the connection with the fewest un-acknowledged
+//! requests - adapts to connections which are slower than others.
+//------------------------------------------------------------------------------
+enum class PoolStrategy {
+  kRoundRobin,
+  kLeastPending
+};
+
+//------------------------------------------------------------------------------
+//! A pool of QClient objects, all towards the same Members. Independent
+//! requests are spread across the connections, so a single process is not
+//! limited by the throughput of a single connection.
+//!
+//! There are no ordering guarantees between two requests issued through the
+//! pool: They may land on different connections. Requests which must be
+//! ordered should go through a single MULTI block, which always runs on a
+//! single connection, or through get(i).
+//!
+//! Not meant for pub-sub - use Subscriber for that.
+//------------------------------------------------------------------------------
+class QClientPool {
+public:
+  //----------------------------------------------------------------------------
+  //! Constructor taking simple host and port. Every connection receives a
+  //! copy of the given options, with its own clone of the handshake.
+  //----------------------------------------------------------------------------
+  QClientPool(const std::string &host, int port, Options &&options,
+    size_t connections, PoolStrategy strategy = PoolStrategy::kLeastPending);
+
+  //----------------------------------------------------------------------------
+  //! Constructor taking a list of members for the cluster
+  //----------------------------------------------------------------------------
+  QClientPool(const Members &members, Options &&options,
+    size_t connections, PoolStrategy strategy = PoolStrategy::kLeastPending);
+
+  //----------------------------------------------------------------------------
+  //! Disallow copy and assign
+  //----------------------------------------------------------------------------
+  QClientPool(const QClientPool&) = delete;
+  void operator=(const QClientPool&) = delete;
+
+  //----------------------------------------------------------------------------
+  //! Number of connections in the pool
+  //----------------------------------------------------------------------------
+  size_t size() const;
+
+  //----------------------------------------------------------------------------
+  //! Access a specific connection
+  //----------------------------------------------------------------------------
+  QClient& get(size_t index);
+
+  //----------------------------------------------------------------------------
+  //! Pick a connection according to the strategy
+  //----------------------------------------------------------------------------
+  QClient& pick();
+
+  //----------------------------------------------------------------------------
+  //! Requests issued through any connection, but not yet acknowledged.
+  //----------------------------------------------------------------------------
+  int64_t getPendingRequests() const;
+
+  //----------------------------------------------------------------------------
+  //! Same API as QClient - see there.
+  //----------------------------------------------------------------------------
+  std::future<redisReplyPtr> execute(EncodedRequest &&req);
+  void execute(QCallback *callback, EncodedRequest &&req);
+  std::future<redisReplyPtr> execute(EncodedRequest &&req, BulkSink *sink);
+  void execute(QCallback *callback, EncodedRequest &&req, BulkSink *sink);
+  std::future<redisReplyPtr> execute(EncodedRequest &&req, ReplyDecoder *decoder);
+  void execute(QCallback *callback, EncodedRequest &&req, ReplyDecoder *decoder);
+  void execute(EncodedRequest &&req, ReplyCallback &&callback);
+  bool tryExecute(QCallback *callback, EncodedRequest &&req);
+#if HAVE_FOLLY == 1
+  folly::Future<redisReplyPtr> follyExecute(EncodedRequest &&req);
+  folly::Future<redisReplyPtr> follyExecute(EncodedRequest &&req, folly::Executor *executor);
+  folly::SemiFuture<redisReplyPtr> follySemiExecute(EncodedRequest &&req);
+#endif
+
+  //----------------------------------------------------------------------------
+  //! MULTI blocks: The entire block goes through a single connection.
+  //----------------------------------------------------------------------------
+  std::future<redisReplyPtr> execute(std::deque<EncodedRequest> &&reqs);
+  void execute(QCallback *callback, std::deque<EncodedRequest> &&reqs);
+#if HAVE_FOLLY == 1
+  folly::Future<redisReplyPtr> follyExecute(std::deque<EncodedRequest> &&reqs);
+#endif
+
+  template<typename T>
+  std::future<redisReplyPtr> execute(const T& container) {
+    return execute(EncodedRequest(container));
+  }
+
+  template<typename T>
+  void execute(QCallback *callback, const T& container) {
+    return execute(callback, EncodedRequest(container));
+  }
+
+#if HAVE_FOLLY == 1
+  template<typename T>
+  folly::Future<redisReplyPtr> follyExecute(const T& container) {
+    return follyExecute(EncodedRequest(container));
+  }
+#endif
+
+  template<typename... Args>
+  std::future<redisReplyPtr> exec(const Args&... args) {
+    return this->execute(EncodedRequest::make(args...));
+  }
+
+  template<typename... Args>
+  void execCB(QCallback *callback, const Args... args) {
+    return this->execute(callback, std::vector<std::string> {args...});
+  }
+
+#if HAVE_FOLLY == 1
+  template<typename... Args>
+  folly::Future<redisReplyPtr> follyExec(const Args... args) {
+    return this->follyExecute(std::vector<std::string> {args...});
+  }
+#endif
+
+private:
+  void initialize(const Members &members, Options &&options, size_t connections);
+
+  PoolStrategy strategy;
+  std::atomic<size_t> nextIndex {0};
+  std::vector<std::unique_ptr<QClient>> clients;
+};
+
+}
+
+#endif
@@ -0,0 +1,135 @@
+// ----------------------------------------------------------------------
+// File: RateLimiter.hh
+// Author: Georgios Bitzes - CERN
+// ----------------------------------------------------------------------
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2016 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+
+#ifndef QCLIENT_RATE_LIMITER_HH
+#define QCLIENT_RATE_LIMITER_HH
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+namespace qclient {
+
+//------------------------------------------------------------------------------
+//! Token bucket limiting egress, both in bytes and in requests per second,
+//! attached through Options::rateLimiter. Several QClients may share one, to
+//! be limited together.
+//!
+//! Enforced by the writer thread, in between writes: Producers are never
+//! blocked by it, requests simply wait in the queue for their turn - subject
+//! to the usual backpressure. Unused capacity accumulates up to burst worth
+//! of traffic, which may go out at once after an idle period.
+//!
+//! A single request larger than the burst allowance is never refused: It is
+//! written, and pays off its excess by holding back the ones after it.
+//!
+//! Rates can be changed at any point, taking effect within a few
+//! milliseconds, without reconnecting. A rate of 0 means unlimited.
+//------------------------------------------------------------------------------
+class RateLimiter {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  //----------------------------------------------------------------------------
+  //! Constructor
+  //----------------------------------------------------------------------------
+  RateLimiter(uint64_t bytesPerSecond, uint64_t requestsPerSecond,
+    std::chrono::milliseconds burst = std::chrono::milliseconds(100));
+
+  //----------------------------------------------------------------------------
+  //! Change the rates. Accumulated tokens beyond the new burst allowance are
+  //! dropped, any debt is kept.
+  //----------------------------------------------------------------------------
+  void setRates(uint64_t bytesPerSecond, uint64_t requestsPerSecond);
+
+  uint64_t getBytesPerSecond() const;
+  uint64_t getRequestsPerSecond() const;
+
+  //----------------------------------------------------------------------------
+  //! How much may go out right now. Both zero while in debt - wait for
+  //! getDelay. SIZE_MAX for an unlimited dimension.
+  //----------------------------------------------------------------------------
+  struct Allowance {
+    size_t requests;
+    size_t bytes;
+  };
+
+  Allowance getAllowance(Clock::time_point now = Clock::now());
+
+  //----------------------------------------------------------------------------
+  //! Take the given requests and bytes out of the bucket, going into debt if
+  //! they exceed what's available.
+  //----------------------------------------------------------------------------
+  void consume(size_t requests, size_t bytes, Clock::time_point now = Clock::now());
+
+  //----------------------------------------------------------------------------
+  //! How long until anything may go out again - zero if right away.
+  //----------------------------------------------------------------------------
+  std::chrono::nanoseconds getDelay(Clock::time_point now = Clock::now());
+
+  //----------------------------------------------------------------------------
+  //! Lifetime totals: time writers spent held back, bytes and requests let
+  //! through.
+  //----------------------------------------------------------------------------
+  std::chrono::nanoseconds getThrottledTime() const;
+  uint64_t getBytesConsumed() const;
+  uint64_t getRequestsConsumed() const;
+
+  //----------------------------------------------------------------------------
+  //! Account for time a writer spent waiting on getDelay.
+  //----------------------------------------------------------------------------
+  void recordThrottled(std::chrono::nanoseconds duration);
+
+private:
+  //----------------------------------------------------------------------------
+  //! A single bucket - rate 0 means unlimited.
+  //----------------------------------------------------------------------------
+  struct Bucket {
+    uint64_t rate = 0;
+    double capacity = 0;
+    double tokens = 0;
+
+    void configure(uint64_t newRate, std::chrono::milliseconds burst);
+    void refill(double seconds);
+    size_t available() const;
+    double secondsUntilPositive() const;
+  };
+
+  void refill(Clock::time_point now);
+
+  mutable std::mutex mtx;
+  const std::chrono::milliseconds burst;
+  Clock::time_point lastRefill;
+  Bucket bytes;
+  Bucket requests;
+
+  uint64_t bytesConsumed = 0;
+  uint64_t requestsConsumed = 0;
+  std::chrono::nanoseconds throttled {0};
+};
+
+}
+
+#endif
@@ -28,10 +28,18 @@
 /* This is the reply object returned by redisCommand() */
 typedef struct redisReply {
     int type; /* REDIS_REPLY_* */
-    long long integer; /* The integer when type is REDIS_REPLY_INTEGER */
+    long long integer; /* The integer when type is REDIS_REPLY_INTEGER, or
+                          1 / 0 when type is REDIS_REPLY_BOOL */
+    double dval; /* The double when type is REDIS_REPLY_DOUBLE */
     size_t len; /* Length of string */
-    char *str; /* Used for both REDIS_REPLY_ERROR and REDIS_REPLY_STRING */
-    size_t elements; /* number of elements, for REDIS_REPLY_ARRAY */
+    char *str; /* Used for REDIS_REPLY_ERROR, REDIS_REPLY_STRING, and the
+                  textual representation of REDIS_REPLY_DOUBLE,
+                  REDIS_REPLY_BIGNUM and REDIS_REPLY_VERB */
+    char vtype[4]; /* For REDIS_REPLY_VERB: The null-terminated, three
+                      character content type, such as "txt" */
+    size_t elements; /* number of elements, for REDIS_REPLY_ARRAY - for
+                        REDIS_REPLY_MAP, keys and values are interleaved,
+                        so this is twice the number of entries */
     struct redisReply **element; /* elements vector for REDIS_REPLY_ARRAY */
 } redisReply;
 
@@ -43,6 +51,15 @@ typedef struct redisReply {
 #define REDIS_REPLY_ERROR 6
 #define REDIS_REPLY_PUSH 7
 
+/* RESP3 types */
+#define REDIS_REPLY_DOUBLE 8
+#define REDIS_REPLY_BOOL 9
+#define REDIS_REPLY_MAP 10
+#define REDIS_REPLY_SET 11
+#define REDIS_REPLY_ATTR 12
+#define REDIS_REPLY_BIGNUM 13
+#define REDIS_REPLY_VERB 14
+
 namespace qclient {
 
 using Reply = redisReply;
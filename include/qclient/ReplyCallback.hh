@@ -0,0 +1,182 @@
+//------------------------------------------------------------------------------
+// File: ReplyCallback.hh
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#ifndef QCLIENT_REPLY_CALLBACK_HH
+#define QCLIENT_REPLY_CALLBACK_HH
+
+#include "qclient/Reply.hh"
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace qclient {
+
+//------------------------------------------------------------------------------
+//! Move-only holder for any callable taking a redisReplyPtr&&, such as a
+//! lambda. Callables up to kInlineSize bytes - which covers lambdas
+//! capturing a handful of pointers - are stored inside the object itself,
+//! so that passing a lambda per request costs no heap allocation. Larger
+//! ones fall back to the heap.
+//------------------------------------------------------------------------------
+class ReplyCallback {
+public:
+  static constexpr size_t kInlineSize = 48;
+
+  ReplyCallback() {}
+
+  template<typename F, typename = typename std::enable_if<
+    !std::is_same<typename std::decay<F>::type, ReplyCallback>::value &&
+    std::is_constructible<typename std::decay<F>::type, F&&>::value &&
+    std::is_void<decltype(std::declval<typename std::decay<F>::type&>()(std::declval<redisReplyPtr&&>()))>::value>::type>
+  ReplyCallback(F &&f) {
+    using Fn = typename std::decay<F>::type;
+    construct<Fn>(std::forward<F>(f), std::integral_constant<bool, fitsInline<Fn>()>());
+  }
+
+  ReplyCallback(ReplyCallback &&other) noexcept {
+    moveFrom(other);
+  }
+
+  ReplyCallback& operator=(ReplyCallback &&other) noexcept {
+    if(this != &other) {
+      reset();
+      moveFrom(other);
+    }
+
+    return *this;
+  }
+
+  ReplyCallback(const ReplyCallback&) = delete;
+  ReplyCallback& operator=(const ReplyCallback&) = delete;
+
+  ~ReplyCallback() {
+    reset();
+  }
+
+  explicit operator bool() const {
+    return ops != nullptr;
+  }
+
+  //----------------------------------------------------------------------------
+  //! Was the callable stored without a heap allocation?
+  //----------------------------------------------------------------------------
+  bool isInline() const {
+    return ops && ops->isInline;
+  }
+
+  void operator()(redisReplyPtr &&reply) {
+    ops->invoke(&storage, std::move(reply));
+  }
+
+  void reset() {
+    if(ops) {
+      ops->destroy(&storage);
+      ops = nullptr;
+    }
+  }
+
+private:
+  struct Ops {
+    void (*invoke)(void *storage, redisReplyPtr &&reply);
+    void (*move)(void *dst, void *src);
+    void (*destroy)(void *storage);
+    bool isInline;
+  };
+
+  template<typename Fn>
+  static constexpr bool fitsInline() {
+    return sizeof(Fn) <= kInlineSize &&
+      alignof(Fn) <= alignof(std::max_align_t) &&
+      std::is_nothrow_move_constructible<Fn>::value;
+  }
+
+  template<typename Fn>
+  struct InlineOps {
+    static void invoke(void *storage, redisReplyPtr &&reply) {
+      (*static_cast<Fn*>(storage))(std::move(reply));
+    }
+
+    static void move(void *dst, void *src) {
+      new (dst) Fn(std::move(*static_cast<Fn*>(src)));
+      static_cast<Fn*>(src)->~Fn();
+    }
+
+    static void destroy(void *storage) {
+      static_cast<Fn*>(storage)->~Fn();
+    }
+
+    static constexpr Ops table = { invoke, move, destroy, true };
+  };
+
+  template<typename Fn>
+  struct HeapOps {
+    static void invoke(void *storage, redisReplyPtr &&reply) {
+      (**static_cast<Fn**>(storage))(std::move(reply));
+    }
+
+    static void move(void *dst, void *src) {
+      new (dst) Fn*(*static_cast<Fn**>(src));
+    }
+
+    static void destroy(void *storage) {
+      delete *static_cast<Fn**>(storage);
+    }
+
+    static constexpr Ops table = { invoke, move, destroy, false };
+  };
+
+  template<typename Fn, typename F>
+  void construct(F &&f, std::true_type) {
+    new (&storage) Fn(std::forward<F>(f));
+    ops = &InlineOps<Fn>::table;
+  }
+
+  template<typename Fn, typename F>
+  void construct(F &&f, std::false_type) {
+    new (&storage) Fn*(new Fn(std::forward<F>(f)));
+    ops = &HeapOps<Fn>::table;
+  }
+
+  void moveFrom(ReplyCallback &other) {
+    if(other.ops) {
+      other.ops->move(&storage, &other.storage);
+      ops = other.ops;
+      other.ops = nullptr;
+    }
+  }
+
+  typename std::aligned_storage<kInlineSize, alignof(std::max_align_t)>::type storage;
+  const Ops *ops = nullptr;
+};
+
+template<typename Fn>
+constexpr ReplyCallback::Ops ReplyCallback::InlineOps<Fn>::table;
+
+template<typename Fn>
+constexpr ReplyCallback::Ops ReplyCallback::HeapOps<Fn>::table;
+
+}
+
+#endif
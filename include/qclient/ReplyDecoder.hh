@@ -0,0 +1,307 @@
+//------------------------------------------------------------------------------
+// File: ReplyDecoder.hh
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#ifndef QCLIENT_REPLY_DECODER_HH
+#define QCLIENT_REPLY_DECODER_HH
+
+#include "qclient/Reply.hh"
+#include <stddef.h>
+#include <functional>
+#include <string>
+#include <vector>
+
+struct redisReplyObjectFunctions;
+
+namespace qclient {
+
+//------------------------------------------------------------------------------
+// Optional, per-request decoder: The elements of an aggregate reply (array,
+// map, set, push) are passed to it as events, straight out of the parser,
+// instead of being assembled into a redisReply tree first - so that they can
+// be moved into the caller's containers directly.
+//
+// The top-level aggregate starts with onAggregate at depth 0, its elements
+// follow in order, at depth 1, and so on. Maps interleave keys and values,
+// same as in a redisReply. Attributes are skipped.
+//
+// The callback or future of the request still receives the top-level reply
+// once it's complete, but an aggregate then shows up empty. Replies which
+// are not aggregates, such as errors, are delivered as usual, without
+// involving the decoder.
+//
+// All events are called from the connection's event loop thread. The decoder
+// must stay alive until the reply has been delivered. If the request is
+// retried after a reconnection, the events start over with depth 0.
+//------------------------------------------------------------------------------
+class ReplyDecoder {
+public:
+  ReplyDecoder() {}
+  virtual ~ReplyDecoder() {}
+
+  // REDIS_REPLY_ARRAY, REDIS_REPLY_MAP (elements counts keys and values),
+  // REDIS_REPLY_SET or REDIS_REPLY_PUSH.
+  virtual void onAggregate(int type, size_t elements, size_t depth) = 0;
+
+  // REDIS_REPLY_STRING, REDIS_REPLY_STATUS, REDIS_REPLY_ERROR,
+  // REDIS_REPLY_BIGNUM, or REDIS_REPLY_VERB without its content type.
+  virtual void onString(int type, const char *str, size_t len, size_t depth) = 0;
+
+  virtual void onInteger(long long value, size_t depth) = 0;
+  virtual void onDouble(double value, size_t depth) { invalidEvent(depth); }
+  virtual void onBool(bool value, size_t depth) { invalidEvent(depth); }
+  virtual void onNil(size_t depth) { invalidEvent(depth); }
+
+  // Called by the default implementations of the less common events.
+  virtual void invalidEvent(size_t depth) {}
+
+  //----------------------------------------------------------------------------
+  // The reader functions which feed a decoder, passed as privdata.
+  //----------------------------------------------------------------------------
+  static redisReplyObjectFunctions* getReaderFunctions();
+};
+
+//------------------------------------------------------------------------------
+// Decoder for a flat aggregate of strings, such as the reply of SMEMBERS or
+// HGETALL: Each string is inserted at the end of the given container, which
+// is cleared as the reply starts. Anything else makes ok() return false.
+//------------------------------------------------------------------------------
+template<typename Container>
+class StringCollector : public ReplyDecoder {
+public:
+  StringCollector(Container &c) : container(c) {}
+
+  void onAggregate(int type, size_t elements, size_t depth) override {
+    if(depth != 0) {
+      valid = false;
+      return;
+    }
+
+    valid = true;
+    container.clear();
+    reserve(container, elements);
+  }
+
+  void onString(int type, const char *str, size_t len, size_t depth) override {
+    if(depth != 1 || type != REDIS_REPLY_STRING) {
+      valid = false;
+      return;
+    }
+
+    container.insert(container.end(), std::string(str, len));
+  }
+
+  void onInteger(long long value, size_t depth) override {
+    valid = false;
+  }
+
+  void invalidEvent(size_t depth) override {
+    valid = false;
+  }
+
+  bool ok() const {
+    return valid;
+  }
+
+private:
+  template<typename T>
+  static auto reserve(T &c, size_t elements) -> decltype(c.reserve(elements), void()) {
+    c.reserve(elements);
+  }
+
+  static void reserve(...) {}
+
+  Container &container;
+  bool valid = false;
+};
+
+//------------------------------------------------------------------------------
+// Decoder for a flat aggregate of strings, handing each one over to a
+// callback, by move, as soon as it's parsed. The callback runs on the event
+// loop thread - if the request is retried after a reconnection, the strings
+// are passed again from the start. Anything else makes ok() return false.
+//------------------------------------------------------------------------------
+class StringStreamer : public ReplyDecoder {
+public:
+  using Callback = std::function<void(std::string&& str)>;
+
+  StringStreamer(const Callback &c) : callback(c) {}
+
+  void onAggregate(int type, size_t elements, size_t depth) override {
+    valid = (depth == 0);
+  }
+
+  void onString(int type, const char *str, size_t len, size_t depth) override {
+    if(depth != 1 || type != REDIS_REPLY_STRING) {
+      valid = false;
+      return;
+    }
+
+    callback(std::string(str, len));
+  }
+
+  void onInteger(long long value, size_t depth) override {
+    valid = false;
+  }
+
+  void invalidEvent(size_t depth) override {
+    valid = false;
+  }
+
+  bool ok() const {
+    return valid;
+  }
+
+private:
+  const Callback &callback;
+  bool valid = false;
+};
+
+//------------------------------------------------------------------------------
+// Decoder for a flat aggregate of alternating keys and values, such as the
+// reply of HGETALL: Each pair is moved into the given map, which is cleared
+// as the reply starts. Anything else makes ok() return false.
+//------------------------------------------------------------------------------
+template<typename Map>
+class PairCollector : public ReplyDecoder {
+public:
+  PairCollector(Map &m) : map(m) {}
+
+  void onAggregate(int type, size_t elements, size_t depth) override {
+    if(depth != 0 || elements % 2 != 0) {
+      valid = false;
+      return;
+    }
+
+    valid = true;
+    haveKey = false;
+    map.clear();
+    reserve(map, elements / 2);
+  }
+
+  void onString(int type, const char *str, size_t len, size_t depth) override {
+    if(depth != 1 || type != REDIS_REPLY_STRING) {
+      valid = false;
+      return;
+    }
+
+    if(!haveKey) {
+      key.assign(str, len);
+      haveKey = true;
+      return;
+    }
+
+    map.emplace(std::move(key), std::string(str, len));
+    key.clear();
+    haveKey = false;
+  }
+
+  void onInteger(long long value, size_t depth) override {
+    valid = false;
+  }
+
+  void invalidEvent(size_t depth) override {
+    valid = false;
+  }
+
+  bool ok() const {
+    return valid && !haveKey;
+  }
+
+private:
+  template<typename T>
+  static auto reserve(T &m, size_t elements) -> decltype(m.reserve(elements), void()) {
+    m.reserve(elements);
+  }
+
+  static void reserve(...) {}
+
+  Map &map;
+  std::string key;
+  bool haveKey = false;
+  bool valid = false;
+};
+
+//------------------------------------------------------------------------------
+// Decoder for one page of a SCAN-family reply - SCAN, HSCAN, SSCAN: The
+// cursor, followed by an aggregate of strings, which are appended to the
+// given container. Anything else makes ok() return false.
+//------------------------------------------------------------------------------
+template<typename Container>
+class ScanPageCollector : public ReplyDecoder {
+public:
+  ScanPageCollector(std::string &cur, Container &c) : cursor(cur), container(c) {}
+
+  void onAggregate(int type, size_t elements, size_t depth) override {
+    if(depth == 0) {
+      valid = (elements == 2);
+      seen = 0;
+      container.clear();
+      return;
+    }
+
+    if(depth != 1 || seen != 1) {
+      valid = false;
+      return;
+    }
+
+    seen++;
+  }
+
+  void onString(int type, const char *str, size_t len, size_t depth) override {
+    if(depth == 1 && seen == 0) {
+      cursor.assign(str, len);
+      seen++;
+      return;
+    }
+
+    if(depth != 2 || seen != 2 || type != REDIS_REPLY_STRING) {
+      valid = false;
+      return;
+    }
+
+    container.insert(container.end(), std::string(str, len));
+  }
+
+  void onInteger(long long value, size_t depth) override {
+    valid = false;
+  }
+
+  void invalidEvent(size_t depth) override {
+    valid = false;
+  }
+
+  bool ok() const {
+    return valid && seen == 2;
+  }
+
+private:
+  std::string &cursor;
+  Container &container;
+  size_t seen = 0;
+  bool valid = false;
+};
+
+}
+
+#endif
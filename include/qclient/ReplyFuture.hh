@@ -0,0 +1,97 @@
+//------------------------------------------------------------------------------
+// File: ReplyFuture.hh
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#ifndef QCLIENT_REPLY_FUTURE_HH
+#define QCLIENT_REPLY_FUTURE_HH
+
+#include "qclient/Reply.hh"
+#include <chrono>
+#include <future>
+
+namespace qclient {
+
+class QCallback;
+class ReplySlot;
+
+//------------------------------------------------------------------------------
+//! Lightweight alternative to std::future<redisReplyPtr>, for synchronous-
+//! style callers which issue one request and immediately wait on it.
+//!
+//! The shared state comes out of a process-wide pool of slab-allocated slots,
+//! which are recycled once both the future and the request are done with
+//! them - so in steady state, a request costs no allocations for its future.
+//! Waiting blocks on a futex, and the reply is handed over straight from the
+//! event loop thread, without going through the callback executor.
+//!
+//! Movable, not copyable. get() may only be called once.
+//------------------------------------------------------------------------------
+class ReplyFuture {
+public:
+  //----------------------------------------------------------------------------
+  //! Empty future, not associated with any request.
+  //----------------------------------------------------------------------------
+  ReplyFuture() {}
+
+  //----------------------------------------------------------------------------
+  //! Get a fresh future out of the pool.
+  //----------------------------------------------------------------------------
+  static ReplyFuture create();
+
+  ~ReplyFuture();
+  ReplyFuture(ReplyFuture &&other);
+  ReplyFuture& operator=(ReplyFuture &&other);
+  ReplyFuture(const ReplyFuture&) = delete;
+  ReplyFuture& operator=(const ReplyFuture&) = delete;
+
+  //----------------------------------------------------------------------------
+  //! The callback fulfilling this future. Must be called at most once, and
+  //! the callback must then receive exactly one reply.
+  //----------------------------------------------------------------------------
+  QCallback* getCallback();
+
+  //----------------------------------------------------------------------------
+  //! Is this future associated with a request, whose reply has not been
+  //! retrieved yet?
+  //----------------------------------------------------------------------------
+  bool valid() const {
+    return slot != nullptr;
+  }
+
+  bool ready() const;
+  void wait() const;
+  std::future_status wait_for(std::chrono::milliseconds timeout) const;
+
+  //----------------------------------------------------------------------------
+  //! Wait for the reply, and retrieve it. Leaves the future invalid.
+  //----------------------------------------------------------------------------
+  redisReplyPtr get();
+
+private:
+  ReplyFuture(ReplySlot *s) : slot(s) {}
+  ReplySlot *slot = nullptr;
+};
+
+}
+
+#endif
@@ -0,0 +1,85 @@
+//------------------------------------------------------------------------------
+// File: RequestTracer.hh
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2016 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#ifndef QCLIENT_REQUEST_TRACER_HH
+#define QCLIENT_REQUEST_TRACER_HH
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+namespace qclient {
+
+//------------------------------------------------------------------------------
+//! Lifecycle of a single request: staged by the caller, written into the
+//! socket, acknowledged by the server, handed to its callback. Stages not
+//! reached are left as a default-constructed time_point - a request may be
+//! purged before ever being written, for example.
+//------------------------------------------------------------------------------
+struct RequestTrace {
+  //! Unique per QClient, starting from 1
+  uint64_t id = 0;
+
+  //! First argument of the request, such as "HSET"
+  std::string command;
+
+  //! Size of the RESP-encoded request, and the total length of all strings
+  //! in the reply
+  size_t requestBytes = 0;
+  size_t replyBytes = 0;
+
+  //! False if the request was given up on, and its callback handed a null
+  //! reply. errorReply is set when the server replied with an error.
+  bool hasReply = false;
+  bool errorReply = false;
+
+  std::chrono::steady_clock::time_point stagedAt;
+  std::chrono::steady_clock::time_point writtenAt;
+  std::chrono::steady_clock::time_point acknowledgedAt;
+  std::chrono::steady_clock::time_point callbackAt;
+  std::chrono::steady_clock::time_point finishedAt;
+};
+
+//------------------------------------------------------------------------------
+//! Hooks into the lifecycle of every request, see Options::tracer - meant for
+//! emitting tracing spans, or attributing tail latency.
+//!
+//! requestStarted runs on the thread staging the request, with only id,
+//! command, requestBytes and stagedAt filled in. requestFinished runs once
+//! the callback or future has been handed the reply and returned, on the
+//! event loop or callback executor thread - both must be thread-safe and
+//! quick, as they hold up the request pipeline. A request may finish before
+//! requestStarted has returned on another thread.
+//------------------------------------------------------------------------------
+class RequestTracer {
+public:
+  virtual ~RequestTracer() {}
+
+  virtual void requestStarted(const RequestTrace &trace) {}
+  virtual void requestFinished(const RequestTrace &trace) {}
+};
+
+}
+
+#endif
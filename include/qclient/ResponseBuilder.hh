@@ -25,12 +25,21 @@
 #define QCLIENT_RESPONSE_BUILDER_HH
 
 #include "qclient/Reply.hh"
+#include <functional>
+#include <memory>
+#include "qclient/utils/MemoryResource.hh"
 #include <vector>
 
 struct redisReader;
+struct redisReplyObjectFunctions;
 
 namespace qclient {
 
+class ReplyArena;
+class ReplyHolder;
+class BulkSink;
+class ReplyDecoder;
+
 class ResponseBuilder {
 public:
   enum class Status {
@@ -44,9 +53,74 @@ public:
   void feed(const char* buff, size_t len);
   void feed(const std::string &str);
 
+  //----------------------------------------------------------------------------
+  // Zero-copy alternative to feed: Get room for up to len bytes directly
+  // inside the parser's buffer, write into it, then commit however many bytes
+  // were actually written. len may be reduced, if the parser wants fewer
+  // bytes at this point. Returns nullptr on allocation failure.
+  //----------------------------------------------------------------------------
+  char* getWriteBuffer(size_t &len);
+  void commitWrite(size_t len);
+
   Status pull(redisReplyPtr &reply);
   void restart();
 
+  //----------------------------------------------------------------------------
+  // Bytes received but not consumed yet, including a large bulk string in
+  // progress.
+  //----------------------------------------------------------------------------
+  size_t getBufferedBytes() const;
+
+  //----------------------------------------------------------------------------
+  // Validate and drop the next reply straight out of the buffer, without
+  // building it, if it's exactly the given status reply. kOk if it was
+  // skipped, kIncomplete if more data is needed to tell, kProtocolError if
+  // the next reply is something else - pull it as usual, then.
+  //----------------------------------------------------------------------------
+  Status skipStatus(const char *status, size_t len);
+
+  //----------------------------------------------------------------------------
+  // Same, but drop any single-line reply other than an error - a status or
+  // an integer, typically. kProtocolError if the next reply is anything
+  // else, errors included.
+  //----------------------------------------------------------------------------
+  Status skipSimple();
+
+  //----------------------------------------------------------------------------
+  // Arena mode: Each reply tree, strings included, is built inside a single
+  // bump-allocated arena, released in one shot once the last reference to
+  // the reply goes away. Takes effect on the next reply - call before
+  // feeding any data.
+  //----------------------------------------------------------------------------
+  void setArenaMode(bool enabled);
+
+  //----------------------------------------------------------------------------
+  // Arena mode: Allocate arenas, and their chunks, out of the given memory
+  // resource instead of the global heap. It must outlive every reply built.
+  //----------------------------------------------------------------------------
+  void setMemoryResource(MemoryResource *resource);
+
+  //----------------------------------------------------------------------------
+  // Bulk strings of at least this many bytes are received into a dedicated
+  // buffer, which becomes the reply string without any further copy. With
+  // getWriteBuffer, the socket is read straight into it. 0 disables.
+  //----------------------------------------------------------------------------
+  void setLargeStringThreshold(size_t threshold);
+
+  //----------------------------------------------------------------------------
+  // Streaming: As a top-level bulk string reply starts, ask the given lookup
+  // whether there's a sink for it. If so, the payload is handed to the sink
+  // as it gets fed, and the reply pulled in the end is an empty string.
+  //----------------------------------------------------------------------------
+  void setBulkSinkLookup(std::function<BulkSink*()> lookup);
+
+  //----------------------------------------------------------------------------
+  // Decoding: As each reply starts, ask the given lookup whether there's a
+  // decoder for it. If so, the elements of an aggregate go to the decoder,
+  // and the reply pulled in the end is empty. See ReplyDecoder.
+  //----------------------------------------------------------------------------
+  void setReplyDecoderLookup(std::function<ReplyDecoder*()> lookup);
+
   // Convenience functions for use in tests. Very inefficient!
   static redisReplyPtr makeInt(int val);
   static redisReplyPtr makeErr(const std::string &msg);
@@ -69,7 +143,25 @@ private:
     void operator()(redisReader *reader);
   };
 
+  // Declared before reader: A reply in progress may still point into it,
+  // while the reader gets destroyed.
+  std::shared_ptr<ReplyHolder> currentHolder;
+
   std::unique_ptr<redisReader, Deleter> reader;
+
+  bool arenaMode = false;
+  MemoryResource *memoryResource = nullptr;
+  size_t largeStringThreshold = 0u;
+  std::shared_ptr<ReplyArena> currentArena;
+
+  std::function<ReplyDecoder*()> replyDecoderLookup;
+  ReplyDecoder *activeDecoder = nullptr;
+  redisReplyObjectFunctions *replyFunctions = nullptr;
+
+  std::function<BulkSink*()> bulkSinkLookup;
+  BulkSink *activeSink = nullptr;
+  static int streamBegin(void *privdata, size_t len);
+  static void streamChunk(void *privdata, const char *data, size_t len);
 };
 
 }
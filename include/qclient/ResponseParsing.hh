@@ -25,11 +25,19 @@
 #define QCLIENT_RESPONSE_PARSER_HH
 
 #include "qclient/Reply.hh"
+#include "qclient/utils/StringView.hh"
 #include <string>
+#include <vector>
 #include <map>
 
 namespace qclient {
 
+//------------------------------------------------------------------------------
+// When constructed from a redisReplyPtr, StatusParser and StringParser keep
+// the reply alive and view() points straight into it - nothing is copied
+// until value() is called. The raw pointer constructors cannot assume the
+// reply outlives the parser, and copy the payload once.
+//------------------------------------------------------------------------------
 class StatusParser {
 public:
 
@@ -38,11 +46,14 @@ public:
 
   bool ok() const;
   std::string err() const;
-  std::string value() const;
+  std::string value() const &;
+  std::string value() &&;
+  StringView view() const;
 
 private:
   bool isOk;
   std::string error;
+  redisReplyPtr holder;
   std::string val;
 };
 
@@ -70,31 +81,71 @@ public:
 
   bool ok() const;
   std::string err() const;
-  std::string value() const;
+  std::string value() const &;
+  std::string value() &&;
+  StringView view() const;
 
 private:
   bool isOk;
   std::string error;
+  redisReplyPtr holder;
   std::string val;
 };
 
 //------------------------------------------------------------------------------
-// Parse HGETALL reply, fills out a map
+// Parse HGETALL reply. Validation walks the reply once, collecting views of
+// every field and value into a flat vector sorted by field.
+//
+// When constructed from a redisReplyPtr, the reply is kept alive and the
+// std::map is only built if value() is asked for - view() alone never copies
+// a string. The raw pointer constructor copies into the map right away, and
+// view() then points into the map's nodes.
+//
+// Views stay valid across moves of the parser, which is why copying is not
+// allowed.
 //------------------------------------------------------------------------------
 class HgetallParser {
 public:
+  using FlatView = std::vector<std::pair<StringView, StringView>>;
 
   HgetallParser(const redisReply *reply);
   HgetallParser(const redisReplyPtr reply);
 
+  HgetallParser(const HgetallParser&) = delete;
+  HgetallParser& operator=(const HgetallParser&) = delete;
+  HgetallParser(HgetallParser&&) = default;
+  HgetallParser& operator=(HgetallParser&&) = default;
+
   bool ok() const;
   std::string err() const;
-  std::map<std::string, std::string> value() const;
+
+  //----------------------------------------------------------------------------
+  // Built on first call, then cached. Calling on an rvalue builds the map
+  // straight into the returned object, or moves out the cached one.
+  //----------------------------------------------------------------------------
+  const std::map<std::string, std::string>& value() const &;
+  std::map<std::string, std::string> value() &&;
+
+  //----------------------------------------------------------------------------
+  // Field / value pairs, sorted by field
+  //----------------------------------------------------------------------------
+  const FlatView& view() const;
+
+  //----------------------------------------------------------------------------
+  // Binary search on view(), returns false if the field does not exist
+  //----------------------------------------------------------------------------
+  bool find(StringView field, StringView &out) const;
 
 private:
+  bool parse(const redisReply *reply);
+  std::map<std::string, std::string> buildMap() const;
+
   bool isOk;
   std::string error;
-  std::map<std::string, std::string> val;
+  redisReplyPtr holder;
+  FlatView flat;
+  mutable bool materialized = false;
+  mutable std::map<std::string, std::string> val;
 };
 
 
@@ -29,6 +29,7 @@
 #include <rocksdb/db.h>
 #include <rocksdb/filter_policy.h>
 #include <rocksdb/table.h>
+#include <chrono>
 
 #include "qclient/BackgroundFlusher.hh"
 
@@ -89,23 +90,94 @@ inline void deserializeVector(std::vector<std::string> &vec, const std::string &
   }
 }
 
+//------------------------------------------------------------------------------
+// Legacy key encoding, with a trailing newline - still used by queues
+// created with it, until they drain.
+//------------------------------------------------------------------------------
 inline std::string getKey(ItemIndex index) {
-  std::stringstream ss;
-  ss << "I" << intToBinaryString(index) << std::endl;
-  return ss.str();
+  char buff[1 + sizeof(int64_t) + 1];
+  buff[0] = 'I';
+  intToBinaryString(index, buff + 1);
+  buff[sizeof(buff) - 1] = '\n';
+  return std::string(buff, sizeof(buff));
+}
+
+//------------------------------------------------------------------------------
+// Prefix-free key encoding: 'I' followed by the big-endian index.
+//------------------------------------------------------------------------------
+inline std::string getCompactKey(ItemIndex index) {
+  char buff[1 + sizeof(int64_t)];
+  buff[0] = 'I';
+  intToBinaryString(index, buff + 1);
+  return std::string(buff, sizeof(buff));
 }
 
+//------------------------------------------------------------------------------
+// RocksDBPersistency tuning.
+//------------------------------------------------------------------------------
+struct RocksDBPersistencyOptions {
+  enum class Durability {
+    // Writes go to the WAL without fsync - they survive a crash of the
+    // process, not of the machine.
+    kNoSync,
+    // As above, plus the WAL is fsync'ed every syncInterval by a background
+    // thread - a machine crash loses at most that window.
+    kPeriodicSync,
+    // Every write batch is fsync'ed before returning. Pair with
+    // BackgroundFlusher::enableGroupCommit, to amortize the cost.
+    kSyncEveryBatch
+  };
+
+  Durability durability = Durability::kNoSync;
+  std::chrono::milliseconds syncInterval {1000};
+
+  // Level compaction by default. FIFO compaction is opt-in, and LOSES DATA:
+  // once the table files exceed fifoMaxTableFilesSize, the oldest ones are
+  // deleted whole, whatever they hold - unacknowledged items of a backlog
+  // grown past the limit, or a START-INDEX not rewritten for a while, in
+  // which case the queue fails to open. Only enable it if the backlog is
+  // bounded well below fifoMaxTableFilesSize, and losing it is acceptable.
+  bool fifoCompaction = false;
+  uint64_t fifoMaxTableFilesSize = 16ull * 1024 * 1024 * 1024;
+
+  // Memtable and WAL settings - 0 / empty keeps the RocksDB default.
+  size_t writeBufferSize = 64 * 1024 * 1024;
+  int maxWriteBufferNumber = 4;
+  uint64_t maxTotalWalSize = 0;
+  std::string walDir;
+
+  size_t blockSize = 16 * 1024;
+  bool bloomFilter = false;
+};
+
 class RocksDBPersistency : public BackgroundFlusherPersistency {
 public:
-  RocksDBPersistency(const std::string &path) : dbpath(path) {
+  RocksDBPersistency(const std::string &path,
+    const RocksDBPersistencyOptions &opts = RocksDBPersistencyOptions())
+  : dbpath(path), persistencyOptions(opts) {
+
     rocksdb::Options options;
     rocksdb::BlockBasedTableOptions table_options;
-    table_options.filter_policy.reset(rocksdb::NewBloomFilterPolicy(10, false));
-    table_options.block_size = 16 * 1024;
+    if(opts.bloomFilter) {
+      table_options.filter_policy.reset(rocksdb::NewBloomFilterPolicy(10, false));
+    }
+    table_options.block_size = opts.blockSize;
 
     options.table_factory.reset(rocksdb::NewBlockBasedTableFactory(table_options));
     options.create_if_missing = true;
 
+    if(opts.fifoCompaction) {
+      options.compaction_style = rocksdb::kCompactionStyleFIFO;
+      options.compaction_options_fifo.max_table_files_size = opts.fifoMaxTableFilesSize;
+    }
+
+    if(opts.writeBufferSize != 0) options.write_buffer_size = opts.writeBufferSize;
+    if(opts.maxWriteBufferNumber != 0) options.max_write_buffer_number = opts.maxWriteBufferNumber;
+    if(opts.maxTotalWalSize != 0) options.max_total_wal_size = opts.maxTotalWalSize;
+    if(!opts.walDir.empty()) options.wal_dir = opts.walDir;
+
+    writeOptions.sync = (opts.durability == RocksDBPersistencyOptions::Durability::kSyncEveryBatch);
+
     rocksdb::DB *ptr = nullptr;
     rocksdb::Status status = rocksdb::DB::Open(options, path, &ptr);
     db.reset(ptr);
@@ -117,6 +189,15 @@ public:
 
     startIndex = retrieveCounter("START-INDEX");
     endIndex = retrieveCounter("END-INDEX");
+    initKeyFormat();
+
+    if(opts.durability == RocksDBPersistencyOptions::Durability::kPeriodicSync) {
+      syncThread.reset(&RocksDBPersistency::syncWal, this);
+    }
+  }
+
+  virtual ~RocksDBPersistency() {
+    syncThread.join();
   }
 
   virtual void record(ItemIndex index, const std::vector<std::string> &cmd) override {
@@ -125,17 +206,31 @@ public:
       exit(EXIT_FAILURE);
     }
 
-    std::string serialization = serializeVector(cmd);
-    std::string key = getKey(index);
-
     rocksdb::WriteBatch batch;
-    batch.Put(key, serialization);
+    batch.Put(key(index), serializeVector(cmd));
     batch.Put("END-INDEX", intToBinaryString(index+1));
     commitBatch(batch);
 
     endIndex = index + 1;
   }
 
+  virtual void recordBatch(ItemIndex index, const std::vector<std::vector<std::string>> &cmds) override {
+    if(index != endIndex) {
+      std::cerr << "Queue corruption, received unexpected index: " << index << " (current endIndex: " << endIndex << ")" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+
+    rocksdb::WriteBatch batch;
+    for(size_t i = 0; i < cmds.size(); i++) {
+      batch.Put(key(index + i), serializeVector(cmds[i]));
+    }
+
+    batch.Put("END-INDEX", intToBinaryString(index + cmds.size()));
+    commitBatch(batch);
+
+    endIndex = index + cmds.size();
+  }
+
   virtual ItemIndex getStartingIndex() override {
     return startIndex;
   }
@@ -146,14 +241,14 @@ public:
 
   virtual bool retrieve(ItemIndex index, std::vector<std::string> &ret) override {
     std::string buffer;
-    rocksdb::Status status = db->Get(rocksdb::ReadOptions(), getKey(index), &buffer);
+    rocksdb::Status status = db->Get(rocksdb::ReadOptions(), key(index), &buffer);
 
     if(status.IsNotFound()) {
       return false;
     }
 
     if(!status.ok()) {
-      std::cerr << "Queue corruption, error when retrieving key " << getKey(index) << ": " << status.ToString() << std::endl;
+      std::cerr << "Queue corruption, error when retrieving key " << key(index) << ": " << status.ToString() << std::endl;
       exit(EXIT_FAILURE);
     }
 
@@ -161,6 +256,23 @@ public:
     return true;
   }
 
+  virtual bool retrieveBatch(ItemIndex index, size_t count, std::vector<std::vector<std::string>> &out) override {
+    std::unique_ptr<rocksdb::Iterator> iter(db->NewIterator(rocksdb::ReadOptions()));
+    iter->Seek(key(index));
+
+    for(size_t i = 0; i < count; i++, iter->Next()) {
+      if(!iter->Valid() || iter->key() != key(index + i)) {
+        return false;
+      }
+
+      out.emplace_back();
+      rocksdb::Slice value = iter->value();
+      deserializeVector(out.back(), std::string(value.data(), value.size()));
+    }
+
+    return true;
+  }
+
   virtual void pop() override {
     if(startIndex >= endIndex) {
       std::cerr << "Queue corruption, cannot pop item. startIndex = " << startIndex << ", endIndex = " << endIndex << std::endl;
@@ -168,16 +280,73 @@ public:
     }
 
     rocksdb::WriteBatch batch;
-    batch.SingleDelete(getKey(startIndex));
+    batch.SingleDelete(key(startIndex));
     batch.Put("START-INDEX", intToBinaryString(startIndex+1));
     commitBatch(batch);
 
     startIndex++;
   }
 
+  virtual void popBatch(size_t count) override {
+    if(count <= 1) {
+      if(count == 1) pop();
+      return;
+    }
+
+    if(startIndex + (ItemIndex) count > endIndex) {
+      std::cerr << "Queue corruption, cannot pop " << count << " items. startIndex = " << startIndex << ", endIndex = " << endIndex << std::endl;
+      exit(EXIT_FAILURE);
+    }
+
+    // Keys are big-endian, so the range covers exactly the popped items
+    rocksdb::WriteBatch batch;
+    batch.DeleteRange(key(startIndex), key(startIndex + count));
+    batch.Put("START-INDEX", intToBinaryString(startIndex + count));
+    commitBatch(batch);
+
+    startIndex += count;
+  }
+
 private:
+  //----------------------------------------------------------------------------
+  // Work out the key encoding from the first queued item - queues written
+  // with the legacy encoding keep it until drained.
+  //----------------------------------------------------------------------------
+  void initKeyFormat() {
+    compactKeys = true;
+    if(startIndex == endIndex || exists(getCompactKey(startIndex))) return;
+
+    if(exists(getKey(startIndex))) {
+      compactKeys = false;
+      return;
+    }
+
+    std::cerr << "Queue corruption, first item " << startIndex << " is missing" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  bool exists(const std::string &k) {
+    std::string buffer;
+    return db->Get(rocksdb::ReadOptions(), k, &buffer).ok();
+  }
+
+  std::string key(ItemIndex index) const {
+    return compactKeys ? getCompactKey(index) : getKey(index);
+  }
+
+  void syncWal(ThreadAssistant &assistant) {
+    while(!assistant.terminationRequested()) {
+      assistant.wait_for(persistencyOptions.syncInterval);
+
+      rocksdb::Status st = db->SyncWAL();
+      if(!st.ok()) {
+        std::cerr << "Unable to sync rocksdb queue WAL: " << st.ToString() << std::endl;
+      }
+    }
+  }
+
   void commitBatch(rocksdb::WriteBatch &batch) {
-    rocksdb::Status st = db->Write(rocksdb::WriteOptions(), &batch);
+    rocksdb::Status st = db->Write(writeOptions, &batch);
     if(!st.ok()) {
       std::cerr << "Unable to commit write batch to rocksdb queue: " << st.ToString() << std::endl;
       exit(EXIT_FAILURE);
@@ -209,7 +378,11 @@ private:
   std::atomic<ItemIndex> endIndex = {0};
 
   std::string dbpath;
+  RocksDBPersistencyOptions persistencyOptions;
+  rocksdb::WriteOptions writeOptions;
+  bool compactKeys = true;
   std::unique_ptr<rocksdb::DB> db;
+  AssistedThread syncThread;
 };
 
 }
@@ -0,0 +1,75 @@
+//------------------------------------------------------------------------------
+// File: ScriptRegistry.hh
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#ifndef QCLIENT_SCRIPT_REGISTRY_HH
+#define QCLIENT_SCRIPT_REGISTRY_HH
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace qclient {
+
+//------------------------------------------------------------------------------
+//! Lua scripts known to a QClient, keyed by their SHA1 digest - the name the
+//! server knows them under, as far as EVALSHA is concerned. Scripts are
+//! never removed: The set of scripts an application uses is expected to be
+//! small and fixed.
+//------------------------------------------------------------------------------
+class ScriptRegistry {
+public:
+  //----------------------------------------------------------------------------
+  //! Lowercase hex SHA1 of the given script, as computed by SCRIPT LOAD
+  //----------------------------------------------------------------------------
+  static std::string digest(const std::string &script);
+
+  //----------------------------------------------------------------------------
+  //! Register the given script, if not already known, and return its digest
+  //----------------------------------------------------------------------------
+  std::string add(const std::string &script);
+
+  //----------------------------------------------------------------------------
+  //! Look up a script by digest - false if unknown.
+  //----------------------------------------------------------------------------
+  bool get(const std::string &sha, std::string &script) const;
+
+  //----------------------------------------------------------------------------
+  //! All registered scripts, as (digest, script) pairs
+  //----------------------------------------------------------------------------
+  std::vector<std::pair<std::string, std::string>> getAll() const;
+
+  size_t size() const;
+
+private:
+  mutable std::mutex mtx;
+  std::unordered_map<std::string, std::string> scripts;
+
+  // Reverse index, so that add needs no SHA1 for known scripts
+  std::unordered_map<std::string, std::string> digests;
+};
+
+}
+
+#endif
@@ -60,6 +60,44 @@ public:
     return;
   }
 
+  //----------------------------------------------------------------------------
+  // Increase semaphore count by the given amount.
+  //----------------------------------------------------------------------------
+  void up(int64_t amount) {
+    std::lock_guard<std::mutex> lock(mtx);
+    count += amount;
+    cv.notify_all();
+  }
+
+  //----------------------------------------------------------------------------
+  // Decrease count by the given amount - blocks until count is at least
+  // that large.
+  //----------------------------------------------------------------------------
+  void down(int64_t amount) {
+    std::unique_lock<std::mutex> lock(mtx);
+
+    while(count < amount) {
+      cv.wait_for(lock, std::chrono::seconds(1));
+    }
+
+    count -= amount;
+  }
+
+  //----------------------------------------------------------------------------
+  // Try to decrease count by the given amount - never blocks. Returns false
+  // if count was too low, leaving it untouched.
+  //----------------------------------------------------------------------------
+  bool tryDown(int64_t amount = 1) {
+    std::lock_guard<std::mutex> lock(mtx);
+
+    if(count < amount) {
+      return false;
+    }
+
+    count -= amount;
+    return true;
+  }
+
   //----------------------------------------------------------------------------
   // Reset count to given value.
   //----------------------------------------------------------------------------
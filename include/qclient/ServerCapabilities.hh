@@ -0,0 +1,131 @@
+//------------------------------------------------------------------------------
+// File: ServerCapabilities.hh
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2016 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#ifndef QCLIENT_SERVER_CAPABILITIES_HH
+#define QCLIENT_SERVER_CAPABILITIES_HH
+
+#include "qclient/Members.hh"
+#include "qclient/QuarkDBVersion.hh"
+#include <map>
+#include <mutex>
+#include <string>
+
+namespace qclient {
+
+//------------------------------------------------------------------------------
+//! Optional server features which unlock faster protocols.
+//------------------------------------------------------------------------------
+enum class Capability : uint32_t {
+  kPushTypes = 0,            // ACTIVATE-PUSH-TYPES
+  kIncrementalResilvering,   // VHGETCHANGES
+  kBatchDequePop,            // deque-pop-front key count
+  kClientTracking,           // CLIENT TRACKING
+  kCount
+};
+
+//------------------------------------------------------------------------------
+//! What a server turned out to support, as negotiated during the handshake -
+//! see Options::negotiateCapabilities. Before negotiation, or without it,
+//! nothing is known: has() is false for everything, while mayHave() is true,
+//! for features which can be tried out and fall back on an error.
+//------------------------------------------------------------------------------
+class ServerCapabilities {
+public:
+  enum class Server {
+    kUnknown = 0,
+    kQuarkDB,
+    kRedis
+  };
+
+  //----------------------------------------------------------------------------
+  //! Nothing negotiated
+  //----------------------------------------------------------------------------
+  ServerCapabilities() {}
+
+  //----------------------------------------------------------------------------
+  //! Capabilities of the given server version. A server which answers
+  //! neither as QuarkDB nor as redis supports nothing.
+  //----------------------------------------------------------------------------
+  static ServerCapabilities forQuarkDB(const QuarkDBVersion &version);
+  static ServerCapabilities forRedis(const QuarkDBVersion &version);
+  static ServerCapabilities forUnknownServer();
+
+  bool negotiated() const {
+    return mNegotiated;
+  }
+
+  bool has(Capability cap) const {
+    return (mBits & bit(cap)) != 0;
+  }
+
+  bool mayHave(Capability cap) const {
+    return !mNegotiated || has(cap);
+  }
+
+  Server getServer() const {
+    return mServer;
+  }
+
+  const QuarkDBVersion& getVersion() const {
+    return mVersion;
+  }
+
+  std::string toString() const;
+
+private:
+  static uint32_t bit(Capability cap) {
+    return 1u << static_cast<uint32_t>(cap);
+  }
+
+  bool mNegotiated = false;
+  Server mServer = Server::kUnknown;
+  QuarkDBVersion mVersion;
+  uint32_t mBits = 0;
+};
+
+//------------------------------------------------------------------------------
+//! Negotiated capabilities per endpoint, so that they are known right away
+//! when reconnecting to a server seen before - including over a warm
+//! standby connection, which skips negotiation. Can be shared between many
+//! QClients, see Options::capabilityCache.
+//------------------------------------------------------------------------------
+class CapabilityCache {
+public:
+  void store(const Endpoint &endpoint, const ServerCapabilities &caps);
+
+  //----------------------------------------------------------------------------
+  //! Returns nothing negotiated if the endpoint hasn't been seen yet
+  //----------------------------------------------------------------------------
+  ServerCapabilities get(const Endpoint &endpoint) const;
+
+  size_t size() const;
+
+private:
+  mutable std::mutex mtx;
+  std::map<Endpoint, ServerCapabilities> entries;
+};
+
+}
+
+#endif
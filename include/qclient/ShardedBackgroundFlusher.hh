@@ -0,0 +1,75 @@
+//------------------------------------------------------------------------------
+// File: ShardedBackgroundFlusher.hh
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#ifndef QCLIENT_SHARDED_BACKGROUND_FLUSHER_HH
+#define QCLIENT_SHARDED_BACKGROUND_FLUSHER_HH
+
+#include "qclient/BackgroundFlusher.hh"
+#include <functional>
+
+namespace qclient {
+
+//------------------------------------------------------------------------------
+// N independent BackgroundFlushers, each with its own connection and
+// persistency layer. Operations are routed by a caller-provided key, so
+// operations sharing a key keep their relative order - there's no ordering
+// whatsoever across keys living in different shards.
+//
+// Routing is a stable hash of the key, modulo the number of shards: reopening
+// the same persistency layers with a different shard count would break
+// per-key ordering of leftover items.
+//------------------------------------------------------------------------------
+class ShardedBackgroundFlusher {
+public:
+  //----------------------------------------------------------------------------
+  // Creates the persistency layer of the given shard - typically pointing to
+  // its own directory. Must never return nullptr.
+  //----------------------------------------------------------------------------
+  using PersistencyFactory = std::function<BackgroundFlusherPersistency*(size_t shard)>;
+
+  ShardedBackgroundFlusher(size_t shards, const Members &members,
+    qclient::Options &&options, Notifier &notifier, const PersistencyFactory &factory);
+
+  void pushRequest(const std::string &key, const std::vector<std::string> &operation);
+  void pushRequest(const std::string &key, std::vector<std::string> &&operation);
+
+  size_t getShardCount() const;
+  size_t getShard(const std::string &key) const;
+  BackgroundFlusher& getFlusher(size_t shard);
+
+  // Applied to every shard
+  void enableGroupCommit(size_t maxAckBatch = 128);
+  void setReplayWindow(size_t window);
+
+  // Summed over every shard
+  size_t size() const;
+  int64_t getEnqueuedAndClear();
+  int64_t getAcknowledgedAndClear();
+
+private:
+  std::vector<std::unique_ptr<BackgroundFlusher>> flushers;
+};
+
+}
+
+#endif
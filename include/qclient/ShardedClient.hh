@@ -0,0 +1,155 @@
+//------------------------------------------------------------------------------
+// File: ShardedClient.hh
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#ifndef QCLIENT_SHARDED_CLIENT_HH
+#define QCLIENT_SHARDED_CLIENT_HH
+
+#include "qclient/QClient.hh"
+#include <memory>
+#include <vector>
+
+namespace qclient {
+
+//------------------------------------------------------------------------------
+//! Consistent hashing ring: Each shard owns virtualNodes points on a 64-bit
+//! ring, and a key belongs to the first point at or after its own hash.
+//! Adding or removing a shard only moves the keys of the points it gains or
+//! loses - roughly 1/N of them.
+//!
+//! Hashes are stable across builds and platforms. If the key contains a
+//! non-empty "{tag}", only the tag is hashed, so related keys can be kept
+//! together on one shard.
+//------------------------------------------------------------------------------
+class ConsistentHashRing {
+public:
+  ConsistentHashRing(size_t shards, size_t virtualNodes);
+
+  size_t getShard(const std::string &key) const {
+    return getShard(key.data(), key.size());
+  }
+
+  size_t getShard(const char *key, size_t len) const;
+
+  size_t getShardCount() const {
+    return shards;
+  }
+
+private:
+  size_t shards;
+  std::vector<std::pair<uint64_t, size_t>> points;
+};
+
+//------------------------------------------------------------------------------
+//! A client for several independent clusters, with keys sharded among them
+//! through a ConsistentHashRing - one QClient per cluster, each given a
+//! clone of the options.
+//!
+//! Each request is routed by its key, the first argument after the command.
+//! Requests without one, such as PING, go to the first shard. There's no
+//! ordering between requests landing on different shards.
+//!
+//! Multi-key commands must go through executeMultiKey instead, which splits
+//! them by shard.
+//------------------------------------------------------------------------------
+class ShardedClient {
+public:
+  //----------------------------------------------------------------------------
+  //! Constructor taking one Members group per shard. The order of groups
+  //! matters: It must stay the same across all clients sharing the data.
+  //----------------------------------------------------------------------------
+  ShardedClient(const std::vector<Members> &shards, Options &&options,
+    size_t virtualNodes = 160);
+
+  //----------------------------------------------------------------------------
+  //! Disallow copy and assign
+  //----------------------------------------------------------------------------
+  ShardedClient(const ShardedClient&) = delete;
+  void operator=(const ShardedClient&) = delete;
+
+  //----------------------------------------------------------------------------
+  //! Shard lookup, and access to the QClient of a specific shard
+  //----------------------------------------------------------------------------
+  size_t getShardCount() const;
+  size_t getShard(const std::string &key) const;
+  QClient& getClient(size_t shard);
+  QClient& getClientForKey(const std::string &key);
+
+  //----------------------------------------------------------------------------
+  //! Requests issued through any shard, but not yet acknowledged.
+  //----------------------------------------------------------------------------
+  int64_t getPendingRequests() const;
+
+  //----------------------------------------------------------------------------
+  //! Same API as QClient - see there.
+  //----------------------------------------------------------------------------
+  std::future<redisReplyPtr> execute(EncodedRequest &&req);
+  void execute(QCallback *callback, EncodedRequest &&req);
+  void execute(EncodedRequest &&req, ReplyCallback &&callback);
+
+  //----------------------------------------------------------------------------
+  //! MULTI blocks: All keys in the block must live on the same shard,
+  //! otherwise the block is not issued, and an error reply is returned.
+  //----------------------------------------------------------------------------
+  std::future<redisReplyPtr> execute(std::deque<EncodedRequest> &&reqs);
+
+  //----------------------------------------------------------------------------
+  //! Multi-key commands such as MGET, DEL or EXISTS: Keys are split by shard,
+  //! one command per shard is issued, all in parallel, and the replies are
+  //! merged once all have arrived. Array replies are put back together in
+  //! the order of the given keys, integer replies are summed up, and any
+  //! error or null reply is returned as is.
+  //----------------------------------------------------------------------------
+  std::future<redisReplyPtr> executeMultiKey(const std::string &command,
+    const std::vector<std::string> &keys);
+
+  template<typename T>
+  std::future<redisReplyPtr> execute(const T& container) {
+    return execute(EncodedRequest(container));
+  }
+
+  template<typename T>
+  void execute(QCallback *callback, const T& container) {
+    return execute(callback, EncodedRequest(container));
+  }
+
+  template<typename... Args>
+  std::future<redisReplyPtr> exec(const Args&... args) {
+    return this->execute(EncodedRequest::make(args...));
+  }
+
+  template<typename... Args>
+  void execCB(QCallback *callback, const Args... args) {
+    return this->execute(callback, std::vector<std::string> {args...});
+  }
+
+private:
+  size_t route(const EncodedRequest &req) const;
+
+  ConsistentHashRing ring;
+  std::vector<std::unique_ptr<QClient>> clients;
+};
+
+}
+
+#endif
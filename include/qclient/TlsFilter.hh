@@ -28,6 +28,8 @@
 #include <functional>
 #include <mutex>
 #include <list>
+#include <atomic>
+#include <memory>
 #include "qclient/Namespace.hh"
 
 struct ssl_ctx_st;
@@ -41,6 +43,8 @@ typedef struct bio_st BIO;
 
 QCLIENT_NAMESPACE_BEGIN
 
+class ByteRing;
+
 enum class FilterType {
   CLIENT = 0,     // act as a client
   SERVER          // act as a server
@@ -68,32 +72,84 @@ struct TlsConfig {
   std::string decryptionPassword; // in case certificate key is encrypted
   std::string capath; // certificate store against which to verify peer certs
   bool verify = true; // verify peer certificate
+  bool ktls = false; // hand encryption over to the kernel after the handshake, if supported (Linux)
 };
 
 using LinkStatus = int;
 using RecvFunction = std::function<RecvStatus(char *buf, int len, int timeout)>;
 using SendFunction = std::function<LinkStatus(const char *buf, int len)>;
 
+//------------------------------------------------------------------------------
+// SSL contexts are shared between all filters with identical TlsConfig and
+// FilterType, so certificates are not loaded from disk on every connection.
+// A context is loaded afresh once its certificate, key or CA path has been
+// replaced on disk: Rotated certificates are picked up on the next connect.
+//
+// Clients identifying their peer (for example "host:port") also remember the
+// last TLS session towards it, and offer it for resumption next time -
+// reconnections then do an abbreviated handshake.
+//
+// Reading and writing may happen from different threads: OpenSSL itself is
+// only held for encryption and decryption, while outgoing ciphertext goes
+// onto the socket straight out of a fixed ring, under a separate lock.
+//
+// With TlsConfig::ktls and the socket fd given, a client lets OpenSSL run
+// the handshake on the socket directly, and enable kernel TLS. Once the
+// kernel encrypts, plaintext is sent through the send function as-is.
+//------------------------------------------------------------------------------
 class TlsFilter {
 public:
-  TlsFilter(const TlsConfig &config, const FilterType &filtertype, RecvFunction rc, SendFunction sd);
+  TlsFilter(const TlsConfig &config, const FilterType &filtertype, RecvFunction rc, SendFunction sd,
+    const std::string &peer = "", int fd = -1);
   ~TlsFilter();
 
   LinkStatus send(const char *buff, int blen);
   RecvStatus recv(char *buff, int blen, int timeout);
   LinkStatus close(int defer);
+
+  // Was a previous session resumed? Only meaningful once the TLS handshake
+  // has completed.
+  bool sessionReused();
+
+  // Has the kernel taken over encryption of outgoing traffic? Plaintext may
+  // then go onto the socket directly, bypassing send().
+  bool kernelSendOffload();
+
+  // Is anything waiting to go onto the socket? Only happens once the socket
+  // stopped taking data - send() and recv() leave the rest behind.
+  bool hasPendingOutput();
+
+  // Push out as much pending output as the socket takes right now. Returns
+  // true if nothing is left.
+  bool flushPendingOutput();
+
 private:
   void initialize();
+  void acquireContext();
   void createContext();
   void configureContext();
 
-  LinkStatus handleTraffic();
-  LinkStatus pushCiphertext();
+  void continueHandshake();
+  void retryPendingWrites();
+  bool drainCiphertext();
+  bool flushCiphertext();
+  void pumpCiphertext();
 
+  // Protects the SSL object - held for encryption and decryption only
   std::mutex mtx;
 
+  // Held while pushing ciphertext onto the socket
+  std::mutex flushMtx;
+
   TlsConfig tlsconfig;
   FilterType filtertype;
+  std::string peer;
+  int fd = -1;
+
+  bool socketBio = false;
+  bool handshakeDone = false;
+  bool ktlsSend = false;
+  std::atomic<bool> kernelSend {false};
 
   SSL_CTX *ctx = nullptr;
   SSL *ssl = nullptr;
@@ -104,6 +160,7 @@ private:
   SendFunction sendFunc;
 
   std::list<std::string> pendingWrites;
+  std::unique_ptr<ByteRing> ciphertext;
 };
 
 QCLIENT_NAMESPACE_END
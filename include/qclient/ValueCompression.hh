@@ -0,0 +1,141 @@
+//------------------------------------------------------------------------------
+// File: ValueCompression.hh
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#ifndef QCLIENT_VALUE_COMPRESSION_HH
+#define QCLIENT_VALUE_COMPRESSION_HH
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace qclient {
+
+//------------------------------------------------------------------------------
+//! Codecs a ValueCompression may use. Which ones are available depends on
+//! the libraries found at build time - see ValueCompression::supported.
+//------------------------------------------------------------------------------
+enum class CompressionAlgorithm : uint8_t {
+  kNone = 0,
+  kZlib = 1,
+  kLz4 = 2,
+  kZstd = 3
+};
+
+//------------------------------------------------------------------------------
+//! Opt-in compression of large values, applied on the client so that both
+//! the network and the server see fewer bytes.
+//!
+//! Compressed values start with a 12-byte header: The magic "\xC5QZ", the
+//! algorithm, and the original size as big-endian int64. Values below the
+//! threshold, or which don't shrink, are stored as they are - unless they
+//! happen to start with the magic themselves, in which case they get a
+//! header with kNone, so that decoding never mistakes them for compressed.
+//!
+//! Decoding needs no configuration, and passes anything without the magic
+//! through untouched: Data written before compression was turned on stays
+//! readable. Clients which don't decode will see the raw header, however -
+//! only turn on once all readers of the affected keys have been upgraded.
+//------------------------------------------------------------------------------
+class ValueCompression {
+public:
+  static constexpr size_t kHeaderSize = 12;
+
+  //----------------------------------------------------------------------------
+  //! Values are never compressed
+  //----------------------------------------------------------------------------
+  static ValueCompression Disabled() {
+    return ValueCompression(CompressionAlgorithm::kNone, 0, 0);
+  }
+
+  //----------------------------------------------------------------------------
+  //! Compress values of at least threshold bytes with the given algorithm.
+  //! level is passed on to the codec, 0 picks its default. An algorithm
+  //! not supported by this build leaves values uncompressed.
+  //----------------------------------------------------------------------------
+  static ValueCompression Enabled(CompressionAlgorithm algorithm,
+    size_t threshold = 1024, int level = 0) {
+    return ValueCompression(algorithm, threshold, level);
+  }
+
+  //----------------------------------------------------------------------------
+  //! Is the given algorithm compiled into this build?
+  //----------------------------------------------------------------------------
+  static bool supported(CompressionAlgorithm algorithm);
+
+  bool active() const {
+    return algorithm != CompressionAlgorithm::kNone;
+  }
+
+  CompressionAlgorithm getAlgorithm() const {
+    return algorithm;
+  }
+
+  size_t getThreshold() const {
+    return threshold;
+  }
+
+  //----------------------------------------------------------------------------
+  //! Encode value into out. Returns false if value can be stored as-is, in
+  //! which case out is left untouched.
+  //----------------------------------------------------------------------------
+  bool encode(const std::string &value, std::string &out) const;
+
+  //----------------------------------------------------------------------------
+  //! Convenience wrapper around the above, always returning the encoded
+  //! value.
+  //----------------------------------------------------------------------------
+  std::string encode(const std::string &value) const;
+
+  //----------------------------------------------------------------------------
+  //! Does the given buffer start with the magic?
+  //----------------------------------------------------------------------------
+  static bool isEncoded(const char *data, size_t len);
+
+  static bool isEncoded(const std::string &value) {
+    return isEncoded(value.data(), value.size());
+  }
+
+  //----------------------------------------------------------------------------
+  //! Decode the given buffer into out. Buffers without the magic are copied
+  //! over as they are. Returns false if the value is corrupted, or was
+  //! compressed with an algorithm this build doesn't support.
+  //----------------------------------------------------------------------------
+  static bool decode(const char *data, size_t len, std::string &out);
+
+  //----------------------------------------------------------------------------
+  //! Decode value in place - false if corrupted, leaving it untouched
+  //----------------------------------------------------------------------------
+  static bool decodeInPlace(std::string &value);
+
+private:
+  ValueCompression(CompressionAlgorithm algo, size_t thres, int lvl)
+  : algorithm(algo), threshold(thres), level(lvl) {}
+
+  CompressionAlgorithm algorithm;
+  size_t threshold;
+  int level;
+};
+
+}
+
+#endif
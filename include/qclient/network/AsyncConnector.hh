@@ -26,12 +26,14 @@
 
 #include "qclient/Status.hh"
 #include "qclient/network/FileDescriptor.hh"
+#include "qclient/network/HostResolver.hh"
+#include "qclient/network/SocketProfile.hh"
 #include <chrono>
+#include <memory>
+#include <vector>
 
 namespace qclient {
 
-class ServiceEndpoint;
-
 //------------------------------------------------------------------------------
 // Establishes connection to the specified resolved endpoint asynchronously.
 // Does not manage the lifetime of the file descriptor once connected!
@@ -41,9 +43,11 @@ public:
   //----------------------------------------------------------------------------
   // Constructor - initiate connection towards the given ServiceEndpoint. Does
   // not block the calling thread until connected - issues an asynchronous
-  // request the OS, asking to connect.
+  // request the OS, asking to connect. The socket is set up according to the
+  // given profile first.
   //----------------------------------------------------------------------------
-  AsyncConnector(const ServiceEndpoint &endpoint);
+  AsyncConnector(const ServiceEndpoint &endpoint,
+    const SocketProfile &profile = SocketProfile::Default());
 
   //----------------------------------------------------------------------------
   // Is ::connect ready yet?
@@ -63,6 +67,18 @@ public:
   bool blockUntilReady(int shutdownFd = -1, std::chrono::seconds timeout =
     std::chrono::seconds(2) );
 
+  //----------------------------------------------------------------------------
+  // Non-blocking version of blockUntilReady, meant for external event loops
+  // waiting for getFd() to become writable. Returns true if ::connect has
+  // completed, successfully or not - check ok() afterwards.
+  //----------------------------------------------------------------------------
+  bool checkCompletion();
+
+  //----------------------------------------------------------------------------
+  // Get file descriptor, without releasing ownership.
+  //----------------------------------------------------------------------------
+  int getFd() const;
+
   //----------------------------------------------------------------------------
   // Has there been an error yet? Note that, if ::connect is still pending,
   // there might be an error in the future.
@@ -92,6 +108,88 @@ private:
   std::string error;
 
   bool finished = false;
+
+  //----------------------------------------------------------------------------
+  // Set the options of the given profile on our socket, best effort
+  //----------------------------------------------------------------------------
+  void applyProfile(const SocketProfile &profile, ProtocolType type);
+
+  //----------------------------------------------------------------------------
+  // Our file descriptor became writable, find out how ::connect went. Returns
+  // false if the connection is still in progress.
+  //----------------------------------------------------------------------------
+  bool finishConnect();
+};
+
+//------------------------------------------------------------------------------
+// Races connections towards several endpoints, RFC 8305 style ("happy
+// eyeballs"): Attempts are started in the given order, a new one each time
+// attemptDelay passes without any success, or as soon as a pending one
+// fails. The first attempt to succeed wins, the rest are abandoned.
+//
+// A blackholed endpoint thus costs attemptDelay, not a full TCP timeout.
+//------------------------------------------------------------------------------
+class ParallelConnector {
+public:
+  //----------------------------------------------------------------------------
+  // Constructor - nothing happens until blockUntilReady is called.
+  //----------------------------------------------------------------------------
+  ParallelConnector(const std::vector<ServiceEndpoint> &endpoints,
+    std::chrono::milliseconds attemptDelay,
+    const SocketProfile &profile = SocketProfile::Default());
+
+  //----------------------------------------------------------------------------
+  // Run attempts until one succeeds, or all of them have failed. Return
+  // false if we had to cancel due to events in shutdownFd, or because the
+  // timeout expired - check ok() otherwise.
+  //----------------------------------------------------------------------------
+  bool blockUntilReady(int shutdownFd, std::chrono::milliseconds timeout);
+
+  //----------------------------------------------------------------------------
+  // Did some attempt succeed?
+  //----------------------------------------------------------------------------
+  bool ok() const;
+
+  //----------------------------------------------------------------------------
+  // Get connected file descriptor, releasing ownership.
+  //----------------------------------------------------------------------------
+  int release();
+
+  //----------------------------------------------------------------------------
+  // The endpoint we connected to - only valid if ok().
+  //----------------------------------------------------------------------------
+  const ServiceEndpoint& getEndpoint() const;
+
+  //----------------------------------------------------------------------------
+  // Why each of the failed attempts failed.
+  //----------------------------------------------------------------------------
+  std::string getError() const;
+
+private:
+  struct Attempt {
+    ServiceEndpoint endpoint;
+    std::unique_ptr<AsyncConnector> connector;
+  };
+
+  //----------------------------------------------------------------------------
+  // Start the next attempt. Returns true if it completed right away - the
+  // winner is set, if it succeeded.
+  //----------------------------------------------------------------------------
+  bool startAttempt();
+
+  //----------------------------------------------------------------------------
+  // The given attempt has completed - record the winner, or the error.
+  //----------------------------------------------------------------------------
+  void attemptCompleted(Attempt &attempt);
+
+  std::vector<ServiceEndpoint> endpoints;
+  std::chrono::milliseconds attemptDelay;
+  SocketProfile profile;
+  size_t nextAttempt = 0u;
+
+  std::vector<Attempt> pending;
+  std::unique_ptr<Attempt> winner;
+  std::string error;
 };
 
 }
@@ -0,0 +1,124 @@
+//------------------------------------------------------------------------------
+// File: DnsCache.hh
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#ifndef QCLIENT_DNS_CACHE_HH
+#define QCLIENT_DNS_CACHE_HH
+
+#include "qclient/AssistedThread.hh"
+#include "qclient/Status.hh"
+#include "qclient/network/HostResolver.hh"
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+
+namespace qclient {
+
+//------------------------------------------------------------------------------
+// A cache of hostname resolutions, meant to be shared between many
+// HostResolvers - all QClients of a process, for example - so that a
+// reconnecting client rarely has to wait for DNS.
+//
+// - Successful resolutions are served for ttl. During the ttl after that,
+//   they are still served, but also refreshed by a background thread.
+//   Past that, or if refreshing keeps failing, lookups resolve again
+//   synchronously.
+// - Failed resolutions are remembered for negativeTtl, and resolved again
+//   synchronously afterwards.
+//
+// getaddrinfo doesn't tell us the TTL of the records it found, hence the
+// fixed TTLs.
+//------------------------------------------------------------------------------
+class DnsCache {
+public:
+  using ResolveFunction = std::function<std::vector<ServiceEndpoint>(
+    const std::string &host, int port, Status &st)>;
+
+  //----------------------------------------------------------------------------
+  // Constructor. If no resolve function is given, getaddrinfo is used.
+  //----------------------------------------------------------------------------
+  DnsCache(std::chrono::milliseconds ttl = std::chrono::seconds(60),
+    std::chrono::milliseconds negativeTtl = std::chrono::seconds(5),
+    ResolveFunction resolveFunction = {});
+
+  //----------------------------------------------------------------------------
+  // Destructor
+  //----------------------------------------------------------------------------
+  ~DnsCache();
+
+  //----------------------------------------------------------------------------
+  // Process-wide cache, with the default TTLs.
+  //----------------------------------------------------------------------------
+  static std::shared_ptr<DnsCache> getDefault();
+
+  //----------------------------------------------------------------------------
+  // Resolve the given hostname and port pair, through the cache.
+  //----------------------------------------------------------------------------
+  std::vector<ServiceEndpoint> resolve(const std::string &host, int port,
+    Status &st);
+
+  //----------------------------------------------------------------------------
+  // Forget everything.
+  //----------------------------------------------------------------------------
+  void clear();
+
+  //----------------------------------------------------------------------------
+  // Number of hostname and port pairs currently cached.
+  //----------------------------------------------------------------------------
+  size_t size() const;
+
+private:
+  using Key = std::pair<std::string, int>;
+
+  struct Entry {
+    std::vector<ServiceEndpoint> endpoints;
+    Status status;
+    std::chrono::steady_clock::time_point expiry;
+    bool refreshPending = false;
+  };
+
+  //----------------------------------------------------------------------------
+  // Background thread, refreshing stale entries.
+  //----------------------------------------------------------------------------
+  void refreshLoop(ThreadAssistant &assistant);
+
+  ResolveFunction resolveFunction;
+  const std::chrono::milliseconds ttl;
+  const std::chrono::milliseconds negativeTtl;
+
+  mutable std::mutex mtx;
+  std::condition_variable refreshCV;
+  std::map<Key, Entry> entries;
+  std::deque<Key> refreshQueue;
+  bool shuttingDown = false;
+
+  AssistedThread refresher;
+};
+
+}
+
+#endif
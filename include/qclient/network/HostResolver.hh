@@ -29,11 +29,13 @@
 #include <string>
 #include <mutex>
 #include <map>
+#include <memory>
 
 namespace qclient {
 
 class Logger;
 class Status;
+class DnsCache;
 
 //------------------------------------------------------------------------------
 // Protocol type
@@ -41,6 +43,7 @@ class Status;
 enum class ProtocolType {
   kIPv4,
   kIPv6,
+  kUnix,
 };
 
 //------------------------------------------------------------------------------
@@ -80,7 +83,8 @@ public:
     const std::vector<char> addr, const std::string &original);
 
   //----------------------------------------------------------------------------
-  // Constructor, taking the IP address as text and a port, not sockaddr bytes
+  // Constructor, taking the IP address as text and a port, not sockaddr bytes.
+  // For kUnix, addr is the socket path and port is ignored.
   //----------------------------------------------------------------------------
   ServiceEndpoint(ProtocolType protocol, SocketType socket,
     const std::string &addr, int port, const std::string &original);
@@ -155,9 +159,9 @@ private:
 class HostResolver {
 public:
   //----------------------------------------------------------------------------
-  // Constructor
+  // Constructor. If a cache is given, resolutions go through it.
   //----------------------------------------------------------------------------
-  HostResolver(Logger *logger);
+  HostResolver(Logger *logger, std::shared_ptr<DnsCache> cache = {});
 
   //----------------------------------------------------------------------------
   // Main resolve function: How many service endpoints match the given
@@ -178,8 +182,21 @@ public:
   //----------------------------------------------------------------------------
   void feedFake(const std::string &host, int port, const std::vector<ServiceEndpoint> &out);
 
+  //----------------------------------------------------------------------------
+  // Ask getaddrinfo directly, bypassing fakes and caching.
+  //----------------------------------------------------------------------------
+  static std::vector<ServiceEndpoint> resolveSystem(Logger *logger,
+    const std::string &host, int port, Status &st);
+
+  //----------------------------------------------------------------------------
+  // Build the endpoint for a "unix:/path" host - no lookup involved.
+  //----------------------------------------------------------------------------
+  static std::vector<ServiceEndpoint> resolveUnix(const std::string &path,
+    const std::string &host, Status &st);
+
 private:
   Logger *logger;
+  std::shared_ptr<DnsCache> cache;
 
   std::mutex mtx;
   std::map<std::pair<std::string, int>, std::vector<ServiceEndpoint>> fakeMap;
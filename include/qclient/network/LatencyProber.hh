@@ -0,0 +1,123 @@
+//------------------------------------------------------------------------------
+// File: LatencyProber.hh
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#ifndef QCLIENT_LATENCY_PROBER_HH
+#define QCLIENT_LATENCY_PROBER_HH
+
+#include "qclient/AssistedThread.hh"
+#include "qclient/EventFD.hh"
+#include "qclient/Members.hh"
+#include "qclient/TlsFilter.hh"
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace qclient {
+
+class DnsCache;
+class HostResolver;
+class NetworkStream;
+
+//------------------------------------------------------------------------------
+// Measures the round-trip time towards each cluster member in the background,
+// by keeping a connection to each one open and PINGing it every interval. The
+// samples are smoothed the same way TCP smooths its RTT estimate.
+//
+// Meant to be shared through Options::latencyProber between all clients of a
+// cluster: When no redirection or leader hint says otherwise, they go through
+// the members fastest first, instead of in configured order. Since follower
+// connections clone their options, follower reads prefer the closest members
+// as well.
+//
+// Any reply to PING counts as proof of life, even an error - a server that
+// wants authentication first is still as far away as it is.
+//------------------------------------------------------------------------------
+class LatencyProber {
+public:
+  //----------------------------------------------------------------------------
+  // Constructor. An interval of zero disables the background thread, leaving
+  // it up to the caller to feed samples through record / recordFailure.
+  //----------------------------------------------------------------------------
+  LatencyProber(const Members &members,
+    std::chrono::milliseconds interval = std::chrono::seconds(5),
+    const TlsConfig &tlsconfig = {}, std::shared_ptr<DnsCache> dnsCache = {},
+    std::chrono::seconds timeout = std::chrono::seconds(2));
+
+  //----------------------------------------------------------------------------
+  // Destructor
+  //----------------------------------------------------------------------------
+  ~LatencyProber();
+
+  //----------------------------------------------------------------------------
+  // Feed a sample, marking the endpoint as healthy
+  //----------------------------------------------------------------------------
+  void record(const Endpoint &endpoint, std::chrono::microseconds rtt);
+
+  //----------------------------------------------------------------------------
+  // The endpoint could not be reached - it goes last until it answers again
+  //----------------------------------------------------------------------------
+  void recordFailure(const Endpoint &endpoint);
+
+  //----------------------------------------------------------------------------
+  // Smoothed round-trip time towards the given endpoint. False if it's not
+  // healthy, or hasn't been measured yet.
+  //----------------------------------------------------------------------------
+  bool getLatency(const Endpoint &endpoint, std::chrono::microseconds &rtt) const;
+
+  //----------------------------------------------------------------------------
+  // The given endpoints, reordered: Healthy ones by increasing latency, then
+  // those not measured yet, then those failing. Ties keep their order.
+  //----------------------------------------------------------------------------
+  std::vector<Endpoint> rank(const std::vector<Endpoint> &endpoints) const;
+
+private:
+  struct Entry {
+    std::chrono::microseconds smoothed {0};
+    bool healthy = false;
+  };
+
+  void main(ThreadAssistant &assistant);
+  void probe(size_t index);
+  std::unique_ptr<NetworkStream> connect(const Endpoint &endpoint);
+
+  Members members;
+  std::chrono::milliseconds interval;
+  TlsConfig tlsconfig;
+  std::chrono::seconds timeout;
+  std::unique_ptr<HostResolver> hostResolver;
+
+  // One connection per member, only touched by the background thread
+  std::vector<std::unique_ptr<NetworkStream>> streams;
+
+  mutable std::mutex mtx;
+  std::map<Endpoint, Entry> entries;
+
+  EventFD wakeupFD;
+  AssistedThread thread;
+};
+
+}
+
+#endif
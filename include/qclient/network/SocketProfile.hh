@@ -0,0 +1,160 @@
+//------------------------------------------------------------------------------
+// File: SocketProfile.hh
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#ifndef QCLIENT_SOCKET_PROFILE_HH
+#define QCLIENT_SOCKET_PROFILE_HH
+
+#include <algorithm>
+#include <chrono>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace qclient {
+
+//------------------------------------------------------------------------------
+// Socket options applied by AsyncConnector to every socket it creates, before
+// connecting - buffer sizes only take effect on the TCP window if set that
+// early. TCP-level options are skipped for unix sockets.
+//
+// Each option is applied on a best-effort basis: Those not supported by the
+// kernel are silently left alone.
+//------------------------------------------------------------------------------
+class SocketProfile {
+private:
+  //----------------------------------------------------------------------------
+  // Private constructor, use static methods below to construct an object.
+  //----------------------------------------------------------------------------
+  SocketProfile() {}
+
+public:
+  //----------------------------------------------------------------------------
+  // What qclient has always done: A TCP_USER_TIMEOUT of 30 seconds, and
+  // kernel defaults for everything else.
+  //----------------------------------------------------------------------------
+  static SocketProfile Default() {
+    return SocketProfile();
+  }
+
+  //----------------------------------------------------------------------------
+  // Nagle off, TCP_QUICKACK on, and a dead peer noticed within roughly
+  // deadPeerTimeout: Both unacknowledged data (TCP_USER_TIMEOUT) and an idle
+  // connection (keepalive probes) give up after that long.
+  //
+  // TCP_QUICKACK is not sticky - the kernel may fall back to delayed ACKs
+  // later on. It covers the handshake and first requests of a connection.
+  //----------------------------------------------------------------------------
+  static SocketProfile LowLatency(std::chrono::seconds deadPeerTimeout = std::chrono::seconds(10)) {
+    SocketProfile val;
+    val.noDelay = true;
+    val.quickAck = true;
+    val.userTimeout = deadPeerTimeout;
+    val.keepalive = true;
+
+    // Idle for half the timeout, then three probes over the other half
+    int64_t total = std::max<int64_t>(deadPeerTimeout.count(), 2);
+    val.keepaliveIdle = std::chrono::seconds(total / 2);
+    val.keepaliveInterval = std::chrono::seconds(std::max<int64_t>(total / 6, 1));
+    val.keepaliveCount = 3;
+    return val;
+  }
+
+  //----------------------------------------------------------------------------
+  // LowLatency, with send and receive buffers sized to the bandwidth-delay
+  // product of the link, so that a single connection can keep it full -
+  // clamped to [64 KB, 64 MB]. Fixing the buffer size turns off kernel
+  // autotuning for the socket, so err on the generous side for rtt.
+  //----------------------------------------------------------------------------
+  static SocketProfile BandwidthDelay(uint64_t bytesPerSecond,
+    std::chrono::microseconds rtt,
+    std::chrono::seconds deadPeerTimeout = std::chrono::seconds(10)) {
+
+    SocketProfile val = LowLatency(deadPeerTimeout);
+    uint64_t bdp = (bytesPerSecond / 1000) * rtt.count() / 1000;
+    bdp = std::min(std::max(bdp, uint64_t(kMinBuffer)), uint64_t(kMaxBuffer));
+
+    val.sendBufferSize = bdp;
+    val.receiveBufferSize = bdp;
+    return val;
+  }
+
+  bool getNoDelay() const {
+    return noDelay;
+  }
+
+  bool getQuickAck() const {
+    return quickAck;
+  }
+
+  //----------------------------------------------------------------------------
+  // Zero leaves the buffer size up to the kernel
+  //----------------------------------------------------------------------------
+  size_t getSendBufferSize() const {
+    return sendBufferSize;
+  }
+
+  size_t getReceiveBufferSize() const {
+    return receiveBufferSize;
+  }
+
+  std::chrono::seconds getUserTimeout() const {
+    return userTimeout;
+  }
+
+  bool getKeepalive() const {
+    return keepalive;
+  }
+
+  std::chrono::seconds getKeepaliveIdle() const {
+    return keepaliveIdle;
+  }
+
+  std::chrono::seconds getKeepaliveInterval() const {
+    return keepaliveInterval;
+  }
+
+  int getKeepaliveCount() const {
+    return keepaliveCount;
+  }
+
+private:
+  static constexpr uint64_t kMinBuffer = 64 * 1024;
+  static constexpr uint64_t kMaxBuffer = 64 * 1024 * 1024;
+
+  bool noDelay = false;
+  bool quickAck = false;
+  size_t sendBufferSize = 0;
+  size_t receiveBufferSize = 0;
+  std::chrono::seconds userTimeout {30};
+
+  //----------------------------------------------------------------------------
+  // Only apply if keepalive is set
+  //----------------------------------------------------------------------------
+  bool keepalive = false;
+  std::chrono::seconds keepaliveIdle {0};
+  std::chrono::seconds keepaliveInterval {0};
+  int keepaliveCount = 0;
+};
+
+}
+
+#endif
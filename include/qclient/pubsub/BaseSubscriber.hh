@@ -27,6 +27,7 @@
 #include "qclient/QClient.hh"
 #include "qclient/Members.hh"
 #include "qclient/Options.hh"
+#include "qclient/utils/Macros.hh"
 #include <set>
 #include <mutex>
 
@@ -85,11 +86,27 @@ public:
   //----------------------------------------------------------------------------
   void punsubscribe(const std::vector<std::string> &patterns);
 
+  //----------------------------------------------------------------------------
+  //! Subscribe to the given channel or pattern first when resubscribing
+  //! after a reconnection. Only has an effect while subscribed to it.
+  //----------------------------------------------------------------------------
+  void prioritize(const std::string &key, bool pattern);
+
   //----------------------------------------------------------------------------
   //! Get underlying QClient object - lifetime tied to this object
   //----------------------------------------------------------------------------
   qclient::QClient* getQcl();
 
+PUBLIC_FOR_TESTS_ONLY:
+  //----------------------------------------------------------------------------
+  //! Split keys into resubscription chunks of at most chunkSize each, those
+  //! in priority first.
+  //----------------------------------------------------------------------------
+  using Chunk = std::vector<const std::string*>;
+  static void planResubscription(const std::set<std::string> &keys,
+    const std::set<std::string> &priority, size_t chunkSize,
+    std::vector<Chunk> &chunks);
+
 private:
   //----------------------------------------------------------------------------
   //! Notify of a reconnection in the underlying qclient
@@ -105,7 +122,15 @@ private:
   std::mutex mtx;
   std::set<std::string> channels;
   std::set<std::string> patterns;
+  std::set<std::string> priorityChannels;
+  std::set<std::string> priorityPatterns;
+  size_t resubscribeChunkSize;
   qclient::QClient qcl;
+
+  //----------------------------------------------------------------------------
+  //! Send out the given resubscription chunks. Assumes mtx is taken.
+  //----------------------------------------------------------------------------
+  void resubscribe(const char *command, const std::vector<Chunk> &chunks);
 };
 
 }
@@ -24,11 +24,13 @@
 #ifndef QCLIENT_MESSAGE_HH
 #define QCLIENT_MESSAGE_HH
 
+#include <memory>
 #include <string>
 
 namespace qclient {
 
 class MessageParser;
+class MessageDecoder;
 
 enum class MessageType {
   kSubscribe,
@@ -51,6 +53,10 @@ enum class MessageType {
 //!       messageType, channel, contents
 //! - kPatternMessage
 //!       messageType, channel, contents, pattern
+//!
+//! The strings are immutable and shared between copies, so handing the same
+//! message to many subscriptions, or queueing and reading it back, doesn't
+//! copy the payload.
 //------------------------------------------------------------------------------
 class Message {
 public:
@@ -65,19 +71,19 @@ public:
   }
 
   bool hasPattern() const {
-    return ! pattern.empty();
+    return ! contents().pattern.empty();
   }
 
   const std::string& getPattern() const {
-    return pattern;
+    return contents().pattern;
   }
 
   const std::string& getChannel() const {
-    return channel;
+    return contents().channel;
   }
 
   const std::string& getPayload() const {
-    return payload;
+    return contents().payload;
   }
 
   int getActiveSubscriptions() const {
@@ -88,9 +94,7 @@ public:
     messageType = MessageType::kSubscribe;
     activeSubscriptions = 0;
 
-    pattern.clear();
-    channel.clear();
-    payload.clear();
+    data.reset();
   }
 
   //----------------------------------------------------------------------------
@@ -99,9 +103,9 @@ public:
   bool operator==(const Message &other) const {
     return messageType           ==   other.messageType           &&
            activeSubscriptions   ==   other.activeSubscriptions   &&
-           pattern               ==   other.pattern               &&
-           channel               ==   other.channel               &&
-           payload               ==   other.payload;
+           getPattern()          ==   other.getPattern()          &&
+           getChannel()          ==   other.getChannel()          &&
+           getPayload()          ==   other.getPayload();
   }
 
   //----------------------------------------------------------------------------
@@ -110,20 +114,41 @@ public:
   static Message createMessage(const std::string &channel, const std::string &payload) {
     Message out;
     out.messageType = MessageType::kMessage;
-    out.channel = channel;
-    out.payload = payload;
+    out.data = std::make_shared<Contents>(Contents { "", channel, payload });
+    return out;
+  }
+
+  //----------------------------------------------------------------------------
+  //! "Constructor": Make kPatternMessage.
+  //----------------------------------------------------------------------------
+  static Message createPatternMessage(const std::string &pattern,
+    const std::string &channel, const std::string &payload) {
+    Message out;
+    out.messageType = MessageType::kPatternMessage;
+    out.data = std::make_shared<Contents>(Contents { pattern, channel, payload });
     return out;
   }
 
 private:
   friend class MessageParser;
+  friend class MessageDecoder;
+class MessageDecoder;
 
   MessageType messageType = MessageType::kSubscribe;
   int activeSubscriptions = 0u;
 
-  std::string pattern;
-  std::string channel;
-  std::string payload;
+  struct Contents {
+    std::string pattern;
+    std::string channel;
+    std::string payload;
+  };
+
+  const Contents& contents() const {
+    static const Contents empty;
+    return data ? *data : empty;
+  }
+
+  std::shared_ptr<const Contents> data;
 };
 
 }
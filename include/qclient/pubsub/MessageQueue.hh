@@ -26,6 +26,7 @@
 
 #include "qclient/queueing/WaitableQueue.hh"
 #include "qclient/pubsub/MessageListener.hh"
+#include <limits>
 
 namespace qclient {
 
@@ -45,6 +46,21 @@ public:
     queue.pop_front();
   }
 
+  //----------------------------------------------------------------------------
+  // Move up to max messages from the front into out, in one go. Returns how
+  // many were moved. Don't mix with an outstanding iterator.
+  //----------------------------------------------------------------------------
+  size_t popBatch(std::vector<Message> &out, size_t max) {
+    return queue.popBatch(out, max);
+  }
+
+  //----------------------------------------------------------------------------
+  // Move everything queued so far into out.
+  //----------------------------------------------------------------------------
+  size_t drain(std::vector<Message> &out) {
+    return queue.popBatch(out, std::numeric_limits<size_t>::max());
+  }
+
   Iterator begin() {
     return queue.begin();
   }
@@ -26,25 +26,65 @@
 
 #include "qclient/pubsub/BaseSubscriber.hh"
 #include "qclient/queueing/AttachableQueue.hh"
+#include "qclient/pubsub/Message.hh"
+#include <condition_variable>
+#include <unordered_map>
 
 namespace qclient {
 
 class Subscriber;
 class Message;
 class SubscriberListener;
+class SubscriptionDispatcher;
+
+//------------------------------------------------------------------------------
+// What a bounded Subscription does with a message that doesn't fit.
+//------------------------------------------------------------------------------
+enum class OverflowPolicy {
+  // Evict the oldest queued messages to make room
+  kDropOldest,
+  // Discard the incoming message
+  kDropNewest,
+  // A message whose key is already queued replaces it, instead of queueing
+  // behind it - the limits then bound the number of distinct keys, and a
+  // new key that doesn't fit is discarded.
+  kConflate
+};
+
+//------------------------------------------------------------------------------
+// Per-subscription queue limits. 0 means no limit. Only messages that are
+// queued count - not ones handed to an attached callback right away.
+//------------------------------------------------------------------------------
+struct SubscriptionLimits {
+  size_t maxMessages = 0;
+  size_t maxBytes = 0;
+  OverflowPolicy policy = OverflowPolicy::kDropOldest;
+
+  //----------------------------------------------------------------------------
+  // kConflate only: which messages supersede each other. Defaults to the
+  // channel - handy for pattern subscriptions.
+  //----------------------------------------------------------------------------
+  std::function<std::string(const Message&)> conflationKey;
+
+  bool bounded() const {
+    return maxMessages != 0 || maxBytes != 0 || policy == OverflowPolicy::kConflate;
+  }
+};
 
 //------------------------------------------------------------------------------
 // A pub-sub subscription which collects incoming messages. Make sure to
-// consume them from time to time, or it'll blow up in space.
+// consume them from time to time, or it'll blow up in space - unless it was
+// given SubscriptionLimits.
 //
-// A Subscriber must outlive all dependent Subscriptions!
+// A Subscriber must outlive all dependent Subscriptions! Don't destroy a
+// Subscription from within its own callback.
 //------------------------------------------------------------------------------
 class Subscription {
 public:
   //----------------------------------------------------------------------------
   // Constructor
   //----------------------------------------------------------------------------
-  Subscription(Subscriber* subscriber);
+  Subscription(Subscriber* subscriber, const SubscriptionLimits &limits = {});
 
   //----------------------------------------------------------------------------
   // Destructor - notify subscriber we're shutting down
@@ -62,6 +102,18 @@ public:
   //----------------------------------------------------------------------------
   void pop_front();
 
+  //----------------------------------------------------------------------------
+  // Move up to max of the oldest messages into out, appending, in a single
+  // pass over the queue. Returns how many were moved - 0 when a callback is
+  // attached.
+  //----------------------------------------------------------------------------
+  size_t popBatch(std::vector<Message> &out, size_t max);
+
+  //----------------------------------------------------------------------------
+  // Move all queued messages into out.
+  //----------------------------------------------------------------------------
+  size_t drain(std::vector<Message> &out);
+
   //----------------------------------------------------------------------------
   // Is the queue empty?
   //----------------------------------------------------------------------------
@@ -74,13 +126,22 @@ public:
 
   //----------------------------------------------------------------------------
   // Stop behaving like a queue, forward incoming messages to the given
-  // callback.
+  // callback. With SubscriptionOptions::dispatcher set, the callback runs on
+  // the dispatcher's workers - still one message at a time, in order.
   //----------------------------------------------------------------------------
   using Callback = qclient::AttachableQueue<Message, 50>::Callback;
   void attachCallback(const Callback &cb);
 
   //----------------------------------------------------------------------------
-  // Detach callback, start behaving like a queue again
+  // Same, but receive messages in batches of up to maxBatch, from a
+  // dedicated thread. See AttachableQueue::attachBatch.
+  //----------------------------------------------------------------------------
+  using BatchCallback = qclient::AttachableQueue<Message, 50>::BatchCallback;
+  void attachBatchCallback(const BatchCallback &cb, size_t maxBatch);
+
+  //----------------------------------------------------------------------------
+  // Detach callback, start behaving like a queue again. Waits for messages
+  // already handed to the dispatcher, unless called from the callback itself.
   //----------------------------------------------------------------------------
   void detachCallback();
 
@@ -89,6 +150,19 @@ public:
   //----------------------------------------------------------------------------
   bool acknowledged() const;
 
+  //----------------------------------------------------------------------------
+  // Overflow counters: messages discarded or evicted to respect the limits,
+  // and messages superseded through conflation.
+  //----------------------------------------------------------------------------
+  uint64_t getDropped() const;
+  uint64_t getConflated() const;
+
+  //----------------------------------------------------------------------------
+  // Bytes of channel, pattern and payload currently queued - only tracked
+  // for bounded subscriptions.
+  //----------------------------------------------------------------------------
+  size_t getQueuedBytes() const;
+
 private:
   friend class Subscriber;
 
@@ -102,6 +176,68 @@ private:
   //----------------------------------------------------------------------------
   void markAcknowledged();
 
+  //----------------------------------------------------------------------------
+  // Bounded mode: admit msg according to the policy. Call with limitMtx.
+  //----------------------------------------------------------------------------
+  void admit(const Message &msg);
+
+  //----------------------------------------------------------------------------
+  // Bounded mode: account for a message leaving the queue, and swap in its
+  // conflated replacement, if any. Call with limitMtx. If the replacement
+  // arrived after the consumer last looked at front(), returns false with
+  // the replacement in msg, which the caller must queue again.
+  //----------------------------------------------------------------------------
+  bool settle(Message &msg, bool viaFront);
+
+  std::string conflationKey(const Message &msg) const;
+  bool wouldOverflow(size_t weight) const;
+
+  //----------------------------------------------------------------------------
+  // Take weight bytes out of the shared memory budget, if any - counts the
+  // message as shed if they don't fit.
+  //----------------------------------------------------------------------------
+  bool takeBudget(size_t weight);
+  void releaseBytes(size_t weight);
+
+  //----------------------------------------------------------------------------
+  // Dispatcher mode: hand msg to the worker owning its channel, or pattern,
+  // and wait until everything handed over so far has been delivered.
+  //----------------------------------------------------------------------------
+  void dispatch(const Callback &cb, Message &&msg);
+  void waitForDispatched();
+
+  //----------------------------------------------------------------------------
+  // Bounded mode state. A conflated key keeps its first message queued as a
+  // placeholder, while newer ones wait in pending.
+  //----------------------------------------------------------------------------
+  struct Pending {
+    bool replaced = false;
+    Message replacement;
+    uint64_t version = 0;
+  };
+
+  //----------------------------------------------------------------------------
+  // With a memory budget, every subscription tracks its queued bytes, as if
+  // bounded.
+  //----------------------------------------------------------------------------
+  const SubscriptionLimits limits;
+  const std::shared_ptr<MemoryBudget> budget;
+  const bool bounded;
+  mutable std::mutex limitMtx;
+  std::unordered_map<std::string, Pending> pending;
+  mutable uint64_t observedVersion = 0;
+  std::atomic<size_t> queuedBytes {0};
+  std::atomic<uint64_t> dropped {0};
+  std::atomic<uint64_t> conflated {0};
+
+  //----------------------------------------------------------------------------
+  // Dispatcher mode state: messages handed to the workers, not yet delivered
+  //----------------------------------------------------------------------------
+  const std::shared_ptr<SubscriptionDispatcher> dispatcher;
+  std::mutex dispatchMtx;
+  std::condition_variable dispatchCv;
+  size_t inFlight = 0;
+
   //----------------------------------------------------------------------------
   // Internal state
   //----------------------------------------------------------------------------
@@ -123,9 +259,15 @@ public:
 
   //----------------------------------------------------------------------------
   // Simulated mode - enable ability to feed fake messages for testing
-  // this class
+  // this class, optionally against a memory budget, or with a dispatcher
   //----------------------------------------------------------------------------
-  Subscriber();
+  explicit Subscriber(std::shared_ptr<MemoryBudget> budget = {},
+    std::shared_ptr<SubscriptionDispatcher> dispatcher = {});
+
+  //----------------------------------------------------------------------------
+  // Destructor - stop the connections before the index they dispatch into
+  //----------------------------------------------------------------------------
+  ~Subscriber();
 
   //----------------------------------------------------------------------------
   // Feed fake message - only has an effect in sumulated mode
@@ -135,13 +277,32 @@ public:
   //----------------------------------------------------------------------------
   // Subscribe to the given channel through a Subscription object
   //----------------------------------------------------------------------------
-  std::unique_ptr<Subscription> subscribe(const std::string &channel);
+  std::unique_ptr<Subscription> subscribe(const std::string &channel,
+    const SubscriptionLimits &limits = {});
 
   //----------------------------------------------------------------------------
-  // Get underlying QClient - lifetime tied to this object
+  // Subscribe to the given pattern through a Subscription object. It
+  // receives the kPatternMessages the server matched against this pattern.
+  //----------------------------------------------------------------------------
+  std::unique_ptr<Subscription> psubscribe(const std::string &pattern,
+    const SubscriptionLimits &limits = {});
+
+  //----------------------------------------------------------------------------
+  // Get underlying QClient - lifetime tied to this object. With several
+  // shards, this is the first one's.
   //----------------------------------------------------------------------------
   qclient::QClient* getQcl();
 
+  //----------------------------------------------------------------------------
+  // Number of underlying connections - 0 in simulated mode
+  //----------------------------------------------------------------------------
+  size_t getShardCount() const;
+
+  //----------------------------------------------------------------------------
+  // Which connection the given channel or pattern is subscribed through
+  //----------------------------------------------------------------------------
+  static size_t shardOf(const std::string &key, size_t shards);
+
 private:
   // Logger *logger;
   friend class Subscription;
@@ -152,22 +313,68 @@ private:
   //----------------------------------------------------------------------------
   void unsubscribe(Subscription *subscription);
 
+  //----------------------------------------------------------------------------
+  // A callback got attached to the given Subscription - resubscribe to its
+  // channel first after reconnecting
+  //----------------------------------------------------------------------------
+  void prioritize(Subscription *subscription);
+
   std::shared_ptr<MessageListener> listener;
-  std::unique_ptr<BaseSubscriber> base;
+  std::shared_ptr<MemoryBudget> memoryBudget;
+  std::shared_ptr<SubscriptionDispatcher> dispatcher;
+  std::vector<std::unique_ptr<BaseSubscriber>> shards;
+
+  //----------------------------------------------------------------------------
+  // Delivery slot of a single Subscription. Dispatch holds the slot lock
+  // while calling into the subscription, and unsubscribe clears it under the
+  // same lock: once ~Subscription returns, nothing is delivered or in flight.
+  //----------------------------------------------------------------------------
+  struct Slot {
+    Slot(Subscription *sub) : subscription(sub) {}
+
+    std::mutex mtx;
+    Subscription *subscription;
+  };
 
   //----------------------------------------------------------------------------
-  // Subscription maps
+  // Subscription index: channel (or pattern) -> immutable list of slots.
+  // Lists are copied on write, so dispatch grabs one with a single hash
+  // lookup and walks it without holding mtx.
   //----------------------------------------------------------------------------
+  using SlotList = std::vector<std::shared_ptr<Slot>>;
+  using SlotIndex = std::unordered_map<std::string, std::shared_ptr<const SlotList>>;
+
+  struct IndexEntry {
+    bool pattern;
+    std::string key;
+    std::shared_ptr<Slot> slot;
+  };
+
   std::mutex mtx;
+  SlotIndex channelIndex;
+  SlotIndex patternIndex;
+  std::unordered_map<Subscription*, IndexEntry> reverseIndex;
 
-  std::multimap<std::string, Subscription*> channelSubscriptions;
-  std::map<Subscription*, std::multimap<std::string, Subscription*>::iterator> reverseChannelSubscriptions;
+  //----------------------------------------------------------------------------
+  // Add subscription to the index, under key
+  //----------------------------------------------------------------------------
+  std::unique_ptr<Subscription> addSubscription(bool pattern, const std::string &key,
+    const SubscriptionLimits &limits);
+
+  //----------------------------------------------------------------------------
+  // Grab the current slot list for key - null if there's none
+  //----------------------------------------------------------------------------
+  std::shared_ptr<const SlotList> lookup(const SlotIndex &index, const std::string &key);
 
   //----------------------------------------------------------------------------
   // Process incoming message
   //----------------------------------------------------------------------------
   void processIncomingMessage(const Message &msg);
 
+  //----------------------------------------------------------------------------
+  // Mark the oldest unacknowledged subscription under key as acknowledged
+  //----------------------------------------------------------------------------
+  void processAcknowledgement(const SlotIndex &index, const std::string &key);
 
 };
 
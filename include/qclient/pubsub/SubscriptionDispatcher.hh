@@ -0,0 +1,99 @@
+//------------------------------------------------------------------------------
+// File: SubscriptionDispatcher.hh
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2019 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+
+#ifndef QCLIENT_SUBSCRIPTION_DISPATCHER_HH
+#define QCLIENT_SUBSCRIPTION_DISPATCHER_HH
+
+#include "qclient/AssistedThread.hh"
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace qclient {
+
+//------------------------------------------------------------------------------
+// A fixed pool of worker threads, which run Subscription callbacks instead of
+// the thread which receives messages. Work is assigned to workers by hash of
+// a key - the channel, or pattern, of a Subscription - so that everything
+// under the same key runs in order, one at a time, while independent keys
+// are processed in parallel.
+//
+// Pass it through SubscriptionOptions::dispatcher, it can be shared between
+// several Subscribers.
+//------------------------------------------------------------------------------
+class SubscriptionDispatcher {
+public:
+  using Task = std::function<void()>;
+
+  //----------------------------------------------------------------------------
+  // Constructor, spawns the given number of threads - at least one.
+  //----------------------------------------------------------------------------
+  SubscriptionDispatcher(size_t threads);
+
+  //----------------------------------------------------------------------------
+  // Destructor - runs whatever has been dispatched so far, then stops.
+  //----------------------------------------------------------------------------
+  ~SubscriptionDispatcher();
+
+  //----------------------------------------------------------------------------
+  // Number of threads in the pool
+  //----------------------------------------------------------------------------
+  size_t size() const;
+
+  //----------------------------------------------------------------------------
+  // Which worker runs tasks dispatched under the given key
+  //----------------------------------------------------------------------------
+  size_t workerOf(const std::string &key) const;
+
+  //----------------------------------------------------------------------------
+  // Queue task on the worker owning key. Never blocks on the task itself.
+  //----------------------------------------------------------------------------
+  void dispatch(const std::string &key, Task &&task);
+
+  //----------------------------------------------------------------------------
+  // Number of tasks dispatched, and not yet finished
+  //----------------------------------------------------------------------------
+  size_t getPending() const;
+
+private:
+  struct Worker {
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::deque<Task> tasks;
+    size_t running = 0;
+    AssistedThread thread;
+  };
+
+  void work(Worker *worker, ThreadAssistant &assistant);
+
+  std::vector<std::unique_ptr<Worker>> workers;
+};
+
+}
+
+#endif
@@ -26,10 +26,14 @@
 #define QCLIENT_ATTACHABLE_QUEUE_HH
 
 #include "qclient/queueing/WaitableQueue.hh"
+#include "qclient/AssistedThread.hh"
+#include <algorithm>
 #include <atomic>
 #include <mutex>
 #include <condition_variable>
 #include <functional>
+#include <limits>
+#include <vector>
 
 namespace qclient {
 
@@ -43,6 +47,12 @@ namespace qclient {
 // Sometimes we want to queue items, or process them immediatelly as we go.
 // Use this class if you want to offer your client the possibility of using
 // either.
+//
+// A third mode, batch-attached, keeps queueing items, and has a dedicated
+// thread hand them to a callback in batches, as many as have piled up while
+// the previous batch was being processed. Producers never wait for the
+// callback; a consumer which takes a lock per invocation takes it once per
+// batch.
 //------------------------------------------------------------------------------
 template<typename T, size_t BlockSize>
 class AttachableQueue {
@@ -51,6 +61,11 @@ public:
   // Callback type - function consuming a single T&&
   //----------------------------------------------------------------------------
   using Callback = std::function<void(T&&)>;
+
+  //----------------------------------------------------------------------------
+  // Batch callback type - function consuming a run of items, in order
+  //----------------------------------------------------------------------------
+  using BatchCallback = std::function<void(std::vector<T>&&)>;
   using Iterator = WaitableQueue<T, BlockSize>;
 
   //----------------------------------------------------------------------------
@@ -68,13 +83,17 @@ public:
   //----------------------------------------------------------------------------
   // Destructor
   //----------------------------------------------------------------------------
-  virtual ~AttachableQueue() {}
+  virtual ~AttachableQueue() {
+    std::lock_guard<std::mutex> lock(mtx);
+    stopBatchDelivery();
+  }
 
   //----------------------------------------------------------------------------
-  // Construct an item
+  // Construct an item. Returns true if it was queued, false if it was handed
+  // to the callback right away.
   //----------------------------------------------------------------------------
   template<typename... Args>
-  void emplace_back(Args&&... args) {
+  bool emplace_back(Args&&... args) {
     std::lock_guard<std::mutex> lock(mtx);
 
     if(queue) {
@@ -82,13 +101,14 @@ public:
       // Unattached mode
       //------------------------------------------------------------------------
       queue->emplace_back(std::forward<Args>(args)...);
+      return true;
     }
-    else {
-      //------------------------------------------------------------------------
-      // Attached mode, forward to callback
-      //------------------------------------------------------------------------
-      callback(T(std::forward<Args>(args)...));
-    }
+
+    //--------------------------------------------------------------------------
+    // Attached mode, forward to callback
+    //--------------------------------------------------------------------------
+    callback(T(std::forward<Args>(args)...));
+    return false;
   }
 
   //----------------------------------------------------------------------------
@@ -101,9 +121,21 @@ public:
   }
 
   void pop_front() {
+    std::lock_guard<std::mutex> lock(popMtx);
     queue->pop_front();
   }
 
+  //----------------------------------------------------------------------------
+  // Pop up to max queued items into out. Returns 0 in attached mode, where
+  // nothing is queued. Safe against the batch delivery thread - in
+  // batch-attached mode, whatever is popped here is never delivered.
+  //----------------------------------------------------------------------------
+  size_t popBatch(std::vector<T> &out, size_t max) {
+    std::lock_guard<std::mutex> lock(popMtx);
+    if(!queue) return 0u;
+    return queue->popBatch(out, max);
+  }
+
   T& front() {
     return queue->front();
   }
@@ -129,12 +161,15 @@ public:
   //----------------------------------------------------------------------------
   void attach(const Callback &cb) {
     std::lock_guard<std::mutex> lock(mtx);
+    stopBatchDelivery();
     callback = cb;
 
     if(queue) {
-      while(queue->size() != 0u) {
-        callback(std::move(queue->front()));
-        queue->pop_front();
+      std::vector<T> backlog;
+      popBatch(backlog, std::numeric_limits<size_t>::max());
+
+      for(T &item : backlog) {
+        callback(std::move(item));
       }
 
       queue.reset();
@@ -146,6 +181,7 @@ public:
   //----------------------------------------------------------------------------
   void detach() {
     std::lock_guard<std::mutex> lock(mtx);
+    stopBatchDelivery();
     callback = {};
 
     if(!queue) {
@@ -153,10 +189,83 @@ public:
     }
   }
 
+  //----------------------------------------------------------------------------
+  // Attach batch callback - replace any existing callback. Each invocation
+  // receives between 1 and maxBatch items, including any backlog queued
+  // before attaching. Invocations happen one at a time, on a separate
+  // thread.
+  //
+  // Don't call attach, detach, or attachBatch from within the batch
+  // callback itself: those wait for the delivery thread to finish.
+  //----------------------------------------------------------------------------
+  void attachBatch(const BatchCallback &cb, size_t maxBatch) {
+    std::lock_guard<std::mutex> lock(mtx);
+    stopBatchDelivery();
+    callback = {};
+
+    if(!queue) {
+      queue.reset(new WaitableQueue<T, BlockSize>());
+    }
+
+    batchCallback = cb;
+    deliveryThread.reset(&AttachableQueue<T, BlockSize>::deliverBatches, this,
+      std::max<size_t>(maxBatch, 1u));
+  }
+
 private:
+  //----------------------------------------------------------------------------
+  // Stop the delivery thread, if running - anything it hasn't picked up
+  // stays queued. Call with mtx held.
+  //----------------------------------------------------------------------------
+  void stopBatchDelivery() {
+    if(!batchCallback) {
+      return;
+    }
+
+    deliveryThread.stop();
+    queue->setBlockingMode(false);
+    deliveryThread.join();
+    queue->setBlockingMode(true);
+    batchCallback = {};
+  }
+
+  //----------------------------------------------------------------------------
+  // Delivery thread: Take every item that has arrived by now, up to
+  // maxBatch, or block until at least one is there. Items are popped under
+  // popMtx, so others may pop concurrently - the iterator we block on is
+  // only used for its sequence number, never dereferenced.
+  //----------------------------------------------------------------------------
+  void deliverBatches(size_t maxBatch, ThreadAssistant &assistant) {
+    std::vector<T> batch;
+
+    while(!assistant.terminationRequested()) {
+      typename WaitableQueue<T, BlockSize>::Iterator edge;
+
+      {
+        std::lock_guard<std::mutex> lock(popMtx);
+        queue->popBatch(batch, maxBatch);
+
+        if(batch.empty()) {
+          edge = queue->begin();
+        }
+      }
+
+      if(batch.empty()) {
+        edge.blockUntilItemHasArrived();
+        continue;
+      }
+
+      batchCallback(std::move(batch));
+      batch.clear();
+    }
+  }
+
   std::mutex mtx;
+  std::mutex popMtx;
   std::unique_ptr<WaitableQueue<T, BlockSize>> queue;
   Callback callback;
+  BatchCallback batchCallback;
+  AssistedThread deliveryThread;
 };
 
 }
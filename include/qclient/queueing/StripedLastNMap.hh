@@ -0,0 +1,164 @@
+//------------------------------------------------------------------------------
+// File: StripedLastNMap.hh
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#ifndef QCLIENT_STRIPED_LAST_N_MAP_HH
+#define QCLIENT_STRIPED_LAST_N_MAP_HH
+
+#include "RingBuffer.hh"
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+
+namespace qclient {
+
+//------------------------------------------------------------------------------
+// Same as LastNMap, but meant for many concurrent readers and writers: The
+// contents are spread over independently locked hash map shards, and
+// queries only take a shared lock on one of them.
+//
+// Writers still agree on the order of insertion through the ring buffer,
+// but only hold its lock long enough to claim a slot - eviction and
+// insertion happen afterwards, on the respective shards. Reference counts
+// are signed for that reason: an eviction may land before the insertion it
+// undoes, and the two still cancel out.
+//
+// Thread-safe.
+//------------------------------------------------------------------------------
+template<typename K, typename V, typename Hash = std::hash<K>>
+class StripedLastNMap {
+public:
+  static constexpr size_t kDefaultShards = 16;
+
+  //----------------------------------------------------------------------------
+  // Constructor
+  //----------------------------------------------------------------------------
+  StripedLastNMap(size_t n, size_t shards = kDefaultShards)
+  : mRingBuffer(n), mShardCount(std::max<size_t>(shards, 1u)),
+    mShards(new Shard[mShardCount]) {}
+
+  //----------------------------------------------------------------------------
+  // Does the given element exist?
+  //----------------------------------------------------------------------------
+  bool query(const K& key, V& out) const {
+    const Shard &shard = getShard(key);
+    std::shared_lock<std::shared_timed_mutex> lock(shard.mutex);
+    auto it = shard.contents.find(key);
+
+    if(it == shard.contents.end() || it->second.count <= 0) {
+      return false;
+    }
+
+    out = it->second.value;
+    return true;
+  }
+
+  //----------------------------------------------------------------------------
+  // Emplace
+  //----------------------------------------------------------------------------
+  void insert(const K &k, const V &v) {
+    K evicted;
+    bool mustEvict = false;
+
+    {
+      std::lock_guard<std::mutex> lock(mRingMutex);
+      if(mRingBuffer.hasRolledOver()) {
+        evicted = std::move(mRingBuffer.getNextToEvict());
+        mustEvict = true;
+      }
+
+      mRingBuffer.emplace_back(k);
+    }
+
+    if(mustEvict) {
+      adjust(evicted, -1, nullptr);
+    }
+
+    adjust(k, +1, &v);
+  }
+
+private:
+  struct InternalItem {
+    int64_t count = 0;
+    V value;
+  };
+
+  struct Shard {
+    mutable std::shared_timed_mutex mutex;
+    std::unordered_map<K, InternalItem, Hash> contents;
+  };
+
+  //----------------------------------------------------------------------------
+  // Pick shard - mix the hash, since std::hash is the identity for integers
+  //----------------------------------------------------------------------------
+  size_t shardIndex(const K &key) const {
+    uint64_t h = static_cast<uint64_t>(mHash(key)) * 0x9E3779B97F4A7C15ull;
+    return (h >> 32) % mShardCount;
+  }
+
+  Shard& getShard(const K &key) {
+    return mShards[shardIndex(key)];
+  }
+
+  const Shard& getShard(const K &key) const {
+    return mShards[shardIndex(key)];
+  }
+
+  //----------------------------------------------------------------------------
+  // Change reference count of the given key, dropping it once it reaches
+  // zero. Sets the value too, if given.
+  //----------------------------------------------------------------------------
+  void adjust(const K &key, int64_t delta, const V *value) {
+    Shard &shard = getShard(key);
+    std::unique_lock<std::shared_timed_mutex> lock(shard.mutex);
+
+    InternalItem &item = shard.contents[key];
+    item.count += delta;
+
+    if(item.count == 0) {
+      shard.contents.erase(key);
+    }
+    else if(value) {
+      item.value = *value;
+    }
+  }
+
+  Hash mHash;
+
+  std::mutex mRingMutex;
+  RingBuffer<K> mRingBuffer;
+
+  const size_t mShardCount;
+  std::unique_ptr<Shard[]> mShards;
+};
+
+template<typename K, typename V, typename Hash>
+constexpr size_t StripedLastNMap<K, V, Hash>::kDefaultShards;
+
+}
+
+#endif
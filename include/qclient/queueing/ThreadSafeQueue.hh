@@ -24,9 +24,14 @@
 #ifndef QCLIENT_THREAD_SAFE_QUEUE_H
 #define QCLIENT_THREAD_SAFE_QUEUE_H
 
-#include <array>
+#include <algorithm>
+#include <atomic>
 #include <memory>
 #include <mutex>
+#include <type_traits>
+#include <vector>
+#include "qclient/utils/AllocationAccounting.hh"
+#include "qclient/utils/MemoryResource.hh"
 
 namespace qclient {
 
@@ -39,7 +44,17 @@ namespace qclient {
 // - Progressing the iterator should be very fast, and lockless.
 //
 // The items are laid out in memory inside a singly-linked list composed of
-// large memory chunks.
+// large memory chunks. Drained chunks are kept on a small free-list, up to
+// a configurable limit, so that steady-state queueing doesn't keep
+// allocating and freeing them.
+//
+// Chunks start out small, and double in size up to a maximum - BlockSize,
+// unless changed through setBlockSizes - so that an idle queue only costs a
+// few items' worth of memory.
+//
+// Producer and consumer state live on separate cache lines, so that pushing
+// and popping from different cores doesn't bounce the same line back and
+// forth. size() reads both sequence numbers without taking either mutex.
 //
 // This class does no error checking that it is being used correctly, and will
 // blow up if:
@@ -48,21 +63,70 @@ namespace qclient {
 //   assumed to be valid.
 //------------------------------------------------------------------------------
 
-template<typename T, size_t BlockSize>
+template<typename T>
+struct MemoryBlock;
+
+template<typename T>
+struct MemoryBlockDeleter {
+  void operator()(MemoryBlock<T> *block) const {
+    MemoryBlock<T>::destroy(block);
+  }
+};
+
+//------------------------------------------------------------------------------
+// A block and its storage come out of a single allocation from the given
+// memory resource, and go back to the same one.
+//------------------------------------------------------------------------------
+template<typename T>
 struct MemoryBlock {
-  std::unique_ptr<MemoryBlock> next;
+  using Ptr = std::unique_ptr<MemoryBlock, MemoryBlockDeleter<T>>;
+
+  static Ptr create(size_t cap, MemoryResource *resource) {
+    void *memory = resource->allocate(footprint(cap), kAlignment);
+    return Ptr(new (memory) MemoryBlock(cap, resource));
+  }
+
+  static void destroy(MemoryBlock *block) {
+    MemoryResource *resource = block->resource;
+    size_t bytes = footprint(block->capacity);
+
+    block->~MemoryBlock();
+    resource->deallocate(block, bytes, kAlignment);
+  }
+
+  static size_t footprint(size_t cap) {
+    return storageOffset() + cap * sizeof(Storage);
+  }
+
+  Ptr next;
+  const size_t capacity;
 
   T* getObject(size_t position) {
-    return reinterpret_cast<T*>(&contents[sizeof(T)*position]);
+    Storage *storage = reinterpret_cast<Storage*>(reinterpret_cast<char*>(this) + storageOffset());
+    return reinterpret_cast<T*>(&storage[position]);
   }
 
 private:
-  std::array<unsigned char, sizeof(T)*BlockSize> contents;
+  using Storage = typename std::aligned_storage<sizeof(T), alignof(T)>::type;
+  static constexpr size_t kAlignment = std::max(alignof(Ptr), alignof(Storage));
+
+  static constexpr size_t storageOffset() {
+    return (sizeof(MemoryBlock) + alignof(Storage) - 1) & ~(alignof(Storage) - 1);
+  }
+
+  MemoryBlock(size_t cap, MemoryResource *res)
+  : capacity(cap), resource(res) {}
+
+  MemoryResource *const resource;
 };
 
 template<typename T, size_t BlockSize>
 class ThreadSafeQueue {
 public:
+  static constexpr size_t kDefaultSpareBlocks = 2;
+  static constexpr size_t kDefaultInitialBlockSize = 16;
+  static constexpr size_t kCacheLineSize = 64;
+
   ThreadSafeQueue() {
     reset();
   }
@@ -75,7 +139,7 @@ public:
   // Reset all contents, and start sequence numbers from 0 again.
   //----------------------------------------------------------------------------
   void reset() {
-    while(nextSequenceNumber != frontSequenceNumber) {
+    while(nextSequenceNumber.load() != frontSequenceNumber.load()) {
       pop_front();
     }
 
@@ -85,16 +149,60 @@ public:
     firstBlockNextToPop = 0;
     lastBlockNextPos = 0;
 
-    root.reset();
+    if(root) {
+      recycleBlock(std::move(root));
+    }
     lastBlock = nullptr;
 
     //--------------------------------------------------------------------------
-    // Allocate root.
+    // Allocate root - start small again.
     //--------------------------------------------------------------------------
-    root = std::unique_ptr<MemoryBlock<T, BlockSize>>(new MemoryBlock<T, BlockSize>());
+    nextBlockSize = initialBlockSize;
+    root = obtainBlock();
     lastBlock = root.get();
   }
 
+  //----------------------------------------------------------------------------
+  // Set the size of the first block, and the maximum size later blocks grow
+  // to. Takes effect on the next block allocated.
+  //----------------------------------------------------------------------------
+  void setBlockSizes(size_t initial, size_t maximum) {
+    std::lock_guard<std::mutex> lock(pushMutex);
+    maxBlockSize = std::max<size_t>(maximum, 1u);
+    initialBlockSize = std::min(std::max<size_t>(initial, 1u), maxBlockSize);
+    nextBlockSize = std::min(std::max(nextBlockSize, initialBlockSize), maxBlockSize);
+  }
+
+  //----------------------------------------------------------------------------
+  // Set how many drained blocks to hold on to for reuse. 0 means every
+  // drained block is freed right away.
+  //----------------------------------------------------------------------------
+  void setSpareBlockLimit(size_t limit) {
+    std::lock_guard<std::mutex> lock(spareMutex);
+    spareLimit = limit;
+
+    while(spareCount > spareLimit) {
+      typename MemoryBlock<T>::Ptr block = std::move(spareBlocks);
+      spareBlocks = std::move(block->next);
+      spareCount--;
+    }
+  }
+
+  //----------------------------------------------------------------------------
+  // Allocate blocks out of the given memory resource from now on, instead of
+  // the global heap - it must be thread-safe, and outlive the queue. Blocks
+  // allocated earlier go back to wherever they came from.
+  //----------------------------------------------------------------------------
+  void setMemoryResource(MemoryResource *res) {
+    std::lock_guard<std::mutex> lock(pushMutex);
+    resource = res ? res : newDeleteResource();
+  }
+
+  size_t getSpareBlocks() const {
+    std::lock_guard<std::mutex> lock(spareMutex);
+    return spareCount;
+  }
+
   //----------------------------------------------------------------------------
   // Constructs an item inside the queue, and returns that item's unique
   // sequence number.
@@ -106,11 +214,37 @@ public:
     new (lastBlock->getObject(lastBlockNextPos)) T(std::forward<Args>(args)...);
     lastBlockNextPos++;
 
-    if(lastBlockNextPos == BlockSize) {
+    if(lastBlockNextPos == lastBlock->capacity) {
       allocateBlock();
     }
 
-    return nextSequenceNumber++;
+    int64_t seq = nextSequenceNumber.load(std::memory_order_relaxed);
+    nextSequenceNumber.store(seq + 1, std::memory_order_release);
+    return seq;
+  }
+
+  //----------------------------------------------------------------------------
+  // Constructs count consecutive items under a single lock acquisition, by
+  // calling construct(memory, i) for each - which must placement-new a T
+  // into memory. Returns the sequence number of the last item, count must
+  // not be zero.
+  //----------------------------------------------------------------------------
+  template<typename Constructor>
+  int64_t emplace_many(size_t count, Constructor &&construct) {
+    std::lock_guard<std::mutex> lock(pushMutex);
+
+    for(size_t i = 0; i < count; i++) {
+      construct(lastBlock->getObject(lastBlockNextPos), i);
+      lastBlockNextPos++;
+
+      if(lastBlockNextPos == lastBlock->capacity) {
+        allocateBlock();
+      }
+    }
+
+    int64_t seq = nextSequenceNumber.load(std::memory_order_relaxed);
+    nextSequenceNumber.store(seq + count, std::memory_order_release);
+    return seq + count - 1;
   }
 
   //----------------------------------------------------------------------------
@@ -134,18 +268,46 @@ public:
     root->getObject(firstBlockNextToPop)->~T();
 
     firstBlockNextToPop++;
-    if(firstBlockNextToPop == BlockSize) {
+    if(firstBlockNextToPop == root->capacity) {
       removeRoot();
     }
 
-    return frontSequenceNumber++;
+    int64_t seq = frontSequenceNumber.load(std::memory_order_relaxed);
+    frontSequenceNumber.store(seq + 1, std::memory_order_release);
+    return seq;
+  }
+
+  //----------------------------------------------------------------------------
+  // Move up to max items from the front into out, appending, under a single
+  // acquisition of popMutex. Returns how many were moved.
+  //----------------------------------------------------------------------------
+  size_t popBatch(std::vector<T> &out, size_t max) {
+    std::lock_guard<std::mutex> lock(popMutex);
+
+    int64_t seq = frontSequenceNumber.load(std::memory_order_relaxed);
+    size_t count = std::min<size_t>(max, nextSequenceNumber.load(std::memory_order_acquire) - seq);
+    out.reserve(out.size() + count);
+
+    for(size_t i = 0; i < count; i++) {
+      T* item = root->getObject(firstBlockNextToPop);
+      out.emplace_back(std::move(*item));
+      item->~T();
+
+      firstBlockNextToPop++;
+      if(firstBlockNextToPop == root->capacity) {
+        removeRoot();
+      }
+    }
+
+    frontSequenceNumber.store(seq + count, std::memory_order_release);
+    return count;
   }
 
   class Iterator {
   public:
     Iterator() {}
 
-    Iterator(MemoryBlock<T, BlockSize> *block, size_t pos, int64_t seq)
+    Iterator(MemoryBlock<T> *block, size_t pos, int64_t seq)
     : currentBlock(block), nextPos(pos), sequenceNumber(seq) {}
 
     T& item() {
@@ -163,14 +325,14 @@ public:
     void next() {
       sequenceNumber++;
       nextPos++;
-      if(nextPos == BlockSize) {
+      if(nextPos == currentBlock->capacity) {
         nextPos = 0;
         currentBlock = currentBlock->next.get();
       }
     }
 
   private:
-    MemoryBlock<T, BlockSize> *currentBlock = nullptr;
+    MemoryBlock<T> *currentBlock = nullptr;
     size_t nextPos = -1;
     int64_t sequenceNumber;
   };
@@ -185,10 +347,15 @@ public:
     return Iterator(root.get(), firstBlockNextToPop, frontSequenceNumber);
   }
 
+  //----------------------------------------------------------------------------
+  // Lock-free, and only a snapshot if there are concurrent pushes or pops.
+  // Reading the front first means the result can never go negative: the back
+  // only ever moves forward, and is always past the front we saw.
+  //----------------------------------------------------------------------------
   size_t size() const {
-    std::lock_guard<std::mutex> lock(pushMutex);
-    std::lock_guard<std::mutex> lock2(popMutex);
-    return nextSequenceNumber - frontSequenceNumber;
+    int64_t front = frontSequenceNumber.load(std::memory_order_acquire);
+    int64_t next = nextSequenceNumber.load(std::memory_order_acquire);
+    return next - front;
   }
 
   bool empty() const {
@@ -196,8 +363,7 @@ public:
   }
 
   int64_t getNextSequenceNumber() const {
-    std::lock_guard<std::mutex> lock(pushMutex);
-    return nextSequenceNumber;
+    return nextSequenceNumber.load(std::memory_order_acquire);
   }
 
 private:
@@ -205,7 +371,8 @@ private:
   // Remove the root node, and make its child the root.
   //----------------------------------------------------------------------------
   void removeRoot() {
-    std::unique_ptr<MemoryBlock<T, BlockSize>> child = std::move(root->next);
+    typename MemoryBlock<T>::Ptr child = std::move(root->next);
+    recycleBlock(std::move(root));
     root = std::move(child);
     firstBlockNextToPop = 0;
   }
@@ -214,24 +381,90 @@ private:
   // Allocate new block.
   //----------------------------------------------------------------------------
   void allocateBlock() {
-    lastBlock->next = std::unique_ptr<MemoryBlock<T, BlockSize>>(new MemoryBlock<T, BlockSize>());
+    lastBlock->next = obtainBlock();
     lastBlockNextPos = 0;
     lastBlock = lastBlock->next.get();
   }
 
-  std::unique_ptr<MemoryBlock<T, BlockSize>> root;
-  MemoryBlock<T, BlockSize> *lastBlock;
+  //----------------------------------------------------------------------------
+  // Take a block off the free-list, or allocate one if it's empty. Pushers
+  // and poppers may both end up here, hence the separate mutex - taken only
+  // once per block.
+  //
+  // Spares are reused as long as they're at least as large as the next
+  // block should be - the queue grows into them, but never shrinks into them.
+  //----------------------------------------------------------------------------
+  typename MemoryBlock<T>::Ptr obtainBlock() {
+    size_t wanted = nextBlockSize;
+    nextBlockSize = std::min(nextBlockSize * 2, maxBlockSize);
+
+    {
+      std::lock_guard<std::mutex> lock(spareMutex);
+      if(spareBlocks && spareBlocks->capacity >= wanted) {
+        typename MemoryBlock<T>::Ptr block = std::move(spareBlocks);
+        spareBlocks = std::move(block->next);
+        spareCount--;
+        return block;
+      }
+    }
 
-  size_t firstBlockNextToPop;
+    AllocationAccounting::record(AllocationCategory::kQueueing, MemoryBlock<T>::footprint(wanted));
+    return MemoryBlock<T>::create(wanted, resource);
+  }
+
+  //----------------------------------------------------------------------------
+  // Give a drained block back - kept for reuse, unless we have enough spares.
+  // Only full-sized blocks are worth keeping: Smaller ones are cheap, and
+  // only ever show up while the queue is still growing.
+  //----------------------------------------------------------------------------
+  void recycleBlock(typename MemoryBlock<T>::Ptr block) {
+    std::lock_guard<std::mutex> lock(spareMutex);
+    if(spareCount < spareLimit && block->capacity >= maxBlockSize) {
+      block->next = std::move(spareBlocks);
+      spareBlocks = std::move(block);
+      spareCount++;
+    }
+  }
+
+  //----------------------------------------------------------------------------
+  // Producer side - only touched by emplace_back, and block sizing.
+  //----------------------------------------------------------------------------
+  alignas(kCacheLineSize) mutable std::mutex pushMutex;
+  MemoryBlock<T> *lastBlock;
   size_t lastBlockNextPos;
+  std::atomic<int64_t> nextSequenceNumber {0};
+
+  size_t maxBlockSize = BlockSize;
+  size_t initialBlockSize = std::min(kDefaultInitialBlockSize, BlockSize);
+  size_t nextBlockSize = initialBlockSize;
+  MemoryResource *resource = newDeleteResource();
 
-  int64_t nextSequenceNumber = 0;
-  int64_t frontSequenceNumber = 0;
+  //----------------------------------------------------------------------------
+  // Consumer side - only touched by front, pop_front, and begin.
+  //----------------------------------------------------------------------------
+  alignas(kCacheLineSize) mutable std::mutex popMutex;
+  typename MemoryBlock<T>::Ptr root;
+  size_t firstBlockNextToPop;
+  std::atomic<int64_t> frontSequenceNumber {0};
 
-  mutable std::mutex pushMutex;
-  mutable std::mutex popMutex;
+  //----------------------------------------------------------------------------
+  // Free-list, shared by both - taken once per block.
+  //----------------------------------------------------------------------------
+  alignas(kCacheLineSize) mutable std::mutex spareMutex;
+  typename MemoryBlock<T>::Ptr spareBlocks;
+  size_t spareCount = 0;
+  size_t spareLimit = kDefaultSpareBlocks;
 };
 
+template<typename T, size_t BlockSize>
+constexpr size_t ThreadSafeQueue<T, BlockSize>::kDefaultSpareBlocks;
+
+template<typename T, size_t BlockSize>
+constexpr size_t ThreadSafeQueue<T, BlockSize>::kDefaultInitialBlockSize;
+
+template<typename T, size_t BlockSize>
+constexpr size_t ThreadSafeQueue<T, BlockSize>::kCacheLineSize;
+
 }
 
 #endif
@@ -25,9 +25,8 @@
 #define QCLIENT_WAITABLE_QUEUE_H
 
 #include "qclient/queueing/ThreadSafeQueue.hh"
+#include "qclient/utils/Futex.hh"
 #include <atomic>
-#include <mutex>
-#include <condition_variable>
 
 namespace qclient {
 
@@ -44,6 +43,11 @@ namespace qclient {
 // Semantics are still the same: Readers almost never block each other (only
 // obtainers of the long-lived iterator block each other), and writers only
 // block other writers.
+//
+// Producers never issue a syscall, unless a consumer is actually parked
+// waiting for items: Publishing a new item is a single atomic update of
+// highestSequence. A waiting consumer can optionally spin for a while before
+// parking on a futex, trading CPU for wake-up latency.
 //------------------------------------------------------------------------------
 
 template<typename T, size_t BlockSize>
@@ -57,13 +61,49 @@ public:
   }
 
   //----------------------------------------------------------------------------
-  // Constructs an item inside the queue.
+  // Constructs an item inside the queue, returns its sequence number.
   //----------------------------------------------------------------------------
   template<typename... Args>
-  void emplace_back(Args&&... args) {
-    std::lock_guard<std::mutex> lock(mtx);
-    highestSequence = queue.emplace_back(std::forward<Args>(args)...);
-    cv.notify_one();
+  int64_t emplace_back(Args&&... args) {
+    int64_t seq = queue.emplace_back(std::forward<Args>(args)...);
+    publish(seq);
+    return seq;
+  }
+
+  //----------------------------------------------------------------------------
+  // Constructs count items in one go, see ThreadSafeQueue::emplace_many. The
+  // consumer is woken up once, for all of them. Returns the sequence number
+  // of the last item, or -1 if there were none.
+  //----------------------------------------------------------------------------
+  template<typename Constructor>
+  int64_t emplace_many(size_t count, Constructor &&construct) {
+    if(count == 0) return -1;
+    int64_t seq = queue.emplace_many(count, std::forward<Constructor>(construct));
+    publish(seq);
+    return seq;
+  }
+
+  //----------------------------------------------------------------------------
+  // How many times a consumer checks for new items before parking. 0 parks
+  // right away, which is best unless the consumer thread has a core to
+  // itself.
+  //----------------------------------------------------------------------------
+  void setSpinIterations(size_t iterations) {
+    spinIterations = iterations;
+  }
+
+  //----------------------------------------------------------------------------
+  // Block sizing, see ThreadSafeQueue
+  //----------------------------------------------------------------------------
+  void setBlockSizes(size_t initial, size_t maximum) {
+    queue.setBlockSizes(initial, maximum);
+  }
+
+  //----------------------------------------------------------------------------
+  // Block allocation, see ThreadSafeQueue
+  //----------------------------------------------------------------------------
+  void setMemoryResource(MemoryResource *resource) {
+    queue.setMemoryResource(resource);
   }
 
   //----------------------------------------------------------------------------
@@ -80,6 +120,14 @@ public:
     queue.pop_front();
   }
 
+  //----------------------------------------------------------------------------
+  // Pop up to max items from the front into out, in one go. Don't combine
+  // with an outstanding iterator, same as pop_front.
+  //----------------------------------------------------------------------------
+  size_t popBatch(std::vector<T> &out, size_t max) {
+    return queue.popBatch(out, max);
+  }
+
   //----------------------------------------------------------------------------
   // Returns a reference to the top item.
   //----------------------------------------------------------------------------
@@ -105,9 +153,8 @@ public:
   // incoming items.
   //----------------------------------------------------------------------------
   void setBlockingMode(bool value) {
-    std::unique_lock<std::mutex> lock(mtx);
     blockingMode = value;
-    cv.notify_one();
+    wakeConsumer();
   }
 
   class Iterator {
@@ -146,6 +193,17 @@ public:
       return queue->highestSequence >= iterator.seq();
     }
 
+    //--------------------------------------------------------------------------
+    // How many items, starting from the one we're pointing to, have arrived
+    // and are safe to access? Reads the edge of the queue only once, so
+    // consuming a run of items costs a single atomic load.
+    //--------------------------------------------------------------------------
+    size_t itemsAvailable() {
+      int64_t highest = queue->highestSequence;
+      if(highest < iterator.seq()) return 0u;
+      return highest - iterator.seq() + 1;
+    }
+
     //--------------------------------------------------------------------------
     // After getting false from itemHasArrived, call this to sleep until there's
     // some item to process.
@@ -155,11 +213,31 @@ public:
     // itemHasArrived again.
     //--------------------------------------------------------------------------
     void blockUntilItemHasArrived() {
-      std::unique_lock<std::mutex> lock(queue->mtx);
+      for(size_t i = 0; i < queue->spinIterations; i++) {
+        if(!mustWait()) {
+          return;
+        }
 
-      while(queue->blockingMode && iterator.seq() > queue->highestSequence) {
-        queue->cv.wait(lock);
+        cpuRelax();
       }
+
+      //------------------------------------------------------------------------
+      // Register as waiter first, then read the wakeup counter, then check:
+      // Any producer publishing after our check sees us waiting, and bumps
+      // the counter - making futexWait return immediately if we're late.
+      //------------------------------------------------------------------------
+      queue->waiters++;
+
+      while(true) {
+        uint32_t epoch = queue->wakeups.load();
+        if(!mustWait()) {
+          break;
+        }
+
+        futexWait(&queue->wakeups, epoch);
+      }
+
+      queue->waiters--;
     }
 
     //--------------------------------------------------------------------------
@@ -185,6 +263,10 @@ public:
     }
 
   private:
+    bool mustWait() {
+      return queue->blockingMode && iterator.seq() > queue->highestSequence;
+    }
+
     WaitableQueue<T, BlockSize> *queue;
     typename ThreadSafeQueue<T, BlockSize>::Iterator iterator;
   };
@@ -205,12 +287,40 @@ public:
   }
 
 private:
+  //----------------------------------------------------------------------------
+  // Make every item up to seq visible to the consumer.
+  //----------------------------------------------------------------------------
+  void publish(int64_t seq) {
+    //--------------------------------------------------------------------------
+    // Concurrent producers may publish out of order - only ever move
+    // highestSequence forward. Every item up to seq is already constructed,
+    // as ThreadSafeQueue hands out sequence numbers in construction order.
+    //--------------------------------------------------------------------------
+    int64_t prev = highestSequence.load();
+    while(prev < seq && !highestSequence.compare_exchange_weak(prev, seq)) {}
+
+    //--------------------------------------------------------------------------
+    // Wake up the consumer only if it's parked. The consumer registers itself
+    // in waiters before checking highestSequence, so either it sees our item,
+    // or we see it waiting.
+    //--------------------------------------------------------------------------
+    if(waiters.load() != 0) {
+      wakeConsumer();
+    }
+  }
+
+  void wakeConsumer() {
+    wakeups++;
+    futexWakeAll(&wakeups);
+  }
+
   friend class WaitableQueue<T, BlockSize>::Iterator;
   ThreadSafeQueue<T, BlockSize> queue;
   std::atomic<int64_t> highestSequence {-1};
-  std::mutex mtx;
-  std::condition_variable cv;
   std::atomic<bool> blockingMode {true};
+  std::atomic<int64_t> waiters {0};
+  std::atomic<uint32_t> wakeups {0};
+  std::atomic<size_t> spinIterations {0};
 };
 
 }
@@ -34,6 +34,7 @@ class Subscription;
 class QClient;
 class Message;
 class SteadyClock;
+class CommunicatorBatcher;
 
 //------------------------------------------------------------------------------
 // Convenience class for point-to-point request / response messaging between
@@ -67,6 +68,16 @@ public:
   //----------------------------------------------------------------------------
   ~Communicator();
 
+  //----------------------------------------------------------------------------
+  // Pack outgoing requests and retries into batches of up to maxBytes, sent
+  // at the latest maxDelay after they were issued. Replies sent in batches
+  // are understood regardless.
+  //
+  // Only enable once every listener on the channel understands batches!
+  // Call before issuing any requests.
+  //----------------------------------------------------------------------------
+  void enableBatching(size_t maxBytes, std::chrono::milliseconds maxDelay);
+
   //----------------------------------------------------------------------------
   // Issue a request on the given channel, retrieve assigned ID
   //----------------------------------------------------------------------------
@@ -92,6 +103,11 @@ public:
   std::chrono::milliseconds getSleepUntilRetry() const;
 
 private:
+  //----------------------------------------------------------------------------
+  // Maximum number of retries the background thread publishes per pass
+  //----------------------------------------------------------------------------
+  static constexpr size_t kMaxRetryBatch = 1024;
+
   //----------------------------------------------------------------------------
   // Cleanup and retry thread
   //----------------------------------------------------------------------------
@@ -102,6 +118,11 @@ private:
   //----------------------------------------------------------------------------
   void processIncoming(Message &&msg);
 
+  //----------------------------------------------------------------------------
+  // Send out a serialized request, batched or not
+  //----------------------------------------------------------------------------
+  void publishRequest(const std::string &channel, std::string &&payload);
+
   Subscriber* mSubscriber;
   std::string mChannel;
   SteadyClock *mClock;
@@ -113,6 +134,7 @@ private:
   std::chrono::milliseconds mRetryInterval;
   std::chrono::milliseconds mHardDeadline;
 
+  std::unique_ptr<CommunicatorBatcher> mBatcher;
   AssistedThread mThread;
 
 };
@@ -28,7 +28,7 @@
 
 #include "qclient/queueing/AttachableQueue.hh"
 #include "qclient/queueing/LastNSet.hh"
-#include "qclient/queueing/LastNMap.hh"
+#include "qclient/queueing/StripedLastNMap.hh"
 
 #include <string>
 #include <memory>
@@ -40,6 +40,7 @@ class Subscription;
 class Message;
 class CommunicatorListener;
 class QClient;
+class CommunicatorBatcher;
 
 //------------------------------------------------------------------------------
 // CommunicatorRequest
@@ -89,6 +90,16 @@ public:
   //----------------------------------------------------------------------------
   ~CommunicatorListener();
 
+  //----------------------------------------------------------------------------
+  // Pack outgoing replies into batches of up to maxBytes, sent at the latest
+  // maxDelay after the reply. Requests sent in batches are understood
+  // regardless.
+  //
+  // Only enable once every Communicator on the channel understands batches!
+  // Call before any requests arrive.
+  //----------------------------------------------------------------------------
+  void enableBatching(size_t maxBytes, std::chrono::milliseconds maxDelay);
+
   //----------------------------------------------------------------------------
   // Send reply
   //----------------------------------------------------------------------------
@@ -100,13 +111,25 @@ private:
   //----------------------------------------------------------------------------
   void processIncoming(Message &&msg);
 
+  //----------------------------------------------------------------------------
+  // Process a single incoming request
+  //----------------------------------------------------------------------------
+  void processRequest(const std::string &uuid, const std::string &contents);
+
+  //----------------------------------------------------------------------------
+  // Send out a serialized reply, batched or not
+  //----------------------------------------------------------------------------
+  void publishReply(std::string &&payload);
+
   Subscriber *mSubscriber;
   QClient *mQcl;
   std::string mChannel;
   std::unique_ptr<Subscription> mSubscription;
 
   LastNSet<std::string> mAlreadyReceived;
-  LastNMap<std::string, CommunicatorReply> mCachedReplies;
+  StripedLastNMap<std::string, CommunicatorReply> mCachedReplies;
+
+  std::unique_ptr<CommunicatorBatcher> mBatcher;
 };
 
 
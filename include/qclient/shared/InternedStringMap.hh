@@ -0,0 +1,111 @@
+//------------------------------------------------------------------------------
+// File: InternedStringMap.hh
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#ifndef QCLIENT_INTERNED_STRING_MAP_HH
+#define QCLIENT_INTERNED_STRING_MAP_HH
+
+#include "qclient/shared/StringInterner.hh"
+#include <map>
+#include <string>
+#include <vector>
+
+namespace qclient {
+
+//------------------------------------------------------------------------------
+//! Compact string -> string map: A sorted vector of entries, with keys
+//! coming out of a StringInterner, so that maps with the same keys share
+//! them. Much lighter than a std::map for the small to medium sized hashes
+//! it's meant for, but inserting or erasing a key moves the entries after
+//! it - don't use for huge ones.
+//!
+//! Not thread-safe.
+//------------------------------------------------------------------------------
+class InternedStringMap {
+public:
+  using Entry = std::pair<StringInterner::Handle, std::string>;
+  using const_iterator = std::vector<Entry>::const_iterator;
+
+  //----------------------------------------------------------------------------
+  //! Constructor - without an interner, each map keeps its own keys
+  //----------------------------------------------------------------------------
+  InternedStringMap(const std::shared_ptr<StringInterner> &interner = {});
+
+  //----------------------------------------------------------------------------
+  //! Value of the given key, nullptr if not found
+  //----------------------------------------------------------------------------
+  const std::string* find(const std::string &key) const;
+
+  //----------------------------------------------------------------------------
+  //! Value of the given key, inserted empty if not there yet
+  //----------------------------------------------------------------------------
+  std::string& operator[](const std::string &key);
+
+  //----------------------------------------------------------------------------
+  //! Erase the given key - false if it wasn't there
+  //----------------------------------------------------------------------------
+  bool erase(const std::string &key);
+
+  //----------------------------------------------------------------------------
+  //! Replace the entire contents
+  //----------------------------------------------------------------------------
+  void assign(const std::map<std::string, std::string> &contents);
+
+  //----------------------------------------------------------------------------
+  //! Copy out the entire contents
+  //----------------------------------------------------------------------------
+  std::map<std::string, std::string> toMap() const;
+
+  void clear() {
+    entries.clear();
+  }
+
+  size_t size() const {
+    return entries.size();
+  }
+
+  bool empty() const {
+    return entries.empty();
+  }
+
+  //----------------------------------------------------------------------------
+  //! Iterate in key order
+  //----------------------------------------------------------------------------
+  const_iterator begin() const {
+    return entries.begin();
+  }
+
+  const_iterator end() const {
+    return entries.end();
+  }
+
+private:
+  std::shared_ptr<StringInterner> interner;
+  std::vector<Entry> entries;
+
+  StringInterner::Handle makeKey(const std::string &key);
+  std::vector<Entry>::iterator lowerBound(const std::string &key);
+};
+
+}
+
+#endif
@@ -26,9 +26,10 @@
 
 #include <string>
 #include <future>
-#include <map>
+#include <unordered_map>
 #include <chrono>
 #include <list>
+#include <vector>
 #include <shared_mutex>
 #include <condition_variable>
 
@@ -45,25 +46,45 @@ struct CommunicatorReply {
 //
 // Operations:
 // - Insert a new request, provide a UUID and std::future<Reply>
+//
+// Request IDs handed out are a per-vault UUID, followed by an increasing
+// sequence number. Internally, requests are keyed by the sequence number
+// alone: generating a fresh UUID per request, and hashing or comparing
+// UUID strings on every lookup, is far too expensive with thousands of
+// requests in flight.
+//
+// All requests share the same retry interval, so ordering them by last
+// retry is a plain FIFO: a retried item moves to the back. This is what a
+// timer wheel would degenerate to, at O(1) per operation.
 //------------------------------------------------------------------------------
 class PendingRequestVault {
 public:
   using RequestID = std::string;
+  using Sequence = uint64_t;
 
   struct Item {
     Item() {}
-    Item(const RequestID &reqid) : id(reqid) {}
+    Item(Sequence s) : seq(s) {}
 
     std::chrono::steady_clock::time_point start;
     std::chrono::steady_clock::time_point lastRetry;
 
-    RequestID id;
+    Sequence seq = 0;
 
     std::string channel;
     std::string contents;
     std::promise<CommunicatorReply> promise;
 
-    std::list<RequestID>::iterator listIter;
+    std::list<Sequence>::iterator listIter;
+  };
+
+  //----------------------------------------------------------------------------
+  // An item due for retry, as returned by retryDueItems
+  //----------------------------------------------------------------------------
+  struct RetryItem {
+    RequestID id;
+    std::string channel;
+    std::string contents;
   };
 
   //----------------------------------------------------------------------------
@@ -126,16 +147,39 @@ public:
   bool retryFrontItem(std::chrono::steady_clock::time_point now,
     std::string &channel, std::string &contents, std::string &id);
 
+  //----------------------------------------------------------------------------
+  // Retry all items whose last retry happened at least retryInterval before
+  // now, up to maxItems, all under a single lock acquisition. Due items are
+  // appended to out. Returns the number of items appended.
+  //----------------------------------------------------------------------------
+  size_t retryDueItems(std::chrono::steady_clock::time_point now,
+    std::chrono::milliseconds retryInterval, size_t maxItems,
+    std::vector<RetryItem> &out);
+
 private:
   //----------------------------------------------------------------------------
   // Drop front item
   //----------------------------------------------------------------------------
   void dropFront();
 
-  using PendingRequestMap = std::map<RequestID, Item>;
+  //----------------------------------------------------------------------------
+  // Convert between sequence numbers and request IDs
+  //----------------------------------------------------------------------------
+  RequestID toRequestID(Sequence seq) const;
+  bool toSequence(const RequestID &id, Sequence &seq) const;
+
+  //----------------------------------------------------------------------------
+  // Move front item to the back of the retry list, marking it as retried
+  //----------------------------------------------------------------------------
+  Item& retryFront(std::chrono::steady_clock::time_point now);
+
+  using PendingRequestMap = std::unordered_map<Sequence, Item>;
+
+  std::string mIdPrefix;
+  Sequence mNextSequence {1};
 
   PendingRequestMap mPendingRequests;
-  std::list<RequestID> mNextToRetry;
+  std::list<Sequence> mNextToRetry;
   bool mBlockingMode {true};
 
   mutable std::mutex mMutex;
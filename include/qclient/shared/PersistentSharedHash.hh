@@ -27,16 +27,14 @@
 #include "qclient/utils/Macros.hh"
 #include "qclient/ReconnectionListener.hh"
 #include "qclient/Reply.hh"
+#include "qclient/shared/InternedStringMap.hh"
 #include <map>
 #include <vector>
 #include <string>
 #include <future>
-
-#ifdef EOSCITRINE
-#include "common/SharedMutexWrapper.hh"
-#else
-#include <shared_mutex>
-#endif
+#include <atomic>
+#include <chrono>
+#include <mutex>
 
 namespace qclient {
 
@@ -59,12 +57,18 @@ class SharedManager; class Logger;
 class Subscription; class QClient;
 class Message;
 class SharedHashSubscriber;
+class MultiBuilder;
+struct HashSnapshot;
+template<typename T> class SnapshotCell;
 
 class PersistentSharedHash final : public ReconnectionListener {
 public:
   //----------------------------------------------------------------------------
   //! Constructor - supply a SharedManager object. I'll keep a reference to it
   //! throughout my lifetime - don't destroy it before me!
+  //!
+  //! With a SharedManager in simulation mode, set() applies each batch as
+  //! the next revision right away, as if QDB had acknowledged it.
   //----------------------------------------------------------------------------
   PersistentSharedHash(SharedManager *sm, const std::string &key,
     const std::shared_ptr<SharedHashSubscriber> &sub = {} );
@@ -104,6 +108,13 @@ public:
   //----------------------------------------------------------------------------
   uint64_t getCurrentVersion();
 
+  //----------------------------------------------------------------------------
+  //! Write the current contents and version to the on-disk snapshot right
+  //! away - see SharedManager::setSnapshotDirectory. Returns false if
+  //! snapshots are disabled, there's nothing to write yet, or writing failed.
+  //----------------------------------------------------------------------------
+  bool saveSnapshot();
+
   //----------------------------------------------------------------------------
   //! Listen for reconnection events
   //----------------------------------------------------------------------------
@@ -138,34 +149,108 @@ PUBLIC_FOR_TESTS_ONLY:
   //----------------------------------------------------------------------------
   void resilver(uint64_t revision, std::map<std::string, std::string> &&newContents);
 
+  //----------------------------------------------------------------------------
+  //! Parse the reply of VHGETCHANGES: An array of revisions, oldest first,
+  //! each serialized same as in a revision update message.
+  //----------------------------------------------------------------------------
+  using Revision = std::pair<uint64_t, std::map<std::string, std::string>>;
+  static bool parseChanges(const redisReply *reply, std::vector<Revision> &changes);
+
+  //----------------------------------------------------------------------------
+  //! On-disk snapshots: A magic, the version, and the contents in the compact
+  //! batch encoding. Written to a temporary file first, then renamed over
+  //! the previous snapshot, so that a crash never leaves a torn one behind.
+  //----------------------------------------------------------------------------
+  static bool writeSnapshot(const std::string &path, uint64_t version,
+    const std::map<std::string, std::string> &contents);
+  static bool readSnapshot(const std::string &path, uint64_t &version,
+    std::map<std::string, std::string> &contents);
+
+  //----------------------------------------------------------------------------
+  //! Snapshot file name for the given key, with anything but alphanumerics
+  //! and "._-" percent-encoded
+  //----------------------------------------------------------------------------
+  static std::string snapshotFilename(const std::string &key);
+
 private:
   friend class SharedManager;
+  friend class SharedHash;
+
+  //----------------------------------------------------------------------------
+  // Read the field out of the latest published contents, without looking
+  // at any pending resilvering reply.
+  //----------------------------------------------------------------------------
+  bool getPublished(const std::string &field, std::string& value);
+
+  //----------------------------------------------------------------------------
+  // Append the commands applying the given updates to the hash with the
+  // given key - VHSET, or VHDEL for empty values.
+  //----------------------------------------------------------------------------
+  static void appendUpdates(MultiBuilder &multi, const std::string &key,
+    const std::map<std::string, std::string> &batch);
 
   SharedManager *sm;
   std::string key;
   std::shared_ptr<Logger> logger;
 
-  mutable std::shared_timed_mutex contentsMutex;
-  std::map<std::string, std::string> contents;
+  //----------------------------------------------------------------------------
+  // Writers modify contents under contentsMutex, then publish an immutable
+  // copy of it. Readers only ever look at the latest published copy, without
+  // taking any locks.
+  //----------------------------------------------------------------------------
+  std::mutex contentsMutex;
+  InternedStringMap contents;
   uint64_t currentVersion;
+  std::unique_ptr<SnapshotCell<HashSnapshot>> snapshot;
+
+  //----------------------------------------------------------------------------
+  // Publish the current contents and version. Assumes lock is taken.
+  //----------------------------------------------------------------------------
+  void publishSnapshot();
 
   std::unique_ptr<qclient::Subscription> subscription;
   qclient::QClient *qcl = nullptr;
 
+  //----------------------------------------------------------------------------
+  // Resilvering: If we have a version to start from, first ask only for the
+  // revisions we've missed. If the server doesn't understand the request, we
+  // stop asking, and always fetch the entire contents.
+  //----------------------------------------------------------------------------
   std::mutex futureReplyMtx;
   std::future<redisReplyPtr> futureReply;
+  bool futureReplyIsIncremental = false;
+  std::atomic<bool> futureReplyPending {false};
+  std::atomic<bool> incrementalSupported {true};
 
   std::shared_ptr<SharedHashSubscriber> mHashSubscriber;
 
+  //----------------------------------------------------------------------------
+  // On-disk snapshot, if enabled: Loaded on construction, and rewritten at
+  // most once per snapshotInterval as revisions come in.
+  //----------------------------------------------------------------------------
+  std::string snapshotPath;
+  std::chrono::seconds snapshotInterval {0};
+  std::mutex snapshotFileMtx;
+  std::chrono::steady_clock::time_point lastSnapshotAt;
+  void loadSnapshot();
+  void maybeSaveSnapshot();
+  bool saveSnapshotLocked();
+
   //----------------------------------------------------------------------------
   // Feed a single key-value update. Assumes lock is taken.
   //----------------------------------------------------------------------------
   void feedSingleKeyValue(const std::string &key, const std::string &value);
 
   //----------------------------------------------------------------------------
-  // Asynchronously trigger resilvering
+  // Asynchronously trigger resilvering - incremental, if possible.
+  //----------------------------------------------------------------------------
+  void triggerResilvering(bool allowIncremental = true);
+
+  //----------------------------------------------------------------------------
+  // Apply the reply of an incremental resilvering request. Returns false if
+  // a full resilvering is needed instead.
   //----------------------------------------------------------------------------
-  void triggerResilvering();
+  bool handleIncrementalResponse(redisReplyPtr &&reply);
 
   //----------------------------------------------------------------------------
   //! Process incoming message
@@ -180,7 +265,7 @@ private:
   //----------------------------------------------------------------------------
   //! Parse serialized version + string map
   //----------------------------------------------------------------------------
-  bool parseReply(redisReplyPtr &reply, uint64_t &revision, std::map<std::string, std::string> &contents);
+  static bool parseReply(const redisReply *reply, uint64_t &revision, std::map<std::string, std::string> &contents);
 
 };
 
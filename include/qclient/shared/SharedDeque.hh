@@ -26,9 +26,12 @@
 
 #include "qclient/Status.hh"
 #include "qclient/ReconnectionListener.hh"
+#include "qclient/utils/Macros.hh"
+#include <functional>
 #include <string>
 #include <mutex>
 #include <memory>
+#include <vector>
 
 namespace qclient {
 
@@ -39,6 +42,12 @@ class Message;
 
 class SharedDeque final : public ReconnectionListener {
 public:
+  //----------------------------------------------------------------------------
+  //! Completion callbacks for the asynchronous variants. They run on the
+  //! QClient callback executor, and may be empty.
+  //----------------------------------------------------------------------------
+  using StatusCallback = std::function<void(qclient::Status)>;
+  using PopCallback = std::function<void(qclient::Status, std::vector<std::string>&&)>;
 
   //----------------------------------------------------------------------------
   //! Constructor
@@ -55,6 +64,20 @@ public:
   //----------------------------------------------------------------------------
   qclient::Status push_back(const std::string &contents);
 
+  //----------------------------------------------------------------------------
+  //! Push several elements into the back of the deque, through a single
+  //! command. Subscribers are notified once for the entire batch.
+  //----------------------------------------------------------------------------
+  qclient::Status push_back_many(const std::vector<std::string> &contents);
+
+  //----------------------------------------------------------------------------
+  //! Asynchronous versions of the above: notifications and command are
+  //! written out back-to-back, and cb is invoked once the reply arrives.
+  //----------------------------------------------------------------------------
+  void push_back_async(const std::string &contents, StatusCallback cb);
+  void push_back_many_async(const std::vector<std::string> &contents,
+    StatusCallback cb);
+
   //----------------------------------------------------------------------------
   //! Clear deque contents
   //----------------------------------------------------------------------------
@@ -67,7 +90,25 @@ public:
   qclient::Status pop_front(std::string &out);
 
   //----------------------------------------------------------------------------
-  //! Query deque size
+  //! Remove up to count items from the front of the queue, appending them to
+  //! out. All pops are pipelined between a single pair of notifications.
+  //! Fewer than count items are returned if the deque runs empty - not an
+  //! error.
+  //----------------------------------------------------------------------------
+  qclient::Status pop_front_many(size_t count, std::vector<std::string> &out);
+
+  //----------------------------------------------------------------------------
+  //! Asynchronous version of the above.
+  //----------------------------------------------------------------------------
+  void pop_front_many_async(size_t count, PopCallback cb);
+
+  //----------------------------------------------------------------------------
+  //! Query deque size. Served from a local count, which is kept up-to-date
+  //! with the results of our own operations, and with the notifications of
+  //! other clients - the server is asked only when the count is unknown:
+  //! At first, after reconnecting, after a clear, or after a notification
+  //! which doesn't add up - or doesn't say how many items were pushed or
+  //! popped, as with older clients.
   //----------------------------------------------------------------------------
   qclient::Status size(size_t &out);
 
@@ -83,15 +124,68 @@ public:
   virtual void notifyConnectionEstablished(int64_t epoch) override final;
 
 
+PUBLIC_FOR_TESTS_ONLY:
+  //----------------------------------------------------------------------------
+  //! Completion notifications say which operation completed, how many items
+  //! it pushed or popped, and which deque object it came from:
+  //! "push-back-done <count> <origin>". Returns false for anything else,
+  //! including the bare notifications of older clients.
+  //----------------------------------------------------------------------------
+  static bool parseNotification(const std::string &payload, std::string &op,
+    size_t &count, std::string &origin);
+
+  //----------------------------------------------------------------------------
+  //! Local count of items. Every change bumps the generation, so that a
+  //! server query racing with a change doesn't overwrite it with an outdated
+  //! value.
+  //!
+  //! Notifications are published separately from the commands they describe,
+  //! and those of different clients interleave: Only relative changes can be
+  //! applied in any order. A clear, or a pop of more items than counted,
+  //! means the count is lost until the server is asked again.
+  //----------------------------------------------------------------------------
+  class SizeCache {
+  public:
+    void invalidate();
+    void pushed(size_t count);
+    void popped(size_t count);
+
+    //--------------------------------------------------------------------------
+    //! Apply a completion notification of another client
+    //--------------------------------------------------------------------------
+    void applyNotification(const std::string &op, size_t count);
+
+    //--------------------------------------------------------------------------
+    //! Returns false if the count is unknown, along with the generation to
+    //! pass to set once the server has been asked.
+    //--------------------------------------------------------------------------
+    bool get(size_t &out, uint64_t &gen);
+    void set(size_t value, uint64_t gen);
+
+  private:
+    std::mutex mtx;
+    size_t size = 0u;
+    bool valid = false;
+    uint64_t generation = 0u;
+  };
+
 private:
   SharedManager *mSharedManager;
   std::string mKey;
   qclient::QClient *mQcl;
   std::unique_ptr<qclient::Subscription> mSubscription;
 
-  std::mutex mCacheMutex;
-  size_t mCachedSize = 0u;
-  bool mCachedSizeValid = false;
+  //----------------------------------------------------------------------------
+  // Local count of items - shared with the callbacks of asynchronous
+  // operations, which may outlive us.
+  //----------------------------------------------------------------------------
+  std::shared_ptr<SizeCache> mSizeCache;
+
+  //----------------------------------------------------------------------------
+  // Tells our own notifications apart - their effect has been counted
+  // already, once the replies arrived.
+  //----------------------------------------------------------------------------
+  std::string mOrigin;
 
   //----------------------------------------------------------------------------
   //! Process incoming message
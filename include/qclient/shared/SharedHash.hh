@@ -30,7 +30,11 @@
 #include <shared_mutex>
 #endif
 
+#include "qclient/shared/InternedStringMap.hh"
 #include <map>
+#include <memory>
+#include <mutex>
+#include <set>
 
 namespace qclient {
 
@@ -40,12 +44,30 @@ class PersistentSharedHash;
 class TransientSharedHash;
 class SharedHashSubscriber;
 class SharedHashSubscription;
+struct SharedHashUpdateSet;
+struct MergedIndex;
+template<typename T> class SnapshotCell;
 
 //------------------------------------------------------------------------------
 //! Convenience class for Transient + Persistent shared hashes mushed together.
+//!
+//! Lookups are served from a single merged index, holding the effective value
+//! of each field and where it came from - local values win over transient
+//! ones, which win over persistent ones. The index is rebuilt field by field
+//! as the layers change, and published as an immutable snapshot, so that
+//! readers never take a lock.
 //------------------------------------------------------------------------------
 class SharedHash {
 public:
+  //----------------------------------------------------------------------------
+  //! Which layer the effective value of a field comes from
+  //----------------------------------------------------------------------------
+  enum class Origin : char {
+    kLocal = 'L',
+    kTransient = 'T',
+    kPersistent = 'P'
+  };
+
   //----------------------------------------------------------------------------
   //! Constructor
   //----------------------------------------------------------------------------
@@ -66,6 +88,11 @@ public:
   //----------------------------------------------------------------------------
   bool get(const std::string &field, std::string& value);
 
+  //----------------------------------------------------------------------------
+  //! Get value, along with the layer it comes from
+  //----------------------------------------------------------------------------
+  bool get(const std::string &field, std::string& value, Origin &origin);
+
   //----------------------------------------------------------------------------
   //! Subscribe for updates to this hash
   //----------------------------------------------------------------------------
@@ -81,6 +108,33 @@ private:
   std::map<std::string, std::string> mLocal;
   std::unique_ptr<PersistentSharedHash> mPersistent;
   std::unique_ptr<TransientSharedHash> mTransient;
+
+  //----------------------------------------------------------------------------
+  // Merged index: mMerged holds the effective value of each field, prefixed
+  // with its origin, and is modified under mMutex. Every change publishes
+  // an immutable copy of it, which is what readers look at.
+  //----------------------------------------------------------------------------
+  InternedStringMap mMerged;
+  std::unique_ptr<SnapshotCell<MergedIndex>> mIndex;
+  std::unique_ptr<SharedHashSubscription> mIndexSubscription;
+
+  //----------------------------------------------------------------------------
+  // Fields which changed while the layers were still being constructed,
+  // merged once they're in place.
+  //----------------------------------------------------------------------------
+  std::set<std::string> mPendingFields;
+
+  //----------------------------------------------------------------------------
+  // Layer update listener, feeds the merged index
+  //----------------------------------------------------------------------------
+  void processLayerUpdate(SharedHashUpdateSet &&set);
+
+  //----------------------------------------------------------------------------
+  // Recompute the effective value of a field, and publish the merged index.
+  // Assume mMutex is taken.
+  //----------------------------------------------------------------------------
+  void mergeField(const std::string &field);
+  void publishIndex();
 };
 
 }
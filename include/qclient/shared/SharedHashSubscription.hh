@@ -25,9 +25,15 @@
 #define QCLIENT_HASH_SUBSCRIPTION_HH
 
 #include "qclient/queueing/AttachableQueue.hh"
+#include "qclient/AssistedThread.hh"
 
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
 #include <memory>
 #include <set>
+#include <vector>
 
 namespace qclient {
 
@@ -41,6 +47,23 @@ struct SharedHashUpdate {
   std::string value;
 };
 
+//------------------------------------------------------------------------------
+//! SharedHashUpdateSet: All changes of a revision, or of several, when
+//! coalesced over a time window.
+//------------------------------------------------------------------------------
+struct SharedHashUpdateSet {
+  //----------------------------------------------------------------------------
+  //! True if the hash got resilvered: Its entire contents were replaced, and
+  //! updates holds all of them - any key not in there is gone.
+  //----------------------------------------------------------------------------
+  bool resilvered = false;
+
+  //----------------------------------------------------------------------------
+  //! Last value of each changed key - empty means deleted.
+  //----------------------------------------------------------------------------
+  std::map<std::string, std::string> updates;
+};
+
 //------------------------------------------------------------------------------
 //! Listen for changes on a shared hash
 //------------------------------------------------------------------------------
@@ -99,6 +122,25 @@ public:
   //----------------------------------------------------------------------------
   void detachCallback();
 
+  //----------------------------------------------------------------------------
+  // Batch mode: Instead of one SharedHashUpdate per key, deliver each
+  // revision, or resilvering, whole, as a single update set. Only updates
+  // arriving from now on are delivered - the queue is left alone.
+  //
+  // With a non-zero window, update sets are coalesced: The first change
+  // opens the window, and everything arriving until it closes goes to the
+  // callback as one set, from a background thread.
+  //----------------------------------------------------------------------------
+  using BatchCallback = std::function<void(SharedHashUpdateSet &&)>;
+  void attachBatchCallback(const BatchCallback &cb,
+    std::chrono::milliseconds window = std::chrono::milliseconds(0));
+
+  //----------------------------------------------------------------------------
+  // Leave batch mode. Whatever's pending in the current window is delivered
+  // right away.
+  //----------------------------------------------------------------------------
+  void detachBatchCallback();
+
 private:
   friend class SharedHashSubscriber;
 
@@ -107,12 +149,33 @@ private:
   //----------------------------------------------------------------------------
   void processIncoming(const SharedHashUpdate &update);
 
+  //----------------------------------------------------------------------------
+  // Process incoming updates of a single revision, or a resilvering
+  //----------------------------------------------------------------------------
+  void processIncoming(const std::vector<SharedHashUpdate> &updates);
+  void processResilvering(const std::map<std::string, std::string> &contents);
+
+  //----------------------------------------------------------------------------
+  // Batch mode, see attachBatchCallback
+  //----------------------------------------------------------------------------
+  bool isBatchMode();
+  void deliverBatch(SharedHashUpdateSet &&set);
+  void coalesce(ThreadAssistant &assistant);
+
   //----------------------------------------------------------------------------
   //! Internal state
   //----------------------------------------------------------------------------
   qclient::AttachableQueue<SharedHashUpdate, 50> mQueue;
   std::shared_ptr<SharedHashSubscriber> mSubscriber;
 
+  std::mutex mBatchMtx;
+  std::condition_variable mBatchCV;
+  BatchCallback mBatchCallback;
+  std::chrono::milliseconds mBatchWindow {0};
+  bool mBatchPending = false;
+  std::chrono::steady_clock::time_point mBatchDeadline;
+  SharedHashUpdateSet mPendingBatch;
+  AssistedThread mCoalescingThread;
 };
 
 //------------------------------------------------------------------------------
@@ -135,6 +198,18 @@ public:
   //----------------------------------------------------------------------------
   void feedUpdate(const SharedHashUpdate &update);
 
+  //----------------------------------------------------------------------------
+  //! Feed all updates of a single revision at once. Subscriptions in batch
+  //! mode receive them as one update set, the others one by one.
+  //----------------------------------------------------------------------------
+  void feedUpdates(const std::vector<SharedHashUpdate> &updates);
+
+  //----------------------------------------------------------------------------
+  //! Feed the entire contents of a resilvered hash - only subscriptions in
+  //! batch mode are told about it.
+  //----------------------------------------------------------------------------
+  void feedResilvering(const std::map<std::string, std::string> &contents);
+
   //----------------------------------------------------------------------------
   //! Register subscription
   //----------------------------------------------------------------------------
@@ -26,7 +26,17 @@
 
 #include "../AssistedThread.hh"
 #include "../Options.hh"
+#include "../ValueCompression.hh"
+#include "../utils/Macros.hh"
+#include "StringInterner.hh"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
 
 namespace qclient {
 
@@ -35,6 +45,8 @@ class QClient;
 class Subscriber;
 class TransientSharedHash;
 class SharedHashSubscriber;
+class SharedWriteBatch;
+class MultiBuilder;
 
 //------------------------------------------------------------------------------
 //! SharedManager class to babysit SharedHashes and SharedQueues.
@@ -75,6 +87,70 @@ public:
   //----------------------------------------------------------------------------
   void publish(const std::string &channel, const std::string &payload);
 
+  //----------------------------------------------------------------------------
+  //! Publish the given batch of hash updates, coalescing it with others on
+  //! the same channel, if there's a coalescing window for it.
+  //----------------------------------------------------------------------------
+  void publishBatch(const std::string &channel, const std::map<std::string, std::string> &batch);
+
+  //----------------------------------------------------------------------------
+  //! Coalesce hash updates within the given window: The first update on a
+  //! channel opens the window, and any further updates on it are merged into
+  //! the same batch - the last value of each key wins - which goes out as a
+  //! single PUBLISH once the window closes.
+  //!
+  //! Applies to all channels, unless overridden for specific ones. Zero, the
+  //! default, publishes every update right away.
+  //----------------------------------------------------------------------------
+  void setCoalescingWindow(std::chrono::microseconds window);
+  void setCoalescingWindow(const std::string &channel, std::chrono::microseconds window);
+
+  //----------------------------------------------------------------------------
+  //! Publish all coalesced updates right away, without waiting for their
+  //! windows to close.
+  //----------------------------------------------------------------------------
+  void flushCoalesced();
+
+  //----------------------------------------------------------------------------
+  //! Send out updates to many hashes in one go: The durable ones are packed
+  //! into pipelined transactions of about maxPerTransaction commands each -
+  //! the updates of any single hash always stay within one transaction - and
+  //! the transient ones go out as a single batch per hash, subject to
+  //! coalescing as usual.
+  //!
+  //! In simulation mode, there's nowhere to send durable updates to, and
+  //! they are dropped.
+  //----------------------------------------------------------------------------
+  void flush(const SharedWriteBatch &batch, size_t maxPerTransaction = 1024);
+
+  //----------------------------------------------------------------------------
+  //! Publish hash updates in a compact encoding, with varint lengths and
+  //! shared key prefixes. Incoming updates are understood in either encoding,
+  //! but clients from before the compact one can't read it - only turn on
+  //! once every client of the affected hashes has been upgraded.
+  //----------------------------------------------------------------------------
+  void setCompactEncoding(bool enabled);
+
+  //----------------------------------------------------------------------------
+  //! Compress published hash updates of at least the configured threshold -
+  //! see ValueCompression. Incoming updates are decompressed regardless, but
+  //! as with the compact encoding, older clients can't read compressed ones.
+  //----------------------------------------------------------------------------
+  void setCompression(const ValueCompression &compression);
+
+  //----------------------------------------------------------------------------
+  //! Keep an on-disk snapshot of every PersistentSharedHash in the given
+  //! directory, rewritten at most once per interval as the hash changes, and
+  //! once more when the hash is destroyed. On construction, a hash starts
+  //! out from its snapshot, and only asks for the revisions it's missing -
+  //! instead of fetching its entire contents. Call before creating hashes.
+  //----------------------------------------------------------------------------
+  void setSnapshotDirectory(const std::string &dir,
+    std::chrono::seconds interval = std::chrono::seconds(60));
+
+  std::string getSnapshotDirectory();
+  std::chrono::seconds getSnapshotInterval();
+
   //----------------------------------------------------------------------------
   //! Get pointer to underlying QClient object - lifetime is tied to this
   //! SharedManager.
@@ -92,10 +168,53 @@ public:
   //----------------------------------------------------------------------------
   std::shared_ptr<Logger> getLogger();
 
+  //----------------------------------------------------------------------------
+  //! Interner for the field names of all hashes managed by us - hashes with
+  //! the same fields then share a single copy of each name.
+  //----------------------------------------------------------------------------
+  std::shared_ptr<StringInterner> getKeyInterner();
+
+PUBLIC_FOR_TESTS_ONLY:
+  //----------------------------------------------------------------------------
+  //! Pack the durable updates of the given batch into transactions
+  //----------------------------------------------------------------------------
+  static std::vector<MultiBuilder> makeTransactions(const SharedWriteBatch &batch,
+    size_t maxPerTransaction);
+
 private:
   std::shared_ptr<Logger> logger;
   qclient::QClient *qcl = nullptr;
   std::unique_ptr<Subscriber> subscriber;
+  std::atomic<bool> compactEncoding {false};
+  std::shared_ptr<StringInterner> keyInterner {std::make_shared<StringInterner>()};
+
+  std::mutex compressionMtx;
+  ValueCompression compression = ValueCompression::Disabled();
+
+  std::mutex snapshotMtx;
+  std::string snapshotDirectory;
+  std::chrono::seconds snapshotInterval {60};
+
+  std::string serialize(const std::map<std::string, std::string> &batch);
+
+  //----------------------------------------------------------------------------
+  // Coalescing: One pending batch per channel, and the channels in order of
+  // their window closing.
+  //----------------------------------------------------------------------------
+  using Batch = std::map<std::string, std::string>;
+  using Clock = std::chrono::steady_clock;
+
+  std::mutex coalescingMtx;
+  std::condition_variable coalescingCV;
+  std::chrono::microseconds defaultCoalescingWindow {0};
+  std::map<std::string, std::chrono::microseconds> channelCoalescingWindows;
+  std::map<std::string, Batch> pendingBatches;
+  std::multimap<Clock::time_point, std::string> pendingDeadlines;
+  bool coalescingStarted = false;
+  AssistedThread coalescingThread;
+
+  void coalesce(ThreadAssistant &assistant);
+  void startCoalescingThread();
 };
 
 }
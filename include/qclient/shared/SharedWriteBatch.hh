@@ -0,0 +1,93 @@
+//------------------------------------------------------------------------------
+// File: SharedWriteBatch.hh
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#ifndef QCLIENT_SHARED_WRITE_BATCH_HH
+#define QCLIENT_SHARED_WRITE_BATCH_HH
+
+#include <map>
+#include <string>
+
+namespace qclient {
+
+class UpdateBatch;
+
+//------------------------------------------------------------------------------
+//! Updates to many shared hashes at once, to be sent out in one go through
+//! SharedManager::flush: Durable updates of all hashes are packed into a few
+//! pipelined transactions, and transient updates of each hash into a single
+//! publish - instead of a transaction or publish per hash and update.
+//!
+//! Later updates to the same field of the same hash replace earlier ones.
+//------------------------------------------------------------------------------
+class SharedWriteBatch {
+public:
+  using Updates = std::map<std::string, std::string>;
+
+  //----------------------------------------------------------------------------
+  //! Set durable value of a field in the given hash - empty deletes
+  //----------------------------------------------------------------------------
+  void setDurable(const std::string &hash, const std::string &field,
+    const std::string &value);
+
+  //----------------------------------------------------------------------------
+  //! Set transient value of a field in the given hash
+  //----------------------------------------------------------------------------
+  void setTransient(const std::string &hash, const std::string &field,
+    const std::string &value);
+
+  //----------------------------------------------------------------------------
+  //! Add the durable and transient updates of the given batch. Local updates
+  //! only make sense to a particular SharedHash object, and are ignored.
+  //----------------------------------------------------------------------------
+  void add(const std::string &hash, const UpdateBatch &batch);
+
+  //----------------------------------------------------------------------------
+  //! Updates, per hash
+  //----------------------------------------------------------------------------
+  const std::map<std::string, Updates>& getDurable() const {
+    return mDurable;
+  }
+
+  const std::map<std::string, Updates>& getTransient() const {
+    return mTransient;
+  }
+
+  //----------------------------------------------------------------------------
+  //! Number of field updates
+  //----------------------------------------------------------------------------
+  size_t size() const;
+
+  bool empty() const {
+    return mDurable.empty() && mTransient.empty();
+  }
+
+  void clear();
+
+private:
+  std::map<std::string, Updates> mDurable;
+  std::map<std::string, Updates> mTransient;
+};
+
+}
+
+#endif
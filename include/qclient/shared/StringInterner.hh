@@ -0,0 +1,72 @@
+//------------------------------------------------------------------------------
+// File: StringInterner.hh
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#ifndef QCLIENT_STRING_INTERNER_HH
+#define QCLIENT_STRING_INTERNER_HH
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace qclient {
+
+//------------------------------------------------------------------------------
+//! Hands out a single shared copy of each distinct string - hashes with the
+//! same field names then hold pointers to the same strings, instead of a
+//! copy each. A string is dropped from the interner once the last handle to
+//! it goes away.
+//!
+//! Thread-safe. Handles may outlive the interner.
+//------------------------------------------------------------------------------
+class StringInterner {
+public:
+  using Handle = std::shared_ptr<const std::string>;
+
+  //----------------------------------------------------------------------------
+  //! Constructor
+  //----------------------------------------------------------------------------
+  StringInterner();
+
+  //----------------------------------------------------------------------------
+  //! Get the shared copy of the given string, creating it if needed
+  //----------------------------------------------------------------------------
+  Handle intern(const std::string &str);
+
+  //----------------------------------------------------------------------------
+  //! Number of distinct strings currently alive
+  //----------------------------------------------------------------------------
+  size_t size() const;
+
+private:
+  struct State {
+    mutable std::mutex mtx;
+    std::unordered_map<std::string, std::weak_ptr<const std::string>> strings;
+  };
+
+  std::shared_ptr<State> state;
+};
+
+}
+
+#endif
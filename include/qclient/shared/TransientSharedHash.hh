@@ -25,7 +25,9 @@
 #define QCLIENT_TRANSIENT_SHARED_HASH_HH
 
 #include "qclient/utils/Macros.hh"
+#include "qclient/shared/InternedStringMap.hh"
 #include <map>
+#include <memory>
 #include <string>
 
 #ifdef EOSCITRINE
@@ -95,7 +97,7 @@ private:
   std::string channel;
 
   mutable std::mutex contentsMtx;
-  std::map<std::string, std::string> contents;
+  InternedStringMap contents;
   std::unique_ptr<qclient::Subscription> subscription;
 
   std::shared_ptr<SharedHashSubscriber> mHashSubscriber;
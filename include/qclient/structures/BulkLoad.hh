@@ -0,0 +1,141 @@
+//------------------------------------------------------------------------------
+//! @file BulkLoad.hh
+//! @brief Chunked, pipelined bulk writes for the data structure wrappers
+//------------------------------------------------------------------------------
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2016 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#pragma once
+#include "qclient/Namespace.hh"
+#include "qclient/ReplyFuture.hh"
+#include <algorithm>
+#include <deque>
+#include <string>
+#include <vector>
+
+QCLIENT_NAMESPACE_BEGIN
+
+class QClient;
+class QClientPool;
+class EncodedRequest;
+
+//------------------------------------------------------------------------------
+//! How to split up a bulk write
+//------------------------------------------------------------------------------
+struct BulkLoadOptions {
+  //----------------------------------------------------------------------------
+  //! Maximum number of elements (or field-value pairs) per command
+  //----------------------------------------------------------------------------
+  size_t chunkSize = 1000;
+
+  //----------------------------------------------------------------------------
+  //! Maximum number of commands awaiting a reply at any time
+  //----------------------------------------------------------------------------
+  size_t maxInFlight = 16;
+};
+
+//------------------------------------------------------------------------------
+//! Aggregate outcome of a bulk write. Chunks are independent: A failed chunk
+//! does not stop the remaining ones from being sent.
+//------------------------------------------------------------------------------
+struct BulkLoadResult {
+  size_t chunks = 0;        ///< Commands sent
+  size_t failedChunks = 0;  ///< Commands which received an unexpected reply
+  long long int total = 0;  ///< Sum of integer replies, such as SADD counts
+  std::string firstError;   ///< Description of the first failure, if any
+
+  bool ok() const {
+    return failedChunks == 0;
+  }
+};
+
+//------------------------------------------------------------------------------
+//! Sends a stream of commands, keeping at most maxInFlight of them awaiting
+//! a reply: Once the window is full, push blocks on the oldest one.
+//------------------------------------------------------------------------------
+class BulkPipeline {
+public:
+  //----------------------------------------------------------------------------
+  //! Constructor
+  //!
+  //! @param qcl client to send commands through
+  //! @param maxInFlight size of the window, at least 1
+  //! @param expectedType reply type which counts as success
+  //----------------------------------------------------------------------------
+  BulkPipeline(QClient* qcl, size_t maxInFlight, int expectedType);
+
+  //----------------------------------------------------------------------------
+  //! Same as above, spreading commands over the connections of a pool
+  //----------------------------------------------------------------------------
+  BulkPipeline(QClientPool* pool, size_t maxInFlight, int expectedType);
+
+  //----------------------------------------------------------------------------
+  //! Pass as expectedType to accept any reply but an error
+  //----------------------------------------------------------------------------
+  static constexpr int kAnyReply = -1;
+
+  //----------------------------------------------------------------------------
+  //! Destructor - waits for any outstanding replies
+  //----------------------------------------------------------------------------
+  ~BulkPipeline();
+
+  //----------------------------------------------------------------------------
+  //! Send one more command
+  //----------------------------------------------------------------------------
+  void push(EncodedRequest&& req);
+
+  //----------------------------------------------------------------------------
+  //! Wait for all outstanding replies, and return the aggregate result
+  //----------------------------------------------------------------------------
+  BulkLoadResult finish();
+
+  //----------------------------------------------------------------------------
+  //! The result so far, counting only replies received already
+  //----------------------------------------------------------------------------
+  const BulkLoadResult& progress() const {
+    return mResult;
+  }
+
+  //----------------------------------------------------------------------------
+  //! Argument buffers for building the next command out of borrowed
+  //! strings, without copying them - see EncodedRequest
+  //----------------------------------------------------------------------------
+  void startCommand(const std::string& cmd, const std::string& key);
+  void addArgument(const std::string& arg);
+  size_t argumentCount() const;
+  void sendCommand();
+
+private:
+  //----------------------------------------------------------------------------
+  //! Wait for the oldest outstanding reply, and account for it
+  //----------------------------------------------------------------------------
+  void reapOldest();
+
+  QClient* mQcl = nullptr;
+  QClientPool* mPool = nullptr;
+  size_t mMaxInFlight;
+  int mExpectedType;
+  std::deque<ReplyFuture> mInFlight;
+  BulkLoadResult mResult;
+
+  std::vector<const char*> mArgs;
+  std::vector<size_t> mSizes;
+};
+
+QCLIENT_NAMESPACE_END
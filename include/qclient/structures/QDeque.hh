@@ -25,7 +25,10 @@
 #define QCLIENT_DEQUE_HH
 
 #include <qclient/Status.hh>
+#include <qclient/structures/TypedFuture.hh>
+#include <functional>
 #include <string>
+#include <vector>
 
 namespace qclient {
 
@@ -36,6 +39,13 @@ class QClient;
 //------------------------------------------------------------------------------
 class QDeque {
 public:
+  //----------------------------------------------------------------------------
+  //! Completion callbacks for the asynchronous variants. They run on the
+  //! QClient callback executor, and may be empty.
+  //----------------------------------------------------------------------------
+  using StatusCallback = std::function<void(qclient::Status)>;
+  using PopCallback = std::function<void(qclient::Status, std::vector<std::string>&&)>;
+
   //----------------------------------------------------------------------------
   //! Constructor
   //----------------------------------------------------------------------------
@@ -56,18 +66,76 @@ public:
   //----------------------------------------------------------------------------
   qclient::Status push_back(const std::string &contents);
 
+  //----------------------------------------------------------------------------
+  //! Add several items to the back of the queue, through a single command
+  //----------------------------------------------------------------------------
+  qclient::Status push_back_many(const std::vector<std::string> &contents);
+
+  //----------------------------------------------------------------------------
+  //! Asynchronous version of the above - cb is invoked once the reply
+  //! arrives.
+  //----------------------------------------------------------------------------
+  void push_back_many_async(const std::vector<std::string> &contents,
+    StatusCallback cb);
+
+  //----------------------------------------------------------------------------
+  //! Non-blocking form of push_back_many, yielding the new length of the
+  //! queue.
+  //----------------------------------------------------------------------------
+  TypedFuture<long long> push_back_many_future(const std::vector<std::string> &contents);
+
   //----------------------------------------------------------------------------
   //! Remove item from the front of the queue. If queue is empty, "" will be
   //! returned - not an error.
   //----------------------------------------------------------------------------
   qclient::Status pop_front(std::string &out);
 
+  //----------------------------------------------------------------------------
+  //! Remove up to count items from the front of the queue, appending them to
+  //! out. All pops are pipelined, costing a single round-trip - or go out as
+  //! a single command, if negotiated with the server, see
+  //! Options::negotiateCapabilities. Fewer than count items are returned if
+  //! the queue runs empty - not an error.
+  //----------------------------------------------------------------------------
+  qclient::Status pop_front_many(size_t count, std::vector<std::string> &out);
+
+  //----------------------------------------------------------------------------
+  //! Asynchronous version of the above.
+  //----------------------------------------------------------------------------
+  void pop_front_many_async(size_t count, PopCallback cb);
+
+  //----------------------------------------------------------------------------
+  //! Non-blocking form of pop_front_many - get() appends the items to out.
+  //----------------------------------------------------------------------------
+  TypedFuture<std::vector<std::string>> pop_front_many_future(size_t count);
+
+  //----------------------------------------------------------------------------
+  //! Non-blocking forms of size, push_back and pop_front. push_back yields
+  //! the new length of the queue; pop_front yields "" if the queue is empty.
+  //----------------------------------------------------------------------------
+  TypedFuture<long long> size_future();
+  void size_async(TypedCallback<long long> cb);
+
+  TypedFuture<long long> push_back_future(const std::string &contents);
+  void push_back_async(const std::string &contents, TypedCallback<long long> cb);
+
+  TypedFuture<std::string> pop_front_future();
+  void pop_front_async(TypedCallback<std::string> cb);
+
   //----------------------------------------------------------------------------
   //! Clear all items in the queue
   //----------------------------------------------------------------------------
   qclient::Status clear();
 
+  //----------------------------------------------------------------------------
+  //! Non-blocking forms of clear
+  //----------------------------------------------------------------------------
+  TypedFuture<long long> clear_future();
+  void clear_async(TypedCallback<long long> cb);
+
 private:
+  bool batchPopSupported() const;
+
   qclient::QClient& mQcl;
   std::string mKey;
 };
@@ -26,10 +26,24 @@
 #include "qclient/QClient.hh"
 #include "qclient/Utils.hh"
 #include "qclient/AsyncHandler.hh"
+#include "qclient/ValueCompression.hh"
+#include "qclient/structures/QHashCache.hh"
+#include "qclient/structures/BulkLoad.hh"
+#include "qclient/structures/TypedFuture.hh"
+#include "qclient/utils/StringView.hh"
+#include <functional>
+#include <memory>
 #include <unordered_map>
+#include <unordered_set>
 
 QCLIENT_NAMESPACE_BEGIN
 
+//------------------------------------------------------------------------------
+//! Pre-encoded prefixes of the hottest hash commands
+//------------------------------------------------------------------------------
+constexpr Command<3> kHget("HGET");
+constexpr Command<4> kHset("HSET");
+
 //------------------------------------------------------------------------------
 //! Class QHash
 //------------------------------------------------------------------------------
@@ -117,6 +131,27 @@ public:
     return mClient;
   }
 
+  //----------------------------------------------------------------------------
+  //! Serve hget, hexists and hlen out of the given cache when possible, and
+  //! populate it on misses. Writes through this object invalidate the key.
+  //! See QHashCache on how to pick up writes made by others. Pass nullptr to
+  //! go back to uncached reads.
+  //----------------------------------------------------------------------------
+  void setCache(const std::shared_ptr<QHashCache>& cache)
+  {
+    mCache = cache;
+  }
+
+  //----------------------------------------------------------------------------
+  //! Compress values written through this object, and decompress the ones
+  //! read - see ValueCompression. Values written uncompressed, such as by
+  //! older clients, stay readable. Fields are never compressed.
+  //----------------------------------------------------------------------------
+  void setCompression(const ValueCompression& compression)
+  {
+    mCompression = compression;
+  }
+
   //----------------------------------------------------------------------------
   //! HASH get command - synchronous
   //!
@@ -127,6 +162,40 @@ public:
   //----------------------------------------------------------------------------
   std::string hget(const std::string& field);
 
+  //----------------------------------------------------------------------------
+  //! HASH multi get command - synchronous, single round-trip
+  //!
+  //! @param fields hash fields to look up
+  //!
+  //! @return values, in the same order as fields - empty strings for fields
+  //!         which don't exist, same as hget
+  //----------------------------------------------------------------------------
+  std::vector<std::string> hmget(const std::vector<std::string>& fields);
+
+  //----------------------------------------------------------------------------
+  //! HASH multi get command - synchronous, single round-trip. Values are
+  //! decoded straight into the given map.
+  //!
+  //! @param fields hash fields to look up
+  //! @param out receives the fields which exist, with their values
+  //----------------------------------------------------------------------------
+  void hmget(const std::vector<std::string>& fields,
+             std::unordered_map<std::string, std::string>& out);
+
+  //----------------------------------------------------------------------------
+  //! Look up the same field in many hashes - synchronous. All HGETs are
+  //! pipelined, so this costs a single round-trip.
+  //!
+  //! @param qcl client to use
+  //! @param keys keys of the hashes
+  //! @param field hash field
+  //!
+  //! @return values, in the same order as keys - empty strings where the
+  //!         field doesn't exist
+  //----------------------------------------------------------------------------
+  static std::vector<std::string> multiGet(QClient& qcl,
+      const std::vector<std::string>& keys, const std::string& field);
+
   //----------------------------------------------------------------------------
   //! HASH set command - synchronous
   //!
@@ -136,7 +205,10 @@ public:
   //! @return return true if successful, otherwise false
   //----------------------------------------------------------------------------
   bool hset(const std::string& field, const std::string& value) {
-    redisReplyPtr reply = mClient->exec("HSET", mKey, field, value).get();
+    std::string buffer;
+    redisReplyPtr reply = mClient->pooledExecute(kHset.make(mKey, field,
+                          packValue(value, buffer))).get();
+    invalidateCache();
 
     if ((reply == nullptr) || (reply->type != REDIS_REPLY_INTEGER)) {
       throw std::runtime_error("[FATAL] Error hset key: " + mKey + " field: "
@@ -175,6 +247,23 @@ public:
   //----------------------------------------------------------------------------
   bool hmset(std::list<std::string> lst_elem);
 
+  //----------------------------------------------------------------------------
+  //! HASH multi set command for large inputs - synchronous. The pairs are
+  //! split into HMSET commands of options.chunkSize pairs each, encoded
+  //! straight out of the input, and pipelined with at most
+  //! options.maxInFlight of them awaiting a reply.
+  //!
+  //! Not atomic: If some chunks fail, the rest are still applied.
+  //!
+  //! @param begin, end range of field-value pairs, such as from a std::map
+  //! @param options chunking options
+  //!
+  //! @return aggregate result of all chunks
+  //----------------------------------------------------------------------------
+  template <typename Iter>
+  BulkLoadResult hmset_bulk(Iter begin, Iter end,
+                            const BulkLoadOptions& options = BulkLoadOptions());
+
   //----------------------------------------------------------------------------
   //! HASH del command - synchronous
   //!
@@ -201,6 +290,32 @@ public:
   //----------------------------------------------------------------------------
   std::vector<std::string> hgetall();
 
+  //----------------------------------------------------------------------------
+  //! HASH get all command - synchronous, filling the given map. Fields and
+  //! values are moved into it as they are parsed, without an intermediate
+  //! reply or vector.
+  //!
+  //! @param out cleared, then filled with the contents of the hash
+  //----------------------------------------------------------------------------
+  void hgetall(std::unordered_map<std::string, std::string>& out);
+
+  //----------------------------------------------------------------------------
+  //! HASH get all, streamed - synchronous. Walks the hash through HSCAN, so
+  //! that at most one page of "count" pairs is held in memory at a time,
+  //! and hands each pair over to the callback, by move.
+  //!
+  //! Unlike hgetall, this is not atomic: Concurrent modifications may or may
+  //! not be observed, and a field may be reported more than once.
+  //!
+  //! @param cb called for each field and value
+  //! @param count number of pairs to request per page
+  //!
+  //! @return number of pairs passed to the callback
+  //----------------------------------------------------------------------------
+  using PairCallback = std::function<void(std::string&& field,
+                                          std::string&& value)>;
+  size_t hgetall_stream(const PairCallback& cb, long long count = 1000);
+
   //----------------------------------------------------------------------------
   //! HASH exists command - synchronous
   //!
@@ -274,6 +389,31 @@ public:
   //----------------------------------------------------------------------------
   std::vector<std::string> hvals();
 
+  //----------------------------------------------------------------------------
+  //! HASH keys / values commands - synchronous, filling the given container.
+  //! Strings are moved into it as they are parsed, after reserving room for
+  //! all of them, without an intermediate reply.
+  //!
+  //! @param out cleared, then filled with the fields / values of the hash
+  //! @param sorted if true, sort the vector once all fields are in
+  //----------------------------------------------------------------------------
+  void hkeys(std::vector<std::string>& out, bool sorted = false);
+  void hkeys(std::unordered_set<std::string>& out);
+  void hvals(std::vector<std::string>& out);
+
+  //----------------------------------------------------------------------------
+  //! HASH keys / values commands - synchronous, streamed. Each field or
+  //! value is handed over to the callback, by move, as soon as it's parsed.
+  //! The callback runs on the connection's event loop thread while this call
+  //! blocks, and may see strings again from the start if the request is
+  //! retried after a reconnection.
+  //!
+  //! @return number of strings passed to the callback
+  //----------------------------------------------------------------------------
+  using StringCallback = std::function<void(std::string&& str)>;
+  size_t hkeys(const StringCallback& cb);
+  size_t hvals(const StringCallback& cb);
+
   //----------------------------------------------------------------------------
   //! HASH SCAN command - synchronous
   //!
@@ -287,7 +427,56 @@ public:
   hscan(const std::string& cursor, long long count = 1000);
 
   //----------------------------------------------------------------------------
-  //! Iterator class
+  //! Non-blocking forms of the above. The *_future methods return a
+  //! TypedFuture, the *_async ones hand the result to a callback running on
+  //! the callback executor. Neither throws on unexpected replies - these are
+  //! reported through the returned Status instead.
+  //!
+  //! Reads bypass the cache, if any; writes invalidate it when issued.
+  //----------------------------------------------------------------------------
+  TypedFuture<std::string> hget_future(const std::string& field);
+  void hget_async(const std::string& field, TypedCallback<std::string> cb);
+
+  TypedFuture<bool> hset_future(const std::string& field, const std::string& value);
+  void hset_async(const std::string& field, const std::string& value,
+                  TypedCallback<bool> cb);
+
+  TypedFuture<bool> hsetnx_future(const std::string& field, const std::string& value);
+  void hsetnx_async(const std::string& field, const std::string& value,
+                    TypedCallback<bool> cb);
+
+  TypedFuture<bool> hmset_future(const std::list<std::string>& lst_elem);
+  void hmset_async(const std::list<std::string>& lst_elem, TypedCallback<bool> cb);
+
+  TypedFuture<bool> hdel_future(const std::string& field);
+  void hdel_async(const std::string& field, TypedCallback<bool> cb);
+
+  TypedFuture<bool> hexists_future(const std::string& field);
+  void hexists_async(const std::string& field, TypedCallback<bool> cb);
+
+  TypedFuture<long long> hlen_future();
+  void hlen_async(TypedCallback<long long> cb);
+
+  TypedFuture<long long> hincrby_future(const std::string& field, long long increment);
+  void hincrby_async(const std::string& field, long long increment,
+                     TypedCallback<long long> cb);
+
+  TypedFuture<double> hincrbyfloat_future(const std::string& field, double increment);
+  void hincrbyfloat_async(const std::string& field, double increment,
+                          TypedCallback<double> cb);
+
+  TypedFuture<std::vector<std::string>> hgetall_future();
+  void hgetall_async(TypedCallback<std::vector<std::string>> cb);
+
+  TypedFuture<std::vector<std::string>> hkeys_future();
+  void hkeys_async(TypedCallback<std::vector<std::string>> cb);
+
+  TypedFuture<std::vector<std::string>> hvals_future();
+  void hvals_async(TypedCallback<std::vector<std::string>> cb);
+
+  //----------------------------------------------------------------------------
+  //! Iterator class - as soon as a page arrives, the request for the next one
+  //! goes out, so that fetching it overlaps with consuming the current one.
   //-----------------------------------------------------------------------------
   class Iterator {
   public:
@@ -298,24 +487,81 @@ public:
     std::string getValue() const;
     size_t requestsSoFar() const;
 
+    //--------------------------------------------------------------------------
+    //! Same as getKey / getValue, without copying: The views point into the
+    //! reply of the current page - or, for compressed values, into their
+    //! decoded copies - and remain valid until the iterator moves past it.
+    //--------------------------------------------------------------------------
+    StringView getKeyView() const;
+    StringView getValueView() const;
+
   private:
     friend class QHash;
     Iterator(QHash &qhash, size_t count, const std::string &startCursor);
     void fillFromBackend();
+    void prefetch();
 
     QHash &qhash;
     uint32_t count;
     std::string cursor;
     bool reachedEnd = false;
-    std::map<std::string, std::string> results;
+    redisReplyPtr page; ///< Current page, kept alive for the views
+    const redisReply* entries = nullptr; ///< Field, value pairs of page
+    size_t position = 0; ///< Offset of the current pair in entries
+    std::vector<std::string> decoded; ///< Decompressed values, if compressing
     size_t reqs = 0;
+    ReplyFuture pending; ///< Request for the page after results
   };
 
   Iterator getIterator(size_t count = 100000, const std::string &startCursor = "0");
 
 private:
+  //----------------------------------------------------------------------------
+  //! Drop cached contents of this hash, if caching
+  //----------------------------------------------------------------------------
+  void invalidateCache()
+  {
+    if (mCache) {
+      mCache->invalidate(mKey);
+    }
+  }
+
+  //----------------------------------------------------------------------------
+  //! Value to send in place of the given one: Either itself, or its encoding,
+  //! stored into buffer
+  //----------------------------------------------------------------------------
+  const std::string& packValue(const std::string& value,
+                               std::string& buffer) const
+  {
+    if (mCompression.encode(value, buffer)) {
+      return buffer;
+    }
+
+    return value;
+  }
+
+  //----------------------------------------------------------------------------
+  //! Decode values received from the backend in place, if compressing -
+  //! throws on corrupted ones
+  //----------------------------------------------------------------------------
+  void packValues(std::list<std::string>& lst_elem) const;
+
+  //----------------------------------------------------------------------------
+  //! Run a command replying with a flat aggregate of strings, such as HKEYS,
+  //! through the given decoder - throws if the reply is unexpected
+  //----------------------------------------------------------------------------
+  template<typename Decoder>
+  void executeDecode(const std::string& cmd, Decoder& decoder);
+  void unpackValue(std::string& value) const;
+  void unpackValues(std::vector<std::string>& values, size_t first,
+                    size_t stride) const;
+  void unpackValues(std::map<std::string, std::string>& values) const;
+  void unpackValues(std::unordered_map<std::string, std::string>& values) const;
+
   QClient* mClient; ///< Client to talk to the backend
   std::string mKey; ///< Key of the hash object
+  std::shared_ptr<QHashCache> mCache; ///< Optional cache for reads
+  ValueCompression mCompression = ValueCompression::Disabled();
 };
 
 //------------------------------------------------------------------------------
@@ -324,7 +570,9 @@ private:
 inline void
 QHash::hset_async(const std::string& field, const std::string& value, AsyncHandler* ah)
 {
-  ah->Register(mClient, {"HSET", mKey, field, value});
+  std::string buffer;
+  invalidateCache();
+  ah->Register(mClient, {"HSET", mKey, field, packValue(value, buffer)});
 }
 
 //------------------------------------------------------------------------------
@@ -332,7 +580,10 @@ QHash::hset_async(const std::string& field, const std::string& value, AsyncHandl
 //------------------------------------------------------------------------------
 inline bool QHash::hsetnx(const std::string& field, const std::string& value)
 {
-  redisReplyPtr reply = mClient->exec("HSETNX", mKey, field, value).get();
+  std::string buffer;
+  redisReplyPtr reply = mClient->pooledExec("HSETNX", mKey, field,
+                        packValue(value, buffer)).get();
+  invalidateCache();
 
   if ((reply == nullptr) || (reply->type != REDIS_REPLY_INTEGER)) {
     throw std::runtime_error("[FATAL] Error hsetnx key: " + mKey + " field: "
@@ -350,6 +601,7 @@ void
 QHash::hincrby_async(const std::string& field, const T& increment,
                      AsyncHandler* ah)
 {
+  invalidateCache();
   ah->Register(mClient, {"HINCRBY", mKey, field, std::to_string(increment)});
 }
 
@@ -359,8 +611,9 @@ QHash::hincrby_async(const std::string& field, const T& increment,
 template <typename T>
 long long int QHash::hincrby(const std::string& field, const T& increment)
 {
-  redisReplyPtr reply = mClient->exec("HINCRBY", mKey, field,
-                                      std::to_string(increment)).get();
+  redisReplyPtr reply = mClient->pooledExec("HINCRBY", mKey, field,
+                                            increment).get();
+  invalidateCache();
 
   if ((reply == nullptr) || (reply->type != REDIS_REPLY_INTEGER)) {
     throw std::runtime_error("[FATAL] Error hincrby key: " + mKey + " field: "
@@ -376,8 +629,9 @@ long long int QHash::hincrby(const std::string& field, const T& increment)
 template <typename T>
 double QHash::hincrbyfloat(const std::string& field, const T& increment)
 {
-  redisReplyPtr reply = mClient->exec("HINCRBYFLOAT", mKey, field,
-                                      std::to_string(increment)).get();
+  redisReplyPtr reply = mClient->pooledExec("HINCRBYFLOAT", mKey, field,
+                                            std::to_string(increment)).get();
+  invalidateCache();
 
   if ((reply == nullptr) || (reply->type != REDIS_REPLY_STRING)) {
     throw std::runtime_error("[FATAL] Error hincrbyfloat key: " + mKey + " field: "
@@ -388,4 +642,31 @@ double QHash::hincrbyfloat(const std::string& field, const T& increment)
   return std::stod(resp);
 }
 
+//------------------------------------------------------------------------------
+// HMSET in chunks, pipelined - synchronous
+//------------------------------------------------------------------------------
+template <typename Iter>
+BulkLoadResult QHash::hmset_bulk(Iter begin, Iter end,
+                                 const BulkLoadOptions& options)
+{
+  BulkPipeline pipeline(mClient, options.maxInFlight, REDIS_REPLY_STATUS);
+  size_t chunkArgs = 2 + 2 * std::max<size_t>(options.chunkSize, 1u);
+  std::string buffer;
+
+  while (begin != end) {
+    pipeline.startCommand("HMSET", mKey);
+
+    for (; begin != end && pipeline.argumentCount() < chunkArgs; ++begin) {
+      pipeline.addArgument(begin->first);
+      pipeline.addArgument(packValue(begin->second, buffer));
+    }
+
+    pipeline.sendCommand();
+  }
+
+  BulkLoadResult result = pipeline.finish();
+  invalidateCache();
+  return result;
+}
+
 QCLIENT_NAMESPACE_END
@@ -0,0 +1,153 @@
+//------------------------------------------------------------------------------
+//! @file QHashCache.hh
+//! @brief Client-side cache for QHash reads
+//------------------------------------------------------------------------------
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2016 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#pragma once
+#include "qclient/Namespace.hh"
+#include "qclient/pubsub/MessageListener.hh"
+#include <chrono>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+QCLIENT_NAMESPACE_BEGIN
+
+class SteadyClock;
+
+//------------------------------------------------------------------------------
+//! Opt-in cache for QHash::hget, hexists and hlen - attach to any number of
+//! QHash objects through QHash::setCache.
+//!
+//! Entries expire after a TTL, and the least recently used ones are evicted
+//! once the cache holds more than maxBytes. Writes through a QHash with this
+//! cache attached drop the affected key right away; to also notice writes
+//! from other clients, feed the cache push messages:
+//!
+//! - Set it as Options::messageListener with exclusivePubsub = false (or
+//!   forward to handleIncomingMessage from your own listener), and
+//! - Subscribe that connection to keyspace notifications for the hashes
+//!   (__keyspace@*__:<key>), or to __redis__:invalidate with server-side
+//!   client tracking.
+//!
+//! Without invalidation messages, reads may be stale for up to the TTL.
+//------------------------------------------------------------------------------
+class QHashCache : public MessageListener
+{
+public:
+  //----------------------------------------------------------------------------
+  //! Constructor
+  //!
+  //! @param ttl maximum time to serve an entry from the cache
+  //! @param maxBytes approximate memory bound for cached entries
+  //! @param clock clock to use - nullptr means the real one
+  //----------------------------------------------------------------------------
+  QHashCache(std::chrono::milliseconds ttl, size_t maxBytes,
+             SteadyClock* clock = nullptr);
+
+  //----------------------------------------------------------------------------
+  //! Lookup cached field. On a hit, exists and value are filled. On a miss,
+  //! generation is filled with the token to pass to putField.
+  //----------------------------------------------------------------------------
+  bool getField(const std::string& key, const std::string& field,
+                bool& exists, std::string& value, uint64_t& generation);
+
+  //----------------------------------------------------------------------------
+  //! Store field fetched from the backend. Ignored if any invalidation
+  //! happened since generation was handed out, as the fetched value might
+  //! predate it.
+  //----------------------------------------------------------------------------
+  void putField(const std::string& key, const std::string& field,
+                bool exists, const std::string& value, uint64_t generation);
+
+  //----------------------------------------------------------------------------
+  //! Same as above, for the hash length
+  //----------------------------------------------------------------------------
+  bool getLength(const std::string& key, long long int& length,
+                 uint64_t& generation);
+  void putLength(const std::string& key, long long int length,
+                 uint64_t generation);
+
+  //----------------------------------------------------------------------------
+  //! Drop everything cached for the given key
+  //----------------------------------------------------------------------------
+  void invalidate(const std::string& key);
+
+  //----------------------------------------------------------------------------
+  //! Drop everything
+  //----------------------------------------------------------------------------
+  void invalidateAll();
+
+  //----------------------------------------------------------------------------
+  //! Invalidate keys named in keyspace notifications, keyevent notifications
+  //! or client tracking messages - ignore anything else.
+  //----------------------------------------------------------------------------
+  void handleIncomingMessage(const Message& msg) override;
+
+  //----------------------------------------------------------------------------
+  //! Number of cached entries, and their approximate size in bytes
+  //----------------------------------------------------------------------------
+  size_t size() const;
+  size_t bytes() const;
+
+private:
+  //----------------------------------------------------------------------------
+  //! One cached field, or the length of the hash if isLength is set
+  //----------------------------------------------------------------------------
+  struct Entry {
+    std::string key;
+    std::string field;
+    bool isLength;
+    bool exists;
+    std::string value;
+    long long int length;
+    std::chrono::steady_clock::time_point expiry;
+  };
+
+  using Lru = std::list<Entry>;
+
+  struct KeyIndex {
+    std::unordered_map<std::string, Lru::iterator> fields;
+    Lru::iterator length;
+    bool hasLength = false;
+  };
+
+  //----------------------------------------------------------------------------
+  //! Helpers, called with mMutex held
+  //----------------------------------------------------------------------------
+  Entry* lookup(const std::string& key, const std::string* field);
+  void insert(Entry&& entry);
+  void erase(Lru::iterator it);
+  static size_t entrySize(const Entry& entry);
+
+  std::chrono::milliseconds mTtl;
+  size_t mMaxBytes;
+  SteadyClock* mClock;
+
+  mutable std::mutex mMutex;
+  Lru mLru; ///< Most recently used at the front
+  std::unordered_map<std::string, KeyIndex> mIndex;
+  size_t mBytes = 0;
+  uint64_t mGeneration = 0;
+};
+
+QCLIENT_NAMESPACE_END
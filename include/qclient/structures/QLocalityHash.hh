@@ -25,8 +25,12 @@
 #define QCLIENT_STRUCTURES_LOCALITY_HASH_HH
 
 #include <string>
-#include <deque>
+#include <unordered_map>
+#include <vector>
 #include "qclient/Reply.hh"
+#include "qclient/ReplyFuture.hh"
+#include "qclient/utils/StringView.hh"
+#include "qclient/structures/TypedFuture.hh"
 
 namespace qclient {
 
@@ -38,6 +42,63 @@ class QClient;
 class QLocalityHash
 {
 public:
+  //----------------------------------------------------------------------------
+  //! Constructor
+  //----------------------------------------------------------------------------
+  QLocalityHash(QClient &qcl, const std::string &key);
+
+  //----------------------------------------------------------------------------
+  //! LHGET - the value of the given field, or "" if it does not exist. The
+  //! locality hint is optional, and speeds up the lookup if correct.
+  //----------------------------------------------------------------------------
+  TypedFuture<std::string> lhget_future(const std::string &field,
+    const std::string &hint = "");
+  void lhget_async(const std::string &field, const std::string &hint,
+    TypedCallback<std::string> cb);
+
+  //----------------------------------------------------------------------------
+  //! A field to look up in bulk, along with its locality hint - may be empty
+  //----------------------------------------------------------------------------
+  struct Lookup {
+    std::string field;
+    std::string hint;
+  };
+
+  //----------------------------------------------------------------------------
+  //! Bulk LHGET - synchronous. Lookups are grouped by locality hint, so that
+  //! fields which live next to each other on the server are requested back
+  //! to back, and pipelined with at most maxInFlight awaiting a reply.
+  //!
+  //! @param lookups fields to look up, in any order
+  //! @param out receives the fields which exist, with their values
+  //! @param maxInFlight size of the window, at least 1
+  //!
+  //! @return OK, or the first error - no further lookups are sent after it,
+  //!         and out holds whatever had arrived until then
+  //----------------------------------------------------------------------------
+  Status lhgetBulk(const std::vector<Lookup> &lookups,
+    std::unordered_map<std::string, std::string> &out, size_t maxInFlight = 64);
+
+  //----------------------------------------------------------------------------
+  //! LHSET - true if the field did not exist before
+  //----------------------------------------------------------------------------
+  TypedFuture<bool> lhset_future(const std::string &field,
+    const std::string &hint, const std::string &value);
+  void lhset_async(const std::string &field, const std::string &hint,
+    const std::string &value, TypedCallback<bool> cb);
+
+  //----------------------------------------------------------------------------
+  //! LHDEL - true if the field existed
+  //----------------------------------------------------------------------------
+  TypedFuture<bool> lhdel_future(const std::string &field);
+  void lhdel_async(const std::string &field, TypedCallback<bool> cb);
+
+  //----------------------------------------------------------------------------
+  //! LHLEN - number of fields
+  //----------------------------------------------------------------------------
+  TypedFuture<long long> lhlen_future();
+  void lhlen_async(TypedCallback<long long> cb);
+
 
   //----------------------------------------------------------------------------
   //! Iterator class
@@ -57,6 +118,14 @@ public:
     std::string getLocalityHint() const;
     std::string getValue() const;
 
+    //--------------------------------------------------------------------------
+    //! Same as above, without copying: The views point into the reply of the
+    //! current page, and remain valid until the iterator moves past it.
+    //--------------------------------------------------------------------------
+    StringView getKeyView() const;
+    StringView getLocalityHintView() const;
+    StringView getValueView() const;
+
     //--------------------------------------------------------------------------
     //! Check if an unexpected error occurred (network issue,
     //! data type mismatch)
@@ -87,10 +156,22 @@ public:
     void malformed(redisReplyPtr reply);
 
     //--------------------------------------------------------------------------
-    //! Fill internal buffer with contents from remote server
+    //! Fetch pages from the remote server until one has entries
     //--------------------------------------------------------------------------
     void fillFromBackend();
 
+    //--------------------------------------------------------------------------
+    //! Element of the current entry: 0 is the locality hint, 1 the key, 2 the
+    //! value
+    //--------------------------------------------------------------------------
+    StringView element(size_t offset) const;
+
+    //--------------------------------------------------------------------------
+    //! Request the next page. Issued as soon as the current one arrives, so
+    //! that fetching it overlaps with consuming the current one.
+    //--------------------------------------------------------------------------
+    void prefetch();
+
     QClient *mQcl;
     std::string mKey;
 
@@ -98,13 +179,23 @@ public:
     std::string mCursor;
     bool mReachedEnd = false;
     size_t mReqs = 0;
+    ReplyFuture mPending;
 
-    std::deque<std::string> mResults;
-    redisReplyPtr mReply;
+    redisReplyPtr mReply; ///< Current page, kept alive for the views
+    const redisReply *mEntries = nullptr; ///< Hint, key, value triplets
+    size_t mPosition = 0; ///< Offset of the current entry in mEntries
 
     std::string mError;
   };
 
+private:
+  //----------------------------------------------------------------------------
+  //! LHGET request, with the hint only if given
+  //----------------------------------------------------------------------------
+  EncodedRequest makeLhget(const std::string &field, const std::string &hint) const;
+
+  QClient &mQcl;
+  std::string mKey;
 };
 
 }
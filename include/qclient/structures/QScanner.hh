@@ -43,10 +43,11 @@ public:
 
   void fillFromBackend() {
     while(!reachedEnd && results.empty()) {
-      reqs++;
+      if(!pending.valid()) {
+        prefetch();
+      }
 
-      redisReplyPtr reply = qcl.exec("SCAN", cursor, "MATCH", pattern,
-                                     "COUNT", std::to_string(count)).get();
+      redisReplyPtr reply = pending.get();
 
       if (reply == nullptr) {
         throw std::runtime_error("[FATAL] Error scan pattern: " + pattern +
@@ -66,6 +67,9 @@ public:
       if(cursor == "0") {
         reachedEnd = true;
       }
+      else {
+        prefetch();
+      }
     }
   }
 
@@ -85,6 +89,16 @@ public:
   }
 
 private:
+  //----------------------------------------------------------------------------
+  //! As soon as a page arrives, the request for the next one goes out, so
+  //! that fetching it overlaps with consuming the current one.
+  //----------------------------------------------------------------------------
+  void prefetch() {
+    reqs++;
+    pending = qcl.pooledExec("SCAN", cursor, "MATCH", pattern, "COUNT",
+                             count);
+  }
+
   qclient::QClient &qcl;
   std::string pattern;
   uint32_t count;
@@ -92,6 +106,7 @@ private:
   bool reachedEnd;
   std::deque<std::string> results;
   size_t reqs = 0;
+  ReplyFuture pending;
 };
 
 }
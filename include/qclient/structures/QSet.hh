@@ -26,8 +26,12 @@
 #include "qclient/Namespace.hh"
 #include "qclient/Utils.hh"
 #include "qclient/AsyncHandler.hh"
+#include "qclient/structures/BulkLoad.hh"
+#include "qclient/structures/TypedFuture.hh"
+#include <functional>
 #include <vector>
 #include <set>
+#include <unordered_set>
 
 QCLIENT_NAMESPACE_BEGIN
 
@@ -172,6 +176,24 @@ public:
   template<typename Iterator>
   void sadd_async(const Iterator& begin, const Iterator& end, AsyncHandler* ah);
 
+  //----------------------------------------------------------------------------
+  //! Redis SET add command for large inputs - synchronous. The members are
+  //! split into SADD commands of options.chunkSize members each, encoded
+  //! straight out of the input, and pipelined with at most
+  //! options.maxInFlight of them awaiting a reply.
+  //!
+  //! Not atomic: If some chunks fail, the rest are still applied.
+  //!
+  //! @param begin, end range of members
+  //! @param options chunking options
+  //!
+  //! @return aggregate result of all chunks - total holds the number of
+  //!         members actually added
+  //----------------------------------------------------------------------------
+  template<typename Iter>
+  BulkLoadResult sadd_bulk(Iter begin, Iter end,
+                           const BulkLoadOptions& options = BulkLoadOptions());
+
   //----------------------------------------------------------------------------
   //! Redis SET remove command - synchronous
   //!
@@ -221,6 +243,30 @@ public:
   //----------------------------------------------------------------------------
   std::set<std::string> smembers();
 
+  //----------------------------------------------------------------------------
+  //! Redis SET members command - synchronous, filling the given container.
+  //! Members are moved into it as they are parsed, after reserving room for
+  //! all of them, which for large sets is much cheaper than building a
+  //! std::set.
+  //!
+  //! @param out cleared, then filled with the members of the set
+  //! @param sorted if true, sort the vector once all members are in
+  //----------------------------------------------------------------------------
+  void smembers(std::vector<std::string>& out, bool sorted = false);
+  void smembers(std::unordered_set<std::string>& out);
+
+  //----------------------------------------------------------------------------
+  //! Redis SET members command - synchronous, streamed. Each member is handed
+  //! over to the callback, by move, as soon as it's parsed - nothing is
+  //! accumulated. The callback runs on the connection's event loop thread
+  //! while this call blocks, and may see members again from the start if the
+  //! request is retried after a reconnection.
+  //!
+  //! @return number of members passed to the callback
+  //----------------------------------------------------------------------------
+  using MemberCallback = std::function<void(std::string&& member)>;
+  size_t smembers(const MemberCallback& cb);
+
   //----------------------------------------------------------------------------
   //! Redis SET SSCAN command - synchronous
   //!
@@ -234,7 +280,37 @@ public:
   sscan(const std::string &cursor, long long count = 1000);
 
   //----------------------------------------------------------------------------
-  //! Iterator class
+  //! Non-blocking forms of the above. The *_future methods return a
+  //! TypedFuture, the *_async ones hand the result to a callback running on
+  //! the callback executor. Unexpected replies are reported through the
+  //! returned Status, never thrown.
+  //----------------------------------------------------------------------------
+  TypedFuture<bool> sadd_future(const std::string& member);
+  void sadd_async(const std::string& member, TypedCallback<bool> cb);
+
+  TypedFuture<long long> sadd_future(const std::list<std::string>& lst_elem);
+  void sadd_async(const std::list<std::string>& lst_elem,
+                  TypedCallback<long long> cb);
+
+  TypedFuture<bool> srem_future(const std::string& member);
+  void srem_async(const std::string& member, TypedCallback<bool> cb);
+
+  TypedFuture<long long> srem_future(const std::list<std::string>& lst_elem);
+  void srem_async(const std::list<std::string>& lst_elem,
+                  TypedCallback<long long> cb);
+
+  TypedFuture<long long> scard_future();
+  void scard_async(TypedCallback<long long> cb);
+
+  TypedFuture<bool> sismember_future(const std::string& member);
+  void sismember_async(const std::string& member, TypedCallback<bool> cb);
+
+  TypedFuture<std::set<std::string>> smembers_future();
+  void smembers_async(TypedCallback<std::set<std::string>> cb);
+
+  //----------------------------------------------------------------------------
+  //! Iterator class - as soon as a page arrives, the request for the next one
+  //! goes out, so that fetching it overlaps with consuming the current one.
   //-----------------------------------------------------------------------------
   class Iterator {
   public:
@@ -248,6 +324,7 @@ public:
     friend class QSet;
     Iterator(QSet &qset, size_t count, const std::string &startCursor);
     void fillFromBackend();
+    void prefetch();
 
     QSet &qset;
     uint32_t count;
@@ -255,6 +332,7 @@ public:
     bool reachedEnd = false;
     std::vector<std::string> results;
     size_t reqs = 0;
+    ReplyFuture pending; ///< Request for the page after results
 
     std::vector<std::string>::const_iterator it;
   };
@@ -262,6 +340,12 @@ public:
   Iterator getIterator(size_t count = 100000, const std::string &startCursor = "0");
 
 private:
+  //----------------------------------------------------------------------------
+  //! Run SMEMBERS with the given decoder, throw if the reply is unexpected
+  //----------------------------------------------------------------------------
+  template<typename Decoder>
+  void smembersDecode(Decoder& decoder);
+
   QClient* mClient; ///< Qclient client object
   std::string mKey; ///< Key of the set object
 };
@@ -288,7 +372,7 @@ QSet::sadd_async(const Iter& begin, const Iter& end, AsyncHandler* ah)
 
 inline bool QSet::sadd(const std::string& member)
 {
-  redisReplyPtr reply = mClient->exec("SADD", mKey, member).get();
+  redisReplyPtr reply = mClient->pooledExec("SADD", mKey, member).get();
 
   if ((reply == nullptr) || (reply->type != REDIS_REPLY_INTEGER)) {
     throw std::runtime_error("[FATAL] Error sadd key: " + mKey + " field: "
@@ -305,7 +389,7 @@ inline void QSet::srem_async(const std::string& member, AsyncHandler* ah)
 
 inline bool QSet::srem(const std::string& member)
 {
-  redisReplyPtr reply = mClient->exec("SREM", mKey, member).get();
+  redisReplyPtr reply = mClient->pooledExec("SREM", mKey, member).get();
 
   if ((reply == nullptr) || (reply->type != REDIS_REPLY_INTEGER)) {
     throw std::runtime_error("[FATAL] Error srem key: " + mKey + " member: "
@@ -317,7 +401,7 @@ inline bool QSet::srem(const std::string& member)
 
 inline bool QSet::sismember(const std::string& member)
 {
-  redisReplyPtr reply = mClient->exec("SISMEMBER", mKey, member).get();
+  redisReplyPtr reply = mClient->pooledExec("SISMEMBER", mKey, member).get();
 
   if ((reply == nullptr) || (reply->type != REDIS_REPLY_INTEGER)) {
     throw std::runtime_error("[FATAL] Error sismember key: " + mKey + " member: "
@@ -327,4 +411,27 @@ inline bool QSet::sismember(const std::string& member)
   return (reply->integer == 1);
 }
 
+//------------------------------------------------------------------------------
+// Redis SET add command in chunks, pipelined - synchronous
+//------------------------------------------------------------------------------
+template<typename Iter>
+BulkLoadResult QSet::sadd_bulk(Iter begin, Iter end,
+                               const BulkLoadOptions& options)
+{
+  BulkPipeline pipeline(mClient, options.maxInFlight, REDIS_REPLY_INTEGER);
+  size_t chunkArgs = 2 + std::max<size_t>(options.chunkSize, 1u);
+
+  while (begin != end) {
+    pipeline.startCommand("SADD", mKey);
+
+    for (; begin != end && pipeline.argumentCount() < chunkArgs; ++begin) {
+      pipeline.addArgument(*begin);
+    }
+
+    pipeline.sendCommand();
+  }
+
+  return pipeline.finish();
+}
+
 QCLIENT_NAMESPACE_END
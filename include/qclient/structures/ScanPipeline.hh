@@ -0,0 +1,142 @@
+//------------------------------------------------------------------------------
+//! @file ScanPipeline.hh
+//! @brief Scan-and-act bulk maintenance over the keyspace
+//------------------------------------------------------------------------------
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2016 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#pragma once
+#include "qclient/Namespace.hh"
+#include "qclient/structures/BulkLoad.hh"
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
+
+QCLIENT_NAMESPACE_BEGIN
+
+class QClient;
+class QClientPool;
+
+//------------------------------------------------------------------------------
+//! What to scan, and how many commands to keep going at once
+//------------------------------------------------------------------------------
+struct ScanPipelineOptions {
+  //----------------------------------------------------------------------------
+  //! Keys to visit, as a SCAN MATCH pattern
+  //----------------------------------------------------------------------------
+  std::string pattern = "*";
+
+  //----------------------------------------------------------------------------
+  //! COUNT hint of each SCAN request
+  //----------------------------------------------------------------------------
+  size_t scanCount = 1000;
+
+  //----------------------------------------------------------------------------
+  //! Maximum number of commands awaiting a reply at any time
+  //----------------------------------------------------------------------------
+  size_t maxInFlight = 64;
+
+  //----------------------------------------------------------------------------
+  //! Report progress every this many keys scanned - 0 to only report once
+  //! the scan is done
+  //----------------------------------------------------------------------------
+  size_t progressInterval = 10000;
+};
+
+//------------------------------------------------------------------------------
+//! Outcome of a scan, or progress so far
+//------------------------------------------------------------------------------
+struct ScanPipelineResult {
+  size_t keysScanned = 0;   ///< Keys returned by SCAN
+  size_t keysSkipped = 0;   ///< Keys for which the action issued no command
+  size_t scanRequests = 0;  ///< SCAN requests sent
+  BulkLoadResult commands;  ///< Outcome of the commands replied to so far
+  std::chrono::milliseconds elapsed {0};
+
+  double keysPerSecond() const {
+    if (elapsed.count() == 0) {
+      return 0;
+    }
+
+    return keysScanned * 1000.0 / elapsed.count();
+  }
+
+  bool ok() const {
+    return commands.ok();
+  }
+};
+
+//------------------------------------------------------------------------------
+//! Visits all keys matching a pattern through QScanner, and issues a command
+//! for each, such as deleting or expiring it: The next SCAN page is fetched
+//! while the current one is worked through, and up to maxInFlight commands
+//! are awaiting a reply at any time, instead of a round-trip per key.
+//!
+//! A command counts as failed on an error reply - a failed command does not
+//! stop the scan. Keys created or removed while scanning may or may not be
+//! visited, as with SCAN itself.
+//------------------------------------------------------------------------------
+class ScanPipeline {
+public:
+  //----------------------------------------------------------------------------
+  //! Fill in the command to issue for the given key, which starts out empty
+  //! - return false, or leave it empty, to skip the key.
+  //----------------------------------------------------------------------------
+  using Action = std::function<bool(const std::string& key,
+                                    std::vector<std::string>& command)>;
+
+  //----------------------------------------------------------------------------
+  //! Called every progressInterval keys, and once more at the end
+  //----------------------------------------------------------------------------
+  using ProgressCallback = std::function<void(const ScanPipelineResult&)>;
+
+  //----------------------------------------------------------------------------
+  //! Constructor - commands go through the given client, or are spread over
+  //! the connections of the given pool
+  //----------------------------------------------------------------------------
+  ScanPipeline(QClient& qcl, const ScanPipelineOptions& options = {});
+  ScanPipeline(QClientPool& pool, const ScanPipelineOptions& options = {});
+
+  //----------------------------------------------------------------------------
+  //! Set progress callback
+  //----------------------------------------------------------------------------
+  void onProgress(ProgressCallback callback);
+
+  //----------------------------------------------------------------------------
+  //! Run through the keyspace, blocking until all commands are answered.
+  //! Throws if a SCAN request fails.
+  //----------------------------------------------------------------------------
+  ScanPipelineResult run(const Action& action);
+
+  //----------------------------------------------------------------------------
+  //! Action issuing "cmd <key> args..." for every key, such as
+  //! perKey("UNLINK") or perKey("EXPIRE", {"3600"})
+  //----------------------------------------------------------------------------
+  static Action perKey(const std::string& cmd,
+                       const std::vector<std::string>& args = {});
+
+private:
+  QClient* mQcl = nullptr;
+  QClientPool* mPool = nullptr;
+  ScanPipelineOptions mOptions;
+  ProgressCallback mProgress;
+};
+
+QCLIENT_NAMESPACE_END
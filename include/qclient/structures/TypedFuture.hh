@@ -0,0 +1,156 @@
+//------------------------------------------------------------------------------
+// File: TypedFuture.hh
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#ifndef QCLIENT_STRUCTURES_TYPED_FUTURE_HH
+#define QCLIENT_STRUCTURES_TYPED_FUTURE_HH
+
+#include "qclient/QClient.hh"
+#include "qclient/ReplyFuture.hh"
+#include "qclient/Status.hh"
+#include <functional>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace qclient {
+
+//------------------------------------------------------------------------------
+//! Reply parsers shared by the structure wrappers. Each one converts a reply
+//! into a typed value, or returns EINVAL describing what was unexpected about
+//! it - they never throw.
+//------------------------------------------------------------------------------
+namespace TypedReply {
+
+//------------------------------------------------------------------------------
+//! INTEGER reply
+//------------------------------------------------------------------------------
+Status toInteger(const redisReplyPtr &reply, long long &out);
+
+//------------------------------------------------------------------------------
+//! INTEGER reply, true if equal to 1 - as returned by SADD, HSET, HEXISTS...
+//------------------------------------------------------------------------------
+Status toBool(const redisReplyPtr &reply, bool &out);
+
+//------------------------------------------------------------------------------
+//! STATUS reply, true if "OK"
+//------------------------------------------------------------------------------
+Status toOk(const redisReplyPtr &reply, bool &out);
+
+//------------------------------------------------------------------------------
+//! STRING reply. A nil reply gives an empty string - not an error.
+//------------------------------------------------------------------------------
+Status toString(const redisReplyPtr &reply, std::string &out);
+
+//------------------------------------------------------------------------------
+//! STRING reply holding a floating point number, as returned by HINCRBYFLOAT
+//------------------------------------------------------------------------------
+Status toDouble(const redisReplyPtr &reply, double &out);
+
+//------------------------------------------------------------------------------
+//! Flat aggregate reply made of strings
+//------------------------------------------------------------------------------
+Status toStringVector(const redisReplyPtr &reply, std::vector<std::string> &out);
+Status toStringSet(const redisReplyPtr &reply, std::set<std::string> &out);
+
+}
+
+//------------------------------------------------------------------------------
+//! Callback receiving a typed result. On error, the value is
+//! default-constructed.
+//------------------------------------------------------------------------------
+template<typename T>
+using TypedCallback = std::function<void(Status, T&&)>;
+
+//------------------------------------------------------------------------------
+//! A ReplyFuture paired with the parser turning its reply into a T - what
+//! the *_future methods of QHash, QSet, QDeque and QLocalityHash return.
+//!
+//! Movable, not copyable. get() may only be called once.
+//------------------------------------------------------------------------------
+template<typename T>
+class TypedFuture {
+public:
+  using Parser = Status (*)(const redisReplyPtr &reply, T &out);
+
+  TypedFuture() {}
+  TypedFuture(ReplyFuture &&fut, Parser parser)
+  : mFuture(std::move(fut)), mParser(parser) {}
+
+  TypedFuture(TypedFuture &&other) = default;
+  TypedFuture& operator=(TypedFuture &&other) = default;
+
+  bool valid() const {
+    return mFuture.valid();
+  }
+
+  bool ready() const {
+    return mFuture.ready();
+  }
+
+  void wait() const {
+    mFuture.wait();
+  }
+
+  std::future_status wait_for(std::chrono::milliseconds timeout) const {
+    return mFuture.wait_for(timeout);
+  }
+
+  //----------------------------------------------------------------------------
+  //! Wait for the reply, and parse it into out. Leaves the future invalid.
+  //----------------------------------------------------------------------------
+  Status get(T &out) {
+    return mParser(mFuture.get(), out);
+  }
+
+private:
+  ReplyFuture mFuture;
+  Parser mParser = nullptr;
+};
+
+//------------------------------------------------------------------------------
+//! Issue the given request, returning a future parsing its reply into a T
+//------------------------------------------------------------------------------
+template<typename T>
+TypedFuture<T> executeTyped(QClient &qcl, EncodedRequest &&req,
+  typename TypedFuture<T>::Parser parser) {
+  return TypedFuture<T>(qcl.pooledExecute(std::move(req)), parser);
+}
+
+//------------------------------------------------------------------------------
+//! Issue the given request, handing its parsed reply to cb on the callback
+//! executor. cb may be empty.
+//------------------------------------------------------------------------------
+template<typename T>
+void executeTyped(QClient &qcl, EncodedRequest &&req,
+  typename TypedFuture<T>::Parser parser, TypedCallback<T> cb) {
+
+  qcl.execute(std::move(req), [parser, cb](redisReplyPtr &&reply) {
+    T out {};
+    Status st = parser(reply, out);
+    if(cb) cb(st, std::move(out));
+  });
+}
+
+}
+
+#endif
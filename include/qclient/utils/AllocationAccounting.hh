@@ -0,0 +1,103 @@
+// ----------------------------------------------------------------------
+// File: AllocationAccounting.hh
+// Author: Georgios Bitzes - CERN
+// ----------------------------------------------------------------------
+
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2016 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#ifndef QCLIENT_UTILS_ALLOCATION_ACCOUNTING_HH
+#define QCLIENT_UTILS_ALLOCATION_ACCOUNTING_HH
+
+#include <cstddef>
+#include <cstdint>
+
+namespace qclient {
+
+//------------------------------------------------------------------------------
+//! Hot paths whose heap allocations are accounted for.
+//------------------------------------------------------------------------------
+enum class AllocationCategory : size_t {
+  kEncoding = 0,   // EncodedRequest buffers
+  kParsing,        // reply trees and arena chunks
+  kFutures,        // promise shared states
+  kQueueing,       // request and callback queue blocks
+  kPubsub,         // pub-sub message contents
+  kCount
+};
+
+struct AllocationCount {
+  int64_t allocations = 0;
+  int64_t bytes = 0;
+};
+
+//------------------------------------------------------------------------------
+//! Allocations per category, cumulative over the lifetime of the process.
+//! All zero unless built with ALLOCATION_ACCOUNTING enabled.
+//------------------------------------------------------------------------------
+struct AllocationStatistics {
+  AllocationCount encoding;
+  AllocationCount parsing;
+  AllocationCount futures;
+  AllocationCount queueing;
+  AllocationCount pubsub;
+
+  int64_t totalAllocations() const {
+    return encoding.allocations + parsing.allocations + futures.allocations +
+      queueing.allocations + pubsub.allocations;
+  }
+
+  int64_t totalBytes() const {
+    return encoding.bytes + parsing.bytes + futures.bytes +
+      queueing.bytes + pubsub.bytes;
+  }
+};
+
+//------------------------------------------------------------------------------
+//! Process-wide allocation accounting. Recording compiles down to nothing
+//! unless HAVE_ALLOCATION_ACCOUNTING is set - see the ALLOCATION_ACCOUNTING
+//! CMake option. When enabled, each recorded allocation costs two relaxed
+//! increments on per-CPU counters.
+//------------------------------------------------------------------------------
+class AllocationAccounting {
+public:
+  static constexpr bool enabled() {
+#if HAVE_ALLOCATION_ACCOUNTING == 1
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  static void record(AllocationCategory category, size_t bytes) {
+#if HAVE_ALLOCATION_ACCOUNTING == 1
+    recordSlow(category, bytes);
+#endif
+  }
+
+  static AllocationStatistics get();
+  static AllocationCount get(AllocationCategory category);
+
+private:
+  static void recordSlow(AllocationCategory category, size_t bytes);
+};
+
+}
+
+#endif
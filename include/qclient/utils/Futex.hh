@@ -0,0 +1,119 @@
+//------------------------------------------------------------------------------
+// File: Futex.hh
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#ifndef QCLIENT_UTILS_FUTEX_HH
+#define QCLIENT_UTILS_FUTEX_HH
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <time.h>
+#include <climits>
+#endif
+
+namespace qclient {
+
+//------------------------------------------------------------------------------
+// Thin futex-style wait / wake on a 32-bit atomic word. On Linux, these map
+// directly onto the futex syscall. Elsewhere, onto a small table of mutexes
+// and condition variables, hashed by address.
+//
+// futexWait blocks while *addr == expected, up to timeout if non-negative.
+// It may return spuriously: Always re-check the condition.
+//------------------------------------------------------------------------------
+#if !defined(__linux__)
+struct FutexBucket {
+  std::mutex mtx;
+  std::condition_variable cv;
+};
+
+inline FutexBucket& futexBucket(const void *addr) {
+  static FutexBucket buckets[64];
+  return buckets[(reinterpret_cast<uintptr_t>(addr) >> 4) % 64];
+}
+#endif
+
+inline void futexWait(std::atomic<uint32_t> *addr, uint32_t expected,
+  std::chrono::nanoseconds timeout = std::chrono::nanoseconds(-1)) {
+#if defined(__linux__)
+  struct timespec ts;
+  struct timespec *tsp = nullptr;
+
+  if(timeout.count() >= 0) {
+    ts.tv_sec = timeout.count() / 1000000000;
+    ts.tv_nsec = timeout.count() % 1000000000;
+    tsp = &ts;
+  }
+
+  syscall(SYS_futex, reinterpret_cast<uint32_t*>(addr), FUTEX_WAIT_PRIVATE,
+    expected, tsp, nullptr, 0);
+#else
+  FutexBucket &bucket = futexBucket(addr);
+  std::unique_lock<std::mutex> lock(bucket.mtx);
+
+  if(addr->load() != expected) {
+    return;
+  }
+
+  if(timeout.count() >= 0) {
+    bucket.cv.wait_for(lock, timeout);
+  }
+  else {
+    bucket.cv.wait(lock);
+  }
+#endif
+}
+
+inline void futexWakeAll(std::atomic<uint32_t> *addr) {
+#if defined(__linux__)
+  syscall(SYS_futex, reinterpret_cast<uint32_t*>(addr), FUTEX_WAKE_PRIVATE,
+    INT_MAX, nullptr, nullptr, 0);
+#else
+  FutexBucket &bucket = futexBucket(addr);
+  std::lock_guard<std::mutex> lock(bucket.mtx);
+  bucket.cv.notify_all();
+#endif
+}
+
+//------------------------------------------------------------------------------
+// Hint to the CPU that we're busy-waiting.
+//------------------------------------------------------------------------------
+inline void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield");
+#endif
+}
+
+}
+
+#endif
@@ -0,0 +1,172 @@
+// ----------------------------------------------------------------------
+// File: MemoryResource.hh
+// Author: Georgios Bitzes - CERN
+// ----------------------------------------------------------------------
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#ifndef QCLIENT_UTILS_MEMORY_RESOURCE_HH
+#define QCLIENT_UTILS_MEMORY_RESOURCE_HH
+
+#include <cstddef>
+#include <memory>
+
+#if __cplusplus >= 201703L && defined(__has_include)
+#if __has_include(<memory_resource>)
+#include <memory_resource>
+#define QCLIENT_HAVE_PMR 1
+#endif
+#endif
+
+namespace qclient {
+
+#ifdef QCLIENT_HAVE_PMR
+
+//------------------------------------------------------------------------------
+//! Where qclient allocates queue blocks and reply arenas from - with C++17,
+//! simply std::pmr::memory_resource, so any standard resource can be used.
+//------------------------------------------------------------------------------
+using MemoryResource = std::pmr::memory_resource;
+
+template<typename T>
+using ResourceAllocator = std::pmr::polymorphic_allocator<T>;
+
+inline MemoryResource* newDeleteResource()
+{
+  return std::pmr::new_delete_resource();
+}
+
+#else
+
+//------------------------------------------------------------------------------
+//! Without <memory_resource> (C++14, or gcc 8), a stand-in with the same
+//! interface as std::pmr::memory_resource, so that resources written against
+//! it build either way. The default one sits on top of std::allocator, and
+//! does not support over-aligned allocations.
+//------------------------------------------------------------------------------
+class MemoryResource
+{
+public:
+  virtual ~MemoryResource() {}
+
+  void* allocate(size_t bytes, size_t alignment = alignof(std::max_align_t))
+  {
+    return do_allocate(bytes, alignment);
+  }
+
+  void deallocate(void* p, size_t bytes,
+                  size_t alignment = alignof(std::max_align_t))
+  {
+    do_deallocate(p, bytes, alignment);
+  }
+
+  bool is_equal(const MemoryResource& other) const noexcept
+  {
+    return do_is_equal(other);
+  }
+
+private:
+  virtual void* do_allocate(size_t bytes, size_t alignment) = 0;
+  virtual void do_deallocate(void* p, size_t bytes, size_t alignment) = 0;
+  virtual bool do_is_equal(const MemoryResource& other) const noexcept = 0;
+};
+
+class NewDeleteResource : public MemoryResource
+{
+private:
+  using Unit = std::max_align_t;
+
+  static size_t units(size_t bytes)
+  {
+    return (bytes + sizeof(Unit) - 1) / sizeof(Unit);
+  }
+
+  void* do_allocate(size_t bytes, size_t alignment) override
+  {
+    return std::allocator<Unit>().allocate(units(bytes));
+  }
+
+  void do_deallocate(void* p, size_t bytes, size_t alignment) override
+  {
+    std::allocator<Unit>().deallocate(static_cast<Unit*>(p), units(bytes));
+  }
+
+  bool do_is_equal(const MemoryResource& other) const noexcept override
+  {
+    return this == &other;
+  }
+};
+
+inline MemoryResource* newDeleteResource()
+{
+  static NewDeleteResource resource;
+  return &resource;
+}
+
+//------------------------------------------------------------------------------
+//! Allocator on top of a MemoryResource, like std::pmr::polymorphic_allocator
+//------------------------------------------------------------------------------
+template<typename T>
+class ResourceAllocator
+{
+public:
+  using value_type = T;
+
+  ResourceAllocator(MemoryResource* res) : mResource(res) {}
+
+  template<typename U>
+  ResourceAllocator(const ResourceAllocator<U>& other)
+    : mResource(other.resource()) {}
+
+  T* allocate(size_t n)
+  {
+    return static_cast<T*>(mResource->allocate(n * sizeof(T), alignof(T)));
+  }
+
+  void deallocate(T* p, size_t n)
+  {
+    mResource->deallocate(p, n * sizeof(T), alignof(T));
+  }
+
+  MemoryResource* resource() const
+  {
+    return mResource;
+  }
+
+private:
+  MemoryResource* mResource;
+};
+
+template<typename T, typename U>
+bool operator==(const ResourceAllocator<T>& a, const ResourceAllocator<U>& b)
+{
+  return a.resource() == b.resource() || a.resource()->is_equal(*b.resource());
+}
+
+template<typename T, typename U>
+bool operator!=(const ResourceAllocator<T>& a, const ResourceAllocator<U>& b)
+{
+  return !(a == b);
+}
+
+#endif
+
+}
+
+#endif
@@ -0,0 +1,82 @@
+// ----------------------------------------------------------------------
+// File: ShardedCounter.hh
+// Author: Georgios Bitzes - CERN
+// ----------------------------------------------------------------------
+
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2016 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#ifndef QCLIENT_UTILS_SHARDED_COUNTER_HH
+#define QCLIENT_UTILS_SHARDED_COUNTER_HH
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <sched.h>
+
+namespace qclient {
+
+//------------------------------------------------------------------------------
+//! A counter for hot paths: Increments go to a slot picked by the current CPU,
+//! each slot on its own cache line, so that threads on different cores never
+//! contend. Reading sums up all slots - cheap enough for monitoring, but not
+//! meant for every request.
+//!
+//! A thread migrating between cores simply lands on another slot, every slot
+//! being atomic.
+//------------------------------------------------------------------------------
+class ShardedCounter {
+public:
+  static constexpr size_t kShards = 16;
+
+  void add(int64_t value) {
+    slots[shard()].value.fetch_add(value, std::memory_order_relaxed);
+  }
+
+  int64_t get() const {
+    int64_t sum = 0;
+    for(size_t i = 0; i < kShards; i++) {
+      sum += slots[i].value.load(std::memory_order_relaxed);
+    }
+
+    return sum;
+  }
+
+private:
+  static size_t shard() {
+    int cpu = sched_getcpu();
+    if(cpu < 0) return 0;
+    return static_cast<size_t>(cpu) % kShards;
+  }
+
+  //----------------------------------------------------------------------------
+  //! Padded rather than over-aligned, heap allocations aren't guaranteed to
+  //! honour alignas before C++17.
+  //----------------------------------------------------------------------------
+  struct Slot {
+    std::atomic<int64_t> value {0};
+    char padding[64 - sizeof(std::atomic<int64_t>)];
+  };
+
+  Slot slots[kShards];
+};
+
+}
+
+#endif
@@ -0,0 +1,138 @@
+// ----------------------------------------------------------------------
+// File: StringView.hh
+// Author: Georgios Bitzes - CERN
+// ----------------------------------------------------------------------
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#ifndef QCLIENT_UTILS_STRING_VIEW_HH
+#define QCLIENT_UTILS_STRING_VIEW_HH
+
+#include <algorithm>
+#include <cstring>
+#include <ostream>
+#include <string>
+
+#if __cplusplus >= 201703L && defined(__has_include)
+#if __has_include(<string_view>)
+#include <string_view>
+#define QCLIENT_HAVE_STD_STRING_VIEW 1
+#endif
+#endif
+
+namespace qclient {
+
+//------------------------------------------------------------------------------
+//! Non-owning pointer / length view of a string, for the public headers -
+//! which must not assume C++17, so std::string_view is out. Converts to
+//! std::string explicitly, since that copies, and to std::string_view
+//! implicitly where available.
+//------------------------------------------------------------------------------
+class StringView
+{
+public:
+  StringView() {}
+  StringView(const char* data, size_t size) : mData(data), mSize(size) {}
+  StringView(const char* str) : mData(str), mSize(strlen(str)) {}
+  StringView(const std::string& str) : mData(str.data()), mSize(str.size()) {}
+
+  const char* data() const
+  {
+    return mData;
+  }
+
+  size_t size() const
+  {
+    return mSize;
+  }
+
+  bool empty() const
+  {
+    return mSize == 0;
+  }
+
+  const char* begin() const
+  {
+    return mData;
+  }
+
+  const char* end() const
+  {
+    return mData + mSize;
+  }
+
+  explicit operator std::string() const
+  {
+    return std::string(mData, mSize);
+  }
+
+#ifdef QCLIENT_HAVE_STD_STRING_VIEW
+  operator std::string_view() const
+  {
+    return std::string_view(mData, mSize);
+  }
+#endif
+
+  //----------------------------------------------------------------------------
+  //! Lexicographic, like std::string::compare
+  //----------------------------------------------------------------------------
+  int compare(StringView other) const
+  {
+    size_t len = std::min(mSize, other.mSize);
+    int res = (len == 0) ? 0 : memcmp(mData, other.mData, len);
+
+    if (res != 0) {
+      return res;
+    }
+
+    if (mSize == other.mSize) {
+      return 0;
+    }
+
+    return (mSize < other.mSize) ? -1 : 1;
+  }
+
+private:
+  const char* mData = "";
+  size_t mSize = 0;
+};
+
+inline bool operator==(StringView a, StringView b)
+{
+  return a.size() == b.size() && a.compare(b) == 0;
+}
+
+inline bool operator!=(StringView a, StringView b)
+{
+  return !(a == b);
+}
+
+inline bool operator<(StringView a, StringView b)
+{
+  return a.compare(b) < 0;
+}
+
+inline std::ostream& operator<<(std::ostream& out, StringView view)
+{
+  return out.write(view.data(), view.size());
+}
+
+}
+
+#endif
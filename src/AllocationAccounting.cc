@@ -0,0 +1,68 @@
+//------------------------------------------------------------------------------
+// File: AllocationAccounting.cc
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2016 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#include "qclient/utils/AllocationAccounting.hh"
+#include "qclient/utils/ShardedCounter.hh"
+
+namespace qclient {
+
+struct CategoryCounters {
+  ShardedCounter allocations;
+  ShardedCounter bytes;
+};
+
+static CategoryCounters counters[static_cast<size_t>(AllocationCategory::kCount)];
+
+//------------------------------------------------------------------------------
+// Record a single allocation of the given size
+//------------------------------------------------------------------------------
+void AllocationAccounting::recordSlow(AllocationCategory category, size_t bytes) {
+  CategoryCounters &target = counters[static_cast<size_t>(category)];
+  target.allocations.add(1);
+  target.bytes.add(bytes);
+}
+
+//------------------------------------------------------------------------------
+// Snapshot of a single category
+//------------------------------------------------------------------------------
+AllocationCount AllocationAccounting::get(AllocationCategory category) {
+  AllocationCount count;
+  count.allocations = counters[static_cast<size_t>(category)].allocations.get();
+  count.bytes = counters[static_cast<size_t>(category)].bytes.get();
+  return count;
+}
+
+//------------------------------------------------------------------------------
+// Snapshot of all categories
+//------------------------------------------------------------------------------
+AllocationStatistics AllocationAccounting::get() {
+  AllocationStatistics stats;
+  stats.encoding = get(AllocationCategory::kEncoding);
+  stats.parsing = get(AllocationCategory::kParsing);
+  stats.futures = get(AllocationCategory::kFutures);
+  stats.queueing = get(AllocationCategory::kQueueing);
+  stats.pubsub = get(AllocationCategory::kPubsub);
+  return stats;
+}
+
+}
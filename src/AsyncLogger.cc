@@ -0,0 +1,247 @@
+//------------------------------------------------------------------------------
+// File: AsyncLogger.cc
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2016 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#include "qclient/AsyncLogger.hh"
+#include "qclient/utils/Futex.hh"
+#include <thread>
+
+namespace qclient {
+
+//------------------------------------------------------------------------------
+// Round capacity up to a power of two, so positions map onto slots by masking
+//------------------------------------------------------------------------------
+static size_t roundUpPowerOfTwo(size_t value) {
+  size_t result = 1;
+  while(result < value) {
+    result <<= 1;
+  }
+
+  return result;
+}
+
+AsyncLogger::AsyncLogger(std::shared_ptr<Logger> s, size_t capacity) : sink(s) {
+  if(!sink) {
+    sink = std::make_shared<StandardErrorLogger>();
+  }
+
+  capacity = roundUpPowerOfTwo(std::max<size_t>(capacity, 2));
+  slots.reset(new Slot[capacity]);
+  mask = capacity - 1;
+
+  for(size_t i = 0; i < capacity; i++) {
+    slots[i].sequence.store(i, std::memory_order_relaxed);
+  }
+
+  lastSweep = std::chrono::steady_clock::now();
+  thread.reset(&AsyncLogger::writerThread, this);
+}
+
+AsyncLogger::~AsyncLogger() {
+  thread.stop();
+  wakeups++;
+  futexWakeAll(&wakeups);
+  thread.join();
+}
+
+void AsyncLogger::setRateLimit(size_t b, std::chrono::milliseconds interval) {
+  burst = b;
+  intervalNs = std::chrono::duration_cast<std::chrono::nanoseconds>(interval).count();
+}
+
+//------------------------------------------------------------------------------
+// Producers claim a position by bumping tail, fill the slot, then publish it
+// by advancing its sequence number. A slot whose sequence lags behind the
+// position is still held by the consumer: The ring is full.
+//------------------------------------------------------------------------------
+bool AsyncLogger::tryPush(Record &&record) {
+  uint64_t pos = tail.load(std::memory_order_relaxed);
+  Slot *slot;
+
+  while(true) {
+    slot = &slots[pos & mask];
+    uint64_t seq = slot->sequence.load(std::memory_order_acquire);
+    int64_t diff = (int64_t) seq - (int64_t) pos;
+
+    if(diff == 0) {
+      if(tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+        break;
+      }
+    }
+    else if(diff < 0) {
+      return false;
+    }
+    else {
+      pos = tail.load(std::memory_order_relaxed);
+    }
+  }
+
+  slot->record = std::move(record);
+  slot->sequence.store(pos + 1, std::memory_order_release);
+  return true;
+}
+
+bool AsyncLogger::tryPop(Record &out) {
+  uint64_t pos = head.load(std::memory_order_relaxed);
+  Slot *slot = &slots[pos & mask];
+
+  if(slot->sequence.load(std::memory_order_acquire) != pos + 1) {
+    return false;
+  }
+
+  out = std::move(slot->record);
+  slot->sequence.store(pos + mask + 1, std::memory_order_release);
+  head.store(pos + 1, std::memory_order_release);
+  return true;
+}
+
+void AsyncLogger::print(LogLevel level, int line, const std::string &file, const std::string &msg) {
+  Record record { level, line, file, msg };
+
+  if(!tryPush(std::move(record))) {
+    dropped++;
+    return;
+  }
+
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if(writerParked.load()) {
+    wakeups++;
+    futexWakeAll(&wakeups);
+  }
+}
+
+void AsyncLogger::flush() {
+  uint64_t target = tail.load();
+
+  while(written.load() < target) {
+    wakeups++;
+    futexWakeAll(&wakeups);
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+}
+
+//------------------------------------------------------------------------------
+// Hand the message to the sink, unless its call site is over the limit
+//------------------------------------------------------------------------------
+void AsyncLogger::write(Record &&record, std::chrono::steady_clock::time_point now) {
+  size_t limit = burst;
+
+  if(limit != 0) {
+    CallSite &site = callSites[std::make_pair(record.file, record.line)];
+    site.level = record.level;
+
+    if(now - site.windowStart >= std::chrono::nanoseconds(intervalNs)) {
+      if(site.suppressed != 0) {
+        sink->print(site.level, record.line, record.file,
+          "Suppressed " + std::to_string(site.suppressed) + " similar messages");
+      }
+
+      site.windowStart = now;
+      site.printed = 0;
+      site.suppressed = 0;
+    }
+
+    if(site.printed >= limit) {
+      site.suppressed++;
+      suppressed++;
+      return;
+    }
+
+    site.printed++;
+  }
+
+  sink->print(record.level, record.line, record.file, record.msg);
+}
+
+//------------------------------------------------------------------------------
+// Summarize suppressed messages of call sites which went quiet, so they
+// aren't held back until the next message from the same site.
+//------------------------------------------------------------------------------
+void AsyncLogger::summarizeSuppressed(std::chrono::steady_clock::time_point now, bool all) {
+  std::chrono::nanoseconds interval(intervalNs);
+
+  for(auto it = callSites.begin(); it != callSites.end(); ) {
+    CallSite &site = it->second;
+    bool expired = (now - site.windowStart >= interval);
+
+    if(site.suppressed != 0 && (all || expired)) {
+      sink->print(site.level, it->first.second, it->first.first,
+        "Suppressed " + std::to_string(site.suppressed) + " similar messages");
+      site.suppressed = 0;
+    }
+
+    if(expired && site.suppressed == 0) {
+      it = callSites.erase(it);
+    }
+    else {
+      it++;
+    }
+  }
+
+  int64_t droppedNow = dropped;
+  if(droppedNow != reportedDropped) {
+    sink->print(LogLevel::kWarn, __LINE__, __FUNCTION__, "Log queue full, dropped " +
+      std::to_string(droppedNow - reportedDropped) + " messages");
+    reportedDropped = droppedNow;
+  }
+}
+
+void AsyncLogger::drain(std::chrono::steady_clock::time_point now) {
+  Record record;
+  while(tryPop(record)) {
+    write(std::move(record), now);
+    written++;
+  }
+}
+
+void AsyncLogger::writerThread(ThreadAssistant &assistant) {
+  while(!assistant.terminationRequested()) {
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    drain(now);
+
+    if(now - lastSweep >= std::chrono::nanoseconds(intervalNs)) {
+      summarizeSuppressed(now, false);
+      lastSweep = now;
+    }
+
+    //--------------------------------------------------------------------------
+    // Park - but check the ring once more after announcing it, a producer
+    // which pushed in between may have missed that we're about to sleep.
+    //--------------------------------------------------------------------------
+    uint32_t seen = wakeups;
+    writerParked = true;
+
+    if(head.load() == tail.load()) {
+      futexWait(&wakeups, seen, std::chrono::milliseconds(100));
+    }
+
+    writerParked = false;
+  }
+
+  // Shutting down - nothing printed so far may get lost
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+  drain(now);
+  summarizeSuppressed(now, true);
+}
+
+}
@@ -23,6 +23,7 @@
 
 #include "qclient/BackgroundFlusher.hh"
 #include "qclient/Utils.hh"
+#include <algorithm>
 
 using namespace qclient;
 
@@ -58,6 +59,20 @@ void BackgroundFlusher::FlusherCallback::handleResponse(redisReplyPtr &&reply) {
 
 BackgroundFlusher::~BackgroundFlusher() {
   inShutdown = true;
+  replayer.join();
+
+  //----------------------------------------------------------------------------
+  // Stop QClient first, so no more acknowledgements can arrive, then let the
+  // popper pop whatever is left.
+  //----------------------------------------------------------------------------
+  qclient.reset();
+
+  popper.stop();
+  {
+    std::lock_guard<std::mutex> lock(popMtx);
+  }
+  popCV.notify_all();
+  popper.join();
 }
 
 BackgroundFlusher::BackgroundFlusher(Members members, qclient::Options &&opts,
@@ -78,22 +93,98 @@ BackgroundFlusher::BackgroundFlusher(Members members, qclient::Options &&opts,
   //----------------------------------------------------------------------------
   qclient.reset(new QClient(members, std::move(options)));
 
+  ackedIndex = persistency->getStartingIndex();
+  popper.reset(&BackgroundFlusher::popperThread, this);
+
   //----------------------------------------------------------------------------
-  // Restore contents from persistency layer, if there are any.
+  // Replay contents from persistency layer in the background, if there are
+  // any.
   //----------------------------------------------------------------------------
-  for(ItemIndex i = persistency->getStartingIndex(); i != persistency->getEndingIndex(); i++) {
-    std::vector<std::string> contents;
-    if(!persistency->retrieve(i, contents)) {
-      std::cerr << "BackgroundFlusher corruption, could not retrieve entry with index " << i << std::endl;
+  if(persistency->getStartingIndex() != persistency->getEndingIndex()) {
+    replaying = true;
+    replayer.reset(&BackgroundFlusher::replayThread, this);
+  }
+}
+
+void BackgroundFlusher::setReplayWindow(size_t window) {
+  replayWindow = std::max<size_t>(window, 1);
+}
+
+//------------------------------------------------------------------------------
+// Send count stored items starting at index, as encoded by the persistency
+// layer if it stores requests that way.
+//------------------------------------------------------------------------------
+bool BackgroundFlusher::replayRange(ItemIndex index, size_t count) {
+  if(persistency->storesEncoded()) {
+    std::vector<EncodedRequest> reqs;
+    if(!persistency->retrieveEncoded(index, count, reqs)) return false;
+
+    for(size_t i = 0; i < reqs.size(); i++) {
+      qclient->execute(&callback, std::move(reqs[i]));
+    }
+
+    return true;
+  }
+
+  std::vector<std::vector<std::string>> items;
+  if(!persistency->retrieveBatch(index, count, items)) return false;
+
+  for(size_t i = 0; i < items.size(); i++) {
+    qclient->execute(&callback, EncodedRequest::makeZeroCopy(std::move(items[i])));
+  }
+
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Stream stored items to QClient in order, at most replayWindow at a time,
+// until catching up with the end of the queue.
+//------------------------------------------------------------------------------
+void BackgroundFlusher::replayThread(ThreadAssistant &assistant) {
+  ItemIndex next = persistency->getStartingIndex();
+
+  while(!assistant.terminationRequested()) {
+    //--------------------------------------------------------------------------
+    // Wait until fewer than replayWindow items are in flight
+    //--------------------------------------------------------------------------
+    ItemIndex window = replayWindow;
+    if(!waitForIndexUntil(next - window, std::chrono::steady_clock::now() + std::chrono::milliseconds(100))) {
+      continue;
+    }
+
+    ItemIndex room = window - (next - getStartingIndex());
+    ItemIndex count = std::min(room, persistency->getEndingIndex() - next);
+
+    if(count <= 0) {
+      //------------------------------------------------------------------------
+      // Caught up - hand execution back to pushRequest, unless something was
+      // recorded in the meantime.
+      //------------------------------------------------------------------------
+      std::lock_guard<std::mutex> lock(newEntriesMtx);
+      if(next == persistency->getEndingIndex()) {
+        replaying = false;
+        return;
+      }
+
+      continue;
+    }
+
+    if(!replayRange(next, count)) {
+      std::cerr << "BackgroundFlusher corruption, could not retrieve entries in range [" << next << ", " << next + count << ")" << std::endl;
       std::terminate();
     }
 
-    qclient->execute(&callback, contents);
+    next += count;
   }
 }
 
 size_t BackgroundFlusher::size() const {
-  return persistency->getEndingIndex() - persistency->getStartingIndex();
+  return persistency->getEndingIndex() - ackedIndex;
+}
+
+void BackgroundFlusher::enableGroupCommit(size_t maxAck) {
+  groupCommit = true;
+  maxAckBatch = std::max<size_t>(maxAck, 1);
 }
 
 // Return number of enqueued items since last time this function was called.
@@ -109,15 +200,202 @@ int64_t BackgroundFlusher::getAcknowledgedAndClear() {
 }
 
 void BackgroundFlusher::pushRequest(const std::vector<std::string> &operation) {
+  if(groupCommit) {
+    return pushGrouped(std::vector<std::string>(operation));
+  }
+
+  if(persistency->storesEncoded()) {
+    return pushEncoded(EncodedRequest(operation));
+  }
+
   std::lock_guard<std::mutex> lock(newEntriesMtx);
   persistency->record(persistency->getEndingIndex(), operation);
-  qclient->execute(&callback, operation);
+  if(!replaying) {
+    qclient->execute(&callback, operation);
+  }
   enqueued++;
 }
 
+void BackgroundFlusher::pushRequest(std::vector<std::string> &&operation) {
+  if(groupCommit) {
+    return pushGrouped(std::move(operation));
+  }
+
+  if(persistency->storesEncoded()) {
+    return pushEncoded(EncodedRequest::makeZeroCopy(std::move(operation)));
+  }
+
+  std::lock_guard<std::mutex> lock(newEntriesMtx);
+  persistency->record(persistency->getEndingIndex(), operation);
+  if(!replaying) {
+    qclient->execute(&callback, EncodedRequest::makeZeroCopy(std::move(operation)));
+  }
+  enqueued++;
+}
+
+void BackgroundFlusher::pushEncoded(EncodedRequest &&req) {
+  std::lock_guard<std::mutex> lock(newEntriesMtx);
+  persistency->recordEncoded(persistency->getEndingIndex(), &req, 1);
+  if(!replaying) {
+    qclient->execute(&callback, std::move(req));
+  }
+  enqueued++;
+}
+
+//------------------------------------------------------------------------------
+// Group commit: queue the operation, and wait until some leader has recorded
+// it. Whoever finds no leader active becomes one, and commits everything
+// queued so far - including what piled up while the previous leader was busy.
+//------------------------------------------------------------------------------
+void BackgroundFlusher::pushGrouped(std::vector<std::string> &&operation) {
+  std::unique_lock<std::mutex> lock(groupMtx);
+  groupPending.emplace_back(std::move(operation));
+  uint64_t ticket = ++groupSubmitted;
+
+  while(groupCommitted < ticket) {
+    if(groupLeaderActive) {
+      groupCV.wait(lock);
+      continue;
+    }
+
+    groupLeaderActive = true;
+    std::vector<std::vector<std::string>> group;
+    group.swap(groupPending);
+    uint64_t upTo = groupSubmitted;
+
+    lock.unlock();
+    commitGroup(group);
+    lock.lock();
+
+    groupCommitted = upTo;
+    groupLeaderActive = false;
+    groupCV.notify_all();
+  }
+}
+
+void BackgroundFlusher::commitGroup(std::vector<std::vector<std::string>> &group) {
+  std::lock_guard<std::mutex> lock(newEntriesMtx);
+
+  if(persistency->storesEncoded()) {
+    std::vector<EncodedRequest> reqs;
+    reqs.reserve(group.size());
+    for(size_t i = 0; i < group.size(); i++) {
+      reqs.emplace_back(EncodedRequest::makeZeroCopy(std::move(group[i])));
+    }
+
+    persistency->recordEncoded(persistency->getEndingIndex(), reqs.data(), reqs.size());
+    if(!replaying) {
+      for(size_t i = 0; i < reqs.size(); i++) {
+        qclient->execute(&callback, std::move(reqs[i]));
+      }
+    }
+
+    enqueued += reqs.size();
+    return;
+  }
+
+  persistency->recordBatch(persistency->getEndingIndex(), group);
+
+  if(!replaying) {
+    for(size_t i = 0; i < group.size(); i++) {
+      qclient->execute(&callback, EncodedRequest::makeZeroCopy(std::move(group[i])));
+    }
+  }
+
+  enqueued += group.size();
+}
+
+//------------------------------------------------------------------------------
+// Wait for a specific item - see AckWaiter.
+//------------------------------------------------------------------------------
+bool BackgroundFlusher::waitForIndexUntil(ItemIndex index,
+  std::chrono::steady_clock::time_point deadline) {
+
+  if(hasItemBeenAcked(index)) return true;
+
+  std::unique_lock<std::mutex> lock(acknowledgementMtx);
+  AckWaiter waiter;
+  auto it = ackWaiters.emplace(index, &waiter);
+  nextWakeup = ackWaiters.begin()->first;
+
+  //----------------------------------------------------------------------------
+  // An acknowledgement racing with registration either sees the new
+  // nextWakeup, or is visible to the check below.
+  //----------------------------------------------------------------------------
+  while(!waiter.woken && !hasItemBeenAcked(index)) {
+    if(waiter.cv.wait_until(lock, deadline) == std::cv_status::timeout) break;
+  }
+
+  if(!waiter.woken) {
+    ackWaiters.erase(it);
+    nextWakeup = ackWaiters.empty() ? std::numeric_limits<ItemIndex>::max() : ackWaiters.begin()->first;
+  }
+
+  return hasItemBeenAcked(index);
+}
+
+//------------------------------------------------------------------------------
+// Should the popper get going? Without group commit, as soon as there's
+// anything to pop.
+//------------------------------------------------------------------------------
+bool BackgroundFlusher::shouldPop() {
+  ItemIndex acked = ackedIndex;
+  ItemIndex pending = acked - persistency->getStartingIndex();
+
+  return pending >= (ItemIndex) maxAckBatch ||
+    (pending > 0 && acked == persistency->getEndingIndex());
+}
+
+void BackgroundFlusher::popAcknowledged() {
+  ItemIndex count = ackedIndex - persistency->getStartingIndex();
+  if(count > 0) {
+    persistency->popBatch(count);
+  }
+}
+
+//------------------------------------------------------------------------------
+// The only thread popping from the persistency layer. A wakeup lost while it
+// was busy only delays the next pop until the following acknowledgement, or
+// the periodic check.
+//------------------------------------------------------------------------------
+void BackgroundFlusher::popperThread(ThreadAssistant &assistant) {
+  std::unique_lock<std::mutex> lock(popMtx);
+
+  while(!assistant.terminationRequested()) {
+    popCV.wait_for(lock, std::chrono::seconds(1), [&]() {
+      return assistant.terminationRequested() || shouldPop();
+    });
+
+    lock.unlock();
+    popAcknowledged();
+    lock.lock();
+  }
+
+  lock.unlock();
+  popAcknowledged();
+}
+
 void BackgroundFlusher::itemWasAcknowledged() {
-  std::lock_guard<std::mutex> lock(acknowledgementMtx);
-  persistency->pop();
+  ItemIndex acked = ++ackedIndex;
   acknowledged++;
-  acknowledgementCV.notify_all();
+
+  if(shouldPop()) {
+    popCV.notify_one();
+  }
+
+  //----------------------------------------------------------------------------
+  // Wake up exactly the waiters whose item is now acknowledged
+  //----------------------------------------------------------------------------
+  if(nextWakeup < acked) {
+    std::lock_guard<std::mutex> lock(acknowledgementMtx);
+
+    auto it = ackWaiters.begin();
+    while(it != ackWaiters.end() && it->first < acked) {
+      it->second->woken = true;
+      it->second->cv.notify_one();
+      it = ackWaiters.erase(it);
+    }
+
+    nextWakeup = ackWaiters.empty() ? std::numeric_limits<ItemIndex>::max() : ackWaiters.begin()->first;
+  }
 }
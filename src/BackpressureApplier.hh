@@ -26,34 +26,372 @@
 
 #include "qclient/Semaphore.hh"
 #include "qclient/Options.hh"
+#include "qclient/MemoryBudget.hh"
+#include "qclient/utils/ShardedCounter.hh"
+#include "Tracepoints.hh"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <memory>
+#include <mutex>
 
 namespace qclient {
 
+//------------------------------------------------------------------------------
+// Enforces a BackpressureStrategy: One semaphore counts pending requests,
+// another one pending bytes. Either may be disabled.
+//
+// Every admitted request is accounted for, regardless of whether any limit
+// is active.
+//
+// Producers which cannot block use tryReserve, and may register a one-shot
+// notification for when the backlog has drained below the low-water mark.
+//
+// An attached MemoryBudget is consulted after the local limits, and
+// charged the same bytes.
+//
+// With an adaptive strategy, the request semaphore holds the current window
+// instead of the fixed limit. Growing the window hands out more slots right
+// away; shrinking takes back free slots if there are enough, and otherwise
+// withholds the rest from releases later on.
+//------------------------------------------------------------------------------
 class BackpressureApplier {
 public:
-  BackpressureApplier(BackpressureStrategy st) : strategy(st), semaphore(1) {
-    if(strategy.active()) {
-      semaphore.reset(strategy.getRequestLimit());
+  BackpressureApplier(BackpressureStrategy st) : strategy(st), semaphore(1), byteSemaphore(1) {
+    window = strategy.isAdaptive() ? strategy.getInitialWindow() : strategy.getRequestLimit();
+
+    if(limitsRequests()) {
+      semaphore.reset(window);
+    }
+
+    if(limitsBytes()) {
+      byteSemaphore.reset(strategy.getByteLimit());
     }
   }
 
-  void reserve() {
-    // Reserve a single slot. If not possible, block.
-    if(strategy.active()) {
+  void reserve(size_t bytes) {
+    // Reserve a single slot, plus the given amount of bytes. If not possible,
+    // block, and keep track of how long for.
+    if(tryReserve(bytes)) {
+      return;
+    }
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    QCLIENT_TRACE(backpressure_block, bytes, getPendingRequests());
+
+    if(limitsRequests()) {
       semaphore.down();
     }
+
+    if(limitsBytes()) {
+      byteSemaphore.down(cost(bytes));
+    }
+
+    if(budget) {
+      budget->acquire(MemoryBudget::Category::kStagedRequests, bytes);
+    }
+
+    int64_t blocked = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now() - start).count();
+    blockedTime.add(blocked);
+    QCLIENT_TRACE(backpressure_unblock, bytes, blocked);
+
+    account(1, bytes);
+  }
+
+  //----------------------------------------------------------------------------
+  // Same as reserve, but never blocks: Returns false if the request would
+  // exceed the limits, in which case nothing is reserved.
+  //----------------------------------------------------------------------------
+  bool tryReserve(size_t bytes) {
+    if(limitsRequests() && !semaphore.tryDown()) {
+      return false;
+    }
+
+    if(limitsBytes() && !byteSemaphore.tryDown(cost(bytes))) {
+      if(limitsRequests()) {
+        semaphore.up();
+      }
+
+      return false;
+    }
+
+    if(budget && !budget->tryAcquire(MemoryBudget::Category::kStagedRequests, bytes)) {
+      if(limitsRequests()) {
+        semaphore.up();
+      }
+
+      if(limitsBytes()) {
+        byteSemaphore.up(cost(bytes));
+      }
+
+      return false;
+    }
+
+    account(1, bytes);
+    return true;
   }
 
-  void release() {
-    // Release a single slot.
-    if(strategy.active()) {
+  void release(size_t bytes) {
+    // Release a single slot, plus the given amount of bytes.
+    if(limitsRequests() && !withholdSlot()) {
       semaphore.up();
     }
+
+    if(limitsBytes()) {
+      byteSemaphore.up(cost(bytes));
+    }
+
+    if(budget) {
+      budget->release(MemoryBudget::Category::kStagedRequests, bytes);
+    }
+
+    account(-1, -static_cast<int64_t>(bytes));
+
+    if(notificationArmed) {
+      checkNotification();
+    }
+  }
+
+  //----------------------------------------------------------------------------
+  // Share the given budget with other clients. Call before reserving
+  // anything.
+  //----------------------------------------------------------------------------
+  void setMemoryBudget(std::shared_ptr<MemoryBudget> value) {
+    budget = std::move(value);
+  }
+
+  //----------------------------------------------------------------------------
+  // Feed the round-trip time of an acknowledged request into the adaptive
+  // window, if enabled. Must not be called from more than one thread at a
+  // time.
+  //----------------------------------------------------------------------------
+  void observeLatency(std::chrono::nanoseconds rtt) {
+    if(strategy.isAdaptive()) {
+      adaptWindow(rtt.count());
+    }
+  }
+
+  //----------------------------------------------------------------------------
+  // Current limit on pending requests, 0 if none.
+  //----------------------------------------------------------------------------
+  int64_t getWindow() const {
+    return limitsRequests() ? window.load() : 0;
+  }
+
+  //----------------------------------------------------------------------------
+  // Arm a one-shot notification, fired once the backlog drops to the
+  // low-water mark. If we're below it already, fires immediately.
+  //
+  // The callback runs on whichever thread releases capacity, typically the
+  // event loop - it must not block. Registering again replaces any callback
+  // which has not fired yet.
+  //----------------------------------------------------------------------------
+  void notifyWhenCapacityAvailable(std::function<void()> callback) {
+    {
+      std::lock_guard<std::mutex> lock(notificationMtx);
+      pendingNotification = std::move(callback);
+      notificationArmed = true;
+    }
+
+    checkNotification();
+  }
+
+  //----------------------------------------------------------------------------
+  // Is the backlog at or below the low-water mark?
+  //----------------------------------------------------------------------------
+  bool belowLowWaterMark() const {
+    double fraction = 1.0 - strategy.getLowWaterMark();
+
+    if(limitsRequests() && semaphore.getValue() < fraction * window) {
+      return false;
+    }
+
+    if(limitsBytes() && byteSemaphore.getValue() < fraction * strategy.getByteLimit()) {
+      return false;
+    }
+
+    return true;
+  }
+
+  //----------------------------------------------------------------------------
+  // Requests and bytes admitted, but not yet released.
+  //----------------------------------------------------------------------------
+  int64_t getPendingRequests() const {
+    return pendingRequests;
+  }
+
+  int64_t getPendingBytes() const {
+    return pendingBytes;
+  }
+
+  //----------------------------------------------------------------------------
+  // Lifetime totals: requests admitted and released, and time spent blocked
+  // inside reserve.
+  //----------------------------------------------------------------------------
+  int64_t getAdmitted() const {
+    return admitted.get();
+  }
+
+  int64_t getReleased() const {
+    return released.get();
+  }
+
+  std::chrono::nanoseconds getBlockedTime() const {
+    return std::chrono::nanoseconds(blockedTime.get());
   }
 
 private:
+  void account(int64_t requests, int64_t bytes) {
+    pendingRequests += requests;
+    pendingBytes += bytes;
+
+    if(requests > 0) {
+      admitted.add(requests);
+    }
+    else {
+      released.add(-requests);
+    }
+  }
+
+  void checkNotification() {
+    if(!belowLowWaterMark()) return;
+
+    std::function<void()> callback;
+    {
+      std::lock_guard<std::mutex> lock(notificationMtx);
+      if(!notificationArmed) return;
+
+      callback = std::move(pendingNotification);
+      pendingNotification = {};
+      notificationArmed = false;
+    }
+
+    // Run outside of the lock, the callback may well re-register itself.
+    if(callback) {
+      callback();
+    }
+  }
+
+  //----------------------------------------------------------------------------
+  // Once per window's worth of acknowledgements, compare their average
+  // latency against the baseline, the lowest seen lately: The ratio of the
+  // two scales the window down as requests start queueing up, while the
+  // square root term lets it grow as long as latency stays flat. Changes are
+  // smoothed out over several rounds.
+  //
+  // The baseline is re-learnt every kBaselineRounds, so that a changed
+  // network path is picked up.
+  //----------------------------------------------------------------------------
+  static constexpr size_t kBaselineRounds = 32;
+
+  void adaptWindow(int64_t rtt) {
+    rtt = std::max<int64_t>(rtt, 1);
+    roundSum += rtt;
+    roundCount++;
+    roundMin = (roundMin == 0) ? rtt : std::min(roundMin, rtt);
+
+    int64_t current = window;
+    if(roundCount < current) return;
+
+    rounds++;
+    if(baseline == 0 || roundMin < baseline || rounds % kBaselineRounds == 0) {
+      baseline = roundMin;
+    }
+
+    double average = (double) roundSum / roundCount;
+    double gradient = std::max(0.5, std::min(1.0, baseline / average));
+    double target = current * gradient + std::sqrt((double) current);
+    double smoothed = 0.5 * current + 0.5 * target;
+
+    int64_t next = std::llround(smoothed);
+    next = std::max<int64_t>(next, strategy.getMinimumWindow());
+    next = std::min<int64_t>(next, strategy.getRequestLimit());
+    setWindow(next);
+
+    roundSum = 0;
+    roundCount = 0;
+    roundMin = 0;
+  }
+
+  void setWindow(int64_t next) {
+    int64_t delta = next - window;
+    window = next;
+
+    if(delta > 0) {
+      // Cancel out any slots still to be withheld first
+      int64_t owed = withheld.load();
+      while(owed > 0 && delta > 0) {
+        int64_t cancel = std::min(owed, delta);
+        if(withheld.compare_exchange_weak(owed, owed - cancel)) {
+          delta -= cancel;
+          owed -= cancel;
+        }
+      }
+
+      if(delta > 0) {
+        semaphore.up(delta);
+      }
+    }
+    else if(delta < 0 && !semaphore.tryDown(-delta)) {
+      withheld += -delta;
+    }
+  }
+
+  bool withholdSlot() {
+    int64_t owed = withheld.load();
+    while(owed > 0) {
+      if(withheld.compare_exchange_weak(owed, owed - 1)) {
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  bool limitsRequests() const {
+    return strategy.active() && strategy.getRequestLimit() != 0u;
+  }
+
+  bool limitsBytes() const {
+    return strategy.active() && strategy.getByteLimit() != 0u;
+  }
+
+  //----------------------------------------------------------------------------
+  // A request larger than the whole budget is charged the full budget, so it
+  // gets through as soon as everything else has drained.
+  //----------------------------------------------------------------------------
+  int64_t cost(size_t bytes) const {
+    return std::min(bytes, strategy.getByteLimit());
+  }
+
   BackpressureStrategy strategy;
   Semaphore semaphore;
+  Semaphore byteSemaphore;
+  std::shared_ptr<MemoryBudget> budget;
+
+  // Adaptive window state - the round counters are only touched by
+  // observeLatency.
+  std::atomic<int64_t> window {0};
+  std::atomic<int64_t> withheld {0};
+  int64_t roundSum = 0;
+  int64_t roundCount = 0;
+  int64_t roundMin = 0;
+  int64_t baseline = 0;
+  size_t rounds = 0;
+
+  std::atomic<int64_t> pendingRequests {0};
+  std::atomic<int64_t> pendingBytes {0};
+
+  ShardedCounter admitted;
+  ShardedCounter released;
+  ShardedCounter blockedTime;
+
+  std::mutex notificationMtx;
+  std::atomic<bool> notificationArmed {false};
+  std::function<void()> pendingNotification;
 };
 
 }
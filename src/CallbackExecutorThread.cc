@@ -22,20 +22,49 @@
  ************************************************************************/
 
 #include "CallbackExecutorThread.hh"
+#include "Tracepoints.hh"
+#include <algorithm>
 
 using namespace qclient;
 
-CallbackExecutorThread::CallbackExecutorThread()
-: thread(&CallbackExecutorThread::main, this) {}
+CallbackExecutorThread::CallbackExecutorThread(size_t threads) {
+  for(size_t i = 0; i < std::max<size_t>(threads, 1u); i++) {
+    lanes.emplace_back(new Lane());
+  }
+}
+
+void CallbackExecutorThread::setCpuAffinity(const std::vector<int> &cpus) {
+  cpuAffinity = cpus;
+}
+
+void CallbackExecutorThread::setInline(bool value) {
+  runInline = value;
+}
+
+void CallbackExecutorThread::start() {
+  std::call_once(startOnce, [this]() {
+    for(auto &lane : lanes) {
+      lane->thread.reset(&CallbackExecutorThread::main, this, lane.get());
+      lane->thread.setAffinity(cpuAffinity);
+    }
+
+    started.store(true, std::memory_order_release);
+  });
+}
 
 CallbackExecutorThread::~CallbackExecutorThread() {
-  thread.stop();
-  pendingCallbacks.setBlockingMode(false);
-  thread.join();
+  for(auto &lane : lanes) {
+    lane->thread.stop();
+    lane->pendingCallbacks.setBlockingMode(false);
+  }
+
+  for(auto &lane : lanes) {
+    lane->thread.join();
+  }
 }
 
-void CallbackExecutorThread::main(ThreadAssistant &assistant) {
-  auto frontier = pendingCallbacks.begin();
+void CallbackExecutorThread::main(Lane *lane, ThreadAssistant &assistant) {
+  auto frontier = lane->pendingCallbacks.begin();
 
   while(true) {
     if(assistant.terminationRequested() && !frontier.itemHasArrived()) {
@@ -48,15 +77,142 @@ void CallbackExecutorThread::main(ThreadAssistant &assistant) {
 
     PendingCallback *cb = frontier.getItemBlockOrNull();
     if(!cb) continue;
-    if(cb->callback) {
-      cb->callback->handleResponse(std::move(cb->reply));
-    }
+
+    run(*cb);
 
     frontier.next();
-    pendingCallbacks.pop_front();
+    lane->pendingCallbacks.pop_front();
   }
 }
 
-void CallbackExecutorThread::stage(QCallback *callback, redisReplyPtr &&response) {
-  pendingCallbacks.emplace_back(callback, std::move(response));
+void CallbackExecutorThread::run(PendingCallback &cb) {
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+  if(latency) {
+    latency->record(now - cb.stagedAt);
+  }
+
+  [[maybe_unused]] const redisReply *reply = cb.reply.get();
+  QCLIENT_TRACE(callback_start, reply, (now - cb.stagedAt).count());
+
+  if(cb.callback) {
+    cb.callback->handleResponse(std::move(cb.reply));
+  }
+  else if(cb.function) {
+    cb.function(std::move(cb.reply));
+  }
+
+  QCLIENT_TRACE(callback_end, reply);
+
+  if(cb.trace) {
+    cb.trace->callbackAt = now;
+    cb.trace->finishedAt = std::chrono::steady_clock::now();
+    tracer->requestFinished(*cb.trace);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Callback objects are usually heap-allocated, so the low bits of the
+// address carry no information - mix before picking a lane.
+//------------------------------------------------------------------------------
+CallbackExecutorThread::Lane& CallbackExecutorThread::pickLane(QCallback *callback) {
+  return *lanes[laneOf(callback)];
+}
+
+size_t CallbackExecutorThread::laneOf(QCallback *callback) const {
+  if(lanes.size() == 1) {
+    return 0u;
+  }
+
+  uint64_t hash = reinterpret_cast<uintptr_t>(callback) * 0x9E3779B97F4A7C15ull;
+  return (hash >> 32) % lanes.size();
+}
+
+void CallbackExecutorThread::setBlockSizes(size_t initial, size_t maximum) {
+  for(auto &lane : lanes) {
+    lane->pendingCallbacks.setBlockSizes(initial, maximum);
+  }
+}
+
+void CallbackExecutorThread::setMemoryResource(MemoryResource *resource) {
+  for(auto &lane : lanes) {
+    lane->pendingCallbacks.setMemoryResource(resource);
+  }
+}
+
+void CallbackExecutorThread::setSpinIterations(size_t iterations) {
+  for(auto &lane : lanes) {
+    lane->pendingCallbacks.setSpinIterations(iterations);
+  }
+}
+
+void CallbackExecutorThread::setLatencyHistogram(LatencyHistogram *histogram) {
+  latency = histogram;
+}
+
+void CallbackExecutorThread::setTracer(RequestTracer *t) {
+  tracer = t;
+}
+
+size_t CallbackExecutorThread::getQueueDepth() const {
+  size_t depth = 0u;
+  for(size_t i = 0; i < lanes.size(); i++) {
+    depth += lanes[i]->pendingCallbacks.size();
+  }
+
+  return depth;
+}
+
+void CallbackExecutorThread::stage(QCallback *callback, redisReplyPtr &&response,
+  std::chrono::steady_clock::time_point now, std::unique_ptr<RequestTrace> &&trace) {
+  if(runInline) {
+    PendingCallback cb(callback, std::move(response), now, std::move(trace));
+    run(cb);
+    return;
+  }
+
+  ensureStarted();
+  pickLane(callback).pendingCallbacks.emplace_back(callback, std::move(response), now, std::move(trace));
+}
+
+void CallbackExecutorThread::stage(ReplyCallback &&function, redisReplyPtr &&response,
+  std::chrono::steady_clock::time_point now, std::unique_ptr<RequestTrace> &&trace) {
+  if(runInline) {
+    PendingCallback cb(std::move(function), std::move(response), now, std::move(trace));
+    run(cb);
+    return;
+  }
+
+  ensureStarted();
+  lanes[0]->pendingCallbacks.emplace_back(std::move(function), std::move(response), now, std::move(trace));
+}
+
+void CallbackExecutorThread::stage(std::vector<PendingCallback> &&batch) {
+  if(runInline) {
+    for(PendingCallback &cb : batch) {
+      run(cb);
+    }
+
+    batch.clear();
+    return;
+  }
+
+  if(batch.empty()) {
+    return;
+  }
+
+  ensureStarted();
+
+  std::vector<std::vector<PendingCallback*>> perLane(lanes.size());
+  for(PendingCallback &cb : batch) {
+    perLane[cb.callback ? laneOf(cb.callback) : 0u].emplace_back(&cb);
+  }
+
+  for(size_t i = 0; i < lanes.size(); i++) {
+    std::vector<PendingCallback*> &items = perLane[i];
+    lanes[i]->pendingCallbacks.emplace_many(items.size(), [&](void *memory, size_t j) {
+      new (memory) PendingCallback(std::move(*items[j]));
+    });
+  }
+
+  batch.clear();
 }
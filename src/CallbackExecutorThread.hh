@@ -26,8 +26,14 @@
 
 #include <string>
 #include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
 #include "qclient/QCallback.hh"
+#include "qclient/ReplyCallback.hh"
 #include "qclient/AssistedThread.hh"
+#include "qclient/LatencyHistogram.hh"
+#include "qclient/RequestTracer.hh"
 #include "qclient/queueing/WaitableQueue.hh"
 
 namespace qclient {
@@ -35,24 +41,99 @@ namespace qclient {
 class QCallback;
 
 struct PendingCallback {
-  PendingCallback(QCallback *cb, redisReplyPtr &&rep) : callback(cb),
-  reply(std::move(rep)) {}
+  PendingCallback(QCallback *cb, redisReplyPtr &&rep,
+    std::chrono::steady_clock::time_point at, std::unique_ptr<RequestTrace> &&tr)
+  : callback(cb), reply(std::move(rep)), stagedAt(at), trace(std::move(tr)) {}
+
+  PendingCallback(ReplyCallback &&fn, redisReplyPtr &&rep,
+    std::chrono::steady_clock::time_point at, std::unique_ptr<RequestTrace> &&tr)
+  : callback(nullptr), function(std::move(fn)), reply(std::move(rep)),
+    stagedAt(at), trace(std::move(tr)) {}
 
   QCallback *callback;
+  ReplyCallback function;
   redisReplyPtr reply;
+  std::chrono::steady_clock::time_point stagedAt;
+
+  // Only set when the request is being traced
+  std::unique_ptr<RequestTrace> trace;
 };
 
+//------------------------------------------------------------------------------
+// Runs callbacks away from the event loop thread. With more than one thread,
+// callbacks are sharded by callback object: All responses for the same
+// QCallback are delivered in order, on the same thread, while unrelated
+// callbacks may run in parallel.
+//
+// The threads are only spawned once the first callback is staged - a client
+// which never receives a reply never pays for them.
+//------------------------------------------------------------------------------
 class CallbackExecutorThread {
 public:
-  CallbackExecutorThread();
+  CallbackExecutorThread(size_t threads = 1u);
   ~CallbackExecutorThread();
 
-  void main(ThreadAssistant &assistant);
-  void stage(QCallback *callback, redisReplyPtr &&reply);
+  void stage(QCallback *callback, redisReplyPtr &&reply,
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now(),
+    std::unique_ptr<RequestTrace> &&trace = {});
+  void setBlockSizes(size_t initial, size_t maximum);
+  void setMemoryResource(MemoryResource *resource);
+  void setSpinIterations(size_t iterations);
+
+  // Callables carry no identity to shard by - they all share the first lane,
+  // and run in the order their replies arrived.
+  void stage(ReplyCallback &&function, redisReplyPtr &&reply,
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now(),
+    std::unique_ptr<RequestTrace> &&trace = {});
+
+  // Stage many at once: A single queue operation and wake-up per lane, with
+  // the same lane choice, and ordering, as staging them one by one.
+  void stage(std::vector<PendingCallback> &&batch);
+
+  // Record the time each callback spent waiting to run. Call before staging
+  // anything.
+  void setLatencyHistogram(LatencyHistogram *histogram);
+
+  // Report traced requests once their callback has run. Call before staging
+  // anything.
+  void setTracer(RequestTracer *tracer);
+
+  // Pin the threads to the given CPUs. Call before staging anything.
+  void setCpuAffinity(const std::vector<int> &cpus);
+
+  // Run callbacks right away on the thread staging them, without spawning
+  // any threads. Call before staging anything.
+  void setInline(bool value);
+
+  // Callbacks staged, but not yet run, across all lanes
+  size_t getQueueDepth() const;
 
 private:
-  WaitableQueue<PendingCallback, 5000> pendingCallbacks;
-  AssistedThread thread;
+  struct Lane {
+    WaitableQueue<PendingCallback, 5000> pendingCallbacks;
+    AssistedThread thread;
+  };
+
+  void main(Lane *lane, ThreadAssistant &assistant);
+  void run(PendingCallback &cb);
+  Lane& pickLane(QCallback *callback);
+  size_t laneOf(QCallback *callback) const;
+
+  void ensureStarted() {
+    if(!started.load(std::memory_order_acquire)) {
+      start();
+    }
+  }
+
+  void start();
+  std::once_flag startOnce;
+  std::atomic<bool> started {false};
+
+  std::vector<std::unique_ptr<Lane>> lanes;
+  LatencyHistogram *latency = nullptr;
+  RequestTracer *tracer = nullptr;
+  std::vector<int> cpuAffinity;
+  bool runInline = false;
 };
 
 }
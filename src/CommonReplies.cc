@@ -0,0 +1,118 @@
+//------------------------------------------------------------------------------
+// File: CommonReplies.cc
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#include "CommonReplies.hh"
+#include <string.h>
+
+namespace qclient {
+
+namespace {
+
+//------------------------------------------------------------------------------
+// The replies, and a shared_ptr to each which never deletes anything -
+// created once, on first use.
+//------------------------------------------------------------------------------
+class Table {
+public:
+  Table() {
+    makeStatus(ok, okPtr, "OK");
+    makeStatus(queued, queuedPtr, "QUEUED");
+    makeStatus(pong, pongPtr, "PONG");
+
+    for(long long i = 0; i < kIntegers; i++) {
+      memset(&integers[i], 0, sizeof(redisReply));
+      integers[i].type = REDIS_REPLY_INTEGER;
+      integers[i].integer = CommonReplies::kMinInteger + i;
+      integerPtrs[i] = redisReplyPtr(&integers[i], [](redisReply*) {});
+    }
+  }
+
+  static constexpr long long kIntegers =
+    CommonReplies::kMaxInteger - CommonReplies::kMinInteger + 1;
+
+  redisReply ok, queued, pong;
+  redisReplyPtr okPtr, queuedPtr, pongPtr;
+
+  redisReply integers[kIntegers];
+  redisReplyPtr integerPtrs[kIntegers];
+
+private:
+  static void makeStatus(redisReply &reply, redisReplyPtr &ptr, const char *str) {
+    memset(&reply, 0, sizeof(redisReply));
+    reply.type = REDIS_REPLY_STATUS;
+    reply.str = (char*) str;
+    reply.len = strlen(str);
+    ptr = redisReplyPtr(&reply, [](redisReply*) {});
+  }
+};
+
+Table& getTable() {
+  static Table table;
+  return table;
+}
+
+bool isStatus(const redisReply *reply, const redisReply &common) {
+  return reply->len == common.len && memcmp(reply->str, common.str, common.len) == 0;
+}
+
+}
+
+//------------------------------------------------------------------------------
+// If the given reply equals one of the common ones, point out to the shared
+// copy of it
+//------------------------------------------------------------------------------
+bool CommonReplies::lookup(const redisReply *reply, redisReplyPtr &out) {
+  if(reply->type == REDIS_REPLY_INTEGER) {
+    if(reply->integer < kMinInteger || reply->integer > kMaxInteger) {
+      return false;
+    }
+
+    out = getTable().integerPtrs[reply->integer - kMinInteger];
+    return true;
+  }
+
+  if(reply->type != REDIS_REPLY_STATUS) {
+    return false;
+  }
+
+  Table &table = getTable();
+
+  if(isStatus(reply, table.ok)) {
+    out = table.okPtr;
+    return true;
+  }
+
+  if(isStatus(reply, table.queued)) {
+    out = table.queuedPtr;
+    return true;
+  }
+
+  if(isStatus(reply, table.pong)) {
+    out = table.pongPtr;
+    return true;
+  }
+
+  return false;
+}
+
+}
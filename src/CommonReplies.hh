@@ -0,0 +1,51 @@
+//------------------------------------------------------------------------------
+// File: CommonReplies.hh
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#ifndef QCLIENT_COMMON_REPLIES_HH
+#define QCLIENT_COMMON_REPLIES_HH
+
+#include "qclient/Reply.hh"
+
+namespace qclient {
+
+//------------------------------------------------------------------------------
+// Statically allocated, immutable copies of the most frequent small replies:
+// The statuses OK, QUEUED and PONG, and small integers. The reader hands
+// these out instead of allocating a reply of its own - most write
+// acknowledgements then cost no allocation at all.
+//------------------------------------------------------------------------------
+class CommonReplies {
+public:
+  static constexpr long long kMinInteger = -1;
+  static constexpr long long kMaxInteger = 127;
+
+  //----------------------------------------------------------------------------
+  // If the given reply equals one of the common ones, point out to the shared
+  // copy of it, and return true.
+  //----------------------------------------------------------------------------
+  static bool lookup(const redisReply *reply, redisReplyPtr &out);
+};
+
+}
+
+#endif
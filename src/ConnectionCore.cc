@@ -23,23 +23,183 @@
 
 #include "ConnectionCore.hh"
 #include "pubsub/MessageParser.hh"
+#include "Tracepoints.hh"
 #include "qclient/Handshake.hh"
 #include "qclient/pubsub/MessageListener.hh"
 #include "qclient/QClient.hh"
+#include "qclient/ResponseBuilder.hh"
+#include <limits>
 
 #define DBG(message) std::cerr << __FILE__ << ":" << __LINE__ << " -- " << #message << " = " << message << std::endl;
 
 namespace qclient {
 
+static int64_t steadyNanoseconds() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 ConnectionCore::ConnectionCore(Logger *log, Handshake *hs, BackpressureStrategy bp,
-  bool transUnavail, MessageListener *ms, bool exclpubsub)
+  bool transUnavail, MessageListener *ms, bool exclpubsub, size_t callbackThreads)
 : logger(log), handshake(hs), backpressure(bp), transparentUnavailable(transUnavail), listener(ms),
-  exclusivePubsub(exclpubsub) {
+  exclusivePubsub(exclpubsub), cbExecutor(callbackThreads) {
+  cbExecutor.setLatencyHistogram(&callbackLatency);
   reconnection();
 }
 
 ConnectionCore::~ConnectionCore() {
+  stopTimers();
+}
+
+void ConnectionCore::setQueueBlockSizes(size_t initial, size_t maximum) {
+  requestQueue.setBlockSizes(initial, maximum);
+  cbExecutor.setBlockSizes(initial, maximum);
+}
+
+void ConnectionCore::setMemoryResource(MemoryResource *resource) {
+  requestQueue.setMemoryResource(resource);
+  cbExecutor.setMemoryResource(resource);
+}
+
+void ConnectionCore::setTracer(RequestTracer *t) {
+  tracer = t;
+  cbExecutor.setTracer(t);
+}
 
+void ConnectionCore::setMemoryBudget(std::shared_ptr<MemoryBudget> budget) {
+  backpressure.setMemoryBudget(std::move(budget));
+}
+
+void ConnectionCore::setCpuAffinity(const std::vector<int> &cpus) {
+  cpuAffinity = cpus;
+  cbExecutor.setCpuAffinity(cpus);
+}
+
+void ConnectionCore::setInlineCallbacks(bool value) {
+  cbExecutor.setInline(value);
+}
+
+void ConnectionCore::setOffloadPushMessages(bool value) {
+  if(value) {
+    pushExecutor.reset(new CallbackExecutorThread(1u));
+    pushExecutor->setCpuAffinity(cpuAffinity);
+  }
+  else {
+    pushExecutor.reset();
+  }
+}
+
+void ConnectionCore::setStagingListener(std::function<void()> listener) {
+  requestQueue.setStagingListener(std::move(listener));
+}
+
+void ConnectionCore::setWriteCombining(bool value) {
+  if(value) {
+    writeCombiner.reset(new WriteCombiner());
+  }
+  else {
+    writeCombiner.reset();
+  }
+}
+
+void ConnectionCore::setReplayPacing(const ReplayPacing &pacing) {
+  replayPacing = pacing;
+}
+
+//------------------------------------------------------------------------------
+// The command is the first argument: "*<n>\r\n$<len>\r\n<command>\r\n". It
+// always sits in the first segment, as zero-copy only applies to large
+// arguments.
+//------------------------------------------------------------------------------
+static std::string extractCommand(EncodedRequest::Segment segment) {
+  const char *end = segment.data + segment.len;
+
+  const char *pos = (const char*) memchr(segment.data, '\n', segment.len);
+  if(!pos || end - pos < 2 || pos[1] != '$') return {};
+
+  const char *lengthStart = pos + 2;
+  pos = (const char*) memchr(lengthStart, '\n', end - lengthStart);
+  if(!pos) return {};
+
+  size_t length = strtoull(lengthStart, nullptr, 10);
+  const char *command = pos + 1;
+  return std::string(command, std::min<size_t>(length, end - command));
+}
+
+static size_t replyBytes(const redisReply *reply) {
+  if(reply->type == REDIS_REPLY_ARRAY || reply->type == REDIS_REPLY_MAP ||
+     reply->type == REDIS_REPLY_SET || reply->type == REDIS_REPLY_PUSH) {
+    size_t total = 0u;
+    for(size_t i = 0; i < reply->elements; i++) {
+      total += replyBytes(reply->element[i]);
+    }
+
+    return total;
+  }
+
+  return reply->str ? reply->len : 0u;
+}
+
+uint64_t ConnectionCore::startTrace(const EncodedRequest &req) {
+  RequestTrace trace;
+  trace.id = nextTraceId++;
+  trace.command = extractCommand(req.getSegment(0));
+  trace.requestBytes = req.getLen();
+  trace.stagedAt = std::chrono::steady_clock::now();
+
+  tracer->requestStarted(trace);
+  return trace.id;
+}
+
+std::unique_ptr<RequestTrace> ConnectionCore::traceAcknowledged(StagedRequest &item,
+  const redisReplyPtr &reply, std::chrono::steady_clock::time_point now) {
+
+  if(item.getTraceId() == 0u) {
+    return {};
+  }
+
+  std::unique_ptr<RequestTrace> trace(new RequestTrace());
+  trace->id = item.getTraceId();
+  trace->command = extractCommand(item.getSegment(0));
+  trace->requestBytes = item.getLen();
+  trace->stagedAt = item.getStagedAt();
+  trace->writtenAt = item.getWrittenAt();
+  trace->acknowledgedAt = now;
+
+  if(reply) {
+    trace->hasReply = true;
+    trace->errorReply = (reply->type == REDIS_REPLY_ERROR);
+    trace->replyBytes = replyBytes(reply.get());
+  }
+
+  return trace;
+}
+
+void ConnectionCore::setOptimisticHandshake(bool value) {
+  optimisticHandshake = value;
+
+  // The first handshake request was queued by the constructor already.
+  if(handshake && inHandshake) {
+    pipelineBehindHandshake = optimisticHandshake && handshake->pipelinable();
+  }
+}
+
+//------------------------------------------------------------------------------
+// Queue the next request of the handshake, noting down whether user requests
+// may follow right behind it.
+//------------------------------------------------------------------------------
+void ConnectionCore::queueHandshakeRequest() {
+  std::vector<std::string> request = handshake->provideHandshake();
+
+  // Set before the request becomes visible to the writer
+  pipelineBehindHandshake = optimisticHandshake && handshake->pipelinable();
+  handshakeRequests.emplace_back(nullptr, EncodedRequest(request));
+}
+
+void ConnectionCore::setQueueSpinIterations(size_t iterations) {
+  requestQueue.setSpinIterations(iterations);
+  handshakeRequests.setSpinIterations(iterations);
+  cbExecutor.setSpinIterations(iterations);
 }
 
 //------------------------------------------------------------------------------
@@ -77,15 +237,21 @@ void ConnectionCore::reconnection() {
   // again, but that's for clearAllPending() to decide, not us.
   //----------------------------------------------------------------------------
 
+  messageDecoder.reset();
+  lastProgressAt = steadyNanoseconds();
+  setReady(false);
+
   if(handshake) {
     //--------------------------------------------------------------------------
     // Re-initialize handshake.
     //--------------------------------------------------------------------------
     inHandshake = true;
+    handshakeStartedAt = 0;
 
     handshake->restart();
     handshakeRequests.reset();
-    handshakeRequests.emplace_back(nullptr, handshake->provideHandshake());
+    handshakeFlushed = false;
+    queueHandshakeRequest();
     handshakeIterator = handshakeRequests.begin();
   }
   else {
@@ -98,65 +264,505 @@ void ConnectionCore::reconnection() {
   ignoredResponses = 0u;
   nextToWriteIterator = requestQueue.begin();
   nextToAcknowledgeIterator = requestQueue.begin();
-}
 
-size_t ConnectionCore::clearAllPending() {
-  std::lock_guard<std::mutex> lock(mtx);
+  //----------------------------------------------------------------------------
+  // Pace the replay of whatever is still pending, if there's more of it than
+  // fits into the initial window.
+  //----------------------------------------------------------------------------
+  std::lock_guard<std::mutex> lock(pacingMtx);
+  replayEnd = requestQueue.getNextSequenceNumber();
+  pacedAcknowledged = nextToAcknowledgeIterator.seq();
+  replayWindow = replayPacing.getInitialWindow();
+  pacingActive = replayPacing.active() && replayEnd - pacedAcknowledged > replayWindow;
+}
 
+void ConnectionCore::handshakeCompletedOutOfBand() {
   //----------------------------------------------------------------------------
-  // The party's over, any requests that still remain un-acknowledged
-  // will get a null response.
+  // Nothing from the handshake queue reaches this connection - go straight
+  // to replaying user requests.
   //----------------------------------------------------------------------------
   inHandshake = false;
+}
 
-  redisReplyPtr nullReply;
-  while(nextToAcknowledgeIterator.itemHasArrived()) {
-    acknowledgePending(std::move(nullReply));
+//------------------------------------------------------------------------------
+// Without a handshake, or with one completed out of band, the connection is
+// ready as soon as it's up.
+//------------------------------------------------------------------------------
+void ConnectionCore::connectionEstablished() {
+  if(!inHandshake) {
+    setReady(true);
   }
+}
 
-  size_t retval = requestQueue.size();
+bool ConnectionCore::waitUntilReady(std::chrono::milliseconds timeout) {
+  std::unique_lock<std::mutex> lock(readyMtx);
+  return readyCv.wait_for(lock, timeout, [this]() { return ready; });
+}
 
-  requestQueue.reset();
-  reconnection();
-  return retval;
+void ConnectionCore::setReady(bool value) {
+  std::lock_guard<std::mutex> lock(readyMtx);
+  ready = value;
+
+  if(ready) {
+    readyCv.notify_all();
+  }
+}
+
+//------------------------------------------------------------------------------
+// Complete a purged request on the calling thread, the way the callback
+// executor would
+//------------------------------------------------------------------------------
+static void completeNow(PendingCallback &cb, RequestTracer *tracer) {
+  if(cb.callback) {
+    cb.callback->handleResponse(std::move(cb.reply));
+  }
+  else if(cb.function) {
+    cb.function(std::move(cb.reply));
+  }
+
+  if(cb.trace) {
+    cb.trace->callbackAt = cb.stagedAt;
+    cb.trace->finishedAt = std::chrono::steady_clock::now();
+    tracer->requestFinished(*cb.trace);
+  }
+}
+
+size_t ConnectionCore::clearAllPending() {
+  std::vector<PendingCallback> immediate;
+  std::vector<PendingCallback> deferred;
+  size_t purged = 0u;
+
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+
+    //--------------------------------------------------------------------------
+    // The party's over, any requests that still remain un-acknowledged
+    // will get a null response.
+    //
+    // We don't reset the request queue: Callback-based producers stage
+    // without taking mtx, so the queue must remain valid throughout. Once
+    // everything has been acknowledged, the hidden front item left behind
+    // serves as the dummy request, and sequence numbers simply keep going.
+    //
+    // Only unlinking happens under mtx. Fulfilling promises and handing
+    // callbacks to the executor - one queue operation per lane - come after
+    // releasing it, so that purging a huge backlog doesn't hold up staging.
+    //--------------------------------------------------------------------------
+    inHandshake = false;
+
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    while(nextToAcknowledgeIterator.itemHasArrived()) {
+      purgePending(immediate, deferred, now);
+      purged++;
+    }
+
+    reconnection();
+  }
+
+  for(PendingCallback &cb : immediate) {
+    completeNow(cb, tracer);
+  }
+
+  cbExecutor.stage(std::move(deferred));
+  return purged;
 }
 
-void ConnectionCore::stage(QCallback *callback, EncodedRequest &&req, size_t multiSize) {
-  backpressure.reserve();
+//------------------------------------------------------------------------------
+// All staging paths go through admission control before touching the queue,
+// and every request is released exactly once in discardPending.
+//
+// Staging does not need mtx: Each staged request carries its own callback -
+// or, for the future-based paths, its own promise - and publishing into the
+// request queue is a single short critical section inside ThreadSafeQueue.
+//------------------------------------------------------------------------------
+void ConnectionCore::stage(QCallback *callback, EncodedRequest &&req, size_t multiSize,
+  BulkSink *sink, ReplyDecoder *decoder) {
+  if(callback && writeCombiner && multiSize == 0u && !sink && !decoder) {
+    ReplyCallback function([callback](redisReplyPtr &&reply) {
+      callback->handleResponse(std::move(reply));
+    });
+
+    if(stageCombined(std::move(function), std::move(req))) {
+      return;
+    }
+  }
 
-  std::lock_guard<std::mutex> lock(mtx);
-  requestQueue.emplace_back(callback, std::move(req), multiSize);
+  backpressure.reserve(req.getLen());
+  uint64_t traceId = traceStart(req);
+  requestQueue.emplace_back(callback, std::move(req), multiSize, sink, decoder, traceId);
 }
 
-std::future<redisReplyPtr> ConnectionCore::stage(EncodedRequest &&req, size_t multiSize) {
-  std::lock_guard<std::mutex> lock(mtx);
+void ConnectionCore::stage(ReplyCallback &&callback, EncodedRequest &&req) {
+  if(writeCombiner && stageCombined(std::move(callback), std::move(req))) {
+    return;
+  }
+
+  backpressure.reserve(req.getLen());
+  uint64_t traceId = traceStart(req);
+  requestQueue.emplace_back(std::move(callback), std::move(req), traceId);
+}
 
-  std::future<redisReplyPtr> retval = futureHandler.stage();
-  requestQueue.emplace_back(&futureHandler, std::move(req), multiSize);
+//------------------------------------------------------------------------------
+// A batch goes in chunks of whatever the backpressure limits admit: Only the
+// first request of a chunk may block, and only once everything reserved
+// before it has been staged. Holding on to slots of requests not yet staged
+// while blocking would never end for a batch larger than the window, as
+// nothing staged could drain to free up room - or for two batches each
+// holding part of it.
+//------------------------------------------------------------------------------
+void ConnectionCore::stage(std::vector<ReplyCallback> &callbacks,
+  std::vector<EncodedRequest> &requests) {
+
+  std::vector<uint64_t> traceIds;
+  size_t first = 0u;
+
+  while(first < requests.size()) {
+    backpressure.reserve(requests[first].getLen());
+
+    size_t end = first + 1;
+    while(end < requests.size() && backpressure.tryReserve(requests[end].getLen())) {
+      end++;
+    }
+
+    traceIds.clear();
+    [[maybe_unused]] size_t totalLen = 0u;
+    for(size_t i = first; i < end; i++) {
+      totalLen += requests[i].getLen();
+
+      if(tracer) {
+        traceIds.push_back(startTrace(requests[i]));
+      }
+    }
+
+    [[maybe_unused]] int64_t lastSeq = requestQueue.emplace_many(end - first, [&](void *where, size_t i) {
+      new (where) StagedRequest(std::move(callbacks[first + i]), std::move(requests[first + i]),
+        traceIds.empty() ? 0u : traceIds[i]);
+    });
+
+    QCLIENT_TRACE(stage_batch, lastSeq - (int64_t) (end - first) + 1, end - first, totalLen);
+    first = end;
+  }
+
+  callbacks.clear();
+  requests.clear();
+}
+
+void ConnectionCore::stage(ReplyCallback &&callback, EncodedRequest &&req,
+  std::chrono::steady_clock::time_point deadline) {
+  std::shared_ptr<RequestDeadline> state = std::make_shared<RequestDeadline>(std::move(callback), deadline);
+  ReplyCallback wrapper([state](redisReplyPtr &&reply) {
+    state->complete(std::move(reply));
+  });
+
+  backpressure.reserve(req.getLen());
+  uint64_t traceId = traceStart(req);
+  requestQueue.emplace_back(std::move(wrapper), std::move(req), traceId, state);
+  scheduleTimer(std::move(state));
+}
+
+//------------------------------------------------------------------------------
+// Cancellable requests share the machinery of deadlines, with a deadline that
+// never passes: Cancelling completes them early, just like expiry would.
+//------------------------------------------------------------------------------
+CancellationHandle ConnectionCore::stageCancellable(ReplyCallback &&callback,
+  EncodedRequest &&req) {
+
+  std::shared_ptr<RequestDeadline> state = std::make_shared<RequestDeadline>(
+    std::move(callback), std::chrono::steady_clock::time_point::max());
+  ReplyCallback wrapper([state](redisReplyPtr &&reply) {
+    state->complete(std::move(reply));
+  });
+
+  backpressure.reserve(req.getLen());
+  uint64_t traceId = traceStart(req);
+  requestQueue.emplace_back(std::move(wrapper), std::move(req), traceId, state);
+  return CancellationHandle(std::move(state));
+}
+
+bool CancellationHandle::cancel() {
+  if(!state) {
+    return false;
+  }
+
+  return state->complete(ResponseBuilder::makeErr("ERR request cancelled"));
+}
+
+bool CancellationHandle::isCompleted() const {
+  return state && state->isCompleted();
+}
+
+//------------------------------------------------------------------------------
+// Stage a write through the combiner - false if the request doesn't combine,
+// leaving both arguments untouched.
+//------------------------------------------------------------------------------
+bool ConnectionCore::stageCombined(ReplyCallback &&callback, EncodedRequest &&req) {
+  std::string key = WriteCombiner::combiningKey(req);
+  if(key.empty()) {
+    return false;
+  }
+
+  std::shared_ptr<RequestDeadline> state = writeCombiner->combine(std::move(key), std::move(callback));
+  ReplyCallback wrapper([state](redisReplyPtr &&reply) {
+    state->complete(std::move(reply));
+  });
+
+  backpressure.reserve(req.getLen());
+  uint64_t traceId = traceStart(req);
+  requestQueue.emplace_back(std::move(wrapper), std::move(req), traceId, std::move(state));
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Timers share the wheel with request deadlines
+//------------------------------------------------------------------------------
+void ConnectionCore::scheduleTimer(std::shared_ptr<RequestDeadline> &&timer) {
+  std::call_once(deadlineThreadStarted, [this]() {
+    deadlineThread.reset(&ConnectionCore::expireDeadlines, this);
+    deadlineThread.setAffinity(cpuAffinity);
+  });
+
+  deadlines.schedule(std::move(timer));
+}
+
+void ConnectionCore::stopTimers() {
+  deadlineThread.stop();
+  deadlines.shutdown();
+  deadlineThread.join();
+}
+
+//------------------------------------------------------------------------------
+// Expire whatever is due - requests are completed with an error reply
+//------------------------------------------------------------------------------
+void ConnectionCore::expireDeadlines(ThreadAssistant &assistant) {
+  std::vector<std::shared_ptr<RequestDeadline>> expired;
+
+  while(!assistant.terminationRequested()) {
+    deadlines.waitForWork();
+    deadlines.advance(std::chrono::steady_clock::now(), expired);
+
+    for(size_t i = 0; i < expired.size(); i++) {
+      expired[i]->expire();
+    }
+
+    expired.clear();
+  }
+}
+
+bool ConnectionCore::tryStage(QCallback *callback, EncodedRequest &&req, size_t multiSize) {
+  if(!backpressure.tryReserve(req.getLen())) {
+    return false;
+  }
+
+  uint64_t traceId = traceStart(req);
+  requestQueue.emplace_back(callback, std::move(req), multiSize, nullptr, nullptr, traceId);
+  return true;
+}
+
+bool ConnectionCore::tryStage(ReplyCallback &&callback, EncodedRequest &&req) {
+  if(!backpressure.tryReserve(req.getLen())) {
+    return false;
+  }
+
+  uint64_t traceId = traceStart(req);
+  requestQueue.emplace_back(std::move(callback), std::move(req), traceId);
+  return true;
+}
+
+void ConnectionCore::notifyWhenCapacityAvailable(std::function<void()> callback) {
+  backpressure.notifyWhenCapacityAvailable(std::move(callback));
+}
+
+int64_t ConnectionCore::getPendingRequests() const {
+  return backpressure.getPendingRequests();
+}
+
+std::chrono::nanoseconds ConnectionCore::getOldestPendingAge() {
+  int64_t now = steadyNanoseconds();
+
+  if(getPendingRequests() == 0) {
+    lastIdleAt = now;
+    return std::chrono::nanoseconds(0);
+  }
+
+  int64_t since = std::max(lastProgressAt.load(), lastIdleAt.load());
+  return std::chrono::nanoseconds(std::max<int64_t>(0, now - since));
+}
+
+int64_t ConnectionCore::getPendingBytes() const {
+  return backpressure.getPendingBytes();
+}
+
+LatencyStats ConnectionCore::getLatencyStats() const {
+  LatencyStats stats;
+  stats.queueing = queueingLatency.snapshot();
+  stats.network = networkLatency.snapshot();
+  stats.callback = callbackLatency.snapshot();
+  return stats;
+}
+
+void ConnectionCore::resetLatencyStats() {
+  queueingLatency.reset();
+  networkLatency.reset();
+  callbackLatency.reset();
+}
+
+ClientStatistics ConnectionCore::getStatistics() const {
+  ClientStatistics stats;
+  stats.requestsStaged = backpressure.getAdmitted();
+  stats.requestsAcknowledged = backpressure.getReleased();
+  stats.bytesSent = counters.bytesSent.get();
+  stats.bytesReceived = counters.bytesReceived.get();
+  stats.pendingRequests = requestQueue.size();
+  stats.inFlightWindow = backpressure.getWindow();
+  stats.executorQueueDepth = cbExecutor.getQueueDepth();
+  stats.pushQueueDepth = pushExecutor ? pushExecutor->getQueueDepth() : 0;
+  stats.reconnects = counters.reconnects.get();
+  stats.redirects = counters.redirects.get();
+  stats.handshakes = handshakes.get();
+  stats.handshakeTime = std::chrono::nanoseconds(handshakeTime.get());
+  stats.backpressureBlockedTime = backpressure.getBlockedTime();
+  stats.combinedWrites = writeCombiner ? writeCombiner->getCombined() : 0;
+  stats.fireAndForgetErrors = fireAndForgetErrors.get();
+  stats.allocations = AllocationAccounting::get();
+  return stats;
+}
+
+std::future<redisReplyPtr> ConnectionCore::stage(EncodedRequest &&req, size_t multiSize,
+  BulkSink *sink, ReplyDecoder *decoder) {
+  FutureSlot slot;
+  std::future<redisReplyPtr> retval = slot.getFuture();
+
+  if(multiSize == 0u && !sink && !decoder && combines(req)) {
+    stageCombined(ReplyCallback(std::move(slot)), std::move(req));
+    return retval;
+  }
+
+  backpressure.reserve(req.getLen());
+  uint64_t traceId = traceStart(req);
+  requestQueue.emplace_back(ReplyCallback(std::move(slot)), std::move(req), multiSize, sink, decoder, traceId);
   return retval;
 }
 
 #if HAVE_FOLLY == 1
 folly::Future<redisReplyPtr> ConnectionCore::follyStage(EncodedRequest &&req, size_t multiSize) {
-  backpressure.reserve();
+  FollyFutureSlot slot;
+  folly::Future<redisReplyPtr> retval = slot.getFuture();
+
+  backpressure.reserve(req.getLen());
+  uint64_t traceId = traceStart(req);
+  requestQueue.emplace_back(ReplyCallback(std::move(slot)), std::move(req), multiSize, nullptr, nullptr, traceId);
+  return retval;
+}
 
-  std::lock_guard<std::mutex> lock(mtx);
+folly::SemiFuture<redisReplyPtr> ConnectionCore::follySemiStage(EncodedRequest &&req, size_t multiSize) {
+  FollyFutureSlot slot;
+  folly::SemiFuture<redisReplyPtr> retval = slot.getSemiFuture();
 
-  folly::Future<redisReplyPtr> retval = follyFutureHandler.stage();
-  requestQueue.emplace_back(&follyFutureHandler, std::move(req), multiSize);
+  backpressure.reserve(req.getLen());
+  uint64_t traceId = traceStart(req);
+  requestQueue.emplace_back(ReplyCallback(std::move(slot)), std::move(req), multiSize, nullptr, nullptr, traceId, true);
   return retval;
 }
 #endif
 
-void ConnectionCore::acknowledgePending(redisReplyPtr &&reply) {
-  cbExecutor.stage(nextToAcknowledgeIterator.item().getCallback(), std::move(reply));
+void ConnectionCore::acknowledgePending(redisReplyPtr &&reply, bool skipped) {
+  StagedRequest &item = nextToAcknowledgeIterator.item();
+  QCallback *callback = item.getCallback();
+  QCLIENT_TRACE(acknowledge, nextToAcknowledgeIterator.seq(), item.getStagedLen(), reply.get());
+
+  //----------------------------------------------------------------------------
+  // Requests purged before ever being written have no write time
+  //----------------------------------------------------------------------------
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+  lastProgressAt = std::chrono::duration_cast<std::chrono::nanoseconds>(now.time_since_epoch()).count();
+
+  std::chrono::steady_clock::time_point writtenAt = item.getWrittenAt();
+  if(writtenAt != std::chrono::steady_clock::time_point()) {
+    queueingLatency.record(writtenAt - item.getStagedAt());
+    networkLatency.record(now - writtenAt);
+
+    if(reply || skipped) {
+      backpressure.observeLatency(now - writtenAt);
+    }
+  }
+
+  std::unique_ptr<RequestTrace> trace;
+  if(tracer) {
+    trace = traceAcknowledged(item, reply, now);
+    if(trace && skipped) {
+      trace->hasReply = true;
+    }
+  }
+
+  //----------------------------------------------------------------------------
+  // Fire-and-forget: Nobody to hand the reply to, it's dropped right here,
+  // without a detour through the callback executor.
+  //----------------------------------------------------------------------------
+  if(reply && reply->type == REDIS_REPLY_ERROR && item.isFireAndForget()) {
+    fireAndForgetErrors.add(1);
+  }
+
+  if(item.hasFunction() && !item.functionRunsInline()) {
+    cbExecutor.stage(item.takeFunction(), std::move(reply), now, std::move(trace));
+  }
+  else if(item.hasFunction() || !callback || callback->runInline()) {
+    item.set_value(std::move(reply));
+
+    if(trace) {
+      trace->callbackAt = now;
+      trace->finishedAt = std::chrono::steady_clock::now();
+      tracer->requestFinished(*trace);
+    }
+  }
+  else {
+    cbExecutor.stage(callback, std::move(reply), now, std::move(trace));
+  }
+
+  discardPending();
+}
+
+void ConnectionCore::purgePending(std::vector<PendingCallback> &immediate,
+  std::vector<PendingCallback> &deferred, std::chrono::steady_clock::time_point now) {
+  StagedRequest &item = nextToAcknowledgeIterator.item();
+  QCallback *callback = item.getCallback();
+
+  std::chrono::steady_clock::time_point writtenAt = item.getWrittenAt();
+  if(writtenAt != std::chrono::steady_clock::time_point()) {
+    queueingLatency.record(writtenAt - item.getStagedAt());
+    networkLatency.record(now - writtenAt);
+  }
+
+  std::unique_ptr<RequestTrace> trace;
+  if(tracer) {
+    trace = traceAcknowledged(item, redisReplyPtr(), now);
+  }
+
+  if(item.hasFunction()) {
+    bool runsInline = item.functionRunsInline();
+    (runsInline ? immediate : deferred).emplace_back(item.takeFunction(), redisReplyPtr(), now, std::move(trace));
+  }
+  else if(callback && !callback->runInline()) {
+    deferred.emplace_back(callback, redisReplyPtr(), now, std::move(trace));
+  }
+  else if(callback || trace) {
+    immediate.emplace_back(callback, redisReplyPtr(), now, std::move(trace));
+  }
+
   discardPending();
 }
 
 void ConnectionCore::discardPending() {
+  size_t len = nextToAcknowledgeIterator.item().getStagedLen();
   nextToAcknowledgeIterator.next();
   requestQueue.pop_front();
-  backpressure.release();
+  backpressure.release(len);
+
+  if(pacingActive.load(std::memory_order_acquire)) {
+    std::lock_guard<std::mutex> lock(pacingMtx);
+    pacedAcknowledged = nextToAcknowledgeIterator.seq();
+    replayWindow++;
+    pacingCv.notify_one();
+  }
 }
 
 static bool isOK(const redisReplyPtr &reply) {
@@ -191,6 +797,116 @@ static bool isQueued(const redisReplyPtr &reply) {
   return true;
 }
 
+//------------------------------------------------------------------------------
+// Move past requests the writer skipped, as their deadline expired before
+// they could be written. The writer decides on each request in order, before
+// writing any that follow, so those skipped ahead of the request a response
+// belongs to are always marked by the time the response arrives.
+//------------------------------------------------------------------------------
+void ConnectionCore::skipUnwritten() {
+  while(nextToAcknowledgeIterator.itemHasArrived() &&
+        nextToAcknowledgeIterator.item().wasSkipped()) {
+    discardPending();
+  }
+}
+
+//------------------------------------------------------------------------------
+// Mirrors the decisions of consumeResponse: Only a response which is going to
+// acknowledge a plain request can be handed to its sink or decoder. Handshake
+// and pub-sub traffic, or the OK / QUEUED replies of a MULTI block, never are.
+//------------------------------------------------------------------------------
+StagedRequest* ConnectionCore::getRequestForNextResponse() {
+  if(inHandshake || (listener && exclusivePubsub)) {
+    return nullptr;
+  }
+
+  skipUnwritten();
+
+  if(!nextToAcknowledgeIterator.itemHasArrived()) {
+    return nullptr;
+  }
+
+  StagedRequest &item = nextToAcknowledgeIterator.item();
+  if(item.getMultiSize() != 0u) {
+    return nullptr;
+  }
+
+  return &item;
+}
+
+BulkSink* ConnectionCore::getBulkSinkForNextResponse() {
+  StagedRequest *item = getRequestForNextResponse();
+  return item ? item->getBulkSink() : nullptr;
+}
+
+ReplyDecoder* ConnectionCore::getReplyDecoderForNextResponse() {
+  //----------------------------------------------------------------------------
+  // Exclusive pub-sub mode: Everything past the handshake is a message, built
+  // straight out of the parser.
+  //----------------------------------------------------------------------------
+  if(!inHandshake && listener && exclusivePubsub) {
+    return &messageDecoder;
+  }
+
+  StagedRequest *item = getRequestForNextResponse();
+  return item ? item->getReplyDecoder() : nullptr;
+}
+
+const char* ConnectionCore::getSkippableStatusForNextResponse(size_t &len) {
+  if(inHandshake || (listener && exclusivePubsub)) {
+    return nullptr;
+  }
+
+  skipUnwritten();
+
+  if(!nextToAcknowledgeIterator.itemHasArrived()) {
+    return nullptr;
+  }
+
+  if(ignoredResponses >= nextToAcknowledgeIterator.item().getMultiSize()) {
+    return nullptr;
+  }
+
+  if(ignoredResponses == 0u) {
+    len = 2;
+    return "OK";
+  }
+
+  len = 6;
+  return "QUEUED";
+}
+
+void ConnectionCore::skippedResponse() {
+  ignoredResponses++;
+}
+
+bool ConnectionCore::nextResponseIsFireAndForget() {
+  if(inHandshake || (listener && exclusivePubsub)) {
+    return false;
+  }
+
+  skipUnwritten();
+
+  return nextToAcknowledgeIterator.itemHasArrived() &&
+    nextToAcknowledgeIterator.item().isFireAndForget();
+}
+
+void ConnectionCore::skippedFireAndForget() {
+  acknowledgePending(redisReplyPtr(), true);
+}
+
+//------------------------------------------------------------------------------
+// A reply which went through the message decoder shows up empty - the message
+// is waiting in the decoder already.
+//------------------------------------------------------------------------------
+bool ConnectionCore::parseMessage(redisReplyPtr &&reply, Message &out) {
+  if(messageDecoder.hasMessage()) {
+    return messageDecoder.take(out);
+  }
+
+  return MessageParser::parse(std::move(reply), out);
+}
+
 bool ConnectionCore::consumeResponse(redisReplyPtr &&reply) {
   // Is this a transient "unavailable" error? Specific to QDB.
   if(transparentUnavailable && isUnavailable(reply.get())) {
@@ -212,13 +928,32 @@ bool ConnectionCore::consumeResponse(redisReplyPtr &&reply) {
     if(status == Handshake::Status::VALID_COMPLETE) {
       // We're done handshaking
       inHandshake = false;
+
+      int64_t startedAt = handshakeStartedAt;
+      if(startedAt != 0) {
+        handshakeTime.add(steadyNanoseconds() - startedAt);
+      }
+
+      handshakes.add(1);
       handshakeRequests.setBlockingMode(false);
+      setReady(true);
       return true;
     }
 
     if(status == Handshake::Status::VALID_INCOMPLETE) {
+      if(handshakeFlushed) {
+        //----------------------------------------------------------------------
+        // The handshake claimed to be done after this stage, and user
+        // requests went out behind it already. Nothing to do but to start
+        // over, without optimism this time.
+        //----------------------------------------------------------------------
+        QCLIENT_LOG(logger, LogLevel::kWarn, "Handshake asked for more after claiming to be pipelinable, disabling optimistic pipelining");
+        optimisticHandshake = false;
+        return false;
+      }
+
       // Still more requests to go
-      handshakeRequests.emplace_back(nullptr, handshake->provideHandshake());
+      queueHandshakeRequest();
       return true;
     }
 
@@ -228,7 +963,7 @@ bool ConnectionCore::consumeResponse(redisReplyPtr &&reply) {
   if(reply->type == REDIS_REPLY_PUSH) {
     if(listener) {
       Message msg;
-      if(!MessageParser::parse(std::move(reply), msg)) {
+      if(!parseMessage(std::move(reply), msg)) {
         //----------------------------------------------------------------------
         // Parse error, doesn't look like a valid pub/sub message
         //----------------------------------------------------------------------
@@ -236,6 +971,15 @@ bool ConnectionCore::consumeResponse(redisReplyPtr &&reply) {
         return false;
       }
 
+      if(pushExecutor) {
+        MessageListener *target = listener;
+        std::shared_ptr<Message> shared = std::make_shared<Message>(std::move(msg));
+        pushExecutor->stage([target, shared](redisReplyPtr&&) {
+          target->handleIncomingMessage(*shared);
+        }, redisReplyPtr());
+        return true;
+      }
+
       listener->handleIncomingMessage(std::move(msg));
       return true;
     }
@@ -253,7 +997,7 @@ bool ConnectionCore::consumeResponse(redisReplyPtr &&reply) {
     // listener.
     //--------------------------------------------------------------------------
     Message msg;
-    if(!MessageParser::parse(std::move(reply), msg)) {
+    if(!parseMessage(std::move(reply), msg)) {
       //------------------------------------------------------------------------
       // Parse error, doesn't look like a valid pub/sub message
       //------------------------------------------------------------------------
@@ -265,6 +1009,8 @@ bool ConnectionCore::consumeResponse(redisReplyPtr &&reply) {
     return true;
   }
 
+  skipUnwritten();
+
   if(!nextToAcknowledgeIterator.itemHasArrived()) {
     //--------------------------------------------------------------------------
     // The server is sending more responses than we sent requests... wtf.
@@ -315,33 +1061,163 @@ bool ConnectionCore::consumeResponse(redisReplyPtr &&reply) {
 void ConnectionCore::setBlockingMode(bool value) {
   handshakeRequests.setBlockingMode(value);
   requestQueue.setBlockingMode(value);
+
+  std::lock_guard<std::mutex> lock(pacingMtx);
+  pacingBlocks = value;
+  pacingCv.notify_all();
+}
+
+//------------------------------------------------------------------------------
+// How many more user requests may be written right now, as far as replay
+// pacing is concerned. If none may, either block until a response makes
+// room, or return zero right away.
+//------------------------------------------------------------------------------
+size_t ConnectionCore::replayAllowance(bool wait) {
+  if(!pacingActive.load(std::memory_order_acquire)) {
+    return std::numeric_limits<size_t>::max();
+  }
+
+  std::unique_lock<std::mutex> lock(pacingMtx);
+  while(true) {
+    int64_t written = nextToWriteIterator.seq();
+
+    if(written >= replayEnd || replayWindow >= (int64_t) replayPacing.getMaxWindow()) {
+      pacingActive = false;
+      return std::numeric_limits<size_t>::max();
+    }
+
+    int64_t allowed = pacedAcknowledged + replayWindow - written;
+    if(allowed > 0) {
+      return allowed;
+    }
+
+    if(!wait || !pacingBlocks) {
+      return 0u;
+    }
+
+    pacingCv.wait(lock);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Cap a batch currently holding the given number of requests
+//------------------------------------------------------------------------------
+size_t ConnectionCore::pacedLimit(size_t current, size_t maxCount) {
+  size_t allowance = replayAllowance(false);
+  if(allowance >= maxCount) {
+    return maxCount;
+  }
+
+  return std::min(maxCount, current + allowance);
 }
 
 StagedRequest* ConnectionCore::getNextToWrite() {
-  if(inHandshake) {
+  if(inHandshake && !handshakeFlushed) {
     StagedRequest *item = handshakeIterator.getItemBlockOrNull();
     if(!item) return nullptr;
 
     handshakeIterator.next();
+
+    if(handshakeStartedAt == 0) {
+      handshakeStartedAt = steadyNanoseconds();
+    }
+
+    // Optimistic pipelining: User requests may go out right behind this one.
+    if(pipelineBehindHandshake) {
+      handshakeFlushed = true;
+    }
+
     return item;
   }
 
-  StagedRequest *item = nextToWriteIterator.getItemBlockOrNull();
+  while(true) {
+    if(replayAllowance(true) == 0u) {
+      return nullptr;
+    }
+
+    StagedRequest *item = nextToWriteIterator.getItemBlockOrNull();
+
+    if (listener && exclusivePubsub ) {
+      //------------------------------------------------------------------------
+      // The connection is in exclusive pub-sub mode, which means normal
+      // requests are no longer being acknowledged. The request queue can
+      // potentially grow to infinity - let's trim no-longer-needed items.
+      //------------------------------------------------------------------------
+      while(nextToWriteIterator.seq() > nextToAcknowledgeIterator.seq()) {
+        discardPending();
+      }
+    }
+
+    if(!item) return nullptr;
+    nextToWriteIterator.next();
+
+    if(!item->skipIfExpired()) {
+      return item;
+    }
+  }
+}
+
+//------------------------------------------------------------------------------
+// Append already-arrived items to the batch, until we run out of items or hit
+// the budget. The edge of the queue is only checked once.
+//------------------------------------------------------------------------------
+template<typename Iterator>
+static void extendBatch(Iterator &iterator, std::vector<StagedRequest*> &batch,
+  size_t maxCount, size_t maxBytes, size_t bytes) {
+
+  size_t available = iterator.itemsAvailable();
+
+  while(available > 0 && batch.size() < maxCount && bytes < maxBytes) {
+    StagedRequest *item = &iterator.item();
+    iterator.next();
+    available--;
+
+    if(item->skipIfExpired()) {
+      continue;
+    }
+
+    batch.push_back(item);
+    bytes += item->getLen();
+  }
+}
+
+size_t ConnectionCore::getNextToWrite(std::vector<StagedRequest*> &batch, size_t maxCount, size_t maxBytes) {
+  batch.clear();
+
+  //----------------------------------------------------------------------------
+  // The first item goes through the single-item path, which takes care of
+  // blocking, and trimming the queue in exclusive pub-sub mode. Trimming is
+  // only safe here, as the previous batch must have been fully written.
+  //----------------------------------------------------------------------------
+  bool handshakeBatch = inHandshake && !handshakeFlushed;
+  StagedRequest *first = getNextToWrite();
+  if(!first) return 0u;
+
+  batch.push_back(first);
+
+  if(handshakeBatch) {
+    extendBatch(handshakeIterator, batch, maxCount, maxBytes, first->getLen());
 
-  if (listener && exclusivePubsub ) {
     //--------------------------------------------------------------------------
-    // The connection is in exclusive pub-sub mode, which means normal requests
-    // are no longer being acknowledged. The request queue can potentially
-    // grow to infinity - let's trim no-longer-needed items.
+    // Optimistic pipelining: Fill up the rest of the batch with user
+    // requests, so they go out in the same write as the handshake.
     //--------------------------------------------------------------------------
-    while(nextToWriteIterator.seq() > nextToAcknowledgeIterator.seq()) {
-      discardPending();
+    if(handshakeFlushed) {
+      size_t bytes = 0u;
+      for(size_t i = 0; i < batch.size(); i++) {
+        bytes += batch[i]->getLen();
+      }
+
+      extendBatch(nextToWriteIterator, batch, pacedLimit(batch.size(), maxCount),
+        maxBytes, bytes);
     }
   }
+  else {
+    extendBatch(nextToWriteIterator, batch, pacedLimit(batch.size(), maxCount),
+      maxBytes, first->getLen());
+  }
 
-  if(!item) return nullptr;
-  nextToWriteIterator.next();
-  return item;
+  return batch.size();
 }
 
 }
@@ -27,15 +27,36 @@
 #include "qclient/queueing/WaitableQueue.hh"
 #include "BackpressureApplier.hh"
 #include "RequestQueue.hh"
+#include "TimerWheel.hh"
+#include "WriteCombiner.hh"
 #include "FutureHandler.hh"
 #include "CallbackExecutorThread.hh"
+#include "pubsub/MessageDecoder.hh"
 #include "qclient/Logger.hh"
+#include "qclient/ClientStatistics.hh"
+#include "qclient/RequestTracer.hh"
+#include "qclient/utils/ShardedCounter.hh"
+#include "qclient/AssistedThread.hh"
+#include "qclient/CancellationHandle.hh"
+#include <mutex>
+#include <condition_variable>
 
 namespace qclient {
 
 class Handshake;
 class MessageListener;
 
+//------------------------------------------------------------------------------
+// Counters fed by the networking code around ConnectionCore, which sees
+// neither sockets nor endpoints.
+//------------------------------------------------------------------------------
+struct ConnectionCounters {
+  ShardedCounter bytesSent;
+  ShardedCounter bytesReceived;
+  ShardedCounter reconnects;
+  ShardedCounter redirects;
+};
+
 //------------------------------------------------------------------------------
 // Handles a particular connection, deciding what should be written into the
 // socket, and consumes bytes out of it. However, this class is decoupled from
@@ -44,25 +65,190 @@ class MessageListener;
 class ConnectionCore {
 public:
   ConnectionCore(Logger *log, Handshake *hs, BackpressureStrategy backpressure,
-    bool transparentUnavailable, MessageListener *listener = nullptr, bool exclusivePubsub = true);
+    bool transparentUnavailable, MessageListener *listener = nullptr, bool exclusivePubsub = true,
+    size_t callbackThreads = 1u);
   ~ConnectionCore();
   void reconnection();
 
+  // The new connection went through the handshake before being handed to
+  // us, see StandbyConnection. Call after reconnection().
+  void handshakeCompletedOutOfBand();
+
+  // The new connection is up, handshake not necessarily done yet. Call
+  // after handshakeCompletedOutOfBand, if applicable.
+  void connectionEstablished();
+
+  // Block until the current connection is established and handshaken -
+  // false on timeout.
+  bool waitUntilReady(std::chrono::milliseconds timeout);
+
+  // Size the blocks of all internal queues, see ThreadSafeQueue. Call before
+  // staging any requests.
+  void setQueueBlockSizes(size_t initial, size_t maximum);
+
+  // Allocate the blocks of all internal queues out of the given memory
+  // resource. Call before staging any requests.
+  void setMemoryResource(MemoryResource *resource);
+
+  // Write user requests right behind the last handshake request, if the
+  // handshake deems it safe, see Handshake::pipelinable. Call before
+  // starting.
+  void setOptimisticHandshake(bool value);
+
+  // How long the writer and callback threads spin on an empty queue before
+  // parking, see WaitableQueue.
+  void setQueueSpinIterations(size_t iterations);
+
+  // Report the lifecycle of every user request to the given tracer. Call
+  // before staging any requests.
+  void setTracer(RequestTracer *tracer);
+
+  // Let SET / HSET requests supersede earlier ones for the same key and
+  // field which haven't been written yet, see WriteCombiner. Call before
+  // staging any requests.
+  void setWriteCombining(bool value);
+
+  // Ramp up the replay of pending requests on a new connection, see
+  // ReplayPacing. Call before connecting.
+  void setReplayPacing(const ReplayPacing &pacing);
+
+  // Account staged requests against a budget shared with other clients,
+  // on top of our own backpressure. Call before staging any requests.
+  void setMemoryBudget(std::shared_ptr<MemoryBudget> budget);
+
+  // Pin the callback executor and timer threads to the given CPUs. Call
+  // before staging any requests.
+  void setCpuAffinity(const std::vector<int> &cpus);
+
+  // For clients driven by an external event loop: Run callbacks inline, on
+  // the thread consuming responses, and notify the listener whenever user
+  // requests are staged. Call before staging any requests.
+  void setInlineCallbacks(bool value);
+
+  // Deliver push messages from a thread of their own, instead of from
+  // within consumeResponse. Call before connecting.
+  void setOffloadPushMessages(bool value);
+  void setStagingListener(std::function<void()> listener);
+
   // Returns whether connection is still alive after consuming this response.
   // False can happen durnig a failed handshake, for example.
   bool consumeResponse(redisReplyPtr &&reply);
 
-  void stage(QCallback *callback, EncodedRequest &&req, size_t multiSize = 0u);
-  std::future<redisReplyPtr> stage(EncodedRequest &&req, size_t multiSize = 0u);
+  void stage(QCallback *callback, EncodedRequest &&req, size_t multiSize = 0u,
+    BulkSink *sink = nullptr, ReplyDecoder *decoder = nullptr);
+
+  // Callable instead of a QCallback, stored inside the staged request.
+  void stage(ReplyCallback &&callback, EncodedRequest &&req);
+
+  // Stage all given requests back to back, taking the queue lock and waking
+  // up the writer once for all of them - or once per chunk, if they do not
+  // fit within the backpressure limits all at once. Both vectors must be of
+  // the same size, and are left empty.
+  void stage(std::vector<ReplyCallback> &callbacks, std::vector<EncodedRequest> &requests);
+
+  // Same as above, with a deadline: Once it passes, the callback receives an
+  // error reply right away - the request is not written if it hasn't been
+  // yet, and its late response is discarded. A skipped request still counts
+  // as pending until the next response arrives.
+  void stage(ReplyCallback &&callback, EncodedRequest &&req,
+    std::chrono::steady_clock::time_point deadline);
+
+  // Same as above, but instead of a deadline, the returned handle may cancel
+  // the request at any point - see CancellationHandle.
+  CancellationHandle stageCancellable(ReplyCallback &&callback, EncodedRequest &&req);
+
+  // Call expire() on the given timer once its deadline passes, unless it has
+  // completed by then - see RequestDeadline. Expiry runs on a dedicated
+  // thread, shared with request deadlines.
+  void scheduleTimer(std::shared_ptr<RequestDeadline> &&timer);
+
+  // Stop expiring timers and deadlines: Any still pending never fire.
+  void stopTimers();
+
+  // Non-blocking flavour of stage: If backpressure would block, returns false
+  // without staging - req is left untouched.
+  bool tryStage(QCallback *callback, EncodedRequest &&req, size_t multiSize = 0u);
+  bool tryStage(ReplyCallback &&callback, EncodedRequest &&req);
+
+  // One-shot notification for when the backlog drains below the low-water mark
+  void notifyWhenCapacityAvailable(std::function<void()> callback);
+
+  // Requests and bytes admitted, but not yet acknowledged
+  int64_t getPendingRequests() const;
+  int64_t getPendingBytes() const;
+  LatencyStats getLatencyStats() const;
+  void resetLatencyStats();
+
+  ClientStatistics getStatistics() const;
+
+  // How long the oldest pending request has gone without any progress: Time
+  // since the last acknowledgement or reconnection, or since the pipeline was
+  // last seen empty, whichever is most recent - 0 if nothing is pending.
+  // Meant to be polled periodically, the result may overshoot by up to one
+  // polling interval.
+  std::chrono::nanoseconds getOldestPendingAge();
+
+  ConnectionCounters& getCounters() {
+    return counters;
+  }
+
+  std::future<redisReplyPtr> stage(EncodedRequest &&req, size_t multiSize = 0u,
+    BulkSink *sink = nullptr, ReplyDecoder *decoder = nullptr);
+
+  // The sink / decoder of the request which the next response will be
+  // delivered to, or nullptr. Must only be called from the thread consuming
+  // responses.
+  BulkSink* getBulkSinkForNextResponse();
+  ReplyDecoder* getReplyDecoderForNextResponse();
+
+  //----------------------------------------------------------------------------
+  // Inside a MULTI block, the next response is an OK or QUEUED which only
+  // gets validated and dropped: Return it, so the reader can skip it without
+  // building it, then call skippedResponse. nullptr if the next response is
+  // to be consumed in full. Same threading rules as above.
+  //----------------------------------------------------------------------------
+  const char* getSkippableStatusForNextResponse(size_t &len);
+  void skippedResponse();
+
+  //----------------------------------------------------------------------------
+  // Is the next response for a fire-and-forget request, staged without any
+  // callback? The reader may then skip it without building it, unless it's
+  // an error, and call skippedFireAndForget. Same threading rules as above.
+  //----------------------------------------------------------------------------
+  bool nextResponseIsFireAndForget();
+  void skippedFireAndForget();
 
 #if HAVE_FOLLY == 1
   folly::Future<redisReplyPtr> follyStage(EncodedRequest &&req, size_t multiSize = 0u);
+  folly::SemiFuture<redisReplyPtr> follySemiStage(EncodedRequest &&req, size_t multiSize = 0u);
 #endif
 
   void setBlockingMode(bool value);
   StagedRequest* getNextToWrite();
 
-  // Wipe out pending request queue - return size of queue
+  // Batch form of getNextToWrite: Blocks until at least one request is
+  // available, then fills the given vector with consecutive requests up to
+  // the given count and byte budget. Returns number of requests in batch,
+  // 0 only if blocking mode was turned off.
+  size_t getNextToWrite(std::vector<StagedRequest*> &batch, size_t maxCount, size_t maxBytes);
+
+  // Sequence number of the next user request getNextToWrite would consider.
+  // Writer thread only.
+  int64_t getNextToWriteSeq() const {
+    return nextToWriteIterator.seq();
+  }
+
+  // Keep user requests from seq onwards alive even once acknowledged, while
+  // the kernel may still read from them - see RequestQueue.
+  void pinRequests(int64_t seq) {
+    requestQueue.pin(seq);
+  }
+
+  void unpinRequests() {
+    requestQueue.unpin();
+  }
+
+  // Wipe out pending request queue - return number of purged requests
   size_t clearAllPending();
 
 private:
@@ -73,26 +259,120 @@ private:
   MessageListener *listener = nullptr;
   bool exclusivePubsub;
 
-  void acknowledgePending(redisReplyPtr &&reply);
+  StagedRequest* getRequestForNextResponse();
+  void skipUnwritten();
+  bool parseMessage(redisReplyPtr &&reply, Message &out);
+  MessageDecoder messageDecoder;
+  void acknowledgePending(redisReplyPtr &&reply, bool skipped = false);
+
+  // clearAllPending: Unlink the next request, and collect how to complete it
+  // with a null reply - right away on the purging thread, or through the
+  // callback executor. Nothing gets completed here.
+  void purgePending(std::vector<PendingCallback> &immediate,
+    std::vector<PendingCallback> &deferred, std::chrono::steady_clock::time_point now);
+
+  // The only cost of tracing on the staging path while disabled is the
+  // branch on tracer. Returns the trace ID to store in the request.
+  uint64_t traceStart(const EncodedRequest &req) {
+    if(!tracer) return 0u;
+    return startTrace(req);
+  }
+
+  uint64_t startTrace(const EncodedRequest &req);
+  std::unique_ptr<RequestTrace> traceAcknowledged(StagedRequest &item,
+    const redisReplyPtr &reply, std::chrono::steady_clock::time_point now);
+
+  RequestTracer *tracer = nullptr;
+  std::atomic<uint64_t> nextTraceId {1};
+
+  // Only set if write combining is enabled
+  std::unique_ptr<WriteCombiner> writeCombiner;
+  std::vector<int> cpuAffinity;
+
+  // Only set if push messages are offloaded - a single thread, so that
+  // messages keep their order.
+  std::unique_ptr<CallbackExecutorThread> pushExecutor;
+  bool stageCombined(ReplyCallback &&callback, EncodedRequest &&req);
+
+  bool combines(const EncodedRequest &req) const {
+    return writeCombiner && !WriteCombiner::combiningKey(req).empty();
+  }
+
+  // Nanoseconds of steady_clock, used by getOldestPendingAge. lastProgressAt
+  // is refreshed on each acknowledgement; reading the acknowledged request
+  // itself from another thread would race with its removal.
+  std::atomic<int64_t> lastProgressAt {0};
+  std::atomic<int64_t> lastIdleAt {0};
   void discardPending();
+
+  //----------------------------------------------------------------------------
+  // Replay pacing: While active, at most replayWindow requests may be written
+  // past the last acknowledged one. Each acknowledgement grows the window by
+  // one, and pacing ends once it reaches the maximum, or the writer is past
+  // the backlog pending at reconnection. Writers block on pacingCv while the
+  // window is full, unless in non-blocking mode.
+  //----------------------------------------------------------------------------
+  ReplayPacing replayPacing = ReplayPacing::Unpaced();
+  std::atomic<bool> pacingActive {false};
+  std::mutex pacingMtx;
+  std::condition_variable pacingCv;
+  bool pacingBlocks = false;
+  int64_t replayWindow = 0;
+  int64_t replayEnd = 0;
+  int64_t pacedAcknowledged = 0;
+  size_t replayAllowance(bool wait);
+  size_t pacedLimit(size_t current, size_t maxCount);
   size_t ignoredResponses = 0u;
 
   WaitableQueue<StagedRequest, 15> handshakeRequests;
   decltype(handshakeRequests)::Iterator handshakeIterator;
 
   std::atomic<bool> inHandshake {true};
+
+  // Readiness, see waitUntilReady: Set once the handshake completes, cleared
+  // on reconnection.
+  std::mutex readyMtx;
+  std::condition_variable readyCv;
+  bool ready = false;
+  void setReady(bool value);
+
+  // Set by the writer once the first handshake request goes out, in
+  // nanoseconds of steady_clock - 0 until then.
+  std::atomic<int64_t> handshakeStartedAt {0};
+  ShardedCounter handshakes;
+  ShardedCounter fireAndForgetErrors;
+  ShardedCounter handshakeTime;
+
+  //----------------------------------------------------------------------------
+  // Optimistic pipelining: pipelineBehindHandshake tells whether user
+  // requests may follow the last queued handshake request, handshakeFlushed
+  // whether the writer has moved on to them.
+  //----------------------------------------------------------------------------
+  bool optimisticHandshake = false;
+  std::atomic<bool> pipelineBehindHandshake {false};
+  std::atomic<bool> handshakeFlushed {false};
+  void queueHandshakeRequest();
   RequestQueue::Iterator nextToWriteIterator;
   RequestQueue::Iterator nextToAcknowledgeIterator;
   RequestQueue requestQueue;
 
-  FutureHandler futureHandler;
+  //----------------------------------------------------------------------------
+  // Request deadlines, expired by deadlineThread - started along with the
+  // first request carrying a deadline. Expired callbacks run on it as well.
+  //----------------------------------------------------------------------------
+  TimerWheel deadlines;
+  std::once_flag deadlineThreadStarted;
+  AssistedThread deadlineThread;
+  void expireDeadlines(ThreadAssistant &assistant);
 
-#if HAVE_FOLLY == 1
-  FollyFutureHandler follyFutureHandler;
-#endif
+  // Latency of requests, per stage - callbackLatency is fed by cbExecutor,
+  // so it must outlive it.
+  LatencyHistogram queueingLatency;
+  LatencyHistogram networkLatency;
+  LatencyHistogram callbackLatency;
+
+  ConnectionCounters counters;
 
-  // NOTE: cbExecutor must be destroyed before FutureHandler, so it has to be
-  // below it in the member variables definition.
   CallbackExecutorThread cbExecutor;
 
   std::mutex mtx;
@@ -29,31 +29,85 @@
 
 namespace qclient {
 
-void EncodedRequest::initFromChunks(size_t nchunks, const char** chunks, const size_t* sizes) {
-  // First, format all integers we're going to need.. fmt::format_int
-  // keeps its buffers on the stack.
-
-  fmt::format_int nchunksFormatted(nchunks);
+//------------------------------------------------------------------------------
+// Encode the given chunks after a header which has been formatted already -
+// either just "*<nchunks>\r\n", or the pre-encoded prefix of a Command.
+//------------------------------------------------------------------------------
+void EncodedRequest::encodeAfter(const char *header, size_t headerLen,
+  size_t nchunks, const char** chunks, const size_t* sizes, Allocator alloc,
+  void *ctx) {
 
-  // Abuse a stack memory region to store fmt::format_int's. I found no better
-  // way to do this, while making sure all variables are kept on the stack.
-  // We use placement new to construct the objects directly in a custom memory
-  // region.
-  char memoryRegion[sizeof(fmt::format_int) * nchunks];
+  size_t required = headerLen;
   for(size_t i = 0; i < nchunks; i++) {
-    new (memoryRegion + (i*sizeof(fmt::format_int))) fmt::format_int(sizes[i]);
+    required += chunkLength(sizes[i]);
   }
 
-  // Calculate the required size of our buffer.
-  length = 0;
+  char* buff = alloc(ctx, required);
+  memcpy(buff, header, headerLen);
+  size_t pos = headerLen;
+
   for(size_t i = 0; i < nchunks; i++) {
-    length += sizes[i] + (((fmt::format_int*) memoryRegion)[i]).size();
-    length += 1 + 2 + 2;
+    pos = writeChunk(buff, pos, chunks[i], sizes[i]);
   }
+}
+
+void EncodedRequest::encode(size_t nchunks, const char** chunks, const size_t* sizes,
+  Allocator alloc, void *ctx) {
+
+  char header[32];
+  size_t headerLen = writeHeader(header, nchunks);
+  encodeAfter(header, headerLen, nchunks, chunks, sizes, alloc, ctx);
+}
+
+void EncodedRequest::initFromChunks(size_t nchunks, const char** chunks, const size_t* sizes) {
+  encode(nchunks, chunks, sizes, [](void *ctx, size_t len) {
+    return static_cast<EncodedRequest*>(ctx)->allocate(len);
+  }, this);
+}
+
+EncodedRequest::EncodedRequest(size_t nchunks, const char** chunks, const size_t* sizes) {
+  initFromChunks(nchunks, chunks, sizes);
+}
 
-  length += nchunksFormatted.size() + 3;
+EncodedRequest EncodedRequest::makeWithPrefix(const char *prefix, size_t prefixLen,
+  size_t nchunks, const char** chunks, const size_t* sizes) {
+
+  EncodedRequest req;
+  encodeAfter(prefix, prefixLen, nchunks, chunks, sizes, [](void *ctx, size_t len) {
+    return static_cast<EncodedRequest*>(ctx)->allocate(len);
+  }, &req);
+
+  return req;
+}
+
+//------------------------------------------------------------------------------
+// Encode the framing into an owned buffer, copying small arguments along, and
+// reference the large ones.
+//------------------------------------------------------------------------------
+void EncodedRequest::initZeroCopy(const std::vector<const std::string*> &args,
+  std::vector<std::shared_ptr<const std::string>> &&owners) {
+
+  fmt::format_int nchunksFormatted(args.size());
+
+  size_t framingLen = 1 + nchunksFormatted.size() + 2;
+  for(size_t i = 0; i < args.size(); i++) {
+    framingLen += 1 + fmt::format_int(args[i]->size()).size() + 2 + 2;
+    if(args[i]->size() < kZeroCopyThreshold) {
+      framingLen += args[i]->size();
+    }
+  }
+
+  //----------------------------------------------------------------------------
+  // Framing must be heap-allocated, never inline: Segments point into it.
+  //----------------------------------------------------------------------------
+  heapBuffer.reset((char*) malloc(framingLen));
+  char *buff = heapBuffer.get();
+
+  borrowed.reset(new BorrowedParts());
+  AllocationAccounting::record(AllocationCategory::kEncoding, framingLen);
+  AllocationAccounting::record(AllocationCategory::kEncoding, sizeof(BorrowedParts));
+  borrowed->payloads = std::move(owners);
 
-  char* buff = (char*) malloc(length);
   buff[0] = '*';
   memcpy(buff+1, nchunksFormatted.data(), nchunksFormatted.size());
 
@@ -61,28 +115,109 @@ void EncodedRequest::initFromChunks(size_t nchunks, const char** chunks, const s
   buff[pos++] = '\r';
   buff[pos++] = '\n';
 
-  for(size_t i = 0; i < nchunks; i++) {
-    buff[pos++] = '$';
+  size_t segmentStart = 0;
+  length = 0;
+
+  for(size_t i = 0; i < args.size(); i++) {
+    const std::string &arg = *args[i];
+    fmt::format_int formatted(arg.size());
 
-    fmt::format_int *formatted = reinterpret_cast<fmt::format_int*>(&memoryRegion[sizeof(fmt::format_int)*i]);
-    memcpy(buff+pos, formatted->data(), formatted->size());
-    pos += formatted->size();
+    buff[pos++] = '$';
+    memcpy(buff+pos, formatted.data(), formatted.size());
+    pos += formatted.size();
 
     buff[pos++] = '\r';
     buff[pos++] = '\n';
 
-    memcpy(buff+pos, chunks[i], sizes[i]);
-    pos += sizes[i];
+    if(arg.size() < kZeroCopyThreshold) {
+      memcpy(buff+pos, arg.data(), arg.size());
+      pos += arg.size();
+    }
+    else {
+      borrowed->segments.push_back(Segment { buff + segmentStart, pos - segmentStart });
+      borrowed->segments.push_back(Segment { arg.data(), arg.size() });
+      length += arg.size();
+      segmentStart = pos;
+    }
 
     buff[pos++] = '\r';
     buff[pos++] = '\n';
   }
 
-  buffer.reset(buff);
+  borrowed->segments.push_back(Segment { buff + segmentStart, pos - segmentStart });
+  length += framingLen;
 }
 
-EncodedRequest::EncodedRequest(size_t nchunks, const char** chunks, const size_t* sizes) {
-  initFromChunks(nchunks, chunks, sizes);
+EncodedRequest EncodedRequest::makeZeroCopy(std::vector<std::string> &&args) {
+  std::vector<const std::string*> pointers;
+  std::vector<std::shared_ptr<const std::string>> owners;
+
+  std::vector<const char*> cstr;
+  std::vector<size_t> sizes;
+
+  for(size_t i = 0; i < args.size(); i++) {
+    if(args[i].size() >= kZeroCopyThreshold) {
+      owners.emplace_back(std::make_shared<const std::string>(std::move(args[i])));
+      pointers.emplace_back(owners.back().get());
+    }
+    else {
+      pointers.emplace_back(&args[i]);
+    }
+
+    cstr.emplace_back(pointers.back()->data());
+    sizes.emplace_back(pointers.back()->size());
+  }
+
+  //----------------------------------------------------------------------------
+  // Nothing large enough to be worth it, use a plain contiguous buffer.
+  //----------------------------------------------------------------------------
+  if(owners.empty()) {
+    return EncodedRequest(cstr.size(), cstr.data(), sizes.data());
+  }
+
+  EncodedRequest req;
+  req.initZeroCopy(pointers, std::move(owners));
+  return req;
+}
+
+EncodedRequest EncodedRequest::makeZeroCopy(const std::vector<std::shared_ptr<const std::string>> &args) {
+  std::vector<const std::string*> pointers;
+  std::vector<std::shared_ptr<const std::string>> owners;
+
+  for(size_t i = 0; i < args.size(); i++) {
+    pointers.emplace_back(args[i].get());
+    if(args[i]->size() >= kZeroCopyThreshold) {
+      owners.emplace_back(args[i]);
+    }
+  }
+
+  if(owners.empty()) {
+    std::vector<const char*> cstr;
+    std::vector<size_t> sizes;
+
+    for(size_t i = 0; i < pointers.size(); i++) {
+      cstr.emplace_back(pointers[i]->data());
+      sizes.emplace_back(pointers[i]->size());
+    }
+
+    return EncodedRequest(cstr.size(), cstr.data(), sizes.data());
+  }
+
+  EncodedRequest req;
+  req.initZeroCopy(pointers, std::move(owners));
+  return req;
+}
+
+std::string EncodedRequest::toString() const {
+  std::string ret;
+  ret.reserve(length);
+
+  for(size_t i = 0; i < getSegmentCount(); i++) {
+    Segment segment = getSegment(i);
+    ret.append(segment.data, segment.len);
+  }
+
+  return ret;
 }
 
 EncodedRequest EncodedRequest::fuseIntoBlock(const std::deque<EncodedRequest> &block) {
@@ -91,16 +226,19 @@ EncodedRequest EncodedRequest::fuseIntoBlock(const std::deque<EncodedRequest> &b
     fusedSize += block[i].getLen();
   }
 
-  char* buff = (char*) malloc(fusedSize);
+  EncodedRequest fused;
+  char* buff = fused.allocate(fusedSize);
 
   size_t pos = 0;
   for(size_t i = 0; i < block.size(); i++) {
-    size_t localSize = block[i].getLen();
-    memcpy(buff+pos, block[i].getBuffer(), localSize);
-    pos += localSize;
+    for(size_t j = 0; j < block[i].getSegmentCount(); j++) {
+      Segment segment = block[i].getSegment(j);
+      memcpy(buff+pos, segment.data, segment.len);
+      pos += segment.len;
+    }
   }
 
-  return EncodedRequest(buff, fusedSize);
+  return fused;
 }
 
 EncodedRequest EncodedRequest::fuseIntoBlockAndSurround(std::deque<EncodedRequest> &&block) {
@@ -131,11 +269,11 @@ std::string escapeNonPrintable(const std::string &str) {
 }
 
 std::string EncodedRequest::toPrintableString() const {
-  if(!buffer) {
+  if(!heapBuffer && length == 0) {
     return "!!!uninitialized!!!";
   }
 
-  return escapeNonPrintable(std::string(buffer.get(), length));
+  return escapeNonPrintable(toString());
 }
 
 }
\ No newline at end of file
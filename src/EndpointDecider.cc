@@ -22,6 +22,8 @@
  ************************************************************************/
 
 #include "EndpointDecider.hh"
+#include "LeaderHints.hh"
+#include "qclient/network/LatencyProber.hh"
 #include "qclient/Status.hh"
 #include "qclient/network/HostResolver.hh"
 #include "qclient/Logger.hh"
@@ -34,8 +36,10 @@ namespace qclient {
 // contact different clusters when issued a redirection, however, outside of
 // the original list.
 //----------------------------------------------------------------------------
-EndpointDecider::EndpointDecider(Logger *log, HostResolver *resolv, const Members &memb)
-: logger(log), resolver(resolv), members(memb) {}
+EndpointDecider::EndpointDecider(Logger *log, HostResolver *resolv, const Members &memb,
+  LeaderHints *hints, LatencyProber *prober) : logger(log), resolver(resolv),
+  leaderHints(hints), latencyProber(prober), members(memb),
+  memberOrder(memb.getEndpoints()) {}
 
 //------------------------------------------------------------------------------
 // We were just notified of a redirection.
@@ -43,6 +47,56 @@ EndpointDecider::EndpointDecider(Logger *log, HostResolver *resolv, const Member
 void EndpointDecider::registerRedirection(const Endpoint &redir) {
   resolvedEndpoints.clear();
   redirection = redir;
+
+  if(leaderHints) {
+    hintInFlight = {};
+    leaderHints->set(members, redir);
+  }
+}
+
+//------------------------------------------------------------------------------
+// The connection towards the given endpoint works, and did not redirect us.
+//------------------------------------------------------------------------------
+void EndpointDecider::registerConnectionSuccess(const Endpoint &target) {
+  if(leaderHints) {
+    hintInFlight = {};
+    leaderHints->set(members, target);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Take the leader hint, if any
+//------------------------------------------------------------------------------
+bool EndpointDecider::takeLeaderHint(Endpoint &hint) {
+  if(!leaderHints) {
+    return false;
+  }
+
+  if(!hintInFlight.empty()) {
+    leaderHints->invalidate(members, hintInFlight);
+    hintInFlight = {};
+    return false;
+  }
+
+  if(!leaderHints->get(members, hint)) {
+    return false;
+  }
+
+  hintInFlight = hint;
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Next member, round-robin
+//------------------------------------------------------------------------------
+Endpoint EndpointDecider::nextMemberEndpoint() {
+  if(latencyProber && nextMember == 0) {
+    memberOrder = latencyProber->rank(members.getEndpoints());
+  }
+
+  Endpoint retval = memberOrder[nextMember];
+  nextMember = (nextMember + 1) % members.size();
+  return retval;
 }
 
 //------------------------------------------------------------------------------
@@ -58,9 +112,12 @@ Endpoint EndpointDecider::getNext() {
     return retval;
   }
 
-  Endpoint retval = members.getEndpoints()[nextMember];
-  nextMember = (nextMember + 1) % members.size();
-  return retval;
+  Endpoint hint;
+  if(takeLeaderHint(hint)) {
+    return hint;
+  }
+
+  return nextMemberEndpoint();
 }
 
 //------------------------------------------------------------------------------
@@ -113,6 +170,93 @@ bool EndpointDecider::getNextEndpoint(ServiceEndpoint &resolved) {
   return false;
 }
 
+//------------------------------------------------------------------------------
+// Alternate between address families, keeping the order within each.
+//------------------------------------------------------------------------------
+static std::vector<ServiceEndpoint> interleaveFamilies(const std::vector<ServiceEndpoint> &endpoints) {
+  if(endpoints.empty()) {
+    return endpoints;
+  }
+
+  ProtocolType first = endpoints[0].getProtocolType();
+  std::vector<ServiceEndpoint> primary, secondary;
+
+  for(const ServiceEndpoint &endpoint : endpoints) {
+    if(endpoint.getProtocolType() == first) {
+      primary.emplace_back(endpoint);
+    }
+    else {
+      secondary.emplace_back(endpoint);
+    }
+  }
+
+  std::vector<ServiceEndpoint> retval;
+  for(size_t i = 0; i < std::max(primary.size(), secondary.size()); i++) {
+    if(i < primary.size()) retval.emplace_back(primary[i]);
+    if(i < secondary.size()) retval.emplace_back(secondary[i]);
+  }
+
+  return retval;
+}
+
+//------------------------------------------------------------------------------
+// Get every service endpoint worth trying right now
+//------------------------------------------------------------------------------
+bool EndpointDecider::getAllEndpoints(std::vector<ServiceEndpoint> &out) {
+  out.clear();
+  bool redirected = !redirection.empty();
+  std::vector<Endpoint> targets;
+
+  if(redirected) {
+    targets.emplace_back(getNext());
+  }
+  else {
+    //--------------------------------------------------------------------------
+    // Leader hint goes first, without trying it twice
+    //--------------------------------------------------------------------------
+    resolvedEndpoints.clear();
+    Endpoint hint;
+    bool hinted = takeLeaderHint(hint);
+
+    if(hinted) {
+      targets.emplace_back(hint);
+    }
+
+    for(size_t i = 0; i < members.size(); i++) {
+      Endpoint member = nextMemberEndpoint();
+      if(!hinted || !(member == hint)) {
+        targets.emplace_back(member);
+      }
+    }
+  }
+
+  for(const Endpoint &endpoint : targets) {
+    Status st;
+    std::vector<ServiceEndpoint> resolved = resolver->resolve(endpoint.getHost(), endpoint.getPort(), st);
+
+    if(!st.ok() || resolved.empty()) {
+      QCLIENT_LOG(logger, LogLevel::kWarn, "DNS resolution of " << endpoint.toString() << " failed: " << st.toString());
+    }
+
+    out.insert(out.end(), resolved.begin(), resolved.end());
+  }
+
+  //----------------------------------------------------------------------------
+  // Every member gets tried in one go - unless this was a redirection
+  //----------------------------------------------------------------------------
+  if(!redirected) {
+    fullCircle = true;
+  }
+
+  if(out.empty()) {
+    QCLIENT_LOG(logger, LogLevel::kError, "Unable to resolve any endpoints, possible trouble with DNS");
+    return false;
+  }
+
+  out = interleaveFamilies(out);
+  return true;
+}
+
 //------------------------------------------------------------------------------
 // Have we made a full circle yet? That is, have we tried all possible
 // ServiceEndpoints at least once? Including possible redirects.
@@ -34,6 +34,8 @@ namespace qclient {
 
 class HostResolver;
 class ServiceEndpoint;
+class LeaderHints;
+class LatencyProber;
 
 //------------------------------------------------------------------------------
 // In face of having multiple cluster members, each cluster member entry
@@ -44,6 +46,13 @@ class ServiceEndpoint;
 // an IP failed.
 //
 // This class gives an answer on where to connect to next.
+//
+// If given LeaderHints, the leader last seen by anyone in the process is
+// tried before going through the members in order.
+//
+// If given a LatencyProber, each round through the members goes fastest
+// first, as measured at the start of the round, instead of in configured
+// order.
 //------------------------------------------------------------------------------
 class EndpointDecider {
 public:
@@ -52,13 +61,19 @@ public:
   // contact different clusters when issued a redirection, however, outside of
   // the original list.
   //----------------------------------------------------------------------------
-  EndpointDecider(Logger *log, HostResolver *resolver, const Members &memb);
+  EndpointDecider(Logger *log, HostResolver *resolver, const Members &memb,
+    LeaderHints *hints = nullptr, LatencyProber *prober = nullptr);
 
   //----------------------------------------------------------------------------
   // We were just notified of a redirection.
   //----------------------------------------------------------------------------
   void registerRedirection(const Endpoint &redir);
 
+  //----------------------------------------------------------------------------
+  // The connection towards the given endpoint works, and did not redirect us.
+  //----------------------------------------------------------------------------
+  void registerConnectionSuccess(const Endpoint &target);
+
   //----------------------------------------------------------------------------
   // The event loop needs to reconnect - which endpoint should we target?
   //
@@ -73,6 +88,17 @@ public:
   //----------------------------------------------------------------------------
   bool getNextEndpoint(ServiceEndpoint &endpoint);
 
+  //----------------------------------------------------------------------------
+  // Get every service endpoint worth trying right now, for connecting in
+  // parallel: Only the redirection target if there's one pending, otherwise
+  // all members, starting from the one getNext would have picked. Address
+  // families are interleaved, as RFC 8305 suggests, so that a broken IPv6
+  // setup doesn't hold up reaching the IPv4 addresses.
+  //
+  // False means all DNS resolution attempts failed.
+  //----------------------------------------------------------------------------
+  bool getAllEndpoints(std::vector<ServiceEndpoint> &out);
+
   //----------------------------------------------------------------------------
   // Have we made a full circle yet? That is, have we tried all possible
   // ServiceEndpoints at least once? Including possible redirects.
@@ -83,19 +109,44 @@ public:
 private:
   Logger *logger;
   HostResolver *resolver;
+  LeaderHints *leaderHints;
+  LatencyProber *latencyProber;
 
   size_t nextMember = 0u;
   bool fullCircle = false;
 
   Members members;
+
+  //----------------------------------------------------------------------------
+  // Order of the current round through the members
+  //----------------------------------------------------------------------------
+  std::vector<Endpoint> memberOrder;
   Endpoint redirection;
 
   std::vector<ServiceEndpoint> resolvedEndpoints;
 
+  //----------------------------------------------------------------------------
+  // The leader hint we last handed out, if we haven't heard back about it.
+  //----------------------------------------------------------------------------
+  Endpoint hintInFlight;
+
   //----------------------------------------------------------------------------
   // Fetch one of the resolved endpoints, return true
   //----------------------------------------------------------------------------
   bool fetchServiceEndpoint(ServiceEndpoint &out);
+
+  //----------------------------------------------------------------------------
+  // Take the leader hint, if any. We're asked for a target again, without
+  // having heard of a successful connection since the last hint: It didn't
+  // work, so drop it for everyone.
+  //----------------------------------------------------------------------------
+  bool takeLeaderHint(Endpoint &hint);
+
+  //----------------------------------------------------------------------------
+  // Next member, round-robin - ranked by latency at the start of each round,
+  // if probing
+  //----------------------------------------------------------------------------
+  Endpoint nextMemberEndpoint();
 };
 
 }
@@ -0,0 +1,413 @@
+//------------------------------------------------------------------------------
+// File: EventLoopGroup.cc
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#include "qclient/EventLoopGroup.hh"
+#include "qclient/AssistedThread.hh"
+#include "qclient/EventFD.hh"
+#include <atomic>
+#include <condition_variable>
+#include <set>
+#include <thread>
+#include <unordered_map>
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+
+#if defined(__linux__)
+#include <sys/epoll.h>
+#define QCLIENT_HAVE_EPOLL 1
+#endif
+
+namespace qclient {
+
+#if QCLIENT_HAVE_EPOLL
+
+//------------------------------------------------------------------------------
+// A single thread of the group, multiplexing any number of handlers.
+//------------------------------------------------------------------------------
+class EventLoop {
+public:
+  using Clock = std::chrono::steady_clock;
+  using Handler = EventLoopGroup::Handler;
+
+  EventLoop() {
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if(epollFd < 0) {
+      std::cerr << "qclient: CRITICAL: could not create epoll instance: " << strerror(errno) << std::endl;
+      std::abort();
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = nullptr;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeupFD.getFD(), &ev);
+
+    thread.reset(&EventLoop::main, this);
+  }
+
+  ~EventLoop() {
+    thread.stop();
+    wakeupFD.notify();
+    thread.join();
+    ::close(epollFd);
+  }
+
+  size_t load() {
+    std::lock_guard<std::mutex> lock(mtx);
+    return handlers.size();
+  }
+
+  void attach(Handler *handler) {
+    std::lock_guard<std::mutex> lock(mtx);
+    handlers[handler];
+  }
+
+  void detach(Handler *handler) {
+    std::unique_lock<std::mutex> lock(mtx);
+
+    auto it = handlers.find(handler);
+    if(it == handlers.end()) return;
+
+    unwatchLocked(it->second);
+    unscheduleLocked(it->second);
+    handlers.erase(it);
+    pendingWakeups.erase(handler);
+
+    if(std::this_thread::get_id() != threadId) {
+      while(running == handler) {
+        runningCV.wait(lock);
+      }
+    }
+  }
+
+  void watch(Handler *handler, int fd, uint32_t events) {
+    std::lock_guard<std::mutex> lock(mtx);
+
+    auto it = handlers.find(handler);
+    if(it == handlers.end()) return;
+
+    Registration &reg = it->second;
+    if(fd < 0) {
+      unwatchLocked(reg);
+      return;
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = 0;
+    if(events & EventLoopGroup::kReadable) ev.events |= EPOLLIN;
+    if(events & EventLoopGroup::kWritable) ev.events |= EPOLLOUT;
+    ev.data.ptr = handler;
+
+    //--------------------------------------------------------------------------
+    // The previous fd may have been closed in the meantime, in which case
+    // the kernel has already dropped it from the epoll set - possibly even
+    // reused the number for the new fd. Fall back to ADD if MOD fails.
+    //--------------------------------------------------------------------------
+    if(reg.fd == fd && epoll_ctl(epollFd, EPOLL_CTL_MOD, fd, &ev) == 0) {
+      return;
+    }
+
+    if(reg.fd != fd) {
+      unwatchLocked(reg);
+    }
+
+    if(epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev) != 0 && errno == EEXIST) {
+      epoll_ctl(epollFd, EPOLL_CTL_MOD, fd, &ev);
+    }
+
+    reg.fd = fd;
+  }
+
+  void scheduleAt(Handler *handler, Clock::time_point deadline) {
+    std::lock_guard<std::mutex> lock(mtx);
+
+    auto it = handlers.find(handler);
+    if(it == handlers.end()) return;
+
+    unscheduleLocked(it->second);
+    it->second.timer = timers.emplace(deadline, handler);
+    it->second.scheduled = true;
+
+    if(std::this_thread::get_id() != threadId) {
+      wakeupFD.notify();
+    }
+  }
+
+  void cancelSchedule(Handler *handler) {
+    std::lock_guard<std::mutex> lock(mtx);
+
+    auto it = handlers.find(handler);
+    if(it == handlers.end()) return;
+    unscheduleLocked(it->second);
+  }
+
+  void wakeup(Handler *handler) {
+    std::lock_guard<std::mutex> lock(mtx);
+    if(handlers.find(handler) == handlers.end()) return;
+
+    pendingWakeups.insert(handler);
+    wakeupFD.notify();
+  }
+
+private:
+  struct Registration {
+    int fd = -1;
+    bool scheduled = false;
+    std::multimap<Clock::time_point, Handler*>::iterator timer;
+  };
+
+  void unwatchLocked(Registration &reg) {
+    if(reg.fd >= 0) {
+      epoll_ctl(epollFd, EPOLL_CTL_DEL, reg.fd, nullptr);
+      reg.fd = -1;
+    }
+  }
+
+  void unscheduleLocked(Registration &reg) {
+    if(reg.scheduled) {
+      timers.erase(reg.timer);
+      reg.scheduled = false;
+    }
+  }
+
+  //----------------------------------------------------------------------------
+  // Milliseconds until the earliest deadline, rounded up, or -1 if none.
+  //----------------------------------------------------------------------------
+  int computeTimeout() {
+    std::lock_guard<std::mutex> lock(mtx);
+    if(!pendingWakeups.empty()) return 0;
+    if(timers.empty()) return -1;
+
+    Clock::time_point now = Clock::now();
+    Clock::time_point earliest = timers.begin()->first;
+    if(earliest <= now) return 0;
+
+    int64_t micros = std::chrono::duration_cast<std::chrono::microseconds>(earliest - now).count();
+    return (micros + 999) / 1000;
+  }
+
+  void dispatch(Handler *handler) {
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      if(handlers.find(handler) == handlers.end()) return;
+      running = handler;
+    }
+
+    handler->onEvent();
+
+    std::lock_guard<std::mutex> lock(mtx);
+    running = nullptr;
+    runningCV.notify_all();
+  }
+
+  void main(ThreadAssistant &assistant) {
+    signal(SIGPIPE, SIG_IGN);
+    threadId = std::this_thread::get_id();
+
+    const int kMaxEvents = 64;
+    struct epoll_event events[kMaxEvents];
+    std::vector<Handler*> ready;
+
+    while(!assistant.terminationRequested()) {
+      int nfds = epoll_wait(epollFd, events, kMaxEvents, computeTimeout());
+      if(nfds < 0 && errno != EINTR) {
+        std::cerr << "qclient: error during epoll_wait in EventLoop: " << strerror(errno) << std::endl;
+      }
+
+      ready.clear();
+      for(int i = 0; i < nfds; i++) {
+        if(events[i].data.ptr == nullptr) {
+          wakeupFD.clear();
+          continue;
+        }
+
+        ready.push_back((Handler*) events[i].data.ptr);
+      }
+
+      {
+        std::lock_guard<std::mutex> lock(mtx);
+        ready.insert(ready.end(), pendingWakeups.begin(), pendingWakeups.end());
+        pendingWakeups.clear();
+
+        Clock::time_point now = Clock::now();
+        while(!timers.empty() && timers.begin()->first <= now) {
+          Handler *handler = timers.begin()->second;
+          handlers[handler].scheduled = false;
+          timers.erase(timers.begin());
+          ready.push_back(handler);
+        }
+      }
+
+      //------------------------------------------------------------------------
+      // The same handler may show up several times - dispatching twice is
+      // harmless, handlers tolerate spurious calls.
+      //------------------------------------------------------------------------
+      for(Handler *handler : ready) {
+        dispatch(handler);
+      }
+    }
+  }
+
+  int epollFd = -1;
+  EventFD wakeupFD;
+  std::atomic<std::thread::id> threadId;
+
+  std::mutex mtx;
+  std::condition_variable runningCV;
+  Handler *running = nullptr;
+
+  std::unordered_map<Handler*, Registration> handlers;
+  std::multimap<Clock::time_point, Handler*> timers;
+  std::set<Handler*> pendingWakeups;
+
+  AssistedThread thread;
+};
+
+bool EventLoopGroup::supported() {
+  return true;
+}
+
+#else
+
+//------------------------------------------------------------------------------
+// No epoll: The group stays empty, and QClient falls back to running a
+// dedicated thread.
+//------------------------------------------------------------------------------
+class EventLoop {
+public:
+  using Handler = EventLoopGroup::Handler;
+
+  size_t load() { return 0; }
+  void attach(Handler *handler) {}
+  void detach(Handler *handler) {}
+  void watch(Handler *handler, int fd, uint32_t events) {}
+  void scheduleAt(Handler *handler, std::chrono::steady_clock::time_point deadline) {}
+  void cancelSchedule(Handler *handler) {}
+  void wakeup(Handler *handler) {}
+};
+
+bool EventLoopGroup::supported() {
+  return false;
+}
+
+#endif
+
+//------------------------------------------------------------------------------
+// Constructor, spawns the given number of threads.
+//------------------------------------------------------------------------------
+EventLoopGroup::EventLoopGroup(size_t threads) {
+  if(!supported()) return;
+  if(threads == 0) threads = 1;
+
+  for(size_t i = 0; i < threads; i++) {
+    loops.emplace_back(new EventLoop());
+  }
+}
+
+//------------------------------------------------------------------------------
+// Destructor
+//------------------------------------------------------------------------------
+EventLoopGroup::~EventLoopGroup() {}
+
+//------------------------------------------------------------------------------
+// Number of threads in the group
+//------------------------------------------------------------------------------
+size_t EventLoopGroup::size() const {
+  return loops.size();
+}
+
+//------------------------------------------------------------------------------
+// Attach handler to the least loaded thread.
+//------------------------------------------------------------------------------
+void EventLoopGroup::attach(Handler *handler) {
+  if(loops.empty()) return;
+
+  EventLoop *target = loops[0].get();
+  size_t targetLoad = target->load();
+
+  for(size_t i = 1; i < loops.size(); i++) {
+    size_t load = loops[i]->load();
+    if(load < targetLoad) {
+      target = loops[i].get();
+      targetLoad = load;
+    }
+  }
+
+  target->attach(handler);
+
+  std::lock_guard<std::mutex> lock(mtx);
+  assignments[handler] = target;
+}
+
+//------------------------------------------------------------------------------
+// Detach handler.
+//------------------------------------------------------------------------------
+void EventLoopGroup::detach(Handler *handler) {
+  EventLoop *loop = nullptr;
+
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    auto it = assignments.find(handler);
+    if(it == assignments.end()) return;
+
+    loop = it->second;
+    assignments.erase(it);
+  }
+
+  loop->detach(handler);
+}
+
+//------------------------------------------------------------------------------
+// Find the loop a handler is assigned to
+//------------------------------------------------------------------------------
+EventLoop* EventLoopGroup::findLoop(Handler *handler) {
+  std::lock_guard<std::mutex> lock(mtx);
+  auto it = assignments.find(handler);
+  if(it == assignments.end()) return nullptr;
+  return it->second;
+}
+
+void EventLoopGroup::watch(Handler *handler, int fd, uint32_t events) {
+  EventLoop *loop = findLoop(handler);
+  if(loop) loop->watch(handler, fd, events);
+}
+
+void EventLoopGroup::scheduleAt(Handler *handler, std::chrono::steady_clock::time_point deadline) {
+  EventLoop *loop = findLoop(handler);
+  if(loop) loop->scheduleAt(handler, deadline);
+}
+
+void EventLoopGroup::cancelSchedule(Handler *handler) {
+  EventLoop *loop = findLoop(handler);
+  if(loop) loop->cancelSchedule(handler);
+}
+
+void EventLoopGroup::wakeup(Handler *handler) {
+  EventLoop *loop = findLoop(handler);
+  if(loop) loop->wakeup(handler);
+}
+
+}
@@ -23,6 +23,7 @@
 
 #include "qclient/FaultInjector.hh"
 #include "qclient/QClient.hh"
+#include "network/LinkShaper.hh"
 
 namespace qclient {
 
@@ -31,6 +32,11 @@ namespace qclient {
 //------------------------------------------------------------------------------
 FaultInjector::FaultInjector(QClient &q) : qcl(q) {}
 
+//------------------------------------------------------------------------------
+// Destructor
+//------------------------------------------------------------------------------
+FaultInjector::~FaultInjector() {}
+
 //------------------------------------------------------------------------------
 // Enforce total blackout
 //------------------------------------------------------------------------------
@@ -97,4 +103,57 @@ bool FaultInjector::hasPartition(const Endpoint &endpoint) {
   return false;
 }
 
+//------------------------------------------------------------------------------
+// Emulate the given link conditions towards this endpoint
+//------------------------------------------------------------------------------
+void FaultInjector::shapeLink(const Endpoint &endpoint, const LinkShaping &shaping) {
+  std::lock_guard<std::mutex> lock(mtx);
+
+  auto it = shapers.find(endpoint);
+  if(it != shapers.end()) {
+    it->second->configure(shaping);
+    return;
+  }
+
+  shapers.emplace(endpoint, std::unique_ptr<LinkShaper>(new LinkShaper(shaping)));
+  qcl.notifyFaultInjectionsUpdated();
+}
+
+//------------------------------------------------------------------------------
+// Back to a clean link towards this endpoint
+//------------------------------------------------------------------------------
+void FaultInjector::unshapeLink(const Endpoint &endpoint) {
+  std::lock_guard<std::mutex> lock(mtx);
+
+  auto it = shapers.find(endpoint);
+  if(it != shapers.end()) {
+    it->second->configure(LinkShaping());
+  }
+}
+
+//------------------------------------------------------------------------------
+// Back to clean links towards all endpoints
+//------------------------------------------------------------------------------
+void FaultInjector::unshapeAllLinks() {
+  std::lock_guard<std::mutex> lock(mtx);
+
+  for(auto it = shapers.begin(); it != shapers.end(); it++) {
+    it->second->configure(LinkShaping());
+  }
+}
+
+//------------------------------------------------------------------------------
+// The shaper for links towards this endpoint, if any
+//------------------------------------------------------------------------------
+LinkShaper* FaultInjector::getLinkShaper(const Endpoint &endpoint) {
+  std::lock_guard<std::mutex> lock(mtx);
+
+  auto it = shapers.find(endpoint);
+  if(it == shapers.end()) {
+    return nullptr;
+  }
+
+  return it->second.get();
+}
+
 }
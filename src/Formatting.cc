@@ -23,106 +23,164 @@
 
 #include "qclient/Reply.hh"
 #include "qclient/Formatting.hh"
-#include <sstream>
 #include <memory>
 
-#define SSTR(message) static_cast<std::ostringstream&>(std::ostringstream().flush() << message).str()
-
 namespace {
-std::string escapeNonPrintable(const std::string &str) {
-  std::stringstream ss;
 
-  for(size_t i = 0; i < str.size(); i++) {
+//------------------------------------------------------------------------------
+// Append str to out, escaping anything non-printable
+//------------------------------------------------------------------------------
+void appendEscaped(std::string &out, const char *str, size_t len) {
+  for(size_t i = 0; i < len; i++) {
     if(isprint(str[i])) {
-      ss << str[i];
+      out.push_back(str[i]);
     }
     else if(str[i] == '\0') {
-      ss << "\\x00";
+      out.append("\\x00");
     }
     else {
       char buff[16];
-      snprintf(buff, 16, "\\x%02X", (unsigned char) str[i]);
-      ss << buff;
+      int written = snprintf(buff, 16, "\\x%02X", (unsigned char) str[i]);
+      out.append(buff, written);
     }
   }
-  return ss.str();
 }
+
+bool isAggregate(const redisReply *reply) {
+  return reply->type == REDIS_REPLY_ARRAY || reply->type == REDIS_REPLY_PUSH ||
+         reply->type == REDIS_REPLY_SET   || reply->type == REDIS_REPLY_MAP  ||
+         reply->type == REDIS_REPLY_ATTR;
 }
 
-namespace qclient {
+//------------------------------------------------------------------------------
+// Describe reply into out - nested aggregates are appended to the same
+// string, rather than built separately and concatenated.
+//------------------------------------------------------------------------------
+void describeInto(std::string &out, const redisReply *const redisReply,
+  const std::string &prefix) {
 
-std::string describeRedisReply(const redisReply *const redisReply, const std::string &prefix) {
   if(!redisReply) {
-    return SSTR(prefix << "nullptr");
+    out.append(prefix);
+    out.append("nullptr");
+    return;
   }
 
-  if(redisReply->type == REDIS_REPLY_NIL) {
-    return SSTR(prefix << "(nil)");
+  switch(redisReply->type) {
+    case REDIS_REPLY_NIL: {
+      out.append(prefix);
+      out.append("(nil)");
+      return;
+    }
+    case REDIS_REPLY_INTEGER: {
+      fmt::format_int formatted(redisReply->integer);
+      out.append(prefix);
+      out.append("(integer) ");
+      out.append(formatted.data(), formatted.size());
+      return;
+    }
+    case REDIS_REPLY_ERROR: {
+      out.append(prefix);
+      out.append("(error) ");
+      appendEscaped(out, redisReply->str, redisReply->len);
+      return;
+    }
+    case REDIS_REPLY_STATUS: {
+      out.append(prefix);
+      appendEscaped(out, redisReply->str, redisReply->len);
+      return;
+    }
+    case REDIS_REPLY_DOUBLE: {
+      out.append(prefix);
+      out.append("(double) ");
+      out.append(redisReply->str, redisReply->len);
+      return;
+    }
+    case REDIS_REPLY_BOOL: {
+      out.append(prefix);
+      out.append(redisReply->integer ? "(true)" : "(false)");
+      return;
+    }
+    case REDIS_REPLY_BIGNUM: {
+      out.append(prefix);
+      out.append("(big number) ");
+      out.append(redisReply->str, redisReply->len);
+      return;
+    }
+    case REDIS_REPLY_STRING:
+    case REDIS_REPLY_VERB: {
+      out.append(prefix);
+      out.push_back('"');
+      appendEscaped(out, redisReply->str, redisReply->len);
+      out.push_back('"');
+      return;
+    }
   }
 
-  if(redisReply->type == REDIS_REPLY_INTEGER) {
-    return SSTR(prefix <<"(integer) " << redisReply->integer);
-  }
+  std::string spacePrefix(prefix.size(), ' ');
+  std::string elementPrefix;
 
-  if(redisReply->type == REDIS_REPLY_ERROR) {
-    return SSTR(prefix << "(error) " << escapeNonPrintable(std::string(redisReply->str, redisReply->len)));
-  }
+  if(redisReply->type == REDIS_REPLY_MAP || redisReply->type == REDIS_REPLY_ATTR) {
+    if(redisReply->elements == 0u) {
+      out.append(prefix);
+      out.append("(empty hash)\n");
+    }
 
-  if(redisReply->type == REDIS_REPLY_STATUS) {
-    return SSTR(prefix << escapeNonPrintable(std::string(redisReply->str, redisReply->len)));
-  }
+    for(size_t i = 0; i+1 < redisReply->elements; i += 2) {
+      fmt::format_int index(i/2+1);
+      elementPrefix = (i == 0 ? prefix : spacePrefix);
+      elementPrefix.append(index.data(), index.size());
+      elementPrefix.append("# ");
 
-  if(redisReply->type == REDIS_REPLY_STRING) {
-    return SSTR(prefix << "\"" <<
-      escapeNonPrintable(std::string(redisReply->str, redisReply->len)) <<
-      "\"");
-  }
+      describeInto(out, redisReply->element[i], elementPrefix);
+      out.append(" => ");
+      describeInto(out, redisReply->element[i+1], "");
 
-  std::string spacePrefix;
-  for(size_t i = 0; i < prefix.size(); i++) {
-    spacePrefix += " ";
-  }
+      if(!isAggregate(redisReply->element[i+1])) {
+        out.push_back('\n');
+      }
+    }
 
-  if(redisReply->type == REDIS_REPLY_ARRAY || redisReply->type == REDIS_REPLY_PUSH) {
-    std::stringstream ss;
+    return;
+  }
 
+  if(redisReply->type == REDIS_REPLY_ARRAY || redisReply->type == REDIS_REPLY_PUSH || redisReply->type == REDIS_REPLY_SET) {
     if(redisReply->elements == 0u) {
-      ss << prefix << "(empty list or set)" << std::endl;
+      out.append(prefix);
+      out.append("(empty list or set)\n");
     }
 
     for(size_t i = 0; i < redisReply->elements; i++) {
-      if(i == 0) {
-        ss << describeRedisReply(redisReply->element[i], SSTR(prefix << i+1 << ") ") );
-      }
-      else {
-        ss << describeRedisReply(redisReply->element[i], SSTR(spacePrefix << i+1 << ") ") );
-      }
+      fmt::format_int index(i+1);
+      elementPrefix = (i == 0 ? prefix : spacePrefix);
+      elementPrefix.append(index.data(), index.size());
+      elementPrefix.append(") ");
+
+      describeInto(out, redisReply->element[i], elementPrefix);
 
-      if(redisReply->element[i]->type != REDIS_REPLY_ARRAY && redisReply->element[i]->type != REDIS_REPLY_PUSH) {
-        ss << std::endl;
+      if(!isAggregate(redisReply->element[i])) {
+        out.push_back('\n');
       }
     }
 
-    return ss.str();
+    return;
   }
 
-  return SSTR(prefix << "!!! unknown reply type !!!");
+  out.append(prefix);
+  out.append("!!! unknown reply type !!!");
 }
 
-std::string describeRedisReply(const redisReplyPtr &redisReply) {
-  return describeRedisReply(redisReply.get(), "");
 }
 
-//------------------------------------------------------------------------------
-// Internal API: Serialize onto a given std::ostringstream.
-// We need this to support efficient serialization of arrays.
-//------------------------------------------------------------------------------
-void Formatting::serializeInternal(std::ostringstream &ss, const std::string &str) {
-  ss << "$" << str.size() << "\r\n" << str << "\r\n";
+namespace qclient {
+
+std::string describeRedisReply(const redisReply *const redisReply, const std::string &prefix) {
+  std::string out;
+  describeInto(out, redisReply, prefix);
+  return out;
 }
 
-void Formatting::serializeInternal(std::ostringstream &ss, int64_t num) {
-  ss << ":" << num << "\r\n";
+std::string describeRedisReply(const redisReplyPtr &redisReply) {
+  return describeRedisReply(redisReply.get(), "");
 }
 
 }
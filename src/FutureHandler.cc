@@ -21,46 +21,26 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
  ************************************************************************/
 
-#include "FutureHandler.hh"
 
+#include "FutureHandler.hh"
+#include "qclient/utils/AllocationAccounting.hh"
 
 namespace qclient {
 
-#if HAVE_FOLLY == 1
-FollyFutureHandler::FollyFutureHandler() {}
-
-FollyFutureHandler::~FollyFutureHandler() {}
-
-folly::Future<redisReplyPtr> FollyFutureHandler::stage() {
-  folly::Promise<redisReplyPtr> prom;
-  folly::Future<redisReplyPtr> retval = prom.getFuture();
+//------------------------------------------------------------------------------
+// The shared state behind each promise is allocated inside the futures
+// library, which doesn't tell its size - account for a rough estimate.
+//------------------------------------------------------------------------------
+static constexpr size_t kSharedStateEstimate = 64 + sizeof(redisReplyPtr);
 
-  promises.emplace_back(std::move(prom));
-  return retval;
+FutureSlot::FutureSlot() {
+  AllocationAccounting::record(AllocationCategory::kFutures, kSharedStateEstimate);
 }
 
-void FollyFutureHandler::handleResponse(redisReplyPtr &&reply) {
-  promises.front().setValue(std::move(reply));
-  promises.pop_front();
+#if HAVE_FOLLY == 1
+FollyFutureSlot::FollyFutureSlot() {
+  AllocationAccounting::record(AllocationCategory::kFutures, kSharedStateEstimate);
 }
-
 #endif
 
-FutureHandler::FutureHandler() {}
-
-FutureHandler::~FutureHandler() {}
-
-std::future<redisReplyPtr> FutureHandler::stage() {
-  std::promise<redisReplyPtr> prom;
-  std::future<redisReplyPtr> retval = prom.get_future();
-
-  promises.emplace_back(std::move(prom));
-  return retval;
-}
-
-void FutureHandler::handleResponse(redisReplyPtr &&reply) {
-  promises.front().set_value(reply);
-  promises.pop_front();
-}
-
 }
@@ -21,11 +21,11 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
  ************************************************************************/
 
+
 #ifndef QCLIENT_FUTURE_HANDLER_H
 #define QCLIENT_FUTURE_HANDLER_H
 
-#include "qclient/QCallback.hh"
-#include "qclient/queueing/ThreadSafeQueue.hh"
+#include "qclient/Reply.hh"
 #include <future>
 
 #if HAVE_FOLLY == 1
@@ -34,30 +34,55 @@
 
 namespace qclient {
 
-#if HAVE_FOLLY == 1
-class FollyFutureHandler : public QCallback {
+//------------------------------------------------------------------------------
+// Result slots of the future-based staging paths. Each is moved into the
+// ReplyCallback of its StagedRequest - it fits inline - so that the promise
+// travels inside the request itself: One queue insertion carries everything,
+// and acknowledging the request fulfills it right there.
+//------------------------------------------------------------------------------
+class FutureSlot {
 public:
-  FollyFutureHandler();
-  virtual ~FollyFutureHandler();
+  FutureSlot();
+
+  std::future<redisReplyPtr> getFuture() {
+    return promise.get_future();
+  }
+
+  void operator()(redisReplyPtr &&reply) {
+    promise.set_value(std::move(reply));
+  }
 
-  folly::Future<redisReplyPtr> stage();
-  virtual void handleResponse(redisReplyPtr &&reply) override;
 private:
-  ThreadSafeQueue<folly::Promise<redisReplyPtr>, 5000> promises;
+  std::promise<redisReplyPtr> promise;
 };
-#endif
 
-class FutureHandler : public QCallback {
+#if HAVE_FOLLY == 1
+class FollyFutureSlot {
 public:
-  FutureHandler();
-  virtual ~FutureHandler();
+  FollyFutureSlot();
+
+  folly::Future<redisReplyPtr> getFuture() {
+    return promise.getFuture();
+  }
 
-  std::future<redisReplyPtr> stage();
-  virtual void handleResponse(redisReplyPtr &&reply) override;
+  //----------------------------------------------------------------------------
+  // With no executor attached to the promise, setValue only schedules
+  // continuations onto whichever executor the caller picked through via(),
+  // so it's cheap - SemiFutures get fulfilled inline on the event loop
+  // thread, saving a hop through the callback executor.
+  //----------------------------------------------------------------------------
+  folly::SemiFuture<redisReplyPtr> getSemiFuture() {
+    return promise.getSemiFuture();
+  }
+
+  void operator()(redisReplyPtr &&reply) {
+    promise.setValue(std::move(reply));
+  }
 
 private:
-  ThreadSafeQueue<std::promise<redisReplyPtr>, 5000> promises;
+  folly::Promise<redisReplyPtr> promise;
 };
+#endif
 
 }
 
@@ -26,6 +26,7 @@
 
 #include <iostream>
 #include "qclient/Handshake.hh"
+#include "qclient/QClient.hh"
 #include "qclient/utils/Macros.hh"
 using namespace qclient;
 
@@ -65,6 +66,13 @@ Handshake::Status AuthHandshake::validateResponse(const redisReplyPtr &reply) {
 //------------------------------------------------------------------------------
 void AuthHandshake::restart() {}
 
+//------------------------------------------------------------------------------
+// AuthHandshake: Single request, pipelinable
+//------------------------------------------------------------------------------
+bool AuthHandshake::pipelinable() const {
+  return true;
+}
+
 //------------------------------------------------------------------------------
 // Create a new handshake object of this type
 //------------------------------------------------------------------------------
@@ -189,6 +197,14 @@ void HmacAuthHandshake::restart() {
   stringToSign.clear();
 }
 
+//------------------------------------------------------------------------------
+// HmacAuthHandshake: Only the signature can be pipelined, the challenge has
+// to be awaited.
+//------------------------------------------------------------------------------
+bool HmacAuthHandshake::pipelinable() const {
+  return receivedChallenge;
+}
+
 //------------------------------------------------------------------------------
 // Create a new handshake object of this type
 //------------------------------------------------------------------------------
@@ -244,6 +260,13 @@ void HandshakeChainer::restart() {
   second->restart();
 }
 
+//------------------------------------------------------------------------------
+// HandshakeChainer: Pipelinable once we're into the second one, and it is
+//------------------------------------------------------------------------------
+bool HandshakeChainer::pipelinable() const {
+  return firstDone && second->pipelinable();
+}
+
 //------------------------------------------------------------------------------
 // Create a new handshake object of this type
 //------------------------------------------------------------------------------
@@ -290,6 +313,13 @@ Handshake::Status PingHandshake::validateResponse(const redisReplyPtr &reply) {
 void PingHandshake::restart() {
 }
 
+//------------------------------------------------------------------------------
+// PingHandshake: Single request, pipelinable
+//------------------------------------------------------------------------------
+bool PingHandshake::pipelinable() const {
+  return true;
+}
+
 //------------------------------------------------------------------------------
 // Create a new handshake object of this type
 //------------------------------------------------------------------------------
@@ -336,6 +366,13 @@ Handshake::Status ActivatePushTypesHandshake::validateResponse(const redisReplyP
 //------------------------------------------------------------------------------
 void ActivatePushTypesHandshake::restart() {}
 
+//------------------------------------------------------------------------------
+// Activate push types handshake: Single request, pipelinable
+//------------------------------------------------------------------------------
+bool ActivatePushTypesHandshake::pipelinable() const {
+  return true;
+}
+
 //------------------------------------------------------------------------------
 // Activate push types handshake: Clone
 //------------------------------------------------------------------------------
@@ -343,6 +380,59 @@ std::unique_ptr<Handshake> ActivatePushTypesHandshake::clone() const {
   return std::unique_ptr<Handshake>(new ActivatePushTypesHandshake());
 }
 
+//------------------------------------------------------------------------------
+// Activate stale reads handshake: Constructor
+//------------------------------------------------------------------------------
+ActivateStaleReadsHandshake::ActivateStaleReadsHandshake() {}
+
+//------------------------------------------------------------------------------
+// Activate stale reads handshake: Destructor
+//------------------------------------------------------------------------------
+ActivateStaleReadsHandshake::~ActivateStaleReadsHandshake() {}
+
+//------------------------------------------------------------------------------
+// Activate stale reads handshake: Provide handshake
+//------------------------------------------------------------------------------
+std::vector<std::string> ActivateStaleReadsHandshake::provideHandshake() {
+  return { "ACTIVATE-STALE-READS" };
+}
+
+//------------------------------------------------------------------------------
+// Activate stale reads handshake: Validate response, expect OK
+//------------------------------------------------------------------------------
+Handshake::Status ActivateStaleReadsHandshake::validateResponse(const redisReplyPtr &reply) {
+  if(reply->type != REDIS_REPLY_STATUS) {
+    std::cerr << "qclient: Received invalid response type in ActivateStaleReadsHandshake" << std::endl;
+    return Status::INVALID;
+  }
+
+  if(std::string(reply->str, reply->len) != "OK") {
+    std::cerr << "qclient: ActivateStaleReadsHandshake received invalid response - " << std::string(reply->str, reply->len) << std::endl;
+    return Status::INVALID;
+  }
+
+  return Status::VALID_COMPLETE;
+}
+
+//------------------------------------------------------------------------------
+// Activate stale reads handshake: Restart
+//------------------------------------------------------------------------------
+void ActivateStaleReadsHandshake::restart() {}
+
+//------------------------------------------------------------------------------
+// Activate stale reads handshake: Single request, pipelinable
+//------------------------------------------------------------------------------
+bool ActivateStaleReadsHandshake::pipelinable() const {
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Activate stale reads handshake: Clone
+//------------------------------------------------------------------------------
+std::unique_ptr<Handshake> ActivateStaleReadsHandshake::clone() const {
+  return std::unique_ptr<Handshake>(new ActivateStaleReadsHandshake());
+}
+
 //------------------------------------------------------------------------------
 // Set client name handshake: Constructor
 //------------------------------------------------------------------------------
@@ -378,7 +468,214 @@ Handshake::Status SetClientNameHandshake::validateResponse(const redisReplyPtr &
 
 void SetClientNameHandshake::restart() {}
 
+bool SetClientNameHandshake::pipelinable() const {
+  return true;
+}
+
 std::unique_ptr<Handshake> SetClientNameHandshake::clone() const {
   return std::unique_ptr<Handshake>(new SetClientNameHandshake(clientName, ignoreFailures));
 }
 
+//------------------------------------------------------------------------------
+// Script load handshake: Constructor
+//------------------------------------------------------------------------------
+ScriptLoadHandshake::ScriptLoadHandshake(std::shared_ptr<ScriptRegistry> reg)
+: registry(reg) {}
+
+//------------------------------------------------------------------------------
+// Script load handshake: Destructor
+//------------------------------------------------------------------------------
+ScriptLoadHandshake::~ScriptLoadHandshake() {}
+
+//------------------------------------------------------------------------------
+// Script load handshake: Provide handshake - the set of scripts is fixed
+// when the handshake starts, later ones go through the NOSCRIPT path.
+//------------------------------------------------------------------------------
+std::vector<std::string> ScriptLoadHandshake::provideHandshake() {
+  if(!started) {
+    scripts = registry->getAll();
+    started = true;
+  }
+
+  if(scripts.empty()) {
+    return { "PING", "qclient-script-load" };
+  }
+
+  return { "SCRIPT", "LOAD", scripts[next].second };
+}
+
+//------------------------------------------------------------------------------
+// Script load handshake: Validate response
+//------------------------------------------------------------------------------
+Handshake::Status ScriptLoadHandshake::validateResponse(const redisReplyPtr &reply) {
+  if(!reply) return Status::INVALID;
+
+  if(++next >= scripts.size()) {
+    return Status::VALID_COMPLETE;
+  }
+
+  return Status::VALID_INCOMPLETE;
+}
+
+void ScriptLoadHandshake::restart() {
+  started = false;
+  next = 0;
+  scripts.clear();
+}
+
+//------------------------------------------------------------------------------
+// Script load handshake: Failures are ignored, so the last request always
+// completes the handshake - not the ones before it, however.
+//------------------------------------------------------------------------------
+bool ScriptLoadHandshake::pipelinable() const {
+  return next + 1 >= scripts.size();
+}
+
+std::unique_ptr<Handshake> ScriptLoadHandshake::clone() const {
+  return std::unique_ptr<Handshake>(new ScriptLoadHandshake(registry));
+}
+
+//------------------------------------------------------------------------------
+// Capability handshake: Constructor
+//------------------------------------------------------------------------------
+CapabilityHandshake::CapabilityHandshake(Callback cb, bool activatePush)
+: callback(std::move(cb)), activatePushTypes(activatePush) {}
+
+//------------------------------------------------------------------------------
+// Capability handshake: Destructor
+//------------------------------------------------------------------------------
+CapabilityHandshake::~CapabilityHandshake() {}
+
+//------------------------------------------------------------------------------
+// Capability handshake: Provide handshake
+//------------------------------------------------------------------------------
+std::vector<std::string> CapabilityHandshake::provideHandshake() {
+  switch(stage) {
+    case Stage::kQuarkDBVersion: return { "QUARKDB-VERSION" };
+    case Stage::kRedisInfo: return { "INFO", "server" };
+    case Stage::kActivatePushTypes: return { "ACTIVATE-PUSH-TYPES" };
+  }
+
+  return {};
+}
+
+//------------------------------------------------------------------------------
+// Capability handshake: A QuarkDB server replies with its version
+//------------------------------------------------------------------------------
+bool CapabilityHandshake::parseQuarkDBVersion(const redisReplyPtr &reply, ServerCapabilities &out) {
+  if(!reply || (reply->type != REDIS_REPLY_STRING && reply->type != REDIS_REPLY_STATUS)) {
+    return false;
+  }
+
+  QuarkDBVersion version;
+  if(!QuarkDBVersion::fromString(std::string(reply->str, reply->len), version)) {
+    return false;
+  }
+
+  out = ServerCapabilities::forQuarkDB(version);
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Capability handshake: Find redis_version in the output of INFO
+//------------------------------------------------------------------------------
+bool CapabilityHandshake::parseRedisInfo(const redisReplyPtr &reply, ServerCapabilities &out) {
+  if(!reply || reply->type != REDIS_REPLY_STRING) {
+    return false;
+  }
+
+  static const std::string prefix = "redis_version:";
+  std::string info(reply->str, reply->len);
+
+  size_t start = info.find(prefix);
+  if(start == std::string::npos) {
+    return false;
+  }
+
+  start += prefix.size();
+  size_t end = info.find_first_of("\r\n", start);
+
+  QuarkDBVersion version;
+  if(!QuarkDBVersion::fromString(info.substr(start, end - start), version)) {
+    return false;
+  }
+
+  out = ServerCapabilities::forRedis(version);
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Capability handshake: Report the outcome, and activate push types if
+// supported and asked to
+//------------------------------------------------------------------------------
+Handshake::Status CapabilityHandshake::negotiated(const ServerCapabilities &caps) {
+  if(callback) {
+    callback(caps);
+  }
+
+  if(activatePushTypes && caps.has(Capability::kPushTypes)) {
+    stage = Stage::kActivatePushTypes;
+    return Status::VALID_INCOMPLETE;
+  }
+
+  return Status::VALID_COMPLETE;
+}
+
+//------------------------------------------------------------------------------
+// Capability handshake: Validate response
+//------------------------------------------------------------------------------
+Handshake::Status CapabilityHandshake::validateResponse(const redisReplyPtr &reply) {
+  if(!reply) return Status::INVALID;
+
+  ServerCapabilities caps;
+
+  switch(stage) {
+    case Stage::kQuarkDBVersion: {
+      if(parseQuarkDBVersion(reply, caps)) {
+        return negotiated(caps);
+      }
+
+      stage = Stage::kRedisInfo;
+      return Status::VALID_INCOMPLETE;
+    }
+    case Stage::kRedisInfo: {
+      if(!parseRedisInfo(reply, caps)) {
+        caps = ServerCapabilities::forUnknownServer();
+      }
+
+      return negotiated(caps);
+    }
+    case Stage::kActivatePushTypes: {
+      if(reply->type != REDIS_REPLY_STATUS || std::string(reply->str, reply->len) != "OK") {
+        std::cerr << "qclient: CapabilityHandshake could not activate push types - " <<
+          describeRedisReply(reply) << std::endl;
+        return Status::INVALID;
+      }
+
+      return Status::VALID_COMPLETE;
+    }
+  }
+
+  return Status::INVALID;
+}
+
+//------------------------------------------------------------------------------
+// Capability handshake: Restart
+//------------------------------------------------------------------------------
+void CapabilityHandshake::restart() {
+  stage = Stage::kQuarkDBVersion;
+}
+
+//------------------------------------------------------------------------------
+// Capability handshake: Whether more requests follow depends on the replies
+//------------------------------------------------------------------------------
+bool CapabilityHandshake::pipelinable() const {
+  return false;
+}
+
+//------------------------------------------------------------------------------
+// Capability handshake: Clone
+//------------------------------------------------------------------------------
+std::unique_ptr<Handshake> CapabilityHandshake::clone() const {
+  return std::unique_ptr<Handshake>(new CapabilityHandshake(callback, activatePushTypes));
+}
@@ -0,0 +1,102 @@
+//------------------------------------------------------------------------------
+// File: LatencyHistogram.cc
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#include "qclient/LatencyHistogram.hh"
+#include <algorithm>
+
+namespace qclient {
+
+double LatencySnapshot::mean() const {
+  if(count == 0) return 0;
+  return (double) sum / (double) count;
+}
+
+uint64_t LatencySnapshot::percentile(double p) const {
+  if(count == 0) return 0;
+
+  uint64_t target = (uint64_t) ((p / 100.0) * count + 0.5);
+  if(target == 0) target = 1;
+
+  uint64_t seen = 0;
+  for(size_t i = 0; i < buckets.size(); i++) {
+    seen += buckets[i];
+    if(seen >= target) {
+      return std::min(LatencyHistogram::bucketUpperBound(i), max);
+    }
+  }
+
+  return max;
+}
+
+LatencyHistogram::LatencyHistogram() {
+  reset();
+}
+
+size_t LatencyHistogram::bucketIndex(uint64_t value) {
+  if(value < kSubBuckets) return value;
+
+  size_t msb = 63 - __builtin_clzll(value);
+  size_t shift = msb - kSubBucketBits;
+  return (shift + 1) * kSubBuckets + ((value >> shift) & (kSubBuckets - 1));
+}
+
+uint64_t LatencyHistogram::bucketUpperBound(size_t index) {
+  if(index < kSubBuckets) return index;
+
+  size_t shift = index / kSubBuckets - 1;
+  uint64_t lower = (uint64_t) (kSubBuckets + index % kSubBuckets) << shift;
+  return lower + ((uint64_t) 1 << shift) - 1;
+}
+
+void LatencyHistogram::record(uint64_t ns) {
+  buckets[bucketIndex(ns)].fetch_add(1, std::memory_order_relaxed);
+  sum.fetch_add(ns, std::memory_order_relaxed);
+
+  uint64_t prev = max.load(std::memory_order_relaxed);
+  while(ns > prev && !max.compare_exchange_weak(prev, ns, std::memory_order_relaxed)) {}
+}
+
+LatencySnapshot LatencyHistogram::snapshot() const {
+  LatencySnapshot snap;
+  snap.buckets.resize(kBuckets);
+
+  for(size_t i = 0; i < kBuckets; i++) {
+    snap.buckets[i] = buckets[i].load(std::memory_order_relaxed);
+    snap.count += snap.buckets[i];
+  }
+
+  snap.sum = sum.load(std::memory_order_relaxed);
+  snap.max = max.load(std::memory_order_relaxed);
+  return snap;
+}
+
+void LatencyHistogram::reset() {
+  for(size_t i = 0; i < kBuckets; i++) {
+    buckets[i].store(0, std::memory_order_relaxed);
+  }
+
+  sum.store(0, std::memory_order_relaxed);
+  max.store(0, std::memory_order_relaxed);
+}
+
+}
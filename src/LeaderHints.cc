@@ -0,0 +1,72 @@
+//------------------------------------------------------------------------------
+// File: LeaderHints.cc
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#include "LeaderHints.hh"
+
+namespace qclient {
+
+//------------------------------------------------------------------------------
+// Process-wide instance
+//------------------------------------------------------------------------------
+LeaderHints& LeaderHints::global() {
+  static LeaderHints instance;
+  return instance;
+}
+
+//------------------------------------------------------------------------------
+// Record leader of the given cluster
+//------------------------------------------------------------------------------
+void LeaderHints::set(const Members &members, const Endpoint &leader) {
+  std::lock_guard<std::mutex> lock(mtx);
+  hints[members] = leader;
+}
+
+//------------------------------------------------------------------------------
+// Look up leader of the given cluster
+//------------------------------------------------------------------------------
+bool LeaderHints::get(const Members &members, Endpoint &leader) const {
+  std::lock_guard<std::mutex> lock(mtx);
+  auto it = hints.find(members);
+
+  if(it == hints.end()) {
+    return false;
+  }
+
+  leader = it->second;
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Forget leader of the given cluster, if still the given one
+//------------------------------------------------------------------------------
+void LeaderHints::invalidate(const Members &members, const Endpoint &leader) {
+  std::lock_guard<std::mutex> lock(mtx);
+  auto it = hints.find(members);
+
+  if(it != hints.end() && it->second == leader) {
+    hints.erase(it);
+  }
+}
+
+}
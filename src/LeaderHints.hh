@@ -0,0 +1,72 @@
+//------------------------------------------------------------------------------
+// File: LeaderHints.hh
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#ifndef QCLIENT_LEADER_HINTS_HH
+#define QCLIENT_LEADER_HINTS_HH
+
+#include "qclient/Members.hh"
+#include <map>
+#include <mutex>
+
+namespace qclient {
+
+//------------------------------------------------------------------------------
+// Remembers which endpoint was last seen acting as leader of a cluster,
+// keyed by the cluster's Members, so that every QClient towards that cluster
+// in the process can go straight there, instead of each one reconnecting
+// through a follower and a MOVED redirection on its own.
+//
+// Only a hint: whoever finds it wrong removes it.
+//------------------------------------------------------------------------------
+class LeaderHints {
+public:
+  //----------------------------------------------------------------------------
+  // Process-wide instance
+  //----------------------------------------------------------------------------
+  static LeaderHints& global();
+
+  //----------------------------------------------------------------------------
+  // Record leader of the given cluster
+  //----------------------------------------------------------------------------
+  void set(const Members &members, const Endpoint &leader);
+
+  //----------------------------------------------------------------------------
+  // Look up leader of the given cluster - false if we have no idea
+  //----------------------------------------------------------------------------
+  bool get(const Members &members, Endpoint &leader) const;
+
+  //----------------------------------------------------------------------------
+  // Forget leader of the given cluster, but only if it's still the given
+  // one - someone else may have found the new leader in the meantime
+  //----------------------------------------------------------------------------
+  void invalidate(const Members &members, const Endpoint &leader);
+
+private:
+  mutable std::mutex mtx;
+  std::map<Members, Endpoint> hints;
+};
+
+}
+
+#endif
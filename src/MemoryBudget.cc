@@ -0,0 +1,135 @@
+//------------------------------------------------------------------------------
+// File: MemoryBudget.cc
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2016 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#include "qclient/MemoryBudget.hh"
+#include <algorithm>
+
+namespace qclient {
+
+//------------------------------------------------------------------------------
+// Constructor
+//------------------------------------------------------------------------------
+MemoryBudget::MemoryBudget(size_t lim) : limit(std::max<size_t>(lim, 1u)) {
+  for(std::atomic<size_t> &counter : perCategory) {
+    counter = 0;
+  }
+}
+
+//------------------------------------------------------------------------------
+// Do the given bytes fit on top of usage? Anything larger than the whole
+// budget fits once usage drops to zero.
+//------------------------------------------------------------------------------
+bool MemoryBudget::fits(size_t current, size_t bytes) const {
+  return current + std::min(bytes, limit) <= limit;
+}
+
+//------------------------------------------------------------------------------
+// Non-blocking acquire
+//------------------------------------------------------------------------------
+bool MemoryBudget::tryAcquire(Category category, size_t bytes) {
+  size_t current = usage.load();
+
+  while(true) {
+    if(!fits(current, bytes)) {
+      return false;
+    }
+
+    if(usage.compare_exchange_weak(current, current + bytes)) {
+      perCategory[static_cast<size_t>(category)] += bytes;
+      return true;
+    }
+  }
+}
+
+//------------------------------------------------------------------------------
+// Blocking acquire - release wakes us up, as long as anyone is waiting.
+//------------------------------------------------------------------------------
+void MemoryBudget::acquire(Category category, size_t bytes) {
+  if(tryAcquire(category, bytes)) {
+    return;
+  }
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+  {
+    std::unique_lock<std::mutex> lock(mtx);
+    waiters++;
+
+    while(!tryAcquire(category, bytes)) {
+      cv.wait_for(lock, std::chrono::seconds(1));
+    }
+
+    waiters--;
+  }
+
+  blockedTime += std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now() - start).count();
+}
+
+//------------------------------------------------------------------------------
+// Account for memory already in use
+//------------------------------------------------------------------------------
+void MemoryBudget::charge(Category category, size_t bytes) {
+  usage += bytes;
+  perCategory[static_cast<size_t>(category)] += bytes;
+}
+
+//------------------------------------------------------------------------------
+// Give back bytes. Notify under the lock, so that a waiter which just
+// failed to acquire cannot miss it.
+//------------------------------------------------------------------------------
+void MemoryBudget::release(Category category, size_t bytes) {
+  perCategory[static_cast<size_t>(category)] -= bytes;
+  usage -= bytes;
+
+  if(waiters.load() != 0) {
+    std::lock_guard<std::mutex> lock(mtx);
+    cv.notify_all();
+  }
+}
+
+void MemoryBudget::recordShed(size_t messages) {
+  shed += messages;
+}
+
+bool MemoryBudget::exhausted() const {
+  return usage.load() >= limit;
+}
+
+size_t MemoryBudget::getUsage() const {
+  return usage.load();
+}
+
+size_t MemoryBudget::getUsage(Category category) const {
+  return perCategory[static_cast<size_t>(category)].load();
+}
+
+uint64_t MemoryBudget::getShed() const {
+  return shed.load();
+}
+
+std::chrono::nanoseconds MemoryBudget::getBlockedTime() const {
+  return std::chrono::nanoseconds(blockedTime.load());
+}
+
+}
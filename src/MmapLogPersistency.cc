@@ -0,0 +1,504 @@
+//------------------------------------------------------------------------------
+// File: MmapLogPersistency.cc
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#include "qclient/MmapLogPersistency.hh"
+#include "qclient/SSTR.hh"
+#include <algorithm>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace qclient {
+
+namespace {
+
+//------------------------------------------------------------------------------
+// Record framing: [u32 payload length][u32 CRC32C of length + payload]
+// followed by the payload - the request, RESP-encoded. An all-zero header
+// marks the end of a segment.
+//------------------------------------------------------------------------------
+constexpr size_t kHeaderSize = 2 * sizeof(uint32_t);
+constexpr char kSegmentPrefix[] = "segment-";
+constexpr char kSegmentSuffix[] = ".log";
+
+struct Crc32cTable {
+  uint32_t entries[256];
+
+  Crc32cTable() {
+    for(uint32_t i = 0; i < 256; i++) {
+      uint32_t crc = i;
+      for(int bit = 0; bit < 8; bit++) {
+        crc = (crc & 1) ? (crc >> 1) ^ 0x82F63B78 : (crc >> 1);
+      }
+      entries[i] = crc;
+    }
+  }
+};
+
+uint32_t crc32c(uint32_t crc, const char *data, size_t len) {
+  static const Crc32cTable table;
+
+  crc = ~crc;
+  for(size_t i = 0; i < len; i++) {
+    crc = table.entries[(crc ^ (uint8_t) data[i]) & 0xFF] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+uint32_t frameChecksum(const char *frame, uint32_t len) {
+  return crc32c(crc32c(0, frame, sizeof(uint32_t)), frame + kHeaderSize, len);
+}
+
+//------------------------------------------------------------------------------
+// Parse a RESP-encoded array of bulk strings
+//------------------------------------------------------------------------------
+bool readNumber(const char *&pos, const char *end, char marker, size_t &value) {
+  if(pos >= end || *pos != marker) return false;
+  pos++;
+
+  value = 0;
+  while(pos < end && *pos != '\r') {
+    if(*pos < '0' || *pos > '9') return false;
+    value = value * 10 + (*pos - '0');
+    pos++;
+  }
+
+  if(end - pos < 2) return false;
+  pos += 2;
+  return true;
+}
+
+bool decodeRequest(const char *pos, size_t len, std::vector<std::string> &out) {
+  const char *end = pos + len;
+  out.clear();
+
+  size_t nchunks;
+  if(!readNumber(pos, end, '*', nchunks)) return false;
+
+  for(size_t i = 0; i < nchunks; i++) {
+    size_t chunk;
+    if(!readNumber(pos, end, '$', chunk)) return false;
+    if((size_t) (end - pos) < chunk + 2) return false;
+
+    out.emplace_back(pos, chunk);
+    pos += chunk + 2;
+  }
+
+  return pos == end;
+}
+
+[[noreturn]] void fatal(const std::string &msg) {
+  std::cerr << "MmapLogPersistency: " << msg << std::endl;
+  exit(EXIT_FAILURE);
+}
+
+}
+
+struct MmapLogPersistency::Segment {
+  ~Segment() {
+    if(map) munmap(map, capacity);
+  }
+
+  ItemIndex firstIndex = 0;
+  std::string path;
+  FileDescriptor fd;
+  char *map = nullptr;
+  size_t capacity = 0;
+  size_t used = 0;
+
+  // Offset of each record's frame, in order
+  std::vector<uint32_t> offsets;
+
+  ItemIndex endIndex() const {
+    return firstIndex + offsets.size();
+  }
+};
+
+MmapLogPersistency::MmapLogPersistency(const std::string &path, size_t segSize)
+: dirpath(path), segmentSize(segSize) {
+
+  if(mkdir(dirpath.c_str(), 0755) != 0 && errno != EEXIST) {
+    fatal(SSTR("unable to create directory " << dirpath << ": " << strerror(errno)));
+  }
+
+  loadSegments();
+  loadHead();
+  dropConsumedSegments();
+}
+
+MmapLogPersistency::~MmapLogPersistency() {}
+
+//------------------------------------------------------------------------------
+// Map all existing segments in order, recovering the ending index
+//------------------------------------------------------------------------------
+void MmapLogPersistency::loadSegments() {
+  std::vector<std::pair<ItemIndex, std::string>> found;
+
+  DIR *dir = opendir(dirpath.c_str());
+  if(!dir) {
+    fatal(SSTR("unable to open directory " << dirpath << ": " << strerror(errno)));
+  }
+
+  while(struct dirent *entry = readdir(dir)) {
+    std::string name(entry->d_name);
+    size_t prefix = strlen(kSegmentPrefix);
+    size_t suffix = strlen(kSegmentSuffix);
+
+    if(name.size() > prefix + suffix && name.compare(0, prefix, kSegmentPrefix) == 0 &&
+       name.compare(name.size() - suffix, suffix, kSegmentSuffix) == 0) {
+      found.emplace_back(strtoll(name.c_str() + prefix, nullptr, 10), name);
+    }
+  }
+
+  closedir(dir);
+  std::sort(found.begin(), found.end());
+
+  for(size_t i = 0; i < found.size(); i++) {
+    std::unique_ptr<Segment> segment = openSegment(found[i].second, found[i].first);
+
+    if(!segments.empty() && segments.back()->endIndex() != segment->firstIndex) {
+      fatal(SSTR("queue corruption, segment " << segment->path << " does not follow " <<
+        segments.back()->path << " which ends at index " << segments.back()->endIndex()));
+    }
+
+    segments.emplace_back(std::move(segment));
+  }
+
+  if(!segments.empty()) {
+    startIndex = segments.front()->firstIndex;
+    endIndex = segments.back()->endIndex();
+  }
+}
+
+std::unique_ptr<MmapLogPersistency::Segment> MmapLogPersistency::openSegment(
+  const std::string &filename, ItemIndex firstIndex) {
+
+  std::unique_ptr<Segment> segment(new Segment());
+  segment->firstIndex = firstIndex;
+  segment->path = SSTR(dirpath << "/" << filename);
+  segment->fd.reset(open(segment->path.c_str(), O_RDWR | O_CLOEXEC));
+
+  struct stat st;
+  if(!segment->fd || fstat(segment->fd.get(), &st) != 0) {
+    fatal(SSTR("unable to open segment " << segment->path << ": " << strerror(errno)));
+  }
+
+  segment->capacity = st.st_size;
+  if(segment->capacity == 0) {
+    return segment;
+  }
+
+  void *map = mmap(nullptr, segment->capacity, PROT_READ | PROT_WRITE, MAP_SHARED, segment->fd.get(), 0);
+  if(map == MAP_FAILED) {
+    fatal(SSTR("unable to map segment " << segment->path << ": " << strerror(errno)));
+  }
+
+  segment->map = (char*) map;
+
+  //----------------------------------------------------------------------------
+  // Scan records until the end marker, or the first one which doesn't check
+  // out - a torn write left behind by a crash.
+  //----------------------------------------------------------------------------
+  size_t offset = 0;
+  while(offset + kHeaderSize <= segment->capacity) {
+    uint32_t len, crc;
+    memcpy(&len, segment->map + offset, sizeof(len));
+    memcpy(&crc, segment->map + offset + sizeof(len), sizeof(crc));
+
+    if(len == 0 && crc == 0) break;
+    if(offset + kHeaderSize + len > segment->capacity) break;
+    if(frameChecksum(segment->map + offset, len) != crc) break;
+
+    segment->offsets.push_back(offset);
+    offset += kHeaderSize + len;
+  }
+
+  segment->used = offset;
+  if(offset + kHeaderSize <= segment->capacity) {
+    memset(segment->map + offset, 0, segment->capacity - offset);
+  }
+
+  return segment;
+}
+
+std::unique_ptr<MmapLogPersistency::Segment> MmapLogPersistency::createSegment(
+  ItemIndex firstIndex, size_t capacity) {
+
+  std::unique_ptr<Segment> segment(new Segment());
+  segment->firstIndex = firstIndex;
+  segment->path = SSTR(dirpath << "/" << kSegmentPrefix << std::setw(20) <<
+    std::setfill('0') << firstIndex << kSegmentSuffix);
+  segment->capacity = capacity;
+  segment->fd.reset(open(segment->path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+
+  if(!segment->fd) {
+    fatal(SSTR("unable to create segment " << segment->path << ": " << strerror(errno)));
+  }
+
+  //----------------------------------------------------------------------------
+  // Allocate blocks up front - running out of disk space while writing
+  // through the mapping would be a SIGBUS.
+  //----------------------------------------------------------------------------
+  int rc = posix_fallocate(segment->fd.get(), 0, capacity);
+  if(rc != 0) {
+    fatal(SSTR("unable to allocate segment " << segment->path << ": " << strerror(rc)));
+  }
+
+  void *map = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, segment->fd.get(), 0);
+  if(map == MAP_FAILED) {
+    fatal(SSTR("unable to map segment " << segment->path << ": " << strerror(errno)));
+  }
+
+  segment->map = (char*) map;
+  return segment;
+}
+
+//------------------------------------------------------------------------------
+// HEAD: [i64 starting index][u32 CRC32C]. If missing or torn, we fall back to
+// the first segment - replaying some acknowledged items is safe, skipping
+// unacknowledged ones is not.
+//------------------------------------------------------------------------------
+void MmapLogPersistency::loadHead() {
+  std::string path = SSTR(dirpath << "/HEAD");
+  headFd.reset(open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644));
+  if(!headFd) {
+    fatal(SSTR("unable to open " << path << ": " << strerror(errno)));
+  }
+
+  char buff[sizeof(int64_t) + sizeof(uint32_t)];
+  if(pread(headFd.get(), buff, sizeof(buff), 0) != (ssize_t) sizeof(buff)) {
+    return;
+  }
+
+  int64_t head;
+  uint32_t crc;
+  memcpy(&head, buff, sizeof(head));
+  memcpy(&crc, buff + sizeof(head), sizeof(crc));
+
+  if(crc32c(0, buff, sizeof(head)) != crc) {
+    return;
+  }
+
+  if(segments.empty()) {
+    startIndex = head;
+    endIndex = head;
+  }
+  else if(head > startIndex) {
+    startIndex = std::min<ItemIndex>(head, endIndex);
+  }
+}
+
+void MmapLogPersistency::writeHead() {
+  char buff[sizeof(int64_t) + sizeof(uint32_t)];
+  int64_t head = startIndex;
+  memcpy(buff, &head, sizeof(head));
+
+  uint32_t crc = crc32c(0, buff, sizeof(head));
+  memcpy(buff + sizeof(head), &crc, sizeof(crc));
+
+  if(pwrite(headFd.get(), buff, sizeof(buff), 0) != (ssize_t) sizeof(buff)) {
+    fatal(SSTR("unable to update HEAD: " << strerror(errno)));
+  }
+}
+
+//------------------------------------------------------------------------------
+// Delete every segment whose items have all been popped, except the one
+// being appended to.
+//------------------------------------------------------------------------------
+void MmapLogPersistency::dropConsumedSegments() {
+  while(segments.size() > 1 && segments[1]->firstIndex <= startIndex) {
+    unlink(segments.front()->path.c_str());
+    segments.pop_front();
+  }
+}
+
+MmapLogPersistency::Segment* MmapLogPersistency::findSegment(ItemIndex index) {
+  auto it = std::upper_bound(segments.begin(), segments.end(), index,
+    [](ItemIndex idx, const std::unique_ptr<Segment> &seg) {
+      return idx < seg->firstIndex;
+    });
+
+  if(it == segments.begin()) return nullptr;
+  return (it - 1)->get();
+}
+
+//------------------------------------------------------------------------------
+// Append a single record, starting a new segment if needed. Call with mtx.
+//------------------------------------------------------------------------------
+void MmapLogPersistency::append(const EncodedRequest &req) {
+  size_t len = req.getLen();
+  if(len > UINT32_MAX - kHeaderSize) {
+    fatal(SSTR("item with index " << endIndex << " too large: " << len << " bytes"));
+  }
+
+  size_t frame = kHeaderSize + len;
+
+  if(segments.empty() || segments.back()->used + frame > segments.back()->capacity) {
+    segments.emplace_back(createSegment(endIndex, std::max(segmentSize, frame + kHeaderSize)));
+    dropConsumedSegments();
+  }
+
+  Segment &segment = *segments.back();
+  char *start = segment.map + segment.used;
+  char *pos = start + kHeaderSize;
+
+  for(size_t i = 0; i < req.getSegmentCount(); i++) {
+    EncodedRequest::Segment piece = req.getSegment(i);
+    memcpy(pos, piece.data, piece.len);
+    pos += piece.len;
+  }
+
+  //----------------------------------------------------------------------------
+  // Header goes last, so a torn record never looks valid
+  //----------------------------------------------------------------------------
+  uint32_t len32 = len;
+  memcpy(start, &len32, sizeof(len32));
+  uint32_t crc = frameChecksum(start, len32);
+  memcpy(start + sizeof(len32), &crc, sizeof(crc));
+
+  segment.offsets.push_back(segment.used);
+  segment.used += frame;
+  endIndex++;
+}
+
+//------------------------------------------------------------------------------
+// Locate the payload of the given item. Call with mtx.
+//------------------------------------------------------------------------------
+bool MmapLogPersistency::locate(ItemIndex index, const char *&payload, uint32_t &len) {
+  if(index < startIndex || index >= endIndex) {
+    return false;
+  }
+
+  Segment *segment = findSegment(index);
+  if(!segment || index >= segment->endIndex()) {
+    return false;
+  }
+
+  const char *frame = segment->map + segment->offsets[index - segment->firstIndex];
+  memcpy(&len, frame, sizeof(len));
+  payload = frame + kHeaderSize;
+  return true;
+}
+
+void MmapLogPersistency::record(ItemIndex index, const std::vector<std::string> &cmd) {
+  std::lock_guard<std::mutex> lock(mtx);
+  if(index != endIndex) {
+    fatal(SSTR("queue corruption, received unexpected index: " << index << " (current endIndex: " << endIndex << ")"));
+  }
+
+  append(EncodedRequest(cmd));
+}
+
+void MmapLogPersistency::recordBatch(ItemIndex index, const std::vector<std::vector<std::string>> &cmds) {
+  std::lock_guard<std::mutex> lock(mtx);
+  if(index != endIndex) {
+    fatal(SSTR("queue corruption, received unexpected index: " << index << " (current endIndex: " << endIndex << ")"));
+  }
+
+  for(size_t i = 0; i < cmds.size(); i++) {
+    append(EncodedRequest(cmds[i]));
+  }
+}
+
+bool MmapLogPersistency::storesEncoded() {
+  return true;
+}
+
+void MmapLogPersistency::recordEncoded(ItemIndex index, const EncodedRequest *reqs, size_t count) {
+  std::lock_guard<std::mutex> lock(mtx);
+  if(index != endIndex) {
+    fatal(SSTR("queue corruption, received unexpected index: " << index << " (current endIndex: " << endIndex << ")"));
+  }
+
+  for(size_t i = 0; i < count; i++) {
+    append(reqs[i]);
+  }
+}
+
+void MmapLogPersistency::pop() {
+  popBatch(1);
+}
+
+void MmapLogPersistency::popBatch(size_t count) {
+  std::lock_guard<std::mutex> lock(mtx);
+  if(startIndex + (ItemIndex) count > endIndex) {
+    fatal(SSTR("queue corruption, cannot pop " << count << " items. startIndex = " << startIndex << ", endIndex = " << endIndex));
+  }
+
+  startIndex += count;
+  writeHead();
+  dropConsumedSegments();
+}
+
+ItemIndex MmapLogPersistency::getStartingIndex() {
+  return startIndex;
+}
+
+ItemIndex MmapLogPersistency::getEndingIndex() {
+  return endIndex;
+}
+
+bool MmapLogPersistency::retrieve(ItemIndex index, std::vector<std::string> &ret) {
+  std::lock_guard<std::mutex> lock(mtx);
+
+  const char *payload;
+  uint32_t len;
+  return locate(index, payload, len) && decodeRequest(payload, len, ret);
+}
+
+bool MmapLogPersistency::retrieveBatch(ItemIndex index, size_t count, std::vector<std::vector<std::string>> &out) {
+  for(size_t i = 0; i < count; i++) {
+    out.emplace_back();
+    if(!retrieve(index + i, out.back())) return false;
+  }
+
+  return true;
+}
+
+bool MmapLogPersistency::retrieveEncoded(ItemIndex index, size_t count, std::vector<EncodedRequest> &out) {
+  std::lock_guard<std::mutex> lock(mtx);
+
+  for(size_t i = 0; i < count; i++) {
+    const char *payload;
+    uint32_t len;
+    if(!locate(index + i, payload, len)) return false;
+
+    char *buff = (char*) malloc(len);
+    memcpy(buff, payload, len);
+    out.emplace_back(buff, len);
+  }
+
+  return true;
+}
+
+size_t MmapLogPersistency::getSegmentCount() {
+  std::lock_guard<std::mutex> lock(mtx);
+  return segments.size();
+}
+
+}
@@ -0,0 +1,173 @@
+//------------------------------------------------------------------------------
+// File: MultiBuilder.cc
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2018 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#include "qclient/MultiBuilder.hh"
+#include "qclient/ResponseBuilder.hh"
+#include <stdlib.h>
+#include <algorithm>
+#include <new>
+#include <vector>
+
+namespace qclient {
+
+namespace {
+
+constexpr char kMulti[] = "*1\r\n$5\r\nMULTI\r\n";
+constexpr char kExec[] = "*1\r\n$4\r\nEXEC\r\n";
+constexpr size_t kInitialCapacity = 256;
+
+}
+
+MultiBuilder::MultiBuilder() {}
+
+MultiBuilder::~MultiBuilder() {
+  free(buffer);
+}
+
+MultiBuilder::MultiBuilder(MultiBuilder&& other) noexcept
+: buffer(other.buffer), length(other.length), capacity(other.capacity),
+  count(other.count) {
+
+  other.buffer = nullptr;
+  other.reset();
+}
+
+MultiBuilder& MultiBuilder::operator=(MultiBuilder&& other) noexcept {
+  if(this != &other) {
+    free(buffer);
+    buffer = other.buffer;
+    length = other.length;
+    capacity = other.capacity;
+    count = other.count;
+
+    other.buffer = nullptr;
+    other.reset();
+  }
+
+  return *this;
+}
+
+//------------------------------------------------------------------------------
+// Forget all contents, without touching the buffer
+//------------------------------------------------------------------------------
+void MultiBuilder::reset() {
+  length = 0;
+  capacity = buffer ? capacity : 0;
+  count = 0;
+}
+
+//------------------------------------------------------------------------------
+// Write the MULTI framing, if not there yet
+//------------------------------------------------------------------------------
+void MultiBuilder::start() {
+  if(length == 0) {
+    memcpy(grow(sizeof(kMulti) - 1), kMulti, sizeof(kMulti) - 1);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Extend the buffer by len bytes, returning a pointer to the new region
+//------------------------------------------------------------------------------
+char* MultiBuilder::grow(size_t len) {
+  if(length + len > capacity) {
+    size_t newCapacity = std::max(capacity * 2, kInitialCapacity);
+    while(newCapacity < length + len) {
+      newCapacity *= 2;
+    }
+
+    resize(newCapacity);
+  }
+
+  char *dst = buffer + length;
+  length += len;
+  return dst;
+}
+
+void MultiBuilder::resize(size_t newCapacity) {
+  char *newBuffer = (char*) realloc(buffer, newCapacity);
+  if(!newBuffer) {
+    throw std::bad_alloc();
+  }
+
+  buffer = newBuffer;
+  capacity = newCapacity;
+}
+
+void MultiBuilder::reserve(size_t bytes) {
+  size_t required = (length == 0 ? sizeof(kMulti) - 1 : length) + bytes +
+    sizeof(kExec) - 1;
+
+  if(required > capacity) {
+    resize(required);
+  }
+}
+
+void MultiBuilder::append(size_t nchunks, const char** chunks, const size_t* sizes) {
+  start();
+
+  EncodedRequest::encode(nchunks, chunks, sizes, [](void *ctx, size_t len) {
+    return static_cast<MultiBuilder*>(ctx)->grow(len);
+  }, this);
+
+  count++;
+}
+
+EncodedRequest MultiBuilder::release() {
+  start();
+  memcpy(grow(sizeof(kExec) - 1), kExec, sizeof(kExec) - 1);
+
+  EncodedRequest req(buffer, length);
+  buffer = nullptr;
+  reset();
+  return req;
+}
+
+//------------------------------------------------------------------------------
+// Deprecated: Decode the commands back out of the buffer, one request each
+//------------------------------------------------------------------------------
+std::deque<EncodedRequest> MultiBuilder::getDeque() const {
+  std::deque<EncodedRequest> contents;
+  if(length == 0) {
+    return contents;
+  }
+
+  ResponseBuilder builder;
+  builder.feed(buffer + sizeof(kMulti) - 1, length - (sizeof(kMulti) - 1));
+
+  redisReplyPtr command;
+  while(builder.pull(command) == ResponseBuilder::Status::kOk) {
+    std::vector<const char*> chunks;
+    std::vector<size_t> sizes;
+
+    for(size_t i = 0; i < command->elements; i++) {
+      chunks.emplace_back(command->element[i]->str);
+      sizes.emplace_back(command->element[i]->len);
+    }
+
+    contents.emplace_back(chunks.size(), chunks.data(), sizes.data());
+  }
+
+  return contents;
+}
+
+}
@@ -32,6 +32,70 @@
 
 using namespace qclient;
 
+//------------------------------------------------------------------------------
+// Copy all options, with a clone of the handshake
+//------------------------------------------------------------------------------
+qclient::Options Options::clone() const {
+  Options options;
+  options.transparentRedirects = transparentRedirects;
+  options.retryStrategy = retryStrategy;
+  options.reconnectStrategy = reconnectStrategy;
+  options.replayPacing = replayPacing;
+  options.backpressureStrategy = backpressureStrategy;
+  options.tlsconfig = tlsconfig;
+  options.ensureConnectionIsPrimed = ensureConnectionIsPrimed;
+  options.tcpTimeout = tcpTimeout;
+  options.socketProfile = socketProfile;
+  options.parallelConnect = parallelConnect;
+  options.connectionAttemptDelay = connectionAttemptDelay;
+  options.warmStandby = warmStandby;
+  options.standbyPingInterval = standbyPingInterval;
+  options.optimisticHandshake = optimisticHandshake;
+  options.maxReceiveBufferSize = maxReceiveBufferSize;
+  options.replyArena = replyArena;
+  options.zeroCopyReplyThreshold = zeroCopyReplyThreshold;
+  options.pipelinedParsing = pipelinedParsing;
+  options.callbackThreads = callbackThreads;
+  options.queueInitialBlockSize = queueInitialBlockSize;
+  options.queueMaxBlockSize = queueMaxBlockSize;
+  options.queueSpinIterations = queueSpinIterations;
+  options.logger = logger;
+  options.messageListener = messageListener;
+  options.exclusivePubsub = exclusivePubsub;
+  options.offloadPushMessages = offloadPushMessages;
+  options.ioBackend = ioBackend;
+  options.zeroCopyThreshold = zeroCopyThreshold;
+  options.sharedMemoryRingSize = sharedMemoryRingSize;
+  options.eventLoopGroup = eventLoopGroup;
+  options.externalEventLoop = externalEventLoop;
+  options.dnsCache = dnsCache;
+  options.latencyProber = latencyProber;
+  options.tracer = tracer;
+  options.stuckRequestThreshold = stuckRequestThreshold;
+  options.stuckRequestCallback = stuckRequestCallback;
+  options.reconnectOnStuckRequests = reconnectOnStuckRequests;
+  options.readRouting = readRouting;
+  options.priorityLanes = priorityLanes;
+  options.hedgedReads = hedgedReads;
+  options.singleFlightReads = singleFlightReads;
+  options.writeCombining = writeCombining;
+  options.scriptPriming = scriptPriming;
+  options.negotiateCapabilities = negotiateCapabilities;
+  options.capabilityCache = capabilityCache;
+  options.memoryBudget = memoryBudget;
+  options.memoryResource = memoryResource;
+  options.rateLimiter = rateLimiter;
+  options.lazyConnect = lazyConnect;
+  options.cpuAffinity = cpuAffinity;
+  options.busyPoll = busyPoll;
+
+  if(handshake) {
+    options.handshake = handshake->clone();
+  }
+
+  return options;
+}
+
 //------------------------------------------------------------------------------
 // Fluent interface: Chain HMAC handshake. If password is empty, any existing
 // handshake is left untouched.
@@ -97,3 +161,199 @@ qclient::Options& Options::withRetryStrategy(const RetryStrategy& str) {
   retryStrategy = str;
   return *this;
 }
+
+//------------------------------------------------------------------------------
+// Fluent interface: Setting reconnect strategy
+//------------------------------------------------------------------------------
+qclient::Options& Options::withReconnectStrategy(const ReconnectStrategy& str) {
+  reconnectStrategy = str;
+  return *this;
+}
+
+//------------------------------------------------------------------------------
+// Fluent interface: Setting replay pacing
+//------------------------------------------------------------------------------
+qclient::Options& Options::withReplayPacing(const ReplayPacing& pacing) {
+  replayPacing = pacing;
+  return *this;
+}
+
+//------------------------------------------------------------------------------
+// Fluent interface: Setting I/O backend
+//------------------------------------------------------------------------------
+qclient::Options& Options::withIoBackend(IoBackend backend) {
+  ioBackend = backend;
+  return *this;
+}
+
+//------------------------------------------------------------------------------
+// Fluent interface: Send writes of at least threshold bytes with MSG_ZEROCOPY
+//------------------------------------------------------------------------------
+qclient::Options& Options::withZeroCopyThreshold(size_t threshold) {
+  zeroCopyThreshold = threshold;
+  return *this;
+}
+
+//------------------------------------------------------------------------------
+// Fluent interface: Offer a shared memory channel to unix socket servers
+//------------------------------------------------------------------------------
+qclient::Options& Options::withSharedMemoryTransport(size_t ringSize) {
+  sharedMemoryRingSize = ringSize;
+  return *this;
+}
+
+//------------------------------------------------------------------------------
+// Fluent interface: Setting event loop group
+//------------------------------------------------------------------------------
+qclient::Options& Options::withEventLoopGroup(std::shared_ptr<EventLoopGroup> group) {
+  eventLoopGroup = group;
+  return *this;
+}
+
+//------------------------------------------------------------------------------
+// Fluent interface: Drive the client from an external event loop
+//------------------------------------------------------------------------------
+qclient::Options& Options::withExternalEventLoop(std::shared_ptr<ExternalEventLoop> loop) {
+  externalEventLoop = loop;
+  return *this;
+}
+
+//------------------------------------------------------------------------------
+// Fluent interface: Setting DNS cache
+//------------------------------------------------------------------------------
+qclient::Options& Options::withDnsCache(std::shared_ptr<DnsCache> cache) {
+  dnsCache = cache;
+  return *this;
+}
+
+//------------------------------------------------------------------------------
+// Fluent interface: Setting request tracer
+//------------------------------------------------------------------------------
+qclient::Options& Options::withTracer(std::shared_ptr<RequestTracer> t) {
+  tracer = t;
+  return *this;
+}
+
+//------------------------------------------------------------------------------
+// Fluent interface: Setting read routing
+//------------------------------------------------------------------------------
+qclient::Options& Options::withReadRouting(const ReadRouting& routing) {
+  readRouting = routing;
+  return *this;
+}
+
+//------------------------------------------------------------------------------
+// Fluent interface: Setting priority lanes
+//------------------------------------------------------------------------------
+qclient::Options& Options::withPriorityLanes(const PriorityLanes& lanes) {
+  priorityLanes = lanes;
+  return *this;
+}
+
+//------------------------------------------------------------------------------
+// Fluent interface: Setting hedged reads
+//------------------------------------------------------------------------------
+qclient::Options& Options::withHedgedReads(const HedgedReads& hedging) {
+  hedgedReads = hedging;
+  return *this;
+}
+
+//------------------------------------------------------------------------------
+// Fluent interface: Enable single-flight reads
+//------------------------------------------------------------------------------
+qclient::Options& Options::withSingleFlightReads() {
+  singleFlightReads = true;
+  return *this;
+}
+
+//------------------------------------------------------------------------------
+// Fluent interface: Enable write combining
+//------------------------------------------------------------------------------
+qclient::Options& Options::withWriteCombining() {
+  writeCombining = true;
+  return *this;
+}
+
+//------------------------------------------------------------------------------
+// Fluent interface: Enable script priming
+//------------------------------------------------------------------------------
+qclient::Options& Options::withScriptPriming() {
+  scriptPriming = true;
+  return *this;
+}
+
+//------------------------------------------------------------------------------
+// Fluent interface: Negotiate capabilities
+//------------------------------------------------------------------------------
+qclient::Options& Options::withCapabilityNegotiation(std::shared_ptr<CapabilityCache> cache) {
+  negotiateCapabilities = true;
+  capabilityCache = cache;
+  return *this;
+}
+
+//------------------------------------------------------------------------------
+// Fluent interface: Share the given memory budget
+//------------------------------------------------------------------------------
+qclient::Options& Options::withMemoryBudget(std::shared_ptr<MemoryBudget> budget) {
+  memoryBudget = budget;
+  return *this;
+}
+
+//------------------------------------------------------------------------------
+// Fluent interface: Allocate out of the given memory resource
+//------------------------------------------------------------------------------
+qclient::Options& Options::withMemoryResource(MemoryResource *resource) {
+  memoryResource = resource;
+  return *this;
+}
+
+//------------------------------------------------------------------------------
+// Fluent interface: Limit egress through the given rate limiter
+//------------------------------------------------------------------------------
+qclient::Options& Options::withRateLimiter(std::shared_ptr<RateLimiter> limiter) {
+  rateLimiter = limiter;
+  return *this;
+}
+
+//------------------------------------------------------------------------------
+// Fluent interface: Enable lazy connect
+//------------------------------------------------------------------------------
+qclient::Options& Options::withLazyConnect() {
+  lazyConnect = true;
+  return *this;
+}
+
+//------------------------------------------------------------------------------
+// Fluent interface: Pin internal threads to the given CPUs
+//------------------------------------------------------------------------------
+qclient::Options& Options::withCpuAffinity(const std::vector<int> &cpus) {
+  cpuAffinity = cpus;
+  return *this;
+}
+
+//------------------------------------------------------------------------------
+// Fluent interface: Busy-poll the socket for the given duration
+//------------------------------------------------------------------------------
+qclient::Options& Options::withBusyPoll(std::chrono::microseconds duration) {
+  busyPoll = duration;
+  return *this;
+}
+
+//------------------------------------------------------------------------------
+// Fluent interface: Deliver push messages from a thread of their own
+//------------------------------------------------------------------------------
+qclient::Options& Options::withOffloadPushMessages() {
+  offloadPushMessages = true;
+  return *this;
+}
+
+//------------------------------------------------------------------------------
+// Fluent interface: Enable stuck pipeline watchdog
+//------------------------------------------------------------------------------
+qclient::Options& Options::withStuckRequestWatchdog(std::chrono::milliseconds threshold,
+  bool reconnect, std::function<void(std::chrono::milliseconds)> callback) {
+  stuckRequestThreshold = threshold;
+  reconnectOnStuckRequests = reconnect;
+  stuckRequestCallback = std::move(callback);
+  return *this;
+}
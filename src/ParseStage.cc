@@ -0,0 +1,197 @@
+//------------------------------------------------------------------------------
+// File: ParseStage.cc
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#include "ParseStage.hh"
+#include <algorithm>
+
+using namespace qclient;
+
+//------------------------------------------------------------------------------
+// Round up capacity to a power of two
+//------------------------------------------------------------------------------
+static size_t roundUpPowerOfTwo(size_t n) {
+  size_t result = 1;
+  while(result < n) {
+    result <<= 1;
+  }
+
+  return result;
+}
+
+//------------------------------------------------------------------------------
+// ByteRing constructor
+//------------------------------------------------------------------------------
+ByteRing::ByteRing(size_t minCapacity) {
+  size_t cap = roundUpPowerOfTwo(std::max<size_t>(minCapacity, 64));
+  buffer.reset(new char[cap]);
+  mask = cap - 1;
+}
+
+//------------------------------------------------------------------------------
+// Producer side, get contiguous free space
+//------------------------------------------------------------------------------
+char* ByteRing::getWriteBuffer(size_t &len) {
+  size_t h = head.load(std::memory_order_relaxed);
+  size_t t = tail.load(std::memory_order_acquire);
+
+  size_t freeBytes = capacity() - (h - t);
+  size_t offset = h & mask;
+  len = std::min(len, std::min(freeBytes, capacity() - offset));
+
+  if(len == 0) {
+    return nullptr;
+  }
+
+  return buffer.get() + offset;
+}
+
+//------------------------------------------------------------------------------
+// Producer side, publish written bytes
+//------------------------------------------------------------------------------
+void ByteRing::commitWrite(size_t len) {
+  head.store(head.load(std::memory_order_relaxed) + len, std::memory_order_release);
+}
+
+//------------------------------------------------------------------------------
+// Consumer side, get contiguous filled bytes
+//------------------------------------------------------------------------------
+const char* ByteRing::getReadBuffer(size_t &len) {
+  size_t t = tail.load(std::memory_order_relaxed);
+  size_t h = head.load(std::memory_order_acquire);
+
+  size_t offset = t & mask;
+  len = std::min(h - t, capacity() - offset);
+
+  if(len == 0) {
+    return nullptr;
+  }
+
+  return buffer.get() + offset;
+}
+
+//------------------------------------------------------------------------------
+// Consumer side, release consumed bytes
+//------------------------------------------------------------------------------
+void ByteRing::commitRead(size_t len) {
+  tail.store(tail.load(std::memory_order_relaxed) + len, std::memory_order_release);
+}
+
+//------------------------------------------------------------------------------
+// ParseStage constructor - starts the parse thread
+//------------------------------------------------------------------------------
+ParseStage::ParseStage(size_t ringCapacity, Consumer cons)
+: ring(ringCapacity), consumer(std::move(cons)) {
+  thread.reset(&ParseStage::main, this);
+}
+
+//------------------------------------------------------------------------------
+// Destructor
+//------------------------------------------------------------------------------
+ParseStage::~ParseStage() {
+  finish();
+}
+
+//------------------------------------------------------------------------------
+// Socket thread: get room for more bytes, wait while the ring is full
+//------------------------------------------------------------------------------
+char* ParseStage::getWriteBuffer(size_t &len) {
+  if(hasFailed) {
+    return nullptr;
+  }
+
+  size_t requested = len;
+  char *buf = ring.getWriteBuffer(len);
+
+  if(buf) {
+    return buf;
+  }
+
+  std::unique_lock<std::mutex> lock(mtx);
+  cv.wait(lock, [&]() {
+    len = requested;
+    buf = ring.getWriteBuffer(len);
+    return buf != nullptr || hasFailed;
+  });
+
+  if(hasFailed) {
+    return nullptr;
+  }
+
+  return buf;
+}
+
+//------------------------------------------------------------------------------
+// Socket thread: hand bytes over to the parse thread
+//------------------------------------------------------------------------------
+void ParseStage::commitWrite(size_t len) {
+  ring.commitWrite(len);
+
+  std::lock_guard<std::mutex> lock(mtx);
+  cv.notify_all();
+}
+
+//------------------------------------------------------------------------------
+// Drain remaining bytes and stop the parse thread
+//------------------------------------------------------------------------------
+void ParseStage::finish() {
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    finishing = true;
+    cv.notify_all();
+  }
+
+  thread.join();
+}
+
+//------------------------------------------------------------------------------
+// Parse thread main loop
+//------------------------------------------------------------------------------
+void ParseStage::main(ThreadAssistant &assistant) {
+  while(true) {
+    {
+      std::unique_lock<std::mutex> lock(mtx);
+      cv.wait(lock, [&]() { return !ring.empty() || finishing; });
+
+      if(ring.empty()) {
+        return;
+      }
+    }
+
+    size_t len;
+    const char *buf = ring.getReadBuffer(len);
+
+    if(!consumer(buf, len)) {
+      std::lock_guard<std::mutex> lock(mtx);
+      hasFailed = true;
+      failureFD.notify();
+      cv.notify_all();
+      return;
+    }
+
+    ring.commitRead(len);
+
+    std::lock_guard<std::mutex> lock(mtx);
+    cv.notify_all();
+  }
+}
@@ -0,0 +1,133 @@
+//------------------------------------------------------------------------------
+// File: ParseStage.hh
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#ifndef QCLIENT_PARSE_STAGE_HH
+#define QCLIENT_PARSE_STAGE_HH
+
+#include "qclient/AssistedThread.hh"
+#include "qclient/EventFD.hh"
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stddef.h>
+
+namespace qclient {
+
+//------------------------------------------------------------------------------
+// Fixed-capacity byte ring with one producer and one consumer thread. Both
+// sides work on contiguous regions in place: The producer receives straight
+// into the free space, the consumer parses straight out of the filled part.
+// Positions only ever grow, wrapping is done through the mask.
+//------------------------------------------------------------------------------
+class ByteRing {
+public:
+  ByteRing(size_t minCapacity);
+
+  //----------------------------------------------------------------------------
+  // Producer side: Get up to len contiguous free bytes - len is lowered to
+  // what's actually available. Returns nullptr if the ring is full.
+  //----------------------------------------------------------------------------
+  char* getWriteBuffer(size_t &len);
+  void commitWrite(size_t len);
+
+  //----------------------------------------------------------------------------
+  // Consumer side: Get all contiguous filled bytes, nullptr if empty.
+  //----------------------------------------------------------------------------
+  const char* getReadBuffer(size_t &len);
+  void commitRead(size_t len);
+
+  bool empty() const {
+    return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+  }
+
+  size_t capacity() const {
+    return mask + 1;
+  }
+
+private:
+  std::unique_ptr<char[]> buffer;
+  size_t mask;
+
+  alignas(64) std::atomic<size_t> head {0};
+  alignas(64) std::atomic<size_t> tail {0};
+};
+
+//------------------------------------------------------------------------------
+// Moves response parsing off the socket-reading thread: Raw bytes are
+// handed over through a ByteRing, and a dedicated thread feeds them to the
+// given consumer, so that recv and parse overlap.
+//
+// The consumer returns false once the connection cannot go on - protocol
+// violation, redirect, and the like. From then on, the parse thread drops
+// all further bytes and signals getFailureFD, which the socket thread polls
+// next to the socket.
+//------------------------------------------------------------------------------
+class ParseStage {
+public:
+  using Consumer = std::function<bool(const char* buf, size_t len)>;
+
+  ParseStage(size_t ringCapacity, Consumer consumer);
+  ~ParseStage();
+
+  //----------------------------------------------------------------------------
+  // Socket thread: Get room for up to len bytes, blocking while the ring is
+  // full. Returns nullptr if the parse stage has failed.
+  //----------------------------------------------------------------------------
+  char* getWriteBuffer(size_t &len);
+  void commitWrite(size_t len);
+
+  bool failed() const {
+    return hasFailed;
+  }
+
+  int getFailureFD() const {
+    return failureFD.getFD();
+  }
+
+  //----------------------------------------------------------------------------
+  // Let the parse thread digest everything handed over so far, then stop it.
+  // Once this returns, the consumer is no longer called.
+  //----------------------------------------------------------------------------
+  void finish();
+
+private:
+  void main(ThreadAssistant &assistant);
+
+  ByteRing ring;
+  Consumer consumer;
+
+  std::mutex mtx;
+  std::condition_variable cv;
+  bool finishing = false;
+  std::atomic<bool> hasFailed {false};
+  EventFD failureFD;
+
+  AssistedThread thread;
+};
+
+}
+
+#endif
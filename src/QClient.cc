@@ -23,21 +23,34 @@
 
 #include "qclient/QClient.hh"
 #include "qclient/Utils.hh"
+#include "qclient/MultiBuilder.hh"
 #include "qclient/network/HostResolver.hh"
 #include "qclient/network/AsyncConnector.hh"
 #include "network/NetworkStream.hh"
+#include "network/IoUring.hh"
 #include <unistd.h>
 #include <string.h>
 #include <poll.h>
 #include <signal.h>
 #include <fcntl.h>
+#include <sys/socket.h>
 #include <sstream>
 #include <iterator>
+#include <algorithm>
+#include <random>
 #include "qclient/Logger.hh"
 #include "WriterThread.hh"
 #include "EndpointDecider.hh"
 #include "ConnectionCore.hh"
+#include "ReceiveBufferSizer.hh"
+#include "ReconnectBackoff.hh"
+#include "LeaderHints.hh"
+#include "ParseStage.hh"
+#include "SingleFlight.hh"
+#include "StandbyConnection.hh"
+#include "Tracepoints.hh"
 #include "qclient/GlobalInterceptor.hh"
+#include "qclient/MemoryBudget.hh"
 
 //------------------------------------------------------------------------------
 //! Instantiate a few templates inside this compilation unit, to save compile
@@ -53,6 +66,11 @@ using namespace qclient;
 #define SSTR(message) static_cast<std::ostringstream&>(std::ostringstream().flush() << message).str()
 #define DBG(message) std::cerr << __FILE__ << ":" << __LINE__ << " -- " << #message << " = " << message << std::endl;
 
+static int64_t steadyNanoseconds() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 //------------------------------------------------------------------------------
 // Constructor taking host and port
 //-----------------------------------------------------------------------------
@@ -77,7 +95,33 @@ QClient::QClient(const Members& members_, Options &&opts)
 //------------------------------------------------------------------------------
 QClient::~QClient()
 {
+  // The watchdog may poke the event loop, stop it first. Hedged reads may
+  // still fire towards hedgeClient, which goes away before connectionCore.
+  watchdogThread.join();
+  connectionCore->stopTimers();
+
+  // Ask for termination first, so the event loop doesn't mistake the
+  // shutdown notification for a broken connection and reconnect.
+  eventLoopThread.stop();
   shutdownEventFD.notify();
+
+  if(eventLoopGroup) {
+    eventLoopGroup->detach(this);
+  }
+  else if(externalLoop) {
+    loopWatch(-1, 0);
+    loopCancelSchedule();
+  }
+
+  if(loopDriven()) {
+    if(groupState == GroupState::kConnected) {
+      notifyConnectionLost(0, "shutdown requested");
+    }
+
+    pendingConnector.reset();
+    feed(NULL, 0);
+  }
+
   eventLoopThread.join();
   cleanup(true);
 }
@@ -87,26 +131,569 @@ QClient::~QClient()
 // over the network
 //------------------------------------------------------------------------------
 void QClient::execute(QCallback *callback, EncodedRequest &&req) {
-  connectionCore->stage(callback, std::move(req));
+  if(!callback) {
+    return executeFireAndForget(std::move(req));
+  }
+
+  if(coalesces(req)) {
+    executeCoalesced(std::move(req), [callback](redisReplyPtr &&reply) {
+      callback->handleResponse(std::move(reply));
+    }, false);
+
+    return;
+  }
+
+  coreFor(req)->stage(callback, std::move(req));
 }
 
 std::future<redisReplyPtr> QClient::execute(EncodedRequest &&req) {
-  return connectionCore->stage(std::move(req));
+  if(coalesces(req)) {
+    std::shared_ptr<std::promise<redisReplyPtr>> prom = std::make_shared<std::promise<redisReplyPtr>>();
+    std::future<redisReplyPtr> fut = prom->get_future();
+
+    executeCoalesced(std::move(req), [prom](redisReplyPtr &&reply) {
+      prom->set_value(std::move(reply));
+    }, false);
+
+    return fut;
+  }
+
+  return coreFor(req)->stage(std::move(req));
+}
+
+//------------------------------------------------------------------------------
+// Execute, without anybody waiting for the reply
+//------------------------------------------------------------------------------
+void QClient::executeFireAndForget(EncodedRequest &&req) {
+  coreFor(req)->stage(nullptr, std::move(req));
+}
+
+//------------------------------------------------------------------------------
+// Execute, with a callable stored inside the staged request
+//------------------------------------------------------------------------------
+void QClient::execute(EncodedRequest &&req, ReplyCallback &&callback) {
+  if(coalesces(req)) {
+    executeCoalesced(std::move(req), std::move(callback), false);
+    return;
+  }
+
+  coreFor(req)->stage(std::move(callback), std::move(req));
+}
+
+//------------------------------------------------------------------------------
+// Execute, streaming a bulk string reply into the given sink
+//------------------------------------------------------------------------------
+void QClient::execute(QCallback *callback, EncodedRequest &&req, BulkSink *sink) {
+  coreFor(req)->stage(callback, std::move(req), 0u, sink);
+}
+
+std::future<redisReplyPtr> QClient::execute(EncodedRequest &&req, BulkSink *sink) {
+  return coreFor(req)->stage(std::move(req), 0u, sink);
+}
+
+//------------------------------------------------------------------------------
+// Execute, decoding an aggregate reply through the given decoder
+//------------------------------------------------------------------------------
+void QClient::execute(QCallback *callback, EncodedRequest &&req, ReplyDecoder *decoder) {
+  coreFor(req)->stage(callback, std::move(req), 0u, nullptr, decoder);
+}
+
+std::future<redisReplyPtr> QClient::execute(EncodedRequest &&req, ReplyDecoder *decoder) {
+  return coreFor(req)->stage(std::move(req), 0u, nullptr, decoder);
+}
+
+//------------------------------------------------------------------------------
+// Execute, marking the request as read-only
+//------------------------------------------------------------------------------
+std::future<redisReplyPtr> QClient::executeRead(EncodedRequest &&req) {
+  if(hedgeClient || singleFlight) {
+    std::shared_ptr<std::promise<redisReplyPtr>> prom = std::make_shared<std::promise<redisReplyPtr>>();
+    std::future<redisReplyPtr> fut = prom->get_future();
+
+    executeRead(std::move(req), [prom](redisReplyPtr &&reply) {
+      prom->set_value(std::move(reply));
+    });
+
+    return fut;
+  }
+
+  return routeRead()->stage(std::move(req));
+}
+
+void QClient::executeRead(QCallback *callback, EncodedRequest &&req) {
+  if(hedgeClient || singleFlight) {
+    executeRead(std::move(req), [callback](redisReplyPtr &&reply) {
+      callback->handleResponse(std::move(reply));
+    });
+
+    return;
+  }
+
+  routeRead()->stage(callback, std::move(req));
+}
+
+void QClient::executeRead(EncodedRequest &&req, ReplyCallback &&callback) {
+  if(singleFlight) {
+    executeCoalesced(std::move(req), std::move(callback), true);
+    return;
+  }
+
+  issueRead(std::move(req), std::move(callback));
+}
+
+//------------------------------------------------------------------------------
+// Issue a read, hedged if enabled
+//------------------------------------------------------------------------------
+void QClient::issueRead(EncodedRequest &&req, ReplyCallback &&callback) {
+  if(hedgeClient) {
+    executeHedged(std::move(req), std::move(callback));
+    return;
+  }
+
+  routeRead()->stage(std::move(callback), std::move(req));
+}
+
+//------------------------------------------------------------------------------
+// Should the given request, issued through execute, go through the
+// single-flight table?
+//------------------------------------------------------------------------------
+bool QClient::coalesces(const EncodedRequest &req) const {
+  return singleFlight && ReadRouting::isReadOnly(req);
+}
+
+//------------------------------------------------------------------------------
+// Join an identical read in flight, or issue this one. Reads issued through
+// execute only take the follower path if read routing uses the command
+// table, as they would without single-flight.
+//------------------------------------------------------------------------------
+void QClient::executeCoalesced(EncodedRequest &&req, ReplyCallback &&callback, bool explicitRead) {
+  if(singleFlight->join(req, callback)) {
+    return;
+  }
+
+  if(explicitRead) {
+    issueRead(std::move(req), std::move(callback));
+    return;
+  }
+
+  ConnectionCore *core = options.readRouting.usesCommandTable() ? routeRead() : this->core();
+  core->stage(std::move(callback), std::move(req));
+}
+
+//------------------------------------------------------------------------------
+// Copy a request, for the second attempt of a hedged read
+//------------------------------------------------------------------------------
+static EncodedRequest duplicateRequest(const EncodedRequest &req) {
+  char *buff = (char*) malloc(req.getLen());
+
+  size_t pos = 0;
+  for(size_t i = 0; i < req.getSegmentCount(); i++) {
+    EncodedRequest::Segment segment = req.getSegment(i);
+    memcpy(buff + pos, segment.data, segment.len);
+    pos += segment.len;
+  }
+
+  return EncodedRequest(buff, req.getLen());
+}
+
+//------------------------------------------------------------------------------
+// A hedged read: Once the hedging delay passes without a reply, the copy of
+// the request goes out over the hedge connection, and whichever reply comes
+// first completes the read. If the hedge connection is at its backpressure
+// limit, there's simply no second attempt.
+//------------------------------------------------------------------------------
+class HedgedRead : public RequestDeadline, public std::enable_shared_from_this<HedgedRead> {
+public:
+  HedgedRead(ReplyCallback &&cb, std::chrono::steady_clock::time_point deadline,
+    ConnectionCore *core, EncodedRequest &&req)
+  : RequestDeadline(std::move(cb), deadline), hedgeCore(core), copy(std::move(req)) {}
+
+  void expire() override {
+    if(isCompleted()) {
+      return;
+    }
+
+    std::shared_ptr<HedgedRead> self = shared_from_this();
+    hedgeCore->tryStage([self](redisReplyPtr &&reply) {
+      self->complete(std::move(reply));
+    }, std::move(copy));
+  }
+
+private:
+  ConnectionCore *hedgeCore;
+  EncodedRequest copy;
+};
+
+//------------------------------------------------------------------------------
+// The hedging delay - percentiles are costly to compute, so it's refreshed
+// at most once every 100ms, by whichever thread notices first.
+//------------------------------------------------------------------------------
+std::chrono::nanoseconds QClient::getHedgeDelay() {
+  const HedgedReads &hedging = options.hedgedReads;
+  if(hedging.getMode() == HedgedReads::Mode::kAfterDelay) {
+    return hedging.getMinDelay();
+  }
+
+  int64_t now = steadyNanoseconds();
+  int64_t updatedAt = hedgeDelayUpdatedAt.load(std::memory_order_relaxed);
+
+  if(now - updatedAt >= 100000000 && hedgeDelayUpdatedAt.compare_exchange_strong(updatedAt, now)) {
+    LatencySnapshot network = connectionCore->getLatencyStats().network;
+    std::chrono::nanoseconds delay = hedging.getMaxDelay();
+
+    if(network.count >= 100) {
+      delay = std::chrono::nanoseconds(network.percentile(hedging.getPercentile()));
+      delay = std::max<std::chrono::nanoseconds>(delay, hedging.getMinDelay());
+      delay = std::min<std::chrono::nanoseconds>(delay, hedging.getMaxDelay());
+    }
+
+    hedgeDelay.store(delay.count(), std::memory_order_relaxed);
+  }
+
+  return std::chrono::nanoseconds(hedgeDelay.load(std::memory_order_relaxed));
+}
+
+//------------------------------------------------------------------------------
+// Issue a read, and schedule its second attempt
+//------------------------------------------------------------------------------
+void QClient::executeHedged(EncodedRequest &&req, ReplyCallback &&callback) {
+  std::shared_ptr<HedgedRead> hedged = std::make_shared<HedgedRead>(std::move(callback),
+    std::chrono::steady_clock::now() + getHedgeDelay(), hedgeClient->core(),
+    duplicateRequest(req));
+
+  routeRead()->stage([hedged](redisReplyPtr &&reply) {
+    hedged->complete(std::move(reply));
+  }, std::move(req));
+
+  connectionCore->scheduleTimer(std::move(hedged));
+}
+
+//------------------------------------------------------------------------------
+// Execute, with the given priority
+//------------------------------------------------------------------------------
+std::future<redisReplyPtr> QClient::executeWithPriority(Priority priority, EncodedRequest &&req) {
+  return coreFor(priority, req)->stage(std::move(req));
+}
+
+void QClient::executeWithPriority(Priority priority, QCallback *callback, EncodedRequest &&req) {
+  coreFor(priority, req)->stage(callback, std::move(req));
+}
+
+void QClient::executeWithPriority(Priority priority, EncodedRequest &&req, ReplyCallback &&callback) {
+  coreFor(priority, req)->stage(std::move(callback), std::move(req));
+}
+
+//------------------------------------------------------------------------------
+// Execute, with a deadline - the future is fulfilled through a callback, as
+// expiry completes requests out of order.
+//------------------------------------------------------------------------------
+std::future<redisReplyPtr> QClient::executeWithDeadline(EncodedRequest &&req,
+  std::chrono::steady_clock::time_point deadline) {
+
+  std::shared_ptr<std::promise<redisReplyPtr>> prom = std::make_shared<std::promise<redisReplyPtr>>();
+  std::future<redisReplyPtr> fut = prom->get_future();
+
+  executeWithDeadline(std::move(req), deadline, [prom](redisReplyPtr &&reply) {
+    prom->set_value(std::move(reply));
+  });
+
+  return fut;
+}
+
+void QClient::executeWithDeadline(EncodedRequest &&req,
+  std::chrono::steady_clock::time_point deadline, ReplyCallback &&callback) {
+  coreFor(req)->stage(std::move(callback), std::move(req), deadline);
+}
+
+//------------------------------------------------------------------------------
+// Execute, cancellable - as with deadlines, the future is fulfilled through a
+// callback.
+//------------------------------------------------------------------------------
+CancellationHandle QClient::executeCancellable(EncodedRequest &&req,
+  ReplyCallback &&callback) {
+  return coreFor(req)->stageCancellable(std::move(callback), std::move(req));
+}
+
+std::future<redisReplyPtr> QClient::executeCancellable(EncodedRequest &&req,
+  CancellationHandle &handle) {
+
+  std::shared_ptr<std::promise<redisReplyPtr>> prom = std::make_shared<std::promise<redisReplyPtr>>();
+  std::future<redisReplyPtr> fut = prom->get_future();
+
+  handle = executeCancellable(std::move(req), [prom](redisReplyPtr &&reply) {
+    prom->set_value(std::move(reply));
+  });
+
+  return fut;
+}
+
+//------------------------------------------------------------------------------
+// Pick the lane for a request. Anything sent over a lane counts as a write,
+// as far as read routing is concerned.
+//------------------------------------------------------------------------------
+ConnectionCore* QClient::coreFor(Priority priority, const EncodedRequest &req) {
+  QClient *lane = nullptr;
+
+  if(priority == Priority::kControl) {
+    lane = controlClient.get();
+  }
+  else if(priority == Priority::kBulk) {
+    lane = bulkClient.get();
+  }
+
+  if(!lane) {
+    return coreFor(req);
+  }
+
+  noteWrite();
+  return lane->core();
+}
+
+//------------------------------------------------------------------------------
+// Pick the connection for a request, if read routing is enabled. Without the
+// command table, anything not issued through executeRead counts as a write.
+//------------------------------------------------------------------------------
+ConnectionCore* QClient::routeRequest(const EncodedRequest &req) {
+  if(options.readRouting.usesCommandTable() && ReadRouting::isReadOnly(req)) {
+    return routeRead();
+  }
+
+  noteWrite();
+  return core();
+}
+
+//------------------------------------------------------------------------------
+// Reads go to followers, unless there's been a recent write
+//------------------------------------------------------------------------------
+ConnectionCore* QClient::routeRead() {
+  if(!readClient) {
+    return core();
+  }
+
+  std::chrono::nanoseconds sinceWrite(steadyNanoseconds() - lastWriteAt.load(std::memory_order_relaxed));
+  if(sinceWrite < options.readRouting.getLeaderAfterWrite()) {
+    return core();
+  }
+
+  return readClient->core();
+}
+
+//------------------------------------------------------------------------------
+// Remember when the last write was issued
+//------------------------------------------------------------------------------
+void QClient::noteWrite() {
+  if(readClient) {
+    lastWriteAt.store(steadyNanoseconds(), std::memory_order_relaxed);
+  }
+
+  if(singleFlight) {
+    singleFlight->forget();
+  }
+}
+
+//------------------------------------------------------------------------------
+// Non-blocking execute: returns false if the backpressure limit has been
+// reached, without issuing the request.
+//------------------------------------------------------------------------------
+bool QClient::tryExecute(QCallback *callback, EncodedRequest &&req) {
+  return coreFor(req)->tryStage(callback, std::move(req));
+}
+
+//------------------------------------------------------------------------------
+// Register a one-shot notification for when the backlog drains below the
+// low-water mark.
+//------------------------------------------------------------------------------
+void QClient::notifyWhenCapacityAvailable(std::function<void()> callback) {
+  connectionCore->notifyWhenCapacityAvailable(std::move(callback));
+}
+
+//------------------------------------------------------------------------------
+// Number of requests issued, but not yet acknowledged by the server.
+//------------------------------------------------------------------------------
+int64_t QClient::getPendingRequests() const {
+  return connectionCore->getPendingRequests();
+}
+
+//------------------------------------------------------------------------------
+// Age of the oldest pending request, as far as progress is concerned
+//------------------------------------------------------------------------------
+std::chrono::milliseconds QClient::getOldestPendingAge() const {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+    connectionCore->getOldestPendingAge());
+}
+
+//------------------------------------------------------------------------------
+// Latency distribution of the requests issued so far
+//------------------------------------------------------------------------------
+LatencyStats QClient::getLatencyStats() const {
+  return connectionCore->getLatencyStats();
+}
+
+void QClient::resetLatencyStats() {
+  connectionCore->resetLatencyStats();
+}
+
+//------------------------------------------------------------------------------
+// Operational counters
+//------------------------------------------------------------------------------
+ClientStatistics QClient::getStatistics() const {
+  ClientStatistics stats = connectionCore->getStatistics();
+
+  if(singleFlight) {
+    stats.coalescedReads = singleFlight->getCoalesced();
+  }
+
+  return stats;
 }
 
 #if HAVE_FOLLY == 1
 folly::Future<redisReplyPtr> QClient::follyExecute(EncodedRequest &&req) {
-  return connectionCore->follyStage(std::move(req));
+  return coreFor(req)->follyStage(std::move(req));
+}
+
+folly::Future<redisReplyPtr> QClient::follyExecute(EncodedRequest &&req, folly::Executor *executor) {
+  return coreFor(req)->follySemiStage(std::move(req)).via(folly::getKeepAliveToken(executor));
+}
+
+folly::SemiFuture<redisReplyPtr> QClient::follySemiExecute(EncodedRequest &&req) {
+  return coreFor(req)->follySemiStage(std::move(req));
 }
 #endif
 
+//------------------------------------------------------------------------------
+// Execute, returning a pooled future. The future's slot is the callback.
+//------------------------------------------------------------------------------
+ReplyFuture QClient::pooledExecute(EncodedRequest &&req) {
+  ReplyFuture fut = ReplyFuture::create();
+  execute(fut.getCallback(), std::move(req));
+  return fut;
+}
+
+//------------------------------------------------------------------------------
+// Batch: Requests are only collected here, commit stages them all at once.
+//------------------------------------------------------------------------------
+QClient::Batch::Batch(QClient &cl) : client(cl) {}
+
+QClient::Batch::~Batch() {
+  commit();
+}
+
+std::future<redisReplyPtr> QClient::Batch::execute(EncodedRequest &&req) {
+  std::shared_ptr<std::promise<redisReplyPtr>> prom = std::make_shared<std::promise<redisReplyPtr>>();
+  std::future<redisReplyPtr> fut = prom->get_future();
+
+  execute(std::move(req), [prom](redisReplyPtr &&reply) {
+    prom->set_value(std::move(reply));
+  });
+
+  return fut;
+}
+
+void QClient::Batch::execute(QCallback *callback, EncodedRequest &&req) {
+  execute(std::move(req), [callback](redisReplyPtr &&reply) {
+    callback->handleResponse(std::move(reply));
+  });
+}
+
+void QClient::Batch::execute(EncodedRequest &&req, ReplyCallback &&callback) {
+  requests.emplace_back(std::move(req));
+  callbacks.emplace_back(std::move(callback));
+}
+
+//------------------------------------------------------------------------------
+// Batch: Everything goes to the leader, and counts as a write as far as read
+// routing is concerned.
+//------------------------------------------------------------------------------
+void QClient::Batch::commit() {
+  if(requests.empty()) {
+    return;
+  }
+
+  client.noteWrite();
+  client.core()->stage(callbacks, requests);
+}
+
+//------------------------------------------------------------------------------
+// Completes an EVALSHA: On NOSCRIPT, loads the script, and issues the EVALSHA
+// once more right behind the load, on the same connection.
+//------------------------------------------------------------------------------
+class ScriptFallback {
+public:
+  ScriptFallback(ConnectionCore *c, std::shared_ptr<ScriptRegistry> reg,
+    std::string &&s, EncodedRequest &&req, ReplyCallback &&cb)
+  : core(c), registry(std::move(reg)), sha(std::move(s)), retry(std::move(req)),
+    callback(std::move(cb)) {}
+
+  void operator()(redisReplyPtr &&reply) {
+    std::string script;
+
+    if(!isNoScript(reply) || !registry->get(sha, script)) {
+      callback(std::move(reply));
+      return;
+    }
+
+    core->stage([](redisReplyPtr &&) {}, EncodedRequest::make("SCRIPT", "LOAD", script));
+    core->stage(std::move(callback), std::move(retry));
+  }
+
+private:
+  static bool isNoScript(const redisReplyPtr &reply) {
+    return reply && reply->type == REDIS_REPLY_ERROR && reply->len >= 8 &&
+           strncmp(reply->str, "NOSCRIPT", 8) == 0;
+  }
+
+  ConnectionCore *core;
+  std::shared_ptr<ScriptRegistry> registry;
+  std::string sha;
+  EncodedRequest retry;
+  ReplyCallback callback;
+};
+
+//------------------------------------------------------------------------------
+// Run a Lua script through EVALSHA, falling back to SCRIPT LOAD
+//------------------------------------------------------------------------------
+std::future<redisReplyPtr> QClient::evalScript(const std::string &script,
+  const std::vector<std::string> &keys, const std::vector<std::string> &args) {
+
+  std::shared_ptr<std::promise<redisReplyPtr>> prom = std::make_shared<std::promise<redisReplyPtr>>();
+  std::future<redisReplyPtr> fut = prom->get_future();
+
+  evalScript(script, keys, args, [prom](redisReplyPtr &&reply) {
+    prom->set_value(std::move(reply));
+  });
+
+  return fut;
+}
+
+void QClient::evalScript(const std::string &script, const std::vector<std::string> &keys,
+  const std::vector<std::string> &args, ReplyCallback &&callback) {
+
+  std::string sha = scriptRegistry->add(script);
+
+  std::vector<std::string> request;
+  request.reserve(3 + keys.size() + args.size());
+  request.emplace_back("EVALSHA");
+  request.emplace_back(sha);
+  request.emplace_back(std::to_string(keys.size()));
+  request.insert(request.end(), keys.begin(), keys.end());
+  request.insert(request.end(), args.begin(), args.end());
+
+  EncodedRequest req(request);
+  ConnectionCore *core = coreFor(req);
+  EncodedRequest retry = duplicateRequest(req);
+
+  core->stage(ScriptFallback(core, scriptRegistry, std::move(sha), std::move(retry),
+    std::move(callback)), std::move(req));
+}
+
 //------------------------------------------------------------------------------
 // Execute a MULTI block.
 //------------------------------------------------------------------------------
 void QClient::execute(QCallback *callback, std::deque<EncodedRequest> &&reqs) {
   size_t ignoredResponses = reqs.size() + 1;
+  noteWrite();
 
-  connectionCore->stage(
+  core()->stage(
     callback,
     EncodedRequest::fuseIntoBlockAndSurround(std::move(reqs)),
     ignoredResponses
@@ -115,8 +702,9 @@ void QClient::execute(QCallback *callback, std::deque<EncodedRequest> &&reqs) {
 
 std::future<redisReplyPtr> QClient::execute(std::deque<EncodedRequest> &&reqs) {
   size_t ignoredResponses = reqs.size() + 1;
+  noteWrite();
 
-  return connectionCore->stage(
+  return core()->stage(
     EncodedRequest::fuseIntoBlockAndSurround(std::move(reqs)),
     ignoredResponses
   );
@@ -125,14 +713,38 @@ std::future<redisReplyPtr> QClient::execute(std::deque<EncodedRequest> &&reqs) {
 #if HAVE_FOLLY == 1
 folly::Future<redisReplyPtr> QClient::follyExecute(std::deque<EncodedRequest> &&req) {
   size_t ignoredResponses = req.size() + 1;
+  noteWrite();
 
-  return connectionCore->follyStage(
+  return core()->follyStage(
     EncodedRequest::fuseIntoBlockAndSurround(std::move(req)),
     ignoredResponses
   );
 }
 #endif
 
+//------------------------------------------------------------------------------
+// Execute a MULTI block, already encoded by MultiBuilder.
+//------------------------------------------------------------------------------
+void QClient::execute(QCallback *callback, MultiBuilder &&multi) {
+  size_t ignoredResponses = multi.size() + 1;
+  noteWrite();
+  core()->stage(callback, multi.release(), ignoredResponses);
+}
+
+std::future<redisReplyPtr> QClient::execute(MultiBuilder &&multi) {
+  size_t ignoredResponses = multi.size() + 1;
+  noteWrite();
+  return core()->stage(multi.release(), ignoredResponses);
+}
+
+#if HAVE_FOLLY == 1
+folly::Future<redisReplyPtr> QClient::follyExecute(MultiBuilder &&multi) {
+  size_t ignoredResponses = multi.size() + 1;
+  noteWrite();
+  return core()->follyStage(multi.release(), ignoredResponses);
+}
+#endif
+
 //------------------------------------------------------------------------------
 // Event loop for the client
 //------------------------------------------------------------------------------
@@ -149,16 +761,223 @@ void QClient::startEventLoop()
     options.handshake.reset(new PingHandshake());
   }
 
-  hostResolver = std::make_unique<HostResolver>(options.logger.get());
-  endpointDecider = std::make_unique<EndpointDecider>(options.logger.get(), hostResolver.get(), members);
+  scriptRegistry = std::make_shared<ScriptRegistry>();
+  if(options.scriptPriming) {
+    options.chainHandshake(std::unique_ptr<Handshake>(new ScriptLoadHandshake(scriptRegistry)));
+  }
+
+  //----------------------------------------------------------------------------
+  // The capability handshake reports back to this object, so it's kept out
+  // of options.handshake - clones of it, such as for follower connections,
+  // must not inherit it.
+  //----------------------------------------------------------------------------
+  Handshake *handshake = options.handshake.get();
+  if(options.negotiateCapabilities) {
+    capabilityCache = options.capabilityCache ? options.capabilityCache : std::make_shared<CapabilityCache>();
+
+    std::unique_ptr<Handshake> negotiation(new CapabilityHandshake(
+      [this](const ServerCapabilities &caps) { capabilitiesNegotiated(caps); },
+      options.messageListener && !options.exclusivePubsub));
+
+    if(options.handshake) {
+      negotiatingHandshake.reset(new HandshakeChainer(options.handshake->clone(), std::move(negotiation)));
+    }
+    else {
+      negotiatingHandshake = std::move(negotiation);
+    }
+
+    handshake = negotiatingHandshake.get();
+  }
+
+  receiveSizer.reset(new ReceiveBufferSizer(options.maxReceiveBufferSize));
+  reconnectBackoff.reset(new ReconnectBackoff(options.reconnectStrategy));
+  responseBuilder.setArenaMode(options.replyArena);
+  responseBuilder.setMemoryResource(options.memoryResource);
+  responseBuilder.setLargeStringThreshold(options.zeroCopyReplyThreshold);
+  responseBuilder.setBulkSinkLookup([this]() {
+    return connectionCore->getBulkSinkForNextResponse();
+  });
+  responseBuilder.setReplyDecoderLookup([this]() {
+    return connectionCore->getReplyDecoderForNextResponse();
+  });
+  hostResolver = std::make_unique<HostResolver>(options.logger.get(), options.dnsCache);
+  endpointDecider = std::make_unique<EndpointDecider>(options.logger.get(), hostResolver.get(), members,
+    options.transparentRedirects ? &LeaderHints::global() : nullptr, options.latencyProber.get());
 
   // Give some leeway when starting up before declaring the cluster broken.
   lastAvailable = std::chrono::steady_clock::now();
 
   connectionCore.reset(new ConnectionCore(options.logger.get(),
-    options.handshake.get(), options.backpressureStrategy, options.transparentRedirects, options.messageListener.get(), options.exclusivePubsub));
-  writerThread.reset(new WriterThread(options.logger.get(), *connectionCore.get(), shutdownEventFD));
+    handshake, options.backpressureStrategy, options.transparentRedirects, options.messageListener.get(), options.exclusivePubsub,
+    options.callbackThreads));
+  connectionCore->setQueueBlockSizes(options.queueInitialBlockSize, options.queueMaxBlockSize);
+  connectionCore->setMemoryResource(options.memoryResource);
+  connectionCore->setQueueSpinIterations(options.queueSpinIterations);
+  connectionCore->setOptimisticHandshake(options.optimisticHandshake);
+  connectionCore->setTracer(options.tracer.get());
+  connectionCore->setWriteCombining(options.writeCombining);
+  connectionCore->setReplayPacing(options.replayPacing);
+  connectionCore->setCpuAffinity(options.cpuAffinity);
+  connectionCore->setMemoryBudget(options.memoryBudget);
+  connectionCore->setOffloadPushMessages(options.offloadPushMessages && !options.exclusivePubsub);
+
+  if(options.externalEventLoop) {
+    connectionCore->setInlineCallbacks(true);
+    connectionCore->setStagingListener([this]() { requestWakeup(); });
+  }
+
+  writerThread.reset(new WriterThread(options.logger.get(), *connectionCore.get(), shutdownEventFD, options.ioBackend));
+  writerThread->setCpuAffinity(options.cpuAffinity);
+  writerThread->setZeroCopyThreshold(options.zeroCopyThreshold);
+  writerThread->setRateLimiter(options.rateLimiter);
+
+  followerStart = std::random_device()();
+
+  if(options.readRouting.active() && !(options.messageListener && options.exclusivePubsub)) {
+    startReadClient();
+  }
+
+  if(options.priorityLanes.active() && !(options.messageListener && options.exclusivePubsub)) {
+    startLaneClients();
+  }
+
+  if(options.hedgedReads.active() && !(options.messageListener && options.exclusivePubsub)) {
+    hedgeDelay = std::chrono::nanoseconds(options.hedgedReads.getMaxDelay()).count();
+    hedgeClient = makeFollowerClient(1);
+  }
+
+  if(options.singleFlightReads && !(options.messageListener && options.exclusivePubsub)) {
+    singleFlight = std::make_shared<SingleFlight>();
+  }
+
+  // A subscriber must connect to receive anything, lazy or not
+  if(options.lazyConnect && !options.messageListener) {
+    lazyPending = true;
+    return;
+  }
+
+  startConnecting();
+}
+
+//------------------------------------------------------------------------------
+// Spawn the threads, and start connecting - right away, or on the first
+// request with lazy connect.
+//------------------------------------------------------------------------------
+void QClient::startConnecting()
+{
+  lastAvailable = std::chrono::steady_clock::now();
+
+  if(options.stuckRequestThreshold.count() > 0) {
+    watchdogThread.reset(&QClient::watchdog, this);
+    watchdogThread.setAffinity(options.cpuAffinity);
+  }
+
+  if(options.externalEventLoop) {
+    externalLoop = options.externalEventLoop.get();
+    requestWakeup();
+    return;
+  }
+
+  if(options.eventLoopGroup && EventLoopGroup::supported()) {
+    eventLoopGroup = options.eventLoopGroup.get();
+    eventLoopGroup->attach(this);
+    eventLoopGroup->wakeup(this);
+    return;
+  }
+
+  if(options.warmStandby && !(options.messageListener && options.exclusivePubsub)) {
+    standby.reset(new StandbyConnection(options.logger.get(), members,
+      options.tlsconfig, options.handshake.get(), options.dnsCache,
+      options.tcpTimeout, options.standbyPingInterval, options.socketProfile));
+  }
+
   eventLoopThread.reset(&QClient::eventLoop, this);
+
+  if(!eventLoopThread.setAffinity(options.cpuAffinity)) {
+    QCLIENT_LOG(options.logger, LogLevel::kWarn, "Could not set the CPU affinity of internal threads");
+  }
+}
+
+//------------------------------------------------------------------------------
+// Start the connection serving reads.
+//------------------------------------------------------------------------------
+void QClient::startReadClient()
+{
+  readClient = makeFollowerClient(0);
+}
+
+//------------------------------------------------------------------------------
+// Create a connection towards followers. It goes through the members
+// starting from a random one, so that the read load of many clients spreads
+// out over the followers - offset by the given amount, so that several such
+// connections prefer different members - unless a latency prober ranks them
+// by distance instead. It activates stale reads, so followers serve it
+// instead of redirecting to the leader.
+//------------------------------------------------------------------------------
+std::unique_ptr<QClient> QClient::makeFollowerClient(size_t offset)
+{
+  std::vector<Endpoint> endpoints = members.getEndpoints();
+  if(endpoints.size() > 1) {
+    size_t start = (followerStart + offset) % endpoints.size();
+    std::rotate(endpoints.begin(), endpoints.begin() + start, endpoints.end());
+  }
+
+  Options followerOptions = options.clone();
+  followerOptions.readRouting = ReadRouting::LeaderOnly();
+  followerOptions.priorityLanes = PriorityLanes::Disabled();
+  followerOptions.hedgedReads = HedgedReads::Disabled();
+  followerOptions.singleFlightReads = false;
+  followerOptions.scriptPriming = false;
+  followerOptions.transparentRedirects = false;
+  followerOptions.messageListener.reset();
+  followerOptions.warmStandby = false;
+  followerOptions.externalEventLoop.reset();
+  followerOptions.chainHandshake(std::unique_ptr<Handshake>(new ActivateStaleReadsHandshake()));
+
+  return std::unique_ptr<QClient>(new QClient(Members(endpoints), std::move(followerOptions)));
+}
+
+//------------------------------------------------------------------------------
+// Start the dedicated connections of the control and bulk lanes, each with
+// its own backpressure budget.
+//------------------------------------------------------------------------------
+void QClient::startLaneClients()
+{
+  Options controlOptions = options.clone();
+  controlOptions.priorityLanes = PriorityLanes::Disabled();
+  controlOptions.readRouting = ReadRouting::LeaderOnly();
+  controlOptions.hedgedReads = HedgedReads::Disabled();
+  controlOptions.singleFlightReads = false;
+  controlOptions.scriptPriming = false;
+  controlOptions.messageListener.reset();
+  controlOptions.externalEventLoop.reset();
+  controlOptions.backpressureStrategy = options.priorityLanes.getControlBackpressure();
+
+  Options bulkOptions = controlOptions.clone();
+  bulkOptions.backpressureStrategy = options.priorityLanes.getBulkBackpressure();
+
+  controlClient.reset(new QClient(members, std::move(controlOptions)));
+  bulkClient.reset(new QClient(members, std::move(bulkOptions)));
+}
+
+//------------------------------------------------------------------------------
+// Bring the memory budget up to date with what the response builder holds
+//------------------------------------------------------------------------------
+void QClient::accountUnparsedInput()
+{
+  if(!options.memoryBudget) return;
+
+  size_t buffered = responseBuilder.getBufferedBytes();
+  if(buffered > unparsedInputCharged) {
+    options.memoryBudget->charge(MemoryBudget::Category::kUnparsedInput,
+      buffered - unparsedInputCharged);
+  }
+  else if(buffered < unparsedInputCharged) {
+    options.memoryBudget->release(MemoryBudget::Category::kUnparsedInput,
+      unparsedInputCharged - buffered);
+  }
+
+  unparsedInputCharged = buffered;
 }
 
 //------------------------------------------------------------------------------
@@ -167,8 +986,110 @@ void QClient::startEventLoop()
 bool QClient::feed(const char* buf, size_t len)
 {
   responseBuilder.feed(buf, len);
+  return processResponses();
+}
+
+//------------------------------------------------------------------------------
+// Receive bytes from the socket straight into the response builder, sized
+// adaptively.
+//------------------------------------------------------------------------------
+RecvStatus QClient::recvIntoParser()
+{
+  size_t requested = receiveSizer->get();
+  size_t len = requested;
+
+  char *buffer = responseBuilder.getWriteBuffer(len);
+  if(!buffer) {
+    return RecvStatus(false, ENOMEM, 0);
+  }
+
+  RecvStatus status = networkStream->recv(buffer, len, 0);
+  if(status.bytesRead > 0) {
+    responseBuilder.commitWrite(status.bytesRead);
+    connectionCore->getCounters().bytesReceived.add(status.bytesRead);
+
+    // A read cut short by the parser says nothing about the traffic.
+    if(len == requested) {
+      receiveSizer->record(status.bytesRead);
+    }
+  }
+
+  return status;
+}
+
+//------------------------------------------------------------------------------
+// Receive bytes from the socket into the parse stage ring, for the parse
+// thread to pick up.
+//------------------------------------------------------------------------------
+RecvStatus QClient::recvIntoParseStage(ParseStage &stage)
+{
+  size_t requested = receiveSizer->get();
+  size_t len = requested;
+
+  char *buffer = stage.getWriteBuffer(len);
+  if(!buffer) {
+    // Parse stage has failed, the event loop will notice.
+    return RecvStatus(true, 0, 0);
+  }
+
+  RecvStatus status = networkStream->recv(buffer, len, 0);
+  if(status.bytesRead > 0) {
+    stage.commitWrite(status.bytesRead);
+    connectionCore->getCounters().bytesReceived.add(status.bytesRead);
+
+    if(len == requested) {
+      receiveSizer->record(status.bytesRead);
+    }
+  }
+
+  return status;
+}
 
+//------------------------------------------------------------------------------
+// Pull all complete responses out of the response builder
+//------------------------------------------------------------------------------
+bool QClient::processResponses()
+{
   while (true) {
+    //--------------------------------------------------------------------------
+    // The OK / QUEUED responses of a MULTI block are only validated, skip them
+    // without building a reply. Anything unexpected is pulled in full, and
+    // reported by the connection handler.
+    //--------------------------------------------------------------------------
+    size_t skippableLen = 0;
+    const char *skippable = connectionCore->getSkippableStatusForNextResponse(skippableLen);
+
+    if(skippable) {
+      ResponseBuilder::Status skipped = responseBuilder.skipStatus(skippable, skippableLen);
+
+      if(skipped == ResponseBuilder::Status::kOk) {
+        connectionCore->skippedResponse();
+        continue;
+      }
+
+      if(skipped == ResponseBuilder::Status::kIncomplete) {
+        accountUnparsedInput();
+        return true;
+      }
+    }
+    else if(connectionCore->nextResponseIsFireAndForget()) {
+      //------------------------------------------------------------------------
+      // Nobody is waiting for this one - drop it unbuilt, unless it's an
+      // error, or anything else worth a closer look.
+      //------------------------------------------------------------------------
+      ResponseBuilder::Status skipped = responseBuilder.skipSimple();
+
+      if(skipped == ResponseBuilder::Status::kOk) {
+        connectionCore->skippedFireAndForget();
+        continue;
+      }
+
+      if(skipped == ResponseBuilder::Status::kIncomplete) {
+        accountUnparsedInput();
+        return true;
+      }
+    }
+
     redisReplyPtr rr;
     ResponseBuilder::Status status = responseBuilder.pull(rr);
 
@@ -179,10 +1100,12 @@ bool QClient::feed(const char* buf, size_t len)
     if(status == ResponseBuilder::Status::kIncomplete) {
       // We need more bytes before a full response can be built, go back
       // to the event loop to pull more bytes.
+      accountUnparsedInput();
       return true;
     }
 
     // --- We have a new response from the server!
+    QCLIENT_TRACE(reply, rr.get(), rr->type, rr->len);
 
     // Is this a redirect?
     if (options.transparentRedirects && rr->type == REDIS_REPLY_ERROR &&
@@ -193,6 +1116,8 @@ bool QClient::feed(const char* buf, size_t len)
 
       if (response.size() == 3 && parseServer(response[2], redirect)) {
         endpointDecider->registerRedirection(Endpoint(redirect.host, redirect.port));
+        connectionCore->getCounters().redirects.add(1);
+        QCLIENT_TRACE(redirect, redirect.host.c_str(), redirect.port);
         return false;
       }
     }
@@ -204,6 +1129,10 @@ bool QClient::feed(const char* buf, size_t len)
     }
 
     // We're all good, satisfy request.
+    if(!successfulResponses) {
+      endpointDecider->registerConnectionSuccess(connectedEndpoint);
+    }
+
     successfulResponses = true;
   }
 
@@ -262,6 +1191,7 @@ void QClient::cleanup(bool shutdown)
   networkStream.reset();
 
   responseBuilder.restart();
+  accountUnparsedInput();
   successfulResponsesEver = successfulResponsesEver | successfulResponses;
   successfulResponses = false;
 
@@ -285,35 +1215,194 @@ void QClient::cleanup(bool shutdown)
 //------------------------------------------------------------------------------
 void QClient::connectTCP()
 {
-  // TODO(gbitzes): Fix fault injection eventually..
-  // if(faultInjector.hasPartition(untranslatedTargetEndpoint)) {
-  //   networkStream.reset();
-  //   return;
-  // }
+  if(!takeStandby()) {
+    int fd = options.parallelConnect ? connectParallel() : connectSingle();
+    if(fd < 0) {
+      return;
+    }
+
+    networkStream.reset(new NetworkStream(fd, options.tlsconfig));
+    if(!networkStream->ok()) {
+      return;
+    }
+
+    //--------------------------------------------------------------------------
+    // Before anything else goes out, offer a shared memory channel if the
+    // server is on this host. A refusal leaves the socket as it was.
+    //--------------------------------------------------------------------------
+    if(options.sharedMemoryRingSize > 0 && connectedEndpoint.isUnix() &&
+       !options.tlsconfig.active) {
+      networkStream->upgradeToSharedMemory(options.sharedMemoryRingSize,
+        options.tcpTimeout);
+
+      if(!networkStream->ok()) {
+        return;
+      }
+    }
+  }
+
+  //----------------------------------------------------------------------------
+  // Only now do we know who's on the other end - drop the connection if
+  // the fault injector won't let us talk to them.
+  //----------------------------------------------------------------------------
+  if(faultInjector.hasPartition(connectedEndpoint)) {
+    networkStream.reset();
+    return;
+  }
+
+  networkStream->setLinkShaper(faultInjector.getLinkShaper(connectedEndpoint));
 
+  if(standby) {
+    standby->setActiveEndpoint(connectedEndpoint);
+  }
+
+  applyBusyPoll();
+  loadCachedCapabilities();
+  connectionCore->connectionEstablished();
+  notifyConnectionEstablished();
+  writerThread->activate(networkStream.get());
+}
+
+//------------------------------------------------------------------------------
+// Connect to the next endpoint in line. Returns the connected file
+// descriptor, or -1.
+//------------------------------------------------------------------------------
+int QClient::connectSingle()
+{
   ServiceEndpoint endpoint;
 
   if(!endpointDecider->getNextEndpoint(endpoint)) {
-    return;
+    return -1;
   }
 
-  AsyncConnector connector(endpoint);
+  AsyncConnector connector(endpoint, options.socketProfile);
   if(!connector.blockUntilReady(shutdownEventFD.getFD(), options.tcpTimeout)) {
-    return;
+    return -1;
   }
 
   if(!connector.ok()) {
     QCLIENT_LOG(options.logger, LogLevel::kInfo, "Encountered an error when connecting to " << endpoint.getString() << ": " << connector.getError());
+    return -1;
+  }
+
+  connectedEndpoint = Endpoint(endpoint.getOriginalHostname(), endpoint.getPort());
+  return connector.release();
+}
+
+//------------------------------------------------------------------------------
+// Race connections towards all endpoints. Returns the connected file
+// descriptor, or -1.
+//------------------------------------------------------------------------------
+int QClient::connectParallel()
+{
+  std::vector<ServiceEndpoint> endpoints;
+
+  if(!endpointDecider->getAllEndpoints(endpoints)) {
+    return -1;
+  }
+
+  // Don't let a partitioned member win the race, only to be dropped
+  endpoints.erase(std::remove_if(endpoints.begin(), endpoints.end(),
+    [this](const ServiceEndpoint &endpoint) {
+      return faultInjector.hasPartition(Endpoint(endpoint.getOriginalHostname(), endpoint.getPort()));
+    }), endpoints.end());
+
+  if(endpoints.empty()) {
+    return -1;
+  }
+
+  ParallelConnector connector(endpoints, options.connectionAttemptDelay,
+    options.socketProfile);
+  if(!connector.blockUntilReady(shutdownEventFD.getFD(), options.tcpTimeout)) {
+    return -1;
+  }
+
+  if(!connector.ok()) {
+    QCLIENT_LOG(options.logger, LogLevel::kInfo, "Encountered errors when connecting: " << connector.getError());
+    return -1;
+  }
+
+  connectedEndpoint = Endpoint(connector.getEndpoint().getOriginalHostname(),
+    connector.getEndpoint().getPort());
+  return connector.release();
+}
+
+//------------------------------------------------------------------------------
+// Set SO_BUSY_POLL on the freshly connected socket, if requested
+//------------------------------------------------------------------------------
+void QClient::applyBusyPoll()
+{
+  if(options.busyPoll.count() <= 0) {
     return;
   }
 
-  networkStream.reset(new NetworkStream(connector.release(), options.tlsconfig));
-  if(!networkStream->ok()) {
+#ifdef SO_BUSY_POLL
+  int value = options.busyPoll.count();
+  if(setsockopt(networkStream->getFd(), SOL_SOCKET, SO_BUSY_POLL, &value, sizeof(value)) != 0) {
+    QCLIENT_LOG(options.logger, LogLevel::kWarn, "Could not set SO_BUSY_POLL: " << strerror(errno));
+  }
+#else
+  QCLIENT_LOG(options.logger, LogLevel::kWarn, "SO_BUSY_POLL is not supported on this platform");
+#endif
+}
+
+//------------------------------------------------------------------------------
+// Serve what we learned about the new connection's endpoint earlier, if
+// anything, until the handshake finds out again.
+//------------------------------------------------------------------------------
+void QClient::loadCachedCapabilities()
+{
+  if(!capabilityCache) {
     return;
   }
 
-  notifyConnectionEstablished();
-  writerThread->activate(networkStream.get());
+  ServerCapabilities caps = capabilityCache->get(connectedEndpoint);
+
+  std::lock_guard<std::mutex> lock(capabilitiesMtx);
+  serverCapabilities = caps;
+}
+
+//------------------------------------------------------------------------------
+// Called by the CapabilityHandshake, from the thread processing responses.
+//------------------------------------------------------------------------------
+void QClient::capabilitiesNegotiated(const ServerCapabilities &caps)
+{
+  QCLIENT_LOG(options.logger, LogLevel::kDebug, "Negotiated capabilities with " <<
+    connectedEndpoint.toString() << ": " << caps.toString());
+
+  capabilityCache->store(connectedEndpoint, caps);
+
+  std::lock_guard<std::mutex> lock(capabilitiesMtx);
+  serverCapabilities = caps;
+}
+
+ServerCapabilities QClient::getServerCapabilities() const
+{
+  std::lock_guard<std::mutex> lock(capabilitiesMtx);
+  return serverCapabilities;
+}
+
+//------------------------------------------------------------------------------
+// Switch over to the standby connection, if there's one ready. It has been
+// handshaken already, so we skip straight to replaying pending requests.
+//------------------------------------------------------------------------------
+bool QClient::takeStandby()
+{
+  if(!standby) {
+    return false;
+  }
+
+  Endpoint endpoint;
+  std::unique_ptr<NetworkStream> stream = standby->take(endpoint);
+  if(!stream) {
+    return false;
+  }
+
+  QCLIENT_LOG(options.logger, LogLevel::kInfo, "Switching over to standby connection towards " << endpoint.toString());
+  networkStream = std::move(stream);
+  connectedEndpoint = endpoint;
+  connectionCore->handshakeCompletedOutOfBand();
+  return true;
 }
 
 //------------------------------------------------------------------------------
@@ -323,6 +1412,8 @@ void QClient::connect()
 {
   currentConnectionEpoch++;
   if(currentConnectionEpoch != 1) {
+    connectionCore->getCounters().reconnects.add(1);
+    QCLIENT_TRACE(reconnect, currentConnectionEpoch);
     cleanup(false);
   }
   connectTCP();
@@ -335,30 +1426,68 @@ void QClient::connect()
 void QClient::eventLoop(ThreadAssistant &assistant)
 {
   signal(SIGPIPE, SIG_IGN);
-  std::chrono::milliseconds backoff(1);
 
   while (true) {
     this->connect();
 
     bool receivedBytes = handleConnectionEpoch(assistant);
     if(receivedBytes) {
-      backoff = std::chrono::milliseconds(1);
+      reconnectBackoff->reset();
+    }
+
+    // No point in waiting if a standby connection is ready to take over.
+    if(!standby || !standby->ready()) {
+      assistant.wait_for(reconnectBackoff->next());
+    }
+
+    if (assistant.terminationRequested()) {
+      feed(NULL, 0);
+      break;
+    }
+
+    // Give some more leeway, update lastAvailable after sleeping.
+    if(successfulResponses) {
+      lastAvailable = std::chrono::steady_clock::now();
+    }
+  }
+}
+
+//------------------------------------------------------------------------------
+// Watch over the age of the oldest pending request, and raise the alarm once
+// per stall if it exceeds the threshold.
+//------------------------------------------------------------------------------
+void QClient::watchdog(ThreadAssistant &assistant)
+{
+  std::chrono::milliseconds threshold = options.stuckRequestThreshold;
+  std::chrono::milliseconds interval = std::min(std::max(threshold / 4,
+    std::chrono::milliseconds(10)), std::chrono::milliseconds(1000));
+
+  bool reported = false;
+  while(!assistant.terminationRequested()) {
+    assistant.wait_for(interval);
+
+    std::chrono::milliseconds age = getOldestPendingAge();
+    if(age < threshold) {
+      reported = false;
+      continue;
     }
 
-    assistant.wait_for(backoff);
-
-    if (assistant.terminationRequested()) {
-      feed(NULL, 0);
-      break;
+    if(reported) {
+      continue;
     }
 
-    // Give some more leeway, update lastAvailable after sleeping.
-    if(successfulResponses) {
-      lastAvailable = std::chrono::steady_clock::now();
+    reported = true;
+    QCLIENT_LOG(options.logger, LogLevel::kWarn, "Oldest pending request towards " << members.toString() <<
+      " has seen no progress for " << age.count() << " ms, " << getPendingRequests() << " requests pending" <<
+      (options.reconnectOnStuckRequests ? " - forcing reconnection" : ""));
+
+    if(options.stuckRequestCallback) {
+      options.stuckRequestCallback(age);
     }
 
-    if (backoff < std::chrono::milliseconds(2048)) {
-      backoff++;
+    if(options.reconnectOnStuckRequests) {
+      reconnectRequested = true;
+      requestWakeup();
     }
   }
 }
@@ -374,7 +1503,8 @@ FaultInjector& QClient::getFaultInjector() {
 // Notification from FaultInjector that fault injections were updated
 //------------------------------------------------------------------------------
 void QClient::notifyFaultInjectionsUpdated() {
-  // shutdownEventFD.notify();
+  faultInjectionsUpdated = true;
+  wakeupEventFD.notify();
 }
 
 //------------------------------------------------------------------------------
@@ -409,6 +1539,9 @@ bool QClient::detachListener(ReconnectionListener *listener) {
 // Notify that a connection has been established
 //------------------------------------------------------------------------------
 void QClient::notifyConnectionEstablished() {
+  // A stall reported while still connecting concerns the previous connection
+  reconnectRequested = false;
+
   std::unique_lock<std::mutex> lock(reconnectionListenersMtx);
 
   for(auto it = reconnectionListeners.begin(); it != reconnectionListeners.end(); it++) {
@@ -435,32 +1568,95 @@ void QClient::notifyConnectionLost(int errc, const std::string &err) {
 // from the server.
 //------------------------------------------------------------------------------
 bool QClient::handleConnectionEpoch(ThreadAssistant &assistant) {
-  const size_t BUFFER_SIZE = 1024 * 2;
-  char buffer[BUFFER_SIZE];
   bool receivedBytes = false;
 
   if(!networkStream || !networkStream->ok()) {
     return false;
   }
 
-  struct pollfd polls[2];
+  //----------------------------------------------------------------------------
+  // With pipelined parsing, this thread only receives - parsing and
+  // consuming responses happens on the parse stage thread, which signals
+  // through its failure FD once the connection cannot go on.
+  //----------------------------------------------------------------------------
+  std::unique_ptr<ParseStage> parseStage;
+  if(options.pipelinedParsing) {
+    parseStage.reset(new ParseStage(options.maxReceiveBufferSize * 4,
+      [this](const char* buf, size_t len) { return feed(buf, len); }));
+  }
+
+  //----------------------------------------------------------------------------
+  // No timeout: Everything which needs our attention comes with a file
+  // descriptor - shutdown, the watchdog asking for a reconnection or the
+  // fault injector for a second look, and a failed parse stage. The one
+  // exception are bytes held back by link shaping.
+  //----------------------------------------------------------------------------
+  struct pollfd polls[5];
   polls[0].fd = shutdownEventFD.getFD();
   polls[0].events = POLLIN;
-  polls[1].fd = networkStream->getFd();
-  polls[1].events = POLLIN;
+  networkStream->pollForReading(polls[1]);
+  polls[2].fd = wakeupEventFD.getFD();
+  polls[2].events = POLLIN;
+  polls[2].revents = 0;
+  polls[3].fd = parseStage ? parseStage->getFailureFD() : -1;
+  polls[3].events = POLLIN;
+  polls[3].revents = 0;
+  int npolls = parseStage ? 4 : 3;
+
+  //----------------------------------------------------------------------------
+  // Over shared memory, the socket carries no data - it's only watched to
+  // notice the server going away.
+  //----------------------------------------------------------------------------
+  int socketWatch = -1;
+  if(networkStream->usesSharedMemory()) {
+    socketWatch = npolls++;
+    polls[socketWatch].fd = networkStream->getFd();
+    polls[socketWatch].events = POLLRDHUP;
+    polls[socketWatch].revents = 0;
+  }
+
+  std::unique_ptr<IoUring> ring;
+  if(options.ioBackend == IoBackend::kIoUring && IoUring::supported()) {
+    ring.reset(new IoUring());
+    if(!ring->ok()) ring.reset();
+  }
 
   RecvStatus status(true, 0, 0);
   while (networkStream->ok()) {
     // If the previous iteration returned any bytes at all, try to read again
     // without polling. It could be that there's more data cached inside
     // OpenSSL, which poll() will not detect.
+    //
+    // Reading may make TLS produce output of its own - should the socket
+    // not take it right away, wait until it's writable and push it out.
 
     if(status.bytesRead <= 0) {
-      int rpoll = poll(polls, 2, 60);
+      polls[1].events = POLLIN | (networkStream->hasPendingOutput() ? POLLOUT : 0);
+
+      int timeout = networkStream->getShapingTimeout();
+      int rpoll = ring ? ring->poll(polls, npolls, timeout) : poll(polls, npolls, timeout);
       if(rpoll < 0 && errno != EINTR) {
         // something's wrong, try to reconnect
         break;
       }
+
+      if(rpoll > 0 && (polls[1].revents & POLLOUT)) {
+        networkStream->flushPendingOutput();
+      }
+
+      // Zero-copy completions show up as POLLERR - drain them, or we spin.
+      if(rpoll > 0 && (polls[1].revents & POLLERR)) {
+        networkStream->reapZeroCopy();
+      }
+
+      if(rpoll > 0 && polls[2].revents != 0) {
+        wakeupEventFD.clear();
+      }
+
+      if(rpoll > 0 && socketWatch >= 0 && polls[socketWatch].revents != 0) {
+        notifyConnectionLost(ECONNRESET, "server closed the connection");
+        break;
+      }
     }
 
     if( (polls[0].revents != 0) || assistant.terminationRequested()) {
@@ -468,14 +1664,44 @@ bool QClient::handleConnectionEpoch(ThreadAssistant &assistant) {
       break;
     }
 
+    if(reconnectRequested.exchange(false)) {
+      notifyConnectionLost(ETIMEDOUT, "pipeline stalled");
+      break;
+    }
+
+    if(faultInjectionsUpdated && faultInjectionsUpdated.exchange(false)) {
+      if(faultInjector.hasPartition(connectedEndpoint)) {
+        notifyConnectionLost(ENETUNREACH, "partitioned by fault injector");
+        break;
+      }
+
+      networkStream->setLinkShaper(faultInjector.getLinkShaper(connectedEndpoint));
+    }
+
+    if(parseStage) {
+      if(parseStage->failed()) {
+        notifyConnectionLost(EINVAL, "protocol violation");
+        break;
+      }
+
+      status = recvIntoParseStage(*parseStage);
+
+      if(!status.connectionAlive) {
+        break; // connection died on us
+      }
+
+      receivedBytes = true;
+      continue;
+    }
+
     // looks like a legit connection
-    status = networkStream->recv(buffer, BUFFER_SIZE, 0);
+    status = recvIntoParser();
 
     if(!status.connectionAlive) {
       break; // connection died on us
     }
 
-    if(status.bytesRead > 0 && !feed(buffer, status.bytesRead)) {
+    if(status.bytesRead > 0 && !processResponses()) {
       notifyConnectionLost(EINVAL, "protocol violation");
       break; // protocol violation
     }
@@ -484,6 +1710,11 @@ bool QClient::handleConnectionEpoch(ThreadAssistant &assistant) {
     }
   }
 
+  // Responses already received still get processed, like in the serial case.
+  if(parseStage) {
+    parseStage->finish();
+  }
+
   if(!networkStream->ok()) {
     notifyConnectionLost(networkStream->getErrno(), networkStream->getError());
   }
@@ -491,6 +1722,288 @@ bool QClient::handleConnectionEpoch(ThreadAssistant &assistant) {
   return receivedBytes;
 }
 
+//------------------------------------------------------------------------------
+// Called by the EventLoopGroup thread we're attached to - the state machine
+// equivalent of eventLoop.
+//------------------------------------------------------------------------------
+void QClient::onEvent() {
+  switch(groupState) {
+    case GroupState::kIdle: {
+      groupConnect();
+      break;
+    }
+    case GroupState::kConnecting: {
+      groupContinueConnecting();
+      break;
+    }
+    case GroupState::kConnected: {
+      if(reconnectRequested.exchange(false)) {
+        notifyConnectionLost(ETIMEDOUT, "pipeline stalled");
+        groupEpochFinished(groupReceivedBytes);
+        break;
+      }
+
+      groupRead();
+      break;
+    }
+    case GroupState::kBackoff: {
+      if(std::chrono::steady_clock::now() < groupDeadline) {
+        // Spurious wakeup
+        return;
+      }
+
+      // Give some more leeway, update lastAvailable after sleeping.
+      if(successfulResponses) {
+        lastAvailable = std::chrono::steady_clock::now();
+      }
+
+      groupConnect();
+      break;
+    }
+  }
+}
+
+//------------------------------------------------------------------------------
+// Start a new connection epoch, without blocking the group thread
+//------------------------------------------------------------------------------
+void QClient::groupConnect() {
+  currentConnectionEpoch++;
+  if(currentConnectionEpoch != 1) {
+    connectionCore->getCounters().reconnects.add(1);
+    QCLIENT_TRACE(reconnect, currentConnectionEpoch);
+    cleanup(false);
+  }
+
+  ServiceEndpoint endpoint;
+  if(!endpointDecider->getNextEndpoint(endpoint)) {
+    groupEpochFinished(false);
+    return;
+  }
+
+  pendingConnector.reset(new AsyncConnector(endpoint, options.socketProfile));
+  pendingEndpoint = endpoint.getString();
+  connectedEndpoint = Endpoint(endpoint.getOriginalHostname(), endpoint.getPort());
+  groupState = GroupState::kConnecting;
+  groupDeadline = std::chrono::steady_clock::now() + options.tcpTimeout;
+
+  if(pendingConnector->getFd() >= 0) {
+    loopWatch(pendingConnector->getFd(), EventLoopGroup::kWritable);
+  }
+
+  loopScheduleAt(groupDeadline);
+  groupContinueConnecting();
+}
+
+//------------------------------------------------------------------------------
+// Check on an ongoing ::connect
+//------------------------------------------------------------------------------
+void QClient::groupContinueConnecting() {
+  if(!pendingConnector->checkCompletion()) {
+    if(groupDeadline <= std::chrono::steady_clock::now()) {
+      groupEpochFinished(false);
+    }
+
+    return;
+  }
+
+  if(!pendingConnector->ok()) {
+    QCLIENT_LOG(options.logger, LogLevel::kInfo, "Encountered an error when connecting to " << pendingEndpoint << ": " << pendingConnector->getError());
+    groupEpochFinished(false);
+    return;
+  }
+
+  networkStream.reset(new NetworkStream(pendingConnector->release(), options.tlsconfig));
+  pendingConnector.reset();
+
+  if(!networkStream->ok()) {
+    groupEpochFinished(false);
+    return;
+  }
+
+  applyBusyPoll();
+  loadCachedCapabilities();
+  connectionCore->connectionEstablished();
+  notifyConnectionEstablished();
+
+  if(externalLoop) {
+    writerThread->activateInline();
+  }
+  else {
+    writerThread->activate(networkStream.get());
+  }
+
+  groupState = GroupState::kConnected;
+  groupReceivedBytes = false;
+  loopCancelSchedule();
+  loopWatch(networkStream->getFd(), EventLoopGroup::kReadable);
+
+  // There might be bytes waiting already.
+  groupRead();
+}
+
+//------------------------------------------------------------------------------
+// Socket is readable, drain it - the state machine equivalent of
+// handleConnectionEpoch.
+//------------------------------------------------------------------------------
+void QClient::groupRead() {
+  while(networkStream->ok()) {
+    RecvStatus status = recvIntoParser();
+
+    if(!status.connectionAlive) {
+      break; // connection died on us
+    }
+
+    if(status.bytesRead > 0 && !processResponses()) {
+      notifyConnectionLost(EINVAL, "protocol violation");
+      groupEpochFinished(groupReceivedBytes);
+      return;
+    }
+
+    groupReceivedBytes = true;
+
+    // Keep reading until drained - there could be more data cached inside
+    // OpenSSL, which epoll will not detect.
+    if(status.bytesRead <= 0) {
+      return;
+    }
+  }
+
+  if(!networkStream->ok()) {
+    notifyConnectionLost(networkStream->getErrno(), networkStream->getError());
+  }
+
+  groupEpochFinished(groupReceivedBytes);
+}
+
+//------------------------------------------------------------------------------
+// Connection epoch is over, back off before reconnecting
+//------------------------------------------------------------------------------
+void QClient::groupEpochFinished(bool receivedBytes) {
+  loopWatch(-1, 0);
+  pendingConnector.reset();
+
+  if(receivedBytes) {
+    reconnectBackoff->reset();
+  }
+
+  groupState = GroupState::kBackoff;
+  groupDeadline = std::chrono::steady_clock::now() + reconnectBackoff->next();
+  loopScheduleAt(groupDeadline);
+}
+
+//------------------------------------------------------------------------------
+// Externally driven only: Write out whatever is staged, and keep watching
+// for writability for as long as the kernel buffers are full.
+//------------------------------------------------------------------------------
+void QClient::groupWrite() {
+  bool drained = writerThread->writeInline(networkStream.get());
+
+  if(!networkStream->ok()) {
+    notifyConnectionLost(networkStream->getErrno(), networkStream->getError());
+    groupEpochFinished(groupReceivedBytes);
+    return;
+  }
+
+  loopWatch(networkStream->getFd(), EventLoopGroup::kReadable |
+    (drained ? 0u : EventLoopGroup::kWritable));
+}
+
+//------------------------------------------------------------------------------
+// Externally driven only: Advance the state machine, then flush
+//------------------------------------------------------------------------------
+void QClient::drive() {
+  if(!externalLoop) {
+    return;
+  }
+
+  externalWakeupPending = false;
+  onEvent();
+
+  if(groupState == GroupState::kConnected) {
+    groupWrite();
+  }
+}
+
+//------------------------------------------------------------------------------
+// Entry points for an ExternalEventLoop
+//------------------------------------------------------------------------------
+void QClient::onReadable() {
+  drive();
+}
+
+void QClient::onWritable() {
+  if(externalLoop && groupState == GroupState::kConnected && !reconnectRequested) {
+    groupWrite();
+    return;
+  }
+
+  drive();
+}
+
+void QClient::onTimer() {
+  drive();
+}
+
+//------------------------------------------------------------------------------
+// Ask whoever drives us for attention: The dedicated event loop thread, or
+// a call to onEvent. Coalesced for an ExternalEventLoop, as this runs for
+// every staged request.
+//------------------------------------------------------------------------------
+void QClient::requestWakeup() {
+  if(eventLoopGroup) {
+    eventLoopGroup->wakeup(this);
+  }
+  else if(externalLoop) {
+    if(!externalWakeupPending.load(std::memory_order_relaxed) &&
+       !externalWakeupPending.exchange(true)) {
+      externalLoop->wakeup();
+    }
+  }
+  else {
+    wakeupEventFD.notify();
+  }
+}
+
+//------------------------------------------------------------------------------
+// Forward to the EventLoopGroup or ExternalEventLoop driving us
+//------------------------------------------------------------------------------
+static_assert(EventLoopGroup::kReadable == ExternalEventLoop::kReadable &&
+              EventLoopGroup::kWritable == ExternalEventLoop::kWritable,
+              "event flags must be interchangeable");
+
+void QClient::loopWatch(int fd, uint32_t events) {
+  if(eventLoopGroup) {
+    eventLoopGroup->watch(this, fd, events);
+    return;
+  }
+
+  if(fd == externalFd && events == externalEvents) {
+    return;
+  }
+
+  externalFd = fd;
+  externalEvents = events;
+  externalLoop->watch(fd, events);
+}
+
+void QClient::loopScheduleAt(std::chrono::steady_clock::time_point deadline) {
+  if(eventLoopGroup) {
+    eventLoopGroup->scheduleAt(this, deadline);
+  }
+  else {
+    externalLoop->scheduleAt(deadline);
+  }
+}
+
+void QClient::loopCancelSchedule() {
+  if(eventLoopGroup) {
+    eventLoopGroup->cancelSchedule(this);
+  }
+  else {
+    externalLoop->cancelSchedule();
+  }
+}
+
 //------------------------------------------------------------------------------
 // Wrapper function for exists command
 //------------------------------------------------------------------------------
@@ -523,6 +2036,126 @@ QClient::del(const std::string& key)
   return reply->integer;
 }
 
+//------------------------------------------------------------------------------
+// Integer reply of a bulk request, or throw
+//------------------------------------------------------------------------------
+static long long int bulkReply(std::future<redisReplyPtr> &fut, const char *cmd) {
+  redisReplyPtr reply = fut.get();
+
+  if ((reply == nullptr) || (reply->type != REDIS_REPLY_INTEGER)) {
+    throw std::runtime_error(SSTR("[FATAL] Error bulk " << cmd <<
+                             ": Unexpected/null reply"));
+  }
+
+  return reply->integer;
+}
+
+//------------------------------------------------------------------------------
+// Pipeline a multi-key command over all keys, chunk by chunk, without
+// copying them - the encoded request is built straight out of the keys.
+//------------------------------------------------------------------------------
+long long int
+QClient::bulkCount(const char *cmd, const std::vector<std::string>& keys,
+  size_t chunkSize, size_t window)
+{
+  chunkSize = std::max<size_t>(chunkSize, 1u);
+  window = std::max<size_t>(window, 1u);
+
+  std::deque<std::future<redisReplyPtr>> inflight;
+  std::vector<const char*> chunks;
+  std::vector<size_t> sizes;
+  long long int total = 0;
+
+  for(size_t pos = 0; pos < keys.size(); pos += chunkSize) {
+    size_t end = std::min(keys.size(), pos + chunkSize);
+
+    chunks.clear();
+    sizes.clear();
+    chunks.push_back(cmd);
+    sizes.push_back(strlen(cmd));
+
+    for(size_t i = pos; i < end; i++) {
+      chunks.push_back(keys[i].data());
+      sizes.push_back(keys[i].size());
+    }
+
+    if(inflight.size() >= window) {
+      total += bulkReply(inflight.front(), cmd);
+      inflight.pop_front();
+    }
+
+    inflight.emplace_back(execute(EncodedRequest(chunks.size(), chunks.data(), sizes.data())));
+  }
+
+  while(!inflight.empty()) {
+    total += bulkReply(inflight.front(), cmd);
+    inflight.pop_front();
+  }
+
+  return total;
+}
+
+long long int
+QClient::existsMany(const std::vector<std::string>& keys, size_t chunkSize,
+  size_t window)
+{
+  return bulkCount("EXISTS", keys, chunkSize, window);
+}
+
+long long int
+QClient::delMany(const std::vector<std::string>& keys, size_t chunkSize,
+  size_t window)
+{
+  return bulkCount("DEL", keys, chunkSize, window);
+}
+
+long long int
+QClient::unlinkMany(const std::vector<std::string>& keys, size_t chunkSize,
+  size_t window)
+{
+  return bulkCount("UNLINK", keys, chunkSize, window);
+}
+
+//------------------------------------------------------------------------------
+// Per-key EXISTS, pipelined
+//------------------------------------------------------------------------------
+std::vector<bool>
+QClient::existsEach(const std::vector<std::string>& keys, size_t window)
+{
+  window = std::max<size_t>(window, 1u);
+
+  std::vector<bool> results;
+  results.reserve(keys.size());
+  std::deque<std::future<redisReplyPtr>> inflight;
+
+  for(size_t i = 0; i < keys.size(); i++) {
+    if(inflight.size() >= window) {
+      results.push_back(bulkReply(inflight.front(), "EXISTS") != 0);
+      inflight.pop_front();
+    }
+
+    inflight.emplace_back(exec("EXISTS", keys[i]));
+  }
+
+  while(!inflight.empty()) {
+    results.push_back(bulkReply(inflight.front(), "EXISTS") != 0);
+    inflight.pop_front();
+  }
+
+  return results;
+}
+
+//------------------------------------------------------------------------------
+// Block until the connection is established and handshaken
+//------------------------------------------------------------------------------
+Status QClient::waitUntilReady(std::chrono::milliseconds timeout) {
+  if(!core()->waitUntilReady(timeout)) {
+    return Status(ETIME, "time-out while waiting for the connection to become ready");
+  }
+
+  return Status();
+}
+
 //------------------------------------------------------------------------------
 // Check whether we're currently connected by sending a PING -- synchronous
 // operation with the given timeout.
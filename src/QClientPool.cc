@@ -0,0 +1,177 @@
+//------------------------------------------------------------------------------
+// File: QClientPool.cc
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#include "qclient/QClientPool.hh"
+
+namespace qclient {
+
+//------------------------------------------------------------------------------
+// Constructor taking simple host and port
+//------------------------------------------------------------------------------
+QClientPool::QClientPool(const std::string &host, int port, Options &&options,
+  size_t connections, PoolStrategy st)
+: strategy(st) {
+  initialize(Members(host, port), std::move(options), connections);
+}
+
+//------------------------------------------------------------------------------
+// Constructor taking a list of members for the cluster
+//------------------------------------------------------------------------------
+QClientPool::QClientPool(const Members &members, Options &&options,
+  size_t connections, PoolStrategy st)
+: strategy(st) {
+  initialize(members, std::move(options), connections);
+}
+
+//------------------------------------------------------------------------------
+// Spawn all connections
+//------------------------------------------------------------------------------
+void QClientPool::initialize(const Members &members, Options &&options, size_t connections) {
+  if(connections == 0) {
+    connections = 1;
+  }
+
+  for(size_t i = 0; i < connections; i++) {
+    clients.emplace_back(new QClient(members, options.clone()));
+  }
+}
+
+//------------------------------------------------------------------------------
+// Number of connections in the pool
+//------------------------------------------------------------------------------
+size_t QClientPool::size() const {
+  return clients.size();
+}
+
+//------------------------------------------------------------------------------
+// Access a specific connection
+//------------------------------------------------------------------------------
+QClient& QClientPool::get(size_t index) {
+  return *clients[index].get();
+}
+
+//------------------------------------------------------------------------------
+// Pick a connection according to the strategy
+//------------------------------------------------------------------------------
+QClient& QClientPool::pick() {
+  size_t start = nextIndex++ % clients.size();
+
+  if(strategy == PoolStrategy::kRoundRobin) {
+    return *clients[start].get();
+  }
+
+  //----------------------------------------------------------------------------
+  // Least pending: Start scanning from a rotating position, so that ties
+  // (ie an idle pool) are still spread out evenly.
+  //----------------------------------------------------------------------------
+  size_t best = start;
+  int64_t bestPending = clients[start]->getPendingRequests();
+
+  for(size_t i = 1; i < clients.size() && bestPending > 0; i++) {
+    size_t candidate = (start + i) % clients.size();
+    int64_t pending = clients[candidate]->getPendingRequests();
+
+    if(pending < bestPending) {
+      best = candidate;
+      bestPending = pending;
+    }
+  }
+
+  return *clients[best].get();
+}
+
+//------------------------------------------------------------------------------
+// Requests issued through any connection, but not yet acknowledged.
+//------------------------------------------------------------------------------
+int64_t QClientPool::getPendingRequests() const {
+  int64_t total = 0;
+
+  for(size_t i = 0; i < clients.size(); i++) {
+    total += clients[i]->getPendingRequests();
+  }
+
+  return total;
+}
+
+std::future<redisReplyPtr> QClientPool::execute(EncodedRequest &&req) {
+  return pick().execute(std::move(req));
+}
+
+void QClientPool::execute(QCallback *callback, EncodedRequest &&req) {
+  pick().execute(callback, std::move(req));
+}
+
+std::future<redisReplyPtr> QClientPool::execute(EncodedRequest &&req, BulkSink *sink) {
+  return pick().execute(std::move(req), sink);
+}
+
+void QClientPool::execute(QCallback *callback, EncodedRequest &&req, BulkSink *sink) {
+  pick().execute(callback, std::move(req), sink);
+}
+
+std::future<redisReplyPtr> QClientPool::execute(EncodedRequest &&req, ReplyDecoder *decoder) {
+  return pick().execute(std::move(req), decoder);
+}
+
+void QClientPool::execute(QCallback *callback, EncodedRequest &&req, ReplyDecoder *decoder) {
+  pick().execute(callback, std::move(req), decoder);
+}
+
+void QClientPool::execute(EncodedRequest &&req, ReplyCallback &&callback) {
+  pick().execute(std::move(req), std::move(callback));
+}
+
+bool QClientPool::tryExecute(QCallback *callback, EncodedRequest &&req) {
+  return pick().tryExecute(callback, std::move(req));
+}
+
+#if HAVE_FOLLY == 1
+folly::Future<redisReplyPtr> QClientPool::follyExecute(EncodedRequest &&req) {
+  return pick().follyExecute(std::move(req));
+}
+
+folly::Future<redisReplyPtr> QClientPool::follyExecute(EncodedRequest &&req, folly::Executor *executor) {
+  return pick().follyExecute(std::move(req), executor);
+}
+
+folly::SemiFuture<redisReplyPtr> QClientPool::follySemiExecute(EncodedRequest &&req) {
+  return pick().follySemiExecute(std::move(req));
+}
+#endif
+
+std::future<redisReplyPtr> QClientPool::execute(std::deque<EncodedRequest> &&reqs) {
+  return pick().execute(std::move(reqs));
+}
+
+void QClientPool::execute(QCallback *callback, std::deque<EncodedRequest> &&reqs) {
+  pick().execute(callback, std::move(reqs));
+}
+
+#if HAVE_FOLLY == 1
+folly::Future<redisReplyPtr> QClientPool::follyExecute(std::deque<EncodedRequest> &&reqs) {
+  return pick().follyExecute(std::move(reqs));
+}
+#endif
+
+}
@@ -0,0 +1,191 @@
+//------------------------------------------------------------------------------
+// File: RateLimiter.cc
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2016 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+
+#include "qclient/RateLimiter.hh"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace qclient {
+
+//------------------------------------------------------------------------------
+// Bucket: Capacity is burst worth of tokens, at least a single one. Unused
+// tokens carry over, up to capacity - debt carries over always.
+//------------------------------------------------------------------------------
+void RateLimiter::Bucket::configure(uint64_t newRate, std::chrono::milliseconds burst) {
+  rate = newRate;
+  capacity = std::max(1.0, rate * (burst.count() / 1000.0));
+  tokens = std::min(tokens, capacity);
+}
+
+void RateLimiter::Bucket::refill(double seconds) {
+  if(rate != 0) {
+    tokens = std::min(capacity, tokens + rate * seconds);
+  }
+}
+
+size_t RateLimiter::Bucket::available() const {
+  if(rate == 0) {
+    return std::numeric_limits<size_t>::max();
+  }
+
+  if(tokens < 1.0) {
+    return 0u;
+  }
+
+  return static_cast<size_t>(tokens);
+}
+
+double RateLimiter::Bucket::secondsUntilPositive() const {
+  if(rate == 0 || tokens >= 1.0) {
+    return 0.0;
+  }
+
+  return (1.0 - tokens) / rate;
+}
+
+//------------------------------------------------------------------------------
+// Constructor - start out with full buckets
+//------------------------------------------------------------------------------
+RateLimiter::RateLimiter(uint64_t bytesPerSecond, uint64_t requestsPerSecond,
+  std::chrono::milliseconds b)
+: burst(std::max(b, std::chrono::milliseconds(1))), lastRefill(Clock::now()) {
+
+  bytes.configure(bytesPerSecond, burst);
+  bytes.tokens = bytes.capacity;
+  requests.configure(requestsPerSecond, burst);
+  requests.tokens = requests.capacity;
+}
+
+//------------------------------------------------------------------------------
+// Change the rates - whatever accumulated so far was earned at the old ones
+//------------------------------------------------------------------------------
+void RateLimiter::setRates(uint64_t bytesPerSecond, uint64_t requestsPerSecond) {
+  std::lock_guard<std::mutex> lock(mtx);
+  refill(Clock::now());
+
+  // Coming from unlimited: Start with a full bucket, not an empty one.
+  bool fillBytes = (bytes.rate == 0);
+  bool fillRequests = (requests.rate == 0);
+
+  bytes.configure(bytesPerSecond, burst);
+  requests.configure(requestsPerSecond, burst);
+
+  if(fillBytes) bytes.tokens = bytes.capacity;
+  if(fillRequests) requests.tokens = requests.capacity;
+}
+
+uint64_t RateLimiter::getBytesPerSecond() const {
+  std::lock_guard<std::mutex> lock(mtx);
+  return bytes.rate;
+}
+
+uint64_t RateLimiter::getRequestsPerSecond() const {
+  std::lock_guard<std::mutex> lock(mtx);
+  return requests.rate;
+}
+
+//------------------------------------------------------------------------------
+// Refill both buckets for the time elapsed. Call with mtx.
+//------------------------------------------------------------------------------
+void RateLimiter::refill(Clock::time_point now) {
+  if(now <= lastRefill) {
+    return;
+  }
+
+  double seconds = std::chrono::duration<double>(now - lastRefill).count();
+  lastRefill = now;
+
+  bytes.refill(seconds);
+  requests.refill(seconds);
+}
+
+//------------------------------------------------------------------------------
+// How much may go out right now
+//------------------------------------------------------------------------------
+RateLimiter::Allowance RateLimiter::getAllowance(Clock::time_point now) {
+  std::lock_guard<std::mutex> lock(mtx);
+  refill(now);
+
+  Allowance allowance;
+  allowance.requests = requests.available();
+  allowance.bytes = bytes.available();
+
+  if(allowance.requests == 0u || allowance.bytes == 0u) {
+    allowance.requests = 0u;
+    allowance.bytes = 0u;
+  }
+
+  return allowance;
+}
+
+//------------------------------------------------------------------------------
+// Take tokens out, possibly going into debt
+//------------------------------------------------------------------------------
+void RateLimiter::consume(size_t reqs, size_t byteCount, Clock::time_point now) {
+  std::lock_guard<std::mutex> lock(mtx);
+  refill(now);
+
+  if(bytes.rate != 0) bytes.tokens -= byteCount;
+  if(requests.rate != 0) requests.tokens -= reqs;
+
+  bytesConsumed += byteCount;
+  requestsConsumed += reqs;
+}
+
+//------------------------------------------------------------------------------
+// How long until both buckets hold at least a token
+//------------------------------------------------------------------------------
+std::chrono::nanoseconds RateLimiter::getDelay(Clock::time_point now) {
+  std::lock_guard<std::mutex> lock(mtx);
+  refill(now);
+
+  double seconds = std::max(bytes.secondsUntilPositive(), requests.secondsUntilPositive());
+  return std::chrono::nanoseconds(static_cast<int64_t>(std::ceil(seconds * 1e9)));
+}
+
+//------------------------------------------------------------------------------
+// Lifetime totals
+//------------------------------------------------------------------------------
+void RateLimiter::recordThrottled(std::chrono::nanoseconds duration) {
+  std::lock_guard<std::mutex> lock(mtx);
+  throttled += duration;
+}
+
+std::chrono::nanoseconds RateLimiter::getThrottledTime() const {
+  std::lock_guard<std::mutex> lock(mtx);
+  return throttled;
+}
+
+uint64_t RateLimiter::getBytesConsumed() const {
+  std::lock_guard<std::mutex> lock(mtx);
+  return bytesConsumed;
+}
+
+uint64_t RateLimiter::getRequestsConsumed() const {
+  std::lock_guard<std::mutex> lock(mtx);
+  return requestsConsumed;
+}
+
+}
@@ -0,0 +1,117 @@
+//------------------------------------------------------------------------------
+// File: ReadRouting.cc
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2016 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+
+#include "qclient/Options.hh"
+#include "qclient/EncodedRequest.hh"
+#include <algorithm>
+#include <ctype.h>
+#include <string.h>
+
+namespace qclient {
+
+//------------------------------------------------------------------------------
+// Commands which never modify anything, sorted - redis and QuarkDB ones.
+//------------------------------------------------------------------------------
+static const char* const kReadOnlyCommands[] = {
+  "DEQUE-LEN",
+  "DEQUE-SCAN-BACK",
+  "EXISTS",
+  "GET",
+  "HEXISTS",
+  "HGET",
+  "HGETALL",
+  "HKEYS",
+  "HLEN",
+  "HMGET",
+  "HSCAN",
+  "HVALS",
+  "KEYS",
+  "LHGET",
+  "LHGET-WITH-FALLBACK",
+  "LHLEN",
+  "LHSCAN",
+  "LLEN",
+  "LRANGE",
+  "MGET",
+  "SCAN",
+  "SCARD",
+  "SISMEMBER",
+  "SMEMBERS",
+  "SSCAN",
+  "STRLEN",
+  "TYPE"
+};
+
+//------------------------------------------------------------------------------
+// Is the given command a known read-only one? Case-insensitive.
+//------------------------------------------------------------------------------
+bool ReadRouting::isReadOnlyCommand(const char *cmd, size_t len) {
+  char upper[32];
+  if(len == 0 || len >= sizeof(upper)) {
+    return false;
+  }
+
+  for(size_t i = 0; i < len; i++) {
+    upper[i] = toupper((unsigned char) cmd[i]);
+  }
+
+  upper[len] = '\0';
+
+  return std::binary_search(std::begin(kReadOnlyCommands), std::end(kReadOnlyCommands),
+    (const char*) upper, [](const char *a, const char *b) { return strcmp(a, b) < 0; });
+}
+
+//------------------------------------------------------------------------------
+// Find the command inside the encoded request - always within the first
+// segment, as in "*3\r\n$4\r\nHGET\r\n..."
+//------------------------------------------------------------------------------
+bool ReadRouting::isReadOnly(const EncodedRequest &req) {
+  if(req.getSegmentCount() == 0) {
+    return false;
+  }
+
+  EncodedRequest::Segment segment = req.getSegment(0);
+  const char *end = segment.data + segment.len;
+
+  const char *pos = (const char*) memchr(segment.data, '\n', segment.len);
+  if(!pos || end - pos < 2 || pos[1] != '$') {
+    return false;
+  }
+
+  const char *lengthStart = pos + 2;
+  pos = (const char*) memchr(lengthStart, '\n', end - lengthStart);
+  if(!pos) {
+    return false;
+  }
+
+  size_t length = strtoull(lengthStart, nullptr, 10);
+  const char *command = pos + 1;
+  if(length > (size_t) (end - command)) {
+    return false;
+  }
+
+  return isReadOnlyCommand(command, length);
+}
+
+}
@@ -0,0 +1,78 @@
+//------------------------------------------------------------------------------
+// File: ReceiveBufferSizer.hh
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#ifndef QCLIENT_RECEIVE_BUFFER_SIZER_HH
+#define QCLIENT_RECEIVE_BUFFER_SIZER_HH
+
+#include <algorithm>
+#include <stddef.h>
+
+namespace qclient {
+
+//------------------------------------------------------------------------------
+// Decides how many bytes to ask for during the next recv, based on how
+// recent reads went: A read which fills the entire buffer means there's
+// probably more data waiting, so double the size, up to the cap. A streak of
+// reads using only a small fraction of it halves the size again, so that
+// mostly idle connections don't hold onto large buffers.
+//------------------------------------------------------------------------------
+class ReceiveBufferSizer {
+public:
+  static constexpr size_t kMinimum = 1024 * 2;
+  static constexpr size_t kShrinkAfter = 8;
+
+  ReceiveBufferSizer(size_t maxSize)
+  : cap(std::max(maxSize, size_t(kMinimum))), current(kMinimum) {}
+
+  size_t get() const {
+    return current;
+  }
+
+  void record(size_t bytesRead) {
+    if(bytesRead >= current) {
+      current = std::min(current * 2, cap);
+      smallReads = 0;
+      return;
+    }
+
+    if(bytesRead >= current / 4) {
+      smallReads = 0;
+      return;
+    }
+
+    if(++smallReads >= kShrinkAfter) {
+      current = std::max(current / 2, size_t(kMinimum));
+      smallReads = 0;
+    }
+  }
+
+private:
+  size_t cap;
+  size_t current;
+  size_t smallReads = 0;
+};
+
+}
+
+#endif
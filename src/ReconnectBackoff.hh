@@ -0,0 +1,87 @@
+//------------------------------------------------------------------------------
+// File: ReconnectBackoff.hh
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#ifndef QCLIENT_RECONNECT_BACKOFF_HH
+#define QCLIENT_RECONNECT_BACKOFF_HH
+
+#include "qclient/Options.hh"
+#include <algorithm>
+#include <chrono>
+#include <random>
+
+namespace qclient {
+
+//------------------------------------------------------------------------------
+// Hands out the waits between consecutive reconnection attempts, following
+// the given ReconnectStrategy. reset() once a connection turned out to be
+// healthy.
+//------------------------------------------------------------------------------
+class ReconnectBackoff {
+public:
+  ReconnectBackoff(const ReconnectStrategy &str)
+  : strategy(str), rng(std::random_device()()) {}
+
+  void reset() {
+    linear = std::chrono::milliseconds(1);
+    previous = std::chrono::milliseconds(0);
+  }
+
+  std::chrono::milliseconds next() {
+    if(strategy.getMode() == ReconnectStrategy::Mode::kLinear) {
+      std::chrono::milliseconds retval = linear;
+      if(linear < std::chrono::milliseconds(2048)) {
+        linear++;
+      }
+
+      return retval;
+    }
+
+    //--------------------------------------------------------------------------
+    // Decorrelated jitter: The first retry is immediate, each one after that
+    // waits between base and three times the previous wait.
+    //--------------------------------------------------------------------------
+    if(previous.count() == 0) {
+      previous = strategy.getBase();
+      return std::chrono::milliseconds(0);
+    }
+
+    int64_t low = strategy.getBase().count();
+    int64_t high = std::max(low, previous.count() * 3);
+    std::uniform_int_distribution<int64_t> dist(low, high);
+
+    previous = std::min(std::chrono::milliseconds(dist(rng)), strategy.getCap());
+    return previous;
+  }
+
+private:
+  ReconnectStrategy strategy;
+  std::mt19937_64 rng;
+
+  std::chrono::milliseconds linear {1};
+  std::chrono::milliseconds previous {0};
+};
+
+}
+
+#endif
@@ -0,0 +1,324 @@
+//------------------------------------------------------------------------------
+// File: ReplyArena.cc
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#include "ReplyArena.hh"
+#include "qclient/Reply.hh"
+#include "reader/reader.hh"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include "qclient/utils/AllocationAccounting.hh"
+
+namespace qclient {
+
+//------------------------------------------------------------------------------
+// Destructor: Release all chunks in one go
+//------------------------------------------------------------------------------
+ReplyArena::~ReplyArena() {
+  // The list nodes live inside the chunks, free them first.
+  while(adopted) {
+    free(adopted->buffer);
+    adopted = adopted->next;
+  }
+
+  while(chunks) {
+    ChunkHeader *next = chunks->next;
+
+    if(resource) {
+      resource->deallocate(chunks, chunks->size, alignof(ChunkHeader));
+    }
+    else {
+      free(chunks);
+    }
+
+    chunks = next;
+  }
+}
+
+//------------------------------------------------------------------------------
+// Add a chunk of at least the given usable size. Chunks grow geometrically,
+// so a large reply tree needs only a handful of them.
+//------------------------------------------------------------------------------
+bool ReplyArena::addChunk(size_t minimum) {
+  size_t size = nextChunkSize;
+  if(size < minimum) {
+    size = minimum;
+  }
+
+  ChunkHeader *chunk = nullptr;
+
+  if(resource) {
+    try {
+      chunk = (ChunkHeader*) resource->allocate(sizeof(ChunkHeader) + size, alignof(ChunkHeader));
+    }
+    catch(const std::bad_alloc&) {
+      return false;
+    }
+  }
+  else {
+    chunk = (ChunkHeader*) malloc(sizeof(ChunkHeader) + size);
+  }
+
+  if(!chunk) {
+    return false;
+  }
+
+  chunk->size = sizeof(ChunkHeader) + size;
+
+  AllocationAccounting::record(AllocationCategory::kParsing, sizeof(ChunkHeader) + size);
+
+  chunk->next = chunks;
+  chunks = chunk;
+  chunkCount++;
+
+  current = (char*) (chunk + 1);
+  currentSize = size;
+  currentUsed = 0u;
+
+  if(nextChunkSize < kMaxChunkSize) {
+    nextChunkSize *= 2;
+  }
+
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Allocate the given number of bytes, with the given alignment.
+//------------------------------------------------------------------------------
+void* ReplyArena::allocate(size_t bytes, size_t alignment) {
+  size_t offset = (currentUsed + alignment - 1) & ~(alignment - 1);
+
+  if(offset + bytes > currentSize) {
+    // A fresh chunk is pointer-aligned, enough for anything inside a reply.
+    if(!addChunk(bytes)) {
+      return nullptr;
+    }
+
+    offset = 0u;
+  }
+
+  currentUsed = offset + bytes;
+  allocatedBytes += bytes;
+  return current + offset;
+}
+
+//------------------------------------------------------------------------------
+// Take ownership of a malloc'ed buffer, freed along with the arena.
+//------------------------------------------------------------------------------
+bool ReplyArena::adopt(void *buffer) {
+  AdoptedBuffer *node = (AdoptedBuffer*) allocate(sizeof(AdoptedBuffer), alignof(AdoptedBuffer));
+  if(!node) {
+    return false;
+  }
+
+  node->buffer = buffer;
+  node->next = adopted;
+  adopted = node;
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Reader functions - the arena equivalents of the ones in reader.cc
+//------------------------------------------------------------------------------
+static redisReply* createArenaReply(const redisReadTask *task, int type) {
+  ReplyArena *arena = (ReplyArena*) task->privdata;
+
+  redisReply *r = (redisReply*) arena->allocate(sizeof(redisReply), alignof(redisReply));
+  if(r == nullptr) {
+    return nullptr;
+  }
+
+  memset(r, 0, sizeof(redisReply));
+  r->type = type;
+  return r;
+}
+
+static void attachToParent(const redisReadTask *task, redisReply *r) {
+  // Attributes are not part of their parent, the reader discards them.
+  if(task->parent && r->type != REDIS_REPLY_ATTR) {
+    redisReply *parent = (redisReply*) task->parent->obj;
+    assert(parent->type == REDIS_REPLY_ARRAY || parent->type == REDIS_REPLY_PUSH ||
+           parent->type == REDIS_REPLY_MAP || parent->type == REDIS_REPLY_SET ||
+           parent->type == REDIS_REPLY_ATTR);
+    parent->element[task->idx] = r;
+  }
+}
+
+static void *createArenaString(const redisReadTask *task, char *str, size_t len) {
+  ReplyArena *arena = (ReplyArena*) task->privdata;
+
+  redisReply *r = createArenaReply(task, task->type);
+  if(r == nullptr) {
+    return nullptr;
+  }
+
+  assert(task->type == REDIS_REPLY_ERROR  ||
+         task->type == REDIS_REPLY_STATUS ||
+         task->type == REDIS_REPLY_STRING ||
+         task->type == REDIS_REPLY_BIGNUM ||
+         task->type == REDIS_REPLY_VERB);
+
+  // Verbatim strings: Split off the content type.
+  if(task->type == REDIS_REPLY_VERB) {
+    memcpy(r->vtype, str, 3);
+    r->vtype[3] = '\0';
+    str += 4;
+    len -= 4;
+  }
+
+  char *buf = (char*) arena->allocate(len+1, 1);
+  if(buf == nullptr) {
+    return nullptr;
+  }
+
+  memcpy(buf, str, len);
+  buf[len] = '\0';
+  r->str = buf;
+  r->len = len;
+
+  attachToParent(task, r);
+  return r;
+}
+
+static void *adoptArenaString(const redisReadTask *task, char *str, size_t len) {
+  ReplyArena *arena = (ReplyArena*) task->privdata;
+
+  redisReply *r = createArenaReply(task, task->type);
+  if(r == nullptr || !arena->adopt(str)) {
+    return nullptr;
+  }
+
+  assert(task->type == REDIS_REPLY_ERROR  ||
+         task->type == REDIS_REPLY_STATUS ||
+         task->type == REDIS_REPLY_STRING);
+
+  r->str = str;
+  r->len = len;
+
+  attachToParent(task, r);
+  return r;
+}
+
+static void *createArenaArray(const redisReadTask *task, size_t elements, int type) {
+  ReplyArena *arena = (ReplyArena*) task->privdata;
+
+  redisReply *r = createArenaReply(task, type);
+  if(r == nullptr) {
+    return nullptr;
+  }
+
+  if(elements > 0) {
+    r->element = (redisReply**) arena->allocate(elements * sizeof(redisReply*), alignof(redisReply*));
+    if(r->element == nullptr) {
+      return nullptr;
+    }
+
+    memset(r->element, 0, elements * sizeof(redisReply*));
+  }
+
+  r->elements = elements;
+
+  attachToParent(task, r);
+  return r;
+}
+
+static void *createArenaInteger(const redisReadTask *task, long long value) {
+  redisReply *r = createArenaReply(task, REDIS_REPLY_INTEGER);
+  if(r == nullptr) {
+    return nullptr;
+  }
+
+  r->integer = value;
+
+  attachToParent(task, r);
+  return r;
+}
+
+static void *createArenaDouble(const redisReadTask *task, double value, char *str, size_t len) {
+  ReplyArena *arena = (ReplyArena*) task->privdata;
+
+  redisReply *r = createArenaReply(task, REDIS_REPLY_DOUBLE);
+  if(r == nullptr) {
+    return nullptr;
+  }
+
+  char *buf = (char*) arena->allocate(len+1, 1);
+  if(buf == nullptr) {
+    return nullptr;
+  }
+
+  memcpy(buf, str, len);
+  buf[len] = '\0';
+  r->dval = value;
+  r->str = buf;
+  r->len = len;
+
+  attachToParent(task, r);
+  return r;
+}
+
+static void *createArenaBool(const redisReadTask *task, int value) {
+  redisReply *r = createArenaReply(task, REDIS_REPLY_BOOL);
+  if(r == nullptr) {
+    return nullptr;
+  }
+
+  r->integer = value != 0;
+
+  attachToParent(task, r);
+  return r;
+}
+
+static void *createArenaNil(const redisReadTask *task) {
+  redisReply *r = createArenaReply(task, REDIS_REPLY_NIL);
+  if(r == nullptr) {
+    return nullptr;
+  }
+
+  attachToParent(task, r);
+  return r;
+}
+
+static void freeArenaObject(void *reply) {
+  // Nothing to do, the arena owns everything.
+}
+
+static redisReplyObjectFunctions arenaFunctions = {
+  createArenaString,
+  createArenaArray,
+  createArenaInteger,
+  createArenaNil,
+  freeArenaObject,
+  adoptArenaString,
+  createArenaDouble,
+  createArenaBool,
+  nullptr
+};
+
+redisReplyObjectFunctions* ReplyArena::getReaderFunctions() {
+  return &arenaFunctions;
+}
+
+}
@@ -0,0 +1,121 @@
+//------------------------------------------------------------------------------
+// File: ReplyArena.hh
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#ifndef QCLIENT_REPLY_ARENA_HH
+#define QCLIENT_REPLY_ARENA_HH
+
+#include <stddef.h>
+#include <stdint.h>
+#include "qclient/utils/MemoryResource.hh"
+
+struct redisReplyObjectFunctions;
+
+namespace qclient {
+
+//------------------------------------------------------------------------------
+// Bump allocator holding an entire reply tree: Every redisReply node, element
+// array and string lives in here, and is released in one shot by destroying
+// the arena. Nothing is ever freed individually.
+//
+// Small replies fit inside the inline chunk, so a typical "+OK" costs a
+// single allocation, ie the one for the arena itself.
+//
+// Chunks come out of the given memory resource, or the global heap if none.
+//------------------------------------------------------------------------------
+class ReplyArena {
+public:
+  explicit ReplyArena(MemoryResource *res = nullptr) : resource(res) {}
+  ~ReplyArena();
+
+  ReplyArena(const ReplyArena&) = delete;
+  ReplyArena& operator=(const ReplyArena&) = delete;
+
+  //----------------------------------------------------------------------------
+  // Allocate the given number of bytes, with the given alignment (must be a
+  // power of two, at most pointer-sized). Returns nullptr on allocation
+  // failure.
+  //----------------------------------------------------------------------------
+  void* allocate(size_t bytes, size_t alignment = alignof(void*));
+
+  //----------------------------------------------------------------------------
+  // Take ownership of a malloc'ed buffer, freed along with the arena.
+  // Returns false on allocation failure, in which case ownership stays
+  // with the caller.
+  //----------------------------------------------------------------------------
+  bool adopt(void *buffer);
+
+  //----------------------------------------------------------------------------
+  // Total bytes handed out so far, for tests and statistics
+  //----------------------------------------------------------------------------
+  size_t getAllocatedBytes() const {
+    return allocatedBytes;
+  }
+
+  //----------------------------------------------------------------------------
+  // Number of chunks beyond the inline one
+  //----------------------------------------------------------------------------
+  size_t getChunkCount() const {
+    return chunkCount;
+  }
+
+  //----------------------------------------------------------------------------
+  // Reader functions building reply trees inside the ReplyArena pointed to
+  // by the reader's privdata.
+  //----------------------------------------------------------------------------
+  static redisReplyObjectFunctions* getReaderFunctions();
+
+private:
+  static constexpr size_t kInlineSize = 256;
+  static constexpr size_t kFirstChunkSize = 4096;
+  static constexpr size_t kMaxChunkSize = 1024 * 1024;
+
+  struct ChunkHeader {
+    ChunkHeader *next;
+    size_t size;
+  };
+
+  struct AdoptedBuffer {
+    void *buffer;
+    AdoptedBuffer *next;
+  };
+
+  bool addChunk(size_t minimum);
+
+  alignas(16) char inlineChunk[kInlineSize];
+
+  char *current = inlineChunk;
+  size_t currentSize = kInlineSize;
+  size_t currentUsed = 0u;
+
+  MemoryResource *const resource;
+  ChunkHeader *chunks = nullptr;
+  AdoptedBuffer *adopted = nullptr;
+  size_t nextChunkSize = kFirstChunkSize;
+  size_t chunkCount = 0u;
+  size_t allocatedBytes = 0u;
+};
+
+}
+
+#endif
@@ -0,0 +1,180 @@
+//------------------------------------------------------------------------------
+// File: ReplyDecoder.cc
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#include "qclient/ReplyDecoder.hh"
+#include "reader/reader.hh"
+#include <stdlib.h>
+
+namespace qclient {
+
+//------------------------------------------------------------------------------
+// The top-level reply is a regular redisReply, built with the default reader
+// functions - empty, in case of an aggregate. Everything below it goes to
+// the decoder, and is represented by a placeholder towards the reader.
+//------------------------------------------------------------------------------
+static char decodedPlaceholder;
+
+//------------------------------------------------------------------------------
+// Depth of the given task within the reply, or -1 if it's part of an
+// attribute, which is not passed to the decoder.
+//------------------------------------------------------------------------------
+static int getDepth(const redisReadTask *task) {
+  int depth = 0;
+
+  for(const redisReadTask *parent = task->parent; parent; parent = parent->parent) {
+    if(parent->type == REDIS_REPLY_ATTR) {
+      return -1;
+    }
+
+    depth++;
+  }
+
+  return depth;
+}
+
+static ReplyDecoder* getDecoder(const redisReadTask *task) {
+  return (ReplyDecoder*) task->privdata;
+}
+
+static void *decodeString(const redisReadTask *task, char *str, size_t len) {
+  if(!task->parent) {
+    return redisReaderDefaultFunctions()->createString(task, str, len);
+  }
+
+  int depth = getDepth(task);
+  if(depth > 0) {
+    // Verbatim strings: Skip the content type.
+    if(task->type == REDIS_REPLY_VERB) {
+      str += 4;
+      len -= 4;
+    }
+
+    getDecoder(task)->onString(task->type, str, len, depth);
+  }
+
+  return &decodedPlaceholder;
+}
+
+static void *decodeAdoptedString(const redisReadTask *task, char *str, size_t len) {
+  if(!task->parent) {
+    return redisReaderDefaultFunctions()->adoptString(task, str, len);
+  }
+
+  void *obj = decodeString(task, str, len);
+  free(str);
+  return obj;
+}
+
+static void *decodeArray(const redisReadTask *task, size_t elements, int type) {
+  if(!task->parent) {
+    if(type != REDIS_REPLY_ATTR) {
+      getDecoder(task)->onAggregate(type, elements, 0);
+    }
+
+    return redisReaderDefaultFunctions()->createArray(task, 0, type);
+  }
+
+  int depth = getDepth(task);
+  if(depth > 0 && type != REDIS_REPLY_ATTR) {
+    getDecoder(task)->onAggregate(type, elements, depth);
+  }
+
+  return &decodedPlaceholder;
+}
+
+static void *decodeInteger(const redisReadTask *task, long long value) {
+  if(!task->parent) {
+    return redisReaderDefaultFunctions()->createInteger(task, value);
+  }
+
+  int depth = getDepth(task);
+  if(depth > 0) {
+    getDecoder(task)->onInteger(value, depth);
+  }
+
+  return &decodedPlaceholder;
+}
+
+static void *decodeDouble(const redisReadTask *task, double value, char *str, size_t len) {
+  if(!task->parent) {
+    return redisReaderDefaultFunctions()->createDouble(task, value, str, len);
+  }
+
+  int depth = getDepth(task);
+  if(depth > 0) {
+    getDecoder(task)->onDouble(value, depth);
+  }
+
+  return &decodedPlaceholder;
+}
+
+static void *decodeBool(const redisReadTask *task, int value) {
+  if(!task->parent) {
+    return redisReaderDefaultFunctions()->createBool(task, value);
+  }
+
+  int depth = getDepth(task);
+  if(depth > 0) {
+    getDecoder(task)->onBool(value != 0, depth);
+  }
+
+  return &decodedPlaceholder;
+}
+
+static void *decodeNil(const redisReadTask *task) {
+  if(!task->parent) {
+    return redisReaderDefaultFunctions()->createNil(task);
+  }
+
+  int depth = getDepth(task);
+  if(depth > 0) {
+    getDecoder(task)->onNil(depth);
+  }
+
+  return &decodedPlaceholder;
+}
+
+static void freeDecodedObject(void *obj) {
+  if(obj != &decodedPlaceholder) {
+    freeReplyObject(obj);
+  }
+}
+
+static redisReplyObjectFunctions decoderFunctions = {
+  decodeString,
+  decodeArray,
+  decodeInteger,
+  decodeNil,
+  freeDecodedObject,
+  decodeAdoptedString,
+  decodeDouble,
+  decodeBool,
+  nullptr
+};
+
+redisReplyObjectFunctions* ReplyDecoder::getReaderFunctions() {
+  return &decoderFunctions;
+}
+
+}
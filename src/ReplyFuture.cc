@@ -0,0 +1,209 @@
+//------------------------------------------------------------------------------
+// File: ReplyFuture.cc
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#include "qclient/ReplyFuture.hh"
+#include "qclient/QCallback.hh"
+#include "qclient/utils/Futex.hh"
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace qclient {
+
+//------------------------------------------------------------------------------
+// Shared state between a ReplyFuture and its request. Doubles as the
+// request's callback, and runs inline: Storing the reply and waking up the
+// waiter is cheap enough for the event loop thread.
+//
+// Holds two references while in flight - one for the future, one for the
+// callback - and goes back to the pool once both are dropped.
+//------------------------------------------------------------------------------
+class ReplySlot : public QCallback {
+public:
+  static constexpr uint32_t kEmpty = 0;
+  static constexpr uint32_t kWaiting = 1;
+  static constexpr uint32_t kReady = 2;
+
+  virtual void handleResponse(redisReplyPtr &&rep) override {
+    reply = std::move(rep);
+
+    if(state.exchange(kReady, std::memory_order_acq_rel) == kWaiting) {
+      futexWakeAll(&state);
+    }
+
+    release();
+  }
+
+  virtual bool runInline() const override {
+    return true;
+  }
+
+  bool waitUntil(std::chrono::steady_clock::time_point *deadline) {
+    uint32_t current = state.load(std::memory_order_acquire);
+
+    while(current != kReady) {
+      if(current == kEmpty &&
+         !state.compare_exchange_weak(current, kWaiting, std::memory_order_acq_rel)) {
+        continue;
+      }
+
+      std::chrono::nanoseconds timeout(-1);
+      if(deadline) {
+        timeout = *deadline - std::chrono::steady_clock::now();
+        if(timeout.count() <= 0) {
+          return false;
+        }
+      }
+
+      futexWait(&state, kWaiting, timeout);
+      current = state.load(std::memory_order_acquire);
+    }
+
+    return true;
+  }
+
+  void release();
+
+  std::atomic<uint32_t> state {kEmpty};
+  std::atomic<uint32_t> refs {0};
+  redisReplyPtr reply;
+  ReplySlot *nextFree = nullptr;
+};
+
+//------------------------------------------------------------------------------
+// Process-wide pool of slots, grown one slab at a time and never shrunk.
+// Intentionally leaked, as slots can be released during static destruction.
+//------------------------------------------------------------------------------
+class ReplySlotPool {
+public:
+  static constexpr size_t kSlabSize = 64;
+
+  static ReplySlotPool& instance() {
+    static ReplySlotPool *pool = new ReplySlotPool();
+    return *pool;
+  }
+
+  ReplySlot* acquire() {
+    std::lock_guard<std::mutex> lock(mtx);
+
+    if(!freeList) {
+      slabs.emplace_back(new ReplySlot[kSlabSize]);
+      for(size_t i = 0; i < kSlabSize; i++) {
+        slabs.back()[i].nextFree = freeList;
+        freeList = &slabs.back()[i];
+      }
+    }
+
+    ReplySlot *slot = freeList;
+    freeList = slot->nextFree;
+    slot->nextFree = nullptr;
+    return slot;
+  }
+
+  void put(ReplySlot *slot) {
+    std::lock_guard<std::mutex> lock(mtx);
+    slot->nextFree = freeList;
+    freeList = slot;
+  }
+
+private:
+  std::mutex mtx;
+  ReplySlot *freeList = nullptr;
+  std::vector<std::unique_ptr<ReplySlot[]>> slabs;
+};
+
+void ReplySlot::release() {
+  if(refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    reply.reset();
+    state.store(kEmpty, std::memory_order_relaxed);
+    ReplySlotPool::instance().put(this);
+  }
+}
+
+//------------------------------------------------------------------------------
+// ReplyFuture
+//------------------------------------------------------------------------------
+ReplyFuture ReplyFuture::create() {
+  ReplySlot *slot = ReplySlotPool::instance().acquire();
+  slot->refs.store(1, std::memory_order_relaxed);
+  return ReplyFuture(slot);
+}
+
+ReplyFuture::~ReplyFuture() {
+  if(slot) {
+    slot->release();
+  }
+}
+
+ReplyFuture::ReplyFuture(ReplyFuture &&other) : slot(other.slot) {
+  other.slot = nullptr;
+}
+
+ReplyFuture& ReplyFuture::operator=(ReplyFuture &&other) {
+  if(this != &other) {
+    if(slot) {
+      slot->release();
+    }
+
+    slot = other.slot;
+    other.slot = nullptr;
+  }
+
+  return *this;
+}
+
+QCallback* ReplyFuture::getCallback() {
+  slot->refs.fetch_add(1, std::memory_order_relaxed);
+  return slot;
+}
+
+bool ReplyFuture::ready() const {
+  return slot->state.load(std::memory_order_acquire) == ReplySlot::kReady;
+}
+
+void ReplyFuture::wait() const {
+  slot->waitUntil(nullptr);
+}
+
+std::future_status ReplyFuture::wait_for(std::chrono::milliseconds timeout) const {
+  std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + timeout;
+
+  if(slot->waitUntil(&deadline)) {
+    return std::future_status::ready;
+  }
+
+  return std::future_status::timeout;
+}
+
+redisReplyPtr ReplyFuture::get() {
+  slot->waitUntil(nullptr);
+
+  redisReplyPtr reply = std::move(slot->reply);
+  slot->release();
+  slot = nullptr;
+  return reply;
+}
+
+}
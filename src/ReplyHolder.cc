@@ -0,0 +1,228 @@
+//------------------------------------------------------------------------------
+// File: ReplyHolder.cc
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#include "ReplyHolder.hh"
+#include "reader/reader.hh"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "qclient/utils/AllocationAccounting.hh"
+
+namespace qclient {
+
+//------------------------------------------------------------------------------
+// Destructor
+//------------------------------------------------------------------------------
+ReplyHolder::~ReplyHolder() {
+  release();
+}
+
+//------------------------------------------------------------------------------
+// Start a new top-level node
+//------------------------------------------------------------------------------
+redisReply* ReplyHolder::claim(int type) {
+  assert(!claimed);
+
+  memset(&root, 0, sizeof(root));
+  root.type = type;
+  claimed = true;
+  return &root;
+}
+
+//------------------------------------------------------------------------------
+// Room for a string, inline if possible
+//------------------------------------------------------------------------------
+char* ReplyHolder::allocateString(size_t len) {
+  if(len < kInlineStringSize) {
+    return inlineString;
+  }
+
+  AllocationAccounting::record(AllocationCategory::kParsing, len+1);
+  return (char*) malloc(len+1);
+}
+
+//------------------------------------------------------------------------------
+// Free everything below the top-level node
+//------------------------------------------------------------------------------
+void ReplyHolder::release() {
+  if(!claimed) {
+    return;
+  }
+
+  if(root.element != nullptr) {
+    for(size_t i = 0; i < root.elements; i++) {
+      freeReplyObject(root.element[i]);
+    }
+
+    free(root.element);
+  }
+
+  if(root.str != nullptr && root.str != inlineString) {
+    free(root.str);
+  }
+
+  claimed = false;
+}
+
+//------------------------------------------------------------------------------
+// Reader functions: Only the top-level node goes into the holder, anything
+// else is delegated to the default functions.
+//------------------------------------------------------------------------------
+static ReplyHolder* getHolder(const redisReadTask *task) {
+  return (ReplyHolder*) task->privdata;
+}
+
+static void *createHeldString(const redisReadTask *task, char *str, size_t len) {
+  if(task->parent) {
+    return redisReaderDefaultFunctions()->createString(task, str, len);
+  }
+
+  ReplyHolder *holder = getHolder(task);
+  redisReply *r = holder->claim(task->type);
+
+  // Verbatim strings: Split off the content type.
+  if(task->type == REDIS_REPLY_VERB) {
+    memcpy(r->vtype, str, 3);
+    r->vtype[3] = '\0';
+    str += 4;
+    len -= 4;
+  }
+
+  char *buf = holder->allocateString(len);
+  if(buf == nullptr) {
+    holder->release();
+    return nullptr;
+  }
+
+  memcpy(buf, str, len);
+  buf[len] = '\0';
+  r->str = buf;
+  r->len = len;
+  return r;
+}
+
+static void *adoptHeldString(const redisReadTask *task, char *str, size_t len) {
+  if(task->parent) {
+    return redisReaderDefaultFunctions()->adoptString(task, str, len);
+  }
+
+  redisReply *r = getHolder(task)->claim(task->type);
+  r->str = str;
+  r->len = len;
+  return r;
+}
+
+static void *createHeldArray(const redisReadTask *task, size_t elements, int type) {
+  if(task->parent) {
+    return redisReaderDefaultFunctions()->createArray(task, elements, type);
+  }
+
+  ReplyHolder *holder = getHolder(task);
+  redisReply *r = holder->claim(type);
+
+  if(elements > 0) {
+    r->element = (redisReply**) calloc(elements, sizeof(redisReply*));
+    if(r->element == nullptr) {
+      holder->release();
+      return nullptr;
+    }
+  }
+
+  r->elements = elements;
+  return r;
+}
+
+static void *createHeldInteger(const redisReadTask *task, long long value) {
+  if(task->parent) {
+    return redisReaderDefaultFunctions()->createInteger(task, value);
+  }
+
+  redisReply *r = getHolder(task)->claim(REDIS_REPLY_INTEGER);
+  r->integer = value;
+  return r;
+}
+
+static void *createHeldDouble(const redisReadTask *task, double value, char *str, size_t len) {
+  if(task->parent) {
+    return redisReaderDefaultFunctions()->createDouble(task, value, str, len);
+  }
+
+  ReplyHolder *holder = getHolder(task);
+  redisReply *r = holder->claim(REDIS_REPLY_DOUBLE);
+
+  char *buf = holder->allocateString(len);
+  if(buf == nullptr) {
+    holder->release();
+    return nullptr;
+  }
+
+  memcpy(buf, str, len);
+  buf[len] = '\0';
+  r->dval = value;
+  r->str = buf;
+  r->len = len;
+  return r;
+}
+
+static void *createHeldBool(const redisReadTask *task, int value) {
+  if(task->parent) {
+    return redisReaderDefaultFunctions()->createBool(task, value);
+  }
+
+  redisReply *r = getHolder(task)->claim(REDIS_REPLY_BOOL);
+  r->integer = value != 0;
+  return r;
+}
+
+static void *createHeldNil(const redisReadTask *task) {
+  if(task->parent) {
+    return redisReaderDefaultFunctions()->createNil(task);
+  }
+
+  return getHolder(task)->claim(REDIS_REPLY_NIL);
+}
+
+static void freeHeldRoot(void *privdata, void *reply) {
+  ReplyHolder *holder = (ReplyHolder*) privdata;
+  assert(holder->get() == reply);
+  holder->release();
+}
+
+static redisReplyObjectFunctions holderFunctions = {
+  createHeldString,
+  createHeldArray,
+  createHeldInteger,
+  createHeldNil,
+  freeReplyObject,
+  adoptHeldString,
+  createHeldDouble,
+  createHeldBool,
+  freeHeldRoot
+};
+
+redisReplyObjectFunctions* ReplyHolder::getReaderFunctions() {
+  return &holderFunctions;
+}
+
+}
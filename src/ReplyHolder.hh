@@ -0,0 +1,86 @@
+//------------------------------------------------------------------------------
+// File: ReplyHolder.hh
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#ifndef QCLIENT_REPLY_HOLDER_HH
+#define QCLIENT_REPLY_HOLDER_HH
+
+#include "qclient/Reply.hh"
+#include <stddef.h>
+
+struct redisReplyObjectFunctions;
+
+namespace qclient {
+
+//------------------------------------------------------------------------------
+// Storage for the top-level node of a reply, meant to be created through
+// std::make_shared: The node, short strings, and the shared_ptr control
+// block then all live in a single allocation, instead of one each. The
+// rest of the tree is allocated by the default reader functions, as usual.
+//------------------------------------------------------------------------------
+class ReplyHolder {
+public:
+  ReplyHolder() {}
+  ~ReplyHolder();
+
+  ReplyHolder(const ReplyHolder&) = delete;
+  ReplyHolder& operator=(const ReplyHolder&) = delete;
+
+  //----------------------------------------------------------------------------
+  // Start a new top-level node of the given type - the previous one, if any,
+  // must have been released.
+  //----------------------------------------------------------------------------
+  redisReply* claim(int type);
+
+  //----------------------------------------------------------------------------
+  // Room for a string of len bytes, plus the null terminator: Inline if it
+  // fits, otherwise malloc'ed. nullptr on allocation failure.
+  //----------------------------------------------------------------------------
+  char* allocateString(size_t len);
+
+  //----------------------------------------------------------------------------
+  // Free everything below the top-level node
+  //----------------------------------------------------------------------------
+  void release();
+
+  redisReply* get() {
+    return &root;
+  }
+
+  //----------------------------------------------------------------------------
+  // Reader functions placing the top-level node inside the ReplyHolder
+  // pointed to by the reader's privdata.
+  //----------------------------------------------------------------------------
+  static redisReplyObjectFunctions* getReaderFunctions();
+
+private:
+  static constexpr size_t kInlineStringSize = 48;
+
+  redisReply root;
+  bool claimed = false;
+  char inlineString[kInlineStringSize];
+};
+
+}
+
+#endif
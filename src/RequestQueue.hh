@@ -26,6 +26,10 @@
 
 #include "qclient/queueing/WaitableQueue.hh"
 #include "StagedRequest.hh"
+#include "Tracepoints.hh"
+#include <atomic>
+#include <functional>
+#include <limits>
 
 namespace qclient {
 
@@ -61,6 +65,12 @@ namespace qclient {
 //
 // To be able to hold this invariant even at startup and keep the code simple,
 // we insert a dummy request during construction.
+//
+// The same trick, generalised: With MSG_ZEROCOPY, the kernel keeps reading
+// from request buffers long after ::send returned, until it reports the send
+// complete. The writer pins the oldest request such a send may still touch -
+// pop_front() then hides satisfied requests from that one onwards, instead of
+// freeing them, and catches up on a later pop_front() once they're unpinned.
 //------------------------------------------------------------------------------
 
 class RequestQueue {
@@ -75,27 +85,97 @@ public:
     insertDummyRequest();
   }
 
+  //----------------------------------------------------------------------------
+  // Block sizing - identical interface to WaitableQueue
+  //----------------------------------------------------------------------------
+  void setBlockSizes(size_t initial, size_t maximum) {
+    queue.setBlockSizes(initial, maximum);
+  }
+
+  //----------------------------------------------------------------------------
+  // Block allocation - identical interface to WaitableQueue
+  //----------------------------------------------------------------------------
+  void setMemoryResource(MemoryResource *resource) {
+    queue.setMemoryResource(resource);
+  }
+
+  //----------------------------------------------------------------------------
+  // Consumer spinning - identical interface to WaitableQueue
+  //----------------------------------------------------------------------------
+  void setSpinIterations(size_t iterations) {
+    queue.setSpinIterations(iterations);
+  }
+
   //----------------------------------------------------------------------------
   // Reset queue contents - identical interface to WaitableQueue
   //----------------------------------------------------------------------------
   void reset() {
     queue.reset();
+    hiddenPops = 0;
+    unpin();
     insertDummyRequest();
   }
 
   //----------------------------------------------------------------------------
-  // Constructs an item inside the queue - identical interface to WaitableQueue
+  // Constructs an item inside the queue - identical interface to WaitableQueue,
+  // except that the request always comes second, as in every StagedRequest
+  // constructor. That's where the stage tracepoint fires.
+  //----------------------------------------------------------------------------
+  template<typename Callback, typename... Args>
+  int64_t emplace_back(Callback &&callback, EncodedRequest &&req, Args&&... args) {
+    [[maybe_unused]] size_t len = req.getLen();
+    int64_t seq = queue.emplace_back(std::forward<Callback>(callback), std::move(req),
+      std::forward<Args>(args)...);
+    QCLIENT_TRACE(stage, seq, len);
+
+    if(stagingListener) stagingListener();
+    return seq;
+  }
+
+  //----------------------------------------------------------------------------
+  // Constructs many items in one go - identical interface to WaitableQueue
+  //----------------------------------------------------------------------------
+  template<typename Constructor>
+  int64_t emplace_many(size_t count, Constructor &&construct) {
+    int64_t seq = queue.emplace_many(count, std::forward<Constructor>(construct));
+    if(stagingListener) stagingListener();
+    return seq;
+  }
+
+  //----------------------------------------------------------------------------
+  // Called after every emplace_back and emplace_many, on the thread staging
+  // the request. Set before staging anything.
   //----------------------------------------------------------------------------
-  template<typename... Args>
-  void emplace_back(Args&&... args) {
-    queue.emplace_back(std::forward<Args>(args)...);
+  void setStagingListener(std::function<void()> listener) {
+    stagingListener = std::move(listener);
   }
 
   //----------------------------------------------------------------------------
   // Pop an item from the front - identical interface to WaitableQueue.
   //----------------------------------------------------------------------------
   void pop_front() {
-    queue.pop_front();
+    int64_t hidden = hiddenPops.load(std::memory_order_relaxed) + 1;
+    int64_t pinned = pinnedFrom.load();
+
+    while(hidden > 0 && frontSeq < pinned) {
+      queue.pop_front();
+      frontSeq++;
+      hidden--;
+    }
+
+    hiddenPops.store(hidden, std::memory_order_relaxed);
+  }
+
+  //----------------------------------------------------------------------------
+  // Keep every request from the given sequence number onwards alive, even
+  // once popped. Only one pin at a time - pin again to move it.
+  //----------------------------------------------------------------------------
+  void pin(int64_t seq) {
+    pinnedFrom = seq;
+  }
+
+  void unpin() {
+    pinnedFrom = std::numeric_limits<int64_t>::max();
   }
 
   //----------------------------------------------------------------------------
@@ -104,6 +184,11 @@ public:
   Iterator begin() {
     auto iter = queue.begin();
     iter.next();
+
+    for(int64_t i = 0; i < hiddenPops.load(std::memory_order_relaxed); i++) {
+      iter.next();
+    }
+
     return iter;
   }
 
@@ -126,15 +211,24 @@ public:
   // What is the size of the queue? Dummy item not included.
   //----------------------------------------------------------------------------
   size_t size() const {
-    return queue.size() - 1;
+    return queue.size() - 1 - hiddenPops.load(std::memory_order_relaxed);
   }
 
 private:
   void insertDummyRequest() {
     queue.emplace_back(nullptr, EncodedRequest(std::vector<std::string>{"dummy"}));
+    frontSeq = queue.begin().seq();
   }
 
   QueueType queue;
+
+  // Sequence number of the physical front, touched by the popping thread only
+  int64_t frontSeq = 0;
+
+  // Popped requests still held back by a pin, beyond the usual one
+  std::atomic<int64_t> hiddenPops {0};
+  std::atomic<int64_t> pinnedFrom {std::numeric_limits<int64_t>::max()};
+  std::function<void()> stagingListener;
 };
 
 }
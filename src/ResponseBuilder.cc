@@ -22,8 +22,14 @@
  ************************************************************************/
 
 #include "qclient/ResponseBuilder.hh"
+#include "qclient/QCallback.hh"
+#include "qclient/ReplyDecoder.hh"
 #include "qclient/QClient.hh"
 #include "reader/reader.hh"
+#include "ReplyArena.hh"
+#include "ReplyHolder.hh"
+#include "CommonReplies.hh"
+#include "qclient/utils/AllocationAccounting.hh"
 #include <sstream>
 
 #define SSTR(message) static_cast<std::ostringstream&>(std::ostringstream().flush() << message).str()
@@ -35,7 +41,71 @@ ResponseBuilder::ResponseBuilder() {
 }
 
 void ResponseBuilder::restart() {
-  reader.reset(redisReaderCreate());
+  currentArena.reset();
+
+  if(arenaMode) {
+    reader.reset(redisReaderCreateWithFunctions(ReplyArena::getReaderFunctions()));
+  }
+  else {
+    reader.reset(redisReaderCreateWithFunctions(ReplyHolder::getReaderFunctions()));
+  }
+
+  currentHolder.reset();
+  reader->bulkThreshold = largeStringThreshold;
+  replyFunctions = reader->fn;
+
+  activeSink = nullptr;
+  activeDecoder = nullptr;
+  if(bulkSinkLookup) {
+    reader->streamBegin = &ResponseBuilder::streamBegin;
+    reader->streamChunk = &ResponseBuilder::streamChunk;
+    reader->streamPrivdata = this;
+  }
+}
+
+void ResponseBuilder::setArenaMode(bool enabled) {
+  arenaMode = enabled;
+  restart();
+}
+
+void ResponseBuilder::setMemoryResource(MemoryResource *resource) {
+  memoryResource = resource;
+  restart();
+}
+
+void ResponseBuilder::setLargeStringThreshold(size_t threshold) {
+  largeStringThreshold = threshold;
+  reader->bulkThreshold = threshold;
+}
+
+size_t ResponseBuilder::getBufferedBytes() const {
+  return (reader->len - reader->pos) + (reader->bulk ? reader->bulkFilled : 0u);
+}
+
+void ResponseBuilder::setReplyDecoderLookup(std::function<ReplyDecoder*()> lookup) {
+  replyDecoderLookup = std::move(lookup);
+}
+
+void ResponseBuilder::setBulkSinkLookup(std::function<BulkSink*()> lookup) {
+  bulkSinkLookup = std::move(lookup);
+  restart();
+}
+
+int ResponseBuilder::streamBegin(void *privdata, size_t len) {
+  ResponseBuilder *self = (ResponseBuilder*) privdata;
+
+  self->activeSink = self->bulkSinkLookup();
+  if(!self->activeSink) {
+    return 0;
+  }
+
+  self->activeSink->onStart(len);
+  return 1;
+}
+
+void ResponseBuilder::streamChunk(void *privdata, const char *data, size_t len) {
+  ResponseBuilder *self = (ResponseBuilder*) privdata;
+  self->activeSink->onChunk(data, len);
 }
 
 void ResponseBuilder::feed(const char* buff, size_t len) {
@@ -48,6 +118,14 @@ void ResponseBuilder::feed(const std::string &str) {
   feed(str.c_str(), str.size());
 }
 
+char* ResponseBuilder::getWriteBuffer(size_t &len) {
+  return redisReaderGetWriteBuffer(reader.get(), &len);
+}
+
+void ResponseBuilder::commitWrite(size_t len) {
+  redisReaderCommitWrite(reader.get(), len);
+}
+
 void ResponseBuilder::Deleter::operator()(redisReader *reader) {
   redisReaderFree(reader);
 }
@@ -55,6 +133,54 @@ void ResponseBuilder::Deleter::operator()(redisReader *reader) {
 ResponseBuilder::Status ResponseBuilder::pull(redisReplyPtr &out) {
   void* reply = nullptr;
 
+  //----------------------------------------------------------------------------
+  // No reply in progress: Find out whether the next one is to be decoded.
+  // The reader functions only ever change in between replies.
+  //----------------------------------------------------------------------------
+  if(reader->ridx == -1) {
+    activeDecoder = replyDecoderLookup ? replyDecoderLookup() : nullptr;
+    reader->fn = activeDecoder ? ReplyDecoder::getReaderFunctions() : replyFunctions;
+  }
+
+  //----------------------------------------------------------------------------
+  // The reader hands privdata to every task of a reply tree, as the reply
+  // starts. An incomplete reply keeps using the same arena or holder on the
+  // next call.
+  //----------------------------------------------------------------------------
+  if(activeDecoder) {
+    reader->privdata = activeDecoder;
+  }
+  else if(arenaMode) {
+    if(!currentArena && memoryResource) {
+      // The control block comes out of the resource as well. Running out of
+      // it is an allocation failure, same as inside the reader.
+      try {
+        currentArena = std::allocate_shared<ReplyArena>(
+          ResourceAllocator<ReplyArena>(memoryResource), memoryResource);
+      }
+      catch(const std::bad_alloc&) {
+        return Status::kProtocolError;
+      }
+
+      AllocationAccounting::record(AllocationCategory::kParsing, sizeof(ReplyArena));
+    }
+    else if(!currentArena) {
+      currentArena = std::make_shared<ReplyArena>();
+      AllocationAccounting::record(AllocationCategory::kParsing, sizeof(ReplyArena));
+    }
+
+    reader->privdata = currentArena.get();
+  }
+  else {
+    // make_shared: The control block comes in the same allocation.
+    if(!currentHolder) {
+      currentHolder = std::make_shared<ReplyHolder>();
+      AllocationAccounting::record(AllocationCategory::kParsing, sizeof(ReplyHolder));
+    }
+
+    reader->privdata = currentHolder.get();
+  }
+
   if(redisReaderGetReply(reader.get(), &reply) == REDIS_ERR) {
     return Status::kProtocolError;
   }
@@ -63,10 +189,64 @@ ResponseBuilder::Status ResponseBuilder::pull(redisReplyPtr &out) {
     return Status::kIncomplete;
   }
 
-  out = redisReplyPtr(redisReplyPtr((redisReply*) reply, freeReplyObject));
+  if(activeDecoder) {
+    // Built with the default reader functions, irrespective of arena mode.
+    activeDecoder = nullptr;
+    out = redisReplyPtr((redisReply*) reply, freeReplyObject);
+    return Status::kOk;
+  }
+
+  if(arenaMode) {
+    // Aliasing constructor: The reply shares ownership of its arena.
+    out = redisReplyPtr(std::move(currentArena), (redisReply*) reply);
+    currentArena.reset();
+    return Status::kOk;
+  }
+
+  //----------------------------------------------------------------------------
+  // A common reply: Hand out the shared copy, and keep the holder for the
+  // next reply.
+  //----------------------------------------------------------------------------
+  ReplyHolder *holder = currentHolder.get();
+  if(CommonReplies::lookup(holder->get(), out)) {
+    holder->release();
+    return Status::kOk;
+  }
+
+  // Aliasing constructor: The reply shares ownership of its holder.
+  out = redisReplyPtr(std::move(currentHolder), holder->get());
+  currentHolder.reset();
   return Status::kOk;
 }
 
+ResponseBuilder::Status ResponseBuilder::skipStatus(const char *status, size_t len) {
+  int rc = redisReaderSkipStatus(reader.get(), status, len);
+
+  if(rc == 1) {
+    return Status::kOk;
+  }
+
+  if(rc == 0) {
+    return Status::kIncomplete;
+  }
+
+  return Status::kProtocolError;
+}
+
+ResponseBuilder::Status ResponseBuilder::skipSimple() {
+  int rc = redisReaderSkipSimple(reader.get());
+
+  if(rc == 1) {
+    return Status::kOk;
+  }
+
+  if(rc == 0) {
+    return Status::kIncomplete;
+  }
+
+  return Status::kProtocolError;
+}
+
 redisReplyPtr ResponseBuilder::makeInt(int val) {
   ResponseBuilder builder;
   builder.feed(SSTR(":" << val << "\r\n"));
@@ -23,6 +23,7 @@
 
 #include "qclient/ResponseParsing.hh"
 #include "qclient/QClient.hh"
+#include <algorithm>
 #include <sstream>
 
 #define SSTR(message) static_cast<std::ostringstream&>(std::ostringstream().flush() << message).str()
@@ -46,7 +47,15 @@ StatusParser::StatusParser(const redisReply *reply) {
   val = std::string(reply->str, reply->len);
 }
 
-StatusParser::StatusParser(const redisReplyPtr reply) : StatusParser(reply.get()) { }
+StatusParser::StatusParser(const redisReplyPtr reply) {
+  if(!reply || reply->type != REDIS_REPLY_STATUS) {
+    *this = StatusParser(reply.get());
+    return;
+  }
+
+  isOk = true;
+  holder = reply;
+}
 
 bool StatusParser::ok() const {
   return isOk;
@@ -56,7 +65,23 @@ std::string StatusParser::err() const {
   return error;
 }
 
-std::string StatusParser::value() const {
+std::string StatusParser::value() const & {
+  return std::string(view());
+}
+
+std::string StatusParser::value() && {
+  if(holder) {
+    return std::string(view());
+  }
+
+  return std::move(val);
+}
+
+StringView StatusParser::view() const {
+  if(holder) {
+    return StringView(holder->str, holder->len);
+  }
+
   return val;
 }
 
@@ -98,7 +123,7 @@ StringParser::StringParser(const redisReply *reply) {
     return;
   }
 
-  if(reply->type != REDIS_REPLY_STRING) {
+  if(reply->type != REDIS_REPLY_STRING && reply->type != REDIS_REPLY_VERB) {
     error = SSTR("Unexpected reply type; was expecting STRING, received " << qclient::describeRedisReply(reply));
     isOk = false;
     return;
@@ -108,7 +133,15 @@ StringParser::StringParser(const redisReply *reply) {
   val = std::string(reply->str, reply->len);
 }
 
-StringParser::StringParser(const redisReplyPtr reply) : StringParser(reply.get()) { }
+StringParser::StringParser(const redisReplyPtr reply) {
+  if(!reply || (reply->type != REDIS_REPLY_STRING && reply->type != REDIS_REPLY_VERB)) {
+    *this = StringParser(reply.get());
+    return;
+  }
+
+  isOk = true;
+  holder = reply;
+}
 
 bool StringParser::ok() const {
   return isOk;
@@ -118,57 +151,118 @@ std::string StringParser::err() const {
   return error;
 }
 
-std::string StringParser::value() const {
+std::string StringParser::value() const & {
+  return std::string(view());
+}
+
+std::string StringParser::value() && {
+  if(holder) {
+    return std::string(view());
+  }
+
+  return std::move(val);
+}
+
+StringView StringParser::view() const {
+  if(holder) {
+    return StringView(holder->str, holder->len);
+  }
+
   return val;
 }
 
-HgetallParser::HgetallParser(const redisReplyPtr reply) : HgetallParser(reply.get()) {}
+HgetallParser::HgetallParser(const redisReplyPtr reply) {
+  isOk = parse(reply.get());
+  if(isOk) {
+    holder = reply;
+  }
+}
 
 HgetallParser::HgetallParser(const redisReply *reply) {
+  isOk = parse(reply);
+  if(!isOk) {
+    return;
+  }
+
+  // The caller's reply may go away at any time, copy everything now and
+  // point the flat view into the map instead.
+  val = buildMap();
+  materialized = true;
+
+  size_t i = 0;
+  for(auto it = val.begin(); it != val.end(); it++, i++) {
+    flat[i] = { it->first, it->second };
+  }
+}
+
+//------------------------------------------------------------------------------
+// Check the reply and collect views into it - no strings are copied
+//------------------------------------------------------------------------------
+bool HgetallParser::parse(const redisReply *reply) {
   if(reply == nullptr) {
     error = "Received null redisReply";
-    isOk = false;
-    return;
+    return false;
   }
 
-  if(reply->type != REDIS_REPLY_ARRAY) {
+  // RESP3 servers send a map, RESP2 ones a flat array - the layout of the
+  // elements is the same.
+  if(reply->type != REDIS_REPLY_ARRAY && reply->type != REDIS_REPLY_MAP) {
     error = SSTR("Unexpected reply type; was expecting ARRAY, received " << qclient::describeRedisReply(reply));
-    isOk = false;
-    return;
+    return false;
   }
 
   if(reply->elements % 2 != 0) {
     error = SSTR("Unexpected number of elements; expected a multiple of 2, received " << reply->elements);
-    isOk = false;
-    return;
+    return false;
   }
 
-  for(size_t i = 0; i < reply->elements; i += 2) {
-    StringParser parserKey(reply->element[i]);
+  flat.reserve(reply->elements / 2);
+
+  for(size_t i = 0; i < reply->elements; i++) {
+    const redisReply *element = reply->element[i];
 
-    if(!parserKey.ok()) {
-      error = SSTR("Unexpected reply type for element #" << i << ": " << parserKey.err());
-      isOk = false;
-      return;
+    if(element->type != REDIS_REPLY_STRING && element->type != REDIS_REPLY_VERB) {
+      error = SSTR("Unexpected reply type for element #" << i << ": Unexpected reply type; was expecting STRING, received " << qclient::describeRedisReply(element));
+      flat.clear();
+      return false;
     }
 
-    StringParser parserValue(reply->element[i+1]);
-    if(!parserValue.ok()) {
-      error = SSTR("Unexpected reply type for element #" << i+1 << ": " << parserValue.err());
-      isOk = false;
-      return;
+    StringView str(element->str, element->len);
+    if(i % 2 == 0) {
+      flat.emplace_back(str, StringView());
     }
+    else {
+      flat.back().second = str;
+    }
+  }
 
-    if(val.find(parserKey.value()) != val.end()) {
-      error = SSTR("Found duplicate key: '" << parserKey.value() << "'");
-      isOk = false;
-      return;
+  std::sort(flat.begin(), flat.end(), [](const auto &a, const auto &b) {
+    return a.first < b.first;
+  });
+
+  for(size_t i = 1; i < flat.size(); i++) {
+    if(flat[i-1].first == flat[i].first) {
+      error = SSTR("Found duplicate key: '" << flat[i].first << "'");
+      flat.clear();
+      return false;
     }
+  }
+
+  return true;
+}
 
-    val.emplace(parserKey.value(), parserValue.value());
+//------------------------------------------------------------------------------
+// flat is already sorted, so every insertion lands at the end of the map
+//------------------------------------------------------------------------------
+std::map<std::string, std::string> HgetallParser::buildMap() const {
+  std::map<std::string, std::string> out;
+
+  for(auto it = flat.begin(); it != flat.end(); it++) {
+    out.emplace_hint(out.end(), std::piecewise_construct,
+      std::forward_as_tuple(it->first), std::forward_as_tuple(it->second));
   }
 
-  isOk = true;
+  return out;
 }
 
 bool HgetallParser::ok() const {
@@ -179,8 +273,39 @@ std::string HgetallParser::err() const {
   return error;
 }
 
-std::map<std::string, std::string> HgetallParser::value() const {
+const std::map<std::string, std::string>& HgetallParser::value() const & {
+  if(!materialized) {
+    val = buildMap();
+    materialized = true;
+  }
+
   return val;
 }
 
+std::map<std::string, std::string> HgetallParser::value() && {
+  if(materialized) {
+    return std::move(val);
+  }
+
+  return buildMap();
+}
+
+const HgetallParser::FlatView& HgetallParser::view() const {
+  return flat;
+}
+
+bool HgetallParser::find(StringView field, StringView &out) const {
+  auto it = std::lower_bound(flat.begin(), flat.end(), field,
+    [](const auto &entry, StringView key) {
+      return entry.first < key;
+    });
+
+  if(it == flat.end() || it->first != field) {
+    return false;
+  }
+
+  out = it->second;
+  return true;
+}
+
 }
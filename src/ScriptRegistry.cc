@@ -0,0 +1,97 @@
+//------------------------------------------------------------------------------
+// File: ScriptRegistry.cc
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#include <openssl/sha.h>
+
+#include "qclient/ScriptRegistry.hh"
+
+namespace qclient {
+
+//------------------------------------------------------------------------------
+// Lowercase hex SHA1 of the given script
+//------------------------------------------------------------------------------
+std::string ScriptRegistry::digest(const std::string &script) {
+  static const char kHex[] = "0123456789abcdef";
+
+  unsigned char hash[SHA_DIGEST_LENGTH];
+  SHA1((const unsigned char*) script.data(), script.size(), hash);
+
+  std::string out;
+  out.reserve(SHA_DIGEST_LENGTH * 2);
+
+  for(size_t i = 0; i < SHA_DIGEST_LENGTH; i++) {
+    out.push_back(kHex[hash[i] >> 4]);
+    out.push_back(kHex[hash[i] & 0x0F]);
+  }
+
+  return out;
+}
+
+//------------------------------------------------------------------------------
+// Register the given script, if not already known, and return its digest
+//------------------------------------------------------------------------------
+std::string ScriptRegistry::add(const std::string &script) {
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    auto it = digests.find(script);
+    if(it != digests.end()) {
+      return it->second;
+    }
+  }
+
+  std::string sha = digest(script);
+
+  std::lock_guard<std::mutex> lock(mtx);
+  scripts.emplace(sha, script);
+  digests.emplace(script, sha);
+  return sha;
+}
+
+//------------------------------------------------------------------------------
+// Look up a script by digest
+//------------------------------------------------------------------------------
+bool ScriptRegistry::get(const std::string &sha, std::string &script) const {
+  std::lock_guard<std::mutex> lock(mtx);
+  auto it = scripts.find(sha);
+  if(it == scripts.end()) {
+    return false;
+  }
+
+  script = it->second;
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// All registered scripts
+//------------------------------------------------------------------------------
+std::vector<std::pair<std::string, std::string>> ScriptRegistry::getAll() const {
+  std::lock_guard<std::mutex> lock(mtx);
+  return std::vector<std::pair<std::string, std::string>>(scripts.begin(), scripts.end());
+}
+
+size_t ScriptRegistry::size() const {
+  std::lock_guard<std::mutex> lock(mtx);
+  return scripts.size();
+}
+
+}
@@ -0,0 +1,148 @@
+//------------------------------------------------------------------------------
+// File: ServerCapabilities.cc
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2016 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#include "qclient/ServerCapabilities.hh"
+#include <sstream>
+
+namespace qclient {
+
+namespace {
+
+struct Requirement {
+  Capability capability;
+  QuarkDBVersion minimum;
+};
+
+//------------------------------------------------------------------------------
+// First server versions supporting each capability
+//------------------------------------------------------------------------------
+const Requirement quarkdbRequirements[] = {
+  { Capability::kPushTypes, QuarkDBVersion(0, 3, 0, "") },
+  { Capability::kIncrementalResilvering, QuarkDBVersion(0, 4, 3, "") },
+  { Capability::kBatchDequePop, QuarkDBVersion(0, 4, 3, "") },
+};
+
+const Requirement redisRequirements[] = {
+  { Capability::kClientTracking, QuarkDBVersion(6, 0, 0, "") },
+};
+
+const char* capabilityName(Capability cap) {
+  switch(cap) {
+    case Capability::kPushTypes: return "push-types";
+    case Capability::kIncrementalResilvering: return "incremental-resilvering";
+    case Capability::kBatchDequePop: return "batch-deque-pop";
+    case Capability::kClientTracking: return "client-tracking";
+    case Capability::kCount: break;
+  }
+
+  return "unknown";
+}
+
+}
+
+//------------------------------------------------------------------------------
+// Capabilities of the given QuarkDB version. Development builds compare
+// greater than their release, and get its capabilities.
+//------------------------------------------------------------------------------
+ServerCapabilities ServerCapabilities::forQuarkDB(const QuarkDBVersion &version) {
+  ServerCapabilities caps = forUnknownServer();
+  caps.mServer = Server::kQuarkDB;
+  caps.mVersion = version;
+
+  for(const Requirement &req : quarkdbRequirements) {
+    if(version >= req.minimum) {
+      caps.mBits |= bit(req.capability);
+    }
+  }
+
+  return caps;
+}
+
+//------------------------------------------------------------------------------
+// Capabilities of the given redis version - push types need RESP3, which
+// we don't speak.
+//------------------------------------------------------------------------------
+ServerCapabilities ServerCapabilities::forRedis(const QuarkDBVersion &version) {
+  ServerCapabilities caps = forUnknownServer();
+  caps.mServer = Server::kRedis;
+  caps.mVersion = version;
+
+  for(const Requirement &req : redisRequirements) {
+    if(version >= req.minimum) {
+      caps.mBits |= bit(req.capability);
+    }
+  }
+
+  return caps;
+}
+
+ServerCapabilities ServerCapabilities::forUnknownServer() {
+  ServerCapabilities caps;
+  caps.mNegotiated = true;
+  return caps;
+}
+
+std::string ServerCapabilities::toString() const {
+  if(!mNegotiated) {
+    return "not negotiated";
+  }
+
+  std::ostringstream ss;
+  switch(mServer) {
+    case Server::kQuarkDB: ss << "quarkdb " << mVersion.toString(); break;
+    case Server::kRedis: ss << "redis " << mVersion.toString(); break;
+    case Server::kUnknown: ss << "unknown server"; break;
+  }
+
+  for(uint32_t i = 0; i < static_cast<uint32_t>(Capability::kCount); i++) {
+    Capability cap = static_cast<Capability>(i);
+    if(has(cap)) {
+      ss << " " << capabilityName(cap);
+    }
+  }
+
+  return ss.str();
+}
+
+void CapabilityCache::store(const Endpoint &endpoint, const ServerCapabilities &caps) {
+  std::lock_guard<std::mutex> lock(mtx);
+  entries[endpoint] = caps;
+}
+
+ServerCapabilities CapabilityCache::get(const Endpoint &endpoint) const {
+  std::lock_guard<std::mutex> lock(mtx);
+
+  auto it = entries.find(endpoint);
+  if(it == entries.end()) {
+    return ServerCapabilities();
+  }
+
+  return it->second;
+}
+
+size_t CapabilityCache::size() const {
+  std::lock_guard<std::mutex> lock(mtx);
+  return entries.size();
+}
+
+}
@@ -0,0 +1,114 @@
+//------------------------------------------------------------------------------
+// File: ShardedBackgroundFlusher.cc
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#include "qclient/ShardedBackgroundFlusher.hh"
+#include <algorithm>
+
+namespace qclient {
+
+namespace {
+
+//------------------------------------------------------------------------------
+// 64-bit FNV-1a - unlike std::hash, guaranteed to stay the same across
+// builds, which routing of persisted items relies on.
+//------------------------------------------------------------------------------
+uint64_t stableHash(const std::string &key) {
+  uint64_t hash = 14695981039346656037ull;
+  for(size_t i = 0; i < key.size(); i++) {
+    hash ^= (uint8_t) key[i];
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+}
+
+ShardedBackgroundFlusher::ShardedBackgroundFlusher(size_t shards,
+  const Members &members, qclient::Options &&options, Notifier &notifier,
+  const PersistencyFactory &factory) {
+
+  flushers.reserve(std::max<size_t>(shards, 1));
+  for(size_t i = 0; i < std::max<size_t>(shards, 1); i++) {
+    flushers.emplace_back(new BackgroundFlusher(members, options.clone(), notifier, factory(i)));
+  }
+}
+
+void ShardedBackgroundFlusher::pushRequest(const std::string &key,
+  const std::vector<std::string> &operation) {
+  flushers[getShard(key)]->pushRequest(operation);
+}
+
+void ShardedBackgroundFlusher::pushRequest(const std::string &key,
+  std::vector<std::string> &&operation) {
+  flushers[getShard(key)]->pushRequest(std::move(operation));
+}
+
+size_t ShardedBackgroundFlusher::getShardCount() const {
+  return flushers.size();
+}
+
+size_t ShardedBackgroundFlusher::getShard(const std::string &key) const {
+  return stableHash(key) % flushers.size();
+}
+
+BackgroundFlusher& ShardedBackgroundFlusher::getFlusher(size_t shard) {
+  return *flushers[shard];
+}
+
+void ShardedBackgroundFlusher::enableGroupCommit(size_t maxAckBatch) {
+  for(size_t i = 0; i < flushers.size(); i++) {
+    flushers[i]->enableGroupCommit(maxAckBatch);
+  }
+}
+
+void ShardedBackgroundFlusher::setReplayWindow(size_t window) {
+  for(size_t i = 0; i < flushers.size(); i++) {
+    flushers[i]->setReplayWindow(window);
+  }
+}
+
+size_t ShardedBackgroundFlusher::size() const {
+  size_t total = 0;
+  for(size_t i = 0; i < flushers.size(); i++) {
+    total += flushers[i]->size();
+  }
+  return total;
+}
+
+int64_t ShardedBackgroundFlusher::getEnqueuedAndClear() {
+  int64_t total = 0;
+  for(size_t i = 0; i < flushers.size(); i++) {
+    total += flushers[i]->getEnqueuedAndClear();
+  }
+  return total;
+}
+
+int64_t ShardedBackgroundFlusher::getAcknowledgedAndClear() {
+  int64_t total = 0;
+  for(size_t i = 0; i < flushers.size(); i++) {
+    total += flushers[i]->getAcknowledgedAndClear();
+  }
+  return total;
+}
+
+}
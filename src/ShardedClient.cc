@@ -0,0 +1,400 @@
+//------------------------------------------------------------------------------
+// File: ShardedClient.cc
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#include "qclient/ShardedClient.hh"
+#include "qclient/ResponseBuilder.hh"
+#include <algorithm>
+#include <atomic>
+#include <string.h>
+
+namespace qclient {
+
+//------------------------------------------------------------------------------
+// 64-bit FNV-1a, finalized with the splitmix64 mixer - similar keys and
+// virtual node names would otherwise cluster together on the ring.
+//------------------------------------------------------------------------------
+static uint64_t ringHash(const char *data, size_t len) {
+  uint64_t hash = 14695981039346656037ull;
+  for(size_t i = 0; i < len; i++) {
+    hash ^= (uint8_t) data[i];
+    hash *= 1099511628211ull;
+  }
+
+  hash ^= hash >> 30;
+  hash *= 0xbf58476d1ce4e5b9ull;
+  hash ^= hash >> 27;
+  hash *= 0x94d049bb133111ebull;
+  hash ^= hash >> 31;
+  return hash;
+}
+
+//------------------------------------------------------------------------------
+// Build the ring
+//------------------------------------------------------------------------------
+ConsistentHashRing::ConsistentHashRing(size_t shardCount, size_t virtualNodes)
+: shards(std::max<size_t>(shardCount, 1)) {
+  virtualNodes = std::max<size_t>(virtualNodes, 1);
+  points.reserve(shards * virtualNodes);
+
+  for(size_t shard = 0; shard < shards; shard++) {
+    for(size_t node = 0; node < virtualNodes; node++) {
+      std::string name = "shard-" + std::to_string(shard) + "-" + std::to_string(node);
+      points.emplace_back(ringHash(name.data(), name.size()), shard);
+    }
+  }
+
+  std::sort(points.begin(), points.end());
+}
+
+//------------------------------------------------------------------------------
+// Find the shard owning the given key
+//------------------------------------------------------------------------------
+size_t ConsistentHashRing::getShard(const char *key, size_t len) const {
+  const char *open = (const char*) memchr(key, '{', len);
+  if(open) {
+    const char *close = (const char*) memchr(open + 1, '}', key + len - open - 1);
+    if(close && close != open + 1) {
+      key = open + 1;
+      len = close - key;
+    }
+  }
+
+  uint64_t hash = ringHash(key, len);
+  auto it = std::lower_bound(points.begin(), points.end(),
+    std::make_pair(hash, (size_t) 0));
+
+  if(it == points.end()) {
+    it = points.begin();
+  }
+
+  return it->second;
+}
+
+//------------------------------------------------------------------------------
+// Find the argument with the given index inside the first segment of the
+// encoded request, as in "*3\r\n$4\r\nHGET\r\n$3\r\nkey\r\n..."
+//------------------------------------------------------------------------------
+static bool findArgument(const EncodedRequest &req, size_t index, const char *&data, size_t &len) {
+  if(req.getSegmentCount() == 0) {
+    return false;
+  }
+
+  EncodedRequest::Segment segment = req.getSegment(0);
+  const char *end = segment.data + segment.len;
+
+  const char *pos = (const char*) memchr(segment.data, '\n', segment.len);
+  if(!pos) {
+    return false;
+  }
+
+  for(size_t i = 0; i <= index; i++) {
+    if(end - pos < 2 || pos[1] != '$') {
+      return false;
+    }
+
+    const char *lengthStart = pos + 2;
+    pos = (const char*) memchr(lengthStart, '\n', end - lengthStart);
+    if(!pos) {
+      return false;
+    }
+
+    size_t length = strtoull(lengthStart, nullptr, 10);
+    const char *argument = pos + 1;
+    if(length + 2 > (size_t) (end - argument)) {
+      return false;
+    }
+
+    if(i == index) {
+      data = argument;
+      len = length;
+      return true;
+    }
+
+    pos = argument + length + 1;
+  }
+
+  return false;
+}
+
+//------------------------------------------------------------------------------
+// Encode a reply back into RESP, to assemble merged replies
+//------------------------------------------------------------------------------
+static void appendReply(std::string &out, const redisReply *reply) {
+  switch(reply->type) {
+    case REDIS_REPLY_NIL: {
+      out += "$-1\r\n";
+      break;
+    }
+    case REDIS_REPLY_INTEGER: {
+      out += ":" + std::to_string(reply->integer) + "\r\n";
+      break;
+    }
+    case REDIS_REPLY_STATUS: {
+      out += "+";
+      out.append(reply->str, reply->len);
+      out += "\r\n";
+      break;
+    }
+    case REDIS_REPLY_ERROR: {
+      out += "-";
+      out.append(reply->str, reply->len);
+      out += "\r\n";
+      break;
+    }
+    case REDIS_REPLY_ARRAY:
+    case REDIS_REPLY_SET:
+    case REDIS_REPLY_PUSH: {
+      out += "*" + std::to_string(reply->elements) + "\r\n";
+      for(size_t i = 0; i < reply->elements; i++) {
+        appendReply(out, reply->element[i]);
+      }
+      break;
+    }
+    default: {
+      out += "$" + std::to_string(reply->len) + "\r\n";
+      out.append(reply->str, reply->len);
+      out += "\r\n";
+    }
+  }
+}
+
+//------------------------------------------------------------------------------
+// Replies of a multi-key command, one per shard involved - merged once the
+// last one arrives, on whichever callback thread delivers it.
+//------------------------------------------------------------------------------
+struct MultiKeyMerge {
+  std::promise<redisReplyPtr> promise;
+  std::vector<redisReplyPtr> replies;
+  std::vector<std::vector<size_t>> positions;
+  std::atomic<size_t> remaining {0};
+  size_t totalKeys = 0;
+
+  void deliver(size_t batch, redisReplyPtr &&reply) {
+    replies[batch] = std::move(reply);
+    if(remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      promise.set_value(merge());
+    }
+  }
+
+  redisReplyPtr merge() {
+    bool allIntegers = true;
+    bool allArrays = true;
+
+    for(size_t i = 0; i < replies.size(); i++) {
+      if(!replies[i] || replies[i]->type == REDIS_REPLY_ERROR) {
+        return replies[i];
+      }
+
+      allIntegers &= (replies[i]->type == REDIS_REPLY_INTEGER);
+      allArrays &= (replies[i]->type == REDIS_REPLY_ARRAY &&
+        replies[i]->elements == positions[i].size());
+    }
+
+    if(allIntegers) {
+      long long sum = 0;
+      for(size_t i = 0; i < replies.size(); i++) {
+        sum += replies[i]->integer;
+      }
+
+      return ResponseBuilder::parseRedisEncodedString(":" + std::to_string(sum) + "\r\n");
+    }
+
+    if(allArrays) {
+      std::vector<const redisReply*> ordered(totalKeys);
+      for(size_t i = 0; i < replies.size(); i++) {
+        for(size_t j = 0; j < positions[i].size(); j++) {
+          ordered[positions[i][j]] = replies[i]->element[j];
+        }
+      }
+
+      std::string encoded = "*" + std::to_string(totalKeys) + "\r\n";
+      for(size_t i = 0; i < ordered.size(); i++) {
+        appendReply(encoded, ordered[i]);
+      }
+
+      return ResponseBuilder::parseRedisEncodedString(encoded);
+    }
+
+    return ResponseBuilder::makeErr("ERR unexpected reply type to sharded multi-key command");
+  }
+};
+
+//------------------------------------------------------------------------------
+// Constructor
+//------------------------------------------------------------------------------
+ShardedClient::ShardedClient(const std::vector<Members> &shards, Options &&options,
+  size_t virtualNodes)
+: ring(shards.size(), virtualNodes) {
+
+  for(size_t i = 0; i < shards.size(); i++) {
+    clients.emplace_back(new QClient(shards[i], options.clone()));
+  }
+}
+
+//------------------------------------------------------------------------------
+// Shard lookup
+//------------------------------------------------------------------------------
+size_t ShardedClient::getShardCount() const {
+  return clients.size();
+}
+
+size_t ShardedClient::getShard(const std::string &key) const {
+  return ring.getShard(key);
+}
+
+QClient& ShardedClient::getClient(size_t shard) {
+  return *clients[shard].get();
+}
+
+QClient& ShardedClient::getClientForKey(const std::string &key) {
+  return *clients[ring.getShard(key)].get();
+}
+
+//------------------------------------------------------------------------------
+// Requests issued through any shard, but not yet acknowledged
+//------------------------------------------------------------------------------
+int64_t ShardedClient::getPendingRequests() const {
+  int64_t total = 0;
+  for(size_t i = 0; i < clients.size(); i++) {
+    total += clients[i]->getPendingRequests();
+  }
+
+  return total;
+}
+
+//------------------------------------------------------------------------------
+// Route a request by its key - requests without one go to the first shard
+//------------------------------------------------------------------------------
+size_t ShardedClient::route(const EncodedRequest &req) const {
+  const char *key;
+  size_t len;
+
+  if(!findArgument(req, 1, key, len)) {
+    return 0;
+  }
+
+  return ring.getShard(key, len);
+}
+
+//------------------------------------------------------------------------------
+// Same API as QClient
+//------------------------------------------------------------------------------
+std::future<redisReplyPtr> ShardedClient::execute(EncodedRequest &&req) {
+  size_t shard = route(req);
+  return clients[shard]->execute(std::move(req));
+}
+
+void ShardedClient::execute(QCallback *callback, EncodedRequest &&req) {
+  size_t shard = route(req);
+  clients[shard]->execute(callback, std::move(req));
+}
+
+void ShardedClient::execute(EncodedRequest &&req, ReplyCallback &&callback) {
+  size_t shard = route(req);
+  clients[shard]->execute(std::move(req), std::move(callback));
+}
+
+//------------------------------------------------------------------------------
+// MULTI blocks, which must not span shards
+//------------------------------------------------------------------------------
+std::future<redisReplyPtr> ShardedClient::execute(std::deque<EncodedRequest> &&reqs) {
+  size_t shard = 0;
+  bool first = true;
+
+  for(auto it = reqs.begin(); it != reqs.end(); it++) {
+    const char *key;
+    size_t len;
+
+    if(!findArgument(*it, 1, key, len)) {
+      continue;
+    }
+
+    size_t current = ring.getShard(key, len);
+    if(!first && current != shard) {
+      std::promise<redisReplyPtr> prom;
+      prom.set_value(ResponseBuilder::makeErr("ERR transaction spans multiple shards"));
+      return prom.get_future();
+    }
+
+    shard = current;
+    first = false;
+  }
+
+  return clients[shard]->execute(std::move(reqs));
+}
+
+//------------------------------------------------------------------------------
+// Multi-key commands, split by shard and merged back
+//------------------------------------------------------------------------------
+std::future<redisReplyPtr> ShardedClient::executeMultiKey(const std::string &command,
+  const std::vector<std::string> &keys) {
+
+  std::shared_ptr<MultiKeyMerge> merge = std::make_shared<MultiKeyMerge>();
+  std::future<redisReplyPtr> retval = merge->promise.get_future();
+
+  if(keys.empty()) {
+    merge->promise.set_value(ResponseBuilder::makeErr("ERR wrong number of arguments for '" + command + "' command"));
+    return retval;
+  }
+
+  //----------------------------------------------------------------------------
+  // Split keys into one batch per shard, remembering where each came from
+  //----------------------------------------------------------------------------
+  std::vector<std::vector<std::string>> commands(clients.size());
+  std::vector<std::vector<size_t>> positions(clients.size());
+
+  for(size_t i = 0; i < keys.size(); i++) {
+    size_t shard = ring.getShard(keys[i]);
+    if(commands[shard].empty()) {
+      commands[shard].push_back(command);
+    }
+
+    commands[shard].push_back(keys[i]);
+    positions[shard].push_back(i);
+  }
+
+  std::vector<size_t> shards;
+  for(size_t shard = 0; shard < clients.size(); shard++) {
+    if(!positions[shard].empty()) {
+      shards.push_back(shard);
+      merge->positions.emplace_back(std::move(positions[shard]));
+    }
+  }
+
+  merge->totalKeys = keys.size();
+  merge->replies.resize(shards.size());
+  merge->remaining = shards.size();
+
+  for(size_t batch = 0; batch < shards.size(); batch++) {
+    clients[shards[batch]]->execute(EncodedRequest(commands[shards[batch]]),
+      [merge, batch](redisReplyPtr &&reply) {
+        merge->deliver(batch, std::move(reply));
+      }
+    );
+  }
+
+  return retval;
+}
+
+}
@@ -0,0 +1,123 @@
+//------------------------------------------------------------------------------
+// File: SingleFlight.cc
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#include "SingleFlight.hh"
+
+namespace qclient {
+
+//------------------------------------------------------------------------------
+// FNV-1a over all segments of the request
+//------------------------------------------------------------------------------
+uint64_t SingleFlight::hash(const EncodedRequest &req) {
+  uint64_t h = 14695981039346656037ull;
+
+  for(size_t i = 0; i < req.getSegmentCount(); i++) {
+    EncodedRequest::Segment segment = req.getSegment(i);
+
+    for(size_t j = 0; j < segment.len; j++) {
+      h ^= (uint8_t) segment.data[j];
+      h *= 1099511628211ull;
+    }
+  }
+
+  return h;
+}
+
+//------------------------------------------------------------------------------
+// Join a flight, or start a new one
+//------------------------------------------------------------------------------
+bool SingleFlight::join(const EncodedRequest &req, ReplyCallback &callback) {
+  uint64_t key = hash(req);
+  std::string encoded = req.toString();
+
+  std::unique_lock<std::mutex> lock(mtx);
+  auto range = flights.equal_range(key);
+
+  for(auto it = range.first; it != range.second; it++) {
+    if(it->second->request == encoded) {
+      it->second->followers.emplace_back(std::move(callback));
+      coalesced.fetch_add(1, std::memory_order_relaxed);
+      return true;
+    }
+  }
+
+  std::shared_ptr<Flight> flight = std::make_shared<Flight>();
+  flight->request = std::move(encoded);
+  flight->leader = std::move(callback);
+  flights.emplace(key, flight);
+  inFlight.fetch_add(1, std::memory_order_relaxed);
+  lock.unlock();
+
+  std::shared_ptr<SingleFlight> self = shared_from_this();
+  callback = [self, key, flight](redisReplyPtr &&reply) {
+    self->land(key, flight, std::move(reply));
+  };
+
+  return false;
+}
+
+//------------------------------------------------------------------------------
+// The reply of a flight arrived - remove it from the table, if still there,
+// and fan the reply out.
+//------------------------------------------------------------------------------
+void SingleFlight::land(uint64_t key, const std::shared_ptr<Flight> &flight,
+  redisReplyPtr &&reply) {
+
+  std::vector<ReplyCallback> followers;
+
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    auto range = flights.equal_range(key);
+
+    for(auto it = range.first; it != range.second; it++) {
+      if(it->second == flight) {
+        flights.erase(it);
+        inFlight.fetch_sub(1, std::memory_order_relaxed);
+        break;
+      }
+    }
+
+    followers.swap(flight->followers);
+  }
+
+  flight->leader(redisReplyPtr(reply));
+
+  for(size_t i = 0; i < followers.size(); i++) {
+    followers[i](redisReplyPtr(reply));
+  }
+}
+
+//------------------------------------------------------------------------------
+// Let no one else join the flights currently in the air
+//------------------------------------------------------------------------------
+void SingleFlight::forget() {
+  if(inFlight.load(std::memory_order_relaxed) == 0) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(mtx);
+  flights.clear();
+  inFlight.store(0, std::memory_order_relaxed);
+}
+
+}
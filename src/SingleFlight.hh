@@ -0,0 +1,87 @@
+//------------------------------------------------------------------------------
+// File: SingleFlight.hh
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#ifndef QCLIENT_SINGLE_FLIGHT_HH
+#define QCLIENT_SINGLE_FLIGHT_HH
+
+#include "qclient/EncodedRequest.hh"
+#include "qclient/ReplyCallback.hh"
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace qclient {
+
+//------------------------------------------------------------------------------
+// Table of read-only requests in flight, so that identical ones issued while
+// the first is pending piggyback on its reply instead of going out again.
+// Requests are keyed by a hash of their encoding, and compared in full.
+//
+// Writes must call forget: Reads issued after a write never join a flight
+// which started before it, and thus always observe the write.
+//------------------------------------------------------------------------------
+class SingleFlight : public std::enable_shared_from_this<SingleFlight> {
+public:
+  //----------------------------------------------------------------------------
+  // If an identical request is in flight, queue callback behind it and
+  // return true - req is not to be issued. Otherwise, start a new flight:
+  // callback is replaced with one completing the original callback first,
+  // then everyone who joined since. Issue req with it.
+  //----------------------------------------------------------------------------
+  bool join(const EncodedRequest &req, ReplyCallback &callback);
+
+  //----------------------------------------------------------------------------
+  // Let no one else join the flights currently in the air
+  //----------------------------------------------------------------------------
+  void forget();
+
+  //----------------------------------------------------------------------------
+  // Number of requests served by another request's reply, so far
+  //----------------------------------------------------------------------------
+  int64_t getCoalesced() const {
+    return coalesced.load(std::memory_order_relaxed);
+  }
+
+  static uint64_t hash(const EncodedRequest &req);
+
+private:
+  struct Flight {
+    std::string request;
+    ReplyCallback leader;
+    std::vector<ReplyCallback> followers;
+  };
+
+  void land(uint64_t key, const std::shared_ptr<Flight> &flight,
+    redisReplyPtr &&reply);
+
+  std::mutex mtx;
+  std::unordered_multimap<uint64_t, std::shared_ptr<Flight>> flights;
+  std::atomic<size_t> inFlight {0};
+  std::atomic<int64_t> coalesced {0};
+};
+
+}
+
+#endif
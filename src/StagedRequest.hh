@@ -25,14 +25,35 @@
 #define QCLIENT_STAGED_REQUEST_HH
 
 #include "qclient/QCallback.hh"
+#include "qclient/ReplyDecoder.hh"
+#include "qclient/ReplyCallback.hh"
 #include "qclient/EncodedRequest.hh"
+#include "TimerWheel.hh"
+#include <chrono>
 
 namespace qclient {
 
 class StagedRequest {
 public:
-  StagedRequest(QCallback *cb, EncodedRequest &&request, size_t multi = 0)
-  : callback(cb), encodedRequest(std::move(request)), multiSize(multi) { }
+  StagedRequest(QCallback *cb, EncodedRequest &&request, size_t multi = 0,
+    BulkSink *sink = nullptr, ReplyDecoder *decoder = nullptr, uint64_t trace = 0)
+  : callback(cb), encodedRequest(std::move(request)),
+    stagedLen(encodedRequest.getLen()), multiSize(multi), bulkSink(sink), replyDecoder(decoder), traceId(trace) { }
+
+  StagedRequest(ReplyCallback &&fn, EncodedRequest &&request, uint64_t trace = 0,
+    std::shared_ptr<RequestDeadline> dl = {})
+  : function(std::move(fn)), encodedRequest(std::move(request)),
+    stagedLen(encodedRequest.getLen()), multiSize(0), bulkSink(nullptr), replyDecoder(nullptr), traceId(trace), deadline(std::move(dl)) { }
+
+  //----------------------------------------------------------------------------
+  // Future-based staging: fn holds the promise itself. runInline fulfills it
+  // on the thread consuming responses, instead of going through the
+  // callback executor.
+  //----------------------------------------------------------------------------
+  StagedRequest(ReplyCallback &&fn, EncodedRequest &&request, size_t multi,
+    BulkSink *sink, ReplyDecoder *decoder, uint64_t trace, bool runInline = false)
+  : function(std::move(fn)), functionInline(runInline), encodedRequest(std::move(request)),
+    stagedLen(encodedRequest.getLen()), multiSize(multi), bulkSink(sink), replyDecoder(decoder), traceId(trace) { }
 
   StagedRequest(const StagedRequest& other) = delete;
   StagedRequest(StagedRequest&& other) = delete;
@@ -45,24 +66,129 @@ public:
     return encodedRequest.getLen();
   }
 
+  //----------------------------------------------------------------------------
+  // Length at the time of staging, as reserved against backpressure - the
+  // buffer itself is dropped early if the request gets skipped.
+  //----------------------------------------------------------------------------
+  size_t getStagedLen() const {
+    return stagedLen;
+  }
+
+  size_t getSegmentCount() const {
+    return encodedRequest.getSegmentCount();
+  }
+
+  EncodedRequest::Segment getSegment(size_t i) const {
+    return encodedRequest.getSegment(i);
+  }
+
   QCallback* getCallback() {
     return callback;
   }
 
+  //----------------------------------------------------------------------------
+  // Callable stored in place of a QCallback, if any - moved out once the
+  // reply is in, as the request itself goes away before the callback runs.
+  //----------------------------------------------------------------------------
+  ReplyCallback takeFunction() {
+    return std::move(function);
+  }
+
+  bool hasFunction() const {
+    return static_cast<bool>(function);
+  }
+
+  bool functionRunsInline() const {
+    return functionInline;
+  }
+
   void set_value(redisReplyPtr &&reply) {
     if(callback) {
       callback->handleResponse(std::move(reply));
     }
+    else if(function) {
+      function(std::move(reply));
+    }
   }
 
   size_t getMultiSize() const {
     return multiSize;
   }
 
+  //----------------------------------------------------------------------------
+  // Nobody is waiting for the reply: Unless it's an error, it may be dropped
+  // without even being built.
+  //----------------------------------------------------------------------------
+  bool isFireAndForget() const {
+    return !callback && !function && multiSize == 0u && !bulkSink && !replyDecoder;
+  }
+
+  BulkSink* getBulkSink() const {
+    return bulkSink;
+  }
+
+  ReplyDecoder* getReplyDecoder() const {
+    return replyDecoder;
+  }
+
+  //----------------------------------------------------------------------------
+  // Latency tracking: staging time is taken on construction, writing time by
+  // WriterThread, right before handing the request to the socket.
+  //----------------------------------------------------------------------------
+  std::chrono::steady_clock::time_point getStagedAt() const {
+    return stagedAt;
+  }
+
+  std::chrono::steady_clock::time_point getWrittenAt() const {
+    return writtenAt;
+  }
+
+  void markWritten(std::chrono::steady_clock::time_point now) {
+    writtenAt = now;
+  }
+
+  //----------------------------------------------------------------------------
+  // Identifies the request towards the RequestTracer - 0 if not traced.
+  //----------------------------------------------------------------------------
+  uint64_t getTraceId() const {
+    return traceId;
+  }
+
+  //----------------------------------------------------------------------------
+  // Requests whose deadline expired, or which were cancelled, before they
+  // were written are skipped by the writer - they'll never get a response,
+  // so the reader must skip them as well. Called by the writer right before
+  // writing the request. The encoded buffer is no longer needed, and goes
+  // away right here.
+  //----------------------------------------------------------------------------
+  bool skipIfExpired() {
+    if(!deadline || deadline->markWritten()) {
+      return false;
+    }
+
+    encodedRequest = EncodedRequest(nullptr, 0);
+    skipped.store(true, std::memory_order_release);
+    return true;
+  }
+
+  bool wasSkipped() const {
+    return skipped.load(std::memory_order_acquire);
+  }
+
 private:
   QCallback *callback = nullptr;
+  ReplyCallback function;
+  bool functionInline = false;
   EncodedRequest encodedRequest;
+  size_t stagedLen;
   size_t multiSize;
+  BulkSink *bulkSink;
+  ReplyDecoder *replyDecoder;
+  uint64_t traceId;
+  std::chrono::steady_clock::time_point stagedAt = std::chrono::steady_clock::now();
+  std::chrono::steady_clock::time_point writtenAt;
+  std::shared_ptr<RequestDeadline> deadline;
+  std::atomic<bool> skipped {false};
 };
 
 }
@@ -0,0 +1,389 @@
+//------------------------------------------------------------------------------
+// File: StandbyConnection.cc
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#include "StandbyConnection.hh"
+#include "network/NetworkStream.hh"
+#include "qclient/EncodedRequest.hh"
+#include "qclient/Handshake.hh"
+#include "qclient/Logger.hh"
+#include "qclient/ResponseBuilder.hh"
+#include "qclient/network/AsyncConnector.hh"
+#include "qclient/network/HostResolver.hh"
+#include <poll.h>
+
+namespace qclient {
+
+//------------------------------------------------------------------------------
+// Constructor - starts the background thread right away. The handshake is
+// cloned, the given one may be null.
+//------------------------------------------------------------------------------
+StandbyConnection::StandbyConnection(Logger *log, const Members &mem,
+  const TlsConfig &tls, const Handshake *hs, std::shared_ptr<DnsCache> dnsCache,
+  std::chrono::seconds timeout, std::chrono::milliseconds interval,
+  const SocketProfile &profile)
+: logger(log), members(mem), tlsconfig(tls), tcpTimeout(timeout),
+  pingInterval(interval), socketProfile(profile) {
+
+  if(hs) {
+    handshake = hs->clone();
+  }
+
+  // The active connection is most likely to start out on the first member.
+  if(members.size() > 1) {
+    nextMember = 1u;
+  }
+
+  hostResolver.reset(new HostResolver(logger, dnsCache));
+  thread.reset(&StandbyConnection::main, this);
+}
+
+//------------------------------------------------------------------------------
+// Destructor
+//------------------------------------------------------------------------------
+StandbyConnection::~StandbyConnection() {
+  thread.stop();
+  wakeupFD.notify();
+  thread.join();
+}
+
+//------------------------------------------------------------------------------
+// Let us know where the active connection went to, so as to keep the
+// standby elsewhere.
+//------------------------------------------------------------------------------
+void StandbyConnection::setActiveEndpoint(const Endpoint &endpoint) {
+  std::lock_guard<std::mutex> lock(mtx);
+  activeEndpoint = endpoint;
+}
+
+//------------------------------------------------------------------------------
+// Hand over the standby connection, if one is ready - nullptr otherwise.
+//------------------------------------------------------------------------------
+std::unique_ptr<NetworkStream> StandbyConnection::take(Endpoint &endpoint) {
+  std::unique_ptr<NetworkStream> retval;
+
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    if(!stream) {
+      return retval;
+    }
+
+    retval = std::move(stream);
+    endpoint = streamEndpoint;
+  }
+
+  // Wake up the background thread to start on a replacement
+  wakeupFD.notify();
+  return retval;
+}
+
+//------------------------------------------------------------------------------
+// Same as above, but wait up to timeout for a standby to become ready.
+//------------------------------------------------------------------------------
+std::unique_ptr<NetworkStream> StandbyConnection::take(Endpoint &endpoint,
+  std::chrono::milliseconds timeout) {
+
+  std::unique_ptr<NetworkStream> retval;
+
+  {
+    std::unique_lock<std::mutex> lock(mtx);
+    if(!streamCV.wait_for(lock, timeout, [&]() { return stream != nullptr; })) {
+      return retval;
+    }
+
+    retval = std::move(stream);
+    endpoint = streamEndpoint;
+  }
+
+  // Wake up the background thread to start on a replacement
+  wakeupFD.notify();
+  return retval;
+}
+
+//------------------------------------------------------------------------------
+// Is there a standby connection ready to be taken?
+//------------------------------------------------------------------------------
+bool StandbyConnection::ready() {
+  std::lock_guard<std::mutex> lock(mtx);
+  return stream != nullptr;
+}
+
+//------------------------------------------------------------------------------
+// Background thread: establish a standby whenever we have none, PING it
+// otherwise.
+//------------------------------------------------------------------------------
+void StandbyConnection::main(ThreadAssistant &assistant) {
+  while(!assistant.terminationRequested()) {
+    if(!ready()) {
+      // Any wakeup pending by now is stale, and would abort connecting.
+      wakeupFD.clear();
+      if(assistant.terminationRequested()) {
+        break;
+      }
+
+      if(!establish(assistant)) {
+        waitForWakeup(pingInterval);
+      }
+
+      continue;
+    }
+
+    waitForWakeup(pingInterval);
+
+    if(!assistant.terminationRequested()) {
+      keepalive(assistant);
+    }
+  }
+}
+
+//------------------------------------------------------------------------------
+// Try to establish a standby connection, going through the members in
+// round-robin, skipping the one the active connection went to. Returns
+// true if we now have one.
+//------------------------------------------------------------------------------
+bool StandbyConnection::establish(ThreadAssistant &assistant) {
+  const std::vector<Endpoint> &endpoints = members.getEndpoints();
+
+  Endpoint active;
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    active = activeEndpoint;
+  }
+
+  for(size_t i = 0; i < endpoints.size(); i++) {
+    const Endpoint &candidate = endpoints[nextMember];
+    nextMember = (nextMember + 1) % endpoints.size();
+
+    // A single member is all we've got - no choice but to double up on it.
+    if(endpoints.size() > 1 && candidate == active) {
+      continue;
+    }
+
+    std::unique_ptr<NetworkStream> established = connect(candidate);
+    if(established) {
+      QCLIENT_LOG(logger, LogLevel::kDebug, "Standby connection towards " << candidate.toString() << " is ready");
+
+      std::lock_guard<std::mutex> lock(mtx);
+      stream = std::move(established);
+      streamEndpoint = candidate;
+      streamCV.notify_all();
+      return true;
+    }
+
+    if(assistant.terminationRequested()) {
+      break;
+    }
+  }
+
+  return false;
+}
+
+//------------------------------------------------------------------------------
+// PING the standby connection. It's moved out while doing so - a take()
+// in the meantime finds nothing, and the caller reconnects the slow way.
+// Returns false if the standby had to be dropped.
+//------------------------------------------------------------------------------
+bool StandbyConnection::keepalive(ThreadAssistant &assistant) {
+  std::unique_ptr<NetworkStream> current;
+  Endpoint endpoint;
+
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    if(!stream) {
+      return false;
+    }
+
+    //--------------------------------------------------------------------------
+    // The active connection ended up on the same member as we are, since it
+    // reconnected on its own. Start over elsewhere.
+    //--------------------------------------------------------------------------
+    if(members.size() > 1 && streamEndpoint == activeEndpoint) {
+      stream.reset();
+      return false;
+    }
+
+    current = std::move(stream);
+    endpoint = streamEndpoint;
+  }
+
+  ResponseBuilder builder;
+  redisReplyPtr reply;
+
+  if(!exchange(*current, builder, {"PING"}, reply)) {
+    if(!assistant.terminationRequested()) {
+      QCLIENT_LOG(logger, LogLevel::kInfo, "Standby connection towards " << endpoint.toString() << " broke, establishing a new one");
+    }
+
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lock(mtx);
+  stream = std::move(current);
+  streamCV.notify_all();
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Connect to the given member and handshake with it. With no handshake
+// configured, a PING makes sure TLS has been negotiated as well.
+//------------------------------------------------------------------------------
+std::unique_ptr<NetworkStream> StandbyConnection::connect(const Endpoint &endpoint) {
+  Status st;
+  std::vector<ServiceEndpoint> resolved = hostResolver->resolve(endpoint.getHost(),
+    endpoint.getPort(), st);
+
+  if(!st.ok()) {
+    return {};
+  }
+
+  for(size_t i = 0; i < resolved.size(); i++) {
+    AsyncConnector connector(resolved[i], socketProfile);
+    if(!connector.blockUntilReady(wakeupFD.getFD(), tcpTimeout)) {
+      return {};
+    }
+
+    if(!connector.ok()) {
+      QCLIENT_LOG(logger, LogLevel::kDebug, "Encountered an error when connecting standby to " << resolved[i].getString() << ": " << connector.getError());
+      continue;
+    }
+
+    std::unique_ptr<NetworkStream> candidate(new NetworkStream(connector.release(), tlsconfig));
+    if(!candidate->ok()) {
+      continue;
+    }
+
+    ResponseBuilder builder;
+    redisReplyPtr reply;
+
+    if(!handshake) {
+      if(exchange(*candidate, builder, {"PING"}, reply)) {
+        return candidate;
+      }
+
+      continue;
+    }
+
+    handshake->restart();
+    std::vector<std::string> request = handshake->provideHandshake();
+
+    while(exchange(*candidate, builder, request, reply)) {
+      Handshake::Status status = handshake->validateResponse(reply);
+
+      if(status == Handshake::Status::VALID_COMPLETE) {
+        return candidate;
+      }
+
+      if(status == Handshake::Status::INVALID) {
+        QCLIENT_LOG(logger, LogLevel::kDebug, "Standby handshake with " << resolved[i].getString() << " failed");
+        break;
+      }
+
+      request = handshake->provideHandshake();
+    }
+  }
+
+  return {};
+}
+
+//------------------------------------------------------------------------------
+// Send a single request, and wait for its reply; at most timeout. Gives up
+// early if woken up, which only happens when shutting down.
+//------------------------------------------------------------------------------
+bool exchangeSync(NetworkStream &conn, ResponseBuilder &builder,
+  const std::vector<std::string> &request, redisReplyPtr &reply,
+  int wakeupFd, std::chrono::milliseconds timeout) {
+
+  EncodedRequest encoded(request);
+  if(conn.send(encoded.getBuffer(), encoded.getLen()) <= 0) {
+    return false;
+  }
+
+  std::chrono::steady_clock::time_point deadline =
+    std::chrono::steady_clock::now() + timeout;
+
+  while(true) {
+    ResponseBuilder::Status status = builder.pull(reply);
+    if(status == ResponseBuilder::Status::kOk) {
+      return true;
+    }
+
+    if(status == ResponseBuilder::Status::kProtocolError) {
+      return false;
+    }
+
+    // There could be data cached inside OpenSSL, which poll() will not
+    // detect - always try reading first.
+    char buffer[1024];
+    RecvStatus recvStatus = conn.recv(buffer, sizeof(buffer), 0);
+
+    if(!recvStatus.connectionAlive) {
+      return false;
+    }
+
+    if(recvStatus.bytesRead > 0) {
+      builder.feed(buffer, recvStatus.bytesRead);
+      continue;
+    }
+
+    std::chrono::milliseconds remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+      deadline - std::chrono::steady_clock::now());
+
+    if(remaining.count() <= 0) {
+      return false;
+    }
+
+    struct pollfd polls[2];
+    polls[0].fd = wakeupFd;
+    polls[0].events = POLLIN;
+    polls[0].revents = 0;
+    polls[1].fd = conn.getFd();
+    polls[1].events = POLLIN;
+    polls[1].revents = 0;
+
+    int rpoll = poll(polls, 2, remaining.count());
+    if(rpoll < 0 && errno != EINTR) {
+      return false;
+    }
+
+    if(polls[0].revents != 0) {
+      return false;
+    }
+  }
+}
+
+//------------------------------------------------------------------------------
+// Sleep for the given duration, or until woken up. Returns true if woken up.
+//------------------------------------------------------------------------------
+bool StandbyConnection::waitForWakeup(std::chrono::milliseconds duration) {
+  struct pollfd polls[1];
+  polls[0].fd = wakeupFD.getFD();
+  polls[0].events = POLLIN;
+  polls[0].revents = 0;
+
+  poll(polls, 1, duration.count());
+  bool woken = (polls[0].revents != 0);
+  wakeupFD.clear();
+  return woken;
+}
+
+}
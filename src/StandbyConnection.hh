@@ -0,0 +1,149 @@
+//------------------------------------------------------------------------------
+// File: StandbyConnection.hh
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#ifndef QCLIENT_STANDBY_CONNECTION_HH
+#define QCLIENT_STANDBY_CONNECTION_HH
+
+#include "qclient/AssistedThread.hh"
+#include "qclient/EventFD.hh"
+#include "qclient/Members.hh"
+#include "qclient/Reply.hh"
+#include "qclient/TlsFilter.hh"
+#include "qclient/network/SocketProfile.hh"
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace qclient {
+
+class DnsCache;
+class Handshake;
+class HostResolver;
+class Logger;
+class NetworkStream;
+class ResponseBuilder;
+
+//------------------------------------------------------------------------------
+// Send a single request over a blocking-style connection, and wait for its
+// reply; at most timeout. Gives up early if wakeupFd becomes readable, which
+// background threads use to shut down.
+//------------------------------------------------------------------------------
+bool exchangeSync(NetworkStream &conn, ResponseBuilder &builder,
+  const std::vector<std::string> &request, redisReplyPtr &reply,
+  int wakeupFd, std::chrono::milliseconds timeout);
+
+//------------------------------------------------------------------------------
+// Keeps a spare connection towards the cluster established, TLS-negotiated
+// and handshaken in the background, preferably towards a different member
+// than the one the active connection went to. Idle periods are bridged with
+// PINGs, so that a dead standby is noticed before it's needed.
+//
+// When the active connection breaks, QClient takes the standby instead of
+// going through DNS, connect, TLS and handshake all over again - a new
+// standby is then established in the background.
+//------------------------------------------------------------------------------
+class StandbyConnection {
+public:
+  //----------------------------------------------------------------------------
+  // Constructor - starts the background thread right away. The handshake is
+  // cloned, the given one may be null.
+  //----------------------------------------------------------------------------
+  StandbyConnection(Logger *logger, const Members &members,
+    const TlsConfig &tlsconfig, const Handshake *handshake,
+    std::shared_ptr<DnsCache> dnsCache, std::chrono::seconds tcpTimeout,
+    std::chrono::milliseconds pingInterval,
+    const SocketProfile &profile = SocketProfile::Default());
+
+  //----------------------------------------------------------------------------
+  // Destructor
+  //----------------------------------------------------------------------------
+  ~StandbyConnection();
+
+  //----------------------------------------------------------------------------
+  // Let us know where the active connection went to, so as to keep the
+  // standby elsewhere.
+  //----------------------------------------------------------------------------
+  void setActiveEndpoint(const Endpoint &endpoint);
+
+  //----------------------------------------------------------------------------
+  // Hand over the standby connection, if one is ready - nullptr otherwise.
+  // Its handshake is already complete.
+  //----------------------------------------------------------------------------
+  std::unique_ptr<NetworkStream> take(Endpoint &endpoint);
+
+  //----------------------------------------------------------------------------
+  // Same as above, but wait up to timeout for a standby to become ready -
+  // for example while the background thread is busy PINGing it.
+  //----------------------------------------------------------------------------
+  std::unique_ptr<NetworkStream> take(Endpoint &endpoint,
+    std::chrono::milliseconds timeout);
+
+  //----------------------------------------------------------------------------
+  // Is there a standby connection ready to be taken?
+  //----------------------------------------------------------------------------
+  bool ready();
+
+private:
+  void main(ThreadAssistant &assistant);
+  bool establish(ThreadAssistant &assistant);
+  bool keepalive(ThreadAssistant &assistant);
+  std::unique_ptr<NetworkStream> connect(const Endpoint &endpoint);
+  bool exchange(NetworkStream &stream, ResponseBuilder &builder,
+    const std::vector<std::string> &request, redisReplyPtr &reply) {
+    return exchangeSync(stream, builder, request, reply, wakeupFD.getFD(), tcpTimeout);
+  }
+  bool waitForWakeup(std::chrono::milliseconds duration);
+
+  Logger *logger;
+  Members members;
+  TlsConfig tlsconfig;
+  std::unique_ptr<Handshake> handshake;
+  std::unique_ptr<HostResolver> hostResolver;
+  std::chrono::seconds tcpTimeout;
+  std::chrono::milliseconds pingInterval;
+  SocketProfile socketProfile;
+
+  // Index into members of the next one to try
+  size_t nextMember = 0u;
+
+  //----------------------------------------------------------------------------
+  // Protects everything below. The background thread moves the stream out
+  // while PINGing it, so take() never waits on the network.
+  //----------------------------------------------------------------------------
+  std::mutex mtx;
+  std::condition_variable streamCV;
+  std::unique_ptr<NetworkStream> stream;
+  Endpoint streamEndpoint;
+  Endpoint activeEndpoint;
+
+  EventFD wakeupFD;
+  AssistedThread thread;
+};
+
+}
+
+#endif
@@ -0,0 +1,224 @@
+//------------------------------------------------------------------------------
+// File: TimerWheel.hh
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#ifndef QCLIENT_TIMER_WHEEL_HH
+#define QCLIENT_TIMER_WHEEL_HH
+
+#include "qclient/ReplyCallback.hh"
+#include "qclient/ResponseBuilder.hh"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace qclient {
+
+//------------------------------------------------------------------------------
+// The deadline of a single request, shared between the request itself and
+// the TimerWheel: Whichever of the reply or the expiry comes first completes
+// it, and the other one is discarded.
+//
+// Subclasses may override expire to do something else than completing the
+// request with an error once the deadline passes.
+//------------------------------------------------------------------------------
+class RequestDeadline {
+public:
+  RequestDeadline(ReplyCallback &&cb, std::chrono::steady_clock::time_point dl)
+  : callback(std::move(cb)), deadline(dl) {}
+
+  virtual ~RequestDeadline() {}
+
+  virtual void expire() {
+    complete(ResponseBuilder::makeErr("ERR deadline exceeded"));
+  }
+
+  //----------------------------------------------------------------------------
+  // Hand the reply to the callback, unless already completed - returns
+  // whether it did.
+  //----------------------------------------------------------------------------
+  bool complete(redisReplyPtr &&reply) {
+    if(state.exchange(kCompleted, std::memory_order_acq_rel) == kCompleted) {
+      return false;
+    }
+
+    ReplyCallback fn = std::move(callback);
+    fn(std::move(reply));
+    return true;
+  }
+
+  //----------------------------------------------------------------------------
+  // Complete without calling the callback, handing it over instead - false
+  // if already completed, or written. Used to supersede an unwritten
+  // request, see WriteCombiner.
+  //----------------------------------------------------------------------------
+  bool takeOver(ReplyCallback &out) {
+    int expected = kPending;
+    if(!state.compare_exchange_strong(expected, kCompleted, std::memory_order_acq_rel)) {
+      return false;
+    }
+
+    out = std::move(callback);
+    return true;
+  }
+
+  //----------------------------------------------------------------------------
+  // Called by the writer right before writing the request - false if
+  // already completed, in which case the request must be skipped.
+  //----------------------------------------------------------------------------
+  bool markWritten() {
+    int expected = kPending;
+    if(state.compare_exchange_strong(expected, kWritten, std::memory_order_acq_rel)) {
+      return true;
+    }
+
+    return expected == kWritten;
+  }
+
+  bool isCompleted() const {
+    return state.load(std::memory_order_acquire) == kCompleted;
+  }
+
+  std::chrono::steady_clock::time_point getDeadline() const {
+    return deadline;
+  }
+
+private:
+  static constexpr int kPending = 0;
+  static constexpr int kWritten = 1;
+  static constexpr int kCompleted = 2;
+
+  std::atomic<int> state {kPending};
+  ReplyCallback callback;
+  std::chrono::steady_clock::time_point deadline;
+};
+
+//------------------------------------------------------------------------------
+// Hashed timer wheel holding request deadlines: Scheduling costs a single
+// push into the slot of the deadline's tick, and each advance only visits
+// the slots of the ticks elapsed since the previous one. Deadlines further
+// out than a full turn of the wheel simply stay in their slot for another
+// round.
+//
+// Deadlines completed by their reply are not removed eagerly, but dropped
+// once their slot comes up.
+//------------------------------------------------------------------------------
+class TimerWheel {
+public:
+  TimerWheel(std::chrono::nanoseconds tickLength = std::chrono::milliseconds(1),
+    size_t slotCount = 512)
+  : tick(tickLength), slots(slotCount) {
+    currentTick = toTick(std::chrono::steady_clock::now());
+  }
+
+  void schedule(std::shared_ptr<RequestDeadline> &&deadline) {
+    std::lock_guard<std::mutex> lock(mtx);
+
+    // Already due: expire on the next advance
+    int64_t target = std::max(toTick(deadline->getDeadline()), currentTick + 1);
+    slots[target % slots.size()].emplace_back(std::move(deadline));
+    entries++;
+    cv.notify_one();
+  }
+
+  //----------------------------------------------------------------------------
+  // Move all deadlines due by now, which haven't completed yet, into expired.
+  //----------------------------------------------------------------------------
+  void advance(std::chrono::steady_clock::time_point now,
+    std::vector<std::shared_ptr<RequestDeadline>> &expired) {
+
+    std::lock_guard<std::mutex> lock(mtx);
+    int64_t nowTick = toTick(now);
+    int64_t steps = std::min<int64_t>(nowTick - currentTick, slots.size());
+
+    for(int64_t i = 1; i <= steps; i++) {
+      std::vector<std::shared_ptr<RequestDeadline>> &slot = slots[(currentTick + i) % slots.size()];
+
+      size_t kept = 0;
+      for(size_t j = 0; j < slot.size(); j++) {
+        if(slot[j]->isCompleted()) {
+          continue;
+        }
+
+        if(toTick(slot[j]->getDeadline()) <= nowTick) {
+          expired.emplace_back(std::move(slot[j]));
+          continue;
+        }
+
+        slot[kept++] = std::move(slot[j]);
+      }
+
+      entries -= slot.size() - kept;
+      slot.resize(kept);
+    }
+
+    currentTick = std::max(currentTick, nowTick);
+  }
+
+  //----------------------------------------------------------------------------
+  // Block for one tick, or until something gets scheduled if the wheel is
+  // empty. Returns immediately after shutdown.
+  //----------------------------------------------------------------------------
+  void waitForWork() {
+    std::unique_lock<std::mutex> lock(mtx);
+
+    if(entries == 0) {
+      cv.wait(lock, [&]() { return entries != 0 || stopped; });
+    }
+    else {
+      cv.wait_for(lock, tick, [&]() { return stopped; });
+    }
+  }
+
+  void shutdown() {
+    std::lock_guard<std::mutex> lock(mtx);
+    stopped = true;
+    cv.notify_all();
+  }
+
+  size_t size() {
+    std::lock_guard<std::mutex> lock(mtx);
+    return entries;
+  }
+
+private:
+  int64_t toTick(std::chrono::steady_clock::time_point point) const {
+    return point.time_since_epoch() / tick;
+  }
+
+  std::mutex mtx;
+  std::condition_variable cv;
+  bool stopped = false;
+
+  std::chrono::nanoseconds tick;
+  std::vector<std::vector<std::shared_ptr<RequestDeadline>>> slots;
+  int64_t currentTick;
+  size_t entries = 0;
+};
+
+}
+
+#endif
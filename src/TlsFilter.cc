@@ -22,8 +22,12 @@
  ************************************************************************/
 
 #include "qclient/TlsFilter.hh"
+#include "ParseStage.hh"
 #include <iostream>
 #include <sstream>
+#include <map>
+#include <utility>
+#include <sys/stat.h>
 
 #ifdef __APPLE__
   #define TLS_FILTER_ACTIVE 0
@@ -50,8 +54,101 @@ static void initOpenSSL() {
 
 std::once_flag opensslFlag;
 
-TlsFilter::TlsFilter(const TlsConfig &config, const FilterType &type, RecvFunction rc, SendFunction sd)
-: tlsconfig(config), filtertype(type), recvFunc(rc), sendFunc(sd) {
+//------------------------------------------------------------------------------
+// Process-wide caches: SSL contexts by configuration, and the last client
+// session by context and peer. Each context remembers which certificate,
+// key and CA path it was loaded from; once any of them is replaced on disk,
+// the next filter loads a fresh context. Never destroyed, as filters may
+// still be around during static destruction.
+//------------------------------------------------------------------------------
+namespace {
+
+// Outgoing ciphertext waiting for the socket, per filter
+constexpr size_t kCiphertextRingSize = 256 * 1024;
+
+struct CachedContext {
+  SSL_CTX *ctx = nullptr;
+  std::string files;
+};
+
+std::mutex cacheMtx;
+std::map<std::string, CachedContext> &contextCache = *new std::map<std::string, CachedContext>();
+std::map<std::pair<SSL_CTX*, std::string>, SSL_SESSION*> &sessionCache =
+  *new std::map<std::pair<SSL_CTX*, std::string>, SSL_SESSION*>();
+
+std::string contextKey(const TlsConfig &config, FilterType type) {
+  return SSTR((int) type << '\0' << config.certificatePath << '\0' << config.keyPath <<
+    '\0' << config.decryptionPassword << '\0' << config.capath << '\0' << config.verify);
+}
+
+//------------------------------------------------------------------------------
+// Identify the version on disk of each file a context is loaded from: inode,
+// size and modification time. Certificates rotated in place, or renamed over
+// the old ones, both show up. Returns false if any of them can't be found.
+//------------------------------------------------------------------------------
+bool contextFiles(const TlsConfig &config, std::string &out) {
+  std::ostringstream ss;
+
+  for(const std::string *path : { &config.certificatePath, &config.keyPath, &config.capath }) {
+    if(path->empty()) {
+      continue;
+    }
+
+    struct stat st;
+    if(::stat(path->c_str(), &st) != 0) {
+      return false;
+    }
+
+    ss << st.st_dev << ":" << st.st_ino << ":" << st.st_size << ":" <<
+      st.st_mtim.tv_sec << "." << st.st_mtim.tv_nsec << ";";
+  }
+
+  out = ss.str();
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// A context is being replaced: Its sessions will never be offered again. The
+// context itself is left alone, filters created out of it may still be
+// around.
+//------------------------------------------------------------------------------
+void dropSessions(SSL_CTX *ctx) {
+  for(auto it = sessionCache.begin(); it != sessionCache.end();) {
+    if(it->first.first == ctx) {
+      SSL_SESSION_free(it->second);
+      it = sessionCache.erase(it);
+    }
+    else {
+      it++;
+    }
+  }
+}
+
+//------------------------------------------------------------------------------
+// Called by OpenSSL whenever a client connection receives a new session -
+// with TLS 1.3, that only happens after the handshake.
+//------------------------------------------------------------------------------
+int storeSession(SSL *ssl, SSL_SESSION *session) {
+  const std::string *peer = static_cast<const std::string*>(SSL_get_app_data(ssl));
+  if(!peer || peer->empty()) {
+    return 0;
+  }
+
+  std::lock_guard<std::mutex> lock(cacheMtx);
+  SSL_SESSION *&slot = sessionCache[std::make_pair(SSL_get_SSL_CTX(ssl), *peer)];
+  if(slot) {
+    SSL_SESSION_free(slot);
+  }
+
+  // We keep the reference OpenSSL is handing us
+  slot = session;
+  return 1;
+}
+
+}
+TlsFilter::TlsFilter(const TlsConfig &config, const FilterType &type, RecvFunction rc, SendFunction sd,
+  const std::string &peer_, int fd_)
+: tlsconfig(config), filtertype(type), peer(peer_), fd(fd_), recvFunc(rc), sendFunc(sd) {
 
   if(config.active) {
     initialize();
@@ -61,27 +158,105 @@ TlsFilter::TlsFilter(const TlsConfig &config, const FilterType &type, RecvFuncti
 void TlsFilter::initialize() {
   std::call_once(opensslFlag, initOpenSSL);
 
-  // Create memory BIO
-  wbio = BIO_new(BIO_s_mem()); // For reading from with BIO_read
-  rbio = BIO_new(BIO_s_mem()); // For writing to with BIO_write
-
-  // Create context and SSL structs
-  createContext();
-  configureContext();
+  // Create SSL struct, out of the shared context
+  acquireContext();
   ssl = SSL_new(ctx);
 
-  // Link BIOs to SSL struct
-  SSL_set_bio(ssl, wbio, rbio);
+#ifdef SSL_OP_ENABLE_KTLS
+  //----------------------------------------------------------------------------
+  // Kernel TLS needs OpenSSL to talk to the socket itself. The handshake then
+  // runs through the socket, and the keys are handed to the kernel once done.
+  //----------------------------------------------------------------------------
+  if(tlsconfig.ktls && fd >= 0 && filtertype == FilterType::CLIENT) {
+    socketBio = true;
+    SSL_set_options(ssl, SSL_OP_ENABLE_KTLS);
+    SSL_set_fd(ssl, fd);
+  }
+#endif
+
+  if(!socketBio) {
+    // Create memory BIOs, and link them to the SSL struct
+    wbio = BIO_new(BIO_s_mem()); // For writing to with BIO_write
+    rbio = BIO_new(BIO_s_mem()); // For reading from with BIO_read
+    SSL_set_bio(ssl, wbio, rbio);
+
+    ciphertext.reset(new ByteRing(kCiphertextRingSize));
+  }
 
   if(filtertype == FilterType::SERVER) {
     SSL_set_accept_state(ssl);
   }
   else {
     SSL_set_connect_state(ssl);
+
+    if(!peer.empty()) {
+      SSL_set_app_data(ssl, &peer);
+
+      std::lock_guard<std::mutex> lock(cacheMtx);
+      auto it = sessionCache.find(std::make_pair(ctx, peer));
+      if(it != sessionCache.end()) {
+        SSL_set_session(ssl, it->second);
+      }
+    }
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    continueHandshake();
+    retryPendingWrites();
+  }
+
+  pumpCiphertext();
+}
+
+
+//------------------------------------------------------------------------------
+// Look up the context for our configuration, creating it on first use, or
+// once its files have changed on disk. Files that have gone missing keep the
+// cached context in use, as it's all we can do.
+//------------------------------------------------------------------------------
+void TlsFilter::acquireContext() {
+  std::lock_guard<std::mutex> lock(cacheMtx);
+  std::string key = contextKey(tlsconfig, filtertype);
+
+  std::string files;
+  bool filesFound = contextFiles(tlsconfig, files);
+
+  auto it = contextCache.find(key);
+  if(it != contextCache.end() && (!filesFound || it->second.files == files)) {
+    ctx = it->second.ctx;
+    return;
+  }
+
+  try {
+    createContext();
+    configureContext();
+  }
+  catch(...) {
+    SSL_CTX_free(ctx);
+    ctx = nullptr;
+    throw;
   }
 
-  SSL_do_handshake(ssl);
-  handleTraffic();
+  if(filtertype == FilterType::CLIENT) {
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ctx, storeSession);
+  }
+
+  if(it != contextCache.end()) {
+    dropSessions(it->second.ctx);
+  }
+
+  CachedContext &cached = contextCache[key];
+  cached.ctx = ctx;
+  cached.files = files;
+}
+
+bool TlsFilter::sessionReused() {
+  if(!ssl) return false;
+
+  std::lock_guard<std::mutex> lock(mtx);
+  return SSL_session_reused(ssl) == 1;
 }
 
 void TlsFilter::createContext() {
@@ -125,20 +300,34 @@ void TlsFilter::configureContext() {
   // TODO: handle case where key file is encrypted
 }
 
-LinkStatus TlsFilter::handleTraffic() {
-  pushCiphertext();
 
-  //----------------------------------------------------------------------------
-  // In some cases, SSL_write will give us SSL_ERROR_WANT_READ or
-  // SSL_ERROR_WANT_WRITE, and require the same function is called again.
-  // When that happens, we store the contents of the send operation into
-  // pendingWrites, and process them as soon as possible.
-  //----------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+// Drive the handshake forward, if still in progress. Once complete, find out
+// whether the kernel took over. Call with mtx held.
+//------------------------------------------------------------------------------
+void TlsFilter::continueHandshake() {
+  if(handshakeDone) return;
+
+  if(SSL_do_handshake(ssl) != 1) return;
+  handshakeDone = true;
+
+  if(socketBio) {
+    ktlsSend = BIO_get_ktls_send(SSL_get_wbio(ssl));
+  }
+}
+
+//------------------------------------------------------------------------------
+// In some cases, SSL_write will give us SSL_ERROR_WANT_READ or
+// SSL_ERROR_WANT_WRITE, and require the same function is called again.
+// When that happens, we store the contents of the send operation into
+// pendingWrites, and process them as soon as possible. Call with mtx held.
+//------------------------------------------------------------------------------
+void TlsFilter::retryPendingWrites() {
   while(!pendingWrites.empty()) {
     const std::string &contents = pendingWrites.front();
     int bytes = SSL_write(ssl, contents.c_str(), contents.size());
 
-    if(bytes == -1) break;
+    if(bytes <= 0) break;
     if(bytes != (int) contents.size()) {
       std::cerr << "qclient: CRITICAL - wrong size by SSL_write: " << bytes << ", expected: " << contents.size() << std::endl;
       exit(EXIT_FAILURE);
@@ -147,30 +336,82 @@ LinkStatus TlsFilter::handleTraffic() {
     pendingWrites.pop_front();
   }
 
-  pushCiphertext();
-  return 1;
-}
-
-LinkStatus TlsFilter::pushCiphertext() {
   //----------------------------------------------------------------------------
-  // In this function we check whether there's any ciphertext coming from
-  // OpenSSL that we ought to push onto the socket.
+  // With the kernel encrypting, plaintext can bypass OpenSSL from now on -
+  // but only once everything written through it has gone out.
   //----------------------------------------------------------------------------
+  if(ktlsSend && pendingWrites.empty()) {
+    kernelSend = true;
+  }
+}
 
-  const size_t BUF_SIZE = 1024 * 8;
-  char ciphertext[BUF_SIZE];
-
+//------------------------------------------------------------------------------
+// Move ciphertext produced by OpenSSL into the ring, as much as fits. Call
+// with mtx held - this is the only producer.
+//------------------------------------------------------------------------------
+bool TlsFilter::drainCiphertext() {
   while(BIO_ctrl_pending(rbio) > 0) {
-    int cipherbytes = BIO_read(rbio, ciphertext, BUF_SIZE);
-    if(cipherbytes < 0) {
+    size_t len = BIO_ctrl_pending(rbio);
+    char *buffer = ciphertext->getWriteBuffer(len);
+    if(!buffer) {
+      return false;
+    }
+
+    int cipherbytes = BIO_read(rbio, buffer, len);
+    if(cipherbytes <= 0) {
       std::cerr << "BIO_read from a TLS connection not successful" << std::endl;
-      return -1;
+      return false;
     }
 
-    sendFunc(ciphertext, cipherbytes);
+    ciphertext->commitWrite(cipherbytes);
   }
 
-  return 1;
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Push ciphertext from the ring onto the socket, straight out of the ring.
+// Whatever the socket won't take right now stays for next time. Returns
+// true if the ring was emptied.
+//------------------------------------------------------------------------------
+bool TlsFilter::flushCiphertext() {
+  std::lock_guard<std::mutex> lock(flushMtx);
+
+  while(true) {
+    size_t len = 0;
+    const char *buffer = ciphertext->getReadBuffer(len);
+    if(!buffer) {
+      return true;
+    }
+
+    LinkStatus sent = sendFunc(buffer, len);
+    if(sent <= 0) {
+      return false;
+    }
+
+    ciphertext->commitRead(sent);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Get ciphertext from OpenSSL onto the socket. The socket is only ever
+// written to under flushMtx, so the other direction can work with OpenSSL
+// in the meantime.
+//------------------------------------------------------------------------------
+void TlsFilter::pumpCiphertext() {
+  if(socketBio) return;
+
+  while(true) {
+    bool drained;
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      drained = drainCiphertext();
+    }
+
+    if(!flushCiphertext() || drained) {
+      return;
+    }
+  }
 }
 
 LinkStatus TlsFilter::send(const char *buff, int blen) {
@@ -178,73 +419,122 @@ LinkStatus TlsFilter::send(const char *buff, int blen) {
     return sendFunc(buff, blen);
   }
 
-  // We receive plaintext here, and give it to OpenSSL for encryption.
-  std::lock_guard<std::mutex> lock(mtx);
-  handleTraffic();
+  // The kernel encrypts, OpenSSL is out of the picture.
+  if(kernelSend) {
+    return sendFunc(buff, blen);
+  }
 
-  if(pendingWrites.empty()) {
-    int bytes;
-    bytes = SSL_write(ssl, buff, blen);
+  // We receive plaintext here, and give it to OpenSSL for encryption.
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    continueHandshake();
+    retryPendingWrites();
+
+    bool written = false;
+    if(pendingWrites.empty()) {
+      written = (SSL_write(ssl, buff, blen) == blen);
+    }
 
-    if(bytes == blen) { // all OK
-      handleTraffic();
-      return 1;
+    // Must queue write request
+    if(!written) {
+      pendingWrites.push_back(std::string(buff, blen));
     }
   }
 
-  // Must queue write request
-  pendingWrites.push_back(std::string(buff, blen));
+  pumpCiphertext();
   return 1;
 }
 
 RecvStatus TlsFilter::recv(char *buff, int blen, int timeout) {
   if(!tlsconfig.active) return recvFunc(buff, blen, timeout);
-  std::lock_guard<std::mutex> lock(mtx);
-
-  handleTraffic();
 
-  // We receive ciphertext from the socket.
+  //----------------------------------------------------------------------------
+  // We receive ciphertext from the socket - there's a single reader, no need
+  // to hold any lock for this.
+  //----------------------------------------------------------------------------
   const size_t BUF_SIZE = 1024 * 8;
-  char ciphertext[BUF_SIZE];
+  char ciphertextBuffer[BUF_SIZE];
+  RecvStatus status(true, 0, 0);
 
-  RecvStatus status = recvFunc(ciphertext, BUF_SIZE, 0);
-  if(!status.connectionAlive) return status;
+  if(!socketBio) {
+    status = recvFunc(ciphertextBuffer, BUF_SIZE, 0);
+    if(!status.connectionAlive) return status;
+  }
+
+  RecvStatus ret;
+
+  {
+    std::lock_guard<std::mutex> lock(mtx);
 
-  // We give the ciphertext to OpenSSL for decryption.
-  if(status.bytesRead > 0) {
-    int bytes = BIO_write(wbio, ciphertext, status.bytesRead);
+    // We give the ciphertext to OpenSSL for decryption.
+    if(status.bytesRead > 0) {
+      int bytes = BIO_write(wbio, ciphertextBuffer, status.bytesRead);
 
-    if(bytes != status.bytesRead) {
-      std::cerr << "qclient: 'should never happen' error when calling BIO_write (" << bytes << ")" << std::endl;
-      return RecvStatus(false, status.bytesRead, 0);
+      if(bytes != status.bytesRead) {
+        std::cerr << "qclient: 'should never happen' error when calling BIO_write (" << bytes << ")" << std::endl;
+        return RecvStatus(false, status.bytesRead, 0);
+      }
     }
-  }
 
-  // We receive the decrypted plaintext from OpenSSL.
-  ERR_clear_error();
-  int plaintextBytes = SSL_read(ssl, buff, blen);
+    continueHandshake();
+    retryPendingWrites();
 
-  RecvStatus ret;
-  if(plaintextBytes > 0) {
-    // Successful read
-    ret = RecvStatus(true, 0, plaintextBytes);
-  }
-  else {
-    int err = SSL_get_error(ssl, plaintextBytes);
-    if(err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
-      // not an error, connection is fine
-      ret = RecvStatus(true, 0, 0);
+    // We receive the decrypted plaintext from OpenSSL.
+    ERR_clear_error();
+    int plaintextBytes = SSL_read(ssl, buff, blen);
+
+    if(plaintextBytes > 0) {
+      // Successful read
+      ret = RecvStatus(true, 0, plaintextBytes);
     }
     else {
-      // Ok, something's not right. Propagate to caller
-      ret = RecvStatus(false, err, 0);
+      int err = SSL_get_error(ssl, plaintextBytes);
+      if(err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
+        // not an error, connection is fine
+        ret = RecvStatus(true, 0, 0);
+      }
+      else {
+        // Ok, something's not right. Propagate to caller
+        ret = RecvStatus(false, err, 0);
+      }
     }
+
+    // A read could complete the handshake as well
+    continueHandshake();
+    retryPendingWrites();
   }
 
-  handleTraffic();
+  pumpCiphertext();
   return ret;
 }
 
+bool TlsFilter::kernelSendOffload() {
+  return kernelSend;
+}
+
+bool TlsFilter::hasPendingOutput() {
+  if(!tlsconfig.active) return false;
+
+  std::lock_guard<std::mutex> lock(mtx);
+  if(!pendingWrites.empty()) return true;
+  if(socketBio) return false;
+
+  return BIO_ctrl_pending(rbio) > 0 || !ciphertext->empty();
+}
+
+bool TlsFilter::flushPendingOutput() {
+  if(!tlsconfig.active) return true;
+
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    continueHandshake();
+    retryPendingWrites();
+  }
+
+  pumpCiphertext();
+  return !hasPendingOutput();
+}
+
 TlsFilter::~TlsFilter() {
   close(0);
 
@@ -253,27 +543,36 @@ TlsFilter::~TlsFilter() {
     ssl = nullptr;
   }
 
-  if(ctx) {
-    SSL_CTX_free(ctx);
-    ctx = nullptr;
-  }
+  // ctx is owned by the context cache
+  ctx = nullptr;
 }
 
 LinkStatus TlsFilter::close(int defer) {
-  std::lock_guard<std::mutex> lock(mtx);
+  if(!ssl) return 0;
 
-  if(ssl) {
+  {
+    std::lock_guard<std::mutex> lock(mtx);
     SSL_shutdown(ssl);
-    handleTraffic();
   }
+
+  pumpCiphertext();
   return 0;
 }
 
 #else
 
-TlsFilter::TlsFilter(const TlsConfig &config, const FilterType &filtertype, RecvFunction rc, SendFunction sd) {}
+TlsFilter::TlsFilter(const TlsConfig &config, const FilterType &filtertype, RecvFunction rc, SendFunction sd,
+  const std::string &peer, int fd) {}
 TlsFilter::~TlsFilter() {}
 
+bool TlsFilter::sessionReused() {
+  return false;
+}
+
+bool TlsFilter::kernelSendOffload() {
+  return false;
+}
+
 LinkStatus TlsFilter::send(const char *buff, int blen) {
   return sendFunc(buff, blen);
 }
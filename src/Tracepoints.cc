@@ -0,0 +1,36 @@
+//------------------------------------------------------------------------------
+// File: Tracepoints.cc
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#include "Tracepoints.hh"
+
+#if HAVE_USDT == 1
+
+//------------------------------------------------------------------------------
+// Probe semaphores, incremented by the tracer while attached to a probe
+//------------------------------------------------------------------------------
+#define QCLIENT_DEFINE_SEMAPHORE(name) \
+  unsigned short QCLIENT_TRACE_SEMAPHORE(name) = 0;
+
+QCLIENT_PROBES(QCLIENT_DEFINE_SEMAPHORE)
+
+#endif
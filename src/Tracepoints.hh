@@ -0,0 +1,99 @@
+//------------------------------------------------------------------------------
+// File: Tracepoints.hh
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#ifndef QCLIENT_TRACEPOINTS_HH
+#define QCLIENT_TRACEPOINTS_HH
+
+//------------------------------------------------------------------------------
+// USDT probes on the request path, under the "qclient" provider - for
+// bpftrace, perf or systemtap to attach to at runtime. Compiled in only when
+// sys/sdt.h is available, see the USDT_PROBES CMake option.
+//
+// Every probe comes with a semaphore, which the tracer increments while
+// attached: An unattached probe costs a load and a not-taken branch, and its
+// arguments are not evaluated. The semaphores are defined in
+// Tracepoints.cc - adding a probe means adding it to QCLIENT_PROBES.
+//
+// qclient is a static library, so the probes end up in whichever binary
+// links it, for example:
+//
+//   bpftrace -e 'usdt:./app:qclient:acknowledge { @[arg1] = count(); }'
+//
+// Probes and their arguments:
+//
+//   stage                (seq, request length)
+//   stage_batch          (first seq, request count, total length)
+//   send                 (seq of first request in batch, bytes written)
+//   reply                (reply, reply type, length of a string reply)
+//   acknowledge          (seq, request length, reply - null if skipped)
+//   callback_start       (reply, nanoseconds spent queued for the executor)
+//   callback_end         (reply)
+//   reconnect            (connection epoch)
+//   redirect             (host, port)
+//   backpressure_block   (request length, pending requests)
+//   backpressure_unblock (request length, nanoseconds blocked)
+//
+// Replies are identified by address: reply, acknowledge and the callback
+// probes all carry the same one for a given response.
+//------------------------------------------------------------------------------
+
+#define QCLIENT_PROBES(X) \
+  X(stage) \
+  X(stage_batch) \
+  X(send) \
+  X(reply) \
+  X(acknowledge) \
+  X(callback_start) \
+  X(callback_end) \
+  X(reconnect) \
+  X(redirect) \
+  X(backpressure_block) \
+  X(backpressure_unblock)
+
+#if HAVE_USDT == 1
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+// Same name and section as "dtrace -h" would generate, so that the probe
+// notes point at them.
+#define QCLIENT_TRACE_SEMAPHORE(name) qclient_##name##_semaphore
+#define QCLIENT_DECLARE_SEMAPHORE(name) \
+  extern "C" unsigned short QCLIENT_TRACE_SEMAPHORE(name) \
+    __attribute__((unused)) __attribute__((section(".probes")));
+
+QCLIENT_PROBES(QCLIENT_DECLARE_SEMAPHORE)
+
+#define QCLIENT_TRACE_ENABLED(name) \
+  __builtin_expect(QCLIENT_TRACE_SEMAPHORE(name) != 0, 0)
+
+#define QCLIENT_TRACE(name, ...) do { \
+  if(QCLIENT_TRACE_ENABLED(name)) { \
+    STAP_PROBEV(qclient, name, __VA_ARGS__); \
+  } \
+} while(false)
+#else
+#define QCLIENT_TRACE_ENABLED(name) false
+#define QCLIENT_TRACE(name, ...) do {} while(false)
+#endif
+
+#endif
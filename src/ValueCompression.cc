@@ -0,0 +1,285 @@
+//------------------------------------------------------------------------------
+// File: ValueCompression.cc
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#include "qclient/ValueCompression.hh"
+#include <cstring>
+#include <limits>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+namespace qclient {
+
+static const char kMagic[3] = { '\xC5', 'Q', 'Z' };
+
+//------------------------------------------------------------------------------
+// Refuse to allocate more than this for a single decoded value - a
+// corrupted header should not be able to exhaust memory.
+//------------------------------------------------------------------------------
+static constexpr uint64_t kMaxDecodedSize = 1ull << 32;
+
+static void appendHeader(std::string &out, CompressionAlgorithm algorithm,
+  uint64_t size) {
+
+  out.append(kMagic, sizeof(kMagic));
+  out.push_back((char) algorithm);
+
+  for(int shift = 56; shift >= 0; shift -= 8) {
+    out.push_back((char) ((size >> shift) & 0xFF));
+  }
+}
+
+//------------------------------------------------------------------------------
+// Compress src into the buffer following the header, resizing out to fit -
+// false if the codec failed, or the result would not be smaller.
+//------------------------------------------------------------------------------
+static bool compressInto(CompressionAlgorithm algorithm, int level,
+  const std::string &src, std::string &out) {
+
+  switch(algorithm) {
+#ifdef HAVE_ZLIB
+    case CompressionAlgorithm::kZlib: {
+      uLongf len = compressBound(src.size());
+      out.resize(ValueCompression::kHeaderSize + len);
+
+      if(compress2((Bytef*) &out[ValueCompression::kHeaderSize], &len,
+                   (const Bytef*) src.data(), src.size(),
+                   level == 0 ? Z_DEFAULT_COMPRESSION : level) != Z_OK) {
+        return false;
+      }
+
+      out.resize(ValueCompression::kHeaderSize + len);
+      return out.size() < src.size();
+    }
+#endif
+#ifdef HAVE_LZ4
+    case CompressionAlgorithm::kLz4: {
+      if(src.size() > (size_t) LZ4_MAX_INPUT_SIZE) return false;
+
+      int bound = LZ4_compressBound(src.size());
+      out.resize(ValueCompression::kHeaderSize + bound);
+
+      int len = LZ4_compress_fast(src.data(), &out[ValueCompression::kHeaderSize],
+                                  src.size(), bound, level <= 0 ? 1 : level);
+      if(len <= 0) return false;
+
+      out.resize(ValueCompression::kHeaderSize + len);
+      return out.size() < src.size();
+    }
+#endif
+#ifdef HAVE_ZSTD
+    case CompressionAlgorithm::kZstd: {
+      size_t bound = ZSTD_compressBound(src.size());
+      out.resize(ValueCompression::kHeaderSize + bound);
+
+      size_t len = ZSTD_compress(&out[ValueCompression::kHeaderSize], bound,
+                                 src.data(), src.size(), level);
+      if(ZSTD_isError(len)) return false;
+
+      out.resize(ValueCompression::kHeaderSize + len);
+      return out.size() < src.size();
+    }
+#endif
+    default: {
+      return false;
+    }
+  }
+}
+
+//------------------------------------------------------------------------------
+// Decompress exactly size bytes out of src
+//------------------------------------------------------------------------------
+static bool decompressInto(CompressionAlgorithm algorithm, const char *src,
+  size_t len, uint64_t size, std::string &out) {
+
+  out.resize(size);
+
+  switch(algorithm) {
+    case CompressionAlgorithm::kNone: {
+      if(len != size) return false;
+      if(len != 0) memcpy(&out[0], src, len);
+      return true;
+    }
+#ifdef HAVE_ZLIB
+    case CompressionAlgorithm::kZlib: {
+      uLongf outLen = size;
+      if(uncompress((Bytef*) &out[0], &outLen, (const Bytef*) src, len) != Z_OK) {
+        return false;
+      }
+
+      return outLen == size;
+    }
+#endif
+#ifdef HAVE_LZ4
+    case CompressionAlgorithm::kLz4: {
+      if(size > (uint64_t) std::numeric_limits<int>::max()) return false;
+      int outLen = LZ4_decompress_safe(src, &out[0], len, size);
+      return outLen >= 0 && (uint64_t) outLen == size;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    case CompressionAlgorithm::kZstd: {
+      size_t outLen = ZSTD_decompress(&out[0], size, src, len);
+      return !ZSTD_isError(outLen) && outLen == size;
+    }
+#endif
+    default: {
+      return false;
+    }
+  }
+}
+
+//------------------------------------------------------------------------------
+// Is the given algorithm compiled into this build?
+//------------------------------------------------------------------------------
+bool ValueCompression::supported(CompressionAlgorithm algorithm) {
+  switch(algorithm) {
+    case CompressionAlgorithm::kNone: {
+      return true;
+    }
+    case CompressionAlgorithm::kZlib: {
+#ifdef HAVE_ZLIB
+      return true;
+#else
+      return false;
+#endif
+    }
+    case CompressionAlgorithm::kLz4: {
+#ifdef HAVE_LZ4
+      return true;
+#else
+      return false;
+#endif
+    }
+    case CompressionAlgorithm::kZstd: {
+#ifdef HAVE_ZSTD
+      return true;
+#else
+      return false;
+#endif
+    }
+  }
+
+  return false;
+}
+
+//------------------------------------------------------------------------------
+// Encode value into out, if it can't be stored as-is
+//------------------------------------------------------------------------------
+bool ValueCompression::encode(const std::string &value, std::string &out) const {
+  if(!active()) {
+    return false;
+  }
+
+  if(value.size() >= threshold && value.size() > kHeaderSize) {
+    std::string compressed;
+    appendHeader(compressed, algorithm, value.size());
+
+    if(compressInto(algorithm, level, value, compressed)) {
+      out = std::move(compressed);
+      return true;
+    }
+  }
+
+  if(!isEncoded(value)) {
+    return false;
+  }
+
+  out.clear();
+  out.reserve(kHeaderSize + value.size());
+  appendHeader(out, CompressionAlgorithm::kNone, value.size());
+  out.append(value);
+  return true;
+}
+
+std::string ValueCompression::encode(const std::string &value) const {
+  std::string out;
+  if(!encode(value, out)) {
+    return value;
+  }
+
+  return out;
+}
+
+//------------------------------------------------------------------------------
+// Does the given buffer start with the magic?
+//------------------------------------------------------------------------------
+bool ValueCompression::isEncoded(const char *data, size_t len) {
+  return len >= sizeof(kMagic) && memcmp(data, kMagic, sizeof(kMagic)) == 0;
+}
+
+//------------------------------------------------------------------------------
+// Decode the given buffer into out
+//------------------------------------------------------------------------------
+bool ValueCompression::decode(const char *data, size_t len, std::string &out) {
+  if(!isEncoded(data, len)) {
+    out.assign(data, len);
+    return true;
+  }
+
+  if(len < kHeaderSize) {
+    return false;
+  }
+
+  CompressionAlgorithm algorithm = (CompressionAlgorithm) data[3];
+
+  uint64_t size = 0;
+  for(size_t i = 4; i < kHeaderSize; i++) {
+    size = (size << 8) | (uint8_t) data[i];
+  }
+
+  if(size > kMaxDecodedSize) {
+    return false;
+  }
+
+  return decompressInto(algorithm, data + kHeaderSize, len - kHeaderSize,
+                        size, out);
+}
+
+//------------------------------------------------------------------------------
+// Decode value in place
+//------------------------------------------------------------------------------
+bool ValueCompression::decodeInPlace(std::string &value) {
+  if(!isEncoded(value)) {
+    return true;
+  }
+
+  std::string decoded;
+  if(!decode(value.data(), value.size(), decoded)) {
+    return false;
+  }
+
+  value = std::move(decoded);
+  return true;
+}
+
+}
@@ -0,0 +1,161 @@
+//------------------------------------------------------------------------------
+// File: WriteCombiner.cc
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#include "WriteCombiner.hh"
+#include <algorithm>
+#include <ctype.h>
+#include <string.h>
+#include <strings.h>
+
+namespace qclient {
+
+//------------------------------------------------------------------------------
+// Both callbacks of two combined writes, the earlier one first
+//------------------------------------------------------------------------------
+class ChainedCallback {
+public:
+  ChainedCallback(ReplyCallback &&e, ReplyCallback &&l)
+  : earlier(std::move(e)), later(std::move(l)) {}
+
+  void operator()(redisReplyPtr &&reply) {
+    earlier(redisReplyPtr(reply));
+    later(std::move(reply));
+  }
+
+private:
+  ReplyCallback earlier;
+  ReplyCallback later;
+};
+
+//------------------------------------------------------------------------------
+// Does the segment start with the given array header and command?
+//------------------------------------------------------------------------------
+static bool startsWith(EncodedRequest::Segment segment, const char *header,
+  const char *command) {
+
+  size_t headerLen = strlen(header);
+  size_t commandLen = strlen(command);
+
+  return segment.len >= headerLen + commandLen &&
+         memcmp(segment.data, header, headerLen) == 0 &&
+         strncasecmp(segment.data + headerLen, command, commandLen) == 0;
+}
+
+//------------------------------------------------------------------------------
+// Everything up to the value - the key and field sit in the first segment,
+// unless huge, in which case the request simply doesn't combine.
+//------------------------------------------------------------------------------
+std::string WriteCombiner::combiningKey(const EncodedRequest &req) {
+  EncodedRequest::Segment segment = req.getSegment(0);
+  size_t arguments = 0;
+
+  if(startsWith(segment, "*3\r\n$3\r\n", "SET")) {
+    arguments = 3;
+  }
+  else if(startsWith(segment, "*4\r\n$4\r\n", "HSET")) {
+    arguments = 4;
+  }
+  else {
+    return {};
+  }
+
+  const char *end = segment.data + segment.len;
+  const char *pos = segment.data + 4;
+
+  for(size_t i = 0; i + 1 < arguments; i++) {
+    if(pos >= end || *pos != '$') {
+      return {};
+    }
+
+    const char *lengthStart = pos + 1;
+    const char *newline = (const char*) memchr(lengthStart, '\n', end - lengthStart);
+    if(!newline) {
+      return {};
+    }
+
+    size_t length = strtoull(lengthStart, nullptr, 10);
+    const char *argument = newline + 1;
+    if(length + 2 > (size_t) (end - argument)) {
+      return {};
+    }
+
+    pos = argument + length + 2;
+  }
+
+  // Command names are case-insensitive - normalize, so that they combine
+  std::string key(segment.data, pos - segment.data);
+  for(size_t i = 8; i < 8 + arguments; i++) {
+    key[i] = toupper(key[i]);
+  }
+
+  return key;
+}
+
+//------------------------------------------------------------------------------
+// Register a write, superseding any earlier one still pending
+//------------------------------------------------------------------------------
+std::shared_ptr<RequestDeadline> WriteCombiner::combine(std::string &&key,
+  ReplyCallback &&callback) {
+
+  std::lock_guard<std::mutex> lock(mtx);
+  std::weak_ptr<RequestDeadline> &slot = pending[key];
+
+  std::shared_ptr<RequestDeadline> earlier = slot.lock();
+  ReplyCallback earlierCallback;
+
+  if(earlier && earlier->takeOver(earlierCallback)) {
+    combined.fetch_add(1, std::memory_order_relaxed);
+    callback = ChainedCallback(std::move(earlierCallback), std::move(callback));
+  }
+
+  std::shared_ptr<RequestDeadline> state = std::make_shared<RequestDeadline>(
+    std::move(callback), std::chrono::steady_clock::time_point::max());
+  slot = state;
+
+  if(pending.size() >= sweepAt) {
+    sweep();
+  }
+
+  return state;
+}
+
+//------------------------------------------------------------------------------
+// Drop the keys whose last write is done with - amortized over the inserts,
+// by sweeping again only once the table doubles.
+//------------------------------------------------------------------------------
+void WriteCombiner::sweep() {
+  for(auto it = pending.begin(); it != pending.end(); ) {
+    std::shared_ptr<RequestDeadline> state = it->second.lock();
+
+    if(!state || state->isCompleted()) {
+      it = pending.erase(it);
+    }
+    else {
+      it++;
+    }
+  }
+
+  sweepAt = std::max<size_t>(1024, pending.size() * 2);
+}
+
+}
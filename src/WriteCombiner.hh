@@ -0,0 +1,82 @@
+//------------------------------------------------------------------------------
+// File: WriteCombiner.hh
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+
+#ifndef QCLIENT_WRITE_COMBINER_HH
+#define QCLIENT_WRITE_COMBINER_HH
+
+#include "qclient/EncodedRequest.hh"
+#include "TimerWheel.hh"
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace qclient {
+
+//------------------------------------------------------------------------------
+// Write combining: Of several SET key value, or HSET key field value, for the
+// same key and field, only the last one needs to reach the server. When such
+// a write is staged while an earlier one is still waiting in the queue, the
+// earlier one is marked as completed - the writer skips it, as with an
+// expired deadline - and its callback is chained in front of the later one.
+//
+// The earlier write thus takes effect at the position of the later one:
+// Requests staged in between don't observe it. Only a write the writer has
+// not got to yet is merged this way - one already written goes out and
+// completes as usual, independently of the later one.
+//------------------------------------------------------------------------------
+class WriteCombiner {
+public:
+  //----------------------------------------------------------------------------
+  // Everything up to the value, which identifies the writes superseding each
+  // other - empty if the request never combines.
+  //----------------------------------------------------------------------------
+  static std::string combiningKey(const EncodedRequest &req);
+
+  //----------------------------------------------------------------------------
+  // Register a write with the given key, superseding any earlier one still
+  // pending. Returns the state to stage the request with.
+  //----------------------------------------------------------------------------
+  std::shared_ptr<RequestDeadline> combine(std::string &&key, ReplyCallback &&callback);
+
+  //----------------------------------------------------------------------------
+  // Number of writes superseded so far
+  //----------------------------------------------------------------------------
+  int64_t getCombined() const {
+    return combined.load(std::memory_order_relaxed);
+  }
+
+private:
+  void sweep();
+
+  std::mutex mtx;
+  std::unordered_map<std::string, std::weak_ptr<RequestDeadline>> pending;
+  size_t sweepAt = 1024;
+  std::atomic<int64_t> combined {0};
+};
+
+}
+
+#endif
@@ -24,16 +24,19 @@
 #include "WriterThread.hh"
 #include "ConnectionCore.hh"
 #include "network/NetworkStream.hh"
+#include "network/IoUring.hh"
 #include "qclient/Handshake.hh"
 #include "qclient/Logger.hh"
+#include "Tracepoints.hh"
 #include <poll.h>
+#include <limits.h>
 
 #define DBG(message) std::cerr << __FILE__ << ":" << __LINE__ << " -- " << #message << " = " << message << std::endl
 
 using namespace qclient;
 
-WriterThread::WriterThread(Logger *log, ConnectionCore &core, EventFD &shutdownFD)
-: logger(log), connectionCore(core), shutdownEventFD(shutdownFD) { }
+WriterThread::WriterThread(Logger *log, ConnectionCore &core, EventFD &shutdownFD, IoBackend backend)
+: logger(log), connectionCore(core), shutdownEventFD(shutdownFD), ioBackend(backend) { }
 
 WriterThread::~WriterThread() {
   deactivate();
@@ -42,6 +45,19 @@ WriterThread::~WriterThread() {
 void WriterThread::activate(NetworkStream *stream) {
   connectionCore.setBlockingMode(true);
   thread.reset(&WriterThread::eventLoop, this, stream);
+  thread.setAffinity(cpuAffinity);
+}
+
+void WriterThread::setCpuAffinity(const std::vector<int> &cpus) {
+  cpuAffinity = cpus;
+}
+
+void WriterThread::setZeroCopyThreshold(size_t threshold) {
+  zeroCopyThreshold = threshold;
+}
+
+void WriterThread::setRateLimiter(std::shared_ptr<RateLimiter> limiter) {
+  rateLimiter = std::move(limiter);
 }
 
 void WriterThread::deactivate() {
@@ -50,87 +66,319 @@ void WriterThread::deactivate() {
   thread.join();
 }
 
+//------------------------------------------------------------------------------
+// Upper limits on how much we gather into a single batch.
+//------------------------------------------------------------------------------
+static constexpr size_t kMaxBatchRequests = IOV_MAX;
+static constexpr size_t kMaxBatchBytes = 1024 * 1024 * 4;
+
+//------------------------------------------------------------------------------
+// Upper limit on a single wait for rate limiter tokens, so that rate changes
+// and termination requests are noticed promptly.
+//------------------------------------------------------------------------------
+static constexpr std::chrono::milliseconds kMaxThrottleWait {20};
+
+//------------------------------------------------------------------------------
+// Fill the given batch with as many staged requests as are available, up to
+// the given limits. Blocks until at least one request is available, or
+// shutdown has been requested - in that case, the batch is left empty.
+// Returns the number of requests in the batch. The first one is always
+// taken, even if larger than maxBytes.
+//
+// Requests made of several segments produce one iovec per segment.
+//
+// Request lengths are copied into the iovecs, and write times stamped: Once a
+// request has been written out, we never touch it again, since its response
+// may arrive at any moment and the reader would free it.
+//------------------------------------------------------------------------------
+size_t WriterThread::fillBatch(std::vector<struct iovec> &batch, size_t maxRequests, size_t maxBytes) {
+  batch.clear();
+  batchFirstSeq = connectionCore.getNextToWriteSeq();
+  size_t requests = connectionCore.getNextToWrite(stagedBatch, maxRequests, maxBytes);
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+  for(StagedRequest *item : stagedBatch) {
+    item->markWritten(now);
+
+    for(size_t i = 0; i < item->getSegmentCount(); i++) {
+      EncodedRequest::Segment segment = item->getSegment(i);
+
+      struct iovec vec;
+      vec.iov_base = (void*) segment.data;
+      vec.iov_len = segment.len;
+      batch.push_back(vec);
+    }
+  }
+
+  stagedBatch.clear();
+  return requests;
+}
+
+//------------------------------------------------------------------------------
+// Rate limiting: Narrow the allowance of the next batch down to the tokens
+// available. If there are none, wait for a bit, and return false - the
+// caller starts its round over.
+//------------------------------------------------------------------------------
+bool WriterThread::throttle(RateLimiter::Allowance &allowance, ThreadAssistant &assistant) {
+  RateLimiter::Allowance available = rateLimiter->getAllowance();
+
+  if(available.requests == 0u) {
+    std::chrono::nanoseconds delay = std::min<std::chrono::nanoseconds>(
+      rateLimiter->getDelay(), kMaxThrottleWait);
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    assistant.wait_for(delay);
+    rateLimiter->recordThrottled(std::chrono::steady_clock::now() - start);
+    return false;
+  }
+
+  allowance.requests = std::min(allowance.requests, available.requests);
+  allowance.bytes = std::min(allowance.bytes, available.bytes);
+  return true;
+}
+
 void WriterThread::eventLoop(NetworkStream *networkStream, ThreadAssistant &assistant) {
 
-  struct pollfd polls[2];
+  // Over shared memory, keep an eye on the socket too: A dead server never
+  // makes room in the ring.
+  struct pollfd polls[3];
   polls[0].fd = shutdownEventFD.getFD();
   polls[0].events = POLLIN;
-  polls[1].fd = networkStream->getFd();
-  polls[1].events = POLLOUT;
+  networkStream->pollForWriting(polls[1]);
+  polls[2].fd = networkStream->getFd();
+  polls[2].events = POLLRDHUP;
+  polls[2].revents = 0;
+  int npolls = networkStream->usesSharedMemory() ? 3 : 2;
 
-  StagedRequest *beingProcessed = nullptr;
-  size_t bytesWritten = 0;
+  std::vector<struct iovec> batch;
+  batch.reserve(kMaxBatchRequests);
+
+  // One ring per connection epoch, owned by this thread.
+  std::unique_ptr<IoUring> ring;
+  if(ioBackend == IoBackend::kIoUring && IoUring::supported()) {
+    ring.reset(new IoUring());
+    if(!ring->ok()) ring.reset();
+  }
+
+  // Zero-copy ids restart with every socket, while the kernel releases
+  // pinned pages of a dead one by itself.
+  zeroCopy = (zeroCopyThreshold > 0 && networkStream->enableZeroCopy());
+  nextZeroCopyId = 0;
+  zeroCopyInFlight.clear();
+  connectionCore.unpinRequests();
+
+  size_t batchPos = 0;
   bool canWrite = true;
 
   while(!assistant.terminationRequested() && networkStream->ok()) {
     // What should we do during this round?
+    if(!zeroCopyInFlight.empty()) {
+      reapZeroCopy(networkStream);
+    }
 
     if(!canWrite) {
       // We have data to write but cannot, because the kernel buffers are full.
       // Poll until the socket is writable.
 
-      int rpoll = poll(polls, 2, -1);
+      int rpoll = ring ? ring->poll(polls, npolls, -1) : poll(polls, npolls, -1);
       if(rpoll < 0 && errno != EINTR) {
         QCLIENT_LOG(logger, LogLevel::kError,
           "error during poll() in WriterThread::eventLoop. errno="
           << errno << ":" << strerror(errno));
       }
 
+      if(rpoll > 0 && npolls == 3 && polls[2].revents != 0) {
+        networkStream->shutdown();
+        break;
+      }
+
       canWrite = true; // try writing again, regardless of poll outcome
     }
 
-    // Determine what exactly we should be writing into the socket. getNextToWrite
+    // Determine what exactly we should be writing into the socket. fillBatch
     // will block until there's something to write, or shutdown has been requested.
-    if(beingProcessed == nullptr) {
-      bytesWritten = 0;
-      beingProcessed = connectionCore.getNextToWrite();
-      if(!beingProcessed) continue;
-    }
+    if(batchPos == batch.size()) {
+      // Before going to sleep, make sure TLS hasn't kept anything behind -
+      // the server may be waiting for it.
+      if(networkStream->hasPendingOutput() && !networkStream->flushPendingOutput()) {
+        canWrite = false;
+        continue;
+      }
 
-    // The socket is writable AND there's staged requests waiting to be written.
-    int bytes;
+      RateLimiter::Allowance allowance { kMaxBatchRequests, kMaxBatchBytes };
+      if(rateLimiter && !throttle(allowance, assistant)) continue;
 
-    bytes = networkStream->send(
-      beingProcessed->getBuffer() + bytesWritten,
-      beingProcessed->getLen() - bytesWritten
-    );
+      batchPos = 0;
 
-    // Determine what happened during sending.
-    if(bytes < 0 && errno == EWOULDBLOCK) {
-      // Recoverable error: EWOULDBLOCK
-      // All is good, we just need to poll before writing again.
-      canWrite = false;
-      continue;
-    }
+      size_t requests = fillBatch(batch, allowance.requests, allowance.bytes);
+      if(batch.empty()) continue;
+
+      if(rateLimiter) {
+        size_t bytes = 0u;
+        for(const struct iovec &vec : batch) {
+          bytes += vec.iov_len;
+        }
 
-    if(bytes < 0) {
-      // Non-recoverable error, this looks bad. Kill connection.
-      QCLIENT_LOG(logger, LogLevel::kError, "Bad return value from send(): "
-        << bytes << ", errno: " << errno << "," << strerror(errno));
-      networkStream->shutdown();
+        rateLimiter->consume(requests, bytes);
+      }
+    }
 
+    SendStatus status = sendBatch(networkStream, batch, batchPos, ring.get());
+    if(status == SendStatus::kFailed) {
       // Stop the loop. The parent class will activate us again with a
       // new network stream if need be.
-      return;
+      break;
+    }
+
+    if(status == SendStatus::kBlocked) {
+      canWrite = false;
+    }
+  }
+
+  zeroCopy = false;
+  zeroCopyInFlight.clear();
+  connectionCore.unpinRequests();
+}
+
+//------------------------------------------------------------------------------
+// Forget zero-copy sends the kernel is done with, and move the pin forward
+// to the oldest one still in flight.
+//------------------------------------------------------------------------------
+void WriterThread::reapZeroCopy(NetworkStream *networkStream) {
+  networkStream->reapZeroCopy();
+  uint32_t completed = networkStream->getZeroCopyCompleted();
+
+  size_t before = zeroCopyInFlight.size();
+  while(!zeroCopyInFlight.empty() &&
+        (int32_t) (zeroCopyInFlight.front().first - completed) < 0) {
+    zeroCopyInFlight.pop_front();
+  }
+
+  if(zeroCopyInFlight.empty()) {
+    connectionCore.unpinRequests();
+  }
+  else if(zeroCopyInFlight.size() != before) {
+    connectionCore.pinRequests(zeroCopyInFlight.front().second);
+  }
+}
+
+//------------------------------------------------------------------------------
+// The socket is writable AND there's staged requests waiting to be written.
+// Write out everything we have with a single syscall. Zero-copy requests
+// span several iovecs, so a batch may exceed IOV_MAX.
+//------------------------------------------------------------------------------
+WriterThread::SendStatus WriterThread::sendBatch(NetworkStream *networkStream,
+  std::vector<struct iovec> &batch, size_t &batchPos, IoUring *ring) {
+  int iovcnt = std::min<size_t>(batch.size() - batchPos, IOV_MAX);
+  size_t attempted = 0;
+  for(int i = 0; i < iovcnt; i++) {
+    attempted += batch[batchPos + i].iov_len;
+  }
+
+  //----------------------------------------------------------------------------
+  // Zero-copy: Pin before sending, the response to the first request might
+  // well arrive before sendv returns.
+  //----------------------------------------------------------------------------
+  bool zeroCopySend = zeroCopy && !ring && attempted >= zeroCopyThreshold;
+  if(zeroCopySend && zeroCopyInFlight.empty()) {
+    connectionCore.pinRequests(batchFirstSeq);
+  }
+
+  int bytes = networkStream->sendv(batch.data() + batchPos, iovcnt, ring, zeroCopySend);
+  if(zeroCopySend && bytes < 0 && errno == ENOBUFS) {
+    zeroCopySend = false;
+    bytes = networkStream->sendv(batch.data() + batchPos, iovcnt, ring);
+  }
+
+  if(zeroCopySend && bytes > 0) {
+    zeroCopyInFlight.emplace_back(nextZeroCopyId++, batchFirstSeq);
+  }
+  else if(zeroCopy && zeroCopyInFlight.empty()) {
+    connectionCore.unpinRequests();
+  }
+
+  // Determine what happened during sending.
+  if(bytes < 0 && errno == EWOULDBLOCK) {
+    // Recoverable error: EWOULDBLOCK
+    // All is good, we just need to poll before writing again.
+    return SendStatus::kBlocked;
+  }
+
+  if(bytes < 0) {
+    // Non-recoverable error, this looks bad. Kill connection.
+    QCLIENT_LOG(logger, LogLevel::kError, "Bad return value from sendv(): "
+      << bytes << ", errno: " << errno << "," << strerror(errno));
+    networkStream->shutdown();
+    return SendStatus::kFailed;
+  }
+
+  connectionCore.getCounters().bytesSent.add(bytes);
+  QCLIENT_TRACE(send, batchFirstSeq, bytes);
+
+  // Seems good, at least some bytes were written. Whoo! Advance through
+  // the batch, skipping any iovecs which were written out fully.
+  size_t remaining = bytes;
+  while(remaining > 0 && batchPos < batch.size()) {
+    struct iovec &vec = batch[batchPos];
+
+    if(remaining < vec.iov_len) {
+      vec.iov_base = (char*) vec.iov_base + remaining;
+      vec.iov_len -= remaining;
+      remaining = 0;
+      break;
     }
 
-    // Seems good, at least some bytes were written. Whoo!
-    bytesWritten += bytes;
-    if(bytesWritten > beingProcessed->getLen()) {
-      QCLIENT_LOG(logger, LogLevel::kFatal, "Wrote more bytes for a request than its length: "
-        << bytesWritten << ", " << beingProcessed->getLen());
-      std::abort();
+    remaining -= vec.iov_len;
+    batchPos++;
+  }
+
+  if(remaining != 0) {
+    QCLIENT_LOG(logger, LogLevel::kFatal, "Wrote more bytes for a batch than its length: "
+      << bytes << ", excess: " << remaining);
+    std::abort();
+  }
+
+  // Fewer bytes were written than we asked for? The kernel buffers must
+  // be full. Poll until the socket is writable.
+  if((size_t) bytes < attempted) {
+    return SendStatus::kBlocked;
+  }
+
+  return SendStatus::kProgress;
+}
+
+//------------------------------------------------------------------------------
+// Inline mode, for clients driven by an external event loop: The same as
+// eventLoop, minus the thread - write until either nothing is staged, or the
+// kernel buffers are full.
+//------------------------------------------------------------------------------
+void WriterThread::activateInline() {
+  connectionCore.setBlockingMode(false);
+  inlineBatch.clear();
+  inlineBatchPos = 0;
+}
+
+bool WriterThread::writeInline(NetworkStream *networkStream) {
+  while(networkStream->ok()) {
+    if(inlineBatchPos == inlineBatch.size()) {
+      if(networkStream->hasPendingOutput() && !networkStream->flushPendingOutput()) {
+        return false;
+      }
+
+      inlineBatchPos = 0;
+      fillBatch(inlineBatch, kMaxBatchRequests, kMaxBatchBytes);
+      if(inlineBatch.empty()) return true;
     }
 
-    // Are we done with 'beingProcessed' yet?
-    if(bytesWritten == beingProcessed->getLen()) {
-      // Yep, set to null and process next one.
-      beingProcessed = nullptr;
+    SendStatus status = sendBatch(networkStream, inlineBatch, inlineBatchPos, nullptr);
+    if(status == SendStatus::kBlocked) {
+      return false;
     }
-    else {
-      // Fewer bytes were written than the full length of the request, the
-      // kernel buffers must be full. Poll until the socket is writable.
-      canWrite = false;
+
+    if(status == SendStatus::kFailed) {
+      break;
     }
   }
+
+  return true;
 }
@@ -32,28 +32,80 @@
 #include "StagedRequest.hh"
 #include "qclient/Options.hh"
 #include "qclient/EncodedRequest.hh"
+#include "qclient/RateLimiter.hh"
 #include <deque>
 #include <future>
+#include <vector>
+#include <sys/uio.h>
 
 namespace qclient {
 
 class ConnectionCore;
 class NetworkStream;
+class IoUring;
 
 class WriterThread {
 public:
-  WriterThread(Logger *logger, ConnectionCore &core, EventFD &shutdownFD);
+  WriterThread(Logger *logger, ConnectionCore &core, EventFD &shutdownFD,
+    IoBackend backend = IoBackend::kPoll);
   ~WriterThread();
 
   void activate(NetworkStream *stream);
   void deactivate();
   void eventLoop(NetworkStream *stream, ThreadAssistant &assistant);
 
+  // Pin the thread to the given CPUs, from the next activation onwards
+  void setCpuAffinity(const std::vector<int> &cpus);
+
+  // Send writes of at least threshold bytes with MSG_ZEROCOPY, from the next
+  // activation onwards. 0 disables. Threaded mode only.
+  void setZeroCopyThreshold(size_t threshold);
+
+  // Pace writes through the given rate limiter, from the next activation
+  // onwards. Threaded mode only.
+  void setRateLimiter(std::shared_ptr<RateLimiter> limiter);
+
+  // Inline mode, without a thread: The caller invokes writeInline whenever
+  // requests were staged, or the socket became writable. Returns false if
+  // the kernel buffers are full, and there's more to write.
+  void activateInline();
+  bool writeInline(NetworkStream *stream);
+
 private:
+  size_t fillBatch(std::vector<struct iovec> &batch, size_t maxRequests, size_t maxBytes);
+  bool throttle(RateLimiter::Allowance &allowance, ThreadAssistant &assistant);
+
+  enum class SendStatus {
+    kProgress,
+    kBlocked,
+    kFailed
+  };
+
+  SendStatus sendBatch(NetworkStream *stream, std::vector<struct iovec> &batch,
+    size_t &batchPos, IoUring *ring);
+
+  void reapZeroCopy(NetworkStream *stream);
+
   Logger *logger;
   ConnectionCore &connectionCore;
   EventFD &shutdownEventFD;
+  IoBackend ioBackend;
   AssistedThread thread;
+  std::vector<int> cpuAffinity;
+  std::shared_ptr<RateLimiter> rateLimiter;
+
+  std::vector<StagedRequest*> stagedBatch;
+
+  // Zero-copy sends the kernel hasn't reported complete yet: Their id, and
+  // the sequence number of the first user request they may touch.
+  size_t zeroCopyThreshold = 0;
+  bool zeroCopy = false;
+  uint32_t nextZeroCopyId = 0;
+  int64_t batchFirstSeq = 0;
+  std::deque<std::pair<uint32_t, int64_t>> zeroCopyInFlight;
+
+  std::vector<struct iovec> inlineBatch;
+  size_t inlineBatchPos = 0;
 };
 
 }
@@ -23,6 +23,7 @@
 
 #include "qclient/network/AsyncConnector.hh"
 #include "qclient/network/HostResolver.hh"
+#include <algorithm>
 #include <iostream>
 #include <string.h>
 #include <fcntl.h>
@@ -42,7 +43,7 @@ namespace qclient {
 // not block the calling thread until connected - issues an asynchronous
 // request the OS, asking to connect.
 //------------------------------------------------------------------------------
-AsyncConnector::AsyncConnector(const ServiceEndpoint &endpoint) {
+AsyncConnector::AsyncConnector(const ServiceEndpoint &endpoint, const SocketProfile &profile) {
   //----------------------------------------------------------------------------
   // Create the socket..
   //----------------------------------------------------------------------------
@@ -53,16 +54,7 @@ AsyncConnector::AsyncConnector(const ServiceEndpoint &endpoint) {
     return;
   }
 
-#ifndef __APPLE__
-#define CUSTOM_TCP_USER_TIMEOUT 18
-  //----------------------------------------------------------------------------
-  // Set TCP timeout to 30 sec. Allow failure, as it's not supported on SLC6.
-  //----------------------------------------------------------------------------
-  int timeout = 30 * 1000;
-  if(setsockopt(fd.get(), IPPROTO_TCP, CUSTOM_TCP_USER_TIMEOUT, &timeout, sizeof(timeout)) != 0) {
-    std::cerr << "qclient: could not set TCP_USER_TIMEOUT: " << strerror(localerrno) << std::endl;
-  }
-#endif
+  applyProfile(profile, endpoint.getProtocolType());
 
   //----------------------------------------------------------------------------
   // Make non-blocking..
@@ -95,6 +87,67 @@ AsyncConnector::AsyncConnector(const ServiceEndpoint &endpoint) {
   }
 }
 
+//------------------------------------------------------------------------------
+// Set the options of the given profile on our socket, best effort
+//------------------------------------------------------------------------------
+void AsyncConnector::applyProfile(const SocketProfile &profile, ProtocolType type) {
+  int value = 0;
+
+  //----------------------------------------------------------------------------
+  // Buffer sizes apply to unix sockets too
+  //----------------------------------------------------------------------------
+  if(profile.getSendBufferSize() > 0) {
+    value = profile.getSendBufferSize();
+    setsockopt(fd.get(), SOL_SOCKET, SO_SNDBUF, &value, sizeof(value));
+  }
+
+  if(profile.getReceiveBufferSize() > 0) {
+    value = profile.getReceiveBufferSize();
+    setsockopt(fd.get(), SOL_SOCKET, SO_RCVBUF, &value, sizeof(value));
+  }
+
+  if(type == ProtocolType::kUnix) {
+    return;
+  }
+
+#ifndef __APPLE__
+#define CUSTOM_TCP_USER_TIMEOUT 18
+  //----------------------------------------------------------------------------
+  // Allow failure, as it's not supported on SLC6.
+  //----------------------------------------------------------------------------
+  value = std::chrono::duration_cast<std::chrono::milliseconds>(profile.getUserTimeout()).count();
+  if(value > 0 && setsockopt(fd.get(), IPPROTO_TCP, CUSTOM_TCP_USER_TIMEOUT, &value, sizeof(value)) != 0) {
+    std::cerr << "qclient: could not set TCP_USER_TIMEOUT: " << strerror(errno) << std::endl;
+  }
+#endif
+
+  if(profile.getNoDelay()) {
+    value = 1;
+    setsockopt(fd.get(), IPPROTO_TCP, TCP_NODELAY, &value, sizeof(value));
+  }
+
+#ifdef TCP_QUICKACK
+  if(profile.getQuickAck()) {
+    value = 1;
+    setsockopt(fd.get(), IPPROTO_TCP, TCP_QUICKACK, &value, sizeof(value));
+  }
+#endif
+
+  if(profile.getKeepalive()) {
+    value = 1;
+    setsockopt(fd.get(), SOL_SOCKET, SO_KEEPALIVE, &value, sizeof(value));
+
+#ifdef TCP_KEEPIDLE
+    value = profile.getKeepaliveIdle().count();
+    setsockopt(fd.get(), IPPROTO_TCP, TCP_KEEPIDLE, &value, sizeof(value));
+    value = profile.getKeepaliveInterval().count();
+    setsockopt(fd.get(), IPPROTO_TCP, TCP_KEEPINTVL, &value, sizeof(value));
+    value = profile.getKeepaliveCount();
+    setsockopt(fd.get(), IPPROTO_TCP, TCP_KEEPCNT, &value, sizeof(value));
+#endif
+  }
+}
+
 //------------------------------------------------------------------------------
 // Is ::connect ready yet?
 //------------------------------------------------------------------------------
@@ -169,42 +222,7 @@ bool AsyncConnector::blockUntilReady(int shutdownFd, std::chrono::seconds timeou
       continue;
     }
 
-    if(polls[1].revents != 0) {
-      //------------------------------------------------------------------------
-      // An event on our file descriptor.. we could check POLLOUT and POLLERR,
-      // but getsockopt seems more robust, and we can get the errno on failure.
-      //------------------------------------------------------------------------
-      int valopt = 0;
-      socklen_t optlen = sizeof(int);
-      if(getsockopt(fd.get(), SOL_SOCKET, SO_ERROR, (void*)(&valopt), &optlen) < 0) {
-        //----------------------------------------------------------------------
-        // Not really supposed to happen..
-        //----------------------------------------------------------------------
-        localerrno = errno;
-        error = SSTR("Unable to run getsockopt() after poll(), errno=" << localerrno << strerror(localerrno));
-        finished = true;
-        return true;
-      }
-
-
-      if(valopt == EINTR || valopt == EINPROGRESS) {
-        //----------------------------------------------------------------------
-        // Strange, but ok.. retry.. might never happen.
-        //----------------------------------------------------------------------
-        continue;
-      }
-
-      finished = true;
-
-      if(valopt != 0) {
-        localerrno = valopt;
-        error = SSTR("Unable to connect (" << localerrno << ")" << ":" << strerror(localerrno));
-        return true;
-      }
-
-      //------------------------------------------------------------------------
-      // Success, connection is active
-      //------------------------------------------------------------------------
+    if(polls[1].revents != 0 && finishConnect()) {
       return true;
     }
 
@@ -217,6 +235,74 @@ bool AsyncConnector::blockUntilReady(int shutdownFd, std::chrono::seconds timeou
   }
 }
 
+//------------------------------------------------------------------------------
+// Our file descriptor became writable, find out how ::connect went. Returns
+// false if the connection is still in progress.
+//------------------------------------------------------------------------------
+bool AsyncConnector::finishConnect() {
+  //----------------------------------------------------------------------------
+  // We could check POLLOUT and POLLERR, but getsockopt seems more robust,
+  // and we can get the errno on failure.
+  //----------------------------------------------------------------------------
+  int valopt = 0;
+  socklen_t optlen = sizeof(int);
+  if(getsockopt(fd.get(), SOL_SOCKET, SO_ERROR, (void*)(&valopt), &optlen) < 0) {
+    //--------------------------------------------------------------------------
+    // Not really supposed to happen..
+    //--------------------------------------------------------------------------
+    localerrno = errno;
+    error = SSTR("Unable to run getsockopt() after poll(), errno=" << localerrno << strerror(localerrno));
+    finished = true;
+    return true;
+  }
+
+  if(valopt == EINTR || valopt == EINPROGRESS) {
+    //--------------------------------------------------------------------------
+    // Strange, but ok.. retry.. might never happen.
+    //--------------------------------------------------------------------------
+    return false;
+  }
+
+  finished = true;
+
+  if(valopt != 0) {
+    localerrno = valopt;
+    error = SSTR("Unable to connect (" << localerrno << ")" << ":" << strerror(localerrno));
+    return true;
+  }
+
+  //----------------------------------------------------------------------------
+  // Success, connection is active
+  //----------------------------------------------------------------------------
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Non-blocking version of blockUntilReady, meant for external event loops.
+//------------------------------------------------------------------------------
+bool AsyncConnector::checkCompletion() {
+  if(finished || localerrno != 0 || fd.get() < 0) {
+    return true;
+  }
+
+  struct pollfd polls[1];
+  polls[0].fd = fd.get();
+  polls[0].events = POLLOUT;
+
+  if(poll(polls, 1, 0) != 1) {
+    return false;
+  }
+
+  return finishConnect();
+}
+
+//------------------------------------------------------------------------------
+// Get file descriptor, without releasing ownership.
+//------------------------------------------------------------------------------
+int AsyncConnector::getFd() const {
+  return fd.get();
+}
+
 //------------------------------------------------------------------------------
 // Has there been an error yet? Note that, if ::connect is still pending,
 // there might be an error in the future.
@@ -248,6 +334,174 @@ std::string AsyncConnector::getError() const {
   return error;
 }
 
+//------------------------------------------------------------------------------
+// ParallelConnector constructor
+//------------------------------------------------------------------------------
+ParallelConnector::ParallelConnector(const std::vector<ServiceEndpoint> &endp,
+  std::chrono::milliseconds delay, const SocketProfile &prof)
+: endpoints(endp), attemptDelay(delay), profile(prof) {}
+
+//------------------------------------------------------------------------------
+// Start the next attempt
+//------------------------------------------------------------------------------
+bool ParallelConnector::startAttempt() {
+  Attempt attempt;
+  attempt.endpoint = endpoints[nextAttempt++];
+  attempt.connector.reset(new AsyncConnector(attempt.endpoint, profile));
+
+  if(attempt.connector->checkCompletion()) {
+    attemptCompleted(attempt);
+    return true;
+  }
+
+  pending.emplace_back(std::move(attempt));
+  return false;
+}
+
+//------------------------------------------------------------------------------
+// Attempt has completed, one way or another
+//------------------------------------------------------------------------------
+void ParallelConnector::attemptCompleted(Attempt &attempt) {
+  if(attempt.connector->ok()) {
+    winner.reset(new Attempt(std::move(attempt)));
+    return;
+  }
+
+  if(!error.empty()) {
+    error += ", ";
+  }
+
+  error += SSTR(attempt.endpoint.getString() << ": " << attempt.connector->getError());
+}
+
+//------------------------------------------------------------------------------
+// Run attempts until one succeeds, or all fail
+//------------------------------------------------------------------------------
+bool ParallelConnector::blockUntilReady(int shutdownFd, std::chrono::milliseconds timeout) {
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+  std::chrono::steady_clock::time_point deadline = now + timeout;
+  std::chrono::steady_clock::time_point nextStart = now;
+
+  std::vector<struct pollfd> polls;
+
+  while(!winner) {
+    now = std::chrono::steady_clock::now();
+
+    //--------------------------------------------------------------------------
+    // Time to start another attempt? Also if nothing is in flight, no point
+    // in waiting.
+    //--------------------------------------------------------------------------
+    if(nextAttempt < endpoints.size() && (nextStart <= now || pending.empty())) {
+      bool completed = startAttempt();
+      nextStart = completed ? now : now + attemptDelay;
+      continue;
+    }
+
+    if(pending.empty()) {
+      //------------------------------------------------------------------------
+      // Everything failed
+      //------------------------------------------------------------------------
+      return true;
+    }
+
+    if(deadline <= now) {
+      return false;
+    }
+
+    //--------------------------------------------------------------------------
+    // Sleep until some attempt completes, or it's time to start the next one
+    //--------------------------------------------------------------------------
+    std::chrono::steady_clock::time_point wakeup = deadline;
+    if(nextAttempt < endpoints.size()) {
+      wakeup = std::min(wakeup, nextStart);
+    }
+
+    int waitMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+      wakeup - now + std::chrono::microseconds(999)).count();
+
+    polls.resize(pending.size() + 1);
+    polls[0].fd = shutdownFd;
+    polls[0].events = POLLIN;
+    polls[0].revents = 0;
+
+    for(size_t i = 0; i < pending.size(); i++) {
+      polls[i+1].fd = pending[i].connector->getFd();
+      polls[i+1].events = POLLOUT;
+      polls[i+1].revents = 0;
+    }
+
+    int rpoll = poll(polls.data(), polls.size(), waitMs);
+    if(rpoll < 0 && errno != EINTR) {
+      return false;
+    }
+
+    if(rpoll <= 0) {
+      continue;
+    }
+
+    if(polls[0].revents != 0) {
+      //------------------------------------------------------------------------
+      // Signalled to break
+      //------------------------------------------------------------------------
+      return false;
+    }
+
+    //--------------------------------------------------------------------------
+    // Collect completed attempts - a failure means we start the next one
+    // right away.
+    //--------------------------------------------------------------------------
+    for(size_t i = pending.size(); i-- > 0; ) {
+      if(polls[i+1].revents == 0 || !pending[i].connector->checkCompletion()) {
+        continue;
+      }
+
+      attemptCompleted(pending[i]);
+      pending.erase(pending.begin() + i);
+
+      if(winner) {
+        break;
+      }
+
+      nextStart = now;
+    }
+  }
+
+  pending.clear();
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Did some attempt succeed?
+//------------------------------------------------------------------------------
+bool ParallelConnector::ok() const {
+  return winner != nullptr;
+}
+
+//------------------------------------------------------------------------------
+// Get connected file descriptor, releasing ownership.
+//------------------------------------------------------------------------------
+int ParallelConnector::release() {
+  if(!winner) {
+    return -1;
+  }
+
+  return winner->connector->release();
+}
+
+//------------------------------------------------------------------------------
+// The endpoint we connected to
+//------------------------------------------------------------------------------
+const ServiceEndpoint& ParallelConnector::getEndpoint() const {
+  return winner->endpoint;
+}
+
+//------------------------------------------------------------------------------
+// Why each of the failed attempts failed.
+//------------------------------------------------------------------------------
+std::string ParallelConnector::getError() const {
+  return error;
+}
+
 
 
 
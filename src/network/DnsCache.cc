@@ -0,0 +1,169 @@
+//------------------------------------------------------------------------------
+// File: DnsCache.cc
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#include "qclient/network/DnsCache.hh"
+
+namespace qclient {
+
+//------------------------------------------------------------------------------
+// Constructor
+//------------------------------------------------------------------------------
+DnsCache::DnsCache(std::chrono::milliseconds tt, std::chrono::milliseconds negative,
+  ResolveFunction func) : resolveFunction(func), ttl(tt), negativeTtl(negative) {
+
+  if(!resolveFunction) {
+    resolveFunction = [](const std::string &host, int port, Status &st) {
+      return HostResolver::resolveSystem(nullptr, host, port, st);
+    };
+  }
+
+  refresher.reset(&DnsCache::refreshLoop, this);
+}
+
+//------------------------------------------------------------------------------
+// Destructor
+//------------------------------------------------------------------------------
+DnsCache::~DnsCache() {
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    shuttingDown = true;
+    refreshCV.notify_all();
+  }
+
+  refresher.join();
+}
+
+//------------------------------------------------------------------------------
+// Process-wide cache
+//------------------------------------------------------------------------------
+std::shared_ptr<DnsCache> DnsCache::getDefault() {
+  static std::shared_ptr<DnsCache> cache = std::make_shared<DnsCache>();
+  return cache;
+}
+
+//------------------------------------------------------------------------------
+// Resolve through the cache
+//------------------------------------------------------------------------------
+std::vector<ServiceEndpoint> DnsCache::resolve(const std::string &host, int port,
+  Status &st) {
+
+  Key key(host, port);
+  std::unique_lock<std::mutex> lock(mtx);
+
+  auto it = entries.find(key);
+  if(it != entries.end()) {
+    Entry &entry = it->second;
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+    if(now < entry.expiry) {
+      st = entry.status;
+      return entry.endpoints;
+    }
+
+    if(entry.status.ok() && now < entry.expiry + ttl) {
+      //------------------------------------------------------------------------
+      // Stale, but still good enough - serve it, and refresh in the
+      // background.
+      //------------------------------------------------------------------------
+      if(!entry.refreshPending) {
+        entry.refreshPending = true;
+        refreshQueue.push_back(key);
+        refreshCV.notify_one();
+      }
+
+      st = entry.status;
+      return entry.endpoints;
+    }
+  }
+
+  //----------------------------------------------------------------------------
+  // Nothing usable, resolve synchronously - without holding the lock.
+  //----------------------------------------------------------------------------
+  lock.unlock();
+  std::vector<ServiceEndpoint> resolved = resolveFunction(host, port, st);
+  bool good = st.ok() && !resolved.empty();
+  lock.lock();
+
+  Entry &entry = entries[key];
+  entry.endpoints = resolved;
+  entry.status = st;
+  entry.expiry = std::chrono::steady_clock::now() + (good ? ttl : negativeTtl);
+  return resolved;
+}
+
+//------------------------------------------------------------------------------
+// Background thread, refreshing stale entries. A failed refresh leaves the
+// stale entry in place: It's retried on the next lookup, until the entry is
+// too old to serve.
+//------------------------------------------------------------------------------
+void DnsCache::refreshLoop(ThreadAssistant &assistant) {
+  std::unique_lock<std::mutex> lock(mtx);
+
+  while(true) {
+    refreshCV.wait(lock, [this]() { return shuttingDown || !refreshQueue.empty(); });
+
+    if(shuttingDown) {
+      return;
+    }
+
+    Key key = refreshQueue.front();
+    refreshQueue.pop_front();
+
+    lock.unlock();
+    Status st;
+    std::vector<ServiceEndpoint> resolved = resolveFunction(key.first, key.second, st);
+    lock.lock();
+
+    auto it = entries.find(key);
+    if(it == entries.end()) {
+      continue;
+    }
+
+    it->second.refreshPending = false;
+
+    if(st.ok() && !resolved.empty()) {
+      it->second.endpoints = resolved;
+      it->second.status = st;
+      it->second.expiry = std::chrono::steady_clock::now() + ttl;
+    }
+  }
+}
+
+//------------------------------------------------------------------------------
+// Forget everything
+//------------------------------------------------------------------------------
+void DnsCache::clear() {
+  std::lock_guard<std::mutex> lock(mtx);
+  entries.clear();
+}
+
+//------------------------------------------------------------------------------
+// Number of hostname and port pairs currently cached
+//------------------------------------------------------------------------------
+size_t DnsCache::size() const {
+  std::lock_guard<std::mutex> lock(mtx);
+  return entries.size();
+}
+
+}
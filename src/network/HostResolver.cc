@@ -22,11 +22,14 @@
  ************************************************************************/
 
 #include "qclient/network/HostResolver.hh"
+#include "qclient/network/DnsCache.hh"
 #include "qclient/GlobalInterceptor.hh"
 #include "qclient/Logger.hh"
 #include "qclient/Status.hh"
 #include "qclient/GlobalInterceptor.hh"
 #include <arpa/inet.h>
+#include <sys/un.h>
+#include <stddef.h>
 #include <string.h>
 
 #define SSTR(message) static_cast<std::ostringstream&>(std::ostringstream().flush() << message).str()
@@ -44,6 +47,9 @@ std::string protocolTypeToString(ProtocolType prot) {
     case ProtocolType::kIPv6: {
       return "IPv6";
     }
+    case ProtocolType::kUnix: {
+      return "unix";
+    }
   }
 
   return "unknown protocol";
@@ -105,6 +111,15 @@ ServiceEndpoint::ServiceEndpoint(ProtocolType protocol, SocketType socket,
     address.resize(sizeof(struct sockaddr_in6));
     memcpy(address.data(), &out, sizeof(struct sockaddr_in6));
   }
+  else if(protocolType == ProtocolType::kUnix) {
+    struct sockaddr_un out;
+    memset(&out, 0, sizeof(sockaddr_un));
+    out.sun_family = AF_UNIX;
+    strncpy(out.sun_path, addr.c_str(), sizeof(out.sun_path) - 1);
+
+    address.resize(offsetof(struct sockaddr_un, sun_path) + strlen(out.sun_path) + 1);
+    memcpy(address.data(), &out, address.size());
+  }
 }
 
 //------------------------------------------------------------------------------
@@ -145,6 +160,10 @@ std::string ServiceEndpoint::getPrintableAddress() const {
       inet_ntop(AF_INET6, &(sockaddr->sin6_addr), buffer, INET6_ADDRSTRLEN);
       break;
     }
+    case ProtocolType::kUnix: {
+      const struct sockaddr_un* sockaddr = (const struct sockaddr_un*)(address.data());
+      return std::string(sockaddr->sun_path);
+    }
   }
 
   return buffer;
@@ -164,6 +183,9 @@ uint16_t ServiceEndpoint::getPort() const {
       const struct sockaddr_in6* sockaddr = (const struct sockaddr_in6*)(address.data());
       return ntohs(sockaddr->sin6_port);
     }
+    case ProtocolType::kUnix: {
+      return 0;
+    }
   }
 
   return 0; // should never happen
@@ -174,6 +196,13 @@ uint16_t ServiceEndpoint::getPort() const {
 //----------------------------------------------- ------------------------------
 std::string ServiceEndpoint::getString() const {
   std::ostringstream ss;
+
+  if(protocolType == ProtocolType::kUnix) {
+    ss << "[" << getPrintableAddress() << "] (" << protocolTypeToString(protocolType) << "," <<
+      socketTypeToString(socketType) << " resolved from " << originalHostname << ")";
+    return ss.str();
+  }
+
   ss << "[" << getPrintableAddress() << "]" << ":" << getPort() << " ("  << protocolTypeToString(protocolType) << "," <<
     socketTypeToString(socketType) << " resolved from " << originalHostname << ")";
 
@@ -191,6 +220,9 @@ int ServiceEndpoint::getAiFamily() const {
     case ProtocolType::kIPv6: {
       return AF_INET6;
     }
+    case ProtocolType::kUnix: {
+      return AF_UNIX;
+    }
   }
 
   return 0;
@@ -216,6 +248,10 @@ int ServiceEndpoint::getAiSocktype() const {
 // Get ai_protocol to pass to ::socket
 //------------------------------------------------------------------------------
 int ServiceEndpoint::getAiProtocol() const {
+  if(protocolType == ProtocolType::kUnix) {
+    return 0;
+  }
+
   switch(socketType) {
     case SocketType::kStream: {
       return IPPROTO_TCP;
@@ -248,7 +284,8 @@ bool ServiceEndpoint::operator==(const ServiceEndpoint& other) const {
 //------------------------------------------------------------------------------
 // Constructor
 //------------------------------------------------------------------------------
-HostResolver::HostResolver(Logger *log) : logger(log) { }
+HostResolver::HostResolver(Logger *log, std::shared_ptr<DnsCache> dnsCache)
+: logger(log), cache(dnsCache) { }
 
 //------------------------------------------------------------------------------
 // Resolve, while taking into account intercepts as well
@@ -263,10 +300,28 @@ std::vector<ServiceEndpoint> HostResolver::resolve(const std::string &host, int
 // hostname and port pair?
 //------------------------------------------------------------------------------
 std::vector<ServiceEndpoint> HostResolver::resolveNoIntercept(const std::string &host, int port, Status &st) {
+  Endpoint endpoint(host, port);
+  if(endpoint.isUnix()) {
+    return resolveUnix(endpoint.getUnixPath(), host, st);
+  }
+
   if(!fakeMap.empty()) {
     return resolveFake(host, port, st);
   }
 
+  if(cache) {
+    return cache->resolve(host, port, st);
+  }
+
+  return resolveSystem(logger, host, port, st);
+}
+
+//------------------------------------------------------------------------------
+// Ask getaddrinfo directly, bypassing fakes and caching.
+//------------------------------------------------------------------------------
+std::vector<ServiceEndpoint> HostResolver::resolveSystem(Logger *logger,
+  const std::string &host, int port, Status &st) {
+
   std::vector<ServiceEndpoint> output;
 
   struct addrinfo hints, *servinfo, *p;
@@ -325,6 +380,21 @@ std::vector<ServiceEndpoint> HostResolver::resolveNoIntercept(const std::string
   return output;
 }
 
+//------------------------------------------------------------------------------
+// Unix domain sockets need no lookup, only a check that the path fits.
+//------------------------------------------------------------------------------
+std::vector<ServiceEndpoint> HostResolver::resolveUnix(const std::string &path,
+  const std::string &host, Status &st) {
+
+  if(path.empty() || path.size() >= sizeof(sockaddr_un::sun_path)) {
+    st = Status(ENAMETOOLONG, SSTR("invalid unix socket path '" << path << "'"));
+    return {};
+  }
+
+  st = Status();
+  return { ServiceEndpoint(ProtocolType::kUnix, SocketType::kStream, path, 0, host) };
+}
+
 //----------------------------------------------------------------------------
 // Feed fake data - once you call this, _all_ responses will be faked
 //----------------------------------------------------------------------------
@@ -0,0 +1,381 @@
+//------------------------------------------------------------------------------
+// File: IoUring.cc
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#include "network/IoUring.hh"
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <mutex>
+
+#if QCLIENT_HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+namespace qclient {
+
+#if QCLIENT_HAVE_IO_URING
+
+static int sysIoUringSetup(unsigned entries, struct io_uring_params *p) {
+  return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sysIoUringEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags) {
+  return syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, nullptr, 0);
+}
+
+//------------------------------------------------------------------------------
+// Is io_uring usable on this machine? Probes once, caches the result.
+//------------------------------------------------------------------------------
+bool IoUring::supported() {
+  static std::once_flag flag;
+  static bool result = false;
+
+  std::call_once(flag, []() {
+    IoUring probe(2);
+    result = probe.ok();
+  });
+
+  return result;
+}
+
+//------------------------------------------------------------------------------
+// Constructor: Set up the ring, and map the submission / completion queues.
+//------------------------------------------------------------------------------
+IoUring::IoUring(unsigned entries) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+
+  int fd = sysIoUringSetup(entries, &params);
+  if(fd < 0) {
+    return;
+  }
+
+  sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+  if(params.features & IORING_FEAT_SINGLE_MMAP) {
+    if(cqRingSize > sqRingSize) sqRingSize = cqRingSize;
+    cqRingSize = sqRingSize;
+  }
+
+  sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if(sqRing == MAP_FAILED) {
+    sqRing = nullptr;
+    ::close(fd);
+    return;
+  }
+
+  if(params.features & IORING_FEAT_SINGLE_MMAP) {
+    cqRing = sqRing;
+  }
+  else {
+    cqRing = mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if(cqRing == MAP_FAILED) {
+      cqRing = nullptr;
+      munmap(sqRing, sqRingSize);
+      sqRing = nullptr;
+      ::close(fd);
+      return;
+    }
+  }
+
+  sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+  void *sqesPtr = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if(sqesPtr == MAP_FAILED) {
+    if(cqRing != sqRing) munmap(cqRing, cqRingSize);
+    munmap(sqRing, sqRingSize);
+    sqRing = nullptr;
+    cqRing = nullptr;
+    ::close(fd);
+    return;
+  }
+
+  sqes = (struct io_uring_sqe*) sqesPtr;
+
+  char *sq = (char*) sqRing;
+  sqHead = (unsigned*) (sq + params.sq_off.head);
+  sqTail = (unsigned*) (sq + params.sq_off.tail);
+  sqMask = (unsigned*) (sq + params.sq_off.ring_mask);
+  sqArray = (unsigned*) (sq + params.sq_off.array);
+  sqEntries = params.sq_entries;
+
+  char *cq = (char*) cqRing;
+  cqHead = (unsigned*) (cq + params.cq_off.head);
+  cqTail = (unsigned*) (cq + params.cq_off.tail);
+  cqMask = (unsigned*) (cq + params.cq_off.ring_mask);
+  cqes = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+
+  ringFd = fd;
+}
+
+//------------------------------------------------------------------------------
+// Destructor: Closing the ring cancels anything still in flight.
+//------------------------------------------------------------------------------
+IoUring::~IoUring() {
+  if(ringFd < 0) return;
+
+  munmap(sqes, sqesSize);
+  if(cqRing != sqRing) munmap(cqRing, cqRingSize);
+  munmap(sqRing, sqRingSize);
+  ::close(ringFd);
+}
+
+//------------------------------------------------------------------------------
+// Grab the next free submission queue entry, or nullptr if full.
+//------------------------------------------------------------------------------
+struct io_uring_sqe* IoUring::getSqe() {
+  unsigned head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+  unsigned tail = *sqTail + pendingSubmissions;
+
+  if(tail - head >= sqEntries) {
+    return nullptr;
+  }
+
+  unsigned index = tail & *sqMask;
+  struct io_uring_sqe *sqe = &sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+
+  sqArray[index] = index;
+  pendingSubmissions++;
+  return sqe;
+}
+
+bool IoUring::prepareRecv(int fd, char *buf, size_t len, uint64_t userData, bool linkNext) {
+  struct io_uring_sqe *sqe = getSqe();
+  if(!sqe) return false;
+
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t) buf;
+  sqe->len = len;
+  sqe->user_data = userData;
+  if(linkNext) sqe->flags |= IOSQE_IO_LINK;
+  return true;
+}
+
+bool IoUring::prepareSendmsg(int fd, const struct msghdr *msg, uint64_t userData, bool linkNext) {
+  struct io_uring_sqe *sqe = getSqe();
+  if(!sqe) return false;
+
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t) msg;
+  sqe->len = 1;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = userData;
+  if(linkNext) sqe->flags |= IOSQE_IO_LINK;
+  return true;
+}
+
+bool IoUring::preparePollAdd(int fd, short events, uint64_t userData, bool linkNext) {
+  struct io_uring_sqe *sqe = getSqe();
+  if(!sqe) return false;
+
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->poll32_events = events;
+  sqe->user_data = userData;
+  if(linkNext) sqe->flags |= IOSQE_IO_LINK;
+  return true;
+}
+
+bool IoUring::prepareTimeout(int timeoutMs, uint64_t userData) {
+  struct io_uring_sqe *sqe = getSqe();
+  if(!sqe) return false;
+
+  // Layout-compatible with struct __kernel_timespec.
+  timeoutSpec[0] = timeoutMs / 1000;
+  timeoutSpec[1] = (timeoutMs % 1000) * 1000000LL;
+
+  sqe->opcode = IORING_OP_TIMEOUT;
+  sqe->fd = -1;
+  sqe->addr = (uint64_t) timeoutSpec;
+  sqe->len = 1;
+  sqe->user_data = userData;
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Submit everything queued, and wait for at least waitNr completions.
+//------------------------------------------------------------------------------
+int IoUring::submitAndWait(unsigned waitNr) {
+  unsigned toSubmit = pendingSubmissions;
+  __atomic_store_n(sqTail, *sqTail + toSubmit, __ATOMIC_RELEASE);
+  pendingSubmissions = 0u;
+
+  while(true) {
+    int ret = sysIoUringEnter(ringFd, toSubmit, waitNr, waitNr > 0 ? IORING_ENTER_GETEVENTS : 0);
+    if(ret >= 0) return ret;
+    if(errno != EINTR) return -errno;
+
+    // Interrupted - anything already consumed by the kernel is not
+    // submitted twice, the kernel tracks the submission queue head.
+    toSubmit = 0u;
+  }
+}
+
+//------------------------------------------------------------------------------
+// Fetch a single completion, if any is available.
+//------------------------------------------------------------------------------
+bool IoUring::popCompletion(uint64_t &userData, int &res) {
+  unsigned head = *cqHead;
+  unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+
+  if(head == tail) {
+    return false;
+  }
+
+  struct io_uring_cqe *cqe = &cqes[head & *cqMask];
+  userData = cqe->user_data;
+  res = cqe->res;
+
+  __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Tagging of the requests we issue ourselves in poll() / sendmsg()
+//------------------------------------------------------------------------------
+static constexpr uint64_t kTagPoll = 1ull << 32;
+static constexpr uint64_t kTagTimeout = 2ull << 32;
+static constexpr uint64_t kTagSend = 3ull << 32;
+static constexpr uint64_t kTagMask = 0xFFFFFFFFull << 32;
+
+void IoUring::handleCompletion(uint64_t userData, int res, struct pollfd *fds, int nfds, int &events) {
+  uint64_t tag = userData & kTagMask;
+  int index = userData & 0xFFFFFFFFull;
+
+  if(tag == kTagPoll) {
+    pollArmed[index] = false;
+
+    if(index < nfds) {
+      fds[index].revents = (res < 0) ? POLLERR : res;
+      events++;
+    }
+  }
+  else if(tag == kTagTimeout) {
+    timeoutArmed = false;
+  }
+  else if(tag == kTagSend) {
+    sendCompleted = true;
+    sendResult = res;
+  }
+}
+
+//------------------------------------------------------------------------------
+// Drop-in replacement for ::poll(), built on top of the ring.
+//------------------------------------------------------------------------------
+int IoUring::poll(struct pollfd *fds, int nfds, int timeoutMs) {
+  if(nfds > kMaxPollSlots) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  for(int i = 0; i < nfds; i++) {
+    fds[i].revents = 0;
+
+    if(!pollArmed[i] && preparePollAdd(fds[i].fd, fds[i].events, kTagPoll | i)) {
+      pollArmed[i] = true;
+    }
+  }
+
+  // An older timeout might still be armed, in which case we may wake up a bit
+  // earlier than requested - that's fine, poll() callers handle early returns.
+  if(timeoutMs >= 0 && !timeoutArmed && prepareTimeout(timeoutMs, kTagTimeout)) {
+    timeoutArmed = true;
+  }
+
+  int ret = submitAndWait(1);
+  if(ret < 0) {
+    errno = -ret;
+    return -1;
+  }
+
+  int events = 0;
+  uint64_t userData;
+  int res;
+
+  while(popCompletion(userData, res)) {
+    handleCompletion(userData, res, fds, nfds, events);
+  }
+
+  return events;
+}
+
+//------------------------------------------------------------------------------
+// Drop-in replacement for ::sendmsg() on a non-blocking socket.
+//------------------------------------------------------------------------------
+ssize_t IoUring::sendmsg(int fd, const struct msghdr *msg) {
+  if(!prepareSendmsg(fd, msg, kTagSend)) {
+    errno = EBUSY;
+    return -1;
+  }
+
+  sendCompleted = false;
+
+  // Poll completions arriving in the meantime are consumed too, and their
+  // slots re-armed on the next call to poll(). No readiness information is
+  // lost, since poll is level-triggered.
+  int events = 0;
+  uint64_t userData;
+  int res;
+
+  while(!sendCompleted) {
+    int ret = submitAndWait(1);
+    if(ret < 0) {
+      errno = -ret;
+      return -1;
+    }
+
+    while(popCompletion(userData, res)) {
+      handleCompletion(userData, res, nullptr, 0, events);
+    }
+  }
+
+  if(sendResult < 0) {
+    errno = -sendResult;
+    return -1;
+  }
+
+  return sendResult;
+}
+
+#else
+
+bool IoUring::supported() { return false; }
+IoUring::IoUring(unsigned entries) {}
+IoUring::~IoUring() {}
+bool IoUring::prepareRecv(int fd, char *buf, size_t len, uint64_t userData, bool linkNext) { return false; }
+bool IoUring::prepareSendmsg(int fd, const struct msghdr *msg, uint64_t userData, bool linkNext) { return false; }
+bool IoUring::preparePollAdd(int fd, short events, uint64_t userData, bool linkNext) { return false; }
+bool IoUring::prepareTimeout(int timeoutMs, uint64_t userData) { return false; }
+int IoUring::submitAndWait(unsigned waitNr) { return -ENOSYS; }
+bool IoUring::popCompletion(uint64_t &userData, int &res) { return false; }
+int IoUring::poll(struct pollfd *fds, int nfds, int timeoutMs) { return ::poll(fds, nfds, timeoutMs); }
+ssize_t IoUring::sendmsg(int fd, const struct msghdr *msg) { return ::sendmsg(fd, msg, MSG_NOSIGNAL); }
+
+#endif
+
+}
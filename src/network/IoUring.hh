@@ -0,0 +1,146 @@
+//------------------------------------------------------------------------------
+// File: IoUring.hh
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#ifndef QCLIENT_IO_URING_HH
+#define QCLIENT_IO_URING_HH
+
+#include <stdint.h>
+#include <stddef.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define QCLIENT_HAVE_IO_URING 1
+#endif
+#endif
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+namespace qclient {
+
+//------------------------------------------------------------------------------
+// Minimal io_uring wrapper, talking to the kernel through raw syscalls, so
+// that we don't depend on liburing. A ring is meant to be driven by a single
+// thread: No internal locking.
+//
+// If the kernel (or build environment) does not support io_uring, ok()
+// returns false, and callers are expected to fall back to poll().
+//------------------------------------------------------------------------------
+class IoUring {
+public:
+  //----------------------------------------------------------------------------
+  // Is io_uring usable on this machine? Probes once, caches the result.
+  //----------------------------------------------------------------------------
+  static bool supported();
+
+  //----------------------------------------------------------------------------
+  // Constructor / destructor
+  //----------------------------------------------------------------------------
+  IoUring(unsigned entries = 16);
+  ~IoUring();
+
+  IoUring(const IoUring&) = delete;
+  IoUring& operator=(const IoUring&) = delete;
+
+  bool ok() const {
+    return ringFd >= 0;
+  }
+
+  //----------------------------------------------------------------------------
+  // Queue up operations - nothing reaches the kernel until submitAndWait.
+  // If linkNext is true, the next operation only starts once this one
+  // has completed successfully. Return false if the submission queue is full.
+  //----------------------------------------------------------------------------
+  bool prepareRecv(int fd, char *buf, size_t len, uint64_t userData, bool linkNext = false);
+  bool prepareSendmsg(int fd, const struct msghdr *msg, uint64_t userData, bool linkNext = false);
+  bool preparePollAdd(int fd, short events, uint64_t userData, bool linkNext = false);
+  bool prepareTimeout(int timeoutMs, uint64_t userData);
+
+  //----------------------------------------------------------------------------
+  // Submit everything queued, and wait for at least waitNr completions.
+  // Returns negative errno on failure.
+  //----------------------------------------------------------------------------
+  int submitAndWait(unsigned waitNr);
+
+  //----------------------------------------------------------------------------
+  // Fetch a single completion, if any is available. res follows kernel
+  // conventions: bytes transferred, or negative errno.
+  //----------------------------------------------------------------------------
+  bool popCompletion(uint64_t &userData, int &res);
+
+  //----------------------------------------------------------------------------
+  // Drop-in replacement for ::poll(), built on top of the ring. Poll requests
+  // stay armed across calls until they fire, so a loop polling the same set
+  // of file descriptors costs a single io_uring_enter per iteration.
+  //
+  // The set of file descriptors must not change between calls on the same
+  // ring, and is limited to kMaxPollSlots.
+  //----------------------------------------------------------------------------
+  static constexpr int kMaxPollSlots = 4;
+  int poll(struct pollfd *fds, int nfds, int timeoutMs);
+
+  //----------------------------------------------------------------------------
+  // Drop-in replacement for ::sendmsg() on a non-blocking socket, goes
+  // through the ring. Waits for the send to complete - on a full socket, the
+  // kernel answers with EAGAIN right away, just like ::sendmsg.
+  //----------------------------------------------------------------------------
+  ssize_t sendmsg(int fd, const struct msghdr *msg);
+
+private:
+  struct io_uring_sqe* getSqe();
+  void handleCompletion(uint64_t userData, int res, struct pollfd *fds, int nfds, int &events);
+
+  bool pollArmed[kMaxPollSlots] = { false };
+  bool timeoutArmed = false;
+  bool sendCompleted = false;
+  int sendResult = 0;
+  int64_t timeoutSpec[2] = {0, 0};
+
+  int ringFd = -1;
+  unsigned pendingSubmissions = 0u;
+
+  void *sqRing = nullptr;
+  size_t sqRingSize = 0u;
+  void *cqRing = nullptr;
+  size_t cqRingSize = 0u;
+  struct io_uring_sqe *sqes = nullptr;
+  size_t sqesSize = 0u;
+
+  unsigned *sqHead = nullptr;
+  unsigned *sqTail = nullptr;
+  unsigned *sqMask = nullptr;
+  unsigned *sqArray = nullptr;
+  unsigned sqEntries = 0u;
+
+  unsigned *cqHead = nullptr;
+  unsigned *cqTail = nullptr;
+  unsigned *cqMask = nullptr;
+  struct io_uring_cqe *cqes = nullptr;
+};
+
+}
+
+#endif
@@ -0,0 +1,233 @@
+//------------------------------------------------------------------------------
+// File: LatencyProber.cc
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#include "qclient/network/LatencyProber.hh"
+#include "qclient/network/AsyncConnector.hh"
+#include "qclient/network/HostResolver.hh"
+#include "qclient/ResponseBuilder.hh"
+#include "network/NetworkStream.hh"
+#include "StandbyConnection.hh"
+#include <algorithm>
+#include <poll.h>
+
+namespace qclient {
+
+//------------------------------------------------------------------------------
+// Constructor
+//------------------------------------------------------------------------------
+LatencyProber::LatencyProber(const Members &mem, std::chrono::milliseconds intv,
+  const TlsConfig &tls, std::shared_ptr<DnsCache> dnsCache,
+  std::chrono::seconds tmout)
+: members(mem), interval(intv), tlsconfig(tls), timeout(tmout) {
+
+  hostResolver.reset(new HostResolver(nullptr, dnsCache));
+  streams.resize(members.size());
+
+  if(interval.count() > 0) {
+    thread.reset(&LatencyProber::main, this);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Destructor
+//------------------------------------------------------------------------------
+LatencyProber::~LatencyProber() {
+  thread.stop();
+  wakeupFD.notify();
+  thread.join();
+}
+
+//------------------------------------------------------------------------------
+// Feed a sample, marking the endpoint as healthy
+//------------------------------------------------------------------------------
+void LatencyProber::record(const Endpoint &endpoint, std::chrono::microseconds rtt) {
+  std::lock_guard<std::mutex> lock(mtx);
+  Entry &entry = entries[endpoint];
+
+  if(!entry.healthy || entry.smoothed.count() == 0) {
+    entry.smoothed = rtt;
+  }
+  else {
+    entry.smoothed = (entry.smoothed * 7 + rtt) / 8;
+  }
+
+  entry.healthy = true;
+}
+
+//------------------------------------------------------------------------------
+// The endpoint could not be reached
+//------------------------------------------------------------------------------
+void LatencyProber::recordFailure(const Endpoint &endpoint) {
+  std::lock_guard<std::mutex> lock(mtx);
+  entries[endpoint].healthy = false;
+}
+
+//------------------------------------------------------------------------------
+// Smoothed round-trip time towards the given endpoint
+//------------------------------------------------------------------------------
+bool LatencyProber::getLatency(const Endpoint &endpoint,
+  std::chrono::microseconds &rtt) const {
+
+  std::lock_guard<std::mutex> lock(mtx);
+  auto it = entries.find(endpoint);
+
+  if(it == entries.end() || !it->second.healthy) {
+    return false;
+  }
+
+  rtt = it->second.smoothed;
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// The given endpoints, healthy ones first by increasing latency
+//------------------------------------------------------------------------------
+std::vector<Endpoint> LatencyProber::rank(const std::vector<Endpoint> &endpoints) const {
+  // 0: healthy, 1: unknown, 2: failing
+  std::vector<std::pair<int, std::chrono::microseconds>> keys;
+  keys.reserve(endpoints.size());
+
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    for(const Endpoint &endpoint : endpoints) {
+      auto it = entries.find(endpoint);
+
+      if(it == entries.end()) {
+        keys.emplace_back(1, std::chrono::microseconds(0));
+      }
+      else if(it->second.healthy) {
+        keys.emplace_back(0, it->second.smoothed);
+      }
+      else {
+        keys.emplace_back(2, std::chrono::microseconds(0));
+      }
+    }
+  }
+
+  std::vector<size_t> order(endpoints.size());
+  for(size_t i = 0; i < order.size(); i++) {
+    order[i] = i;
+  }
+
+  std::stable_sort(order.begin(), order.end(), [&keys](size_t a, size_t b) {
+    return keys[a] < keys[b];
+  });
+
+  std::vector<Endpoint> retval;
+  retval.reserve(endpoints.size());
+
+  for(size_t index : order) {
+    retval.emplace_back(endpoints[index]);
+  }
+
+  return retval;
+}
+
+//------------------------------------------------------------------------------
+// Background thread: Probe every member, then sleep for an interval
+//------------------------------------------------------------------------------
+void LatencyProber::main(ThreadAssistant &assistant) {
+  while(!assistant.terminationRequested()) {
+    for(size_t i = 0; i < members.size() && !assistant.terminationRequested(); i++) {
+      probe(i);
+    }
+
+    struct pollfd polls[1];
+    polls[0].fd = wakeupFD.getFD();
+    polls[0].events = POLLIN;
+    polls[0].revents = 0;
+    poll(polls, 1, interval.count());
+  }
+}
+
+//------------------------------------------------------------------------------
+// PING the given member, connecting first if needed. Only the PING itself is
+// timed, so DNS, connect and TLS don't distort the estimate.
+//------------------------------------------------------------------------------
+void LatencyProber::probe(size_t index) {
+  const Endpoint &endpoint = members.getEndpoints()[index];
+
+  ResponseBuilder builder;
+  redisReplyPtr reply;
+
+  //----------------------------------------------------------------------------
+  // A fresh connection gets an untimed PING first, which completes TLS
+  // negotiation out of the way of the measurement.
+  //----------------------------------------------------------------------------
+  if(!streams[index]) {
+    streams[index] = connect(endpoint);
+
+    if(!streams[index] || !exchangeSync(*streams[index], builder, {"PING"},
+        reply, wakeupFD.getFD(), timeout)) {
+      streams[index].reset();
+      recordFailure(endpoint);
+      return;
+    }
+  }
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  bool success = exchangeSync(*streams[index], builder, {"PING"}, reply,
+    wakeupFD.getFD(), timeout);
+
+  if(!success) {
+    streams[index].reset();
+    recordFailure(endpoint);
+    return;
+  }
+
+  record(endpoint, std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::steady_clock::now() - start));
+}
+
+//------------------------------------------------------------------------------
+// Connect to the first reachable address of the given member
+//------------------------------------------------------------------------------
+std::unique_ptr<NetworkStream> LatencyProber::connect(const Endpoint &endpoint) {
+  Status st;
+  std::vector<ServiceEndpoint> resolved = hostResolver->resolve(endpoint.getHost(),
+    endpoint.getPort(), st);
+
+  if(!st.ok()) {
+    return {};
+  }
+
+  for(size_t i = 0; i < resolved.size(); i++) {
+    AsyncConnector connector(resolved[i]);
+    if(!connector.blockUntilReady(wakeupFD.getFD(), timeout)) {
+      return {};
+    }
+
+    if(!connector.ok()) {
+      continue;
+    }
+
+    std::unique_ptr<NetworkStream> candidate(new NetworkStream(connector.release(), tlsconfig));
+    if(candidate->ok()) {
+      return candidate;
+    }
+  }
+
+  return {};
+}
+
+}
@@ -0,0 +1,109 @@
+//------------------------------------------------------------------------------
+// File: LinkShaper.cc
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#include "LinkShaper.hh"
+
+namespace qclient {
+
+//------------------------------------------------------------------------------
+// Constructor
+//------------------------------------------------------------------------------
+LinkShaper::LinkShaper(const LinkShaping &s)
+: shaping(s), origin(Clock::now()), rng(s.getSeed()) {}
+
+//------------------------------------------------------------------------------
+// Replace the link conditions
+//------------------------------------------------------------------------------
+void LinkShaper::configure(const LinkShaping &s) {
+  std::lock_guard<std::mutex> lock(mtx);
+  shaping = s;
+  rng.seed(s.getSeed());
+}
+
+//------------------------------------------------------------------------------
+// How long len bytes occupy the link
+//------------------------------------------------------------------------------
+std::chrono::nanoseconds LinkShaper::transferTime(size_t len) const {
+  if(shaping.getBandwidth() == 0) {
+    return std::chrono::nanoseconds(0);
+  }
+
+  return std::chrono::nanoseconds((uint64_t) ((len * 1e9) / shaping.getBandwidth()));
+}
+
+//------------------------------------------------------------------------------
+// If t falls into a stall window, when does that window end?
+//------------------------------------------------------------------------------
+LinkShaper::Clock::time_point LinkShaper::endOfStall(Clock::time_point t) const {
+  if(shaping.getStallPeriod().count() <= 0 || shaping.getStallDuration().count() <= 0) {
+    return t;
+  }
+
+  std::chrono::nanoseconds period = shaping.getStallPeriod();
+  std::chrono::nanoseconds duration = shaping.getStallDuration();
+  std::chrono::nanoseconds phase = (t - origin) % period;
+
+  if(phase < duration) {
+    return t + (duration - phase);
+  }
+
+  return t;
+}
+
+//------------------------------------------------------------------------------
+// Writes wait for the link to be free, and for any stall to be over.
+//------------------------------------------------------------------------------
+std::chrono::nanoseconds LinkShaper::sendDelay() {
+  std::lock_guard<std::mutex> lock(mtx);
+
+  Clock::time_point now = Clock::now();
+  return endOfStall(std::max(now, sendLinkFree)) - now;
+}
+
+void LinkShaper::sent(size_t len) {
+  std::lock_guard<std::mutex> lock(mtx);
+  sendLinkFree = std::max(Clock::now(), sendLinkFree) + transferTime(len);
+}
+
+//------------------------------------------------------------------------------
+// Received bytes first cross the link at its bandwidth, then sit out the
+// latency and jitter, and any stall on top.
+//------------------------------------------------------------------------------
+LinkShaper::Clock::time_point LinkShaper::releaseTime(size_t len) {
+  std::lock_guard<std::mutex> lock(mtx);
+
+  Clock::time_point now = Clock::now();
+  recvLinkFree = std::max(now, recvLinkFree) + transferTime(len);
+
+  std::chrono::nanoseconds delay = shaping.getLatency();
+  if(shaping.getJitter().count() > 0) {
+    std::uniform_int_distribution<int64_t> dist(0,
+      std::chrono::duration_cast<std::chrono::nanoseconds>(shaping.getJitter()).count());
+    delay += std::chrono::nanoseconds(dist(rng));
+  }
+
+  lastRelease = std::max(lastRelease, endOfStall(recvLinkFree + delay));
+  return lastRelease;
+}
+
+}
@@ -0,0 +1,82 @@
+//------------------------------------------------------------------------------
+// File: LinkShaper.hh
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#ifndef QCLIENT_NETWORK_LINK_SHAPER_HH
+#define QCLIENT_NETWORK_LINK_SHAPER_HH
+
+#include "qclient/FaultInjector.hh"
+#include <chrono>
+#include <mutex>
+#include <random>
+
+namespace qclient {
+
+//------------------------------------------------------------------------------
+// Turns LinkShaping into timings for NetworkStream: How long to hold back a
+// write, and when received bytes may be handed out. Shared between reader
+// and writer thread.
+//------------------------------------------------------------------------------
+class LinkShaper {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  //----------------------------------------------------------------------------
+  // Constructor
+  //----------------------------------------------------------------------------
+  LinkShaper(const LinkShaping &shaping);
+
+  //----------------------------------------------------------------------------
+  // Replace the link conditions. Bytes already held back keep their timings.
+  //----------------------------------------------------------------------------
+  void configure(const LinkShaping &shaping);
+
+  //----------------------------------------------------------------------------
+  // About to write: How long to wait for the link to be free. Once written,
+  // report how many bytes went out, they occupy the link for a while.
+  //----------------------------------------------------------------------------
+  std::chrono::nanoseconds sendDelay();
+  void sent(size_t len);
+
+  //----------------------------------------------------------------------------
+  // Just received len bytes: When to hand them out. Never earlier than the
+  // bytes received before.
+  //----------------------------------------------------------------------------
+  Clock::time_point releaseTime(size_t len);
+
+private:
+  std::chrono::nanoseconds transferTime(size_t len) const;
+  Clock::time_point endOfStall(Clock::time_point t) const;
+
+  std::mutex mtx;
+  LinkShaping shaping;
+  Clock::time_point origin;
+  std::mt19937_64 rng;
+
+  Clock::time_point sendLinkFree;
+  Clock::time_point recvLinkFree;
+  Clock::time_point lastRelease;
+};
+
+}
+
+#endif
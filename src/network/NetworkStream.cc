@@ -23,11 +23,21 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/un.h>
+#include <linux/errqueue.h>
 
 #include "NetworkStream.hh"
+#include "IoUring.hh"
+#include "LinkShaper.hh"
+#include "SharedMemoryChannel.hh"
+#include "qclient/SSTR.hh"
 
 #include <iostream>
+#include <string.h>
 #include <unistd.h>
+#include <thread>
 using namespace qclient;
 
 static RecvStatus recvfn(int socket, char *buffer, int len, int timeout) {
@@ -68,10 +78,50 @@ NetworkStream::NetworkStream(int fd_, TlsConfig tlsconfig)
 }
 
 //------------------------------------------------------------------------------
-// Initialize TlsFilter
+// Find out who's on the other end of the socket, as "address:port", or
+// "unix:/path" for unix domain sockets. Empty string if unknown.
+//------------------------------------------------------------------------------
+static std::string describePeer(int fd, std::string &host, int &port) {
+  struct sockaddr_storage addr;
+  socklen_t len = sizeof(addr);
+
+  if(::getpeername(fd, (struct sockaddr*) &addr, &len) != 0) {
+    return "";
+  }
+
+  char buffer[INET6_ADDRSTRLEN];
+  if(addr.ss_family == AF_INET) {
+    struct sockaddr_in *in = (struct sockaddr_in*) &addr;
+    inet_ntop(AF_INET, &in->sin_addr, buffer, sizeof(buffer));
+    port = ntohs(in->sin_port);
+  }
+  else if(addr.ss_family == AF_INET6) {
+    struct sockaddr_in6 *in6 = (struct sockaddr_in6*) &addr;
+    inet_ntop(AF_INET6, &in6->sin6_addr, buffer, sizeof(buffer));
+    port = ntohs(in6->sin6_port);
+  }
+  else if(addr.ss_family == AF_UNIX) {
+    struct sockaddr_un *un = (struct sockaddr_un*) &addr;
+    host = std::string("unix:") + un->sun_path;
+    port = 0;
+    return host;
+  }
+  else {
+    return "";
+  }
+
+  host = buffer;
+  return host + ":" + std::to_string(port);
+}
+
+//------------------------------------------------------------------------------
+// Initialize TlsFilter. The peer address lets it resume the previous TLS
+// session towards the same server.
 //------------------------------------------------------------------------------
 void NetworkStream::initializeTlsFliter(const TlsConfig &tlsconfig) {
   if(tlsconfig.active) {
+    std::string peer = describePeer(fd, host, port);
+
     using std::placeholders::_1;
     using std::placeholders::_2;
     using std::placeholders::_3;
@@ -79,13 +129,18 @@ void NetworkStream::initializeTlsFliter(const TlsConfig &tlsconfig) {
     RecvFunction recvF = std::bind(recvfn, fd, _1, _2, _3);
     SendFunction sendF = std::bind(sendfn, fd, _1, _2, 0);
 
-    tlsfilter.reset(new TlsFilter(tlsconfig, FilterType::CLIENT, recvF, sendF));
+    tlsfilter.reset(new TlsFilter(tlsconfig, FilterType::CLIENT, recvF, sendF, peer, fd));
   }
 }
 
 void NetworkStream::shutdown() {
   if(fd < 0 || fdShutdown) return;
 
+  // Nobody waiting on a doorbell would notice otherwise
+  if(shm) {
+    shm->wakeLocal();
+  }
+
   int ret = ::shutdown(fd, SHUT_RDWR);
   fdShutdown = true;
   isOk = false;
@@ -99,6 +154,107 @@ void NetworkStream::shutdown() {
   // Only close socket on object destruction.
 }
 
+void NetworkStream::pollForReading(struct pollfd &pfd) {
+  pfd.fd = shm ? shm->getReadableFd() : fd;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+}
+
+void NetworkStream::pollForWriting(struct pollfd &pfd) {
+  pfd.fd = shm ? shm->getWritableFd() : fd;
+  pfd.events = shm ? POLLIN : POLLOUT;
+  pfd.revents = 0;
+}
+
+void NetworkStream::broken(int errc, const std::string &msg) {
+  localerrno = errc;
+  error = msg;
+  isOk = false;
+}
+
+//------------------------------------------------------------------------------
+// Ask the server to move over to a shared memory channel. The answer is read
+// byte by byte, so that nothing past it gets consumed from the socket.
+//------------------------------------------------------------------------------
+bool NetworkStream::upgradeToSharedMemory(size_t ringSize, std::chrono::milliseconds timeout) {
+  if(tlsfilter || shm || fd < 0 || !isOk) {
+    return false;
+  }
+
+  std::string err;
+  std::unique_ptr<SharedMemoryChannel> channel = SharedMemoryChannel::create(ringSize, err);
+  if(!channel) {
+    std::cerr << "qclient: Unable to set up shared memory transport: " << err << std::endl;
+    return false;
+  }
+
+  static const char request[] = "*1\r\n$10\r\nSHM-ATTACH\r\n";
+  struct iovec iov = { const_cast<char*>(request), sizeof(request) - 1 };
+
+  constexpr size_t kFdBytes = sizeof(int) * SharedMemoryChannel::kFdCount;
+  char control[CMSG_SPACE(kFdBytes)];
+  memset(control, 0, sizeof(control));
+
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(kFdBytes);
+  memcpy(CMSG_DATA(cmsg), channel->getFds(), kFdBytes);
+
+  if(::sendmsg(fd, &msg, MSG_NOSIGNAL) != (ssize_t) iov.iov_len) {
+    broken(errno, SSTR("unable to send SHM-ATTACH: " << strerror(errno)));
+    return false;
+  }
+
+  std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + timeout;
+  std::string line;
+
+  while(line.size() < 2 || line.compare(line.size() - 2, 2, "\r\n") != 0) {
+    std::chrono::milliseconds remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+      deadline - std::chrono::steady_clock::now());
+
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+
+    if(line.size() > 1024 || remaining.count() <= 0 || ::poll(&pfd, 1, remaining.count()) == 0) {
+      broken(ETIMEDOUT, "no valid response to SHM-ATTACH");
+      return false;
+    }
+
+    char c;
+    ssize_t rc = ::recv(fd, &c, 1, 0);
+    if(rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+      continue;
+    }
+
+    if(rc <= 0) {
+      broken(rc == 0 ? ECONNRESET : errno, "connection lost during SHM-ATTACH");
+      return false;
+    }
+
+    line += c;
+  }
+
+  if(line == "+OK\r\n") {
+    shm = std::move(channel);
+    return true;
+  }
+
+  if(line[0] != '-') {
+    broken(EINVAL, "unexpected response to SHM-ATTACH: " + line.substr(0, line.size() - 2));
+  }
+
+  return false;
+}
+
 void NetworkStream::close() {
   int ret = ::close(fd);
   if(ret != 0) {
@@ -109,6 +265,24 @@ void NetworkStream::close() {
 }
 
 RecvStatus NetworkStream::recv(char *buffer, int len, int timeout) {
+  LinkShaper *shaper = linkShaper.load(std::memory_order_acquire);
+  if(shaper || !heldBack.empty()) {
+    return recvShaped(shaper, buffer, len);
+  }
+
+  return recvDirect(buffer, len);
+}
+
+RecvStatus NetworkStream::recvDirect(char *buffer, int len) {
+  if(shm) {
+    size_t bytes = shm->read(buffer, len);
+    if(bytes == 0) {
+      return RecvStatus(true, EAGAIN, 0);
+    }
+
+    return RecvStatus(true, 0, bytes);
+  }
+
   if(tlsfilter) {
     return tlsfilter->recv(buffer, len, 0);
   }
@@ -116,12 +290,244 @@ RecvStatus NetworkStream::recv(char *buffer, int len, int timeout) {
   return recvfn(fd, buffer, len, 0);
 }
 
+//------------------------------------------------------------------------------
+// Move whatever arrived into the delay line, stamped with its release time,
+// then hand out what's due. A broken connection is reported right away.
+//------------------------------------------------------------------------------
+RecvStatus NetworkStream::recvShaped(LinkShaper *shaper, char *buffer, int len) {
+  char chunk[16384];
+
+  while(heldBackBytes < kMaxHeldBack) {
+    RecvStatus status = recvDirect(chunk, sizeof(chunk));
+    if(!status.connectionAlive) {
+      return status;
+    }
+
+    if(status.bytesRead <= 0) {
+      break;
+    }
+
+    HeldBytes held;
+    held.release = shaper ? shaper->releaseTime(status.bytesRead)
+                          : std::chrono::steady_clock::now();
+    held.bytes.assign(chunk, status.bytesRead);
+
+    heldBackBytes += status.bytesRead;
+    heldBack.emplace_back(std::move(held));
+  }
+
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+  int copied = 0;
+
+  while(copied < len && !heldBack.empty() && heldBack.front().release <= now) {
+    HeldBytes &front = heldBack.front();
+    size_t amount = std::min<size_t>(len - copied, front.bytes.size() - heldBackOffset);
+    memcpy(buffer + copied, front.bytes.data() + heldBackOffset, amount);
+
+    copied += amount;
+    heldBackOffset += amount;
+    heldBackBytes -= amount;
+
+    if(heldBackOffset == front.bytes.size()) {
+      heldBack.pop_front();
+      heldBackOffset = 0;
+    }
+  }
+
+  if(copied == 0) {
+    return RecvStatus(true, EAGAIN, 0);
+  }
+
+  return RecvStatus(true, 0, copied);
+}
+
+void NetworkStream::setLinkShaper(LinkShaper *shaper) {
+  linkShaper.store(shaper, std::memory_order_release);
+}
+
+int NetworkStream::getShapingTimeout() {
+  if(heldBack.empty()) {
+    return -1;
+  }
+
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+  if(heldBack.front().release <= now) {
+    return 0;
+  }
+
+  // Round up, waking up early would only mean polling again
+  std::chrono::nanoseconds wait = heldBack.front().release - now;
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+    wait + std::chrono::milliseconds(1) - std::chrono::nanoseconds(1)).count();
+}
+
+bool NetworkStream::hasPendingOutput() {
+  return tlsfilter && tlsfilter->hasPendingOutput();
+}
+
+bool NetworkStream::flushPendingOutput() {
+  return !tlsfilter || tlsfilter->flushPendingOutput();
+}
+
 LinkStatus NetworkStream::send(const char *buff, int len) {
-  if(tlsfilter) {
-    return tlsfilter->send(buff, len);
+  LinkShaper *shaper = linkShaper.load(std::memory_order_acquire);
+  if(shaper) {
+    std::this_thread::sleep_for(shaper->sendDelay());
+  }
+
+  LinkStatus status;
+  if(shm) {
+    struct iovec iov = { const_cast<char*>(buff), (size_t) len };
+    status = sendvDirect(&iov, 1, nullptr, false);
+  }
+  else {
+    status = tlsfilter ? tlsfilter->send(buff, len) : ::send(fd, buff, len, 0);
+  }
+
+  if(shaper && status > 0) {
+    shaper->sent(status);
+  }
+
+  return status;
+}
+
+LinkStatus NetworkStream::sendv(const struct iovec *iov, int iovcnt, IoUring *ring,
+  bool zeroCopy) {
+  LinkShaper *shaper = linkShaper.load(std::memory_order_acquire);
+  if(shaper) {
+    std::this_thread::sleep_for(shaper->sendDelay());
+    LinkStatus status = sendvDirect(iov, iovcnt, ring, zeroCopy);
+
+    if(status > 0) {
+      shaper->sent(status);
+    }
+
+    return status;
+  }
+
+  return sendvDirect(iov, iovcnt, ring, zeroCopy);
+}
+
+LinkStatus NetworkStream::sendvDirect(const struct iovec *iov, int iovcnt, IoUring *ring,
+  bool zeroCopy) {
+  //----------------------------------------------------------------------------
+  // A full ring looks just like a full socket buffer to the writer.
+  //----------------------------------------------------------------------------
+  if(shm) {
+    size_t bytes = shm->write(iov, iovcnt);
+    if(bytes == 0) {
+      errno = EWOULDBLOCK;
+      return -1;
+    }
+
+    return bytes;
+  }
+
+  //----------------------------------------------------------------------------
+  // With kernel TLS, the socket takes plaintext - scatter-gather just like
+  // without TLS.
+  //----------------------------------------------------------------------------
+  if(tlsfilter && !tlsfilter->kernelSendOffload()) {
+    //--------------------------------------------------------------------------
+    // Pack everything into a single buffer, so that OpenSSL sees one write
+    // and produces as few TLS records as possible. TlsFilter queues anything
+    // it cannot write right away, so the full length counts as written.
+    //
+    // The buffer is kept around between calls, unless it grew huge.
+    //--------------------------------------------------------------------------
+    size_t total = 0;
+    for(int i = 0; i < iovcnt; i++) {
+      total += iov[i].iov_len;
+    }
+
+    packed.clear();
+    packed.reserve(total);
+    for(int i = 0; i < iovcnt; i++) {
+      packed.append((const char*) iov[i].iov_base, iov[i].iov_len);
+    }
+
+    LinkStatus status = tlsfilter->send(packed.data(), packed.size());
+    if(packed.capacity() > kMaxPackedCapacity) {
+      std::string().swap(packed);
+    }
+
+    if(status < 0) {
+      return status;
+    }
+
+    return total;
+  }
+
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = const_cast<struct iovec*>(iov);
+  msg.msg_iovlen = iovcnt;
+
+  if(ring) {
+    return ring->sendmsg(fd, &msg);
+  }
+
+#ifdef MSG_ZEROCOPY
+  if(zeroCopy && zeroCopyEnabled) {
+    return ::sendmsg(fd, &msg, MSG_ZEROCOPY);
+  }
+#endif
+
+  return ::sendmsg(fd, &msg, 0);
+}
+
+//------------------------------------------------------------------------------
+// Enable MSG_ZEROCOPY on the socket
+//------------------------------------------------------------------------------
+bool NetworkStream::enableZeroCopy() {
+#ifdef SO_ZEROCOPY
+  if(tlsfilter || shm || fd < 0) {
+    return false;
   }
 
-  return ::send(fd, buff, len, 0);
+  int one = 1;
+  zeroCopyEnabled = (::setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0);
+#endif
+
+  return zeroCopyEnabled;
+}
+
+//------------------------------------------------------------------------------
+// Drain zero-copy completions from the error queue. Each reports a range of
+// ids [ee_info, ee_data] - on TCP they arrive in order, so the end of the
+// latest range is all we need. Ids wrap around at 2^32.
+//------------------------------------------------------------------------------
+void NetworkStream::reapZeroCopy() {
+#ifdef SO_EE_ORIGIN_ZEROCOPY
+  if(!zeroCopyEnabled) return;
+
+  while(true) {
+    char control[128];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    if(::recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+      return;
+    }
+
+    for(struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+      bool ip = (cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR);
+      bool ip6 = (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR);
+      if(!ip && !ip6) continue;
+
+      struct sock_extended_err serr;
+      memcpy(&serr, CMSG_DATA(cm), sizeof(serr));
+      if(serr.ee_errno != 0 || serr.ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+
+      uint32_t end = serr.ee_data + 1;
+      uint32_t prev = zeroCopyCompleted.load();
+      while((int32_t) (end - prev) > 0 &&
+            !zeroCopyCompleted.compare_exchange_weak(prev, end)) {}
+    }
+  }
+#endif
 }
 
 NetworkStream::~NetworkStream() {
@@ -26,12 +26,20 @@
 
 #include <string>
 #include <atomic>
+#include <chrono>
+#include <deque>
 #include <memory>
+#include <sys/uio.h>
+#include <poll.h>
 #include "qclient/TlsFilter.hh"
 #include "qclient/network/HostResolver.hh"
 
 namespace qclient {
 
+class IoUring;
+class LinkShaper;
+class SharedMemoryChannel;
+
 class NetworkStream {
 public:
   //----------------------------------------------------------------------------
@@ -61,18 +69,104 @@ public:
     return fd;
   }
 
+  //----------------------------------------------------------------------------
+  // Set up a pollfd to wait for incoming bytes, or for room to send more:
+  // The socket itself, or a doorbell with the shared memory transport.
+  //----------------------------------------------------------------------------
+  void pollForReading(struct pollfd &pfd);
+  void pollForWriting(struct pollfd &pfd);
+
+  //----------------------------------------------------------------------------
+  // Experimental shared memory transport, for unix domain sockets towards
+  // the same host: Hand the server a SharedMemoryChannel with rings of the
+  // given size through SCM_RIGHTS, asking it with SHM-ATTACH. If it answers
+  // +OK, all bytes flow through the rings from then on - the socket only
+  // tells us whether the server is still there. Call right after
+  // connecting, before anything else is sent.
+  //
+  // Returns false if we stay on the socket, either because the server
+  // refused, or because the connection broke while asking - check ok().
+  //----------------------------------------------------------------------------
+  bool upgradeToSharedMemory(size_t ringSize, std::chrono::milliseconds timeout);
+
+  bool usesSharedMemory() const {
+    return shm != nullptr;
+  }
+
   void shutdown();
   RecvStatus recv(char *buff, int len, int timeout);
   LinkStatus send(const char *buff, int len);
 
+  //----------------------------------------------------------------------------
+  // Scatter-gather send: Write the given iovecs using a single syscall. With
+  // TLS, the buffers are packed together and handed to a single SSL_write.
+  // Returns the number of bytes written, or a negative value on error.
+  //
+  // If a ring is given, plaintext sends are submitted through io_uring.
+  //----------------------------------------------------------------------------
+  LinkStatus sendv(const struct iovec *iov, int iovcnt, IoUring *ring = nullptr,
+    bool zeroCopy = false);
+
+  //----------------------------------------------------------------------------
+  // MSG_ZEROCOPY support. Once enabled, a sendv with zeroCopy set lets the
+  // kernel read straight from the given buffers, which must stay untouched
+  // until the send is reported complete: Every such sendv which wrote
+  // anything is assigned the next id, starting from 0.
+  //
+  // Completions arrive on the socket error queue, and make poll report
+  // POLLERR - call reapZeroCopy() then, from any thread. All ids below
+  // getZeroCopyCompleted() have completed. A zeroCopy sendv may fail with
+  // ENOBUFS, if the kernel can't track any more pinned pages - just send
+  // without then.
+  //
+  // Not available with TLS, and refused by the kernel on non-TCP sockets.
+  //----------------------------------------------------------------------------
+  bool enableZeroCopy();
+  void reapZeroCopy();
+
+  uint32_t getZeroCopyCompleted() const {
+    return zeroCopyCompleted.load(std::memory_order_acquire);
+  }
+
+  //----------------------------------------------------------------------------
+  // With TLS, a send may leave encrypted bytes behind if the socket is full -
+  // sends report them as written regardless. Nobody else is going to push
+  // them out: Flush once the socket is writable again. Always false / true
+  // without TLS.
+  //----------------------------------------------------------------------------
+  bool hasPendingOutput();
+  bool flushPendingOutput();
+
+  //----------------------------------------------------------------------------
+  // Emulate a degraded link, see FaultInjector: Sends wait out the link's
+  // bandwidth and stalls, and received bytes are held back until their
+  // release time. Set from the reader thread, nullptr turns it off - bytes
+  // already held back are still handed out on schedule.
+  //
+  // The reader must not poll for longer than getShapingTimeout()
+  // milliseconds, or bytes held back are handed out late. -1 if there's
+  // nothing to wait for.
+  //----------------------------------------------------------------------------
+  void setLinkShaper(LinkShaper *shaper);
+  int getShapingTimeout();
+
 private:
   //----------------------------------------------------------------------------
   // Initialize TlsFilter
   //----------------------------------------------------------------------------
   void initializeTlsFliter(const TlsConfig &tlsconfig);
 
+  //----------------------------------------------------------------------------
+  // recv / sendv without link shaping, and recv through the shaper's delay
+  // line
+  //----------------------------------------------------------------------------
+  RecvStatus recvDirect(char *buff, int len);
+  RecvStatus recvShaped(LinkShaper *shaper, char *buff, int len);
+  LinkStatus sendvDirect(const struct iovec *iov, int iovcnt, IoUring *ring,
+    bool zeroCopy);
+
   std::string host;
-  int port;
+  int port = 0;
 
   int localerrno = 0;
   std::string error;
@@ -82,9 +176,33 @@ private:
 
   bool fdShutdown = false;
   std::unique_ptr<TlsFilter> tlsfilter;
+
+  // sendv packing buffer for TLS - only ever used by the writer thread
+  std::string packed;
+  static constexpr size_t kMaxPackedCapacity = 1024 * 1024;
+
   std::atomic<bool> isOk;
 
+  // Link shaping - the delay line is only ever touched by the reader thread
+  struct HeldBytes {
+    std::chrono::steady_clock::time_point release;
+    std::string bytes;
+  };
+
+  std::atomic<LinkShaper*> linkShaper {nullptr};
+  std::deque<HeldBytes> heldBack;
+  size_t heldBackOffset = 0;
+  size_t heldBackBytes = 0;
+  static constexpr size_t kMaxHeldBack = 64 * 1024 * 1024;
+
+  // Set before the reader and writer start, if at all
+  std::unique_ptr<SharedMemoryChannel> shm;
+
+  std::atomic<bool> zeroCopyEnabled {false};
+  std::atomic<uint32_t> zeroCopyCompleted {0};
+
   void close();
+  void broken(int errc, const std::string &msg);
 };
 
 
@@ -0,0 +1,311 @@
+//------------------------------------------------------------------------------
+// File: SharedMemoryChannel.cc
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#include "SharedMemoryChannel.hh"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+namespace qclient {
+
+//------------------------------------------------------------------------------
+// Control block of one ring, each counter on a cache line of its own. head
+// and tail count bytes ever written and read, and never wrap.
+//------------------------------------------------------------------------------
+struct SharedMemoryChannel::Ring {
+  alignas(64) std::atomic<uint64_t> head;
+  alignas(64) std::atomic<uint64_t> tail;
+  alignas(64) std::atomic<uint32_t> consumerWaiting;
+  alignas(64) std::atomic<uint32_t> producerWaiting;
+};
+
+//------------------------------------------------------------------------------
+// Start of the shared region - the ring buffers follow, client to server
+// first.
+//------------------------------------------------------------------------------
+struct SharedMemoryChannel::Header {
+  uint64_t magic;
+  uint64_t ringSize;
+  Ring rings[2];
+};
+
+static constexpr uint64_t kMagic = 0x716d656d63686e31ull; // "qmemchn1"
+static constexpr size_t kMaxRingSize = 1ull << 30;
+
+static void closeAll(const int fds[SharedMemoryChannel::kFdCount]) {
+  for(size_t i = 0; i < SharedMemoryChannel::kFdCount; i++) {
+    if(fds[i] >= 0) {
+      ::close(fds[i]);
+    }
+  }
+}
+
+static void ring(int fd) {
+  uint64_t one = 1;
+  ssize_t rc = ::write(fd, &one, sizeof(one));
+  (void) rc;
+}
+
+static void drain(int fd) {
+  uint64_t value;
+  ssize_t rc = ::read(fd, &value, sizeof(value));
+  (void) rc;
+}
+
+std::unique_ptr<SharedMemoryChannel> SharedMemoryChannel::create(size_t size, std::string &err) {
+#ifdef __linux__
+  size_t rounded = 4096;
+  while(rounded < size && rounded < kMaxRingSize) {
+    rounded *= 2;
+  }
+
+  std::unique_ptr<SharedMemoryChannel> channel(new SharedMemoryChannel());
+  channel->ringSize = rounded;
+  channel->mappedSize = sizeof(Header) + 2 * rounded;
+
+  channel->fds[0] = memfd_create("qclient-channel", MFD_CLOEXEC);
+  if(channel->fds[0] < 0 || ftruncate(channel->fds[0], channel->mappedSize) != 0) {
+    err = std::string("unable to create shared memory: ") + strerror(errno);
+    return nullptr;
+  }
+
+  for(size_t i = 1; i < kFdCount; i++) {
+    channel->fds[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(channel->fds[i] < 0) {
+      err = std::string("unable to create eventfd: ") + strerror(errno);
+      return nullptr;
+    }
+  }
+
+  if(!channel->map(false, err)) {
+    return nullptr;
+  }
+
+  Header *header = new (channel->mapped) Header();
+  header->magic = kMagic;
+  header->ringSize = rounded;
+
+  // Both consumers start out waiting, so that the first bytes written ring
+  // the doorbell even if nobody looked at an empty ring before.
+  for(Ring &ring : header->rings) {
+    ring.consumerWaiting.store(1);
+  }
+
+  return channel;
+#else
+  err = "shared memory channels are only supported on Linux";
+  return nullptr;
+#endif
+}
+
+std::unique_ptr<SharedMemoryChannel> SharedMemoryChannel::attach(const int received[kFdCount], std::string &err) {
+  std::unique_ptr<SharedMemoryChannel> channel(new SharedMemoryChannel());
+  std::copy(received, received + kFdCount, channel->fds);
+
+  struct stat st;
+  if(fstat(channel->fds[0], &st) != 0 || (size_t) st.st_size < sizeof(Header)) {
+    err = "shared memory region is too small";
+    return nullptr;
+  }
+
+  //----------------------------------------------------------------------------
+  // Never trust the header alone - the rings must fit into what's there.
+  //----------------------------------------------------------------------------
+  uint64_t prefix[2];
+  if(pread(channel->fds[0], prefix, sizeof(prefix), 0) != (ssize_t) sizeof(prefix)) {
+    err = "unable to read shared memory header";
+    return nullptr;
+  }
+
+  uint64_t magic = prefix[0];
+  uint64_t size = prefix[1];
+
+  if(magic != kMagic || size == 0 || size > kMaxRingSize || (size & (size - 1)) != 0 ||
+     (size_t) st.st_size < sizeof(Header) + 2 * size) {
+    err = "invalid shared memory header";
+    return nullptr;
+  }
+
+  channel->ringSize = size;
+  channel->mappedSize = sizeof(Header) + 2 * size;
+
+  if(!channel->map(true, err)) {
+    return nullptr;
+  }
+
+  return channel;
+}
+
+//------------------------------------------------------------------------------
+// Map the region, and pick rings and doorbells depending on our side.
+//------------------------------------------------------------------------------
+bool SharedMemoryChannel::map(bool server, std::string &err) {
+  mapped = mmap(nullptr, mappedSize, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+  if(mapped == MAP_FAILED) {
+    mapped = nullptr;
+    err = std::string("unable to map shared memory: ") + strerror(errno);
+    return false;
+  }
+
+  Header *header = static_cast<Header*>(mapped);
+  char *buffers = static_cast<char*>(mapped) + sizeof(Header);
+
+  // Client to server: ring 0, doorbells 1 and 2 - the other way around:
+  // ring 1, doorbells 3 and 4.
+  size_t outIdx = server ? 1 : 0;
+  size_t inIdx = 1 - outIdx;
+
+  out = &header->rings[outIdx];
+  in = &header->rings[inIdx];
+  outBuffer = buffers + outIdx * ringSize;
+  inBuffer = buffers + inIdx * ringSize;
+
+  outDataBell = fds[1 + 2 * outIdx];
+  outSpaceBell = fds[2 + 2 * outIdx];
+  inDataBell = fds[1 + 2 * inIdx];
+  inSpaceBell = fds[2 + 2 * inIdx];
+  return true;
+}
+
+SharedMemoryChannel::~SharedMemoryChannel() {
+  if(mapped) {
+    munmap(mapped, mappedSize);
+  }
+
+  closeAll(fds);
+}
+
+//------------------------------------------------------------------------------
+// Before giving up on a full ring, announce we're waiting and look again -
+// the consumer checks for the announcement after making space, so one of
+// us is bound to notice the other. Returns whether the ring is still full.
+//------------------------------------------------------------------------------
+bool SharedMemoryChannel::waitForSpace(uint64_t head) {
+  drain(outSpaceBell);
+  out->producerWaiting.store(1, std::memory_order_seq_cst);
+
+  if(head - out->tail.load(std::memory_order_seq_cst) == ringSize) {
+    return true;
+  }
+
+  out->producerWaiting.store(0, std::memory_order_relaxed);
+  return false;
+}
+
+size_t SharedMemoryChannel::write(const struct iovec *iov, int iovcnt) {
+  uint64_t head = out->head.load(std::memory_order_relaxed);
+  uint64_t tail = out->tail.load(std::memory_order_acquire);
+
+  if(head - tail == ringSize) {
+    if(waitForSpace(head)) {
+      return 0;
+    }
+
+    tail = out->tail.load(std::memory_order_acquire);
+  }
+
+  size_t space = ringSize - (head - tail);
+  size_t written = 0;
+
+  for(int i = 0; i < iovcnt && written < space; i++) {
+    const char *src = static_cast<const char*>(iov[i].iov_base);
+    size_t remaining = std::min<size_t>(iov[i].iov_len, space - written);
+
+    while(remaining > 0) {
+      size_t pos = (head + written) & (ringSize - 1);
+      size_t chunk = std::min(remaining, ringSize - pos);
+      memcpy(outBuffer + pos, src, chunk);
+
+      src += chunk;
+      remaining -= chunk;
+      written += chunk;
+    }
+  }
+
+  out->head.store(head + written, std::memory_order_seq_cst);
+
+  if(out->consumerWaiting.load(std::memory_order_seq_cst) != 0 &&
+     out->consumerWaiting.exchange(0) != 0) {
+    ring(outDataBell);
+  }
+
+  //----------------------------------------------------------------------------
+  // Filled the ring up: Whoever wrote this is about to wait for space, so
+  // arm the doorbell already - or ring it ourselves, if there's space again.
+  //----------------------------------------------------------------------------
+  if(head + written - tail == ringSize && !waitForSpace(head + written)) {
+    ring(outSpaceBell);
+  }
+
+  return written;
+}
+
+size_t SharedMemoryChannel::read(char *buffer, size_t len) {
+  uint64_t tail = in->tail.load(std::memory_order_relaxed);
+  uint64_t head = in->head.load(std::memory_order_acquire);
+
+  if(head == tail) {
+    drain(inDataBell);
+    in->consumerWaiting.store(1, std::memory_order_seq_cst);
+    head = in->head.load(std::memory_order_seq_cst);
+
+    if(head == tail) {
+      return 0;
+    }
+
+    in->consumerWaiting.store(0, std::memory_order_relaxed);
+  }
+
+  size_t amount = std::min<size_t>(len, head - tail);
+  size_t copied = 0;
+
+  while(copied < amount) {
+    size_t pos = (tail + copied) & (ringSize - 1);
+    size_t chunk = std::min(amount - copied, ringSize - pos);
+    memcpy(buffer + copied, inBuffer + pos, chunk);
+    copied += chunk;
+  }
+
+  in->tail.store(tail + amount, std::memory_order_seq_cst);
+
+  if(in->producerWaiting.load(std::memory_order_seq_cst) != 0 &&
+     in->producerWaiting.exchange(0) != 0) {
+    ring(inSpaceBell);
+  }
+
+  return amount;
+}
+
+void SharedMemoryChannel::wakeLocal() {
+  ring(inDataBell);
+  ring(outSpaceBell);
+}
+
+}
@@ -0,0 +1,131 @@
+//------------------------------------------------------------------------------
+// File: SharedMemoryChannel.hh
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#ifndef QCLIENT_NETWORK_SHARED_MEMORY_CHANNEL_HH
+#define QCLIENT_NETWORK_SHARED_MEMORY_CHANNEL_HH
+
+#include <sys/uio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include <string>
+
+namespace qclient {
+
+//------------------------------------------------------------------------------
+// Two single-producer single-consumer byte rings in a memfd, one per
+// direction, with an eventfd doorbell for each side to wait on: "data
+// available" for the consumer, "space available" for the producer. A side
+// only rings a doorbell if the other announced it's about to wait, so a
+// busy channel costs no syscalls at all.
+//
+// The client creates the channel and hands kFdCount descriptors over a unix
+// socket - see NetworkStream::upgradeToSharedMemory. The server attaches to
+// them. Linux only, create() fails elsewhere.
+//
+// At most one thread may write, and one read, at a time.
+//------------------------------------------------------------------------------
+class SharedMemoryChannel {
+public:
+  static constexpr size_t kFdCount = 5;
+
+  //----------------------------------------------------------------------------
+  // Client side: Create a channel with rings of the given size, rounded up
+  // to a power of two. nullptr on failure, with err filled.
+  //----------------------------------------------------------------------------
+  static std::unique_ptr<SharedMemoryChannel> create(size_t ringSize, std::string &err);
+
+  //----------------------------------------------------------------------------
+  // Server side: Attach to the descriptors received from a client, taking
+  // ownership of them. nullptr on failure, with err filled.
+  //----------------------------------------------------------------------------
+  static std::unique_ptr<SharedMemoryChannel> attach(const int fds[kFdCount], std::string &err);
+
+  ~SharedMemoryChannel();
+
+  //----------------------------------------------------------------------------
+  // Descriptors to hand to the server - memfd first, then the doorbells.
+  //----------------------------------------------------------------------------
+  const int* getFds() const {
+    return fds;
+  }
+
+  size_t getRingSize() const {
+    return ringSize;
+  }
+
+  //----------------------------------------------------------------------------
+  // Copy as much as fits into the outgoing ring. Returns 0 if it's full -
+  // once it's full, getWritableFd() becomes readable when there's space
+  // again.
+  //----------------------------------------------------------------------------
+  size_t write(const struct iovec *iov, int iovcnt);
+
+  //----------------------------------------------------------------------------
+  // Take up to len bytes from the incoming ring. Returns 0 if it's empty -
+  // getReadableFd() becomes readable once there's more.
+  //----------------------------------------------------------------------------
+  size_t read(char *buffer, size_t len);
+
+  int getReadableFd() const {
+    return inDataBell;
+  }
+
+  int getWritableFd() const {
+    return outSpaceBell;
+  }
+
+  //----------------------------------------------------------------------------
+  // Ring our own doorbells, so that local waiters look again - when
+  // shutting down, for example.
+  //----------------------------------------------------------------------------
+  void wakeLocal();
+
+private:
+  struct Ring;
+  struct Header;
+
+  SharedMemoryChannel() {}
+  bool map(bool server, std::string &err);
+  bool waitForSpace(uint64_t head);
+
+  int fds[kFdCount] = {-1, -1, -1, -1, -1};
+  size_t ringSize = 0;
+  size_t mappedSize = 0;
+  void *mapped = nullptr;
+
+  Ring *out = nullptr;
+  Ring *in = nullptr;
+  char *outBuffer = nullptr;
+  char *inBuffer = nullptr;
+
+  // Doorbells, from our point of view
+  int outDataBell = -1;    // rung by us, after writing
+  int outSpaceBell = -1;   // waited on by us, when the outgoing ring is full
+  int inDataBell = -1;     // waited on by us, when the incoming ring is empty
+  int inSpaceBell = -1;    // rung by us, after reading
+};
+
+}
+
+#endif
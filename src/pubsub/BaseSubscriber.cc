@@ -25,6 +25,8 @@
 #include "qclient/Handshake.hh"
 #include "qclient/Logger.hh"
 #include "qclient/ReconnectionListener.hh"
+#include <algorithm>
+#include <cstring>
 
 namespace qclient {
 
@@ -53,6 +55,10 @@ static Options makeOptions(SubscriptionOptions &&opts,
   options.tlsconfig = opts.tlsconfig;
   options.handshake = std::move(opts.handshake);
   options.logger = opts.logger;
+  options.dnsCache = opts.dnsCache;
+  options.latencyProber = opts.latencyProber;
+  options.socketProfile = opts.socketProfile;
+  options.memoryBudget = opts.memoryBudget;
   options.ensureConnectionIsPrimed = true;
   options.transparentRedirects = true;
   options.retryStrategy = RetryStrategy::NoRetries();
@@ -73,7 +79,7 @@ static Options makeOptions(SubscriptionOptions &&opts,
 BaseSubscriber::BaseSubscriber(const Members &memb,
   std::shared_ptr<MessageListener> list, SubscriptionOptions &&opt)
 : reconnectionListener(new BaseSubscriberListener(this)), members(memb),
-  listener(list),
+  listener(list), resubscribeChunkSize(std::max<size_t>(opt.resubscribeChunkSize, 1u)),
   qcl(members, makeOptions(std::move(opt), list)) {
 
   // Invalid listener?
@@ -97,22 +103,90 @@ BaseSubscriber::~BaseSubscriber() { }
 void BaseSubscriber::notifyConnectionEstablished(int64_t epoch) {
   std::unique_lock<std::mutex> lock(mtx);
 
-  std::vector<std::string> payloadChannels = {"subscribe"};
-  for(auto it = channels.begin(); it != channels.end(); it++) {
-    payloadChannels.emplace_back(*it);
+  std::vector<Chunk> channelChunks;
+  planResubscription(channels, priorityChannels, resubscribeChunkSize, channelChunks);
+
+  std::vector<Chunk> patternChunks;
+  planResubscription(patterns, priorityPatterns, resubscribeChunkSize, patternChunks);
+
+  resubscribe("subscribe", channelChunks);
+  resubscribe("psubscribe", patternChunks);
+}
+
+//------------------------------------------------------------------------------
+// Split keys into resubscription chunks of at most chunkSize each, those in
+// priority first.
+//------------------------------------------------------------------------------
+void BaseSubscriber::planResubscription(const std::set<std::string> &keys,
+  const std::set<std::string> &priority, size_t chunkSize,
+  std::vector<Chunk> &chunks) {
+
+  chunks.clear();
+  Chunk current;
+
+  auto add = [&](const std::string *key) {
+    current.push_back(key);
+    if(current.size() >= chunkSize) {
+      chunks.emplace_back(std::move(current));
+      current.clear();
+    }
+  };
+
+  for(auto it = priority.begin(); it != priority.end(); it++) {
+    auto key = keys.find(*it);
+    if(key != keys.end()) {
+      add(&*key);
+    }
   }
 
-  std::vector<std::string> payloadPatterns = {"psubscribe"};
-  for(auto it = patterns.begin(); it != patterns.end(); it++) {
-    payloadPatterns.emplace_back(*it);
+  for(auto it = keys.begin(); it != keys.end(); it++) {
+    if(priority.find(*it) == priority.end()) {
+      add(&*it);
+    }
   }
 
-  if(payloadChannels.size() != 1) {
-    qcl.execute(nullptr, payloadChannels);
+  if(!current.empty()) {
+    chunks.emplace_back(std::move(current));
   }
+}
+
+//------------------------------------------------------------------------------
+// Send out the given resubscription chunks, pipelined, straight out of the
+// keys - no intermediate copies. Assumes mtx is taken.
+//------------------------------------------------------------------------------
+void BaseSubscriber::resubscribe(const char *command, const std::vector<Chunk> &chunks) {
+  std::vector<const char*> args;
+  std::vector<size_t> sizes;
 
-  if(payloadPatterns.size() != 1) {
-    qcl.execute(nullptr, payloadPatterns);
+  for(size_t i = 0; i < chunks.size(); i++) {
+    args.clear();
+    sizes.clear();
+
+    args.push_back(command);
+    sizes.push_back(strlen(command));
+
+    for(size_t j = 0; j < chunks[i].size(); j++) {
+      args.push_back(chunks[i][j]->data());
+      sizes.push_back(chunks[i][j]->size());
+    }
+
+    qcl.execute(nullptr, EncodedRequest(args.size(), args.data(), sizes.data()));
+  }
+}
+
+//------------------------------------------------------------------------------
+// Subscribe to the given channel or pattern first when resubscribing
+//------------------------------------------------------------------------------
+void BaseSubscriber::prioritize(const std::string &key, bool pattern) {
+  std::unique_lock<std::mutex> lock(mtx);
+
+  if(pattern) {
+    if(patterns.find(key) != patterns.end()) {
+      priorityPatterns.insert(key);
+    }
+  }
+  else if(channels.find(key) != channels.end()) {
+    priorityChannels.insert(key);
   }
 }
 
@@ -167,10 +241,12 @@ void BaseSubscriber::unsubscribe(const std::vector<std::string> &remChannels) {
   for(auto it = remChannels.begin(); it != remChannels.end(); it++) {
     payload.emplace_back(*it);
     channels.erase(*it);
+    priorityChannels.erase(*it);
   }
 
   if(remChannels.size() == 0) {
     channels.clear();
+    priorityChannels.clear();
   }
 
   qcl.execute(nullptr, payload);
@@ -187,10 +263,12 @@ void BaseSubscriber::punsubscribe(const std::vector<std::string> &remPatterns) {
   for(auto it = remPatterns.begin(); it != remPatterns.end(); it++) {
     payload.emplace_back(*it);
     patterns.erase(*it);
+    priorityPatterns.erase(*it);
   }
 
   if(remPatterns.size() == 0) {
     patterns.clear();
+    priorityPatterns.clear();
   }
 
   qcl.execute(nullptr, payload);
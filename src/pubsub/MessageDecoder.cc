@@ -0,0 +1,211 @@
+//------------------------------------------------------------------------------
+// File: MessageDecoder.cc
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#include "MessageDecoder.hh"
+#include <string.h>
+#include "qclient/utils/AllocationAccounting.hh"
+
+namespace qclient {
+
+using Field = MessageDecoder::Field;
+
+//------------------------------------------------------------------------------
+// What follows the type string of each kind of message.
+//------------------------------------------------------------------------------
+static const Field kMessageLayout[] = { Field::kChannel, Field::kPayload };
+static const Field kPatternMessageLayout[] = { Field::kPattern, Field::kChannel, Field::kPayload };
+static const Field kChannelLayout[] = { Field::kChannel, Field::kActiveSubscriptions };
+static const Field kPatternLayout[] = { Field::kPattern, Field::kActiveSubscriptions };
+
+struct MessageKind {
+  const char *name;
+  MessageType type;
+  const Field *layout;
+  size_t layoutSize;
+};
+
+#define QCLIENT_MESSAGE_KIND(name, type, layout) { name, type, layout, sizeof(layout) / sizeof(Field) }
+
+static const MessageKind kMessageKinds[] = {
+  QCLIENT_MESSAGE_KIND("message", MessageType::kMessage, kMessageLayout),
+  QCLIENT_MESSAGE_KIND("pmessage", MessageType::kPatternMessage, kPatternMessageLayout),
+  QCLIENT_MESSAGE_KIND("subscribe", MessageType::kSubscribe, kChannelLayout),
+  QCLIENT_MESSAGE_KIND("psubscribe", MessageType::kPatternSubscribe, kPatternLayout),
+  QCLIENT_MESSAGE_KIND("unsubscribe", MessageType::kUnsubscribe, kChannelLayout),
+  QCLIENT_MESSAGE_KIND("punsubscribe", MessageType::kPatternUnsubscribe, kPatternLayout)
+};
+
+#undef QCLIENT_MESSAGE_KIND
+
+static const MessageKind* findKind(const char *str, size_t len) {
+  for(const MessageKind &kind : kMessageKinds) {
+    if(strlen(kind.name) == len && memcmp(kind.name, str, len) == 0) {
+      return &kind;
+    }
+  }
+
+  return nullptr;
+}
+
+//------------------------------------------------------------------------------
+// A new reply starts. Same as in MessageParser, the first element of a push
+// type reply is skipped.
+//------------------------------------------------------------------------------
+void MessageDecoder::onAggregate(int type, size_t elems, size_t depth) {
+  if(depth != 0) {
+    valid = false;
+    return;
+  }
+
+  reset();
+  started = true;
+
+  if(type == REDIS_REPLY_ARRAY) {
+    baseIdx = 0;
+  }
+  else if(type == REDIS_REPLY_PUSH) {
+    baseIdx = 1;
+  }
+  else {
+    return;
+  }
+
+  valid = true;
+  elements = elems;
+  contents = std::make_shared<Message::Contents>();
+  AllocationAccounting::record(AllocationCategory::kPubsub, sizeof(Message::Contents));
+}
+
+void MessageDecoder::onString(int type, const char *str, size_t len, size_t depth) {
+  if(depth != 1 || !valid) {
+    valid = false;
+    return;
+  }
+
+  size_t idx = position++;
+  if(idx < baseIdx) {
+    return;
+  }
+
+  if(type != REDIS_REPLY_STRING) {
+    valid = false;
+    return;
+  }
+
+  if(idx == baseIdx) {
+    //--------------------------------------------------------------------------
+    // The type string - from now on we know what to expect.
+    //--------------------------------------------------------------------------
+    const MessageKind *kind = findKind(str, len);
+    if(!kind || elements != baseIdx + 1 + kind->layoutSize) {
+      valid = false;
+      return;
+    }
+
+    message.messageType = kind->type;
+    layout = kind->layout;
+    return;
+  }
+
+  std::string *target = getString(layout[idx - baseIdx - 1]);
+  if(!target) {
+    valid = false;
+    return;
+  }
+
+  target->assign(str, len);
+}
+
+void MessageDecoder::onInteger(long long value, size_t depth) {
+  if(depth != 1 || !valid) {
+    valid = false;
+    return;
+  }
+
+  size_t idx = position++;
+  if(idx < baseIdx) {
+    return;
+  }
+
+  if(idx == baseIdx || layout[idx - baseIdx - 1] != Field::kActiveSubscriptions) {
+    valid = false;
+    return;
+  }
+
+  message.activeSubscriptions = value;
+}
+
+void MessageDecoder::invalidEvent(size_t depth) {
+  valid = false;
+}
+
+//------------------------------------------------------------------------------
+// Where the given string field goes, nullptr if it's not a string.
+//------------------------------------------------------------------------------
+std::string* MessageDecoder::getString(Field field) {
+  switch(field) {
+    case Field::kPattern: {
+      return &contents->pattern;
+    }
+    case Field::kChannel: {
+      return &contents->channel;
+    }
+    case Field::kPayload: {
+      return &contents->payload;
+    }
+    default: {
+      return nullptr;
+    }
+  }
+}
+
+bool MessageDecoder::take(Message &out) {
+  out.clear();
+
+  //----------------------------------------------------------------------------
+  // The element count was checked against the layout as soon as the type
+  // string arrived, so a valid message without one must have been empty.
+  //----------------------------------------------------------------------------
+  bool ok = valid && layout != nullptr;
+  if(ok) {
+    message.data = std::move(contents);
+    out = std::move(message);
+  }
+
+  reset();
+  return ok;
+}
+
+void MessageDecoder::reset() {
+  started = false;
+  valid = false;
+  baseIdx = 0u;
+  elements = 0u;
+  position = 0u;
+  layout = nullptr;
+  message.clear();
+  contents.reset();
+}
+
+}
@@ -0,0 +1,93 @@
+//------------------------------------------------------------------------------
+// File: MessageDecoder.hh
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#ifndef QCLIENT_MESSAGE_DECODER_HH
+#define QCLIENT_MESSAGE_DECODER_HH
+
+#include "qclient/ReplyDecoder.hh"
+#include "qclient/pubsub/Message.hh"
+
+namespace qclient {
+
+//------------------------------------------------------------------------------
+// Builds pub-sub messages straight out of the parser, one per reply, without
+// assembling a redisReply tree first: Each string is copied exactly once,
+// from the receive buffer into the contents of the message. Accepts the very
+// same replies as MessageParser.
+//------------------------------------------------------------------------------
+class MessageDecoder : public ReplyDecoder {
+public:
+  MessageDecoder() {}
+
+  void onAggregate(int type, size_t elements, size_t depth) override;
+  void onString(int type, const char *str, size_t len, size_t depth) override;
+  void onInteger(long long value, size_t depth) override;
+  void invalidEvent(size_t depth) override;
+
+  //----------------------------------------------------------------------------
+  // Did the last reply go through the decoder? Replies which are not
+  // aggregates, such as errors, never do.
+  //----------------------------------------------------------------------------
+  bool hasMessage() const {
+    return started;
+  }
+
+  //----------------------------------------------------------------------------
+  // Hand over the message decoded out of the last reply, and get ready for
+  // the next one. Returns false if it doesn't look like a valid pub-sub
+  // message.
+  //----------------------------------------------------------------------------
+  bool take(Message &out);
+
+  //----------------------------------------------------------------------------
+  // Forget about any reply in progress, such as after a reconnection.
+  //----------------------------------------------------------------------------
+  void reset();
+
+  enum class Field {
+    kPattern,
+    kChannel,
+    kPayload,
+    kActiveSubscriptions
+  };
+
+private:
+  std::string* getString(Field field);
+
+  bool started = false;
+  bool valid = false;
+
+  size_t baseIdx = 0u;
+  size_t elements = 0u;
+  size_t position = 0u;
+
+  const Field *layout = nullptr;
+
+  Message message;
+  std::shared_ptr<Message::Contents> contents;
+};
+
+}
+
+#endif
@@ -24,6 +24,7 @@
 #include "MessageParser.hh"
 #include "qclient/pubsub/Message.hh"
 #include <string.h>
+#include "qclient/utils/AllocationAccounting.hh"
 
 namespace qclient {
 
@@ -54,7 +55,7 @@ static bool extractString(const redisReply *reply, std::string &out) {
     return false;
   }
 
-  out = std::string(reply->str, reply->len);
+  out.assign(reply->str, reply->len);
   return true;
 }
 
@@ -109,6 +110,16 @@ bool MessageParser::parse(redisReplyPtr &&reply, Message &out) {
     return false;
   }
 
+  if(reply->elements <= baseIdx) {
+    return false;
+  }
+
+  //----------------------------------------------------------------------------
+  // The only copy out of the reply - from here on, all copies of the message
+  // share these strings.
+  //----------------------------------------------------------------------------
+  std::shared_ptr<Message::Contents> contents = std::make_shared<Message::Contents>();
+  AllocationAccounting::record(AllocationCategory::kPubsub, sizeof(Message::Contents));
 
   //----------------------------------------------------------------------------
   // Is this a kMessage?
@@ -117,8 +128,9 @@ bool MessageParser::parse(redisReplyPtr &&reply, Message &out) {
     if(reply->elements != baseIdx+3) return false;
     out.messageType = MessageType::kMessage;
 
-    if(!extractString(reply->element[baseIdx+1], out.channel)) return false;
-    if(!extractString(reply->element[baseIdx+2], out.payload)) return false;
+    if(!extractString(reply->element[baseIdx+1], contents->channel)) return false;
+    if(!extractString(reply->element[baseIdx+2], contents->payload)) return false;
+    out.data = std::move(contents);
     return true;
   }
 
@@ -129,9 +141,10 @@ bool MessageParser::parse(redisReplyPtr &&reply, Message &out) {
     if(reply->elements != baseIdx+4) return false;
     out.messageType = MessageType::kPatternMessage;
 
-    if(!extractString(reply->element[baseIdx+1], out.pattern)) return false;
-    if(!extractString(reply->element[baseIdx+2], out.channel)) return false;
-    if(!extractString(reply->element[baseIdx+3], out.payload)) return false;
+    if(!extractString(reply->element[baseIdx+1], contents->pattern)) return false;
+    if(!extractString(reply->element[baseIdx+2], contents->channel)) return false;
+    if(!extractString(reply->element[baseIdx+3], contents->payload)) return false;
+    out.data = std::move(contents);
     return true;
   }
 
@@ -142,8 +155,9 @@ bool MessageParser::parse(redisReplyPtr &&reply, Message &out) {
     if(reply->elements != baseIdx+3) return false;
     out.messageType = MessageType::kSubscribe;
 
-    if(!extractString(reply->element[baseIdx+1], out.channel)) return false;
+    if(!extractString(reply->element[baseIdx+1], contents->channel)) return false;
     if(!extractInteger(reply->element[baseIdx+2], out.activeSubscriptions)) return false;
+    out.data = std::move(contents);
     return true;
   }
 
@@ -154,8 +168,9 @@ bool MessageParser::parse(redisReplyPtr &&reply, Message &out) {
     if(reply->elements != baseIdx+3) return false;
     out.messageType = MessageType::kPatternSubscribe;
 
-    if(!extractString(reply->element[baseIdx+1], out.pattern)) return false;
+    if(!extractString(reply->element[baseIdx+1], contents->pattern)) return false;
     if(!extractInteger(reply->element[baseIdx+2], out.activeSubscriptions)) return false;
+    out.data = std::move(contents);
     return true;
   }
 
@@ -166,8 +181,9 @@ bool MessageParser::parse(redisReplyPtr &&reply, Message &out) {
     if(reply->elements != baseIdx+3) return false;
     out.messageType = MessageType::kUnsubscribe;
 
-    if(!extractString(reply->element[baseIdx+1], out.channel)) return false;
+    if(!extractString(reply->element[baseIdx+1], contents->channel)) return false;
     if(!extractInteger(reply->element[baseIdx+2], out.activeSubscriptions)) return false;
+    out.data = std::move(contents);
     return true;
   }
 
@@ -178,8 +194,9 @@ bool MessageParser::parse(redisReplyPtr &&reply, Message &out) {
     if(reply->elements != baseIdx+3) return false;
     out.messageType = MessageType::kPatternUnsubscribe;
 
-    if(!extractString(reply->element[baseIdx+1], out.pattern)) return false;
+    if(!extractString(reply->element[baseIdx+1], contents->pattern)) return false;
     if(!extractInteger(reply->element[baseIdx+2], out.activeSubscriptions)) return false;
+    out.data = std::move(contents);
     return true;
   }
 
@@ -24,6 +24,11 @@
 #include "qclient/pubsub/Subscriber.hh"
 #include "qclient/pubsub/Message.hh"
 #include "qclient/pubsub/MessageListener.hh"
+#include "qclient/Handshake.hh"
+#include "qclient/MemoryBudget.hh"
+#include "qclient/pubsub/SubscriptionDispatcher.hh"
+#include <algorithm>
+#include <limits>
 
 namespace qclient {
 
@@ -42,28 +47,197 @@ private:
   Subscriber *subscriber;
 };
 
+//------------------------------------------------------------------------------
+// How much a queued message counts against maxBytes
+//------------------------------------------------------------------------------
+static size_t weigh(const Message &msg) {
+  return msg.getChannel().size() + msg.getPattern().size() + msg.getPayload().size();
+}
+
 //------------------------------------------------------------------------------
 // Constructor
 //------------------------------------------------------------------------------
-Subscription::Subscription(Subscriber* sub) : subscriber(sub) {}
+Subscription::Subscription(Subscriber* sub, const SubscriptionLimits &lim)
+: limits(lim), budget(sub ? sub->memoryBudget : nullptr),
+  bounded(lim.bounded() || budget),
+  dispatcher(sub ? sub->dispatcher : nullptr), subscriber(sub) {}
 
 //------------------------------------------------------------------------------
-// Destructor - notify subscriber we're shutting down
+// Destructor - notify subscriber we're shutting down, wait for anything
+// still with the dispatcher, then give back whatever is still queued.
 //------------------------------------------------------------------------------
 Subscription::~Subscription() {
   if(subscriber) {
     subscriber->unsubscribe(this);
     subscriber = nullptr;
   }
+
+  waitForDispatched();
+
+  if(budget) {
+    queue.detach();
+    budget->release(MemoryBudget::Category::kQueuedMessages, queuedBytes.exchange(0));
+  }
 }
 
 //------------------------------------------------------------------------------
 // Process incoming message
 //------------------------------------------------------------------------------
 void Subscription::processIncoming(const Message &msg) {
+  if(bounded) {
+    admit(msg);
+    return;
+  }
+
   queue.emplace_back(msg);
 }
 
+//------------------------------------------------------------------------------
+// Conflation key of the given message
+//------------------------------------------------------------------------------
+std::string Subscription::conflationKey(const Message &msg) const {
+  if(limits.conflationKey) {
+    return limits.conflationKey(msg);
+  }
+
+  return msg.getChannel();
+}
+
+//------------------------------------------------------------------------------
+// Would queueing another message of this weight exceed the limits?
+//------------------------------------------------------------------------------
+bool Subscription::wouldOverflow(size_t weight) const {
+  if(limits.maxMessages != 0 && queue.size() + 1 > limits.maxMessages) {
+    return true;
+  }
+
+  return limits.maxBytes != 0 && queuedBytes + weight > limits.maxBytes;
+}
+
+//------------------------------------------------------------------------------
+// Memory budget accounting of queued messages
+//------------------------------------------------------------------------------
+bool Subscription::takeBudget(size_t weight) {
+  if(!budget || budget->tryAcquire(MemoryBudget::Category::kQueuedMessages, weight)) {
+    return true;
+  }
+
+  budget->recordShed();
+  return false;
+}
+
+void Subscription::releaseBytes(size_t weight) {
+  queuedBytes -= weight;
+
+  if(budget) {
+    budget->release(MemoryBudget::Category::kQueuedMessages, weight);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Bounded mode: admit msg according to the policy. Decide under limitMtx,
+// but queue without it - in attached mode, queueing runs the callback,
+// which settles under limitMtx itself.
+//------------------------------------------------------------------------------
+void Subscription::admit(const Message &msg) {
+  size_t weight = weigh(msg);
+
+  {
+    std::lock_guard<std::mutex> lock(limitMtx);
+
+    if(limits.policy == OverflowPolicy::kConflate) {
+      std::string key = conflationKey(msg);
+      auto it = pending.find(key);
+
+      if(it != pending.end()) {
+        if(it->second.replaced) {
+          releaseBytes(weigh(it->second.replacement));
+        }
+
+        // Superseding keeps the number of keys bounded - never shed
+        it->second.replacement = msg;
+        it->second.replaced = true;
+        it->second.version++;
+        queuedBytes += weight;
+        if(budget) budget->charge(MemoryBudget::Category::kQueuedMessages, weight);
+        conflated++;
+        return;
+      }
+
+      if(wouldOverflow(weight) || !takeBudget(weight)) {
+        dropped++;
+        return;
+      }
+
+      pending.emplace(std::move(key), Pending());
+    }
+    else if(limits.policy == OverflowPolicy::kDropNewest) {
+      if(wouldOverflow(weight) || !takeBudget(weight)) {
+        dropped++;
+        return;
+      }
+    }
+    else {
+      std::vector<Message> evicted;
+      while(wouldOverflow(weight) && queue.popBatch(evicted, 1) != 0u) {
+        settle(evicted.back(), false);
+        dropped++;
+      }
+
+      while(!takeBudget(weight)) {
+        if(queue.popBatch(evicted, 1) == 0u) {
+          dropped++;
+          return;
+        }
+
+        settle(evicted.back(), false);
+        dropped++;
+      }
+    }
+
+    queuedBytes += weight;
+  }
+
+  queue.emplace_back(msg);
+}
+
+//------------------------------------------------------------------------------
+// Bounded mode: account for a message leaving the queue
+//------------------------------------------------------------------------------
+bool Subscription::settle(Message &msg, bool viaFront) {
+  releaseBytes(weigh(msg));
+
+  if(pending.empty()) {
+    return true;
+  }
+
+  auto it = pending.find(conflationKey(msg));
+  if(it == pending.end()) {
+    return true;
+  }
+
+  if(!it->second.replaced) {
+    pending.erase(it);
+    return true;
+  }
+
+  if(viaFront && it->second.version != observedVersion) {
+    //--------------------------------------------------------------------------
+    // The consumer saw an older version than the latest - hand the latest
+    // back, to be queued again. Its bytes stay accounted for.
+    //--------------------------------------------------------------------------
+    msg = std::move(it->second.replacement);
+    it->second.replacement.clear();
+    it->second.replaced = false;
+    return false;
+  }
+
+  releaseBytes(weigh(it->second.replacement));
+  msg = std::move(it->second.replacement);
+  pending.erase(it);
+  return true;
+}
+
 //------------------------------------------------------------------------------
 // Is the queue empty?
 //------------------------------------------------------------------------------
@@ -75,7 +249,48 @@ bool Subscription::empty() const {
 // Remove the oldest received message, ie the front of the queue.
 //------------------------------------------------------------------------------
 void Subscription::pop_front() {
-  return queue.pop_front();
+  if(!bounded) {
+    return queue.pop_front();
+  }
+
+  std::vector<Message> popped;
+  bool again = false;
+
+  {
+    std::lock_guard<std::mutex> lock(limitMtx);
+    if(queue.popBatch(popped, 1) != 0u) {
+      again = !settle(popped.back(), true);
+    }
+  }
+
+  if(again) {
+    queue.emplace_back(std::move(popped.back()));
+  }
+}
+
+//------------------------------------------------------------------------------
+// Move up to max of the oldest messages into out
+//------------------------------------------------------------------------------
+size_t Subscription::popBatch(std::vector<Message> &out, size_t max) {
+  if(!bounded) {
+    return queue.popBatch(out, max);
+  }
+
+  std::lock_guard<std::mutex> lock(limitMtx);
+  size_t count = queue.popBatch(out, max);
+
+  for(size_t i = out.size() - count; i < out.size(); i++) {
+    settle(out[i], false);
+  }
+
+  return count;
+}
+
+//------------------------------------------------------------------------------
+// Move all queued messages into out
+//------------------------------------------------------------------------------
+size_t Subscription::drain(std::vector<Message> &out) {
+  return popBatch(out, std::numeric_limits<size_t>::max());
 }
 
 //------------------------------------------------------------------------------
@@ -83,11 +298,27 @@ void Subscription::pop_front() {
 // is empty.
 //------------------------------------------------------------------------------
 bool Subscription::front(Message &out) const {
+  std::unique_lock<std::mutex> lock(limitMtx, std::defer_lock);
+  if(bounded) {
+    lock.lock();
+  }
+
   if(queue.size() == 0) {
     return false;
   }
 
   out = queue.front();
+
+  if(!pending.empty()) {
+    auto it = pending.find(conflationKey(out));
+    if(it != pending.end()) {
+      observedVersion = it->second.version;
+      if(it->second.replaced) {
+        out = it->second.replacement;
+      }
+    }
+  }
+
   return true;
 }
 
@@ -103,7 +334,96 @@ size_t Subscription::size() const {
 // callback.
 //------------------------------------------------------------------------------
 void Subscription::attachCallback(const Callback &cb) {
-  queue.attach(cb);
+  if(subscriber) {
+    subscriber->prioritize(this);
+  }
+
+  Callback deliver = cb;
+
+  if(bounded) {
+    deliver = [this, cb](Message &&msg) {
+      {
+        std::lock_guard<std::mutex> lock(limitMtx);
+        settle(msg, false);
+      }
+
+      cb(std::move(msg));
+    };
+  }
+
+  if(!dispatcher) {
+    return queue.attach(deliver);
+  }
+
+  queue.attach([this, deliver](Message &&msg) {
+    dispatch(deliver, std::move(msg));
+  });
+}
+
+//------------------------------------------------------------------------------
+// Dispatcher mode: The subscription being delivered to by this thread, if
+// any. Waiting for ourselves from within the callback would never finish.
+//------------------------------------------------------------------------------
+static thread_local Subscription *currentlyDelivering = nullptr;
+
+//------------------------------------------------------------------------------
+// Hand msg to the worker owning its channel, or pattern. A subscription only
+// ever receives a single channel or pattern, so its callback is never called
+// concurrently with itself.
+//------------------------------------------------------------------------------
+void Subscription::dispatch(const Callback &cb, Message &&msg) {
+  {
+    std::lock_guard<std::mutex> lock(dispatchMtx);
+    inFlight++;
+  }
+
+  std::string key = msg.getPattern().empty() ? msg.getChannel() : msg.getPattern();
+  dispatcher->dispatch(key, [this, cb, msg = std::move(msg)]() mutable {
+    currentlyDelivering = this;
+    cb(std::move(msg));
+    currentlyDelivering = nullptr;
+
+    std::lock_guard<std::mutex> lock(dispatchMtx);
+    if(--inFlight == 0) {
+      dispatchCv.notify_all();
+    }
+  });
+}
+
+//------------------------------------------------------------------------------
+// Wait until everything handed to the dispatcher has been delivered
+//------------------------------------------------------------------------------
+void Subscription::waitForDispatched() {
+  if(!dispatcher || currentlyDelivering == this) {
+    return;
+  }
+
+  std::unique_lock<std::mutex> lock(dispatchMtx);
+  dispatchCv.wait(lock, [this]() { return inFlight == 0; });
+}
+
+//------------------------------------------------------------------------------
+// Same, but receive messages in batches
+//------------------------------------------------------------------------------
+void Subscription::attachBatchCallback(const BatchCallback &cb, size_t maxBatch) {
+  if(subscriber) {
+    subscriber->prioritize(this);
+  }
+
+  if(!bounded) {
+    return queue.attachBatch(cb, maxBatch);
+  }
+
+  queue.attachBatch([this, cb](std::vector<Message> &&batch) {
+    {
+      std::lock_guard<std::mutex> lock(limitMtx);
+      for(Message &msg : batch) {
+        settle(msg, false);
+      }
+    }
+
+    cb(std::move(batch));
+  }, maxBatch);
 }
 
 //------------------------------------------------------------------------------
@@ -111,6 +431,25 @@ void Subscription::attachCallback(const Callback &cb) {
 //------------------------------------------------------------------------------
 void Subscription::detachCallback() {
   queue.detach();
+  waitForDispatched();
+}
+
+//------------------------------------------------------------------------------
+// Overflow counters
+//------------------------------------------------------------------------------
+uint64_t Subscription::getDropped() const {
+  return dropped;
+}
+
+uint64_t Subscription::getConflated() const {
+  return conflated;
+}
+
+//------------------------------------------------------------------------------
+// Bytes currently queued
+//------------------------------------------------------------------------------
+size_t Subscription::getQueuedBytes() const {
+  return queuedBytes;
 }
 
 //------------------------------------------------------------------------------
@@ -127,33 +466,132 @@ void Subscription::markAcknowledged() {
   isAcknowledged = true;
 }
 
+//------------------------------------------------------------------------------
+// Copy options for an additional shard
+//------------------------------------------------------------------------------
+static SubscriptionOptions cloneOptions(const SubscriptionOptions &opts) {
+  SubscriptionOptions options;
+  options.tlsconfig = opts.tlsconfig;
+  options.logger = opts.logger;
+  options.usePushTypes = opts.usePushTypes;
+  options.dnsCache = opts.dnsCache;
+  options.latencyProber = opts.latencyProber;
+  options.socketProfile = opts.socketProfile;
+  options.shards = opts.shards;
+  options.resubscribeChunkSize = opts.resubscribeChunkSize;
+  options.memoryBudget = opts.memoryBudget;
+  options.dispatcher = opts.dispatcher;
+
+  if(opts.handshake) {
+    options.handshake = opts.handshake->clone();
+  }
+
+  return options;
+}
+
 //------------------------------------------------------------------------------
 // Constructor - real mode, connect to a real server
 //------------------------------------------------------------------------------
 Subscriber::Subscriber(const Members &members, SubscriptionOptions &&options, Logger *log)
-: /*logger(log),*/ listener(new SubscriberListener(this)),
-  base(new BaseSubscriber(members, listener, std::move(options))) {}
+: /*logger(log),*/ listener(new SubscriberListener(this)), memoryBudget(options.memoryBudget),
+  dispatcher(options.dispatcher) {
+
+  size_t count = std::max<size_t>(options.shards, 1u);
+  shards.resize(count);
+
+  for(size_t i = 1; i < count; i++) {
+    shards[i].reset(new BaseSubscriber(members, listener, cloneOptions(options)));
+  }
+
+  shards[0].reset(new BaseSubscriber(members, listener, std::move(options)));
+}
 
 //------------------------------------------------------------------------------
 // Simulated mode - enable ability to feed fake messages for testing
 // this class
 //------------------------------------------------------------------------------
-Subscriber::Subscriber() {}
+Subscriber::Subscriber(std::shared_ptr<MemoryBudget> budget,
+  std::shared_ptr<SubscriptionDispatcher> disp)
+: memoryBudget(std::move(budget)), dispatcher(std::move(disp)) {}
+
+//------------------------------------------------------------------------------
+// Destructor - stop the connections before the index they dispatch into
+//------------------------------------------------------------------------------
+Subscriber::~Subscriber() {
+  shards.clear();
+}
 
 //------------------------------------------------------------------------------
 // Receive notification about a Subscription being destroyed
 //------------------------------------------------------------------------------
 void Subscriber::unsubscribe(Subscription *subscription) {
-  std::lock_guard<std::mutex> lock(mtx);
+  std::shared_ptr<Slot> slot;
+
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+
+    auto it = reverseIndex.find(subscription);
+    if(it == reverseIndex.end()) {
+      // Something is not right, warn.. TODO
+      return;
+    }
+
+    SlotIndex &index = it->second.pattern ? patternIndex : channelIndex;
+    slot = std::move(it->second.slot);
+
+    auto target = index.find(it->second.key);
+    if(target != index.end()) {
+      std::shared_ptr<SlotList> updated = std::make_shared<SlotList>();
+      for(const std::shared_ptr<Slot> &other : *target->second) {
+        if(other != slot) {
+          updated->push_back(other);
+        }
+      }
+
+      if(updated->empty()) {
+        index.erase(target);
+      }
+      else {
+        target->second = std::move(updated);
+      }
+    }
+
+    reverseIndex.erase(it);
+  }
+
+  //----------------------------------------------------------------------------
+  // A dispatch may still hold a list containing this slot: wait out any
+  // delivery in flight, and make sure no further one reaches us.
+  //----------------------------------------------------------------------------
+  std::lock_guard<std::mutex> lock(slot->mtx);
+  slot->subscription = nullptr;
+}
 
-  auto it = reverseChannelSubscriptions.find(subscription);
-  if(it == reverseChannelSubscriptions.end()) {
-    // Something is not right, warn.. TODO
+//------------------------------------------------------------------------------
+// A callback got attached to the given Subscription - resubscribe to its
+// channel first after reconnecting
+//------------------------------------------------------------------------------
+void Subscriber::prioritize(Subscription *subscription) {
+  if(shards.empty()) {
     return;
   }
 
-  channelSubscriptions.erase(it->second);
-  reverseChannelSubscriptions.erase(it);
+  bool pattern;
+  std::string key;
+
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+
+    auto it = reverseIndex.find(subscription);
+    if(it == reverseIndex.end()) {
+      return;
+    }
+
+    pattern = it->second.pattern;
+    key = it->second.key;
+  }
+
+  shards[shardOf(key, shards.size())]->prioritize(key, pattern);
 }
 
 //------------------------------------------------------------------------------
@@ -164,46 +602,131 @@ void Subscriber::feedFakeMessage(const Message& msg) {
 }
 
 //------------------------------------------------------------------------------
-// Process incoming message
+// Grab the current slot list for key - null if there's none
 //------------------------------------------------------------------------------
-void Subscriber::processIncomingMessage(const Message &msg) {
+std::shared_ptr<const Subscriber::SlotList> Subscriber::lookup(const SlotIndex &index,
+  const std::string &key) {
+
   std::lock_guard<std::mutex> lock(mtx);
 
-  if(msg.getMessageType() == MessageType::kSubscribe) {
-    auto targetChannel = channelSubscriptions.find(msg.getChannel());
-    if(targetChannel != channelSubscriptions.end()) {
-      targetChannel->second->markAcknowledged();
-    }
+  auto it = index.find(key);
+  if(it == index.end()) {
+    return {};
+  }
 
+  return it->second;
+}
+
+//------------------------------------------------------------------------------
+// Mark the oldest unacknowledged subscription under key as acknowledged -
+// each subscription sends its own subscribe command, in order.
+//------------------------------------------------------------------------------
+void Subscriber::processAcknowledgement(const SlotIndex &index, const std::string &key) {
+  std::shared_ptr<const SlotList> slots = lookup(index, key);
+  if(!slots) {
     return;
   }
 
-  if(msg.getMessageType() != MessageType::kMessage &&
-     msg.getMessageType() != MessageType::kPatternMessage) {
+  for(const std::shared_ptr<Slot> &slot : *slots) {
+    std::lock_guard<std::mutex> lock(slot->mtx);
+    if(slot->subscription && !slot->subscription->acknowledged()) {
+      slot->subscription->markAcknowledged();
+      return;
+    }
+  }
+}
+
+//------------------------------------------------------------------------------
+// Process incoming message
+//------------------------------------------------------------------------------
+void Subscriber::processIncomingMessage(const Message &msg) {
+  std::shared_ptr<const SlotList> slots;
+
+  switch(msg.getMessageType()) {
+    case MessageType::kSubscribe: {
+      processAcknowledgement(channelIndex, msg.getChannel());
+      return;
+    }
+    case MessageType::kPatternSubscribe: {
+      processAcknowledgement(patternIndex, msg.getPattern());
+      return;
+    }
+    case MessageType::kMessage: {
+      slots = lookup(channelIndex, msg.getChannel());
+      break;
+    }
+    case MessageType::kPatternMessage: {
+      //------------------------------------------------------------------------
+      // The server tells us which pattern matched, no need to match again
+      //------------------------------------------------------------------------
+      slots = lookup(patternIndex, msg.getPattern());
+      break;
+    }
+    default: {
+      return;
+    }
+  }
+
+  if(!slots) {
     return;
   }
 
   //----------------------------------------------------------------------------
-  // Feed to channel subscriptions
+  // Feed to subscriptions - mtx is not held, callbacks may subscribe or
+  // unsubscribe others freely
   //----------------------------------------------------------------------------
-  auto channels = channelSubscriptions.equal_range(msg.getChannel());
-  for(auto it = channels.first; it != channels.second; it++) {
-    it->second->processIncoming(msg);
+  for(const std::shared_ptr<Slot> &slot : *slots) {
+    std::lock_guard<std::mutex> lock(slot->mtx);
+    if(slot->subscription) {
+      slot->subscription->processIncoming(msg);
+    }
   }
 }
 
 //------------------------------------------------------------------------------
-// Subscribe to the given channel through a Subscription object
+// Add subscription to the index, under key
 //------------------------------------------------------------------------------
-std::unique_ptr<Subscription> Subscriber::subscribe(const std::string &channel) {
+std::unique_ptr<Subscription> Subscriber::addSubscription(bool pattern, const std::string &key,
+  const SubscriptionLimits &limits) {
   std::lock_guard<std::mutex> lock(mtx);
 
-  std::unique_ptr<Subscription> subscription = std::make_unique<Subscription>(this);
-  auto it = channelSubscriptions.emplace(channel, subscription.get());
-  reverseChannelSubscriptions.emplace(subscription.get(), it);
+  std::unique_ptr<Subscription> subscription = std::make_unique<Subscription>(this, limits);
+  std::shared_ptr<Slot> slot = std::make_shared<Slot>(subscription.get());
+
+  SlotIndex &index = pattern ? patternIndex : channelIndex;
+  std::shared_ptr<const SlotList> &current = index[key];
+
+  std::shared_ptr<SlotList> updated = current ? std::make_shared<SlotList>(*current) : std::make_shared<SlotList>();
+  updated->push_back(slot);
+  current = std::move(updated);
+
+  reverseIndex.emplace(subscription.get(), IndexEntry { pattern, key, std::move(slot) });
+  return subscription;
+}
+
+//------------------------------------------------------------------------------
+// Subscribe to the given channel through a Subscription object
+//------------------------------------------------------------------------------
+std::unique_ptr<Subscription> Subscriber::subscribe(const std::string &channel,
+  const SubscriptionLimits &limits) {
+  std::unique_ptr<Subscription> subscription = addSubscription(false, channel, limits);
+
+  if(!shards.empty()) {
+    shards[shardOf(channel, shards.size())]->subscribe( {channel} );
+  }
+
+  return subscription;
+}
+
+//------------------------------------------------------------------------------
+// Subscribe to the given pattern through a Subscription object
+//------------------------------------------------------------------------------
+std::unique_ptr<Subscription> Subscriber::psubscribe(const std::string &pattern,
+  const SubscriptionLimits &limits) {
+  std::unique_ptr<Subscription> subscription = addSubscription(true, pattern, limits);
 
-  if(base) {
-    base->subscribe( {channel} );
+  if(!shards.empty()) {
+    shards[shardOf(pattern, shards.size())]->psubscribe( {pattern} );
   }
 
   return subscription;
@@ -213,11 +736,30 @@ std::unique_ptr<Subscription> Subscriber::subscribe(const std::string &channel)
 // Get underlying QClient - lifetime tied to this object
 //------------------------------------------------------------------------------
 qclient::QClient* Subscriber::getQcl() {
-  if(base) {
-    return base->getQcl();
+  if(!shards.empty()) {
+    return shards[0]->getQcl();
   }
 
   return nullptr;
 }
 
+//------------------------------------------------------------------------------
+// Number of underlying connections
+//------------------------------------------------------------------------------
+size_t Subscriber::getShardCount() const {
+  return shards.size();
+}
+
+//------------------------------------------------------------------------------
+// Which connection the given channel or pattern is subscribed through - every
+// message of a channel arrives over the same one, so ordering is kept.
+//------------------------------------------------------------------------------
+size_t Subscriber::shardOf(const std::string &key, size_t count) {
+  if(count <= 1) {
+    return 0;
+  }
+
+  return std::hash<std::string>()(key) % count;
+}
+
 }
@@ -0,0 +1,127 @@
+// ----------------------------------------------------------------------
+// File: SubscriptionDispatcher.cc
+// Author: Georgios Bitzes - CERN
+// ----------------------------------------------------------------------
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2019 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+
+#include "qclient/pubsub/SubscriptionDispatcher.hh"
+#include <algorithm>
+
+namespace qclient {
+
+//------------------------------------------------------------------------------
+// Constructor
+//------------------------------------------------------------------------------
+SubscriptionDispatcher::SubscriptionDispatcher(size_t threads) {
+  workers.resize(std::max<size_t>(threads, 1u));
+
+  for(std::unique_ptr<Worker> &worker : workers) {
+    worker.reset(new Worker());
+    worker->thread.reset(&SubscriptionDispatcher::work, this, worker.get());
+  }
+}
+
+//------------------------------------------------------------------------------
+// Destructor - workers only exit once their queue is empty
+//------------------------------------------------------------------------------
+SubscriptionDispatcher::~SubscriptionDispatcher() {
+  for(std::unique_ptr<Worker> &worker : workers) {
+    std::lock_guard<std::mutex> lock(worker->mtx);
+    worker->thread.stop();
+    worker->cv.notify_all();
+  }
+
+  for(std::unique_ptr<Worker> &worker : workers) {
+    worker->thread.join();
+  }
+}
+
+//------------------------------------------------------------------------------
+// Number of threads in the pool
+//------------------------------------------------------------------------------
+size_t SubscriptionDispatcher::size() const {
+  return workers.size();
+}
+
+//------------------------------------------------------------------------------
+// Which worker runs tasks dispatched under the given key
+//------------------------------------------------------------------------------
+size_t SubscriptionDispatcher::workerOf(const std::string &key) const {
+  return std::hash<std::string>()(key) % workers.size();
+}
+
+//------------------------------------------------------------------------------
+// Queue task on the worker owning key
+//------------------------------------------------------------------------------
+void SubscriptionDispatcher::dispatch(const std::string &key, Task &&task) {
+  Worker *worker = workers[workerOf(key)].get();
+
+  std::lock_guard<std::mutex> lock(worker->mtx);
+  worker->tasks.emplace_back(std::move(task));
+  worker->cv.notify_one();
+}
+
+//------------------------------------------------------------------------------
+// Number of tasks dispatched, and not yet finished
+//------------------------------------------------------------------------------
+size_t SubscriptionDispatcher::getPending() const {
+  size_t pending = 0;
+
+  for(const std::unique_ptr<Worker> &worker : workers) {
+    std::lock_guard<std::mutex> lock(worker->mtx);
+    pending += worker->tasks.size() + worker->running;
+  }
+
+  return pending;
+}
+
+//------------------------------------------------------------------------------
+// Worker thread: Run tasks in the order they were dispatched. Termination is
+// requested under the worker lock, so checking for it there can't miss the
+// notification.
+//------------------------------------------------------------------------------
+void SubscriptionDispatcher::work(Worker *worker, ThreadAssistant &assistant) {
+  std::unique_lock<std::mutex> lock(worker->mtx);
+
+  while(true) {
+    if(worker->tasks.empty()) {
+      if(assistant.terminationRequested()) {
+        return;
+      }
+
+      worker->cv.wait(lock);
+      continue;
+    }
+
+    Task task = std::move(worker->tasks.front());
+    worker->tasks.pop_front();
+    worker->running = 1;
+
+    lock.unlock();
+    task();
+    task = {};
+    lock.lock();
+
+    worker->running = 0;
+  }
+}
+
+}
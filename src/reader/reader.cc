@@ -56,7 +56,35 @@
 #include "reader.hh"
 #include "sds.hh"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define QCLIENT_READER_HAVE_AVX2 1
+#endif
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
 #include "qclient/Reply.hh"
+#include "qclient/utils/AllocationAccounting.hh"
+
+using qclient::AllocationAccounting;
+using qclient::AllocationCategory;
+
+/* Task type of a RESP3 blob error while it's being read: The reply is a
+ * regular REDIS_REPLY_ERROR. */
+#define REDIS_READER_BLOB_ERROR 100
+
+/* Types which contain other replies. */
+static int isAggregateType(int type) {
+    return type == REDIS_REPLY_ARRAY || type == REDIS_REPLY_PUSH ||
+           type == REDIS_REPLY_MAP || type == REDIS_REPLY_SET ||
+           type == REDIS_REPLY_ATTR;
+}
 
 /* Create a reply object */
 static redisReply *createReplyObject(int type) {
@@ -65,6 +93,8 @@ static redisReply *createReplyObject(int type) {
     if (r == NULL)
         return NULL;
 
+    AllocationAccounting::record(AllocationCategory::kParsing, sizeof(*r));
+
     r->type = type;
     return r;
 }
@@ -79,9 +109,14 @@ void freeReplyObject(void *reply) {
 
     switch(r->type) {
     case REDIS_REPLY_INTEGER:
+    case REDIS_REPLY_BOOL:
+    case REDIS_REPLY_NIL:
         break; /* Nothing to free */
     case REDIS_REPLY_ARRAY:
     case REDIS_REPLY_PUSH:
+    case REDIS_REPLY_MAP:
+    case REDIS_REPLY_SET:
+    case REDIS_REPLY_ATTR:
         if (r->element != NULL) {
             for (j = 0; j < r->elements; j++)
                 freeReplyObject(r->element[j]);
@@ -91,17 +126,45 @@ void freeReplyObject(void *reply) {
     case REDIS_REPLY_ERROR:
     case REDIS_REPLY_STATUS:
     case REDIS_REPLY_STRING:
+    case REDIS_REPLY_DOUBLE:
+    case REDIS_REPLY_BIGNUM:
+    case REDIS_REPLY_VERB:
         free(r->str);
         break;
     }
     free(r);
 }
 
+/* Free the root object of a reply - privdata is the one the reply started
+ * out with. */
+static void freeReplyRoot(redisReader *r, void *obj) {
+    if (r->fn && r->fn->freeRoot)
+        r->fn->freeRoot(r->rstack[0].privdata,obj);
+    else if (r->fn && r->fn->freeObject)
+        r->fn->freeObject(obj);
+}
+
+/* Attributes which are still being read are not attached to any reply, free
+ * them separately. The root one, if any, is r->reply. */
+static void freePendingAttributes(redisReader *r) {
+    int i;
+
+    for (i = 1; i <= r->ridx; i++) {
+        redisReadTask *task = &(r->rstack[i]);
+        if (task->type == REDIS_REPLY_ATTR && task->obj != NULL) {
+            if (r->fn && r->fn->freeObject)
+                r->fn->freeObject(task->obj);
+            task->obj = NULL;
+        }
+    }
+}
+
 static void __redisReaderSetError(redisReader *r, int type, const char *str) {
     size_t len;
 
-    if (r->reply != NULL && r->fn && r->fn->freeObject) {
-        r->fn->freeObject(r->reply);
+    freePendingAttributes(r);
+    if (r->reply != NULL) {
+        freeReplyRoot(r,r->reply);
         r->reply = NULL;
     }
 
@@ -168,8 +231,8 @@ static char *readBytes(redisReader *r, unsigned int bytes) {
     return NULL;
 }
 
-/* Find pointer to \r\n. */
-static char *seekNewline(char *s, size_t len) {
+/* Find pointer to \r\n, scalar version. */
+static char *seekNewlineScalar(char *s, size_t len) {
     int pos = 0;
     int _len = len-1;
 
@@ -195,6 +258,106 @@ static char *seekNewline(char *s, size_t len) {
     return NULL;
 }
 
+/* Vectorised versions: Compare a block against \r, and the same block shifted
+ * by one byte against \n - the first bit set in the combined mask is the
+ * \r\n we're looking for. Whatever doesn't fill an entire block (plus the
+ * extra byte) is handed to the scalar version. */
+#if defined(__SSE2__)
+static char *seekNewlineSSE2(char *s, size_t len) {
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+    size_t pos = 0;
+
+    while (pos + 17 <= len) {
+        __m128i first = _mm_loadu_si128((const __m128i*) (s+pos));
+        __m128i second = _mm_loadu_si128((const __m128i*) (s+pos+1));
+        int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first, cr),
+            _mm_cmpeq_epi8(second, lf)));
+
+        if (mask != 0)
+            return s + pos + __builtin_ctz(mask);
+
+        pos += 16;
+    }
+
+    return seekNewlineScalar(s+pos, len-pos);
+}
+#endif
+
+#if QCLIENT_READER_HAVE_AVX2
+__attribute__((target("avx2")))
+static char *seekNewlineAVX2(char *s, size_t len) {
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i lf = _mm256_set1_epi8('\n');
+    size_t pos = 0;
+
+    while (pos + 33 <= len) {
+        __m256i first = _mm256_loadu_si256((const __m256i*) (s+pos));
+        __m256i second = _mm256_loadu_si256((const __m256i*) (s+pos+1));
+        unsigned int mask = (unsigned int) _mm256_movemask_epi8(_mm256_and_si256(
+            _mm256_cmpeq_epi8(first, cr), _mm256_cmpeq_epi8(second, lf)));
+
+        if (mask != 0)
+            return s + pos + __builtin_ctz(mask);
+
+        pos += 32;
+    }
+
+    return seekNewlineSSE2(s+pos, len-pos);
+}
+#endif
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+static char *seekNewlineNEON(char *s, size_t len) {
+    const uint8x16_t cr = vdupq_n_u8('\r');
+    const uint8x16_t lf = vdupq_n_u8('\n');
+    size_t pos = 0;
+
+    while (pos + 17 <= len) {
+        uint8x16_t first = vld1q_u8((const uint8_t*) (s+pos));
+        uint8x16_t second = vld1q_u8((const uint8_t*) (s+pos+1));
+        uint8x16_t match = vandq_u8(vceqq_u8(first, cr), vceqq_u8(second, lf));
+
+        if (vmaxvq_u8(match) != 0)
+            return seekNewlineScalar(s+pos, 17);
+
+        pos += 16;
+    }
+
+    return seekNewlineScalar(s+pos, len-pos);
+}
+#endif
+
+/* Pick the best implementation this CPU supports, once. */
+typedef char *(*seekNewlineFunction)(char*, size_t);
+
+static seekNewlineFunction chooseSeekNewline(void) {
+#if QCLIENT_READER_HAVE_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return seekNewlineAVX2;
+#endif
+#if defined(__SSE2__)
+    return seekNewlineSSE2;
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    return seekNewlineNEON;
+#else
+    return seekNewlineScalar;
+#endif
+}
+
+static const seekNewlineFunction seekNewlineImpl = chooseSeekNewline();
+
+/* Find pointer to \r\n. */
+static char *seekNewline(char *s, size_t len) {
+    /* Most lines are short headers such as "$5", for which the scalar
+     * version is fastest. */
+    if (len < 16)
+        return seekNewlineScalar(s, len);
+
+    return seekNewlineImpl(s, len);
+}
+
 /* Convert a string into a long long. Returns REDIS_OK if the string could be
  * parsed into a (non-overflowing) long long, REDIS_ERR otherwise. The value
  * will be set to the parsed value when appropriate.
@@ -285,18 +448,40 @@ static char *readLine(redisReader *r, int *_len) {
     return NULL;
 }
 
+/* An attribute only annotates the value following it, which is the actual
+ * reply, or element of the parent aggregate. Drop the attribute once it's
+ * complete, and read that value into the same task. */
+static void discardAttribute(redisReader *r, redisReadTask *cur) {
+    if (r->ridx == 0) {
+        if (cur->obj != NULL)
+            freeReplyRoot(r,cur->obj);
+        r->reply = NULL;
+    } else if (cur->obj != NULL && r->fn && r->fn->freeObject) {
+        r->fn->freeObject(cur->obj);
+    }
+
+    cur->type = -1;
+    cur->elements = -1;
+    cur->obj = NULL;
+}
+
 static void moveToNextTask(redisReader *r) {
     redisReadTask *cur, *prv;
     while (r->ridx >= 0) {
+        cur = &(r->rstack[r->ridx]);
+        if (cur->type == REDIS_REPLY_ATTR) {
+            discardAttribute(r,cur);
+            return;
+        }
+
         /* Return a.s.a.p. when the stack is now empty. */
         if (r->ridx == 0) {
             r->ridx--;
             return;
         }
 
-        cur = &(r->rstack[r->ridx]);
         prv = &(r->rstack[r->ridx-1]);
-        assert(prv->type == REDIS_REPLY_ARRAY || prv->type == REDIS_REPLY_PUSH);
+        assert(isAggregateType(prv->type));
         if (cur->idx == prv->elements-1) {
             r->ridx--;
         } else {
@@ -304,6 +489,7 @@ static void moveToNextTask(redisReader *r) {
             assert(cur->idx < prv->elements);
             cur->type = -1;
             cur->elements = -1;
+            cur->obj = NULL;
             cur->idx++;
             return;
         }
@@ -329,6 +515,71 @@ static int processLineItem(redisReader *r) {
             } else {
                 obj = (void*)REDIS_REPLY_INTEGER;
             }
+        } else if (cur->type == REDIS_REPLY_DOUBLE) {
+            char buf[326], *eptr;
+            double d;
+
+            /* strtod also takes care of inf, -inf and nan. */
+            if ((size_t)len >= sizeof(buf)) {
+                __redisReaderSetError(r,REDIS_ERR_PROTOCOL,
+                        "Double value is too large");
+                return REDIS_ERR;
+            }
+
+            memcpy(buf,p,len);
+            buf[len] = '\0';
+            d = strtod(buf,&eptr);
+            if (len == 0 || eptr[0] != '\0') {
+                __redisReaderSetError(r,REDIS_ERR_PROTOCOL,
+                        "Bad double value");
+                return REDIS_ERR;
+            }
+
+            if (r->fn && r->fn->createDouble)
+                obj = r->fn->createDouble(cur,d,p,len);
+            else
+                obj = (void*)REDIS_REPLY_DOUBLE;
+        } else if (cur->type == REDIS_REPLY_NIL) {
+            if (len != 0) {
+                __redisReaderSetError(r,REDIS_ERR_PROTOCOL,
+                        "Bad nil value");
+                return REDIS_ERR;
+            }
+
+            if (r->fn && r->fn->createNil)
+                obj = r->fn->createNil(cur);
+            else
+                obj = (void*)REDIS_REPLY_NIL;
+        } else if (cur->type == REDIS_REPLY_BOOL) {
+            if (len != 1 || (p[0] != 't' && p[0] != 'f')) {
+                __redisReaderSetError(r,REDIS_ERR_PROTOCOL,
+                        "Bad bool value");
+                return REDIS_ERR;
+            }
+
+            if (r->fn && r->fn->createBool)
+                obj = r->fn->createBool(cur,p[0] == 't');
+            else
+                obj = (void*)REDIS_REPLY_BOOL;
+        } else if (cur->type == REDIS_REPLY_BIGNUM) {
+            int i;
+
+            /* An optional minus sign, followed by at least one digit. */
+            for (i = (len > 0 && p[0] == '-'); i < len; i++) {
+                if (p[i] < '0' || p[i] > '9')
+                    break;
+            }
+
+            if (i != len || len == 0 || (p[0] == '-' && len == 1)) {
+                __redisReaderSetError(r,REDIS_ERR_PROTOCOL,
+                        "Bad big number value");
+                return REDIS_ERR;
+            }
+
+            if (r->fn && r->fn->createString)
+                obj = r->fn->createString(cur,p,len);
+            else
+                obj = (void*)REDIS_REPLY_BIGNUM;
         } else {
             /* Type will be error or status. */
             if (r->fn && r->fn->createString)
@@ -351,6 +602,98 @@ static int processLineItem(redisReader *r) {
     return REDIS_ERR;
 }
 
+/* Move as many bytes as possible from the read buffer into the large bulk
+ * string in progress, and create the reply once it's complete. */
+static int processLargeBulkItem(redisReader *r) {
+    redisReadTask *cur = &(r->rstack[r->ridx]);
+    void *obj = NULL;
+    size_t wanted, available;
+
+    wanted = r->bulkLen+2 - r->bulkFilled;
+    available = r->len - r->pos;
+    if (available > wanted)
+        available = wanted;
+
+    memcpy(r->bulk+r->bulkFilled, r->buf+r->pos, available);
+    r->bulkFilled += available;
+    r->pos += available;
+
+    if (r->bulkFilled < r->bulkLen+2)
+        return REDIS_ERR; /* Incomplete, wait for more data */
+
+    /* Replace \r with the terminator every string reply carries. */
+    r->bulk[r->bulkLen] = '\0';
+
+    if (r->fn && r->fn->adoptString) {
+        obj = r->fn->adoptString(cur,r->bulk,r->bulkLen);
+        if (obj == NULL)
+            free(r->bulk);
+    } else {
+        if (r->fn && r->fn->createString)
+            obj = r->fn->createString(cur,r->bulk,r->bulkLen);
+        else
+            obj = (void*)REDIS_REPLY_STRING;
+        free(r->bulk);
+    }
+
+    r->bulk = NULL;
+
+    if (obj == NULL) {
+        __redisReaderSetErrorOOM(r);
+        return REDIS_ERR;
+    }
+
+    /* Set reply if this is the root object. */
+    if (r->ridx == 0) r->reply = obj;
+    moveToNextTask(r);
+    return REDIS_OK;
+}
+
+/* Pass as many payload bytes as possible from the read buffer to the stream
+ * in progress, and create the (empty) reply once all of it went through. */
+static int processStreamedBulkItem(redisReader *r) {
+    redisReadTask *cur = &(r->rstack[r->ridx]);
+    void *obj;
+    size_t wanted, available, payload = 0;
+
+    wanted = r->bulkLen+2 - r->bulkFilled;
+    available = r->len - r->pos;
+    if (available > wanted)
+        available = wanted;
+
+    /* Leave out the trailing \r\n. */
+    if (r->bulkFilled < r->bulkLen) {
+        payload = r->bulkLen - r->bulkFilled;
+        if (payload > available)
+            payload = available;
+    }
+
+    if (payload > 0)
+        r->streamChunk(r->streamPrivdata,r->buf+r->pos,payload);
+
+    r->bulkFilled += available;
+    r->pos += available;
+
+    if (r->bulkFilled < r->bulkLen+2)
+        return REDIS_ERR; /* Incomplete, wait for more data */
+
+    r->streaming = 0;
+
+    if (r->fn && r->fn->createString)
+        obj = r->fn->createString(cur,(char*)"",0);
+    else
+        obj = (void*)REDIS_REPLY_STRING;
+
+    if (obj == NULL) {
+        __redisReaderSetErrorOOM(r);
+        return REDIS_ERR;
+    }
+
+    r->reply = obj;
+    moveToNextTask(r);
+    return REDIS_OK;
+}
+
 static int processBulkItem(redisReader *r) {
     redisReadTask *cur = &(r->rstack[r->ridx]);
     void *obj = NULL;
@@ -359,6 +702,11 @@ static int processBulkItem(redisReader *r) {
     unsigned long bytelen;
     int success = 0;
 
+    if (r->bulk != NULL)
+        return processLargeBulkItem(r);
+    if (r->streaming)
+        return processStreamedBulkItem(r);
+
     p = r->buf+r->pos;
     s = seekNewline(p,r->len-r->pos);
     if (s != NULL) {
@@ -385,13 +733,52 @@ static int processBulkItem(redisReader *r) {
                 obj = (void*)REDIS_REPLY_NIL;
             success = 1;
         } else {
+            /* Top-level string, which the caller wants to stream. */
+            if (cur->type == REDIS_REPLY_STRING && r->ridx == 0 &&
+                r->streamBegin && r->streamBegin(r->streamPrivdata,len)) {
+                r->streaming = 1;
+                r->bulkLen = len;
+                r->bulkFilled = 0;
+                r->pos += bytelen;
+                return processStreamedBulkItem(r);
+            }
+
+            /* Large and incomplete: switch to a dedicated buffer. */
+            if (cur->type == REDIS_REPLY_STRING && r->bulkThreshold > 0 &&
+                (size_t)len >= r->bulkThreshold &&
+                r->pos+bytelen+len+2 > r->len) {
+                r->bulk = (char*) malloc(len+2);
+                if (r->bulk == NULL) {
+                    __redisReaderSetErrorOOM(r);
+                    return REDIS_ERR;
+                }
+
+                AllocationAccounting::record(AllocationCategory::kParsing, len+2);
+
+                r->bulkLen = len;
+                r->bulkFilled = 0;
+                r->pos += bytelen;
+                return processLargeBulkItem(r);
+            }
+
             /* Only continue when the buffer contains the entire bulk item. */
             bytelen += len+2; /* include \r\n */
             if (r->pos+bytelen <= r->len) {
+                /* Verbatim strings start with a three character content
+                 * type, followed by ':'. */
+                if (cur->type == REDIS_REPLY_VERB && (len < 4 || s[2+3] != ':')) {
+                    __redisReaderSetError(r,REDIS_ERR_PROTOCOL,
+                            "Verbatim string without a valid content type");
+                    return REDIS_ERR;
+                }
+
+                if (cur->type == REDIS_READER_BLOB_ERROR)
+                    cur->type = REDIS_REPLY_ERROR;
+
                 if (r->fn && r->fn->createString)
                     obj = r->fn->createString(cur,s+2,len);
                 else
-                    obj = (void*)REDIS_REPLY_STRING;
+                    obj = (void*)(size_t)(cur->type);
                 success = 1;
             }
         }
@@ -444,6 +831,17 @@ static int processMultiBulkItem(redisReader *r, int type) {
             return REDIS_ERR;
         }
 
+        /* Maps and attributes hold interleaved keys and values. */
+        if (type == REDIS_REPLY_MAP || type == REDIS_REPLY_ATTR) {
+            if (elements == -1 || elements > INT_MAX/2) {
+                __redisReaderSetError(r,REDIS_ERR_PROTOCOL,
+                        "Map length out of range");
+                return REDIS_ERR;
+            }
+
+            elements *= 2;
+        }
+
         if (elements == -1) {
             if (r->fn && r->fn->createNil)
                 obj = r->fn->createNil(cur);
@@ -455,22 +853,28 @@ static int processMultiBulkItem(redisReader *r, int type) {
                 return REDIS_ERR;
             }
 
+            /* Set reply if this is the root object. */
+            if (root) r->reply = obj;
             moveToNextTask(r);
         } else {
             if (r->fn && r->fn->createArray)
                 obj = r->fn->createArray(cur,elements,type);
             else
-                obj = (void*)REDIS_REPLY_ARRAY;
+                obj = (void*)(size_t)type;
 
             if (obj == NULL) {
                 __redisReaderSetErrorOOM(r);
                 return REDIS_ERR;
             }
 
+            /* Set reply if this is the root object - an attribute which is
+             * complete already is discarded right away, below. */
+            if (root) r->reply = obj;
+            cur->obj = obj;
+
             /* Modify task stack when there are more than 0 elements. */
             if (elements > 0) {
                 cur->elements = elements;
-                cur->obj = obj;
                 r->ridx++;
                 r->rstack[r->ridx].type = -1;
                 r->rstack[r->ridx].elements = -1;
@@ -483,8 +887,6 @@ static int processMultiBulkItem(redisReader *r, int type) {
             }
         }
 
-        /* Set reply if this is the root object. */
-        if (root) r->reply = obj;
         return REDIS_OK;
     }
 
@@ -517,6 +919,33 @@ static int processItem(redisReader *r) {
             case '>':
                 cur->type = REDIS_REPLY_PUSH;
                 break;
+            case ',':
+                cur->type = REDIS_REPLY_DOUBLE;
+                break;
+            case '_':
+                cur->type = REDIS_REPLY_NIL;
+                break;
+            case '#':
+                cur->type = REDIS_REPLY_BOOL;
+                break;
+            case '(':
+                cur->type = REDIS_REPLY_BIGNUM;
+                break;
+            case '!':
+                cur->type = REDIS_READER_BLOB_ERROR;
+                break;
+            case '=':
+                cur->type = REDIS_REPLY_VERB;
+                break;
+            case '%':
+                cur->type = REDIS_REPLY_MAP;
+                break;
+            case '~':
+                cur->type = REDIS_REPLY_SET;
+                break;
+            case '|':
+                cur->type = REDIS_REPLY_ATTR;
+                break;
             default:
                 __redisReaderSetErrorProtocolByte(r,*p);
                 return REDIS_ERR;
@@ -532,11 +961,20 @@ static int processItem(redisReader *r) {
     case REDIS_REPLY_ERROR:
     case REDIS_REPLY_STATUS:
     case REDIS_REPLY_INTEGER:
+    case REDIS_REPLY_DOUBLE:
+    case REDIS_REPLY_NIL:
+    case REDIS_REPLY_BOOL:
+    case REDIS_REPLY_BIGNUM:
         return processLineItem(r);
     case REDIS_REPLY_STRING:
+    case REDIS_REPLY_VERB:
+    case REDIS_READER_BLOB_ERROR:
         return processBulkItem(r);
     case REDIS_REPLY_ARRAY:
     case REDIS_REPLY_PUSH:
+    case REDIS_REPLY_MAP:
+    case REDIS_REPLY_SET:
+    case REDIS_REPLY_ATTR:
         return processMultiBulkItem(r, cur->type);
     default:
         assert(NULL);
@@ -566,8 +1004,10 @@ redisReader *redisReaderCreateWithFunctions(redisReplyObjectFunctions *fn) {
 void redisReaderFree(redisReader *r) {
     if (r == NULL)
         return;
-    if (r->reply != NULL && r->fn && r->fn->freeObject)
-        r->fn->freeObject(r->reply);
+    freePendingAttributes(r);
+    if (r->reply != NULL)
+        freeReplyRoot(r,r->reply);
+    free(r->bulk);
     sdsfree(r->buf);
     free(r);
 }
@@ -604,6 +1044,87 @@ int redisReaderFeed(redisReader *r, const char *buf, size_t len) {
     return REDIS_OK;
 }
 
+/* Return a pointer to at least len bytes of free space at the end of the
+ * internal buffer, so that the caller can read from the socket directly into
+ * it, skipping the copy in redisReaderFeed. Must be followed by a call to
+ * redisReaderCommitWrite with the number of bytes actually written. */
+char *redisReaderGetWriteBuffer(redisReader *r, size_t *len) {
+    sds newbuf;
+
+    if (r->err)
+        return NULL;
+
+    /* A large bulk string is in progress, and everything buffered so far has
+     * been moved into it: Write directly into the bulk string. */
+    r->writingBulk = 0;
+    if (r->bulk != NULL && r->pos == r->len) {
+        size_t remaining = r->bulkLen+2 - r->bulkFilled;
+        if (*len > remaining)
+            *len = remaining;
+
+        r->writingBulk = 1;
+        return r->bulk + r->bulkFilled;
+    }
+
+    /* Destroy internal buffer when it is empty and is quite large - but not
+     * if the caller is about to fill most of it again. */
+    if (r->len == 0 && r->maxbuf != 0 && sdsavail(r->buf) > r->maxbuf &&
+        sdsavail(r->buf) > 2*(*len)) {
+        sdsfree(r->buf);
+        r->buf = sdsempty();
+        r->pos = 0;
+
+        assert(r->buf != NULL);
+    }
+
+    newbuf = sdsMakeRoomFor(r->buf,*len);
+    if (newbuf == NULL) {
+        __redisReaderSetErrorOOM(r);
+        return NULL;
+    }
+
+    r->buf = newbuf;
+    return r->buf + sdslen(r->buf);
+}
+
+int redisReaderCommitWrite(redisReader *r, size_t len) {
+    if (r->err)
+        return REDIS_ERR;
+
+    if (r->writingBulk) {
+        assert(r->bulkFilled + len <= r->bulkLen+2);
+        r->bulkFilled += len;
+        r->writingBulk = 0;
+        return REDIS_OK;
+    }
+
+    if (len > 0) {
+        assert(sdsavail(r->buf) >= len);
+        sdsIncrLen(r->buf,len);
+        r->len = sdslen(r->buf);
+    }
+
+    return REDIS_OK;
+}
+
+/* Discard the consumed part of the buffer once it's at least 1k, and
+ * at least as large as the unconsumed tail. With a deep pipeline the
+ * tail can be megabytes, while a single reply only consumes a few bytes:
+ * Moving the tail every time would be quadratic. This way, every byte
+ * is moved at most once, amortized, and the buffer never grows beyond
+ * twice the unconsumed data. A fully consumed buffer is simply reset. */
+static void discardConsumed(redisReader *r) {
+    if (r->pos == r->len) {
+        sdsclear(r->buf);
+        r->pos = 0;
+        r->len = 0;
+    } else if (r->pos >= 1024 && r->pos >= r->len - r->pos) {
+        sdsrange(r->buf,r->pos,-1);
+        r->pos = 0;
+        r->len = sdslen(r->buf);
+    }
+}
+
 int redisReaderGetReply(redisReader *r, void **reply) {
     /* Default target pointer to NULL. */
     if (reply != NULL)
@@ -613,8 +1134,9 @@ int redisReaderGetReply(redisReader *r, void **reply) {
     if (r->err)
         return REDIS_ERR;
 
-    /* When the buffer is empty, there will never be a reply. */
-    if (r->len == 0)
+    /* When the buffer is empty, there will never be a reply - unless a large
+     * bulk string was written into directly. */
+    if (r->len == 0 && r->bulk == NULL)
         return REDIS_OK;
 
     /* Set first item to process when the stack is empty. */
@@ -637,26 +1159,95 @@ int redisReaderGetReply(redisReader *r, void **reply) {
     if (r->err)
         return REDIS_ERR;
 
-    /* Discard part of the buffer when we've consumed at least 1k, to avoid
-     * doing unnecessary calls to memmove() in sds.c. */
-    if (r->pos >= 1024) {
-        sdsrange(r->buf,r->pos,-1);
-        r->pos = 0;
-        r->len = sdslen(r->buf);
-    }
+    discardConsumed(r);
 
     /* Emit a reply when there is one. */
     if (r->ridx == -1) {
         if (reply != NULL) {
             *reply = r->reply;
-        } else if (r->reply != NULL && r->fn && r->fn->freeObject) {
-            r->fn->freeObject(r->reply);
+        } else if (r->reply != NULL) {
+            freeReplyRoot(r,r->reply);
         }
         r->reply = NULL;
     }
     return REDIS_OK;
 }
 
+/* Skip the next reply without building it, if it is exactly the status reply
+ * "+<status>\r\n". Only valid in between replies. Returns 1 if skipped, 0 if
+ * more data is needed to tell, and -1 if the next reply is something else -
+ * it is then left in the buffer, for redisReaderGetReply to parse. */
+int redisReaderSkipStatus(redisReader *r, const char *status, size_t len) {
+    size_t avail, i;
+
+    if (r->err || r->ridx != -1 || r->bulk != NULL)
+        return -1;
+
+    avail = r->len - r->pos;
+    if (avail == 0)
+        return 0;
+
+    const char *p = r->buf + r->pos;
+    if (p[0] != '+')
+        return -1;
+
+    for (i = 0; i < len && i + 1 < avail; i++) {
+        if (p[i + 1] != status[i])
+            return -1;
+    }
+
+    if (avail < len + 3) {
+        /* The status itself matches so far - is the terminator out of line? */
+        if (avail > len + 1 && p[len + 1] != '\r')
+            return -1;
+        return 0;
+    }
+
+    if (p[len + 1] != '\r' || p[len + 2] != '\n')
+        return -1;
+
+    r->pos += len + 3;
+    discardConsumed(r);
+    return 1;
+}
+
+/* Skip the next reply without building it, if it is a single-line reply
+ * other than an error: status, integer, and the RESP3 null, boolean and
+ * double. Only valid in between replies. Returns 1 if skipped, 0 if more
+ * data is needed, and -1 if the next reply is something else - it is then
+ * left in the buffer, for redisReaderGetReply to parse. */
+int redisReaderSkipSimple(redisReader *r) {
+    size_t avail;
+    char *p, *nl;
+
+    if (r->err || r->ridx != -1 || r->bulk != NULL)
+        return -1;
+
+    avail = r->len - r->pos;
+    if (avail == 0)
+        return 0;
+
+    p = r->buf + r->pos;
+    switch (p[0]) {
+    case '+':
+    case ':':
+    case '_':
+    case '#':
+    case ',':
+        break;
+    default:
+        return -1;
+    }
+
+    nl = seekNewline(p, avail);
+    if (nl == NULL)
+        return 0;
+
+    r->pos += (nl - p) + 2;
+    discardConsumed(r);
+    return 1;
+}
+
 static void *createStringObject(const redisReadTask *task, char *str, size_t len) {
     redisReply *r, *parent;
     char *buf;
@@ -665,15 +1256,27 @@ static void *createStringObject(const redisReadTask *task, char *str, size_t len
     if (r == NULL)
         return NULL;
 
+    assert(task->type == REDIS_REPLY_ERROR  ||
+           task->type == REDIS_REPLY_STATUS ||
+           task->type == REDIS_REPLY_STRING ||
+           task->type == REDIS_REPLY_BIGNUM ||
+           task->type == REDIS_REPLY_VERB);
+
+    /* Verbatim strings: Split off the content type. */
+    if (task->type == REDIS_REPLY_VERB) {
+        memcpy(r->vtype,str,3);
+        r->vtype[3] = '\0';
+        str += 4;
+        len -= 4;
+    }
+
     buf = (char*) malloc(len+1);
     if (buf == NULL) {
         freeReplyObject(r);
         return NULL;
     }
 
-    assert(task->type == REDIS_REPLY_ERROR  ||
-           task->type == REDIS_REPLY_STATUS ||
-           task->type == REDIS_REPLY_STRING);
+    AllocationAccounting::record(AllocationCategory::kParsing, len+1);
 
     /* Copy string value */
     memcpy(buf,str,len);
@@ -683,7 +1286,7 @@ static void *createStringObject(const redisReadTask *task, char *str, size_t len
 
     if (task->parent) {
         parent = (redisReply*) task->parent->obj;
-        assert(parent->type == REDIS_REPLY_ARRAY || parent->type == REDIS_REPLY_PUSH);
+        assert(isAggregateType(parent->type));
         parent->element[task->idx] = r;
     }
     return r;
@@ -702,13 +1305,16 @@ static void *createArrayObject(const redisReadTask *task, size_t elements, int t
             freeReplyObject(r);
             return NULL;
         }
+
+        AllocationAccounting::record(AllocationCategory::kParsing, elements*sizeof(redisReply*));
     }
 
     r->elements = elements;
 
-    if (task->parent) {
+    /* Attributes are not part of their parent, see discardAttribute. */
+    if (task->parent && type != REDIS_REPLY_ATTR) {
         parent = (redisReply*) task->parent->obj;
-        assert(parent->type == REDIS_REPLY_ARRAY);
+        assert(isAggregateType(parent->type));
         parent->element[task->idx] = r;
     }
     return r;
@@ -725,7 +1331,73 @@ static void *createIntegerObject(const redisReadTask *task, long long value) {
 
     if (task->parent) {
         parent = (redisReply*) task->parent->obj;
-        assert(parent->type == REDIS_REPLY_ARRAY || parent->type == REDIS_REPLY_PUSH);
+        assert(isAggregateType(parent->type));
+        parent->element[task->idx] = r;
+    }
+    return r;
+}
+
+static void *adoptStringObject(const redisReadTask *task, char *str, size_t len) {
+    redisReply *r, *parent;
+
+    r = createReplyObject(task->type);
+    if (r == NULL)
+        return NULL;
+
+    assert(task->type == REDIS_REPLY_ERROR  ||
+           task->type == REDIS_REPLY_STATUS ||
+           task->type == REDIS_REPLY_STRING);
+
+    r->str = str;
+    r->len = len;
+
+    if (task->parent) {
+        parent = (redisReply*) task->parent->obj;
+        assert(isAggregateType(parent->type));
+        parent->element[task->idx] = r;
+    }
+    return r;
+}
+
+static void *createDoubleObject(const redisReadTask *task, double value, char *str, size_t len) {
+    redisReply *r, *parent;
+
+    r = createReplyObject(REDIS_REPLY_DOUBLE);
+    if (r == NULL)
+        return NULL;
+
+    r->dval = value;
+    r->str = (char*) malloc(len+1);
+    if (r->str == NULL) {
+        freeReplyObject(r);
+        return NULL;
+    }
+
+    /* Keep the textual representation, as sent by the server. */
+    memcpy(r->str,str,len);
+    r->str[len] = '\0';
+    r->len = len;
+
+    if (task->parent) {
+        parent = (redisReply*) task->parent->obj;
+        assert(isAggregateType(parent->type));
+        parent->element[task->idx] = r;
+    }
+    return r;
+}
+
+static void *createBoolObject(const redisReadTask *task, int value) {
+    redisReply *r, *parent;
+
+    r = createReplyObject(REDIS_REPLY_BOOL);
+    if (r == NULL)
+        return NULL;
+
+    r->integer = value != 0;
+
+    if (task->parent) {
+        parent = (redisReply*) task->parent->obj;
+        assert(isAggregateType(parent->type));
         parent->element[task->idx] = r;
     }
     return r;
@@ -740,7 +1412,7 @@ static void *createNilObject(const redisReadTask *task) {
 
     if (task->parent) {
         parent = (redisReply*) task->parent->obj;
-        assert(parent->type == REDIS_REPLY_ARRAY || parent->type == REDIS_REPLY_PUSH);
+        assert(isAggregateType(parent->type));
         parent->element[task->idx] = r;
     }
     return r;
@@ -755,11 +1427,19 @@ static redisReplyObjectFunctions defaultFunctions = {
     createArrayObject,
     createIntegerObject,
     createNilObject,
-    freeReplyObject
+    freeReplyObject,
+    adoptStringObject,
+    createDoubleObject,
+    createBoolObject,
+    NULL
 };
 
 redisReader *redisReaderCreate(void) {
     return redisReaderCreateWithFunctions(&defaultFunctions);
 }
 
+redisReplyObjectFunctions *redisReaderDefaultFunctions(void) {
+    return &defaultFunctions;
+}
+
 
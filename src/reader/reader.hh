@@ -76,6 +76,16 @@ typedef struct redisReplyObjectFunctions {
     void *(*createInteger)(const redisReadTask*, long long);
     void *(*createNil)(const redisReadTask*);
     void (*freeObject)(void*);
+    /* Optional: Like createString, but takes ownership of str, a malloc'ed
+     * buffer of at least len+1 bytes, instead of copying it. */
+    void *(*adoptString)(const redisReadTask*, char*, size_t);
+    /* RESP3: A double, along with its textual representation, and a
+     * boolean. */
+    void *(*createDouble)(const redisReadTask*, double, char*, size_t);
+    void *(*createBool)(const redisReadTask*, int);
+    /* Optional: Free the root object of a reply, instead of freeObject.
+     * Receives the privdata of the root task. */
+    void (*freeRoot)(void*, void*);
 } redisReplyObjectFunctions;
 
 typedef struct redisReader {
@@ -93,14 +103,38 @@ typedef struct redisReader {
 
     redisReplyObjectFunctions *fn;
     void *privdata;
+
+    /* Bulk strings of at least bulkThreshold bytes (0 to disable) are
+     * accumulated in a dedicated buffer, which is handed over to the reply
+     * without copying. The socket can be read straight into it, see
+     * redisReaderGetWriteBuffer. */
+    size_t bulkThreshold;
+    char *bulk; /* Large bulk string in progress, or NULL */
+    size_t bulkLen; /* Its length, excluding the trailing \r\n */
+    size_t bulkFilled; /* Bytes received so far, including \r\n */
+    int writingBulk; /* Is the pending write buffer pointing into bulk? */
+
+    /* Optional: Top-level bulk strings may be streamed instead of buffered.
+     * Once the length is known, streamBegin decides; when it returns
+     * non-zero, the payload is passed to streamChunk piece by piece, straight
+     * out of the read buffer, and the reply becomes an empty string. */
+    int (*streamBegin)(void *privdata, size_t len);
+    void (*streamChunk)(void *privdata, const char *data, size_t len);
+    void *streamPrivdata;
+    int streaming; /* Is a streamed bulk string in progress? */
 } redisReader;
 
 /* Public API for the protocol parser. */
 redisReader *redisReaderCreateWithFunctions(redisReplyObjectFunctions *fn);
 void redisReaderFree(redisReader *r);
 redisReader *redisReaderCreate(void);
+redisReplyObjectFunctions *redisReaderDefaultFunctions(void);
 int redisReaderFeed(redisReader *r, const char *buf, size_t len);
+char *redisReaderGetWriteBuffer(redisReader *r, size_t *len);
+int redisReaderCommitWrite(redisReader *r, size_t len);
 int redisReaderGetReply(redisReader *r, void **reply);
+int redisReaderSkipStatus(redisReader *r, const char *status, size_t len);
+int redisReaderSkipSimple(redisReader *r);
 void freeReplyObject(void *reply);
 
 #define redisReaderSetPrivdata(_r, _p) (int)(((redisReader*)(_r))->privdata = (_p))
@@ -100,6 +100,35 @@ void BinarySerializer::appendString(const std::string &str) {
   appendBytes(str.data(), str.size());
 }
 
+//------------------------------------------------------------------------------
+// Append unsigned integer as a varint
+//------------------------------------------------------------------------------
+void BinarySerializer::appendVarint(uint64_t num) {
+  char* buff = pos();
+  size_t len = 0;
+
+  while(num >= 0x80) {
+    buff[len++] = (char) ((num & 0x7F) | 0x80);
+    num >>= 7;
+  }
+
+  buff[len++] = (char) num;
+  currentPosition += len;
+}
+
+//------------------------------------------------------------------------------
+// Number of bytes appendVarint needs for the given integer
+//------------------------------------------------------------------------------
+size_t BinarySerializer::getVarintSize(uint64_t num) {
+  size_t len = 1;
+  while(num >= 0x80) {
+    num >>= 7;
+    len++;
+  }
+
+  return len;
+}
+
 //------------------------------------------------------------------------------
 // Get size remaining
 //------------------------------------------------------------------------------
@@ -151,6 +180,57 @@ bool BinaryDeserializer::consumeString(std::string &str) {
   return consumeRawBytes(str, sz);
 }
 
+//------------------------------------------------------------------------------
+//! Consume varint - at most 10 bytes, anything longer can't be a uint64_t
+//------------------------------------------------------------------------------
+bool BinaryDeserializer::consumeVarint(uint64_t &out) {
+  out = 0;
+
+  for(size_t i = 0; i < 10; i++) {
+    if(!canConsume(1)) {
+      return false;
+    }
+
+    uint8_t byte = source[currentPosition++];
+    if(i == 9 && byte > 1) {
+      return false;
+    }
+
+    out |= (uint64_t) (byte & 0x7F) << (7 * i);
+    if((byte & 0x80) == 0) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+//------------------------------------------------------------------------------
+//! Consume string, including its length, without copying
+//------------------------------------------------------------------------------
+bool BinaryDeserializer::consumeStringView(const char *&data, size_t &len) {
+  int64_t sz = 0;
+  if(!consumeInt64(sz) || sz < 0) {
+    return false;
+  }
+
+  len = sz;
+  return consumeRawView(data, len);
+}
+
+//------------------------------------------------------------------------------
+//! Consume that many raw bytes without copying
+//------------------------------------------------------------------------------
+bool BinaryDeserializer::consumeRawView(const char *&data, size_t sz) {
+  if(!canConsume(sz)) {
+    return false;
+  }
+
+  data = source.data()+currentPosition;
+  currentPosition += sz;
+  return true;
+}
+
 //------------------------------------------------------------------------------
 //! Get number of bytes left
 //------------------------------------------------------------------------------
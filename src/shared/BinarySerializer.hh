@@ -26,6 +26,7 @@
 
 #include <map>
 #include <string>
+#include <stdint.h>
 
 namespace qclient {
 
@@ -54,6 +55,17 @@ public:
   //----------------------------------------------------------------------------
   void appendString(const std::string &str);
 
+  //----------------------------------------------------------------------------
+  //! Append unsigned integer as a varint: 7 bits per byte, least significant
+  //! first, high bit set on all but the last byte.
+  //----------------------------------------------------------------------------
+  void appendVarint(uint64_t num);
+
+  //----------------------------------------------------------------------------
+  //! Number of bytes appendVarint needs for the given integer
+  //----------------------------------------------------------------------------
+  static size_t getVarintSize(uint64_t num);
+
   //----------------------------------------------------------------------------
   //! Get size remaining
   //----------------------------------------------------------------------------
@@ -90,6 +102,22 @@ public:
   //----------------------------------------------------------------------------
   bool consumeString(std::string &str);
 
+  //----------------------------------------------------------------------------
+  //! Consume varint, as written by BinarySerializer::appendVarint
+  //----------------------------------------------------------------------------
+  bool consumeVarint(uint64_t &out);
+
+  //----------------------------------------------------------------------------
+  //! Consume string, including its length, without copying: Point to it
+  //! within the source, which must outlive the pointer.
+  //----------------------------------------------------------------------------
+  bool consumeStringView(const char *&data, size_t &len);
+
+  //----------------------------------------------------------------------------
+  //! Consume that many raw bytes without copying, same as above
+  //----------------------------------------------------------------------------
+  bool consumeRawView(const char *&data, size_t sz);
+
   //----------------------------------------------------------------------------
   //! Consume that many raw bytes
   //----------------------------------------------------------------------------
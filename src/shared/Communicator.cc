@@ -25,10 +25,12 @@
 #include "qclient/pubsub/Subscriber.hh"
 #include "qclient/pubsub/Message.hh"
 #include "SharedSerialization.hh"
+#include "CommunicatorBatcher.hh"
 #include "qclient/SSTR.hh"
 #include "qclient/utils/Macros.hh"
 #include "qclient/utils/SteadyClock.hh"
 #include "qclient/Debug.hh"
+#include <algorithm>
 
 namespace qclient {
 
@@ -58,11 +60,35 @@ Communicator::~Communicator() {
   mPendingVault.setBlockingMode(false);
 }
 
+//------------------------------------------------------------------------------
+// Pack outgoing requests and retries into batches
+//------------------------------------------------------------------------------
+void Communicator::enableBatching(size_t maxBytes, std::chrono::milliseconds maxDelay) {
+  mBatcher.reset(new CommunicatorBatcher(mQcl, mChannel, maxBytes, maxDelay));
+}
+
+//------------------------------------------------------------------------------
+// Send out a serialized request, batched or not
+//------------------------------------------------------------------------------
+void Communicator::publishRequest(const std::string &channel, std::string &&payload) {
+  if(mBatcher && channel == mChannel) {
+    mBatcher->push(std::move(payload));
+  }
+  else if(mQcl) {
+    mQcl->execute(kPublish.make(channel, payload));
+  }
+}
+
 //------------------------------------------------------------------------------
 // Cleanup and retry thread
 //------------------------------------------------------------------------------
 void Communicator::backgroundThread(ThreadAssistant &assistant) {
+  std::vector<PendingRequestVault::RetryItem> batch;
+
   while(!assistant.terminationRequested()) {
+    std::chrono::steady_clock::time_point now = SteadyClock::now(mClock);
+    mPendingVault.expire(now - mHardDeadline);
+
     std::chrono::steady_clock::time_point earliestRetry;
     if(!mPendingVault.getEarliestRetry(earliestRetry)) {
       // Pending vault empty, sleep
@@ -70,18 +96,20 @@ void Communicator::backgroundThread(ThreadAssistant &assistant) {
       continue;
     }
 
-    std::chrono::steady_clock::time_point now = SteadyClock::now(mClock);
     if(earliestRetry+mRetryInterval > now) {
       // Not there yet, need to wait a bit more
-      std::chrono::milliseconds nextRetryIn = std::chrono::duration_cast<std::chrono::milliseconds>(now - (earliestRetry+mRetryInterval));
-      assistant.wait_for(nextRetryIn);
+      std::chrono::milliseconds nextRetryIn = std::chrono::duration_cast<std::chrono::milliseconds>((earliestRetry+mRetryInterval) - now);
+      assistant.wait_for(std::max(nextRetryIn, std::chrono::milliseconds(1)));
       continue;
     }
 
-    std::string channel, contents, id;
-    if(runNextToRetry(channel, contents, id) && mQcl) {
-      // Go
-      mQcl->exec("PUBLISH", channel, serializeCommunicatorRequest(id, contents));
+    // Pick up everything that's due in one go, and publish it all
+    // back-to-back: the retries end up pipelined in as few writes as possible.
+    batch.clear();
+    mPendingVault.retryDueItems(now, mRetryInterval, kMaxRetryBatch, batch);
+
+    for(auto it = batch.begin(); it != batch.end(); it++) {
+      publishRequest(it->channel, serializeCommunicatorRequest(it->id, it->contents));
     }
   }
 }
@@ -103,9 +131,7 @@ std::future<CommunicatorReply> Communicator::issue(const std::string &contents,
 
   id = outcome.id;
 
-  if(mQcl) {
-    mQcl->exec("PUBLISH", mChannel, serializeCommunicatorRequest(outcome.id, contents));
-  }
+  publishRequest(mChannel, serializeCommunicatorRequest(outcome.id, contents));
 
   return std::move(outcome.fut);
 }
@@ -146,6 +172,16 @@ void Communicator::processIncoming(Message &&msg) {
   CommunicatorReply reply;
   if(parseCommunicatorReply(msg.getPayload(), reply, uuid)) {
     mPendingVault.satisfy(uuid, std::move(reply));
+    return;
+  }
+
+  std::vector<std::string> batch;
+  if(parseCommunicatorBatch(msg.getPayload(), batch)) {
+    for(size_t i = 0; i < batch.size(); i++) {
+      if(parseCommunicatorReply(batch[i], reply, uuid)) {
+        mPendingVault.satisfy(uuid, std::move(reply));
+      }
+    }
   }
 }
 
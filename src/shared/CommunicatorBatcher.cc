@@ -0,0 +1,120 @@
+//------------------------------------------------------------------------------
+// File: CommunicatorBatcher.cc
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2019 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#include "CommunicatorBatcher.hh"
+#include "SharedSerialization.hh"
+#include "qclient/QClient.hh"
+
+namespace qclient {
+
+//------------------------------------------------------------------------------
+// Constructor
+//------------------------------------------------------------------------------
+CommunicatorBatcher::CommunicatorBatcher(QClient *qcl, const std::string &channel,
+  size_t maxBytes, std::chrono::milliseconds maxDelay)
+: mQcl(qcl), mChannel(channel), mMaxBytes(maxBytes), mMaxDelay(maxDelay) {
+
+  mThread.reset(&CommunicatorBatcher::flushThread, this);
+}
+
+//------------------------------------------------------------------------------
+// Destructor - flushes whatever is pending
+//------------------------------------------------------------------------------
+CommunicatorBatcher::~CommunicatorBatcher() {
+  mThread.join();
+  flush();
+}
+
+//------------------------------------------------------------------------------
+// Add serialized message to the current batch
+//------------------------------------------------------------------------------
+void CommunicatorBatcher::push(std::string &&message) {
+  std::vector<std::string> full;
+
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mBatchBytes += message.size();
+    mBatch.emplace_back(std::move(message));
+
+    if(mBatchBytes < mMaxBytes) {
+      return;
+    }
+
+    full.swap(mBatch);
+    mBatchBytes = 0;
+  }
+
+  publish(std::move(full));
+}
+
+//------------------------------------------------------------------------------
+// Publish current batch, if any
+//------------------------------------------------------------------------------
+void CommunicatorBatcher::flush() {
+  std::vector<std::string> batch;
+
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    batch.swap(mBatch);
+    mBatchBytes = 0;
+  }
+
+  publish(std::move(batch));
+}
+
+//------------------------------------------------------------------------------
+// Number of messages waiting in the current batch
+//------------------------------------------------------------------------------
+size_t CommunicatorBatcher::pending() const {
+  std::lock_guard<std::mutex> lock(mMutex);
+  return mBatch.size();
+}
+
+//------------------------------------------------------------------------------
+// Publish given batch
+//------------------------------------------------------------------------------
+void CommunicatorBatcher::publish(std::vector<std::string> &&batch) {
+  if(batch.empty() || !mQcl) {
+    return;
+  }
+
+  if(batch.size() == 1u) {
+    mQcl->execute(kPublish.make(mChannel, batch[0]));
+  }
+  else {
+    mQcl->execute(kPublish.make(mChannel, serializeCommunicatorBatch(batch)));
+  }
+}
+
+//------------------------------------------------------------------------------
+// Time-based flushing
+//------------------------------------------------------------------------------
+void CommunicatorBatcher::flushThread(ThreadAssistant &assistant) {
+  while(!assistant.terminationRequested()) {
+    assistant.wait_for(mMaxDelay);
+    flush();
+  }
+}
+
+}
@@ -0,0 +1,99 @@
+//------------------------------------------------------------------------------
+// File: CommunicatorBatcher.hh
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2019 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#ifndef QCLIENT_SHARED_COMMUNICATOR_BATCHER_HH
+#define QCLIENT_SHARED_COMMUNICATOR_BATCHER_HH
+
+#include "qclient/AssistedThread.hh"
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace qclient {
+
+class QClient;
+
+//------------------------------------------------------------------------------
+//! Packs serialized Communicator requests or replies headed for the same
+//! channel into a single PUBLISH. A batch goes out as soon as it reaches
+//! maxBytes, or at the latest maxDelay after the first message was added.
+//!
+//! A batch of one is published as a plain message, so that peers which
+//! don't understand batches keep working as long as traffic is light.
+//------------------------------------------------------------------------------
+class CommunicatorBatcher {
+public:
+  //----------------------------------------------------------------------------
+  //! Constructor - qcl may be null, in which case messages are dropped.
+  //----------------------------------------------------------------------------
+  CommunicatorBatcher(QClient *qcl, const std::string &channel, size_t maxBytes,
+    std::chrono::milliseconds maxDelay);
+
+  //----------------------------------------------------------------------------
+  //! Destructor - flushes whatever is pending
+  //----------------------------------------------------------------------------
+  ~CommunicatorBatcher();
+
+  //----------------------------------------------------------------------------
+  //! Add serialized message to the current batch
+  //----------------------------------------------------------------------------
+  void push(std::string &&message);
+
+  //----------------------------------------------------------------------------
+  //! Publish current batch, if any
+  //----------------------------------------------------------------------------
+  void flush();
+
+  //----------------------------------------------------------------------------
+  //! Number of messages waiting in the current batch
+  //----------------------------------------------------------------------------
+  size_t pending() const;
+
+private:
+  //----------------------------------------------------------------------------
+  //! Publish given batch - called without holding mMutex
+  //----------------------------------------------------------------------------
+  void publish(std::vector<std::string> &&batch);
+
+  //----------------------------------------------------------------------------
+  //! Time-based flushing
+  //----------------------------------------------------------------------------
+  void flushThread(ThreadAssistant &assistant);
+
+  QClient *mQcl;
+  std::string mChannel;
+  size_t mMaxBytes;
+  std::chrono::milliseconds mMaxDelay;
+
+  mutable std::mutex mMutex;
+  std::vector<std::string> mBatch;
+  size_t mBatchBytes {0};
+
+  AssistedThread mThread;
+};
+
+}
+
+#endif
@@ -26,6 +26,7 @@
 #include "qclient/pubsub/Message.hh"
 #include "qclient/shared/PendingRequestVault.hh"
 #include "shared/SharedSerialization.hh"
+#include "shared/CommunicatorBatcher.hh"
 
 namespace qclient {
 
@@ -78,6 +79,13 @@ CommunicatorListener::~CommunicatorListener() {
   mSubscription.reset();
 }
 
+//------------------------------------------------------------------------------
+// Pack outgoing replies into batches
+//------------------------------------------------------------------------------
+void CommunicatorListener::enableBatching(size_t maxBytes, std::chrono::milliseconds maxDelay) {
+  mBatcher.reset(new CommunicatorBatcher(mQcl, mChannel, maxBytes, maxDelay));
+}
+
 //------------------------------------------------------------------------------
 // Process incoming message
 //------------------------------------------------------------------------------
@@ -86,28 +94,54 @@ void CommunicatorListener::processIncoming(Message &&msg) {
 
   std::string uuid, contents;
   if(parseCommunicatorRequest(msg.getPayload(), uuid, contents)) {
+    processRequest(uuid, contents);
+    return;
+  }
 
-    CommunicatorReply cachedReply;
-    if(mCachedReplies.query(uuid, cachedReply)) {
-      //------------------------------------------------------------------------
-      // Cached response, replay
-      //------------------------------------------------------------------------
-      if(mQcl) {
-        mQcl->exec("PUBLISH", mChannel, serializeCommunicatorReply(uuid, cachedReply));
+  std::vector<std::string> batch;
+  if(parseCommunicatorBatch(msg.getPayload(), batch)) {
+    for(size_t i = 0; i < batch.size(); i++) {
+      if(parseCommunicatorRequest(batch[i], uuid, contents)) {
+        processRequest(uuid, contents);
       }
     }
-    else if(mAlreadyReceived.query(uuid)) {
-      //------------------------------------------------------------------------
-      // Already received, but no response yet. Ignore
-      //------------------------------------------------------------------------
-    }
-    else {
-      //------------------------------------------------------------------------
-      // Add to queue
-      //------------------------------------------------------------------------
-      this->emplace_back(this, uuid, contents);
-      mAlreadyReceived.emplace(uuid);
-    }
+  }
+}
+
+//------------------------------------------------------------------------------
+// Process a single incoming request
+//------------------------------------------------------------------------------
+void CommunicatorListener::processRequest(const std::string &uuid, const std::string &contents) {
+  CommunicatorReply cachedReply;
+  if(mCachedReplies.query(uuid, cachedReply)) {
+    //--------------------------------------------------------------------------
+    // Cached response, replay
+    //--------------------------------------------------------------------------
+    publishReply(serializeCommunicatorReply(uuid, cachedReply));
+  }
+  else if(mAlreadyReceived.query(uuid)) {
+    //--------------------------------------------------------------------------
+    // Already received, but no response yet. Ignore
+    //--------------------------------------------------------------------------
+  }
+  else {
+    //--------------------------------------------------------------------------
+    // Add to queue
+    //--------------------------------------------------------------------------
+    this->emplace_back(this, uuid, contents);
+    mAlreadyReceived.emplace(uuid);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Send out a serialized reply, batched or not
+//------------------------------------------------------------------------------
+void CommunicatorListener::publishReply(std::string &&payload) {
+  if(mBatcher) {
+    mBatcher->push(std::move(payload));
+  }
+  else if(mQcl) {
+    mQcl->execute(kPublish.make(mChannel, payload));
   }
 }
 
@@ -120,10 +154,9 @@ void CommunicatorListener::sendReply(int64_t status, const std::string &uuid, co
     reply.status = status;
     reply.contents = contents;
 
-    mQcl->exec("PUBLISH", mChannel, serializeCommunicatorReply(uuid, reply));
+    publishReply(serializeCommunicatorReply(uuid, reply));
     mCachedReplies.insert(uuid, reply);
   }
 }
 
 }
-
@@ -0,0 +1,96 @@
+//------------------------------------------------------------------------------
+// File: FlatStringMap.cc
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#include "FlatStringMap.hh"
+#include <functional>
+
+namespace qclient {
+
+//------------------------------------------------------------------------------
+// Build out of a std::map, or an InternedStringMap - sharing its keys.
+//------------------------------------------------------------------------------
+FlatStringMap::FlatStringMap(const std::map<std::string, std::string> &contents) {
+  entries.reserve(contents.size());
+  for(auto it = contents.begin(); it != contents.end(); it++) {
+    entries.emplace_back(std::make_shared<const std::string>(it->first), it->second);
+  }
+
+  buildSlots();
+}
+
+FlatStringMap::FlatStringMap(const InternedStringMap &contents)
+: entries(contents.begin(), contents.end()) {
+  buildSlots();
+}
+
+//------------------------------------------------------------------------------
+// Keep the table at most half full, so that probe sequences stay short.
+//------------------------------------------------------------------------------
+void FlatStringMap::buildSlots() {
+  if(entries.empty()) {
+    return;
+  }
+
+  size_t capacity = 2u;
+  while(capacity < entries.size() * 2) {
+    capacity *= 2;
+  }
+
+  slots.resize(capacity);
+  mask = capacity - 1;
+
+  for(size_t i = 0; i < entries.size(); i++) {
+    size_t hash = std::hash<std::string>()(*entries[i].first);
+    size_t pos = hash & mask;
+
+    while(slots[pos].entry != 0u) {
+      pos = (pos + 1) & mask;
+    }
+
+    slots[pos].tag = static_cast<uint32_t>(static_cast<uint64_t>(hash) >> 32);
+    slots[pos].entry = i + 1;
+  }
+}
+
+const std::string* FlatStringMap::find(const std::string &key) const {
+  if(entries.empty()) {
+    return nullptr;
+  }
+
+  size_t hash = std::hash<std::string>()(key);
+  uint32_t tag = static_cast<uint32_t>(static_cast<uint64_t>(hash) >> 32);
+
+  for(size_t pos = hash & mask; slots[pos].entry != 0u; pos = (pos + 1) & mask) {
+    if(slots[pos].tag == tag) {
+      const InternedStringMap::Entry &entry = entries[slots[pos].entry - 1];
+      if(*entry.first == key) {
+        return &entry.second;
+      }
+    }
+  }
+
+  return nullptr;
+}
+
+}
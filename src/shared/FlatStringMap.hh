@@ -0,0 +1,72 @@
+//------------------------------------------------------------------------------
+// File: FlatStringMap.hh
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#ifndef QCLIENT_FLAT_STRING_MAP_HH
+#define QCLIENT_FLAT_STRING_MAP_HH
+
+#include "qclient/shared/InternedStringMap.hh"
+#include <map>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+namespace qclient {
+
+//------------------------------------------------------------------------------
+// Immutable string -> string hash table with open addressing, built in one go
+// out of a std::map. Lookups probe a flat array of small slots, holding part
+// of the hash next to the entry index, so that a miss rarely has to touch
+// the strings at all. Built out of an InternedStringMap, it shares its keys.
+//------------------------------------------------------------------------------
+class FlatStringMap {
+public:
+  FlatStringMap() {}
+  FlatStringMap(const std::map<std::string, std::string> &contents);
+  FlatStringMap(const InternedStringMap &contents);
+
+  //----------------------------------------------------------------------------
+  // Value of the given key, nullptr if not found.
+  //----------------------------------------------------------------------------
+  const std::string* find(const std::string &key) const;
+
+  size_t size() const {
+    return entries.size();
+  }
+
+private:
+  struct Slot {
+    uint32_t tag = 0u;
+    uint32_t entry = 0u; // index into entries plus one, 0 if empty
+  };
+
+  std::vector<InternedStringMap::Entry> entries;
+  std::vector<Slot> slots;
+  size_t mask = 0u;
+
+  void buildSlots();
+};
+
+}
+
+#endif
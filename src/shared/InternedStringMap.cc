@@ -0,0 +1,114 @@
+//------------------------------------------------------------------------------
+// File: InternedStringMap.cc
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#include "qclient/shared/InternedStringMap.hh"
+#include <algorithm>
+
+namespace qclient {
+
+//------------------------------------------------------------------------------
+// Constructor - without an interner, each map keeps its own keys
+//------------------------------------------------------------------------------
+InternedStringMap::InternedStringMap(const std::shared_ptr<StringInterner> &inter)
+: interner(inter) {}
+
+StringInterner::Handle InternedStringMap::makeKey(const std::string &key) {
+  if(interner) {
+    return interner->intern(key);
+  }
+
+  return std::make_shared<const std::string>(key);
+}
+
+std::vector<InternedStringMap::Entry>::iterator InternedStringMap::lowerBound(const std::string &key) {
+  return std::lower_bound(entries.begin(), entries.end(), key,
+    [](const Entry &entry, const std::string &k) { return *entry.first < k; });
+}
+
+//------------------------------------------------------------------------------
+// Value of the given key, nullptr if not found
+//------------------------------------------------------------------------------
+const std::string* InternedStringMap::find(const std::string &key) const {
+  auto it = std::lower_bound(entries.begin(), entries.end(), key,
+    [](const Entry &entry, const std::string &k) { return *entry.first < k; });
+
+  if(it == entries.end() || *it->first != key) {
+    return nullptr;
+  }
+
+  return &it->second;
+}
+
+//------------------------------------------------------------------------------
+// Value of the given key, inserted empty if not there yet
+//------------------------------------------------------------------------------
+std::string& InternedStringMap::operator[](const std::string &key) {
+  auto it = lowerBound(key);
+  if(it != entries.end() && *it->first == key) {
+    return it->second;
+  }
+
+  return entries.emplace(it, makeKey(key), std::string())->second;
+}
+
+//------------------------------------------------------------------------------
+// Erase the given key - false if it wasn't there
+//------------------------------------------------------------------------------
+bool InternedStringMap::erase(const std::string &key) {
+  auto it = lowerBound(key);
+  if(it == entries.end() || *it->first != key) {
+    return false;
+  }
+
+  entries.erase(it);
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Replace the entire contents - a std::map is sorted already. Release any
+// spare capacity left over from a larger previous generation.
+//------------------------------------------------------------------------------
+void InternedStringMap::assign(const std::map<std::string, std::string> &contents) {
+  std::vector<Entry> next;
+  next.reserve(contents.size());
+
+  for(auto it = contents.begin(); it != contents.end(); it++) {
+    next.emplace_back(makeKey(it->first), it->second);
+  }
+
+  entries.swap(next);
+}
+
+//------------------------------------------------------------------------------
+// Copy out the entire contents
+//------------------------------------------------------------------------------
+std::map<std::string, std::string> InternedStringMap::toMap() const {
+  std::map<std::string, std::string> out;
+  for(auto it = entries.begin(); it != entries.end(); it++) {
+    out.emplace_hint(out.end(), *it->first, it->second);
+  }
+
+  return out;
+}
+
+}
@@ -24,6 +24,7 @@
 #include "qclient/shared/PendingRequestVault.hh"
 #include "qclient/utils/Macros.hh"
 #include "../Uuid.hh"
+#include <algorithm>
 #include <iostream>
 
 namespace qclient {
@@ -31,13 +32,42 @@ namespace qclient {
 //------------------------------------------------------------------------------
 // Constructor
 //------------------------------------------------------------------------------
-PendingRequestVault::PendingRequestVault() {}
+PendingRequestVault::PendingRequestVault()
+: mIdPrefix(generateUuid() + "#") {}
 
 //------------------------------------------------------------------------------
 // Destructor
 //------------------------------------------------------------------------------
 PendingRequestVault::~PendingRequestVault() {}
 
+//------------------------------------------------------------------------------
+// Convert sequence number to request ID
+//------------------------------------------------------------------------------
+PendingRequestVault::RequestID PendingRequestVault::toRequestID(Sequence seq) const {
+  return mIdPrefix + std::to_string(seq);
+}
+
+//------------------------------------------------------------------------------
+// Convert request ID to sequence number - fails if the ID was not issued by
+// this vault
+//------------------------------------------------------------------------------
+bool PendingRequestVault::toSequence(const RequestID &id, Sequence &seq) const {
+  if(id.size() <= mIdPrefix.size() || id.compare(0, mIdPrefix.size(), mIdPrefix) != 0) {
+    return false;
+  }
+
+  seq = 0;
+  for(size_t i = mIdPrefix.size(); i < id.size(); i++) {
+    if(id[i] < '0' || id[i] > '9') {
+      return false;
+    }
+
+    seq = (seq * 10) + (id[i] - '0');
+  }
+
+  return true;
+}
+
 
 //------------------------------------------------------------------------------
 // Insert pending request
@@ -47,17 +77,19 @@ PendingRequestVault::InsertOutcome PendingRequestVault::insert(const std::string
 
   std::unique_lock<std::mutex> lock(mMutex);
 
+  Sequence seq = mNextSequence++;
+
   InsertOutcome outcome;
-  outcome.id = generateUuid();
+  outcome.id = toRequestID(seq);
 
-  auto mapIter = mPendingRequests.insert(std::make_pair(outcome.id, Item(outcome.id))).first;
+  auto mapIter = mPendingRequests.emplace(seq, Item(seq)).first;
   mapIter->second.start = timepoint;
   mapIter->second.lastRetry = timepoint;
   mapIter->second.channel = channel;
   mapIter->second.contents = contents;
 
   outcome.fut = mapIter->second.promise.get_future();
-  mNextToRetry.push_back(outcome.id);
+  mNextToRetry.push_back(seq);
   mapIter->second.listIter = mNextToRetry.end();
   --mapIter->second.listIter;
 
@@ -70,9 +102,14 @@ PendingRequestVault::InsertOutcome PendingRequestVault::insert(const std::string
 // Satisfy pending request
 //------------------------------------------------------------------------------
 bool PendingRequestVault::satisfy(const RequestID &id, CommunicatorReply &&reply) {
+  Sequence seq;
+  if(!toSequence(id, seq)) {
+    return false;
+  }
+
   std::unique_lock<std::mutex> lock(mMutex);
 
-  auto mapIter = mPendingRequests.find(id);
+  auto mapIter = mPendingRequests.find(seq);
   if(mapIter == mPendingRequests.end()) {
     return false;
   }
@@ -104,7 +141,7 @@ bool PendingRequestVault::getEarliestRetry(std::chrono::steady_clock::time_point
     return false;
   }
 
-  tp = mPendingRequests[mNextToRetry.front()].lastRetry;
+  tp = mPendingRequests.at(mNextToRetry.front()).lastRetry;
   return true;
 }
 
@@ -126,7 +163,7 @@ size_t PendingRequestVault::expire(std::chrono::steady_clock::time_point deadlin
 
   size_t expired = 0;
   while(!mPendingRequests.empty()) {
-    if(mPendingRequests[mNextToRetry.front()].start <= deadline) {
+    if(mPendingRequests.at(mNextToRetry.front()).start <= deadline) {
       dropFront();
       expired++;
     }
@@ -138,6 +175,18 @@ size_t PendingRequestVault::expire(std::chrono::steady_clock::time_point deadlin
   return expired;
 }
 
+//------------------------------------------------------------------------------
+// Move front item to the back of the retry list, marking it as retried
+//------------------------------------------------------------------------------
+PendingRequestVault::Item& PendingRequestVault::retryFront(std::chrono::steady_clock::time_point now) {
+  Item& item = mPendingRequests.at(mNextToRetry.front());
+  item.lastRetry = now;
+
+  mNextToRetry.splice(mNextToRetry.end(), mNextToRetry, mNextToRetry.begin());
+  qclient_assert(mPendingRequests.size() == mNextToRetry.size());
+  return item;
+}
+
 //------------------------------------------------------------------------------
 // Retry front item, if it exists
 //------------------------------------------------------------------------------
@@ -150,17 +199,44 @@ bool PendingRequestVault::retryFrontItem(std::chrono::steady_clock::time_point n
     return false;
   }
 
-  Item& item = mPendingRequests[mNextToRetry.front()];
+  Item& item = retryFront(now);
   channel = item.channel;
   contents = item.contents;
-  id = item.id;
-  item.lastRetry = now;
-
-  mNextToRetry.splice(mNextToRetry.end(), mNextToRetry, mNextToRetry.begin());
-  qclient_assert(mPendingRequests.size() == mNextToRetry.size());
+  id = toRequestID(item.seq);
   return true;
 }
 
+//------------------------------------------------------------------------------
+// Retry all items due for retry, up to maxItems
+//------------------------------------------------------------------------------
+size_t PendingRequestVault::retryDueItems(std::chrono::steady_clock::time_point now,
+  std::chrono::milliseconds retryInterval, size_t maxItems,
+  std::vector<RetryItem> &out) {
+
+  std::unique_lock<std::mutex> lock(mMutex);
+
+  // Never visit an item twice in the same pass, even with a zero interval
+  maxItems = std::min(maxItems, mPendingRequests.size());
+
+  size_t retried = 0;
+  while(retried < maxItems) {
+    if(mPendingRequests.at(mNextToRetry.front()).lastRetry + retryInterval > now) {
+      break;
+    }
+
+    Item& item = retryFront(now);
+
+    RetryItem retry;
+    retry.id = toRequestID(item.seq);
+    retry.channel = item.channel;
+    retry.contents = item.contents;
+    out.emplace_back(std::move(retry));
+    retried++;
+  }
+
+  return retried;
+}
+
 //------------------------------------------------------------------------------
 // Set blocking mode
 //------------------------------------------------------------------------------
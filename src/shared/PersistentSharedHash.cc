@@ -32,22 +32,55 @@
 #include "qclient/pubsub/Message.hh"
 #include "qclient/ResponseBuilder.hh"
 #include "qclient/shared/SharedHashSubscription.hh"
+#include "FlatStringMap.hh"
+#include "SnapshotCell.hh"
+#include "SharedSerialization.hh"
 #include <sstream>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdio.h>
 
 namespace qclient {
 
+//------------------------------------------------------------------------------
+// What readers see: An immutable copy of the contents, along with the version
+// it corresponds to.
+//------------------------------------------------------------------------------
+struct HashSnapshot {
+  HashSnapshot(uint64_t ver, const InternedStringMap &contents)
+  : version(ver), contents(contents) {}
+
+  uint64_t version;
+  FlatStringMap contents;
+};
+
 //------------------------------------------------------------------------------
 // Constructor - supply a SharedManager object. I'll keep a reference to it
 // throughout my lifetime - don't destroy it before me!
 //------------------------------------------------------------------------------
 PersistentSharedHash::PersistentSharedHash(SharedManager *sm_, const std::string &key_,
   const std::shared_ptr<SharedHashSubscriber> &sub)
-: sm(sm_), key(key_), currentVersion(0u) {
+: sm(sm_), key(key_), contents(sm_->getKeyInterner()), currentVersion(0u),
+  snapshot(new SnapshotCell<HashSnapshot>(std::unique_ptr<const HashSnapshot>(new HashSnapshot(0u, InternedStringMap())))) {
 
   mHashSubscriber = sub;
 
   logger = sm->getLogger();
   qcl = sm->getQClient();
+
+  std::string snapshotDir = sm->getSnapshotDirectory();
+  if(!snapshotDir.empty()) {
+    snapshotPath = SSTR(snapshotDir << "/" << snapshotFilename(key));
+    snapshotInterval = sm->getSnapshotInterval();
+    loadSnapshot();
+  }
+
+  if(!qcl) {
+    // Simulation mode, nothing to listen to
+    return;
+  }
+
   qcl->attachListener(this);
   subscription = sm->getSubscriber()->subscribe(SSTR("__vhash@" << key));
 
@@ -61,7 +94,13 @@ PersistentSharedHash::PersistentSharedHash(SharedManager *sm_, const std::string
 // Destructor
 //------------------------------------------------------------------------------
 PersistentSharedHash::~PersistentSharedHash() {
-  qcl->detachListener(this);
+  if(qcl) {
+    qcl->detachListener(this);
+  }
+
+  if(!snapshotPath.empty()) {
+    saveSnapshot();
+  }
 }
 
 //------------------------------------------------------------------------------
@@ -76,15 +115,22 @@ PersistentSharedHash::~PersistentSharedHash() {
 //------------------------------------------------------------------------------
 bool PersistentSharedHash::get(const std::string &field, std::string& value) {
   checkFuture();
+  return getPublished(field, value);
+}
 
-  std::shared_lock<std::shared_timed_mutex> lock(contentsMutex);
+//------------------------------------------------------------------------------
+// Read the field out of the latest published contents, without looking
+// at any pending resilvering reply.
+//------------------------------------------------------------------------------
+bool PersistentSharedHash::getPublished(const std::string &field, std::string& value) {
+  SnapshotCell<HashSnapshot>::ReadGuard snap(*snapshot);
 
-  auto it = contents.find(field);
-  if(it == contents.end()) {
+  const std::string *found = snap->contents.find(field);
+  if(!found) {
     return false;
   }
 
-  value = it->second;
+  value = *found;
   return true;
 }
 
@@ -99,7 +145,45 @@ void PersistentSharedHash::set(const std::string &field, const std::string &valu
 }
 
 void PersistentSharedHash::set(const std::map<std::string, std::string> &batch) {
+  if(!qcl) {
+    //--------------------------------------------------------------------------
+    // Simulation mode: Apply as the next revision
+    //--------------------------------------------------------------------------
+    if(batch.empty()) {
+      return;
+    }
+
+    std::unique_lock<std::mutex> lock(contentsMutex);
+    uint64_t revision = currentVersion + 1;
+    lock.unlock();
+
+    feedRevision(revision, batch);
+    return;
+  }
+
   qclient::MultiBuilder multi;
+  appendUpdates(multi, key, batch);
+  sm->getQClient()->execute(std::move(multi));
+}
+
+//------------------------------------------------------------------------------
+// Append the commands applying the given updates to the hash with the
+// given key - VHSET, or VHDEL for empty values.
+//------------------------------------------------------------------------------
+void PersistentSharedHash::appendUpdates(MultiBuilder &multi, const std::string &key,
+  const std::map<std::string, std::string> &batch) {
+
+  //----------------------------------------------------------------------------
+  // Generous estimate of the encoded size, so that the whole transaction fits
+  // into a single allocation.
+  //----------------------------------------------------------------------------
+  size_t estimate = 0;
+  for(auto it = batch.begin(); it != batch.end(); it++) {
+    estimate += key.size() + it->first.size() + it->second.size() + 64;
+  }
+
+  multi.reserve(estimate);
+
   for(auto it = batch.begin(); it != batch.end(); it++) {
     if(it->second.empty()) {
       multi.emplace_back("VHDEL", key, it->first);
@@ -108,8 +192,6 @@ void PersistentSharedHash::set(const std::map<std::string, std::string> &batch)
       multi.emplace_back("VHSET", key, it->first, it->second);
     }
   }
-
-  sm->getQClient()->execute(multi.getDeque());
 }
 
 //------------------------------------------------------------------------------
@@ -128,8 +210,8 @@ void PersistentSharedHash::del(const std::string &field) {
 uint64_t PersistentSharedHash::getCurrentVersion() {
   checkFuture();
 
-  std::shared_lock<std::shared_timed_mutex> lock(contentsMutex);
-  return currentVersion;
+  SnapshotCell<HashSnapshot>::ReadGuard snap(*snapshot);
+  return snap->version;
 }
 
 //------------------------------------------------------------------------------
@@ -143,27 +225,64 @@ void PersistentSharedHash::notifyConnectionEstablished(int64_t epoch) {
 }
 
 //------------------------------------------------------------------------------
-// Asynchronously trigger resilvering
+// Asynchronously trigger resilvering - incremental, if possible.
 //------------------------------------------------------------------------------
-void PersistentSharedHash::triggerResilvering() {
+void PersistentSharedHash::triggerResilvering(bool allowIncremental) {
+  uint64_t version = SnapshotCell<HashSnapshot>::ReadGuard(*snapshot)->version;
+
   std::lock_guard<std::mutex> lock(futureReplyMtx);
-  futureReply = qcl->exec("VHGETALL", key);
+  futureReplyIsIncremental = allowIncremental && incrementalSupported && version != 0u &&
+    qcl->getServerCapabilities().mayHave(Capability::kIncrementalResilvering);
+
+  if(futureReplyIsIncremental) {
+    futureReply = qcl->exec("VHGETCHANGES", key, SSTR(version));
+  }
+  else {
+    futureReply = qcl->exec("VHGETALL", key);
+  }
+
+  futureReplyPending = true;
 }
 
 //------------------------------------------------------------------------------
 // Check future
 //------------------------------------------------------------------------------
 void PersistentSharedHash::checkFuture() {
-  std::lock_guard<std::mutex> lock(futureReplyMtx);
-  if(futureReply.valid() && futureReply.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
-    handleResponse(futureReply.get());
+  // Fast path for readers: Nothing to look at, don't touch the mutex.
+  if(!futureReplyPending) {
+    return;
+  }
+
+  redisReplyPtr reply;
+  bool incremental;
+
+  {
+    std::lock_guard<std::mutex> lock(futureReplyMtx);
+    if(!futureReply.valid() || futureReply.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+      return;
+    }
+
+    futureReplyPending = false;
+    reply = futureReply.get();
+    incremental = futureReplyIsIncremental;
+  }
+
+  //----------------------------------------------------------------------------
+  // Handle outside of the lock - falling back to a full resilvering queues
+  // up a new request.
+  //----------------------------------------------------------------------------
+  if(!incremental) {
+    handleResponse(std::move(reply));
+  }
+  else if(!handleIncrementalResponse(std::move(reply))) {
+    triggerResilvering(false);
   }
 }
 
 //------------------------------------------------------------------------------
 // Parse serialized version + string map
 //------------------------------------------------------------------------------
-bool PersistentSharedHash::parseReply(redisReplyPtr &reply, uint64_t &revision, std::map<std::string, std::string> &contents) {
+bool PersistentSharedHash::parseReply(const redisReply *reply, uint64_t &revision, std::map<std::string, std::string> &contents) {
   contents.clear();
 
   if(reply == nullptr || reply->type != REDIS_REPLY_ARRAY || reply->elements != 2) {
@@ -198,6 +317,66 @@ bool PersistentSharedHash::parseReply(redisReplyPtr &reply, uint64_t &revision,
   return true;
 }
 
+//------------------------------------------------------------------------------
+// Parse the reply of VHGETCHANGES: An array of revisions, oldest first,
+// each serialized same as in a revision update message.
+//------------------------------------------------------------------------------
+bool PersistentSharedHash::parseChanges(const redisReply *reply, std::vector<Revision> &changes) {
+  changes.clear();
+
+  if(reply == nullptr || reply->type != REDIS_REPLY_ARRAY) {
+    return false;
+  }
+
+  changes.resize(reply->elements);
+  for(size_t i = 0; i < reply->elements; i++) {
+    if(!parseReply(reply->element[i], changes[i].first, changes[i].second)) {
+      changes.clear();
+      return false;
+    }
+  }
+
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Apply the reply of an incremental resilvering request. Returns false if
+// a full resilvering is needed instead.
+//------------------------------------------------------------------------------
+bool PersistentSharedHash::handleIncrementalResponse(redisReplyPtr &&reply) {
+  if(reply && reply->type == REDIS_REPLY_ERROR) {
+    //--------------------------------------------------------------------------
+    // Most likely an older server, which doesn't know about VHGETCHANGES.
+    // Don't bother asking again.
+    //--------------------------------------------------------------------------
+    QCLIENT_LOG(logger, LogLevel::kWarn, "SharedHash with key " << key <<
+      " cannot be resilvered incrementally, falling back to full resilvering: " <<
+      qclient::describeRedisReply(reply));
+    incrementalSupported = false;
+    return false;
+  }
+
+  if(reply && reply->type == REDIS_REPLY_NIL) {
+    // The server no longer has all revisions we're missing.
+    return false;
+  }
+
+  std::vector<Revision> changes;
+  if(!parseChanges(reply.get(), changes)) {
+    QCLIENT_LOG(logger, LogLevel::kWarn, "SharedHash could not parse incoming incremental resilvering message: " <<
+      qclient::describeRedisReply(reply));
+    return false;
+  }
+
+  for(size_t i = 0; i < changes.size(); i++) {
+    if(!feedRevision(changes[i].first, changes[i].second)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
 //------------------------------------------------------------------------------
 // Listen for resilvering responses
 //------------------------------------------------------------------------------
@@ -205,7 +384,7 @@ void PersistentSharedHash::handleResponse(redisReplyPtr &&reply) {
   uint64_t revision;
   std::map<std::string, std::string> contents;
 
-  if(!parseReply(reply, revision, contents)) {
+  if(!parseReply(reply.get(), revision, contents)) {
     QCLIENT_LOG(logger, LogLevel::kWarn, "SharedHash could not parse incoming resilvering message: " <<
       qclient::describeRedisReply(reply));
     return;
@@ -231,7 +410,7 @@ void PersistentSharedHash::processIncoming(Message &&msg) {
   uint64_t revision;
   std::map<std::string, std::string> update;
 
-  if(!parseReply(payload, revision, update)) {
+  if(!parseReply(payload.get(), revision, update)) {
     QCLIENT_LOG(logger, LogLevel::kWarn, "SharedHash could not parse incoming revision update: " <<
       qclient::describeRedisReply(payload));
     return;
@@ -268,7 +447,7 @@ void PersistentSharedHash::feedSingleKeyValue(const std::string &key, const std:
 //   "please bring me up-to-date by calling resilver function"
 //------------------------------------------------------------------------------
 bool PersistentSharedHash::feedRevision(uint64_t revision, const std::map<std::string, std::string> &updates) {
-  std::unique_lock<std::shared_timed_mutex> lock(contentsMutex);
+  std::unique_lock<std::mutex> lock(contentsMutex);
 
   if(revision <= currentVersion) {
     // I have a newer version than current revision, nothing to do
@@ -291,16 +470,21 @@ bool PersistentSharedHash::feedRevision(uint64_t revision, const std::map<std::s
   }
 
   currentVersion = revision;
+  publishSnapshot();
   lock.unlock();
 
+  maybeSaveSnapshot();
+
   if(mHashSubscriber) {
-    for(auto it = updates.begin(); it != updates.end(); it++) {
-      qclient::SharedHashUpdate hashUpdate;
-      hashUpdate.key = it->first;
-      hashUpdate.value = it->second;
+    std::vector<qclient::SharedHashUpdate> hashUpdates(updates.size());
 
-      mHashSubscriber->feedUpdate(hashUpdate);
+    size_t i = 0;
+    for(auto it = updates.begin(); it != updates.end(); it++, i++) {
+      hashUpdates[i].key = it->first;
+      hashUpdates[i].value = it->second;
     }
+
+    mHashSubscriber->feedUpdates(hashUpdates);
   }
 
   return true;
@@ -320,13 +504,233 @@ bool PersistentSharedHash::feedRevision(uint64_t revision, const std::string &ke
 // "Resilver" ṫhe hash, flushing all previous contents with new ones.
 //------------------------------------------------------------------------------
 void PersistentSharedHash::resilver(uint64_t revision, std::map<std::string, std::string> &&newContents) {
-  std::unique_lock<std::shared_timed_mutex> lock(contentsMutex);
+  std::unique_lock<std::mutex> lock(contentsMutex);
 
   QCLIENT_LOG(logger, LogLevel::kWarn, "SharedHash with key " << key <<
     " being resilvered with revision " << revision << " from " << currentVersion);
 
   currentVersion = revision;
-  contents = std::move(newContents);
+  contents.assign(newContents);
+  publishSnapshot();
+
+  if(mHashSubscriber) {
+    mHashSubscriber->feedResilvering(newContents);
+  }
+
+  lock.unlock();
+  maybeSaveSnapshot();
+}
+
+//------------------------------------------------------------------------------
+// Publish the current contents and version. Assumes lock is taken.
+//------------------------------------------------------------------------------
+void PersistentSharedHash::publishSnapshot() {
+  snapshot->publish(std::unique_ptr<const HashSnapshot>(new HashSnapshot(currentVersion, contents)));
+}
+
+//------------------------------------------------------------------------------
+// Start out from the on-disk snapshot, if there's one - resilvering then
+// only asks for newer revisions.
+//------------------------------------------------------------------------------
+void PersistentSharedHash::loadSnapshot() {
+  uint64_t version;
+  std::map<std::string, std::string> loaded;
+
+  lastSnapshotAt = std::chrono::steady_clock::now();
+
+  if(!readSnapshot(snapshotPath, version, loaded)) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(contentsMutex);
+
+  QCLIENT_LOG(logger, LogLevel::kInfo, "SharedHash with key " << key <<
+    " loaded snapshot with revision " << version << " from " << snapshotPath);
+
+  currentVersion = version;
+  contents.assign(loaded);
+  publishSnapshot();
+
+  if(mHashSubscriber) {
+    mHashSubscriber->feedResilvering(loaded);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Rewrite the on-disk snapshot, if the interval has passed. Never waits for
+// a write which is already going on.
+//------------------------------------------------------------------------------
+void PersistentSharedHash::maybeSaveSnapshot() {
+  if(snapshotPath.empty()) {
+    return;
+  }
+
+  std::unique_lock<std::mutex> lock(snapshotFileMtx, std::try_to_lock);
+  if(!lock.owns_lock()) {
+    return;
+  }
+
+  if(std::chrono::steady_clock::now() - lastSnapshotAt < snapshotInterval) {
+    return;
+  }
+
+  saveSnapshotLocked();
+}
+
+//------------------------------------------------------------------------------
+// Write the on-disk snapshot right away
+//------------------------------------------------------------------------------
+bool PersistentSharedHash::saveSnapshot() {
+  if(snapshotPath.empty()) {
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lock(snapshotFileMtx);
+  return saveSnapshotLocked();
+}
+
+//------------------------------------------------------------------------------
+// Assumes snapshotFileMtx is taken. Contents are copied under contentsMutex,
+// and written out without it, so writers aren't held up by the disk.
+//------------------------------------------------------------------------------
+bool PersistentSharedHash::saveSnapshotLocked() {
+  uint64_t version;
+  std::map<std::string, std::string> copy;
+
+  {
+    std::lock_guard<std::mutex> lock(contentsMutex);
+    version = currentVersion;
+    copy = contents.toMap();
+  }
+
+  lastSnapshotAt = std::chrono::steady_clock::now();
+
+  if(version == 0u) {
+    return false;
+  }
+
+  if(!writeSnapshot(snapshotPath, version, copy)) {
+    QCLIENT_LOG(logger, LogLevel::kWarn, "SharedHash with key " << key <<
+      " could not write snapshot to " << snapshotPath << ": " << strerror(errno));
+    return false;
+  }
+
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// On-disk snapshot format
+//------------------------------------------------------------------------------
+static const char kSnapshotMagic[4] = { 'Q', 'S', 'H', 'S' };
+static constexpr size_t kSnapshotHeaderSize = sizeof(kSnapshotMagic) + 8;
+
+bool PersistentSharedHash::writeSnapshot(const std::string &path, uint64_t version,
+  const std::map<std::string, std::string> &contents) {
+
+  std::string data(kSnapshotMagic, sizeof(kSnapshotMagic));
+  for(int shift = 56; shift >= 0; shift -= 8) {
+    data.push_back((char) ((version >> shift) & 0xFF));
+  }
+
+  data.append(serializeBatch(contents, BatchEncoding::kCompact));
+
+  std::string tmpPath = path + ".tmp";
+  int fd = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if(fd < 0) {
+    return false;
+  }
+
+  size_t written = 0;
+  while(written < data.size()) {
+    ssize_t rc = ::write(fd, data.data() + written, data.size() - written);
+    if(rc < 0 && errno == EINTR) continue;
+
+    if(rc <= 0) {
+      ::close(fd);
+      ::unlink(tmpPath.c_str());
+      return false;
+    }
+
+    written += rc;
+  }
+
+  if(::fsync(fd) != 0 || ::close(fd) != 0) {
+    ::unlink(tmpPath.c_str());
+    return false;
+  }
+
+  if(::rename(tmpPath.c_str(), path.c_str()) != 0) {
+    ::unlink(tmpPath.c_str());
+    return false;
+  }
+
+  return true;
+}
+
+bool PersistentSharedHash::readSnapshot(const std::string &path, uint64_t &version,
+  std::map<std::string, std::string> &contents) {
+
+  contents.clear();
+
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if(fd < 0) {
+    return false;
+  }
+
+  std::string data;
+  char buffer[64 * 1024];
+
+  while(true) {
+    ssize_t rc = ::read(fd, buffer, sizeof(buffer));
+    if(rc < 0 && errno == EINTR) continue;
+
+    if(rc < 0) {
+      ::close(fd);
+      return false;
+    }
+
+    if(rc == 0) break;
+    data.append(buffer, rc);
+  }
+
+  ::close(fd);
+
+  if(data.size() < kSnapshotHeaderSize ||
+     memcmp(data.data(), kSnapshotMagic, sizeof(kSnapshotMagic)) != 0) {
+    return false;
+  }
+
+  version = 0;
+  for(size_t i = sizeof(kSnapshotMagic); i < kSnapshotHeaderSize; i++) {
+    version = (version << 8) | (uint8_t) data[i];
+  }
+
+  if(version == 0u || !parseBatch(data.substr(kSnapshotHeaderSize), contents)) {
+    contents.clear();
+    return false;
+  }
+
+  return true;
+}
+
+std::string PersistentSharedHash::snapshotFilename(const std::string &key) {
+  static const char kHex[] = "0123456789ABCDEF";
+  std::string out;
+
+  for(size_t i = 0; i < key.size(); i++) {
+    unsigned char c = key[i];
+
+    if(isalnum(c) || c == '.' || c == '_' || c == '-') {
+      out.push_back(c);
+    }
+    else {
+      out.push_back('%');
+      out.push_back(kHex[c >> 4]);
+      out.push_back(kHex[c & 0xF]);
+    }
+  }
+
+  return out + ".snapshot";
 }
 
 }
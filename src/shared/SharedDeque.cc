@@ -27,15 +27,160 @@
 #include "qclient/QClient.hh"
 #include "qclient/pubsub/Subscriber.hh"
 #include "qclient/pubsub/Message.hh"
-
+#include "qclient/SSTR.hh"
+#include <mutex>
+#include <random>
+#include <sstream>
 
 namespace qclient {
 
+namespace {
+
+//------------------------------------------------------------------------------
+// Build a single deque-push-back carrying all given items, encoded straight
+// out of them - no intermediate copies.
+//------------------------------------------------------------------------------
+EncodedRequest makePushRequest(const std::string &key, const std::vector<std::string> &contents) {
+  std::vector<const char*> args;
+  std::vector<size_t> sizes;
+  args.reserve(contents.size() + 2);
+  sizes.reserve(contents.size() + 2);
+
+  args.emplace_back("deque-push-back");
+  sizes.emplace_back(15);
+  args.emplace_back(key.data());
+  sizes.emplace_back(key.size());
+
+  for(auto it = contents.begin(); it != contents.end(); it++) {
+    args.emplace_back(it->data());
+    sizes.emplace_back(it->size());
+  }
+
+  return EncodedRequest(args.size(), args.data(), sizes.data());
+}
+
+//------------------------------------------------------------------------------
+// Completion notification of an operation: "<op>-done <count> <origin>"
+//------------------------------------------------------------------------------
+std::string makeDoneNotification(const std::string &op, size_t count,
+  const std::string &origin) {
+  return SSTR(op << "-done " << count << " " << origin);
+}
+
+qclient::Status parsePushReply(const redisReplyPtr &reply) {
+  IntegerParser parser(reply);
+  if(!parser.ok()) {
+    return qclient::Status(EINVAL, parser.err());
+  }
+
+  return qclient::Status();
+}
+
+//------------------------------------------------------------------------------
+// Append the item held by a deque-pop-front reply into out. A nil reply
+// means the deque was empty at that point - skip it, but keep going, since a
+// concurrent push could have landed between two of our pipelined pops.
+//------------------------------------------------------------------------------
+qclient::Status parsePopReply(const redisReplyPtr &reply, std::vector<std::string> &out) {
+  if(reply && reply->type == REDIS_REPLY_NIL) {
+    return qclient::Status();
+  }
+
+  StringParser parser(reply);
+  if(!parser.ok()) {
+    return qclient::Status(EINVAL, parser.err());
+  }
+
+  out.emplace_back(parser.value());
+  return qclient::Status();
+}
+
+//------------------------------------------------------------------------------
+// Replies of a pipelined pop_front_many_async, gathered until the last one
+// arrives
+//------------------------------------------------------------------------------
+struct PopBatch {
+  PopBatch(size_t count, SharedDeque::PopCallback &&callback)
+  : replies(count), remaining(count), cb(std::move(callback)) {}
+
+  std::mutex mtx;
+  std::vector<redisReplyPtr> replies;
+  size_t remaining;
+  SharedDeque::PopCallback cb;
+};
+
+}
+
+//------------------------------------------------------------------------------
+// Local count of items
+//------------------------------------------------------------------------------
+void SharedDeque::SizeCache::invalidate() {
+  std::lock_guard<std::mutex> lock(mtx);
+  valid = false;
+  generation++;
+}
+
+void SharedDeque::SizeCache::pushed(size_t count) {
+  std::lock_guard<std::mutex> lock(mtx);
+  size += count;
+  generation++;
+}
+
+//------------------------------------------------------------------------------
+// Popping more than counted means some change went missing - don't paper over
+// it by clamping at zero.
+//------------------------------------------------------------------------------
+void SharedDeque::SizeCache::popped(size_t count) {
+  std::lock_guard<std::mutex> lock(mtx);
+  if(count > size) {
+    valid = false;
+  }
+  else {
+    size -= count;
+  }
+
+  generation++;
+}
+
+void SharedDeque::SizeCache::applyNotification(const std::string &op, size_t count) {
+  if(op == "push-back") {
+    pushed(count);
+  }
+  else if(op == "pop-front") {
+    popped(count);
+  }
+  else {
+    // A clear wipes out whatever happened before it, including changes whose
+    // notifications are yet to arrive
+    invalidate();
+  }
+}
+
+bool SharedDeque::SizeCache::get(size_t &out, uint64_t &gen) {
+  std::lock_guard<std::mutex> lock(mtx);
+  out = size;
+  gen = generation;
+  return valid;
+}
+
+void SharedDeque::SizeCache::set(size_t value, uint64_t gen) {
+  std::lock_guard<std::mutex> lock(mtx);
+  if(generation == gen) {
+    size = value;
+    valid = true;
+  }
+}
+
 //------------------------------------------------------------------------------
 // Constructor
 //------------------------------------------------------------------------------
 SharedDeque::SharedDeque(SharedManager *sm, const std::string &key)
-: mSharedManager(sm), mKey(key), mQcl(sm->getQClient()) {
+: mSharedManager(sm), mKey(key), mQcl(sm->getQClient()),
+  mSizeCache(std::make_shared<SizeCache>()) {
+
+  std::ostringstream origin;
+  origin << std::hex << std::random_device()() << std::random_device()();
+  mOrigin = origin.str();
 
   mSubscription = sm->getSubscriber()->subscribe(mKey);
   mSharedManager->getSubscriber()->getQcl()->attachListener(this);
@@ -56,28 +201,77 @@ SharedDeque::~SharedDeque() {
 // Push an element into the back of the deque
 //------------------------------------------------------------------------------
 qclient::Status SharedDeque::push_back(const std::string &contents) {
-  invalidateCachedSize();
+  return push_back_many(std::vector<std::string>{contents});
+}
+
+//------------------------------------------------------------------------------
+// Push several elements into the back of the deque, through a single
+// command. Subscribers are notified once for the entire batch.
+//------------------------------------------------------------------------------
+qclient::Status SharedDeque::push_back_many(const std::vector<std::string> &contents) {
+  if(contents.empty()) {
+    return qclient::Status();
+  }
 
   mSharedManager->publish(mKey, "push-back-prepare");
-  IntegerParser parser(mQcl->exec("deque-push-back", mKey, contents).get());
-  mSharedManager->publish(mKey, "push-back-done");
+  std::future<redisReplyPtr> fut = mQcl->execute(makePushRequest(mKey, contents));
+  mSharedManager->publish(mKey, makeDoneNotification("push-back", contents.size(), mOrigin));
 
-  if(!parser.ok()) {
-    return qclient::Status(EINVAL, parser.err());
+  qclient::Status st = parsePushReply(fut.get());
+  if(st.ok()) {
+    mSizeCache->pushed(contents.size());
+  }
+  else {
+    mSizeCache->invalidate();
   }
 
-  return qclient::Status();
+  return st;
+}
+
+//------------------------------------------------------------------------------
+// Asynchronous versions of push_back and push_back_many
+//------------------------------------------------------------------------------
+void SharedDeque::push_back_async(const std::string &contents, StatusCallback cb) {
+  push_back_many_async(std::vector<std::string>{contents}, std::move(cb));
+}
+
+void SharedDeque::push_back_many_async(const std::vector<std::string> &contents,
+  StatusCallback cb) {
+
+  if(contents.empty()) {
+    if(cb) cb(qclient::Status());
+    return;
+  }
+
+  std::shared_ptr<SizeCache> cache = mSizeCache;
+  size_t count = contents.size();
+
+  mSharedManager->publish(mKey, "push-back-prepare");
+  mQcl->execute(makePushRequest(mKey, contents), [cb, cache, count](redisReplyPtr &&reply) {
+    qclient::Status st = parsePushReply(reply);
+    if(st.ok()) {
+      cache->pushed(count);
+    }
+    else {
+      cache->invalidate();
+    }
+
+    if(cb) cb(st);
+  });
+  mSharedManager->publish(mKey, makeDoneNotification("push-back", count, mOrigin));
 }
 
 //------------------------------------------------------------------------------
 // Clear deque contents
 //------------------------------------------------------------------------------
 qclient::Status SharedDeque::clear() {
-  invalidateCachedSize();
-
   mSharedManager->publish(mKey, "clear-prepare");
   IntegerParser parser(mQcl->exec("deque-clear", mKey).get());
-  mSharedManager->publish(mKey, "clear-done");
+  mSharedManager->publish(mKey, makeDoneNotification("clear", 0, mOrigin));
+
+  // Notifications of changes made before the clear may still be on their
+  // way, so the count is unknown either way.
+  mSizeCache->invalidate();
 
   if(!parser.ok()) {
     return qclient::Status(EINVAL, parser.err());
@@ -91,42 +285,133 @@ qclient::Status SharedDeque::clear() {
 // returned - not an error.
 //------------------------------------------------------------------------------
 qclient::Status SharedDeque::pop_front(std::string &out) {
-  invalidateCachedSize();
   mSharedManager->publish(mKey, "pop-front-prepare");
-  StringParser parser(mQcl->exec("deque-pop-front", mKey).get());
-  mSharedManager->publish(mKey, "pop-front-done");
+  redisReplyPtr reply = mQcl->exec("deque-pop-front", mKey).get();
+
+  StringParser parser(reply);
+  mSharedManager->publish(mKey, makeDoneNotification("pop-front", parser.ok() ? 1 : 0, mOrigin));
 
   if(!parser.ok()) {
+    mSizeCache->invalidate();
     return qclient::Status(EINVAL, parser.err());
   }
 
+  mSizeCache->popped(1u);
   out = parser.value();
   return qclient::Status();
 }
 
+//------------------------------------------------------------------------------
+// Remove up to count items from the front of the queue. All pops are
+// pipelined between a single pair of notifications - the second one sent
+// once the replies are in, carrying how many items were actually popped.
+//------------------------------------------------------------------------------
+qclient::Status SharedDeque::pop_front_many(size_t count, std::vector<std::string> &out) {
+  if(count == 0u) {
+    return qclient::Status();
+  }
+
+  std::vector<std::future<redisReplyPtr>> futs;
+  futs.reserve(count);
+
+  mSharedManager->publish(mKey, "pop-front-prepare");
+  for(size_t i = 0; i < count; i++) {
+    futs.emplace_back(mQcl->exec("deque-pop-front", mKey));
+  }
+
+  size_t before = out.size();
+
+  qclient::Status retval;
+  for(size_t i = 0; i < futs.size(); i++) {
+    qclient::Status st = parsePopReply(futs[i].get(), out);
+    if(!st.ok() && retval.ok()) {
+      retval = st;
+    }
+  }
+
+  mSharedManager->publish(mKey, makeDoneNotification("pop-front", out.size() - before, mOrigin));
+
+  if(retval.ok()) {
+    mSizeCache->popped(out.size() - before);
+  }
+  else {
+    mSizeCache->invalidate();
+  }
+
+  return retval;
+}
+
+//------------------------------------------------------------------------------
+// Asynchronous version of pop_front_many. The completion notification goes
+// out from the last callback - unless a reply is missing, as happens when the
+// QClient shuts down, and publishing through it is no longer possible.
+//------------------------------------------------------------------------------
+void SharedDeque::pop_front_many_async(size_t count, PopCallback cb) {
+  if(count == 0u) {
+    if(cb) cb(qclient::Status(), {});
+    return;
+  }
+
+  std::shared_ptr<PopBatch> batch = std::make_shared<PopBatch>(count, std::move(cb));
+  std::shared_ptr<SizeCache> cache = mSizeCache;
+  SharedManager *sm = mSharedManager;
+  std::string key = mKey;
+  std::string origin = mOrigin;
+
+  mSharedManager->publish(mKey, "pop-front-prepare");
+  for(size_t i = 0; i < count; i++) {
+    mQcl->execute(EncodedRequest::make("deque-pop-front", mKey), [batch, cache, sm, key, origin, i](redisReplyPtr &&reply) {
+      std::unique_lock<std::mutex> lock(batch->mtx);
+      batch->replies[i] = std::move(reply);
+      if(--batch->remaining != 0u) {
+        return;
+      }
+
+      lock.unlock();
+
+      qclient::Status retval;
+      bool complete = true;
+      std::vector<std::string> items;
+      for(size_t j = 0; j < batch->replies.size(); j++) {
+        complete = complete && batch->replies[j];
+        qclient::Status st = parsePopReply(batch->replies[j], items);
+        if(!st.ok() && retval.ok()) {
+          retval = st;
+        }
+      }
+
+      if(complete) {
+        sm->publish(key, makeDoneNotification("pop-front", items.size(), origin));
+      }
+
+      if(retval.ok()) {
+        cache->popped(items.size());
+      }
+      else {
+        cache->invalidate();
+      }
+
+      if(batch->cb) batch->cb(retval, std::move(items));
+    });
+  }
+}
+
 //------------------------------------------------------------------------------
 //! Query deque size
 //------------------------------------------------------------------------------
 qclient::Status SharedDeque::size(size_t &out) {
-  std::unique_lock<std::mutex> lock(mCacheMutex);
-
-  if(mCachedSizeValid) {
-    out = mCachedSize;
+  uint64_t generation;
+  if(mSizeCache->get(out, generation)) {
     return qclient::Status();
   }
 
-  lock.unlock();
-
   IntegerParser parser(mQcl->exec("deque-len", mKey).get());
   if(!parser.ok()) {
     return qclient::Status(EINVAL, parser.err());
   }
 
-  lock.lock();
-
   out = parser.value();
-  mCachedSize = out;
-  mCachedSizeValid = true;
+  mSizeCache->set(out, generation);
   return qclient::Status();
 }
 
@@ -134,20 +419,67 @@ qclient::Status SharedDeque::size(size_t &out) {
 //! Invalidate cached size
 //------------------------------------------------------------------------------
 void SharedDeque::invalidateCachedSize() {
-  std::unique_lock<std::mutex> lock(mCacheMutex);
-  mCachedSize = 0u;
-  mCachedSizeValid = false;
+  mSizeCache->invalidate();
+}
+
+//------------------------------------------------------------------------------
+//! Completion notifications: "<op>-done <count> <origin>"
+//------------------------------------------------------------------------------
+bool SharedDeque::parseNotification(const std::string &payload, std::string &op,
+  size_t &count, std::string &origin) {
+
+  std::istringstream ss(payload);
+  std::string done;
+  if(!(ss >> done >> count >> origin)) {
+    return false;
+  }
+
+  const std::string suffix = "-done";
+  if(done.size() <= suffix.size() ||
+     done.compare(done.size() - suffix.size(), suffix.size(), suffix) != 0) {
+    return false;
+  }
+
+  std::string extra;
+  if(ss >> extra) {
+    return false;
+  }
+
+  op = done.substr(0, done.size() - suffix.size());
+  return true;
 }
 
 //------------------------------------------------------------------------------
-//! Process incoming message
+//! Process incoming message: Apply what other clients did - prepare
+//! notifications carry no information. Anything we can't make sense of
+//! means the count can't be trusted anymore.
 //------------------------------------------------------------------------------
 void SharedDeque::processIncoming(Message &&msg) {
-  invalidateCachedSize();
+  const std::string &payload = msg.getPayload();
+
+  const std::string suffix = "-prepare";
+  if(payload.size() > suffix.size() &&
+     payload.compare(payload.size() - suffix.size(), suffix.size(), suffix) == 0) {
+    return;
+  }
+
+  std::string op, origin;
+  size_t count;
+  if(!parseNotification(payload, op, count, origin)) {
+    mSizeCache->invalidate();
+    return;
+  }
+
+  if(origin == mOrigin) {
+    return;
+  }
+
+  mSizeCache->applyNotification(op, count);
 }
 
 //------------------------------------------------------------------------------
-//! Receive notifications from QClient
+//! Receive notifications from QClient - messages may have been lost while
+//! disconnected.
 //------------------------------------------------------------------------------
 void SharedDeque::notifyConnectionLost(int64_t epoch, int errc, const std::string &msg) {
   invalidateCachedSize();
@@ -27,25 +27,59 @@
 #include "qclient/shared/UpdateBatch.hh"
 #include "qclient/shared/SharedManager.hh"
 #include "qclient/shared/SharedHashSubscription.hh"
+#include "SnapshotCell.hh"
+#include "FlatStringMap.hh"
 
 namespace qclient {
 
+//------------------------------------------------------------------------------
+// Immutable merged index - each value is prefixed with its origin.
+//------------------------------------------------------------------------------
+struct MergedIndex {
+  MergedIndex(const InternedStringMap &merged)
+  : contents(merged) {}
+
+  FlatStringMap contents;
+};
+
 //------------------------------------------------------------------------------
 // Constructor
 //------------------------------------------------------------------------------
 SharedHash::SharedHash(SharedManager *sm, const std::string &key)
-: mSharedManager(sm), mKey(key) {
+: mSharedManager(sm), mKey(key), mMerged(sm->getKeyInterner()),
+  mIndex(new SnapshotCell<MergedIndex>(std::unique_ptr<const MergedIndex>(new MergedIndex(InternedStringMap())))) {
 
   mHashSubscriber.reset(new SharedHashSubscriber());
-  mPersistent.reset(new PersistentSharedHash(sm, key, mHashSubscriber));
-  mTransient = sm->makeTransientSharedHash(key, mHashSubscriber);
+
+  //----------------------------------------------------------------------------
+  // Start listening before the layers exist, so that no change can slip
+  // through - whatever arrives during construction gets merged below.
+  //----------------------------------------------------------------------------
+  using namespace std::placeholders;
+  mIndexSubscription.reset(new SharedHashSubscription(mHashSubscriber));
+  mIndexSubscription->attachBatchCallback(std::bind(&SharedHash::processLayerUpdate, this, _1));
+
+  std::unique_ptr<PersistentSharedHash> persistent(new PersistentSharedHash(sm, key, mHashSubscriber));
+  std::unique_ptr<TransientSharedHash> transient = sm->makeTransientSharedHash(key, mHashSubscriber);
+
+  std::lock_guard<std::mutex> lock(mMutex);
+  mPersistent = std::move(persistent);
+  mTransient = std::move(transient);
+
+  for(auto it = mPendingFields.begin(); it != mPendingFields.end(); it++) {
+    mergeField(*it);
+  }
+
+  mPendingFields.clear();
+  publishIndex();
 }
 
 //------------------------------------------------------------------------------
 // Destructor
 //------------------------------------------------------------------------------
 SharedHash::~SharedHash() {
-
+  // Stop listening before the layers go away
+  mIndexSubscription.reset();
 }
 
 //------------------------------------------------------------------------------
@@ -55,6 +89,11 @@ void SharedHash::set(const UpdateBatch &batch) {
   std::unique_lock<std::mutex> lock(mMutex);
   for(auto it = batch.localBegin(); it != batch.localEnd(); it++) {
     mLocal[it->first] = it->second;
+    mergeField(it->first);
+  }
+
+  if(batch.localBegin() != batch.localEnd()) {
+    publishIndex();
   }
 
   lock.unlock();
@@ -67,24 +106,27 @@ void SharedHash::set(const UpdateBatch &batch) {
 // Get value
 //------------------------------------------------------------------------------
 bool SharedHash::get(const std::string &field, std::string& value) {
-  std::unique_lock<std::mutex> lock(mMutex);
-  auto it = mLocal.find(field);
-  if(it != mLocal.end()) {
-    value = it->second;
-    return true;
-  }
+  Origin origin;
+  return get(field, value, origin);
+}
 
-  lock.unlock();
+//------------------------------------------------------------------------------
+// Get value, along with the layer it comes from
+//------------------------------------------------------------------------------
+bool SharedHash::get(const std::string &field, std::string& value, Origin &origin) {
+  // Let the persistent layer pick up a pending resilvering reply, if any
+  mPersistent->checkFuture();
 
-  if(mTransient->get(field, value)) {
-    return true;
-  }
+  SnapshotCell<MergedIndex>::ReadGuard index(*mIndex);
 
-  if(mPersistent->get(field, value)) {
-    return true;
+  const std::string *found = index->contents.find(field);
+  if(!found) {
+    return false;
   }
 
-  return false;
+  origin = static_cast<Origin>((*found)[0]);
+  value.assign(*found, 1, std::string::npos);
+  return true;
 }
 
 //------------------------------------------------------------------------------
@@ -95,4 +137,78 @@ std::unique_ptr<SharedHashSubscription> SharedHash::subscribe() {
     new SharedHashSubscription(mHashSubscriber));
 }
 
+//------------------------------------------------------------------------------
+// Layer update listener, feeds the merged index. A resilvering of the
+// persistent layer lists all of its fields - those it no longer lists
+// need a second look, too.
+//------------------------------------------------------------------------------
+void SharedHash::processLayerUpdate(SharedHashUpdateSet &&set) {
+  std::lock_guard<std::mutex> lock(mMutex);
+
+  if(!mPersistent || !mTransient) {
+    for(auto it = set.updates.begin(); it != set.updates.end(); it++) {
+      mPendingFields.insert(it->first);
+    }
+
+    return;
+  }
+
+  if(set.resilvered) {
+    std::vector<std::string> dropped;
+    for(auto it = mMerged.begin(); it != mMerged.end(); it++) {
+      if(it->second[0] == static_cast<char>(Origin::kPersistent) &&
+         set.updates.find(*it->first) == set.updates.end()) {
+        dropped.emplace_back(*it->first);
+      }
+    }
+
+    for(size_t i = 0; i < dropped.size(); i++) {
+      mergeField(dropped[i]);
+    }
+  }
+
+  for(auto it = set.updates.begin(); it != set.updates.end(); it++) {
+    mergeField(it->first);
+  }
+
+  publishIndex();
+}
+
+//------------------------------------------------------------------------------
+// Recompute the effective value of a field. Assume mMutex is taken.
+//------------------------------------------------------------------------------
+void SharedHash::mergeField(const std::string &field) {
+  Origin origin;
+  std::string value;
+
+  auto local = mLocal.find(field);
+  if(local != mLocal.end()) {
+    origin = Origin::kLocal;
+    value = local->second;
+  }
+  else if(mTransient->get(field, value)) {
+    origin = Origin::kTransient;
+  }
+  else if(mPersistent->getPublished(field, value)) {
+    origin = Origin::kPersistent;
+  }
+  else {
+    mMerged.erase(field);
+    return;
+  }
+
+  std::string &entry = mMerged[field];
+  entry.clear();
+  entry.reserve(value.size() + 1);
+  entry.push_back(static_cast<char>(origin));
+  entry.append(value);
+}
+
+//------------------------------------------------------------------------------
+// Publish the merged index. Assume mMutex is taken.
+//------------------------------------------------------------------------------
+void SharedHash::publishIndex() {
+  mIndex->publish(std::unique_ptr<const MergedIndex>(new MergedIndex(mMerged)));
+}
+
 }
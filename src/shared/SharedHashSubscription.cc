@@ -41,6 +41,7 @@ SharedHashSubscription::SharedHashSubscription(std::shared_ptr<SharedHashSubscri
 //------------------------------------------------------------------------------
 SharedHashSubscription::~SharedHashSubscription() {
   mSubscriber->unregisterSubscription(this);
+  detachBatchCallback();
 }
 
 //------------------------------------------------------------------------------
@@ -106,13 +107,169 @@ void SharedHashSubscription::detachCallback() {
   mQueue.detach();
 }
 
+//------------------------------------------------------------------------------
+// Batch mode: Deliver each revision, or resilvering, whole, as a single
+// update set - optionally coalesced over the given window.
+//------------------------------------------------------------------------------
+void SharedHashSubscription::attachBatchCallback(const BatchCallback &cb, std::chrono::milliseconds window) {
+  detachBatchCallback();
+
+  std::unique_lock<std::mutex> lock(mBatchMtx);
+  mBatchCallback = cb;
+  mBatchWindow = window;
+  lock.unlock();
+
+  if(window != std::chrono::milliseconds(0)) {
+    mCoalescingThread.reset(&SharedHashSubscription::coalesce, this);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Leave batch mode, delivering whatever's pending right away
+//------------------------------------------------------------------------------
+void SharedHashSubscription::detachBatchCallback() {
+  //----------------------------------------------------------------------------
+  // Notify under the lock, so that the thread can't miss the termination
+  // request.
+  //----------------------------------------------------------------------------
+  mCoalescingThread.stop();
+
+  {
+    std::lock_guard<std::mutex> lock(mBatchMtx);
+    mBatchCV.notify_all();
+  }
+
+  mCoalescingThread.join();
+
+  std::unique_lock<std::mutex> lock(mBatchMtx);
+  BatchCallback cb;
+  cb.swap(mBatchCallback);
+  mBatchWindow = std::chrono::milliseconds(0);
+
+  SharedHashUpdateSet pending;
+  bool hasPending = mBatchPending;
+  std::swap(pending, mPendingBatch);
+  mBatchPending = false;
+  lock.unlock();
+
+  if(hasPending) {
+    cb(std::move(pending));
+  }
+}
+
+//------------------------------------------------------------------------------
+// Are we in batch mode?
+//------------------------------------------------------------------------------
+bool SharedHashSubscription::isBatchMode() {
+  std::lock_guard<std::mutex> lock(mBatchMtx);
+  return mBatchCallback != nullptr;
+}
+
+//------------------------------------------------------------------------------
+// Hand an update set to the batch callback, or merge it into the pending
+// one, if there's a coalescing window.
+//------------------------------------------------------------------------------
+void SharedHashSubscription::deliverBatch(SharedHashUpdateSet &&set) {
+  std::unique_lock<std::mutex> lock(mBatchMtx);
+  if(!mBatchCallback) {
+    return;
+  }
+
+  if(mBatchWindow == std::chrono::milliseconds(0)) {
+    BatchCallback cb = mBatchCallback;
+    lock.unlock();
+    cb(std::move(set));
+    return;
+  }
+
+  if(set.resilvered) {
+    mPendingBatch.resilvered = true;
+    mPendingBatch.updates = std::move(set.updates);
+  }
+  else {
+    for(auto it = set.updates.begin(); it != set.updates.end(); it++) {
+      mPendingBatch.updates[it->first] = std::move(it->second);
+    }
+  }
+
+  if(!mBatchPending) {
+    mBatchPending = true;
+    mBatchDeadline = std::chrono::steady_clock::now() + mBatchWindow;
+    mBatchCV.notify_one();
+  }
+}
+
+//------------------------------------------------------------------------------
+// Coalescing thread: Deliver the pending update set once its window closes.
+//------------------------------------------------------------------------------
+void SharedHashSubscription::coalesce(ThreadAssistant &assistant) {
+  std::unique_lock<std::mutex> lock(mBatchMtx);
+
+  while(!assistant.terminationRequested()) {
+    if(!mBatchPending) {
+      mBatchCV.wait(lock);
+      continue;
+    }
+
+    if(std::chrono::steady_clock::now() < mBatchDeadline) {
+      mBatchCV.wait_until(lock, mBatchDeadline);
+      continue;
+    }
+
+    SharedHashUpdateSet set;
+    std::swap(set, mPendingBatch);
+    mBatchPending = false;
+    BatchCallback cb = mBatchCallback;
+
+    lock.unlock();
+    cb(std::move(set));
+    lock.lock();
+  }
+}
+
 //------------------------------------------------------------------------------
 // Process incoming update
 //------------------------------------------------------------------------------
 void SharedHashSubscription::processIncoming(const SharedHashUpdate &update) {
+  if(isBatchMode()) {
+    SharedHashUpdateSet set;
+    set.updates[update.key] = update.value;
+    return deliverBatch(std::move(set));
+  }
+
   mQueue.emplace_back(update);
 }
 
+//------------------------------------------------------------------------------
+// Process incoming updates of a single revision
+//------------------------------------------------------------------------------
+void SharedHashSubscription::processIncoming(const std::vector<SharedHashUpdate> &updates) {
+  if(isBatchMode()) {
+    SharedHashUpdateSet set;
+    for(auto it = updates.begin(); it != updates.end(); it++) {
+      set.updates[it->key] = it->value;
+    }
+
+    return deliverBatch(std::move(set));
+  }
+
+  for(auto it = updates.begin(); it != updates.end(); it++) {
+    mQueue.emplace_back(*it);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Process resilvering - only of interest in batch mode
+//------------------------------------------------------------------------------
+void SharedHashSubscription::processResilvering(const std::map<std::string, std::string> &contents) {
+  if(isBatchMode()) {
+    SharedHashUpdateSet set;
+    set.resilvered = true;
+    set.updates = contents;
+    deliverBatch(std::move(set));
+  }
+}
+
 //------------------------------------------------------------------------------
 // Constructor
 //------------------------------------------------------------------------------
@@ -137,6 +294,26 @@ void SharedHashSubscriber::feedUpdate(const SharedHashUpdate &update) {
   }
 }
 
+//------------------------------------------------------------------------------
+// Feed all updates of a single revision at once
+//------------------------------------------------------------------------------
+void SharedHashSubscriber::feedUpdates(const std::vector<SharedHashUpdate> &updates) {
+  std::unique_lock<std::mutex> lock(mMutex);
+  for(auto it = mSubscriptions.begin(); it != mSubscriptions.end(); it++) {
+    (*it)->processIncoming(updates);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Feed the entire contents of a resilvered hash
+//------------------------------------------------------------------------------
+void SharedHashSubscriber::feedResilvering(const std::map<std::string, std::string> &contents) {
+  std::unique_lock<std::mutex> lock(mMutex);
+  for(auto it = mSubscriptions.begin(); it != mSubscriptions.end(); it++) {
+    (*it)->processResilvering(contents);
+  }
+}
+
 //------------------------------------------------------------------------------
 // Register subscription
 //------------------------------------------------------------------------------
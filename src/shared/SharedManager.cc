@@ -26,6 +26,11 @@
 #include "qclient/pubsub/Subscriber.hh"
 #include "qclient/pubsub/Message.hh"
 #include "qclient/shared/TransientSharedHash.hh"
+#include "qclient/shared/PersistentSharedHash.hh"
+#include "qclient/shared/SharedWriteBatch.hh"
+#include "qclient/MultiBuilder.hh"
+#include "SharedSerialization.hh"
+#include <vector>
 
 namespace qclient {
 
@@ -62,7 +67,7 @@ void SharedManager::publish(const std::string &channel, const std::string &paylo
     //--------------------------------------------------------------------------
     // Real mode
     //--------------------------------------------------------------------------
-    qcl->exec("PUBLISH", channel, payload);
+    qcl->executeFireAndForget(kPublish.make(channel, payload));
   }
   else {
     //--------------------------------------------------------------------------
@@ -72,6 +77,206 @@ void SharedManager::publish(const std::string &channel, const std::string &paylo
   }
 }
 
+//------------------------------------------------------------------------------
+// Publish the given batch of hash updates, coalescing it with others on
+// the same channel, if there's a coalescing window for it.
+//------------------------------------------------------------------------------
+void SharedManager::publishBatch(const std::string &channel, const std::map<std::string, std::string> &batch) {
+  std::unique_lock<std::mutex> lock(coalescingMtx);
+
+  auto pending = pendingBatches.find(channel);
+  if(pending != pendingBatches.end()) {
+    //--------------------------------------------------------------------------
+    // Window already open, merge
+    //--------------------------------------------------------------------------
+    for(auto it = batch.begin(); it != batch.end(); it++) {
+      pending->second[it->first] = it->second;
+    }
+
+    return;
+  }
+
+  std::chrono::microseconds window = defaultCoalescingWindow;
+  auto custom = channelCoalescingWindows.find(channel);
+  if(custom != channelCoalescingWindows.end()) {
+    window = custom->second;
+  }
+
+  if(window == std::chrono::microseconds(0)) {
+    lock.unlock();
+    publish(channel, serialize(batch));
+    return;
+  }
+
+  //----------------------------------------------------------------------------
+  // Open a new window
+  //----------------------------------------------------------------------------
+  pendingBatches[channel] = batch;
+  pendingDeadlines.emplace(Clock::now() + window, channel);
+  coalescingCV.notify_one();
+}
+
+//------------------------------------------------------------------------------
+// Publish hash updates in a compact encoding
+//------------------------------------------------------------------------------
+void SharedManager::setCompactEncoding(bool enabled) {
+  compactEncoding = enabled;
+}
+
+//------------------------------------------------------------------------------
+// Keep on-disk snapshots of persistent shared hashes
+//------------------------------------------------------------------------------
+void SharedManager::setSnapshotDirectory(const std::string &dir, std::chrono::seconds interval) {
+  std::lock_guard<std::mutex> lock(snapshotMtx);
+  snapshotDirectory = dir;
+  snapshotInterval = interval;
+}
+
+std::string SharedManager::getSnapshotDirectory() {
+  std::lock_guard<std::mutex> lock(snapshotMtx);
+  return snapshotDirectory;
+}
+
+std::chrono::seconds SharedManager::getSnapshotInterval() {
+  std::lock_guard<std::mutex> lock(snapshotMtx);
+  return snapshotInterval;
+}
+
+//------------------------------------------------------------------------------
+// Compress published hash updates
+//------------------------------------------------------------------------------
+void SharedManager::setCompression(const ValueCompression &comp) {
+  std::lock_guard<std::mutex> lock(compressionMtx);
+  compression = comp;
+}
+
+std::string SharedManager::serialize(const std::map<std::string, std::string> &batch) {
+  std::string payload = serializeBatch(batch, compactEncoding ? BatchEncoding::kCompact : BatchEncoding::kLegacy);
+
+  std::lock_guard<std::mutex> lock(compressionMtx);
+  if(!compression.active()) {
+    return payload;
+  }
+
+  return compression.encode(payload);
+}
+
+//------------------------------------------------------------------------------
+// Coalesce hash updates within the given window
+//------------------------------------------------------------------------------
+void SharedManager::setCoalescingWindow(std::chrono::microseconds window) {
+  std::lock_guard<std::mutex> lock(coalescingMtx);
+  defaultCoalescingWindow = window;
+  startCoalescingThread();
+}
+
+void SharedManager::setCoalescingWindow(const std::string &channel, std::chrono::microseconds window) {
+  std::lock_guard<std::mutex> lock(coalescingMtx);
+  channelCoalescingWindows[channel] = window;
+  startCoalescingThread();
+}
+
+//------------------------------------------------------------------------------
+// Start the coalescing thread, if not running already. Assumes lock is taken.
+//------------------------------------------------------------------------------
+void SharedManager::startCoalescingThread() {
+  if(!coalescingStarted) {
+    coalescingStarted = true;
+    coalescingThread.reset(&SharedManager::coalesce, this);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Publish all coalesced updates right away
+//------------------------------------------------------------------------------
+void SharedManager::flushCoalesced() {
+  std::map<std::string, Batch> batches;
+
+  {
+    std::lock_guard<std::mutex> lock(coalescingMtx);
+    batches.swap(pendingBatches);
+    pendingDeadlines.clear();
+  }
+
+  for(auto it = batches.begin(); it != batches.end(); it++) {
+    publish(it->first, serialize(it->second));
+  }
+}
+
+//------------------------------------------------------------------------------
+// Send out updates to many hashes in one go
+//------------------------------------------------------------------------------
+void SharedManager::flush(const SharedWriteBatch &batch, size_t maxPerTransaction) {
+  if(qcl) {
+    std::vector<MultiBuilder> transactions = makeTransactions(batch, maxPerTransaction);
+    for(size_t i = 0; i < transactions.size(); i++) {
+      qcl->execute(std::move(transactions[i]));
+    }
+  }
+
+  const std::map<std::string, SharedWriteBatch::Updates> &transient = batch.getTransient();
+  for(auto it = transient.begin(); it != transient.end(); it++) {
+    publishBatch(it->first, it->second);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Pack the durable updates of the given batch into transactions. A
+// transaction is closed once it holds maxPerTransaction commands or more,
+// in between two hashes.
+//------------------------------------------------------------------------------
+std::vector<MultiBuilder> SharedManager::makeTransactions(const SharedWriteBatch &batch,
+  size_t maxPerTransaction) {
+
+  std::vector<MultiBuilder> transactions;
+  const std::map<std::string, SharedWriteBatch::Updates> &durable = batch.getDurable();
+
+  for(auto it = durable.begin(); it != durable.end(); it++) {
+    if(transactions.empty() || transactions.back().size() >= maxPerTransaction) {
+      transactions.emplace_back();
+    }
+
+    PersistentSharedHash::appendUpdates(transactions.back(), it->first, it->second);
+  }
+
+  return transactions;
+}
+
+//------------------------------------------------------------------------------
+// Coalescing thread: Publish each batch once its window closes.
+//------------------------------------------------------------------------------
+void SharedManager::coalesce(ThreadAssistant &assistant) {
+  std::unique_lock<std::mutex> lock(coalescingMtx);
+
+  while(!assistant.terminationRequested()) {
+    if(pendingDeadlines.empty()) {
+      coalescingCV.wait(lock);
+      continue;
+    }
+
+    Clock::time_point now = Clock::now();
+    if(pendingDeadlines.begin()->first > now) {
+      coalescingCV.wait_until(lock, pendingDeadlines.begin()->first);
+      continue;
+    }
+
+    std::vector<std::pair<std::string, Batch>> due;
+    while(!pendingDeadlines.empty() && pendingDeadlines.begin()->first <= now) {
+      auto pending = pendingBatches.find(pendingDeadlines.begin()->second);
+      due.emplace_back(pending->first, std::move(pending->second));
+
+      pendingBatches.erase(pending);
+      pendingDeadlines.erase(pendingDeadlines.begin());
+    }
+
+    lock.unlock();
+    for(size_t i = 0; i < due.size(); i++) {
+      publish(due[i].first, serialize(due[i].second));
+    }
+    lock.lock();
+  }
+}
+
 //------------------------------------------------------------------------------
 // Make a transient shared hash based on the given channel
 //------------------------------------------------------------------------------
@@ -83,7 +288,21 @@ std::unique_ptr<TransientSharedHash> SharedManager::makeTransientSharedHash(cons
 //------------------------------------------------------------------------------
 // Destructor
 //------------------------------------------------------------------------------
-SharedManager::~SharedManager() {}
+SharedManager::~SharedManager() {
+  //----------------------------------------------------------------------------
+  // Stop the coalescing thread - notify under the lock, so that it can't miss
+  // the termination request - then send out whatever it left behind.
+  //----------------------------------------------------------------------------
+  coalescingThread.stop();
+
+  {
+    std::lock_guard<std::mutex> lock(coalescingMtx);
+    coalescingCV.notify_all();
+  }
+
+  coalescingThread.join();
+  flushCoalesced();
+}
 
 //------------------------------------------------------------------------------
 // Get pointer to underlying QClient object - lifetime is tied to this
@@ -108,5 +327,12 @@ std::shared_ptr<Logger> SharedManager::getLogger() {
   return logger;
 }
 
+//------------------------------------------------------------------------------
+// Interner for the field names of all hashes managed by us
+//------------------------------------------------------------------------------
+std::shared_ptr<StringInterner> SharedManager::getKeyInterner() {
+  return keyInterner;
+}
+
 }
 
@@ -26,7 +26,10 @@
 #include "qclient/utils/Macros.hh"
 #include "qclient/Debug.hh"
 #include "BinarySerializer.hh"
+#include "qclient/ValueCompression.hh"
+#include <algorithm>
 #include <iostream>
+#include <iterator>
 
 namespace qclient {
 
@@ -34,56 +37,188 @@ namespace qclient {
 //! Utilities for serializing the payload of messages intended for shared
 //! data structures.
 //------------------------------------------------------------------------------
-std::string serializeBatch(const std::map<std::string, std::string> &batch) {
+static const char kCompactBatchVersion = 0x01;
+
+static size_t getSharedPrefix(const std::string &a, const std::string &b) {
+  size_t len = std::min(a.size(), b.size());
+  size_t i = 0;
+
+  while(i < len && a[i] == b[i]) {
+    i++;
+  }
+
+  return i;
+}
+
+static std::string serializeCompactBatch(const std::map<std::string, std::string> &batch) {
   std::string retval;
 
-  size_t retvalSize = 8; // 8 bytes for array size
+  //----------------------------------------------------------------------------
+  // Keys come sorted out of the map, so neighbours often share a prefix.
+  //----------------------------------------------------------------------------
+  size_t retvalSize = 1 + BinarySerializer::getVarintSize(batch.size());
+  const std::string *previous = nullptr;
+
   for(auto it = batch.begin(); it != batch.end(); it++) {
-    // 8 bytes for key size + actual key
-    retvalSize += 8 + it->first.size();
+    size_t shared = previous ? getSharedPrefix(*previous, it->first) : 0u;
+    size_t rest = it->first.size() - shared;
 
-    // 8 bytes for value size + actual value
-    retvalSize += 8 + it->second.size();
+    retvalSize += BinarySerializer::getVarintSize(shared);
+    retvalSize += BinarySerializer::getVarintSize(rest) + rest;
+    retvalSize += BinarySerializer::getVarintSize(it->second.size()) + it->second.size();
+    previous = &it->first;
   }
 
   BinarySerializer serializer(retval, retvalSize);
+  serializer.appendBytes(&kCompactBatchVersion, 1);
+  serializer.appendVarint(batch.size());
 
-  serializer.appendInt64(batch.size() * 2);
-
+  previous = nullptr;
   for(auto it = batch.begin(); it != batch.end(); it++) {
-    serializer.appendString(it->first);
-    serializer.appendString(it->second);
+    size_t shared = previous ? getSharedPrefix(*previous, it->first) : 0u;
+
+    serializer.appendVarint(shared);
+    serializer.appendVarint(it->first.size() - shared);
+    serializer.appendBytes(it->first.data() + shared, it->first.size() - shared);
+    serializer.appendVarint(it->second.size());
+    serializer.appendBytes(it->second.data(), it->second.size());
+    previous = &it->first;
   }
 
+  qclient_assert(serializer.getRemaining() == 0);
   return retval;
 }
 
-bool parseBatch(const std::string &payload, std::map<std::string, std::string> &out) {
-  out.clear();
+static bool walkCompactBatch(const std::string &payload, const BatchVisitor *visitor) {
+  BinaryDeserializer deserializer(payload);
+
+  const char *version = nullptr;
+  if(!deserializer.consumeRawView(version, 1)) return false;
+  if(version[0] != kCompactBatchVersion) return false;
+
+  uint64_t pairs = 0;
+  if(!deserializer.consumeVarint(pairs)) return false;
+
+  //----------------------------------------------------------------------------
+  // Keys are rebuilt in place out of the shared prefix, so they can't point
+  // into the payload - reusing the buffer saves the allocations at least.
+  //----------------------------------------------------------------------------
+  std::string key;
+  for(uint64_t i = 0; i < pairs; i++) {
+    uint64_t shared = 0;
+    if(!deserializer.consumeVarint(shared)) return false;
+    if(shared > key.size()) return false;
+    key.resize(shared);
+
+    const char *rest = nullptr;
+    uint64_t restLen = 0;
+    if(!deserializer.consumeVarint(restLen)) return false;
+    if(!deserializer.consumeRawView(rest, restLen)) return false;
+    key.append(rest, restLen);
+
+    const char *value = nullptr;
+    uint64_t valueLen = 0;
+    if(!deserializer.consumeVarint(valueLen)) return false;
+    if(!deserializer.consumeRawView(value, valueLen)) return false;
 
+    if(visitor) {
+      (*visitor)(key.data(), key.size(), value, valueLen);
+    }
+  }
+
+  return deserializer.bytesLeft() == 0;
+}
+
+static bool walkLegacyBatch(const std::string &payload, const BatchVisitor *visitor) {
   BinaryDeserializer deserializer(payload);
 
   int64_t elements = 0;
   if(!deserializer.consumeInt64(elements)) return false;
   if(elements < 0 || elements % 2 != 0) return false;
 
-  std::string key;
-  for(int64_t i = 0; i < elements; i++) {
-    std::string value;
-    if(!deserializer.consumeString(value)) return false;
+  for(int64_t i = 0; i < elements; i += 2) {
+    const char *key = nullptr;
+    const char *value = nullptr;
+    size_t keyLen = 0;
+    size_t valueLen = 0;
+
+    if(!deserializer.consumeStringView(key, keyLen)) return false;
+    if(!deserializer.consumeStringView(value, valueLen)) return false;
 
-    // adjust output
-    if(i % 2 != 0) {
-      out[key] = value;
+    if(visitor) {
+      (*visitor)(key, keyLen, value, valueLen);
     }
-    else {
-      key = std::move(value);
+  }
+
+  return true;
+}
+
+static bool walkBatch(const std::string &payload, const BatchVisitor *visitor) {
+  if(!payload.empty() && payload[0] == kCompactBatchVersion) {
+    return walkCompactBatch(payload, visitor);
+  }
+
+  return walkLegacyBatch(payload, visitor);
+}
+
+//------------------------------------------------------------------------------
+//! Validate the entire batch first, so that the visitor never sees part of
+//! a corrupted one.
+//------------------------------------------------------------------------------
+bool visitBatch(const std::string &payload, const BatchVisitor &visitor) {
+  if(ValueCompression::isEncoded(payload)) {
+    std::string decoded;
+    if(!ValueCompression::decode(payload.data(), payload.size(), decoded)) {
+      return false;
     }
+
+    return visitBatch(decoded, visitor);
+  }
+
+  if(!walkBatch(payload, nullptr)) {
+    return false;
   }
 
+  walkBatch(payload, &visitor);
   return true;
 }
 
+std::string serializeBatch(const std::map<std::string, std::string> &batch, BatchEncoding encoding) {
+  if(encoding == BatchEncoding::kCompact) {
+    return serializeCompactBatch(batch);
+  }
+
+  std::string retval;
+
+  size_t retvalSize = 8; // 8 bytes for array size
+  for(auto it = batch.begin(); it != batch.end(); it++) {
+    // 8 bytes for key size + actual key
+    retvalSize += 8 + it->first.size();
+
+    // 8 bytes for value size + actual value
+    retvalSize += 8 + it->second.size();
+  }
+
+  BinarySerializer serializer(retval, retvalSize);
+
+  serializer.appendInt64(batch.size() * 2);
+
+  for(auto it = batch.begin(); it != batch.end(); it++) {
+    serializer.appendString(it->first);
+    serializer.appendString(it->second);
+  }
+
+  return retval;
+}
+
+bool parseBatch(const std::string &payload, std::map<std::string, std::string> &out) {
+  out.clear();
+
+  return visitBatch(payload, [&out](const char *key, size_t keyLen, const char *value, size_t valueLen) {
+    out[std::string(key, keyLen)].assign(value, valueLen);
+  });
+}
+
 //------------------------------------------------------------------------------
 //! Serialize Communicator request
 //------------------------------------------------------------------------------
@@ -154,4 +289,57 @@ bool parseCommunicatorReply(const std::string &payload, CommunicatorReply &reply
   return true;
 }
 
+//------------------------------------------------------------------------------
+//! Serialize a batch of Communicator requests or replies
+//------------------------------------------------------------------------------
+std::string serializeCommunicatorBatch(const std::vector<std::string> &messages) {
+  std::string retval;
+
+  // BATCH (string) + count (int64) + each message (string)
+  size_t payloadSize = (8 + 5) + 8;
+  for(size_t i = 0; i < messages.size(); i++) {
+    payloadSize += 8 + messages[i].size();
+  }
+
+  BinarySerializer serializer(retval, payloadSize);
+  serializer.appendString("BATCH");
+  serializer.appendInt64(messages.size());
+
+  for(size_t i = 0; i < messages.size(); i++) {
+    serializer.appendString(messages[i]);
+  }
+
+  qclient_assert(serializer.getRemaining() == 0);
+  return retval;
+}
+
+//------------------------------------------------------------------------------
+//! Parse a batch of Communicator requests or replies
+//------------------------------------------------------------------------------
+bool parseCommunicatorBatch(const std::string &payload, std::vector<std::string> &messages) {
+  BinaryDeserializer deserializer(payload);
+
+  std::string tmp;
+  if(!deserializer.consumeString(tmp)) return false;
+  if(tmp != "BATCH") return false;
+
+  int64_t count;
+  if(!deserializer.consumeInt64(count)) return false;
+  if(count < 0) return false;
+
+  // Each message needs at least its 8-byte length
+  if(static_cast<uint64_t>(count) > deserializer.bytesLeft() / 8) return false;
+
+  std::vector<std::string> parsed(count);
+  for(int64_t i = 0; i < count; i++) {
+    if(!deserializer.consumeString(parsed[i])) return false;
+  }
+
+  if(deserializer.bytesLeft() != 0) return false;
+
+  messages.insert(messages.end(), std::make_move_iterator(parsed.begin()),
+    std::make_move_iterator(parsed.end()));
+  return true;
+}
+
 }
@@ -24,20 +24,60 @@
 #ifndef QCLIENT_SHARED_SERIALIZATION_HH
 #define QCLIENT_SHARED_SERIALIZATION_HH
 
+#include "qclient/EncodedRequest.hh"
+#include <functional>
 #include <map>
 #include <string>
+#include <vector>
 
 namespace qclient {
 
 class CommunicatorReply;
 
+//------------------------------------------------------------------------------
+//! All serialized messages go out through PUBLISH channel payload
+//------------------------------------------------------------------------------
+constexpr Command<3> kPublish("PUBLISH");
+
+//------------------------------------------------------------------------------
+//! Encodings of a batch of updates:
+//!
+//! - kLegacy: Number of strings as int64, followed by each key and value,
+//!   prefixed by its length as int64. Since the count is big-endian, the
+//!   first byte is always zero.
+//! - kCompact: A version byte, the number of pairs as varint, then for each
+//!   pair: The length of the prefix the key shares with the previous one,
+//!   the length of the rest of the key, the rest of the key, the length of
+//!   the value, and the value. Lengths are varints. Not readable by clients
+//!   older than this format!
+//!
+//! parseBatch understands both, as well as either one compressed through
+//! ValueCompression - a compressed payload starts with a different byte.
+//------------------------------------------------------------------------------
+enum class BatchEncoding {
+  kLegacy,
+  kCompact
+};
+
 //------------------------------------------------------------------------------
 //! Utilities for serializing the payload of messages intended for shared
 //! data structures.
 //------------------------------------------------------------------------------
-std::string serializeBatch(const std::map<std::string, std::string> &batch);
+std::string serializeBatch(const std::map<std::string, std::string> &batch,
+  BatchEncoding encoding = BatchEncoding::kLegacy);
 bool parseBatch(const std::string &payload, std::map<std::string, std::string> &out);
 
+//------------------------------------------------------------------------------
+//! Call the visitor for each key-value pair of the batch, in order, without
+//! copying the strings out of the payload first. The pointers are only valid
+//! during the call. Returns false, without calling the visitor at all, if the
+//! batch is corrupted.
+//------------------------------------------------------------------------------
+using BatchVisitor = std::function<void(const char *key, size_t keyLen,
+  const char *value, size_t valueLen)>;
+
+bool visitBatch(const std::string &payload, const BatchVisitor &visitor);
+
 //------------------------------------------------------------------------------
 //! Utilities for serializing Communicator requests.
 //------------------------------------------------------------------------------
@@ -50,6 +90,13 @@ bool parseCommunicatorRequest(const std::string &payload, std::string &uuid, std
 std::string serializeCommunicatorReply(const std::string &uuid, const CommunicatorReply &reply);
 bool parseCommunicatorReply(const std::string &payload, CommunicatorReply &reply, std::string &uuid);
 
+//------------------------------------------------------------------------------
+//! Pack several Communicator requests or replies, each already serialized
+//! through the functions above, into a single pubsub message.
+//------------------------------------------------------------------------------
+std::string serializeCommunicatorBatch(const std::vector<std::string> &messages);
+bool parseCommunicatorBatch(const std::string &payload, std::vector<std::string> &messages);
+
 
 
 }
@@ -0,0 +1,83 @@
+//------------------------------------------------------------------------------
+// File: SharedWriteBatch.cc
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#include "qclient/shared/SharedWriteBatch.hh"
+#include "qclient/shared/UpdateBatch.hh"
+
+namespace qclient {
+
+//------------------------------------------------------------------------------
+// Set durable value of a field in the given hash - empty deletes
+//------------------------------------------------------------------------------
+void SharedWriteBatch::setDurable(const std::string &hash, const std::string &field,
+  const std::string &value) {
+  mDurable[hash][field] = value;
+}
+
+//------------------------------------------------------------------------------
+// Set transient value of a field in the given hash
+//------------------------------------------------------------------------------
+void SharedWriteBatch::setTransient(const std::string &hash, const std::string &field,
+  const std::string &value) {
+  mTransient[hash][field] = value;
+}
+
+//------------------------------------------------------------------------------
+// Add the durable and transient updates of the given batch
+//------------------------------------------------------------------------------
+void SharedWriteBatch::add(const std::string &hash, const UpdateBatch &batch) {
+  for(auto it = batch.durableBegin(); it != batch.durableEnd(); it++) {
+    mDurable[hash][it->first] = it->second;
+  }
+
+  for(auto it = batch.transientBegin(); it != batch.transientEnd(); it++) {
+    mTransient[hash][it->first] = it->second;
+  }
+}
+
+//------------------------------------------------------------------------------
+// Number of field updates
+//------------------------------------------------------------------------------
+size_t SharedWriteBatch::size() const {
+  size_t total = 0;
+
+  for(auto it = mDurable.begin(); it != mDurable.end(); it++) {
+    total += it->second.size();
+  }
+
+  for(auto it = mTransient.begin(); it != mTransient.end(); it++) {
+    total += it->second.size();
+  }
+
+  return total;
+}
+
+//------------------------------------------------------------------------------
+// Clear
+//------------------------------------------------------------------------------
+void SharedWriteBatch::clear() {
+  mDurable.clear();
+  mTransient.clear();
+}
+
+}
@@ -0,0 +1,154 @@
+//------------------------------------------------------------------------------
+// File: SnapshotCell.hh
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#ifndef QCLIENT_SNAPSHOT_CELL_HH
+#define QCLIENT_SNAPSHOT_CELL_HH
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace qclient {
+
+//------------------------------------------------------------------------------
+// Holds an immutable object, which writers replace as a whole, while readers
+// keep going through the current one without ever blocking.
+//
+// Readers announce themselves in one of a few reader counters, picked per
+// thread and each on a cache line of its own, so separate threads hardly
+// ever write to the same cache line. There are two generations of counters:
+// After swapping in a new object, a writer flips the generation and waits for
+// the readers of the previous one to drain before deleting the old object.
+// Only writers ever wait.
+//------------------------------------------------------------------------------
+template<typename T>
+class SnapshotCell {
+public:
+  SnapshotCell(std::unique_ptr<const T> initial) : current(initial.release()) {}
+
+  ~SnapshotCell() {
+    delete current.load();
+  }
+
+  SnapshotCell(const SnapshotCell&) = delete;
+  SnapshotCell& operator=(const SnapshotCell&) = delete;
+
+  //----------------------------------------------------------------------------
+  // Keeps the snapshot it was created with alive - don't hold on to it for
+  // long, writers are waiting on it.
+  //----------------------------------------------------------------------------
+  class ReadGuard {
+  public:
+    ReadGuard(SnapshotCell &cell) : counter(cell.enter()), snapshot(cell.current.load()) {}
+
+    ~ReadGuard() {
+      counter->fetch_sub(1);
+    }
+
+    ReadGuard(const ReadGuard&) = delete;
+    ReadGuard& operator=(const ReadGuard&) = delete;
+
+    const T& operator*() const {
+      return *snapshot;
+    }
+
+    const T* operator->() const {
+      return snapshot;
+    }
+
+  private:
+    std::atomic<int64_t> *counter;
+    const T *snapshot;
+  };
+
+  //----------------------------------------------------------------------------
+  // Swap in a new object. Returns once no reader can be looking at the old
+  // one anymore, which is deleted by then.
+  //----------------------------------------------------------------------------
+  void publish(std::unique_ptr<const T> next) {
+    std::lock_guard<std::mutex> lock(writerMtx);
+    const T *old = current.exchange(next.release());
+
+    uint32_t previous = generation.load();
+    generation.store(previous ^ 1u);
+
+    for(size_t i = 0; i < kStripes; i++) {
+      while(stripes[i].readers[previous].load() != 0) {
+        std::this_thread::yield();
+      }
+    }
+
+    delete old;
+  }
+
+private:
+  static constexpr size_t kStripes = 16;
+
+  struct alignas(64) Stripe {
+    std::atomic<int64_t> readers[2];
+
+    Stripe() {
+      readers[0] = 0;
+      readers[1] = 0;
+    }
+  };
+
+  //----------------------------------------------------------------------------
+  // Register as a reader of the current generation. Should a writer flip it
+  // in the meantime, try again: A writer only waits on the generation which
+  // was current when it flipped.
+  //----------------------------------------------------------------------------
+  std::atomic<int64_t>* enter() {
+    Stripe &stripe = stripes[getThreadStripe()];
+
+    while(true) {
+      uint32_t gen = generation.load();
+      stripe.readers[gen].fetch_add(1);
+
+      if(generation.load() == gen) {
+        return &stripe.readers[gen];
+      }
+
+      stripe.readers[gen].fetch_sub(1);
+    }
+  }
+
+  static size_t getThreadStripe() {
+    static std::atomic<size_t> nextStripe {0};
+    thread_local size_t stripe = nextStripe++ % kStripes;
+    return stripe;
+  }
+
+  Stripe stripes[kStripes];
+  std::atomic<uint32_t> generation {0};
+  std::atomic<const T*> current;
+  std::mutex writerMtx;
+};
+
+}
+
+#endif
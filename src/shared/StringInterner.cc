@@ -0,0 +1,72 @@
+//------------------------------------------------------------------------------
+// File: StringInterner.cc
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#include "qclient/shared/StringInterner.hh"
+
+namespace qclient {
+
+//------------------------------------------------------------------------------
+// Constructor
+//------------------------------------------------------------------------------
+StringInterner::StringInterner() : state(std::make_shared<State>()) {}
+
+//------------------------------------------------------------------------------
+// Get the shared copy of the given string, creating it if needed. The
+// deleter of each copy erases its entry - unless the string has been
+// interned anew in the meantime, and the entry points to the new copy.
+//------------------------------------------------------------------------------
+StringInterner::Handle StringInterner::intern(const std::string &str) {
+  std::lock_guard<std::mutex> lock(state->mtx);
+
+  std::weak_ptr<const std::string> &entry = state->strings[str];
+  Handle handle = entry.lock();
+  if(handle) {
+    return handle;
+  }
+
+  std::shared_ptr<State> owner = state;
+  handle = Handle(new std::string(str), [owner](const std::string *ptr) {
+    {
+      std::lock_guard<std::mutex> lock(owner->mtx);
+      auto it = owner->strings.find(*ptr);
+      if(it != owner->strings.end() && it->second.expired()) {
+        owner->strings.erase(it);
+      }
+    }
+
+    delete ptr;
+  });
+
+  entry = handle;
+  return handle;
+}
+
+//------------------------------------------------------------------------------
+// Number of distinct strings currently alive
+//------------------------------------------------------------------------------
+size_t StringInterner::size() const {
+  std::lock_guard<std::mutex> lock(state->mtx);
+  return state->strings.size();
+}
+
+}
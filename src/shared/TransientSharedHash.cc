@@ -37,7 +37,8 @@ namespace qclient {
 TransientSharedHash::TransientSharedHash(SharedManager *sm,
   const std::string &chan, std::unique_ptr<qclient::Subscription> sub,
   const std::shared_ptr<SharedHashSubscriber> &hashSub)
-: sharedManager(sm), channel(chan), subscription(std::move(sub)), mHashSubscriber(hashSub) {
+: sharedManager(sm), channel(chan), contents(sm->getKeyInterner()),
+  subscription(std::move(sub)), mHashSubscriber(hashSub) {
 
   using namespace std::placeholders;
   subscription->attachCallback(std::bind(&TransientSharedHash::processIncoming, this, _1));
@@ -57,30 +58,37 @@ void TransientSharedHash::processIncoming(Message &&msg) {
     return;
   }
 
-  std::map<std::string, std::string> incomingBatch;
-  if(!parseBatch(msg.getPayload(), incomingBatch)) {
-    QCLIENT_LOG(logger, LogLevel::kError, "Could not parse message payload (length " << msg.getPayload().size() << ") received in channel " << channel << ", ignoring");
-    return;
-  }
-
   //----------------------------------------------------------------------------
-  // Batch received and parsed, apply
+  // Apply straight out of the payload - each key and value gets copied
+  // exactly once, into contents.
   //----------------------------------------------------------------------------
   std::unique_lock<std::mutex> lock(contentsMtx);
-  contents.insert(incomingBatch.begin(), incomingBatch.end());
+
+  std::string key;
+  bool valid = visitBatch(msg.getPayload(), [this, &key](const char *k, size_t keyLen, const char *value, size_t valueLen) {
+    key.assign(k, keyLen);
+    contents[key].assign(value, valueLen);
+  });
+
   lock.unlock();
 
+  if(!valid) {
+    QCLIENT_LOG(logger, LogLevel::kError, "Could not parse message payload (length " << msg.getPayload().size() << ") received in channel " << channel << ", ignoring");
+    return;
+  }
+
   //----------------------------------------------------------------------------
   // Notify subscriber
   //----------------------------------------------------------------------------
   if(mHashSubscriber) {
-    for(auto it = incomingBatch.begin(); it != incomingBatch.end(); it++) {
-      SharedHashUpdate hashUpdate;
-      hashUpdate.key = it->first;
-      hashUpdate.value = it->second;
-
-      mHashSubscriber->feedUpdate(hashUpdate);
-    }
+    std::vector<SharedHashUpdate> hashUpdates;
+    visitBatch(msg.getPayload(), [&hashUpdates](const char *key, size_t keyLen, const char *value, size_t valueLen) {
+      hashUpdates.emplace_back();
+      hashUpdates.back().key.assign(key, keyLen);
+      hashUpdates.back().value.assign(value, valueLen);
+    });
+
+    mHashSubscriber->feedUpdates(hashUpdates);
   }
 }
 
@@ -97,8 +105,7 @@ void TransientSharedHash::set(const std::string &key, const std::string &value)
 // Set a batch of key-value pairs.
 //------------------------------------------------------------------------------
 void TransientSharedHash::set(const std::map<std::string, std::string> &batch) {
-  std::string serializedBatch = serializeBatch(batch);
-  sharedManager->publish(channel, serializedBatch);
+  sharedManager->publishBatch(channel, batch);
 }
 
 //------------------------------------------------------------------------------
@@ -107,12 +114,12 @@ void TransientSharedHash::set(const std::map<std::string, std::string> &batch) {
 bool TransientSharedHash::get(const std::string &key, std::string &value) const {
   std::lock_guard<std::mutex> lock(contentsMtx);
 
-  auto it = contents.find(key);
-  if(it == contents.end()) {
+  const std::string *found = contents.find(key);
+  if(!found) {
     return false;
   }
 
-  value = it->second;
+  value = *found;
   return true;
 }
 
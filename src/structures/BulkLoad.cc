@@ -0,0 +1,133 @@
+/************************************************************************
+ * EOS - the CERN Disk Storage System                                   *
+ * Copyright (C) 2016 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+//------------------------------------------------------------------------------
+//! @brief Chunked, pipelined bulk writes for the data structure wrappers
+//------------------------------------------------------------------------------
+
+#include "qclient/structures/BulkLoad.hh"
+#include "qclient/QClient.hh"
+#include "qclient/QClientPool.hh"
+#include <algorithm>
+
+QCLIENT_NAMESPACE_BEGIN
+
+//------------------------------------------------------------------------------
+// Constructor
+//------------------------------------------------------------------------------
+BulkPipeline::BulkPipeline(QClient* qcl, size_t maxInFlight, int expectedType)
+  : mQcl(qcl), mMaxInFlight(std::max<size_t>(maxInFlight, 1u)),
+    mExpectedType(expectedType) {}
+
+BulkPipeline::BulkPipeline(QClientPool* pool, size_t maxInFlight, int expectedType)
+  : mPool(pool), mMaxInFlight(std::max<size_t>(maxInFlight, 1u)),
+    mExpectedType(expectedType) {}
+
+//------------------------------------------------------------------------------
+// Destructor - waits for any outstanding replies
+//------------------------------------------------------------------------------
+BulkPipeline::~BulkPipeline()
+{
+  while (!mInFlight.empty()) {
+    reapOldest();
+  }
+}
+
+//------------------------------------------------------------------------------
+// Send one more command
+//------------------------------------------------------------------------------
+void BulkPipeline::push(EncodedRequest&& req)
+{
+  while (mInFlight.size() >= mMaxInFlight) {
+    reapOldest();
+  }
+
+  QClient* qcl = mPool ? &mPool->pick() : mQcl;
+  mInFlight.emplace_back(qcl->pooledExecute(std::move(req)));
+  mResult.chunks++;
+}
+
+//------------------------------------------------------------------------------
+// Wait for all outstanding replies, and return the aggregate result
+//------------------------------------------------------------------------------
+BulkLoadResult BulkPipeline::finish()
+{
+  while (!mInFlight.empty()) {
+    reapOldest();
+  }
+
+  return mResult;
+}
+
+//------------------------------------------------------------------------------
+// Argument buffers for building the next command out of borrowed strings
+//------------------------------------------------------------------------------
+void BulkPipeline::startCommand(const std::string& cmd, const std::string& key)
+{
+  mArgs.clear();
+  mSizes.clear();
+  addArgument(cmd);
+  addArgument(key);
+}
+
+void BulkPipeline::addArgument(const std::string& arg)
+{
+  mArgs.emplace_back(arg.data());
+  mSizes.emplace_back(arg.size());
+}
+
+size_t BulkPipeline::argumentCount() const
+{
+  return mArgs.size();
+}
+
+void BulkPipeline::sendCommand()
+{
+  push(EncodedRequest(mArgs.size(), mArgs.data(), mSizes.data()));
+  mArgs.clear();
+  mSizes.clear();
+}
+
+//------------------------------------------------------------------------------
+// Wait for the oldest outstanding reply, and account for it
+//------------------------------------------------------------------------------
+void BulkPipeline::reapOldest()
+{
+  redisReplyPtr reply = mInFlight.front().get();
+  mInFlight.pop_front();
+
+  bool unexpected = (reply == nullptr) ||
+                    (mExpectedType == kAnyReply ? reply->type == REDIS_REPLY_ERROR :
+                                                  reply->type != mExpectedType);
+
+  if (unexpected) {
+    if (mResult.failedChunks == 0) {
+      mResult.firstError = (reply == nullptr) ? "null reply" :
+                           describeRedisReply(reply);
+    }
+
+    mResult.failedChunks++;
+    return;
+  }
+
+  if (reply->type == REDIS_REPLY_INTEGER) {
+    mResult.total += reply->integer;
+  }
+}
+
+QCLIENT_NAMESPACE_END
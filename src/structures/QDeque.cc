@@ -24,9 +24,108 @@
 #include "qclient/structures/QDeque.hh"
 #include "qclient/ResponseParsing.hh"
 #include "qclient/QClient.hh"
+#include "qclient/QCallback.hh"
+#include "qclient/ResponseBuilder.hh"
+#include "qclient/SSTR.hh"
+#include <memory>
+#include <mutex>
 
 namespace qclient {
 
+namespace {
+
+//------------------------------------------------------------------------------
+// Build a single deque-push-back carrying all given items
+//------------------------------------------------------------------------------
+EncodedRequest makePushRequest(const std::string &key, const std::vector<std::string> &contents) {
+  std::vector<const char*> args;
+  std::vector<size_t> sizes;
+  args.reserve(contents.size() + 2);
+  sizes.reserve(contents.size() + 2);
+
+  args.emplace_back("deque-push-back");
+  sizes.emplace_back(15);
+  args.emplace_back(key.data());
+  sizes.emplace_back(key.size());
+
+  for(size_t i = 0; i < contents.size(); i++) {
+    args.emplace_back(contents[i].data());
+    sizes.emplace_back(contents[i].size());
+  }
+
+  return EncodedRequest(args.size(), args.data(), sizes.data());
+}
+
+qclient::Status parsePushReply(const redisReplyPtr &reply) {
+  IntegerParser parser(reply);
+  if(!parser.ok()) {
+    return qclient::Status(EINVAL, parser.err());
+  }
+
+  return qclient::Status();
+}
+
+//------------------------------------------------------------------------------
+// Append the item held by a deque-pop-front reply into out. A nil reply
+// means the deque was empty at that point - skip it.
+//------------------------------------------------------------------------------
+qclient::Status parsePopReply(const redisReplyPtr &reply, std::vector<std::string> &out) {
+  if(reply && reply->type == REDIS_REPLY_NIL) {
+    return qclient::Status();
+  }
+
+  StringParser parser(reply);
+  if(!parser.ok()) {
+    return qclient::Status(EINVAL, parser.err());
+  }
+
+  out.emplace_back(parser.value());
+  return qclient::Status();
+}
+
+//------------------------------------------------------------------------------
+// Append the items held by a deque-pop-front key count reply into out - an
+// array of them, or nil if the deque was empty.
+//------------------------------------------------------------------------------
+qclient::Status parseBatchPopReply(const redisReplyPtr &reply, std::vector<std::string> &out) {
+  if(reply && reply->type == REDIS_REPLY_NIL) {
+    return qclient::Status();
+  }
+
+  if(!reply || reply->type != REDIS_REPLY_ARRAY) {
+    return qclient::Status(EINVAL, SSTR("Unexpected reply to batch deque-pop-front: " <<
+      qclient::describeRedisReply(reply)));
+  }
+
+  for(size_t i = 0; i < reply->elements; i++) {
+    const redisReply *item = reply->element[i];
+    if(item->type != REDIS_REPLY_STRING) {
+      return qclient::Status(EINVAL, SSTR("Unexpected item in batch deque-pop-front reply: " <<
+        qclient::describeRedisReply(item)));
+    }
+
+    out.emplace_back(item->str, item->len);
+  }
+
+  return qclient::Status();
+}
+
+//------------------------------------------------------------------------------
+// Replies of a pipelined pop_front_many_async, gathered until the last one
+// arrives
+//------------------------------------------------------------------------------
+struct PopBatch {
+  PopBatch(size_t count, QDeque::PopCallback &&callback)
+  : replies(count), remaining(count), cb(std::move(callback)) {}
+
+  std::mutex mtx;
+  std::vector<redisReplyPtr> replies;
+  size_t remaining;
+  QDeque::PopCallback cb;
+};
+
+}
+
 //------------------------------------------------------------------------------
 // Constructor
 //------------------------------------------------------------------------------
@@ -42,7 +141,7 @@ QDeque::~QDeque() {}
 // Query deque size
 //------------------------------------------------------------------------------
 qclient::Status QDeque::size(size_t &out) {
-  IntegerParser parser(mQcl.exec("deque-len", mKey).get());
+  IntegerParser parser(mQcl.pooledExec("deque-len", mKey).get());
   if(!parser.ok()) {
     return qclient::Status(EINVAL, parser.err());
   }
@@ -55,7 +154,7 @@ qclient::Status QDeque::size(size_t &out) {
 // Add item to the back of the queue
 //------------------------------------------------------------------------------
 qclient::Status QDeque::push_back(const std::string &contents) {
-  IntegerParser parser(mQcl.exec("deque-push-back", mKey, contents).get());
+  IntegerParser parser(mQcl.pooledExec("deque-push-back", mKey, contents).get());
   if(!parser.ok()) {
     return qclient::Status(EINVAL, parser.err());
   }
@@ -63,12 +162,53 @@ qclient::Status QDeque::push_back(const std::string &contents) {
   return qclient::Status();
 }
 
+//------------------------------------------------------------------------------
+// Add several items to the back of the queue, through a single command
+//------------------------------------------------------------------------------
+qclient::Status QDeque::push_back_many(const std::vector<std::string> &contents) {
+  if(contents.empty()) {
+    return qclient::Status();
+  }
+
+  return parsePushReply(mQcl.pooledExecute(makePushRequest(mKey, contents)).get());
+}
+
+//------------------------------------------------------------------------------
+// Asynchronous version of push_back_many
+//------------------------------------------------------------------------------
+void QDeque::push_back_many_async(const std::vector<std::string> &contents,
+  StatusCallback cb) {
+
+  if(contents.empty()) {
+    if(cb) cb(qclient::Status());
+    return;
+  }
+
+  mQcl.execute(makePushRequest(mKey, contents), [cb](redisReplyPtr &&reply) {
+    qclient::Status st = parsePushReply(reply);
+    if(cb) cb(st);
+  });
+}
+
+//------------------------------------------------------------------------------
+// Non-blocking form of push_back_many. With nothing to push, there's still
+// a length to yield.
+//------------------------------------------------------------------------------
+TypedFuture<long long> QDeque::push_back_many_future(const std::vector<std::string> &contents) {
+  if(contents.empty()) {
+    return size_future();
+  }
+
+  return executeTyped<long long>(mQcl, makePushRequest(mKey, contents),
+    TypedReply::toInteger);
+}
+
 //------------------------------------------------------------------------------
 // Remove item from the front of the queue. If queue is empty, "" will be
 // returned - not an error.
 //------------------------------------------------------------------------------
 qclient::Status QDeque::pop_front(std::string &out) {
-  StringParser parser(mQcl.exec("deque-pop-front", mKey).get());
+  StringParser parser(mQcl.pooledExec("deque-pop-front", mKey).get());
   if(!parser.ok()) {
     return qclient::Status(EINVAL, parser.err());
   }
@@ -77,11 +217,150 @@ qclient::Status QDeque::pop_front(std::string &out) {
   return qclient::Status();
 }
 
+//------------------------------------------------------------------------------
+// Can the server pop several items through a single command?
+//------------------------------------------------------------------------------
+bool QDeque::batchPopSupported() const {
+  return mQcl.getServerCapabilities().has(Capability::kBatchDequePop);
+}
+
+//------------------------------------------------------------------------------
+// Remove up to count items from the front of the queue - in a single
+// command if the server supports it, pipelined otherwise
+//------------------------------------------------------------------------------
+qclient::Status QDeque::pop_front_many(size_t count, std::vector<std::string> &out) {
+  if(count != 0u && batchPopSupported()) {
+    return parseBatchPopReply(mQcl.pooledExec("deque-pop-front", mKey, std::to_string(count)).get(), out);
+  }
+
+  std::vector<ReplyFuture> futs;
+  futs.reserve(count);
+
+  for(size_t i = 0; i < count; i++) {
+    futs.emplace_back(mQcl.pooledExec("deque-pop-front", mKey));
+  }
+
+  qclient::Status retval;
+  for(size_t i = 0; i < futs.size(); i++) {
+    qclient::Status st = parsePopReply(futs[i].get(), out);
+    if(!st.ok() && retval.ok()) {
+      retval = st;
+    }
+  }
+
+  return retval;
+}
+
+//------------------------------------------------------------------------------
+// Asynchronous version of pop_front_many
+//------------------------------------------------------------------------------
+void QDeque::pop_front_many_async(size_t count, PopCallback cb) {
+  if(count == 0u) {
+    if(cb) cb(qclient::Status(), {});
+    return;
+  }
+
+  if(batchPopSupported()) {
+    mQcl.execute(EncodedRequest::make("deque-pop-front", mKey, std::to_string(count)), [cb](redisReplyPtr &&reply) {
+      std::vector<std::string> items;
+      qclient::Status st = parseBatchPopReply(reply, items);
+      if(cb) cb(st, std::move(items));
+    });
+
+    return;
+  }
+
+  std::shared_ptr<PopBatch> batch = std::make_shared<PopBatch>(count, std::move(cb));
+
+  for(size_t i = 0; i < count; i++) {
+    mQcl.execute(EncodedRequest::make("deque-pop-front", mKey), [batch, i](redisReplyPtr &&reply) {
+      std::unique_lock<std::mutex> lock(batch->mtx);
+      batch->replies[i] = std::move(reply);
+      if(--batch->remaining != 0u) {
+        return;
+      }
+
+      lock.unlock();
+
+      qclient::Status retval;
+      std::vector<std::string> items;
+      for(size_t j = 0; j < batch->replies.size(); j++) {
+        qclient::Status st = parsePopReply(batch->replies[j], items);
+        if(!st.ok() && retval.ok()) {
+          retval = st;
+        }
+      }
+
+      if(batch->cb) batch->cb(retval, std::move(items));
+    });
+  }
+}
+
+//------------------------------------------------------------------------------
+// Non-blocking form of pop_front_many. The future is parsed as a batch
+// deque-pop-front reply - when the pops are pipelined instead, their items
+// are handed to it gathered into one, once the last of them arrives.
+//------------------------------------------------------------------------------
+TypedFuture<std::vector<std::string>> QDeque::pop_front_many_future(size_t count) {
+  if(count != 0u && batchPopSupported()) {
+    return executeTyped<std::vector<std::string>>(mQcl,
+      EncodedRequest::make("deque-pop-front", mKey, std::to_string(count)),
+      parseBatchPopReply);
+  }
+
+  ReplyFuture fut = ReplyFuture::create();
+  QCallback *callback = fut.getCallback();
+
+  pop_front_many_async(count, [callback](qclient::Status st, std::vector<std::string> &&items) {
+    if(!st.ok()) {
+      callback->handleResponse(ResponseBuilder::makeErr(st.getMsg()));
+    }
+    else {
+      callback->handleResponse(ResponseBuilder::makeStringArray(items));
+    }
+  });
+
+  return TypedFuture<std::vector<std::string>>(std::move(fut), parseBatchPopReply);
+}
+
+//------------------------------------------------------------------------------
+// Non-blocking forms of size, push_back and pop_front
+//------------------------------------------------------------------------------
+TypedFuture<long long> QDeque::size_future() {
+  return executeTyped<long long>(mQcl, EncodedRequest::make("deque-len", mKey),
+    TypedReply::toInteger);
+}
+
+void QDeque::size_async(TypedCallback<long long> cb) {
+  executeTyped<long long>(mQcl, EncodedRequest::make("deque-len", mKey),
+    TypedReply::toInteger, std::move(cb));
+}
+
+TypedFuture<long long> QDeque::push_back_future(const std::string &contents) {
+  return executeTyped<long long>(mQcl,
+    EncodedRequest::make("deque-push-back", mKey, contents), TypedReply::toInteger);
+}
+
+void QDeque::push_back_async(const std::string &contents, TypedCallback<long long> cb) {
+  executeTyped<long long>(mQcl, EncodedRequest::make("deque-push-back", mKey, contents),
+    TypedReply::toInteger, std::move(cb));
+}
+
+TypedFuture<std::string> QDeque::pop_front_future() {
+  return executeTyped<std::string>(mQcl,
+    EncodedRequest::make("deque-pop-front", mKey), TypedReply::toString);
+}
+
+void QDeque::pop_front_async(TypedCallback<std::string> cb) {
+  executeTyped<std::string>(mQcl, EncodedRequest::make("deque-pop-front", mKey),
+    TypedReply::toString, std::move(cb));
+}
+
 //------------------------------------------------------------------------------
 // Clear all items in the queue
 //------------------------------------------------------------------------------
 qclient::Status QDeque::clear() {
-  IntegerParser parser(mQcl.exec("deque-clear", mKey).get());
+  IntegerParser parser(mQcl.pooledExec("deque-clear", mKey).get());
   if(!parser.ok()) {
     return qclient::Status(EINVAL, parser.err());
   }
@@ -89,5 +368,17 @@ qclient::Status QDeque::clear() {
   return qclient::Status();
 }
 
+//------------------------------------------------------------------------------
+// Non-blocking forms of clear
+//------------------------------------------------------------------------------
+TypedFuture<long long> QDeque::clear_future() {
+  return executeTyped<long long>(mQcl, EncodedRequest::make("deque-clear", mKey),
+    TypedReply::toInteger);
+}
+
+void QDeque::clear_async(TypedCallback<long long> cb) {
+  executeTyped<long long>(mQcl, EncodedRequest::make("deque-clear", mKey),
+    TypedReply::toInteger, std::move(cb));
+}
 
 }
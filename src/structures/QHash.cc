@@ -22,9 +22,192 @@
 //------------------------------------------------------------------------------
 
 #include "qclient/structures/QHash.hh"
+#include <algorithm>
+#include <cerrno>
 
 QCLIENT_NAMESPACE_BEGIN
 
+//------------------------------------------------------------------------------
+// Parse the reply to HSCAN
+//------------------------------------------------------------------------------
+static std::pair<std::string, std::map<std::string, std::string> >
+parseHscan(const std::string& key, const redisReplyPtr& reply)
+{
+  if (reply == nullptr) {
+    throw std::runtime_error("[FATAL] Error hscan key: " + key +
+                             ": Unexpected/null reply");
+  }
+
+  // Parse the Redis reply
+  std::string new_cursor = std::string(reply->element[0]->str,
+                                       reply->element[0]->len);
+  // First element is the new cursor
+  std::pair<std::string, std::map<std::string, std::string> > retc_pair;
+  retc_pair.first = new_cursor;
+  // Get array part of the response
+  redisReply* array = reply->element[1];
+
+  for (unsigned long i = 0; i < array->elements; i += 2) {
+    retc_pair.second.emplace(
+      std::string(array->element[i]->str,
+                  static_cast<unsigned int>(array->element[i]->len)),
+      std::string(array->element[i + 1]->str,
+                  static_cast<unsigned int>(array->element[i + 1]->len)));
+  }
+
+  return retc_pair;
+}
+
+//------------------------------------------------------------------------------
+// Decoder for the reply of HMGET: One string or nil per requested field,
+// either stored by position into a vector, or inserted into a map keyed by
+// field name - nils are skipped there. Compressed values are decoded on the
+// way in, when asked to.
+//------------------------------------------------------------------------------
+class HmgetCollector : public ReplyDecoder
+{
+public:
+  HmgetCollector(const std::vector<std::string>& f,
+                 std::vector<std::string>* v,
+                 std::unordered_map<std::string, std::string>* m,
+                 bool d)
+    : fields(f), values(v), map(m), decode(d) {}
+
+  void onAggregate(int type, size_t elements, size_t depth) override
+  {
+    valid = (depth == 0 && elements == fields.size());
+    next = 0;
+
+    if (values) {
+      values->clear();
+      values->resize(fields.size());
+    }
+  }
+
+  void onString(int type, const char* str, size_t len, size_t depth) override
+  {
+    if (depth != 1 || type != REDIS_REPLY_STRING || next >= fields.size()) {
+      valid = false;
+      return;
+    }
+
+    std::string& target = values ? (*values)[next] : (*map)[fields[next]];
+
+    if (!decode) {
+      target.assign(str, len);
+    } else if (!ValueCompression::decode(str, len, target)) {
+      valid = false;
+      return;
+    }
+
+    next++;
+  }
+
+  void onNil(size_t depth) override
+  {
+    if (depth != 1 || next >= fields.size()) {
+      valid = false;
+      return;
+    }
+
+    next++;
+  }
+
+  void onInteger(long long value, size_t depth) override
+  {
+    valid = false;
+  }
+
+  void invalidEvent(size_t depth) override
+  {
+    valid = false;
+  }
+
+  bool ok() const
+  {
+    return valid && next == fields.size();
+  }
+
+private:
+  const std::vector<std::string>& fields;
+  std::vector<std::string>* values;
+  std::unordered_map<std::string, std::string>* map;
+  bool decode;
+  size_t next = 0;
+  bool valid = false;
+};
+
+//------------------------------------------------------------------------------
+// Issue HMGET through the given decoder
+//------------------------------------------------------------------------------
+static void execHmget(QClient* qcl, const std::string& key,
+                      const std::vector<std::string>& fields,
+                      HmgetCollector& decoder)
+{
+  std::vector<const char*> args;
+  std::vector<size_t> sizes;
+  args.reserve(fields.size() + 2);
+  sizes.reserve(fields.size() + 2);
+
+  args.emplace_back("HMGET");
+  sizes.emplace_back(5);
+  args.emplace_back(key.data());
+  sizes.emplace_back(key.size());
+
+  for (auto it = fields.begin(); it != fields.end(); ++it) {
+    args.emplace_back(it->data());
+    sizes.emplace_back(it->size());
+  }
+
+  redisReplyPtr reply = qcl->execute(EncodedRequest(args.size(), args.data(),
+                                     sizes.data()), &decoder).get();
+
+  if ((reply == nullptr) || (reply->type != REDIS_REPLY_ARRAY) ||
+      !decoder.ok()) {
+    throw std::runtime_error("[FATAL] Error hmget key: " + key +
+                             ": Unexpected/null reply");
+  }
+}
+
+//------------------------------------------------------------------------------
+// Typed parsers decoding compressed values - only used when compressing, so
+// that hashes written without compression are never second-guessed.
+//------------------------------------------------------------------------------
+static Status toDecodedString(const redisReplyPtr& reply, std::string& out)
+{
+  Status st = TypedReply::toString(reply, out);
+
+  if (st.ok() && !ValueCompression::decodeInPlace(out)) {
+    return Status(EINVAL, "Corrupted compressed value");
+  }
+
+  return st;
+}
+
+static Status decodeStrings(Status st, std::vector<std::string>& out,
+                            size_t first, size_t stride)
+{
+  for (size_t i = first; st.ok() && i < out.size(); i += stride) {
+    if (!ValueCompression::decodeInPlace(out[i])) {
+      return Status(EINVAL, "Corrupted compressed value");
+    }
+  }
+
+  return st;
+}
+
+static Status toDecodedPairs(const redisReplyPtr& reply,
+                             std::vector<std::string>& out)
+{
+  return decodeStrings(TypedReply::toStringVector(reply, out), out, 1, 2);
+}
+
+static Status toDecodedValues(const redisReplyPtr& reply,
+                              std::vector<std::string>& out)
+{
+  return decodeStrings(TypedReply::toStringVector(reply, out), out, 0, 1);
+}
+
 //------------------------------------------------------------------------------
 // Copy assignment
 //------------------------------------------------------------------------------
@@ -33,6 +216,8 @@ QHash::operator=(const QHash& other)
 {
   mClient = other.mClient;
   mKey = other.mKey;
+  mCache = other.mCache;
+  mCompression = other.mCompression;
   return *this;
 }
 
@@ -51,7 +236,14 @@ std::string
 QHash::hget(const std::string& field)
 {
   std::string resp{""};
-  redisReplyPtr reply = mClient->exec("HGET", mKey, field).get();
+  bool exists = false;
+  uint64_t generation = 0;
+
+  if (mCache && mCache->getField(mKey, field, exists, resp, generation)) {
+    return resp;
+  }
+
+  redisReplyPtr reply = mClient->pooledExecute(kHget.make(mKey, field)).get();
 
   if ((reply == nullptr) || ((reply->type != REDIS_REPLY_STRING) &&
                              (reply->type != REDIS_REPLY_NIL))) {
@@ -61,18 +253,90 @@ QHash::hget(const std::string& field)
 
   if (reply->type == REDIS_REPLY_STRING) {
     resp.append(reply->str, reply->len);
+    unpackValue(resp);
+  }
+
+  if (mCache) {
+    mCache->putField(mKey, field, reply->type == REDIS_REPLY_STRING, resp,
+                     generation);
   }
 
   return resp;
 }
 
+//------------------------------------------------------------------------------
+// HMGET command - synchronous
+//------------------------------------------------------------------------------
+std::vector<std::string>
+QHash::hmget(const std::vector<std::string>& fields)
+{
+  std::vector<std::string> values;
+
+  if (fields.empty()) {
+    return values;
+  }
+
+  HmgetCollector decoder(fields, &values, nullptr, mCompression.active());
+  execHmget(mClient, mKey, fields, decoder);
+  return values;
+}
+
+//------------------------------------------------------------------------------
+// HMGET command - synchronous, into the given map
+//------------------------------------------------------------------------------
+void
+QHash::hmget(const std::vector<std::string>& fields,
+             std::unordered_map<std::string, std::string>& out)
+{
+  if (fields.empty()) {
+    return;
+  }
+
+  HmgetCollector decoder(fields, nullptr, &out, mCompression.active());
+  execHmget(mClient, mKey, fields, decoder);
+}
+
+//------------------------------------------------------------------------------
+// Pipelined HGET of the same field across many hashes - synchronous
+//------------------------------------------------------------------------------
+std::vector<std::string>
+QHash::multiGet(QClient& qcl, const std::vector<std::string>& keys,
+                const std::string& field)
+{
+  std::vector<ReplyFuture> futures;
+  futures.reserve(keys.size());
+
+  for (auto it = keys.begin(); it != keys.end(); ++it) {
+    futures.emplace_back(qcl.pooledExecute(kHget.make(*it, field)));
+  }
+
+  std::vector<std::string> values(keys.size());
+
+  for (size_t i = 0; i < futures.size(); ++i) {
+    redisReplyPtr reply = futures[i].get();
+
+    if ((reply == nullptr) || ((reply->type != REDIS_REPLY_STRING) &&
+                               (reply->type != REDIS_REPLY_NIL))) {
+      throw std::runtime_error("[FATAL] Error hget key: " + keys[i] + " field: "
+                               + field + ": Unexpected/null reply");
+    }
+
+    if (reply->type == REDIS_REPLY_STRING) {
+      values[i].assign(reply->str, reply->len);
+    }
+  }
+
+  return values;
+}
+
 //------------------------------------------------------------------------------
 // HDEL command  - synchronous
 //------------------------------------------------------------------------------
 bool
 QHash::hdel(const std::string& field)
 {
-  redisReplyPtr reply = mClient->exec("HDEL", mKey, field).get();
+  redisReplyPtr reply = mClient->pooledExec("HDEL", mKey, field).get();
+  invalidateCache();
 
   if ((reply == nullptr) || (reply->type != REDIS_REPLY_INTEGER)) {
     throw std::runtime_error("[FATAL] Error hdel key: " + mKey + " field: "
@@ -88,6 +352,7 @@ QHash::hdel(const std::string& field)
 void
 QHash::hdel_async(const std::string& field, AsyncHandler* ah)
 {
+  invalidateCache();
   ah->Register(mClient, {"HDEL", mKey, field});
 }
 
@@ -97,21 +362,74 @@ QHash::hdel_async(const std::string& field, AsyncHandler* ah)
 std::vector<std::string>
 QHash::hgetall()
 {
-  redisReplyPtr reply = mClient->exec("HGETALL", mKey).get();
+  // Decode straight into the result, without building a reply tree
+  std::vector<std::string> resp;
+  StringCollector<std::vector<std::string>> decoder(resp);
+  redisReplyPtr reply = mClient->execute(EncodedRequest::make("HGETALL", mKey),
+                                         &decoder).get();
 
-  if ((reply == nullptr) || (reply->type != REDIS_REPLY_ARRAY)) {
+  if ((reply == nullptr) || ((reply->type != REDIS_REPLY_ARRAY) &&
+                             (reply->type != REDIS_REPLY_MAP)) ||
+      !decoder.ok()) {
     throw std::runtime_error("[FATAL] Error hgetall key: " + mKey +
                              ": Unexpected/null reply");
   }
 
-  std::vector<std::string> resp;
-  resp.reserve(reply->elements);
+  unpackValues(resp, 1, 2);
+  return resp;
+}
 
-  for (size_t i = 0; i < reply->elements; ++i) {
-    resp.emplace_back(reply->element[i]->str, reply->element[i]->len);
+//------------------------------------------------------------------------------
+// HGETALL command - synchronous, into the given map
+//------------------------------------------------------------------------------
+void
+QHash::hgetall(std::unordered_map<std::string, std::string>& out)
+{
+  PairCollector<std::unordered_map<std::string, std::string>> decoder(out);
+  redisReplyPtr reply = mClient->execute(EncodedRequest::make("HGETALL", mKey),
+                                         &decoder).get();
+
+  if ((reply == nullptr) || ((reply->type != REDIS_REPLY_ARRAY) &&
+                             (reply->type != REDIS_REPLY_MAP)) ||
+      !decoder.ok()) {
+    throw std::runtime_error("[FATAL] Error hgetall key: " + mKey +
+                             ": Unexpected/null reply");
   }
 
-  return resp;
+  unpackValues(out);
+}
+
+//------------------------------------------------------------------------------
+// HGETALL through HSCAN, one page at a time - synchronous
+//------------------------------------------------------------------------------
+size_t
+QHash::hgetall_stream(const PairCallback& cb, long long count)
+{
+  std::string cursor = "0";
+  std::vector<std::string> page;
+  size_t pairs = 0;
+
+  do {
+    ScanPageCollector<std::vector<std::string>> decoder(cursor, page);
+    redisReplyPtr reply = mClient->execute(EncodedRequest::make("HSCAN", mKey,
+                                           cursor, "COUNT", count), &decoder).get();
+
+    if ((reply == nullptr) || (reply->type != REDIS_REPLY_ARRAY) ||
+        !decoder.ok() || (page.size() % 2 != 0)) {
+      throw std::runtime_error("[FATAL] Error hscan key: " + mKey +
+                               ": Unexpected/null reply");
+    }
+
+    unpackValues(page, 1, 2);
+
+    for (size_t i = 0; i < page.size(); i += 2) {
+      cb(std::move(page[i]), std::move(page[i + 1]));
+    }
+
+    pairs += page.size() / 2;
+  } while (cursor != "0");
+
+  return pairs;
 }
 
 //------------------------------------------------------------------------------
@@ -120,7 +438,16 @@ QHash::hgetall()
 bool
 QHash::hexists(const std::string& field)
 {
-  redisReplyPtr reply = mClient->exec("HEXISTS", mKey, field).get();
+  // A cached hget answers this just as well
+  bool exists = false;
+  std::string value;
+  uint64_t generation = 0;
+
+  if (mCache && mCache->getField(mKey, field, exists, value, generation)) {
+    return exists;
+  }
+
+  redisReplyPtr reply = mClient->pooledExec("HEXISTS", mKey, field).get();
 
   if (reply->type != REDIS_REPLY_INTEGER) {
     throw std::runtime_error("[FATAL] Error hexists key: " + mKey + " field: "
@@ -136,13 +463,24 @@ QHash::hexists(const std::string& field)
 long long int
 QHash::hlen()
 {
-  redisReplyPtr reply = mClient->exec("HLEN", mKey).get();
+  long long int length = 0;
+  uint64_t generation = 0;
+
+  if (mCache && mCache->getLength(mKey, length, generation)) {
+    return length;
+  }
+
+  redisReplyPtr reply = mClient->pooledExec("HLEN", mKey).get();
 
   if (reply->type != REDIS_REPLY_INTEGER) {
     throw std::runtime_error("[FATAL] Error hlen key: " + mKey +
                              ": Unexpected/null reply");
   }
 
+  if (mCache) {
+    mCache->putLength(mKey, reply->integer, generation);
+  }
+
   return reply->integer;
 }
 
@@ -156,26 +494,63 @@ QHash::hlen_async(AsyncHandler* ah)
 }
 
 //------------------------------------------------------------------------------
-// HKEYS command - synchronous
+// Run a command replying with a flat aggregate of strings, through a decoder
 //------------------------------------------------------------------------------
-std::vector<std::string>
-QHash::hkeys()
+template<typename Decoder>
+void
+QHash::executeDecode(const std::string& cmd, Decoder& decoder)
 {
-  redisReplyPtr reply = mClient->exec("HKEYS", mKey).get();
+  redisReplyPtr reply = mClient->execute(EncodedRequest::make(cmd, mKey),
+                                         &decoder).get();
 
-  if ((reply == nullptr) || (reply->type != REDIS_REPLY_ARRAY)) {
-    throw std::runtime_error("[FATAL] Error hkeys key: " + mKey +
-                             ": Unexpected/null reply");
+  if ((reply == nullptr) || (reply->type != REDIS_REPLY_ARRAY) ||
+      !decoder.ok()) {
+    throw std::runtime_error("[FATAL] Error " + cmd + " key: " +
+                             mKey + ": Unexpected/null reply");
   }
+}
 
+//------------------------------------------------------------------------------
+// HKEYS command - synchronous
+//------------------------------------------------------------------------------
+std::vector<std::string>
+QHash::hkeys()
+{
   std::vector<std::string> resp;
-  resp.reserve(reply->elements);
+  hkeys(resp);
+  return resp;
+}
 
-  for (size_t i = 0; i < reply->elements; ++i) {
-    resp.emplace_back(reply->element[i]->str, reply->element[i]->len);
+void
+QHash::hkeys(std::vector<std::string>& out, bool sorted)
+{
+  StringCollector<std::vector<std::string>> decoder(out);
+  executeDecode("HKEYS", decoder);
+
+  if (sorted) {
+    std::sort(out.begin(), out.end());
   }
+}
 
-  return resp;
+void
+QHash::hkeys(std::unordered_set<std::string>& out)
+{
+  StringCollector<std::unordered_set<std::string>> decoder(out);
+  executeDecode("HKEYS", decoder);
+}
+
+size_t
+QHash::hkeys(const StringCallback& cb)
+{
+  size_t fields = 0;
+  StringStreamer::Callback counting = [&cb, &fields](std::string&& str) {
+    fields++;
+    cb(std::move(str));
+  };
+
+  StringStreamer decoder(counting);
+  executeDecode("HKEYS", decoder);
+  return fields;
 }
 
 //------------------------------------------------------------------------------
@@ -184,21 +559,49 @@ QHash::hkeys()
 std::vector<std::string>
 QHash::hvals()
 {
-  redisReplyPtr reply = mClient->exec("HVALS", mKey).get();
+  std::vector<std::string> resp;
+  hvals(resp);
+  return resp;
+}
 
-  if ((reply == nullptr) || (reply->type != REDIS_REPLY_ARRAY)) {
-    throw std::runtime_error("[FATAL] Error hvals key: " + mKey +
-                             ": Unexpected/null reply");
-  }
+void
+QHash::hvals(std::vector<std::string>& out)
+{
+  StringCollector<std::vector<std::string>> decoder(out);
+  executeDecode("HVALS", decoder);
+  unpackValues(out, 0, 1);
+}
 
-  std::vector<std::string> resp;
-  resp.reserve(reply->elements);
+size_t
+QHash::hvals(const StringCallback& cb)
+{
+  // The callback runs on the event loop thread - a corrupted value must not
+  // throw there, remember it and throw from here instead.
+  size_t values = 0;
+  bool corrupted = false;
+  StringStreamer::Callback unpacking = [&](std::string&& str) {
+    if (corrupted) {
+      return;
+    }
 
-  for (size_t i = 0; i < reply->elements; ++i) {
-    resp.emplace_back(reply->element[i]->str, reply->element[i]->len);
+    if (mCompression.active() && !ValueCompression::decodeInPlace(str)) {
+      corrupted = true;
+      return;
+    }
+
+    values++;
+    cb(std::move(str));
+  };
+
+  StringStreamer decoder(unpacking);
+  executeDecode("HVALS", decoder);
+
+  if (corrupted) {
+    throw std::runtime_error("[FATAL] Error decoding value of key: " + mKey +
+                             ": Corrupted compressed value");
   }
 
-  return resp;
+  return values;
 }
 
 //------------------------------------------------------------------------------
@@ -207,32 +610,11 @@ QHash::hvals()
 std::pair<std::string, std::map<std::string, std::string> >
 QHash::hscan(const std::string& cursor, long long count)
 {
-  redisReplyPtr reply = mClient->exec("HSCAN", mKey, cursor, "COUNT",
-                                      std::to_string(count)).get();
-
-  if (reply == nullptr) {
-    throw std::runtime_error("[FATAL] Error hscan key: " + mKey +
-                             ": Unexpected/null reply");
-  }
-
-  // Parse the Redis reply
-  std::string new_cursor = std::string(reply->element[0]->str,
-                                       reply->element[0]->len);
-  // First element is the new cursor
-  std::pair<std::string, std::map<std::string, std::string> > retc_pair;
-  retc_pair.first = new_cursor;
-  // Get array part of the response
-  redisReply* array = reply->element[1];
-
-  for (unsigned long i = 0; i < array->elements; i += 2) {
-    retc_pair.second.emplace(
-      std::string(array->element[i]->str,
-                  static_cast<unsigned int>(array->element[i]->len)),
-      std::string(array->element[i + 1]->str,
-                  static_cast<unsigned int>(array->element[i + 1]->len)));
-  }
-
-  return retc_pair;
+  std::pair<std::string, std::map<std::string, std::string> > page =
+    parseHscan(mKey, mClient->pooledExec("HSCAN", mKey, cursor, "COUNT",
+               count).get());
+  unpackValues(page.second);
+  return page;
 }
 
 //------------------------------------------------------------------------------
@@ -240,9 +622,11 @@ QHash::hscan(const std::string& cursor, long long count)
 //------------------------------------------------------------------------------
 bool QHash::hmset(std::list<std::string> lst_elem)
 {
+  packValues(lst_elem);
   (void) lst_elem.push_front(mKey);
   (void) lst_elem.push_front("HMSET");
-  redisReplyPtr reply =  mClient->execute(lst_elem).get();
+  redisReplyPtr reply =  mClient->pooledExecute(EncodedRequest(lst_elem)).get();
+  invalidateCache();
 
   if ((reply == nullptr) || (reply->type != REDIS_REPLY_STATUS)) {
     throw std::runtime_error("[FATAL] Error hmset key: " + mKey +
@@ -252,6 +636,273 @@ bool QHash::hmset(std::list<std::string> lst_elem)
   return true;
 }
 
+//------------------------------------------------------------------------------
+// HMSET request out of a list of alternating fields and values
+//------------------------------------------------------------------------------
+static EncodedRequest makeHmset(const std::string& key,
+                                const std::list<std::string>& lst_elem)
+{
+  std::vector<std::string> cmd;
+  cmd.reserve(lst_elem.size() + 2);
+  cmd.emplace_back("HMSET");
+  cmd.emplace_back(key);
+  cmd.insert(cmd.end(), lst_elem.begin(), lst_elem.end());
+  return EncodedRequest(cmd);
+}
+
+//------------------------------------------------------------------------------
+// Non-blocking forms
+//------------------------------------------------------------------------------
+TypedFuture<std::string> QHash::hget_future(const std::string& field)
+{
+  return executeTyped<std::string>(*mClient, kHget.make(mKey, field),
+    mCompression.active() ? toDecodedString : TypedReply::toString);
+}
+
+void QHash::hget_async(const std::string& field, TypedCallback<std::string> cb)
+{
+  executeTyped<std::string>(*mClient, kHget.make(mKey, field),
+    mCompression.active() ? toDecodedString : TypedReply::toString,
+    std::move(cb));
+}
+
+TypedFuture<bool> QHash::hset_future(const std::string& field,
+                                     const std::string& value)
+{
+  std::string buffer;
+  invalidateCache();
+  return executeTyped<bool>(*mClient,
+    kHset.make(mKey, field, packValue(value, buffer)), TypedReply::toBool);
+}
+
+void QHash::hset_async(const std::string& field, const std::string& value,
+                       TypedCallback<bool> cb)
+{
+  std::string buffer;
+  invalidateCache();
+  executeTyped<bool>(*mClient, kHset.make(mKey, field, packValue(value, buffer)),
+    TypedReply::toBool, std::move(cb));
+}
+
+TypedFuture<bool> QHash::hsetnx_future(const std::string& field,
+                                       const std::string& value)
+{
+  std::string buffer;
+  invalidateCache();
+  return executeTyped<bool>(*mClient,
+    EncodedRequest::make("HSETNX", mKey, field, packValue(value, buffer)),
+    TypedReply::toBool);
+}
+
+void QHash::hsetnx_async(const std::string& field, const std::string& value,
+                         TypedCallback<bool> cb)
+{
+  std::string buffer;
+  invalidateCache();
+  executeTyped<bool>(*mClient,
+    EncodedRequest::make("HSETNX", mKey, field, packValue(value, buffer)),
+    TypedReply::toBool, std::move(cb));
+}
+
+TypedFuture<bool> QHash::hmset_future(const std::list<std::string>& lst_elem)
+{
+  invalidateCache();
+  std::list<std::string> packed(lst_elem);
+  packValues(packed);
+  return executeTyped<bool>(*mClient, makeHmset(mKey, packed),
+    TypedReply::toOk);
+}
+
+void QHash::hmset_async(const std::list<std::string>& lst_elem,
+                        TypedCallback<bool> cb)
+{
+  invalidateCache();
+  std::list<std::string> packed(lst_elem);
+  packValues(packed);
+  executeTyped<bool>(*mClient, makeHmset(mKey, packed), TypedReply::toOk,
+    std::move(cb));
+}
+
+TypedFuture<bool> QHash::hdel_future(const std::string& field)
+{
+  invalidateCache();
+  return executeTyped<bool>(*mClient,
+    EncodedRequest::make("HDEL", mKey, field), TypedReply::toBool);
+}
+
+void QHash::hdel_async(const std::string& field, TypedCallback<bool> cb)
+{
+  invalidateCache();
+  executeTyped<bool>(*mClient, EncodedRequest::make("HDEL", mKey, field),
+    TypedReply::toBool, std::move(cb));
+}
+
+TypedFuture<bool> QHash::hexists_future(const std::string& field)
+{
+  return executeTyped<bool>(*mClient,
+    EncodedRequest::make("HEXISTS", mKey, field), TypedReply::toBool);
+}
+
+void QHash::hexists_async(const std::string& field, TypedCallback<bool> cb)
+{
+  executeTyped<bool>(*mClient, EncodedRequest::make("HEXISTS", mKey, field),
+    TypedReply::toBool, std::move(cb));
+}
+
+TypedFuture<long long> QHash::hlen_future()
+{
+  return executeTyped<long long>(*mClient, EncodedRequest::make("HLEN", mKey),
+    TypedReply::toInteger);
+}
+
+void QHash::hlen_async(TypedCallback<long long> cb)
+{
+  executeTyped<long long>(*mClient, EncodedRequest::make("HLEN", mKey),
+    TypedReply::toInteger, std::move(cb));
+}
+
+TypedFuture<long long> QHash::hincrby_future(const std::string& field,
+                                             long long increment)
+{
+  invalidateCache();
+  return executeTyped<long long>(*mClient,
+    EncodedRequest::make("HINCRBY", mKey, field, increment),
+    TypedReply::toInteger);
+}
+
+void QHash::hincrby_async(const std::string& field, long long increment,
+                          TypedCallback<long long> cb)
+{
+  invalidateCache();
+  executeTyped<long long>(*mClient,
+    EncodedRequest::make("HINCRBY", mKey, field, increment),
+    TypedReply::toInteger, std::move(cb));
+}
+
+TypedFuture<double> QHash::hincrbyfloat_future(const std::string& field,
+                                               double increment)
+{
+  invalidateCache();
+  return executeTyped<double>(*mClient,
+    EncodedRequest::make("HINCRBYFLOAT", mKey, field, std::to_string(increment)),
+    TypedReply::toDouble);
+}
+
+void QHash::hincrbyfloat_async(const std::string& field, double increment,
+                               TypedCallback<double> cb)
+{
+  invalidateCache();
+  executeTyped<double>(*mClient,
+    EncodedRequest::make("HINCRBYFLOAT", mKey, field, std::to_string(increment)),
+    TypedReply::toDouble, std::move(cb));
+}
+
+TypedFuture<std::vector<std::string>> QHash::hgetall_future()
+{
+  return executeTyped<std::vector<std::string>>(*mClient,
+    EncodedRequest::make("HGETALL", mKey),
+    mCompression.active() ? toDecodedPairs : TypedReply::toStringVector);
+}
+
+void QHash::hgetall_async(TypedCallback<std::vector<std::string>> cb)
+{
+  executeTyped<std::vector<std::string>>(*mClient,
+    EncodedRequest::make("HGETALL", mKey),
+    mCompression.active() ? toDecodedPairs : TypedReply::toStringVector,
+    std::move(cb));
+}
+
+TypedFuture<std::vector<std::string>> QHash::hkeys_future()
+{
+  return executeTyped<std::vector<std::string>>(*mClient,
+    EncodedRequest::make("HKEYS", mKey), TypedReply::toStringVector);
+}
+
+void QHash::hkeys_async(TypedCallback<std::vector<std::string>> cb)
+{
+  executeTyped<std::vector<std::string>>(*mClient,
+    EncodedRequest::make("HKEYS", mKey), TypedReply::toStringVector,
+    std::move(cb));
+}
+
+TypedFuture<std::vector<std::string>> QHash::hvals_future()
+{
+  return executeTyped<std::vector<std::string>>(*mClient,
+    EncodedRequest::make("HVALS", mKey),
+    mCompression.active() ? toDecodedValues : TypedReply::toStringVector);
+}
+
+void QHash::hvals_async(TypedCallback<std::vector<std::string>> cb)
+{
+  executeTyped<std::vector<std::string>>(*mClient,
+    EncodedRequest::make("HVALS", mKey),
+    mCompression.active() ? toDecodedValues : TypedReply::toStringVector,
+    std::move(cb));
+}
+
+//------------------------------------------------------------------------------
+// Compression helpers
+//------------------------------------------------------------------------------
+void QHash::packValues(std::list<std::string>& lst_elem) const
+{
+  if (!mCompression.active()) {
+    return;
+  }
+
+  std::string buffer;
+  bool isValue = false;
+
+  for (auto it = lst_elem.begin(); it != lst_elem.end(); ++it) {
+    if (isValue && mCompression.encode(*it, buffer)) {
+      it->swap(buffer);
+    }
+
+    isValue = !isValue;
+  }
+}
+
+void QHash::unpackValue(std::string& value) const
+{
+  if (mCompression.active() && !ValueCompression::decodeInPlace(value)) {
+    throw std::runtime_error("[FATAL] Error decoding value of key: " + mKey +
+                             ": Corrupted compressed value");
+  }
+}
+
+void QHash::unpackValues(std::vector<std::string>& values, size_t first,
+                         size_t stride) const
+{
+  if (!mCompression.active()) {
+    return;
+  }
+
+  for (size_t i = first; i < values.size(); i += stride) {
+    unpackValue(values[i]);
+  }
+}
+
+void QHash::unpackValues(std::map<std::string, std::string>& values) const
+{
+  if (!mCompression.active()) {
+    return;
+  }
+
+  for (auto it = values.begin(); it != values.end(); ++it) {
+    unpackValue(it->second);
+  }
+}
+
+void QHash::unpackValues(std::unordered_map<std::string, std::string>& values) const
+{
+  if (!mCompression.active()) {
+    return;
+  }
+
+  for (auto it = values.begin(); it != values.end(); ++it) {
+    unpackValue(it->second);
+  }
+}
+
 //------------------------------------------------------------------------------
 // HASH Get iterator
 //------------------------------------------------------------------------------
@@ -268,37 +919,97 @@ QHash::Iterator::Iterator(QHash &qh, size_t cnt, const std::string &crs)
 }
 
 bool QHash::Iterator::valid() const {
-  return ! results.empty();
+  return entries && position < entries->elements;
+}
+
+void QHash::Iterator::prefetch() {
+  reqs++;
+  pending = qhash.mClient->pooledExec("HSCAN", qhash.mKey, cursor, "COUNT",
+    count);
 }
 
 void QHash::Iterator::fillFromBackend() {
-  while(!reachedEnd && results.empty()) {
-    reqs++;
-    std::pair<std::string, std::map<std::string, std::string> > answer =
-    qhash.hscan(cursor, count);
+  while(!reachedEnd && !valid()) {
+    if(!pending.valid()) {
+      prefetch();
+    }
+
+    redisReplyPtr reply = pending.get();
+
+    if ((reply == nullptr) || (reply->type != REDIS_REPLY_ARRAY) ||
+        (reply->elements != 2) ||
+        (reply->element[0]->type != REDIS_REPLY_STRING) ||
+        (reply->element[1]->type != REDIS_REPLY_ARRAY) ||
+        (reply->element[1]->elements % 2 != 0)) {
+      throw std::runtime_error("[FATAL] Error hscan key: " + qhash.mKey +
+                               ": Unexpected/null reply");
+    }
+
+    const redisReply* array = reply->element[1];
+
+    for (size_t i = 0; i < array->elements; ++i) {
+      if (array->element[i]->type != REDIS_REPLY_STRING) {
+        throw std::runtime_error("[FATAL] Error hscan key: " + qhash.mKey +
+                                 ": Unexpected/null reply");
+      }
+    }
+
+    cursor.assign(reply->element[0]->str, reply->element[0]->len);
+
+    // Pairs are served straight out of the reply - only compressed values
+    // need a decoded copy
+    decoded.clear();
+
+    if (qhash.mCompression.active()) {
+      decoded.reserve(array->elements / 2);
 
-    cursor = answer.first;
-    results = std::move(answer.second);
+      for (size_t i = 1; i < array->elements; i += 2) {
+        decoded.emplace_back(array->element[i]->str, array->element[i]->len);
+      }
+
+      qhash.unpackValues(decoded, 0, 1);
+    }
+
+    page = std::move(reply);
+    entries = array;
+    position = 0;
 
     if(cursor == "0") {
       reachedEnd = true;
     }
+    else {
+      prefetch();
+    }
   }
 }
 
 void QHash::Iterator::next() {
-  if(!results.empty()) {
-    results.erase(results.begin());
+  if(valid()) {
+    position += 2;
   }
   fillFromBackend();
 }
 
 std::string QHash::Iterator::getKey() const {
-  return results.begin()->first;
+  return std::string(getKeyView());
 }
 
 std::string QHash::Iterator::getValue() const {
-  return results.begin()->second;
+  return std::string(getValueView());
+}
+
+StringView QHash::Iterator::getKeyView() const {
+  const redisReply* field = entries->element[position];
+  return StringView(field->str, field->len);
+}
+
+StringView QHash::Iterator::getValueView() const {
+  if (!decoded.empty()) {
+    return decoded[position / 2];
+  }
+
+  const redisReply* value = entries->element[position + 1];
+  return StringView(value->str, value->len);
 }
 
 size_t QHash::Iterator::requestsSoFar() const {
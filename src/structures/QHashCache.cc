@@ -0,0 +1,338 @@
+/************************************************************************
+ * EOS - the CERN Disk Storage System                                   *
+ * Copyright (C) 2016 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+//------------------------------------------------------------------------------
+//! @brief Client-side cache for QHash reads
+//------------------------------------------------------------------------------
+
+#include "qclient/structures/QHashCache.hh"
+#include "qclient/pubsub/Message.hh"
+#include "qclient/utils/SteadyClock.hh"
+#include <iterator>
+
+QCLIENT_NAMESPACE_BEGIN
+
+//------------------------------------------------------------------------------
+// Rough per-entry bookkeeping overhead: list node, index slot, strings
+//------------------------------------------------------------------------------
+static constexpr size_t kEntryOverhead = 128;
+
+//------------------------------------------------------------------------------
+// Constructor
+//------------------------------------------------------------------------------
+QHashCache::QHashCache(std::chrono::milliseconds ttl, size_t maxBytes,
+                       SteadyClock* clock)
+  : mTtl(ttl), mMaxBytes(maxBytes), mClock(clock) {}
+
+//------------------------------------------------------------------------------
+// Approximate memory taken by an entry
+//------------------------------------------------------------------------------
+size_t QHashCache::entrySize(const Entry& entry)
+{
+  return kEntryOverhead + entry.key.size() + entry.field.size() +
+         entry.value.size();
+}
+
+//------------------------------------------------------------------------------
+// Find live entry, dropping it if expired - field nullptr means the length
+//------------------------------------------------------------------------------
+QHashCache::Entry* QHashCache::lookup(const std::string& key,
+                                      const std::string* field)
+{
+  auto keyIt = mIndex.find(key);
+
+  if (keyIt == mIndex.end()) {
+    return nullptr;
+  }
+
+  Lru::iterator it;
+
+  if (field) {
+    auto fieldIt = keyIt->second.fields.find(*field);
+
+    if (fieldIt == keyIt->second.fields.end()) {
+      return nullptr;
+    }
+
+    it = fieldIt->second;
+  } else {
+    if (!keyIt->second.hasLength) {
+      return nullptr;
+    }
+
+    it = keyIt->second.length;
+  }
+
+  if (it->expiry <= SteadyClock::now(mClock)) {
+    erase(it);
+    return nullptr;
+  }
+
+  mLru.splice(mLru.begin(), mLru, it);
+  return &(*it);
+}
+
+//------------------------------------------------------------------------------
+// Insert entry, replacing any previous one, and evict down to mMaxBytes
+//------------------------------------------------------------------------------
+void QHashCache::insert(Entry&& entry)
+{
+  if (entrySize(entry) > mMaxBytes) {
+    return;
+  }
+
+  KeyIndex& index = mIndex[entry.key];
+
+  if (entry.isLength) {
+    if (index.hasLength) {
+      erase(index.length);
+    }
+  } else {
+    auto fieldIt = index.fields.find(entry.field);
+
+    if (fieldIt != index.fields.end()) {
+      erase(fieldIt->second);
+    }
+  }
+
+  // erase() might have dropped the index entry, if it was the last one
+  KeyIndex& target = mIndex[entry.key];
+  mBytes += entrySize(entry);
+  mLru.emplace_front(std::move(entry));
+
+  if (mLru.front().isLength) {
+    target.length = mLru.begin();
+    target.hasLength = true;
+  } else {
+    target.fields[mLru.front().field] = mLru.begin();
+  }
+
+  while (mBytes > mMaxBytes) {
+    erase(std::prev(mLru.end()));
+  }
+}
+
+//------------------------------------------------------------------------------
+// Remove entry from both the LRU list and the index
+//------------------------------------------------------------------------------
+void QHashCache::erase(Lru::iterator it)
+{
+  auto keyIt = mIndex.find(it->key);
+
+  if (it->isLength) {
+    keyIt->second.hasLength = false;
+  } else {
+    keyIt->second.fields.erase(it->field);
+  }
+
+  if (!keyIt->second.hasLength && keyIt->second.fields.empty()) {
+    mIndex.erase(keyIt);
+  }
+
+  mBytes -= entrySize(*it);
+  mLru.erase(it);
+}
+
+//------------------------------------------------------------------------------
+// Lookup cached field
+//------------------------------------------------------------------------------
+bool QHashCache::getField(const std::string& key, const std::string& field,
+                          bool& exists, std::string& value, uint64_t& generation)
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+  Entry* entry = lookup(key, &field);
+
+  if (!entry) {
+    generation = mGeneration;
+    return false;
+  }
+
+  exists = entry->exists;
+  value = entry->value;
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Store field fetched from the backend
+//------------------------------------------------------------------------------
+void QHashCache::putField(const std::string& key, const std::string& field,
+                          bool exists, const std::string& value,
+                          uint64_t generation)
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+
+  if (generation != mGeneration) {
+    return;
+  }
+
+  Entry entry;
+  entry.key = key;
+  entry.field = field;
+  entry.isLength = false;
+  entry.exists = exists;
+  entry.value = value;
+  entry.length = 0;
+  entry.expiry = SteadyClock::now(mClock) + mTtl;
+  insert(std::move(entry));
+}
+
+//------------------------------------------------------------------------------
+// Lookup cached hash length
+//------------------------------------------------------------------------------
+bool QHashCache::getLength(const std::string& key, long long int& length,
+                           uint64_t& generation)
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+  Entry* entry = lookup(key, nullptr);
+
+  if (!entry) {
+    generation = mGeneration;
+    return false;
+  }
+
+  length = entry->length;
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Store hash length fetched from the backend
+//------------------------------------------------------------------------------
+void QHashCache::putLength(const std::string& key, long long int length,
+                           uint64_t generation)
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+
+  if (generation != mGeneration) {
+    return;
+  }
+
+  Entry entry;
+  entry.key = key;
+  entry.isLength = true;
+  entry.exists = true;
+  entry.length = length;
+  entry.expiry = SteadyClock::now(mClock) + mTtl;
+  insert(std::move(entry));
+}
+
+//------------------------------------------------------------------------------
+// Drop everything cached for the given key
+//------------------------------------------------------------------------------
+void QHashCache::invalidate(const std::string& key)
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+  mGeneration++;
+
+  auto keyIt = mIndex.find(key);
+
+  if (keyIt == mIndex.end()) {
+    return;
+  }
+
+  for (auto it = keyIt->second.fields.begin(); it != keyIt->second.fields.end(); it++) {
+    mBytes -= entrySize(*it->second);
+    mLru.erase(it->second);
+  }
+
+  if (keyIt->second.hasLength) {
+    mBytes -= entrySize(*keyIt->second.length);
+    mLru.erase(keyIt->second.length);
+  }
+
+  mIndex.erase(keyIt);
+}
+
+//------------------------------------------------------------------------------
+// Drop everything
+//------------------------------------------------------------------------------
+void QHashCache::invalidateAll()
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+  mGeneration++;
+  mLru.clear();
+  mIndex.clear();
+  mBytes = 0;
+}
+
+//------------------------------------------------------------------------------
+// Invalidate keys named in keyspace / keyevent notifications, or client
+// tracking messages
+//------------------------------------------------------------------------------
+void QHashCache::handleIncomingMessage(const Message& msg)
+{
+  if (msg.getMessageType() != MessageType::kMessage &&
+      msg.getMessageType() != MessageType::kPatternMessage) {
+    return;
+  }
+
+  const std::string& channel = msg.getChannel();
+
+  if (channel == "__redis__:invalidate") {
+    // Empty payload: the server flushed its tracking table
+    if (msg.getPayload().empty()) {
+      invalidateAll();
+    } else {
+      invalidate(msg.getPayload());
+    }
+
+    return;
+  }
+
+  // __keyspace@<db>__:<key>, or __keyevent@<db>__:<event> with the key as
+  // payload
+  static const std::string kKeyspace = "__keyspace@";
+  static const std::string kKeyevent = "__keyevent@";
+  bool keyspace = channel.compare(0, kKeyspace.size(), kKeyspace) == 0;
+  bool keyevent = channel.compare(0, kKeyevent.size(), kKeyevent) == 0;
+
+  if (!keyspace && !keyevent) {
+    return;
+  }
+
+  size_t separator = channel.find("__:", kKeyspace.size());
+
+  if (separator == std::string::npos) {
+    return;
+  }
+
+  if (keyspace) {
+    invalidate(channel.substr(separator + 3));
+  } else {
+    invalidate(msg.getPayload());
+  }
+}
+
+//------------------------------------------------------------------------------
+// Number of cached entries
+//------------------------------------------------------------------------------
+size_t QHashCache::size() const
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+  return mLru.size();
+}
+
+//------------------------------------------------------------------------------
+// Approximate size of cached entries, in bytes
+//------------------------------------------------------------------------------
+size_t QHashCache::bytes() const
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+  return mBytes;
+}
+
+QCLIENT_NAMESPACE_END
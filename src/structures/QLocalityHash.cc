@@ -23,6 +23,8 @@
 
 #include "qclient/structures/QLocalityHash.hh"
 #include "qclient/QClient.hh"
+#include <algorithm>
+#include <deque>
 
 #define SSTR(message) static_cast<std::ostringstream&>(std::ostringstream().flush() << message).str()
 #define DBG(message) std::cerr << __FILE__ << ":" << __LINE__ << " -- " << #message << " = " << message << std::endl
@@ -30,6 +32,132 @@
 
 namespace qclient {
 
+//------------------------------------------------------------------------------
+// Constructor
+//------------------------------------------------------------------------------
+QLocalityHash::QLocalityHash(QClient &qcl, const std::string &key)
+: mQcl(qcl), mKey(key) {}
+
+//------------------------------------------------------------------------------
+// LHGET request, with the hint only if given
+//------------------------------------------------------------------------------
+EncodedRequest QLocalityHash::makeLhget(const std::string &field,
+  const std::string &hint) const {
+
+  if(hint.empty()) {
+    return EncodedRequest::make("LHGET", mKey, field);
+  }
+
+  return EncodedRequest::make("LHGET", mKey, field, hint);
+}
+
+//------------------------------------------------------------------------------
+// Non-blocking operations
+//------------------------------------------------------------------------------
+TypedFuture<std::string> QLocalityHash::lhget_future(const std::string &field,
+  const std::string &hint) {
+  return executeTyped<std::string>(mQcl, makeLhget(field, hint), TypedReply::toString);
+}
+
+void QLocalityHash::lhget_async(const std::string &field, const std::string &hint,
+  TypedCallback<std::string> cb) {
+  executeTyped<std::string>(mQcl, makeLhget(field, hint), TypedReply::toString,
+    std::move(cb));
+}
+
+//------------------------------------------------------------------------------
+// Bulk LHGET. Sorting by hint keeps each locality together; the sort is
+// stable, so fields sharing one are still asked for in the caller's order.
+//------------------------------------------------------------------------------
+Status QLocalityHash::lhgetBulk(const std::vector<Lookup> &lookups,
+  std::unordered_map<std::string, std::string> &out, size_t maxInFlight) {
+
+  std::vector<const Lookup*> order;
+  order.reserve(lookups.size());
+  for(const Lookup &lookup : lookups) {
+    order.emplace_back(&lookup);
+  }
+
+  std::stable_sort(order.begin(), order.end(), [](const Lookup *a, const Lookup *b) {
+    return a->hint < b->hint;
+  });
+
+  maxInFlight = std::max<size_t>(maxInFlight, 1u);
+  std::deque<std::pair<const Lookup*, ReplyFuture>> inFlight;
+  Status status;
+
+  auto reapOldest = [&]() {
+    const Lookup *lookup = inFlight.front().first;
+    redisReplyPtr reply = inFlight.front().second.get();
+    inFlight.pop_front();
+
+    if(reply && reply->type == REDIS_REPLY_NIL) {
+      return;
+    }
+
+    std::string value;
+    Status st = reply ? TypedReply::toString(reply, value) :
+      Status(ENOTCONN, "unable to contact backend - network error");
+
+    if(!st.ok()) {
+      if(status.ok()) {
+        status = Status(st.getErrc(), SSTR("LHGET " << lookup->field << ": " << st.getMsg()));
+      }
+
+      return;
+    }
+
+    out[lookup->field] = std::move(value);
+  };
+
+  for(const Lookup *lookup : order) {
+    while(inFlight.size() >= maxInFlight) {
+      reapOldest();
+    }
+
+    if(!status.ok()) break;
+    inFlight.emplace_back(lookup, mQcl.pooledExecute(makeLhget(lookup->field, lookup->hint)));
+  }
+
+  while(!inFlight.empty()) {
+    reapOldest();
+  }
+
+  return status;
+}
+
+TypedFuture<bool> QLocalityHash::lhset_future(const std::string &field,
+  const std::string &hint, const std::string &value) {
+  return executeTyped<bool>(mQcl,
+    EncodedRequest::make("LHSET", mKey, field, hint, value), TypedReply::toBool);
+}
+
+void QLocalityHash::lhset_async(const std::string &field, const std::string &hint,
+  const std::string &value, TypedCallback<bool> cb) {
+  executeTyped<bool>(mQcl, EncodedRequest::make("LHSET", mKey, field, hint, value),
+    TypedReply::toBool, std::move(cb));
+}
+
+TypedFuture<bool> QLocalityHash::lhdel_future(const std::string &field) {
+  return executeTyped<bool>(mQcl, EncodedRequest::make("LHDEL", mKey, field),
+    TypedReply::toBool);
+}
+
+void QLocalityHash::lhdel_async(const std::string &field, TypedCallback<bool> cb) {
+  executeTyped<bool>(mQcl, EncodedRequest::make("LHDEL", mKey, field),
+    TypedReply::toBool, std::move(cb));
+}
+
+TypedFuture<long long> QLocalityHash::lhlen_future() {
+  return executeTyped<long long>(mQcl, EncodedRequest::make("LHLEN", mKey),
+    TypedReply::toInteger);
+}
+
+void QLocalityHash::lhlen_async(TypedCallback<long long> cb) {
+  executeTyped<long long>(mQcl, EncodedRequest::make("LHLEN", mKey),
+    TypedReply::toInteger, std::move(cb));
+}
+
 //------------------------------------------------------------------------------
 // Constructor
 //------------------------------------------------------------------------------
@@ -59,14 +187,24 @@ void QLocalityHash::Iterator::malformed(redisReplyPtr reply) {
   return;
 }
 
+//------------------------------------------------------------------------------
+// Request the next page
+//------------------------------------------------------------------------------
+void QLocalityHash::Iterator::prefetch() {
+  mReqs++;
+  mPending = mQcl->pooledExec("LHSCAN", mKey, mCursor, "COUNT", mCount);
+}
+
 //------------------------------------------------------------------------------
 // Fill internal buffer with contents from remote server
 //------------------------------------------------------------------------------
 void QLocalityHash::Iterator::fillFromBackend() {
-  while(mError.empty() && mResults.empty() && !mReachedEnd) {
-    mReqs++;
+  while(mError.empty() && !valid() && !mReachedEnd) {
+    if(!mPending.valid()) {
+      prefetch();
+    }
 
-    redisReplyPtr reply = mQcl->exec("LHSCAN", mKey, mCursor, "COUNT", std::to_string(mCount)).get();
+    redisReplyPtr reply = mPending.get();
 
     if(!reply) {
       mError = "unable to contact backend - network error";
@@ -82,22 +220,31 @@ void QLocalityHash::Iterator::fillFromBackend() {
       return malformed(reply);
     }
 
-    mCursor = std::string(nextCursor->str, nextCursor->len);
-    if(mCursor == "0") mReachedEnd = true;
-
     redisReply *subArray = reply->element[1];
     if(!subArray || subArray->type != REDIS_REPLY_ARRAY || (subArray->elements % 3) != 0) {
       return malformed(reply);
     }
 
+    mCursor = std::string(nextCursor->str, nextCursor->len);
+    if(mCursor == "0") {
+      mReachedEnd = true;
+    }
+    else {
+      prefetch();
+    }
+
     for(size_t i = 0; i < subArray->elements; i++) {
       redisReply *item = subArray->element[i];
       if(!item || item->type != REDIS_REPLY_STRING) {
         return malformed(reply);
       }
-
-      mResults.emplace_back(item->str, item->len);
     }
+
+    // Entries are served straight out of the reply, which stays alive until
+    // the next page replaces it
+    mReply = std::move(reply);
+    mEntries = subArray;
+    mPosition = 0;
   }
 }
 
@@ -107,22 +254,39 @@ void QLocalityHash::Iterator::fillFromBackend() {
 // valid() == true
 //------------------------------------------------------------------------------
 bool QLocalityHash::Iterator::valid() const {
-  return mError.empty() && !mResults.empty();
+  return mError.empty() && mEntries && mPosition < mEntries->elements;
 }
 
 //------------------------------------------------------------------------------
 // Fetch current element being pointed to
 //------------------------------------------------------------------------------
+StringView QLocalityHash::Iterator::element(size_t offset) const {
+  const redisReply *item = mEntries->element[mPosition + offset];
+  return StringView(item->str, item->len);
+}
+
 std::string QLocalityHash::Iterator::getKey() const {
-  return mResults[1];
+  return std::string(getKeyView());
 }
 
 std::string QLocalityHash::Iterator::getLocalityHint() const {
-  return mResults[0];
+  return std::string(getLocalityHintView());
 }
 
 std::string QLocalityHash::Iterator::getValue() const {
-  return mResults[2];
+  return std::string(getValueView());
+}
+
+StringView QLocalityHash::Iterator::getKeyView() const {
+  return element(1);
+}
+
+StringView QLocalityHash::Iterator::getLocalityHintView() const {
+  return element(0);
+}
+
+StringView QLocalityHash::Iterator::getValueView() const {
+  return element(2);
 }
 
 //------------------------------------------------------------------------------
@@ -136,8 +300,8 @@ size_t QLocalityHash::Iterator::requestsSoFar() const {
 // Advance iterator - may result in network requests and block
 //------------------------------------------------------------------------------
 void QLocalityHash::Iterator::next() {
-  if(!mResults.empty()) {
-    mResults.erase(mResults.begin(), mResults.begin()+3);
+  if(valid()) {
+    mPosition += 3;
   }
 
   fillFromBackend();
@@ -22,9 +22,38 @@
  ************************************************************************/
 
 #include "qclient/structures/QSet.hh"
+#include <algorithm>
 
 QCLIENT_NAMESPACE_BEGIN
 
+//------------------------------------------------------------------------------
+// Parse the reply to SSCAN
+//------------------------------------------------------------------------------
+static std::pair< std::string, std::vector<std::string> >
+parseSscan(const std::string &key, const redisReplyPtr &reply)
+{
+  if (reply == nullptr) {
+    throw std::runtime_error("[FATAL] Error sscan key: " + key +
+                             ": Unexpected/null reply");
+  }
+
+  // Parse the Redis reply
+  std::string new_cursor {reply->element[0]->str,
+                          static_cast<unsigned int>(reply->element[0]->len)};
+  // First element is the new cursor
+  std::pair<std::string, std::vector<std::string> > retc_pair;
+  retc_pair.first = new_cursor;
+  // Get arrary part of the response
+  redisReply* reply_ptr =  reply->element[1];
+
+  for (unsigned long i = 0; i < reply_ptr->elements; ++i) {
+    retc_pair.second.emplace_back(reply_ptr->element[i]->str,
+                                  static_cast<unsigned int>(reply_ptr->element[i]->len));
+  }
+
+  return retc_pair;
+}
+
 //------------------------------------------------------------------------------
 // Copy assignment
 //------------------------------------------------------------------------------
@@ -51,7 +80,7 @@ long long int QSet::sadd(std::list<std::string> lst_elem)
 {
   (void) lst_elem.push_front(mKey);
   (void) lst_elem.push_front("SADD");
-  redisReplyPtr reply = mClient->execute(lst_elem).get();
+  redisReplyPtr reply = mClient->pooledExecute(EncodedRequest(lst_elem)).get();
 
   if ((reply == nullptr) || (reply->type != REDIS_REPLY_INTEGER)) {
     throw std::runtime_error("[FATAL] Error sadd key: " + mKey +
@@ -68,7 +97,7 @@ long long int QSet::srem(std::list<std::string> lst_elem)
 {
   (void) lst_elem.push_front(mKey);
   (void) lst_elem.push_front("SREM");
-  redisReplyPtr reply = mClient->execute(lst_elem).get();
+  redisReplyPtr reply = mClient->pooledExecute(EncodedRequest(lst_elem)).get();
 
   if ((reply == nullptr) || (reply->type != REDIS_REPLY_INTEGER)) {
     throw std::runtime_error("[FATAL] Error srem key: " + mKey +
@@ -83,7 +112,7 @@ long long int QSet::srem(std::list<std::string> lst_elem)
 //------------------------------------------------------------------------------
 long long int QSet::scard()
 {
-  redisReplyPtr reply = mClient->exec("SCARD", mKey).get();
+  redisReplyPtr reply = mClient->pooledExec("SCARD", mKey).get();
 
   if ((reply == nullptr) || (reply->type != REDIS_REPLY_INTEGER)) {
     throw std::runtime_error("[FATAL] Error scard key: " + mKey +
@@ -96,52 +125,72 @@ long long int QSet::scard()
 //------------------------------------------------------------------------------
 // Redis SET smembers command - synchronous
 //------------------------------------------------------------------------------
-std::set<std::string> QSet::smembers()
+template<typename Decoder>
+void QSet::smembersDecode(Decoder& decoder)
 {
-  redisReplyPtr reply = mClient->exec("SMEMBERS", mKey).get();
+  // Decode straight into the result, without building a reply tree
+  redisReplyPtr reply = mClient->execute(EncodedRequest::make("SMEMBERS", mKey),
+                                         &decoder).get();
 
-  if ((reply == nullptr) || (reply->type != REDIS_REPLY_ARRAY)) {
+  if ((reply == nullptr) || ((reply->type != REDIS_REPLY_ARRAY) &&
+                             (reply->type != REDIS_REPLY_SET)) ||
+      !decoder.ok()) {
     throw std::runtime_error("[FATAL] Error smembers key: " + mKey +
                              " : Unexpected/null reply");
   }
+}
 
+std::set<std::string> QSet::smembers()
+{
   std::set<std::string> ret;
-
-  for (size_t i = 0; i < reply->elements; ++i) {
-    ret.emplace(reply->element[i]->str, reply->element[i]->len);
-  }
-
+  StringCollector<std::set<std::string>> decoder(ret);
+  smembersDecode(decoder);
   return ret;
 }
 
 //------------------------------------------------------------------------------
-// Redis SET SCAN command - synchronous
+// Redis SET smembers command - synchronous, into the given container
 //------------------------------------------------------------------------------
-std::pair< std::string, std::vector<std::string> >
-QSet::sscan(const std::string &cursor, long long count)
+void QSet::smembers(std::vector<std::string>& out, bool sorted)
 {
-  redisReplyPtr reply = mClient->exec("SSCAN", mKey, cursor, "COUNT", std::to_string(count)).get();
+  StringCollector<std::vector<std::string>> decoder(out);
+  smembersDecode(decoder);
 
-  if (reply == nullptr) {
-    throw std::runtime_error("[FATAL] Error sscan key: " + mKey +
-                             ": Unexpected/null reply");
+  if (sorted) {
+    std::sort(out.begin(), out.end());
   }
+}
 
-  // Parse the Redis reply
-  std::string new_cursor {reply->element[0]->str,
-                          static_cast<unsigned int>(reply->element[0]->len)};
-  // First element is the new cursor
-  std::pair<std::string, std::vector<std::string> > retc_pair;
-  retc_pair.first = new_cursor;
-  // Get arrary part of the response
-  redisReply* reply_ptr =  reply->element[1];
+void QSet::smembers(std::unordered_set<std::string>& out)
+{
+  StringCollector<std::unordered_set<std::string>> decoder(out);
+  smembersDecode(decoder);
+}
 
-  for (unsigned long i = 0; i < reply_ptr->elements; ++i) {
-    retc_pair.second.emplace_back(reply_ptr->element[i]->str,
-                                  static_cast<unsigned int>(reply_ptr->element[i]->len));
-  }
+//------------------------------------------------------------------------------
+// Redis SET smembers command - synchronous, streamed
+//------------------------------------------------------------------------------
+size_t QSet::smembers(const MemberCallback& cb)
+{
+  size_t members = 0;
+  StringStreamer::Callback counting = [&cb, &members](std::string&& member) {
+    members++;
+    cb(std::move(member));
+  };
+
+  StringStreamer decoder(counting);
+  smembersDecode(decoder);
+  return members;
+}
 
-  return retc_pair;
+//------------------------------------------------------------------------------
+// Redis SET SCAN command - synchronous
+//------------------------------------------------------------------------------
+std::pair< std::string, std::vector<std::string> >
+QSet::sscan(const std::string &cursor, long long count)
+{
+  return parseSscan(mKey, mClient->pooledExec("SSCAN", mKey, cursor, "COUNT",
+                    count).get());
 }
 
 //------------------------------------------------------------------------------
@@ -172,6 +221,110 @@ QSet::sadd_async(const std::list<std::string>& set_elem, AsyncHandler* ah)
   ah->Register(mClient, cmd);
 }
 
+//------------------------------------------------------------------------------
+// Request applying cmd to the given members
+//------------------------------------------------------------------------------
+static EncodedRequest makeMulti(const char* cmd, const std::string& key,
+                                const std::list<std::string>& lst_elem)
+{
+  std::vector<std::string> req;
+  req.reserve(lst_elem.size() + 2);
+  req.emplace_back(cmd);
+  req.emplace_back(key);
+  req.insert(req.end(), lst_elem.begin(), lst_elem.end());
+  return EncodedRequest(req);
+}
+
+//------------------------------------------------------------------------------
+// Non-blocking forms
+//------------------------------------------------------------------------------
+TypedFuture<bool> QSet::sadd_future(const std::string& member)
+{
+  return executeTyped<bool>(*mClient, EncodedRequest::make("SADD", mKey, member),
+    TypedReply::toBool);
+}
+
+void QSet::sadd_async(const std::string& member, TypedCallback<bool> cb)
+{
+  executeTyped<bool>(*mClient, EncodedRequest::make("SADD", mKey, member),
+    TypedReply::toBool, std::move(cb));
+}
+
+TypedFuture<long long> QSet::sadd_future(const std::list<std::string>& lst_elem)
+{
+  return executeTyped<long long>(*mClient, makeMulti("SADD", mKey, lst_elem),
+    TypedReply::toInteger);
+}
+
+void QSet::sadd_async(const std::list<std::string>& lst_elem,
+                      TypedCallback<long long> cb)
+{
+  executeTyped<long long>(*mClient, makeMulti("SADD", mKey, lst_elem),
+    TypedReply::toInteger, std::move(cb));
+}
+
+TypedFuture<bool> QSet::srem_future(const std::string& member)
+{
+  return executeTyped<bool>(*mClient, EncodedRequest::make("SREM", mKey, member),
+    TypedReply::toBool);
+}
+
+void QSet::srem_async(const std::string& member, TypedCallback<bool> cb)
+{
+  executeTyped<bool>(*mClient, EncodedRequest::make("SREM", mKey, member),
+    TypedReply::toBool, std::move(cb));
+}
+
+TypedFuture<long long> QSet::srem_future(const std::list<std::string>& lst_elem)
+{
+  return executeTyped<long long>(*mClient, makeMulti("SREM", mKey, lst_elem),
+    TypedReply::toInteger);
+}
+
+void QSet::srem_async(const std::list<std::string>& lst_elem,
+                      TypedCallback<long long> cb)
+{
+  executeTyped<long long>(*mClient, makeMulti("SREM", mKey, lst_elem),
+    TypedReply::toInteger, std::move(cb));
+}
+
+TypedFuture<long long> QSet::scard_future()
+{
+  return executeTyped<long long>(*mClient, EncodedRequest::make("SCARD", mKey),
+    TypedReply::toInteger);
+}
+
+void QSet::scard_async(TypedCallback<long long> cb)
+{
+  executeTyped<long long>(*mClient, EncodedRequest::make("SCARD", mKey),
+    TypedReply::toInteger, std::move(cb));
+}
+
+TypedFuture<bool> QSet::sismember_future(const std::string& member)
+{
+  return executeTyped<bool>(*mClient,
+    EncodedRequest::make("SISMEMBER", mKey, member), TypedReply::toBool);
+}
+
+void QSet::sismember_async(const std::string& member, TypedCallback<bool> cb)
+{
+  executeTyped<bool>(*mClient, EncodedRequest::make("SISMEMBER", mKey, member),
+    TypedReply::toBool, std::move(cb));
+}
+
+TypedFuture<std::set<std::string>> QSet::smembers_future()
+{
+  return executeTyped<std::set<std::string>>(*mClient,
+    EncodedRequest::make("SMEMBERS", mKey), TypedReply::toStringSet);
+}
+
+void QSet::smembers_async(TypedCallback<std::set<std::string>> cb)
+{
+  executeTyped<std::set<std::string>>(*mClient,
+    EncodedRequest::make("SMEMBERS", mKey), TypedReply::toStringSet,
+    std::move(cb));
+}
+
 //------------------------------------------------------------------------------
 // SET Get iterator
 //------------------------------------------------------------------------------
@@ -191,12 +344,20 @@ bool QSet::Iterator::valid() const {
   return it != results.end();
 }
 
+void QSet::Iterator::prefetch() {
+  reqs++;
+  pending = qset.mClient->pooledExec("SSCAN", qset.mKey, cursor, "COUNT",
+    count);
+}
+
 void QSet::Iterator::fillFromBackend() {
   while(!reachedEnd && it == results.end()) {
-    reqs++;
+    if(!pending.valid()) {
+      prefetch();
+    }
 
     std::pair<std::string, std::vector<std::string> > answer =
-    qset.sscan(cursor, count);
+    parseSscan(qset.mKey, pending.get());
 
     cursor = answer.first;
     results = std::move(answer.second);
@@ -205,6 +366,9 @@ void QSet::Iterator::fillFromBackend() {
     if(cursor == "0") {
       reachedEnd = true;
     }
+    else {
+      prefetch();
+    }
   }
 }
 
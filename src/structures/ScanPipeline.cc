@@ -0,0 +1,115 @@
+/************************************************************************
+ * EOS - the CERN Disk Storage System                                   *
+ * Copyright (C) 2016 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+//------------------------------------------------------------------------------
+//! @brief Scan-and-act bulk maintenance over the keyspace
+//------------------------------------------------------------------------------
+
+#include "qclient/structures/ScanPipeline.hh"
+#include "qclient/structures/QScanner.hh"
+#include "qclient/QClient.hh"
+#include "qclient/QClientPool.hh"
+#include <memory>
+
+QCLIENT_NAMESPACE_BEGIN
+
+//------------------------------------------------------------------------------
+// Constructors
+//------------------------------------------------------------------------------
+ScanPipeline::ScanPipeline(QClient& qcl, const ScanPipelineOptions& options)
+  : mQcl(&qcl), mOptions(options) {}
+
+ScanPipeline::ScanPipeline(QClientPool& pool, const ScanPipelineOptions& options)
+  : mPool(&pool), mOptions(options) {}
+
+//------------------------------------------------------------------------------
+// Set progress callback
+//------------------------------------------------------------------------------
+void ScanPipeline::onProgress(ProgressCallback callback)
+{
+  mProgress = std::move(callback);
+}
+
+//------------------------------------------------------------------------------
+// Run through the keyspace. SCAN itself always goes through the same
+// connection, as its cursor is only meaningful there - with a pool, the
+// first one.
+//------------------------------------------------------------------------------
+ScanPipelineResult ScanPipeline::run(const Action& action)
+{
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  ScanPipelineResult result;
+
+  std::unique_ptr<BulkPipeline> pipeline(mPool ?
+    new BulkPipeline(mPool, mOptions.maxInFlight, BulkPipeline::kAnyReply) :
+    new BulkPipeline(mQcl, mOptions.maxInFlight, BulkPipeline::kAnyReply));
+
+  auto snapshot = [&](size_t scanRequests) {
+    result.scanRequests = scanRequests;
+    result.commands = pipeline->progress();
+    result.elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - start);
+  };
+
+  QClient& scanClient = mPool ? mPool->get(0) : *mQcl;
+  QScanner scanner(scanClient, mOptions.pattern, mOptions.scanCount);
+  std::vector<std::string> command;
+
+  for (; scanner.valid(); scanner.next()) {
+    command.clear();
+    result.keysScanned++;
+
+    if (action(scanner.getValue(), command) && !command.empty()) {
+      pipeline->push(EncodedRequest(command));
+    } else {
+      result.keysSkipped++;
+    }
+
+    if (mProgress && mOptions.progressInterval != 0 &&
+        result.keysScanned % mOptions.progressInterval == 0) {
+      snapshot(scanner.requestsSoFar());
+      mProgress(result);
+    }
+  }
+
+  pipeline->finish();
+  snapshot(scanner.requestsSoFar());
+
+  if (mProgress) {
+    mProgress(result);
+  }
+
+  return result;
+}
+
+//------------------------------------------------------------------------------
+// Action issuing the same command for every key
+//------------------------------------------------------------------------------
+ScanPipeline::Action ScanPipeline::perKey(const std::string& cmd,
+    const std::vector<std::string>& args)
+{
+  return [cmd, args](const std::string & key, std::vector<std::string>& command) {
+    command.reserve(args.size() + 2);
+    command.push_back(cmd);
+    command.push_back(key);
+    command.insert(command.end(), args.begin(), args.end());
+    return true;
+  };
+}
+
+QCLIENT_NAMESPACE_END
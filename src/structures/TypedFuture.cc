@@ -0,0 +1,166 @@
+//------------------------------------------------------------------------------
+// File: TypedFuture.cc
+// Author: Georgios Bitzes - CERN
+//------------------------------------------------------------------------------
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2020 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#include "qclient/structures/TypedFuture.hh"
+#include "qclient/ResponseParsing.hh"
+#include "qclient/SSTR.hh"
+#include <cerrno>
+#include <cstdlib>
+
+namespace qclient {
+namespace TypedReply {
+
+namespace {
+
+Status unexpected(const char *expecting, const redisReplyPtr &reply) {
+  if(!reply) {
+    return Status(EINVAL, "Received null redisReply");
+  }
+
+  return Status(EINVAL, SSTR("Unexpected reply type; was expecting " <<
+    expecting << ", received " << describeRedisReply(reply)));
+}
+
+//------------------------------------------------------------------------------
+// Walk a flat aggregate of strings, handing each element to f
+//------------------------------------------------------------------------------
+template<typename F>
+Status forEachString(const redisReplyPtr &reply, const F &f) {
+  if(!reply || (reply->type != REDIS_REPLY_ARRAY &&
+                reply->type != REDIS_REPLY_MAP &&
+                reply->type != REDIS_REPLY_SET)) {
+    return unexpected("ARRAY", reply);
+  }
+
+  for(size_t i = 0; i < reply->elements; i++) {
+    StringParser parser(reply->element[i]);
+    if(!parser.ok()) {
+      return Status(EINVAL, SSTR("Unexpected reply type for element #" << i <<
+        ": " << parser.err()));
+    }
+
+    f(std::move(parser).value());
+  }
+
+  return Status();
+}
+
+}
+
+//------------------------------------------------------------------------------
+// INTEGER reply
+//------------------------------------------------------------------------------
+Status toInteger(const redisReplyPtr &reply, long long &out) {
+  IntegerParser parser(reply);
+  if(!parser.ok()) {
+    return Status(EINVAL, parser.err());
+  }
+
+  out = parser.value();
+  return Status();
+}
+
+//------------------------------------------------------------------------------
+// INTEGER reply, true if equal to 1
+//------------------------------------------------------------------------------
+Status toBool(const redisReplyPtr &reply, bool &out) {
+  long long val = 0;
+  Status st = toInteger(reply, val);
+  out = (val == 1);
+  return st;
+}
+
+//------------------------------------------------------------------------------
+// STATUS reply, true if "OK"
+//------------------------------------------------------------------------------
+Status toOk(const redisReplyPtr &reply, bool &out) {
+  StatusParser parser(reply);
+  if(!parser.ok()) {
+    out = false;
+    return Status(EINVAL, parser.err());
+  }
+
+  out = (parser.value() == "OK");
+  return Status();
+}
+
+//------------------------------------------------------------------------------
+// STRING reply, nil gives an empty string
+//------------------------------------------------------------------------------
+Status toString(const redisReplyPtr &reply, std::string &out) {
+  if(reply && reply->type == REDIS_REPLY_NIL) {
+    out.clear();
+    return Status();
+  }
+
+  StringParser parser(reply);
+  if(!parser.ok()) {
+    return Status(EINVAL, parser.err());
+  }
+
+  out = parser.value();
+  return Status();
+}
+
+//------------------------------------------------------------------------------
+// STRING reply holding a floating point number
+//------------------------------------------------------------------------------
+Status toDouble(const redisReplyPtr &reply, double &out) {
+  std::string str;
+  Status st = toString(reply, str);
+  if(!st.ok()) {
+    return st;
+  }
+
+  char *end = nullptr;
+  out = strtod(str.c_str(), &end);
+  if(str.empty() || *end != '\0') {
+    return Status(EINVAL, SSTR("Could not parse \"" << str << "\" as a double"));
+  }
+
+  return Status();
+}
+
+//------------------------------------------------------------------------------
+// Flat aggregate reply made of strings
+//------------------------------------------------------------------------------
+Status toStringVector(const redisReplyPtr &reply, std::vector<std::string> &out) {
+  out.clear();
+  if(reply) {
+    out.reserve(reply->elements);
+  }
+
+  return forEachString(reply, [&out](std::string &&str) {
+    out.emplace_back(std::move(str));
+  });
+}
+
+Status toStringSet(const redisReplyPtr &reply, std::set<std::string> &out) {
+  out.clear();
+  return forEachString(reply, [&out](std::string &&str) {
+    out.emplace(std::move(str));
+  });
+}
+
+}
+}
@@ -0,0 +1,85 @@
+// ----------------------------------------------------------------------
+// File: allocation-budget.hh
+// Author: Georgios Bitzes - CERN
+// ----------------------------------------------------------------------
+
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2016 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#ifndef QCLIENT_BENCHMARKS_ALLOCATION_BUDGET_HH
+#define QCLIENT_BENCHMARKS_ALLOCATION_BUDGET_HH
+
+#include "qclient/utils/AllocationAccounting.hh"
+#include <benchmark/benchmark.h>
+
+namespace qclient {
+
+//------------------------------------------------------------------------------
+// Reports allocations per item as benchmark counters, and fails the benchmark
+// if they exceed the given budget - for a single category, or all of them
+// when given kCount. Build with ALLOCATION_ACCOUNTING for this to do
+// anything.
+//
+// Create right before the timed loop, call check once it's done.
+//------------------------------------------------------------------------------
+class AllocationBudget {
+public:
+  AllocationBudget(benchmark::State &st, double maxPerItem,
+    AllocationCategory cat = AllocationCategory::kCount)
+  : state(st), budget(maxPerItem), category(cat), start(read()) {}
+
+  void check(int64_t items) {
+    if(!AllocationAccounting::enabled() || items <= 0) {
+      return;
+    }
+
+    AllocationCount now = read();
+    double allocations = double(now.allocations - start.allocations) / items;
+    double bytes = double(now.bytes - start.bytes) / items;
+
+    state.counters["allocs_per_item"] = allocations;
+    state.counters["alloc_bytes_per_item"] = bytes;
+
+    if(allocations > budget) {
+      state.SkipWithError("allocation budget exceeded");
+    }
+  }
+
+private:
+  AllocationCount read() const {
+    if(category != AllocationCategory::kCount) {
+      return AllocationAccounting::get(category);
+    }
+
+    AllocationStatistics stats = AllocationAccounting::get();
+    AllocationCount total;
+    total.allocations = stats.totalAllocations();
+    total.bytes = stats.totalBytes();
+    return total;
+  }
+
+  benchmark::State &state;
+  double budget;
+  AllocationCategory category;
+  AllocationCount start;
+};
+
+}
+
+#endif
@@ -0,0 +1,111 @@
+// ----------------------------------------------------------------------
+// File: encoding.cc
+// Author: Georgios Bitzes - CERN
+// ----------------------------------------------------------------------
+
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2016 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#include "allocation-budget.hh"
+#include "qclient/EncodedRequest.hh"
+#include <benchmark/benchmark.h>
+#include <string>
+#include <vector>
+
+using namespace qclient;
+
+static void BM_EncodeShortCommand(benchmark::State &state) {
+  AllocationBudget budget(state, 0);
+
+  for(auto _ : state) {
+    EncodedRequest req = EncodedRequest::make("GET", "some-key");
+    benchmark::DoNotOptimize(req.getBuffer());
+  }
+
+  budget.check(state.iterations());
+}
+BENCHMARK(BM_EncodeShortCommand);
+
+static void BM_EncodeIntegerArguments(benchmark::State &state) {
+  int64_t value = 0;
+  AllocationBudget budget(state, 0);
+
+  for(auto _ : state) {
+    EncodedRequest req = EncodedRequest::make("LRANGE", "some-list", value++, -1);
+    benchmark::DoNotOptimize(req.getBuffer());
+  }
+
+  budget.check(state.iterations());
+}
+BENCHMARK(BM_EncodeIntegerArguments);
+
+//------------------------------------------------------------------------------
+// Single value of the given size: Small ones go inline, large ones are
+// copied into a heap buffer.
+//------------------------------------------------------------------------------
+static void BM_EncodeValue(benchmark::State &state) {
+  std::string value(state.range(0), 'x');
+  AllocationBudget budget(state, 1);
+
+  for(auto _ : state) {
+    EncodedRequest req = EncodedRequest::make("SET", "some-key", value);
+    benchmark::DoNotOptimize(req.getBuffer());
+  }
+
+  budget.check(state.iterations());
+
+  state.SetBytesProcessed(state.iterations() * value.size());
+}
+BENCHMARK(BM_EncodeValue)->Range(8, 1 << 20);
+
+static void BM_EncodeZeroCopy(benchmark::State &state) {
+  std::string value(state.range(0), 'x');
+
+  for(auto _ : state) {
+    std::vector<std::string> args = { "SET", "some-key", value };
+    EncodedRequest req = EncodedRequest::makeZeroCopy(std::move(args));
+    benchmark::DoNotOptimize(req.getLen());
+  }
+
+  state.SetBytesProcessed(state.iterations() * value.size());
+}
+BENCHMARK(BM_EncodeZeroCopy)->Range(16 * 1024, 1 << 20);
+
+//------------------------------------------------------------------------------
+// Many small arguments, such as a large HMSET.
+//------------------------------------------------------------------------------
+static void BM_EncodeManyArguments(benchmark::State &state) {
+  std::vector<std::string> args = { "HMSET", "some-hash" };
+  for(int64_t i = 0; i < state.range(0); i++) {
+    args.emplace_back("field-" + std::to_string(i));
+    args.emplace_back("value-" + std::to_string(i));
+  }
+
+  AllocationBudget budget(state, 1);
+
+  for(auto _ : state) {
+    EncodedRequest req(args);
+    benchmark::DoNotOptimize(req.getBuffer());
+  }
+
+  budget.check(state.iterations());
+
+  state.SetItemsProcessed(state.iterations() * args.size());
+}
+BENCHMARK(BM_EncodeManyArguments)->Range(8, 4096);
@@ -0,0 +1,57 @@
+// ----------------------------------------------------------------------
+// File: main.cc
+// Author: Georgios Bitzes - CERN
+// ----------------------------------------------------------------------
+
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2016 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#include <benchmark/benchmark.h>
+#include <cstring>
+#include <vector>
+
+//------------------------------------------------------------------------------
+// Same as BENCHMARK_MAIN, except results go to stdout as JSON unless another
+// format is asked for, so runs can be archived and compared across releases.
+//------------------------------------------------------------------------------
+int main(int argc, char** argv) {
+  std::vector<char*> args(argv, argv + argc);
+
+  bool formatGiven = false;
+  for(int i = 1; i < argc; i++) {
+    if(strncmp(argv[i], "--benchmark_format", strlen("--benchmark_format")) == 0) {
+      formatGiven = true;
+    }
+  }
+
+  char jsonFormat[] = "--benchmark_format=json";
+  if(!formatGiven) {
+    args.push_back(jsonFormat);
+  }
+
+  int count = args.size();
+  benchmark::Initialize(&count, args.data());
+  if(benchmark::ReportUnrecognizedArguments(count, args.data())) {
+    return 1;
+  }
+
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+  return 0;
+}
@@ -0,0 +1,78 @@
+// ----------------------------------------------------------------------
+// File: pubsub.cc
+// Author: Georgios Bitzes - CERN
+// ----------------------------------------------------------------------
+
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2016 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#include "allocation-budget.hh"
+#include "pubsub/MessageParser.hh"
+#include "qclient/ResponseBuilder.hh"
+#include "qclient/pubsub/Message.hh"
+#include <benchmark/benchmark.h>
+#include <string>
+#include <vector>
+
+using namespace qclient;
+
+//------------------------------------------------------------------------------
+// Parsing consumes the reply, so every iteration needs a fresh one - build
+// them outside of the timed region, in batches.
+//------------------------------------------------------------------------------
+static void runParser(benchmark::State &state, const std::vector<std::string> &parts, bool push) {
+  const size_t kBatch = 1024;
+  std::vector<redisReplyPtr> replies;
+
+  // A single allocation per message, shared by all copies - building the
+  // replies themselves is only accounted for under parsing.
+  AllocationBudget budget(state, 1, AllocationCategory::kPubsub);
+
+  while(state.KeepRunningBatch(kBatch)) {
+    state.PauseTiming();
+    replies.clear();
+    for(size_t i = 0; i < kBatch; i++) {
+      replies.emplace_back(push ? ResponseBuilder::makePushArray(parts) : ResponseBuilder::makeStringArray(parts));
+    }
+    state.ResumeTiming();
+
+    for(size_t i = 0; i < kBatch; i++) {
+      Message msg;
+      if(!MessageParser::parse(std::move(replies[i]), msg)) {
+        state.SkipWithError("parse failure");
+        return;
+      }
+
+      benchmark::DoNotOptimize(msg);
+    }
+  }
+
+  state.SetItemsProcessed(state.iterations());
+  budget.check(state.iterations());
+}
+
+static void BM_MessageParserMessage(benchmark::State &state) {
+  runParser(state, { "message", "some-channel", std::string(state.range(0), 'x') }, false);
+}
+BENCHMARK(BM_MessageParserMessage)->Range(8, 4096);
+
+static void BM_MessageParserPatternMessagePush(benchmark::State &state) {
+  runParser(state, { "pubsub", "pmessage", "some-*", "some-channel", std::string(state.range(0), 'x') }, true);
+}
+BENCHMARK(BM_MessageParserPatternMessagePush)->Range(8, 4096);
@@ -0,0 +1,93 @@
+// ----------------------------------------------------------------------
+// File: queueing.cc
+// Author: Georgios Bitzes - CERN
+// ----------------------------------------------------------------------
+
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2016 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#include "allocation-budget.hh"
+#include "qclient/queueing/ThreadSafeQueue.hh"
+#include "qclient/queueing/WaitableQueue.hh"
+#include <benchmark/benchmark.h>
+#include <thread>
+#include <vector>
+
+using namespace qclient;
+
+//------------------------------------------------------------------------------
+// The given number of producers push items as fast as they can, while the
+// benchmark thread consumes them.
+//------------------------------------------------------------------------------
+static constexpr int64_t kItemsPerProducer = 100000;
+
+template<typename Queue, typename Consume>
+static void runProducers(benchmark::State &state, Queue &queue, Consume consume) {
+  int64_t producers = state.range(0);
+
+  // Blocks are recycled once the queue reaches its steady size
+  AllocationBudget budget(state, 0.01, AllocationCategory::kQueueing);
+
+  for(auto _ : state) {
+    std::vector<std::thread> threads;
+    for(int64_t p = 0; p < producers; p++) {
+      threads.emplace_back([&queue]() {
+        for(int64_t i = 0; i < kItemsPerProducer; i++) {
+          queue.emplace_back(i);
+        }
+      });
+    }
+
+    consume(producers * kItemsPerProducer);
+
+    for(std::thread &thread : threads) {
+      thread.join();
+    }
+  }
+
+  state.SetItemsProcessed(state.iterations() * producers * kItemsPerProducer);
+  budget.check(state.iterations() * producers * kItemsPerProducer);
+}
+
+static void BM_ThreadSafeQueueProducers(benchmark::State &state) {
+  ThreadSafeQueue<int64_t, 1024> queue;
+  std::vector<int64_t> batch;
+
+  runProducers(state, queue, [&](int64_t total) {
+    while(total > 0) {
+      batch.clear();
+      total -= queue.popBatch(batch, 256);
+    }
+  });
+}
+BENCHMARK(BM_ThreadSafeQueueProducers)->RangeMultiplier(2)->Range(1, 8)->UseRealTime();
+
+static void BM_WaitableQueueProducers(benchmark::State &state) {
+  WaitableQueue<int64_t, 1024> queue;
+  auto it = queue.begin();
+
+  runProducers(state, queue, [&](int64_t total) {
+    for(int64_t i = 0; i < total; i++) {
+      benchmark::DoNotOptimize(it.getItemBlockOrNull());
+      it.next();
+      queue.pop_front();
+    }
+  });
+}
+BENCHMARK(BM_WaitableQueueProducers)->RangeMultiplier(2)->Range(1, 8)->UseRealTime();
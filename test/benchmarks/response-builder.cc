@@ -0,0 +1,133 @@
+// ----------------------------------------------------------------------
+// File: response-builder.cc
+// Author: Georgios Bitzes - CERN
+// ----------------------------------------------------------------------
+
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2016 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#include "allocation-budget.hh"
+#include "qclient/ResponseBuilder.hh"
+#include <benchmark/benchmark.h>
+#include <string>
+
+using namespace qclient;
+
+//------------------------------------------------------------------------------
+// A stream of replies resembling real traffic: Mostly statuses and integers,
+// some short bulk strings, the odd array and nil.
+//------------------------------------------------------------------------------
+static std::string makeReplyMix(size_t count) {
+  std::string stream;
+
+  for(size_t i = 0; i < count; i++) {
+    switch(i % 8) {
+      case 0:
+      case 1: {
+        stream += "+OK\r\n";
+        break;
+      }
+      case 2:
+      case 3: {
+        stream += ":" + std::to_string(i) + "\r\n";
+        break;
+      }
+      case 4:
+      case 5: {
+        std::string value = "value-" + std::to_string(i);
+        stream += "$" + std::to_string(value.size()) + "\r\n" + value + "\r\n";
+        break;
+      }
+      case 6: {
+        stream += "*3\r\n$5\r\nfield\r\n:42\r\n$5\r\nvalue\r\n";
+        break;
+      }
+      case 7: {
+        stream += "$-1\r\n";
+        break;
+      }
+    }
+  }
+
+  return stream;
+}
+
+//------------------------------------------------------------------------------
+// Feed the stream in chunks of the given size, pulling every complete reply
+// after each.
+//------------------------------------------------------------------------------
+static void BM_ResponseBuilderMix(benchmark::State &state) {
+  const size_t kReplies = 1024;
+  std::string stream = makeReplyMix(kReplies);
+  size_t chunk = state.range(0);
+
+  ResponseBuilder builder;
+  builder.setArenaMode(state.range(1) != 0);
+  AllocationBudget budget(state, state.range(1) != 0 ? 1.25 : 2, AllocationCategory::kParsing);
+
+  for(auto _ : state) {
+    size_t pulled = 0;
+
+    for(size_t pos = 0; pos < stream.size(); pos += chunk) {
+      builder.feed(stream.data() + pos, std::min(chunk, stream.size() - pos));
+
+      redisReplyPtr reply;
+      while(builder.pull(reply) == ResponseBuilder::Status::kOk) {
+        pulled++;
+      }
+    }
+
+    if(pulled != kReplies) {
+      state.SkipWithError("lost replies");
+      break;
+    }
+  }
+
+  state.SetItemsProcessed(state.iterations() * kReplies);
+  state.SetBytesProcessed(state.iterations() * stream.size());
+  budget.check(state.iterations() * kReplies);
+}
+BENCHMARK(BM_ResponseBuilderMix)
+  ->ArgNames({"chunk", "arena"})
+  ->ArgsProduct({{64, 1024, 16 * 1024}, {0, 1}});
+
+//------------------------------------------------------------------------------
+// Large bulk strings, as in GET on big values.
+//------------------------------------------------------------------------------
+static void BM_ResponseBuilderLargeBulk(benchmark::State &state) {
+  std::string value(state.range(0), 'x');
+  std::string stream = "$" + std::to_string(value.size()) + "\r\n" + value + "\r\n";
+
+  ResponseBuilder builder;
+
+  for(auto _ : state) {
+    builder.feed(stream);
+
+    redisReplyPtr reply;
+    if(builder.pull(reply) != ResponseBuilder::Status::kOk) {
+      state.SkipWithError("bad reply");
+      break;
+    }
+
+    benchmark::DoNotOptimize(reply.get());
+  }
+
+  state.SetBytesProcessed(state.iterations() * stream.size());
+}
+BENCHMARK(BM_ResponseBuilderLargeBulk)->Range(1024, 4 << 20);
@@ -0,0 +1,121 @@
+// ----------------------------------------------------------------------
+// File: serialization.cc
+// Author: Georgios Bitzes - CERN
+// ----------------------------------------------------------------------
+
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2016 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#include "shared/BinarySerializer.hh"
+#include "shared/SharedSerialization.hh"
+#include <benchmark/benchmark.h>
+#include <map>
+#include <string>
+
+using namespace qclient;
+
+static void BM_BinarySerializer(benchmark::State &state) {
+  std::string str(state.range(0), 'x');
+  size_t size = 8 * 3 + BinarySerializer::getVarintSize(str.size()) + str.size() + 8 + str.size();
+
+  for(auto _ : state) {
+    std::string target;
+    BinarySerializer serializer(target, size);
+    serializer.appendInt64(1);
+    serializer.appendInt64(2);
+    serializer.appendInt64(3);
+    serializer.appendVarint(str.size());
+    serializer.appendBytes(str.data(), str.size());
+    serializer.appendString(str);
+    benchmark::DoNotOptimize(target.data());
+  }
+}
+BENCHMARK(BM_BinarySerializer)->Range(8, 4096);
+
+static void BM_BinaryDeserializer(benchmark::State &state) {
+  std::string str(state.range(0), 'x');
+  std::string source;
+  BinarySerializer serializer(source, 8 * 3 + 8 + str.size());
+  serializer.appendInt64(1);
+  serializer.appendInt64(2);
+  serializer.appendInt64(3);
+  serializer.appendString(str);
+
+  for(auto _ : state) {
+    BinaryDeserializer deserializer(source);
+    int64_t num;
+    const char *data;
+    size_t len;
+
+    deserializer.consumeInt64(num);
+    deserializer.consumeInt64(num);
+    deserializer.consumeInt64(num);
+    deserializer.consumeStringView(data, len);
+    benchmark::DoNotOptimize(data);
+  }
+}
+BENCHMARK(BM_BinaryDeserializer)->Range(8, 4096);
+
+//------------------------------------------------------------------------------
+// Batches of shared hash updates - keys share long prefixes, as is typical.
+//------------------------------------------------------------------------------
+static std::map<std::string, std::string> makeBatch(size_t count) {
+  std::map<std::string, std::string> batch;
+  for(size_t i = 0; i < count; i++) {
+    batch["stat.filesystem." + std::to_string(i) + ".usedbytes"] = std::to_string(i * 4096);
+  }
+
+  return batch;
+}
+
+static void BM_SerializeBatch(benchmark::State &state) {
+  std::map<std::string, std::string> batch = makeBatch(state.range(0));
+  BatchEncoding encoding = state.range(1) ? BatchEncoding::kCompact : BatchEncoding::kLegacy;
+
+  for(auto _ : state) {
+    std::string payload = serializeBatch(batch, encoding);
+    benchmark::DoNotOptimize(payload.data());
+  }
+
+  state.SetItemsProcessed(state.iterations() * batch.size());
+}
+BENCHMARK(BM_SerializeBatch)
+  ->ArgNames({"pairs", "compact"})
+  ->ArgsProduct({{1, 16, 256}, {0, 1}});
+
+static void BM_ParseBatch(benchmark::State &state) {
+  std::map<std::string, std::string> batch = makeBatch(state.range(0));
+  BatchEncoding encoding = state.range(1) ? BatchEncoding::kCompact : BatchEncoding::kLegacy;
+  std::string payload = serializeBatch(batch, encoding);
+
+  for(auto _ : state) {
+    std::map<std::string, std::string> out;
+    if(!parseBatch(payload, out)) {
+      state.SkipWithError("parse failure");
+      break;
+    }
+
+    benchmark::DoNotOptimize(out.size());
+  }
+
+  state.SetItemsProcessed(state.iterations() * batch.size());
+}
+BENCHMARK(BM_ParseBatch)
+  ->ArgNames({"pairs", "compact"})
+  ->ArgsProduct({{1, 16, 256}, {0, 1}});
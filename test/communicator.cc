@@ -28,6 +28,7 @@
 #include "qclient/pubsub/Message.hh"
 #include "qclient/utils/SteadyClock.hh"
 #include "shared/SharedSerialization.hh"
+#include "shared/CommunicatorBatcher.hh"
 #include "qclient/SSTR.hh"
 #include <gtest/gtest.h>
 
@@ -45,6 +46,45 @@ TEST(CommunicatorRequest, Serialization) {
   ASSERT_TRUE(parseCommunicatorRequest(payload, parsedUuid, parsedContents));
 }
 
+TEST(CommunicatorBatch, Serialization) {
+  CommunicatorReply reply;
+  reply.status = 3;
+  reply.contents = "zxcv";
+
+  std::vector<std::string> messages;
+  messages.emplace_back(serializeCommunicatorRequest("qwerty", "uiop"));
+  messages.emplace_back(serializeCommunicatorReply("asdf", reply));
+
+  std::string payload = serializeCommunicatorBatch(messages);
+
+  std::vector<std::string> parsed;
+  ASSERT_TRUE(parseCommunicatorBatch(payload, parsed));
+  ASSERT_EQ(parsed, messages);
+
+  std::string uuid, contents;
+  ASSERT_FALSE(parseCommunicatorRequest(payload, uuid, contents));
+  ASSERT_FALSE(parseCommunicatorBatch(messages[0], parsed));
+  ASSERT_FALSE(parseCommunicatorBatch(payload.substr(0, payload.size() - 1), parsed));
+  ASSERT_EQ(parsed.size(), 2u);
+}
+
+TEST(CommunicatorBatcher, FlushOnSize) {
+  CommunicatorBatcher batcher(nullptr, "abc", 10, std::chrono::seconds(1000));
+  ASSERT_EQ(batcher.pending(), 0u);
+
+  batcher.push("1234");
+  batcher.push("5678");
+  ASSERT_EQ(batcher.pending(), 2u);
+
+  batcher.push("90");
+  ASSERT_EQ(batcher.pending(), 0u);
+
+  batcher.push("1234");
+  ASSERT_EQ(batcher.pending(), 1u);
+  batcher.flush();
+  ASSERT_EQ(batcher.pending(), 0u);
+}
+
 TEST(Communicator, IssueWithReply) {
   Subscriber subscriber;
   Communicator communicator(&subscriber, "abc");
@@ -66,6 +106,39 @@ TEST(Communicator, IssueWithReply) {
   ASSERT_EQ(rep.contents, "AAAA");
 }
 
+TEST(Communicator, BatchedReplies) {
+  Subscriber subscriber;
+  Communicator communicator(&subscriber, "abc");
+  communicator.enableBatching(1024 * 1024, std::chrono::milliseconds(1));
+
+  std::string reqid1, reqid2;
+  std::future<CommunicatorReply> fut1 = communicator.issue("1234", reqid1);
+  std::future<CommunicatorReply> fut2 = communicator.issue("5678", reqid2);
+
+  CommunicatorReply reply1;
+  reply1.status = 1;
+  reply1.contents = "AAAA";
+
+  CommunicatorReply reply2;
+  reply2.status = 2;
+  reply2.contents = "BBBB";
+
+  std::vector<std::string> messages;
+  messages.emplace_back(serializeCommunicatorReply(reqid2, reply2));
+  messages.emplace_back(serializeCommunicatorReply(reqid1, reply1));
+
+  Message msg = Message::createMessage("abc", serializeCommunicatorBatch(messages));
+  subscriber.feedFakeMessage(msg);
+
+  CommunicatorReply rep = fut1.get();
+  ASSERT_EQ(rep.status, 1);
+  ASSERT_EQ(rep.contents, "AAAA");
+
+  rep = fut2.get();
+  ASSERT_EQ(rep.status, 2);
+  ASSERT_EQ(rep.contents, "BBBB");
+}
+
 TEST(Communicator, WithRetries) {
   Subscriber subscriber;
   SteadyClock steadyClock(true);
@@ -201,6 +274,37 @@ TEST(PendingRequestVault, SingleItemRetry) {
   ASSERT_TRUE(requestVault.satisfy(id, std::move(reply)));
 }
 
+TEST(PendingRequestVault, RetryDueItems) {
+  PendingRequestVault requestVault;
+  std::chrono::steady_clock::time_point start;
+
+  PendingRequestVault::InsertOutcome outcome1 = requestVault.insert("ch1", "123", start+std::chrono::seconds(1));
+  requestVault.insert("ch1", "1234", start+std::chrono::seconds(2));
+  requestVault.insert("ch2", "12345", start+std::chrono::seconds(3));
+
+  std::vector<PendingRequestVault::RetryItem> batch;
+  ASSERT_EQ(requestVault.retryDueItems(start+std::chrono::seconds(10), std::chrono::seconds(10), 10, batch), 0u);
+  ASSERT_EQ(requestVault.retryDueItems(start+std::chrono::seconds(12), std::chrono::seconds(10), 10, batch), 2u);
+  ASSERT_EQ(batch.size(), 2u);
+  ASSERT_EQ(batch[0].id, outcome1.id);
+  ASSERT_EQ(batch[0].contents, "123");
+  ASSERT_EQ(batch[1].contents, "1234");
+
+  batch.clear();
+  ASSERT_EQ(requestVault.retryDueItems(start+std::chrono::seconds(100), std::chrono::seconds(0), 10, batch), 3u);
+  ASSERT_EQ(batch[0].channel, "ch2");
+  ASSERT_EQ(batch[0].contents, "12345");
+
+  // IDs not issued by this vault are never satisfied
+  PendingRequestVault otherVault;
+  PendingRequestVault::InsertOutcome outcome2 = otherVault.insert("ch1", "123", start);
+  ASSERT_NE(outcome1.id, outcome2.id);
+  ASSERT_FALSE(requestVault.satisfy(outcome2.id, CommunicatorReply()));
+  ASSERT_FALSE(requestVault.satisfy(outcome1.id + "0", CommunicatorReply()));
+  ASSERT_TRUE(requestVault.satisfy(outcome1.id, CommunicatorReply()));
+  ASSERT_EQ(requestVault.size(), 2u);
+}
+
 TEST(CommunicatorListener, BasicSanity) {
   Subscriber subscriber;
   CommunicatorListener communicator(&subscriber, "abc");
@@ -219,3 +323,25 @@ TEST(CommunicatorListener, BasicSanity) {
   subscriber.feedFakeMessage(msg);
   ASSERT_EQ(communicator.size(), 0u);
 }
+
+TEST(CommunicatorListener, BatchedRequests) {
+  Subscriber subscriber;
+  CommunicatorListener communicator(&subscriber, "abc");
+
+  std::vector<std::string> messages;
+  messages.emplace_back(serializeCommunicatorRequest("1-2-3-4", "qqq"));
+  messages.emplace_back(serializeCommunicatorRequest("5-6-7-8", "www"));
+  messages.emplace_back(serializeCommunicatorRequest("1-2-3-4", "qqq"));
+
+  Message msg = Message::createMessage("abc", serializeCommunicatorBatch(messages));
+  subscriber.feedFakeMessage(msg);
+  ASSERT_EQ(communicator.size(), 2u);
+
+  ASSERT_EQ(communicator.front().getID(), "1-2-3-4");
+  ASSERT_EQ(communicator.front().getContents(), "qqq");
+  communicator.pop_front();
+
+  ASSERT_EQ(communicator.front().getID(), "5-6-7-8");
+  ASSERT_EQ(communicator.front().getContents(), "www");
+  communicator.pop_front();
+}
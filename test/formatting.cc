@@ -25,6 +25,7 @@
 #include "qclient/QClient.hh"
 #include "qclient/Formatting.hh"
 #include "qclient/ResponseBuilder.hh"
+#include "qclient/ValueCompression.hh"
 #include "shared/SharedSerialization.hh"
 
 using namespace qclient;
@@ -132,6 +133,50 @@ TEST(Formatting, SerializeStringMap) {
   );
 }
 
+TEST(Formatting, SerializeNested) {
+  std::vector<std::map<std::string, std::string>> vec(2);
+  vec[0]["a"] = "b";
+
+  std::string out = "prefix";
+  Formatting::serializeInto(out, vec);
+  ASSERT_EQ(out,
+    "prefix"
+    "*2\r\n"
+    "*2\r\n$1\r\na\r\n$1\r\nb\r\n"
+    "*0\r\n"
+  );
+
+  ASSERT_EQ(Formatting::serializeVector(std::string("x"), -17, std::vector<int64_t>{1}),
+    "*3\r\n"
+    "$1\r\nx\r\n"
+    ":-17\r\n"
+    "*1\r\n:1\r\n"
+  );
+
+  ASSERT_EQ(Formatting::serializeVector(), "*0\r\n");
+}
+
+TEST(Formatting, MakeRequest) {
+  std::map<std::string, std::string> map;
+  map["k"] = "v";
+
+  EncodedRequest req = Formatting::makeRequest({"PUBLISH", "channel"}, map);
+  ASSERT_EQ(req, EncodedRequest::make("PUBLISH", "channel", Formatting::serialize(map)));
+
+  req = Formatting::makeRequest({}, (int64_t) 5);
+  ASSERT_EQ(req, EncodedRequest::make(":5\r\n"));
+}
+
+TEST(DescribeRedisReply, Map) {
+  ASSERT_EQ(qclient::describeRedisReply("%2\r\n$1\r\na\r\n:1\r\n$1\r\nb\r\n*2\r\n$1\r\nc\r\n$1\r\nd\r\n"),
+    "1# \"a\" => (integer) 1\n"
+    "2# \"b\" => 1) \"c\"\n"
+    "2) \"d\"\n");
+
+  ASSERT_EQ(qclient::describeRedisReply("%0\r\n"), "(empty hash)\n");
+  ASSERT_EQ(qclient::describeRedisReply("-ERR bad\r\n"), "(error) ERR bad");
+}
+
 TEST(Formatting, DescribeEncodedString) {
   ASSERT_EQ(
     "(integer) 5",
@@ -154,3 +199,146 @@ TEST(SharedSerialization, BatchUpdate) {
   ASSERT_TRUE(qclient::parseBatch(qclient::serializeBatch(batch), parsed));
   ASSERT_EQ(batch, parsed);
 }
+
+TEST(SharedSerialization, CompactBatchUpdate) {
+  std::map<std::string, std::string> batch;
+  batch["a"] = "bb";
+  batch["ccc"] = "dddd";
+  batch["ccc-1"] = "";
+  batch["ccc-2"] = std::string(300, 'x');
+  batch[""] = "empty";
+  batch[std::string("\x00\x01", 2)] = std::string("\x00", 1);
+
+  std::string compact = qclient::serializeBatch(batch, qclient::BatchEncoding::kCompact);
+  std::string legacy = qclient::serializeBatch(batch);
+  ASSERT_LT(compact.size(), legacy.size());
+
+  std::map<std::string, std::string> parsed;
+  ASSERT_TRUE(qclient::parseBatch(compact, parsed));
+  ASSERT_EQ(batch, parsed);
+
+  ASSERT_TRUE(qclient::parseBatch(legacy, parsed));
+  ASSERT_EQ(batch, parsed);
+
+  // version, 1 pair, no shared prefix, key "ab", value "c"
+  ASSERT_EQ(qclient::serializeBatch({{"ab", "c"}}, qclient::BatchEncoding::kCompact),
+    std::string("\x01\x01\x00\x02" "ab" "\x01" "c", 8));
+
+  // Empty batch
+  ASSERT_TRUE(qclient::parseBatch(qclient::serializeBatch({}, qclient::BatchEncoding::kCompact), parsed));
+  ASSERT_TRUE(parsed.empty());
+
+  // Truncated, trailing garbage, or a prefix longer than the previous key
+  for(size_t i = 0; i < compact.size(); i++) {
+    ASSERT_FALSE(qclient::parseBatch(compact.substr(0, i), parsed));
+  }
+
+  ASSERT_FALSE(qclient::parseBatch(compact + "z", parsed));
+  ASSERT_FALSE(qclient::parseBatch(std::string("\x01\x01\x01\x00\x00", 5), parsed));
+}
+
+TEST(SharedSerialization, VisitBatch) {
+  std::map<std::string, std::string> batch;
+  batch["key-1"] = "a";
+  batch["key-2"] = "";
+  batch["other"] = "bbb";
+
+  for(qclient::BatchEncoding encoding : {qclient::BatchEncoding::kLegacy, qclient::BatchEncoding::kCompact}) {
+    std::string payload = qclient::serializeBatch(batch, encoding);
+
+    std::vector<std::pair<std::string, std::string>> visited;
+    ASSERT_TRUE(qclient::visitBatch(payload, [&](const char *key, size_t keyLen, const char *value, size_t valueLen) {
+      visited.emplace_back(std::string(key, keyLen), std::string(value, valueLen));
+    }));
+
+    std::vector<std::pair<std::string, std::string>> expected(batch.begin(), batch.end());
+    ASSERT_EQ(visited, expected);
+
+    // A corrupted batch is rejected as a whole, without visiting anything
+    visited.clear();
+    ASSERT_FALSE(qclient::visitBatch(payload.substr(0, payload.size() - 1), [&](const char *key, size_t keyLen, const char *value, size_t valueLen) {
+      visited.emplace_back(std::string(key, keyLen), std::string(value, valueLen));
+    }));
+
+    ASSERT_TRUE(visited.empty());
+  }
+}
+
+TEST(ValueCompression, BasicSanity) {
+  qclient::ValueCompression disabled = qclient::ValueCompression::Disabled();
+  ASSERT_FALSE(disabled.active());
+  ASSERT_EQ(disabled.encode(std::string(5000, 'a')), std::string(5000, 'a'));
+
+  for(qclient::CompressionAlgorithm algorithm : {qclient::CompressionAlgorithm::kZlib,
+    qclient::CompressionAlgorithm::kLz4, qclient::CompressionAlgorithm::kZstd}) {
+
+    if(!qclient::ValueCompression::supported(algorithm)) continue;
+
+    qclient::ValueCompression compression = qclient::ValueCompression::Enabled(algorithm, 64);
+    ASSERT_TRUE(compression.active());
+
+    // Below the threshold, or incompressible: Stored as-is
+    ASSERT_EQ(compression.encode("small"), "small");
+    std::string noise;
+    for(size_t i = 0; i < 100; i++) noise.push_back((char) ((i * 7919 + 13) % 251));
+    ASSERT_EQ(compression.encode(noise.substr(0, 20)), noise.substr(0, 20));
+
+    std::string large;
+    for(size_t i = 0; i < 1000; i++) large += "value-" + std::to_string(i % 10);
+
+    std::string encoded = compression.encode(large);
+    ASSERT_TRUE(qclient::ValueCompression::isEncoded(encoded));
+    ASSERT_LT(encoded.size(), large.size() / 4);
+
+    std::string decoded;
+    ASSERT_TRUE(qclient::ValueCompression::decode(encoded.data(), encoded.size(), decoded));
+    ASSERT_EQ(decoded, large);
+
+    // Truncated or corrupted
+    ASSERT_FALSE(qclient::ValueCompression::decode(encoded.data(), encoded.size() - 1, decoded));
+    ASSERT_FALSE(qclient::ValueCompression::decode(encoded.data(), 6, decoded));
+
+    std::string lying = encoded;
+    lying[11]++;
+    ASSERT_FALSE(qclient::ValueCompression::decode(lying.data(), lying.size(), decoded));
+
+    // Small values which happen to start with the magic get escaped
+    std::string tricky("\xC5QZ!", 4);
+    encoded = compression.encode(tricky);
+    ASSERT_EQ(encoded.size(), qclient::ValueCompression::kHeaderSize + tricky.size());
+    ASSERT_TRUE(qclient::ValueCompression::decodeInPlace(encoded));
+    ASSERT_EQ(encoded, tricky);
+  }
+
+  // Anything without the magic passes through
+  std::string plain = "plain";
+  ASSERT_TRUE(qclient::ValueCompression::decodeInPlace(plain));
+  ASSERT_EQ(plain, "plain");
+
+  // Unknown algorithm
+  std::string unknown("\xC5QZ\x09\x00\x00\x00\x00\x00\x00\x00\x01" "a", 13);
+  ASSERT_FALSE(qclient::ValueCompression::decodeInPlace(unknown));
+}
+
+TEST(SharedSerialization, CompressedBatch) {
+  if(!qclient::ValueCompression::supported(qclient::CompressionAlgorithm::kZlib)) return;
+
+  std::map<std::string, std::string> batch;
+  for(size_t i = 0; i < 100; i++) {
+    batch["key-" + std::to_string(i)] = std::string(100, 'a' + (i % 26));
+  }
+
+  qclient::ValueCompression compression = qclient::ValueCompression::Enabled(qclient::CompressionAlgorithm::kZlib);
+
+  for(qclient::BatchEncoding encoding : {qclient::BatchEncoding::kLegacy, qclient::BatchEncoding::kCompact}) {
+    std::string plain = qclient::serializeBatch(batch, encoding);
+    std::string payload = compression.encode(plain);
+    ASSERT_LT(payload.size(), plain.size());
+
+    std::map<std::string, std::string> parsed;
+    ASSERT_TRUE(qclient::parseBatch(payload, parsed));
+    ASSERT_EQ(batch, parsed);
+
+    ASSERT_FALSE(qclient::parseBatch(payload.substr(0, payload.size() - 1), parsed));
+  }
+}
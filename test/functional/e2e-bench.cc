@@ -0,0 +1,262 @@
+// ----------------------------------------------------------------------
+// File: e2e-bench.cc
+// Author: Georgios Bitzes - CERN
+// ----------------------------------------------------------------------
+
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2016 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+//------------------------------------------------------------------------------
+// End-to-end pipelined throughput of QClient against MockServer, without any
+// external server. Usage:
+//
+//   qclient-e2e-bench [--producers=4] [--requests=100000] [--window=1024]
+//     [--mode=future|callback|folly] [--latency-us=0] [--reply-size=0]
+//     [--moved-every=0] [--unavailable-every=0]
+//
+// Each producer thread issues --requests requests, keeping at most --window
+// of them in flight. Results are printed as a single JSON object.
+//------------------------------------------------------------------------------
+
+#include "mock-server.hh"
+#include "qclient/QClient.hh"
+#include "qclient/Semaphore.hh"
+#include <sys/resource.h>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <thread>
+
+using namespace qclient;
+
+struct BenchConfig {
+  int64_t producers = 4;
+  int64_t requests = 100000;
+  int64_t window = 1024;
+  std::string mode = "future";
+  MockServerConfig server;
+};
+
+static bool parseArgs(int argc, char **argv, BenchConfig &config) {
+  std::map<std::string, std::string> args;
+
+  for(int i = 1; i < argc; i++) {
+    std::string arg(argv[i]);
+    size_t eq = arg.find('=');
+    if(arg.compare(0, 2, "--") != 0 || eq == std::string::npos) {
+      std::cerr << "Unable to parse argument: " << arg << std::endl;
+      return false;
+    }
+
+    args[arg.substr(2, eq - 2)] = arg.substr(eq + 1);
+  }
+
+  try {
+    for(auto it = args.begin(); it != args.end(); it++) {
+      if(it->first == "producers") config.producers = std::stoll(it->second);
+      else if(it->first == "requests") config.requests = std::stoll(it->second);
+      else if(it->first == "window") config.window = std::stoll(it->second);
+      else if(it->first == "mode") config.mode = it->second;
+      else if(it->first == "latency-us") config.server.latency = std::chrono::microseconds(std::stoll(it->second));
+      else if(it->first == "reply-size") config.server.replySize = std::stoull(it->second);
+      else if(it->first == "moved-every") config.server.movedEvery = std::stoull(it->second);
+      else if(it->first == "unavailable-every") config.server.unavailableEvery = std::stoull(it->second);
+      else {
+        std::cerr << "Unknown option: --" << it->first << std::endl;
+        return false;
+      }
+    }
+  }
+  catch(const std::exception &exc) {
+    std::cerr << "Invalid numeric argument: " << exc.what() << std::endl;
+    return false;
+  }
+
+  if(config.mode != "future" && config.mode != "callback" && config.mode != "folly") {
+    std::cerr << "Unknown mode: " << config.mode << std::endl;
+    return false;
+  }
+
+#if HAVE_FOLLY == 0
+  if(config.mode == "folly") {
+    std::cerr << "qclient was built without folly support" << std::endl;
+    return false;
+  }
+#endif
+
+  return config.producers > 0 && config.requests > 0 && config.window > 0;
+}
+
+static std::chrono::nanoseconds processCpuTime() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+
+  return std::chrono::seconds(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) +
+    std::chrono::microseconds(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec);
+}
+
+//------------------------------------------------------------------------------
+// Futures are waited upon oldest first - replies arrive in order, so the
+// time a future becomes ready is observed promptly.
+//------------------------------------------------------------------------------
+template<typename Future, typename Issue>
+static void produceWithFutures(const BenchConfig &config, LatencyHistogram &latency, Issue issue) {
+  using Clock = std::chrono::steady_clock;
+  std::deque<std::pair<Clock::time_point, Future>> inflight;
+
+  auto retire = [&]() {
+    redisReplyPtr reply = std::move(inflight.front().second).get();
+    if(!reply) {
+      std::cerr << "Request failed" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+
+    latency.record(Clock::now() - inflight.front().first);
+    inflight.pop_front();
+  };
+
+  for(int64_t i = 0; i < config.requests; i++) {
+    if((int64_t) inflight.size() >= config.window) {
+      retire();
+    }
+
+    Clock::time_point start = Clock::now();
+    inflight.emplace_back(start, issue());
+  }
+
+  while(!inflight.empty()) {
+    retire();
+  }
+}
+
+static void produceWithCallbacks(const BenchConfig &config, QClient &cl, LatencyHistogram &latency) {
+  using Clock = std::chrono::steady_clock;
+  Semaphore window(config.window);
+
+  for(int64_t i = 0; i < config.requests; i++) {
+    window.down();
+
+    Clock::time_point start = Clock::now();
+    cl.execute(EncodedRequest::make("GET", "key"), [&window, &latency, start](redisReplyPtr &&reply) {
+      if(!reply) {
+        std::cerr << "Request failed" << std::endl;
+        exit(EXIT_FAILURE);
+      }
+
+      latency.record(Clock::now() - start);
+      window.up();
+    });
+  }
+
+  window.down(config.window);
+}
+
+static void produce(const BenchConfig &config, QClient &cl, LatencyHistogram &latency) {
+  if(config.mode == "callback") {
+    produceWithCallbacks(config, cl, latency);
+  }
+  else if(config.mode == "future") {
+    produceWithFutures<std::future<redisReplyPtr>>(config, latency, [&cl]() {
+      return cl.execute(EncodedRequest::make("GET", "key"));
+    });
+  }
+#if HAVE_FOLLY == 1
+  else if(config.mode == "folly") {
+    produceWithFutures<folly::Future<redisReplyPtr>>(config, latency, [&cl]() {
+      return cl.follyExecute(EncodedRequest::make("GET", "key"));
+    });
+  }
+#endif
+}
+
+static std::string describe(const LatencySnapshot &snapshot) {
+  std::ostringstream ss;
+  ss << "{\"count\": " << snapshot.count
+     << ", \"mean_ns\": " << (uint64_t) snapshot.mean()
+     << ", \"p50_ns\": " << snapshot.percentile(50)
+     << ", \"p90_ns\": " << snapshot.percentile(90)
+     << ", \"p99_ns\": " << snapshot.percentile(99)
+     << ", \"p999_ns\": " << snapshot.percentile(99.9)
+     << ", \"max_ns\": " << snapshot.max << "}";
+  return ss.str();
+}
+
+int main(int argc, char **argv) {
+  BenchConfig config;
+  if(!parseArgs(argc, argv, config)) {
+    return 1;
+  }
+
+  MockServer server(config.server);
+
+  Options opts;
+  opts.transparentRedirects = true;
+  opts.retryStrategy = RetryStrategy::InfiniteRetries();
+  QClient cl("127.0.0.1", server.getPort(), std::move(opts));
+
+  LatencyHistogram latency;
+
+  std::chrono::nanoseconds cpuBefore = processCpuTime();
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+  std::vector<std::thread> producers;
+  for(int64_t i = 0; i < config.producers; i++) {
+    producers.emplace_back(produce, std::cref(config), std::ref(cl), std::ref(latency));
+  }
+
+  for(size_t i = 0; i < producers.size(); i++) {
+    producers[i].join();
+  }
+
+  std::chrono::nanoseconds elapsed = std::chrono::steady_clock::now() - start;
+
+  //----------------------------------------------------------------------------
+  // The mock server runs in-process: Its CPU time is accounted separately,
+  // the rest is charged to the client.
+  //----------------------------------------------------------------------------
+  std::chrono::nanoseconds serverCpu = server.getCpuTime();
+  std::chrono::nanoseconds clientCpu = processCpuTime() - cpuBefore - serverCpu;
+
+  int64_t total = config.producers * config.requests;
+  double seconds = elapsed.count() / 1e9;
+  ClientStatistics stats = cl.getStatistics();
+  LatencyStats stages = cl.getLatencyStats();
+
+  std::cout << "{" << std::endl
+    << "  \"mode\": \"" << config.mode << "\"," << std::endl
+    << "  \"producers\": " << config.producers << "," << std::endl
+    << "  \"requests\": " << total << "," << std::endl
+    << "  \"window\": " << config.window << "," << std::endl
+    << "  \"server_latency_us\": " << config.server.latency.count() << "," << std::endl
+    << "  \"reply_size\": " << config.server.replySize << "," << std::endl
+    << "  \"elapsed_s\": " << seconds << "," << std::endl
+    << "  \"requests_per_s\": " << (uint64_t) (total / seconds) << "," << std::endl
+    << "  \"client_cpu_ns_per_request\": " << clientCpu.count() / total << "," << std::endl
+    << "  \"server_cpu_ns_per_request\": " << serverCpu.count() / total << "," << std::endl
+    << "  \"reconnects\": " << stats.reconnects << "," << std::endl
+    << "  \"redirects\": " << stats.redirects << "," << std::endl
+    << "  \"bytes_sent\": " << stats.bytesSent << "," << std::endl
+    << "  \"bytes_received\": " << stats.bytesReceived << "," << std::endl
+    << "  \"latency\": " << describe(latency.snapshot()) << "," << std::endl
+    << "  \"network_latency\": " << describe(stages.network) << std::endl
+    << "}" << std::endl;
+
+  return 0;
+}
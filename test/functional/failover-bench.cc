@@ -0,0 +1,373 @@
+// ----------------------------------------------------------------------
+// File: failover-bench.cc
+// Author: Georgios Bitzes - CERN
+// ----------------------------------------------------------------------
+
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2016 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+//------------------------------------------------------------------------------
+// How quickly QClient recovers when the member it talks to goes away, against
+// a cluster of in-process MockServers. Usage:
+//
+//   qclient-failover-bench [--members=3] [--rounds=5] [--window=256]
+//     [--fault=kill|partition] [--retry=infinite|timeout|none]
+//     [--retry-timeout-s=5] [--reconnect=linear|exponential]
+//     [--warm-standby=0|1] [--parallel-connect=0|1] [--latency-us=0]
+//
+// A producer keeps --window requests in flight throughout. Every round, the
+// member currently serving them is killed, or partitioned off through the
+// FaultInjector, and brought back once the client has recovered. Per round:
+//
+// - failover_ms: From the fault until a request issued after it succeeds.
+// - replay_ms: From the first to the last reply to requests which were
+//   pending when the fault hit - how long replaying them took.
+// - lost: Requests pending at the fault which failed instead.
+//
+// Results are printed as a single JSON object.
+//------------------------------------------------------------------------------
+
+#include "mock-server.hh"
+#include "qclient/QClient.hh"
+#include "qclient/FaultInjector.hh"
+#include "qclient/Semaphore.hh"
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <thread>
+
+using namespace qclient;
+using Clock = std::chrono::steady_clock;
+
+struct BenchConfig {
+  int64_t members = 3;
+  int64_t rounds = 5;
+  int64_t window = 256;
+  std::string fault = "kill";
+  std::string retry = "infinite";
+  int64_t retryTimeout = 5;
+  std::string reconnect = "linear";
+  bool warmStandby = false;
+  bool parallelConnect = false;
+  MockServerConfig server;
+};
+
+static bool parseArgs(int argc, char **argv, BenchConfig &config) {
+  std::map<std::string, std::string> args;
+
+  for(int i = 1; i < argc; i++) {
+    std::string arg(argv[i]);
+    size_t eq = arg.find('=');
+    if(arg.compare(0, 2, "--") != 0 || eq == std::string::npos) {
+      std::cerr << "Unable to parse argument: " << arg << std::endl;
+      return false;
+    }
+
+    args[arg.substr(2, eq - 2)] = arg.substr(eq + 1);
+  }
+
+  try {
+    for(auto it = args.begin(); it != args.end(); it++) {
+      if(it->first == "members") config.members = std::stoll(it->second);
+      else if(it->first == "rounds") config.rounds = std::stoll(it->second);
+      else if(it->first == "window") config.window = std::stoll(it->second);
+      else if(it->first == "fault") config.fault = it->second;
+      else if(it->first == "retry") config.retry = it->second;
+      else if(it->first == "retry-timeout-s") config.retryTimeout = std::stoll(it->second);
+      else if(it->first == "reconnect") config.reconnect = it->second;
+      else if(it->first == "warm-standby") config.warmStandby = std::stoll(it->second) != 0;
+      else if(it->first == "parallel-connect") config.parallelConnect = std::stoll(it->second) != 0;
+      else if(it->first == "latency-us") config.server.latency = std::chrono::microseconds(std::stoll(it->second));
+      else {
+        std::cerr << "Unknown option: --" << it->first << std::endl;
+        return false;
+      }
+    }
+  }
+  catch(const std::exception &exc) {
+    std::cerr << "Invalid numeric argument: " << exc.what() << std::endl;
+    return false;
+  }
+
+  if(config.fault != "kill" && config.fault != "partition") {
+    std::cerr << "Unknown fault: " << config.fault << std::endl;
+    return false;
+  }
+
+  if(config.retry != "infinite" && config.retry != "timeout" && config.retry != "none") {
+    std::cerr << "Unknown retry strategy: " << config.retry << std::endl;
+    return false;
+  }
+
+  if(config.reconnect != "linear" && config.reconnect != "exponential") {
+    std::cerr << "Unknown reconnect strategy: " << config.reconnect << std::endl;
+    return false;
+  }
+
+  return config.members >= 2 && config.rounds > 0 && config.window > 0;
+}
+
+//------------------------------------------------------------------------------
+// Every request the producer issued: When, when it completed, and how.
+//------------------------------------------------------------------------------
+struct Sample {
+  Clock::time_point issued;
+  Clock::time_point completed;
+  bool ok;
+};
+
+class Producer {
+public:
+  Producer(QClient &qcl, int64_t window)
+  : cl(qcl), slots(window), windowSize(window), thread(&Producer::main, this) {}
+
+  //----------------------------------------------------------------------------
+  // Stop issuing requests, wait for all in flight to complete, and hand out
+  // the samples.
+  //----------------------------------------------------------------------------
+  std::vector<Sample> finish() {
+    stop = true;
+    thread.join();
+    slots.down(windowSize);
+
+    std::lock_guard<std::mutex> lock(mtx);
+    return std::move(samples);
+  }
+
+private:
+  void main() {
+    while(!stop) {
+      slots.down();
+
+      Clock::time_point issued = Clock::now();
+      cl.execute(EncodedRequest::make("GET", "key"), [this, issued](redisReplyPtr &&reply) {
+        Sample sample { issued, Clock::now(), reply != nullptr };
+
+        {
+          std::lock_guard<std::mutex> lock(mtx);
+          samples.push_back(sample);
+        }
+
+        slots.up();
+      });
+    }
+  }
+
+  QClient &cl;
+  Semaphore slots;
+  int64_t windowSize;
+  std::atomic<bool> stop {false};
+
+  std::mutex mtx;
+  std::vector<Sample> samples;
+  std::thread thread;
+};
+
+struct RoundResult {
+  int leader;
+  double failoverMs;
+  double replayMs;
+  int64_t pending;
+  int64_t lost;
+};
+
+//------------------------------------------------------------------------------
+// Whoever served the most requests lately is the member the client talks to.
+//------------------------------------------------------------------------------
+static int findLeader(std::vector<std::unique_ptr<MockServer>> &servers) {
+  std::vector<int64_t> before;
+  for(size_t i = 0; i < servers.size(); i++) {
+    before.push_back(servers[i]->getRequestsServed());
+  }
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+  int leader = 0;
+  int64_t best = -1;
+  for(size_t i = 0; i < servers.size(); i++) {
+    int64_t served = servers[i]->getRequestsServed() - before[i];
+    if(served > best) {
+      best = served;
+      leader = i;
+    }
+  }
+
+  return leader;
+}
+
+//------------------------------------------------------------------------------
+// Keep issuing single requests until one succeeds - returns when it did.
+//------------------------------------------------------------------------------
+static Clock::time_point probe(QClient &cl) {
+  while(true) {
+    redisReplyPtr reply = cl.exec("GET", "probe").get();
+    if(reply) {
+      return Clock::now();
+    }
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+}
+
+static double toMs(Clock::duration duration) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(duration).count() / 1000.0;
+}
+
+static RoundResult analyze(const std::vector<Sample> &samples, Clock::time_point fault,
+  Clock::time_point recovered, int leader) {
+
+  RoundResult result;
+  result.leader = leader;
+  result.failoverMs = toMs(recovered - fault);
+  result.pending = 0;
+  result.lost = 0;
+
+  Clock::time_point firstReply = Clock::time_point::max();
+  Clock::time_point lastReply = Clock::time_point::min();
+
+  for(const Sample &sample : samples) {
+    if(sample.issued >= fault || sample.completed < fault) continue;
+
+    result.pending++;
+    if(!sample.ok) {
+      result.lost++;
+      continue;
+    }
+
+    firstReply = std::min(firstReply, sample.completed);
+    lastReply = std::max(lastReply, sample.completed);
+  }
+
+  result.replayMs = (lastReply >= firstReply) ? toMs(lastReply - firstReply) : 0;
+  return result;
+}
+
+int main(int argc, char **argv) {
+  BenchConfig config;
+  if(!parseArgs(argc, argv, config)) {
+    return 1;
+  }
+
+  std::vector<std::unique_ptr<MockServer>> servers;
+  Members members;
+  for(int64_t i = 0; i < config.members; i++) {
+    servers.emplace_back(new MockServer(config.server));
+    members.push_back("127.0.0.1", servers.back()->getPort());
+  }
+
+  Options opts;
+  opts.warmStandby = config.warmStandby;
+  opts.parallelConnect = config.parallelConnect;
+
+  if(config.retry == "infinite") {
+    opts.retryStrategy = RetryStrategy::InfiniteRetries();
+  }
+  else if(config.retry == "timeout") {
+    opts.retryStrategy = RetryStrategy::WithTimeout(std::chrono::seconds(config.retryTimeout));
+  }
+
+  if(config.reconnect == "exponential") {
+    opts.reconnectStrategy = ReconnectStrategy::ExponentialJitter();
+  }
+
+  QClient cl(members, std::move(opts));
+  probe(cl);
+
+  struct Fault {
+    int leader;
+    Clock::time_point injected;
+    Clock::time_point recovered;
+  };
+
+  std::vector<Fault> faults;
+  Producer producer(cl, config.window);
+
+  for(int64_t round = 0; round < config.rounds; round++) {
+    int leader = findLeader(servers);
+    Endpoint endpoint("127.0.0.1", servers[leader]->getPort());
+
+    Clock::time_point injected = Clock::now();
+    if(config.fault == "kill") {
+      servers[leader]->kill();
+    }
+    else {
+      cl.getFaultInjector().addPartition(endpoint);
+    }
+
+    Clock::time_point recovered = probe(cl);
+    faults.push_back(Fault { leader, injected, recovered });
+
+    // Let whatever was pending drain before healing
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+    if(config.fault == "kill") {
+      servers[leader]->revive();
+    }
+    else {
+      cl.getFaultInjector().healPartition(endpoint);
+    }
+  }
+
+  std::vector<Sample> samples = producer.finish();
+  ClientStatistics stats = cl.getStatistics();
+
+  std::ostringstream rounds;
+  double worstFailover = 0, totalFailover = 0, worstReplay = 0;
+  int64_t totalPending = 0, totalLost = 0;
+
+  for(size_t i = 0; i < faults.size(); i++) {
+    RoundResult result = analyze(samples, faults[i].injected, faults[i].recovered,
+      faults[i].leader);
+
+    worstFailover = std::max(worstFailover, result.failoverMs);
+    totalFailover += result.failoverMs;
+    worstReplay = std::max(worstReplay, result.replayMs);
+    totalPending += result.pending;
+    totalLost += result.lost;
+
+    rounds << (i == 0 ? "" : ",") << std::endl
+      << "    {\"leader\": " << result.leader
+      << ", \"failover_ms\": " << result.failoverMs
+      << ", \"replay_ms\": " << result.replayMs
+      << ", \"pending\": " << result.pending
+      << ", \"lost\": " << result.lost << "}";
+  }
+
+  std::cout << "{" << std::endl
+    << "  \"members\": " << config.members << "," << std::endl
+    << "  \"fault\": \"" << config.fault << "\"," << std::endl
+    << "  \"retry\": \"" << config.retry << "\"," << std::endl
+    << "  \"reconnect\": \"" << config.reconnect << "\"," << std::endl
+    << "  \"warm_standby\": " << config.warmStandby << "," << std::endl
+    << "  \"parallel_connect\": " << config.parallelConnect << "," << std::endl
+    << "  \"window\": " << config.window << "," << std::endl
+    << "  \"requests\": " << samples.size() << "," << std::endl
+    << "  \"reconnects\": " << stats.reconnects << "," << std::endl
+    << "  \"mean_failover_ms\": " << totalFailover / faults.size() << "," << std::endl
+    << "  \"max_failover_ms\": " << worstFailover << "," << std::endl
+    << "  \"max_replay_ms\": " << worstReplay << "," << std::endl
+    << "  \"pending_at_fault\": " << totalPending << "," << std::endl
+    << "  \"lost\": " << totalLost << "," << std::endl
+    << "  \"rounds\": [" << rounds.str() << std::endl
+    << "  ]" << std::endl
+    << "}" << std::endl;
+
+  return 0;
+}
@@ -26,6 +26,7 @@
 #include "test-config.hh"
 #include "qclient/AsyncHandler.hh"
 #include <algorithm>
+#include <future>
 
 using namespace qclient;
 
@@ -66,8 +67,19 @@ TEST(QHash, HashSync)
     ASSERT_TRUE(std::find(fields.begin(), fields.end(), elem) != fields.end());
   }
 
+  std::vector<std::string> sorted_fields;
+  qhash.hkeys(sorted_fields, true);
+  ASSERT_EQ(sorted_fields.size(), 3u);
+  ASSERT_TRUE(std::is_sorted(sorted_fields.begin(), sorted_fields.end()));
+  ASSERT_EQ(qhash.hkeys([](std::string && field) {}), 3u);
+
   // Test the hvals command
   resp = qhash.hvals();
+  std::vector<std::string> streamed_values;
+  ASSERT_EQ(qhash.hvals([&](std::string && value) {
+    streamed_values.emplace_back(std::move(value));
+  }), 3u);
+  ASSERT_EQ(streamed_values, resp);
 
   for (auto && elem : resp) {
     ASSERT_TRUE(std::find(ivalues.begin(), ivalues.end(),
@@ -181,3 +193,181 @@ TEST(QHash, HashAsync)
   ASSERT_TRUE(ah.Wait());
   ASSERT_EQ(0, qhash.hlen());
 }
+
+//------------------------------------------------------------------------------
+// Test HASH interface - cached reads
+//------------------------------------------------------------------------------
+TEST(QHash, HashCached)
+{
+  QClient cl{testconfig.host, testconfig.port, {} };
+  std::string hash_key = "qclient_test:hash_cached";
+  QHash qhash{cl, hash_key};
+  QHash uncached{cl, hash_key};
+  qhash.setCache(std::make_shared<QHashCache>(std::chrono::minutes(10), 1024 * 1024));
+
+  ASSERT_EQ(0, qhash.hlen());
+  ASSERT_FALSE(qhash.hexists("f1"));
+  ASSERT_EQ("", qhash.hget("f1"));
+
+  // Writes through the cached object invalidate it
+  ASSERT_TRUE(qhash.hset("f1", "v1"));
+  ASSERT_EQ("v1", qhash.hget("f1"));
+  ASSERT_TRUE(qhash.hexists("f1"));
+  ASSERT_EQ(1, qhash.hlen());
+
+  // Writes by others are only noticed through notifications
+  ASSERT_FALSE(uncached.hset("f1", "v2"));
+  ASSERT_EQ("v1", qhash.hget("f1"));
+  ASSERT_EQ("v2", uncached.hget("f1"));
+
+  ASSERT_TRUE(qhash.hdel("f1"));
+  ASSERT_EQ("", qhash.hget("f1"));
+  ASSERT_EQ(0, qhash.hlen());
+}
+
+//------------------------------------------------------------------------------
+// Test HASH interface - bulk reads
+//------------------------------------------------------------------------------
+TEST(QHash, HashGetAll)
+{
+  QClient cl{testconfig.host, testconfig.port, {} };
+  std::string hash_key = "qclient_test:hash_getall";
+  QHash qhash{cl, hash_key};
+  std::unordered_map<std::string, std::string> expected;
+
+  for (size_t i = 0; i < 1000; ++i) {
+    expected["field" + std::to_string(i)] = std::to_string(i);
+    ASSERT_TRUE(qhash.hset("field" + std::to_string(i), std::to_string(i)));
+  }
+
+  std::unordered_map<std::string, std::string> contents;
+  qhash.hgetall(contents);
+  ASSERT_EQ(contents, expected);
+
+  contents.clear();
+  size_t pairs = qhash.hgetall_stream([&](std::string && field, std::string && value) {
+    contents.emplace(std::move(field), std::move(value));
+  }, 100);
+  ASSERT_EQ(pairs, 1000u);
+  ASSERT_EQ(contents, expected);
+
+  contents.clear();
+  QHash::Iterator it = qhash.getIterator(100);
+
+  for (; it.valid(); it.next()) {
+    ASSERT_EQ(it.getKey(), it.getKeyView());
+    contents.emplace(it.getKeyView(), it.getValueView());
+  }
+
+  ASSERT_EQ(contents, expected);
+
+  for (size_t i = 0; i < 1000; ++i) {
+    ASSERT_TRUE(qhash.hdel("field" + std::to_string(i)));
+  }
+}
+
+//------------------------------------------------------------------------------
+// Test HASH interface - chunked bulk set
+//------------------------------------------------------------------------------
+TEST(QHash, HashBulk)
+{
+  QClient cl{testconfig.host, testconfig.port, {} };
+  std::string hash_key = "qclient_test:hash_bulk";
+  QHash qhash{cl, hash_key};
+  std::map<std::string, std::string> contents;
+
+  for (size_t i = 0; i < 1000; ++i) {
+    contents["field" + std::to_string(i)] = std::to_string(i);
+  }
+
+  BulkLoadOptions options;
+  options.chunkSize = 100;
+  options.maxInFlight = 2;
+
+  BulkLoadResult result = qhash.hmset_bulk(contents.begin(), contents.end(), options);
+  ASSERT_TRUE(result.ok());
+  ASSERT_EQ(10u, result.chunks);
+  ASSERT_EQ(1000, qhash.hlen());
+  ASSERT_EQ("500", qhash.hget("field500"));
+
+  auto future = cl.execute(std::vector<std::string>({"DEL", hash_key}));
+  ASSERT_EQ(1, future.get()->integer);
+}
+
+//------------------------------------------------------------------------------
+// Test HASH interface - multi-field and multi-hash lookups
+//------------------------------------------------------------------------------
+TEST(QHash, HashMultiGet)
+{
+  QClient cl{testconfig.host, testconfig.port, {} };
+  QHash qhash1{cl, "qclient_test:hash_mget1"};
+  QHash qhash2{cl, "qclient_test:hash_mget2"};
+
+  ASSERT_TRUE(qhash1.hset("f1", "v1"));
+  ASSERT_TRUE(qhash1.hset("f2", "v2"));
+  ASSERT_TRUE(qhash2.hset("f1", "w1"));
+
+  std::vector<std::string> values = qhash1.hmget({"f2", "f3", "f1"});
+  ASSERT_EQ(values, std::vector<std::string>({"v2", "", "v1"}));
+
+  std::unordered_map<std::string, std::string> found;
+  qhash1.hmget({"f2", "f3", "f1"}, found);
+  ASSERT_EQ(2u, found.size());
+  ASSERT_EQ("v1", found["f1"]);
+  ASSERT_EQ("v2", found["f2"]);
+
+  values = QHash::multiGet(cl, {"qclient_test:hash_mget1",
+                                "qclient_test:hash_mget3", "qclient_test:hash_mget2"}, "f1");
+  ASSERT_EQ(values, std::vector<std::string>({"v1", "", "w1"}));
+
+  ASSERT_TRUE(qhash1.hdel("f1"));
+  ASSERT_TRUE(qhash1.hdel("f2"));
+  ASSERT_TRUE(qhash2.hdel("f1"));
+}
+
+//------------------------------------------------------------------------------
+// Test the future- and callback-based forms
+//------------------------------------------------------------------------------
+TEST(QHash, HashFuture)
+{
+  QClient cl{testconfig.host, testconfig.port, {} };
+  QHash qhash{cl, "qclient_test:hash_future"};
+
+  TypedFuture<bool> set1 = qhash.hset_future("f1", "v1");
+  TypedFuture<long long> incr = qhash.hincrby_future("f2", 5);
+  TypedFuture<std::string> get1 = qhash.hget_future("f1");
+  TypedFuture<std::string> get2 = qhash.hget_future("f3");
+
+  bool created = false;
+  ASSERT_TRUE(set1.get(created).ok());
+  ASSERT_TRUE(created);
+
+  long long counter = 0;
+  ASSERT_TRUE(incr.get(counter).ok());
+  ASSERT_EQ(5, counter);
+
+  std::string value;
+  ASSERT_TRUE(get1.get(value).ok());
+  ASSERT_EQ("v1", value);
+  ASSERT_TRUE(get2.get(value).ok());
+  ASSERT_EQ("", value);
+
+  // Wrong type - reported through the Status, not thrown
+  double dbl = 0;
+  ASSERT_FALSE(qhash.hincrbyfloat_future("f1", 1.0).get(dbl).ok());
+
+  std::promise<long long> lenPromise;
+  qhash.hlen_async([&lenPromise](qclient::Status st, long long &&len) {
+    lenPromise.set_value(st.ok() ? len : -1);
+  });
+  ASSERT_EQ(2, lenPromise.get_future().get());
+
+  std::vector<std::string> keys;
+  ASSERT_TRUE(qhash.hkeys_future().get(keys).ok());
+  std::sort(keys.begin(), keys.end());
+  ASSERT_EQ(keys, std::vector<std::string>({"f1", "f2"}));
+
+  ASSERT_TRUE(qhash.hdel_future("f1").get(created).ok());
+  ASSERT_TRUE(created);
+  ASSERT_TRUE(qhash.hdel("f2"));
+}
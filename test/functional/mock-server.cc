@@ -0,0 +1,371 @@
+// ----------------------------------------------------------------------
+// File: mock-server.cc
+// Author: Georgios Bitzes - CERN
+// ----------------------------------------------------------------------
+
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2016 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#include "mock-server.hh"
+#include "qclient/ResponseBuilder.hh"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <iostream>
+
+namespace qclient {
+
+static int64_t threadCpuTime() {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1000000000ll + ts.tv_nsec;
+}
+
+static bool isCommand(const redisReplyPtr &request, const char *name) {
+  size_t len = strlen(name);
+  return request->type == REDIS_REPLY_ARRAY && request->elements >= 1 &&
+    request->element[0]->type == REDIS_REPLY_STRING &&
+    (size_t) request->element[0]->len == len &&
+    strncasecmp(request->element[0]->str, name, len) == 0;
+}
+
+static void appendBulk(std::string &out, const char *data, size_t len) {
+  out += "$" + std::to_string(len) + "\r\n";
+  out.append(data, len);
+  out += "\r\n";
+}
+
+static void appendBulk(std::string &out, const std::string &str) {
+  appendBulk(out, str.data(), str.size());
+}
+
+//------------------------------------------------------------------------------
+// Start a pub-sub array - with push types, the pubsub tag comes first.
+//------------------------------------------------------------------------------
+static void appendPubsubHeader(std::string &out, bool pushTypes, size_t elements) {
+  if(pushTypes) {
+    out += ">" + std::to_string(elements + 1) + "\r\n";
+    appendBulk(out, "pubsub");
+  }
+  else {
+    out += "*" + std::to_string(elements) + "\r\n";
+  }
+}
+
+static bool writeAll(int fd, const std::string &data) {
+  size_t pos = 0;
+  while(pos < data.size()) {
+    ssize_t rc = send(fd, data.data() + pos, data.size() - pos, MSG_NOSIGNAL);
+    if(rc <= 0) return false;
+    pos += rc;
+  }
+
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Listen on the given loopback port, 0 for an ephemeral one.
+//------------------------------------------------------------------------------
+bool MockServer::listenOn(int requested) {
+  listenFd = socket(AF_INET, SOCK_STREAM, 0);
+
+  int one = 1;
+  setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(requested);
+
+  socklen_t len = sizeof(addr);
+  if(bind(listenFd, (struct sockaddr*) &addr, sizeof(addr)) != 0 ||
+     listen(listenFd, 128) != 0 ||
+     getsockname(listenFd, (struct sockaddr*) &addr, &len) != 0) {
+    return false;
+  }
+
+  port = ntohs(addr.sin_port);
+  return true;
+}
+
+MockServer::MockServer(const MockServerConfig &conf) : config(conf) {
+  if(!listenOn(0)) {
+    std::cerr << "MockServer: unable to listen on loopback: " << strerror(errno) << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  if(config.replySize == 0) {
+    okReply = "+OK\r\n";
+  }
+  else {
+    okReply = "$" + std::to_string(config.replySize) + "\r\n" + std::string(config.replySize, 'x') + "\r\n";
+  }
+
+  movedReply = "-MOVED 0 127.0.0.1:" + std::to_string(port) + "\r\n";
+  unavailableReply = "-UNAVAILABLE mock server says so\r\n";
+
+  acceptor.reset(&MockServer::acceptLoop, this);
+}
+
+MockServer::~MockServer() {
+  acceptor.join();
+
+  std::lock_guard<std::mutex> lock(mtx);
+  for(size_t i = 0; i < connections.size(); i++) {
+    shutdown(connections[i]->fd, SHUT_RDWR);
+  }
+
+  for(size_t i = 0; i < connections.size(); i++) {
+    connections[i]->thread.join();
+    close(connections[i]->fd);
+  }
+
+  if(listenFd >= 0) {
+    close(listenFd);
+  }
+}
+
+void MockServer::kill() {
+  acceptor.join();
+  close(listenFd);
+  listenFd = -1;
+
+  std::lock_guard<std::mutex> lock(mtx);
+  for(size_t i = 0; i < connections.size(); i++) {
+    shutdown(connections[i]->fd, SHUT_RDWR);
+  }
+}
+
+void MockServer::revive() {
+  if(!listenOn(port)) {
+    std::cerr << "MockServer: unable to listen on port " << port << " again: " << strerror(errno) << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  acceptor.reset(&MockServer::acceptLoop, this);
+}
+
+int64_t MockServer::getConnectionsAccepted() const {
+  std::lock_guard<std::mutex> lock(mtx);
+  return connectionsAccepted;
+}
+
+std::chrono::nanoseconds MockServer::getCpuTime() const {
+  std::lock_guard<std::mutex> lock(mtx);
+
+  int64_t total = reapedCpuTime;
+  for(size_t i = 0; i < connections.size(); i++) {
+    total += connections[i]->cpuTime;
+  }
+
+  return std::chrono::nanoseconds(total);
+}
+
+void MockServer::acceptLoop(ThreadAssistant &assistant) {
+  while(!assistant.terminationRequested()) {
+    struct pollfd pfd;
+    pfd.fd = listenFd;
+    pfd.events = POLLIN;
+
+    if(poll(&pfd, 1, 10) <= 0) continue;
+
+    int fd = accept(listenFd, nullptr, nullptr);
+    if(fd < 0) continue;
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    std::lock_guard<std::mutex> lock(mtx);
+    reapFinished();
+
+    connectionsAccepted++;
+    connections.emplace_back(new Connection());
+    Connection *conn = connections.back().get();
+    conn->fd = fd;
+    conn->thread = std::thread(&MockServer::serve, this, conn);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Join and close connections whose thread is done - mtx must be held. A
+// finished thread no longer touches mtx, so joining it here is safe.
+//------------------------------------------------------------------------------
+void MockServer::reapFinished() {
+  size_t kept = 0;
+
+  for(size_t i = 0; i < connections.size(); i++) {
+    if(!connections[i]->finished) {
+      connections[kept++] = std::move(connections[i]);
+      continue;
+    }
+
+    connections[i]->thread.join();
+    close(connections[i]->fd);
+    reapedCpuTime += connections[i]->cpuTime;
+  }
+
+  connections.resize(kept);
+}
+
+//------------------------------------------------------------------------------
+// Append the reply to the given request - returns false if it's an error
+// which should be the last thing sent on this connection.
+//
+// PING is answered properly, the default handshake depends on it.
+//------------------------------------------------------------------------------
+bool MockServer::reply(Connection *conn, const redisReplyPtr &request, std::string &out) {
+  if(isCommand(request, "ping")) {
+    if(request->elements == 1) {
+      out += "+PONG\r\n";
+    }
+    else {
+      redisReply *arg = request->element[1];
+      appendBulk(out, arg->str, arg->len);
+    }
+
+    return true;
+  }
+
+  if(isCommand(request, "activate-push-types")) {
+    std::lock_guard<std::mutex> lock(mtx);
+    conn->pushTypes = true;
+    out += "+OK\r\n";
+    return true;
+  }
+
+  if(isCommand(request, "subscribe")) {
+    subscribe(conn, request, out);
+    return true;
+  }
+
+  if(isCommand(request, "publish") && request->elements == 3) {
+    std::string channel(request->element[1]->str, request->element[1]->len);
+    std::string payload(request->element[2]->str, request->element[2]->len);
+    out += ":" + std::to_string(publish(channel, payload)) + "\r\n";
+    requestsServed++;
+    return true;
+  }
+
+  int64_t seq = ++repliesSent;
+
+  if(config.movedEvery != 0 && seq % config.movedEvery == 0) {
+    out += movedReply;
+    return false;
+  }
+
+  if(config.unavailableEvery != 0 && seq % config.unavailableEvery == 0) {
+    out += unavailableReply;
+    return false;
+  }
+
+  out += okReply;
+  requestsServed++;
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Confirm each channel separately, as redis does.
+//------------------------------------------------------------------------------
+void MockServer::subscribe(Connection *conn, const redisReplyPtr &request, std::string &out) {
+  std::lock_guard<std::mutex> lock(mtx);
+
+  for(size_t i = 1; i < request->elements; i++) {
+    std::string channel(request->element[i]->str, request->element[i]->len);
+    conn->channels.insert(channel);
+
+    appendPubsubHeader(out, conn->pushTypes, 3);
+    appendBulk(out, "subscribe");
+    appendBulk(out, channel);
+    out += ":" + std::to_string(conn->channels.size()) + "\r\n";
+  }
+}
+
+size_t MockServer::publish(const std::string &channel, const std::string &payload) {
+  std::lock_guard<std::mutex> lock(mtx);
+
+  size_t receivers = 0;
+  std::string out;
+
+  for(size_t i = 0; i < connections.size(); i++) {
+    Connection *conn = connections[i].get();
+    if(conn->channels.count(channel) == 0) continue;
+
+    out.clear();
+    appendPubsubHeader(out, conn->pushTypes, 3);
+    appendBulk(out, "message");
+    appendBulk(out, channel);
+    appendBulk(out, payload);
+
+    std::lock_guard<std::mutex> writeLock(conn->writeMtx);
+    if(writeAll(conn->fd, out)) {
+      receivers++;
+    }
+  }
+
+  return receivers;
+}
+
+void MockServer::serve(Connection *conn) {
+  ResponseBuilder builder;
+  std::string out;
+  bool alive = true;
+
+  while(alive) {
+    size_t len = 64 * 1024;
+    char *buffer = builder.getWriteBuffer(len);
+
+    ssize_t rc = recv(conn->fd, buffer, len, 0);
+    if(rc <= 0) break;
+
+    builder.commitWrite(rc);
+    std::chrono::steady_clock::time_point arrival = std::chrono::steady_clock::now();
+
+    out.clear();
+    redisReplyPtr request;
+    while(alive && builder.pull(request) == ResponseBuilder::Status::kOk) {
+      alive = reply(conn, request, out);
+    }
+
+    if(config.latency.count() != 0) {
+      std::this_thread::sleep_until(arrival + config.latency);
+    }
+
+    if(!out.empty()) {
+      std::lock_guard<std::mutex> writeLock(conn->writeMtx);
+      if(!writeAll(conn->fd, out)) break;
+    }
+
+    conn->cpuTime = threadCpuTime();
+  }
+
+  // Hang up, as a real server would after redirecting - the fd itself is
+  // closed once the connection is reaped.
+  shutdown(conn->fd, SHUT_RDWR);
+  conn->cpuTime = threadCpuTime();
+  conn->finished = true;
+}
+
+}
@@ -0,0 +1,139 @@
+// ----------------------------------------------------------------------
+// File: mock-server.hh
+// Author: Georgios Bitzes - CERN
+// ----------------------------------------------------------------------
+
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2016 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#ifndef QCLIENT_TEST_MOCK_SERVER_HH
+#define QCLIENT_TEST_MOCK_SERVER_HH
+
+#include "qclient/AssistedThread.hh"
+#include "qclient/Reply.hh"
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace qclient {
+
+struct MockServerConfig {
+  // Every reply is held back until this long after its request arrived.
+  // Pipelined requests are delayed concurrently, not one after the other.
+  std::chrono::microseconds latency {0};
+
+  // 0 means +OK, anything else a bulk string of that many bytes
+  size_t replySize = 0;
+
+  // Reply to every n-th request, counted across connections, with MOVED
+  // pointing back to the server itself, or UNAVAILABLE - 0 disables.
+  size_t movedEvery = 0;
+  size_t unavailableEvery = 0;
+};
+
+//------------------------------------------------------------------------------
+// Minimal in-process RESP server on loopback, answering every request the
+// same way, as configured. Each connection is served by its own thread.
+//
+// SUBSCRIBE and ACTIVATE-PUSH-TYPES are understood as well, so that
+// messages handed to publish() reach subscribed connections - as push
+// types, if activated on that connection. PUBLISH from a client is relayed
+// the same way.
+//
+// Connections which went away are cleaned up on the next accept, so that
+// a long-lived server with clients coming and going doesn't keep growing.
+//------------------------------------------------------------------------------
+class MockServer {
+public:
+  MockServer(const MockServerConfig &config);
+  ~MockServer();
+
+  int getPort() const {
+    return port;
+  }
+
+  int64_t getRequestsServed() const {
+    return requestsServed;
+  }
+
+  int64_t getConnectionsAccepted() const;
+
+  //----------------------------------------------------------------------------
+  // Simulate the server process dying: Stop listening, so new connections
+  // are refused, and hang up on every open one. revive() listens on the same
+  // port again.
+  //----------------------------------------------------------------------------
+  void kill();
+  void revive();
+
+  //----------------------------------------------------------------------------
+  // Send a message to every connection subscribed to the channel, returns
+  // how many there were. Blocks while a subscriber's socket buffer is full.
+  //----------------------------------------------------------------------------
+  size_t publish(const std::string &channel, const std::string &payload);
+
+  // CPU time consumed by the connection threads so far
+  std::chrono::nanoseconds getCpuTime() const;
+
+private:
+  struct Connection {
+    int fd;
+    std::atomic<int64_t> cpuTime {0};
+    std::atomic<bool> finished {false};
+    std::thread thread;
+
+    // Serializes writes by serve() and publish() - the rest is protected
+    // by the server's mtx.
+    std::mutex writeMtx;
+    bool pushTypes = false;
+    std::set<std::string> channels;
+  };
+
+  bool listenOn(int port);
+  void acceptLoop(ThreadAssistant &assistant);
+  void serve(Connection *conn);
+  bool reply(Connection *conn, const redisReplyPtr &request, std::string &out);
+  void subscribe(Connection *conn, const redisReplyPtr &request, std::string &out);
+  void reapFinished();
+
+  MockServerConfig config;
+  std::string okReply;
+  std::string movedReply;
+  std::string unavailableReply;
+
+  int listenFd = -1;
+  int port = -1;
+  std::atomic<int64_t> requestsServed {0};
+  std::atomic<int64_t> repliesSent {0};
+
+  mutable std::mutex mtx;
+  std::vector<std::unique_ptr<Connection>> connections;
+  int64_t connectionsAccepted = 0;
+  int64_t reapedCpuTime = 0;
+  AssistedThread acceptor;
+};
+
+}
+
+#endif
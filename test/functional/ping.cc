@@ -24,9 +24,11 @@
 #include <gtest/gtest.h>
 #include "test-config.hh"
 #include "qclient/AsyncHandler.hh"
+#include "qclient/QClientPool.hh"
 #include <set>
 #include <list>
 #include <algorithm>
+#include <thread>
 
 using namespace qclient;
 #define SSTR(message) static_cast<std::ostringstream&>(std::ostringstream().flush() << message).str()
@@ -71,3 +73,71 @@ TEST(Ping, Benchmark) {
   std::cout << "Took " << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count()
   << " ms for " << kRequests << " pings (" << ((double) kRequests / (double) microsec)*1000 << " kHz)" << std::endl;
 }
+
+TEST(Ping, Pool) {
+  QClientPool pool(testconfig.host, testconfig.port, {}, 4);
+  ASSERT_EQ(pool.size(), 4u);
+
+  std::vector<std::future<redisReplyPtr>> responses;
+  for(size_t i = 0; i < 1000; i++) {
+    responses.push_back(pool.exec("PING", SSTR("ping #" << i)));
+  }
+
+  for(size_t i = 0; i < responses.size(); i++) {
+    redisReplyPtr reply = responses[i].get();
+    ASSERT_TRUE(reply != nullptr);
+    ASSERT_EQ(std::string(reply->str, reply->len), SSTR("ping #" << i));
+  }
+
+  // Acknowledgement accounting may lag slightly behind the futures.
+  for(size_t i = 0; i < 100 && pool.getPendingRequests() != 0; i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+
+  ASSERT_EQ(pool.getPendingRequests(), 0);
+}
+
+class CollectingSink : public BulkSink {
+public:
+  void onStart(size_t totalLen) override {
+    expected = totalLen;
+    contents.clear();
+  }
+
+  void onChunk(const char *data, size_t len) override {
+    contents.append(data, len);
+    chunks++;
+  }
+
+  size_t expected = 0;
+  size_t chunks = 0;
+  std::string contents;
+};
+
+TEST(Ping, StreamedReply) {
+  QClient cl{testconfig.host, testconfig.port, {} };
+
+  std::string payload(4 * 1024 * 1024, 'a');
+  for(size_t i = 0; i < payload.size(); i += 4096) {
+    payload[i] = 'b';
+  }
+
+  CollectingSink sink;
+  std::future<redisReplyPtr> before = cl.exec("PING", "before");
+  std::future<redisReplyPtr> streamed = cl.execute(EncodedRequest::make("PING", payload), &sink);
+  std::future<redisReplyPtr> after = cl.exec("PING", "after");
+
+  redisReplyPtr reply = before.get();
+  ASSERT_EQ(std::string(reply->str, reply->len), "before");
+
+  reply = streamed.get();
+  ASSERT_TRUE(reply != nullptr);
+  ASSERT_EQ(reply->type, REDIS_REPLY_STRING);
+  ASSERT_EQ(reply->len, 0u);
+  ASSERT_EQ(sink.expected, payload.size());
+  ASSERT_GT(sink.chunks, 1u);
+  ASSERT_TRUE(sink.contents == payload);
+
+  reply = after.get();
+  ASSERT_EQ(std::string(reply->str, reply->len), "after");
+}
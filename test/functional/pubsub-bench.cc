@@ -0,0 +1,261 @@
+// ----------------------------------------------------------------------
+// File: pubsub-bench.cc
+// Author: Georgios Bitzes - CERN
+// ----------------------------------------------------------------------
+
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2016 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+//------------------------------------------------------------------------------
+// Pub-sub fan-out throughput of Subscriber against MockServer: Messages go
+// through the whole receive path - BaseSubscriber, MessageParser, dispatch
+// by Subscriber, and every Subscription's callback. Usage:
+//
+//   qclient-pubsub-bench [--channels=16] [--messages=200000] [--payload=64]
+//     [--subscriptions=1] [--shards=1] [--push=0|1] [--window=1024]
+//
+// --messages are published round-robin over --channels, each of which has
+// --subscriptions Subscriptions with a callback attached. At most --window
+// messages are published but not yet seen by all their callbacks. Every message
+// carries its publishing time, so latency is measured from publish() until
+// a callback sees it. Results are printed as a single JSON object.
+//------------------------------------------------------------------------------
+
+#include "mock-server.hh"
+#include "qclient/LatencyHistogram.hh"
+#include "qclient/pubsub/Message.hh"
+#include "qclient/pubsub/Subscriber.hh"
+#include "qclient/utils/AllocationAccounting.hh"
+#include <string.h>
+#include <atomic>
+#include <condition_variable>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <thread>
+
+using namespace qclient;
+using Clock = std::chrono::steady_clock;
+
+struct BenchConfig {
+  int64_t channels = 16;
+  int64_t messages = 200000;
+  int64_t payload = 64;
+  int64_t subscriptions = 1;
+  int64_t shards = 1;
+  bool push = false;
+  int64_t window = 1024;
+};
+
+static bool parseArgs(int argc, char **argv, BenchConfig &config) {
+  std::map<std::string, std::string> args;
+
+  for(int i = 1; i < argc; i++) {
+    std::string arg(argv[i]);
+    size_t eq = arg.find('=');
+    if(arg.compare(0, 2, "--") != 0 || eq == std::string::npos) {
+      std::cerr << "Unable to parse argument: " << arg << std::endl;
+      return false;
+    }
+
+    args[arg.substr(2, eq - 2)] = arg.substr(eq + 1);
+  }
+
+  try {
+    for(auto it = args.begin(); it != args.end(); it++) {
+      if(it->first == "channels") config.channels = std::stoll(it->second);
+      else if(it->first == "messages") config.messages = std::stoll(it->second);
+      else if(it->first == "payload") config.payload = std::stoll(it->second);
+      else if(it->first == "subscriptions") config.subscriptions = std::stoll(it->second);
+      else if(it->first == "shards") config.shards = std::stoll(it->second);
+      else if(it->first == "push") config.push = std::stoll(it->second) != 0;
+      else if(it->first == "window") config.window = std::stoll(it->second);
+      else {
+        std::cerr << "Unknown option: --" << it->first << std::endl;
+        return false;
+      }
+    }
+  }
+  catch(const std::exception &exc) {
+    std::cerr << "Invalid numeric argument: " << exc.what() << std::endl;
+    return false;
+  }
+
+  // The payload has to fit the publishing timestamp
+  if(config.payload < (int64_t) sizeof(int64_t)) {
+    std::cerr << "--payload must be at least " << sizeof(int64_t) << " bytes" << std::endl;
+    return false;
+  }
+
+  return config.channels > 0 && config.messages > 0 && config.subscriptions > 0 &&
+    config.shards > 0 && config.window > 0;
+}
+
+//------------------------------------------------------------------------------
+// Counts deliveries across all callbacks, so the main thread can wait for
+// the last one.
+//------------------------------------------------------------------------------
+class DeliveryCounter {
+public:
+  DeliveryCounter(int64_t exp) : expected(exp) {}
+
+  void delivered() {
+    if(++count == expected) {
+      std::lock_guard<std::mutex> lock(mtx);
+      cv.notify_all();
+    }
+  }
+
+  bool wait(std::chrono::seconds timeout) {
+    std::unique_lock<std::mutex> lock(mtx);
+    return cv.wait_for(lock, timeout, [this]() { return count >= expected; });
+  }
+
+  int64_t get() const {
+    return count;
+  }
+
+private:
+  const int64_t expected;
+  std::atomic<int64_t> count {0};
+  std::mutex mtx;
+  std::condition_variable cv;
+};
+
+static std::string makePayload(size_t size) {
+  std::string payload(size, 'x');
+  int64_t now = Clock::now().time_since_epoch().count();
+  memcpy(&payload[0], &now, sizeof(now));
+  return payload;
+}
+
+static Clock::time_point publishedAt(const Message &msg) {
+  int64_t stamp;
+  memcpy(&stamp, msg.getPayload().data(), sizeof(stamp));
+  return Clock::time_point(Clock::duration(stamp));
+}
+
+//------------------------------------------------------------------------------
+// Only the first Subscription to a channel triggers a SUBSCRIBE, later ones
+// are acknowledged only if they made it before the server's reply did.
+//------------------------------------------------------------------------------
+static bool waitForAcknowledgement(const std::vector<std::unique_ptr<Subscription>> &subscriptions,
+  int64_t perChannel) {
+  Clock::time_point deadline = Clock::now() + std::chrono::seconds(30);
+
+  for(size_t i = 0; i < subscriptions.size(); i += perChannel) {
+    while(!subscriptions[i]->acknowledged()) {
+      if(Clock::now() > deadline) return false;
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }
+
+  return true;
+}
+
+static std::string describe(const LatencySnapshot &snapshot) {
+  std::ostringstream ss;
+  ss << "{\"count\": " << snapshot.count
+     << ", \"mean_ns\": " << (uint64_t) snapshot.mean()
+     << ", \"p50_ns\": " << snapshot.percentile(50)
+     << ", \"p90_ns\": " << snapshot.percentile(90)
+     << ", \"p99_ns\": " << snapshot.percentile(99)
+     << ", \"p999_ns\": " << snapshot.percentile(99.9)
+     << ", \"max_ns\": " << snapshot.max << "}";
+  return ss.str();
+}
+
+int main(int argc, char **argv) {
+  BenchConfig config;
+  if(!parseArgs(argc, argv, config)) {
+    return 1;
+  }
+
+  MockServer server(MockServerConfig {});
+
+  SubscriptionOptions opts;
+  opts.usePushTypes = config.push;
+  opts.shards = config.shards;
+  Subscriber subscriber(Members("127.0.0.1", server.getPort()), std::move(opts));
+
+  LatencyHistogram latency;
+  DeliveryCounter counter(config.messages * config.subscriptions);
+
+  std::vector<std::string> channels;
+  std::vector<std::unique_ptr<Subscription>> subscriptions;
+
+  for(int64_t i = 0; i < config.channels; i++) {
+    channels.emplace_back("channel-" + std::to_string(i));
+
+    for(int64_t j = 0; j < config.subscriptions; j++) {
+      subscriptions.emplace_back(subscriber.subscribe(channels.back()));
+      subscriptions.back()->attachCallback([&latency, &counter](Message &&msg) {
+        latency.record(Clock::now() - publishedAt(msg));
+        counter.delivered();
+      });
+    }
+  }
+
+  if(!waitForAcknowledgement(subscriptions, config.subscriptions)) {
+    std::cerr << "Timed out waiting for subscriptions to be acknowledged" << std::endl;
+    return 1;
+  }
+
+  AllocationStatistics allocsBefore = AllocationAccounting::get();
+  Clock::time_point start = Clock::now();
+
+  for(int64_t i = 0; i < config.messages; i++) {
+    while((i - config.window) * config.subscriptions >= counter.get()) {
+      std::this_thread::yield();
+    }
+
+    server.publish(channels[i % config.channels], makePayload(config.payload));
+  }
+
+  if(!counter.wait(std::chrono::seconds(60))) {
+    std::cerr << "Timed out waiting for deliveries, got " << counter.get() << std::endl;
+    return 1;
+  }
+
+  double seconds = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count() / 1e9;
+  AllocationStatistics allocsAfter = AllocationAccounting::get();
+
+  int64_t deliveries = config.messages * config.subscriptions;
+  double allocations = double(allocsAfter.totalAllocations() - allocsBefore.totalAllocations()) / config.messages;
+  double allocatedBytes = double(allocsAfter.totalBytes() - allocsBefore.totalBytes()) / config.messages;
+
+  std::cout << "{" << std::endl
+    << "  \"channels\": " << config.channels << "," << std::endl
+    << "  \"messages\": " << config.messages << "," << std::endl
+    << "  \"payload\": " << config.payload << "," << std::endl
+    << "  \"subscriptions_per_channel\": " << config.subscriptions << "," << std::endl
+    << "  \"shards\": " << config.shards << "," << std::endl
+    << "  \"push_types\": " << (config.push ? "true" : "false") << "," << std::endl
+    << "  \"window\": " << config.window << "," << std::endl
+    << "  \"elapsed_s\": " << seconds << "," << std::endl
+    << "  \"messages_per_s\": " << (uint64_t) (config.messages / seconds) << "," << std::endl
+    << "  \"deliveries_per_s\": " << (uint64_t) (deliveries / seconds) << "," << std::endl
+    << "  \"allocation_accounting\": " << (AllocationAccounting::enabled() ? "true" : "false") << "," << std::endl
+    << "  \"allocs_per_message\": " << allocations << "," << std::endl
+    << "  \"alloc_bytes_per_message\": " << allocatedBytes << "," << std::endl
+    << "  \"latency\": " << describe(latency.snapshot()) << std::endl
+    << "}" << std::endl;
+
+  return 0;
+}
@@ -24,9 +24,15 @@
 #include "test-config.hh"
 #include "qclient/pubsub/BaseSubscriber.hh"
 #include "qclient/pubsub/MessageQueue.hh"
+#include "qclient/pubsub/Subscriber.hh"
+#include "qclient/shared/SharedDeque.hh"
+#include "qclient/shared/SharedManager.hh"
+#include "qclient/SSTR.hh"
 #include "qclient/Debug.hh"
 #include "../ReplyMacros.hh"
 #include <gtest/gtest.h>
+#include <future>
+#include <thread>
 
 using namespace qclient;
 
@@ -191,3 +197,76 @@ TEST(BaseSubscriber, BasicSanity) {
   ASSERT_EQ(item->getPattern(), "test-*");
   ASSERT_EQ(item->getActiveSubscriptions(), 0);
 }
+
+TEST(Subscriber, Sharded) {
+  Members members(testconfig.host, testconfig.port);
+
+  SubscriptionOptions opts;
+  opts.shards = 4;
+  Subscriber subscriber(members, std::move(opts));
+  ASSERT_EQ(subscriber.getShardCount(), 4u);
+
+  std::vector<std::unique_ptr<Subscription>> subscriptions;
+  for(size_t i = 0; i < 16; i++) {
+    subscriptions.emplace_back(subscriber.subscribe(SSTR("sharded-" << i)));
+  }
+
+  for(size_t i = 0; i < subscriptions.size(); i++) {
+    for(size_t attempt = 0; attempt < 500 && !subscriptions[i]->acknowledged(); attempt++) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    ASSERT_TRUE(subscriptions[i]->acknowledged());
+  }
+
+  QClient publisher(members, {} );
+  for(size_t i = 0; i < subscriptions.size(); i++) {
+    ASSERT_REPLY(publisher.exec("publish", SSTR("sharded-" << i), SSTR("payload-" << i)), 1);
+  }
+
+  for(size_t i = 0; i < subscriptions.size(); i++) {
+    for(size_t attempt = 0; attempt < 500 && subscriptions[i]->empty(); attempt++) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    Message msg;
+    ASSERT_TRUE(subscriptions[i]->front(msg));
+    ASSERT_EQ(msg, Message::createMessage(SSTR("sharded-" << i), SSTR("payload-" << i)));
+  }
+}
+
+TEST(SharedDeque, BatchedOperations) {
+  Members members(testconfig.host, testconfig.port);
+  SharedManager sm(members, SubscriptionOptions());
+  SharedDeque deque(&sm, "shared-deque-batched");
+
+  ASSERT_TRUE(deque.clear().ok());
+  ASSERT_TRUE(deque.push_back_many({"a", "b", "c"}).ok());
+  ASSERT_TRUE(deque.push_back("d").ok());
+
+  std::promise<qclient::Status> pushed;
+  deque.push_back_many_async({"e", "f"}, [&pushed](qclient::Status st) {
+    pushed.set_value(st);
+  });
+  ASSERT_TRUE(pushed.get_future().get().ok());
+
+  size_t sz = 0;
+  ASSERT_TRUE(deque.size(sz).ok());
+  ASSERT_EQ(sz, 6u);
+
+  std::vector<std::string> items;
+  ASSERT_TRUE(deque.pop_front_many(2, items).ok());
+  ASSERT_EQ(items, std::vector<std::string>({"a", "b"}));
+
+  std::promise<std::vector<std::string>> popped;
+  deque.pop_front_many_async(10, [&popped](qclient::Status st, std::vector<std::string> &&out) {
+    ASSERT_TRUE(st.ok());
+    popped.set_value(std::move(out));
+  });
+
+  std::vector<std::string> expected = {"c", "d", "e", "f"};
+  ASSERT_EQ(popped.get_future().get(), expected);
+
+  ASSERT_TRUE(deque.size(sz).ok());
+  ASSERT_EQ(sz, 0u);
+}
@@ -28,6 +28,7 @@
 #include <set>
 #include <list>
 #include <algorithm>
+#include <future>
 
 using namespace qclient;
 
@@ -53,6 +54,21 @@ TEST(QSet, SetSync)
     ASSERT_TRUE(ret_members.find(elem) != ret_members.end());
   }
 
+  std::vector<std::string> vec_members;
+  qset.smembers(vec_members, true);
+  ASSERT_EQ(vec_members, std::vector<std::string>(ret_members.begin(),
+            ret_members.end()));
+
+  std::unordered_set<std::string> hashed_members;
+  qset.smembers(hashed_members);
+  ASSERT_EQ(hashed_members.size(), 4u);
+
+  std::set<std::string> streamed_members;
+  ASSERT_EQ(qset.smembers([&](std::string && member) {
+    streamed_members.emplace(std::move(member));
+  }), 4u);
+  ASSERT_EQ(streamed_members, ret_members);
+
   ASSERT_TRUE(qset.srem("100"));
   ASSERT_EQ(3, qset.srem(members));
   ASSERT_FALSE(qset.srem("100"));
@@ -145,3 +161,67 @@ TEST(QSet, SetAsync)
   auto future = cl.execute(std::vector<std::string>({"DEL", set_key}));
   ASSERT_EQ(1, future.get()->integer);
 }
+
+//------------------------------------------------------------------------------
+// Test SET interface - chunked bulk add
+//------------------------------------------------------------------------------
+TEST(QSet, SetBulk)
+{
+  QClient cl{testconfig.host, testconfig.port, {} };
+  std::string set_key = "qclient_test:set_bulk";
+  QSet qset{cl, set_key};
+  std::vector<std::string> members;
+
+  for (auto i = 0; i < 1000; ++i) {
+    members.emplace_back("val" + std::to_string(i));
+  }
+
+  BulkLoadOptions options;
+  options.chunkSize = 64;
+  options.maxInFlight = 4;
+
+  BulkLoadResult result = qset.sadd_bulk(members.begin(), members.end(), options);
+  ASSERT_TRUE(result.ok());
+  ASSERT_EQ(16u, result.chunks);
+  ASSERT_EQ(1000, result.total);
+  ASSERT_EQ(1000, qset.scard());
+
+  result = qset.sadd_bulk(members.begin(), members.end());
+  ASSERT_TRUE(result.ok());
+  ASSERT_EQ(1u, result.chunks);
+  ASSERT_EQ(0, result.total);
+
+  auto future = cl.execute(std::vector<std::string>({"DEL", set_key}));
+  ASSERT_EQ(1, future.get()->integer);
+}
+
+//------------------------------------------------------------------------------
+// Test Set class - future- and callback-based forms
+//------------------------------------------------------------------------------
+TEST(QSet, SetFuture)
+{
+  QClient cl{testconfig.host, testconfig.port, {} };
+  QSet qset{cl, "qclient_test:set_future"};
+
+  TypedFuture<long long> added = qset.sadd_future(std::list<std::string>{"a", "b"});
+  TypedFuture<bool> isMember = qset.sismember_future("a");
+
+  long long count = 0;
+  ASSERT_TRUE(added.get(count).ok());
+  ASSERT_EQ(2, count);
+
+  bool member = false;
+  ASSERT_TRUE(isMember.get(member).ok());
+  ASSERT_TRUE(member);
+
+  std::set<std::string> members;
+  ASSERT_TRUE(qset.smembers_future().get(members).ok());
+  ASSERT_EQ(members, std::set<std::string>({"a", "b"}));
+
+  std::promise<long long> removed;
+  qset.srem_async(std::list<std::string>{"a", "b"},
+    [&removed](qclient::Status st, long long &&val) {
+      removed.set_value(st.ok() ? val : -1);
+    });
+  ASSERT_EQ(2, removed.get_future().get());
+}
@@ -0,0 +1,517 @@
+// ----------------------------------------------------------------------
+// File: soak-bench.cc
+// Author: Georgios Bitzes - CERN
+// ----------------------------------------------------------------------
+
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2016 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+//------------------------------------------------------------------------------
+// Long-running soak test against MockServer, watching the memory footprint.
+// Usage:
+//
+//   qclient-soak-bench [--duration-s=3600] [--sample-s=10] [--warmup-s=120]
+//     [--reconnect-s=60] [--spike-s=600] [--settle-s=30] [--window=256]
+//     [--payload=128] [--channels=8] [--publish-rate=1000]
+//     [--spike-requests=100000] [--spike-messages=100000] [--spike-large=32]
+//     [--drift-pct=10] [--drift-slack-mb=16]
+//
+// Throughout the run, a producer keeps --window requests in flight, while
+// --publish-rate messages per second are published over --channels to a
+// Subscriber, and as many updates go to a TransientSharedHash - relayed back
+// to it by the server. Every --reconnect-s, the server is killed and revived.
+//
+// Every --spike-s, a spike is injected: --spike-requests requests at once,
+// --spike-large requests with 1 MiB replies, and --spike-messages messages
+// queued up in a Subscription without a callback. Once everything has
+// arrived, it is all released, and after --settle-s the footprint is
+// compared to the one before: How much of the growth was given back. The
+// same is measured once more after malloc_trim, to tell memory qclient
+// holds on to apart from memory the allocator does.
+//
+// Every --sample-s, RSS, allocation counters and queue depths are sampled.
+// Samples after --warmup-s, and outside of spikes, are steady-state: If the
+// last third of them averages more than --drift-pct, and at least
+// --drift-slack-mb, above the first third, memory is drifting, and the
+// benchmark fails.
+//
+// RSS is that of the whole process, mock server included. Results are
+// printed as a single JSON object.
+//------------------------------------------------------------------------------
+
+#include "mock-server.hh"
+#include "qclient/QClient.hh"
+#include "qclient/Semaphore.hh"
+#include "qclient/pubsub/Message.hh"
+#include "qclient/pubsub/Subscriber.hh"
+#include "qclient/shared/SharedManager.hh"
+#include "qclient/shared/TransientSharedHash.hh"
+#include "qclient/utils/AllocationAccounting.hh"
+#include <unistd.h>
+#include <algorithm>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <thread>
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+using namespace qclient;
+using Clock = std::chrono::steady_clock;
+
+struct BenchConfig {
+  int64_t duration = 3600;
+  int64_t sample = 10;
+  int64_t warmup = 120;
+  int64_t reconnect = 60;
+  int64_t spike = 600;
+  int64_t settle = 30;
+  int64_t window = 256;
+  int64_t payload = 128;
+  int64_t channels = 8;
+  int64_t publishRate = 1000;
+  int64_t spikeRequests = 100000;
+  int64_t spikeMessages = 100000;
+  int64_t spikeLarge = 32;
+  double driftPct = 10;
+  double driftSlackMb = 16;
+};
+
+static bool parseArgs(int argc, char **argv, BenchConfig &config) {
+  std::map<std::string, std::string> args;
+
+  for(int i = 1; i < argc; i++) {
+    std::string arg(argv[i]);
+    size_t eq = arg.find('=');
+    if(arg.compare(0, 2, "--") != 0 || eq == std::string::npos) {
+      std::cerr << "Unable to parse argument: " << arg << std::endl;
+      return false;
+    }
+
+    args[arg.substr(2, eq - 2)] = arg.substr(eq + 1);
+  }
+
+  try {
+    for(auto it = args.begin(); it != args.end(); it++) {
+      if(it->first == "duration-s") config.duration = std::stoll(it->second);
+      else if(it->first == "sample-s") config.sample = std::stoll(it->second);
+      else if(it->first == "warmup-s") config.warmup = std::stoll(it->second);
+      else if(it->first == "reconnect-s") config.reconnect = std::stoll(it->second);
+      else if(it->first == "spike-s") config.spike = std::stoll(it->second);
+      else if(it->first == "settle-s") config.settle = std::stoll(it->second);
+      else if(it->first == "window") config.window = std::stoll(it->second);
+      else if(it->first == "payload") config.payload = std::stoll(it->second);
+      else if(it->first == "channels") config.channels = std::stoll(it->second);
+      else if(it->first == "publish-rate") config.publishRate = std::stoll(it->second);
+      else if(it->first == "spike-requests") config.spikeRequests = std::stoll(it->second);
+      else if(it->first == "spike-messages") config.spikeMessages = std::stoll(it->second);
+      else if(it->first == "spike-large") config.spikeLarge = std::stoll(it->second);
+      else if(it->first == "drift-pct") config.driftPct = std::stod(it->second);
+      else if(it->first == "drift-slack-mb") config.driftSlackMb = std::stod(it->second);
+      else {
+        std::cerr << "Unknown option: --" << it->first << std::endl;
+        return false;
+      }
+    }
+  }
+  catch(const std::exception &exc) {
+    std::cerr << "Invalid numeric argument: " << exc.what() << std::endl;
+    return false;
+  }
+
+  return config.duration > 0 && config.sample > 0 && config.reconnect > 0 &&
+    config.spike > 0 && config.settle >= 0 && config.window > 0 &&
+    config.payload > 0 && config.channels > 0 && config.publishRate > 0;
+}
+
+static double rssMb() {
+  std::ifstream statm("/proc/self/statm");
+  long size = 0, resident = 0;
+  statm >> size >> resident;
+  return resident * sysconf(_SC_PAGESIZE) / (1024.0 * 1024.0);
+}
+
+static double trimmedRssMb() {
+#ifdef __GLIBC__
+  malloc_trim(0);
+#endif
+  return rssMb();
+}
+
+static double seconds(Clock::duration duration) {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(duration).count() / 1000.0;
+}
+
+//------------------------------------------------------------------------------
+// Keeps a window of requests in flight, alternating writes and reads.
+//------------------------------------------------------------------------------
+class RequestLoad {
+public:
+  RequestLoad(QClient &qcl, int64_t window, int64_t payload)
+  : cl(qcl), slots(window), windowSize(window), value(payload, 'v'),
+    thread(&RequestLoad::main, this) {}
+
+  void finish() {
+    stop = true;
+    thread.join();
+    slots.down(windowSize);
+  }
+
+  int64_t getCompleted() const {
+    return completed;
+  }
+
+  int64_t getFailed() const {
+    return failed;
+  }
+
+private:
+  void main() {
+    for(int64_t i = 0; !stop; i++) {
+      slots.down();
+
+      std::string key = "key-" + std::to_string(i % 1000);
+      EncodedRequest req = (i % 2 == 0) ? EncodedRequest::make("SET", key, value) :
+        EncodedRequest::make("GET", key);
+
+      cl.execute(std::move(req), [this](redisReplyPtr &&reply) {
+        (reply ? completed : failed)++;
+        slots.up();
+      });
+    }
+  }
+
+  QClient &cl;
+  Semaphore slots;
+  int64_t windowSize;
+  std::string value;
+  std::atomic<bool> stop {false};
+  std::atomic<int64_t> completed {0};
+  std::atomic<int64_t> failed {0};
+  std::thread thread;
+};
+
+//------------------------------------------------------------------------------
+// Publishes at a steady rate, both plain messages and shared hash updates.
+//------------------------------------------------------------------------------
+class PublishLoad {
+public:
+  PublishLoad(MockServer &srv, TransientSharedHash &hash, const BenchConfig &conf)
+  : server(srv), sharedHash(hash), config(conf), payload(conf.payload, 'p'),
+    thread(&PublishLoad::main, this) {}
+
+  void finish() {
+    stop = true;
+    thread.join();
+  }
+
+  int64_t getPublished() const {
+    return published;
+  }
+
+private:
+  void main() {
+    Clock::duration interval = std::chrono::nanoseconds(1000000000 / config.publishRate);
+    Clock::time_point next = Clock::now();
+
+    for(int64_t i = 0; !stop; i++) {
+      server.publish("soak-" + std::to_string(i % config.channels), payload);
+      sharedHash.set("key-" + std::to_string(i % 1000), payload);
+      published++;
+
+      next += interval;
+      std::this_thread::sleep_until(next);
+    }
+  }
+
+  MockServer &server;
+  TransientSharedHash &sharedHash;
+  const BenchConfig &config;
+  std::string payload;
+  std::atomic<bool> stop {false};
+  std::atomic<int64_t> published {0};
+  std::thread thread;
+};
+
+struct Sample {
+  double at;
+  double rss;
+  double allocatedMb;
+  int64_t pendingRequests;
+  int64_t executorQueue;
+  int64_t pushQueue;
+  size_t spikeQueue;
+  bool steady;
+};
+
+struct SpikeResult {
+  double at;
+  double before;
+  double peak;
+  double after;
+  double afterTrim;
+  double fillSeconds;
+};
+
+static double releasedPct(double before, double peak, double after) {
+  if(peak <= before) return 100;
+  return std::max(0.0, std::min(100.0, 100 * (peak - after) / (peak - before)));
+}
+
+int main(int argc, char **argv) {
+  BenchConfig config;
+  if(!parseArgs(argc, argv, config)) {
+    return 1;
+  }
+
+  MockServerConfig serverConfig;
+  serverConfig.replySize = config.payload;
+  MockServer server(serverConfig);
+  Members members("127.0.0.1", server.getPort());
+
+  Options opts;
+  opts.retryStrategy = RetryStrategy::InfiniteRetries();
+  QClient cl(members, std::move(opts));
+
+  Subscriber subscriber(members, SubscriptionOptions());
+  std::atomic<int64_t> deliveries {0};
+  std::vector<std::unique_ptr<Subscription>> subscriptions;
+  for(int64_t i = 0; i < config.channels; i++) {
+    subscriptions.emplace_back(subscriber.subscribe("soak-" + std::to_string(i)));
+    subscriptions.back()->attachCallback([&deliveries](Message &&msg) {
+      deliveries++;
+    });
+  }
+
+  // No callback: Spike messages pile up in here, until drained
+  std::unique_ptr<Subscription> spikeSubscription = subscriber.subscribe("soak-spike");
+
+  SubscriptionOptions sharedOpts;
+  sharedOpts.usePushTypes = true;
+  SharedManager sharedManager(members, std::move(sharedOpts));
+  std::unique_ptr<TransientSharedHash> sharedHash = sharedManager.makeTransientSharedHash("soak-hash");
+
+  Clock::time_point start = Clock::now();
+  std::vector<Sample> samples;
+  std::vector<SpikeResult> spikes;
+  int64_t lastAllocated = AllocationAccounting::get().totalBytes();
+
+  auto takeSample = [&](bool steady) {
+    ClientStatistics stats = cl.getStatistics();
+    int64_t allocated = stats.allocations.totalBytes();
+
+    samples.push_back(Sample { seconds(Clock::now() - start), rssMb(),
+      (allocated - lastAllocated) / (1024.0 * 1024.0), stats.pendingRequests,
+      stats.executorQueueDepth, stats.pushQueueDepth, spikeSubscription->size(),
+      steady && Clock::now() >= start + std::chrono::seconds(config.warmup) });
+
+    lastAllocated = allocated;
+  };
+
+  //----------------------------------------------------------------------------
+  // A spike: Fill every buffer up, wait until it's all there, release it, and
+  // see how much memory is given back.
+  //----------------------------------------------------------------------------
+  std::string large(1024 * 1024, 'l');
+  std::string spikePayload(config.payload, 's');
+
+  auto runSpike = [&]() {
+    SpikeResult result;
+    result.at = seconds(Clock::now() - start);
+    result.before = rssMb();
+
+    Clock::time_point filling = Clock::now();
+    std::vector<std::future<redisReplyPtr>> futures;
+    futures.reserve(config.spikeRequests + config.spikeLarge);
+
+    for(int64_t i = 0; i < config.spikeRequests; i++) {
+      futures.emplace_back(cl.exec("GET", "spike"));
+    }
+
+    // PING echoes its argument, for large replies
+    for(int64_t i = 0; i < config.spikeLarge; i++) {
+      futures.emplace_back(cl.exec("PING", large));
+    }
+
+    for(int64_t i = 0; i < config.spikeMessages; i++) {
+      server.publish("soak-spike", spikePayload);
+    }
+
+    for(size_t i = 0; i < futures.size(); i++) {
+      futures[i].wait();
+    }
+
+    Clock::time_point deadline = Clock::now() + std::chrono::seconds(60);
+    while(spikeSubscription->size() < (size_t) config.spikeMessages && Clock::now() < deadline) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    result.fillSeconds = seconds(Clock::now() - filling);
+    result.peak = rssMb();
+    takeSample(false);
+
+    futures.clear();
+    futures.shrink_to_fit();
+
+    std::vector<Message> drained;
+    spikeSubscription->drain(drained);
+    drained.clear();
+    drained.shrink_to_fit();
+
+    Clock::time_point settled = Clock::now() + std::chrono::seconds(config.settle);
+    while(Clock::now() < settled) {
+      std::this_thread::sleep_for(std::chrono::seconds(std::min<int64_t>(config.sample, config.settle)));
+      takeSample(false);
+    }
+
+    result.after = rssMb();
+    result.afterTrim = trimmedRssMb();
+    spikes.push_back(result);
+  };
+
+  RequestLoad requests(cl, config.window, config.payload);
+  PublishLoad publishing(server, *sharedHash, config);
+
+  Clock::time_point end = start + std::chrono::seconds(config.duration);
+  Clock::time_point nextSample = start + std::chrono::seconds(config.sample);
+  Clock::time_point nextReconnect = start + std::chrono::seconds(config.reconnect);
+  Clock::time_point nextSpike = start + std::chrono::seconds(config.spike);
+
+  while(Clock::now() < end) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    Clock::time_point now = Clock::now();
+
+    if(now >= nextSample) {
+      takeSample(true);
+      nextSample += std::chrono::seconds(config.sample);
+    }
+
+    if(now >= nextReconnect) {
+      server.kill();
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+      server.revive();
+      nextReconnect = Clock::now() + std::chrono::seconds(config.reconnect);
+    }
+
+    if(now >= nextSpike) {
+      runSpike();
+
+      // Whatever came due while the spike ran would be tainted by it
+      now = Clock::now();
+      nextSample = now + std::chrono::seconds(config.sample);
+      nextSpike = now + std::chrono::seconds(config.spike);
+    }
+  }
+
+  requests.finish();
+  publishing.finish();
+  ClientStatistics stats = cl.getStatistics();
+
+  int64_t sharedKeys = 0;
+  for(int64_t i = 0; i < 1000; i++) {
+    std::string value;
+    if(sharedHash->get("key-" + std::to_string(i), value)) sharedKeys++;
+  }
+
+  //----------------------------------------------------------------------------
+  // Steady-state drift: First third against last third
+  //----------------------------------------------------------------------------
+  std::vector<double> steady;
+  for(const Sample &sample : samples) {
+    if(sample.steady) steady.push_back(sample.rss);
+  }
+
+  size_t third = steady.size() / 3;
+  bool driftChecked = (third >= 2);
+  double baseline = 0, latest = 0;
+
+  if(driftChecked) {
+    for(size_t i = 0; i < third; i++) {
+      baseline += steady[i] / third;
+      latest += steady[steady.size() - third + i] / third;
+    }
+  }
+
+  double allowed = std::max(config.driftSlackMb, baseline * config.driftPct / 100);
+  bool drifting = driftChecked && (latest - baseline > allowed);
+
+  std::ostringstream spikeList;
+  for(size_t i = 0; i < spikes.size(); i++) {
+    const SpikeResult &spike = spikes[i];
+    spikeList << (i == 0 ? "" : ",") << std::endl
+      << "    {\"at_s\": " << spike.at
+      << ", \"fill_s\": " << spike.fillSeconds
+      << ", \"before_mb\": " << spike.before
+      << ", \"peak_mb\": " << spike.peak
+      << ", \"after_mb\": " << spike.after
+      << ", \"after_trim_mb\": " << spike.afterTrim
+      << ", \"released_pct\": " << releasedPct(spike.before, spike.peak, spike.after)
+      << ", \"released_trim_pct\": " << releasedPct(spike.before, spike.peak, spike.afterTrim) << "}";
+  }
+
+  std::ostringstream sampleList;
+  for(size_t i = 0; i < samples.size(); i++) {
+    const Sample &sample = samples[i];
+    sampleList << (i == 0 ? "" : ",") << std::endl
+      << "    {\"at_s\": " << sample.at
+      << ", \"rss_mb\": " << sample.rss
+      << ", \"allocated_mb\": " << sample.allocatedMb
+      << ", \"pending_requests\": " << sample.pendingRequests
+      << ", \"executor_queue\": " << sample.executorQueue
+      << ", \"push_queue\": " << sample.pushQueue
+      << ", \"spike_queue\": " << sample.spikeQueue
+      << ", \"steady\": " << (sample.steady ? "true" : "false") << "}";
+  }
+
+  std::cout << "{" << std::endl
+    << "  \"duration_s\": " << config.duration << "," << std::endl
+    << "  \"window\": " << config.window << "," << std::endl
+    << "  \"payload\": " << config.payload << "," << std::endl
+    << "  \"publish_rate\": " << config.publishRate << "," << std::endl
+    << "  \"requests_completed\": " << requests.getCompleted() << "," << std::endl
+    << "  \"requests_failed\": " << requests.getFailed() << "," << std::endl
+    << "  \"published\": " << publishing.getPublished() << "," << std::endl
+    << "  \"deliveries\": " << deliveries << "," << std::endl
+    << "  \"shared_keys_visible\": " << sharedKeys << "," << std::endl
+    << "  \"reconnects\": " << stats.reconnects << "," << std::endl
+    << "  \"server_connections\": " << server.getConnectionsAccepted() << "," << std::endl
+    << "  \"allocation_accounting\": " << (AllocationAccounting::enabled() ? "true" : "false") << "," << std::endl
+    << "  \"drift_checked\": " << (driftChecked ? "true" : "false") << "," << std::endl
+    << "  \"baseline_rss_mb\": " << baseline << "," << std::endl
+    << "  \"final_rss_mb\": " << latest << "," << std::endl
+    << "  \"allowed_drift_mb\": " << allowed << "," << std::endl
+    << "  \"drifting\": " << (drifting ? "true" : "false") << "," << std::endl
+    << "  \"spikes\": [" << spikeList.str() << std::endl
+    << "  ]," << std::endl
+    << "  \"samples\": [" << sampleList.str() << std::endl
+    << "  ]" << std::endl
+    << "}" << std::endl;
+
+  if(drifting) {
+    std::cerr << "Steady-state memory drifted from " << baseline << " MB to "
+      << latest << " MB, more than the allowed " << allowed << " MB" << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
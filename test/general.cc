@@ -26,15 +26,39 @@
 #include "qclient/EncodedRequest.hh"
 #include "qclient/ResponseBuilder.hh"
 #include "qclient/MultiBuilder.hh"
+#include <limits>
 #include "qclient/Handshake.hh"
+#include "qclient/RequestTracer.hh"
+#include "qclient/AsyncLogger.hh"
 #include "qclient/network/HostResolver.hh"
+#include "qclient/network/DnsCache.hh"
+#include "qclient/network/LatencyProber.hh"
 #include "qclient/pubsub/MessageQueue.hh"
 #include "qclient/Status.hh"
 #include "qclient/QuarkDBVersion.hh"
+#include "qclient/ReplyFuture.hh"
+#include "qclient/ReplyCallback.hh"
+#include "qclient/Coroutines.hh"
+#include "qclient/structures/QHashCache.hh"
+#include "qclient/pubsub/Message.hh"
+#include "qclient/utils/SteadyClock.hh"
+#include "qclient/utils/AllocationAccounting.hh"
+#include "qclient/ShardedClient.hh"
+#include "qclient/AssistedThread.hh"
 #include "ConnectionCore.hh"
+#include "FutureHandler.hh"
+#include "TimerWheel.hh"
+#include "BackpressureApplier.hh"
+#include "qclient/MemoryBudget.hh"
+#include "qclient/RateLimiter.hh"
+#include "ReconnectBackoff.hh"
+#include "LeaderHints.hh"
 #include "ReplyMacros.hh"
 
 #include "gtest/gtest.h"
+#include <thread>
+#include <array>
+#include <condition_variable>
 using namespace qclient;
 
 TEST(GlobalInterceptor, BasicSanity) {
@@ -60,6 +84,139 @@ TEST(EncodedRequest, BasicSanity) {
   ASSERT_EQ("*3\\x0D\\x0A$3\\x0D\\x0Aset\\x0D\\x0A$4\\x0D\\x0A1234\\x0D\\x0A$3\\x0D\\x0Aabc\\x0D\\x0A", encoded.toPrintableString());
 }
 
+TEST(EncodedRequest, InlineStorage) {
+  EncodedRequest small = EncodedRequest::make("get", "key");
+  ASSERT_TRUE(small.isInline());
+  ASSERT_EQ("*2\r\n$3\r\nget\r\n$3\r\nkey\r\n", std::string(small.getBuffer(), small.getLen()));
+
+  std::string value(EncodedRequest::kInlineCapacity, 'a');
+  EncodedRequest large = EncodedRequest::make("set", "key", value);
+  ASSERT_FALSE(large.isInline());
+  ASSERT_EQ("*3\r\n$3\r\nset\r\n$3\r\nkey\r\n$64\r\n" + value + "\r\n", std::string(large.getBuffer(), large.getLen()));
+
+  EncodedRequest moved(std::move(small));
+  ASSERT_TRUE(moved.isInline());
+  ASSERT_EQ("*2\r\n$3\r\nget\r\n$3\r\nkey\r\n", std::string(moved.getBuffer(), moved.getLen()));
+
+  moved = std::move(large);
+  ASSERT_FALSE(moved.isInline());
+  ASSERT_EQ(moved.getLen(), 29u + value.size());
+}
+
+TEST(EncodedRequest, IntegerArguments) {
+  ASSERT_EQ(EncodedRequest::make("HSCAN", "key", "0", "COUNT", 100),
+            EncodedRequest::make("HSCAN", "key", "0", "COUNT", "100"));
+
+  ASSERT_EQ(EncodedRequest::make("HINCRBY", "key", "f", -42LL),
+            EncodedRequest::make("HINCRBY", "key", "f", "-42"));
+
+  ASSERT_EQ(EncodedRequest::make("SET", 0u, std::numeric_limits<int64_t>::min()),
+            EncodedRequest::make("SET", "0", "-9223372036854775808"));
+
+  ASSERT_EQ(EncodedRequest::make("SET", std::numeric_limits<uint64_t>::max(), (short) 7),
+            EncodedRequest::make("SET", "18446744073709551615", "7"));
+
+  MultiBuilder builder;
+  builder.emplace_back("LHSCAN", "key", "0", "COUNT", size_t(5));
+  std::deque<EncodedRequest> expected;
+  expected.emplace_back(EncodedRequest::make("LHSCAN", "key", "0", "COUNT", "5"));
+  ASSERT_EQ(builder.release(), EncodedRequest::fuseIntoBlockAndSurround(std::move(expected)));
+}
+
+TEST(EncodedRequest, Command) {
+  static constexpr Command<4> kSet("HSET");
+  static constexpr Command<1> kPing("PING");
+
+  ASSERT_EQ(std::string(kSet.data(), kSet.size()), "*4\r\n$4\r\nHSET\r\n");
+  ASSERT_EQ(kSet.make("key", "field", "value"), EncodedRequest::make("HSET", "key", "field", "value"));
+  ASSERT_EQ(kSet.make(std::string("key"), "field", 13), EncodedRequest::make("HSET", "key", "field", "13"));
+  ASSERT_EQ(kPing.make(), EncodedRequest::make("PING"));
+
+  std::string large(EncodedRequest::kInlineCapacity, 'a');
+  EncodedRequest req = kSet.make("key", "field", large);
+  ASSERT_FALSE(req.isInline());
+  ASSERT_EQ(req, EncodedRequest::make("HSET", "key", "field", large));
+
+  static constexpr Command<12> kLong("a-rather-long-command-name");
+  ASSERT_EQ(kLong.make(1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11),
+            EncodedRequest::make("a-rather-long-command-name", 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11));
+}
+
+TEST(EncodedRequest, DecimalLengths) {
+  std::vector<size_t> values = { 0, 9, 10, 99, 100, 999, 1000, 9999, 10000,
+    99999, 100000, 123456789, std::numeric_limits<size_t>::max() };
+
+  for(size_t value : values) {
+    std::vector<std::string> req { std::string(value % 4096, 'x') };
+    EncodedRequest encoded(req);
+    ASSERT_EQ(encoded.toString(), "*1\r\n$" + std::to_string(value % 4096) + "\r\n" + req[0] + "\r\n");
+    ASSERT_EQ(EncodedRequest::make(value), EncodedRequest::make(std::to_string(value)));
+  }
+}
+
+namespace {
+
+struct ArgumentView {
+  const char* data() const { return ptr; }
+  size_t size() const { return len; }
+
+  const char* ptr;
+  size_t len;
+};
+
+}
+
+TEST(EncodedRequest, TenMillionArguments) {
+  // Would have needed hundreds of MB of stack with per-argument VLAs
+  const size_t kArgs = 10000000;
+  const std::string arg = "ab";
+
+  std::vector<ArgumentView> args(kArgs, ArgumentView { arg.data(), arg.size() });
+  EncodedRequest encoded(args);
+
+  const std::string header = "*10000000\r\n";
+  const std::string chunk = "$2\r\nab\r\n";
+  ASSERT_EQ(encoded.getLen(), header.size() + kArgs * chunk.size());
+  ASSERT_EQ(std::string(encoded.getBuffer(), header.size() + chunk.size()), header + chunk);
+  ASSERT_EQ(std::string(encoded.getBuffer() + encoded.getLen() - chunk.size(), chunk.size()), chunk);
+
+  std::vector<const char*> cstr(kArgs, arg.data());
+  std::vector<size_t> sizes(kArgs, arg.size());
+  EncodedRequest fromChunks(kArgs, cstr.data(), sizes.data());
+  ASSERT_EQ(encoded, fromChunks);
+}
+
+TEST(EncodedRequest, ZeroCopy) {
+  std::string large(EncodedRequest::kZeroCopyThreshold, 'b');
+  const char* largeData = large.data();
+
+  EncodedRequest expected = EncodedRequest::make("set", "key", large);
+  std::vector<std::string> args {"set", "key"};
+  args.emplace_back(std::move(large));
+  EncodedRequest zc = EncodedRequest::makeZeroCopy(std::move(args));
+
+  ASSERT_FALSE(zc.isContiguous());
+  ASSERT_EQ(zc.getSegmentCount(), 3u);
+  ASSERT_EQ(zc.getSegment(1).data, largeData);
+  ASSERT_EQ(zc.getLen(), expected.getLen());
+  ASSERT_TRUE(zc == expected);
+
+  EncodedRequest moved(std::move(zc));
+  ASSERT_EQ(moved.getSegment(1).data, largeData);
+  ASSERT_EQ(moved.toString(), std::string(expected.getBuffer(), expected.getLen()));
+
+  // Small arguments only - falls back to a contiguous request
+  EncodedRequest small = EncodedRequest::makeZeroCopy(std::vector<std::string> {"get", "key"});
+  ASSERT_TRUE(small.isContiguous());
+  ASSERT_TRUE(small == EncodedRequest::make("get", "key"));
+
+  std::deque<EncodedRequest> reqs;
+  reqs.emplace_back(std::move(moved));
+  reqs.emplace_back(std::move(small));
+  EncodedRequest fused = EncodedRequest::fuseIntoBlock(reqs);
+  ASSERT_EQ(fused.toString(), expected.toString() + "*2\r\n$3\r\nget\r\n$3\r\nkey\r\n");
+}
+
 TEST(EncodedRequest, FusedEncodedRequest) {
   std::deque<EncodedRequest> reqs;
 
@@ -157,6 +314,258 @@ TEST(ConnectionCore, NoRetries) {
   ASSERT_REPLY(fut1, "UNAVAILABLE test test");
 }
 
+class RecordingCallback : public QCallback {
+public:
+  virtual void handleResponse(redisReplyPtr &&reply) override {
+    seen.push_back(reply->integer);
+  }
+
+  std::vector<int> seen;
+};
+
+TEST(ConnectionCore, CallbackThreadsKeepPerCallbackOrder) {
+  std::vector<RecordingCallback> callbacks(16);
+
+  {
+    ConnectionCore core(nullptr, nullptr, BackpressureStrategy::Default(), false,
+      nullptr, true, 4);
+
+    for(int i = 0; i < 500; i++) {
+      for(auto &cb : callbacks) {
+        core.stage(&cb, EncodedRequest::make("ping", "123"));
+      }
+    }
+
+    for(int i = 0; i < 500; i++) {
+      for(size_t j = 0; j < callbacks.size(); j++) {
+        ASSERT_TRUE(core.consumeResponse(ResponseBuilder::makeInt(i)));
+      }
+    }
+
+    // ConnectionCore destructor waits for all callbacks to run.
+  }
+
+  for(auto &cb : callbacks) {
+    ASSERT_EQ(cb.seen.size(), 500u);
+
+    for(int i = 0; i < 500; i++) {
+      ASSERT_EQ(cb.seen[i], i);
+    }
+  }
+}
+
+class InlineCallback : public RecordingCallback {
+public:
+  virtual bool runInline() const override {
+    return true;
+  }
+};
+
+TEST(ConnectionCore, InlineCallbacks) {
+  ConnectionCore core(nullptr, nullptr, BackpressureStrategy::Default(), false);
+  InlineCallback cb;
+
+  core.stage(&cb, EncodedRequest::make("ping", "123"));
+  core.stage(&cb, EncodedRequest::make("ping", "123"));
+
+  // Delivered before consumeResponse returns, no executor involved.
+  ASSERT_TRUE(core.consumeResponse(ResponseBuilder::makeInt(3)));
+  ASSERT_EQ(cb.seen, std::vector<int>{3});
+  ASSERT_TRUE(core.consumeResponse(ResponseBuilder::makeInt(4)));
+  ASSERT_EQ(cb.seen, (std::vector<int>{3, 4}));
+}
+
+class PurgeCountingCallback : public QCallback {
+public:
+  PurgeCountingCallback(bool inl = false) : inlineRun(inl) {}
+
+  virtual void handleResponse(redisReplyPtr &&reply) override {
+    if(!reply) nulls++;
+  }
+
+  virtual bool runInline() const override {
+    return inlineRun;
+  }
+
+  bool inlineRun;
+  std::atomic<int> nulls {0};
+};
+
+TEST(ConnectionCore, BulkPurge) {
+  std::vector<PurgeCountingCallback> callbacks(8);
+  PurgeCountingCallback inlineCallback(true);
+  std::vector<std::future<redisReplyPtr>> futs;
+
+  {
+    ConnectionCore core(nullptr, nullptr, BackpressureStrategy::Default(), false,
+      nullptr, true, 4);
+
+    for(int i = 0; i < 1000; i++) {
+      core.stage(&callbacks[i % callbacks.size()], EncodedRequest::make("ping", "123"));
+      core.stage(&inlineCallback, EncodedRequest::make("ping", "123"));
+      core.stage(nullptr, EncodedRequest::make("ping", "123"));
+      futs.emplace_back(core.stage(EncodedRequest::make("ping", "123")));
+    }
+
+    std::vector<StagedRequest*> batch;
+    ASSERT_EQ(core.getNextToWrite(batch, 10, 1024 * 1024), 10u);
+
+    // Everything is completed with nullptr, inline callbacks right away
+    ASSERT_EQ(core.clearAllPending(), 4000u);
+    ASSERT_EQ(inlineCallback.nulls, 1000);
+    ASSERT_EQ(core.getPendingRequests(), 0);
+
+    for(std::future<redisReplyPtr> &fut : futs) {
+      ASSERT_EQ(fut.get(), nullptr);
+    }
+
+    // Usable afterwards
+    std::future<redisReplyPtr> fut = core.stage(EncodedRequest::make("ping", "123"));
+    ASSERT_EQ(core.getNextToWrite(batch, 10, 1024), 1u);
+    ASSERT_TRUE(core.consumeResponse(ResponseBuilder::makeInt(5)));
+    ASSERT_EQ(fut.get()->integer, 5);
+  }
+
+  for(PurgeCountingCallback &cb : callbacks) {
+    ASSERT_EQ(cb.nulls, 125);
+  }
+}
+
+TEST(ReplyFuture, Basic) {
+  ReplyFuture fut = ReplyFuture::create();
+  QCallback *cb = fut.getCallback();
+  ASSERT_TRUE(fut.valid());
+  ASSERT_FALSE(fut.ready());
+  ASSERT_EQ(fut.wait_for(std::chrono::milliseconds(1)), std::future_status::timeout);
+
+  cb->handleResponse(ResponseBuilder::makeInt(5));
+  ASSERT_TRUE(fut.ready());
+  ASSERT_EQ(fut.wait_for(std::chrono::milliseconds(1)), std::future_status::ready);
+
+  redisReplyPtr reply = fut.get();
+  ASSERT_FALSE(fut.valid());
+  ASSERT_EQ(reply->integer, 5);
+
+  // Slot goes back to the pool, and is reused.
+  ReplyFuture fut2 = ReplyFuture::create();
+  ASSERT_EQ(fut2.getCallback(), cb);
+  cb->handleResponse(ResponseBuilder::makeInt(6));
+  ASSERT_EQ(fut2.get()->integer, 6);
+}
+
+TEST(ReplyFuture, CrossThread) {
+  for(size_t i = 0; i < 100; i++) {
+    ReplyFuture fut = ReplyFuture::create();
+    QCallback *cb = fut.getCallback();
+
+    std::thread th([cb, i]() {
+      if(i % 2 == 0) std::this_thread::sleep_for(std::chrono::microseconds(100));
+      cb->handleResponse(ResponseBuilder::makeInt(i));
+    });
+
+    ASSERT_EQ(fut.get()->integer, (int) i);
+    th.join();
+  }
+}
+
+TEST(ReplyFuture, AbandonedBeforeReply) {
+  QCallback *cb = nullptr;
+
+  {
+    ReplyFuture fut = ReplyFuture::create();
+    cb = fut.getCallback();
+  }
+
+  cb->handleResponse(ResponseBuilder::makeInt(1));
+}
+
+TEST(ConnectionCore, PooledFutures) {
+  ConnectionCore core(nullptr, nullptr, BackpressureStrategy::Default(), false);
+
+  ReplyFuture fut1 = ReplyFuture::create();
+  ReplyFuture fut2 = ReplyFuture::create();
+  core.stage(fut1.getCallback(), EncodedRequest::make("ping", "123"));
+  core.stage(fut2.getCallback(), EncodedRequest::make("ping", "123"));
+
+  ASSERT_TRUE(core.consumeResponse(ResponseBuilder::makeInt(1)));
+  ASSERT_EQ(fut1.get()->integer, 1);
+
+  // Pending requests are failed with nullptr.
+  ASSERT_EQ(core.clearAllPending(), 1u);
+  ASSERT_EQ(fut2.get(), nullptr);
+}
+
+TEST(ReplyCallback, Storage) {
+  int calls = 0;
+  ReplyCallback small([&calls](redisReplyPtr &&reply) { calls += reply->integer; });
+  ASSERT_TRUE(small);
+  ASSERT_TRUE(small.isInline());
+
+  std::array<char, 100> padding {};
+  ReplyCallback large([&calls, padding](redisReplyPtr &&reply) { calls += reply->integer + padding[0]; });
+  ASSERT_FALSE(large.isInline());
+
+  ReplyCallback moved(std::move(small));
+  ASSERT_FALSE(small);
+  moved(ResponseBuilder::makeInt(2));
+  large(ResponseBuilder::makeInt(3));
+  ASSERT_EQ(calls, 5);
+
+  // Captures are destroyed along with the callback.
+  std::shared_ptr<int> tracker = std::make_shared<int>(1);
+  {
+    ReplyCallback cb([tracker](redisReplyPtr &&reply) {});
+    ReplyCallback cb2;
+    cb2 = std::move(cb);
+    ASSERT_EQ(tracker.use_count(), 2);
+  }
+  ASSERT_EQ(tracker.use_count(), 1);
+}
+
+TEST(ConnectionCore, FutureSlotTravelsWithRequest) {
+  FutureSlot slot;
+  std::future<redisReplyPtr> fut = slot.getFuture();
+  ReplyCallback cb(std::move(slot));
+  ASSERT_TRUE(cb.isInline());
+  cb(ResponseBuilder::makeInt(7));
+  ASSERT_EQ(fut.get()->integer, 7);
+
+  std::future<redisReplyPtr> broken;
+  {
+    ConnectionCore core(nullptr, nullptr, BackpressureStrategy::Default(), false);
+    std::future<redisReplyPtr> first = core.stage(EncodedRequest::make("ping", "1"));
+    broken = core.stage(EncodedRequest::make("ping", "2"));
+
+    ASSERT_TRUE(core.consumeResponse(ResponseBuilder::makeInt(1)));
+    ASSERT_EQ(first.get()->integer, 1);
+  }
+
+  // The promise goes away along with its request
+  ASSERT_THROW(broken.get(), std::future_error);
+}
+
+TEST(ConnectionCore, LambdaCallbacks) {
+  std::vector<int> seen;
+
+  {
+    ConnectionCore core(nullptr, nullptr, BackpressureStrategy::Default(), false);
+
+    for(int i = 0; i < 10; i++) {
+      core.stage([&seen](redisReplyPtr &&reply) {
+        seen.push_back(reply ? reply->integer : -1);
+      }, EncodedRequest::make("ping", "123"));
+    }
+
+    for(int i = 0; i < 8; i++) {
+      ASSERT_TRUE(core.consumeResponse(ResponseBuilder::makeInt(i)));
+    }
+
+    ASSERT_EQ(core.clearAllPending(), 2u);
+  }
+
+  ASSERT_EQ(seen, (std::vector<int>{0, 1, 2, 3, 4, 5, 6, 7, -1, -1}));
+}
+
 TEST(ConnectionCore, BasicSanity) {
   ConnectionCore core(nullptr, nullptr, BackpressureStrategy::Default(), true);
 
@@ -389,194 +798,1053 @@ TEST(ConnectionCore, NonExclusivePubsub) {
   ASSERT_EQ(fut3.wait_for(std::chrono::seconds(0)), std::future_status::timeout);
 }
 
-TEST(EndpointDecider, BasicSanity) {
-  StandardErrorLogger logger;
-  Members members;
-  members.push_back(Endpoint("host1.cern.ch", 1234));
-  members.push_back(Endpoint("host2.cern.ch", 2345));
-  members.push_back(Endpoint("host3.cern.ch", 3456));
+TEST(ConnectionCore, BatchDequeue) {
+  ConnectionCore core(nullptr, nullptr, BackpressureStrategy::Default(), true);
 
-  HostResolver resolver(&logger);
-  EndpointDecider decider(&logger, &resolver, members);
+  std::future<redisReplyPtr> fut1 = core.stage(EncodedRequest::make("ping", "1"));
+  std::future<redisReplyPtr> fut2 = core.stage(EncodedRequest::make("ping", "2"));
+  std::future<redisReplyPtr> fut3 = core.stage(EncodedRequest::make("ping", "3"));
+  std::future<redisReplyPtr> fut4 = core.stage(EncodedRequest::make("ping", "4"));
+  std::future<redisReplyPtr> fut5 = core.stage(EncodedRequest::make("ping", "5"));
 
-  ASSERT_EQ(decider.getNext(), Endpoint("host1.cern.ch", 1234));
-  ASSERT_EQ(decider.getNext(), Endpoint("host2.cern.ch", 2345));
+  std::vector<StagedRequest*> batch;
+  ASSERT_EQ(core.getNextToWrite(batch, 3, 1024), 3u);
+  ASSERT_EQ(std::string(batch[0]->getBuffer(), batch[0]->getLen()), "*2\r\n$4\r\nping\r\n$1\r\n1\r\n");
+  ASSERT_EQ(std::string(batch[2]->getBuffer(), batch[2]->getLen()), "*2\r\n$4\r\nping\r\n$1\r\n3\r\n");
 
-  decider.registerRedirection(Endpoint("host4.cern.ch", 9999));
-  ASSERT_EQ(decider.getNext(), Endpoint("host4.cern.ch", 9999));
-  ASSERT_EQ(decider.getNext(), Endpoint("host3.cern.ch", 3456));
-  ASSERT_EQ(decider.getNext(), Endpoint("host1.cern.ch", 1234));
-}
+  // Byte budget is exhausted by the first request, but we always get one
+  ASSERT_EQ(core.getNextToWrite(batch, 10, 1), 1u);
+  ASSERT_EQ(std::string(batch[0]->getBuffer(), batch[0]->getLen()), "*2\r\n$4\r\nping\r\n$1\r\n4\r\n");
 
-TEST(MultiBuilder, BasicSanity) {
-  MultiBuilder builder;
-  builder.emplace_back("GET", "123");
-  builder.emplace_back("GET", "234");
+  ASSERT_EQ(core.getNextToWrite(batch, 10, 1024), 1u);
+  ASSERT_EQ(std::string(batch[0]->getBuffer(), batch[0]->getLen()), "*2\r\n$4\r\nping\r\n$1\r\n5\r\n");
 
-  ASSERT_EQ(builder.size(), 2u);
-  ASSERT_EQ(builder.getDeque()[0], EncodedRequest::make("GET", "123"));
-  ASSERT_EQ(builder.getDeque()[1], EncodedRequest::make("GET", "234"));
+  core.setBlockingMode(false);
+  ASSERT_EQ(core.getNextToWrite(batch, 10, 1024), 0u);
+  ASSERT_TRUE(batch.empty());
 }
 
-TEST(ServiceEndpoint, BasicSanity) {
-  ServiceEndpoint ipv4(ProtocolType::kIPv4, SocketType::kStream, "192.168.1.100", 9999, "example.com");
-  ASSERT_EQ(ipv4.getPort(), 9999);
-  ASSERT_EQ(ipv4.getPrintableAddress(), "192.168.1.100");
-  ASSERT_EQ(ipv4.getOriginalHostname(), "example.com");
-
-  ServiceEndpoint ipv6(ProtocolType::kIPv6, SocketType::kStream, "2001:db8:85a3:8d3:1319:8a2e:370:7348", 8888, "example.com");
-  ASSERT_EQ(ipv6.getPort(), 8888);
-  ASSERT_EQ(ipv6.getPrintableAddress(), "2001:db8:85a3:8d3:1319:8a2e:370:7348");
-  ASSERT_EQ(ipv6.getOriginalHostname(), "example.com");
-}
+TEST(ConnectionCore, OptimisticHandshake) {
+  PingHandshake handshake("hi");
+  ConnectionCore core(nullptr, &handshake, BackpressureStrategy::Default(), false);
 
-TEST(HostResolver, BasicSanity) {
-  StandardErrorLogger logger;
-  HostResolver resolver(&logger);
+  std::future<redisReplyPtr> fut1 = core.stage(EncodedRequest::make("ping", "1"));
+  std::future<redisReplyPtr> fut2 = core.stage(EncodedRequest::make("ping", "2"));
 
-  std::vector<ServiceEndpoint> endpoints;
-  endpoints.emplace_back(ProtocolType::kIPv4, SocketType::kStream, "192.168.1.100", 4444, "1.example.com");
-  endpoints.emplace_back(ProtocolType::kIPv6, SocketType::kStream, "2001:db8:85a3:8d3:1319:8a2e:370:7348", 4444, "2.example.com");
-  resolver.feedFake("example.com", 4444, endpoints);
+  // Not enabled, only the handshake goes out
+  std::vector<StagedRequest*> batch;
+  ASSERT_EQ(core.getNextToWrite(batch, 10, 1024), 1u);
+  ASSERT_EQ(std::string(batch[0]->getBuffer(), batch[0]->getLen()), "*2\r\n$4\r\nPING\r\n$2\r\nhi\r\n");
 
-  Status st;
-  ASSERT_EQ(resolver.resolve("example.com", 4444, st), endpoints);
-  ASSERT_TRUE(st.ok());
-  ASSERT_TRUE(st);
+  core.setOptimisticHandshake(true);
+  core.reconnection();
 
-  ASSERT_TRUE(resolver.resolve("3.example.com", 5555, st).empty());
-  ASSERT_FALSE(st.ok());
-  ASSERT_FALSE(st);
-  ASSERT_EQ(st.getErrc(), ENOENT);
-}
+  // User requests go out in the same batch
+  ASSERT_EQ(core.getNextToWrite(batch, 10, 1024), 3u);
+  ASSERT_EQ(std::string(batch[0]->getBuffer(), batch[0]->getLen()), "*2\r\n$4\r\nPING\r\n$2\r\nhi\r\n");
+  ASSERT_EQ(std::string(batch[1]->getBuffer(), batch[1]->getLen()), "*2\r\n$4\r\nping\r\n$1\r\n1\r\n");
+  ASSERT_EQ(std::string(batch[2]->getBuffer(), batch[2]->getLen()), "*2\r\n$4\r\nping\r\n$1\r\n2\r\n");
 
-TEST(EndpointDecider, WithHostResolution) {
-  Members members;
-  members.push_back("1.example.com", 3333);
-  members.push_back("2.example.com", 4444);
+  // Handshake fails - both are sent again on the next connection
+  ASSERT_FALSE(core.consumeResponse(ResponseBuilder::makeStr("chickens")));
+  core.reconnection();
 
-  StandardErrorLogger logger;
-  HostResolver resolver(&logger);
-  EndpointDecider decider(&logger, &resolver, members);
-  ASSERT_FALSE(decider.madeFullCircle());
+  ASSERT_EQ(core.getNextToWrite(batch, 10, 1024), 3u);
+  ASSERT_TRUE(core.consumeResponse(ResponseBuilder::makeStr("hi")));
+  ASSERT_TRUE(core.consumeResponse(ResponseBuilder::makeInt(1)));
+  ASSERT_TRUE(core.consumeResponse(ResponseBuilder::makeInt(2)));
+  ASSERT_REPLY(fut1, 1);
+  ASSERT_REPLY(fut2, 2);
+}
 
-  ServiceEndpoint ex3_1(ProtocolType::kIPv4, SocketType::kStream, "192.168.1.2", 5555, "3.example.com");
-  ServiceEndpoint ex3_2(ProtocolType::kIPv4, SocketType::kStream, "192.168.1.222", 5555, "3.example.com");
+TEST(ConnectionCore, OptimisticHandshakeChained) {
+  HandshakeChainer handshake(std::unique_ptr<Handshake>(new PingHandshake("one")),
+    std::unique_ptr<Handshake>(new PingHandshake("two")));
+  ConnectionCore core(nullptr, &handshake, BackpressureStrategy::Default(), false);
+  core.setOptimisticHandshake(true);
 
-  resolver.feedFake("3.example.com", 5555, { ex3_1, ex3_2 });
+  std::future<redisReplyPtr> fut1 = core.stage(EncodedRequest::make("ping", "1"));
 
-  // no DNS entries for 3.example.com
-  ServiceEndpoint connectToNext = ServiceEndpoint(ProtocolType::kIPv4, SocketType::kStream, "127.0.0.1", 9999, "example.com");
-  ASSERT_FALSE(decider.madeFullCircle());
-  ASSERT_FALSE(decider.getNextEndpoint(connectToNext));
-  ASSERT_TRUE(decider.madeFullCircle());
+  // The first stage has to be awaited, the second one not
+  std::vector<StagedRequest*> batch;
+  ASSERT_EQ(core.getNextToWrite(batch, 10, 1024), 1u);
+  ASSERT_TRUE(core.consumeResponse(ResponseBuilder::makeStr("one")));
 
-  // only 1.example.com has valid entries
-  std::vector<ServiceEndpoint> endpoints;
-  endpoints.emplace_back(ProtocolType::kIPv4, SocketType::kStream, "192.168.1.3", 3333, "1.example.com");
-  endpoints.emplace_back(ProtocolType::kIPv6, SocketType::kStream, "2001:db8:85a3:8d3:1319:8a2e:370:7348", 3333, "1.example.com");
-  resolver.feedFake("1.example.com", 3333, endpoints);
+  ASSERT_EQ(core.getNextToWrite(batch, 10, 1024), 2u);
+  ASSERT_EQ(std::string(batch[0]->getBuffer(), batch[0]->getLen()), "*2\r\n$4\r\nPING\r\n$3\r\ntwo\r\n");
+  ASSERT_EQ(std::string(batch[1]->getBuffer(), batch[1]->getLen()), "*2\r\n$4\r\nping\r\n$1\r\n1\r\n");
 
-  ASSERT_TRUE(decider.getNextEndpoint(connectToNext));
-  ASSERT_EQ(connectToNext, endpoints[0]);
+  ASSERT_TRUE(core.consumeResponse(ResponseBuilder::makeStr("two")));
+  ASSERT_TRUE(core.consumeResponse(ResponseBuilder::makeInt(1)));
+  ASSERT_REPLY(fut1, 1);
+}
 
-  ASSERT_TRUE(decider.getNextEndpoint(connectToNext));
-  ASSERT_EQ(connectToNext, endpoints[1]);
+TEST(ScriptLoadHandshake, BasicSanity) {
+  ASSERT_EQ(ScriptRegistry::digest("return 1"), "e0e1f9fabfc9d4800c877a703b823ac0578ff8db");
+
+  std::shared_ptr<ScriptRegistry> registry = std::make_shared<ScriptRegistry>();
+  ScriptLoadHandshake handshake(registry);
+
+  // Nothing to load yet
+  ASSERT_EQ(handshake.provideHandshake(), std::vector<std::string>({"PING", "qclient-script-load"}));
+  ASSERT_EQ(handshake.validateResponse(ResponseBuilder::makeStr("qclient-script-load")), Handshake::Status::VALID_COMPLETE);
+
+  ASSERT_EQ(registry->add("return 1"), "e0e1f9fabfc9d4800c877a703b823ac0578ff8db");
+  ASSERT_EQ(registry->add("return 2"), ScriptRegistry::digest("return 2"));
+  ASSERT_EQ(registry->add("return 1"), "e0e1f9fabfc9d4800c877a703b823ac0578ff8db");
+  ASSERT_EQ(registry->size(), 2u);
+
+  // Failures are ignored, the NOSCRIPT path takes care of them
+  handshake.restart();
+  ASSERT_EQ(handshake.provideHandshake()[1], "LOAD");
+  ASSERT_FALSE(handshake.pipelinable());
+  ASSERT_EQ(handshake.validateResponse(ResponseBuilder::makeErr("ERR compilation failed")), Handshake::Status::VALID_INCOMPLETE);
+  ASSERT_EQ(handshake.provideHandshake()[1], "LOAD");
+  ASSERT_TRUE(handshake.pipelinable());
+  ASSERT_EQ(handshake.validateResponse(ResponseBuilder::makeStr("sha")), Handshake::Status::VALID_COMPLETE);
+}
 
-  // cycle back to 1.example.com, since 2.example.com has no entry
-  ASSERT_TRUE(decider.getNextEndpoint(connectToNext));
-  ASSERT_EQ(connectToNext, endpoints[0]);
+TEST(CapabilityHandshake, QuarkDB) {
+  std::vector<ServerCapabilities> reported;
+  CapabilityHandshake handshake([&reported](const ServerCapabilities &caps) {
+    reported.emplace_back(caps);
+  }, true);
+
+  ASSERT_FALSE(handshake.pipelinable());
+  ASSERT_EQ(handshake.provideHandshake(), std::vector<std::string>({"QUARKDB-VERSION"}));
+  ASSERT_EQ(handshake.validateResponse(ResponseBuilder::makeStr("0.4.3.7.c60ff8c")), Handshake::Status::VALID_INCOMPLETE);
+
+  ASSERT_EQ(reported.size(), 1u);
+  ASSERT_TRUE(reported[0].negotiated());
+  ASSERT_EQ(reported[0].getServer(), ServerCapabilities::Server::kQuarkDB);
+  ASSERT_TRUE(reported[0].has(Capability::kPushTypes));
+  ASSERT_TRUE(reported[0].has(Capability::kIncrementalResilvering));
+  ASSERT_TRUE(reported[0].has(Capability::kBatchDequePop));
+  ASSERT_FALSE(reported[0].has(Capability::kClientTracking));
+  ASSERT_EQ(reported[0].toString(), "quarkdb 0.4.3.7.c60ff8c push-types incremental-resilvering batch-deque-pop");
+
+  // Push types get activated, and a refusal is fatal
+  ASSERT_EQ(handshake.provideHandshake(), std::vector<std::string>({"ACTIVATE-PUSH-TYPES"}));
+  ASSERT_EQ(handshake.validateResponse(ResponseBuilder::makeStatus("OK")), Handshake::Status::VALID_COMPLETE);
+
+  handshake.restart();
+  ASSERT_EQ(handshake.provideHandshake(), std::vector<std::string>({"QUARKDB-VERSION"}));
+  ASSERT_EQ(handshake.validateResponse(ResponseBuilder::makeStr("0.4.2")), Handshake::Status::VALID_INCOMPLETE);
+  ASSERT_FALSE(reported[1].has(Capability::kBatchDequePop));
+  ASSERT_FALSE(reported[1].mayHave(Capability::kIncrementalResilvering));
+  ASSERT_EQ(handshake.validateResponse(ResponseBuilder::makeErr("ERR unknown command")), Handshake::Status::INVALID);
+
+  // Not asked to activate push types
+  CapabilityHandshake passive({}, false);
+  ASSERT_EQ(passive.validateResponse(ResponseBuilder::makeStr("0.4.3")), Handshake::Status::VALID_COMPLETE);
+}
 
-  ASSERT_TRUE(decider.getNextEndpoint(connectToNext));
-  ASSERT_EQ(connectToNext, endpoints[1]);
+TEST(CapabilityHandshake, RedisAndUnknownServers) {
+  ServerCapabilities last;
+  CapabilityHandshake handshake([&last](const ServerCapabilities &caps) {
+    last = caps;
+  }, true);
+
+  ASSERT_EQ(handshake.validateResponse(ResponseBuilder::makeErr("ERR unknown command 'QUARKDB-VERSION'")), Handshake::Status::VALID_INCOMPLETE);
+  ASSERT_FALSE(last.negotiated());
+  ASSERT_EQ(handshake.provideHandshake(), std::vector<std::string>({"INFO", "server"}));
+  ASSERT_EQ(handshake.validateResponse(ResponseBuilder::makeStr("# Server\r\nredis_version:7.2.4\r\nredis_mode:standalone\r\n")),
+    Handshake::Status::VALID_COMPLETE);
+
+  ASSERT_EQ(last.getServer(), ServerCapabilities::Server::kRedis);
+  ASSERT_EQ(last.getVersion(), QuarkDBVersion(7, 2, 4, ""));
+  ASSERT_TRUE(last.has(Capability::kClientTracking));
+  ASSERT_FALSE(last.has(Capability::kPushTypes));
+
+  // Neither question understood: Supports nothing, but still a valid peer
+  handshake.restart();
+  ASSERT_EQ(handshake.validateResponse(ResponseBuilder::makeErr("ERR")), Handshake::Status::VALID_INCOMPLETE);
+  ASSERT_EQ(handshake.validateResponse(ResponseBuilder::makeErr("ERR")), Handshake::Status::VALID_COMPLETE);
+  ASSERT_TRUE(last.negotiated());
+  ASSERT_EQ(last.getServer(), ServerCapabilities::Server::kUnknown);
+  ASSERT_FALSE(last.mayHave(Capability::kIncrementalResilvering));
+  ASSERT_EQ(last.toString(), "unknown server");
+}
 
-  // 2.example.com comes alive.. only an IPv4 here.
-  std::vector<ServiceEndpoint> endpoints2;
-  endpoints2.emplace_back(ProtocolType::kIPv4, SocketType::kStream, "192.168.1.4", 4444, "2.example.com");
-  resolver.feedFake("2.example.com", 4444, endpoints2);
+TEST(CapabilityCache, BasicSanity) {
+  ServerCapabilities unknown;
+  ASSERT_FALSE(unknown.negotiated());
+  ASSERT_FALSE(unknown.has(Capability::kPushTypes));
+  ASSERT_TRUE(unknown.mayHave(Capability::kPushTypes));
 
-  ASSERT_TRUE(decider.getNextEndpoint(connectToNext));
-  ASSERT_EQ(connectToNext, endpoints2[0]);
+  CapabilityCache cache;
+  ASSERT_FALSE(cache.get(Endpoint("host1", 7777)).negotiated());
 
-  ASSERT_TRUE(decider.getNextEndpoint(connectToNext));
-  ASSERT_EQ(connectToNext, endpoints[0]);
+  cache.store(Endpoint("host1", 7777), ServerCapabilities::forQuarkDB(QuarkDBVersion(0, 4, 3, "")));
+  cache.store(Endpoint("host2", 7777), ServerCapabilities::forRedis(QuarkDBVersion(5, 0, 0, "")));
+  ASSERT_EQ(cache.size(), 2u);
 
-  ASSERT_TRUE(decider.getNextEndpoint(connectToNext));
-  ASSERT_EQ(connectToNext, endpoints[1]);
+  ASSERT_TRUE(cache.get(Endpoint("host1", 7777)).has(Capability::kBatchDequePop));
+  ASSERT_TRUE(cache.get(Endpoint("host2", 7777)).negotiated());
+  ASSERT_FALSE(cache.get(Endpoint("host2", 7777)).has(Capability::kClientTracking));
+  ASSERT_FALSE(cache.get(Endpoint("host1", 7778)).negotiated());
+}
 
-  // hey, we just got a redirection to 3.example.com:5555
-  decider.registerRedirection(Endpoint("3.example.com", 5555));
+TEST(ConnectionCore, WaitUntilReady) {
+  PingHandshake handshake("hi");
+  ConnectionCore core(nullptr, &handshake, BackpressureStrategy::Default(), false);
 
-  ASSERT_TRUE(decider.getNextEndpoint(connectToNext));
-  ASSERT_EQ(connectToNext, ex3_1);
+  // Connected, but still handshaking
+  core.connectionEstablished();
+  ASSERT_FALSE(core.waitUntilReady(std::chrono::milliseconds(1)));
 
-  ASSERT_TRUE(decider.getNextEndpoint(connectToNext));
-  ASSERT_EQ(connectToNext, ex3_2);
+  std::future<bool> ready = std::async(std::launch::async, [&core]() {
+    return core.waitUntilReady(std::chrono::seconds(30));
+  });
 
-  // redirection hosts have been exhausted, back to cycling
-  ASSERT_TRUE(decider.getNextEndpoint(connectToNext));
-  ASSERT_EQ(connectToNext, endpoints2[0]);
+  std::vector<StagedRequest*> batch;
+  ASSERT_EQ(core.getNextToWrite(batch, 10, 1024), 1u);
+  ASSERT_TRUE(core.consumeResponse(ResponseBuilder::makeStr("hi")));
+  ASSERT_TRUE(ready.get());
 
-  ASSERT_TRUE(decider.getNextEndpoint(connectToNext));
-  ASSERT_EQ(connectToNext, endpoints[0]);
+  core.reconnection();
+  ASSERT_FALSE(core.waitUntilReady(std::chrono::milliseconds(1)));
 
-  ASSERT_TRUE(decider.getNextEndpoint(connectToNext));
-  ASSERT_EQ(connectToNext, endpoints[1]);
+  // Without a handshake, ready as soon as connected
+  ConnectionCore plain(nullptr, nullptr, BackpressureStrategy::Default(), false);
+  ASSERT_FALSE(plain.waitUntilReady(std::chrono::milliseconds(1)));
+  plain.connectionEstablished();
+  ASSERT_TRUE(plain.waitUntilReady(std::chrono::milliseconds(0)));
 }
 
-TEST(EndpointDecider, WithInterception) {
-  GlobalInterceptor::addIntercept(Endpoint("1.example.com", 1111), Endpoint("2.example.com", 3333));
+TEST(BackpressureApplier, ByteLimit) {
+  BackpressureApplier applier(BackpressureStrategy::RateLimitPendingBytes(100));
 
-  Members members;
-  members.push_back("1.example.com", 1111);
+  applier.reserve(60);
+  applier.reserve(40);
 
-  StandardErrorLogger logger;
-  HostResolver resolver(&logger);
-  EndpointDecider decider(&logger, &resolver, members);
+  std::future<void> fut = std::async(std::launch::async, [&applier]() {
+    applier.reserve(10);
+  });
 
-  std::vector<ServiceEndpoint> endpoints;
-  endpoints.emplace_back(ProtocolType::kIPv4, SocketType::kStream, "192.168.1.4", 3333, "2.example.com");
-  resolver.feedFake("2.example.com", 3333, endpoints);
+  ASSERT_EQ(fut.wait_for(std::chrono::milliseconds(50)), std::future_status::timeout);
+  applier.release(40);
+  ASSERT_EQ(fut.wait_for(std::chrono::seconds(5)), std::future_status::ready);
 
-  ServiceEndpoint ep;
-  ASSERT_FALSE(decider.madeFullCircle());
-  ASSERT_TRUE(decider.getNextEndpoint(ep));
-  ASSERT_TRUE(decider.madeFullCircle());
-  ASSERT_EQ(ep, endpoints[0]);
+  // Oversized request passes once everything else has drained
+  fut = std::async(std::launch::async, [&applier]() {
+    applier.reserve(5000);
+  });
 
-  // Status st;
-  // std::vector<ServiceEndpoint> endpoints2 = resolver.resolve("1.example.com", 1111, st);
-  // ASSERT_EQ(endpoints2.size(), 1u);
-  // ASSERT_EQ(endpoints2[0], endpoints[0]);
+  ASSERT_EQ(fut.wait_for(std::chrono::milliseconds(50)), std::future_status::timeout);
+  applier.release(60);
+  ASSERT_EQ(fut.wait_for(std::chrono::milliseconds(50)), std::future_status::timeout);
+  applier.release(10);
+  ASSERT_EQ(fut.wait_for(std::chrono::seconds(5)), std::future_status::ready);
 }
 
-TEST(EndpointDecider, MadeFullCircleAfterAllServiceEndpoints) {
-  Members members;
-  members.push_back("example.com", 1111);
+TEST(BackpressureApplier, TryReserveAndNotify) {
+  BackpressureApplier applier(BackpressureStrategy::RateLimitPendingRequests(4));
 
-  StandardErrorLogger logger;
-  HostResolver resolver(&logger);
-  EndpointDecider decider(&logger, &resolver, members);
+  for(size_t i = 0; i < 4; i++) {
+    ASSERT_TRUE(applier.tryReserve(10));
+  }
 
-  std::vector<ServiceEndpoint> endpoints;
-  endpoints.emplace_back(ProtocolType::kIPv4, SocketType::kStream, "127.0.0.1", 1111, "example.com");
-  endpoints.emplace_back(ProtocolType::kIPv4, SocketType::kStream, "127.0.0.1", 2222, "example.com");
+  ASSERT_FALSE(applier.tryReserve(10));
+  ASSERT_FALSE(applier.belowLowWaterMark());
 
-  resolver.feedFake("example.com", 1111, endpoints);
+  size_t notifications = 0u;
+  applier.notifyWhenCapacityAvailable([&notifications]() { notifications++; });
+  ASSERT_EQ(notifications, 0u);
 
-  ServiceEndpoint ep;
-  ASSERT_FALSE(decider.madeFullCircle());
-  ASSERT_TRUE(decider.getNextEndpoint(ep));
-  ASSERT_EQ(ep, endpoints[0]);
-  ASSERT_FALSE(decider.madeFullCircle());
+  applier.release(10);
+  ASSERT_EQ(notifications, 0u);
+  applier.release(10);
+  ASSERT_EQ(notifications, 1u);
 
-  ASSERT_TRUE(decider.getNextEndpoint(ep));
-  ASSERT_EQ(ep, endpoints[1]);
-  ASSERT_TRUE(decider.madeFullCircle());
+  // One-shot
+  applier.release(10);
+  ASSERT_EQ(notifications, 1u);
+
+  // Already below low-water mark, fires immediately
+  applier.notifyWhenCapacityAvailable([&notifications]() { notifications++; });
+  ASSERT_EQ(notifications, 2u);
 }
 
-TEST(QuarkDBVersion, BasicSanity) {
-  QuarkDBVersion v038(0, 3, 8, "");
+TEST(BackpressureApplier, AdaptiveWindow) {
+  BackpressureApplier applier(BackpressureStrategy::Adaptive(4, 1000, 100));
+  ASSERT_EQ(applier.getWindow(), 100);
+
+  // Flat latency: The window grows
+  for(size_t i = 0; i < 100; i++) {
+    applier.observeLatency(std::chrono::milliseconds(1));
+  }
+
+  int64_t grown = applier.getWindow();
+  ASSERT_GT(grown, 100);
+
+  for(int64_t i = 0; i < grown; i++) {
+    ASSERT_TRUE(applier.tryReserve(10));
+  }
+
+  ASSERT_FALSE(applier.tryReserve(10));
+
+  // Latency goes up as requests queue up: The window shrinks, and slots
+  // are withheld as requests are released
+  for(size_t round = 0; round < 10; round++) {
+    for(int64_t i = 0; i < applier.getWindow(); i++) {
+      applier.observeLatency(std::chrono::milliseconds(10));
+    }
+  }
+
+  int64_t shrunk = applier.getWindow();
+  ASSERT_LT(shrunk, grown);
+  ASSERT_GE(shrunk, 4);
+
+  for(int64_t i = 0; i < grown; i++) {
+    applier.release(10);
+  }
+
+  for(int64_t i = 0; i < shrunk; i++) {
+    ASSERT_TRUE(applier.tryReserve(10));
+  }
+
+  ASSERT_FALSE(applier.tryReserve(10));
+  ASSERT_EQ(applier.getPendingRequests(), shrunk);
+}
+
+TEST(BackpressureApplier, FixedWindow) {
+  BackpressureApplier applier(BackpressureStrategy::RateLimitPendingRequests(8));
+  ASSERT_EQ(applier.getWindow(), 8);
+
+  applier.observeLatency(std::chrono::milliseconds(1));
+  ASSERT_EQ(applier.getWindow(), 8);
+
+  BackpressureApplier unlimited(BackpressureStrategy::InfinitePendingRequests());
+  ASSERT_EQ(unlimited.getWindow(), 0);
+}
+
+TEST(RateLimiter, TokenBucket) {
+  RateLimiter limiter(1000, 10, std::chrono::milliseconds(1000));
+  RateLimiter::Clock::time_point start = RateLimiter::Clock::now() + std::chrono::seconds(1);
+
+  // A full second's worth of burst to begin with
+  RateLimiter::Allowance allowance = limiter.getAllowance(start);
+  ASSERT_EQ(allowance.requests, 10u);
+  ASSERT_EQ(allowance.bytes, 1000u);
+  ASSERT_EQ(limiter.getDelay(start), std::chrono::nanoseconds(0));
+
+  // A single huge request goes into debt: 2000 bytes take 2 seconds to repay
+  limiter.consume(1, 3000, start);
+  ASSERT_EQ(limiter.getAllowance(start).requests, 0u);
+  ASSERT_GE(limiter.getDelay(start), std::chrono::milliseconds(2000));
+  ASSERT_LE(limiter.getDelay(start), std::chrono::milliseconds(2002));
+
+  RateLimiter::Clock::time_point later = start + std::chrono::milliseconds(2101);
+  allowance = limiter.getAllowance(later);
+  ASSERT_EQ(allowance.requests, 10u);
+  ASSERT_GE(allowance.bytes, 100u);
+  ASSERT_LE(allowance.bytes, 101u);
+
+  // Runtime change: More bytes, no limit on requests. Tokens carry over.
+  limiter.setRates(100000, 0);
+  ASSERT_EQ(limiter.getBytesPerSecond(), 100000u);
+  ASSERT_EQ(limiter.getRequestsPerSecond(), 0u);
+
+  allowance = limiter.getAllowance(later);
+  ASSERT_EQ(allowance.requests, std::numeric_limits<size_t>::max());
+  ASSERT_GE(allowance.bytes, 100u);
+
+  // Unlimited again: Nothing ever waits
+  limiter.setRates(0, 0);
+  limiter.consume(1000000, 1000000000);
+  ASSERT_EQ(limiter.getDelay(), std::chrono::nanoseconds(0));
+  ASSERT_EQ(limiter.getRequestsConsumed(), 1000001u);
+}
+
+TEST(MemoryBudget, BasicSanity) {
+  using Category = MemoryBudget::Category;
+  MemoryBudget budget(100);
+
+  ASSERT_TRUE(budget.tryAcquire(Category::kStagedRequests, 60));
+  ASSERT_FALSE(budget.tryAcquire(Category::kStagedRequests, 50));
+  budget.charge(Category::kUnparsedInput, 30);
+  ASSERT_EQ(budget.getUsage(), 90u);
+  ASSERT_EQ(budget.getUsage(Category::kStagedRequests), 60u);
+  ASSERT_EQ(budget.getUsage(Category::kUnparsedInput), 30u);
+  ASSERT_FALSE(budget.exhausted());
+
+  // Charging is never refused
+  budget.charge(Category::kUnparsedInput, 30);
+  ASSERT_TRUE(budget.exhausted());
+
+  std::future<void> fut = std::async(std::launch::async, [&budget]() {
+    budget.acquire(Category::kStagedRequests, 40);
+  });
+
+  ASSERT_EQ(fut.wait_for(std::chrono::milliseconds(50)), std::future_status::timeout);
+  budget.release(Category::kUnparsedInput, 60);
+  ASSERT_EQ(fut.wait_for(std::chrono::seconds(5)), std::future_status::ready);
+  ASSERT_EQ(budget.getUsage(), 100u);
+  ASSERT_GT(budget.getBlockedTime().count(), 0);
+
+  // Oversized acquire passes once everything else has drained
+  fut = std::async(std::launch::async, [&budget]() {
+    budget.acquire(Category::kStagedRequests, 5000);
+  });
+
+  ASSERT_EQ(fut.wait_for(std::chrono::milliseconds(50)), std::future_status::timeout);
+  budget.release(Category::kStagedRequests, 100);
+  ASSERT_EQ(fut.wait_for(std::chrono::seconds(5)), std::future_status::ready);
+  ASSERT_EQ(budget.getUsage(), 5000u);
+  budget.release(Category::kStagedRequests, 5000);
+  ASSERT_EQ(budget.getUsage(), 0u);
+}
+
+TEST(BackpressureApplier, SharedMemoryBudget) {
+  std::shared_ptr<MemoryBudget> budget = std::make_shared<MemoryBudget>(100);
+
+  BackpressureApplier first(BackpressureStrategy::Default());
+  BackpressureApplier second(BackpressureStrategy::RateLimitPendingBytes(1000));
+  first.setMemoryBudget(budget);
+  second.setMemoryBudget(budget);
+
+  ASSERT_TRUE(first.tryReserve(80));
+  ASSERT_FALSE(second.tryReserve(30));
+  ASSERT_EQ(second.getPendingRequests(), 0);
+
+  std::future<void> fut = std::async(std::launch::async, [&second]() {
+    second.reserve(30);
+  });
+
+  ASSERT_EQ(fut.wait_for(std::chrono::milliseconds(50)), std::future_status::timeout);
+  first.release(80);
+  ASSERT_EQ(fut.wait_for(std::chrono::seconds(5)), std::future_status::ready);
+  ASSERT_EQ(budget->getUsage(MemoryBudget::Category::kStagedRequests), 30u);
+
+  second.release(30);
+  ASSERT_EQ(budget->getUsage(), 0u);
+}
+
+TEST(ConnectionCore, TryStage) {
+  ConnectionCore core(nullptr, nullptr, BackpressureStrategy::RateLimitPendingRequests(1), true);
+
+  ASSERT_TRUE(core.tryStage(nullptr, EncodedRequest::make("ping", "1")));
+
+  EncodedRequest req = EncodedRequest::make("ping", "2");
+  ASSERT_FALSE(core.tryStage(nullptr, std::move(req)));
+  ASSERT_EQ(req.toString(), "*2\r\n$4\r\nping\r\n$1\r\n2\r\n");
+
+  ASSERT_TRUE(core.consumeResponse(ResponseBuilder::makeInt(1)));
+  ASSERT_TRUE(core.tryStage(nullptr, std::move(req)));
+}
+
+TEST(ConnectionCore, FuturesAreRateLimited) {
+  ConnectionCore core(nullptr, nullptr, BackpressureStrategy::RateLimitPendingRequests(2), true);
+
+  std::future<redisReplyPtr> fut1 = core.stage(EncodedRequest::make("ping", "1"));
+  std::future<redisReplyPtr> fut2 = core.stage(EncodedRequest::make("ping", "2"));
+  ASSERT_EQ(core.getPendingRequests(), 2);
+  ASSERT_EQ(core.getPendingBytes(), 42);
+
+  std::future<std::future<redisReplyPtr>> blocked = std::async(std::launch::async, [&core]() {
+    return core.stage(EncodedRequest::make("ping", "3"));
+  });
+
+  ASSERT_EQ(blocked.wait_for(std::chrono::milliseconds(50)), std::future_status::timeout);
+  ASSERT_TRUE(core.consumeResponse(ResponseBuilder::makeInt(1)));
+  ASSERT_EQ(blocked.wait_for(std::chrono::seconds(5)), std::future_status::ready);
+
+  std::future<redisReplyPtr> fut3 = blocked.get();
+  ASSERT_TRUE(core.consumeResponse(ResponseBuilder::makeInt(2)));
+  ASSERT_TRUE(core.consumeResponse(ResponseBuilder::makeInt(3)));
+
+  ASSERT_REPLY(fut1, 1);
+  ASSERT_REPLY(fut2, 2);
+  ASSERT_REPLY(fut3, 3);
+  ASSERT_EQ(core.getPendingRequests(), 0);
+  ASSERT_EQ(core.getPendingBytes(), 0);
+}
+
+//------------------------------------------------------------------------------
+// Batches larger than the pending request window go in a window at a time,
+// and two of them committed at once don't hold each other up.
+//------------------------------------------------------------------------------
+TEST(ConnectionCore, BatchLargerThanWindow) {
+  ConnectionCore core(nullptr, nullptr, BackpressureStrategy::RateLimitPendingRequests(4), true);
+  std::atomic<int64_t> sum {0};
+
+  auto commit = [&core, &sum](int64_t base) {
+    std::vector<ReplyCallback> callbacks;
+    std::vector<EncodedRequest> requests;
+
+    for(int64_t i = 0; i < 10; i++) {
+      callbacks.emplace_back([&sum](redisReplyPtr &&reply) {
+        sum += reply->integer;
+      });
+      requests.emplace_back(EncodedRequest::make("ping", std::to_string(base + i)));
+    }
+
+    core.stage(callbacks, requests);
+  };
+
+  std::future<void> first = std::async(std::launch::async, commit, 0);
+  std::future<void> second = std::async(std::launch::async, commit, 100);
+
+  // Play the server, answering whatever has been staged so far
+  std::vector<StagedRequest*> batch;
+  for(size_t answered = 0; answered < 20; ) {
+    size_t count = core.getNextToWrite(batch, 20, 1024 * 1024);
+    ASSERT_LE(core.getPendingRequests(), 4);
+
+    for(size_t i = 0; i < count; i++) {
+      ASSERT_TRUE(core.consumeResponse(ResponseBuilder::makeInt(1)));
+    }
+
+    answered += count;
+  }
+
+  ASSERT_EQ(first.wait_for(std::chrono::seconds(5)), std::future_status::ready);
+  ASSERT_EQ(second.wait_for(std::chrono::seconds(5)), std::future_status::ready);
+
+  // All 20 callbacks have been handed to the executor
+  for(size_t i = 0; i < 500 && sum != 20; i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+
+  ASSERT_EQ(sum, 20);
+  ASSERT_EQ(core.getPendingRequests(), 0);
+}
+
+TEST(ReconnectBackoff, Linear) {
+  ReconnectBackoff backoff(ReconnectStrategy::Linear());
+
+  ASSERT_EQ(backoff.next(), std::chrono::milliseconds(1));
+  ASSERT_EQ(backoff.next(), std::chrono::milliseconds(2));
+  ASSERT_EQ(backoff.next(), std::chrono::milliseconds(3));
+
+  for(size_t i = 0; i < 3000; i++) {
+    backoff.next();
+  }
+
+  ASSERT_EQ(backoff.next(), std::chrono::milliseconds(2048));
+
+  backoff.reset();
+  ASSERT_EQ(backoff.next(), std::chrono::milliseconds(1));
+}
+
+TEST(ReconnectBackoff, ExponentialJitter) {
+  ReconnectBackoff backoff(ReconnectStrategy::ExponentialJitter(
+    std::chrono::milliseconds(10), std::chrono::milliseconds(1000)));
+
+  for(size_t round = 0; round < 3; round++) {
+    // First retry is immediate
+    ASSERT_EQ(backoff.next(), std::chrono::milliseconds(0));
+
+    std::chrono::milliseconds previous(10);
+    std::chrono::milliseconds highest(0);
+
+    for(size_t i = 0; i < 100; i++) {
+      std::chrono::milliseconds wait = backoff.next();
+      ASSERT_GE(wait, std::chrono::milliseconds(10));
+      ASSERT_LE(wait, std::chrono::milliseconds(1000));
+      ASSERT_LE(wait, previous * 3);
+
+      previous = wait;
+      highest = std::max(highest, wait);
+    }
+
+    // Grows towards the cap soon enough
+    ASSERT_GT(highest, std::chrono::milliseconds(500));
+
+    backoff.reset();
+  }
+}
+
+TEST(EndpointDecider, BasicSanity) {
+  StandardErrorLogger logger;
+  Members members;
+  members.push_back(Endpoint("host1.cern.ch", 1234));
+  members.push_back(Endpoint("host2.cern.ch", 2345));
+  members.push_back(Endpoint("host3.cern.ch", 3456));
+
+  HostResolver resolver(&logger);
+  EndpointDecider decider(&logger, &resolver, members);
+
+  ASSERT_EQ(decider.getNext(), Endpoint("host1.cern.ch", 1234));
+  ASSERT_EQ(decider.getNext(), Endpoint("host2.cern.ch", 2345));
+
+  decider.registerRedirection(Endpoint("host4.cern.ch", 9999));
+  ASSERT_EQ(decider.getNext(), Endpoint("host4.cern.ch", 9999));
+  ASSERT_EQ(decider.getNext(), Endpoint("host3.cern.ch", 3456));
+  ASSERT_EQ(decider.getNext(), Endpoint("host1.cern.ch", 1234));
+}
+
+TEST(EndpointDecider, LatencyProber) {
+  StandardErrorLogger logger;
+  Members members;
+  members.push_back(Endpoint("host1.cern.ch", 1234));
+  members.push_back(Endpoint("host2.cern.ch", 2345));
+  members.push_back(Endpoint("host3.cern.ch", 3456));
+
+  // No background probing, samples are fed by hand
+  LatencyProber prober(members, std::chrono::milliseconds(0));
+  ASSERT_EQ(prober.rank(members.getEndpoints()), members.getEndpoints());
+
+  prober.record(Endpoint("host3.cern.ch", 3456), std::chrono::microseconds(200));
+  prober.record(Endpoint("host2.cern.ch", 2345), std::chrono::microseconds(50000));
+  prober.recordFailure(Endpoint("host1.cern.ch", 1234));
+
+  std::chrono::microseconds rtt;
+  ASSERT_TRUE(prober.getLatency(Endpoint("host3.cern.ch", 3456), rtt));
+  ASSERT_EQ(rtt, std::chrono::microseconds(200));
+  ASSERT_FALSE(prober.getLatency(Endpoint("host1.cern.ch", 1234), rtt));
+
+  HostResolver resolver(&logger);
+  EndpointDecider decider(&logger, &resolver, members, nullptr, &prober);
+
+  ASSERT_EQ(decider.getNext(), Endpoint("host3.cern.ch", 3456));
+  ASSERT_EQ(decider.getNext(), Endpoint("host2.cern.ch", 2345));
+
+  // The ranking holds for the whole round
+  prober.record(Endpoint("host1.cern.ch", 1234), std::chrono::microseconds(10));
+  ASSERT_EQ(decider.getNext(), Endpoint("host1.cern.ch", 1234));
+
+  // .. and is refreshed for the next one. Samples are smoothed.
+  prober.record(Endpoint("host2.cern.ch", 2345), std::chrono::microseconds(1));
+  ASSERT_TRUE(prober.getLatency(Endpoint("host2.cern.ch", 2345), rtt));
+  ASSERT_EQ(rtt, std::chrono::microseconds((50000 * 7 + 1) / 8));
+
+  ASSERT_EQ(decider.getNext(), Endpoint("host1.cern.ch", 1234));
+  ASSERT_EQ(decider.getNext(), Endpoint("host3.cern.ch", 3456));
+  ASSERT_EQ(decider.getNext(), Endpoint("host2.cern.ch", 2345));
+
+  // Redirections still take precedence
+  decider.registerRedirection(Endpoint("host4.cern.ch", 9999));
+  ASSERT_EQ(decider.getNext(), Endpoint("host4.cern.ch", 9999));
+}
+
+TEST(EndpointDecider, AllEndpoints) {
+  Members members;
+  members.push_back("1.example.com", 3333);
+  members.push_back("2.example.com", 4444);
+
+  StandardErrorLogger logger;
+  HostResolver resolver(&logger);
+  EndpointDecider decider(&logger, &resolver, members);
+
+  ServiceEndpoint ex1_v6(ProtocolType::kIPv6, SocketType::kStream, "2001:db8::1", 3333, "1.example.com");
+  ServiceEndpoint ex1_v6b(ProtocolType::kIPv6, SocketType::kStream, "2001:db8::2", 3333, "1.example.com");
+  ServiceEndpoint ex2_v4(ProtocolType::kIPv4, SocketType::kStream, "192.168.1.4", 4444, "2.example.com");
+  resolver.feedFake("1.example.com", 3333, { ex1_v6, ex1_v6b });
+  resolver.feedFake("2.example.com", 4444, { ex2_v4 });
+
+  // Both members, with address families interleaved
+  std::vector<ServiceEndpoint> endpoints;
+  ASSERT_TRUE(decider.getAllEndpoints(endpoints));
+  ASSERT_TRUE(decider.madeFullCircle());
+  ASSERT_EQ(endpoints, std::vector<ServiceEndpoint>({ ex1_v6, ex2_v4, ex1_v6b }));
+
+  // A redirection is followed on its own
+  ServiceEndpoint ex3(ProtocolType::kIPv4, SocketType::kStream, "192.168.1.5", 5555, "3.example.com");
+  resolver.feedFake("3.example.com", 5555, { ex3 });
+  decider.registerRedirection(Endpoint("3.example.com", 5555));
+
+  ASSERT_TRUE(decider.getAllEndpoints(endpoints));
+  ASSERT_EQ(endpoints, std::vector<ServiceEndpoint>({ ex3 }));
+}
+
+TEST(EndpointDecider, LeaderHints) {
+  StandardErrorLogger logger;
+  Members members;
+  members.push_back(Endpoint("host1.cern.ch", 1234));
+  members.push_back(Endpoint("host2.cern.ch", 2345));
+  members.push_back(Endpoint("host3.cern.ch", 3456));
+
+  HostResolver resolver(&logger);
+  LeaderHints hints;
+
+  // One client learns of the leader through a redirection..
+  EndpointDecider decider1(&logger, &resolver, members, &hints);
+  ASSERT_EQ(decider1.getNext(), Endpoint("host1.cern.ch", 1234));
+  decider1.registerRedirection(Endpoint("host3.cern.ch", 3456));
+  ASSERT_EQ(decider1.getNext(), Endpoint("host3.cern.ch", 3456));
+
+  // .. and another goes there straight away
+  EndpointDecider decider2(&logger, &resolver, members, &hints);
+  ASSERT_EQ(decider2.getNext(), Endpoint("host3.cern.ch", 3456));
+
+  // That didn't work out: Back to the members, and the hint is gone
+  ASSERT_EQ(decider2.getNext(), Endpoint("host1.cern.ch", 1234));
+  Endpoint leader;
+  ASSERT_FALSE(hints.get(members, leader));
+
+  // Successful connections update the hint too
+  decider2.registerConnectionSuccess(Endpoint("host2.cern.ch", 2345));
+  ASSERT_TRUE(hints.get(members, leader));
+  ASSERT_EQ(leader, Endpoint("host2.cern.ch", 2345));
+
+  EndpointDecider decider3(&logger, &resolver, members, &hints);
+  ASSERT_EQ(decider3.getNext(), Endpoint("host2.cern.ch", 2345));
+  decider3.registerConnectionSuccess(Endpoint("host2.cern.ch", 2345));
+  ASSERT_EQ(decider3.getNext(), Endpoint("host2.cern.ch", 2345));
+
+  // An outdated invalidation doesn't clobber a newer hint
+  hints.invalidate(members, Endpoint("host3.cern.ch", 3456));
+  ASSERT_TRUE(hints.get(members, leader));
+
+  // Hints are per cluster
+  Members others;
+  others.push_back(Endpoint("host4.cern.ch", 1234));
+  EndpointDecider decider4(&logger, &resolver, others, &hints);
+  ASSERT_EQ(decider4.getNext(), Endpoint("host4.cern.ch", 1234));
+}
+
+TEST(MultiBuilder, BasicSanity) {
+  MultiBuilder builder;
+  builder.emplace_back("GET", "123");
+  builder.emplace_back("GET", "234");
+
+  ASSERT_EQ(builder.size(), 2u);
+  ASSERT_EQ(builder.release().toString(),
+    "*1\r\n$5\r\nMULTI\r\n*2\r\n$3\r\nGET\r\n$3\r\n123\r\n"
+    "*2\r\n$3\r\nGET\r\n$3\r\n234\r\n*1\r\n$4\r\nEXEC\r\n");
+}
+
+//------------------------------------------------------------------------------
+// The deprecated getDeque() still hands out each command on its own
+//------------------------------------------------------------------------------
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wdeprecated-declarations"
+TEST(MultiBuilder, GetDeque) {
+  MultiBuilder builder;
+  builder.emplace_back("GET", "123");
+  builder.emplace_back("GET", "234");
+
+  std::deque<EncodedRequest> commands = builder.getDeque();
+  ASSERT_EQ(commands.size(), 2u);
+  ASSERT_EQ(commands[0], EncodedRequest::make("GET", "123"));
+  ASSERT_EQ(commands[1], EncodedRequest::make("GET", "234"));
+
+  // The builder keeps its contents
+  ASSERT_EQ(builder.size(), 2u);
+  ASSERT_EQ(builder.getDeque().size(), 2u);
+}
+#pragma GCC diagnostic pop
+
+TEST(MultiBuilder, Release) {
+  MultiBuilder builder;
+  builder.emplace_back("GET", "123");
+  builder.emplace_back("GET", "234");
+  ASSERT_EQ(builder.size(), 2u);
+
+  std::deque<EncodedRequest> expected;
+  expected.emplace_back(EncodedRequest::make("GET", "123"));
+  expected.emplace_back(EncodedRequest::make("GET", "234"));
+
+  ASSERT_EQ(builder.release(), EncodedRequest::fuseIntoBlockAndSurround(std::move(expected)));
+  ASSERT_EQ(builder.size(), 0u);
+
+  // Builder is reusable after release
+  builder.emplace_back("SET", "abc", "def");
+  ASSERT_EQ(builder.size(), 1u);
+  ASSERT_EQ(builder.release().toString(),
+    "*1\r\n$5\r\nMULTI\r\n*3\r\n$3\r\nSET\r\n$3\r\nabc\r\n$3\r\ndef\r\n*1\r\n$4\r\nEXEC\r\n");
+
+  // An empty transaction is just MULTI / EXEC
+  ASSERT_EQ(builder.release().toString(), "*1\r\n$5\r\nMULTI\r\n*1\r\n$4\r\nEXEC\r\n");
+}
+
+TEST(MultiBuilder, GrowAndReserve) {
+  std::string large(1000, 'x');
+  std::deque<EncodedRequest> expected;
+
+  MultiBuilder builder;
+  builder.reserve(100);
+
+  for(size_t i = 0; i < 100; i++) {
+    builder.emplace_back("SET", std::to_string(i), large);
+    expected.emplace_back(EncodedRequest::make("SET", std::to_string(i), large));
+  }
+
+  MultiBuilder moved(std::move(builder));
+  ASSERT_EQ(moved.size(), 100u);
+  ASSERT_EQ(builder.size(), 0u);
+  ASSERT_EQ(moved.release(), EncodedRequest::fuseIntoBlockAndSurround(std::move(expected)));
+}
+
+TEST(ServiceEndpoint, BasicSanity) {
+  ServiceEndpoint ipv4(ProtocolType::kIPv4, SocketType::kStream, "192.168.1.100", 9999, "example.com");
+  ASSERT_EQ(ipv4.getPort(), 9999);
+  ASSERT_EQ(ipv4.getPrintableAddress(), "192.168.1.100");
+  ASSERT_EQ(ipv4.getOriginalHostname(), "example.com");
+
+  ServiceEndpoint ipv6(ProtocolType::kIPv6, SocketType::kStream, "2001:db8:85a3:8d3:1319:8a2e:370:7348", 8888, "example.com");
+  ASSERT_EQ(ipv6.getPort(), 8888);
+  ASSERT_EQ(ipv6.getPrintableAddress(), "2001:db8:85a3:8d3:1319:8a2e:370:7348");
+  ASSERT_EQ(ipv6.getOriginalHostname(), "example.com");
+}
+
+TEST(ServiceEndpoint, Unix) {
+  ServiceEndpoint local(ProtocolType::kUnix, SocketType::kStream, "/tmp/quarkdb.sock", 0, "unix:/tmp/quarkdb.sock");
+  ASSERT_EQ(local.getPort(), 0);
+  ASSERT_EQ(local.getPrintableAddress(), "/tmp/quarkdb.sock");
+  ASSERT_EQ(local.getAiFamily(), AF_UNIX);
+  ASSERT_EQ(local.getAiProtocol(), 0);
+  ASSERT_EQ(local.getString(), "[/tmp/quarkdb.sock] (unix,stream resolved from unix:/tmp/quarkdb.sock)");
+}
+
+TEST(Members, Unix) {
+  Members members;
+  ASSERT_TRUE(members.parse("unix:/tmp/qdb.sock host1.cern.ch:7777 unix:"));
+  ASSERT_EQ(members.size(), 2u);
+
+  const Endpoint &local = members.getEndpoints()[0];
+  ASSERT_TRUE(local.isUnix());
+  ASSERT_FALSE(local.empty());
+  ASSERT_EQ(local.getUnixPath(), "/tmp/qdb.sock");
+  ASSERT_EQ(local.toString(), "unix:/tmp/qdb.sock");
+
+  ASSERT_FALSE(members.getEndpoints()[1].isUnix());
+  ASSERT_EQ(members.toString(), "unix:/tmp/qdb.sock,host1.cern.ch:7777");
+  ASSERT_TRUE(Endpoint("unix:", 0).empty());
+}
+
+TEST(HostResolver, Unix) {
+  StandardErrorLogger logger;
+  HostResolver resolver(&logger);
+
+  // Fakes don't apply, unix endpoints never hit DNS
+  resolver.feedFake("example.com", 4444, {});
+
+  Status st;
+  std::vector<ServiceEndpoint> out = resolver.resolve("unix:/tmp/qdb.sock", 0, st);
+  ASSERT_TRUE(st.ok());
+  ASSERT_EQ(out.size(), 1u);
+  ASSERT_EQ(out[0].getProtocolType(), ProtocolType::kUnix);
+  ASSERT_EQ(out[0].getPrintableAddress(), "/tmp/qdb.sock");
+  ASSERT_EQ(out[0].getOriginalHostname(), "unix:/tmp/qdb.sock");
+
+  ASSERT_TRUE(resolver.resolve("unix:/" + std::string(200, 'x'), 0, st).empty());
+  ASSERT_EQ(st.getErrc(), ENAMETOOLONG);
+}
+
+TEST(HostResolver, BasicSanity) {
+  StandardErrorLogger logger;
+  HostResolver resolver(&logger);
+
+  std::vector<ServiceEndpoint> endpoints;
+  endpoints.emplace_back(ProtocolType::kIPv4, SocketType::kStream, "192.168.1.100", 4444, "1.example.com");
+  endpoints.emplace_back(ProtocolType::kIPv6, SocketType::kStream, "2001:db8:85a3:8d3:1319:8a2e:370:7348", 4444, "2.example.com");
+  resolver.feedFake("example.com", 4444, endpoints);
+
+  Status st;
+  ASSERT_EQ(resolver.resolve("example.com", 4444, st), endpoints);
+  ASSERT_TRUE(st.ok());
+  ASSERT_TRUE(st);
+
+  ASSERT_TRUE(resolver.resolve("3.example.com", 5555, st).empty());
+  ASSERT_FALSE(st.ok());
+  ASSERT_FALSE(st);
+  ASSERT_EQ(st.getErrc(), ENOENT);
+}
+
+TEST(DnsCache, BasicSanity) {
+  std::mutex mtx;
+  int resolutions = 0;
+  bool fail = false;
+
+  ServiceEndpoint ex1(ProtocolType::kIPv4, SocketType::kStream, "192.168.1.2", 5555, "1.example.com");
+
+  DnsCache cache(std::chrono::milliseconds(200), std::chrono::milliseconds(100),
+    [&](const std::string &host, int port, Status &st) -> std::vector<ServiceEndpoint> {
+      std::lock_guard<std::mutex> lock(mtx);
+      resolutions++;
+
+      if(fail || host != "1.example.com") {
+        st = Status(ENOENT, "Unable to resolve");
+        return {};
+      }
+
+      st = Status();
+      return { ex1 };
+    }
+  );
+
+  auto getResolutions = [&]() {
+    std::lock_guard<std::mutex> lock(mtx);
+    return resolutions;
+  };
+
+  // First lookup is a miss, the second one is served from the cache
+  Status st;
+  ASSERT_EQ(cache.resolve("1.example.com", 5555, st), std::vector<ServiceEndpoint>({ ex1 }));
+  ASSERT_TRUE(st.ok());
+  ASSERT_EQ(cache.resolve("1.example.com", 5555, st), std::vector<ServiceEndpoint>({ ex1 }));
+  ASSERT_EQ(getResolutions(), 1);
+
+  // Failures are cached too
+  ASSERT_TRUE(cache.resolve("2.example.com", 5555, st).empty());
+  ASSERT_EQ(st.getErrc(), ENOENT);
+  ASSERT_TRUE(cache.resolve("2.example.com", 5555, st).empty());
+  ASSERT_EQ(st.getErrc(), ENOENT);
+  ASSERT_EQ(getResolutions(), 2);
+  ASSERT_EQ(cache.size(), 2u);
+
+  // Stale entry: still served, while refreshed in the background
+  std::this_thread::sleep_for(std::chrono::milliseconds(250));
+  ASSERT_EQ(cache.resolve("1.example.com", 5555, st), std::vector<ServiceEndpoint>({ ex1 }));
+  ASSERT_TRUE(st.ok());
+
+  for(size_t i = 0; i < 100 && getResolutions() != 3; i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+
+  ASSERT_EQ(getResolutions(), 3);
+
+  // Negative entry expired: resolved again, synchronously
+  ASSERT_TRUE(cache.resolve("2.example.com", 5555, st).empty());
+  ASSERT_EQ(getResolutions(), 4);
+
+  // Too stale, and DNS now failing: the error surfaces
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    fail = true;
+  }
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(450));
+  ASSERT_TRUE(cache.resolve("1.example.com", 5555, st).empty());
+  ASSERT_EQ(st.getErrc(), ENOENT);
+
+  // A HostResolver goes through the cache
+  HostResolver resolver(nullptr, std::shared_ptr<DnsCache>(&cache, [](DnsCache*) {}));
+  int before = getResolutions();
+  ASSERT_TRUE(resolver.resolve("1.example.com", 5555, st).empty());
+  ASSERT_EQ(getResolutions(), before);
+}
+
+TEST(EndpointDecider, WithHostResolution) {
+  Members members;
+  members.push_back("1.example.com", 3333);
+  members.push_back("2.example.com", 4444);
+
+  StandardErrorLogger logger;
+  HostResolver resolver(&logger);
+  EndpointDecider decider(&logger, &resolver, members);
+  ASSERT_FALSE(decider.madeFullCircle());
+
+  ServiceEndpoint ex3_1(ProtocolType::kIPv4, SocketType::kStream, "192.168.1.2", 5555, "3.example.com");
+  ServiceEndpoint ex3_2(ProtocolType::kIPv4, SocketType::kStream, "192.168.1.222", 5555, "3.example.com");
+
+  resolver.feedFake("3.example.com", 5555, { ex3_1, ex3_2 });
+
+  // no DNS entries for 3.example.com
+  ServiceEndpoint connectToNext = ServiceEndpoint(ProtocolType::kIPv4, SocketType::kStream, "127.0.0.1", 9999, "example.com");
+  ASSERT_FALSE(decider.madeFullCircle());
+  ASSERT_FALSE(decider.getNextEndpoint(connectToNext));
+  ASSERT_TRUE(decider.madeFullCircle());
+
+  // only 1.example.com has valid entries
+  std::vector<ServiceEndpoint> endpoints;
+  endpoints.emplace_back(ProtocolType::kIPv4, SocketType::kStream, "192.168.1.3", 3333, "1.example.com");
+  endpoints.emplace_back(ProtocolType::kIPv6, SocketType::kStream, "2001:db8:85a3:8d3:1319:8a2e:370:7348", 3333, "1.example.com");
+  resolver.feedFake("1.example.com", 3333, endpoints);
+
+  ASSERT_TRUE(decider.getNextEndpoint(connectToNext));
+  ASSERT_EQ(connectToNext, endpoints[0]);
+
+  ASSERT_TRUE(decider.getNextEndpoint(connectToNext));
+  ASSERT_EQ(connectToNext, endpoints[1]);
+
+  // cycle back to 1.example.com, since 2.example.com has no entry
+  ASSERT_TRUE(decider.getNextEndpoint(connectToNext));
+  ASSERT_EQ(connectToNext, endpoints[0]);
+
+  ASSERT_TRUE(decider.getNextEndpoint(connectToNext));
+  ASSERT_EQ(connectToNext, endpoints[1]);
+
+  // 2.example.com comes alive.. only an IPv4 here.
+  std::vector<ServiceEndpoint> endpoints2;
+  endpoints2.emplace_back(ProtocolType::kIPv4, SocketType::kStream, "192.168.1.4", 4444, "2.example.com");
+  resolver.feedFake("2.example.com", 4444, endpoints2);
+
+  ASSERT_TRUE(decider.getNextEndpoint(connectToNext));
+  ASSERT_EQ(connectToNext, endpoints2[0]);
+
+  ASSERT_TRUE(decider.getNextEndpoint(connectToNext));
+  ASSERT_EQ(connectToNext, endpoints[0]);
+
+  ASSERT_TRUE(decider.getNextEndpoint(connectToNext));
+  ASSERT_EQ(connectToNext, endpoints[1]);
+
+  // hey, we just got a redirection to 3.example.com:5555
+  decider.registerRedirection(Endpoint("3.example.com", 5555));
+
+  ASSERT_TRUE(decider.getNextEndpoint(connectToNext));
+  ASSERT_EQ(connectToNext, ex3_1);
+
+  ASSERT_TRUE(decider.getNextEndpoint(connectToNext));
+  ASSERT_EQ(connectToNext, ex3_2);
+
+  // redirection hosts have been exhausted, back to cycling
+  ASSERT_TRUE(decider.getNextEndpoint(connectToNext));
+  ASSERT_EQ(connectToNext, endpoints2[0]);
+
+  ASSERT_TRUE(decider.getNextEndpoint(connectToNext));
+  ASSERT_EQ(connectToNext, endpoints[0]);
+
+  ASSERT_TRUE(decider.getNextEndpoint(connectToNext));
+  ASSERT_EQ(connectToNext, endpoints[1]);
+}
+
+TEST(EndpointDecider, WithInterception) {
+  GlobalInterceptor::addIntercept(Endpoint("1.example.com", 1111), Endpoint("2.example.com", 3333));
+
+  Members members;
+  members.push_back("1.example.com", 1111);
+
+  StandardErrorLogger logger;
+  HostResolver resolver(&logger);
+  EndpointDecider decider(&logger, &resolver, members);
+
+  std::vector<ServiceEndpoint> endpoints;
+  endpoints.emplace_back(ProtocolType::kIPv4, SocketType::kStream, "192.168.1.4", 3333, "2.example.com");
+  resolver.feedFake("2.example.com", 3333, endpoints);
+
+  ServiceEndpoint ep;
+  ASSERT_FALSE(decider.madeFullCircle());
+  ASSERT_TRUE(decider.getNextEndpoint(ep));
+  ASSERT_TRUE(decider.madeFullCircle());
+  ASSERT_EQ(ep, endpoints[0]);
+
+  // Status st;
+  // std::vector<ServiceEndpoint> endpoints2 = resolver.resolve("1.example.com", 1111, st);
+  // ASSERT_EQ(endpoints2.size(), 1u);
+  // ASSERT_EQ(endpoints2[0], endpoints[0]);
+}
+
+TEST(EndpointDecider, MadeFullCircleAfterAllServiceEndpoints) {
+  Members members;
+  members.push_back("example.com", 1111);
+
+  StandardErrorLogger logger;
+  HostResolver resolver(&logger);
+  EndpointDecider decider(&logger, &resolver, members);
+
+  std::vector<ServiceEndpoint> endpoints;
+  endpoints.emplace_back(ProtocolType::kIPv4, SocketType::kStream, "127.0.0.1", 1111, "example.com");
+  endpoints.emplace_back(ProtocolType::kIPv4, SocketType::kStream, "127.0.0.1", 2222, "example.com");
+
+  resolver.feedFake("example.com", 1111, endpoints);
+
+  ServiceEndpoint ep;
+  ASSERT_FALSE(decider.madeFullCircle());
+  ASSERT_TRUE(decider.getNextEndpoint(ep));
+  ASSERT_EQ(ep, endpoints[0]);
+  ASSERT_FALSE(decider.madeFullCircle());
+
+  ASSERT_TRUE(decider.getNextEndpoint(ep));
+  ASSERT_EQ(ep, endpoints[1]);
+  ASSERT_TRUE(decider.madeFullCircle());
+}
+
+TEST(QuarkDBVersion, BasicSanity) {
+  QuarkDBVersion v038(0, 3, 8, "");
   ASSERT_EQ(v038.getMajor(), 0u);
   ASSERT_EQ(v038.getMinor(), 3u);
   ASSERT_EQ(v038.getPatch(), 8u);
@@ -649,3 +1917,763 @@ TEST(QuarkDBVersion, Parsing) {
     ASSERT_FALSE(QuarkDBVersion::fromString(badVersions[i], ver));
   }
 }
+
+#if defined(QCLIENT_HAVE_COROUTINES)
+
+// Minimal eager, fire-and-forget coroutine.
+struct DetachedTask {
+  struct promise_type {
+    DetachedTask get_return_object() { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+  };
+};
+
+static DetachedTask awaitReply(QClient &qcl, std::promise<redisReplyPtr> &result) {
+  redisReplyPtr reply = co_await co_exec(qcl, "PING", "abc");
+  result.set_value(std::move(reply));
+}
+
+TEST(Coroutines, UnreachableServer) {
+  Options opts;
+  opts.withRetryStrategy(RetryStrategy::NoRetries());
+
+  QClient qcl("localhost", 1, std::move(opts));
+  std::promise<redisReplyPtr> result;
+  std::future<redisReplyPtr> fut = result.get_future();
+
+  awaitReply(qcl, result);
+  ASSERT_EQ(fut.get(), nullptr);
+}
+
+#endif
+
+TEST(QHashCache, TtlAndInvalidation) {
+  SteadyClock clock(true);
+  QHashCache cache(std::chrono::seconds(10), 1024 * 1024, &clock);
+
+  bool exists = false;
+  std::string value;
+  uint64_t generation = 0;
+  long long int length = 0;
+
+  ASSERT_FALSE(cache.getField("key", "f1", exists, value, generation));
+  cache.putField("key", "f1", true, "v1", generation);
+  cache.putField("key", "f2", false, "", generation);
+  cache.putLength("key", 1, generation);
+  ASSERT_EQ(cache.size(), 3u);
+
+  ASSERT_TRUE(cache.getField("key", "f1", exists, value, generation));
+  ASSERT_TRUE(exists);
+  ASSERT_EQ(value, "v1");
+  ASSERT_TRUE(cache.getField("key", "f2", exists, value, generation));
+  ASSERT_FALSE(exists);
+  ASSERT_TRUE(cache.getLength("key", length, generation));
+  ASSERT_EQ(length, 1);
+
+  clock.advance(std::chrono::seconds(10));
+  ASSERT_FALSE(cache.getField("key", "f1", exists, value, generation));
+  ASSERT_EQ(cache.size(), 2u);
+
+  // A fetch racing with an invalidation must not be cached
+  cache.invalidate("other-key");
+  cache.putField("key", "f1", true, "stale", generation);
+  ASSERT_FALSE(cache.getField("key", "f1", exists, value, generation));
+
+  cache.putField("key", "f1", true, "v2", generation);
+  cache.handleIncomingMessage(Message::createMessage("__keyspace@0__:key", "hset"));
+  ASSERT_EQ(cache.size(), 0u);
+  ASSERT_EQ(cache.bytes(), 0u);
+
+  ASSERT_FALSE(cache.getField("key", "f1", exists, value, generation));
+  cache.putField("key", "f1", true, "v3", generation);
+  cache.handleIncomingMessage(Message::createMessage("__keyevent@0__:hdel", "key"));
+  ASSERT_EQ(cache.size(), 0u);
+
+  ASSERT_FALSE(cache.getField("key", "f1", exists, value, generation));
+  cache.putField("key", "f1", true, "v4", generation);
+  cache.handleIncomingMessage(Message::createMessage("unrelated", "key"));
+  ASSERT_EQ(cache.size(), 1u);
+  cache.handleIncomingMessage(Message::createMessage("__redis__:invalidate", ""));
+  ASSERT_EQ(cache.size(), 0u);
+}
+
+TEST(QHashCache, BoundedMemory) {
+  QHashCache cache(std::chrono::seconds(10), 2048);
+
+  bool exists = false;
+  std::string value;
+  uint64_t generation = 0;
+
+  for(size_t i = 0; i < 100; i++) {
+    ASSERT_FALSE(cache.getField("key", "f" + std::to_string(i), exists, value, generation));
+    cache.putField("key", "f" + std::to_string(i), true, std::string(100, 'a'), generation);
+    ASSERT_LE(cache.bytes(), 2048u);
+  }
+
+  // Most recently inserted survive
+  ASSERT_TRUE(cache.getField("key", "f99", exists, value, generation));
+  ASSERT_FALSE(cache.getField("key", "f0", exists, value, generation));
+
+  // Too large to ever fit
+  cache.putField("key", "huge", true, std::string(4096, 'a'), generation);
+  ASSERT_FALSE(cache.getField("key", "huge", exists, value, generation));
+}
+
+TEST(LatencyHistogram, Buckets) {
+  std::vector<uint64_t> values = {0, 1, 7, 8, 15, 16, 17, 1000, 123456789,
+    (1ull << 40) + 12345, std::numeric_limits<uint64_t>::max()};
+
+  for(uint64_t value : values) {
+    size_t index = LatencyHistogram::bucketIndex(value);
+    ASSERT_LT(index, size_t(LatencyHistogram::kBuckets));
+    ASSERT_GE(LatencyHistogram::bucketUpperBound(index), value);
+
+    // Worst-case relative error of 1/8
+    ASSERT_LE(LatencyHistogram::bucketUpperBound(index) - value, value / 8);
+
+    if(index > 0) {
+      ASSERT_LT(LatencyHistogram::bucketUpperBound(index - 1), value);
+    }
+  }
+
+  LatencyHistogram histogram;
+  for(uint64_t i = 1; i <= 1000; i++) {
+    histogram.record(i * 1000);
+  }
+
+  LatencySnapshot snap = histogram.snapshot();
+  ASSERT_EQ(snap.count, 1000u);
+  ASSERT_EQ(snap.max, 1000000u);
+  ASSERT_EQ(snap.mean(), 500500.0);
+  ASSERT_NEAR(snap.percentile(50), 500000, 500000 / 8);
+  ASSERT_NEAR(snap.percentile(99), 990000, 990000 / 8);
+  ASSERT_EQ(snap.percentile(100), 1000000u);
+
+  histogram.reset();
+  ASSERT_EQ(histogram.snapshot().count, 0u);
+  ASSERT_EQ(histogram.snapshot().percentile(50), 0u);
+}
+
+TEST(ConnectionCore, LatencyStats) {
+  RecordingCallback callback;
+  ConnectionCore core(nullptr, nullptr, BackpressureStrategy::Default(), false);
+
+  for(int i = 0; i < 10; i++) {
+    core.stage(&callback, EncodedRequest::make("ping", "123"));
+  }
+
+  std::vector<StagedRequest*> batch;
+  ASSERT_EQ(core.getNextToWrite(batch, 100, 1024 * 1024), 10u);
+  for(StagedRequest *item : batch) {
+    item->markWritten(std::chrono::steady_clock::now());
+  }
+
+  for(int i = 0; i < 10; i++) {
+    ASSERT_TRUE(core.consumeResponse(ResponseBuilder::makeInt(i)));
+  }
+
+  LatencyStats stats = core.getLatencyStats();
+  ASSERT_EQ(stats.queueing.count, 10u);
+  ASSERT_EQ(stats.network.count, 10u);
+
+  for(size_t i = 0; i < 1000 && core.getLatencyStats().callback.count != 10; i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+
+  ASSERT_EQ(core.getLatencyStats().callback.count, 10u);
+
+  core.resetLatencyStats();
+  ASSERT_EQ(core.getLatencyStats().network.count, 0u);
+}
+
+class RecordingTracer : public RequestTracer {
+public:
+  virtual void requestStarted(const RequestTrace &trace) override {
+    std::lock_guard<std::mutex> lock(mtx);
+    started.push_back(trace);
+  }
+
+  virtual void requestFinished(const RequestTrace &trace) override {
+    std::lock_guard<std::mutex> lock(mtx);
+    finished.push_back(trace);
+    finishedCV.notify_all();
+  }
+
+  size_t finishedCount() {
+    std::lock_guard<std::mutex> lock(mtx);
+    return finished.size();
+  }
+
+  // Wait for the given number of requests to finish, return the last one
+  bool waitFinished(size_t count, RequestTrace &trace) {
+    std::unique_lock<std::mutex> lock(mtx);
+    if(!finishedCV.wait_for(lock, std::chrono::seconds(30), [&]() { return finished.size() >= count; })) {
+      return false;
+    }
+
+    trace = finished[count - 1];
+    return true;
+  }
+
+  std::mutex mtx;
+  std::condition_variable finishedCV;
+  std::vector<RequestTrace> started;
+  std::vector<RequestTrace> finished;
+};
+
+TEST(ConnectionCore, Tracer) {
+  RecordingTracer tracer;
+  ConnectionCore core(nullptr, nullptr, BackpressureStrategy::Default(), false);
+  core.setTracer(&tracer);
+
+  std::future<redisReplyPtr> fut = core.stage(EncodedRequest::make("GET", "key"));
+  core.stage([](redisReplyPtr &&reply) {}, EncodedRequest::make("HSET", "key", "field", "value"));
+
+  ASSERT_EQ(tracer.started.size(), 2u);
+  ASSERT_EQ(tracer.started[0].id, 1u);
+  ASSERT_EQ(tracer.started[0].command, "GET");
+  ASSERT_EQ(tracer.started[1].id, 2u);
+  ASSERT_EQ(tracer.started[1].command, "HSET");
+  ASSERT_EQ(tracer.started[1].requestBytes, EncodedRequest::make("HSET", "key", "field", "value").getLen());
+
+  std::vector<StagedRequest*> batch;
+  ASSERT_EQ(core.getNextToWrite(batch, 10, 1024), 2u);
+  batch[0]->markWritten(std::chrono::steady_clock::now());
+
+  ASSERT_TRUE(core.consumeResponse(ResponseBuilder::makeStr("value")));
+  ASSERT_REPLY(fut, "value");
+
+  // Futures complete inline
+  RequestTrace trace;
+  ASSERT_TRUE(tracer.waitFinished(1u, trace));
+  ASSERT_EQ(tracer.finishedCount(), 1u);
+  ASSERT_EQ(trace.id, 1u);
+  ASSERT_EQ(trace.command, "GET");
+  ASSERT_TRUE(trace.hasReply);
+  ASSERT_FALSE(trace.errorReply);
+  ASSERT_EQ(trace.replyBytes, 5u);
+  ASSERT_LE(trace.stagedAt, trace.writtenAt);
+  ASSERT_LE(trace.writtenAt, trace.acknowledgedAt);
+  ASSERT_LE(trace.callbackAt, trace.finishedAt);
+
+  // Callbacks finish on the executor - never written, purged with a null reply
+  ASSERT_EQ(core.clearAllPending(), 1u);
+
+  ASSERT_TRUE(tracer.waitFinished(2u, trace));
+  ASSERT_EQ(tracer.finishedCount(), 2u);
+  ASSERT_EQ(trace.id, 2u);
+  ASSERT_FALSE(trace.hasReply);
+  ASSERT_EQ(trace.writtenAt, std::chrono::steady_clock::time_point());
+  ASSERT_LE(trace.acknowledgedAt, trace.callbackAt);
+}
+
+TEST(ConnectionCore, Statistics) {
+  PingHandshake handshake("hi");
+  ConnectionCore core(nullptr, &handshake, BackpressureStrategy::RateLimitPendingRequests(2), false);
+
+  std::future<redisReplyPtr> fut1 = core.stage(EncodedRequest::make("ping", "1"));
+  std::future<redisReplyPtr> fut2 = core.stage(EncodedRequest::make("ping", "2"));
+
+  ClientStatistics stats = core.getStatistics();
+  ASSERT_EQ(stats.requestsStaged, 2);
+  ASSERT_EQ(stats.requestsAcknowledged, 0);
+  ASSERT_EQ(stats.pendingRequests, 2);
+  ASSERT_EQ(stats.handshakes, 0);
+
+  // A third request blocks until the first is acknowledged
+  std::future<std::future<redisReplyPtr>> fut3 = std::async(std::launch::async, [&core]() {
+    return core.stage(EncodedRequest::make("ping", "3"));
+  });
+
+  ASSERT_EQ(fut3.wait_for(std::chrono::milliseconds(20)), std::future_status::timeout);
+
+  std::vector<StagedRequest*> batch;
+  ASSERT_EQ(core.getNextToWrite(batch, 10, 1024), 1u);
+  ASSERT_TRUE(core.consumeResponse(ResponseBuilder::makeStr("hi")));
+  ASSERT_EQ(core.getStatistics().handshakes, 1);
+
+  ASSERT_EQ(core.getNextToWrite(batch, 10, 1024), 2u);
+  ASSERT_TRUE(core.consumeResponse(ResponseBuilder::makeInt(1)));
+  ASSERT_EQ(fut3.wait_for(std::chrono::seconds(5)), std::future_status::ready);
+
+  stats = core.getStatistics();
+  ASSERT_EQ(stats.requestsStaged, 3);
+  ASSERT_EQ(stats.requestsAcknowledged, 1);
+  ASSERT_EQ(stats.pendingRequests, 2);
+  ASSERT_GE(stats.backpressureBlockedTime, std::chrono::milliseconds(20));
+
+  core.getCounters().bytesSent.add(10);
+  core.getCounters().bytesSent.add(5);
+  ASSERT_EQ(core.getStatistics().bytesSent, 15);
+}
+
+TEST(ConnectionCore, OldestPendingAge) {
+  ConnectionCore core(nullptr, nullptr, BackpressureStrategy::Default(), false);
+  ASSERT_EQ(core.getOldestPendingAge(), std::chrono::nanoseconds(0));
+
+  std::future<redisReplyPtr> fut1 = core.stage(EncodedRequest::make("ping", "1"));
+  std::future<redisReplyPtr> fut2 = core.stage(EncodedRequest::make("ping", "2"));
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  ASSERT_GE(core.getOldestPendingAge(), std::chrono::milliseconds(20));
+
+  // An acknowledgement counts as progress, even with requests still pending
+  std::vector<StagedRequest*> batch;
+  ASSERT_EQ(core.getNextToWrite(batch, 10, 1024), 2u);
+  ASSERT_TRUE(core.consumeResponse(ResponseBuilder::makeInt(1)));
+  ASSERT_LT(core.getOldestPendingAge(), std::chrono::milliseconds(20));
+
+  ASSERT_TRUE(core.consumeResponse(ResponseBuilder::makeInt(2)));
+  ASSERT_EQ(core.getOldestPendingAge(), std::chrono::nanoseconds(0));
+}
+
+TEST(TimerWheel, Expiry) {
+  TimerWheel wheel(std::chrono::milliseconds(1), 512);
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+  std::vector<redisReplyPtr> replies(3);
+  std::vector<std::shared_ptr<RequestDeadline>> deadlines;
+  for(size_t i = 0; i < 3; i++) {
+    deadlines.emplace_back(std::make_shared<RequestDeadline>(
+      [&replies, i](redisReplyPtr &&reply) { replies[i] = std::move(reply); },
+      start + std::chrono::milliseconds(i == 0 ? 5 : 2000)));
+
+    wheel.schedule(std::shared_ptr<RequestDeadline>(deadlines.back()));
+  }
+
+  // The reply came in first - never expires
+  ASSERT_TRUE(deadlines[2]->complete(ResponseBuilder::makeInt(2)));
+  ASSERT_EQ(wheel.size(), 3u);
+
+  std::vector<std::shared_ptr<RequestDeadline>> expired;
+  wheel.advance(start + std::chrono::milliseconds(10), expired);
+  ASSERT_EQ(expired.size(), 1u);
+  ASSERT_EQ(expired[0], deadlines[0]);
+  ASSERT_EQ(wheel.size(), 2u);
+
+  // More than a full turn of the wheel away
+  expired.clear();
+  wheel.advance(start + std::chrono::milliseconds(1000), expired);
+  ASSERT_TRUE(expired.empty());
+
+  wheel.advance(start + std::chrono::milliseconds(2001), expired);
+  ASSERT_EQ(expired.size(), 1u);
+  ASSERT_EQ(expired[0], deadlines[1]);
+  ASSERT_EQ(wheel.size(), 0u);
+
+  ASSERT_TRUE(expired[0]->complete(ResponseBuilder::makeErr("ERR deadline exceeded")));
+  ASSERT_FALSE(expired[0]->complete(ResponseBuilder::makeInt(1)));
+  ASSERT_EQ(describeRedisReply(replies[1]), "(error) ERR deadline exceeded");
+  ASSERT_EQ(replies[2]->integer, 2);
+}
+
+TEST(ConnectionCore, Deadlines) {
+  ConnectionCore core(nullptr, nullptr, BackpressureStrategy::Default(), false);
+
+  auto stageWithDeadline = [&](EncodedRequest &&req, std::chrono::milliseconds timeout) {
+    std::shared_ptr<std::promise<redisReplyPtr>> prom = std::make_shared<std::promise<redisReplyPtr>>();
+    std::future<redisReplyPtr> fut = prom->get_future();
+    core.stage([prom](redisReplyPtr &&reply) { prom->set_value(std::move(reply)); },
+      std::move(req), std::chrono::steady_clock::now() + timeout);
+    return fut;
+  };
+
+  // Written, then expired - the late response is discarded
+  std::future<redisReplyPtr> fut1 = stageWithDeadline(EncodedRequest::make("get", "1"), std::chrono::milliseconds(20));
+  std::future<redisReplyPtr> fut2 = core.stage(EncodedRequest::make("ping", "2"));
+
+  std::vector<StagedRequest*> batch;
+  ASSERT_EQ(core.getNextToWrite(batch, 10, 1024), 2u);
+
+  ASSERT_EQ(fut1.wait_for(std::chrono::seconds(5)), std::future_status::ready);
+  ASSERT_EQ(describeRedisReply(fut1.get()), "(error) ERR deadline exceeded");
+
+  ASSERT_TRUE(core.consumeResponse(ResponseBuilder::makeInt(1)));
+  ASSERT_TRUE(core.consumeResponse(ResponseBuilder::makeInt(2)));
+  ASSERT_EQ(fut2.get()->integer, 2);
+
+  // Expired before being written - never sent, and gets no response
+  std::future<redisReplyPtr> fut3 = stageWithDeadline(EncodedRequest::make("get", "3"), std::chrono::milliseconds(0));
+  ASSERT_EQ(fut3.wait_for(std::chrono::seconds(5)), std::future_status::ready);
+  ASSERT_EQ(describeRedisReply(fut3.get()), "(error) ERR deadline exceeded");
+
+  std::future<redisReplyPtr> fut4 = core.stage(EncodedRequest::make("ping", "4"));
+  std::future<redisReplyPtr> fut5 = stageWithDeadline(EncodedRequest::make("get", "5"), std::chrono::seconds(60));
+
+  ASSERT_EQ(core.getNextToWrite(batch, 10, 1024), 2u);
+  ASSERT_EQ(std::string(batch[0]->getBuffer(), batch[0]->getLen()), EncodedRequest::make("ping", "4").toString());
+
+  ASSERT_TRUE(core.consumeResponse(ResponseBuilder::makeInt(4)));
+  ASSERT_EQ(fut4.get()->integer, 4);
+  ASSERT_TRUE(core.consumeResponse(ResponseBuilder::makeInt(5)));
+  ASSERT_EQ(fut5.get()->integer, 5);
+  ASSERT_EQ(core.getPendingRequests(), 0);
+}
+
+TEST(ConnectionCore, Cancellation) {
+  ConnectionCore core(nullptr, nullptr, BackpressureStrategy::Default(), false);
+
+  auto stageCancellable = [&](EncodedRequest &&req, CancellationHandle &handle) {
+    std::shared_ptr<std::promise<redisReplyPtr>> prom = std::make_shared<std::promise<redisReplyPtr>>();
+    std::future<redisReplyPtr> fut = prom->get_future();
+    handle = core.stageCancellable([prom](redisReplyPtr &&reply) { prom->set_value(std::move(reply)); },
+      std::move(req));
+    return fut;
+  };
+
+  // Written, then cancelled - the late response is discarded
+  CancellationHandle handle1;
+  std::future<redisReplyPtr> fut1 = stageCancellable(EncodedRequest::make("get", "1"), handle1);
+  std::future<redisReplyPtr> fut2 = core.stage(EncodedRequest::make("ping", "2"));
+
+  std::vector<StagedRequest*> batch;
+  ASSERT_EQ(core.getNextToWrite(batch, 10, 1024), 2u);
+
+  ASSERT_TRUE(handle1.cancel());
+  ASSERT_FALSE(handle1.cancel());
+  ASSERT_TRUE(handle1.isCompleted());
+  ASSERT_EQ(describeRedisReply(fut1.get()), "(error) ERR request cancelled");
+
+  ASSERT_TRUE(core.consumeResponse(ResponseBuilder::makeInt(1)));
+  ASSERT_TRUE(core.consumeResponse(ResponseBuilder::makeInt(2)));
+  ASSERT_EQ(fut2.get()->integer, 2);
+
+  // Cancelled before being written - never sent, and gets no response
+  CancellationHandle handle3, handle5;
+  std::future<redisReplyPtr> fut3 = stageCancellable(EncodedRequest::make("get", "3"), handle3);
+  std::future<redisReplyPtr> fut4 = core.stage(EncodedRequest::make("ping", "4"));
+  std::future<redisReplyPtr> fut5 = stageCancellable(EncodedRequest::make("get", "5"), handle5);
+
+  ASSERT_TRUE(handle3.cancel());
+  ASSERT_EQ(describeRedisReply(fut3.get()), "(error) ERR request cancelled");
+
+  ASSERT_EQ(core.getNextToWrite(batch, 10, 1024), 2u);
+  ASSERT_EQ(std::string(batch[0]->getBuffer(), batch[0]->getLen()), EncodedRequest::make("ping", "4").toString());
+
+  // Completed by its reply - nothing left to cancel
+  ASSERT_TRUE(core.consumeResponse(ResponseBuilder::makeInt(4)));
+  ASSERT_EQ(fut4.get()->integer, 4);
+  ASSERT_TRUE(core.consumeResponse(ResponseBuilder::makeInt(5)));
+  ASSERT_EQ(fut5.get()->integer, 5);
+  ASSERT_FALSE(handle5.cancel());
+  ASSERT_FALSE(CancellationHandle().cancel());
+  ASSERT_EQ(core.getPendingRequests(), 0);
+}
+
+TEST(ConnectionCore, ReplayPacing) {
+  ConnectionCore core(nullptr, nullptr, BackpressureStrategy::Default(), false);
+  core.setReplayPacing(ReplayPacing::SlowStart(2, 4));
+
+  // Nothing to replay on the first connection - no pacing
+  std::vector<std::future<redisReplyPtr>> futs;
+  for(size_t i = 0; i < 8; i++) {
+    futs.emplace_back(core.stage(EncodedRequest::make("get", std::to_string(i))));
+  }
+
+  std::vector<StagedRequest*> batch;
+  ASSERT_EQ(core.getNextToWrite(batch, 10, 1024), 8u);
+
+  // Reconnect: At most two requests outstanding at first
+  core.reconnection();
+  ASSERT_EQ(core.getNextToWrite(batch, 10, 1024), 2u);
+  ASSERT_EQ(core.getNextToWrite(batch, 10, 1024), 0u);
+
+  // Each response grows the window by one
+  ASSERT_TRUE(core.consumeResponse(ResponseBuilder::makeInt(0)));
+  ASSERT_EQ(core.getNextToWrite(batch, 10, 1024), 2u);
+  ASSERT_EQ(std::string(batch[0]->getBuffer(), batch[0]->getLen()), EncodedRequest::make("get", "2").toString());
+  ASSERT_EQ(core.getNextToWrite(batch, 10, 1024), 0u);
+
+  // Maximum window reached - pacing is over
+  ASSERT_TRUE(core.consumeResponse(ResponseBuilder::makeInt(1)));
+  ASSERT_EQ(core.getNextToWrite(batch, 10, 1024), 4u);
+
+  for(size_t i = 2; i < 8; i++) {
+    ASSERT_TRUE(core.consumeResponse(ResponseBuilder::makeInt(i)));
+  }
+
+  for(size_t i = 0; i < 8; i++) {
+    ASSERT_REPLY(futs[i], i);
+  }
+
+  ASSERT_EQ(core.getPendingRequests(), 0);
+}
+
+TEST(ConnectionCore, WriteCombining) {
+  ConnectionCore core(nullptr, nullptr, BackpressureStrategy::Default(), false);
+  core.setWriteCombining(true);
+
+  ASSERT_EQ(WriteCombiner::combiningKey(EncodedRequest::make("hset", "k", "f", "1")),
+    WriteCombiner::combiningKey(EncodedRequest::make("HSET", "k", "f", "2")));
+  ASSERT_NE(WriteCombiner::combiningKey(EncodedRequest::make("hset", "k", "f", "1")),
+    WriteCombiner::combiningKey(EncodedRequest::make("hset", "k", "g", "1")));
+  ASSERT_TRUE(WriteCombiner::combiningKey(EncodedRequest::make("set", "k", "v", "EX", "10")).empty());
+  ASSERT_TRUE(WriteCombiner::combiningKey(EncodedRequest::make("hset", "k", "f", "1", "g", "2")).empty());
+
+  // Superseded before being written - only the last value is sent
+  std::future<redisReplyPtr> fut1 = core.stage(EncodedRequest::make("hset", "k", "f", "1"));
+  std::future<redisReplyPtr> fut2 = core.stage(EncodedRequest::make("ping", "2"));
+  std::future<redisReplyPtr> fut3 = core.stage(EncodedRequest::make("hset", "k", "f", "3"));
+
+  std::vector<StagedRequest*> batch;
+  ASSERT_EQ(core.getNextToWrite(batch, 10, 1024), 2u);
+  ASSERT_EQ(std::string(batch[0]->getBuffer(), batch[0]->getLen()), EncodedRequest::make("ping", "2").toString());
+  ASSERT_EQ(std::string(batch[1]->getBuffer(), batch[1]->getLen()), EncodedRequest::make("hset", "k", "f", "3").toString());
+
+  ASSERT_TRUE(core.consumeResponse(ResponseBuilder::makeStr("PONG")));
+  ASSERT_TRUE(core.consumeResponse(ResponseBuilder::makeInt(0)));
+  ASSERT_EQ(fut2.get()->type, REDIS_REPLY_STRING);
+  ASSERT_EQ(fut1.get()->integer, 0);
+  ASSERT_EQ(fut3.get()->integer, 0);
+
+  // Already written - nothing left to combine with
+  std::future<redisReplyPtr> fut4 = core.stage(EncodedRequest::make("set", "k", "4"));
+  ASSERT_EQ(core.getNextToWrite(batch, 10, 1024), 1u);
+  std::future<redisReplyPtr> fut5 = core.stage(EncodedRequest::make("set", "k", "5"));
+  ASSERT_EQ(core.getNextToWrite(batch, 10, 1024), 1u);
+
+  ASSERT_TRUE(core.consumeResponse(ResponseBuilder::makeStr("OK")));
+  ASSERT_TRUE(core.consumeResponse(ResponseBuilder::makeInt(5)));
+  ASSERT_EQ(fut4.get()->type, REDIS_REPLY_STRING);
+  ASSERT_EQ(fut5.get()->integer, 5);
+
+  ASSERT_EQ(core.getStatistics().combinedWrites, 1);
+  ASSERT_EQ(core.getPendingRequests(), 0);
+}
+
+TEST(ConnectionCore, StageMany) {
+  ConnectionCore core(nullptr, nullptr, BackpressureStrategy::Default(), false);
+
+  std::vector<std::future<redisReplyPtr>> futs;
+  std::vector<ReplyCallback> callbacks;
+  std::vector<EncodedRequest> requests;
+
+  for(size_t i = 0; i < 3; i++) {
+    std::shared_ptr<std::promise<redisReplyPtr>> prom = std::make_shared<std::promise<redisReplyPtr>>();
+    futs.emplace_back(prom->get_future());
+    callbacks.emplace_back([prom](redisReplyPtr &&reply) { prom->set_value(std::move(reply)); });
+    requests.emplace_back(EncodedRequest::make("ping", std::to_string(i)));
+  }
+
+  std::future<redisReplyPtr> before = core.stage(EncodedRequest::make("ping", "before"));
+  core.stage(callbacks, requests);
+  ASSERT_TRUE(callbacks.empty());
+  ASSERT_TRUE(requests.empty());
+
+  std::vector<StagedRequest*> batch;
+  ASSERT_EQ(core.getNextToWrite(batch, 10, 1024), 4u);
+  for(size_t i = 1; i < 4; i++) {
+    ASSERT_EQ(std::string(batch[i]->getBuffer(), batch[i]->getLen()), EncodedRequest::make("ping", std::to_string(i - 1)).toString());
+  }
+
+  for(int64_t i = 0; i < 4; i++) {
+    ASSERT_TRUE(core.consumeResponse(ResponseBuilder::makeInt(i)));
+  }
+
+  ASSERT_EQ(before.get()->integer, 0);
+  for(size_t i = 0; i < 3; i++) {
+    ASSERT_EQ(futs[i].get()->integer, (int64_t) i + 1);
+  }
+
+  ASSERT_EQ(core.getPendingRequests(), 0);
+}
+
+TEST(ConnectionCore, FireAndForget) {
+  ConnectionCore core(nullptr, nullptr, BackpressureStrategy::Default(), false);
+
+  core.stage(nullptr, EncodedRequest::make("publish", "ch", "1"));
+  core.stage(nullptr, EncodedRequest::make("publish", "ch", "2"));
+  std::future<redisReplyPtr> fut = core.stage(EncodedRequest::make("ping"));
+
+  std::vector<StagedRequest*> batch;
+  ASSERT_EQ(core.getNextToWrite(batch, 10, 1024), 3u);
+
+  ASSERT_TRUE(core.nextResponseIsFireAndForget());
+  core.skippedFireAndForget();
+
+  // Errors go through the regular path, and are counted
+  ASSERT_TRUE(core.nextResponseIsFireAndForget());
+  ASSERT_TRUE(core.consumeResponse(ResponseBuilder::makeErr("ERR no")));
+  ASSERT_EQ(core.getStatistics().fireAndForgetErrors, 1);
+
+  ASSERT_FALSE(core.nextResponseIsFireAndForget());
+  ASSERT_TRUE(core.consumeResponse(ResponseBuilder::makeStatus("PONG")));
+  ASSERT_EQ(describeRedisReply(fut.get()), "PONG");
+  ASSERT_EQ(core.getPendingRequests(), 0);
+}
+
+TEST(AllocationAccounting, Encoding) {
+  AllocationStatistics before = AllocationAccounting::get();
+  EncodedRequest small = EncodedRequest::make("GET", "abc");
+  EncodedRequest large = EncodedRequest::make("SET", "abc", std::string(1024, 'x'));
+  AllocationStatistics after = AllocationAccounting::get();
+
+  if(!AllocationAccounting::enabled()) {
+    ASSERT_EQ(after.totalAllocations(), 0);
+    return;
+  }
+
+  ASSERT_EQ(after.encoding.allocations - before.encoding.allocations, 1);
+  ASSERT_EQ(after.encoding.bytes - before.encoding.bytes, (int64_t) large.getLen());
+}
+
+class RecordingLogger : public Logger {
+public:
+  void print(LogLevel level, int line, const std::string &file, const std::string &msg) override {
+    std::unique_lock<std::mutex> lock(mtx);
+    cv.wait(lock, [this]() { return !blocked; });
+    messages.push_back(msg);
+  }
+
+  void setBlocked(bool value) {
+    std::lock_guard<std::mutex> lock(mtx);
+    blocked = value;
+    cv.notify_all();
+  }
+
+  std::mutex mtx;
+  std::condition_variable cv;
+  bool blocked = false;
+  std::vector<std::string> messages;
+};
+
+TEST(AsyncLogger, DeliversInOrder) {
+  std::shared_ptr<RecordingLogger> sink = std::make_shared<RecordingLogger>();
+  AsyncLogger logger(sink, 16);
+  logger.setRateLimit(0, std::chrono::milliseconds(1000));
+
+  for(size_t i = 0; i < 10; i++) {
+    QCLIENT_LOG((&logger), LogLevel::kInfo, "message " << i);
+  }
+
+  // Formatting below the active level never happens
+  QCLIENT_LOG((&logger), LogLevel::kDebug, "invisible");
+
+  logger.flush();
+  ASSERT_EQ(sink->messages.size(), 10u);
+  for(size_t i = 0; i < 10; i++) {
+    ASSERT_EQ(sink->messages[i], "message " + std::to_string(i));
+  }
+}
+
+TEST(AsyncLogger, RateLimit) {
+  std::shared_ptr<RecordingLogger> sink = std::make_shared<RecordingLogger>();
+
+  {
+    AsyncLogger logger(sink);
+    logger.setRateLimit(5, std::chrono::hours(1));
+
+    for(size_t i = 0; i < 20; i++) {
+      logger.print(LogLevel::kError, 10, "func", "storm");
+    }
+
+    logger.print(LogLevel::kError, 11, "func", "other");
+    logger.flush();
+
+    ASSERT_EQ(sink->messages.size(), 6u);
+    ASSERT_EQ(logger.getSuppressed(), 15);
+  }
+
+  ASSERT_EQ(sink->messages.size(), 7u);
+  ASSERT_EQ(sink->messages.back(), "Suppressed 15 similar messages");
+}
+
+TEST(AsyncLogger, DropsWhenFull) {
+  std::shared_ptr<RecordingLogger> sink = std::make_shared<RecordingLogger>();
+  sink->setBlocked(true);
+
+  {
+    AsyncLogger logger(sink, 4);
+    logger.setRateLimit(0, std::chrono::milliseconds(1000));
+
+    // Never blocks, even though the sink is stuck
+    for(size_t i = 0; i < 20; i++) {
+      logger.print(LogLevel::kError, i, "func", "message");
+    }
+
+    ASSERT_GE(logger.getDropped(), 15);
+    sink->setBlocked(false);
+  }
+
+  ASSERT_LE(sink->messages.size(), 6u);
+  ASSERT_EQ(sink->messages.back().find("Log queue full, dropped "), 0u);
+}
+
+TEST(ConsistentHashRing, Distribution) {
+  ConsistentHashRing ring(4, 160);
+  ConsistentHashRing grown(5, 160);
+
+  std::vector<size_t> counts(4);
+  size_t moved = 0;
+
+  for(size_t i = 0; i < 10000; i++) {
+    std::string key = "key-" + std::to_string(i);
+    size_t shard = ring.getShard(key);
+    ASSERT_LT(shard, 4u);
+    ASSERT_EQ(shard, ring.getShard(key));
+    counts[shard]++;
+
+    size_t newShard = grown.getShard(key);
+    if(newShard != shard) {
+      // Keys only ever move to the new shard
+      ASSERT_EQ(newShard, 4u);
+      moved++;
+    }
+  }
+
+  for(size_t i = 0; i < counts.size(); i++) {
+    ASSERT_GT(counts[i], 1800u);
+    ASSERT_LT(counts[i], 3200u);
+  }
+
+  ASSERT_GT(moved, 1200u);
+  ASSERT_LT(moved, 2800u);
+
+  // Hash tags
+  ASSERT_EQ(ring.getShard("{user:1}:name"), ring.getShard("user:1"));
+  ASSERT_EQ(ring.getShard("{user:1}:name"), ring.getShard("a{user:1}b"));
+  ASSERT_EQ(ring.getShard("{}x"), ring.getShard(std::string("{}x")));
+
+  ConsistentHashRing single(1, 160);
+  ASSERT_EQ(single.getShard("anything"), 0u);
+}
+
+TEST(AssistedThread, CpuAffinity) {
+  std::atomic<int> allowedCpus {0};
+
+  AssistedThread thread([&](ThreadAssistant &assistant) {
+    while(!assistant.terminationRequested()) {
+#ifdef __linux__
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      if(sched_getaffinity(0, sizeof(set), &set) == 0) {
+        allowedCpus = CPU_COUNT(&set);
+      }
+#endif
+      assistant.wait_for(std::chrono::milliseconds(1));
+    }
+  });
+
+  ASSERT_TRUE(thread.setAffinity({}));
+
+#ifdef __linux__
+  ASSERT_TRUE(thread.setAffinity({0}));
+
+  for(size_t i = 0; i < 1000 && allowedCpus != 1; i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+
+  ASSERT_EQ(allowedCpus, 1);
+#endif
+
+  thread.join();
+  ASSERT_FALSE(thread.setAffinity({0}));
+
+  Options opts;
+  opts.withCpuAffinity({0, 1}).withBusyPoll(std::chrono::microseconds(50));
+  Options copy = opts.clone();
+  ASSERT_EQ(copy.cpuAffinity, std::vector<int>({0, 1}));
+  ASSERT_EQ(copy.busyPoll, std::chrono::microseconds(50));
+}
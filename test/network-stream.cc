@@ -23,9 +23,48 @@
 
 #include <gtest/gtest.h>
 #include "qclient/QClient.hh"
+#include "qclient/RateLimiter.hh"
+#include "qclient/ShardedClient.hh"
 #include <functional>
 #include "qclient/network/AsyncConnector.hh"
 #include "qclient/network/HostResolver.hh"
+#include "network/NetworkStream.hh"
+#include "network/IoUring.hh"
+#include "network/LinkShaper.hh"
+#include "network/SharedMemoryChannel.hh"
+#include "qclient/ResponseBuilder.hh"
+#include "ReplyMacros.hh"
+#include "qclient/FaultInjector.hh"
+#include "StandbyConnection.hh"
+#include "qclient/TlsFilter.hh"
+#include "qclient/SSTR.hh"
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+#include <openssl/ec.h>
+#include <fcntl.h>
+#include "qclient/EventLoopGroup.hh"
+#include "qclient/ExternalEventLoop.hh"
+#include "qclient/pubsub/MessageListener.hh"
+#include "qclient/pubsub/Message.hh"
+#include "qclient/structures/QDeque.hh"
+#include "qclient/structures/QLocalityHash.hh"
+#include "qclient/structures/ScanPipeline.hh"
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <thread>
+#include <set>
+#include <map>
 
 using namespace qclient;
 
@@ -42,3 +81,2879 @@ TEST(AsyncConnector, noone_is_listening) {
   ASSERT_FALSE(connector.ok());
   ASSERT_EQ(connector.getErrno(), ECONNREFUSED);
 }
+
+TEST(AsyncConnector, SocketProfile) {
+  SocketProfile bdp = SocketProfile::BandwidthDelay(125000000, std::chrono::milliseconds(40));
+  ASSERT_EQ(bdp.getSendBufferSize(), 5000000u);
+  ASSERT_EQ(bdp.getReceiveBufferSize(), 5000000u);
+  ASSERT_EQ(SocketProfile::BandwidthDelay(1000, std::chrono::milliseconds(1)).getSendBufferSize(), 64u * 1024u);
+  ASSERT_EQ(SocketProfile::Default().getSendBufferSize(), 0u);
+
+  int listener = socket(AF_INET, SOCK_STREAM, 0);
+  ASSERT_GE(listener, 0);
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = 0;
+  ASSERT_EQ(::bind(listener, (struct sockaddr*) &addr, sizeof(addr)), 0);
+  ASSERT_EQ(::listen(listener, 10), 0);
+
+  socklen_t len = sizeof(addr);
+  ASSERT_EQ(getsockname(listener, (struct sockaddr*) &addr, &len), 0);
+
+  ServiceEndpoint endpoint(ProtocolType::kIPv4, SocketType::kStream, "127.0.0.1", ntohs(addr.sin_port), "localhost");
+  AsyncConnector connector(endpoint, SocketProfile::LowLatency(std::chrono::seconds(12)));
+  ASSERT_TRUE(connector.blockUntilReady(-1, std::chrono::seconds(5)));
+  ASSERT_TRUE(connector.ok());
+
+  int value = 0;
+  len = sizeof(value);
+  ASSERT_EQ(getsockopt(connector.getFd(), IPPROTO_TCP, TCP_NODELAY, &value, &len), 0);
+  ASSERT_NE(value, 0);
+  ASSERT_EQ(getsockopt(connector.getFd(), SOL_SOCKET, SO_KEEPALIVE, &value, &len), 0);
+  ASSERT_NE(value, 0);
+  ASSERT_EQ(getsockopt(connector.getFd(), IPPROTO_TCP, TCP_KEEPIDLE, &value, &len), 0);
+  ASSERT_EQ(value, 6);
+  ASSERT_EQ(getsockopt(connector.getFd(), IPPROTO_TCP, TCP_KEEPINTVL, &value, &len), 0);
+  ASSERT_EQ(value, 2);
+
+  ::close(listener);
+}
+
+TEST(ParallelConnector, FirstSuccessWins) {
+  // Listening socket on an ephemeral port
+  int listener = socket(AF_INET, SOCK_STREAM, 0);
+  ASSERT_GE(listener, 0);
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = 0;
+  ASSERT_EQ(::bind(listener, (struct sockaddr*) &addr, sizeof(addr)), 0);
+  ASSERT_EQ(::listen(listener, 10), 0);
+
+  socklen_t len = sizeof(addr);
+  ASSERT_EQ(getsockname(listener, (struct sockaddr*) &addr, &len), 0);
+  uint16_t port = ntohs(addr.sin_port);
+
+  // Unroutable, then refused, then the good one
+  std::vector<ServiceEndpoint> endpoints;
+  endpoints.emplace_back(ProtocolType::kIPv4, SocketType::kStream, "10.255.255.1", port, "blackhole");
+  endpoints.emplace_back(ProtocolType::kIPv4, SocketType::kStream, "127.0.0.1", 13000, "refused");
+  endpoints.emplace_back(ProtocolType::kIPv4, SocketType::kStream, "127.0.0.1", port, "localhost");
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+  ParallelConnector connector(endpoints, std::chrono::milliseconds(50));
+  ASSERT_TRUE(connector.blockUntilReady(-1, std::chrono::seconds(10)));
+  ASSERT_TRUE(connector.ok());
+  ASSERT_EQ(connector.getEndpoint(), endpoints[2]);
+
+  // Didn't wait for the blackholed endpoint to time out
+  ASSERT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(2));
+
+  int fd = connector.release();
+  ASSERT_GE(fd, 0);
+  ::close(fd);
+  ::close(listener);
+
+  // Nothing to connect to
+  std::vector<ServiceEndpoint> refused;
+  refused.emplace_back(ProtocolType::kIPv4, SocketType::kStream, "127.0.0.1", 13000, "refused");
+
+  ParallelConnector connector2(refused, std::chrono::milliseconds(50));
+  ASSERT_TRUE(connector2.blockUntilReady(-1, std::chrono::seconds(10)));
+  ASSERT_FALSE(connector2.ok());
+  ASSERT_FALSE(connector2.getError().empty());
+}
+
+TEST(StandbyConnection, ReadyAndTake) {
+  int listener = socket(AF_INET, SOCK_STREAM, 0);
+  ASSERT_GE(listener, 0);
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = 0;
+  ASSERT_EQ(::bind(listener, (struct sockaddr*) &addr, sizeof(addr)), 0);
+  ASSERT_EQ(::listen(listener, 10), 0);
+
+  socklen_t len = sizeof(addr);
+  ASSERT_EQ(getsockname(listener, (struct sockaddr*) &addr, &len), 0);
+  uint16_t port = ntohs(addr.sin_port);
+
+  //----------------------------------------------------------------------------
+  // Fake server: answer each PING arriving on any connection with PONG.
+  //----------------------------------------------------------------------------
+  std::atomic<bool> stop {false};
+  std::atomic<int> accepted {0};
+  std::atomic<int> pings {0};
+
+  std::thread server([&]() {
+    std::vector<struct pollfd> polls(1);
+    polls[0].fd = listener;
+    polls[0].events = POLLIN;
+
+    while(!stop) {
+      if(poll(polls.data(), polls.size(), 10) <= 0) continue;
+
+      for(size_t i = 1; i < polls.size(); i++) {
+        if(polls[i].revents == 0) continue;
+
+        char buffer[128];
+        ssize_t bytes = ::recv(polls[i].fd, buffer, sizeof(buffer), 0);
+        if(bytes > 0) {
+          ASSERT_EQ(std::string(buffer, bytes), "*1\r\n$4\r\nPING\r\n");
+          ASSERT_EQ(::send(polls[i].fd, "+PONG\r\n", 7, 0), 7);
+          pings++;
+        }
+      }
+
+      if(polls[0].revents != 0) {
+        struct pollfd conn;
+        conn.fd = ::accept(listener, nullptr, nullptr);
+        conn.events = POLLIN;
+        conn.revents = 0;
+        polls.push_back(conn);
+        accepted++;
+      }
+    }
+
+    for(size_t i = 1; i < polls.size(); i++) {
+      ::close(polls[i].fd);
+    }
+  });
+
+  {
+    StandbyConnection standby(nullptr, Members("127.0.0.1", port), TlsConfig(),
+      nullptr, {}, std::chrono::seconds(2), std::chrono::milliseconds(20));
+
+    for(size_t i = 0; i < 500 && !standby.ready(); i++) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    ASSERT_TRUE(standby.ready());
+
+    // Kept alive in the background
+    int pingsBefore = pings;
+    for(size_t i = 0; i < 500 && pings < pingsBefore + 3; i++) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    ASSERT_GE(pings, pingsBefore + 3);
+
+    // The keepalive may be holding it - wait until it's handed back
+    Endpoint endpoint;
+    std::unique_ptr<NetworkStream> stream = standby.take(endpoint, std::chrono::seconds(5));
+
+    ASSERT_TRUE(stream);
+    ASSERT_TRUE(stream->ok());
+    ASSERT_EQ(endpoint, Endpoint("127.0.0.1", port));
+
+    // A replacement is established
+    for(size_t i = 0; i < 500 && (!standby.ready() || accepted < 2); i++) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    ASSERT_TRUE(standby.ready());
+    ASSERT_EQ(accepted, 2);
+  }
+
+  stop = true;
+  server.join();
+  ::close(listener);
+}
+
+TEST(QClient, UnixDomainSocket) {
+  std::string path = "/tmp/qclient-tests-" + std::to_string(getpid()) + ".sock";
+  ::unlink(path.c_str());
+
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  ASSERT_GE(listener, 0);
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+  ASSERT_EQ(::bind(listener, (struct sockaddr*) &addr, sizeof(addr)), 0);
+  ASSERT_EQ(::listen(listener, 10), 0);
+
+  //----------------------------------------------------------------------------
+  // Fake server: answer a single PING with PONG.
+  //----------------------------------------------------------------------------
+  std::thread server([&]() {
+    int conn = ::accept(listener, nullptr, nullptr);
+    ASSERT_GE(conn, 0);
+
+    std::string received;
+    char buffer[128];
+    while(received.size() < 14) {
+      ssize_t bytes = ::recv(conn, buffer, sizeof(buffer), 0);
+      ASSERT_GT(bytes, 0);
+      received.append(buffer, bytes);
+    }
+
+    ASSERT_EQ(received, "*1\r\n$4\r\nPING\r\n");
+    ASSERT_EQ(::send(conn, "+PONG\r\n", 7, 0), 7);
+    ::close(conn);
+  });
+
+  {
+    Options opts;
+    opts.ensureConnectionIsPrimed = false;
+    QClient qcl(Members::fromString("unix:" + path), std::move(opts));
+    redisReplyPtr reply = qcl.exec("PING").get();
+    ASSERT_TRUE(reply);
+    ASSERT_EQ(std::string(reply->str, reply->len), "PONG");
+  }
+
+  server.join();
+  ::close(listener);
+  ::unlink(path.c_str());
+}
+
+TEST(QClient, RateLimiter) {
+  std::string path = "/tmp/qclient-tests-ratelimit-" + std::to_string(getpid()) + ".sock";
+  ::unlink(path.c_str());
+
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  ASSERT_GE(listener, 0);
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+  ASSERT_EQ(::bind(listener, (struct sockaddr*) &addr, sizeof(addr)), 0);
+  ASSERT_EQ(::listen(listener, 10), 0);
+
+  //----------------------------------------------------------------------------
+  // Fake server: answer every "PING NNNN" with PONG, until the client goes
+  // away. Arguments differ, so that no two requests get coalesced.
+  //----------------------------------------------------------------------------
+  auto ping = [](size_t i) {
+    char arg[8];
+    snprintf(arg, sizeof(arg), "%04zu", i);
+    return std::string(arg);
+  };
+
+  const size_t frameSize = EncodedRequest::make("PING", ping(0)).getLen();
+
+  std::thread server([&]() {
+    int conn = ::accept(listener, nullptr, nullptr);
+    ASSERT_GE(conn, 0);
+
+    std::string received;
+    char buffer[4096];
+
+    while(true) {
+      ssize_t bytes = ::recv(conn, buffer, sizeof(buffer), 0);
+      if(bytes <= 0) break;
+      received.append(buffer, bytes);
+
+      while(received.size() >= frameSize) {
+        received.erase(0, frameSize);
+        ASSERT_EQ(::send(conn, "+PONG\r\n", 7, 0), 7);
+      }
+    }
+
+    ::close(conn);
+  });
+
+  // 100 requests per second, at most one at a time
+  std::shared_ptr<RateLimiter> limiter = std::make_shared<RateLimiter>(0, 100,
+    std::chrono::milliseconds(10));
+
+  {
+    Options opts;
+    opts.ensureConnectionIsPrimed = false;
+    opts.withRateLimiter(limiter);
+    QClient qcl(Members::fromString("unix:" + path), std::move(opts));
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::vector<std::future<redisReplyPtr>> futs;
+    for(size_t i = 0; i < 20; i++) {
+      futs.emplace_back(qcl.exec("PING", ping(i)));
+    }
+
+    for(auto &fut : futs) {
+      ASSERT_EQ(describeRedisReply(fut.get()), "PONG");
+    }
+
+    // Producers weren't held up, the writer was
+    ASSERT_GE(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(150));
+    ASSERT_GT(limiter->getThrottledTime(), std::chrono::milliseconds(100));
+    ASSERT_EQ(limiter->getRequestsConsumed(), 20u);
+
+    // Lift the limit, without reconnecting
+    limiter->setRates(0, 0);
+    start = std::chrono::steady_clock::now();
+    futs.clear();
+    for(size_t i = 0; i < 1000; i++) {
+      futs.emplace_back(qcl.exec("PING", ping(i)));
+    }
+
+    for(auto &fut : futs) {
+      ASSERT_EQ(describeRedisReply(fut.get()), "PONG");
+    }
+
+    ASSERT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(5));
+  }
+
+  server.join();
+  ::close(listener);
+  ::unlink(path.c_str());
+}
+
+TEST(SharedMemoryChannel, BothDirections) {
+  std::string err;
+  std::unique_ptr<SharedMemoryChannel> client = SharedMemoryChannel::create(100, err);
+  ASSERT_TRUE(client) << err;
+  ASSERT_EQ(client->getRingSize(), 4096u);
+
+  int fds[SharedMemoryChannel::kFdCount];
+  for(size_t i = 0; i < SharedMemoryChannel::kFdCount; i++) {
+    fds[i] = dup(client->getFds()[i]);
+  }
+
+  std::unique_ptr<SharedMemoryChannel> server = SharedMemoryChannel::attach(fds, err);
+  ASSERT_TRUE(server) << err;
+
+  //----------------------------------------------------------------------------
+  // Nothing to read yet - the doorbell rings once the client writes.
+  //----------------------------------------------------------------------------
+  char buffer[8192];
+  ASSERT_EQ(server->read(buffer, sizeof(buffer)), 0u);
+
+  struct pollfd pfd;
+  pfd.fd = server->getReadableFd();
+  pfd.events = POLLIN;
+  ASSERT_EQ(poll(&pfd, 1, 0), 0);
+
+  std::string first(3000, 'a');
+  struct iovec iov = { (void*) first.data(), first.size() };
+  ASSERT_EQ(client->write(&iov, 1), 3000u);
+  ASSERT_EQ(poll(&pfd, 1, 0), 1);
+
+  ASSERT_EQ(server->read(buffer, sizeof(buffer)), 3000u);
+  ASSERT_EQ(std::string(buffer, 3000), first);
+
+  //----------------------------------------------------------------------------
+  // Wrap around, and fill the ring up - the writer gets to know once there's
+  // space again.
+  //----------------------------------------------------------------------------
+  std::string part1(2000, 'b');
+  std::string part2(4000, 'c');
+  struct iovec iovs[2] = { { (void*) part1.data(), part1.size() }, { (void*) part2.data(), part2.size() } };
+  ASSERT_EQ(client->write(iovs, 2), 4096u);
+  ASSERT_EQ(client->write(iovs, 2), 0u);
+
+  pfd.fd = client->getWritableFd();
+  ASSERT_EQ(poll(&pfd, 1, 0), 0);
+
+  ASSERT_EQ(server->read(buffer, 100), 100u);
+  ASSERT_EQ(poll(&pfd, 1, 0), 1);
+  ASSERT_EQ(server->read(buffer + 100, sizeof(buffer)), 3996u);
+  ASSERT_EQ(std::string(buffer, 4096), part1 + part2.substr(0, 2096));
+
+  //----------------------------------------------------------------------------
+  // The other direction is independent.
+  //----------------------------------------------------------------------------
+  struct iovec pong = { (void*) "+PONG\r\n", 7 };
+  ASSERT_EQ(server->write(&pong, 1), 7u);
+  ASSERT_EQ(client->read(buffer, sizeof(buffer)), 7u);
+  ASSERT_EQ(std::string(buffer, 7), "+PONG\r\n");
+  ASSERT_EQ(client->read(buffer, sizeof(buffer)), 0u);
+}
+
+TEST(SharedMemoryChannel, RejectsGarbage) {
+  int fds[SharedMemoryChannel::kFdCount];
+  fds[0] = memfd_create("garbage", 0);
+  ASSERT_GE(fds[0], 0);
+  std::string junk(8192, 'x');
+  ASSERT_EQ(::write(fds[0], junk.data(), junk.size()), (ssize_t) junk.size());
+
+  for(size_t i = 1; i < SharedMemoryChannel::kFdCount; i++) {
+    fds[i] = eventfd(0, EFD_NONBLOCK);
+  }
+
+  std::string err;
+  ASSERT_FALSE(SharedMemoryChannel::attach(fds, err));
+  ASSERT_EQ(err, "invalid shared memory header");
+}
+
+namespace {
+
+//------------------------------------------------------------------------------
+// Fake unix socket server: Takes the shared memory channel on offer if
+// accept is set, then serves PING, SET and GET through it - or over the
+// socket, after refusing.
+//------------------------------------------------------------------------------
+class ShmFakeServer {
+public:
+  ShmFakeServer(const std::string &p, bool accept) : path(p) {
+    ::unlink(path.c_str());
+    listener = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    EXPECT_EQ(::bind(listener, (struct sockaddr*) &addr, sizeof(addr)), 0);
+    EXPECT_EQ(::listen(listener, 10), 0);
+
+    thread = std::thread(&ShmFakeServer::serve, this, accept);
+  }
+
+  ~ShmFakeServer() {
+    thread.join();
+    ::close(listener);
+    ::unlink(path.c_str());
+  }
+
+  std::atomic<bool> attached {false};
+
+private:
+  void serve(bool accept) {
+    int conn = ::accept(listener, nullptr, nullptr);
+    ASSERT_GE(conn, 0);
+
+    char request[64];
+    struct iovec iov = { request, sizeof(request) };
+    char control[CMSG_SPACE(sizeof(int) * SharedMemoryChannel::kFdCount)];
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t bytes = recvmsg(conn, &msg, 0);
+    ASSERT_EQ(std::string(request, bytes), "*1\r\n$10\r\nSHM-ATTACH\r\n");
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    ASSERT_TRUE(cmsg != nullptr);
+    ASSERT_EQ(cmsg->cmsg_type, SCM_RIGHTS);
+
+    int fds[SharedMemoryChannel::kFdCount];
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+    std::string err;
+    std::unique_ptr<SharedMemoryChannel> channel;
+
+    if(accept) {
+      channel = SharedMemoryChannel::attach(fds, err);
+      ASSERT_TRUE(channel) << err;
+      ASSERT_EQ(::send(conn, "+OK\r\n", 5, 0), 5);
+      attached = true;
+    }
+    else {
+      for(int fd : fds) ::close(fd);
+      std::string refusal = "-ERR unknown command 'SHM-ATTACH'\r\n";
+      ASSERT_EQ(::send(conn, refusal.data(), refusal.size(), 0), (ssize_t) refusal.size());
+    }
+
+    ResponseBuilder builder;
+    std::map<std::string, std::string> contents;
+
+    while(true) {
+      struct pollfd polls[2];
+      polls[0].fd = conn;
+      polls[0].events = channel ? POLLRDHUP : POLLIN;
+      polls[1].fd = channel ? channel->getReadableFd() : -1;
+      polls[1].events = POLLIN;
+
+      char buffer[1024];
+      size_t len = channel ? channel->read(buffer, sizeof(buffer)) : 0;
+      if(len == 0) {
+        poll(polls, 2, -1);
+        if(channel && polls[0].revents != 0) break;
+        if(channel) continue;
+
+        ssize_t rc = ::recv(conn, buffer, sizeof(buffer), 0);
+        if(rc <= 0) break;
+        len = rc;
+      }
+
+      builder.feed(buffer, len);
+
+      redisReplyPtr req;
+      while(builder.pull(req) == ResponseBuilder::Status::kOk) {
+        std::string cmd(req->element[0]->str, req->element[0]->len);
+        std::string response = "+OK\r\n";
+
+        if(cmd == "PING") {
+          response = "+PONG\r\n";
+        }
+        else if(cmd == "SET") {
+          contents[std::string(req->element[1]->str, req->element[1]->len)] =
+            std::string(req->element[2]->str, req->element[2]->len);
+        }
+        else if(cmd == "GET") {
+          const std::string &value = contents[std::string(req->element[1]->str, req->element[1]->len)];
+          response = SSTR("$" << value.size() << "\r\n" << value << "\r\n");
+        }
+
+        respond(conn, channel.get(), response);
+      }
+    }
+
+    ::close(conn);
+  }
+
+  void respond(int conn, SharedMemoryChannel *channel, const std::string &response) {
+    if(!channel) {
+      ASSERT_EQ(::send(conn, response.data(), response.size(), MSG_NOSIGNAL), (ssize_t) response.size());
+      return;
+    }
+
+    size_t sent = 0;
+    while(sent < response.size()) {
+      struct iovec iov = { (void*) (response.data() + sent), response.size() - sent };
+      size_t written = channel->write(&iov, 1);
+      sent += written;
+
+      if(written == 0) {
+        struct pollfd pfd;
+        pfd.fd = channel->getWritableFd();
+        pfd.events = POLLIN;
+        poll(&pfd, 1, 1000);
+      }
+    }
+  }
+
+  std::string path;
+  int listener;
+  std::thread thread;
+};
+
+}
+
+TEST(QClient, SharedMemoryTransport) {
+  std::string path = "/tmp/qclient-tests-shm-" + std::to_string(getpid()) + ".sock";
+  ShmFakeServer server(path, true);
+
+  // Values larger than the rings make both sides wait for the other
+  std::string value(50000, 'v');
+  for(size_t i = 0; i < value.size(); i++) {
+    value[i] = 'a' + (i % 26);
+  }
+
+  {
+    Options opts;
+    opts.ensureConnectionIsPrimed = false;
+    opts.withSharedMemoryTransport(4096);
+
+    QClient qcl(Members::fromString("unix:" + path), std::move(opts));
+    ASSERT_REPLY(qcl.exec("PING"), "PONG");
+
+    std::vector<std::future<redisReplyPtr>> futures;
+    for(size_t i = 0; i < 20; i++) {
+      futures.emplace_back(qcl.exec("SET", SSTR("key-" << i), value + std::to_string(i)));
+      futures.emplace_back(qcl.exec("GET", SSTR("key-" << i)));
+    }
+
+    for(size_t i = 0; i < 20; i++) {
+      ASSERT_REPLY(futures[2*i], "OK");
+      ASSERT_REPLY(futures[2*i+1], value + std::to_string(i));
+    }
+
+    ASSERT_TRUE(server.attached);
+  }
+}
+
+TEST(QClient, SharedMemoryTransportRefused) {
+  std::string path = "/tmp/qclient-tests-shm-" + std::to_string(getpid()) + ".sock";
+  ShmFakeServer server(path, false);
+
+  {
+    Options opts;
+    opts.ensureConnectionIsPrimed = false;
+    opts.withSharedMemoryTransport(4096);
+
+    QClient qcl(Members::fromString("unix:" + path), std::move(opts));
+    ASSERT_REPLY(qcl.exec("PING"), "PONG");
+    ASSERT_REPLY(qcl.exec("SET", "key", "value"), "OK");
+    ASSERT_REPLY(qcl.exec("GET", "key"), "value");
+    ASSERT_FALSE(server.attached);
+  }
+}
+
+TEST(LinkShaper, Timings) {
+  using namespace std::chrono;
+
+  // 1MB/s: A megabyte occupies the link for a second, in either direction
+  LinkShaper shaper(LinkShaping().withBandwidth(1000000).withLatency(milliseconds(50)));
+  steady_clock::time_point start = steady_clock::now();
+
+  ASSERT_EQ(shaper.sendDelay(), nanoseconds(0));
+  shaper.sent(1000000);
+  ASSERT_GT(shaper.sendDelay(), milliseconds(900));
+
+  steady_clock::time_point first = shaper.releaseTime(1000000);
+  ASSERT_GE(first - start, milliseconds(1050));
+  ASSERT_LT(first - start, milliseconds(1500));
+
+  // Jitter never reorders
+  shaper.configure(LinkShaping().withLatency(milliseconds(10), milliseconds(100)).withSeed(7));
+  steady_clock::time_point prev = shaper.releaseTime(1);
+  for(size_t i = 0; i < 100; i++) {
+    steady_clock::time_point next = shaper.releaseTime(1);
+    ASSERT_GE(next, prev);
+    prev = next;
+  }
+
+  // Stalled for the first 100ms of every hour
+  LinkShaper stalled(LinkShaping().withStalls(minutes(60), milliseconds(100)));
+  ASSERT_GT(stalled.sendDelay(), milliseconds(50));
+  ASSERT_GE(stalled.releaseTime(1) - steady_clock::now(), milliseconds(50));
+}
+
+TEST(FaultInjector, LinkShapingAndPartitions) {
+  int listener = socket(AF_INET, SOCK_STREAM, 0);
+  ASSERT_GE(listener, 0);
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = 0;
+  ASSERT_EQ(::bind(listener, (struct sockaddr*) &addr, sizeof(addr)), 0);
+  ASSERT_EQ(::listen(listener, 10), 0);
+
+  socklen_t len = sizeof(addr);
+  ASSERT_EQ(getsockname(listener, (struct sockaddr*) &addr, &len), 0);
+  int port = ntohs(addr.sin_port);
+
+  //----------------------------------------------------------------------------
+  // Fake server: answer every PING with PONG, note when the client hangs up.
+  //----------------------------------------------------------------------------
+  std::atomic<bool> closed {false};
+  std::thread server([&]() {
+    int conn = ::accept(listener, nullptr, nullptr);
+    ASSERT_GE(conn, 0);
+
+    std::string received;
+    char buffer[128];
+    while(true) {
+      ssize_t bytes = ::recv(conn, buffer, sizeof(buffer), 0);
+      if(bytes <= 0) break;
+      received.append(buffer, bytes);
+
+      while(received.size() >= 14) {
+        ASSERT_EQ(received.substr(0, 14), "*1\r\n$4\r\nPING\r\n");
+        received.erase(0, 14);
+        ASSERT_EQ(::send(conn, "+PONG\r\n", 7, 0), 7);
+      }
+    }
+
+    ::close(conn);
+    closed = true;
+  });
+
+  auto timePing = [](QClient &qcl) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    redisReplyPtr reply = qcl.exec("PING").get();
+    EXPECT_TRUE(reply);
+    return std::chrono::steady_clock::now() - start;
+  };
+
+  {
+    Options opts;
+    opts.ensureConnectionIsPrimed = false;
+    QClient qcl("127.0.0.1", port, std::move(opts));
+    timePing(qcl);
+
+    Endpoint endpoint("127.0.0.1", port);
+    qcl.getFaultInjector().shapeLink(endpoint,
+      LinkShaping().withLatency(std::chrono::milliseconds(300)));
+    ASSERT_GE(timePing(qcl), std::chrono::milliseconds(300));
+
+    qcl.getFaultInjector().unshapeLink(endpoint);
+    ASSERT_LT(timePing(qcl), std::chrono::milliseconds(300));
+
+    qcl.getFaultInjector().addPartition(endpoint);
+    for(size_t i = 0; i < 200 && !closed; i++) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    ASSERT_TRUE(closed);
+  }
+
+  server.join();
+  ::close(listener);
+}
+
+TEST(QClient, StuckPipelineWatchdog) {
+  std::string path = "/tmp/qclient-tests-stuck-" + std::to_string(getpid()) + ".sock";
+  ::unlink(path.c_str());
+
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  ASSERT_GE(listener, 0);
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+  ASSERT_EQ(::bind(listener, (struct sockaddr*) &addr, sizeof(addr)), 0);
+  ASSERT_EQ(::listen(listener, 10), 0);
+
+  //----------------------------------------------------------------------------
+  // Fake server: accept connections, never answer anything.
+  //----------------------------------------------------------------------------
+  std::atomic<bool> stop {false};
+  std::atomic<int> accepted {0};
+  std::thread server([&]() {
+    std::vector<int> conns;
+    while(!stop) {
+      struct pollfd pfd;
+      pfd.fd = listener;
+      pfd.events = POLLIN;
+
+      if(::poll(&pfd, 1, 10) == 1) {
+        conns.push_back(::accept(listener, nullptr, nullptr));
+        accepted++;
+      }
+    }
+
+    for(int conn : conns) {
+      ::close(conn);
+    }
+  });
+
+  std::atomic<int> alarms {0};
+
+  {
+    Options opts;
+    opts.ensureConnectionIsPrimed = false;
+    opts.withStuckRequestWatchdog(std::chrono::milliseconds(100), true,
+      [&alarms](std::chrono::milliseconds age) {
+        EXPECT_GE(age, std::chrono::milliseconds(100));
+        alarms++;
+      }
+    );
+
+    QClient qcl(Members::fromString("unix:" + path), std::move(opts));
+    ASSERT_EQ(qcl.getOldestPendingAge(), std::chrono::milliseconds(0));
+
+    // The stall forces a reconnection, which purges the pending request
+    std::future<redisReplyPtr> fut = qcl.exec("PING");
+    ASSERT_EQ(fut.wait_for(std::chrono::seconds(5)), std::future_status::ready);
+    ASSERT_EQ(fut.get(), nullptr);
+    ASSERT_EQ(alarms, 1);
+    ASSERT_EQ(qcl.getOldestPendingAge(), std::chrono::milliseconds(0));
+
+    for(size_t i = 0; i < 500 && accepted < 2; i++) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+  }
+
+  stop = true;
+  server.join();
+  ::close(listener);
+  ::unlink(path.c_str());
+  ASSERT_GE(accepted, 2);
+}
+
+TEST(ReadRouting, CommandTable) {
+  ASSERT_TRUE(ReadRouting::isReadOnly(EncodedRequest::make("HGET", "a", "b")));
+  ASSERT_TRUE(ReadRouting::isReadOnly(EncodedRequest::make("lhscan", "a", "0")));
+  ASSERT_TRUE(ReadRouting::isReadOnly(EncodedRequest::make("SMEMBERS", "a")));
+  ASSERT_FALSE(ReadRouting::isReadOnly(EncodedRequest::make("HSET", "a", "b", "c")));
+  ASSERT_FALSE(ReadRouting::isReadOnly(EncodedRequest::make("DEL", "a")));
+  ASSERT_FALSE(ReadRouting::isReadOnly(EncodedRequest::make("HGETX")));
+
+  std::vector<std::string> args = { "HGET", "a", std::string(1024 * 1024, 'x') };
+  ASSERT_TRUE(ReadRouting::isReadOnly(EncodedRequest::makeZeroCopy(std::move(args))));
+}
+
+TEST(QClient, ReadRouting) {
+  std::string path = "/tmp/qclient-tests-reads-" + std::to_string(getpid()) + ".sock";
+  ::unlink(path.c_str());
+
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  ASSERT_GE(listener, 0);
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+  ASSERT_EQ(::bind(listener, (struct sockaddr*) &addr, sizeof(addr)), 0);
+  ASSERT_EQ(::listen(listener, 10), 0);
+
+  //----------------------------------------------------------------------------
+  // Fake server: Replies with "leader" or "follower", depending on whether
+  // stale reads were activated on the connection.
+  //----------------------------------------------------------------------------
+  std::atomic<bool> stop {false};
+  std::vector<std::thread> connections;
+
+  std::thread server([&]() {
+    while(!stop) {
+      struct pollfd pfd;
+      pfd.fd = listener;
+      pfd.events = POLLIN;
+
+      if(::poll(&pfd, 1, 10) != 1) {
+        continue;
+      }
+
+      int conn = ::accept(listener, nullptr, nullptr);
+      connections.emplace_back([conn, &stop]() {
+        ResponseBuilder builder;
+        bool stale = false;
+        char buffer[1024];
+
+        while(!stop) {
+          struct pollfd cfd;
+          cfd.fd = conn;
+          cfd.events = POLLIN;
+          if(::poll(&cfd, 1, 10) != 1) continue;
+
+          ssize_t bytes = ::recv(conn, buffer, sizeof(buffer), 0);
+          if(bytes <= 0) break;
+          builder.feed(buffer, bytes);
+
+          redisReplyPtr req;
+          while(builder.pull(req) == ResponseBuilder::Status::kOk) {
+            std::string cmd(req->element[0]->str, req->element[0]->len);
+            std::string reply;
+
+            if(cmd == "ACTIVATE-STALE-READS") {
+              stale = true;
+              reply = "+OK\r\n";
+            }
+            else {
+              std::string who = stale ? "follower" : "leader";
+              reply = "$" + std::to_string(who.size()) + "\r\n" + who + "\r\n";
+            }
+
+            ASSERT_EQ(::send(conn, reply.data(), reply.size(), 0), (ssize_t) reply.size());
+          }
+        }
+
+        ::close(conn);
+      });
+    }
+  });
+
+  auto whoServed = [](std::future<redisReplyPtr> &&fut) {
+    redisReplyPtr reply = fut.get();
+    if(!reply) return std::string("null");
+    return std::string(reply->str, reply->len);
+  };
+
+  {
+    Options opts;
+    opts.ensureConnectionIsPrimed = false;
+    opts.withReadRouting(ReadRouting::Followers(std::chrono::milliseconds(200)));
+    QClient qcl(Members::fromString("unix:" + path), std::move(opts));
+
+    ASSERT_EQ(whoServed(qcl.exec("HGET", "a", "b")), "follower");
+    ASSERT_EQ(whoServed(qcl.execRead("CUSTOM-READ", "a")), "follower");
+    ASSERT_EQ(whoServed(qcl.exec("CUSTOM-READ", "a")), "leader");
+
+    // Reading right after a write goes to the leader
+    ASSERT_EQ(whoServed(qcl.exec("HSET", "a", "b", "c")), "leader");
+    ASSERT_EQ(whoServed(qcl.exec("HGET", "a", "b")), "leader");
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(250));
+    ASSERT_EQ(whoServed(qcl.exec("HGET", "a", "b")), "follower");
+  }
+
+  {
+    Options opts;
+    opts.ensureConnectionIsPrimed = false;
+    QClient qcl(Members::fromString("unix:" + path), std::move(opts));
+    ASSERT_EQ(whoServed(qcl.execRead("HGET", "a", "b")), "leader");
+  }
+
+  stop = true;
+  server.join();
+  for(std::thread &thread : connections) {
+    thread.join();
+  }
+
+  ::close(listener);
+  ::unlink(path.c_str());
+}
+
+TEST(QClient, HedgedReads) {
+  std::string path = "/tmp/qclient-tests-hedged-" + std::to_string(getpid()) + ".sock";
+  ::unlink(path.c_str());
+
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  ASSERT_GE(listener, 0);
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+  ASSERT_EQ(::bind(listener, (struct sockaddr*) &addr, sizeof(addr)), 0);
+  ASSERT_EQ(::listen(listener, 10), 0);
+
+  //----------------------------------------------------------------------------
+  // Fake server: Slow to reply to GET, unless stale reads were activated on
+  // the connection - as if the node the main connection talks to was busy.
+  //----------------------------------------------------------------------------
+  std::atomic<bool> stop {false};
+  std::vector<std::thread> connections;
+
+  std::thread server([&]() {
+    while(!stop) {
+      struct pollfd pfd;
+      pfd.fd = listener;
+      pfd.events = POLLIN;
+
+      if(::poll(&pfd, 1, 10) != 1) {
+        continue;
+      }
+
+      int conn = ::accept(listener, nullptr, nullptr);
+      connections.emplace_back([conn, &stop]() {
+        ResponseBuilder builder;
+        bool stale = false;
+        char buffer[1024];
+
+        while(!stop) {
+          struct pollfd cfd;
+          cfd.fd = conn;
+          cfd.events = POLLIN;
+          if(::poll(&cfd, 1, 10) != 1) continue;
+
+          ssize_t bytes = ::recv(conn, buffer, sizeof(buffer), 0);
+          if(bytes <= 0) break;
+          builder.feed(buffer, bytes);
+
+          redisReplyPtr req;
+          while(builder.pull(req) == ResponseBuilder::Status::kOk) {
+            std::string cmd(req->element[0]->str, req->element[0]->len);
+            std::string reply;
+
+            if(cmd == "ACTIVATE-STALE-READS") {
+              stale = true;
+              reply = "+OK\r\n";
+            }
+            else if(cmd == "GET" && stale) {
+              reply = "$5\r\nhedge\r\n";
+            }
+            else if(cmd == "GET") {
+              std::this_thread::sleep_for(std::chrono::milliseconds(300));
+              reply = "$7\r\nprimary\r\n";
+            }
+            else {
+              reply = "+PONG\r\n";
+            }
+
+            ASSERT_EQ(::send(conn, reply.data(), reply.size(), 0), (ssize_t) reply.size());
+          }
+        }
+
+        ::close(conn);
+      });
+    }
+  });
+
+  {
+    Options opts;
+    opts.ensureConnectionIsPrimed = false;
+    opts.withHedgedReads(HedgedReads::AfterDelay(std::chrono::milliseconds(20)));
+    QClient qcl(Members::fromString("unix:" + path), std::move(opts));
+
+    std::future<redisReplyPtr> read = qcl.execRead("GET", "a");
+    ASSERT_EQ(read.wait_for(std::chrono::milliseconds(250)), std::future_status::ready);
+    ASSERT_EQ(describeRedisReply(read.get()), "\"hedge\"");
+
+    // The late reply of the first attempt is discarded
+    ASSERT_EQ(describeRedisReply(qcl.exec("PING").get()), "PONG");
+  }
+
+  {
+    Options opts;
+    opts.ensureConnectionIsPrimed = false;
+    QClient qcl(Members::fromString("unix:" + path), std::move(opts));
+    ASSERT_EQ(describeRedisReply(qcl.execRead("GET", "a").get()), "\"primary\"");
+  }
+
+  stop = true;
+  server.join();
+  for(std::thread &thread : connections) {
+    thread.join();
+  }
+
+  ::close(listener);
+  ::unlink(path.c_str());
+}
+
+TEST(QClient, SingleFlightReads) {
+  std::string path = "/tmp/qclient-tests-single-flight-" + std::to_string(getpid()) + ".sock";
+  ::unlink(path.c_str());
+
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  ASSERT_GE(listener, 0);
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+  ASSERT_EQ(::bind(listener, (struct sockaddr*) &addr, sizeof(addr)), 0);
+  ASSERT_EQ(::listen(listener, 10), 0);
+
+  //----------------------------------------------------------------------------
+  // Fake server: Counts GETs, and holds their replies until released
+  //----------------------------------------------------------------------------
+  std::atomic<bool> stop {false};
+  std::atomic<bool> release {false};
+  std::atomic<int> gets {0};
+  std::vector<std::thread> connections;
+
+  std::thread server([&]() {
+    while(!stop) {
+      struct pollfd pfd;
+      pfd.fd = listener;
+      pfd.events = POLLIN;
+
+      if(::poll(&pfd, 1, 10) != 1) {
+        continue;
+      }
+
+      int conn = ::accept(listener, nullptr, nullptr);
+      connections.emplace_back([conn, &stop, &release, &gets]() {
+        ResponseBuilder builder;
+        char buffer[1024];
+
+        while(!stop) {
+          struct pollfd cfd;
+          cfd.fd = conn;
+          cfd.events = POLLIN;
+          if(::poll(&cfd, 1, 10) != 1) continue;
+
+          ssize_t bytes = ::recv(conn, buffer, sizeof(buffer), 0);
+          if(bytes <= 0) break;
+          builder.feed(buffer, bytes);
+
+          redisReplyPtr req;
+          while(builder.pull(req) == ResponseBuilder::Status::kOk) {
+            std::string cmd(req->element[0]->str, req->element[0]->len);
+            std::string reply = "+OK\r\n";
+
+            if(cmd == "GET") {
+              gets++;
+              while(!release && !stop) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+              }
+
+              std::string key(req->element[1]->str, req->element[1]->len);
+              reply = "$7\r\nvalue-" + key + "\r\n";
+            }
+
+            ASSERT_EQ(::send(conn, reply.data(), reply.size(), 0), (ssize_t) reply.size());
+          }
+        }
+
+        ::close(conn);
+      });
+    }
+  });
+
+  {
+    Options opts;
+    opts.ensureConnectionIsPrimed = false;
+    opts.withSingleFlightReads();
+    QClient qcl(Members::fromString("unix:" + path), std::move(opts));
+
+    // Explicit reads, and reads recognized through the command table
+    std::vector<std::future<redisReplyPtr>> reads;
+    for(size_t i = 0; i < 10; i++) {
+      reads.emplace_back(qcl.execRead("GET", "a"));
+    }
+
+    ReplyFuture pooled = qcl.pooledExec("GET", "a");
+    std::future<redisReplyPtr> other = qcl.exec("GET", "b");
+
+    release = true;
+
+    for(size_t i = 0; i < reads.size(); i++) {
+      ASSERT_EQ(describeRedisReply(reads[i].get()), "\"value-a\"");
+    }
+
+    ASSERT_EQ(describeRedisReply(pooled.get()), "\"value-a\"");
+    ASSERT_EQ(describeRedisReply(other.get()), "\"value-b\"");
+    ASSERT_EQ(gets, 2);
+    ASSERT_EQ(qcl.getStatistics().coalescedReads, 10);
+
+    // A read issued after a write never joins a flight from before it
+    release = false;
+    std::future<redisReplyPtr> before = qcl.exec("GET", "a");
+    std::future<redisReplyPtr> write = qcl.exec("SET", "a", "b");
+    std::future<redisReplyPtr> after = qcl.exec("GET", "a");
+    release = true;
+
+    ASSERT_EQ(describeRedisReply(before.get()), "\"value-a\"");
+    ASSERT_EQ(describeRedisReply(write.get()), "OK");
+    ASSERT_EQ(describeRedisReply(after.get()), "\"value-a\"");
+    ASSERT_EQ(gets, 4);
+    ASSERT_EQ(qcl.getStatistics().coalescedReads, 10);
+  }
+
+  stop = true;
+  server.join();
+  for(std::thread &thread : connections) {
+    thread.join();
+  }
+
+  ::close(listener);
+  ::unlink(path.c_str());
+}
+
+TEST(QClient, ScriptCaching) {
+  std::string path = "/tmp/qclient-tests-script-caching-" + std::to_string(getpid()) + ".sock";
+  ::unlink(path.c_str());
+
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  ASSERT_GE(listener, 0);
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+  ASSERT_EQ(::bind(listener, (struct sockaddr*) &addr, sizeof(addr)), 0);
+  ASSERT_EQ(::listen(listener, 10), 0);
+
+  //----------------------------------------------------------------------------
+  // Fake server: Every connection starts with an empty script cache, as if
+  // the server restarted. Drops the connection instead of replying to the
+  // next EVALSHA, if asked to.
+  //----------------------------------------------------------------------------
+  std::atomic<bool> stop {false};
+  std::atomic<bool> drop {false};
+  std::atomic<int> loads {0};
+  std::atomic<int> noscripts {0};
+  std::vector<std::thread> connections;
+
+  std::thread server([&]() {
+    while(!stop) {
+      struct pollfd pfd;
+      pfd.fd = listener;
+      pfd.events = POLLIN;
+
+      if(::poll(&pfd, 1, 10) != 1) {
+        continue;
+      }
+
+      int conn = ::accept(listener, nullptr, nullptr);
+      connections.emplace_back([conn, &stop, &drop, &loads, &noscripts]() {
+        ResponseBuilder builder;
+        std::set<std::string> cache;
+        char buffer[1024];
+
+        while(!stop) {
+          struct pollfd cfd;
+          cfd.fd = conn;
+          cfd.events = POLLIN;
+          if(::poll(&cfd, 1, 10) != 1) continue;
+
+          ssize_t bytes = ::recv(conn, buffer, sizeof(buffer), 0);
+          if(bytes <= 0) break;
+          builder.feed(buffer, bytes);
+
+          redisReplyPtr req;
+          while(builder.pull(req) == ResponseBuilder::Status::kOk) {
+            std::string cmd(req->element[0]->str, req->element[0]->len);
+            std::string arg(req->element[1]->str, req->element[1]->len);
+            std::string reply = "+OK\r\n";
+
+            if(cmd == "SCRIPT") {
+              loads++;
+              std::string sha = ScriptRegistry::digest(std::string(req->element[2]->str, req->element[2]->len));
+              cache.insert(sha);
+              reply = "$40\r\n" + sha + "\r\n";
+            }
+            else if(cmd == "EVALSHA" && drop.exchange(false)) {
+              ::shutdown(conn, SHUT_RDWR);
+              break;
+            }
+            else if(cmd == "EVALSHA" && cache.count(arg) == 0) {
+              noscripts++;
+              reply = "-NOSCRIPT No matching script. Please use EVAL.\r\n";
+            }
+            else if(cmd == "EVALSHA") {
+              reply = ":" + std::string(req->element[3]->str, req->element[3]->len) + "\r\n";
+            }
+
+            ASSERT_EQ(::send(conn, reply.data(), reply.size(), 0), (ssize_t) reply.size());
+          }
+        }
+
+        ::close(conn);
+      });
+    }
+  });
+
+  {
+    Options opts;
+    opts.ensureConnectionIsPrimed = false;
+    opts.withScriptPriming();
+    opts.withRetryStrategy(RetryStrategy::WithTimeout(std::chrono::seconds(30)));
+    QClient qcl(Members::fromString("unix:" + path), std::move(opts));
+
+    // Unknown to the server - loaded, and retried transparently
+    ASSERT_EQ(describeRedisReply(qcl.evalScript("return ARGV[1]", {}, {"1"}).get()), "(integer) 1");
+    ASSERT_EQ(loads, 1);
+    ASSERT_EQ(noscripts, 1);
+
+    ASSERT_EQ(describeRedisReply(qcl.evalScript("return ARGV[1]", {}, {"2"}).get()), "(integer) 2");
+    ASSERT_EQ(loads, 1);
+    ASSERT_EQ(noscripts, 1);
+
+    // After a reconnect, the handshake loads the script before the retry
+    drop = true;
+    ASSERT_EQ(describeRedisReply(qcl.evalScript("return ARGV[1]", {}, {"3"}).get()), "(integer) 3");
+    ASSERT_EQ(loads, 2);
+    ASSERT_EQ(noscripts, 1);
+  }
+
+  stop = true;
+  server.join();
+  for(std::thread &thread : connections) {
+    thread.join();
+  }
+
+  ::close(listener);
+  ::unlink(path.c_str());
+}
+
+TEST(QClient, LazyConnect) {
+  std::string path = "/tmp/qclient-tests-lazy-connect-" + std::to_string(getpid()) + ".sock";
+  ::unlink(path.c_str());
+
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  ASSERT_GE(listener, 0);
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+  ASSERT_EQ(::bind(listener, (struct sockaddr*) &addr, sizeof(addr)), 0);
+  ASSERT_EQ(::listen(listener, 10), 0);
+
+  //----------------------------------------------------------------------------
+  // Fake server: Counts connections, replies +OK to everything
+  //----------------------------------------------------------------------------
+  std::atomic<bool> stop {false};
+  std::atomic<int> accepted {0};
+  std::vector<std::thread> connections;
+
+  std::thread server([&]() {
+    while(!stop) {
+      struct pollfd pfd;
+      pfd.fd = listener;
+      pfd.events = POLLIN;
+
+      if(::poll(&pfd, 1, 10) != 1) {
+        continue;
+      }
+
+      int conn = ::accept(listener, nullptr, nullptr);
+      accepted++;
+
+      connections.emplace_back([conn, &stop]() {
+        ResponseBuilder builder;
+        char buffer[1024];
+
+        while(!stop) {
+          struct pollfd cfd;
+          cfd.fd = conn;
+          cfd.events = POLLIN;
+          if(::poll(&cfd, 1, 10) != 1) continue;
+
+          ssize_t bytes = ::recv(conn, buffer, sizeof(buffer), 0);
+          if(bytes <= 0) break;
+          builder.feed(buffer, bytes);
+
+          redisReplyPtr req;
+          while(builder.pull(req) == ResponseBuilder::Status::kOk) {
+            ASSERT_EQ(::send(conn, "+OK\r\n", 5, 0), 5);
+          }
+        }
+
+        ::close(conn);
+      });
+    }
+  });
+
+  {
+    Options opts;
+    opts.ensureConnectionIsPrimed = false;
+    opts.withLazyConnect();
+    QClient qcl(Members::fromString("unix:" + path), std::move(opts));
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    ASSERT_EQ(accepted, 0);
+
+    ASSERT_EQ(describeRedisReply(qcl.exec("SET", "a", "b").get()), "OK");
+    ASSERT_EQ(describeRedisReply(qcl.exec("SET", "a", "c").get()), "OK");
+    ASSERT_EQ(accepted, 1);
+  }
+
+  {
+    // Never used - never connects
+    Options opts;
+    opts.withLazyConnect();
+    QClient qcl(Members::fromString("unix:" + path), std::move(opts));
+  }
+
+  ASSERT_EQ(accepted, 1);
+
+  {
+    // Warmed up without sending anything
+    Options opts;
+    opts.ensureConnectionIsPrimed = false;
+    opts.withLazyConnect();
+    QClient qcl(Members::fromString("unix:" + path), std::move(opts));
+
+    ASSERT_TRUE(qcl.waitUntilReady(std::chrono::seconds(30)).ok());
+    ASSERT_EQ(accepted, 2);
+    ASSERT_EQ(qcl.getStatistics().bytesSent, 0);
+  }
+
+  stop = true;
+  server.join();
+  for(std::thread &thread : connections) {
+    thread.join();
+  }
+
+  ::close(listener);
+  ::unlink(path.c_str());
+}
+
+//------------------------------------------------------------------------------
+// Minimal host loop for driving a QClient: poll() on whatever it asks for
+//------------------------------------------------------------------------------
+class PollLoop : public ExternalEventLoop {
+public:
+  void watch(int f, uint32_t ev) override {
+    fd = f;
+    events = ev;
+  }
+
+  void scheduleAt(std::chrono::steady_clock::time_point d) override {
+    deadline = d;
+    scheduled = true;
+  }
+
+  void cancelSchedule() override {
+    scheduled = false;
+  }
+
+  void wakeup() override {
+    woken = true;
+  }
+
+  void runOnce(QClient &qcl) {
+    if(woken.exchange(false)) {
+      qcl.onTimer();
+    }
+
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = 0;
+    if(events & kReadable) pfd.events |= POLLIN;
+    if(events & kWritable) pfd.events |= POLLOUT;
+
+    if(::poll(&pfd, fd >= 0 ? 1 : 0, 1) == 1) {
+      if(pfd.revents & (POLLIN | POLLERR | POLLHUP)) qcl.onReadable();
+      if(pfd.revents & POLLOUT) qcl.onWritable();
+    }
+
+    if(scheduled && std::chrono::steady_clock::now() >= deadline) {
+      scheduled = false;
+      qcl.onTimer();
+    }
+  }
+
+  int fd = -1;
+  uint32_t events = 0;
+  bool scheduled = false;
+  std::chrono::steady_clock::time_point deadline;
+  std::atomic<bool> woken {false};
+};
+
+TEST(QClient, ExternalEventLoop) {
+  std::string path = "/tmp/qclient-tests-external-loop-" + std::to_string(getpid()) + ".sock";
+  ::unlink(path.c_str());
+
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  ASSERT_GE(listener, 0);
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+  ASSERT_EQ(::bind(listener, (struct sockaddr*) &addr, sizeof(addr)), 0);
+  ASSERT_EQ(::listen(listener, 10), 0);
+
+  //----------------------------------------------------------------------------
+  // Fake server: Echoes back the first argument of every request
+  //----------------------------------------------------------------------------
+  std::atomic<bool> stop {false};
+  std::vector<std::thread> connections;
+
+  std::thread server([&]() {
+    while(!stop) {
+      struct pollfd pfd;
+      pfd.fd = listener;
+      pfd.events = POLLIN;
+
+      if(::poll(&pfd, 1, 10) != 1) {
+        continue;
+      }
+
+      int conn = ::accept(listener, nullptr, nullptr);
+      connections.emplace_back([conn, &stop]() {
+        ResponseBuilder builder;
+        char buffer[1024];
+
+        while(!stop) {
+          struct pollfd cfd;
+          cfd.fd = conn;
+          cfd.events = POLLIN;
+          if(::poll(&cfd, 1, 10) != 1) continue;
+
+          ssize_t bytes = ::recv(conn, buffer, sizeof(buffer), 0);
+          if(bytes <= 0) break;
+          builder.feed(buffer, bytes);
+
+          redisReplyPtr req;
+          while(builder.pull(req) == ResponseBuilder::Status::kOk) {
+            std::string arg(req->element[1]->str, req->element[1]->len);
+            std::string resp = "+" + arg + "\r\n";
+            ASSERT_EQ(::send(conn, resp.c_str(), resp.size(), 0), (ssize_t) resp.size());
+          }
+        }
+
+        ::close(conn);
+      });
+    }
+  });
+
+  {
+    std::shared_ptr<PollLoop> loop = std::make_shared<PollLoop>();
+
+    Options opts;
+    opts.ensureConnectionIsPrimed = false;
+    opts.withExternalEventLoop(loop);
+    QClient qcl(Members::fromString("unix:" + path), std::move(opts));
+    ASSERT_TRUE(loop->woken);
+
+    const size_t kRequests = 2000;
+    std::vector<std::string> replies;
+    bool sameThread = true;
+    std::thread::id self = std::this_thread::get_id();
+
+    for(size_t i = 0; i < kRequests; i++) {
+      qcl.execute(EncodedRequest::make("ECHO", std::to_string(i)), [&](redisReplyPtr &&reply) {
+        sameThread &= (std::this_thread::get_id() == self);
+        replies.emplace_back(describeRedisReply(reply));
+      });
+    }
+
+    for(size_t i = 0; i < 30000 && replies.size() < kRequests; i++) {
+      loop->runOnce(qcl);
+    }
+
+    ASSERT_EQ(replies.size(), kRequests);
+    ASSERT_TRUE(sameThread);
+
+    for(size_t i = 0; i < kRequests; i++) {
+      ASSERT_EQ(replies[i], std::to_string(i));
+    }
+
+    ASSERT_GE(loop->fd, 0);
+    ASSERT_EQ(loop->events, uint32_t(ExternalEventLoop::kReadable));
+  }
+
+  stop = true;
+  server.join();
+  for(std::thread &thread : connections) {
+    thread.join();
+  }
+
+  ::close(listener);
+  ::unlink(path.c_str());
+}
+
+//------------------------------------------------------------------------------
+// Listener blocking until released - as slow as it gets
+//------------------------------------------------------------------------------
+class BlockingListener : public MessageListener {
+public:
+  void handleIncomingMessage(const Message& msg) override {
+    std::unique_lock<std::mutex> lock(mtx);
+    while(!released) {
+      cv.wait(lock);
+    }
+
+    payloads.push_back(msg.getPayload());
+    cv.notify_all();
+  }
+
+  void release() {
+    std::lock_guard<std::mutex> lock(mtx);
+    released = true;
+    cv.notify_all();
+  }
+
+  bool waitFor(size_t count) {
+    std::unique_lock<std::mutex> lock(mtx);
+    return cv.wait_for(lock, std::chrono::seconds(30),
+      [&]() { return payloads.size() >= count; });
+  }
+
+  std::mutex mtx;
+  std::condition_variable cv;
+  bool released = false;
+  std::vector<std::string> payloads;
+};
+
+TEST(QClient, OffloadPushMessages) {
+  std::string path = "/tmp/qclient-tests-offload-push-" + std::to_string(getpid()) + ".sock";
+  ::unlink(path.c_str());
+
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  ASSERT_GE(listener, 0);
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+  ASSERT_EQ(::bind(listener, (struct sockaddr*) &addr, sizeof(addr)), 0);
+  ASSERT_EQ(::listen(listener, 10), 0);
+
+  //----------------------------------------------------------------------------
+  // Fake server: Pushes a message carrying the argument of every PUBLISH
+  // ahead of its reply, replies +OK to anything else.
+  //----------------------------------------------------------------------------
+  std::atomic<bool> stop {false};
+  std::vector<std::thread> connections;
+
+  std::thread server([&]() {
+    while(!stop) {
+      struct pollfd pfd;
+      pfd.fd = listener;
+      pfd.events = POLLIN;
+
+      if(::poll(&pfd, 1, 10) != 1) {
+        continue;
+      }
+
+      int conn = ::accept(listener, nullptr, nullptr);
+      connections.emplace_back([conn, &stop]() {
+        ResponseBuilder builder;
+        char buffer[1024];
+
+        while(!stop) {
+          struct pollfd cfd;
+          cfd.fd = conn;
+          cfd.events = POLLIN;
+          if(::poll(&cfd, 1, 10) != 1) continue;
+
+          ssize_t bytes = ::recv(conn, buffer, sizeof(buffer), 0);
+          if(bytes <= 0) break;
+          builder.feed(buffer, bytes);
+
+          redisReplyPtr req;
+          while(builder.pull(req) == ResponseBuilder::Status::kOk) {
+            std::string cmd(req->element[0]->str, req->element[0]->len);
+            std::string resp;
+
+            if(cmd == "PUBLISH") {
+              std::string arg(req->element[1]->str, req->element[1]->len);
+              resp = ">4\r\n$6\r\npubsub\r\n$7\r\nmessage\r\n$4\r\nchan\r\n$" +
+                std::to_string(arg.size()) + "\r\n" + arg + "\r\n";
+            }
+
+            resp += "+OK\r\n";
+            ASSERT_EQ(::send(conn, resp.c_str(), resp.size(), 0), (ssize_t) resp.size());
+          }
+        }
+
+        ::close(conn);
+      });
+    }
+  });
+
+  {
+    std::shared_ptr<BlockingListener> messages = std::make_shared<BlockingListener>();
+
+    Options opts;
+    opts.ensureConnectionIsPrimed = false;
+    opts.messageListener = messages;
+    opts.exclusivePubsub = false;
+    opts.withOffloadPushMessages();
+    QClient qcl(Members::fromString("unix:" + path), std::move(opts));
+
+    //--------------------------------------------------------------------------
+    // The listener is stuck, but replies keep flowing
+    //--------------------------------------------------------------------------
+    ASSERT_EQ(describeRedisReply(qcl.exec("PUBLISH", "m1").get()), "OK");
+    ASSERT_EQ(describeRedisReply(qcl.exec("PUBLISH", "m2").get()), "OK");
+    ASSERT_EQ(describeRedisReply(qcl.exec("PING").get()), "OK");
+    ASSERT_GE(qcl.getStatistics().pushQueueDepth, 1);
+
+    messages->release();
+    ASSERT_TRUE(messages->waitFor(2));
+
+    std::lock_guard<std::mutex> lock(messages->mtx);
+    ASSERT_EQ(messages->payloads, std::vector<std::string>({"m1", "m2"}));
+  }
+
+  stop = true;
+  server.join();
+  for(std::thread &thread : connections) {
+    thread.join();
+  }
+
+  ::close(listener);
+  ::unlink(path.c_str());
+}
+
+TEST(QClient, BulkKeyHelpers) {
+  std::string path = "/tmp/qclient-tests-bulk-keys-" + std::to_string(getpid()) + ".sock";
+  ::unlink(path.c_str());
+
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  ASSERT_GE(listener, 0);
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+  ASSERT_EQ(::bind(listener, (struct sockaddr*) &addr, sizeof(addr)), 0);
+  ASSERT_EQ(::listen(listener, 10), 0);
+
+  //----------------------------------------------------------------------------
+  // Fake server: Every key exists, except those starting with "missing" -
+  // "bad" gets an error.
+  //----------------------------------------------------------------------------
+  std::atomic<bool> stop {false};
+  std::atomic<int> requests {0};
+  std::atomic<size_t> largestRequest {0};
+
+  std::thread server([&]() {
+    int conn = -1;
+    while(!stop && conn < 0) {
+      struct pollfd pfd;
+      pfd.fd = listener;
+      pfd.events = POLLIN;
+      if(::poll(&pfd, 1, 10) == 1) conn = ::accept(listener, nullptr, nullptr);
+    }
+
+    ResponseBuilder builder;
+    char buffer[4096];
+
+    while(!stop) {
+      struct pollfd cfd;
+      cfd.fd = conn;
+      cfd.events = POLLIN;
+      if(::poll(&cfd, 1, 10) != 1) continue;
+
+      ssize_t bytes = ::recv(conn, buffer, sizeof(buffer), 0);
+      if(bytes <= 0) break;
+      builder.feed(buffer, bytes);
+
+      redisReplyPtr req;
+      while(builder.pull(req) == ResponseBuilder::Status::kOk) {
+        requests++;
+        largestRequest = std::max<size_t>(largestRequest, req->elements - 1);
+
+        int found = 0;
+        bool bad = false;
+        for(size_t i = 1; i < req->elements; i++) {
+          std::string key(req->element[i]->str, req->element[i]->len);
+          if(key == "bad") bad = true;
+          if(key.compare(0, 7, "missing") != 0) found++;
+        }
+
+        std::string resp = bad ? std::string("-ERR bad key\r\n") : SSTR(":" << found << "\r\n");
+        ASSERT_EQ(::send(conn, resp.data(), resp.size(), 0), (ssize_t) resp.size());
+      }
+    }
+
+    ::close(conn);
+  });
+
+  {
+    Options opts;
+    opts.ensureConnectionIsPrimed = false;
+    QClient qcl(Members::fromString("unix:" + path), std::move(opts));
+
+    std::vector<std::string> keys;
+    for(size_t i = 0; i < 1000; i++) {
+      keys.emplace_back(SSTR((i % 4 == 0 ? "missing-" : "key-") << i));
+    }
+
+    ASSERT_EQ(qcl.existsMany(keys, 100, 3), 750);
+    ASSERT_EQ(requests, 10);
+    ASSERT_EQ(largestRequest, 100u);
+
+    ASSERT_EQ(qcl.delMany(keys, 300, 2), 750);
+    ASSERT_EQ(requests, 14);
+    ASSERT_EQ(qcl.unlinkMany(keys), 750);
+    ASSERT_EQ(qcl.delMany({}), 0);
+
+    std::vector<bool> each = qcl.existsEach(keys, 64);
+    ASSERT_EQ(each.size(), keys.size());
+    for(size_t i = 0; i < keys.size(); i++) {
+      ASSERT_EQ(each[i], i % 4 != 0);
+    }
+
+    keys.emplace_back("bad");
+    ASSERT_THROW(qcl.existsMany(keys, 100, 3), std::runtime_error);
+  }
+
+  stop = true;
+  server.join();
+
+  ::close(listener);
+  ::unlink(path.c_str());
+}
+
+TEST(ScanPipeline, UnlinkMatching) {
+  std::string path = "/tmp/qclient-tests-scan-pipeline-" + std::to_string(getpid()) + ".sock";
+  ::unlink(path.c_str());
+
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  ASSERT_GE(listener, 0);
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+  ASSERT_EQ(::bind(listener, (struct sockaddr*) &addr, sizeof(addr)), 0);
+  ASSERT_EQ(::listen(listener, 10), 0);
+
+  //----------------------------------------------------------------------------
+  // Fake server: SCAN pages through key-0 ... key-249, UNLINK removes a key,
+  // except for key-13, which gets an error.
+  //----------------------------------------------------------------------------
+  std::atomic<bool> stop {false};
+  std::atomic<int> unlinked {0};
+
+  std::thread server([&]() {
+    int conn = -1;
+    while(!stop && conn < 0) {
+      struct pollfd pfd;
+      pfd.fd = listener;
+      pfd.events = POLLIN;
+      if(::poll(&pfd, 1, 10) == 1) conn = ::accept(listener, nullptr, nullptr);
+    }
+
+    ResponseBuilder builder;
+    char buffer[4096];
+
+    while(!stop) {
+      struct pollfd cfd;
+      cfd.fd = conn;
+      cfd.events = POLLIN;
+      if(::poll(&cfd, 1, 10) != 1) continue;
+
+      ssize_t bytes = ::recv(conn, buffer, sizeof(buffer), 0);
+      if(bytes <= 0) break;
+      builder.feed(buffer, bytes);
+
+      redisReplyPtr req;
+      while(builder.pull(req) == ResponseBuilder::Status::kOk) {
+        std::string cmd(req->element[0]->str, req->element[0]->len);
+        std::string resp;
+
+        if(cmd == "SCAN") {
+          size_t cursor = std::stoull(std::string(req->element[1]->str, req->element[1]->len));
+          size_t count = std::stoull(std::string(req->element[5]->str, req->element[5]->len));
+          size_t end = std::min<size_t>(250, cursor + count);
+          std::string next = (end == 250) ? "0" : std::to_string(end);
+
+          resp = SSTR("*2\r\n$" << next.size() << "\r\n" << next << "\r\n*" << end - cursor << "\r\n");
+          for(size_t i = cursor; i < end; i++) {
+            std::string key = "key-" + std::to_string(i);
+            resp += SSTR("$" << key.size() << "\r\n" << key << "\r\n");
+          }
+        }
+        else if(std::string(req->element[1]->str, req->element[1]->len) == "key-13") {
+          resp = "-ERR cannot unlink\r\n";
+        }
+        else {
+          unlinked++;
+          resp = ":1\r\n";
+        }
+
+        ASSERT_EQ(::send(conn, resp.data(), resp.size(), 0), (ssize_t) resp.size());
+      }
+    }
+
+    ::close(conn);
+  });
+
+  {
+    Options opts;
+    opts.ensureConnectionIsPrimed = false;
+    QClient qcl(Members::fromString("unix:" + path), std::move(opts));
+
+    ScanPipelineOptions scanOpts;
+    scanOpts.pattern = "key-*";
+    scanOpts.scanCount = 30;
+    scanOpts.maxInFlight = 8;
+    scanOpts.progressInterval = 100;
+
+    std::vector<size_t> reports;
+    ScanPipeline pipeline(qcl, scanOpts);
+    pipeline.onProgress([&](const ScanPipelineResult &progress) {
+      reports.push_back(progress.keysScanned);
+    });
+
+    ScanPipeline::Action unlink = ScanPipeline::perKey("UNLINK");
+    ScanPipelineResult result = pipeline.run([&](const std::string &key, std::vector<std::string> &command) {
+      if(key == "key-7") return false;
+      return unlink(key, command);
+    });
+
+    ASSERT_EQ(result.keysScanned, 250u);
+    ASSERT_EQ(result.keysSkipped, 1u);
+    ASSERT_EQ(result.scanRequests, 9u);
+    ASSERT_EQ(result.commands.chunks, 249u);
+    ASSERT_EQ(result.commands.failedChunks, 1u);
+    ASSERT_EQ(result.commands.total, 248);
+    ASSERT_EQ(result.commands.firstError, "(error) ERR cannot unlink");
+    ASSERT_FALSE(result.ok());
+    ASSERT_EQ(unlinked, 248);
+    ASSERT_EQ(reports, std::vector<size_t>({100, 200, 250}));
+  }
+
+  stop = true;
+  server.join();
+
+  ::close(listener);
+  ::unlink(path.c_str());
+}
+
+TEST(QLocalityHash, BulkGet) {
+  std::string path = "/tmp/qclient-tests-lhget-bulk-" + std::to_string(getpid()) + ".sock";
+  ::unlink(path.c_str());
+
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  ASSERT_GE(listener, 0);
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+  ASSERT_EQ(::bind(listener, (struct sockaddr*) &addr, sizeof(addr)), 0);
+  ASSERT_EQ(::listen(listener, 10), 0);
+
+  //----------------------------------------------------------------------------
+  // Fake server: LHGET answers "value-<field>", nil for fields starting with
+  // "missing", and an error for "broken". Hints are recorded in the order
+  // requests arrive.
+  //----------------------------------------------------------------------------
+  std::atomic<bool> stop {false};
+  std::vector<std::string> hints;
+
+  std::thread server([&]() {
+    int conn = -1;
+    while(!stop && conn < 0) {
+      struct pollfd pfd;
+      pfd.fd = listener;
+      pfd.events = POLLIN;
+      if(::poll(&pfd, 1, 10) == 1) conn = ::accept(listener, nullptr, nullptr);
+    }
+
+    ResponseBuilder builder;
+    char buffer[4096];
+
+    while(!stop) {
+      struct pollfd cfd;
+      cfd.fd = conn;
+      cfd.events = POLLIN;
+      if(::poll(&cfd, 1, 10) != 1) continue;
+
+      ssize_t bytes = ::recv(conn, buffer, sizeof(buffer), 0);
+      if(bytes <= 0) break;
+      builder.feed(buffer, bytes);
+
+      redisReplyPtr req;
+      while(builder.pull(req) == ResponseBuilder::Status::kOk) {
+        std::string field(req->element[2]->str, req->element[2]->len);
+        hints.emplace_back(req->elements == 4 ?
+          std::string(req->element[3]->str, req->element[3]->len) : "");
+
+        std::string resp;
+        if(field.rfind("missing", 0) == 0) {
+          resp = "$-1\r\n";
+        }
+        else if(field == "broken") {
+          resp = "-ERR broken\r\n";
+        }
+        else {
+          std::string value = "value-" + field;
+          resp = SSTR("$" << value.size() << "\r\n" << value << "\r\n");
+        }
+
+        ASSERT_EQ(::send(conn, resp.data(), resp.size(), 0), (ssize_t) resp.size());
+      }
+    }
+
+    ::close(conn);
+  });
+
+  {
+    Options opts;
+    opts.ensureConnectionIsPrimed = false;
+    QClient qcl(Members::fromString("unix:" + path), std::move(opts));
+    QLocalityHash lhash(qcl, "lhash");
+
+    // Hints interleaved, as a caller walking a namespace would produce them
+    std::vector<QLocalityHash::Lookup> lookups;
+    for(size_t i = 0; i < 30; i++) {
+      lookups.push_back({SSTR("f" << i), SSTR("hint-" << i % 3)});
+    }
+
+    lookups.push_back({"no-hint", ""});
+    lookups.push_back({"missing-1", "hint-1"});
+
+    std::unordered_map<std::string, std::string> out;
+    Status st = lhash.lhgetBulk(lookups, out, 4);
+    ASSERT_TRUE(st.ok()) << st.toString();
+    ASSERT_EQ(out.size(), 31u);
+    ASSERT_EQ(out["f0"], "value-f0");
+    ASSERT_EQ(out["f29"], "value-f29");
+    ASSERT_EQ(out["no-hint"], "value-no-hint");
+    ASSERT_EQ(out.count("missing-1"), 0u);
+
+    // Each locality was requested in one go
+    ASSERT_EQ(hints.size(), 32u);
+    ASSERT_TRUE(std::is_sorted(hints.begin(), hints.end()));
+    ASSERT_EQ(hints.front(), "");
+
+    // Nothing more is sent after an error
+    hints.clear();
+    out.clear();
+    lookups = { {"a", "hint-0"}, {"broken", "hint-1"}, {"b", "hint-2"} };
+    st = lhash.lhgetBulk(lookups, out, 1);
+    ASSERT_FALSE(st.ok());
+    ASSERT_EQ(st.getMsg(), "LHGET broken: Unexpected reply type; was expecting STRING, received (error) ERR broken");
+    ASSERT_EQ(out.size(), 1u);
+    ASSERT_EQ(hints.size(), 2u);
+  }
+
+  stop = true;
+  server.join();
+
+  ::close(listener);
+  ::unlink(path.c_str());
+}
+
+//------------------------------------------------------------------------------
+// Run QDeque's bulk operations against a fake server holding a single deque.
+// With negotiate set, the server claims to be a QuarkDB recent enough for
+// batch pops.
+//------------------------------------------------------------------------------
+static void runDequeBulk(bool negotiate) {
+  std::string path = "/tmp/qclient-tests-deque-bulk-" + std::to_string(getpid()) + ".sock";
+  ::unlink(path.c_str());
+
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  ASSERT_GE(listener, 0);
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+  ASSERT_EQ(::bind(listener, (struct sockaddr*) &addr, sizeof(addr)), 0);
+  ASSERT_EQ(::listen(listener, 10), 0);
+
+  //----------------------------------------------------------------------------
+  // Fake server: deque-push-back, deque-pop-front with and without a count,
+  // and deque-len, all on a single deque. Counts the commands it receives.
+  //----------------------------------------------------------------------------
+  std::atomic<bool> stop {false};
+  std::atomic<int> pushes {0};
+  std::atomic<int> singlePops {0};
+  std::atomic<int> batchPops {0};
+
+  std::thread server([&]() {
+    int conn = -1;
+    while(!stop && conn < 0) {
+      struct pollfd pfd;
+      pfd.fd = listener;
+      pfd.events = POLLIN;
+      if(::poll(&pfd, 1, 10) == 1) conn = ::accept(listener, nullptr, nullptr);
+    }
+
+    std::deque<std::string> contents;
+    ResponseBuilder builder;
+    char buffer[4096];
+
+    while(!stop) {
+      struct pollfd cfd;
+      cfd.fd = conn;
+      cfd.events = POLLIN;
+      if(::poll(&cfd, 1, 10) != 1) continue;
+
+      ssize_t bytes = ::recv(conn, buffer, sizeof(buffer), 0);
+      if(bytes <= 0) break;
+      builder.feed(buffer, bytes);
+
+      redisReplyPtr req;
+      while(builder.pull(req) == ResponseBuilder::Status::kOk) {
+        std::vector<std::string> args;
+        for(size_t i = 0; i < req->elements; i++) {
+          args.emplace_back(req->element[i]->str, req->element[i]->len);
+        }
+
+        std::string resp;
+        if(args[0] == "QUARKDB-VERSION" && negotiate) {
+          resp = "$5\r\n0.4.3\r\n";
+        }
+        else if(args[0] == "deque-push-back") {
+          pushes++;
+          contents.insert(contents.end(), args.begin() + 2, args.end());
+          resp = SSTR(":" << contents.size() << "\r\n");
+        }
+        else if(args[0] == "deque-len") {
+          resp = SSTR(":" << contents.size() << "\r\n");
+        }
+        else if(args[0] == "deque-pop-front" && args.size() == 2) {
+          singlePops++;
+          if(contents.empty()) {
+            resp = "$-1\r\n";
+          }
+          else {
+            resp = SSTR("$" << contents.front().size() << "\r\n" << contents.front() << "\r\n");
+            contents.pop_front();
+          }
+        }
+        else if(args[0] == "deque-pop-front" && args.size() == 3) {
+          batchPops++;
+          size_t count = std::min<size_t>(std::stoull(args[2]), contents.size());
+          if(count == 0) {
+            resp = "*-1\r\n";
+          }
+          else {
+            resp = SSTR("*" << count << "\r\n");
+            for(size_t i = 0; i < count; i++) {
+              resp += SSTR("$" << contents.front().size() << "\r\n" << contents.front() << "\r\n");
+              contents.pop_front();
+            }
+          }
+        }
+        else {
+          resp = "-ERR unknown command\r\n";
+        }
+
+        ASSERT_EQ(::send(conn, resp.data(), resp.size(), 0), (ssize_t) resp.size());
+      }
+    }
+
+    ::close(conn);
+  });
+
+  {
+    Options opts;
+    opts.ensureConnectionIsPrimed = false;
+    opts.negotiateCapabilities = negotiate;
+    QClient qcl(Members::fromString("unix:" + path), std::move(opts));
+    QDeque deque(qcl, "deque");
+
+    // Queued behind the capability handshake - negotiated once it's back
+    size_t len = 1;
+    ASSERT_TRUE(deque.size(len).ok());
+    ASSERT_EQ(len, 0u);
+
+    // Nothing to push: No request goes out
+    ASSERT_TRUE(deque.push_back_many({}).ok());
+    long long newLength = -1;
+    ASSERT_TRUE(deque.push_back_many_future({}).get(newLength).ok());
+    ASSERT_EQ(newLength, 0);
+    ASSERT_EQ(pushes, 0);
+
+    ASSERT_TRUE(deque.push_back_many({"a", "b", "c"}).ok());
+    ASSERT_TRUE(deque.push_back_many_future({"d", "e"}).get(newLength).ok());
+    ASSERT_EQ(newLength, 5);
+
+    std::promise<Status> pushed;
+    deque.push_back_many_async({"f", "g"}, [&](Status st) { pushed.set_value(st); });
+    ASSERT_TRUE(pushed.get_future().get().ok());
+    ASSERT_EQ(pushes, 3);
+
+    // Nothing to pop
+    std::vector<std::string> out;
+    ASSERT_TRUE(deque.pop_front_many(0, out).ok());
+    ASSERT_TRUE(out.empty());
+
+    // Items come out in order, appended to what's there already
+    out = {"x"};
+    ASSERT_TRUE(deque.pop_front_many(2, out).ok());
+    ASSERT_EQ(out, std::vector<std::string>({"x", "a", "b"}));
+
+    out.clear();
+    ASSERT_TRUE(deque.pop_front_many_future(2).get(out).ok());
+    ASSERT_EQ(out, std::vector<std::string>({"c", "d"}));
+
+    // More than there is: Only what's left
+    std::promise<std::vector<std::string>> popped;
+    deque.pop_front_many_async(10, [&](Status st, std::vector<std::string> &&items) {
+      EXPECT_TRUE(st.ok());
+      popped.set_value(std::move(items));
+    });
+    ASSERT_EQ(popped.get_future().get(), std::vector<std::string>({"e", "f", "g"}));
+
+    // Empty by now
+    out.clear();
+    ASSERT_TRUE(deque.pop_front_many(5, out).ok());
+    ASSERT_TRUE(out.empty());
+    ASSERT_TRUE(deque.pop_front_many_future(3).get(out).ok());
+    ASSERT_TRUE(out.empty());
+    ASSERT_TRUE(deque.pop_front_many_future(0).get(out).ok());
+    ASSERT_TRUE(out.empty());
+
+    if(negotiate) {
+      ASSERT_EQ(batchPops, 5);
+      ASSERT_EQ(singlePops, 0);
+    }
+    else {
+      ASSERT_EQ(batchPops, 0);
+      ASSERT_EQ(singlePops, 2 + 2 + 10 + 5 + 3);
+    }
+  }
+
+  stop = true;
+  server.join();
+
+  ::close(listener);
+  ::unlink(path.c_str());
+}
+
+TEST(QDeque, BulkPipelined) {
+  runDequeBulk(false);
+}
+
+TEST(QDeque, BulkBatchPop) {
+  runDequeBulk(true);
+}
+
+TEST(QClient, PriorityLanes) {
+  std::string path = "/tmp/qclient-tests-lanes-" + std::to_string(getpid()) + ".sock";
+  ::unlink(path.c_str());
+
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  ASSERT_GE(listener, 0);
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+  ASSERT_EQ(::bind(listener, (struct sockaddr*) &addr, sizeof(addr)), 0);
+  ASSERT_EQ(::listen(listener, 10), 0);
+
+  //----------------------------------------------------------------------------
+  // Fake server: Never replies to STALL, which holds up everything behind it
+  // on the same connection, and replies +PONG to anything else.
+  //----------------------------------------------------------------------------
+  std::atomic<bool> stop {false};
+  std::vector<std::thread> connections;
+
+  std::thread server([&]() {
+    while(!stop) {
+      struct pollfd pfd;
+      pfd.fd = listener;
+      pfd.events = POLLIN;
+
+      if(::poll(&pfd, 1, 10) != 1) {
+        continue;
+      }
+
+      int conn = ::accept(listener, nullptr, nullptr);
+      connections.emplace_back([conn, &stop]() {
+        ResponseBuilder builder;
+        bool stalled = false;
+        char buffer[1024];
+
+        while(!stop) {
+          struct pollfd cfd;
+          cfd.fd = conn;
+          cfd.events = POLLIN;
+          if(::poll(&cfd, 1, 10) != 1) continue;
+
+          ssize_t bytes = ::recv(conn, buffer, sizeof(buffer), 0);
+          if(bytes <= 0) break;
+          builder.feed(buffer, bytes);
+
+          redisReplyPtr req;
+          while(builder.pull(req) == ResponseBuilder::Status::kOk) {
+            std::string cmd(req->element[0]->str, req->element[0]->len);
+            stalled |= (cmd == "STALL");
+
+            if(!stalled) {
+              ASSERT_EQ(::send(conn, "+PONG\r\n", 7, 0), 7);
+            }
+          }
+        }
+
+        ::close(conn);
+      });
+    }
+  });
+
+  {
+    Options opts;
+    opts.ensureConnectionIsPrimed = false;
+    opts.withPriorityLanes(PriorityLanes::Enabled());
+    QClient qcl(Members::fromString("unix:" + path), std::move(opts));
+
+    std::vector<std::future<redisReplyPtr>> stalled;
+    for(size_t i = 0; i < 10; i++) {
+      stalled.emplace_back(qcl.execWithPriority(Priority::kBulk, "STALL"));
+    }
+
+    std::future<redisReplyPtr> control = qcl.execWithPriority(Priority::kControl, "PING");
+    ASSERT_EQ(control.wait_for(std::chrono::seconds(5)), std::future_status::ready);
+    ASSERT_EQ(describeRedisReply(control.get()), "PONG");
+
+    std::future<redisReplyPtr> normal = qcl.exec("PING");
+    ASSERT_EQ(normal.wait_for(std::chrono::seconds(5)), std::future_status::ready);
+    ASSERT_EQ(describeRedisReply(normal.get()), "PONG");
+
+    ASSERT_EQ(stalled[0].wait_for(std::chrono::milliseconds(50)), std::future_status::timeout);
+  }
+
+  {
+    // Without lanes, everything shares the one pipeline
+    Options opts;
+    opts.ensureConnectionIsPrimed = false;
+    QClient qcl(Members::fromString("unix:" + path), std::move(opts));
+
+    std::future<redisReplyPtr> bulk = qcl.execWithPriority(Priority::kBulk, "STALL");
+    std::future<redisReplyPtr> control = qcl.execWithPriority(Priority::kControl, "PING");
+    ASSERT_EQ(control.wait_for(std::chrono::milliseconds(200)), std::future_status::timeout);
+  }
+
+  stop = true;
+  server.join();
+  for(std::thread &thread : connections) {
+    thread.join();
+  }
+
+  ::close(listener);
+  ::unlink(path.c_str());
+}
+
+TEST(ShardedClient, RoutingAndMerging) {
+  //----------------------------------------------------------------------------
+  // Two fake servers: GET replies with the shard name, MGET with "shard:key"
+  // for every key, and DEL with the number of keys given. MULTI blocks reply
+  // with the shard name for every queued command.
+  //----------------------------------------------------------------------------
+  std::atomic<bool> stop {false};
+  std::vector<std::string> paths;
+  std::vector<int> listeners;
+  std::vector<std::thread> servers;
+  std::mutex connectionsMtx;
+  std::vector<std::thread> connections;
+
+  for(size_t shard = 0; shard < 2; shard++) {
+    std::string path = "/tmp/qclient-tests-shard-" + std::to_string(shard) + "-" + std::to_string(getpid()) + ".sock";
+    ::unlink(path.c_str());
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    ASSERT_GE(listener, 0);
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    ASSERT_EQ(::bind(listener, (struct sockaddr*) &addr, sizeof(addr)), 0);
+    ASSERT_EQ(::listen(listener, 10), 0);
+
+    paths.push_back(path);
+    listeners.push_back(listener);
+
+    servers.emplace_back([&, listener, shard]() {
+      std::string name = "shard" + std::to_string(shard);
+
+      while(!stop) {
+        struct pollfd pfd;
+        pfd.fd = listener;
+        pfd.events = POLLIN;
+
+        if(::poll(&pfd, 1, 10) != 1) {
+          continue;
+        }
+
+        int conn = ::accept(listener, nullptr, nullptr);
+        std::lock_guard<std::mutex> lock(connectionsMtx);
+        connections.emplace_back([conn, name, &stop]() {
+          ResponseBuilder builder;
+          char buffer[1024];
+          bool inMulti = false;
+          std::vector<std::string> queued;
+
+          while(!stop) {
+            struct pollfd cfd;
+            cfd.fd = conn;
+            cfd.events = POLLIN;
+            if(::poll(&cfd, 1, 10) != 1) continue;
+
+            ssize_t bytes = ::recv(conn, buffer, sizeof(buffer), 0);
+            if(bytes <= 0) break;
+            builder.feed(buffer, bytes);
+
+            redisReplyPtr req;
+            while(builder.pull(req) == ResponseBuilder::Status::kOk) {
+              std::string cmd(req->element[0]->str, req->element[0]->len);
+              std::string reply;
+
+              if(cmd == "MULTI") {
+                inMulti = true;
+                queued.clear();
+                reply = "+OK\r\n";
+              }
+              else if(cmd == "EXEC") {
+                inMulti = false;
+                reply = "*" + std::to_string(queued.size()) + "\r\n";
+                for(size_t i = 0; i < queued.size(); i++) {
+                  reply += "$" + std::to_string(name.size()) + "\r\n" + name + "\r\n";
+                }
+              }
+              else if(inMulti) {
+                queued.push_back(cmd);
+                reply = "+QUEUED\r\n";
+              }
+              else if(cmd == "MGET") {
+                reply = "*" + std::to_string(req->elements - 1) + "\r\n";
+                for(size_t i = 1; i < req->elements; i++) {
+                  std::string value = name + ":" + std::string(req->element[i]->str, req->element[i]->len);
+                  reply += "$" + std::to_string(value.size()) + "\r\n" + value + "\r\n";
+                }
+              }
+              else if(cmd == "DEL") {
+                reply = ":" + std::to_string(req->elements - 1) + "\r\n";
+              }
+              else {
+                reply = "$" + std::to_string(name.size()) + "\r\n" + name + "\r\n";
+              }
+
+              ASSERT_EQ(::send(conn, reply.data(), reply.size(), 0), (ssize_t) reply.size());
+            }
+          }
+
+          ::close(conn);
+        });
+      }
+    });
+  }
+
+  {
+    Options opts;
+    opts.ensureConnectionIsPrimed = false;
+
+    std::vector<Members> members = {
+      Members::fromString("unix:" + paths[0]),
+      Members::fromString("unix:" + paths[1])
+    };
+
+    ShardedClient client(members, std::move(opts));
+    ASSERT_EQ(client.getShardCount(), 2u);
+
+    std::vector<std::string> keys;
+    for(size_t i = 0; i < 20; i++) {
+      keys.push_back("key-" + std::to_string(i));
+
+      redisReplyPtr reply = client.exec("GET", keys.back()).get();
+      ASSERT_TRUE(reply);
+      ASSERT_EQ(std::string(reply->str, reply->len), "shard" + std::to_string(client.getShard(keys.back())));
+    }
+
+    redisReplyPtr reply = client.executeMultiKey("MGET", keys).get();
+    ASSERT_TRUE(reply);
+    ASSERT_EQ(reply->type, REDIS_REPLY_ARRAY);
+    ASSERT_EQ(reply->elements, keys.size());
+
+    for(size_t i = 0; i < keys.size(); i++) {
+      std::string expected = "shard" + std::to_string(client.getShard(keys[i])) + ":" + keys[i];
+      ASSERT_EQ(std::string(reply->element[i]->str, reply->element[i]->len), expected);
+    }
+
+    reply = client.executeMultiKey("DEL", keys).get();
+    ASSERT_TRUE(reply);
+    ASSERT_EQ(reply->type, REDIS_REPLY_INTEGER);
+    ASSERT_EQ(reply->integer, (long long) keys.size());
+
+    // MULTI blocks must stay within one shard
+    std::deque<EncodedRequest> block;
+    block.emplace_back(EncodedRequest::make("GET", "{user}:a"));
+    block.emplace_back(EncodedRequest::make("GET", "{user}:b"));
+    reply = client.execute(std::move(block)).get();
+    ASSERT_TRUE(reply);
+    ASSERT_EQ(reply->type, REDIS_REPLY_ARRAY);
+    ASSERT_EQ(reply->elements, 2u);
+    ASSERT_EQ(std::string(reply->element[0]->str, reply->element[0]->len), "shard" + std::to_string(client.getShard("user")));
+
+    std::string first, second;
+    for(size_t i = 0; i < keys.size(); i++) {
+      if(client.getShard(keys[i]) == 0) first = keys[i];
+      else second = keys[i];
+    }
+
+    block.clear();
+    block.emplace_back(EncodedRequest::make("GET", first));
+    block.emplace_back(EncodedRequest::make("GET", second));
+    reply = client.execute(std::move(block)).get();
+    ASSERT_TRUE(reply);
+    ASSERT_EQ(reply->type, REDIS_REPLY_ERROR);
+  }
+
+  stop = true;
+  for(std::thread &thread : servers) {
+    thread.join();
+  }
+
+  for(std::thread &thread : connections) {
+    thread.join();
+  }
+
+  for(size_t i = 0; i < paths.size(); i++) {
+    ::close(listeners[i]);
+    ::unlink(paths[i].c_str());
+  }
+}
+
+//------------------------------------------------------------------------------
+// Write a throwaway self-signed certificate and key into the given paths
+//------------------------------------------------------------------------------
+static void generateCertificate(const std::string &certPath, const std::string &keyPath) {
+  EVP_PKEY_CTX *pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr);
+  EVP_PKEY_keygen_init(pctx);
+  EVP_PKEY_CTX_set_ec_paramgen_curve_nid(pctx, NID_X9_62_prime256v1);
+
+  EVP_PKEY *pkey = nullptr;
+  EVP_PKEY_keygen(pctx, &pkey);
+  EVP_PKEY_CTX_free(pctx);
+
+  X509 *x509 = X509_new();
+  ASN1_INTEGER_set(X509_get_serialNumber(x509), 1);
+  X509_gmtime_adj(X509_getm_notBefore(x509), 0);
+  X509_gmtime_adj(X509_getm_notAfter(x509), 3600);
+  X509_set_pubkey(x509, pkey);
+  X509_NAME *name = X509_get_subject_name(x509);
+  X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char*) "qclient-test", -1, -1, 0);
+  X509_set_issuer_name(x509, name);
+  X509_sign(x509, pkey, EVP_sha256());
+
+  FILE *f = fopen(certPath.c_str(), "w");
+  PEM_write_X509(f, x509);
+  fclose(f);
+
+  f = fopen(keyPath.c_str(), "w");
+  PEM_write_PrivateKey(f, pkey, nullptr, nullptr, 0, nullptr, nullptr);
+  fclose(f);
+
+  X509_free(x509);
+  EVP_PKEY_free(pkey);
+}
+
+static RecvStatus recvNonBlocking(int fd, char *buffer, int len) {
+  int ret = ::recv(fd, buffer, len, 0);
+  if(ret == 0) return RecvStatus(false, 0, 0);
+  if(ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return RecvStatus(true, errno, 0);
+  if(ret < 0) return RecvStatus(false, ret, 0);
+  return RecvStatus(true, 0, ret);
+}
+
+//------------------------------------------------------------------------------
+// Connect a client and server filter over a socketpair, have the client say
+// hello and the server answer. Returns whether the client resumed a session.
+//------------------------------------------------------------------------------
+static bool tlsExchange(const TlsConfig &config, const std::string &peer = "test-peer:7777") {
+  int fds[2];
+  EXPECT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+  fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL, 0) | O_NONBLOCK);
+  fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL, 0) | O_NONBLOCK);
+
+  TlsFilter server(config, FilterType::SERVER,
+    [&](char *buf, int len, int) { return recvNonBlocking(fds[1], buf, len); },
+    [&](const char *buf, int len) { return ::send(fds[1], buf, len, 0); });
+
+  TlsFilter client(config, FilterType::CLIENT,
+    [&](char *buf, int len, int) { return recvNonBlocking(fds[0], buf, len); },
+    [&](const char *buf, int len) { return ::send(fds[0], buf, len, 0); },
+    peer, fds[0]);
+
+  client.send("hello", 5);
+
+  std::string received;
+  for(size_t i = 0; i < 1000 && received != "hello"; i++) {
+    char buffer[64];
+    RecvStatus status = server.recv(buffer, sizeof(buffer), 0);
+    EXPECT_TRUE(status.connectionAlive);
+    received.append(buffer, std::max(status.bytesRead, 0));
+    client.recv(buffer, sizeof(buffer), 0);
+  }
+  EXPECT_EQ(received, "hello");
+
+  server.send("world", 5);
+  received.clear();
+  for(size_t i = 0; i < 1000 && received != "world"; i++) {
+    char buffer[64];
+    RecvStatus status = client.recv(buffer, sizeof(buffer), 0);
+    EXPECT_TRUE(status.connectionAlive);
+    received.append(buffer, std::max(status.bytesRead, 0));
+  }
+  EXPECT_EQ(received, "world");
+
+  bool reused = client.sessionReused();
+  ::close(fds[0]);
+  ::close(fds[1]);
+  return reused;
+}
+
+TEST(TlsFilter, SessionResumption) {
+  std::string certPath = "/tmp/qclient-test-tls-cert.pem";
+  std::string keyPath = "/tmp/qclient-test-tls-key.pem";
+  generateCertificate(certPath, keyPath);
+
+  TlsConfig config(certPath, keyPath, "", "", false);
+
+  // Sessions are cached for the whole process - start out with a peer no
+  // earlier run has talked to.
+  static size_t run = 0;
+  std::string peer = SSTR("test-peer-" << run++ << ":7777");
+
+  // First one does a full handshake, from then on sessions are resumed
+  ASSERT_FALSE(tlsExchange(config, peer));
+  ASSERT_TRUE(tlsExchange(config, peer));
+  ASSERT_TRUE(tlsExchange(config, peer));
+
+  // Kernel TLS is not available on unix sockets - OpenSSL driving the
+  // socket itself must work all the same.
+  TlsConfig ktlsConfig = config;
+  ktlsConfig.ktls = true;
+  ASSERT_TRUE(tlsExchange(ktlsConfig, peer));
+
+  // Certificate rotated: A fresh context is loaded, so no session to resume
+  generateCertificate(certPath + ".new", keyPath + ".new");
+  ASSERT_EQ(::rename((certPath + ".new").c_str(), certPath.c_str()), 0);
+  ASSERT_EQ(::rename((keyPath + ".new").c_str(), keyPath.c_str()), 0);
+  ASSERT_FALSE(tlsExchange(config, peer));
+  ASSERT_TRUE(tlsExchange(config, peer));
+
+  // Gone from disk, the context loaded last keeps working
+  ::unlink(certPath.c_str());
+  ::unlink(keyPath.c_str());
+  ASSERT_TRUE(tlsExchange(config, peer));
+}
+
+TEST(TlsFilter, LargeWriteWithFullSocket) {
+  std::string certPath = "/tmp/qclient-test-tls-cert-2.pem";
+  std::string keyPath = "/tmp/qclient-test-tls-key-2.pem";
+  generateCertificate(certPath, keyPath);
+  TlsConfig config(certPath, keyPath, "", "", false);
+
+  int fds[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+  fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL, 0) | O_NONBLOCK);
+  fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL, 0) | O_NONBLOCK);
+
+  TlsFilter server(config, FilterType::SERVER,
+    [&](char *buf, int len, int) { return recvNonBlocking(fds[1], buf, len); },
+    [&](const char *buf, int len) { return ::send(fds[1], buf, len, 0); });
+
+  TlsFilter client(config, FilterType::CLIENT,
+    [&](char *buf, int len, int) { return recvNonBlocking(fds[0], buf, len); },
+    [&](const char *buf, int len) { return ::send(fds[0], buf, len, 0); });
+
+  //----------------------------------------------------------------------------
+  // Far more than the socket buffer holds: Ciphertext has to wait, and go
+  // out as the server reads - written from one thread, while another one
+  // keeps reading on the same filter.
+  //----------------------------------------------------------------------------
+  std::string payload;
+  for(size_t i = 0; payload.size() < 4 * 1024 * 1024; i++) {
+    payload += std::to_string(i);
+    payload += ",";
+  }
+
+  std::atomic<bool> done {false};
+  std::thread reader([&]() {
+    while(!done) {
+      char buffer[64];
+      client.recv(buffer, sizeof(buffer), 0);
+      std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+  });
+
+  for(size_t pos = 0; pos < payload.size(); pos += 64 * 1024) {
+    size_t len = std::min<size_t>(64 * 1024, payload.size() - pos);
+    ASSERT_EQ(client.send(payload.data() + pos, len), 1);
+  }
+
+  std::string received;
+  for(size_t i = 0; i < 200000 && received.size() < payload.size(); i++) {
+    char buffer[16 * 1024];
+    RecvStatus status = server.recv(buffer, sizeof(buffer), 0);
+    ASSERT_TRUE(status.connectionAlive);
+    received.append(buffer, std::max(status.bytesRead, 0));
+  }
+
+  done = true;
+  reader.join();
+
+  ASSERT_EQ(received.size(), payload.size());
+  ASSERT_TRUE(received == payload);
+
+  ::close(fds[0]);
+  ::close(fds[1]);
+  ::unlink(certPath.c_str());
+  ::unlink(keyPath.c_str());
+}
+
+TEST(TlsFilter, FlushPendingOutput) {
+  std::string certPath = "/tmp/qclient-test-tls-cert-3.pem";
+  std::string keyPath = "/tmp/qclient-test-tls-key-3.pem";
+  generateCertificate(certPath, keyPath);
+  TlsConfig config(certPath, keyPath, "", "", false);
+
+  int fds[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+  fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL, 0) | O_NONBLOCK);
+  fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL, 0) | O_NONBLOCK);
+
+  TlsFilter server(config, FilterType::SERVER,
+    [&](char *buf, int len, int) { return recvNonBlocking(fds[1], buf, len); },
+    [&](const char *buf, int len) { return ::send(fds[1], buf, len, 0); });
+
+  TlsFilter client(config, FilterType::CLIENT,
+    [&](char *buf, int len, int) { return recvNonBlocking(fds[0], buf, len); },
+    [&](const char *buf, int len) { return ::send(fds[0], buf, len, 0); });
+
+  // Get the handshake out of the way
+  client.send("x", 1);
+
+  std::string received;
+  for(size_t i = 0; i < 1000 && received != "x"; i++) {
+    char buffer[64];
+    RecvStatus status = server.recv(buffer, sizeof(buffer), 0);
+    received.append(buffer, std::max(status.bytesRead, 0));
+    client.recv(buffer, sizeof(buffer), 0);
+  }
+  ASSERT_EQ(received, "x");
+
+  //----------------------------------------------------------------------------
+  // More than the socket takes: The rest stays behind, and only goes out
+  // when flushed - nothing on the client side reads.
+  //----------------------------------------------------------------------------
+  std::string payload(2 * 1024 * 1024, 'a');
+  ASSERT_EQ(client.send(payload.data(), payload.size()), 1);
+  ASSERT_TRUE(client.hasPendingOutput());
+
+  received.clear();
+  for(size_t i = 0; i < 200000 && received.size() < payload.size(); i++) {
+    char buffer[16 * 1024];
+    RecvStatus status = server.recv(buffer, sizeof(buffer), 0);
+    ASSERT_TRUE(status.connectionAlive);
+    received.append(buffer, std::max(status.bytesRead, 0));
+    client.flushPendingOutput();
+  }
+
+  ASSERT_TRUE(received == payload);
+  ASSERT_FALSE(client.hasPendingOutput());
+  ASSERT_TRUE(client.flushPendingOutput());
+
+  ::close(fds[0]);
+  ::close(fds[1]);
+  ::unlink(certPath.c_str());
+  ::unlink(keyPath.c_str());
+}
+
+TEST(NetworkStream, ScatterGatherSend) {
+  int fds[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+
+  NetworkStream stream(fds[0], TlsConfig());
+  ASSERT_TRUE(stream.ok());
+
+  std::string first = "*1\r\n$4\r\nPING\r\n";
+  std::string second = "*2\r\n$3\r\nGET\r\n$3\r\nabc\r\n";
+
+  struct iovec iov[2];
+  iov[0].iov_base = (void*) first.data();
+  iov[0].iov_len = first.size();
+  iov[1].iov_base = (void*) second.data();
+  iov[1].iov_len = second.size();
+
+  ASSERT_EQ(stream.sendv(iov, 2), (int) (first.size() + second.size()));
+
+  char buffer[128];
+  ssize_t bytes = ::recv(fds[1], buffer, sizeof(buffer), 0);
+  ASSERT_EQ(std::string(buffer, bytes), first + second);
+  ::close(fds[1]);
+}
+
+TEST(NetworkStream, ZeroCopySend) {
+  int listener = socket(AF_INET, SOCK_STREAM, 0);
+  ASSERT_GE(listener, 0);
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = 0;
+  ASSERT_EQ(::bind(listener, (struct sockaddr*) &addr, sizeof(addr)), 0);
+  ASSERT_EQ(::listen(listener, 10), 0);
+
+  socklen_t len = sizeof(addr);
+  ASSERT_EQ(getsockname(listener, (struct sockaddr*) &addr, &len), 0);
+
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  ASSERT_EQ(::connect(fd, (struct sockaddr*) &addr, sizeof(addr)), 0);
+  int peer = ::accept(listener, nullptr, nullptr);
+  ASSERT_GE(peer, 0);
+
+  NetworkStream stream(fd, TlsConfig());
+  if(!stream.enableZeroCopy()) {
+    std::cerr << "MSG_ZEROCOPY not supported, skipping test" << std::endl;
+    ::close(peer);
+    ::close(listener);
+    return;
+  }
+
+  std::string payload(128 * 1024, 'z');
+  struct iovec iov[1];
+  iov[0].iov_base = (void*) payload.data();
+  iov[0].iov_len = payload.size();
+
+  int sent = stream.sendv(iov, 1, nullptr, true);
+  ASSERT_GT(sent, 0);
+
+  std::string received;
+  char buffer[16384];
+  while(received.size() < (size_t) sent) {
+    ssize_t bytes = ::recv(peer, buffer, sizeof(buffer), 0);
+    ASSERT_GT(bytes, 0);
+    received.append(buffer, bytes);
+  }
+  ASSERT_EQ(received, payload.substr(0, sent));
+
+  // The completion for id 0 shows up on the error queue
+  struct pollfd polls[1];
+  polls[0].fd = fd;
+  polls[0].events = 0;
+
+  for(size_t i = 0; i < 100 && stream.getZeroCopyCompleted() == 0u; i++) {
+    poll(polls, 1, 50);
+    stream.reapZeroCopy();
+  }
+
+  ASSERT_EQ(stream.getZeroCopyCompleted(), 1u);
+  ::close(peer);
+  ::close(listener);
+}
+
+TEST(IoUring, PollAndSend) {
+  if(!IoUring::supported()) {
+    std::cerr << "io_uring not supported, skipping test" << std::endl;
+    return;
+  }
+
+  int fds[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds), 0);
+
+  IoUring ring;
+  ASSERT_TRUE(ring.ok());
+
+  struct pollfd polls[1];
+  polls[0].fd = fds[1];
+  polls[0].events = POLLIN;
+
+  // Nothing to read yet, times out
+  ASSERT_EQ(ring.poll(polls, 1, 10), 0);
+
+  NetworkStream stream(fds[0], TlsConfig());
+  std::string contents = "*1\r\n$4\r\nPING\r\n";
+
+  struct iovec iov[1];
+  iov[0].iov_base = (void*) contents.data();
+  iov[0].iov_len = contents.size();
+  ASSERT_EQ(stream.sendv(iov, 1, &ring), (int) contents.size());
+
+  // The poll armed earlier fires now
+  ASSERT_EQ(ring.poll(polls, 1, 1000), 1);
+  ASSERT_TRUE(polls[0].revents & POLLIN);
+
+  char buffer[128];
+  ssize_t bytes = ::recv(fds[1], buffer, sizeof(buffer), 0);
+  ASSERT_EQ(std::string(buffer, bytes), contents);
+  ::close(fds[1]);
+}
+
+namespace {
+
+class CountingHandler : public EventLoopGroup::Handler {
+public:
+  void onEvent() override {
+    std::lock_guard<std::mutex> lock(mtx);
+    events++;
+    cv.notify_all();
+  }
+
+  bool waitFor(size_t target) {
+    std::unique_lock<std::mutex> lock(mtx);
+    return cv.wait_for(lock, std::chrono::seconds(5), [&]() { return events >= target; });
+  }
+
+  size_t get() {
+    std::lock_guard<std::mutex> lock(mtx);
+    return events;
+  }
+
+  std::mutex mtx;
+  std::condition_variable cv;
+  size_t events = 0;
+};
+
+}
+
+TEST(EventLoopGroup, BasicSanity) {
+  if(!EventLoopGroup::supported()) {
+    std::cerr << "EventLoopGroup not supported, skipping test" << std::endl;
+    return;
+  }
+
+  EventLoopGroup group(2);
+  ASSERT_EQ(group.size(), 2u);
+
+  CountingHandler handler;
+  group.attach(&handler);
+
+  group.wakeup(&handler);
+  ASSERT_TRUE(handler.waitFor(1));
+
+  group.scheduleAt(&handler, std::chrono::steady_clock::now() + std::chrono::milliseconds(10));
+  ASSERT_TRUE(handler.waitFor(2));
+
+  int fds[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds), 0);
+  group.watch(&handler, fds[1], EventLoopGroup::kReadable);
+  ASSERT_EQ(::write(fds[0], "a", 1), 1);
+  ASSERT_TRUE(handler.waitFor(3));
+
+  // No more events once detached, even though fds[1] stays readable.
+  group.detach(&handler);
+  size_t events = handler.get();
+  group.wakeup(&handler);
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  ASSERT_EQ(handler.get(), events);
+
+  ::close(fds[0]);
+  ::close(fds[1]);
+}
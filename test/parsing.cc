@@ -23,6 +23,7 @@
 
 #include "qclient/ResponseParsing.hh"
 #include "qclient/ResponseBuilder.hh"
+#include "qclient/structures/TypedFuture.hh"
 #include <gtest/gtest.h>
 
 using namespace qclient;
@@ -75,6 +76,25 @@ TEST(ResponseParsing, StringParser) {
   ASSERT_EQ(parser.value(), "turtles");
 }
 
+TEST(ResponseParsing, StringParserView) {
+  redisReplyPtr reply = ResponseBuilder::makeStr("turtles");
+
+  StringParser parser(reply);
+  ASSERT_TRUE(parser.ok());
+  ASSERT_EQ(parser.view(), "turtles");
+  ASSERT_EQ(parser.view().data(), reply->str);
+
+  reply.reset();
+  ASSERT_EQ(parser.view(), "turtles");
+  ASSERT_EQ(std::move(parser).value(), "turtles");
+
+  redisReplyPtr reply2 = ResponseBuilder::makeStr("chickens");
+  StringParser parser2(reply2.get());
+  reply2.reset();
+  ASSERT_EQ(parser2.view(), "chickens");
+  ASSERT_EQ(std::move(parser2).value(), "chickens");
+}
+
 TEST(ResponseParsing, StringParserErr) {
   redisReplyPtr reply = ResponseBuilder::makeInt(13);
 
@@ -144,3 +164,110 @@ TEST(ResponseParsing, Hgetall) {
   ASSERT_EQ(val["1"], "2");
   ASSERT_EQ(val["3"], "4");
 }
+
+TEST(ResponseParsing, HgetallView) {
+  std::vector<std::string> vec = { "c", "3", "a", "1", "b", "2" };
+  redisReplyPtr reply = ResponseBuilder::makeStringArray(vec);
+
+  HgetallParser parser(reply);
+  ASSERT_TRUE(parser.ok());
+  reply.reset();
+
+  const HgetallParser::FlatView &flat = parser.view();
+  ASSERT_EQ(flat.size(), 3u);
+  ASSERT_EQ(flat[0].first, "a");
+  ASSERT_EQ(flat[0].second, "1");
+  ASSERT_EQ(flat[2].first, "c");
+  ASSERT_EQ(flat[2].second, "3");
+
+  StringView out;
+  ASSERT_TRUE(parser.find("b", out));
+  ASSERT_EQ(out, "2");
+  ASSERT_FALSE(parser.find("d", out));
+
+  const std::map<std::string, std::string> &val = parser.value();
+  ASSERT_EQ(&val, &parser.value());
+  ASSERT_EQ(val.size(), 3u);
+
+  HgetallParser moved(std::move(parser));
+  std::map<std::string, std::string> taken = std::move(moved).value();
+  std::map<std::string, std::string> expected = { {"a", "1"}, {"b", "2"}, {"c", "3"} };
+  ASSERT_EQ(taken, expected);
+
+  reply = ResponseBuilder::makeStringArray(vec);
+  HgetallParser parser2(reply.get());
+  reply.reset();
+  ASSERT_TRUE(parser2.find("c", out));
+  ASSERT_EQ(out, "3");
+  ASSERT_EQ(parser2.value(), expected);
+}
+
+TEST(ResponseParsing, HgetallParserMap) {
+  ResponseBuilder builder;
+  builder.feed("%2\r\n$1\r\na\r\n$1\r\nb\r\n+c\r\n$1\r\nd\r\n");
+
+  redisReplyPtr reply;
+  ASSERT_EQ(ResponseBuilder::Status::kOk, builder.pull(reply));
+  ASSERT_EQ(reply->type, REDIS_REPLY_MAP);
+
+  HgetallParser parser(reply);
+  ASSERT_FALSE(parser.ok());
+  ASSERT_EQ(parser.err(), "Unexpected reply type for element #2: Unexpected reply type; was expecting STRING, received c");
+
+  builder.feed("%2\r\n$1\r\na\r\n$1\r\nb\r\n$1\r\nc\r\n=7\r\ntxt:ddd\r\n");
+  ASSERT_EQ(ResponseBuilder::Status::kOk, builder.pull(reply));
+
+  HgetallParser parser2(reply);
+  ASSERT_TRUE(parser2.ok());
+
+  std::map<std::string, std::string> expected = { {"a", "b"}, {"c", "ddd"} };
+  ASSERT_EQ(parser2.value(), expected);
+}
+
+TEST(TypedReply, Scalars) {
+  long long integer = 0;
+  ASSERT_TRUE(TypedReply::toInteger(ResponseBuilder::makeInt(13), integer).ok());
+  ASSERT_EQ(integer, 13);
+
+  qclient::Status st = TypedReply::toInteger(ResponseBuilder::makeStatus("aaa"), integer);
+  ASSERT_EQ(st.getErrc(), EINVAL);
+  ASSERT_EQ(st.getMsg(), "Unexpected reply type; was expecting INTEGER, received aaa");
+  ASSERT_FALSE(TypedReply::toInteger(redisReplyPtr(), integer).ok());
+
+  bool flag = false;
+  ASSERT_TRUE(TypedReply::toBool(ResponseBuilder::makeInt(1), flag).ok());
+  ASSERT_TRUE(flag);
+  ASSERT_TRUE(TypedReply::toBool(ResponseBuilder::makeInt(0), flag).ok());
+  ASSERT_FALSE(flag);
+
+  ASSERT_TRUE(TypedReply::toOk(ResponseBuilder::makeStatus("OK"), flag).ok());
+  ASSERT_TRUE(flag);
+  ASSERT_FALSE(TypedReply::toOk(ResponseBuilder::makeErr("ERR nope"), flag).ok());
+  ASSERT_FALSE(flag);
+
+  std::string str = "stale";
+  ASSERT_TRUE(TypedReply::toString(ResponseBuilder::makeStr("turtles"), str).ok());
+  ASSERT_EQ(str, "turtles");
+  ASSERT_TRUE(TypedReply::toString(ResponseBuilder::parseRedisEncodedString("$-1\r\n"), str).ok());
+  ASSERT_EQ(str, "");
+  ASSERT_FALSE(TypedReply::toString(ResponseBuilder::makeInt(3), str).ok());
+
+  double dbl = 0;
+  ASSERT_TRUE(TypedReply::toDouble(ResponseBuilder::makeStr("2.5"), dbl).ok());
+  ASSERT_EQ(dbl, 2.5);
+  ASSERT_FALSE(TypedReply::toDouble(ResponseBuilder::makeStr("2.5x"), dbl).ok());
+}
+
+TEST(TypedReply, Aggregates) {
+  std::vector<std::string> vec;
+  ASSERT_TRUE(TypedReply::toStringVector(ResponseBuilder::makeStringArray({"b", "a", "b"}), vec).ok());
+  ASSERT_EQ(vec, std::vector<std::string>({"b", "a", "b"}));
+
+  std::set<std::string> set;
+  ASSERT_TRUE(TypedReply::toStringSet(ResponseBuilder::makeStringArray({"b", "a", "b"}), set).ok());
+  ASSERT_EQ(set, std::set<std::string>({"a", "b"}));
+
+  qclient::Status st = TypedReply::toStringVector(ResponseBuilder::makeArr("a", "b", 3), vec);
+  ASSERT_EQ(st.getMsg(), "Unexpected reply type for element #2: Unexpected reply type; was expecting STRING, received (integer) 3");
+  ASSERT_FALSE(TypedReply::toStringSet(ResponseBuilder::makeInt(3), set).ok());
+}
@@ -0,0 +1,941 @@
+// ----------------------------------------------------------------------
+// File: persistency.cc
+// Author: Georgios Bitzes - CERN
+// ----------------------------------------------------------------------
+
+/************************************************************************
+ * qclient - A simple redis C++ client with support for redirects       *
+ * Copyright (C) 2016 CERN/Switzerland                                  *
+ *                                                                      *
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
+ ************************************************************************/
+
+#include "gtest/gtest.h"
+#include "qclient/MmapLogPersistency.hh"
+#include "qclient/ShardedBackgroundFlusher.hh"
+#include "qclient/ResponseBuilder.hh"
+#include "qclient/SSTR.hh"
+#include <dirent.h>
+#include <deque>
+#include <future>
+#include <limits>
+#include <map>
+#include <set>
+#include <thread>
+#include <condition_variable>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#if HAVE_ROCKSDB == 1
+#include "qclient/RocksDBPersistency.hh"
+#endif
+
+using namespace qclient;
+
+class MmapLog : public ::testing::Test {
+protected:
+  void SetUp() override {
+    char tmpl[] = "/tmp/qclient-mmap-log-XXXXXX";
+    ASSERT_NE(mkdtemp(tmpl), nullptr);
+    dir = tmpl;
+  }
+
+  void TearDown() override {
+    DIR *d = opendir(dir.c_str());
+    while(struct dirent *entry = readdir(d)) {
+      unlink((dir + "/" + entry->d_name).c_str());
+    }
+    closedir(d);
+    rmdir(dir.c_str());
+  }
+
+  std::vector<std::string> item(int i) {
+    return {"SET", "key-" + std::to_string(i), std::string(i % 50, 'x')};
+  }
+
+  std::string dir;
+};
+
+TEST_F(MmapLog, RecordRetrievePop) {
+  MmapLogPersistency log(dir, 4096);
+  ASSERT_EQ(log.getStartingIndex(), 0);
+  ASSERT_EQ(log.getEndingIndex(), 0);
+
+  for(int i = 0; i < 500; i++) {
+    log.record(i, item(i));
+  }
+
+  ASSERT_EQ(log.getEndingIndex(), 500);
+  ASSERT_GT(log.getSegmentCount(), 5u);
+
+  std::vector<std::string> out;
+  ASSERT_TRUE(log.retrieve(0, out));
+  ASSERT_EQ(out, item(0));
+  ASSERT_TRUE(log.retrieve(499, out));
+  ASSERT_EQ(out, item(499));
+  ASSERT_FALSE(log.retrieve(500, out));
+
+  std::vector<std::vector<std::string>> batch;
+  ASSERT_TRUE(log.retrieveBatch(100, 3, batch));
+  ASSERT_EQ(batch.size(), 3u);
+  ASSERT_EQ(batch[2], item(102));
+
+  size_t segments = log.getSegmentCount();
+  log.pop();
+  log.popBatch(399);
+  ASSERT_EQ(log.getStartingIndex(), 400);
+  ASSERT_LT(log.getSegmentCount(), segments);
+  ASSERT_FALSE(log.retrieve(399, out));
+  ASSERT_TRUE(log.retrieve(400, out));
+  ASSERT_EQ(out, item(400));
+}
+
+TEST_F(MmapLog, Recovery) {
+  {
+    MmapLogPersistency log(dir, 4096);
+    std::vector<std::vector<std::string>> batch;
+    for(int i = 0; i < 300; i++) {
+      batch.emplace_back(item(i));
+    }
+
+    log.recordBatch(0, batch);
+    log.popBatch(120);
+  }
+
+  MmapLogPersistency log(dir, 4096);
+  ASSERT_EQ(log.getStartingIndex(), 120);
+  ASSERT_EQ(log.getEndingIndex(), 300);
+
+  std::vector<std::string> out;
+  for(int i = 120; i < 300; i++) {
+    ASSERT_TRUE(log.retrieve(i, out));
+    ASSERT_EQ(out, item(i));
+  }
+
+  log.record(300, {"PING"});
+  ASSERT_TRUE(log.retrieve(300, out));
+  ASSERT_EQ(out, std::vector<std::string>({"PING"}));
+}
+
+TEST_F(MmapLog, TornRecord) {
+  {
+    MmapLogPersistency log(dir, 1 << 20);
+    for(int i = 0; i < 10; i++) {
+      log.record(i, item(i));
+    }
+  }
+
+  //----------------------------------------------------------------------------
+  // Flip a byte inside the last record's payload
+  //----------------------------------------------------------------------------
+  std::string segment = dir + "/segment-00000000000000000000.log";
+  int fd = open(segment.c_str(), O_RDWR);
+  ASSERT_GE(fd, 0);
+
+  std::vector<char> contents(1 << 20);
+  ASSERT_EQ(pread(fd, contents.data(), contents.size(), 0), (ssize_t) contents.size());
+
+  size_t offset = 0;
+  for(int i = 0; i < 9; i++) {
+    uint32_t len;
+    memcpy(&len, contents.data() + offset, sizeof(len));
+    offset += 2 * sizeof(uint32_t) + len;
+  }
+
+  char garbage = 'Z';
+  ASSERT_EQ(pwrite(fd, &garbage, 1, offset + 2 * sizeof(uint32_t) + 12), 1);
+  close(fd);
+
+  MmapLogPersistency log(dir, 1 << 20);
+  ASSERT_EQ(log.getStartingIndex(), 0);
+  ASSERT_EQ(log.getEndingIndex(), 9);
+
+  log.record(9, item(42));
+  std::vector<std::string> out;
+  ASSERT_TRUE(log.retrieve(9, out));
+  ASSERT_EQ(out, item(42));
+}
+
+TEST_F(MmapLog, Encoded) {
+  MmapLogPersistency log(dir, 4096);
+  ASSERT_TRUE(log.storesEncoded());
+
+  std::vector<EncodedRequest> reqs;
+  reqs.emplace_back(EncodedRequest::make("HSET", "key", "field", 5));
+  reqs.emplace_back(EncodedRequest::makeZeroCopy({"SET", "big", std::string(100000, 'a')}));
+  log.recordEncoded(0, reqs.data(), reqs.size());
+  log.record(2, {"DEL", "key"});
+
+  std::vector<EncodedRequest> out;
+  ASSERT_TRUE(log.retrieveEncoded(0, 3, out));
+  ASSERT_EQ(out.size(), 3u);
+  ASSERT_EQ(out[0].toString(), "*4\r\n$4\r\nHSET\r\n$3\r\nkey\r\n$5\r\nfield\r\n$1\r\n5\r\n");
+  ASSERT_TRUE(out[1] == reqs[1]);
+  ASSERT_TRUE(out[2] == EncodedRequest::make("DEL", "key"));
+  ASSERT_FALSE(log.retrieveEncoded(2, 2, out));
+
+  std::vector<std::string> item;
+  ASSERT_TRUE(log.retrieve(1, item));
+  ASSERT_EQ(item, std::vector<std::string>({"SET", "big", std::string(100000, 'a')}));
+}
+
+TEST_F(MmapLog, ShardedFlusher) {
+  Notifier notifier;
+  std::vector<MmapLogPersistency*> layers;
+
+  {
+    ShardedBackgroundFlusher flusher(4, Members("localhost", 1), Options(), notifier,
+      [&](size_t shard) {
+        layers.push_back(new MmapLogPersistency(dir + "/shard-" + std::to_string(shard), 4096));
+        return layers.back();
+      });
+
+    ASSERT_EQ(flusher.getShardCount(), 4u);
+    ASSERT_EQ(layers.size(), 4u);
+
+    for(int i = 0; i < 100; i++) {
+      flusher.pushRequest("key-" + std::to_string(i % 10), {"SET", "key-" + std::to_string(i % 10), std::to_string(i)});
+    }
+
+    ASSERT_EQ(flusher.size(), 100u);
+    ASSERT_EQ(flusher.getEnqueuedAndClear(), 100);
+
+    //--------------------------------------------------------------------------
+    // Every operation on a key landed in the same shard, in order
+    //--------------------------------------------------------------------------
+    size_t used = 0;
+    for(size_t shard = 0; shard < 4; shard++) {
+      std::map<std::string, int> last;
+      std::vector<std::string> item;
+
+      for(ItemIndex i = 0; i < layers[shard]->getEndingIndex(); i++) {
+        ASSERT_TRUE(layers[shard]->retrieve(i, item));
+        ASSERT_EQ(flusher.getShard(item[1]), shard);
+        ASSERT_LT(last[item[1]], std::stoi(item[2]) + 1);
+        last[item[1]] = std::stoi(item[2]) + 1;
+      }
+
+      if(layers[shard]->getEndingIndex() > 0) used++;
+    }
+
+    ASSERT_GT(used, 1u);
+  }
+
+  for(size_t shard = 0; shard < 4; shard++) {
+    std::string sub = dir + "/shard-" + std::to_string(shard);
+    DIR *d = opendir(sub.c_str());
+    while(struct dirent *entry = readdir(d)) {
+      unlink((sub + "/" + entry->d_name).c_str());
+    }
+    closedir(d);
+    rmdir(sub.c_str());
+  }
+}
+
+//------------------------------------------------------------------------------
+// Fake server for BackgroundFlusher: Answers every request with +OK, in
+// order, and records the key of each SET. Replies to SETs can be held back
+// beyond a limit, and the connection dropped at will.
+//------------------------------------------------------------------------------
+class AckServer {
+public:
+  AckServer() {
+    path = "/tmp/qclient-tests-flusher-" + std::to_string(getpid()) + "-" +
+      std::to_string(instances++) + ".sock";
+    ::unlink(path.c_str());
+
+    listener = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    EXPECT_EQ(::bind(listener, (struct sockaddr*) &addr, sizeof(addr)), 0);
+    EXPECT_EQ(::listen(listener, 10), 0);
+
+    thread = std::thread(&AckServer::main, this);
+  }
+
+  ~AckServer() {
+    stop = true;
+    thread.join();
+    ::close(listener);
+    ::unlink(path.c_str());
+  }
+
+  Members members() const {
+    return Members::fromString("unix:" + path);
+  }
+
+  // Reply to at most limit SETs in total, from now on
+  void hold(size_t limit) {
+    std::lock_guard<std::mutex> lock(mtx);
+    replyLimit = limit;
+  }
+
+  void release() {
+    hold(std::numeric_limits<size_t>::max());
+  }
+
+  // Close the current connection, forgetting what's not been replied to
+  void disconnect() {
+    std::lock_guard<std::mutex> lock(mtx);
+    dropConnection = true;
+  }
+
+  // Wait until at least count SETs have arrived, over all connections
+  bool waitReceived(size_t count) {
+    std::unique_lock<std::mutex> lock(mtx);
+    return cv.wait_for(lock, std::chrono::seconds(30), [&]() { return received.size() >= count; });
+  }
+
+  std::vector<std::string> getReceived() {
+    std::lock_guard<std::mutex> lock(mtx);
+    return received;
+  }
+
+  // Keys received over each connection
+  std::vector<std::vector<std::string>> getConnections() {
+    std::lock_guard<std::mutex> lock(mtx);
+    return connections;
+  }
+
+  bool wasReplied(const std::string &key) {
+    std::lock_guard<std::mutex> lock(mtx);
+    return replied.count(key) != 0;
+  }
+
+  // Most SETs outstanding at any time on a single connection
+  size_t getMaxInFlight() {
+    std::lock_guard<std::mutex> lock(mtx);
+    return maxInFlight;
+  }
+
+private:
+  void main() {
+    int conn = -1;
+    std::unique_ptr<ResponseBuilder> builder;
+
+    // Requests yet to be replied to, in order - empty key if not a SET
+    std::deque<std::string> pending;
+
+    while(!stop) {
+      {
+        std::lock_guard<std::mutex> lock(mtx);
+        if(dropConnection && conn >= 0) {
+          ::close(conn);
+          conn = -1;
+          pending.clear();
+        }
+
+        dropConnection = false;
+
+        std::string replies;
+        while(!pending.empty() && (pending.front().empty() || replyCount < replyLimit)) {
+          if(!pending.front().empty()) {
+            replyCount++;
+            replied.insert(pending.front());
+          }
+
+          pending.pop_front();
+          replies += "+OK\r\n";
+        }
+
+        if(!replies.empty()) {
+          EXPECT_EQ(::send(conn, replies.data(), replies.size(), MSG_NOSIGNAL), (ssize_t) replies.size());
+        }
+      }
+
+      struct pollfd polls[2];
+      polls[0].fd = listener;
+      polls[0].events = POLLIN;
+      polls[0].revents = 0;
+      polls[1].fd = conn;
+      polls[1].events = POLLIN;
+      polls[1].revents = 0;
+
+      if(::poll(polls, conn >= 0 ? 2 : 1, 10) <= 0) continue;
+
+      if(polls[0].revents != 0) {
+        if(conn >= 0) ::close(conn);
+        conn = ::accept(listener, nullptr, nullptr);
+        builder.reset(new ResponseBuilder());
+        pending.clear();
+
+        std::lock_guard<std::mutex> lock(mtx);
+        connections.emplace_back();
+        continue;
+      }
+
+      if(conn < 0 || polls[1].revents == 0) continue;
+
+      char buffer[64 * 1024];
+      ssize_t bytes = ::recv(conn, buffer, sizeof(buffer), 0);
+      if(bytes <= 0) {
+        ::close(conn);
+        conn = -1;
+        pending.clear();
+        continue;
+      }
+
+      builder->feed(buffer, bytes);
+
+      std::lock_guard<std::mutex> lock(mtx);
+      redisReplyPtr req;
+      while(builder->pull(req) == ResponseBuilder::Status::kOk) {
+        std::string cmd(req->element[0]->str, req->element[0]->len);
+        if(cmd != "SET") {
+          pending.emplace_back();
+          continue;
+        }
+
+        std::string key(req->element[1]->str, req->element[1]->len);
+        received.emplace_back(key);
+        connections.back().emplace_back(key);
+        pending.emplace_back(key);
+
+        size_t inFlight = 0;
+        for(const std::string &item : pending) {
+          if(!item.empty()) inFlight++;
+        }
+
+        maxInFlight = std::max(maxInFlight, inFlight);
+      }
+
+      cv.notify_all();
+    }
+
+    if(conn >= 0) ::close(conn);
+  }
+
+  static std::atomic<int> instances;
+
+  std::string path;
+  int listener = -1;
+  std::atomic<bool> stop {false};
+  std::thread thread;
+
+  std::mutex mtx;
+  std::condition_variable cv;
+  size_t replyLimit = std::numeric_limits<size_t>::max();
+  size_t replyCount = 0;
+  bool dropConnection = false;
+  std::vector<std::string> received;
+  std::vector<std::vector<std::string>> connections;
+  std::set<std::string> replied;
+  size_t maxInFlight = 0;
+};
+
+std::atomic<int> AckServer::instances {0};
+
+//------------------------------------------------------------------------------
+// In-memory persistency layer. Its state outlives the layer itself, which
+// BackgroundFlusher owns - and checks that only items the server has
+// replied to are ever popped.
+//------------------------------------------------------------------------------
+struct MemoryLog {
+  MemoryLog(AckServer &srv) : server(srv) {}
+
+  bool waitStart(ItemIndex index) {
+    std::unique_lock<std::mutex> lock(mtx);
+    return cv.wait_for(lock, std::chrono::seconds(30), [&]() { return start >= index; });
+  }
+
+  AckServer &server;
+
+  std::mutex mtx;
+  std::condition_variable cv;
+  std::map<ItemIndex, std::vector<std::string>> items;
+  ItemIndex start = 0;
+  ItemIndex end = 0;
+
+  // Keys of all items ever recorded, by index
+  std::vector<std::string> history;
+
+  std::vector<size_t> recordBatches;
+  std::vector<std::pair<ItemIndex, size_t>> retrieveBatches;
+  std::vector<size_t> popBatches;
+  bool poppedUnacknowledged = false;
+};
+
+class MemoryPersistency : public BackgroundFlusherPersistency {
+public:
+  MemoryPersistency(std::shared_ptr<MemoryLog> l) : log(l) {}
+
+  virtual void record(ItemIndex index, const std::vector<std::string> &item) override {
+    std::lock_guard<std::mutex> lock(log->mtx);
+    EXPECT_EQ(index, log->end);
+    log->items[log->end++] = item;
+    log->history.emplace_back(item[1]);
+  }
+
+  virtual void recordBatch(ItemIndex index, const std::vector<std::vector<std::string>> &items) override {
+    std::lock_guard<std::mutex> lock(log->mtx);
+    EXPECT_EQ(index, log->end);
+    for(const std::vector<std::string> &item : items) {
+      log->items[log->end++] = item;
+      log->history.emplace_back(item[1]);
+    }
+
+    log->recordBatches.emplace_back(items.size());
+  }
+
+  virtual void pop() override {
+    popBatch(1);
+  }
+
+  virtual void popBatch(size_t count) override {
+    std::lock_guard<std::mutex> lock(log->mtx);
+    EXPECT_LE(log->start + (ItemIndex) count, log->end);
+
+    for(size_t i = 0; i < count; i++) {
+      auto it = log->items.find(log->start++);
+      if(!log->server.wasReplied(it->second[1])) {
+        log->poppedUnacknowledged = true;
+      }
+
+      log->items.erase(it);
+    }
+
+    log->popBatches.emplace_back(count);
+    log->cv.notify_all();
+  }
+
+  virtual ItemIndex getStartingIndex() override {
+    std::lock_guard<std::mutex> lock(log->mtx);
+    return log->start;
+  }
+
+  virtual ItemIndex getEndingIndex() override {
+    std::lock_guard<std::mutex> lock(log->mtx);
+    return log->end;
+  }
+
+  virtual bool retrieve(ItemIndex index, std::vector<std::string> &ret) override {
+    std::lock_guard<std::mutex> lock(log->mtx);
+    auto it = log->items.find(index);
+    if(it == log->items.end()) return false;
+    ret = it->second;
+    return true;
+  }
+
+  virtual bool retrieveBatch(ItemIndex index, size_t count, std::vector<std::vector<std::string>> &out) override {
+    {
+      std::lock_guard<std::mutex> lock(log->mtx);
+      log->retrieveBatches.emplace_back(index, count);
+    }
+
+    return BackgroundFlusherPersistency::retrieveBatch(index, count, out);
+  }
+
+private:
+  std::shared_ptr<MemoryLog> log;
+};
+
+static std::vector<std::string> setRequest(const std::string &key) {
+  return {"SET", key, "value"};
+}
+
+static Options flusherOptions() {
+  Options opts;
+  opts.ensureConnectionIsPrimed = false;
+  return opts;
+}
+
+TEST(BackgroundFlusher, GroupCommit) {
+  AckServer server;
+  std::shared_ptr<MemoryLog> log = std::make_shared<MemoryLog>(server);
+  Notifier notifier;
+
+  const size_t kThreads = 8;
+  const size_t kPerThread = 200;
+  const ItemIndex kTotal = kThreads * kPerThread;
+
+  {
+    BackgroundFlusher flusher(server.members(), flusherOptions(), notifier,
+      new MemoryPersistency(log));
+    flusher.enableGroupCommit(16);
+
+    std::vector<std::thread> pushers;
+    for(size_t t = 0; t < kThreads; t++) {
+      pushers.emplace_back([&, t]() {
+        for(size_t i = 0; i < kPerThread; i++) {
+          flusher.pushRequest(setRequest(SSTR("t" << t << "-" << i)));
+        }
+      });
+    }
+
+    for(std::thread &pusher : pushers) {
+      pusher.join();
+    }
+
+    ASSERT_TRUE(flusher.waitForIndex(kTotal - 1, std::chrono::seconds(30)));
+    ASSERT_EQ(flusher.getEnqueuedAndClear(), kTotal);
+
+    // Everything acknowledged: popped down to the end
+    ASSERT_TRUE(log->waitStart(kTotal));
+  }
+
+  //----------------------------------------------------------------------------
+  // Every push was recorded exactly once, through batches, each thread's in
+  // the order it pushed them - and sent out in the order recorded.
+  //----------------------------------------------------------------------------
+  std::lock_guard<std::mutex> lock(log->mtx);
+  ASSERT_EQ(log->end, kTotal);
+  ASSERT_EQ(log->history.size(), (size_t) kTotal);
+
+  size_t recorded = 0;
+  for(size_t batch : log->recordBatches) {
+    recorded += batch;
+  }
+
+  ASSERT_EQ(recorded, (size_t) kTotal);
+  ASSERT_LE(log->recordBatches.size(), (size_t) kTotal);
+
+  std::map<std::string, size_t> nextPerThread;
+  for(const std::string &key : log->history) {
+    std::string thread = key.substr(0, key.find('-'));
+    ASSERT_EQ(key, SSTR(thread << "-" << nextPerThread[thread]++));
+  }
+
+  ASSERT_EQ(server.getReceived(), log->history);
+
+  size_t popped = 0;
+  for(size_t batch : log->popBatches) {
+    popped += batch;
+  }
+
+  ASSERT_EQ(popped, (size_t) kTotal);
+  ASSERT_FALSE(log->poppedUnacknowledged);
+}
+
+TEST(BackgroundFlusher, GroupCommitPopsAcknowledgedRange) {
+  AckServer server;
+  std::shared_ptr<MemoryLog> log = std::make_shared<MemoryLog>(server);
+  Notifier notifier;
+  server.hold(6);
+
+  {
+    BackgroundFlusher flusher(server.members(), flusherOptions(), notifier,
+      new MemoryPersistency(log));
+    flusher.enableGroupCommit(4);
+
+    for(size_t i = 0; i < 10; i++) {
+      flusher.pushRequest(setRequest(SSTR("key-" << i)));
+    }
+
+    ASSERT_TRUE(flusher.waitForIndex(5, std::chrono::seconds(30)));
+    ASSERT_FALSE(flusher.hasItemBeenAcked(6));
+
+    //--------------------------------------------------------------------------
+    // Four acknowledgements make a batch to pop - whatever the popper finds
+    // acknowledged by then goes, and nothing beyond it.
+    //--------------------------------------------------------------------------
+    ASSERT_TRUE(log->waitStart(4));
+
+    {
+      std::lock_guard<std::mutex> lock(log->mtx);
+      ASSERT_GE(log->start, 4);
+      ASSERT_LE(log->start, 6);
+      ASSERT_EQ(log->end, 10);
+      ASSERT_EQ(log->items.size(), (size_t) (10 - log->start));
+      ASSERT_EQ(log->items.begin()->first, log->start);
+      ASSERT_FALSE(log->poppedUnacknowledged);
+    }
+
+    // Queue drained: The remainder is popped, however few
+    server.release();
+    ASSERT_TRUE(flusher.waitForIndex(9, std::chrono::seconds(30)));
+    ASSERT_TRUE(log->waitStart(10));
+  }
+
+  std::lock_guard<std::mutex> lock(log->mtx);
+  ASSERT_TRUE(log->items.empty());
+  ASSERT_FALSE(log->poppedUnacknowledged);
+  ASSERT_EQ(server.getReceived(), log->history);
+}
+
+TEST(BackgroundFlusher, WindowedReplay) {
+  AckServer server;
+  std::shared_ptr<MemoryLog> log = std::make_shared<MemoryLog>(server);
+  Notifier notifier;
+
+  //----------------------------------------------------------------------------
+  // Left over from a previous run: 5010 items, the first 10 acknowledged.
+  // More than a whole replay window.
+  //----------------------------------------------------------------------------
+  const ItemIndex kWindow = 4096;
+  MemoryPersistency *persistency = new MemoryPersistency(log);
+  for(ItemIndex i = 0; i < 5010; i++) {
+    persistency->record(i, setRequest(SSTR("key-" << i)));
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(log->mtx);
+    for(ItemIndex i = 0; i < 10; i++) {
+      log->items.erase(i);
+    }
+
+    log->start = 10;
+  }
+
+  // Only the first ten replayed items are acknowledged for now
+  server.hold(10);
+
+  {
+    BackgroundFlusher flusher(server.members(), flusherOptions(), notifier, persistency);
+    ASSERT_TRUE(flusher.isReplaying());
+
+    //--------------------------------------------------------------------------
+    // A full window goes out, then one more item for every acknowledgement -
+    // never more than a window in flight.
+    //--------------------------------------------------------------------------
+    ASSERT_TRUE(server.waitReceived(kWindow + 10));
+    ASSERT_TRUE(flusher.waitForIndex(19, std::chrono::seconds(30)));
+    ASSERT_FALSE(flusher.hasItemBeenAcked(20));
+    ASSERT_EQ(server.getMaxInFlight(), (size_t) kWindow);
+
+    // Pushed during replay: recorded, and sent once replay gets there
+    flusher.pushRequest(setRequest("pushed"));
+    ASSERT_EQ(flusher.getEndingIndex(), 5011);
+
+    //--------------------------------------------------------------------------
+    // Connection drops with a full window in flight. Everything unacknowledged
+    // is written again after reconnecting, and replay carries on behind it.
+    //--------------------------------------------------------------------------
+    server.disconnect();
+    server.release();
+
+    ASSERT_TRUE(flusher.waitForIndex(5010, std::chrono::seconds(30)));
+    ASSERT_TRUE(log->waitStart(5011));
+    ASSERT_LE(server.getMaxInFlight(), (size_t) kWindow);
+  }
+
+  std::vector<std::string> expected;
+  for(ItemIndex i = 20; i < 5010; i++) {
+    expected.emplace_back(SSTR("key-" << i));
+  }
+
+  expected.emplace_back("pushed");
+
+  std::vector<std::vector<std::string>> connections = server.getConnections();
+  ASSERT_EQ(connections.size(), 2u);
+  ASSERT_EQ(connections[0].size(), (size_t) kWindow + 10);
+  ASSERT_EQ(connections[0].front(), "key-10");
+  ASSERT_EQ(connections[0].back(), SSTR("key-" << 10 + kWindow + 9));
+  ASSERT_EQ(connections[1], expected);
+
+  //----------------------------------------------------------------------------
+  // Replay read consecutive ranges through retrieveBatch, none larger than
+  // the window
+  //----------------------------------------------------------------------------
+  std::lock_guard<std::mutex> lock(log->mtx);
+  ItemIndex next = 10;
+  for(const std::pair<ItemIndex, size_t> &batch : log->retrieveBatches) {
+    ASSERT_EQ(batch.first, next);
+    ASSERT_LE(batch.second, (size_t) kWindow);
+    next += batch.second;
+  }
+
+  ASSERT_EQ(next, 5011);
+  ASSERT_TRUE(log->items.empty());
+  ASSERT_FALSE(log->poppedUnacknowledged);
+}
+
+TEST(BackgroundFlusher, WaitForIndex) {
+  AckServer server;
+  std::shared_ptr<MemoryLog> log = std::make_shared<MemoryLog>(server);
+  Notifier notifier;
+  server.hold(3);
+
+  BackgroundFlusher flusher(server.members(), flusherOptions(), notifier,
+    new MemoryPersistency(log));
+
+  for(size_t i = 0; i < 5; i++) {
+    flusher.pushRequest(setRequest(SSTR("key-" << i)));
+  }
+
+  ASSERT_TRUE(flusher.waitForIndex(2, std::chrono::seconds(30)));
+  ASSERT_TRUE(flusher.hasItemBeenAcked(2));
+
+  // Held back: times out, not before the deadline
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  ASSERT_FALSE(flusher.waitForIndex(3, std::chrono::milliseconds(100)));
+  ASSERT_GE(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(100));
+  ASSERT_FALSE(flusher.hasItemBeenAcked(3));
+
+  //----------------------------------------------------------------------------
+  // Waiters on different items, woken once theirs is acknowledged - the one
+  // which timed out above is gone, and doesn't get in the way.
+  //----------------------------------------------------------------------------
+  std::future<bool> waiter3 = std::async(std::launch::async, [&]() {
+    return flusher.waitForIndex(3, std::chrono::seconds(30));
+  });
+
+  std::future<bool> waiter4 = std::async(std::launch::async, [&]() {
+    return flusher.waitForIndex(4, std::chrono::seconds(30));
+  });
+
+  server.release();
+  ASSERT_TRUE(waiter3.get());
+  ASSERT_TRUE(waiter4.get());
+  ASSERT_TRUE(flusher.hasItemBeenAcked(4));
+  ASSERT_FALSE(flusher.hasItemBeenAcked(5));
+}
+
+TEST(BackgroundFlusher, PopperDrainsOnShutdown) {
+  AckServer server;
+  std::shared_ptr<MemoryLog> log = std::make_shared<MemoryLog>(server);
+  Notifier notifier;
+  server.hold(5);
+
+  {
+    //--------------------------------------------------------------------------
+    // A batch size never reached, and a queue which never drains: Nothing is
+    // popped while running.
+    //--------------------------------------------------------------------------
+    BackgroundFlusher flusher(server.members(), flusherOptions(), notifier,
+      new MemoryPersistency(log));
+    flusher.enableGroupCommit(1000);
+
+    for(size_t i = 0; i < 10; i++) {
+      flusher.pushRequest(setRequest(SSTR("key-" << i)));
+    }
+
+    ASSERT_TRUE(flusher.waitForIndex(4, std::chrono::seconds(30)));
+    ASSERT_EQ(flusher.getStartingIndex(), 5);
+    ASSERT_EQ(flusher.size(), 5u);
+
+    std::lock_guard<std::mutex> lock(log->mtx);
+    ASSERT_EQ(log->start, 0);
+  }
+
+  // Shut down: Exactly the acknowledged items were popped on the way out
+  std::lock_guard<std::mutex> lock(log->mtx);
+  ASSERT_EQ(log->start, 5);
+  ASSERT_EQ(log->end, 10);
+  ASSERT_EQ(log->popBatches, std::vector<size_t>({5}));
+  ASSERT_FALSE(log->poppedUnacknowledged);
+}
+
+#if HAVE_ROCKSDB == 1
+
+class RocksDBQueue : public ::testing::Test {
+protected:
+  void SetUp() override {
+    char tmpl[] = "/tmp/qclient-rocksdb-queue-XXXXXX";
+    ASSERT_NE(mkdtemp(tmpl), nullptr);
+    dir = tmpl;
+  }
+
+  void TearDown() override {
+    rocksdb::DestroyDB(dir, rocksdb::Options());
+    rmdir(dir.c_str());
+  }
+
+  std::vector<std::string> item(int i) {
+    return {"SET", "key-" + std::to_string(i), std::string(i % 50, 'x')};
+  }
+
+  std::string dir;
+};
+
+TEST_F(RocksDBQueue, DefaultsToLevelCompaction) {
+  ASSERT_FALSE(RocksDBPersistencyOptions().fifoCompaction);
+}
+
+TEST_F(RocksDBQueue, RecordRetrievePop) {
+  {
+    RocksDBPersistency queue(dir);
+    ASSERT_EQ(queue.getStartingIndex(), 0);
+    ASSERT_EQ(queue.getEndingIndex(), 0);
+
+    for(int i = 0; i < 10; i++) {
+      queue.record(i, item(i));
+    }
+
+    std::vector<std::vector<std::string>> batch;
+    for(int i = 10; i < 100; i++) {
+      batch.emplace_back(item(i));
+    }
+
+    queue.recordBatch(10, batch);
+    ASSERT_EQ(queue.getEndingIndex(), 100);
+
+    std::vector<std::string> out;
+    ASSERT_TRUE(queue.retrieve(42, out));
+    ASSERT_EQ(out, item(42));
+    ASSERT_FALSE(queue.retrieve(100, out));
+
+    std::vector<std::vector<std::string>> range;
+    ASSERT_TRUE(queue.retrieveBatch(5, 20, range));
+    ASSERT_EQ(range.size(), 20u);
+    ASSERT_EQ(range[0], item(5));
+    ASSERT_EQ(range[19], item(24));
+
+    // The range delete covers exactly the popped items
+    queue.pop();
+    queue.popBatch(29);
+    ASSERT_EQ(queue.getStartingIndex(), 30);
+    ASSERT_FALSE(queue.retrieve(29, out));
+    ASSERT_TRUE(queue.retrieve(30, out));
+    ASSERT_EQ(out, item(30));
+  }
+
+  // Reopen: Both counters and the remaining items survive
+  RocksDBPersistency queue(dir);
+  ASSERT_EQ(queue.getStartingIndex(), 30);
+  ASSERT_EQ(queue.getEndingIndex(), 100);
+
+  std::vector<std::vector<std::string>> range;
+  ASSERT_TRUE(queue.retrieveBatch(30, 70, range));
+  ASSERT_EQ(range.front(), item(30));
+  ASSERT_EQ(range.back(), item(99));
+}
+
+TEST_F(RocksDBQueue, LegacyKeys) {
+  {
+    rocksdb::Options options;
+    options.create_if_missing = true;
+
+    rocksdb::DB *ptr = nullptr;
+    ASSERT_TRUE(rocksdb::DB::Open(options, dir, &ptr).ok());
+    std::unique_ptr<rocksdb::DB> db(ptr);
+
+    for(int i = 0; i < 10; i++) {
+      ASSERT_TRUE(db->Put(rocksdb::WriteOptions(), getKey(i), serializeVector(item(i))).ok());
+    }
+
+    ASSERT_TRUE(db->Put(rocksdb::WriteOptions(), "START-INDEX", intToBinaryString(3)).ok());
+    ASSERT_TRUE(db->Put(rocksdb::WriteOptions(), "END-INDEX", intToBinaryString(10)).ok());
+  }
+
+  // Queues written with the legacy encoding keep it until drained
+  RocksDBPersistency queue(dir);
+  ASSERT_EQ(queue.getStartingIndex(), 3);
+  ASSERT_EQ(queue.getEndingIndex(), 10);
+
+  queue.record(10, item(10));
+  queue.popBatch(5);
+
+  std::vector<std::vector<std::string>> range;
+  ASSERT_TRUE(queue.retrieveBatch(8, 3, range));
+  ASSERT_EQ(range[0], item(8));
+  ASSERT_EQ(range[2], item(10));
+}
+
+#endif
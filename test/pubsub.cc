@@ -21,12 +21,18 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.*
  ************************************************************************/
 
+#include "pubsub/MessageDecoder.hh"
 #include "pubsub/MessageParser.hh"
 #include "qclient/ResponseBuilder.hh"
 #include "qclient/pubsub/Message.hh"
 #include "qclient/pubsub/MessageQueue.hh"
 #include "qclient/pubsub/Subscriber.hh"
+#include "qclient/pubsub/SubscriptionDispatcher.hh"
+#include "qclient/MemoryBudget.hh"
 #include "gtest/gtest.h"
+#include <condition_variable>
+#include <future>
+#include <mutex>
 
 using namespace qclient;
 
@@ -131,6 +137,97 @@ TEST(MessageParser, kPatternUnsubscribe) {
   ASSERT_EQ(msg.getActiveSubscriptions(), 9999);
 }
 
+//------------------------------------------------------------------------------
+// Run the encoded reply through a ResponseBuilder, once with the decoder and
+// once without, and check that both paths agree.
+//------------------------------------------------------------------------------
+static bool decodeAndCompare(const std::string &encoded, Message &out) {
+  MessageDecoder decoder;
+  ResponseBuilder builder;
+  builder.setReplyDecoderLookup([&decoder]() { return &decoder; });
+
+  // One byte at a time, to exercise replies which arrive in pieces.
+  redisReplyPtr reply;
+  for(size_t i = 0; i < encoded.size(); i++) {
+    EXPECT_EQ(builder.pull(reply), ResponseBuilder::Status::kIncomplete);
+    builder.feed(encoded.c_str() + i, 1);
+  }
+
+  EXPECT_EQ(builder.pull(reply), ResponseBuilder::Status::kOk);
+
+  bool decoded;
+  if(decoder.hasMessage()) {
+    decoded = decoder.take(out);
+    EXPECT_FALSE(decoder.hasMessage());
+  }
+  else {
+    decoded = MessageParser::parse(std::move(reply), out);
+  }
+
+  Message parsedMsg;
+  bool parsed = MessageParser::parse(ResponseBuilder::parseRedisEncodedString(encoded), parsedMsg);
+  EXPECT_EQ(decoded, parsed) << encoded;
+
+  if(parsed) {
+    EXPECT_EQ(out, parsedMsg) << encoded;
+  }
+
+  return decoded;
+}
+
+TEST(MessageDecoder, kMessage) {
+  Message msg;
+  ASSERT_TRUE(decodeAndCompare("*3\r\n$7\r\nmessage\r\n$4\r\nchan\r\n$7\r\npayload\r\n", msg));
+  ASSERT_EQ(msg, Message::createMessage("chan", "payload"));
+
+  ASSERT_TRUE(decodeAndCompare(">4\r\n$6\r\npubsub\r\n$7\r\nmessage\r\n$4\r\nchan\r\n$0\r\n\r\n", msg));
+  ASSERT_EQ(msg, Message::createMessage("chan", ""));
+}
+
+TEST(MessageDecoder, kPatternMessage) {
+  Message msg;
+  ASSERT_TRUE(decodeAndCompare("*4\r\n$8\r\npmessage\r\n$2\r\nc*\r\n$4\r\nchan\r\n$3\r\nabc\r\n", msg));
+  ASSERT_EQ(msg, Message::createPatternMessage("c*", "chan", "abc"));
+}
+
+TEST(MessageDecoder, Subscriptions) {
+  Message msg;
+  ASSERT_TRUE(decodeAndCompare("*3\r\n$9\r\nsubscribe\r\n$4\r\nchan\r\n:4\r\n", msg));
+  ASSERT_EQ(msg.getMessageType(), MessageType::kSubscribe);
+  ASSERT_EQ(msg.getChannel(), "chan");
+  ASSERT_EQ(msg.getActiveSubscriptions(), 4);
+
+  ASSERT_TRUE(decodeAndCompare(">4\r\n$6\r\npubsub\r\n$10\r\npsubscribe\r\n$2\r\np*\r\n:3\r\n", msg));
+  ASSERT_EQ(msg.getMessageType(), MessageType::kPatternSubscribe);
+  ASSERT_EQ(msg.getPattern(), "p*");
+  ASSERT_EQ(msg.getActiveSubscriptions(), 3);
+
+  ASSERT_TRUE(decodeAndCompare("*3\r\n$11\r\nunsubscribe\r\n$6\r\nmychan\r\n:99\r\n", msg));
+  ASSERT_EQ(msg.getMessageType(), MessageType::kUnsubscribe);
+  ASSERT_EQ(msg.getChannel(), "mychan");
+  ASSERT_EQ(msg.getActiveSubscriptions(), 99);
+
+  ASSERT_TRUE(decodeAndCompare("*3\r\n$12\r\npunsubscribe\r\n$2\r\np*\r\n:0\r\n", msg));
+  ASSERT_EQ(msg.getMessageType(), MessageType::kPatternUnsubscribe);
+  ASSERT_EQ(msg.getPattern(), "p*");
+  ASSERT_EQ(msg.getActiveSubscriptions(), 0);
+}
+
+TEST(MessageDecoder, ParseFailure) {
+  Message msg;
+  ASSERT_FALSE(decodeAndCompare("+OK\r\n", msg));
+  ASSERT_FALSE(decodeAndCompare("-ERR something\r\n", msg));
+  ASSERT_FALSE(decodeAndCompare(":3\r\n", msg));
+  ASSERT_FALSE(decodeAndCompare("*0\r\n", msg));
+  ASSERT_FALSE(decodeAndCompare("*2\r\n$7\r\nmessage\r\n$4\r\nchan\r\n", msg));
+  ASSERT_FALSE(decodeAndCompare("*4\r\n$7\r\nmessage\r\n$4\r\nchan\r\n$1\r\na\r\n$1\r\nb\r\n", msg));
+  ASSERT_FALSE(decodeAndCompare("*3\r\n$7\r\nmessage\r\n:1\r\n$1\r\na\r\n", msg));
+  ASSERT_FALSE(decodeAndCompare("*3\r\n$9\r\nsubscribe\r\n$4\r\nchan\r\n$1\r\n4\r\n", msg));
+  ASSERT_FALSE(decodeAndCompare("*3\r\n$7\r\nmessage\r\n*1\r\n$1\r\na\r\n$1\r\nb\r\n", msg));
+  ASSERT_FALSE(decodeAndCompare("*3\r\n$6\r\nfoobar\r\n$4\r\nchan\r\n$1\r\na\r\n", msg));
+  ASSERT_FALSE(decodeAndCompare("*3\r\n+message\r\n$4\r\nchan\r\n$1\r\na\r\n", msg));
+}
+
 TEST(MessageQueue, BasicSanity) {
   MessageQueue queue;
 
@@ -152,6 +249,53 @@ TEST(MessageQueue, BasicSanity) {
   ASSERT_EQ(queue.size(), 0u);
 }
 
+TEST(MessageQueue, Drain) {
+  MessageQueue queue;
+  for(size_t i = 0; i < 5; i++) {
+    queue.handleIncomingMessage(Message::createMessage("ch", std::to_string(i)));
+  }
+
+  std::vector<Message> out;
+  ASSERT_EQ(queue.popBatch(out, 2), 2u);
+  ASSERT_EQ(queue.drain(out), 3u);
+  ASSERT_EQ(queue.size(), 0u);
+  ASSERT_EQ(out.size(), 5u);
+  ASSERT_EQ(out[4].getPayload(), "4");
+}
+
+TEST(BaseSubscriber, ResubscriptionChunks) {
+  std::set<std::string> keys;
+  for(size_t i = 0; i < 10; i++) {
+    keys.insert("ch" + std::to_string(i));
+  }
+
+  std::set<std::string> priority = {"ch7", "ch3", "not-subscribed"};
+
+  std::vector<BaseSubscriber::Chunk> chunks;
+  BaseSubscriber::planResubscription(keys, priority, 4, chunks);
+  ASSERT_EQ(chunks.size(), 3u);
+  ASSERT_EQ(chunks[0].size(), 4u);
+  ASSERT_EQ(chunks[1].size(), 4u);
+  ASSERT_EQ(chunks[2].size(), 2u);
+
+  // Prioritized keys go first, every key exactly once
+  ASSERT_EQ(*chunks[0][0], "ch3");
+  ASSERT_EQ(*chunks[0][1], "ch7");
+  ASSERT_EQ(*chunks[0][2], "ch0");
+
+  std::set<std::string> seen;
+  for(size_t i = 0; i < chunks.size(); i++) {
+    for(size_t j = 0; j < chunks[i].size(); j++) {
+      ASSERT_TRUE(seen.insert(*chunks[i][j]).second);
+    }
+  }
+
+  ASSERT_EQ(seen, keys);
+
+  BaseSubscriber::planResubscription({}, priority, 4, chunks);
+  ASSERT_TRUE(chunks.empty());
+}
+
 TEST(Subscriber, BasicSanity) {
   Subscriber subscriber;
 
@@ -185,3 +329,355 @@ TEST(Subscriber, BasicSanity) {
   ASSERT_TRUE(ch1clone->empty());
 }
 
+TEST(Subscriber, Patterns) {
+  Subscriber subscriber;
+
+  std::unique_ptr<Subscription> channel = subscriber.subscribe("ch1");
+  std::unique_ptr<Subscription> pattern = subscriber.psubscribe("ch*");
+
+  subscriber.feedFakeMessage(Message::createPatternMessage("ch*", "ch1", "aaaa"));
+  ASSERT_TRUE(channel->empty());
+  ASSERT_EQ(pattern->size(), 1u);
+
+  Message msg;
+  ASSERT_TRUE(pattern->front(msg));
+  ASSERT_EQ(msg, Message::createPatternMessage("ch*", "ch1", "aaaa"));
+  pattern->pop_front();
+
+  subscriber.feedFakeMessage(Message::createMessage("ch1", "bbbb"));
+  ASSERT_EQ(channel->size(), 1u);
+  ASSERT_TRUE(pattern->empty());
+
+  pattern.reset();
+  subscriber.feedFakeMessage(Message::createPatternMessage("ch*", "ch2", "cccc"));
+  ASSERT_EQ(channel->size(), 1u);
+}
+
+TEST(Subscriber, SharedPayload) {
+  Subscriber subscriber;
+
+  std::unique_ptr<Subscription> first = subscriber.subscribe("ch1");
+  std::unique_ptr<Subscription> second = subscriber.subscribe("ch1");
+
+  Message original = Message::createMessage("ch1", std::string(1024 * 1024, 'x'));
+  subscriber.feedFakeMessage(original);
+
+  Message one, two;
+  ASSERT_TRUE(first->front(one));
+  ASSERT_TRUE(second->front(two));
+  ASSERT_EQ(one, original);
+
+  // Fan-out and queueing hand around the same buffer
+  ASSERT_EQ(&one.getPayload(), &original.getPayload());
+  ASSERT_EQ(&two.getPayload(), &original.getPayload());
+
+  one.clear();
+  ASSERT_TRUE(one.getPayload().empty());
+  ASSERT_EQ(two.getPayload().size(), 1024u * 1024u);
+}
+
+TEST(Subscriber, PopBatch) {
+  Subscriber subscriber;
+  std::unique_ptr<Subscription> ch1 = subscriber.subscribe("ch1");
+
+  for(size_t i = 0; i < 10; i++) {
+    subscriber.feedFakeMessage(Message::createMessage("ch1", std::to_string(i)));
+  }
+
+  std::vector<Message> out;
+  ASSERT_EQ(ch1->popBatch(out, 3), 3u);
+  ASSERT_EQ(ch1->size(), 7u);
+  ASSERT_EQ(ch1->drain(out), 7u);
+  ASSERT_TRUE(ch1->empty());
+
+  ASSERT_EQ(out.size(), 10u);
+  for(size_t i = 0; i < 10; i++) {
+    ASSERT_EQ(out[i], Message::createMessage("ch1", std::to_string(i)));
+  }
+
+  // Nothing is queued in attached mode
+  ch1->attachCallback([](Message &&) {});
+  ASSERT_EQ(ch1->drain(out), 0u);
+}
+
+TEST(Subscriber, DropOldest) {
+  Subscriber subscriber;
+
+  SubscriptionLimits limits;
+  limits.maxMessages = 3;
+  std::unique_ptr<Subscription> ch1 = subscriber.subscribe("ch1", limits);
+
+  for(size_t i = 0; i < 5; i++) {
+    subscriber.feedFakeMessage(Message::createMessage("ch1", std::to_string(i)));
+  }
+
+  ASSERT_EQ(ch1->size(), 3u);
+  ASSERT_EQ(ch1->getDropped(), 2u);
+  ASSERT_EQ(ch1->getQueuedBytes(), 3u * 4u);
+
+  std::vector<Message> out;
+  ASSERT_EQ(ch1->drain(out), 3u);
+  ASSERT_EQ(out[0].getPayload(), "2");
+  ASSERT_EQ(out[2].getPayload(), "4");
+  ASSERT_EQ(ch1->getQueuedBytes(), 0u);
+}
+
+TEST(Subscriber, MemoryBudget) {
+  std::shared_ptr<MemoryBudget> budget = std::make_shared<MemoryBudget>(20);
+
+  Subscriber subscriber(budget);
+
+  SubscriptionLimits dropOldest;
+  std::unique_ptr<Subscription> ch1 = subscriber.subscribe("ch1", dropOldest);
+
+  SubscriptionLimits dropNewest;
+  dropNewest.policy = OverflowPolicy::kDropNewest;
+  std::unique_ptr<Subscription> ch2 = subscriber.subscribe("ch2", dropNewest);
+
+  // 4 bytes each: Five fit
+  for(size_t i = 0; i < 4; i++) {
+    subscriber.feedFakeMessage(Message::createMessage("ch2", std::to_string(i)));
+  }
+
+  subscriber.feedFakeMessage(Message::createMessage("ch1", "a"));
+  ASSERT_EQ(budget->getUsage(MemoryBudget::Category::kQueuedMessages), 20u);
+
+  // Full - ch2 discards the incoming message, ch1 evicts its own oldest
+  subscriber.feedFakeMessage(Message::createMessage("ch2", "4"));
+  subscriber.feedFakeMessage(Message::createMessage("ch1", "b"));
+  ASSERT_EQ(ch2->size(), 4u);
+  ASSERT_EQ(ch2->getDropped(), 1u);
+  ASSERT_EQ(ch1->size(), 1u);
+  ASSERT_EQ(ch1->getDropped(), 1u);
+  ASSERT_EQ(budget->getShed(), 2u);
+
+  Message msg;
+  ASSERT_TRUE(ch1->front(msg));
+  ASSERT_EQ(msg.getPayload(), "b");
+
+  std::vector<Message> out;
+  ASSERT_EQ(ch2->popBatch(out, 2), 2u);
+  ASSERT_EQ(budget->getUsage(), 12u);
+
+  subscriber.feedFakeMessage(Message::createMessage("ch1", "c"));
+  ASSERT_EQ(ch1->size(), 2u);
+
+  // Whatever's still queued is given back on destruction
+  ch1.reset();
+  ch2.reset();
+  ASSERT_EQ(budget->getUsage(), 0u);
+}
+
+TEST(Subscriber, DropNewestByBytes) {
+  Subscriber subscriber;
+
+  SubscriptionLimits limits;
+  limits.maxBytes = 10;
+  limits.policy = OverflowPolicy::kDropNewest;
+  std::unique_ptr<Subscription> ch1 = subscriber.subscribe("ch1", limits);
+
+  subscriber.feedFakeMessage(Message::createMessage("ch1", "aaaa"));
+  subscriber.feedFakeMessage(Message::createMessage("ch1", "bbbb"));
+  subscriber.feedFakeMessage(Message::createMessage("ch1", "c"));
+
+  ASSERT_EQ(ch1->size(), 1u);
+  ASSERT_EQ(ch1->getDropped(), 2u);
+
+  Message msg;
+  ASSERT_TRUE(ch1->front(msg));
+  ASSERT_EQ(msg.getPayload(), "aaaa");
+  ch1->pop_front();
+
+  subscriber.feedFakeMessage(Message::createMessage("ch1", "c"));
+  ASSERT_EQ(ch1->size(), 1u);
+}
+
+TEST(Subscriber, Conflate) {
+  Subscriber subscriber;
+
+  SubscriptionLimits limits;
+  limits.maxMessages = 2;
+  limits.policy = OverflowPolicy::kConflate;
+  limits.conflationKey = [](const Message &msg) {
+    return msg.getPayload().substr(0, 1);
+  };
+  std::unique_ptr<Subscription> ch1 = subscriber.subscribe("ch1", limits);
+
+  subscriber.feedFakeMessage(Message::createMessage("ch1", "a1"));
+  subscriber.feedFakeMessage(Message::createMessage("ch1", "b1"));
+  subscriber.feedFakeMessage(Message::createMessage("ch1", "a2"));
+  subscriber.feedFakeMessage(Message::createMessage("ch1", "c1"));
+  subscriber.feedFakeMessage(Message::createMessage("ch1", "a3"));
+
+  ASSERT_EQ(ch1->size(), 2u);
+  ASSERT_EQ(ch1->getConflated(), 2u);
+  ASSERT_EQ(ch1->getDropped(), 1u);
+
+  Message msg;
+  ASSERT_TRUE(ch1->front(msg));
+  ASSERT_EQ(msg.getPayload(), "a3");
+
+  // Superseded between front() and pop_front(): the latest isn't lost
+  subscriber.feedFakeMessage(Message::createMessage("ch1", "a4"));
+  ch1->pop_front();
+
+  std::vector<Message> out;
+  ASSERT_EQ(ch1->drain(out), 2u);
+  ASSERT_EQ(out[0].getPayload(), "b1");
+  ASSERT_EQ(out[1].getPayload(), "a4");
+  ASSERT_EQ(ch1->getQueuedBytes(), 0u);
+
+  // Attaching later delivers the latest values only
+  subscriber.feedFakeMessage(Message::createMessage("ch1", "a5"));
+  subscriber.feedFakeMessage(Message::createMessage("ch1", "a6"));
+
+  std::vector<std::string> seen;
+  ch1->attachCallback([&](Message &&msg) { seen.emplace_back(msg.getPayload()); });
+  subscriber.feedFakeMessage(Message::createMessage("ch1", "a7"));
+  subscriber.feedFakeMessage(Message::createMessage("ch1", "a8"));
+  ASSERT_EQ(seen, std::vector<std::string>({"a6", "a7", "a8"}));
+  ASSERT_EQ(ch1->getQueuedBytes(), 0u);
+}
+
+TEST(Subscriber, BoundedBatchCallback) {
+  Subscriber subscriber;
+
+  SubscriptionLimits limits;
+  limits.maxMessages = 10;
+  std::unique_ptr<Subscription> ch1 = subscriber.subscribe("ch1", limits);
+
+  std::mutex mtx;
+  std::condition_variable cv;
+  size_t received = 0;
+  ch1->attachBatchCallback([&](std::vector<Message> &&batch) {
+    std::lock_guard<std::mutex> lock(mtx);
+    received += batch.size();
+    cv.notify_all();
+  }, 4);
+
+  for(size_t i = 0; i < 1000; i++) {
+    subscriber.feedFakeMessage(Message::createMessage("ch1", std::to_string(i)));
+  }
+
+  std::unique_lock<std::mutex> lock(mtx);
+  cv.wait_for(lock, std::chrono::seconds(10), [&]() {
+    return received + ch1->getDropped() == 1000u;
+  });
+
+  ASSERT_EQ(received + ch1->getDropped(), 1000u);
+  lock.unlock();
+  ch1->detachCallback();
+  ASSERT_EQ(ch1->getQueuedBytes(), 0u);
+}
+
+TEST(Subscriber, ShardOf) {
+  ASSERT_EQ(Subscriber::shardOf("ch1", 1), 0u);
+  ASSERT_EQ(Subscriber::shardOf("ch1", 0), 0u);
+
+  std::vector<size_t> hits(4, 0);
+  for(size_t i = 0; i < 400; i++) {
+    size_t shard = Subscriber::shardOf("channel-" + std::to_string(i), 4);
+    ASSERT_LT(shard, 4u);
+    ASSERT_EQ(shard, Subscriber::shardOf("channel-" + std::to_string(i), 4));
+    hits[shard]++;
+  }
+
+  for(size_t hit : hits) {
+    ASSERT_GT(hit, 50u);
+  }
+
+  ASSERT_EQ(Subscriber().getShardCount(), 0u);
+}
+
+TEST(Subscriber, Dispatcher) {
+  std::shared_ptr<SubscriptionDispatcher> dispatcher = std::make_shared<SubscriptionDispatcher>(4);
+  Subscriber subscriber(nullptr, dispatcher);
+
+  // Two channels owned by different workers
+  std::string fastChannel = "fast";
+  std::string slowChannel = "slow";
+  for(size_t i = 0; dispatcher->workerOf(slowChannel) == dispatcher->workerOf(fastChannel); i++) {
+    slowChannel = "slow-" + std::to_string(i);
+  }
+
+  std::unique_ptr<Subscription> slow = subscriber.subscribe(slowChannel);
+  std::unique_ptr<Subscription> fast = subscriber.psubscribe("fa*");
+
+  std::promise<void> release;
+  std::shared_future<void> released = release.get_future().share();
+  std::vector<std::string> slowSeen;
+  slow->attachCallback([&](Message &&msg) {
+    released.wait();
+    slowSeen.emplace_back(msg.getPayload());
+  });
+
+  std::mutex mtx;
+  std::condition_variable cv;
+  std::vector<std::string> fastSeen;
+  fast->attachCallback([&](Message &&msg) {
+    std::lock_guard<std::mutex> lock(mtx);
+    fastSeen.emplace_back(msg.getPayload());
+    cv.notify_all();
+  });
+
+  std::vector<std::string> expected;
+  for(size_t i = 0; i < 100; i++) {
+    expected.emplace_back(std::to_string(i));
+    subscriber.feedFakeMessage(Message::createMessage(slowChannel, expected.back()));
+    subscriber.feedFakeMessage(Message::createPatternMessage("fa*", fastChannel, expected.back()));
+  }
+
+  // The blocked callback holds up its own channel only
+  {
+    std::unique_lock<std::mutex> lock(mtx);
+    cv.wait(lock, [&]() { return fastSeen.size() == 100u; });
+  }
+
+  ASSERT_EQ(fastSeen, expected);
+  ASSERT_TRUE(slowSeen.empty());
+  ASSERT_GE(dispatcher->getPending(), 99u);
+
+  // Detaching waits for whatever's been dispatched
+  release.set_value();
+  slow->detachCallback();
+  ASSERT_EQ(slowSeen, expected);
+
+  subscriber.feedFakeMessage(Message::createMessage(slowChannel, "queued"));
+  ASSERT_EQ(slow->size(), 1u);
+  fast.reset();
+  ASSERT_EQ(dispatcher->getPending(), 0u);
+}
+
+TEST(Subscriber, ModifyFromCallback) {
+  Subscriber subscriber;
+
+  std::unique_ptr<Subscription> victim = subscriber.subscribe("ch1");
+  std::unique_ptr<Subscription> late;
+  std::unique_ptr<Subscription> trigger = subscriber.subscribe("ch1");
+
+  //----------------------------------------------------------------------------
+  // Callbacks run without the subscriber lock: dropping a sibling and
+  // subscribing anew must not deadlock.
+  //----------------------------------------------------------------------------
+  std::vector<std::string> seen;
+  trigger->attachCallback([&](Message &&msg) {
+    seen.emplace_back(msg.getPayload());
+    if(victim) {
+      victim.reset();
+      late = subscriber.subscribe("ch1");
+    }
+  });
+
+  subscriber.feedFakeMessage(Message::createMessage("ch1", "first"));
+  ASSERT_FALSE(victim);
+  ASSERT_TRUE(late);
+  ASSERT_TRUE(late->empty());
+
+  subscriber.feedFakeMessage(Message::createMessage("ch1", "second"));
+  ASSERT_EQ(late->size(), 1u);
+  ASSERT_EQ(seen, std::vector<std::string>({"first", "second"}));
+
+  trigger.reset();
+  late.reset();
+}
+
@@ -22,11 +22,19 @@
  ************************************************************************/
 
 #include <gtest/gtest.h>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
+#include <iostream>
 #include "qclient/queueing/ThreadSafeQueue.hh"
+#include "qclient/queueing/WaitableQueue.hh"
 #include "qclient/queueing/AttachableQueue.hh"
 #include "qclient/queueing/RingBuffer.hh"
 #include "qclient/queueing/LastNSet.hh"
+#include "RequestQueue.hh"
 #include "qclient/queueing/LastNMap.hh"
+#include "qclient/queueing/StripedLastNMap.hh"
+#include "qclient/utils/MemoryResource.hh"
 
 using namespace qclient;
 
@@ -105,6 +113,307 @@ TYPED_TEST(Thread_Safe_Queue, BasicSanity) {
   ASSERT_TRUE(this->queue.empty());
 }
 
+TYPED_TEST(Thread_Safe_Queue, PopBatch) {
+  std::vector<Coord> out;
+  ASSERT_EQ(this->queue.popBatch(out, 10), 0u);
+
+  for(int i = 0; i < 50; i++) {
+    this->queue.emplace_back(i, i+1);
+  }
+
+  ASSERT_EQ(this->queue.popBatch(out, 7), 7u);
+  ASSERT_EQ(this->queue.size(), 43u);
+  ASSERT_EQ(this->queue.front().x, 7);
+
+  ASSERT_EQ(this->queue.popBatch(out, 1000), 43u);
+  ASSERT_TRUE(this->queue.empty());
+  ASSERT_EQ(out.size(), 50u);
+
+  for(int i = 0; i < 50; i++) {
+    ASSERT_EQ(out[i].x, i);
+    ASSERT_EQ(out[i].y, i+1);
+  }
+
+  // Queue keeps working afterwards, sequence numbers continue
+  ASSERT_EQ(this->queue.emplace_back(3, 4), 50);
+  ASSERT_EQ(this->queue.pop_front(), 50);
+}
+
+TEST(ThreadSafeQueue, SpareBlocks) {
+  ThreadSafeQueue<Coord, 4> queue;
+  ASSERT_EQ(queue.getSpareBlocks(), 0u);
+
+  // Steady traffic: Each drained block gets reused by the next one.
+  for(int i = 0; i < 100; i++) {
+    queue.emplace_back(i, i);
+    ASSERT_EQ(queue.front().x, i);
+    queue.pop_front();
+    ASSERT_LE(queue.getSpareBlocks(), 1u);
+  }
+
+  // A burst leaves behind at most the limit.
+  for(int i = 0; i < 100; i++) {
+    queue.emplace_back(i, i);
+  }
+
+  for(int i = 0; i < 100; i++) {
+    ASSERT_EQ(queue.front().x, i);
+    queue.pop_front();
+  }
+
+  ASSERT_EQ(queue.getSpareBlocks(), (ThreadSafeQueue<Coord, 4>::kDefaultSpareBlocks));
+
+  queue.setSpareBlockLimit(0);
+  ASSERT_EQ(queue.getSpareBlocks(), 0u);
+
+  for(int i = 0; i < 100; i++) {
+    queue.emplace_back(i, i);
+    queue.pop_front();
+  }
+
+  ASSERT_EQ(queue.getSpareBlocks(), 0u);
+  ASSERT_TRUE(queue.empty());
+}
+
+//------------------------------------------------------------------------------
+// Forwards to the global heap, counting outstanding allocations
+//------------------------------------------------------------------------------
+class CountingResource : public MemoryResource {
+public:
+  size_t outstanding = 0;
+  size_t allocations = 0;
+
+private:
+  void* do_allocate(size_t bytes, size_t alignment) override {
+    outstanding++;
+    allocations++;
+    return newDeleteResource()->allocate(bytes, alignment);
+  }
+
+  void do_deallocate(void *p, size_t bytes, size_t alignment) override {
+    outstanding--;
+    newDeleteResource()->deallocate(p, bytes, alignment);
+  }
+
+  bool do_is_equal(const MemoryResource &other) const noexcept override {
+    return this == &other;
+  }
+};
+
+TEST(ThreadSafeQueue, MemoryResource) {
+  CountingResource resource;
+
+  {
+    ThreadSafeQueue<std::string, 8> queue;
+    queue.setMemoryResource(&resource);
+    queue.setSpareBlockLimit(0);
+    ASSERT_EQ(resource.allocations, 0u);
+
+    for(size_t i = 0; i < 100; i++) {
+      queue.emplace_back(std::to_string(i));
+    }
+
+    ASSERT_GT(resource.outstanding, 10u);
+
+    for(size_t i = 0; i < 100; i++) {
+      ASSERT_EQ(queue.front(), std::to_string(i));
+      queue.pop_front();
+    }
+
+    // Only the last block is left
+    ASSERT_EQ(resource.outstanding, 1u);
+  }
+
+  ASSERT_EQ(resource.outstanding, 0u);
+}
+
+TEST(ThreadSafeQueue, GrowingBlocks) {
+  ThreadSafeQueue<Coord, 1000> queue;
+  queue.setBlockSizes(3, 7);
+
+  for(int round = 0; round < 3; round++) {
+    auto it = queue.begin();
+
+    for(int i = 0; i < 500; i++) {
+      queue.emplace_back(i, round);
+    }
+
+    for(int i = 0; i < 500; i++) {
+      ASSERT_EQ(it.item().x, i);
+      ASSERT_EQ(it.item().y, round);
+      it.next();
+      queue.pop_front();
+    }
+
+    ASSERT_TRUE(queue.empty());
+    queue.reset();
+  }
+
+  // Only full-sized blocks are kept around, up to the limit - and the fresh
+  // root after reset() took one of them.
+  ASSERT_EQ(queue.getSpareBlocks(), 1u);
+}
+
+TEST(ThreadSafeQueue, Benchmark) {
+  ThreadSafeQueue<int64_t, 5000> queue;
+  constexpr int64_t kItems = 1000000;
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+  std::thread producer([&queue]() {
+    for(int64_t i = 0; i < kItems; i++) {
+      queue.emplace_back(i);
+    }
+  });
+
+  // A consumer polling size(), the way the writer and callback threads do,
+  // ends up on the producer cache lines all the time.
+  int64_t expected = 0;
+  while(expected < kItems) {
+    if(queue.size() == 0u) {
+      continue;
+    }
+
+    ASSERT_EQ(queue.front(), expected);
+    queue.pop_front();
+    expected++;
+  }
+
+  producer.join();
+
+  std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+  int64_t microsec = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+
+  std::cout << "Took " << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count()
+  << " ms for " << kItems << " items (" << ((double) kItems / (double) microsec)*1000 << " kHz)" << std::endl;
+
+  ASSERT_TRUE(queue.empty());
+}
+
+TEST(WaitableQueue, MultipleProducers) {
+  WaitableQueue<Coord, 7> queue;
+
+  const int kProducers = 8;
+  const int kItems = 5000;
+
+  std::vector<std::thread> producers;
+  for(int p = 0; p < kProducers; p++) {
+    producers.emplace_back([&queue, p]() {
+      for(int i = 0; i < kItems; i++) {
+        queue.emplace_back(p, i);
+      }
+    });
+  }
+
+  std::vector<int> lastSeen(kProducers, -1);
+  auto it = queue.begin();
+
+  for(int i = 0; i < kProducers * kItems; i++) {
+    Coord *item = it.getItemBlockOrNull();
+    ASSERT_NE(item, nullptr);
+
+    // Per-producer FIFO order must be preserved
+    ASSERT_EQ(item->y, lastSeen[item->x] + 1);
+    lastSeen[item->x] = item->y;
+
+    it.next();
+    queue.pop_front();
+  }
+
+  for(auto &thread : producers) {
+    thread.join();
+  }
+
+  ASSERT_EQ(queue.size(), 0u);
+  queue.setBlockingMode(false);
+  ASSERT_EQ(it.getItemBlockOrNull(), nullptr);
+}
+
+TEST(WaitableQueue, BatchedProducers) {
+  WaitableQueue<Coord, 7> queue;
+
+  const int kProducers = 8;
+  const int kBatches = 500;
+  const int kBatchSize = 10;
+
+  std::vector<std::thread> producers;
+  for(int p = 0; p < kProducers; p++) {
+    producers.emplace_back([&queue, p]() {
+      for(int b = 0; b < kBatches; b++) {
+        queue.emplace_many(kBatchSize, [p, b](void *where, size_t i) {
+          new (where) Coord(p, b * kBatchSize + i);
+        });
+      }
+    });
+  }
+
+  auto it = queue.begin();
+
+  for(int i = 0; i < kProducers * kBatches; i++) {
+    Coord *first = it.getItemBlockOrNull();
+    ASSERT_NE(first, nullptr);
+    ASSERT_EQ(first->y % kBatchSize, 0);
+    int producer = first->x;
+    int start = first->y;
+
+    // A batch is never interleaved with items of another producer
+    for(int j = 0; j < kBatchSize; j++) {
+      Coord *item = it.getItemBlockOrNull();
+      ASSERT_NE(item, nullptr);
+      ASSERT_EQ(item->x, producer);
+      ASSERT_EQ(item->y, start + j);
+
+      it.next();
+      queue.pop_front();
+    }
+  }
+
+  for(auto &thread : producers) {
+    thread.join();
+  }
+
+  ASSERT_EQ(queue.size(), 0u);
+}
+
+TEST(WaitableQueue, SpinningConsumer) {
+  WaitableQueue<int, 4> queue;
+  queue.setSpinIterations(1000);
+
+  const int kItems = 20000;
+  std::thread producer([&queue]() {
+    for(int i = 0; i < kItems; i++) {
+      queue.emplace_back(i);
+
+      // Let the consumer catch up once in a while, so that it both spins
+      // and parks
+      if(i % 1000 == 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+    }
+  });
+
+  auto it = queue.begin();
+  for(int i = 0; i < kItems; i++) {
+    int *item = it.getItemBlockOrNull();
+    ASSERT_NE(item, nullptr);
+    ASSERT_EQ(*item, i);
+
+    it.next();
+    queue.pop_front();
+  }
+
+  producer.join();
+
+  // A consumer blocked on an empty queue must wake up on setBlockingMode
+  std::thread unblocker([&queue]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    queue.setBlockingMode(false);
+  });
+
+  ASSERT_EQ(it.getItemBlockOrNull(), nullptr);
+  unblocker.join();
+}
+
 class Accumulator {
 public:
 
@@ -162,6 +471,63 @@ TEST(AttachableQueue, BasicSanity) {
   ASSERT_EQ(acu.getSum(), 20);
 }
 
+TEST(AttachableQueue, BatchCallback) {
+  AttachableQueue<int, 10> queue;
+
+  // Backlog queued before attaching is delivered first
+  queue.emplace_back(0);
+  queue.emplace_back(1);
+  queue.emplace_back(2);
+
+  std::mutex mtx;
+  std::condition_variable cv;
+  std::vector<int> received;
+  size_t maxSeen = 0;
+  std::atomic<bool> produced {false};
+
+  queue.attachBatch([&](std::vector<int> &&batch) {
+    // Hold up the first batch, so that the rest pile up behind it
+    while(!produced) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    std::lock_guard<std::mutex> lock(mtx);
+    maxSeen = std::max(maxSeen, batch.size());
+    received.insert(received.end(), batch.begin(), batch.end());
+    cv.notify_all();
+  }, 4);
+
+  const int kItems = 1000;
+  for(int i = 3; i < kItems; i++) {
+    queue.emplace_back(i);
+  }
+
+  produced = true;
+
+  {
+    std::unique_lock<std::mutex> lock(mtx);
+    cv.wait(lock, [&]() { return received.size() == (size_t) kItems; });
+  }
+
+  for(int i = 0; i < kItems; i++) {
+    ASSERT_EQ(received[i], i);
+  }
+
+  ASSERT_EQ(maxSeen, 4u);
+
+  // Detaching brings back queueing
+  queue.detach();
+  queue.emplace_back(7);
+  ASSERT_EQ(queue.size(), 1u);
+  ASSERT_EQ(queue.front(), 7);
+
+  // Switching to a plain callback drains the queue again
+  using std::placeholders::_1;
+  Accumulator acu;
+  queue.attach(std::bind(&Accumulator::add, &acu, _1));
+  ASSERT_EQ(acu.getSum(), 7);
+}
+
 TEST(RingBuffer, BasicSanity) {
   RingBuffer<std::string> ringBuffer(3);
 
@@ -268,3 +634,101 @@ TEST(LastNMap, BasicSanity) {
   ASSERT_TRUE(lastMap.query("d", val));
   ASSERT_EQ(val, 55);
 }
+
+TEST(StripedLastNMap, BasicSanity) {
+  StripedLastNMap<std::string, int32_t> lastMap(3, 2);
+
+  lastMap.insert("a", 99);
+  int32_t val;
+
+  ASSERT_TRUE(lastMap.query("a", val));
+  ASSERT_EQ(val, 99);
+
+  lastMap.insert("a", 88);
+  ASSERT_TRUE(lastMap.query("a", val));
+  ASSERT_EQ(val, 88);
+
+  lastMap.insert("b", 77);
+  lastMap.insert("c", 66);
+
+  // "a" is still referenced by one slot
+  ASSERT_TRUE(lastMap.query("a", val));
+  ASSERT_EQ(val, 88);
+
+  lastMap.insert("d", 55);
+  ASSERT_FALSE(lastMap.query("a", val));
+
+  ASSERT_TRUE(lastMap.query("b", val));
+  ASSERT_EQ(val, 77);
+
+  ASSERT_TRUE(lastMap.query("c", val));
+  ASSERT_EQ(val, 66);
+
+  ASSERT_TRUE(lastMap.query("d", val));
+  ASSERT_EQ(val, 55);
+}
+
+TEST(StripedLastNMap, ConcurrentWriters) {
+  StripedLastNMap<int, int> lastMap(100);
+
+  const int kWriters = 4;
+  const int kItems = 10000;
+
+  std::vector<std::thread> writers;
+  for(int w = 0; w < kWriters; w++) {
+    writers.emplace_back([&lastMap, w]() {
+      int val;
+      for(int i = 0; i < kItems; i++) {
+        lastMap.insert(w * kItems + i, i);
+        lastMap.query(w * kItems + i / 2, val);
+      }
+    });
+  }
+
+  for(auto &thread : writers) {
+    thread.join();
+  }
+
+  // Exactly the last 100 inserts survive, in whatever order writers
+  // interleaved.
+  int present = 0;
+  int val;
+  for(int key = 0; key < kWriters * kItems; key++) {
+    if(lastMap.query(key, val)) {
+      ASSERT_EQ(val, key % kItems);
+      present++;
+    }
+  }
+
+  ASSERT_EQ(present, 100);
+}
+
+TEST(RequestQueue, Pinning) {
+  qclient::RequestQueue queue;
+
+  for(size_t i = 0; i < 5; i++) {
+    queue.emplace_back(nullptr, qclient::EncodedRequest::make("GET", std::to_string(i)));
+  }
+
+  ASSERT_EQ(queue.size(), 5u);
+  ASSERT_EQ(queue.begin().seq(), 1);
+
+  // Requests from seq 2 onwards stay alive, but are hidden once popped
+  queue.pin(2);
+  queue.pop_front();
+  queue.pop_front();
+  queue.pop_front();
+  ASSERT_EQ(queue.size(), 2u);
+  ASSERT_EQ(queue.begin().seq(), 4);
+  ASSERT_EQ(queue.begin().item().getLen(), qclient::EncodedRequest::make("GET", "3").getLen());
+
+  // Unpinned: Freed on the next pop, except for the usual one
+  queue.unpin();
+  queue.pop_front();
+  ASSERT_EQ(queue.size(), 1u);
+  ASSERT_EQ(queue.begin().seq(), 5);
+
+  queue.reset();
+  ASSERT_EQ(queue.size(), 0u);
+  ASSERT_EQ(queue.begin().seq(), 1);
+}
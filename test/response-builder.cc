@@ -24,6 +24,17 @@
 #include <gtest/gtest.h>
 #include "qclient/ResponseBuilder.hh"
 #include "qclient/QClient.hh"
+#include "qclient/ReplyDecoder.hh"
+#include "qclient/SSTR.hh"
+#include "ReceiveBufferSizer.hh"
+#include "ReplyArena.hh"
+#include "ParseStage.hh"
+#include <string.h>
+#include <cmath>
+#include <set>
+#include <unordered_map>
+#include <unordered_set>
+#include <poll.h>
 
 using namespace qclient;
 
@@ -42,3 +53,789 @@ TEST(ResponseBuilder, PushReplies) {
   );
 
 }
+
+TEST(ResponseBuilder, WriteBuffer) {
+  ResponseBuilder builder;
+  std::string first = "$10\r\nabcd";
+  std::string second = "efghij\r\n:5\r\n";
+
+  size_t len = 4096;
+  char *buf = builder.getWriteBuffer(len);
+  ASSERT_NE(buf, nullptr);
+  ASSERT_EQ(len, 4096u);
+  memcpy(buf, first.data(), first.size());
+  builder.commitWrite(first.size());
+
+  redisReplyPtr reply;
+  ASSERT_EQ(builder.pull(reply), ResponseBuilder::Status::kIncomplete);
+
+  buf = builder.getWriteBuffer(len);
+  memcpy(buf, second.data(), second.size());
+  builder.commitWrite(second.size());
+
+  ASSERT_EQ(builder.pull(reply), ResponseBuilder::Status::kOk);
+  ASSERT_EQ(std::string(reply->str, reply->len), "abcdefghij");
+
+  ASSERT_EQ(builder.pull(reply), ResponseBuilder::Status::kOk);
+  ASSERT_EQ(reply->integer, 5);
+
+  ASSERT_EQ(builder.pull(reply), ResponseBuilder::Status::kIncomplete);
+}
+
+TEST(ReceiveBufferSizer, GrowAndShrink) {
+  ReceiveBufferSizer sizer(1024 * 16);
+  ASSERT_EQ(sizer.get(), 2048u);
+
+  // Full reads double the size, up to the cap
+  sizer.record(2048);
+  ASSERT_EQ(sizer.get(), 4096u);
+  sizer.record(4096);
+  sizer.record(8192);
+  ASSERT_EQ(sizer.get(), 16384u);
+  sizer.record(16384);
+  ASSERT_EQ(sizer.get(), 16384u);
+
+  // A streak of small reads halves it
+  for(size_t i = 0; i < ReceiveBufferSizer::kShrinkAfter - 1; i++) {
+    sizer.record(10);
+  }
+
+  ASSERT_EQ(sizer.get(), 16384u);
+  sizer.record(10);
+  ASSERT_EQ(sizer.get(), 8192u);
+}
+
+TEST(ResponseBuilder, ArenaMode) {
+  ResponseBuilder builder;
+  builder.setArenaMode(true);
+
+  std::string encoded = "*3\r\n$3\r\nabc\r\n:42\r\n*2\r\n$0\r\n\r\n$-1\r\n";
+  builder.feed(encoded.substr(0, 10));
+
+  redisReplyPtr reply;
+  ASSERT_EQ(builder.pull(reply), ResponseBuilder::Status::kIncomplete);
+
+  builder.feed(encoded.substr(10));
+  ASSERT_EQ(builder.pull(reply), ResponseBuilder::Status::kOk);
+
+  ASSERT_EQ(describeRedisReply(reply),
+    "1) \"abc\"\n"
+    "2) (integer) 42\n"
+    "3) 1) \"\"\n"
+    "   2) (nil)\n"
+  );
+
+  // Sub-elements remain valid as long as the root is alive
+  redisReplyPtr second;
+  builder.feed("+OK\r\n");
+  ASSERT_EQ(builder.pull(second), ResponseBuilder::Status::kOk);
+  ASSERT_EQ(std::string(second->str, second->len), "OK");
+  ASSERT_EQ(std::string(reply->element[0]->str, reply->element[0]->len), "abc");
+}
+
+#ifdef QCLIENT_HAVE_PMR
+TEST(ResponseBuilder, ArenaMemoryResource) {
+  char buffer[64 * 1024];
+  std::pmr::monotonic_buffer_resource resource(buffer, sizeof(buffer), std::pmr::null_memory_resource());
+
+  ResponseBuilder builder;
+  builder.setArenaMode(true);
+  builder.setMemoryResource(&resource);
+
+  // Large enough to need chunks beyond the inline one
+  std::string encoded = "*100\r\n";
+  for(size_t i = 0; i < 100; i++) {
+    encoded += SSTR("$10\r\n" << std::string(10, 'a' + (i % 26)) << "\r\n");
+  }
+
+  builder.feed(encoded);
+  redisReplyPtr reply;
+  ASSERT_EQ(builder.pull(reply), ResponseBuilder::Status::kOk);
+  ASSERT_EQ(reply->elements, 100u);
+  ASSERT_EQ(std::string(reply->element[99]->str, reply->element[99]->len), std::string(10, 'v'));
+
+  // Everything came out of the buffer - the upstream resource throws
+  char *str = reply->element[0]->str;
+  ASSERT_TRUE(str >= buffer && str < buffer + sizeof(buffer));
+
+  // Exhausted resource: Parsing fails instead of crashing
+  builder.feed("*1\r\n$70000\r\n" + std::string(70000, 'x') + "\r\n");
+  ASSERT_EQ(builder.pull(reply), ResponseBuilder::Status::kProtocolError);
+}
+#endif
+
+TEST(ResponseBuilder, SkipStatus) {
+  ResponseBuilder builder;
+  ASSERT_EQ(builder.skipStatus("OK", 2), ResponseBuilder::Status::kIncomplete);
+
+  builder.feed("+OK\r\n+QUE");
+  ASSERT_EQ(builder.skipStatus("OK", 2), ResponseBuilder::Status::kOk);
+  ASSERT_EQ(builder.skipStatus("QUEUED", 6), ResponseBuilder::Status::kIncomplete);
+
+  builder.feed("UED\r");
+  ASSERT_EQ(builder.skipStatus("QUEUED", 6), ResponseBuilder::Status::kIncomplete);
+  builder.feed("\n+QUEUEDX\r\n");
+  ASSERT_EQ(builder.skipStatus("QUEUED", 6), ResponseBuilder::Status::kOk);
+
+  // Something else: Left in place, to be pulled as usual
+  ASSERT_EQ(builder.skipStatus("QUEUED", 6), ResponseBuilder::Status::kProtocolError);
+
+  redisReplyPtr reply;
+  ASSERT_EQ(builder.pull(reply), ResponseBuilder::Status::kOk);
+  ASSERT_EQ(describeRedisReply(reply), "QUEUEDX");
+
+  builder.feed("-ERR no\r\n");
+  ASSERT_EQ(builder.skipStatus("QUEUED", 6), ResponseBuilder::Status::kProtocolError);
+  ASSERT_EQ(builder.pull(reply), ResponseBuilder::Status::kOk);
+  ASSERT_EQ(reply->type, REDIS_REPLY_ERROR);
+
+  // Never in the middle of a reply
+  builder.feed("*2\r\n");
+  ASSERT_EQ(builder.pull(reply), ResponseBuilder::Status::kIncomplete);
+  builder.feed("+OK\r\n");
+  ASSERT_EQ(builder.skipStatus("OK", 2), ResponseBuilder::Status::kProtocolError);
+  builder.feed(":1\r\n");
+  ASSERT_EQ(builder.pull(reply), ResponseBuilder::Status::kOk);
+  ASSERT_EQ(reply->elements, 2u);
+}
+
+TEST(ResponseBuilder, SkipSimple) {
+  ResponseBuilder builder;
+  ASSERT_EQ(builder.skipSimple(), ResponseBuilder::Status::kIncomplete);
+
+  builder.feed("+OK\r\n:5\r\n:12");
+  ASSERT_EQ(builder.skipSimple(), ResponseBuilder::Status::kOk);
+  ASSERT_EQ(builder.skipSimple(), ResponseBuilder::Status::kOk);
+  ASSERT_EQ(builder.skipSimple(), ResponseBuilder::Status::kIncomplete);
+  builder.feed("3\r\n-ERR x\r\n");
+  ASSERT_EQ(builder.skipSimple(), ResponseBuilder::Status::kOk);
+
+  // Errors are left in place, to be pulled as usual
+  ASSERT_EQ(builder.skipSimple(), ResponseBuilder::Status::kProtocolError);
+  redisReplyPtr reply;
+  ASSERT_EQ(builder.pull(reply), ResponseBuilder::Status::kOk);
+  ASSERT_EQ(reply->type, REDIS_REPLY_ERROR);
+
+  builder.feed("$3\r\nabc\r\n");
+  ASSERT_EQ(builder.skipSimple(), ResponseBuilder::Status::kProtocolError);
+  ASSERT_EQ(builder.pull(reply), ResponseBuilder::Status::kOk);
+  ASSERT_EQ(describeRedisReply(reply), "\"abc\"");
+}
+
+TEST(ResponseBuilder, CommonReplies) {
+  ResponseBuilder builder;
+  builder.feed("+OK\r\n+OK\r\n:1\r\n:1\r\n+QUEUED\r\n:100000\r\n+OKAY\r\n:-1\r\n");
+
+  redisReplyPtr first, second;
+  ASSERT_EQ(builder.pull(first), ResponseBuilder::Status::kOk);
+  ASSERT_EQ(builder.pull(second), ResponseBuilder::Status::kOk);
+  ASSERT_EQ(first.get(), second.get());
+  ASSERT_EQ(first->type, REDIS_REPLY_STATUS);
+  ASSERT_EQ(std::string(first->str, first->len), "OK");
+
+  ASSERT_EQ(builder.pull(first), ResponseBuilder::Status::kOk);
+  ASSERT_EQ(builder.pull(second), ResponseBuilder::Status::kOk);
+  ASSERT_EQ(first.get(), second.get());
+  ASSERT_EQ(first->integer, 1);
+
+  ASSERT_EQ(builder.pull(first), ResponseBuilder::Status::kOk);
+  ASSERT_EQ(describeRedisReply(first), "QUEUED");
+
+  // Not common: Allocated as usual
+  redisReplyPtr large;
+  ASSERT_EQ(builder.pull(large), ResponseBuilder::Status::kOk);
+  ASSERT_EQ(large->integer, 100000);
+
+  redisReplyPtr status;
+  ASSERT_EQ(builder.pull(status), ResponseBuilder::Status::kOk);
+  ASSERT_EQ(std::string(status->str, status->len), "OKAY");
+  ASSERT_EQ(large->integer, 100000);
+
+  ASSERT_EQ(builder.pull(first), ResponseBuilder::Status::kOk);
+  ASSERT_EQ(first->integer, -1);
+}
+
+TEST(ReplyArena, ChunkGrowth) {
+  ReplyArena arena;
+
+  // Fits inside the inline chunk
+  void *first = arena.allocate(100);
+  ASSERT_NE(first, nullptr);
+  ASSERT_EQ(arena.getChunkCount(), 0u);
+
+  for(size_t i = 0; i < 1000; i++) {
+    void *ptr = arena.allocate(sizeof(void*));
+    ASSERT_EQ(((uintptr_t) ptr) % alignof(void*), 0u);
+  }
+
+  ASSERT_EQ(arena.getAllocatedBytes(), 100 + 1000 * sizeof(void*));
+  ASSERT_LE(arena.getChunkCount(), 3u);
+
+  // Oversized allocation gets a chunk of its own
+  ASSERT_NE(arena.allocate(1024 * 1024 * 4), nullptr);
+}
+
+TEST(ResponseBuilder, LargeStrings) {
+  for(bool arena : {false, true}) {
+    ResponseBuilder builder;
+    builder.setArenaMode(arena);
+    builder.setLargeStringThreshold(16);
+
+    std::string value(100, 'x');
+    value[99] = 'y';
+
+    // Header plus part of the value goes through the regular buffer
+    builder.feed("*2\r\n$100\r\n" + value.substr(0, 30));
+
+    redisReplyPtr reply;
+    ASSERT_EQ(builder.pull(reply), ResponseBuilder::Status::kIncomplete);
+
+    // Remaining bytes are written straight into the reply string
+    size_t len = 4096;
+    char *buf = builder.getWriteBuffer(len);
+    ASSERT_EQ(len, 72u);
+    memcpy(buf, value.data() + 30, 70);
+    memcpy(buf + 70, "\r\n", 2);
+    builder.commitWrite(72);
+
+    builder.feed("$3\r\nabc\r\n");
+    ASSERT_EQ(builder.pull(reply), ResponseBuilder::Status::kOk);
+    ASSERT_EQ(reply->elements, 2u);
+    ASSERT_EQ(std::string(reply->element[0]->str, reply->element[0]->len), value);
+    ASSERT_EQ(reply->element[0]->str[100], '\0');
+    ASSERT_EQ(std::string(reply->element[1]->str, reply->element[1]->len), "abc");
+  }
+}
+
+TEST(ResponseBuilder, NewlineScanning) {
+  // Exercise the vectorised newline search: Lines of every length around
+  // the block sizes, with stray \r and \n bytes in every position.
+  for(size_t len = 0; len < 80; len++) {
+    for(size_t stray = 0; stray <= len; stray++) {
+      std::string line(len, 'a');
+      if(stray < len) line[stray] = (stray % 2 == 0) ? '\r' : '\n';
+
+      ResponseBuilder builder;
+      builder.feed("+" + line + "\r\n:1\r\n");
+
+      redisReplyPtr reply;
+      ASSERT_EQ(builder.pull(reply), ResponseBuilder::Status::kOk);
+      ASSERT_EQ(reply->type, REDIS_REPLY_STATUS);
+      ASSERT_EQ(std::string(reply->str, reply->len), line);
+
+      ASSERT_EQ(builder.pull(reply), ResponseBuilder::Status::kOk);
+      ASSERT_EQ(reply->integer, 1);
+    }
+  }
+}
+
+TEST(ResponseBuilder, DeepPipeline) {
+  ResponseBuilder builder;
+  std::string payload;
+  for(size_t i = 0; i < 50000; i++) {
+    payload += ":" + std::to_string(i) + "\r\n";
+  }
+
+  // Feed a partial reply at the end, too
+  payload += "$5\r\nab";
+  builder.feed(payload);
+
+  redisReplyPtr reply;
+  for(size_t i = 0; i < 50000; i++) {
+    ASSERT_EQ(builder.pull(reply), ResponseBuilder::Status::kOk);
+    ASSERT_EQ(reply->integer, (long long) i);
+  }
+
+  ASSERT_EQ(builder.pull(reply), ResponseBuilder::Status::kIncomplete);
+  builder.feed("cde\r\n");
+  ASSERT_EQ(builder.pull(reply), ResponseBuilder::Status::kOk);
+  ASSERT_EQ(std::string(reply->str, reply->len), "abcde");
+  ASSERT_EQ(builder.pull(reply), ResponseBuilder::Status::kIncomplete);
+}
+
+static void checkResp3(bool arena) {
+  ResponseBuilder builder;
+  builder.setArenaMode(arena);
+
+  builder.feed(",3.25\r\n,-inf\r\n#t\r\n#f\r\n_\r\n(-12345678901234567890\r\n");
+  builder.feed("=15\r\ntxt:Some string\r\n!8\r\nERR a\r\nb\r\n");
+  builder.feed("%2\r\n+first\r\n:1\r\n$6\r\nsecond\r\n~2\r\n#t\r\n,1e3\r\n");
+
+  redisReplyPtr reply;
+  ASSERT_EQ(builder.pull(reply), ResponseBuilder::Status::kOk);
+  ASSERT_EQ(reply->type, REDIS_REPLY_DOUBLE);
+  ASSERT_EQ(reply->dval, 3.25);
+  ASSERT_EQ(std::string(reply->str, reply->len), "3.25");
+  ASSERT_EQ(describeRedisReply(reply), "(double) 3.25");
+
+  ASSERT_EQ(builder.pull(reply), ResponseBuilder::Status::kOk);
+  ASSERT_EQ(reply->type, REDIS_REPLY_DOUBLE);
+  ASSERT_TRUE(std::isinf(reply->dval));
+  ASSERT_LT(reply->dval, 0);
+
+  ASSERT_EQ(builder.pull(reply), ResponseBuilder::Status::kOk);
+  ASSERT_EQ(reply->type, REDIS_REPLY_BOOL);
+  ASSERT_EQ(reply->integer, 1);
+  ASSERT_EQ(describeRedisReply(reply), "(true)");
+
+  ASSERT_EQ(builder.pull(reply), ResponseBuilder::Status::kOk);
+  ASSERT_EQ(reply->type, REDIS_REPLY_BOOL);
+  ASSERT_EQ(reply->integer, 0);
+
+  ASSERT_EQ(builder.pull(reply), ResponseBuilder::Status::kOk);
+  ASSERT_EQ(reply->type, REDIS_REPLY_NIL);
+
+  ASSERT_EQ(builder.pull(reply), ResponseBuilder::Status::kOk);
+  ASSERT_EQ(reply->type, REDIS_REPLY_BIGNUM);
+  ASSERT_EQ(std::string(reply->str, reply->len), "-12345678901234567890");
+
+  ASSERT_EQ(builder.pull(reply), ResponseBuilder::Status::kOk);
+  ASSERT_EQ(reply->type, REDIS_REPLY_VERB);
+  ASSERT_EQ(std::string(reply->vtype), "txt");
+  ASSERT_EQ(std::string(reply->str, reply->len), "Some string");
+
+  ASSERT_EQ(builder.pull(reply), ResponseBuilder::Status::kOk);
+  ASSERT_EQ(reply->type, REDIS_REPLY_ERROR);
+  ASSERT_EQ(std::string(reply->str, reply->len), "ERR a\r\nb");
+
+  ASSERT_EQ(builder.pull(reply), ResponseBuilder::Status::kOk);
+  ASSERT_EQ(reply->type, REDIS_REPLY_MAP);
+  ASSERT_EQ(reply->elements, 4u);
+  ASSERT_EQ(describeRedisReply(reply),
+    "1# first => (integer) 1\n"
+    "2# \"second\" => 1) (true)\n"
+    "2) (double) 1e3\n"
+  );
+
+  ASSERT_EQ(reply->element[3]->type, REDIS_REPLY_SET);
+  ASSERT_EQ(reply->element[3]->element[1]->dval, 1000);
+  ASSERT_EQ(builder.pull(reply), ResponseBuilder::Status::kIncomplete);
+}
+
+TEST(ResponseBuilder, Resp3Types) {
+  checkResp3(false);
+  checkResp3(true);
+}
+
+TEST(ResponseBuilder, Resp3Attributes) {
+  ResponseBuilder builder;
+
+  // Attributes are discarded, both at the top level, and inside aggregates,
+  // even when nested, empty, or fed byte-by-byte.
+  std::string payload = "|1\r\n+key\r\n*1\r\n:1\r\n:5\r\n"
+    "*3\r\n:1\r\n|1\r\n$3\r\nttl\r\n|0\r\n:10\r\n:2\r\n|0\r\n:3\r\n"
+    "|0\r\n%1\r\n+a\r\n+b\r\n";
+
+  for(size_t i = 0; i < payload.size(); i++) {
+    builder.feed(payload.substr(i, 1));
+  }
+
+  redisReplyPtr reply;
+  ASSERT_EQ(builder.pull(reply), ResponseBuilder::Status::kOk);
+  ASSERT_EQ(reply->type, REDIS_REPLY_INTEGER);
+  ASSERT_EQ(reply->integer, 5);
+
+  ASSERT_EQ(builder.pull(reply), ResponseBuilder::Status::kOk);
+  ASSERT_EQ(describeRedisReply(reply),
+    "1) (integer) 1\n"
+    "2) (integer) 2\n"
+    "3) (integer) 3\n"
+  );
+
+  ASSERT_EQ(builder.pull(reply), ResponseBuilder::Status::kOk);
+  ASSERT_EQ(reply->type, REDIS_REPLY_MAP);
+  ASSERT_EQ(reply->elements, 2u);
+  ASSERT_EQ(builder.pull(reply), ResponseBuilder::Status::kIncomplete);
+
+  // A connection dropped in the middle of an attribute must not leak
+  ResponseBuilder builder2;
+  builder2.feed("*2\r\n:1\r\n|1\r\n+a\r\n");
+  ASSERT_EQ(builder2.pull(reply), ResponseBuilder::Status::kIncomplete);
+
+  builder2.feed(",abc\r\n");
+  ASSERT_EQ(builder2.pull(reply), ResponseBuilder::Status::kProtocolError);
+}
+
+class StringSink : public BulkSink {
+public:
+  void onStart(size_t totalLen) override {
+    starts++;
+    expected = totalLen;
+  }
+
+  void onChunk(const char *data, size_t len) override {
+    contents.append(data, len);
+    chunks++;
+  }
+
+  size_t starts = 0;
+  size_t expected = 0;
+  size_t chunks = 0;
+  std::string contents;
+};
+
+TEST(ResponseBuilder, StreamedBulkStrings) {
+  ResponseBuilder builder;
+  StringSink sink;
+  BulkSink *next = nullptr;
+  builder.setBulkSinkLookup([&]() { return next; });
+
+  redisReplyPtr reply;
+
+  // Nothing to stream into: Buffered as usual
+  builder.feed("$5\r\nabcde\r\n");
+  ASSERT_EQ(builder.pull(reply), ResponseBuilder::Status::kOk);
+  ASSERT_EQ(std::string(reply->str, reply->len), "abcde");
+
+  next = &sink;
+
+  // Errors and strings nested in arrays are never streamed
+  builder.feed("-ERR\r\n*1\r\n$3\r\nabc\r\n");
+  ASSERT_EQ(builder.pull(reply), ResponseBuilder::Status::kOk);
+  ASSERT_EQ(reply->type, REDIS_REPLY_ERROR);
+  ASSERT_EQ(builder.pull(reply), ResponseBuilder::Status::kOk);
+  ASSERT_EQ(std::string(reply->element[0]->str, reply->element[0]->len), "abc");
+  ASSERT_EQ(sink.starts, 0u);
+
+  builder.feed("$10\r\n0123");
+  ASSERT_EQ(builder.pull(reply), ResponseBuilder::Status::kIncomplete);
+  ASSERT_EQ(sink.starts, 1u);
+  ASSERT_EQ(sink.expected, 10u);
+  ASSERT_EQ(sink.contents, "0123");
+
+  // Chunks never include the trailing \r\n, even when split
+  builder.feed("456789\r");
+  ASSERT_EQ(builder.pull(reply), ResponseBuilder::Status::kIncomplete);
+  ASSERT_EQ(sink.contents, "0123456789");
+
+  next = nullptr;
+  builder.feed("\n:7\r\n");
+  ASSERT_EQ(builder.pull(reply), ResponseBuilder::Status::kOk);
+  ASSERT_EQ(reply->type, REDIS_REPLY_STRING);
+  ASSERT_EQ(reply->len, 0u);
+  ASSERT_EQ(sink.chunks, 2u);
+
+  ASSERT_EQ(builder.pull(reply), ResponseBuilder::Status::kOk);
+  ASSERT_EQ(reply->integer, 7);
+  ASSERT_EQ(builder.pull(reply), ResponseBuilder::Status::kIncomplete);
+}
+
+class RecordingDecoder : public ReplyDecoder {
+public:
+  void onAggregate(int type, size_t elements, size_t depth) override {
+    events.push_back(SSTR("aggregate " << type << " " << elements << " @" << depth));
+  }
+
+  void onString(int type, const char *str, size_t len, size_t depth) override {
+    events.push_back(SSTR("string " << type << " " << std::string(str, len) << " @" << depth));
+  }
+
+  void onInteger(long long value, size_t depth) override {
+    events.push_back(SSTR("integer " << value << " @" << depth));
+  }
+
+  void invalidEvent(size_t depth) override {
+    events.push_back(SSTR("invalid @" << depth));
+  }
+
+  std::vector<std::string> events;
+};
+
+static void checkDecoding(bool arena) {
+  ResponseBuilder builder;
+  builder.setArenaMode(arena);
+
+  RecordingDecoder decoder;
+  ReplyDecoder *next = &decoder;
+  builder.setReplyDecoderLookup([&]() { return next; });
+
+  // Scalars and errors are not decoded
+  redisReplyPtr reply;
+  builder.feed("-ERR\r\n:3\r\n");
+  ASSERT_EQ(builder.pull(reply), ResponseBuilder::Status::kOk);
+  ASSERT_EQ(reply->type, REDIS_REPLY_ERROR);
+  ASSERT_EQ(builder.pull(reply), ResponseBuilder::Status::kOk);
+  ASSERT_EQ(reply->integer, 3);
+  ASSERT_TRUE(decoder.events.empty());
+
+  // Feed partially, the decoder stays in place until the reply is complete
+  builder.feed("*4\r\n$3\r\nabc\r\n:5\r\n|1\r\n+a\r\n+b\r\n*2\r\n,1.5\r\n=7\r\ntxt:x");
+  ASSERT_EQ(builder.pull(reply), ResponseBuilder::Status::kIncomplete);
+
+  next = nullptr;
+  builder.feed("yz\r\n_\r\n*1\r\n$3\r\nabc\r\n");
+  ASSERT_EQ(builder.pull(reply), ResponseBuilder::Status::kOk);
+  ASSERT_EQ(reply->type, REDIS_REPLY_ARRAY);
+  ASSERT_EQ(reply->elements, 0u);
+
+  std::vector<std::string> expected = {
+    "aggregate 2 4 @0",
+    "string 1 abc @1",
+    "integer 5 @1",
+    "aggregate 2 2 @1",
+    "invalid @2",
+    "string 14 xyz @2",
+    "invalid @1"
+  };
+
+  ASSERT_EQ(decoder.events, expected);
+
+  // No decoder for the next one
+  ASSERT_EQ(builder.pull(reply), ResponseBuilder::Status::kOk);
+  ASSERT_EQ(reply->elements, 1u);
+  ASSERT_EQ(std::string(reply->element[0]->str, reply->element[0]->len), "abc");
+}
+
+TEST(ResponseBuilder, ReplyDecoder) {
+  checkDecoding(false);
+  checkDecoding(true);
+}
+
+TEST(ReplyDecoder, StringCollector) {
+  ResponseBuilder builder;
+  std::vector<std::string> vec;
+  StringCollector<std::vector<std::string>> vecCollector(vec);
+
+  std::set<std::string> set;
+  StringCollector<std::set<std::string>> setCollector(set);
+
+  std::vector<ReplyDecoder*> decoders = { &vecCollector, &setCollector, &vecCollector };
+  size_t next = 0;
+  builder.setReplyDecoderLookup([&]() {
+    return next < decoders.size() ? decoders[next] : nullptr;
+  });
+
+  redisReplyPtr reply;
+  builder.feed("%2\r\n$1\r\na\r\n$1\r\nb\r\n$1\r\nc\r\n$1\r\nd\r\n");
+  ASSERT_EQ(builder.pull(reply), ResponseBuilder::Status::kOk);
+  ASSERT_TRUE(vecCollector.ok());
+  ASSERT_EQ(vec, std::vector<std::string>({"a", "b", "c", "d"}));
+
+  next++;
+  builder.feed("~3\r\n$1\r\nz\r\n$1\r\ny\r\n$1\r\nz\r\n");
+  ASSERT_EQ(builder.pull(reply), ResponseBuilder::Status::kOk);
+  ASSERT_TRUE(setCollector.ok());
+  ASSERT_EQ(set, std::set<std::string>({"y", "z"}));
+
+  next++;
+  builder.feed("*2\r\n$1\r\na\r\n:1\r\n");
+  ASSERT_EQ(builder.pull(reply), ResponseBuilder::Status::kOk);
+  ASSERT_FALSE(vecCollector.ok());
+}
+
+TEST(ReplyDecoder, StringStreamer) {
+  ResponseBuilder builder;
+  std::vector<std::string> seen;
+  StringStreamer::Callback cb = [&seen](std::string &&str) {
+    seen.emplace_back(std::move(str));
+  };
+
+  StringStreamer streamer(cb);
+  std::unordered_set<std::string> set;
+  StringCollector<std::unordered_set<std::string>> setCollector(set);
+
+  ReplyDecoder *next = &streamer;
+  builder.setReplyDecoderLookup([&]() { return next; });
+
+  redisReplyPtr reply;
+  builder.feed("~3\r\n$1\r\nb\r\n$1\r\na\r\n$1\r\nc\r\n");
+  ASSERT_EQ(builder.pull(reply), ResponseBuilder::Status::kOk);
+  ASSERT_TRUE(streamer.ok());
+  ASSERT_EQ(reply->elements, 0u);
+  ASSERT_EQ(seen, std::vector<std::string>({"b", "a", "c"}));
+
+  next = &setCollector;
+  builder.feed("*2\r\n$1\r\nx\r\n$1\r\ny\r\n");
+  ASSERT_EQ(builder.pull(reply), ResponseBuilder::Status::kOk);
+  ASSERT_TRUE(setCollector.ok());
+  ASSERT_EQ(set, std::unordered_set<std::string>({"x", "y"}));
+
+  next = &streamer;
+  builder.feed("*2\r\n$1\r\nd\r\n:1\r\n");
+  ASSERT_EQ(builder.pull(reply), ResponseBuilder::Status::kOk);
+  ASSERT_FALSE(streamer.ok());
+}
+
+TEST(ReplyDecoder, PairCollector) {
+  ResponseBuilder builder;
+  std::unordered_map<std::string, std::string> map;
+  PairCollector<std::unordered_map<std::string, std::string>> collector(map);
+  builder.setReplyDecoderLookup([&]() { return &collector; });
+
+  redisReplyPtr reply;
+  builder.feed("*4\r\n$1\r\na\r\n$1\r\nb\r\n$1\r\nc\r\n$1\r\nd\r\n");
+  ASSERT_EQ(builder.pull(reply), ResponseBuilder::Status::kOk);
+  ASSERT_TRUE(collector.ok());
+  ASSERT_EQ(map.size(), 2u);
+  ASSERT_EQ(map["a"], "b");
+  ASSERT_EQ(map["c"], "d");
+
+  builder.feed("*3\r\n$1\r\na\r\n$1\r\nb\r\n$1\r\nc\r\n");
+  ASSERT_EQ(builder.pull(reply), ResponseBuilder::Status::kOk);
+  ASSERT_FALSE(collector.ok());
+}
+
+TEST(ReplyDecoder, ScanPageCollector) {
+  ResponseBuilder builder;
+  std::string cursor;
+  std::vector<std::string> page;
+  ScanPageCollector<std::vector<std::string>> collector(cursor, page);
+  builder.setReplyDecoderLookup([&]() { return &collector; });
+
+  redisReplyPtr reply;
+  builder.feed("*2\r\n$3\r\n123\r\n*2\r\n$1\r\na\r\n$1\r\nb\r\n");
+  ASSERT_EQ(builder.pull(reply), ResponseBuilder::Status::kOk);
+  ASSERT_TRUE(collector.ok());
+  ASSERT_EQ(cursor, "123");
+  ASSERT_EQ(page, std::vector<std::string>({"a", "b"}));
+
+  builder.feed("*2\r\n$1\r\n0\r\n*0\r\n");
+  ASSERT_EQ(builder.pull(reply), ResponseBuilder::Status::kOk);
+  ASSERT_TRUE(collector.ok());
+  ASSERT_EQ(cursor, "0");
+  ASSERT_TRUE(page.empty());
+
+  builder.feed("*1\r\n$1\r\n0\r\n");
+  ASSERT_EQ(builder.pull(reply), ResponseBuilder::Status::kOk);
+  ASSERT_FALSE(collector.ok());
+}
+
+TEST(ReplyHolder, TopLevelNodes) {
+  ResponseBuilder builder;
+  std::string longString(100, 'x');
+
+  builder.feed("+DONE\r\n");
+  builder.feed(SSTR("$" << longString.size() << "\r\n" << longString << "\r\n"));
+  builder.feed("|1\r\n+a\r\n+b\r\n*2\r\n$3\r\nabc\r\n*1\r\n:9\r\n");
+  builder.feed(",2.5\r\n=7\r\ntxt:abc\r\n");
+
+  redisReplyPtr ok, str, arr, dbl, verb;
+  ASSERT_EQ(builder.pull(ok), ResponseBuilder::Status::kOk);
+  ASSERT_EQ(builder.pull(str), ResponseBuilder::Status::kOk);
+  ASSERT_EQ(builder.pull(arr), ResponseBuilder::Status::kOk);
+  ASSERT_EQ(builder.pull(dbl), ResponseBuilder::Status::kOk);
+  ASSERT_EQ(builder.pull(verb), ResponseBuilder::Status::kOk);
+
+  // Every reply has its own holder, which outlives the builder.
+  builder.restart();
+
+  ASSERT_EQ(ok.use_count(), 1);
+  ASSERT_EQ(describeRedisReply(ok), "DONE");
+  ASSERT_EQ(std::string(str->str, str->len), longString);
+  ASSERT_EQ(describeRedisReply(arr), "1) \"abc\"\n2) 1) (integer) 9\n");
+  ASSERT_EQ(dbl->dval, 2.5);
+  ASSERT_EQ(std::string(verb->vtype), "txt");
+  ASSERT_EQ(std::string(verb->str, verb->len), "abc");
+
+  // A reply torn down half-way is released along with the reader.
+  builder.feed("*3\r\n$3\r\nabc\r\n*2\r\n:1\r\n");
+  ASSERT_EQ(builder.pull(arr), ResponseBuilder::Status::kIncomplete);
+  builder.restart();
+
+  builder.feed("*2\r\n:1\r\n&\r\n");
+  ASSERT_EQ(builder.pull(arr), ResponseBuilder::Status::kProtocolError);
+}
+
+TEST(ByteRing, Wraparound) {
+  ByteRing ring(100);
+  ASSERT_EQ(ring.capacity(), 128u);
+  ASSERT_TRUE(ring.empty());
+
+  size_t len = 1000;
+  char *buf = ring.getWriteBuffer(len);
+  ASSERT_EQ(len, 128u);
+  memcpy(buf, std::string(100, 'a').c_str(), 100);
+  ring.commitWrite(100);
+
+  size_t readLen;
+  ASSERT_NE(ring.getReadBuffer(readLen), nullptr);
+  ASSERT_EQ(readLen, 100u);
+  ring.commitRead(90);
+
+  // Only the tail end is contiguous.
+  len = 1000;
+  buf = ring.getWriteBuffer(len);
+  ASSERT_EQ(len, 28u);
+  memcpy(buf, std::string(28, 'b').c_str(), 28);
+  ring.commitWrite(28);
+
+  len = 1000;
+  buf = ring.getWriteBuffer(len);
+  ASSERT_EQ(len, 90u);
+  ring.commitWrite(90);
+
+  len = 1000;
+  ASSERT_EQ(ring.getWriteBuffer(len), nullptr);
+
+  const char *rbuf = ring.getReadBuffer(readLen);
+  ASSERT_EQ(std::string(rbuf, readLen), std::string(10, 'a') + std::string(28, 'b'));
+  ring.commitRead(readLen);
+
+  ring.getReadBuffer(readLen);
+  ASSERT_EQ(readLen, 90u);
+  ring.commitRead(readLen);
+  ASSERT_TRUE(ring.empty());
+}
+
+TEST(ParseStage, FeedsResponseBuilder) {
+  ResponseBuilder builder;
+  std::vector<redisReplyPtr> replies;
+
+  ParseStage stage(64, [&](const char* buf, size_t len) {
+    builder.feed(buf, len);
+
+    redisReplyPtr reply;
+    while(builder.pull(reply) == ResponseBuilder::Status::kOk) {
+      replies.emplace_back(std::move(reply));
+    }
+
+    return true;
+  });
+
+  // Far more than the ring holds, in odd-sized pieces.
+  std::string payload;
+  for(size_t i = 0; i < 1000; i++) {
+    payload += SSTR("*2\r\n$" << std::to_string(i).size() << "\r\n" << i << "\r\n:" << i << "\r\n");
+  }
+
+  size_t pos = 0;
+  while(pos < payload.size()) {
+    size_t len = 7;
+    char *buf = stage.getWriteBuffer(len);
+    ASSERT_NE(buf, nullptr);
+    len = std::min(len, payload.size() - pos);
+    memcpy(buf, payload.c_str() + pos, len);
+    stage.commitWrite(len);
+    pos += len;
+  }
+
+  stage.finish();
+  ASSERT_FALSE(stage.failed());
+  ASSERT_EQ(replies.size(), 1000u);
+
+  for(size_t i = 0; i < replies.size(); i++) {
+    ASSERT_EQ(replies[i]->element[1]->integer, (long long) i);
+  }
+}
+
+TEST(ParseStage, Failure) {
+  ParseStage stage(64, [&](const char* buf, size_t len) {
+    return false;
+  });
+
+  size_t len = 64;
+  char *buf = stage.getWriteBuffer(len);
+  ASSERT_EQ(len, 64u);
+  memcpy(buf, "+OK\r\n", 5);
+  stage.commitWrite(5);
+
+  struct pollfd pfd;
+  pfd.fd = stage.getFailureFD();
+  pfd.events = POLLIN;
+  ASSERT_EQ(poll(&pfd, 1, 5000), 1);
+  ASSERT_TRUE(stage.failed());
+
+  len = 64;
+  ASSERT_EQ(stage.getWriteBuffer(len), nullptr);
+  stage.finish();
+}
@@ -24,7 +24,19 @@
 #include "qclient/shared/PersistentSharedHash.hh"
 #include "qclient/shared/SharedManager.hh"
 #include "qclient/shared/TransientSharedHash.hh"
+#include "qclient/shared/SharedHash.hh"
+#include "qclient/shared/UpdateBatch.hh"
+#include "qclient/shared/InternedStringMap.hh"
+#include "qclient/shared/SharedWriteBatch.hh"
+#include "qclient/shared/SharedDeque.hh"
+#include "qclient/MultiBuilder.hh"
+#include "qclient/shared/SharedHashSubscription.hh"
+#include "shared/FlatStringMap.hh"
+#include "shared/SnapshotCell.hh"
+#include "qclient/SSTR.hh"
+#include "qclient/ResponseBuilder.hh"
 #include <gtest/gtest.h>
+#include <thread>
 
 using namespace qclient;
 
@@ -93,5 +105,519 @@ TEST(TransientSharedHash, Standalone) {
   ASSERT_EQ(out, "b");
 
   ASSERT_FALSE(hash2->get("a", out));
+
+  // Existing keys get overwritten
+  hash1->set("a", "c");
+  ASSERT_TRUE(hash3->get("a", out));
+  ASSERT_EQ(out, "c");
+}
+
+
+TEST(TransientSharedHash, CompactEncoding) {
+  SharedManager mg;
+  mg.setCompactEncoding(true);
+
+  std::unique_ptr<TransientSharedHash> hash = mg.makeTransientSharedHash("some-hash");
+  hash->set({ {"key-1", "a"}, {"key-2", "b"} });
+
+  std::string out;
+  ASSERT_TRUE(hash->get("key-1", out));
+  ASSERT_EQ(out, "a");
+  ASSERT_TRUE(hash->get("key-2", out));
+  ASSERT_EQ(out, "b");
+}
+
+TEST(TransientSharedHash, Coalescing) {
+  SharedManager mg;
+  mg.setCoalescingWindow(std::chrono::hours(1));
+  mg.setCoalescingWindow("uncoalesced-hash", std::chrono::microseconds(0));
+
+  std::unique_ptr<TransientSharedHash> hash1 = mg.makeTransientSharedHash("some-hash");
+  std::unique_ptr<TransientSharedHash> hash2 = mg.makeTransientSharedHash("uncoalesced-hash");
+
+  hash1->set("a", "1");
+  hash1->set("a", "2");
+  hash1->set("b", "3");
+  hash2->set("a", "4");
+
+  // Still within the window, nothing published yet
+  std::string out;
+  ASSERT_FALSE(hash1->get("a", out));
+  ASSERT_FALSE(hash1->get("b", out));
+
+  ASSERT_TRUE(hash2->get("a", out));
+  ASSERT_EQ(out, "4");
+
+  mg.flushCoalesced();
+  ASSERT_TRUE(hash1->get("a", out));
+  ASSERT_EQ(out, "2");
+  ASSERT_TRUE(hash1->get("b", out));
+  ASSERT_EQ(out, "3");
+}
+
+TEST(TransientSharedHash, CoalescingWindowCloses) {
+  SharedManager mg;
+  mg.setCoalescingWindow(std::chrono::milliseconds(2));
+
+  std::unique_ptr<TransientSharedHash> hash = mg.makeTransientSharedHash("some-hash");
+  for(size_t i = 0; i < 100; i++) {
+    hash->set("key", SSTR(i));
+  }
+
+  // The last value goes out at most one window later
+  std::string out;
+  for(size_t attempt = 0; attempt < 1000 && (!hash->get("key", out) || out != "99"); attempt++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+
+  ASSERT_EQ(out, "99");
+}
+
+TEST(SharedHashSubscription, BatchMode) {
+  SharedManager mg;
+  std::shared_ptr<SharedHashSubscriber> hashSub = std::make_shared<SharedHashSubscriber>();
+  std::unique_ptr<TransientSharedHash> hash = mg.makeTransientSharedHash("some-hash", hashSub);
+
+  SharedHashSubscription perKey(hashSub);
+  SharedHashSubscription batched(hashSub);
+
+  std::vector<SharedHashUpdateSet> sets;
+  batched.attachBatchCallback([&sets](SharedHashUpdateSet &&set) {
+    sets.emplace_back(std::move(set));
+  });
+
+  hash->set({ {"a", "1"}, {"b", "2"} });
+  ASSERT_EQ(perKey.size(), 2u);
+  ASSERT_TRUE(batched.empty());
+
+  ASSERT_EQ(sets.size(), 1u);
+  ASSERT_FALSE(sets[0].resilvered);
+  ASSERT_EQ(sets[0].updates.size(), 2u);
+  ASSERT_EQ(sets[0].updates["a"], "1");
+  ASSERT_EQ(sets[0].updates["b"], "2");
+
+  // A resilvering only goes to subscriptions in batch mode
+  hashSub->feedResilvering({ {"c", "3"} });
+  ASSERT_EQ(perKey.size(), 2u);
+  ASSERT_EQ(sets.size(), 2u);
+  ASSERT_TRUE(sets[1].resilvered);
+  ASSERT_EQ(sets[1].updates.size(), 1u);
+  ASSERT_EQ(sets[1].updates["c"], "3");
+
+  // Back to the queue
+  batched.detachBatchCallback();
+  hash->set("d", "4");
+  ASSERT_EQ(sets.size(), 2u);
+  ASSERT_EQ(batched.size(), 1u);
+}
+
+TEST(SharedHashSubscription, CoalescedBatches) {
+  SharedManager mg;
+  std::shared_ptr<SharedHashSubscriber> hashSub = std::make_shared<SharedHashSubscriber>();
+  std::unique_ptr<TransientSharedHash> hash = mg.makeTransientSharedHash("some-hash", hashSub);
+
+  std::mutex mtx;
+  std::vector<SharedHashUpdateSet> sets;
+  auto callback = [&](SharedHashUpdateSet &&set) {
+    std::lock_guard<std::mutex> lock(mtx);
+    sets.emplace_back(std::move(set));
+  };
+
+  SharedHashSubscription subscription(hashSub);
+  subscription.attachBatchCallback(callback, std::chrono::hours(1));
+
+  hash->set("a", "1");
+  hash->set("a", "2");
+  hashSub->feedResilvering({ {"b", "3"} });
+  hash->set("c", "4");
+
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    ASSERT_TRUE(sets.empty());
+  }
+
+  // Detaching delivers what's pending: The resilvering replaced everything
+  // before it.
+  subscription.detachBatchCallback();
+  ASSERT_EQ(sets.size(), 1u);
+  ASSERT_TRUE(sets[0].resilvered);
+  ASSERT_EQ(sets[0].updates.size(), 2u);
+  ASSERT_EQ(sets[0].updates["b"], "3");
+  ASSERT_EQ(sets[0].updates["c"], "4");
+
+  // Short window, delivered by the coalescing thread
+  subscription.attachBatchCallback(callback, std::chrono::milliseconds(1));
+  hash->set("d", "5");
+
+  for(size_t attempt = 0; attempt < 1000; attempt++) {
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      if(sets.size() == 2u) break;
+    }
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+
+  std::lock_guard<std::mutex> lock(mtx);
+  ASSERT_EQ(sets.size(), 2u);
+  ASSERT_FALSE(sets[1].resilvered);
+  ASSERT_EQ(sets[1].updates["d"], "5");
+}
+
+TEST(FlatStringMap, BasicSanity) {
+  FlatStringMap empty;
+  ASSERT_EQ(empty.size(), 0u);
+  ASSERT_EQ(empty.find("abc"), nullptr);
+
+  std::map<std::string, std::string> contents;
+  for(size_t i = 0; i < 1000; i++) {
+    contents[SSTR("key-" << i)] = SSTR("value-" << i);
+  }
+
+  contents[""] = "empty-key";
+
+  FlatStringMap map(contents);
+  ASSERT_EQ(map.size(), 1001u);
+
+  for(size_t i = 0; i < 1000; i++) {
+    const std::string *value = map.find(SSTR("key-" << i));
+    ASSERT_NE(value, nullptr);
+    ASSERT_EQ(*value, SSTR("value-" << i));
+    ASSERT_EQ(map.find(SSTR("other-" << i)), nullptr);
+  }
+
+  ASSERT_EQ(*map.find(""), "empty-key");
+}
+
+struct CountedSnapshot {
+  CountedSnapshot(int64_t v, std::atomic<int64_t> &live) : value(v), alive(live) {
+    alive++;
+  }
+
+  ~CountedSnapshot() {
+    alive--;
+  }
+
+  int64_t value;
+  std::atomic<int64_t> &alive;
+};
+
+TEST(StringInterner, SharedKeys) {
+  std::shared_ptr<StringInterner> interner = std::make_shared<StringInterner>();
+
+  InternedStringMap map1(interner);
+  InternedStringMap map2(interner);
+
+  map1["stat.geotag"] = "a";
+  map1["stat.boot"] = "b";
+  map2["stat.geotag"] = "c";
+  ASSERT_EQ(interner->size(), 2u);
+
+  // Same field name, same copy
+  ASSERT_EQ(map1.begin()[1].first.get(), map2.begin()[0].first.get());
+  ASSERT_EQ(*map1.find("stat.geotag"), "a");
+  ASSERT_EQ(*map2.find("stat.geotag"), "c");
+  ASSERT_EQ(map2.find("stat.boot"), nullptr);
+
+  // Keys are kept sorted
+  map1["a"] = "first";
+  ASSERT_EQ(*map1.begin()->first, "a");
+  ASSERT_EQ(map1.size(), 3u);
+
+  std::map<std::string, std::string> expected = {
+    {"a", "first"}, {"stat.boot", "b"}, {"stat.geotag", "a"}
+  };
+  ASSERT_EQ(map1.toMap(), expected);
+
+  // Dropped once no map holds on to it anymore
+  ASSERT_TRUE(map1.erase("stat.boot"));
+  ASSERT_FALSE(map1.erase("stat.boot"));
+  ASSERT_EQ(interner->size(), 2u);
+
+  map1.assign({ {"x", "1"} });
+  ASSERT_EQ(interner->size(), 2u);
+  map2.clear();
+  ASSERT_EQ(interner->size(), 1u);
+
+  FlatStringMap flat(map1);
+  ASSERT_EQ(*flat.find("x"), "1");
+  ASSERT_EQ(flat.find("a"), nullptr);
+}
+
+TEST(SnapshotCell, ReadersAndWriter) {
+  std::atomic<int64_t> alive {0};
+  std::atomic<bool> stop {false};
+  std::atomic<bool> failed {false};
+
+  {
+    SnapshotCell<CountedSnapshot> cell(std::unique_ptr<const CountedSnapshot>(new CountedSnapshot(0, alive)));
+
+    std::vector<std::thread> readers;
+    for(size_t i = 0; i < 4; i++) {
+      readers.emplace_back([&]() {
+        int64_t last = 0;
+        while(!stop) {
+          SnapshotCell<CountedSnapshot>::ReadGuard snap(cell);
+
+          // Versions only move forward, and the snapshot stays valid
+          // until we're done with it.
+          int64_t value = snap->value;
+          if(value < last || snap->value != value) {
+            failed = true;
+          }
+
+          last = value;
+        }
+      });
+    }
+
+    for(int64_t i = 1; i <= 2000; i++) {
+      cell.publish(std::unique_ptr<const CountedSnapshot>(new CountedSnapshot(i, alive)));
+
+      // By the time publish returns, the previous snapshot is gone
+      EXPECT_EQ(alive, 1);
+    }
+
+    stop = true;
+    for(size_t i = 0; i < readers.size(); i++) {
+      readers[i].join();
+    }
+
+    SnapshotCell<CountedSnapshot>::ReadGuard snap(cell);
+    ASSERT_EQ(snap->value, 2000);
+  }
+
+  ASSERT_FALSE(failed);
+  ASSERT_EQ(alive, 0);
+}
+
+TEST(PersistentSharedHash, ParseChanges) {
+  std::vector<PersistentSharedHash::Revision> changes;
+
+  redisReplyPtr reply = ResponseBuilder::parseRedisEncodedString(
+    "*2\r\n"
+    "*2\r\n:5\r\n*2\r\n$1\r\na\r\n$1\r\nb\r\n"
+    "*2\r\n:6\r\n*4\r\n$1\r\na\r\n$0\r\n\r\n$1\r\nc\r\n$1\r\nd\r\n");
+  ASSERT_TRUE(PersistentSharedHash::parseChanges(reply.get(), changes));
+  ASSERT_EQ(changes.size(), 2u);
+
+  ASSERT_EQ(changes[0].first, 5u);
+  ASSERT_EQ(changes[0].second.size(), 1u);
+  ASSERT_EQ(changes[0].second["a"], "b");
+
+  ASSERT_EQ(changes[1].first, 6u);
+  ASSERT_EQ(changes[1].second.size(), 2u);
+  ASSERT_EQ(changes[1].second["a"], "");
+  ASSERT_EQ(changes[1].second["c"], "d");
+
+  reply = ResponseBuilder::parseRedisEncodedString("*0\r\n");
+  ASSERT_TRUE(PersistentSharedHash::parseChanges(reply.get(), changes));
+  ASSERT_TRUE(changes.empty());
+
+  reply = ResponseBuilder::parseRedisEncodedString("*1\r\n*2\r\n:5\r\n*1\r\n$1\r\na\r\n");
+  ASSERT_FALSE(PersistentSharedHash::parseChanges(reply.get(), changes));
+  ASSERT_TRUE(changes.empty());
+
+  reply = ResponseBuilder::parseRedisEncodedString("-ERR unknown command\r\n");
+  ASSERT_FALSE(PersistentSharedHash::parseChanges(reply.get(), changes));
+  ASSERT_FALSE(PersistentSharedHash::parseChanges(nullptr, changes));
+}
+
+TEST(PersistentSharedHash, Snapshot) {
+  std::string path = SSTR("/tmp/qclient-tests-shared-hash-" << getpid() << ".snapshot");
+  ::unlink(path.c_str());
+
+  uint64_t version = 0;
+  std::map<std::string, std::string> contents;
+  ASSERT_FALSE(PersistentSharedHash::readSnapshot(path, version, contents));
+
+  std::map<std::string, std::string> written;
+  for(size_t i = 0; i < 1000; i++) {
+    written[SSTR("key-" << i)] = std::string(i % 50, 'v');
+  }
+  written["key-0"] = "non-empty";
+
+  ASSERT_TRUE(PersistentSharedHash::writeSnapshot(path, 12345, written));
+  ASSERT_TRUE(PersistentSharedHash::readSnapshot(path, version, contents));
+  ASSERT_EQ(version, 12345u);
+  ASSERT_EQ(contents, written);
+
+  // Overwritten in place
+  ASSERT_TRUE(PersistentSharedHash::writeSnapshot(path, 12346, {{"a", "b"}}));
+  ASSERT_TRUE(PersistentSharedHash::readSnapshot(path, version, contents));
+  ASSERT_EQ(version, 12346u);
+  ASSERT_EQ(contents.size(), 1u);
+  ASSERT_EQ(::access((path + ".tmp").c_str(), F_OK), -1);
+
+  // Torn or foreign files are ignored
+  ASSERT_EQ(::truncate(path.c_str(), 14), 0);
+  ASSERT_FALSE(PersistentSharedHash::readSnapshot(path, version, contents));
+  ASSERT_TRUE(contents.empty());
+
+  ASSERT_EQ(PersistentSharedHash::snapshotFilename("eos-hash_1.x"), "eos-hash_1.x.snapshot");
+  ASSERT_EQ(PersistentSharedHash::snapshotFilename("a/b c"), "a%2Fb%20c.snapshot");
+  ::unlink(path.c_str());
+}
+
+TEST(SharedHash, MergedIndex) {
+  SharedManager mg;
+  SharedHash hash(&mg, "some-hash");
+
+  std::string value;
+  SharedHash::Origin origin;
+  ASSERT_FALSE(hash.get("a", value));
+
+  UpdateBatch durable;
+  durable.setDurable("a", "persistent-a");
+  durable.setDurable("b", "persistent-b");
+  hash.set(durable);
+
+  ASSERT_TRUE(hash.get("a", value, origin));
+  ASSERT_EQ(value, "persistent-a");
+  ASSERT_EQ(origin, SharedHash::Origin::kPersistent);
+
+  // Transient values shadow persistent ones, local values shadow both
+  UpdateBatch transient;
+  transient.setTransient("a", "transient-a");
+  transient.setTransient("c", "transient-c");
+  hash.set(transient);
+
+  ASSERT_TRUE(hash.get("a", value, origin));
+  ASSERT_EQ(value, "transient-a");
+  ASSERT_EQ(origin, SharedHash::Origin::kTransient);
+
+  UpdateBatch local;
+  local.setLocal("a", "local-a");
+  hash.set(local);
+
+  ASSERT_TRUE(hash.get("a", value, origin));
+  ASSERT_EQ(value, "local-a");
+  ASSERT_EQ(origin, SharedHash::Origin::kLocal);
+
+  ASSERT_TRUE(hash.get("b", value, origin));
+  ASSERT_EQ(value, "persistent-b");
+  ASSERT_EQ(origin, SharedHash::Origin::kPersistent);
+
+  ASSERT_TRUE(hash.get("c", value, origin));
+  ASSERT_EQ(value, "transient-c");
+  ASSERT_EQ(origin, SharedHash::Origin::kTransient);
+
+  // Deleting a persistent field makes it disappear from the index
+  UpdateBatch deletion;
+  deletion.setDurable("b", "");
+  hash.set(deletion);
+  ASSERT_FALSE(hash.get("b", value));
 }
 
+TEST(SharedManager, WriteBatch) {
+  SharedWriteBatch batch;
+  ASSERT_TRUE(batch.empty());
+
+  for(size_t i = 0; i < 5; i++) {
+    batch.setDurable(SSTR("hash-" << i), "status", "online");
+    batch.setDurable(SSTR("hash-" << i), "stale", "");
+  }
+
+  UpdateBatch updates;
+  updates.setDurable("geotag", "site-a");
+  updates.setTransient("heartbeat", "123");
+  updates.setLocal("ignored", "1");
+  batch.add("hash-0", updates);
+
+  batch.setTransient("hash-1", "heartbeat", "456");
+  batch.setTransient("hash-1", "heartbeat", "789");
+  ASSERT_EQ(batch.size(), 13u);
+
+  // Hashes are never split between transactions
+  std::vector<MultiBuilder> transactions = SharedManager::makeTransactions(batch, 4);
+  ASSERT_EQ(transactions.size(), 3u);
+  ASSERT_EQ(transactions[0].size(), 5u);
+  ASSERT_EQ(transactions[1].size(), 4u);
+  ASSERT_EQ(transactions[2].size(), 2u);
+
+  EncodedRequest req = transactions[0].release();
+  std::string encoded(req.getBuffer(), req.getLen());
+  ASSERT_NE(encoded.find("VHSET"), std::string::npos);
+  ASSERT_NE(encoded.find("VHDEL"), std::string::npos);
+  ASSERT_NE(encoded.find("site-a"), std::string::npos);
+
+  // Transient updates go out as one batch per hash
+  SharedManager mg;
+  std::shared_ptr<SharedHashSubscriber> hashSub = std::make_shared<SharedHashSubscriber>();
+  std::unique_ptr<TransientSharedHash> hash0 = mg.makeTransientSharedHash("hash-0", hashSub);
+  std::unique_ptr<TransientSharedHash> hash1 = mg.makeTransientSharedHash("hash-1", hashSub);
+
+  SharedHashSubscription subscription(hashSub);
+  size_t sets = 0;
+  subscription.attachBatchCallback([&sets](SharedHashUpdateSet &&set) {
+    sets++;
+  });
+
+  mg.flush(batch);
+  ASSERT_EQ(sets, 2u);
+
+  std::string value;
+  ASSERT_TRUE(hash0->get("heartbeat", value));
+  ASSERT_EQ(value, "123");
+  ASSERT_TRUE(hash1->get("heartbeat", value));
+  ASSERT_EQ(value, "789");
+
+  batch.clear();
+  ASSERT_TRUE(batch.empty());
+}
+
+TEST(SharedDeque, ParseNotification) {
+  std::string op, origin;
+  size_t count;
+
+  ASSERT_TRUE(SharedDeque::parseNotification("push-back-done 3 1f2e", op, count, origin));
+  ASSERT_EQ(op, "push-back");
+  ASSERT_EQ(count, 3u);
+  ASSERT_EQ(origin, "1f2e");
+
+  ASSERT_TRUE(SharedDeque::parseNotification("clear-done 0 abc", op, count, origin));
+  ASSERT_EQ(op, "clear");
+
+  // Notifications of older clients don't say what happened
+  ASSERT_FALSE(SharedDeque::parseNotification("push-back-done", op, count, origin));
+  ASSERT_FALSE(SharedDeque::parseNotification("pop-front-prepare", op, count, origin));
+  ASSERT_FALSE(SharedDeque::parseNotification("pop-front-done x abc", op, count, origin));
+  ASSERT_FALSE(SharedDeque::parseNotification("pop-front-done 1 abc def", op, count, origin));
+  ASSERT_FALSE(SharedDeque::parseNotification("-done 1 abc", op, count, origin));
+}
+
+TEST(SharedDeque, SizeCache) {
+  SharedDeque::SizeCache cache;
+  size_t size;
+  uint64_t generation;
+
+  // Unknown at first, until the server has been asked
+  ASSERT_FALSE(cache.get(size, generation));
+  cache.set(3, generation);
+  ASSERT_TRUE(cache.get(size, generation));
+  ASSERT_EQ(size, 3u);
+
+  cache.pushed(2);
+  cache.applyNotification("push-back", 4);
+  cache.applyNotification("pop-front", 5);
+  ASSERT_TRUE(cache.get(size, generation));
+  ASSERT_EQ(size, 4u);
+
+  // Another client cleared, while a third one pushed: The notifications
+  // arrive in any order, so the count is lost either way
+  cache.applyNotification("push-back", 1);
+  cache.applyNotification("clear", 0);
+  ASSERT_FALSE(cache.get(size, generation));
+
+  // A server reply overtaken by a change is outdated
+  cache.pushed(1);
+  cache.set(7, generation);
+  ASSERT_FALSE(cache.get(size, generation));
+  cache.set(7, generation);
+  ASSERT_TRUE(cache.get(size, generation));
+  ASSERT_EQ(size, 7u);
+
+  // Popping more than counted means the count was wrong - not empty
+  cache.popped(8);
+  ASSERT_FALSE(cache.get(size, generation));
+}